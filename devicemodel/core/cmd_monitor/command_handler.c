@@ -42,15 +42,11 @@ static char *generate_ack_message(int ret_val)
 	cJSON_Delete(ret_obj);
 	return ack_msg;
 }
-static int send_socket_ack(struct socket_dev *sock, int fd, bool normal)
+static int send_client_ack(struct socket_client *client, bool normal)
 {
 	int ret = 0, val;
 	char *ack_message;
-	struct socket_client *client = NULL;
 
-	client = find_socket_client(sock, fd);
-	if (client == NULL)
-		return -1;
 	val = normal ? SUCCEEDED : FAILED;
 	ack_message = generate_ack_message(val);
 
@@ -66,6 +62,15 @@ static int send_socket_ack(struct socket_dev *sock, int fd, bool normal)
 	}
 	return ret;
 }
+static int send_socket_ack(struct socket_dev *sock, int fd, bool normal)
+{
+	struct socket_client *client = NULL;
+
+	client = find_socket_client(sock, fd);
+	if (client == NULL)
+		return -1;
+	return send_client_ack(client, normal);
+}
 
 static struct socket_client *vm_event_client = NULL;
 static pthread_mutex_t vm_event_client_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -168,29 +173,68 @@ int user_vm_destroy_handler(void *arg, void *command_para)
 	return ret;
 }
 
-int user_vm_blkrescan_handler(void *arg, void *command_para)
+/*
+ * A blkrescan may take long, it runs on the monitor worker and acks on its
+ * own copy of the client: the command parameters are reused by the next
+ * command and the client may be gone by then.
+ */
+struct blkrescan_work {
+	void *ctx;
+	struct socket_client client;
+	char option[CMD_ARG_MAX];
+};
+
+static int blkrescan(void *ctx, char *option, struct socket_client *client)
 {
-	int ret = 0;
-	struct command_parameters *cmd_para = (struct command_parameters *)command_para;
-	struct handler_args *hdl_arg = (struct handler_args *)arg;
-	struct socket_dev *sock = (struct socket_dev *)hdl_arg->channel_arg;
-	struct socket_client *client = NULL;
+	int ret;
 	bool cmd_completed = false;
 
-	client = find_socket_client(sock, cmd_para->fd);
-	if (client == NULL)
-		return -1;
-
-	ret = vm_monitor_blkrescan(hdl_arg->ctx_arg, cmd_para->option);
+	ret = vm_monitor_blkrescan(ctx, option);
 	if (ret >= 0) {
 		cmd_completed = true;
 	} else {
 		pr_err("Failed to rescan virtio-blk device.\n");
 	}
 
-	ret = send_socket_ack(sock, cmd_para->fd, cmd_completed);
+	ret = send_client_ack(client, cmd_completed);
 	if (ret < 0) {
 		pr_err("Failed to send ACK by socket.\n");
 	}
 	return ret;
 }
+
+static void blkrescan_work_fn(void *arg)
+{
+	struct blkrescan_work *work = (struct blkrescan_work *)arg;
+
+	blkrescan(work->ctx, work->option, &work->client);
+	close(work->client.fd);
+	free(work);
+}
+
+int user_vm_blkrescan_handler(void *arg, void *command_para)
+{
+	struct command_parameters *cmd_para = (struct command_parameters *)command_para;
+	struct handler_args *hdl_arg = (struct handler_args *)arg;
+	struct socket_dev *sock = (struct socket_dev *)hdl_arg->channel_arg;
+	struct socket_client *client = NULL;
+	struct blkrescan_work *work;
+
+	client = find_socket_client(sock, cmd_para->fd);
+	if (client == NULL)
+		return -1;
+
+	work = calloc(1, sizeof(*work));
+	if (work != NULL) {
+		work->ctx = hdl_arg->ctx_arg;
+		memcpy(work->option, cmd_para->option, sizeof(work->option));
+		work->client.fd = dup(cmd_para->fd);
+		if ((work->client.fd >= 0) && (monitor_queue_work(blkrescan_work_fn, work) == 0))
+			return 0;
+		if (work->client.fd >= 0)
+			close(work->client.fd);
+		free(work);
+	}
+
+	return blkrescan(hdl_arg->ctx_arg, cmd_para->option, client);
+}
@@ -0,0 +1,438 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Live dump of a User VM to an ELF core file
+ *
+ * The monitor asks for a dump (DM_DUMP, "acrnctl dump"). The guest memory is
+ * copied to the file while the VM runs, with the EPT dirty log cleared just
+ * before: the pages the guest writes to meanwhile are copied again, a few
+ * times while the VM runs, then a last time with the VM paused, together
+ * with the state of its vCPUs. The VM is only paused for that last round and
+ * goes on from there like after a snapshot (see snapshot_pause()); the file
+ * holds the memory and the vCPUs as they were at that point.
+ *
+ * If the VM has no dirty log (RT VM, no EPT A/D bits on the platform, old
+ * HSM) the VM is paused for the whole copy instead.
+ *
+ * The file is a core like the ones of QEMU's dump-guest-memory, crash opens
+ * it with the vmlinux of the guest:
+ *	ELF header, a PT_NOTE then a PT_LOAD per memory region, at its GPA
+ *	per vCPU, a NT_PRSTATUS note and a "QEMU" note with its control and
+ *	segment registers, crash finds the kernel page tables and KASLR
+ *	offset from them
+ *	the lowmem, the highmem then the biosmem, page aligned, the zero pages
+ *	copied while the VM ran are holes in the file
+ *
+ * The device model writes to the guest memory through the mapping of the
+ * Service VM, which is not in the dirty log: the buffers of the I/O requests
+ * completing during the dump may be older than the rest of the memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/param.h>
+#include <sys/procfs.h>
+#include <sys/user.h>
+
+#include "dm.h"
+#include "vmmapi.h"
+#include "sw_load.h"
+#include "log.h"
+#include "snapshot.h"
+#include "coredump.h"
+
+#define DUMP_PAGE_SIZE		4096UL
+#define DUMP_NOTE_ALIGN		4U
+
+/* the rounds of copy while the VM runs, and the pages left to the paused one */
+#define DUMP_LIVE_ROUNDS	5
+#define DUMP_PAUSED_PAGES	2048UL
+
+/* the CPU note of QEMU's dumps, which crash reads */
+#define DUMP_QEMU_NOTE_NAME	"QEMU"
+#define DUMP_QEMU_NOTE_TYPE	0U
+#define DUMP_QEMU_NOTE_VERSION	1U
+
+struct dump_qemu_segment {
+	uint32_t	selector;
+	uint32_t	limit;
+	uint32_t	flags;
+	uint32_t	pad;
+	uint64_t	base;
+};
+
+struct dump_qemu_cpu {
+	uint32_t	version;
+	uint32_t	size;
+	uint64_t	rax, rbx, rcx, rdx, rsi, rdi, rsp, rbp;
+	uint64_t	r8, r9, r10, r11, r12, r13, r14, r15;
+	uint64_t	rip, rflags;
+	struct dump_qemu_segment cs, ds, es, fs, gs, ss;
+	struct dump_qemu_segment ldt, tr, gdt, idt;
+	uint64_t	cr[5];
+	uint64_t	kernel_gs_base;
+};
+
+/* a region of the guest memory, with its dirty log */
+struct dump_mem {
+	uint64_t	gpa;
+	char		*hva;
+	size_t		size;
+	off_t		off;
+	uint64_t	*bitmap;
+};
+
+static int
+dump_mem_regions(struct vmctx *ctx, struct dump_mem *mem)
+{
+	int nr = 0;
+
+	mem[nr++] = (struct dump_mem) { 0, ctx->baseaddr, ctx->lowmem };
+	if (ctx->highmem > 0)
+		mem[nr++] = (struct dump_mem) { ctx->highmem_gpa_base,
+			ctx->baseaddr + ctx->highmem_gpa_base, ctx->highmem };
+	if (ctx->biosmem > 0)
+		mem[nr++] = (struct dump_mem) { 4 * GB - ctx->biosmem,
+			ctx->baseaddr + 4 * GB - ctx->biosmem, ctx->biosmem };
+
+	return nr;
+}
+
+static size_t
+dump_note_size(size_t name, size_t desc)
+{
+	return sizeof(Elf64_Nhdr) + roundup(name, DUMP_NOTE_ALIGN) +
+		roundup(desc, DUMP_NOTE_ALIGN);
+}
+
+static size_t
+dump_notes_size(int nr_vcpus)
+{
+	return nr_vcpus * (dump_note_size(sizeof("CORE"), sizeof(struct elf_prstatus)) +
+		dump_note_size(sizeof(DUMP_QEMU_NOTE_NAME), sizeof(struct dump_qemu_cpu)));
+}
+
+static char *
+dump_add_note(char *p, const char *name, uint32_t type, const void *desc, size_t size)
+{
+	Elf64_Nhdr *nhdr = (Elf64_Nhdr *)p;
+
+	nhdr->n_namesz = strlen(name) + 1;
+	nhdr->n_descsz = size;
+	nhdr->n_type = type;
+	p += sizeof(*nhdr);
+	memcpy(p, name, nhdr->n_namesz);
+	p += roundup(nhdr->n_namesz, DUMP_NOTE_ALIGN);
+	memcpy(p, desc, size);
+
+	return p + roundup(size, DUMP_NOTE_ALIGN);
+}
+
+/* the access rights of VMX to the flags of a descriptor, as QEMU keeps them */
+static void
+dump_qemu_segment(struct dump_qemu_segment *qs, const struct acrn_segment *s)
+{
+	qs->selector = s->selector;
+	qs->limit = s->limit;
+	qs->flags = ((s->attr & 0xffU) << 8) | ((s->attr & 0xf000U) << 8);
+	qs->base = s->base;
+}
+
+static char *
+dump_vcpu_notes(char *p, const struct acrn_vcpu_state *st)
+{
+	const struct acrn_gp_regs *r = &st->gprs;
+	struct elf_prstatus prs;
+	struct user_regs_struct regs;
+	struct dump_qemu_cpu cpu;
+
+	bzero(&regs, sizeof(regs));
+	regs.r15 = r->r15;
+	regs.r14 = r->r14;
+	regs.r13 = r->r13;
+	regs.r12 = r->r12;
+	regs.rbp = r->rbp;
+	regs.rbx = r->rbx;
+	regs.r11 = r->r11;
+	regs.r10 = r->r10;
+	regs.r9 = r->r9;
+	regs.r8 = r->r8;
+	regs.rax = r->rax;
+	regs.rcx = r->rcx;
+	regs.rdx = r->rdx;
+	regs.rsi = r->rsi;
+	regs.rdi = r->rdi;
+	regs.orig_rax = r->rax;
+	regs.rip = st->rip;
+	regs.cs = st->cs.selector;
+	regs.eflags = st->rflags;
+	regs.rsp = r->rsp;
+	regs.ss = st->ss.selector;
+	regs.fs_base = st->fs.base;
+	regs.gs_base = st->gs.base;
+	regs.ds = st->ds.selector;
+	regs.es = st->es.selector;
+	regs.fs = st->fs.selector;
+	regs.gs = st->gs.selector;
+
+	bzero(&prs, sizeof(prs));
+	prs.pr_pid = st->vcpu_id + 1;
+	memcpy(&prs.pr_reg, &regs, sizeof(regs));
+	p = dump_add_note(p, "CORE", NT_PRSTATUS, &prs, sizeof(prs));
+
+	bzero(&cpu, sizeof(cpu));
+	cpu.version = DUMP_QEMU_NOTE_VERSION;
+	cpu.size = sizeof(cpu);
+	cpu.rax = r->rax;
+	cpu.rbx = r->rbx;
+	cpu.rcx = r->rcx;
+	cpu.rdx = r->rdx;
+	cpu.rsi = r->rsi;
+	cpu.rdi = r->rdi;
+	cpu.rsp = r->rsp;
+	cpu.rbp = r->rbp;
+	cpu.r8 = r->r8;
+	cpu.r9 = r->r9;
+	cpu.r10 = r->r10;
+	cpu.r11 = r->r11;
+	cpu.r12 = r->r12;
+	cpu.r13 = r->r13;
+	cpu.r14 = r->r14;
+	cpu.r15 = r->r15;
+	cpu.rip = st->rip;
+	cpu.rflags = st->rflags;
+	dump_qemu_segment(&cpu.cs, &st->cs);
+	dump_qemu_segment(&cpu.ds, &st->ds);
+	dump_qemu_segment(&cpu.es, &st->es);
+	dump_qemu_segment(&cpu.fs, &st->fs);
+	dump_qemu_segment(&cpu.gs, &st->gs);
+	dump_qemu_segment(&cpu.ss, &st->ss);
+	dump_qemu_segment(&cpu.ldt, &st->ldtr);
+	dump_qemu_segment(&cpu.tr, &st->tr);
+	cpu.gdt.base = st->gdt.base;
+	cpu.gdt.limit = st->gdt.limit;
+	cpu.idt.base = st->idt.base;
+	cpu.idt.limit = st->idt.limit;
+	cpu.cr[0] = st->cr0;
+	cpu.cr[2] = st->cr2;
+	cpu.cr[3] = st->cr3;
+	cpu.cr[4] = st->cr4;
+	cpu.kernel_gs_base = st->ia32_kernel_gs_base;
+
+	return dump_add_note(p, DUMP_QEMU_NOTE_NAME, DUMP_QEMU_NOTE_TYPE, &cpu, sizeof(cpu));
+}
+
+/* The ELF header, the program headers and the notes, written last */
+static int
+dump_write_headers(int fd, struct dump_mem *mem, int nr,
+		struct acrn_vcpu_state *states, int nr_vcpus)
+{
+	size_t notes = dump_notes_size(nr_vcpus);
+	size_t hdrs = sizeof(Elf64_Ehdr) + (nr + 1) * sizeof(Elf64_Phdr);
+	Elf64_Ehdr *ehdr;
+	Elf64_Phdr *phdr;
+	char *buf, *p;
+	int i, err;
+
+	buf = calloc(1, hdrs + notes);
+	if (buf == NULL)
+		return -1;
+
+	ehdr = (Elf64_Ehdr *)buf;
+	memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+	ehdr->e_ident[EI_CLASS] = ELFCLASS64;
+	ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr->e_ident[EI_OSABI] = ELFOSABI_NONE;
+	ehdr->e_type = ET_CORE;
+	ehdr->e_machine = EM_X86_64;
+	ehdr->e_version = EV_CURRENT;
+	ehdr->e_phoff = sizeof(*ehdr);
+	ehdr->e_ehsize = sizeof(*ehdr);
+	ehdr->e_phentsize = sizeof(*phdr);
+	ehdr->e_phnum = nr + 1;
+
+	phdr = (Elf64_Phdr *)(buf + sizeof(*ehdr));
+	phdr->p_type = PT_NOTE;
+	phdr->p_offset = hdrs;
+	phdr->p_filesz = notes;
+	phdr->p_memsz = notes;
+
+	/* the guest physical addresses, crash translates the virtual ones */
+	for (i = 0; i < nr; i++) {
+		phdr++;
+		phdr->p_type = PT_LOAD;
+		phdr->p_flags = PF_R | PF_W | PF_X;
+		phdr->p_offset = mem[i].off;
+		phdr->p_paddr = mem[i].gpa;
+		phdr->p_filesz = mem[i].size;
+		phdr->p_memsz = mem[i].size;
+	}
+
+	p = buf + hdrs;
+	for (i = 0; i < nr_vcpus; i++)
+		p = dump_vcpu_notes(p, &states[i]);
+
+	err = snapshot_pwrite(fd, buf, hdrs + notes, 0);
+	free(buf);
+	return err;
+}
+
+/* Clear the dirty log of the regions, -1 if the VM has none */
+static int
+dump_log_start(struct vmctx *ctx, struct dump_mem *mem, int nr)
+{
+	size_t pages;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		pages = mem[i].size / DUMP_PAGE_SIZE;
+		mem[i].bitmap = calloc(howmany(pages, 64), sizeof(uint64_t));
+		if (mem[i].bitmap == NULL)
+			return -1;
+		if (vm_get_dirty_log(ctx, mem[i].gpa, mem[i].size, mem[i].bitmap) != 0) {
+			pr_notice("%s: no dirty log (%s), the VM is paused during the dump\n",
+				__func__, strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Copy again the pages written to since the last round, the number of them or -1 */
+static long
+dump_dirty(struct vmctx *ctx, int fd, struct dump_mem *mem, int nr)
+{
+	size_t pages, start, end;
+	long dirty = 0;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		pages = mem[i].size / DUMP_PAGE_SIZE;
+		if (vm_get_dirty_log(ctx, mem[i].gpa, mem[i].size, mem[i].bitmap) != 0) {
+			pr_err("%s: could not read the dirty log: %s\n", __func__, strerror(errno));
+			return -1;
+		}
+
+		/* in runs, the zero pages too: their last copy may not be */
+		for (start = 0; start < pages; start = end) {
+			while (start < pages && !isset(mem[i].bitmap, start))
+				start++;
+			for (end = start; end < pages && isset(mem[i].bitmap, end); )
+				end++;
+			if (end > start &&
+			    snapshot_pwrite(fd, mem[i].hva + start * DUMP_PAGE_SIZE,
+				    (end - start) * DUMP_PAGE_SIZE,
+				    mem[i].off + start * DUMP_PAGE_SIZE) != 0)
+				return -1;
+			dirty += end - start;
+		}
+	}
+
+	return dirty;
+}
+
+static int
+dump_copy_mem(int fd, struct dump_mem *mem, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (snapshot_write_mem(fd, mem[i].hva, mem[i].size, mem[i].off) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int
+vm_dump(struct vmctx *ctx, const char *path)
+{
+	struct dump_mem mem[3];
+	struct acrn_vcpu_state *states;
+	struct acrn_vioapic_state vioapic;
+	uint64_t start = sw_load_now(), paused;
+	long dirty = 0;
+	bool live;
+	off_t off;
+	int fd, i, nr, round, err = -1;
+
+	/* the VM is paused at least once, which these VMs do not support */
+	if (is_rtvm || lapic_pt || trusty_enabled) {
+		pr_err("%s: RT VMs and VMs with LAPIC passthrough or a secure world are not supported\n",
+			__func__);
+		return -1;
+	}
+
+	states = calloc(ctx->vcpu_num, sizeof(*states));
+	if (states == NULL)
+		return -1;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		pr_err("%s: could not create %s (%s)\n", __func__, path, strerror(errno));
+		free(states);
+		return -1;
+	}
+
+	nr = dump_mem_regions(ctx, mem);
+	off = roundup(sizeof(Elf64_Ehdr) + (nr + 1) * sizeof(Elf64_Phdr) +
+		dump_notes_size(ctx->vcpu_num), DUMP_PAGE_SIZE);
+	for (i = 0; i < nr; i++) {
+		mem[i].off = off;
+		off += mem[i].size;
+	}
+
+	live = (dump_log_start(ctx, mem, nr) == 0);
+	if (live) {
+		if (dump_copy_mem(fd, mem, nr) != 0)
+			goto out;
+		for (round = 0; round < DUMP_LIVE_ROUNDS; round++) {
+			dirty = dump_dirty(ctx, fd, mem, nr);
+			if (dirty < 0)
+				goto out;
+			if (dirty <= DUMP_PAUSED_PAGES)
+				break;
+		}
+	}
+
+	paused = sw_load_now();
+	if (snapshot_pause(ctx, states, &vioapic) != 0)
+		goto out;
+	if (live)
+		dirty = dump_dirty(ctx, fd, mem, nr);
+	else
+		dirty = dump_copy_mem(fd, mem, nr);
+	if (snapshot_resume(ctx, states, &vioapic) != 0 || dirty < 0)
+		goto out;
+	paused = sw_load_now() - paused;
+
+	if (ftruncate(fd, off) != 0 ||
+	    dump_write_headers(fd, mem, nr, states, ctx->vcpu_num) != 0 ||
+	    fdatasync(fd) != 0)
+		goto out;
+
+	err = 0;
+	pr_notice("%s: VM dumped to %s in %lu ms, paused %lu us\n", __func__, path,
+		(sw_load_now() - start) / 1000000UL, paused / 1000UL);
+
+out:
+	close(fd);
+	if (err != 0)
+		unlink(path);
+	for (i = 0; i < nr; i++)
+		free(mem[i].bitmap);
+	free(states);
+	return err;
+}
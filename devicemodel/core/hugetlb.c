@@ -29,18 +29,26 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/param.h>
 #include <sys/vfs.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include <log.h>
 #include <linux/memfd.h>
+#include <linux/falloc.h>
+#include <linux/magic.h>
+#include <signal.h>
 
 #include "vmmapi.h"
+#include "mem.h"
+#include "numa.h"
 
 extern char *vmname;
+extern char *mem_template;
 
 #define ALIGN_CHECK(x, align)	(((x) & ((align)-1)) ? 1 : 0)
 
@@ -57,6 +65,9 @@ extern char *vmname;
 #define SYS_NR_HUGEPAGES  "nr_hugepages"
 #define SYS_FREE_HUGEPAGES  "free_hugepages"
 
+/* the pool of a level on a host node */
+#define SYS_PATH_NODE  "/sys/devices/system/node/node%d/hugepages/hugepages-%dkB/%s"
+
 /* File used for lock between different processes access to hugetlbfs.
  * We observed when access hugetlbfs from different process to allocate
  * huge page at the same time could fail. So use file lock here to make
@@ -133,13 +144,49 @@ struct vm_mmap_mem_region {
 	vm_paddr_t fd_offset;
 	char *hva_base;
 	int fd;
+	size_t pg_size;
 };
 
 static struct vm_mmap_mem_region mmap_mem_regions[16];
 static int mem_idx;
 
+/* one bit per 2M page of guest memory, set while it is given back to the Service VM */
+static uint64_t *released_pages;
+static pthread_mutex_t release_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Memory template (--mem_template): the guest memory in
+ * [MEM_TEMPLATE_BASE, lowmem) and the highmem is mapped from a file on a 2M
+ * hugetlbfs, at its GPA in the file, by all the VMs restored from the same
+ * snapshot. The EPT maps it read-only, the first write to one of its 2M pages
+ * gives the VM a private copy of the page in its memfd, see unshare_page().
+ * The first of these VMs populates the file under a temporary name.
+ *
+ * shared_pages has one bit per 2M page of guest memory, set while the page is
+ * mapped from the template. It is updated under release_mtx as well.
+ */
+static int template_fd = -1;
+static bool template_populated;
+static char template_tmp[MAX_PATH_LEN];
+static size_t template_pages;
+static bool template_sealed;
+static uint64_t *shared_pages;
+static struct vmctx *template_ctx;
+
+/* the numbers of 2M pages released and shared, for hugetlb_get_stats() */
+static size_t nr_released_pages;
+static size_t nr_shared_pages;
+
+/* the guest RAM ranges of hugetlb_register_refault() */
+static struct mem_range refault_ranges[2];
+static int refault_users;
+
 static void *ptr;
 static size_t total_size;
+
+/* threads faulting the guest memory in, the setup thread included */
+#define PREFAULT_MAX_THREADS	8
+static long prefault_threads;
 static int hugetlb_lv_max;
 static int lock_fd;
 
@@ -210,8 +257,7 @@ static int mmap_hugetlbfs_from_level(struct vmctx *ctx, int level, size_t len,
 		size_t offset, size_t skip, char **addr_out)
 {
 	char *addr;
-	size_t pagesz = 0;
-	int fd, i;
+	int fd;
 
 	if (level >= HUGETLB_LV_MAX) {
 		pr_err("exceed max hugetlb level");
@@ -223,8 +269,13 @@ static int mmap_hugetlbfs_from_level(struct vmctx *ctx, int level, size_t len,
 	}
 
 	fd = hugetlb_priv[level].fd;
+	/*
+	 * With a template most of the memfd is never populated, don't reserve
+	 * huge pages for it. A page is allocated before it is touched then.
+	 */
 	addr = mmap(ctx->baseaddr + offset, len, PROT_READ | PROT_WRITE,
-			MAP_SHARED | MAP_FIXED, fd, skip);
+			MAP_SHARED | MAP_FIXED | ((template_fd >= 0) ? MAP_NORESERVE : 0),
+			fd, skip);
 	if (addr == MAP_FAILED)
 		return -ENOMEM;
 
@@ -237,22 +288,110 @@ static int mmap_hugetlbfs_from_level(struct vmctx *ctx, int level, size_t len,
 	mmap_mem_regions[mem_idx].fd = fd;
 	mmap_mem_regions[mem_idx].fd_offset = skip;
 	mmap_mem_regions[mem_idx].hva_base = addr;
+	mmap_mem_regions[mem_idx].pg_size = hugetlb_priv[level].pg_size;
 	mem_idx++;
 	pr_info("mmap 0x%lx@%p\n", len, addr);
 
-	/* pre-allocate hugepages by touch them */
-	pagesz = hugetlb_priv[level].pg_size;
+	/* the huge pages are reserved by now, they are touched by prefault_memory() */
+	return 0;
+}
+
+/* Is the 2M page at gpa still mapped from the template? */
+static bool is_shared_page(vm_paddr_t gpa)
+{
+	uint64_t idx = gpa / hugetlb_priv[HUGETLB_LV1].pg_size;
 
-	pr_info("touch %ld pages with pagesz 0x%lx\n", len/pagesz, pagesz);
+	return (shared_pages != NULL) && (gpa < total_size) &&
+		((__atomic_load_n(&shared_pages[idx / 64], __ATOMIC_ACQUIRE) & (1UL << (idx % 64))) != 0);
+}
 
-	/* Access to the address will trigger hugetlb_fault() in kernel,
-	 * it will allocate and clear the huge page.*/
-	for (i = 0; i < len/pagesz; i++) {
-		*(volatile char *)addr = *addr;
-		addr += pagesz;
+/* Touch the slice of each mapped region that belongs to thread idx */
+static void *prefault_slice(void *arg)
+{
+	long idx = (long)arg;
+	struct vm_mmap_mem_region *region;
+	size_t pages, i;
+	int r;
+
+	for (r = 0; r < mem_idx; r++) {
+		region = &mmap_mem_regions[r];
+		pages = (region->gpa_end - region->gpa_start) / region->pg_size;
+
+		/* Access to the address will trigger hugetlb_fault() in kernel,
+		 * it will allocate and clear the huge page.*/
+		for (i = pages * idx / prefault_threads;
+			i < pages * (idx + 1) / prefault_threads; i++) {
+			/* a page of the template is populated already */
+			if (is_shared_page(region->gpa_start + i * region->pg_size))
+				continue;
+			*(volatile char *)(region->hva_base + i * region->pg_size) =
+				*(region->hva_base + i * region->pg_size);
+		}
 	}
 
-	return 0;
+	return NULL;
+}
+
+/*
+ * Pre-allocate the huge pages of all the mapped regions. The kernel clears
+ * each page as it is faulted in, which is what start-up time goes to with a
+ * big guest, so the regions are split across several threads.
+ */
+static void prefault_memory(void)
+{
+	pthread_t tids[PREFAULT_MAX_THREADS];
+	bool created[PREFAULT_MAX_THREADS] = { false };
+	long i;
+
+	prefault_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (prefault_threads < 1)
+		prefault_threads = 1;
+	else if (prefault_threads > PREFAULT_MAX_THREADS)
+		prefault_threads = PREFAULT_MAX_THREADS;
+
+	pr_info("touch guest memory with %ld threads\n", prefault_threads);
+
+	for (i = 1; i < prefault_threads; i++)
+		created[i] = (pthread_create(&tids[i], NULL, prefault_slice, (void *)i) == 0);
+
+	for (i = 0; i < prefault_threads; i++) {
+		if (created[i])
+			pthread_join(tids[i], NULL);
+		else
+			prefault_slice((void *)i);
+	}
+}
+
+/*
+ * Report how much guest memory each huge page size backs. The hypervisor
+ * only maps a huge page with a leaf of the same size if its GPA is aligned
+ * on it too. The part of a region backed by the largest pages is mapped at
+ * its start, so this holds as long as lowmem, highmem_gpa_base, and the
+ * fd offsets stay aligned.
+ */
+static void report_page_size_mix(void)
+{
+	size_t backed[HUGETLB_LV_MAX] = { 0 };
+	struct vm_mmap_mem_region *region;
+	int level, r;
+
+	for (r = 0; r < mem_idx; r++) {
+		region = &mmap_mem_regions[r];
+		for (level = HUGETLB_LV1; level < hugetlb_lv_max; level++) {
+			if (region->fd == hugetlb_priv[level].fd)
+				backed[level] += region->gpa_end - region->gpa_start;
+		}
+
+		if (ALIGN_CHECK(region->gpa_start, region->pg_size) ||
+			ALIGN_CHECK(region->fd_offset, region->pg_size))
+			pr_warn("gpa 0x%lx is not aligned on its page size 0x%lx, "
+				"it won't be mapped with large EPT pages\n",
+				region->gpa_start, region->pg_size);
+	}
+
+	for (level = hugetlb_lv_max - 1; level >= HUGETLB_LV1; level--)
+		pr_info("guest memory backed by 0x%x pages: 0x%lx\n",
+			hugetlb_priv[level].pg_size, backed[level]);
 }
 
 static int mmap_hugetlbfs(struct vmctx *ctx, size_t offset,
@@ -381,6 +520,25 @@ static int read_sys_info(const char *sys_path)
 	return pages;
 }
 
+static bool write_sys_info(const char *sys_path, int pages)
+{
+	FILE *fp;
+	bool ret;
+
+	fp = fopen(sys_path, "w");
+	if (fp == NULL) {
+		pr_err("can't open: %s, err: %s\n", sys_path, strerror(errno));
+		return false;
+	}
+
+	ret = (fprintf(fp, "%d", pages) > 0);
+	/* the kernel only grows or shrinks the pool once the write is flushed */
+	if (fclose(fp) != 0)
+		ret = false;
+
+	return ret;
+}
+
 /* check if enough free huge pages for the User VM */
 static bool hugetlb_check_memgap(void)
 {
@@ -396,6 +554,9 @@ static bool hugetlb_check_memgap(void)
 		need_pages = (hugetlb_priv[lvl].lowmem + hugetlb_priv[lvl].fbmem +
 			hugetlb_priv[lvl].biosmem + hugetlb_priv[lvl].highmem) /
 			hugetlb_priv[lvl].pg_size;
+		/* the pages of a populated template are allocated already */
+		if ((lvl == HUGETLB_LV1) && template_populated)
+			need_pages -= template_pages;
 
 		hugetlb_priv[lvl].pages_delta = need_pages - free_pages;
 		/* if delta > 0, it's a gap for needed pages, to be handled */
@@ -413,23 +574,19 @@ static bool hugetlb_check_memgap(void)
 static void reserve_more_pages(int level)
 {
 	int total_pages, orig_pages, cur_pages;
-	char cmd_buf[MAX_PATH_LEN];
-	FILE *fp;
 
 	orig_pages = read_sys_info(hugetlb_priv[level].nr_pages_path);
 	total_pages = orig_pages + hugetlb_priv[level].pages_delta;
-	snprintf(cmd_buf, MAX_PATH_LEN, "echo %d > %s",
-		total_pages, hugetlb_priv[level].nr_pages_path);
 
-	/* system cmd to reserve needed huge pages */
-	fp = popen(cmd_buf, "r");
-	if (fp == NULL) {
-		pr_err("cmd: %s failed!\n", cmd_buf);
+	/* reserve needed huge pages */
+	if (!write_sys_info(hugetlb_priv[level].nr_pages_path, total_pages)) {
+		pr_err("fail to reserve %d pages in %s!\n",
+			total_pages, hugetlb_priv[level].nr_pages_path);
 		return;
 	}
-	pclose(fp);
 
-	pr_info("to reserve pages (+orig %d): %s\n", orig_pages, cmd_buf);
+	pr_info("to reserve pages (+orig %d): %d > %s\n", orig_pages,
+		total_pages, hugetlb_priv[level].nr_pages_path);
 	cur_pages = read_sys_info(hugetlb_priv[level].nr_pages_path);
 	hugetlb_priv[level].pages_delta = total_pages - cur_pages;
 }
@@ -439,8 +596,6 @@ static bool release_larger_freepage(int level_limit)
 {
 	int level;
 	int total_pages, orig_pages, cur_pages;
-	char cmd_buf[MAX_PATH_LEN];
-	FILE *fp;
 
 	for (level = hugetlb_lv_max - 1; level >= level_limit; level--) {
 		if (hugetlb_priv[level].pages_delta >= 0)
@@ -449,15 +604,11 @@ static bool release_larger_freepage(int level_limit)
 		/* free one un-used larger page */
 		orig_pages = read_sys_info(hugetlb_priv[level].nr_pages_path);
 		total_pages = orig_pages - 1;
-		snprintf(cmd_buf, MAX_PATH_LEN, "echo %d > %s",
-			total_pages, hugetlb_priv[level].nr_pages_path);
-
-		fp = popen(cmd_buf, "r");
-		if (fp == NULL) {
-			pr_err("cmd to free mem: %s failed!\n", cmd_buf);
+		if (!write_sys_info(hugetlb_priv[level].nr_pages_path, total_pages)) {
+			pr_err("fail to free mem: %d > %s!\n",
+				total_pages, hugetlb_priv[level].nr_pages_path);
 			return false;
 		}
-		pclose(fp);
 
 		cur_pages = read_sys_info(hugetlb_priv[level].nr_pages_path);
 
@@ -539,6 +690,75 @@ static bool hugetlb_reserve_pages(void)
 	return true;
 }
 
+/* the huge pages of the level backing [gpa, gpa + len) of lowmem or highmem */
+static int level_pages_in(struct vmctx *ctx, int level, vm_paddr_t gpa, size_t len)
+{
+	vm_paddr_t start, end;
+	int lvl;
+
+	/* a region is backed by the largest pages first, see mmap_hugetlbfs() */
+	if (gpa < ctx->lowmem) {
+		start = 0;
+		for (lvl = hugetlb_lv_max - 1; lvl > level; lvl--)
+			start += hugetlb_priv[lvl].lowmem;
+		end = start + hugetlb_priv[level].lowmem;
+	} else {
+		start = ctx->highmem_gpa_base;
+		for (lvl = hugetlb_lv_max - 1; lvl > level; lvl--)
+			start += hugetlb_priv[lvl].highmem;
+		end = start + hugetlb_priv[level].highmem;
+	}
+
+	start = MAX(start, gpa);
+	end = MIN(end, gpa + len);
+
+	return (end > start) ? (end - start) / hugetlb_priv[level].pg_size : 0;
+}
+
+/*
+ * Reserve the huge pages of each virtual node on its host node, the free
+ * pages of the global pool may be on another one. Returns false if a node
+ * is short of them, the guest memory is not bound then.
+ */
+static bool hugetlb_reserve_node_pages(struct vmctx *ctx)
+{
+	struct numa_mem_range ranges[2];
+	char nr_path[MAX_PATH_LEN], free_path[MAX_PATH_LEN];
+	int v, r, nr, level, node, need, free_pages;
+
+	for (v = 0; v < numa_nr_vnodes(); v++) {
+		node = numa_host_node(v);
+		nr = numa_vnode_ranges(v, ranges);
+		for (level = HUGETLB_LV1; level < hugetlb_lv_max; level++) {
+			need = 0;
+			for (r = 0; r < nr; r++)
+				need += level_pages_in(ctx, level, ranges[r].gpa, ranges[r].len);
+			if (need == 0)
+				continue;
+
+			snprintf(nr_path, MAX_PATH_LEN, SYS_PATH_NODE, node,
+				hugetlb_priv[level].pg_size / 1024, SYS_NR_HUGEPAGES);
+			snprintf(free_path, MAX_PATH_LEN, SYS_PATH_NODE, node,
+				hugetlb_priv[level].pg_size / 1024, SYS_FREE_HUGEPAGES);
+			free_pages = read_sys_info(free_path);
+			if (free_pages < need) {
+				write_sys_info(nr_path, read_sys_info(nr_path) + need - free_pages);
+				free_pages = read_sys_info(free_path);
+			}
+
+			pr_info("node %d level %d free/need pages:%d/%d\n", node, level,
+				free_pages, need);
+			if (free_pages < need) {
+				pr_warn("node %d is short of 0x%x pages, guest memory not bound\n",
+					node, hugetlb_priv[level].pg_size);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
 bool init_hugetlb(void)
 {
 	char path[MAX_PATH_LEN] = {0};
@@ -600,6 +820,141 @@ void uninit_hugetlb(void)
 	close(lock_fd);
 }
 
+/*
+ * The guest RAM a balloon may release and a template shares: lowmem above
+ * its first 2M page, highmem. Returns the number of ranges.
+ */
+static int guest_ram_ranges(struct vmctx *ctx, vm_paddr_t *gpa, size_t *len)
+{
+	int nr = 0;
+
+	if (ctx->lowmem > MEM_TEMPLATE_BASE) {
+		gpa[nr] = MEM_TEMPLATE_BASE;
+		len[nr++] = ctx->lowmem - MEM_TEMPLATE_BASE;
+	}
+	if (ctx->highmem > 0) {
+		gpa[nr] = ctx->highmem_gpa_base;
+		len[nr++] = ctx->highmem;
+	}
+
+	return nr;
+}
+
+static void close_template(void)
+{
+	struct sigaction sa;
+
+	free(shared_pages);
+	shared_pages = NULL;
+	__atomic_store_n(&nr_shared_pages, 0, __ATOMIC_RELAXED);
+	if (template_fd < 0)
+		return;
+
+	if (template_sealed) {
+		hugetlb_unregister_refault(template_ctx);
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = SIG_DFL;
+		sigaction(SIGSEGV, &sa, NULL);
+		template_sealed = false;
+	}
+
+	close(template_fd);
+	template_fd = -1;
+	/* a template this VM failed to populate */
+	if (!template_populated && (template_tmp[0] != '\0'))
+		unlink(template_tmp);
+	template_tmp[0] = '\0';
+	template_ctx = NULL;
+	template_pages = 0;
+}
+
+/*
+ * Open the template, or create it under a temporary name if it doesn't exist
+ * yet: this VM populates it then, see hugetlb_seal_template().
+ */
+static int open_template(struct vmctx *ctx)
+{
+	vm_paddr_t gpa[2];
+	size_t len[2], size = ctx->highmem_gpa_base + ctx->highmem;
+	struct statfs fs;
+	struct stat st;
+	int i, nr;
+
+	nr = guest_ram_ranges(ctx, gpa, len);
+	if (nr == 0) {
+		pr_err("the VM has no memory to share with a template\n");
+		return -1;
+	}
+
+	template_populated = false;
+	template_fd = open(mem_template, O_RDWR | O_CLOEXEC);
+	if (template_fd >= 0) {
+		template_populated = true;
+	} else if (errno == ENOENT) {
+		snprintf(template_tmp, sizeof(template_tmp), "%s.new", mem_template);
+		template_fd = open(template_tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		if ((template_fd < 0) && (errno == EEXIST)) {
+			pr_err("%s is being created, remove it if no acrn-dm does\n", template_tmp);
+			template_tmp[0] = '\0';
+		} else if ((template_fd >= 0) && (ftruncate(template_fd, size) != 0))
+			goto err;
+	}
+	if (template_fd < 0) {
+		pr_err("fail to open the memory template %s: %s\n", mem_template, strerror(errno));
+		return -1;
+	}
+
+	if ((fstatfs(template_fd, &fs) != 0) || (fs.f_type != HUGETLBFS_MAGIC) ||
+		(fs.f_bsize != hugetlb_priv[HUGETLB_LV1].pg_size)) {
+		pr_err("the memory template %s is not on a 2M hugetlbfs\n", mem_template);
+		goto err;
+	}
+	if ((fstat(template_fd, &st) != 0) || (st.st_size != size)) {
+		pr_err("the memory template %s is not for a VM of this memory size\n", mem_template);
+		goto err;
+	}
+
+	template_pages = 0;
+	for (i = 0; i < nr; i++)
+		template_pages += len[i] / hugetlb_priv[HUGETLB_LV1].pg_size;
+	template_ctx = ctx;
+	pr_info("guest memory shared with the %s template %s\n",
+		template_populated ? "populated" : "new", mem_template);
+
+	return 0;
+
+err:
+	close_template();
+	return -1;
+}
+
+/* Map the template over the memfd in the guest RAM it shares */
+static int map_template(struct vmctx *ctx)
+{
+	size_t pg_size = hugetlb_priv[HUGETLB_LV1].pg_size;
+	vm_paddr_t gpa[2], addr;
+	size_t len[2];
+	uint64_t idx;
+	int i, nr;
+
+	nr = guest_ram_ranges(ctx, gpa, len);
+	for (i = 0; i < nr; i++) {
+		if (mmap(ctx->baseaddr + gpa[i], len[i], PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED, template_fd, gpa[i]) == MAP_FAILED) {
+			pr_err("fail to map the memory template: %s\n", strerror(errno));
+			return -1;
+		}
+
+		for (addr = gpa[i]; addr < gpa[i] + len[i]; addr += pg_size) {
+			idx = addr / pg_size;
+			shared_pages[idx / 64] |= (1UL << (idx % 64));
+		}
+		__atomic_add_fetch(&nr_shared_pages, len[i] / pg_size, __ATOMIC_RELAXED);
+	}
+
+	return 0;
+}
+
 int hugetlb_setup_memory(struct vmctx *ctx)
 {
 	int level;
@@ -608,9 +963,13 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 	int fd;
 	unsigned int seal_flag = F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL;
 	size_t mem_size_level;
+	bool numa_bind;
 
 	mem_idx = 0;
 	memset(&mmap_mem_regions, 0, sizeof(mmap_mem_regions));
+	free(released_pages);
+	released_pages = NULL;
+	__atomic_store_n(&nr_released_pages, 0, __ATOMIC_RELAXED);
 	if (ctx->lowmem == 0) {
 		pr_err("vm requests 0 memory");
 		goto err;
@@ -652,6 +1011,23 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 
 	total_size = ctx->highmem_gpa_base + ctx->highmem;
 
+	released_pages = calloc(ALIGN_UP(total_size / hugetlb_priv[HUGETLB_LV1].pg_size, 64) / 64,
+			sizeof(uint64_t));
+	if (released_pages == NULL) {
+		pr_err("Fail to allocate the released pages bitmap.\n");
+		goto err;
+	}
+
+	if (mem_template != NULL) {
+		shared_pages = calloc(ALIGN_UP(total_size / hugetlb_priv[HUGETLB_LV1].pg_size, 64) / 64,
+				sizeof(uint64_t));
+		if ((shared_pages == NULL) || (open_template(ctx) != 0))
+			goto err;
+
+		/* a write copies one 2M page, no 1G page backs the memory */
+		close_hugetlbfs(HUGETLB_LV2);
+	}
+
 	/* check & set hugetlb level memory size for lowmem/biosmem/highmem */
 	lowmem = ctx->lowmem;
 	fbmem = ctx->fbmem;
@@ -687,8 +1063,20 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 		}
 	}
 
+	/* split the guest RAM between the nodes on the largest pages */
+	for (level = hugetlb_lv_max - 1; level > HUGETLB_LV1; level--) {
+		if (hugetlb_priv[level].fd >= 0)
+			break;
+	}
+	if (numa_layout(ctx, hugetlb_priv[level].pg_size) != 0)
+		goto err;
+
 	lock_acrn_hugetlb();
 
+	/* the pages of a template are not allocated with the node policy */
+	numa_bind = (numa_nr_vnodes() > 0) && (template_fd < 0) &&
+		hugetlb_reserve_node_pages(ctx);
+
 	/* it will check each level memory need */
 	has_gap = hugetlb_check_memgap();
 	if (has_gap) {
@@ -761,6 +1149,12 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 		goto err_lock;
 	}
 
+	if (numa_bind)
+		numa_bind_memory(ctx);
+
+	if ((template_fd >= 0) && (map_template(ctx) != 0))
+		goto err_lock;
+
 	/* resize the memfd to meet with the size requirement and add the
 	 * F_SEAL_SEAL flag
 	 */
@@ -786,6 +1180,9 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 	}
 
 
+	/* still under the lock, see ACRN_HUGETLB_LOCK_FILE */
+	prefault_memory();
+
 	unlock_acrn_hugetlb();
 
 	/* dump hugepage really setup */
@@ -797,9 +1194,17 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 			hugetlb_priv[level].biosmem,
 			hugetlb_priv[level].highmem);
 	}
+	report_page_size_mix();
 
-	/* map ept for lowmem */
-	if (vm_map_memseg_vma(ctx, ctx->lowmem, 0,
+	/* map ept for lowmem, the part shared with a template read-only */
+	if (template_fd >= 0) {
+		if (vm_map_memseg_vma(ctx, MEM_TEMPLATE_BASE, 0,
+			(uint64_t)ctx->baseaddr, PROT_ALL) < 0)
+			goto err;
+		if (vm_map_memseg_vma(ctx, ctx->lowmem - MEM_TEMPLATE_BASE, MEM_TEMPLATE_BASE,
+			(uint64_t)(ctx->baseaddr + MEM_TEMPLATE_BASE), PROT_READ | PROT_EXEC) < 0)
+			goto err;
+	} else if (vm_map_memseg_vma(ctx, ctx->lowmem, 0,
 		(uint64_t)ctx->baseaddr, PROT_ALL) < 0)
 		goto err;
 
@@ -820,7 +1225,7 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 	if (ctx->highmem > 0) {
 		if (vm_map_memseg_vma(ctx, ctx->highmem, ctx->highmem_gpa_base,
 			(uint64_t)(ctx->baseaddr + ctx->highmem_gpa_base),
-			PROT_ALL) < 0)
+			(template_fd >= 0) ? (PROT_READ | PROT_EXEC) : PROT_ALL) < 0)
 			goto err;
 	}
 
@@ -836,6 +1241,7 @@ err:
 	for (level = HUGETLB_LV1; level < hugetlb_lv_max; level++) {
 		close_hugetlbfs(level);
 	}
+	close_template();
 
 	return -ENOMEM;
 }
@@ -853,25 +1259,387 @@ void hugetlb_unsetup_memory(struct vmctx *ctx)
 	for (level = HUGETLB_LV1; level < hugetlb_lv_max; level++) {
 		close_hugetlbfs(level);
 	}
+	close_template();
+
+	free(released_pages);
+	released_pages = NULL;
+	__atomic_store_n(&nr_released_pages, 0, __ATOMIC_RELAXED);
+}
+
+static struct vm_mmap_mem_region *
+find_mmap_region(vm_paddr_t gpa)
+{
+	int i;
+
+	for (i = 0; i < mem_idx; i++) {
+		if ((gpa >= mmap_mem_regions[i].gpa_start) &&
+			(gpa < mmap_mem_regions[i].gpa_end))
+			return &mmap_mem_regions[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Map the 2M page at addr from the memfd in place of the template in the DM.
+ * The caller tells the page is not shared anymore once the EPT agrees.
+ *
+ * @pre release_mtx is held
+ */
+static int map_private_page(struct vmctx *ctx, struct vm_mmap_mem_region *region,
+		vm_paddr_t addr, int flags)
+{
+	size_t pg_size = hugetlb_priv[HUGETLB_LV1].pg_size;
+
+	if (mmap(ctx->baseaddr + addr, pg_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED | flags,
+		region->fd, region->fd_offset + (addr - region->gpa_start)) == MAP_FAILED) {
+		pr_err("Fail to map the private page at gpa 0x%lx: %s\n", addr, strerror(errno));
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* @pre release_mtx is held */
+static void clear_shared_page(vm_paddr_t addr)
+{
+	uint64_t idx = addr / hugetlb_priv[HUGETLB_LV1].pg_size;
+
+	__atomic_fetch_and(&shared_pages[idx / 64], ~(1UL << (idx % 64)), __ATOMIC_RELEASE);
+	__atomic_sub_fetch(&nr_shared_pages, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Copy the 2M page at addr, still shared with the template, into the memfd
+ * and map the copy writable in the DM, then in the EPT. The guest can keep
+ * reading the template meanwhile, both have the same data, and an access
+ * while the page is out of the EPT waits for release_mtx in the refault.
+ *
+ * @pre release_mtx is held
+ */
+static int unshare_page(struct vmctx *ctx, vm_paddr_t addr)
+{
+	struct vm_mmap_mem_region *region = find_mmap_region(addr);
+	size_t pg_size = hugetlb_priv[HUGETLB_LV1].pg_size;
+	off_t offset = region->fd_offset + (addr - region->gpa_start);
+	void *page;
+
+	if (fallocate(region->fd, 0, offset, pg_size) != 0) {
+		pr_err("Fail to allocate the huge page at gpa 0x%lx: %s\n", addr, strerror(errno));
+		return -ENOMEM;
+	}
+
+	page = mmap(NULL, pg_size, PROT_READ | PROT_WRITE, MAP_SHARED, region->fd, offset);
+	if (page == MAP_FAILED)
+		return -ENOMEM;
+	memcpy(page, ctx->baseaddr + addr, pg_size);
+	munmap(page, pg_size);
+
+	if (map_private_page(ctx, region, addr, 0) != 0)
+		return -ENOMEM;
+
+	if ((vm_unmap_memseg(ctx, addr, pg_size) != 0) ||
+		(vm_map_memseg_vma(ctx, pg_size, addr, (uint64_t)(ctx->baseaddr + addr), PROT_ALL) != 0))
+		return -EFAULT;
+	clear_shared_page(addr);
+
+	return 0;
+}
+
+/*
+ * Give the 2M huge pages fully inside [gpa, gpa + len) back to the Service
+ * VM: unmap them from the EPT and punch them out of the memfd. Memory backed
+ * by 1G huge pages is kept. A released page is populated and mapped again by
+ * hugetlb_refault_memory() once the guest accesses it.
+ *
+ * Returns the number of bytes released.
+ */
+size_t
+hugetlb_release_memory(struct vmctx *ctx, vm_paddr_t gpa, size_t len)
+{
+	struct vm_mmap_mem_region *region;
+	size_t pg_size = hugetlb_priv[HUGETLB_LV1].pg_size;
+	size_t released = 0;
+	vm_paddr_t addr, end;
+	uint64_t idx;
+
+	if (released_pages == NULL)
+		return 0;
+
+	addr = ALIGN_UP(gpa, pg_size);
+	end = ALIGN_DOWN(gpa + len, pg_size);
+
+	pthread_mutex_lock(&release_mtx);
+	for (; addr < end; addr += pg_size) {
+		region = find_mmap_region(addr);
+		idx = addr / pg_size;
+		if ((region == NULL) || (region->fd != hugetlb_priv[HUGETLB_LV1].fd) ||
+			((released_pages[idx / 64] & (1UL << (idx % 64))) != 0))
+			continue;
+
+		if (vm_unmap_memseg(ctx, addr, pg_size) != 0)
+			continue;
+
+		/* the memfd backs a page of the template once it is released */
+		if (is_shared_page(addr)) {
+			if (map_private_page(ctx, region, addr, MAP_NORESERVE) != 0) {
+				vm_map_memseg_vma(ctx, pg_size, addr, (uint64_t)(ctx->baseaddr + addr),
+					PROT_READ | PROT_EXEC);
+				continue;
+			}
+			clear_shared_page(addr);
+		}
+
+		/* the guest can't reach the page anymore, it is mapped again on its next access */
+		released_pages[idx / 64] |= (1UL << (idx % 64));
+		__atomic_add_fetch(&nr_released_pages, 1, __ATOMIC_RELAXED);
+		if (fallocate(region->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			region->fd_offset + (addr - region->gpa_start), pg_size) != 0) {
+			pr_err("Fail to release the huge page at gpa 0x%lx: %s\n", addr, strerror(errno));
+			continue;
+		}
+		released += pg_size;
+	}
+	pthread_mutex_unlock(&release_mtx);
+
+	return released;
+}
+
+/*
+ * Populate the released 2M huge page gpa is in again and map it back into
+ * the EPT, or give a page shared with the template its private copy. Any
+ * other page is left alone.
+ */
+int
+hugetlb_refault_memory(struct vmctx *ctx, vm_paddr_t gpa)
+{
+	struct vm_mmap_mem_region *region;
+	size_t pg_size = hugetlb_priv[HUGETLB_LV1].pg_size;
+	vm_paddr_t addr = ALIGN_DOWN(gpa, pg_size);
+	uint64_t idx = addr / pg_size;
+	int ret = 0;
+
+	if ((released_pages == NULL) || (addr >= total_size))
+		return 0;
+
+	pthread_mutex_lock(&release_mtx);
+	if ((released_pages[idx / 64] & (1UL << (idx % 64))) != 0) {
+		region = find_mmap_region(addr);
+		/* allocate it first, touching it with no huge page left would raise SIGBUS */
+		if (fallocate(region->fd, 0, region->fd_offset + (addr - region->gpa_start), pg_size) != 0) {
+			pr_err("Fail to allocate the huge page at gpa 0x%lx: %s\n", addr, strerror(errno));
+			ret = -ENOMEM;
+		} else if (vm_map_memseg_vma(ctx, pg_size, addr, (uint64_t)(ctx->baseaddr + addr), PROT_ALL) != 0) {
+			ret = -EFAULT;
+		} else {
+			released_pages[idx / 64] &= ~(1UL << (idx % 64));
+			__atomic_sub_fetch(&nr_released_pages, 1, __ATOMIC_RELAXED);
+		}
+	} else if (is_shared_page(addr)) {
+		ret = unshare_page(ctx, addr);
+	}
+	pthread_mutex_unlock(&release_mtx);
+
+	return ret;
+}
+
+/*
+ * Give the pages of [gpa, gpa + len) shared with the template their private
+ * copy, before the DM writes them or hands them to a system call.
+ */
+int
+hugetlb_unshare_memory(struct vmctx *ctx, vm_paddr_t gpa, size_t len)
+{
+	size_t pg_size = hugetlb_priv[HUGETLB_LV1].pg_size;
+	vm_paddr_t addr;
+	int ret = 0;
+
+	if ((shared_pages == NULL) || (len == 0))
+		return 0;
+
+	for (addr = ALIGN_DOWN(gpa, pg_size); (addr < gpa + len) && (ret == 0); addr += pg_size) {
+		if (is_shared_page(addr))
+			ret = hugetlb_refault_memory(ctx, addr);
+	}
+
+	return ret;
+}
+
+/*
+ * A write of the DM to the template, through ctx->baseaddr rather than
+ * vm_map_gpa(): copy the page and retry it. Anything else gets the default
+ * action on the retry.
+ */
+static void
+template_sigsegv_handler(int sig, siginfo_t *info, void *ucontext)
+{
+	char *addr = info->si_addr;
+	struct sigaction sa;
+
+	if ((info->si_code == SEGV_ACCERR) && (template_ctx != NULL) &&
+		(addr >= (char *)template_ctx->baseaddr) &&
+		(addr < (char *)template_ctx->baseaddr + total_size) &&
+		is_shared_page(addr - (char *)template_ctx->baseaddr) &&
+		(hugetlb_refault_memory(template_ctx, addr - (char *)template_ctx->baseaddr) == 0))
+		return;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_DFL;
+	sigaction(SIGSEGV, &sa, NULL);
+}
+
+/* Bytes of guest memory released by the balloon and shared with the template, lock free */
+void
+hugetlb_get_stats(struct vmctx *ctx, size_t *released, size_t *shared)
+{
+	size_t pg_size = hugetlb_priv[HUGETLB_LV1].pg_size;
+
+	*released = __atomic_load_n(&nr_released_pages, __ATOMIC_RELAXED) * pg_size;
+	*shared = __atomic_load_n(&nr_shared_pages, __ATOMIC_RELAXED) * pg_size;
+}
+
+bool
+hugetlb_template_populated(void)
+{
+	return (template_fd >= 0) && template_populated;
+}
+
+/*
+ * The guest memory is restored: publish the template if this VM populated it,
+ * and write-protect it in the DM as it is in the EPT. Writes to it go through
+ * hugetlb_refault_memory() from now on.
+ */
+int
+hugetlb_seal_template(struct vmctx *ctx)
+{
+	struct sigaction sa;
+	vm_paddr_t gpa[2];
+	size_t len[2];
+	int i, nr;
+
+	if (template_fd < 0)
+		return 0;
+
+	if (!template_populated) {
+		if (rename(template_tmp, mem_template) != 0) {
+			pr_err("fail to publish the memory template %s: %s\n", mem_template, strerror(errno));
+			return -1;
+		}
+		template_populated = true;
+		pr_notice("memory template %s populated\n", mem_template);
+	}
+
+	nr = guest_ram_ranges(ctx, gpa, len);
+	for (i = 0; i < nr; i++) {
+		if (mprotect(ctx->baseaddr + gpa[i], len[i], PROT_READ) != 0) {
+			pr_err("fail to write-protect the memory template: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = template_sigsegv_handler;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	if (hugetlb_register_refault(ctx) != 0)
+		return -1;
+	if (sigaction(SIGSEGV, &sa, NULL) != 0) {
+		hugetlb_unregister_refault(ctx);
+		return -1;
+	}
+	template_sealed = true;
+
+	return 0;
+}
+
+/*
+ * Guest RAM accesses the EPT doesn't let through end up here: the page was
+ * released or is shared with the template. An instruction fetch only needs
+ * the mapping, it comes with size 0.
+ */
+static int
+hugetlb_mem_handler(struct vmctx *ctx, int vcpu, int dir, uint64_t addr,
+			int size, uint64_t *val, void *arg1, long arg2)
+{
+	if (hugetlb_refault_memory(ctx, addr) != 0) {
+		pr_err("fail to refault gpa 0x%lx\n", addr);
+		return -1;
+	}
+
+	if (size > 0) {
+		if (dir == MEM_F_WRITE)
+			memcpy(ctx->baseaddr + addr, val, size);
+		else
+			memcpy(val, ctx->baseaddr + addr, size);
+	}
+
+	return 0;
+}
+
+/*
+ * Route the guest RAM accesses the EPT doesn't let through to
+ * hugetlb_refault_memory(), for the balloon and the template. The ranges are
+ * registered once for all the users.
+ */
+int
+hugetlb_register_refault(struct vmctx *ctx)
+{
+	vm_paddr_t gpa[2];
+	size_t len[2];
+	int i, nr;
+
+	if (refault_users++ > 0)
+		return 0;
+
+	nr = guest_ram_ranges(ctx, gpa, len);
+	for (i = 0; i < nr; i++) {
+		refault_ranges[i] = (struct mem_range) {
+			.name = (gpa[i] == MEM_TEMPLATE_BASE) ? "ram_lowmem" : "ram_highmem",
+			.flags = MEM_F_RW | MEM_F_MT_SAFE,
+			.handler = hugetlb_mem_handler,
+			.base = gpa[i],
+			.size = len[i],
+		};
+		if (register_mem_fallback(&refault_ranges[i]) != 0) {
+			pr_err("fail to register the guest RAM range 0x%lx\n", gpa[i]);
+			while (--i >= 0)
+				unregister_mem_fallback(&refault_ranges[i]);
+			refault_users--;
+			return -1;
+		}
+	}
+
+	/* the guest may run another task while a page is mapped again */
+	vm_set_lazy_memory(ctx, gpa, len, nr);
+
+	return 0;
+}
+
+void
+hugetlb_unregister_refault(struct vmctx *ctx)
+{
+	vm_paddr_t gpa[2];
+	size_t len[2];
+	int i, nr;
+
+	if ((refault_users == 0) || (--refault_users > 0))
+		return;
+
+	vm_set_lazy_memory(ctx, NULL, NULL, 0);
+	nr = guest_ram_ranges(ctx, gpa, len);
+	for (i = 0; i < nr; i++)
+		unregister_mem_fallback(&refault_ranges[i]);
 }
 
 bool
 vm_find_memfd_region(struct vmctx *ctx, vm_paddr_t gpa,
 			struct vm_mem_region *ret_region)
 {
-	int i;
 	uint64_t offset;
 	struct vm_mmap_mem_region *mmap_region;
 	bool ret;
 
-	mmap_region = NULL;
-	for (i = 0; i < mem_idx; i++) {
-		if ((gpa >= mmap_mem_regions[i].gpa_start) &&
-			(gpa < mmap_mem_regions[i].gpa_end)) {
-			mmap_region = &mmap_mem_regions[i];
-			break;
-		}
-	}
+	mmap_region = find_mmap_region(gpa);
 	if (mmap_region && ret_region) {
 		ret = true;
 		offset = gpa - mmap_region->gpa_start;
@@ -883,6 +1651,27 @@ vm_find_memfd_region(struct vmctx *ctx, vm_paddr_t gpa,
 	return ret;
 }
 
+int
+vm_get_memfd_regions(struct vmctx *ctx, struct vm_memfd_region *regions,
+			int max)
+{
+	int i;
+
+	if (mem_idx > max)
+		return -1;
+
+	for (i = 0; i < mem_idx; i++) {
+		regions[i].gpa = mmap_mem_regions[i].gpa_start;
+		regions[i].size = mmap_mem_regions[i].gpa_end -
+			mmap_mem_regions[i].gpa_start;
+		regions[i].hva = mmap_mem_regions[i].hva_base;
+		regions[i].fd = mmap_mem_regions[i].fd;
+		regions[i].fd_offset = mmap_mem_regions[i].fd_offset;
+	}
+
+	return mem_idx;
+}
+
 bool vm_allow_dmabuf(struct vmctx *ctx)
 {
 	uint32_t mem_flags;
@@ -29,12 +29,17 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "dm.h"
 #include "inout.h"
 #include "log.h"
+#include "io_hotspot.h"
 SET_DECLARE(inout_port_set, struct inout_port);
 
 #define	MAX_IOPORTS	(1 << 16)
 
+/* the hypervisor sends the elements of a string port I/O in one page */
+#define	PIO_STRING_MAX_BYTES	4096
+
 #define	VERIFY_IOPORT(port, size) \
 	((port) >= 0 && (size) > 0 && ((port) + (size)) <= MAX_IOPORTS)
 
@@ -102,19 +107,87 @@ emulate_inout(struct vmctx *ctx, int *pvcpu, struct acrn_pio_request *pio_reques
 		((bytes != 1) && (bytes != 2) && (bytes != 4)))
 		return -1;
 
+	ioreq_emul_lock(false);
+	if ((inout_handlers[port].flags & IOPORT_F_MT_SAFE) == 0) {
+		/* the handler expects the emulation to be serialized */
+		ioreq_emul_unlock();
+		ioreq_emul_lock(true);
+	}
+
+	handler = inout_handlers[port].handler;
+	flags = inout_handlers[port].flags;
+	arg = inout_handlers[port].arg;
+
+	if (!(flags & (in ? IOPORT_F_IN : IOPORT_F_OUT)))
+		retval = -1;
+	else
+		retval = handler(ctx, *pvcpu, in, port, bytes,
+			(uint32_t *)&(pio_request->value), arg);
+	if (io_hotspot_sample_due())
+		io_hotspot_sample(IO_HOTSPOT_PIO, port, inout_handlers[port].name);
+	ioreq_emul_unlock();
+
+	return retval;
+}
+
+/*
+ * The iterations of an ins/outs in one guest page, at once: the handler of
+ * the port is called for each element, in the order the instruction accesses
+ * them, under a single emulation lock.
+ */
+int
+emulate_inout_string(struct vmctx *ctx, int *pvcpu, struct acrn_pio_string_request *req)
+{
+	int bytes, flags, in, port, down;
+	inout_func_t handler;
+	void *arg;
+	uint8_t *buf;
+	uint32_t val;
+	uint64_t i, idx;
+	int retval = 0;
+
+	bytes = req->size;
+	in = (req->direction == ACRN_IOREQ_DIR_READ);
+	port = req->address;
+	down = ((req->flags & ACRN_PIO_STRING_DOWN) != 0);
+
+	if ((port + bytes - 1 >= MAX_IOPORTS) ||
+		((bytes != 1) && (bytes != 2) && (bytes != 4)) ||
+		(req->count > PIO_STRING_MAX_BYTES / bytes))
+		return -1;
+
+	if (req->flags & ACRN_PIO_STRING_VALUE)
+		buf = (uint8_t *)&req->value;
+	else
+		buf = paddr_guest2host(ctx, req->gpa, req->count * bytes);
+	if (buf == NULL)
+		return -1;
+
+	ioreq_emul_lock(false);
+	if ((inout_handlers[port].flags & IOPORT_F_MT_SAFE) == 0) {
+		ioreq_emul_unlock();
+		ioreq_emul_lock(true);
+	}
+
 	handler = inout_handlers[port].handler;
 	flags = inout_handlers[port].flags;
 	arg = inout_handlers[port].arg;
 
-	if (pio_request->direction == ACRN_IOREQ_DIR_READ) {
-		if (!(flags & IOPORT_F_IN))
-			return -1;
-	} else {
-		if (!(flags & IOPORT_F_OUT))
-			return -1;
+	if (!(flags & (in ? IOPORT_F_IN : IOPORT_F_OUT)))
+		retval = -1;
+	for (i = 0; (i < req->count) && (retval == 0); i++) {
+		idx = down ? (req->count - 1 - i) : i;
+		val = 0;
+		if (!in)
+			memcpy(&val, buf + idx * bytes, bytes);
+		retval = handler(ctx, *pvcpu, in, port, bytes, &val, arg);
+		if (in)
+			memcpy(buf + idx * bytes, &val, bytes);
 	}
-	retval = handler(ctx, *pvcpu, in, port, bytes,
-		(uint32_t *)&(pio_request->value), arg);
+	if (io_hotspot_sample_due())
+		io_hotspot_sample(IO_HOTSPOT_PIO, port, inout_handlers[port].name);
+	ioreq_emul_unlock();
+
 	return retval;
 }
 
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * A count-min sketch estimates how often each (type, address) was sampled,
+ * and the ones with the highest estimates are kept with the name of their
+ * handler in a small top-N table, for acrnctl to tell which devices to move
+ * to the hypervisor or to pass through.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "acrn_mngr.h"
+#include "io_hotspot.h"
+
+#define SKETCH_DEPTH		4
+#define SKETCH_WIDTH_SHIFT	8
+#define SKETCH_WIDTH		(1U << SKETCH_WIDTH_SHIFT)
+
+uint64_t io_hotspot_seen;
+
+static pthread_mutex_t hotspot_mtx = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t hotspot_samples;
+static uint32_t sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+static int nr_top;
+static struct io_hotspot top[IO_HOTSPOT_NUM];
+
+static const uint64_t sketch_seed[SKETCH_DEPTH] = {
+	0x243f6a8885a308d3UL, 0x13198a2e03707344UL, 0xa4093822299f31d0UL, 0x082efa98ec4e6c89UL,
+};
+
+static inline uint32_t
+sketch_slot(uint64_t key, int row)
+{
+	return ((key ^ sketch_seed[row]) * 0x9e3779b97f4a7c15UL) >> (64 - SKETCH_WIDTH_SHIFT);
+}
+
+/* conservative update: only the rows at the minimum are bumped */
+static uint32_t
+sketch_count(uint64_t key)
+{
+	uint32_t slot[SKETCH_DEPTH];
+	uint32_t est = UINT32_MAX;
+	int row;
+
+	for (row = 0; row < SKETCH_DEPTH; row++) {
+		slot[row] = sketch_slot(key, row);
+		if (sketch[row][slot[row]] < est)
+			est = sketch[row][slot[row]];
+	}
+
+	if (est == UINT32_MAX)
+		return est;
+
+	for (row = 0; row < SKETCH_DEPTH; row++) {
+		if (sketch[row][slot[row]] == est)
+			sketch[row][slot[row]] = est + 1;
+	}
+	return est + 1;
+}
+
+void
+io_hotspot_sample(int type, uint64_t addr, const char *dev)
+{
+	struct io_hotspot *entry = NULL;
+	uint32_t est;
+	int i, coldest = 0;
+
+	pthread_mutex_lock(&hotspot_mtx);
+	hotspot_samples++;
+	est = sketch_count(addr ^ ((uint64_t)type << 63));
+
+	for (i = 0; i < nr_top; i++) {
+		if ((top[i].addr == addr) && (top[i].type == type)) {
+			entry = &top[i];
+			break;
+		}
+		if (top[i].count < top[coldest].count)
+			coldest = i;
+	}
+
+	if (entry == NULL) {
+		/* a new key takes a free entry, or the coldest one once hotter */
+		if (nr_top < IO_HOTSPOT_NUM)
+			entry = &top[nr_top++];
+		else if (est > top[coldest].count)
+			entry = &top[coldest];
+
+		if (entry != NULL) {
+			entry->addr = addr;
+			entry->type = type;
+			snprintf(entry->dev, sizeof(entry->dev), "%s", dev ? dev : "");
+		}
+	}
+
+	if (entry != NULL)
+		entry->count = est;
+	pthread_mutex_unlock(&hotspot_mtx);
+}
+
+void
+io_hotspot_get(struct io_hotspots *out, bool reset)
+{
+	struct io_hotspot tmp;
+	int i, j;
+
+	memset(out->hotspot, 0, sizeof(out->hotspot));
+	out->sample_shift = IO_HOTSPOT_SAMPLE_SHIFT;
+
+	pthread_mutex_lock(&hotspot_mtx);
+	out->samples = hotspot_samples;
+	memcpy(out->hotspot, top, nr_top * sizeof(top[0]));
+	if (reset) {
+		hotspot_samples = 0;
+		nr_top = 0;
+		memset(sketch, 0, sizeof(sketch));
+		memset(top, 0, sizeof(top));
+	}
+	pthread_mutex_unlock(&hotspot_mtx);
+
+	for (i = 1; i < IO_HOTSPOT_NUM; i++) {
+		tmp = out->hotspot[i];
+		for (j = i; (j > 0) && (out->hotspot[j - 1].count < tmp.count); j--)
+			out->hotspot[j] = out->hotspot[j - 1];
+		out->hotspot[j] = tmp;
+	}
+}
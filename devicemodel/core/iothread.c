@@ -14,10 +14,13 @@
 #include <sys/queue.h>
 #include <pthread.h>
 #include <signal.h>
+#include <string.h>
+#include <time.h>
 
 #include "iothread.h"
 #include "log.h"
 #include "mevent.h"
+#include "dm_string.h"
 
 
 #define MEVENT_MAX 64
@@ -27,80 +30,216 @@ struct iothread_ctx {
 	int epfd;
 	bool started;
 	pthread_mutex_t mtx;
+	int idx;
+	bool in_use;
+	bool pinned;
+	cpu_set_t cpuset;
+	/* the mevents with busy-poll hooks, protected by mtx */
+	struct iothread_mevent *pollers[MEVENT_MAX];
+	int npollers;
+	unsigned int pollers_gen;	/* bumped on every change of pollers */
 };
-static struct iothread_ctx ioctx;
 
-static void *
-io_thread(void *arg)
+/*
+ * ioctxes[0] is the default iothread shared by the devices given a plain
+ * "iothread" option, the others are created for the devices asking for
+ * iothreads of their own.
+ */
+static struct iothread_ctx ioctxes[IOTHREAD_NUM];
+static pthread_mutex_t ioctxes_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Busy-poll mode: after a wakeup the iothread keeps polling the pollers
+ * instead of going back to sleep, with their notifications turned off, and
+ * only falls back to the eventfd wakeup after busy_poll_idle_ns without work.
+ */
+static bool busy_poll_enabled;
+static uint64_t busy_poll_idle_ns;
+static int busy_poll_pcpu = -1;
+
+static int
+iothread_handle_events(struct iothread_ctx *ioctx, int timeout)
 {
 	struct epoll_event eventlist[MEVENT_MAX];
 	struct iothread_mevent *aevp;
 	int i, n, status;
 	char buf[MAX_EVENT_NUM];
 
-	while(ioctx.started) {
-		n = epoll_wait(ioctx.epfd, eventlist, MEVENT_MAX, -1);
-		if (n < 0) {
-			if (errno == EINTR)
-				pr_info("%s: exit from epoll_wait\n", __func__);
-			else
-				pr_err("%s: return from epoll wait with errno %d\r\n", __func__, errno);
-			break;
-		}
-		for (i = 0; i < n; i++) {
-			aevp = eventlist[i].data.ptr;
-			if (aevp && aevp->run) {
-				/* Mitigate the epoll_wait repeat cycles by reading out the events as more as possible.*/
+	n = epoll_wait(ioctx->epfd, eventlist, MEVENT_MAX, timeout);
+	if (n < 0) {
+		if (errno == EINTR)
+			pr_info("%s: exit from epoll_wait\n", __func__);
+		else
+			pr_err("%s: return from epoll wait with errno %d\r\n", __func__, errno);
+		return n;
+	}
+	for (i = 0; i < n; i++) {
+		aevp = eventlist[i].data.ptr;
+		if (aevp && aevp->run) {
+			/* Mitigate the epoll_wait repeat cycles by reading out the events as more as possible.*/
+			if (aevp->events == 0) {
 				do {
 					status = read(aevp->fd, buf, sizeof(buf));
 				} while (status == MAX_EVENT_NUM);
-				(*aevp->run)(aevp->arg);
 			}
+			(*aevp->run)(aevp->arg);
 		}
 	}
 
+	return n;
+}
+
+static uint64_t
+iothread_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * The pollers are called without ioctx->mtx held: their handlers take device
+ * locks which are held while iothread_add()/iothread_del() are called.
+ */
+static int
+iothread_get_pollers(struct iothread_ctx *ioctx, struct iothread_mevent **pollers,
+		unsigned int *gen)
+{
+	int n;
+
+	pthread_mutex_lock(&ioctx->mtx);
+	*gen = ioctx->pollers_gen;
+	n = ioctx->npollers;
+	memcpy(pollers, ioctx->pollers, n * sizeof(pollers[0]));
+	pthread_mutex_unlock(&ioctx->mtx);
+
+	return n;
+}
+
+static void
+iothread_busy_poll(struct iothread_ctx *ioctx)
+{
+	struct iothread_mevent *pollers[MEVENT_MAX];
+	uint64_t last_work;
+	unsigned int gen;
+	bool work;
+	int i, n;
+
+	n = iothread_get_pollers(ioctx, pollers, &gen);
+	if (n == 0)
+		return;
+
+	for (i = 0; i < n; i++)
+		(*pollers[i]->poll_notify)(pollers[i]->arg, false);
+
+	last_work = iothread_now_ns();
+	while (ioctx->started) {
+		work = (iothread_handle_events(ioctx, 0) > 0);
+		for (i = 0; i < n; i++)
+			work |= (*pollers[i]->poll)(pollers[i]->arg);
+
+		if (work)
+			last_work = iothread_now_ns();
+		else if (iothread_now_ns() - last_work > busy_poll_idle_ns)
+			break;
+		else
+			__builtin_ia32_pause();
+
+		/* pick up the pollers added or removed meanwhile */
+		if (__atomic_load_n(&ioctx->pollers_gen, __ATOMIC_ACQUIRE) != gen) {
+			for (i = 0; i < n; i++)
+				(*pollers[i]->poll_notify)(pollers[i]->arg, true);
+			n = iothread_get_pollers(ioctx, pollers, &gen);
+			for (i = 0; i < n; i++)
+				(*pollers[i]->poll_notify)(pollers[i]->arg, false);
+		}
+	}
+
+	/* work queued before the notifications are back on raises no kick */
+	for (i = 0; i < n; i++) {
+		(*pollers[i]->poll_notify)(pollers[i]->arg, true);
+		(*pollers[i]->poll)(pollers[i]->arg);
+	}
+}
+
+static void *
+io_thread(void *arg)
+{
+	struct iothread_ctx *ioctx = arg;
+
+	while(ioctx->started) {
+		if (iothread_handle_events(ioctx, -1) < 0)
+			break;
+		if (busy_poll_enabled)
+			iothread_busy_poll(ioctx);
+	}
+
 	return NULL;
 }
 
 static int
-iothread_start(void)
+iothread_start(struct iothread_ctx *ioctx)
 {
-	pthread_mutex_lock(&ioctx.mtx);
+	char tname[MAXCOMLEN + 1];
+
+	pthread_mutex_lock(&ioctx->mtx);
 
-	if (ioctx.started) {
-		pthread_mutex_unlock(&ioctx.mtx);
+	if (ioctx->started) {
+		pthread_mutex_unlock(&ioctx->mtx);
 		return 0;
 	}
 
-	if (pthread_create(&ioctx.tid, NULL, io_thread, NULL) != 0) {
-		pthread_mutex_unlock(&ioctx.mtx);
+	/* io_thread() checks started first thing */
+	ioctx->started = true;
+	if (pthread_create(&ioctx->tid, NULL, io_thread, ioctx) != 0) {
+		ioctx->started = false;
+		pthread_mutex_unlock(&ioctx->mtx);
 		pr_err("%s", "iothread create failed\r\n");
 		return -1;
 	}
-	ioctx.started = true;
-	pthread_setname_np(ioctx.tid, "iothread");
-	pthread_mutex_unlock(&ioctx.mtx);
-	pr_info("iothread started\n");
+	snprintf(tname, sizeof(tname), "iothread_%d", ioctx->idx);
+	pthread_setname_np(ioctx->tid, tname);
+	if (ioctx->pinned) {
+		if (pthread_setaffinity_np(ioctx->tid, sizeof(ioctx->cpuset), &ioctx->cpuset) != 0)
+			pr_err("%s: failed to set affinity of iothread %d\n",
+				__func__, ioctx->idx);
+	}
+	pthread_mutex_unlock(&ioctx->mtx);
+	pr_info("iothread %d started\n", ioctx->idx);
 	return 0;
 }
 
 int
-iothread_add(int fd, struct iothread_mevent *aevt)
+iothread_add(struct iothread_ctx *ioctx, int fd, struct iothread_mevent *aevt)
 {
 	struct epoll_event ee;
 	int ret;
+
+	if (ioctx == NULL)
+		ioctx = &ioctxes[0];
+
 	/* Create a epoll instance before the first fd is added.*/
-	ee.events = EPOLLIN;
+	ee.events = aevt->events ? aevt->events : EPOLLIN;
 	ee.data.ptr = aevt;
-	ret = epoll_ctl(ioctx.epfd, EPOLL_CTL_ADD, fd, &ee);
+	ret = epoll_ctl(ioctx->epfd, EPOLL_CTL_ADD, fd, &ee);
 	if (ret < 0) {
 		pr_err("%s: failed to add fd, error is %d\n",
 			__func__, errno);
 		return ret;
 	}
 
+	if (busy_poll_enabled && aevt->poll && aevt->poll_notify) {
+		pthread_mutex_lock(&ioctx->mtx);
+		if (ioctx->npollers < MEVENT_MAX) {
+			ioctx->pollers[ioctx->npollers++] = aevt;
+			ioctx->pollers_gen++;
+		}
+		pthread_mutex_unlock(&ioctx->mtx);
+	}
+
 	/* Start the iothread after the first fd is added.*/
-	ret = iothread_start();
+	ret = iothread_start(ioctx);
 	if (ret < 0) {
 		pr_err("%s: failed to start iothread thread\n",
 			__func__);
@@ -109,57 +248,275 @@ iothread_add(int fd, struct iothread_mevent *aevt)
 }
 
 int
-iothread_del(int fd)
+iothread_del(struct iothread_ctx *ioctx, int fd)
 {
-	int ret = 0;
+	int i, ret = 0;
+
+	if (ioctx == NULL)
+		ioctx = &ioctxes[0];
 
-	if (ioctx.epfd) {
-		ret = epoll_ctl(ioctx.epfd, EPOLL_CTL_DEL, fd, NULL);
+	if (ioctx->epfd > 0) {
+		ret = epoll_ctl(ioctx->epfd, EPOLL_CTL_DEL, fd, NULL);
 		if (ret < 0)
 			pr_err("%s: failed to delete fd from epoll fd, error is %d\n",
 				__func__, errno);
 	}
+
+	pthread_mutex_lock(&ioctx->mtx);
+	for (i = 0; i < ioctx->npollers; i++) {
+		if (ioctx->pollers[i]->fd == fd) {
+			ioctx->pollers[i] = ioctx->pollers[--ioctx->npollers];
+			ioctx->pollers_gen++;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ioctx->mtx);
+
 	return ret;
 }
 
-void
-iothread_deinit(void)
+/* Change the events an fd added by iothread_add() waits for to aevt->events */
+int
+iothread_mod(struct iothread_ctx *ioctx, int fd, struct iothread_mevent *aevt)
 {
-	void *jval;
+	struct epoll_event ee;
+	int ret;
 
-	if (ioctx.tid > 0) {
-		pthread_mutex_lock(&ioctx.mtx);
-		ioctx.started = false;
-		pthread_mutex_unlock(&ioctx.mtx);
-		pthread_kill(ioctx.tid, SIGCONT);
-		pthread_join(ioctx.tid, &jval);
-	}
-	if (ioctx.epfd > 0) {
-		close(ioctx.epfd);
-		ioctx.epfd = -1;
-	}
-	pthread_mutex_destroy(&ioctx.mtx);
-	pr_info("iothread stop\n");
+	if (ioctx == NULL)
+		ioctx = &ioctxes[0];
+
+	ee.events = aevt->events ? aevt->events : EPOLLIN;
+	ee.data.ptr = aevt;
+	ret = epoll_ctl(ioctx->epfd, EPOLL_CTL_MOD, fd, &ee);
+	if (ret < 0)
+		pr_err("%s: failed to modify fd, error is %d\n",
+			__func__, errno);
+
+	return ret;
 }
 
-int
-iothread_init(void)
+static int
+iothread_ctx_init(struct iothread_ctx *ioctx, int idx, const cpu_set_t *cpuset)
 {
 	pthread_mutexattr_t attr;
 
 	pthread_mutexattr_init(&attr);
 	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&ioctx.mtx, &attr);
+	pthread_mutex_init(&ioctx->mtx, &attr);
 	pthread_mutexattr_destroy(&attr);
 
-	ioctx.tid = 0;
-	ioctx.started = false;
-	ioctx.epfd = epoll_create1(0);
+	ioctx->idx = idx;
+	ioctx->tid = 0;
+	ioctx->started = false;
+	ioctx->npollers = 0;
+	ioctx->pinned = (cpuset != NULL);
+	if (cpuset)
+		ioctx->cpuset = *cpuset;
+	ioctx->epfd = epoll_create1(0);
 
-	if (ioctx.epfd < 0) {
+	if (ioctx->epfd < 0) {
 		pr_err("%s: failed to create epoll fd, error is %d\r\n",
 			__func__, errno);
+		pthread_mutex_destroy(&ioctx->mtx);
 		return -1;
 	}
 	return 0;
 }
+
+static void
+iothread_ctx_deinit(struct iothread_ctx *ioctx)
+{
+	void *jval;
+
+	if (ioctx->tid > 0) {
+		pthread_mutex_lock(&ioctx->mtx);
+		ioctx->started = false;
+		pthread_mutex_unlock(&ioctx->mtx);
+		pthread_kill(ioctx->tid, SIGCONT);
+		pthread_join(ioctx->tid, &jval);
+		ioctx->tid = 0;
+	}
+	if (ioctx->epfd > 0) {
+		close(ioctx->epfd);
+		ioctx->epfd = -1;
+	}
+	pthread_mutex_destroy(&ioctx->mtx);
+}
+
+/*
+ * Create a dedicated iothread, running on \p cpuset if not NULL. The thread
+ * itself is started when the first fd is added.
+ */
+struct iothread_ctx *
+iothread_create(const cpu_set_t *cpuset)
+{
+	struct iothread_ctx *ioctx = NULL;
+	int i;
+
+	pthread_mutex_lock(&ioctxes_mtx);
+	for (i = 0; i < IOTHREAD_NUM; i++) {
+		if (!ioctxes[i].in_use)
+			break;
+	}
+	if (i < IOTHREAD_NUM) {
+		if (iothread_ctx_init(&ioctxes[i], i, cpuset) == 0) {
+			ioctx = &ioctxes[i];
+			ioctx->in_use = true;
+		}
+	} else
+		pr_err("%s: no more than %d iothreads\n", __func__, IOTHREAD_NUM);
+	pthread_mutex_unlock(&ioctxes_mtx);
+
+	return ioctx;
+}
+
+/*
+ * Stop and free the iothreads iothread_parse_options() created for a device,
+ * once none of its fds is watched by them any more. The default iothread is
+ * left running.
+ */
+void
+iothread_release(struct iothreads_info *info)
+{
+	int i;
+
+	pthread_mutex_lock(&ioctxes_mtx);
+	for (i = 0; i < info->num; i++) {
+		if (info->ioctx_base[i] != &ioctxes[0] && info->ioctx_base[i]->in_use) {
+			iothread_ctx_deinit(info->ioctx_base[i]);
+			info->ioctx_base[i]->in_use = false;
+		}
+		info->ioctx_base[i] = NULL;
+	}
+	info->num = 0;
+	pthread_mutex_unlock(&ioctxes_mtx);
+}
+
+/*
+ * Parse the iothread option of a device:
+ *   iothread                   use the default iothread
+ *   iothread=<num>[@<cpus>]    create <num> iothreads for the device,
+ *                              <cpus> is a ':' separated list of Service VM
+ *                              CPUs the iothreads are pinned to round-robin
+ * The virtqueues of the device are spread over its iothreads.
+ */
+int
+iothread_parse_options(char *opt, struct iothreads_info *info)
+{
+	char *str, *tmp, *cp, *cpus;
+	int i, num, cpu, ncpus = 0;
+	int cpulist[CPU_SETSIZE];
+	cpu_set_t cpuset;
+	int ret = -1;
+
+	info->num = 0;
+	if (strcmp(opt, "iothread") == 0) {
+		info->ioctx_base[0] = &ioctxes[0];
+		info->num = 1;
+		return 0;
+	}
+
+	if (strncmp(opt, "iothread=", strlen("iothread=")) != 0)
+		return -1;
+
+	str = strdup(opt + strlen("iothread="));
+	if (!str)
+		return -1;
+
+	tmp = str;
+	cp = strsep(&tmp, "@");
+	cpus = tmp;
+	if (dm_strtoi(cp, NULL, 10, &num) || num < 1 || num > IOTHREADS_PER_DEV_MAX) {
+		pr_err("%s: the number of iothreads must be 1 to %d\n",
+			__func__, IOTHREADS_PER_DEV_MAX);
+		goto out;
+	}
+
+	while (cpus && (cp = strsep(&cpus, ":")) != NULL) {
+		if (dm_strtoi(cp, NULL, 10, &cpu) || cpu < 0 || cpu >= CPU_SETSIZE) {
+			pr_err("%s: invalid cpu %s\n", __func__, cp);
+			goto out;
+		}
+		cpulist[ncpus++] = cpu;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (ncpus > 0) {
+			CPU_ZERO(&cpuset);
+			CPU_SET(cpulist[i % ncpus], &cpuset);
+		}
+		info->ioctx_base[i] = iothread_create((ncpus > 0) ? &cpuset : NULL);
+		if (info->ioctx_base[i] == NULL)
+			goto out;
+		info->num++;
+	}
+	ret = 0;
+out:
+	if (ret < 0)
+		iothread_release(info);
+	free(str);
+	return ret;
+}
+
+/*
+ * --iothread_busy_poll <idle_us>[,<pcpu>]: busy-poll for up to idle_us
+ * (1 to 1000000) without work before sleeping, optionally pinning the
+ * default iothread to the given Service VM CPU.
+ */
+int
+acrn_parse_iothread_busy_poll(const char *opt)
+{
+	char *cp, *str, *tmp;
+	int idle_us, pcpu = -1;
+	int ret = -1;
+
+	str = strdup(opt);
+	if (!str)
+		return -1;
+
+	tmp = str;
+	cp = strsep(&tmp, ",");
+	if (dm_strtoi(cp, NULL, 10, &idle_us) || idle_us < 1 || idle_us > 1000000)
+		goto out;
+	if (tmp && (dm_strtoi(tmp, NULL, 10, &pcpu) || pcpu < 0 || pcpu >= CPU_SETSIZE))
+		goto out;
+
+	busy_poll_idle_ns = idle_us * 1000UL;
+	busy_poll_pcpu = pcpu;
+	busy_poll_enabled = true;
+	ret = 0;
+out:
+	free(str);
+	return ret;
+}
+
+void
+iothread_deinit(void)
+{
+	int i;
+
+	pthread_mutex_lock(&ioctxes_mtx);
+	for (i = 0; i < IOTHREAD_NUM; i++) {
+		if (ioctxes[i].in_use) {
+			iothread_ctx_deinit(&ioctxes[i]);
+			ioctxes[i].in_use = false;
+		}
+	}
+	pthread_mutex_unlock(&ioctxes_mtx);
+	pr_info("iothread stop\n");
+}
+
+int
+iothread_init(void)
+{
+	cpu_set_t cpuset;
+
+	if (busy_poll_enabled && busy_poll_pcpu >= 0) {
+		CPU_ZERO(&cpuset);
+		CPU_SET(busy_poll_pcpu, &cpuset);
+	}
+
+	/* the default iothread */
+	return (iothread_create((busy_poll_enabled && busy_poll_pcpu >= 0) ?
+			&cpuset : NULL) != NULL) ? 0 : -1;
+}
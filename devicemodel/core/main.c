@@ -58,6 +58,7 @@
 #include "version.h"
 #include "sw_load.h"
 #include "monitor.h"
+#include "metrics.h"
 #include "ioc.h"
 #include "pm.h"
 #include "atomic.h"
@@ -72,6 +73,10 @@
 #include "vdisplay.h"
 #include "iothread.h"
 #include "vm_event.h"
+#include "startup_timeline.h"
+#include "snapshot.h"
+#include "migration.h"
+#include "numa.h"
 
 #define	VM_MAXCPU		16	/* maximum virtual cpus */
 
@@ -102,12 +107,17 @@ bool vtpm2;
 bool is_winvm;
 bool skip_pci_mem64bar_workaround = false;
 bool gfx_ui = false;
+bool vnuma;
+char *mem_template;
 
 static int guest_ncpus;
 static int virtio_msix = 1;
 static bool debugexit_enabled;
 static int pm_notify_channel;
+static int exit_code;
 static bool cmd_monitor;
+static char *restore_file;
+static char *incoming_addr;
 
 static char *progname;
 static const int BSP;
@@ -153,9 +163,14 @@ usage(int code)
 		"       %*s [--enable_trusty] [--intr_monitor param_setting]\n"
 		"       %*s [--acpidev_pt HID] [--mmiodev_pt MMIO_Regions]\n"
 		"       %*s [--vtpm2 sock_path] [--virtio_poll interval]\n"
-		"       %*s [--cpu_affinity lapic_id] [--lapic_pt] [--rtvm] [--windows]\n"
+		"       %*s [--cpu_affinity lapic_id] [--vnuma] [--lapic_pt] [--rtvm] [--windows]\n"
 		"       %*s [--debugexit] [--logger_setting param_setting]\n"
-		"       %*s [--ssram] <vm>\n"
+		"       %*s [--ssram] [--ioreq_workers param_setting]\n"
+		"       %*s [--iothread_busy_poll param_setting] [--restore snapshot_file]\n"
+		"       %*s [--incoming [host:]port]\n"
+		"       %*s [--mem_template template_file]\n"
+		"       %*s [--virtio_intr_moderation max_events,max_usec]\n"
+		"       %*s [--metrics interval] <vm>\n"
 		"       -B: bootargs for kernel\n"
 		"       -E: elf image path\n"
 		"       -h: help\n"
@@ -170,6 +185,7 @@ usage(int code)
 		"       --ssram: Configure Software SRAM parameters\n"
 		"       --cpu_affinity: list of Service VM vCPUs assigned to this User VM, the vCPUs are"
 		"	     identified by their local APIC IDs.\n"
+		"       --vnuma: expose the host nodes of the vCPUs to the guest in its SRAT and SLIT\n"
 		"       --enable_trusty: enable trusty for guest\n"
 		"       --debugexit: enable debug exit function\n"
 		"       --intr_monitor: enable interrupt storm monitor\n"
@@ -177,6 +193,8 @@ usage(int code)
 		"       --cmd_monitor: enable command monitor\n"
 		"            its params: unix domain socket path\n"
 		"       --virtio_poll: enable virtio poll mode with poll interval with ns\n"
+		"       --virtio_intr_moderation: coalesce up to max_events virtqueue\n"
+		"            interrupts, holding them back for at most max_usec\n"
 		"       --acpidev_pt: ACPI device ID args: HID in ACPI Table\n"
 		"       --mmiodev_pt: MMIO resources args: physical MMIO regions\n"
 		"       --vtpm2: Virtual TPM2 args: sock_path=$PATH_OF_SWTPM_SOCKET\n"
@@ -185,12 +203,26 @@ usage(int code)
 		"       --logger_setting: params like console,level=4;kmsg,level=3\n"
 		"       --windows: support Oracle virtio-blk, virtio-net and virtio-input devices\n"
 		"            for windows guest with secure boot\n"
-		"       --virtio_msi: force virtio to use single-vector MSI\n",
+		"       --virtio_msi: force virtio to use single-vector MSI\n"
+		"       --ioreq_workers: emulate the I/O requests of the vCPUs in parallel\n"
+		"            its params: num[,pcpu,...], pcpus are the Service VM CPUs to pin the workers to\n"
+		"       --iothread_busy_poll: busy-poll the iothread virtqueues instead of waiting for kicks\n"
+		"            its params: idle_us[,pcpu], idle time before falling back to kicks,"
+		" Service VM CPU to pin the iothread to\n"
+		"       --restore: start the VM from a snapshot taken with \"acrnctl snapshot\"\n"
+		"       --incoming: start the VM migrated to [host:]port with \"acrnctl migrate\"\n"
+		"       --mem_template: share the memory restored from the snapshot with the other\n"
+		"            VMs restored with the same file on a 2M hugetlbfs, created if missing\n"
+		"       --metrics: snapshot the runtime metrics every interval seconds, for acrnd\n"
+		"            to serve them\n",
 		progname, (int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
 		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
 		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
 		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
-		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "");
+		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
+		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
+		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
+		(int)strnlen(progname, PATH_MAX), "");
 
 	exit(code);
 }
@@ -273,7 +305,9 @@ add_cpu(struct vmctx *ctx, int vcpu_num)
 		mt_vmm_info[i].mt_vcpu = i;
 	}
 
-	vm_set_vcpu_regs(ctx, &ctx->bsp_regs);
+	/* the vCPUs of a restored or migrated VM have their state already */
+	if (restore_file == NULL && incoming_addr == NULL)
+		vm_set_vcpu_regs(ctx, &ctx->bsp_regs);
 
 	error = pthread_create(&mt_vmm_info[0].mt_thr, NULL,
 	    start_thread, &mt_vmm_info[0]);
@@ -328,6 +362,19 @@ vmexit_inout(struct vmctx *ctx, struct acrn_io_request *io_req, int *pvcpu)
 	}
 }
 
+static void
+vmexit_inout_string(struct vmctx *ctx, struct acrn_io_request *io_req, int *pvcpu)
+{
+	struct acrn_pio_string_request *req = &io_req->reqs.pio_string_request;
+
+	if (emulate_inout_string(ctx, pvcpu, req)) {
+		pr_err("Unhandled %s%c 0x%04lx, %lu times\n",
+				(req->direction == ACRN_IOREQ_DIR_READ) ? "ins" : "outs",
+				req->size == 1 ? 'b' : (req->size == 2 ? 'w' : 'd'),
+				req->address, req->count);
+	}
+}
+
 static void
 vmexit_mmio_emul(struct vmctx *ctx, struct acrn_io_request *io_req, int *pvcpu)
 {
@@ -357,6 +404,8 @@ vmexit_pci_emul(struct vmctx *ctx, struct acrn_io_request *io_req, int *pvcpu)
 {
 	int err, in = (io_req->reqs.pci_request.direction == ACRN_IOREQ_DIR_READ);
 
+	/* config space writes may move BARs of any device */
+	ioreq_emul_lock(true);
 	err = emulate_pci_cfgrw(ctx, *pvcpu, in,
 			io_req->reqs.pci_request.bus,
 			io_req->reqs.pci_request.dev,
@@ -364,6 +413,7 @@ vmexit_pci_emul(struct vmctx *ctx, struct acrn_io_request *io_req, int *pvcpu)
 			io_req->reqs.pci_request.reg,
 			io_req->reqs.pci_request.size,
 			&io_req->reqs.pci_request.value);
+	ioreq_emul_unlock();
 	if (err) {
 		pr_err("Unhandled pci cfg rw at %x:%x.%x reg 0x%x\n",
 			io_req->reqs.pci_request.bus,
@@ -391,6 +441,8 @@ enum vm_exitcode {
 	VM_EXITCODE_INOUT = 0,
 	VM_EXITCODE_MMIO_EMUL,
 	VM_EXITCODE_PCI_CFG,
+	VM_EXITCODE_WP,
+	VM_EXITCODE_PIO_STRING,
 	VM_EXITCODE_MAX
 };
 
@@ -398,12 +450,55 @@ static vmexit_handler_t handler[VM_EXITCODE_MAX] = {
 	[VM_EXITCODE_INOUT]  = vmexit_inout,
 	[VM_EXITCODE_MMIO_EMUL] = vmexit_mmio_emul,
 	[VM_EXITCODE_PCI_CFG] = vmexit_pci_emul,
+	/* a write to write-protected guest RAM, e.g. shared with a memory template */
+	[VM_EXITCODE_WP] = vmexit_mmio_emul,
+	/* rep ins/outs, up to a page of them in one request */
+	[VM_EXITCODE_PIO_STRING] = vmexit_inout_string,
 };
 
-static void
+/*
+ * Counts the I/O requests handled by type, read by the monitor for DM_STATS
+ * while the vCPUs run.
+ */
+static uint64_t ioreq_stats[VM_EXITCODE_MAX];
+/* ns spent in the handlers, only with --metrics */
+static uint64_t ioreq_time[VM_EXITCODE_MAX];
+
+void
+dm_get_ioreq_stats(uint64_t *counts, int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++)
+		counts[i] = (i < VM_EXITCODE_MAX) ?
+			__atomic_load_n(&ioreq_stats[i], __ATOMIC_RELAXED) : 0;
+}
+
+void
+dm_get_ioreq_time(uint64_t *ns, int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++)
+		ns[i] = (i < VM_EXITCODE_MAX) ?
+			__atomic_load_n(&ioreq_time[i], __ATOMIC_RELAXED) : 0;
+}
+
+void
+dm_set_exit_code(int code)
+{
+	exit_code = code;
+}
+
+/*
+ * Returns true if the completion of io_req can be notified to the HSM/hypervisor
+ * right away, false if the notification has to be postponed.
+ */
+static bool
 handle_vmexit(struct vmctx *ctx, struct acrn_io_request *io_req, int vcpu)
 {
 	enum vm_exitcode exitcode;
+	struct timespec start, end;
 
 	exitcode = io_req->type;
 	if (exitcode >= VM_EXITCODE_MAX || handler[exitcode] == NULL) {
@@ -412,7 +507,18 @@ handle_vmexit(struct vmctx *ctx, struct acrn_io_request *io_req, int vcpu)
 		exit(1);
 	}
 
-	(*handler[exitcode])(ctx, io_req, &vcpu);
+	__atomic_add_fetch(&ioreq_stats[exitcode], 1, __ATOMIC_RELAXED);
+	/* the writes posted before this request come first */
+	drain_coalesced_mmio();
+	if (metrics_enabled) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		(*handler[exitcode])(ctx, io_req, &vcpu);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		__atomic_add_fetch(&ioreq_time[exitcode],
+			(end.tv_sec - start.tv_sec) * 1000000000UL + end.tv_nsec - start.tv_nsec,
+			__ATOMIC_RELAXED);
+	} else
+		(*handler[exitcode])(ctx, io_req, &vcpu);
 
 	/* We cannot notify the HSM/hypervisor on the request completion at this
 	 * point if the User VM is in suspend or system reset mode, as the VM is
@@ -423,9 +529,282 @@ handle_vmexit(struct vmctx *ctx, struct acrn_io_request *io_req, int vcpu)
 	 */
 	if ((VM_SUSPEND_SYSTEM_RESET == vm_get_suspend_mode()) ||
 		(VM_SUSPEND_SUSPEND == vm_get_suspend_mode()))
+		return false;
+
+	return true;
+}
+
+/*
+ * ioreq workers
+ *
+ * By default vm_loop() emulates the pending requests of all vCPUs one after
+ * another, so a slow emulation on one vCPU delays every other vCPU. With
+ * --ioreq_workers, vm_loop() only dispatches the requests and a pool of
+ * worker threads emulates them in parallel. The requests of one vCPU always
+ * go to the same worker (vcpu_id % ioreq_nworkers).
+ */
+#define IOREQ_WORKERS_MAX	8
+/* How long the dispatcher waits for a retirement if nothing new is pending */
+#define IOREQ_DISPATCH_WAIT_NS	20000
+
+struct ioreq_worker {
+	pthread_t	tid;
+	int		pcpu;		/* Service VM CPU to run on, -1 if not pinned */
+	struct vmctx	*ctx;
+	pthread_mutex_t	mtx;
+	pthread_cond_t	cond;
+	uint64_t	queued;		/* vCPUs whose requests are queued */
+};
+
+static int ioreq_nworkers;
+static struct ioreq_worker ioreq_workers[IOREQ_WORKERS_MAX];
+static bool ioreq_workers_exit;
+static pthread_rwlock_t ioreq_emul_rwlock;
+
+/* Protects the two fields below, ioreq_pool_cond signals a retirement */
+static pthread_mutex_t ioreq_pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ioreq_pool_cond = PTHREAD_COND_INITIALIZER;
+/* vCPUs whose requests are dispatched but not notified yet */
+static uint64_t ioreq_dispatched;
+/* number of requests dispatched but not emulated yet */
+static int ioreq_running;
+
+void
+ioreq_emul_lock(bool exclusive)
+{
+	if (ioreq_nworkers == 0)
 		return;
 
-	vm_notify_request_done(ctx, vcpu);
+	if (exclusive)
+		pthread_rwlock_wrlock(&ioreq_emul_rwlock);
+	else
+		pthread_rwlock_rdlock(&ioreq_emul_rwlock);
+}
+
+void
+ioreq_emul_unlock(void)
+{
+	if (ioreq_nworkers != 0)
+		pthread_rwlock_unlock(&ioreq_emul_rwlock);
+}
+
+/*
+ * --ioreq_workers <num>[,<pcpu>...]: the workers are pinned round-robin to
+ * the listed Service VM CPUs, or run unpinned if none is given.
+ */
+static int
+acrn_parse_ioreq_workers(char *opt)
+{
+	char *cp, *str, *tmp;
+	int i, num;
+	int pcpus[IOREQ_WORKERS_MAX];
+	int npcpus = 0;
+
+	str = strdup(opt);
+	if (!str) {
+		pr_err("%s: strdup returns NULL\n", __func__);
+		return -1;
+	}
+
+	tmp = str;
+	cp = strsep(&tmp, ",");
+	if (dm_strtoi(cp, NULL, 10, &num) || num < 1 || num > IOREQ_WORKERS_MAX) {
+		pr_err("%s: the number of workers must be 1 to %d\n",
+			__func__, IOREQ_WORKERS_MAX);
+		free(str);
+		return -1;
+	}
+
+	while ((cp = strsep(&tmp, ",")) != NULL) {
+		if (npcpus == IOREQ_WORKERS_MAX ||
+			dm_strtoi(cp, NULL, 10, &pcpus[npcpus]) ||
+			pcpus[npcpus] < 0 || pcpus[npcpus] >= CPU_SETSIZE) {
+			pr_err("%s: invalid pcpu %s\n", __func__, cp);
+			free(str);
+			return -1;
+		}
+		npcpus++;
+	}
+	free(str);
+
+	for (i = 0; i < num; i++)
+		ioreq_workers[i].pcpu = (npcpus > 0) ? pcpus[i % npcpus] : -1;
+	ioreq_nworkers = num;
+
+	return 0;
+}
+
+static void *
+ioreq_worker_thread(void *arg)
+{
+	struct ioreq_worker *worker = arg;
+	uint64_t queued, done;
+	int vcpu_id, nr;
+
+	while (1) {
+		pthread_mutex_lock(&worker->mtx);
+		while (worker->queued == 0UL && !ioreq_workers_exit)
+			pthread_cond_wait(&worker->cond, &worker->mtx);
+		queued = worker->queued;
+		worker->queued = 0UL;
+		pthread_mutex_unlock(&worker->mtx);
+
+		if (queued == 0UL)
+			break;
+
+		nr = __builtin_popcountll(queued);
+		done = 0UL;
+		for (vcpu_id = ffsll(queued) - 1; vcpu_id >= 0;
+				vcpu_id = ffsll(queued) - 1) {
+			queued &= ~(1UL << vcpu_id);
+			if (handle_vmexit(worker->ctx, &ioreq_buf[vcpu_id], vcpu_id))
+				done |= (1UL << vcpu_id);
+		}
+
+		if (done != 0UL)
+			vm_notify_request_done_batch(worker->ctx, done);
+
+		/*
+		 * The postponed requests stay dispatched until vm_loop() has
+		 * reset the ioreq states, so they are not handled twice.
+		 */
+		pthread_mutex_lock(&ioreq_pool_mtx);
+		ioreq_dispatched &= ~done;
+		ioreq_running -= nr;
+		pthread_cond_signal(&ioreq_pool_cond);
+		pthread_mutex_unlock(&ioreq_pool_mtx);
+	}
+
+	return NULL;
+}
+
+static int
+ioreq_workers_start(struct vmctx *ctx)
+{
+	pthread_rwlockattr_t attr;
+	struct ioreq_worker *worker;
+	char tname[MAXCOMLEN + 1];
+	cpu_set_t cpuset;
+	int i, ret;
+
+	/* A steady stream of BAR accesses must not starve config space accesses */
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+		PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&ioreq_emul_rwlock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	for (i = 0; i < ioreq_nworkers; i++) {
+		worker = &ioreq_workers[i];
+		worker->ctx = ctx;
+		worker->queued = 0UL;
+		pthread_mutex_init(&worker->mtx, NULL);
+		pthread_cond_init(&worker->cond, NULL);
+
+		ret = pthread_create(&worker->tid, NULL, ioreq_worker_thread, worker);
+		if (ret) {
+			pr_err("%s: failed to create worker %d, error %d\n",
+				__func__, i, ret);
+			return -1;
+		}
+
+		snprintf(tname, sizeof(tname), "ioreq-%d", i);
+		pthread_setname_np(worker->tid, tname);
+
+		if (worker->pcpu >= 0) {
+			CPU_ZERO(&cpuset);
+			CPU_SET(worker->pcpu, &cpuset);
+			ret = pthread_setaffinity_np(worker->tid, sizeof(cpuset), &cpuset);
+			if (ret)
+				pr_err("%s: failed to pin worker %d to pcpu %d, error %d\n",
+					__func__, i, worker->pcpu, ret);
+		}
+	}
+	pr_info("%d ioreq workers started\n", ioreq_nworkers);
+
+	return 0;
+}
+
+static void
+ioreq_workers_stop(void)
+{
+	int i;
+
+	for (i = 0; i < ioreq_nworkers; i++) {
+		pthread_mutex_lock(&ioreq_workers[i].mtx);
+		ioreq_workers_exit = true;
+		pthread_cond_signal(&ioreq_workers[i].cond);
+		pthread_mutex_unlock(&ioreq_workers[i].mtx);
+	}
+
+	for (i = 0; i < ioreq_nworkers; i++) {
+		if (ioreq_workers[i].tid)
+			pthread_join(ioreq_workers[i].tid, NULL);
+	}
+}
+
+/*
+ * Hand the new requests over to the workers
+ *
+ * vm_attach_ioreq_client() does not block while any request is still
+ * outstanding, so if nothing new is found wait a bit for a worker to retire
+ * one instead of spinning on the HSM.
+ */
+static void
+ioreq_dispatch(void)
+{
+	uint64_t queued[IOREQ_WORKERS_MAX] = { 0UL };
+	struct acrn_io_request *io_req;
+	struct timespec ts;
+	int i, vcpu_id, nr = 0;
+
+	pthread_mutex_lock(&ioreq_pool_mtx);
+	for (vcpu_id = 0; vcpu_id < guest_ncpus; vcpu_id++) {
+		io_req = &ioreq_buf[vcpu_id];
+		if ((atomic_load(&io_req->processed) == ACRN_IOREQ_STATE_PROCESSING)
+			&& !io_req->kernel_handled
+			&& !(ioreq_dispatched & (1UL << vcpu_id))) {
+			ioreq_dispatched |= (1UL << vcpu_id);
+			queued[vcpu_id % ioreq_nworkers] |= (1UL << vcpu_id);
+			nr++;
+		}
+	}
+	ioreq_running += nr;
+
+	if (nr == 0 && ioreq_dispatched != 0UL) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += IOREQ_DISPATCH_WAIT_NS;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&ioreq_pool_cond, &ioreq_pool_mtx, &ts);
+	}
+	pthread_mutex_unlock(&ioreq_pool_mtx);
+
+	for (i = 0; i < ioreq_nworkers; i++) {
+		if (queued[i] == 0UL)
+			continue;
+		pthread_mutex_lock(&ioreq_workers[i].mtx);
+		ioreq_workers[i].queued |= queued[i];
+		pthread_cond_signal(&ioreq_workers[i].cond);
+		pthread_mutex_unlock(&ioreq_workers[i].mtx);
+	}
+}
+
+/*
+ * Wait for the workers to finish all the dispatched requests, must be done
+ * before the ioreq states are reset or the VM is torn down.
+ */
+static void
+ioreq_workers_drain(bool reset)
+{
+	pthread_mutex_lock(&ioreq_pool_mtx);
+	while (ioreq_running != 0)
+		pthread_cond_wait(&ioreq_pool_cond, &ioreq_pool_mtx);
+	if (reset)
+		ioreq_dispatched = 0UL;
+	pthread_mutex_unlock(&ioreq_pool_mtx);
 }
 
 static int
@@ -507,6 +886,9 @@ vm_init_vdevs(struct vmctx *ctx)
 	if ((cmd_monitor) && init_cmd_monitor(ctx) < 0)
 		goto monitor_fail;
 
+	if (metrics_init(ctx, guest_ncpus) < 0)
+		goto monitor_fail;
+
 	ret = init_mmio_devs(ctx);
 	if (ret < 0)
 		goto mmio_dev_fail;
@@ -523,6 +905,7 @@ vm_init_vdevs(struct vmctx *ctx)
 pci_fail:
 	deinit_mmio_devs(ctx);
 mmio_dev_fail:
+	metrics_deinit();
 	monitor_close();
 ssram_fail:
 	if (ssram)
@@ -554,6 +937,7 @@ vm_deinit_vdevs(struct vmctx *ctx)
 	 */
 	acrn_writeback_ovmf_nvstorage(ctx);
 
+	metrics_deinit();
 	deinit_pci(ctx);
 	deinit_mmio_devs(ctx);
 	monitor_close();
@@ -670,6 +1054,7 @@ vm_system_reset(struct vmctx *ctx)
 	acrn_sw_load(ctx);
 	vm_set_vcpu_regs(ctx, &ctx->bsp_regs);
 	vm_run(ctx);
+	monitor_notify_state(VM_SUSPEND_NONE);
 }
 
 static void
@@ -689,6 +1074,7 @@ vm_suspend_resume(struct vmctx *ctx)
 
 	vm_clear_ioreq(ctx);
 	vm_stop_watchdog(ctx);
+	monitor_notify_state(VM_SUSPEND_SUSPEND);
 	wait_for_resume(ctx);
 
 	pm_backto_wakeup(ctx);
@@ -716,19 +1102,35 @@ vm_loop(struct vmctx *ctx)
 		return;
 	}
 
+	if (ioreq_nworkers > 0 && ioreq_workers_start(ctx) != 0) {
+		ioreq_workers_stop();
+		return;
+	}
+
 	while (1) {
 		int vcpu_id;
+		uint64_t done_bitmap = 0UL;
 		struct acrn_io_request *io_req;
 
 		error = vm_attach_ioreq_client(ctx);
 		if (error)
 			break;
 
-		for (vcpu_id = 0; vcpu_id < guest_ncpus; vcpu_id++) {
-			io_req = &ioreq_buf[vcpu_id];
-			if ((atomic_load(&io_req->processed) == ACRN_IOREQ_STATE_PROCESSING)
-				&& !io_req->kernel_handled)
-				handle_vmexit(ctx, io_req, vcpu_id);
+		if (ioreq_nworkers > 0) {
+			ioreq_dispatch();
+		} else {
+			for (vcpu_id = 0; vcpu_id < guest_ncpus; vcpu_id++) {
+				io_req = &ioreq_buf[vcpu_id];
+				if ((atomic_load(&io_req->processed) == ACRN_IOREQ_STATE_PROCESSING)
+					&& !io_req->kernel_handled) {
+					if (handle_vmexit(ctx, io_req, vcpu_id))
+						done_bitmap |= (1UL << vcpu_id);
+				}
+			}
+
+			/* Retire all the requests handled in this round with one notification */
+			if (done_bitmap != 0UL)
+				vm_notify_request_done_batch(ctx, done_bitmap);
 		}
 
 		if (VM_SUSPEND_FULL_RESET == vm_get_suspend_mode() ||
@@ -738,13 +1140,20 @@ vm_loop(struct vmctx *ctx)
 
 		/* RTVM can't be reset */
 		if ((VM_SUSPEND_SYSTEM_RESET == vm_get_suspend_mode()) && (!is_rtvm)) {
+			ioreq_workers_drain(true);
 			vm_system_reset(ctx);
 		}
 
 		if (VM_SUSPEND_SUSPEND == vm_get_suspend_mode()) {
+			ioreq_workers_drain(true);
 			vm_suspend_resume(ctx);
 		}
 	}
+
+	if (ioreq_nworkers > 0) {
+		ioreq_workers_drain(false);
+		ioreq_workers_stop();
+	}
 	pr_err("VM loop exit\n");
 }
 
@@ -774,6 +1183,7 @@ enum {
 	CMD_OPT_PART_INFO,
 	CMD_OPT_TRUSTY_ENABLE,
 	CMD_OPT_VIRTIO_POLL_ENABLE,
+	CMD_OPT_VIRTIO_INTR_MODERATION,
 	CMD_OPT_MAC_SEED,
 	CMD_OPT_DEBUGEXIT,
 	CMD_OPT_VMCFG,
@@ -784,6 +1194,7 @@ enum {
 	CMD_OPT_MMIODEV_PT,
 	CMD_OPT_VTPM2,
 	CMD_OPT_LAPIC_PT,
+	CMD_OPT_VNUMA,
 	CMD_OPT_RTVM,
 	CMD_OPT_SOFTWARE_SRAM,
 	CMD_OPT_LOGGER_SETTING,
@@ -791,6 +1202,12 @@ enum {
 	CMD_OPT_PM_BY_VUART,
 	CMD_OPT_WINDOWS,
 	CMD_OPT_FORCE_VIRTIO_MSI,
+	CMD_OPT_IOREQ_WORKERS,
+	CMD_OPT_IOTHREAD_BUSY_POLL,
+	CMD_OPT_RESTORE,
+	CMD_OPT_INCOMING,
+	CMD_OPT_MEM_TEMPLATE,
+	CMD_OPT_METRICS,
 };
 
 static struct option long_options[] = {
@@ -820,6 +1237,7 @@ static struct option long_options[] = {
 	{"enable_trusty",	no_argument,		0,
 					CMD_OPT_TRUSTY_ENABLE},
 	{"virtio_poll",		required_argument,	0, CMD_OPT_VIRTIO_POLL_ENABLE},
+	{"virtio_intr_moderation",	required_argument,	0, CMD_OPT_VIRTIO_INTR_MODERATION},
 	{"debugexit",		no_argument,		0, CMD_OPT_DEBUGEXIT},
 	{"intr_monitor",	required_argument,	0, CMD_OPT_INTR_MONITOR},
 	{"cmd_monitor",		required_argument,	0, CMD_OPT_CMD_MONITOR},
@@ -827,6 +1245,7 @@ static struct option long_options[] = {
 	{"mmiodev_pt",		required_argument,	0, CMD_OPT_MMIODEV_PT},
 	{"vtpm2",		required_argument,	0, CMD_OPT_VTPM2},
 	{"lapic_pt",		no_argument,		0, CMD_OPT_LAPIC_PT},
+	{"vnuma",		no_argument,		0, CMD_OPT_VNUMA},
 	{"rtvm",		no_argument,		0, CMD_OPT_RTVM},
 	{"ssram",		required_argument,	0, CMD_OPT_SOFTWARE_SRAM},
 	{"logger_setting",	required_argument,	0, CMD_OPT_LOGGER_SETTING},
@@ -834,6 +1253,12 @@ static struct option long_options[] = {
 	{"pm_by_vuart",	required_argument,	0, CMD_OPT_PM_BY_VUART},
 	{"windows",		no_argument,		0, CMD_OPT_WINDOWS},
 	{"virtio_msi",		no_argument,		0, CMD_OPT_FORCE_VIRTIO_MSI},
+	{"ioreq_workers",	required_argument,	0, CMD_OPT_IOREQ_WORKERS},
+	{"iothread_busy_poll",	required_argument,	0, CMD_OPT_IOTHREAD_BUSY_POLL},
+	{"restore",		required_argument,	0, CMD_OPT_RESTORE},
+	{"incoming",		required_argument,	0, CMD_OPT_INCOMING},
+	{"mem_template",	required_argument,	0, CMD_OPT_MEM_TEMPLATE},
+	{"metrics",		required_argument,	0, CMD_OPT_METRICS},
 	{0,			0,			0,  0  },
 };
 
@@ -865,6 +1290,7 @@ main(int argc, char *argv[])
 	size_t memsize;
 	int option_idx = 0;
 
+	startup_phase_begin(STARTUP_DM_INIT);
 	progname = basename(argv[0]);
 	memsize = 256 * MB;
 	mptgen = 1;
@@ -973,6 +1399,13 @@ main(int argc, char *argv[])
 					optarg);
 			}
 			break;
+		case CMD_OPT_VIRTIO_INTR_MODERATION:
+			if (acrn_parse_virtio_intr_moderation(optarg) != 0) {
+				errx(EX_USAGE,
+					"invalid virtio interrupt moderation %s",
+					optarg);
+			}
+			break;
 		case CMD_OPT_MAC_SEED:
 			pr_warn("The \"--mac_seed\" parameter is obsolete\n");
 			pr_warn("Please use the \"virtio-net,<device_type>=<name> mac_seed=<seed_string>\"\n");
@@ -983,6 +1416,9 @@ main(int argc, char *argv[])
 		case CMD_OPT_LAPIC_PT:
 			lapic_pt = true;
 			break;
+		case CMD_OPT_VNUMA:
+			vnuma = true;
+			break;
 		case CMD_OPT_RTVM:
 			is_rtvm = true;
 			lapic_pt = true;
@@ -1009,6 +1445,10 @@ main(int argc, char *argv[])
 			if (acrn_parse_intr_monitor(optarg) != 0)
 				errx(EX_USAGE, "invalid intr-monitor params %s", optarg);
 			break;
+		case CMD_OPT_METRICS:
+			if (acrn_parse_metrics(optarg) != 0)
+				errx(EX_USAGE, "invalid metrics interval %s", optarg);
+			break;
 		case CMD_OPT_CMD_MONITOR:
 			if (acrn_parse_cmd_monitor(optarg) != 0)
 				errx(EX_USAGE, "invalid command monitor params %s", optarg);
@@ -1044,6 +1484,23 @@ main(int argc, char *argv[])
 		case CMD_OPT_FORCE_VIRTIO_MSI:
 			virtio_msix = 0;
 			break;
+		case CMD_OPT_IOREQ_WORKERS:
+			if (acrn_parse_ioreq_workers(optarg) != 0)
+				errx(EX_USAGE, "invalid ioreq workers params %s", optarg);
+			break;
+		case CMD_OPT_IOTHREAD_BUSY_POLL:
+			if (acrn_parse_iothread_busy_poll(optarg) != 0)
+				errx(EX_USAGE, "invalid iothread busy poll params %s", optarg);
+			break;
+		case CMD_OPT_RESTORE:
+			restore_file = optarg;
+			break;
+		case CMD_OPT_INCOMING:
+			incoming_addr = optarg;
+			break;
+		case CMD_OPT_MEM_TEMPLATE:
+			mem_template = optarg;
+			break;
 		case 'h':
 			usage(0);
 		default:
@@ -1071,6 +1528,16 @@ main(int argc, char *argv[])
 		usage(1);
         }
 
+	if (mem_template != NULL && restore_file == NULL) {
+		pr_err("A memory template is populated from a snapshot, '--mem_template' needs '--restore'.\n");
+		exit(1);
+	}
+
+	if (restore_file != NULL && incoming_addr != NULL) {
+		pr_err("A VM starts from a snapshot or from a migration, not both.\n");
+		exit(1);
+	}
+
 	if (lapic_pt == true && is_rtvm == false) {
 		lapic_pt = false;
 		pr_warn("Only a Realtime VM can use local APIC pass through, '--lapic_pt' is invalid here.\n");
@@ -1095,12 +1562,15 @@ main(int argc, char *argv[])
 	}
 
 	for (;;) {
+		startup_phase_end(STARTUP_DM_INIT);
 		pr_notice("vm_create: %s\n", vmname);
+		startup_phase_begin(STARTUP_VM_CREATE);
 		ctx = vm_create(vmname, (unsigned long)ioreq_buf, &guest_ncpus);
 		if (!ctx) {
 			pr_err("vm_create failed");
 			goto create_fail;
 		}
+		startup_phase_end(STARTUP_VM_CREATE);
 
 		if (guest_ncpus < 1) {
 			pr_err("Invalid guest vCPUs (%d)\n", guest_ncpus);
@@ -1120,12 +1590,24 @@ main(int argc, char *argv[])
 			pr_warn("ASYNIO capability is not supported by kernel or hyperviosr!\n");
 		}
 
+		error = init_coalesced_mmio(ctx);
+		if (error) {
+			pr_warn("Coalesced MMIO is not supported by kernel or hypervisor!\n");
+		}
+
+		if (numa_init(guest_ncpus) != 0) {
+			pr_err("Unable to place the guest memory on the host nodes\n");
+			goto fail;
+		}
+
 		pr_notice("vm_setup_memory: size=0x%lx\n", memsize);
+		startup_phase_begin(STARTUP_SETUP_MEMORY);
 		error = vm_setup_memory(ctx, memsize);
 		if (error) {
 			pr_err("Unable to setup memory (%d)\n", errno);
 			goto fail;
 		}
+		startup_phase_end(STARTUP_SETUP_MEMORY);
 
 		error = mevent_init();
 		if (error) {
@@ -1140,10 +1622,12 @@ main(int argc, char *argv[])
 		}
 
 		pr_notice("vm_init_vdevs\n");
+		startup_phase_begin(STARTUP_INIT_VDEVS);
 		if (vm_init_vdevs(ctx) < 0) {
 			pr_err("Unable to init vdev (%d)\n", errno);
 			goto dev_fail;
 		}
+		startup_phase_end(STARTUP_INIT_VDEVS);
 
 		pr_notice("vm setup vm event\n");
 		error = vm_event_init(ctx);
@@ -1151,9 +1635,33 @@ main(int argc, char *argv[])
 			pr_warn("VM_EVENT is not supported by kernel or hyperviosr!\n");
 		}
 
+		/*
+		 * A restored VM has its tables and its software in the memory
+		 * read back from the snapshot.
+		 */
+		if (restore_file != NULL) {
+			pr_notice("vm_restore\n");
+			if (vm_restore(ctx, restore_file) != 0) {
+				pr_err("vm_restore from %s failed\n", restore_file);
+				goto vm_fail;
+			}
+			goto add_cpu;
+		}
+
+		/* so has a VM migrated from another host */
+		if (incoming_addr != NULL) {
+			pr_notice("vm_incoming\n");
+			if (vm_incoming(ctx, incoming_addr) != 0) {
+				pr_err("vm_incoming on %s failed\n", incoming_addr);
+				goto vm_fail;
+			}
+			goto add_cpu;
+		}
+
 		/*
 		 * build the guest tables, MP etc.
 		 */
+		startup_phase_begin(STARTUP_BUILD_TABLES);
 		if (mptgen) {
 			error = mptable_build(ctx, guest_ncpus);
 			if (error) {
@@ -1166,28 +1674,40 @@ main(int argc, char *argv[])
 			pr_err("acpi_build failed, error=%d\n", error);
 			goto vm_fail;
 		}
+		startup_phase_end(STARTUP_BUILD_TABLES);
 
 		pr_notice("acrn_sw_load\n");
+		startup_phase_begin(STARTUP_SW_LOAD);
 		error = acrn_sw_load(ctx);
 		if (error) {
 			pr_err("acrn_sw_load failed, error=%d\n", error);
 			goto vm_fail;
 		}
+		startup_phase_end(STARTUP_SW_LOAD);
 
 		/*
 		 * Change the proc title to include the VM name.
 		 */
 		/*setproctitle("%s", vmname);*/
 
+add_cpu:
 		/*
 		 * Add CPU 0
 		 */
 		pr_notice("add_cpu\n");
+		startup_phase_begin(STARTUP_ADD_CPU);
 		error = add_cpu(ctx, guest_ncpus);
 		if (error) {
 			pr_err("add_cpu failed, error=%d\n", error);
 			goto vm_fail;
 		}
+		startup_phase_end(STARTUP_ADD_CPU);
+		startup_timeline_log();
+
+		/* a reset of the VM boots it from its software again, in private memory */
+		restore_file = NULL;
+		incoming_addr = NULL;
+		mem_template = NULL;
 
 		/* Make a copy for ctx */
 		_ctx = ctx;
@@ -1201,7 +1721,7 @@ main(int argc, char *argv[])
 		delete_cpu(ctx, BSP);
 
 		if (vm_get_suspend_mode() != VM_SUSPEND_FULL_RESET){
-			ret = 0;
+			ret = exit_code;
 			break;
 		}
 
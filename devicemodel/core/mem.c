@@ -30,6 +30,13 @@
  * Memory ranges are represented with an RB tree. On insertion, the range
  * is checked for overlaps. On lookup, the key has the same base and limit
  * so it can be searched within the range.
+ *
+ * The MMIO dispatch does not look up the trees: each (un)registration
+ * publishes an immutable snapshot of the tree, an array of its ranges
+ * sorted by base, which the lookups binary search without any lock. A
+ * replaced snapshot, and an unregistered range, is freed once no lookup
+ * can still see it: each thread looking up announces it in a sequence
+ * count of its own, which is odd while it is in mem_lookup().
  */
 
 #include <errno.h>
@@ -37,9 +44,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 
+#include "dm.h"
 #include "mem.h"
 #include "tree.h"
+#include "io_hotspot.h"
+#include "sbuf.h"
+#include "vmmapi.h"
+#include "log.h"
 
 #define MEMNAMESZ (80)
 
@@ -53,14 +66,35 @@ struct mmio_rb_range {
 static RB_HEAD(mmio_rb_tree, mmio_rb_range) mmio_rb_root, mmio_rb_fallback;
 RB_PROTOTYPE_STATIC(mmio_rb_tree, mmio_rb_range, mr_link, mmio_rb_range_compare);
 
+struct mmio_snapshot {
+	uint64_t		gen;
+	int			nr;
+	struct mmio_rb_range	*ranges[];
+};
+
+/* the snapshots of mmio_rb_root and mmio_rb_fallback */
+static struct mmio_snapshot *mmio_snap, *mmio_snap_fallback;
+static uint64_t mmio_snap_gen;
+
+struct mmio_reader {
+	uint64_t		seq;		/* odd while in mem_lookup() */
+	struct mmio_reader	*next;
+} __aligned(64);
+
+static struct mmio_reader *mmio_readers;
+static __thread struct mmio_reader *mmio_reader_self;
+
 /*
- * Per-VM cache. Since most accesses from a vCPU will be to
+ * Per-thread cache. Since most accesses from a vCPU will be to
  * consecutive addresses in a range, it makes sense to cache the
- * result of a lookup.
+ * result of a lookup. It is valid for the snapshot of generation
+ * mmio_hint_gen only.
  */
-static struct mmio_rb_range	*mmio_hint __aligned(sizeof(struct mmio_rb_range *));
+static __thread uint64_t mmio_hint_gen;
+static __thread int mmio_hint_idx;
 
-static pthread_rwlock_t mmio_rwlock;
+/* serializes the updates of the trees, the snapshots and mmio_readers */
+static pthread_mutex_t mmio_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 static int
 mmio_rb_range_compare(struct mmio_rb_range *a, struct mmio_rb_range *b)
@@ -116,17 +150,128 @@ mmio_rb_dump(struct mmio_rb_tree *rbt)
 {
 	struct mmio_rb_range *np;
 
-	pthread_rwlock_rdlock(&mmio_rwlock);
+	pthread_mutex_lock(&mmio_mtx);
 	RB_FOREACH(np, mmio_rb_tree, rbt) {
 		pr_dbg(" %lx:%lx, %s\n", np->mr_base, np->mr_end,
 		       np->mr_param.name);
 	}
-	pthread_rwlock_unlock(&mmio_rwlock);
+	pthread_mutex_unlock(&mmio_mtx);
 }
 #endif
 
 RB_GENERATE_STATIC(mmio_rb_tree, mmio_rb_range, mr_link, mmio_rb_range_compare);
 
+/*
+ * Wait until no thread is in a mem_lookup() which may have seen a snapshot
+ * replaced before the call.
+ */
+static void
+mmio_synchronize(void)
+{
+	struct mmio_reader *r;
+	uint64_t seq;
+
+	/* the replacement is visible before the sequence counts are read */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (r = __atomic_load_n(&mmio_readers, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+		seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1UL) == 0UL)
+			continue;
+		while (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) == seq)
+			sched_yield();
+	}
+}
+
+/*
+ * Replace the snapshot of rbt by a new one, the old snapshot is returned to
+ * be freed after mmio_synchronize().
+ *
+ * @pre mmio_mtx is held
+ */
+static struct mmio_snapshot *
+mmio_publish(struct mmio_rb_tree *rbt, struct mmio_snapshot *snap)
+{
+	struct mmio_snapshot **slot;
+	struct mmio_snapshot *old;
+	struct mmio_rb_range *np;
+	int nr = 0;
+
+	slot = (rbt == &mmio_rb_root) ? &mmio_snap : &mmio_snap_fallback;
+	RB_FOREACH(np, mmio_rb_tree, rbt) {
+		snap->ranges[nr++] = np;
+	}
+	snap->nr = nr;
+	snap->gen = ++mmio_snap_gen;
+
+	old = *slot;
+	__atomic_store_n(slot, snap, __ATOMIC_RELEASE);
+
+	return old;
+}
+
+/*
+ * Allocate a snapshot for rbt after nr_delta ranges are added to it.
+ *
+ * @pre mmio_mtx is held
+ */
+static struct mmio_snapshot *
+mmio_snapshot_alloc(struct mmio_rb_tree *rbt, int nr_delta)
+{
+	struct mmio_rb_range *np;
+	int nr = nr_delta;
+
+	RB_FOREACH(np, mmio_rb_tree, rbt) {
+		nr++;
+	}
+
+	return malloc(sizeof(struct mmio_snapshot) + nr * sizeof(struct mmio_rb_range *));
+}
+
+static struct mmio_reader *
+mmio_reader_register(void)
+{
+	struct mmio_reader *r;
+
+	r = calloc(1, sizeof(struct mmio_reader));
+	if (r != NULL) {
+		pthread_mutex_lock(&mmio_mtx);
+		r->next = mmio_readers;
+		__atomic_store_n(&mmio_readers, r, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&mmio_mtx);
+	}
+
+	return r;
+}
+
+/*
+ * @return the index of the range of snap containing paddr, -1 if none
+ */
+static int
+mmio_snapshot_find(const struct mmio_snapshot *snap, uint64_t paddr)
+{
+	int lo = 0, hi, mid, idx = -1;
+
+	if (snap == NULL)
+		return -1;
+
+	/* the last range with a base not above paddr */
+	hi = snap->nr - 1;
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		if (snap->ranges[mid]->mr_base <= paddr) {
+			idx = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	if ((idx >= 0) && (paddr > snap->ranges[idx]->mr_end))
+		idx = -1;
+
+	return idx;
+}
+
 static int
 mem_read(void *ctx, int vcpu, uint64_t gpa, uint64_t *rval, int size, void *arg)
 {
@@ -149,50 +294,184 @@ mem_write(void *ctx, int vcpu, uint64_t gpa, uint64_t wval, int size, void *arg)
 	return error;
 }
 
+static int
+mem_lookup(uint64_t paddr, struct mmio_rb_range **entry)
+{
+	struct mmio_reader *self = mmio_reader_self;
+	const struct mmio_snapshot *snap;
+	struct mmio_rb_range *hint;
+	int idx, err = 0;
+
+	if (self == NULL) {
+		self = mmio_reader_register();
+		if (self == NULL)
+			return -ENOMEM;
+		mmio_reader_self = self;
+	}
+
+	__atomic_store_n(&self->seq, self->seq + 1UL, __ATOMIC_RELAXED);
+	/* the sequence count is odd before the snapshots are read */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	snap = __atomic_load_n(&mmio_snap, __ATOMIC_ACQUIRE);
+
+	/*
+	 * First check the per-thread cache
+	 */
+	hint = NULL;
+	if ((snap != NULL) && (snap->gen == mmio_hint_gen))
+		hint = snap->ranges[mmio_hint_idx];
+
+	if (hint && paddr >= hint->mr_base && paddr <= hint->mr_end) {
+		*entry = hint;
+	} else {
+		idx = mmio_snapshot_find(snap, paddr);
+		if (idx >= 0) {
+			*entry = snap->ranges[idx];
+			/* Update the per-thread cache */
+			mmio_hint_gen = snap->gen;
+			mmio_hint_idx = idx;
+		} else {
+			snap = __atomic_load_n(&mmio_snap_fallback, __ATOMIC_ACQUIRE);
+			idx = mmio_snapshot_find(snap, paddr);
+			if (idx >= 0)
+				*entry = snap->ranges[idx];
+			else
+				err = -ESRCH;
+		}
+	}
+
+	__atomic_store_n(&self->seq, self->seq + 1UL, __ATOMIC_RELEASE);
+
+	return err;
+}
+
 int
 emulate_mem(struct vmctx *ctx, struct acrn_mmio_request *mmio_req)
 {
 	uint64_t paddr = mmio_req->address;
 	int size = mmio_req->size;
-	struct mmio_rb_range *hint, *entry = NULL;
+	struct mmio_rb_range *entry = NULL;
 	int err;
 
-	pthread_rwlock_rdlock(&mmio_rwlock);
-
 	/*
-	 * First check the per-VM cache
+	 * The emulation lock also keeps the entry from being unregistered
+	 * (by a PCI BAR reprogramming, which is emulated exclusively) while
+	 * it is in use.
 	 */
-	hint = mmio_hint;
-
-	if (hint && paddr >= hint->mr_base && paddr <= hint->mr_end)
-		entry = hint;
-	else if (mmio_rb_lookup(&mmio_rb_root, paddr, &entry) == 0)
-		/* Update the per-VM cache */
-		mmio_hint = entry;
-	else if (mmio_rb_lookup(&mmio_rb_fallback, paddr, &entry)) {
-		pthread_rwlock_unlock(&mmio_rwlock);
-		return -ESRCH;
+	ioreq_emul_lock(false);
+	err = mem_lookup(paddr, &entry);
+	if ((err == 0) && (entry != NULL) &&
+		((entry->mr_param.flags & MEM_F_MT_SAFE) == 0)) {
+		ioreq_emul_unlock();
+		ioreq_emul_lock(true);
+		entry = NULL;
+		err = mem_lookup(paddr, &entry);
 	}
 
-	pthread_rwlock_unlock(&mmio_rwlock);
+	if (err == 0) {
+		if (entry == NULL)
+			err = -EINVAL;
+		else if (mmio_req->direction == ACRN_IOREQ_DIR_READ)
+			err = mem_read(ctx, 0, paddr, (uint64_t *)&mmio_req->value,
+					size, &entry->mr_param);
+		else
+			err = mem_write(ctx, 0, paddr, mmio_req->value,
+					size, &entry->mr_param);
+	}
+	/* the entry, and its name, stays until the unlock */
+	if (io_hotspot_sample_due())
+		io_hotspot_sample(IO_HOTSPOT_MMIO, paddr, (entry != NULL) ? entry->mr_param.name : NULL);
+	ioreq_emul_unlock();
+
+	return err;
+}
+
+/*
+ * The ring of the coalesced MMIO writes. drain_coalesced_mmio() emulates
+ * them: before any I/O request, so they are seen in order with the accesses
+ * of the guest after them, and by the readers of the state they update.
+ */
+static char cmmio_page[4096] __aligned(4096);
+static struct shared_buf *cmmio_sbuf;
+static struct vmctx *cmmio_ctx;
+static pthread_mutex_t cmmio_mtx = PTHREAD_MUTEX_INITIALIZER;
 
-	if (entry == NULL)
-		return -EINVAL;
+int
+init_coalesced_mmio(struct vmctx *ctx)
+{
+	struct shared_buf *sbuf = (struct shared_buf *)cmmio_page;
 
-	if (mmio_req->direction == ACRN_IOREQ_DIR_READ)
-		err = mem_read(ctx, 0, paddr, (uint64_t *)&mmio_req->value,
-				size, &entry->mr_param);
-	else
-		err = mem_write(ctx, 0, paddr, mmio_req->value,
-				size, &entry->mr_param);
+	cmmio_sbuf = NULL;
+	sbuf_init(sbuf, sizeof(cmmio_page), sizeof(struct acrn_coalesced_mmio_entry));
+	if (vm_setup_coalesced_mmio(ctx, (uint64_t)sbuf) != 0)
+		return -1;
 
-	return err;
+	cmmio_ctx = ctx;
+	cmmio_sbuf = sbuf;
+	return 0;
+}
+
+/* Without the ring the writes to the zone stay synchronous, this is no error */
+int
+register_coalesced_mmio(uint64_t addr, uint32_t len)
+{
+	if (cmmio_sbuf == NULL)
+		return 0;
+
+	return vm_add_coalesced_mmio(cmmio_ctx, addr, len);
+}
+
+int
+unregister_coalesced_mmio(uint64_t addr, uint32_t len)
+{
+	int error;
+
+	if (cmmio_sbuf == NULL)
+		return 0;
+
+	error = vm_remove_coalesced_mmio(cmmio_ctx, addr, len);
+	/* the writes posted so far are for the handler still registered */
+	drain_coalesced_mmio();
+	return error;
+}
+
+void
+drain_coalesced_mmio(void)
+{
+	struct acrn_coalesced_mmio_entry *entry;
+	struct acrn_mmio_request req;
+	struct sbuf_span span[2];
+	uint32_t len, off;
+	int s;
+
+	if ((cmmio_sbuf == NULL) || sbuf_is_empty(cmmio_sbuf))
+		return;
+
+	pthread_mutex_lock(&cmmio_mtx);
+	while ((len = sbuf_peek(cmmio_sbuf, span)) != 0) {
+		for (s = 0; s < 2; s++) {
+			for (off = 0; off < span[s].len; off += sizeof(*entry)) {
+				entry = (struct acrn_coalesced_mmio_entry *)((char *)span[s].data + off);
+				memset(&req, 0, sizeof(req));
+				req.direction = ACRN_IOREQ_DIR_WRITE;
+				req.address = entry->addr;
+				req.size = entry->size;
+				req.value = entry->value;
+				if (emulate_mem(cmmio_ctx, &req) != 0)
+					pr_err("Failed to emulate the coalesced write to 0x%lx\n", entry->addr);
+			}
+		}
+		sbuf_commit(cmmio_sbuf, len);
+	}
+	pthread_mutex_unlock(&cmmio_mtx);
 }
 
 static int
 register_mem_int(struct mmio_rb_tree *rbt, struct mem_range *memp)
 {
 	struct mmio_rb_range *entry, *mrp;
+	struct mmio_snapshot *snap, *old = NULL;
 	int err;
 
 	err = -1;
@@ -203,12 +482,20 @@ register_mem_int(struct mmio_rb_tree *rbt, struct mem_range *memp)
 		mrp->mr_param = *memp;
 		mrp->mr_base = memp->base;
 		mrp->mr_end = memp->base + memp->size - 1;
-		pthread_rwlock_wrlock(&mmio_rwlock);
-		if (mmio_rb_lookup(rbt, memp->base, &entry) != 0)
+		pthread_mutex_lock(&mmio_mtx);
+		snap = mmio_snapshot_alloc(rbt, 1);
+		if ((snap != NULL) && (mmio_rb_lookup(rbt, memp->base, &entry) != 0))
 			err = mmio_rb_add(rbt, mrp);
-		pthread_rwlock_unlock(&mmio_rwlock);
-		if (err)
+		if (err == 0)
+			old = mmio_publish(rbt, snap);
+		pthread_mutex_unlock(&mmio_mtx);
+		if (err) {
+			free(snap);
 			free(mrp);
+		} else if (old != NULL) {
+			mmio_synchronize();
+			free(old);
+		}
 	}
 
 	return err;
@@ -231,27 +518,32 @@ unregister_mem_int(struct mmio_rb_tree *rbt, struct mem_range *memp)
 {
 	struct mem_range *mr;
 	struct mmio_rb_range *entry = NULL;
+	struct mmio_snapshot *snap, *old = NULL;
 	int err;
 
-	pthread_rwlock_wrlock(&mmio_rwlock);
+	pthread_mutex_lock(&mmio_mtx);
 	err = mmio_rb_lookup(rbt, memp->base, &entry);
 	if (err == 0) {
 		mr = &entry->mr_param;
+		snap = mmio_snapshot_alloc(rbt, -1);
 		if (strncmp(mr->name, memp->name, MEMNAMESZ)
 			|| (mr->base != memp->base) || (mr->size != memp->size)
-			|| ((mr->flags & MEM_F_IMMUTABLE) != 0)) {
+			|| ((mr->flags & MEM_F_IMMUTABLE) != 0) || (snap == NULL)) {
+			free(snap);
 			err = -1;
 		} else {
 			RB_REMOVE(mmio_rb_tree, rbt, entry);
-
-			/* flush Per-VM cache */
-			if (mmio_hint == entry)
-				mmio_hint = NULL;
-
-			free(entry);
+			/* the per-thread caches are of the old snapshot */
+			old = mmio_publish(rbt, snap);
 		}
 	}
-	pthread_rwlock_unlock(&mmio_rwlock);
+	pthread_mutex_unlock(&mmio_mtx);
+
+	if (err == 0) {
+		mmio_synchronize();
+		free(old);
+		free(entry);
+	}
 
 	return err;
 }
@@ -273,5 +565,4 @@ init_mem(void)
 {
 	RB_INIT(&mmio_rb_root);
 	RB_INIT(&mmio_rb_fallback);
-	pthread_rwlock_init(&mmio_rwlock, NULL);
 }
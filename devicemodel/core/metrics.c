@@ -0,0 +1,352 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Every --metrics seconds the metrics thread takes a snapshot of the
+ * counters of the device model, of its devices and of the vCPUs in the
+ * hypervisor, and writes it in the Prometheus text format to
+ * METRICS_PATH/[vmname].prom, replaced with a rename. acrnd serves the
+ * snapshots of all the VMs; /run being a tmpfs, a scrape costs no
+ * hypercall and does not wake the device model up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include "dm.h"
+#include "dm_string.h"
+#include "types.h"
+#include "mevent.h"
+#include "vmmapi.h"
+#include "acrn_mngr.h"
+#include "metrics.h"
+#include "log.h"
+
+#define METRICS_LABELS_LEN	96
+#define METRICS_INTERVAL_MAX	3600U
+
+struct metric_sample {
+	const char *name;
+	const char *type;
+	const char *help;
+	char labels[METRICS_LABELS_LEN];
+	uint64_t value;
+	int seq;		/* keeps the order of the samples of a metric */
+};
+
+struct metrics_out {
+	struct metric_sample *samples;
+	int num;
+	int max;
+};
+
+struct metrics_src {
+	void (*fn)(struct metrics_out *mo, void *arg);
+	void *arg;
+	LIST_ENTRY(metrics_src) list;
+};
+
+bool metrics_enabled;
+
+static unsigned int metrics_interval;
+static LIST_HEAD(, metrics_src) metrics_srcs = LIST_HEAD_INITIALIZER(metrics_srcs);
+static pthread_mutex_t metrics_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t metrics_cond = PTHREAD_COND_INITIALIZER;
+static bool metrics_stop;
+static pthread_t metrics_tid;
+static struct vmctx *metrics_ctx;
+static int metrics_ncpus;
+static char metrics_file[PATH_MAX];
+
+void
+metrics_add(struct metrics_out *mo, const char *name, const char *type,
+		const char *help, uint64_t value, const char *labels, ...)
+{
+	struct metric_sample *s;
+	va_list ap;
+	int n;
+
+	if (mo->num == mo->max) {
+		n = mo->max ? mo->max * 2 : 64;
+		s = realloc(mo->samples, n * sizeof(*s));
+		if (s == NULL)
+			return;
+		mo->samples = s;
+		mo->max = n;
+	}
+
+	s = &mo->samples[mo->num];
+	s->name = name;
+	s->type = type;
+	s->help = help;
+	s->value = value;
+	s->seq = mo->num;
+
+	n = snprintf(s->labels, sizeof(s->labels), "vm=\"%s\"", vmname);
+	if (labels != NULL && n < (int)sizeof(s->labels) - 1) {
+		s->labels[n++] = ',';
+		va_start(ap, labels);
+		vsnprintf(s->labels + n, sizeof(s->labels) - n, labels, ap);
+		va_end(ap);
+	}
+
+	mo->num++;
+}
+
+int
+metrics_register(void (*fn)(struct metrics_out *mo, void *arg), void *arg)
+{
+	struct metrics_src *src;
+
+	if (!metrics_enabled)
+		return 0;
+
+	src = calloc(1, sizeof(*src));
+	if (src == NULL)
+		return -1;
+
+	src->fn = fn;
+	src->arg = arg;
+	pthread_mutex_lock(&metrics_mtx);
+	LIST_INSERT_HEAD(&metrics_srcs, src, list);
+	pthread_mutex_unlock(&metrics_mtx);
+
+	return 0;
+}
+
+void
+metrics_unregister(void *arg)
+{
+	struct metrics_src *src, *tsrc;
+
+	pthread_mutex_lock(&metrics_mtx);
+	list_foreach_safe(src, &metrics_srcs, list, tsrc) {
+		if (src->arg == arg) {
+			LIST_REMOVE(src, list);
+			free(src);
+		}
+	}
+	pthread_mutex_unlock(&metrics_mtx);
+}
+
+/* the I/O requests the device model emulated, and the time it took */
+static void
+metrics_ioreqs(struct metrics_out *mo)
+{
+	static const char *const names[] = {
+		"pio", "mmio", "pci_cfg", "wp", "pio_str"
+	};
+	uint64_t counts[ARRAY_SIZE(names)], ns[ARRAY_SIZE(names)];
+	int i;
+
+	dm_get_ioreq_stats(counts, ARRAY_SIZE(names));
+	dm_get_ioreq_time(ns, ARRAY_SIZE(names));
+	for (i = 0; i < ARRAY_SIZE(names); i++) {
+		metrics_add(mo, "acrn_dm_ioreqs_total", METRIC_COUNTER,
+			"I/O requests emulated by the device model",
+			counts[i], "type=\"%s\"", names[i]);
+		metrics_add(mo, "acrn_dm_ioreq_ns_total", METRIC_COUNTER,
+			"Time the device model spent emulating the I/O requests, in ns",
+			ns[i], "type=\"%s\"", names[i]);
+	}
+}
+
+static uint64_t
+ticks_to_ns(uint64_t ticks, uint64_t tsc_khz)
+{
+	if (tsc_khz == 0)
+		return 0;
+
+	/* split not to overflow after a few hours of ticks */
+	return (ticks / tsc_khz) * 1000000UL + ((ticks % tsc_khz) * 1000000UL) / tsc_khz;
+}
+
+/* two hypercalls per vCPU and per snapshot, never per scrape */
+static void
+metrics_vcpus(struct metrics_out *mo)
+{
+	static struct acrn_vcpu_exit_stats exits;
+	struct acrn_vcpu_sched_stats sched;
+	int vcpu, reason;
+
+	for (vcpu = 0; vcpu < metrics_ncpus; vcpu++) {
+		memset(&sched, 0, sizeof(sched));
+		sched.vcpu_id = vcpu;
+		if (vm_get_vcpu_sched_stats(metrics_ctx, &sched) == 0) {
+			metrics_add(mo, "acrn_vcpu_run_ns_total", METRIC_COUNTER,
+				"Time the vCPU ran, in ns",
+				ticks_to_ns(sched.run_ticks, sched.tsc_khz),
+				"vcpu=\"%d\"", vcpu);
+			metrics_add(mo, "acrn_vcpu_wait_ns_total", METRIC_COUNTER,
+				"Time the vCPU was runnable but waited for its pCPU, in ns",
+				ticks_to_ns(sched.wait_ticks, sched.tsc_khz),
+				"vcpu=\"%d\"", vcpu);
+			metrics_add(mo, "acrn_vcpu_switches_total", METRIC_COUNTER,
+				"Times the vCPU was switched in", sched.nr_switches,
+				"vcpu=\"%d\"", vcpu);
+		}
+
+		memset(&exits, 0, sizeof(exits));
+		exits.vcpu_id = vcpu;
+		if (vm_get_vcpu_exit_stats(metrics_ctx, &exits) != 0)
+			continue;
+
+		for (reason = 0; reason < ACRN_VMEXIT_REASONS; reason++) {
+			if (exits.reason[reason].count == 0)
+				continue;
+			metrics_add(mo, "acrn_vcpu_exits_total", METRIC_COUNTER,
+				"VM exits of the vCPU by basic exit reason",
+				exits.reason[reason].count,
+				"vcpu=\"%d\",reason=\"%d\"", vcpu, reason);
+			metrics_add(mo, "acrn_vcpu_exit_ns_total", METRIC_COUNTER,
+				"Time the hypervisor spent handling the VM exits, in ns",
+				ticks_to_ns(exits.reason[reason].ticks, exits.tsc_khz),
+				"vcpu=\"%d\",reason=\"%d\"", vcpu, reason);
+		}
+	}
+}
+
+static int
+metrics_cmp(const void *a, const void *b)
+{
+	const struct metric_sample *sa = a, *sb = b;
+	int ret = strcmp(sa->name, sb->name);
+
+	return ret ? ret : sa->seq - sb->seq;
+}
+
+/* the samples of a metric must be together, after its HELP and TYPE */
+static void
+metrics_write(struct metrics_out *mo)
+{
+	char tmp[PATH_MAX + 8];
+	struct metric_sample *s;
+	FILE *fp;
+	int i;
+
+	qsort(mo->samples, mo->num, sizeof(*mo->samples), metrics_cmp);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_file);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		pr_err("%s: failed to open %s: %s\n", __func__, tmp, strerror(errno));
+		return;
+	}
+
+	for (i = 0; i < mo->num; i++) {
+		s = &mo->samples[i];
+		if (i == 0 || strcmp(s->name, mo->samples[i - 1].name))
+			fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n",
+				s->name, s->help, s->name, s->type);
+		fprintf(fp, "%s{%s} %lu\n", s->name, s->labels, s->value);
+	}
+
+	if (fclose(fp) == 0)
+		rename(tmp, metrics_file);
+	else
+		unlink(tmp);
+}
+
+/* called with metrics_mtx held, the sources can't go away meanwhile */
+static void
+metrics_snapshot(void)
+{
+	struct metrics_out mo = { NULL, 0, 0 };
+	struct metrics_src *src;
+
+	metrics_ioreqs(&mo);
+	metrics_vcpus(&mo);
+	LIST_FOREACH(src, &metrics_srcs, list)
+		src->fn(&mo, src->arg);
+
+	metrics_write(&mo);
+	free(mo.samples);
+}
+
+static void *
+metrics_thread(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&metrics_mtx);
+	while (!metrics_stop) {
+		metrics_snapshot();
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += metrics_interval;
+		while (!metrics_stop &&
+		       pthread_cond_timedwait(&metrics_cond, &metrics_mtx, &ts) != ETIMEDOUT)
+			;
+	}
+	pthread_mutex_unlock(&metrics_mtx);
+
+	return NULL;
+}
+
+/* --metrics interval, in seconds */
+int
+acrn_parse_metrics(const char *opt)
+{
+	unsigned int interval;
+
+	if (dm_strtoui(opt, NULL, 10, &interval) || interval == 0 ||
+	    interval > METRICS_INTERVAL_MAX)
+		return -1;
+
+	metrics_interval = interval;
+	metrics_enabled = true;
+
+	return 0;
+}
+
+int
+metrics_init(struct vmctx *ctx, int ncpus)
+{
+	if (!metrics_enabled)
+		return 0;
+
+	if (check_dir(METRICS_PATH, CHK_CREAT)) {
+		pr_err("%s: failed to create %s\n", __func__, METRICS_PATH);
+		return -1;
+	}
+
+	snprintf(metrics_file, sizeof(metrics_file), "%s/%s.prom", METRICS_PATH, vmname);
+	metrics_ctx = ctx;
+	metrics_ncpus = ncpus;
+	metrics_stop = false;
+
+	if (pthread_create(&metrics_tid, NULL, metrics_thread, NULL)) {
+		pr_err("%s: failed to create the metrics thread\n", __func__);
+		return -1;
+	}
+	pthread_setname_np(metrics_tid, "metrics");
+
+	return 0;
+}
+
+void
+metrics_deinit(void)
+{
+	if (!metrics_enabled || metrics_ctx == NULL)
+		return;
+
+	pthread_mutex_lock(&metrics_mtx);
+	metrics_stop = true;
+	pthread_cond_signal(&metrics_cond);
+	pthread_mutex_unlock(&metrics_mtx);
+	pthread_join(metrics_tid, NULL);
+
+	unlink(metrics_file);
+	metrics_ctx = NULL;
+}
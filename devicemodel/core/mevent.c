@@ -37,6 +37,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/queue.h>
 #include <pthread.h>
 
@@ -53,11 +54,12 @@
 
 static int epoll_fd;
 static pthread_t mevent_tid;
-static int mevent_pipefd[2];
+static int mevent_efd = -1;
 static pthread_mutex_t mevent_lmutex;
 
 struct mevent {
 	void			(*run)(int, enum ev_type, void *);
+	bool			(*run_batch)(int, enum ev_type, void *);
 	void			*run_param;
 	void			(*teardown)(void *);
 	void			*teardown_param;
@@ -69,12 +71,29 @@ struct mevent {
 
 	int			closefd;
 	LIST_ENTRY(mevent)	me_list;
+
+	/* batched delivery, only touched by the dispatch thread but me_disabled */
+	bool			me_disabled;
+	uint64_t		me_round;	/* dispatch round it last ran in */
+	struct pending_head	*me_pendq;	/* queue it is on, NULL if none */
+	TAILQ_ENTRY(mevent)	me_pending;
 };
 
 static LIST_HEAD(listhead, mevent) global_head;
 /* List holds the mevent node which is requested to be deleted */
 static LIST_HEAD(del_listhead, mevent) del_head;
 
+/*
+ * Batched events whose handler stopped before draining their fd: they run
+ * again in the next dispatch round, which does not block in epoll_wait().
+ */
+TAILQ_HEAD(pending_head, mevent);
+static struct pending_head mevent_pending = TAILQ_HEAD_INITIALIZER(mevent_pending);
+static struct pending_head mevent_running = TAILQ_HEAD_INITIALIZER(mevent_running);
+static uint64_t mevent_round;
+/* batched event whose handler runs, its deletion is deferred to the end of the round */
+static struct mevent *mevent_batch_current;
+
 static void
 mevent_qlock(void)
 {
@@ -94,36 +113,106 @@ is_dispatch_thread(void)
 }
 
 static void
-mevent_pipe_read(int fd, enum ev_type type, void *param)
+mevent_notify_read(int fd, enum ev_type type, void *param)
 {
-	char buf[MEVENT_MAX];
+	uint64_t cnt;
 	ssize_t status;
 
 	/*
-	 * Drain the pipe read side. The fd is non-blocking so this is
-	 * safe to do.
+	 * Reset the eventfd counter, all the notifications since the last
+	 * read are handled by this round. The fd is non-blocking so this
+	 * is safe to do.
 	 */
-	do {
-		status = read(fd, buf, sizeof(buf));
-	} while (status == MEVENT_MAX);
+	status = read(fd, &cnt, sizeof(cnt));
+	(void)status;
 }
 
 /* On error, -1 is returned, else return zero */
 int
 mevent_notify(void)
 {
-	char c = 0;
+	uint64_t one = 1UL;
 
 	/*
-	 * If calling from outside the i/o thread, write a byte on the
-	 * pipe to force the i/o thread to exit the blocking epoll call.
+	 * If calling from outside the i/o thread, bump the eventfd
+	 * counter to force the i/o thread to exit the blocking epoll call.
 	 */
-	if (mevent_pipefd[1] != 0 && !is_dispatch_thread())
-		if (write(mevent_pipefd[1], &c, 1) <= 0)
+	if (mevent_efd >= 0 && !is_dispatch_thread())
+		if (write(mevent_efd, &one, sizeof(one)) <= 0)
 			return -1;
 	return 0;
 }
 
+/*
+ * @pre called by the dispatch thread
+ */
+static void
+mevent_unqueue(struct mevent *mevp)
+{
+	if (mevp->me_pendq != NULL) {
+		TAILQ_REMOVE(mevp->me_pendq, mevp, me_pending);
+		mevp->me_pendq = NULL;
+	}
+}
+
+/*
+ * @pre called by the dispatch thread
+ */
+static void
+mevent_queue_pending(struct mevent *mevp)
+{
+	if (mevp->me_pendq == NULL) {
+		TAILQ_INSERT_TAIL(&mevent_pending, mevp, me_pending);
+		mevp->me_pendq = &mevent_pending;
+	}
+}
+
+/*
+ * @pre called by the dispatch thread
+ */
+static void
+mevent_run(struct mevent *mevp)
+{
+	bool more;
+
+	if (mevp->run_batch == NULL) {
+		(*mevp->run)(mevp->me_fd, mevp->me_type, mevp->run_param);
+	} else if (mevp->me_round != mevent_round) {
+		mevp->me_round = mevent_round;
+		mevent_batch_current = mevp;
+		more = (*mevp->run_batch)(mevp->me_fd, mevp->me_type, mevp->run_param);
+		mevent_batch_current = NULL;
+		/* me_state is cleared if the handler deleted its event */
+		if (more && mevp->me_state)
+			mevent_queue_pending(mevp);
+		else
+			mevent_unqueue(mevp);
+	}
+}
+
+static void
+mevent_run_pending(void)
+{
+	struct mevent *mevp;
+
+	TAILQ_CONCAT(&mevent_running, &mevent_pending, me_pending);
+	TAILQ_FOREACH(mevp, &mevent_running, me_pending) {
+		mevp->me_pendq = &mevent_running;
+	}
+
+	/* a handler may delete any event of the list, take them one by one */
+	while ((mevp = TAILQ_FIRST(&mevent_running)) != NULL) {
+		mevent_unqueue(mevp);
+		if (!mevp->me_state || __atomic_load_n(&mevp->me_disabled, __ATOMIC_ACQUIRE))
+			continue;
+		/* it already ran in this round on a new edge */
+		if (mevp->me_round == mevent_round)
+			mevent_queue_pending(mevp);
+		else
+			mevent_run(mevp);
+	}
+}
+
 static int
 mevent_kq_filter(struct mevent *mevp)
 {
@@ -143,6 +232,10 @@ mevent_kq_filter(struct mevent *mevp)
 	if (mevp->me_type == EVF_WRITE_ET)
 		retval = EPOLLOUT | EPOLLET;
 
+	/* a batched handler says itself when it has to run again */
+	if (mevp->run_batch != NULL)
+		retval |= EPOLLET;
+
 	return retval;
 }
 
@@ -154,6 +247,7 @@ mevent_destroy(void)
 	mevent_qlock();
 	list_foreach_safe(mevp, &global_head, me_list, tmpp) {
 		LIST_REMOVE(mevp, me_list);
+		mevent_unqueue(mevp);
 		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, mevp->me_fd, NULL);
 
                if ((mevp->me_type == EVF_READ ||
@@ -200,20 +294,21 @@ mevent_handle(struct epoll_event *kev, int numev)
 		mevp = kev[i].data.ptr;
 
 		if (mevp->me_state)
-			(*mevp->run)(mevp->me_fd, mevp->me_type, mevp->run_param);
+			mevent_run(mevp);
 	}
 }
 
-struct mevent *
-mevent_add(int tfd, enum ev_type type,
-	   void (*run)(int, enum ev_type, void *), void *run_param,
+static struct mevent *
+mevent_add_event(int tfd, enum ev_type type,
+	   void (*run)(int, enum ev_type, void *),
+	   bool (*run_batch)(int, enum ev_type, void *), void *run_param,
 	   void (*teardown)(void *), void *teardown_param)
 {
 	int ret;
 	struct epoll_event ee;
 	struct mevent *lp, *mevp;
 
-	if (tfd < 0 || run == NULL)
+	if (tfd < 0 || (run == NULL && run_batch == NULL))
 		return NULL;
 
 	if (type == EVF_TIMER)
@@ -241,6 +336,7 @@ mevent_add(int tfd, enum ev_type type,
 	mevp->me_state = 1;
 
 	mevp->run = run;
+	mevp->run_batch = run_batch;
 	mevp->run_param = run_param;
 	mevp->teardown = teardown;
 	mevp->teardown_param = teardown_param;
@@ -261,6 +357,34 @@ mevent_add(int tfd, enum ev_type type,
 	}
 }
 
+struct mevent *
+mevent_add(int tfd, enum ev_type type,
+	   void (*run)(int, enum ev_type, void *), void *run_param,
+	   void (*teardown)(void *), void *teardown_param)
+{
+	return mevent_add_event(tfd, type, run, NULL, run_param, teardown, teardown_param);
+}
+
+/*
+ * Add an event with batched delivery, for fds which can be busy.
+ *
+ * The fd is edge triggered: run is called once it gets ready and has to
+ * consume what the fd has, up to a budget of its own so the other events
+ * are not starved. It returns true if it stopped before draining the fd,
+ * it is then called again in the next dispatch round without waiting for
+ * another edge, after the other events ready by then.
+ */
+struct mevent *
+mevent_add_batch(int tfd, enum ev_type type,
+	   bool (*run)(int, enum ev_type, void *), void *run_param,
+	   void (*teardown)(void *), void *teardown_param)
+{
+	if (type != EVF_READ && type != EVF_WRITE)
+		return NULL;
+
+	return mevent_add_event(tfd, type, NULL, run, run_param, teardown, teardown_param);
+}
+
 int
 mevent_enable(struct mevent *evp)
 {
@@ -281,6 +405,7 @@ mevent_enable(struct mevent *evp)
 	if (!mevp)
 		return -1;
 
+	__atomic_store_n(&mevp->me_disabled, false, __ATOMIC_RELEASE);
 	ee.events = mevent_kq_filter(mevp);
 	ee.data.ptr = mevp;
 	ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mevp->me_fd, &ee);
@@ -295,6 +420,8 @@ mevent_disable(struct mevent *evp)
 {
 	int ret;
 
+	/* keeps a pending batched event from running again */
+	__atomic_store_n(&evp->me_disabled, true, __ATOMIC_RELEASE);
 	ret = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, evp->me_fd, NULL);
 	if (ret < 0 && errno == ENOENT)
 		ret = 0;
@@ -317,9 +444,17 @@ mevent_drain_del_list(void)
 {
 	struct mevent *evp, *tmpp;
 
+	/*
+	 * Nothing to lock for in most rounds: a deletion queued after this
+	 * check notifies, so it is drained in the next round.
+	 */
+	if (__atomic_load_n(&LIST_FIRST(&del_head), __ATOMIC_ACQUIRE) == NULL)
+		return;
+
 	mevent_qlock();
 	list_foreach_safe(evp, &del_head, me_list, tmpp) {
 		LIST_REMOVE(evp, me_list);
+		mevent_unqueue(evp);
 		if (evp->closefd) {
 			close(evp->me_fd);
 		}
@@ -341,9 +476,10 @@ mevent_delete_event(struct mevent *evp, int closefd)
 	evp->closefd = closefd;
 
 	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, evp->me_fd, NULL);
-	if (!is_dispatch_thread()) {
+	if (!is_dispatch_thread() || evp == mevent_batch_current) {
 		mevent_add_to_del_list(evp, closefd);
 	} else {
+		mevent_unqueue(evp);
 		if (evp->closefd) {
 			close(evp->me_fd);
 		}
@@ -394,10 +530,10 @@ mevent_init(void)
 void
 mevent_deinit(void)
 {
+	/* the eventfd is closed with its event */
+	mevent_efd = -1;
 	mevent_destroy();
 	close(epoll_fd);
-	if (mevent_pipefd[1] != 0)
-		close(mevent_pipefd[1]);
 
 	pthread_mutex_destroy(&mevent_lmutex);
 }
@@ -407,47 +543,51 @@ mevent_dispatch(void)
 {
 	struct epoll_event eventlist[MEVENT_MAX];
 
-	struct mevent *pipev;
-	int ret;
+	struct mevent *notifyev;
+	int efd, ret;
 
 	mevent_tid = pthread_self();
 	mevent_set_name();
 
 	/*
-	 * Open the pipe that will be used for other threads to force
-	 * the blocking kqueue call to exit by writing to it. Set the
+	 * Open the eventfd that will be used for other threads to force
+	 * the blocking epoll call to exit by writing to it. Set the
 	 * descriptor to non-blocking.
 	 */
-	ret = pipe2(mevent_pipefd, O_NONBLOCK);
-	if (ret < 0) {
-		pr_err("pipe");
+	efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0) {
+		pr_err("eventfd");
 		exit(0);
 	}
 
 	/*
-	 * Add internal event handler for the pipe write fd
+	 * Add internal event handler for the eventfd
 	 */
-	pipev = mevent_add(mevent_pipefd[0], EVF_READ, mevent_pipe_read, NULL, NULL, NULL);
-	if (!pipev) {
-		pr_err("pipefd mevent_add failed\n");
+	notifyev = mevent_add(efd, EVF_READ, mevent_notify_read, NULL, NULL, NULL);
+	if (!notifyev) {
+		pr_err("eventfd mevent_add failed\n");
 		exit(0);
 	}
+	mevent_efd = efd;
 
 	for (;;) {
 		int suspend_mode;
 
 		/*
-		 * Block awaiting events
+		 * Block awaiting events, unless batched events are pending
 		 */
-		ret = epoll_wait(epoll_fd, eventlist, MEVENT_MAX, -1);
+		ret = epoll_wait(epoll_fd, eventlist, MEVENT_MAX,
+				TAILQ_EMPTY(&mevent_pending) ? -1 : 0);
 
 		if (ret == -1 && errno != EINTR)
 			pr_err("Error return from epoll_wait");
 
 		/*
-		 * Handle reported events
+		 * Handle reported events, then the pending batched ones
 		 */
+		mevent_round++;
 		mevent_handle(eventlist, ret);
+		mevent_run_pending();
 		mevent_drain_del_list();
 
 		suspend_mode = vm_get_suspend_mode();
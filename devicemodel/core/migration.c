@@ -0,0 +1,986 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Live migration of a User VM
+ *
+ * The target is an acrn-dm started on the other host with the same command
+ * line plus --incoming [host:]port: it creates the VM and its devices as for
+ * a restore (see snapshot.c), then waits for the source instead of loading
+ * the software.
+ *
+ * The monitor of the source asks for the migration (DM_MIGRATE, "acrnctl
+ * migrate"). The source connects to the target, which checks that the vCPUs
+ * and the memory of the VMs match, then opens the data streams, TCP
+ * connections of their own. The guest memory is copied while the VM runs,
+ * the whole of it then, in rounds, the pages written to since the previous
+ * round, from the EPT dirty log. Once the pages left can be sent within the
+ * downtime aimed at, measured from the previous round, or after
+ * MIGRATE_LIVE_ROUNDS, the VM is paused (snapshot_pause()), the devices save
+ * their state (pci_snapshot()) and the last pages are sent. The state of the
+ * vCPUs, of the vIOAPIC and of the devices follows on the control connection,
+ * the target sets it like a restore and its VM starts. The source powers its
+ * VM off once the target has acked; if the target failed, its VM goes on
+ * from where it was paused.
+ *
+ * The pages are split over the data streams by their word of the bitmap, 64
+ * pages: a page always goes through the same stream, so its copies arrive in
+ * order. A thread per stream deflates the runs of pages, the zero ones are
+ * sent as a record only.
+ *
+ * The device model writes to the guest memory through the mapping of the
+ * Service VM, which is not in the dirty log: the virtio devices log the
+ * buffers they complete, and their used rings when they are saved, with
+ * migrate_log_dirty(). The writes of the other devices (AHCI, xHCI...) are
+ * not logged.
+ *
+ * A connection to the target:
+ *	control: struct migrate_header, the status of the target (int32_t),
+ *	then once the memory is sent: struct acrn_vcpu_state per vCPU, struct
+ *	acrn_vioapic_state, the size of the device records (uint64_t) and
+ *	the records, the status of the target again
+ *	data: struct migrate_header, then struct migrate_rec followed by its
+ *	data, until a record at MIGRATE_REC_END
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+
+#include "dm.h"
+#include "vmmapi.h"
+#include "pci_core.h"
+#include "sw_load.h"
+#include "log.h"
+#include "dm_string.h"
+#include "snapshot.h"
+#include "migration.h"
+
+#define MIGRATE_MAGIC		"ACRNMIGR"
+#define MIGRATE_VERSION		1U
+#define MIGRATE_PAGE_SIZE	4096UL
+#define MIGRATE_RUN_PAGES	64U
+#define MIGRATE_REC_END		(~0UL)
+
+/* the data streams, by default and at most */
+#define MIGRATE_STREAMS		4
+#define MIGRATE_STREAMS_MAX	16
+
+/* the rounds of copy while the VM runs at most, and the default downtime */
+#define MIGRATE_LIVE_ROUNDS	30
+#define MIGRATE_DOWNTIME_MS	300UL
+
+struct migrate_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	nr_vcpus;
+	uint32_t	nr_streams;
+	uint32_t	reserved;
+	uint64_t	lowmem;
+	uint64_t	highmem;
+	uint64_t	biosmem;
+	uint64_t	highmem_gpa_base;
+};
+
+/* a run of pages within a word of the bitmap, followed by len bytes */
+struct migrate_rec {
+	uint64_t	gpa;
+	uint32_t	pages;
+	uint32_t	len;	/* 0: zero pages, pages * 4K: as is, else deflated */
+};
+
+/* a region of the guest memory, with the pages to send */
+struct migrate_mem {
+	uint64_t	gpa;
+	char		*hva;
+	size_t		size;
+	uint64_t	*bitmap;
+	uint64_t	*log;	/* the EPT dirty log just read */
+	size_t		word;	/* of its bitmap, over the regions */
+};
+
+struct migrate_ctx;
+
+struct migrate_stream {
+	struct migrate_ctx *mc;
+	int		idx;
+	int		fd;
+	char		*zbuf;
+	pthread_t	tid;
+	int		err;
+	uint64_t	pages;
+	uint64_t	bytes;
+};
+
+struct migrate_ctx {
+	struct vmctx	*ctx;
+	struct migrate_mem mem[3];
+	int		nr;
+	struct migrate_stream streams[MIGRATE_STREAMS_MAX];
+	int		nr_streams;
+};
+
+/* the pages the device model wrote to, by region, kept for the next migrations */
+struct migrate_dm_log {
+	uint64_t	gpa;
+	size_t		size;
+	uint64_t	*bitmap;
+};
+
+bool migrate_logging;
+static struct migrate_dm_log dm_log[3];
+static int dm_log_nr;
+
+static size_t
+migrate_words(size_t size)
+{
+	return howmany(size / MIGRATE_PAGE_SIZE, 64);
+}
+
+static int
+migrate_mem_regions(struct migrate_ctx *mc)
+{
+	struct vmctx *ctx = mc->ctx;
+	struct migrate_mem *mem = mc->mem;
+	size_t word = 0;
+	int i, nr = 0;
+
+	mem[nr++] = (struct migrate_mem) { 0, ctx->baseaddr, ctx->lowmem };
+	if (ctx->highmem > 0)
+		mem[nr++] = (struct migrate_mem) { ctx->highmem_gpa_base,
+			ctx->baseaddr + ctx->highmem_gpa_base, ctx->highmem };
+	if (ctx->biosmem > 0)
+		mem[nr++] = (struct migrate_mem) { 4 * GB - ctx->biosmem,
+			ctx->baseaddr + 4 * GB - ctx->biosmem, ctx->biosmem };
+
+	for (i = 0; i < nr; i++) {
+		mem[i].word = word;
+		word += migrate_words(mem[i].size);
+		mem[i].bitmap = calloc(migrate_words(mem[i].size), sizeof(uint64_t));
+		mem[i].log = calloc(migrate_words(mem[i].size), sizeof(uint64_t));
+		if (mem[i].bitmap == NULL || mem[i].log == NULL)
+			return -1;
+	}
+	mc->nr = nr;
+
+	return 0;
+}
+
+/* the host address of the pages [gpa, gpa + size) of a region, NULL if they are not in one */
+static char *
+migrate_hva(struct migrate_ctx *mc, uint64_t gpa, size_t size)
+{
+	struct migrate_mem *mem;
+	int i;
+
+	for (i = 0; i < mc->nr; i++) {
+		mem = &mc->mem[i];
+		if (gpa >= mem->gpa && size <= mem->size &&
+		    gpa - mem->gpa <= mem->size - size)
+			return mem->hva + (gpa - mem->gpa);
+	}
+
+	return NULL;
+}
+
+void
+migrate_log_dirty(uint64_t gpa, uint64_t len)
+{
+	struct migrate_dm_log *log;
+	uint64_t page, last;
+	int i;
+
+	for (i = 0; (i < dm_log_nr) && (len > 0); i++) {
+		log = &dm_log[i];
+		if (gpa < log->gpa || gpa - log->gpa >= log->size)
+			continue;
+		page = (gpa - log->gpa) / MIGRATE_PAGE_SIZE;
+		last = (MIN(gpa - log->gpa + len, log->size) - 1) / MIGRATE_PAGE_SIZE;
+		for (; page <= last; page++)
+			__atomic_fetch_or(&log->bitmap[page / 64], 1UL << (page % 64),
+				__ATOMIC_RELAXED);
+		break;
+	}
+}
+
+/*
+ * Clear the dirty logs of the regions and have the devices log their
+ * writes, -1 if the VM has no dirty log.
+ */
+static int
+migrate_log_start(struct migrate_ctx *mc)
+{
+	int i;
+
+	if (dm_log_nr == 0) {
+		for (i = 0; i < mc->nr; i++) {
+			dm_log[i].gpa = mc->mem[i].gpa;
+			dm_log[i].size = mc->mem[i].size;
+			dm_log[i].bitmap = calloc(migrate_words(mc->mem[i].size),
+				sizeof(uint64_t));
+			if (dm_log[i].bitmap == NULL)
+				return -1;
+		}
+		dm_log_nr = mc->nr;
+	}
+
+	for (i = 0; i < mc->nr; i++) {
+		if (vm_get_dirty_log(mc->ctx, mc->mem[i].gpa, mc->mem[i].size,
+				mc->mem[i].log) != 0) {
+			pr_notice("%s: no dirty log (%s), the VM is paused during the migration\n",
+				__func__, strerror(errno));
+			return -1;
+		}
+		memset(dm_log[i].bitmap, 0, migrate_words(mc->mem[i].size) * sizeof(uint64_t));
+	}
+	__atomic_store_n(&migrate_logging, true, __ATOMIC_SEQ_CST);
+
+	return 0;
+}
+
+/* Add the pages written to since the last call to the ones to send, the number of them or -1 */
+static long
+migrate_log_read(struct migrate_ctx *mc)
+{
+	struct migrate_mem *mem;
+	uint64_t *dm;
+	long dirty = 0;
+	size_t w;
+	int i;
+
+	for (i = 0; i < mc->nr; i++) {
+		mem = &mc->mem[i];
+		if (vm_get_dirty_log(mc->ctx, mem->gpa, mem->size, mem->log) != 0) {
+			pr_err("%s: could not read the dirty log: %s\n", __func__, strerror(errno));
+			return -1;
+		}
+		dm = dm_log[i].bitmap;
+		for (w = 0; w < migrate_words(mem->size); w++) {
+			mem->bitmap[w] |= mem->log[w] | __atomic_exchange_n(&dm[w], 0, __ATOMIC_ACQ_REL);
+			dirty += __builtin_popcountl(mem->bitmap[w]);
+		}
+	}
+
+	return dirty;
+}
+
+static void
+migrate_mark_all(struct migrate_ctx *mc)
+{
+	struct migrate_mem *mem;
+	size_t pages;
+	int i;
+
+	for (i = 0; i < mc->nr; i++) {
+		mem = &mc->mem[i];
+		pages = mem->size / MIGRATE_PAGE_SIZE;
+		memset(mem->bitmap, 0xff, (pages / 64) * sizeof(uint64_t));
+		if (pages % 64)
+			mem->bitmap[pages / 64] = (1UL << (pages % 64)) - 1;
+	}
+}
+
+static int
+migrate_send(int fd, const void *buf, size_t len, int flags)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = send(fd, p, len, flags | MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			pr_err("%s: %s\n", __func__, (ret < 0) ? strerror(errno) : "connection closed");
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int
+migrate_recv(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = recv(fd, p, len, MSG_WAITALL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			pr_err("%s: %s\n", __func__, (ret < 0) ? strerror(errno) : "connection closed");
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static bool
+migrate_zero_page(const char *page)
+{
+	const uint64_t *p = (const uint64_t *)page;
+	size_t i;
+
+	for (i = 0; i < MIGRATE_PAGE_SIZE / sizeof(*p); i++) {
+		if (p[i] != 0)
+			return false;
+	}
+
+	return true;
+}
+
+static int
+migrate_send_run(struct migrate_stream *st, uint64_t gpa, const char *hva,
+		uint32_t pages, bool zero)
+{
+	struct migrate_rec rec = { gpa, pages, 0 };
+	size_t size = pages * MIGRATE_PAGE_SIZE;
+	uLongf zlen = compressBound(MIGRATE_RUN_PAGES * MIGRATE_PAGE_SIZE);
+	const char *data = hva;
+
+	if (!zero) {
+		rec.len = size;
+		if (compress2((Bytef *)st->zbuf, &zlen, (const Bytef *)hva, size,
+				Z_BEST_SPEED) == Z_OK && zlen < size) {
+			rec.len = zlen;
+			data = st->zbuf;
+		}
+	}
+
+	st->pages += pages;
+	st->bytes += sizeof(rec) + rec.len;
+	if (migrate_send(st->fd, &rec, sizeof(rec), MSG_MORE) != 0 ||
+	    (rec.len > 0 && migrate_send(st->fd, data, rec.len, MSG_MORE) != 0))
+		return -1;
+
+	return 0;
+}
+
+/* Send the pages to send of the words of the bitmaps of the stream, in runs */
+static void *
+migrate_send_thread(void *arg)
+{
+	struct migrate_stream *st = arg;
+	struct migrate_ctx *mc = st->mc;
+	struct migrate_mem *mem;
+	size_t w, p, q, end, pages;
+	bool zero;
+	int i;
+
+	for (i = 0; i < mc->nr; i++) {
+		mem = &mc->mem[i];
+		pages = mem->size / MIGRATE_PAGE_SIZE;
+		for (w = 0; w < migrate_words(mem->size); w++) {
+			if (mem->bitmap[w] == 0 || (mem->word + w) % mc->nr_streams != st->idx)
+				continue;
+			end = MIN((w + 1) * 64, pages);
+			for (p = w * 64; p < end; p = q) {
+				if (!isset(mem->bitmap, p)) {
+					q = p + 1;
+					continue;
+				}
+				zero = migrate_zero_page(mem->hva + p * MIGRATE_PAGE_SIZE);
+				for (q = p + 1; q < end && isset(mem->bitmap, q) &&
+				     migrate_zero_page(mem->hva + q * MIGRATE_PAGE_SIZE) == zero; q++)
+					;
+				if (migrate_send_run(st, mem->gpa + p * MIGRATE_PAGE_SIZE,
+						mem->hva + p * MIGRATE_PAGE_SIZE, q - p, zero) != 0) {
+					st->err = -1;
+					return NULL;
+				}
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* Send the pages to send over the data streams, in parallel, and clear them */
+static int
+migrate_send_round(struct migrate_ctx *mc)
+{
+	int i, err = 0;
+
+	for (i = 0; i < mc->nr_streams; i++) {
+		if (pthread_create(&mc->streams[i].tid, NULL, migrate_send_thread,
+				&mc->streams[i]) != 0) {
+			/* the stream is sent by this thread */
+			migrate_send_thread(&mc->streams[i]);
+			mc->streams[i].tid = 0;
+		}
+	}
+	for (i = 0; i < mc->nr_streams; i++) {
+		if (mc->streams[i].tid != 0)
+			pthread_join(mc->streams[i].tid, NULL);
+		if (mc->streams[i].err != 0)
+			err = -1;
+	}
+
+	for (i = 0; i < mc->nr; i++)
+		memset(mc->mem[i].bitmap, 0, migrate_words(mc->mem[i].size) * sizeof(uint64_t));
+
+	return err;
+}
+
+static int
+migrate_send_end(struct migrate_ctx *mc)
+{
+	struct migrate_rec rec = { MIGRATE_REC_END, 0, 0 };
+	int i;
+
+	for (i = 0; i < mc->nr_streams; i++) {
+		if (migrate_send(mc->streams[i].fd, &rec, sizeof(rec), 0) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Receive the pages of a data stream into the guest memory, until its end */
+static void *
+migrate_recv_thread(void *arg)
+{
+	struct migrate_stream *st = arg;
+	struct migrate_rec rec;
+	uLongf zlen, zmax = compressBound(MIGRATE_RUN_PAGES * MIGRATE_PAGE_SIZE);
+	size_t size;
+	char *hva;
+
+	for (;;) {
+		if (migrate_recv(st->fd, &rec, sizeof(rec)) != 0)
+			break;
+		if (rec.gpa == MIGRATE_REC_END) {
+			st->err = 0;
+			break;
+		}
+
+		size = rec.pages * MIGRATE_PAGE_SIZE;
+		hva = migrate_hva(st->mc, rec.gpa, size);
+		if (hva == NULL || rec.pages == 0 || rec.pages > MIGRATE_RUN_PAGES ||
+		    (rec.gpa % MIGRATE_PAGE_SIZE) != 0 || rec.len > zmax) {
+			pr_err("%s: invalid pages 0x%lx, %u\n", __func__, rec.gpa, rec.pages);
+			break;
+		}
+
+		if (rec.len == 0) {
+			memset(hva, 0, size);
+		} else if (rec.len == size) {
+			if (migrate_recv(st->fd, hva, size) != 0)
+				break;
+		} else {
+			zlen = size;
+			if (migrate_recv(st->fd, st->zbuf, rec.len) != 0)
+				break;
+			if (uncompress((Bytef *)hva, &zlen, (const Bytef *)st->zbuf,
+					rec.len) != Z_OK || zlen != size) {
+				pr_err("%s: corrupted pages 0x%lx\n", __func__, rec.gpa);
+				break;
+			}
+		}
+		st->pages += rec.pages;
+		st->bytes += sizeof(rec) + rec.len;
+	}
+
+	/* the source must not block on a stream no longer read */
+	if (st->err != 0)
+		shutdown(st->fd, SHUT_RDWR);
+	return NULL;
+}
+
+static int
+migrate_streams_init(struct migrate_ctx *mc, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		mc->streams[i].mc = mc;
+		mc->streams[i].idx = i;
+		mc->streams[i].fd = -1;
+		mc->streams[i].err = 0;
+		mc->streams[i].zbuf = malloc(compressBound(MIGRATE_RUN_PAGES * MIGRATE_PAGE_SIZE));
+		if (mc->streams[i].zbuf == NULL)
+			return -1;
+	}
+	mc->nr_streams = nr;
+
+	return 0;
+}
+
+static void
+migrate_ctx_free(struct migrate_ctx *mc)
+{
+	int i;
+
+	for (i = 0; i < mc->nr; i++) {
+		free(mc->mem[i].bitmap);
+		free(mc->mem[i].log);
+	}
+	for (i = 0; i < mc->nr_streams; i++) {
+		if (mc->streams[i].fd >= 0)
+			close(mc->streams[i].fd);
+		free(mc->streams[i].zbuf);
+	}
+}
+
+static void
+migrate_header_init(struct vmctx *ctx, struct migrate_header *hdr, int nr_streams)
+{
+	bzero(hdr, sizeof(*hdr));
+	memcpy(hdr->magic, MIGRATE_MAGIC, sizeof(hdr->magic));
+	hdr->version = MIGRATE_VERSION;
+	hdr->nr_vcpus = ctx->vcpu_num;
+	hdr->nr_streams = nr_streams;
+	hdr->lowmem = ctx->lowmem;
+	hdr->highmem = ctx->highmem;
+	hdr->biosmem = ctx->biosmem;
+	hdr->highmem_gpa_base = ctx->highmem_gpa_base;
+}
+
+/* Split [host:]port, host is NULL if there is none */
+static int
+migrate_parse_addr(char *addr, char **host, char **port)
+{
+	char *p = strrchr(addr, ':');
+
+	*host = NULL;
+	*port = addr;
+	if (p != NULL) {
+		*p = '\0';
+		*host = addr;
+		*port = p + 1;
+		/* an IPv6 address */
+		if (addr[0] == '[' && p > addr && p[-1] == ']') {
+			p[-1] = '\0';
+			*host = addr + 1;
+		}
+	}
+
+	return (**port != '\0') ? 0 : -1;
+}
+
+static void
+migrate_sockopts(int fd)
+{
+	int one = 1;
+
+	/* the records are corked with MSG_MORE, the control messages must not wait */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static int
+migrate_connect(const char *host, const char *port)
+{
+	struct addrinfo hints, *res, *ai;
+	int fd = -1, ret;
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret != 0) {
+		pr_err("%s: %s:%s: %s\n", __func__, host, port, gai_strerror(ret));
+		return -1;
+	}
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd < 0)
+		pr_err("%s: could not connect to %s:%s (%s)\n", __func__, host, port, strerror(errno));
+	else
+		migrate_sockopts(fd);
+	return fd;
+}
+
+static int
+migrate_listen(const char *host, const char *port)
+{
+	struct addrinfo hints, *res, *ai;
+	int fd = -1, one = 1, ret;
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret != 0) {
+		pr_err("%s: %s: %s\n", __func__, port, gai_strerror(ret));
+		return -1;
+	}
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		    listen(fd, MIGRATE_STREAMS_MAX + 1) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd < 0)
+		pr_err("%s: could not listen on port %s (%s)\n", __func__, port, strerror(errno));
+	return fd;
+}
+
+/* "host:port[,streams=<n>][,downtime=<ms>]" */
+static int
+migrate_parse(char *spec, char **host, char **port, int *streams, unsigned long *downtime)
+{
+	char *addr, *opt;
+	int val;
+
+	*streams = MIGRATE_STREAMS;
+	*downtime = MIGRATE_DOWNTIME_MS;
+
+	addr = strsep(&spec, ",");
+	if (migrate_parse_addr(addr, host, port) != 0 || *host == NULL)
+		return -1;
+
+	while ((opt = strsep(&spec, ",")) != NULL) {
+		if (strncmp(opt, "streams=", 8) == 0 && dm_strtoi(opt + 8, NULL, 0, &val) == 0 &&
+		    val > 0 && val <= MIGRATE_STREAMS_MAX)
+			*streams = val;
+		else if (strncmp(opt, "downtime=", 9) == 0 &&
+			 dm_strtoul(opt + 9, NULL, 0, downtime) == 0)
+			continue;
+		else
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Send the states read by snapshot_pause() and the device records in devfd */
+static int
+migrate_send_states(struct vmctx *ctx, int fd, struct acrn_vcpu_state *states,
+		struct acrn_vioapic_state *vioapic, int devfd)
+{
+	uint64_t size = lseek(devfd, 0, SEEK_END);
+	char *buf;
+	int err = -1;
+
+	buf = malloc(size);
+	if (buf != NULL && pread(devfd, buf, size, 0) == size &&
+	    migrate_send(fd, states, ctx->vcpu_num * sizeof(*states), MSG_MORE) == 0 &&
+	    migrate_send(fd, vioapic, sizeof(*vioapic), MSG_MORE) == 0 &&
+	    migrate_send(fd, &size, sizeof(size), MSG_MORE) == 0 &&
+	    migrate_send(fd, buf, size, 0) == 0)
+		err = 0;
+	free(buf);
+
+	return err;
+}
+
+static void
+migrate_stats(struct migrate_ctx *mc, uint64_t *pages, uint64_t *bytes)
+{
+	int i;
+
+	*pages = 0;
+	*bytes = 0;
+	for (i = 0; i < mc->nr_streams; i++) {
+		*pages += mc->streams[i].pages;
+		*bytes += mc->streams[i].bytes;
+	}
+}
+
+int
+vm_migrate(struct vmctx *ctx, const char *spec)
+{
+	struct migrate_ctx mc;
+	struct migrate_header hdr;
+	struct acrn_vcpu_state *states = NULL;
+	struct acrn_vioapic_state vioapic;
+	uint64_t start = sw_load_now(), t, paused, round_ns = 0, round_pages = 0;
+	uint64_t pages, bytes;
+	unsigned long downtime;
+	char *dup, *host, *port;
+	int32_t status = -1;
+	int fd = -1, devfd = -1, i, nr_streams, round = 0, err = -1;
+	long dirty = 0;
+	bool live;
+
+	/* the VM is paused at the end, which these VMs do not support */
+	if (is_rtvm || lapic_pt || trusty_enabled) {
+		pr_err("%s: RT VMs and VMs with LAPIC passthrough or a secure world are not supported\n",
+			__func__);
+		return -1;
+	}
+	if (pci_snapshot_capable() != 0)
+		return -1;
+
+	bzero(&mc, sizeof(mc));
+	mc.ctx = ctx;
+	dup = strdup(spec);
+	if (dup == NULL || migrate_parse(dup, &host, &port, &nr_streams, &downtime) != 0) {
+		pr_err("%s: invalid target %s, host:port[,streams=<n>][,downtime=<ms>]\n",
+			__func__, spec);
+		free(dup);
+		return -1;
+	}
+
+	states = calloc(ctx->vcpu_num, sizeof(*states));
+	if (states == NULL || migrate_mem_regions(&mc) != 0 ||
+	    migrate_streams_init(&mc, nr_streams) != 0)
+		goto out;
+
+	/* the target checks the VM and opens the data streams */
+	migrate_header_init(ctx, &hdr, nr_streams);
+	fd = migrate_connect(host, port);
+	if (fd < 0 || migrate_send(fd, &hdr, sizeof(hdr), 0) != 0 ||
+	    migrate_recv(fd, &status, sizeof(status)) != 0)
+		goto out;
+	if (status != 0) {
+		pr_err("%s: the VM on %s:%s differs from this one\n", __func__, host, port);
+		goto out;
+	}
+	for (i = 0; i < nr_streams; i++) {
+		mc.streams[i].fd = migrate_connect(host, port);
+		if (mc.streams[i].fd < 0 ||
+		    migrate_send(mc.streams[i].fd, &hdr, sizeof(hdr), 0) != 0)
+			goto out;
+	}
+
+	live = (migrate_log_start(&mc) == 0);
+	if (live) {
+		migrate_mark_all(&mc);
+		for (round = 0; round < MIGRATE_LIVE_ROUNDS; round++) {
+			if (round > 0) {
+				dirty = migrate_log_read(&mc);
+				if (dirty < 0)
+					goto out;
+				/* the time the last round would take, at the pace of this one */
+				if (dirty * round_ns / round_pages <= downtime * 1000000UL)
+					break;
+				round_pages = dirty;
+			} else {
+				round_pages = ctx->lowmem + ctx->highmem + ctx->biosmem;
+				round_pages /= MIGRATE_PAGE_SIZE;
+			}
+
+			t = sw_load_now();
+			if (migrate_send_round(&mc) != 0)
+				goto out;
+			round_ns = MAX(sw_load_now() - t, 1UL);
+		}
+	}
+
+	paused = sw_load_now();
+	if (snapshot_pause(ctx, states, &vioapic) != 0)
+		goto out;
+
+	devfd = memfd_create("acrn_migrate", MFD_CLOEXEC);
+	if (devfd < 0)
+		goto resume;
+	ioreq_emul_lock(true);
+	i = pci_snapshot(ctx, devfd);
+	ioreq_emul_unlock();
+	if (i != 0)
+		goto resume;
+
+	/* the used rings the devices logged when they were saved too */
+	if (live)
+		dirty = migrate_log_read(&mc);
+	else
+		migrate_mark_all(&mc);
+	if ((live && dirty < 0) || migrate_send_round(&mc) != 0 ||
+	    migrate_send_end(&mc) != 0 ||
+	    migrate_send_states(ctx, fd, states, &vioapic, devfd) != 0)
+		goto resume;
+
+	if (migrate_recv(fd, &status, sizeof(status)) != 0) {
+		/* it may run there already, it must not run twice */
+		pr_err("%s: no answer from %s:%s, the VM is left paused\n", __func__, host, port);
+		goto out;
+	}
+	if (status != 0) {
+		pr_err("%s: the VM could not be restored on %s:%s\n", __func__, host, port);
+		goto resume;
+	}
+
+	err = 0;
+	paused = sw_load_now() - paused;
+	migrate_stats(&mc, &pages, &bytes);
+	pr_notice("%s: VM migrated to %s:%s in %lu ms, paused %lu ms, %lu pages in %d rounds, "
+		"%lu MB sent\n", __func__, host, port, (sw_load_now() - start) / 1000000UL,
+		paused / 1000000UL, pages, round + 1, bytes / MB);
+	vm_suspend(ctx, VM_SUSPEND_POWEROFF);
+	goto out;
+
+resume:
+	/* the VM goes on here */
+	snapshot_resume(ctx, states, &vioapic);
+
+out:
+	__atomic_store_n(&migrate_logging, false, __ATOMIC_SEQ_CST);
+	if (devfd >= 0)
+		close(devfd);
+	if (fd >= 0)
+		close(fd);
+	migrate_ctx_free(&mc);
+	free(states);
+	free(dup);
+	return err;
+}
+
+/* Receive the states and the device records sent by migrate_send_states() and set them */
+static int
+migrate_recv_states(struct vmctx *ctx, int fd)
+{
+	struct acrn_vcpu_state *states;
+	struct acrn_vioapic_state vioapic;
+	uint64_t size = 0;
+	char *buf = NULL;
+	int devfd = -1, err = -1;
+
+	states = calloc(ctx->vcpu_num, sizeof(*states));
+	if (states == NULL ||
+	    migrate_recv(fd, states, ctx->vcpu_num * sizeof(*states)) != 0 ||
+	    migrate_recv(fd, &vioapic, sizeof(vioapic)) != 0 ||
+	    migrate_recv(fd, &size, sizeof(size)) != 0)
+		goto out;
+
+	buf = malloc(size);
+	devfd = memfd_create("acrn_migrate", MFD_CLOEXEC);
+	if (buf == NULL || devfd < 0 || migrate_recv(fd, buf, size) != 0 ||
+	    snapshot_write(devfd, buf, size) != 0 || lseek(devfd, 0, SEEK_SET) != 0)
+		goto out;
+
+	if (snapshot_set_states(ctx, states, ctx->vcpu_num, &vioapic) != 0 ||
+	    pci_restore(ctx, devfd) != 0)
+		goto out;
+
+	err = 0;
+
+out:
+	if (devfd >= 0)
+		close(devfd);
+	free(buf);
+	free(states);
+	return err;
+}
+
+int
+vm_incoming(struct vmctx *ctx, const char *spec)
+{
+	struct migrate_ctx mc;
+	struct migrate_header hdr, ref, shdr;
+	uint64_t start, pages, bytes;
+	char *dup, *host, *port;
+	int32_t status = -1;
+	int lfd = -1, fd = -1, i, err = -1;
+
+	bzero(&mc, sizeof(mc));
+	mc.ctx = ctx;
+	dup = strdup(spec);
+	if (dup == NULL || migrate_parse_addr(dup, &host, &port) != 0) {
+		pr_err("%s: invalid address %s, [host:]port\n", __func__, spec);
+		free(dup);
+		return -1;
+	}
+
+	lfd = migrate_listen(host, port);
+	if (lfd < 0 || migrate_mem_regions(&mc) != 0)
+		goto out;
+
+	pr_notice("%s: waiting for the VM on port %s\n", __func__, port);
+	fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0 || migrate_recv(fd, &hdr, sizeof(hdr)) != 0)
+		goto out;
+	migrate_sockopts(fd);
+	start = sw_load_now();
+
+	migrate_header_init(ctx, &ref, hdr.nr_streams);
+	if (memcmp(&hdr, &ref, sizeof(hdr)) != 0 || hdr.nr_streams == 0 ||
+	    hdr.nr_streams > MIGRATE_STREAMS_MAX) {
+		pr_err("%s: the vCPUs or the memory of the VM differ from the source's\n", __func__);
+		migrate_send(fd, &status, sizeof(status), 0);
+		goto out;
+	}
+	if (migrate_streams_init(&mc, hdr.nr_streams) != 0)
+		goto out;
+	status = 0;
+	if (migrate_send(fd, &status, sizeof(status), 0) != 0)
+		goto out;
+	status = -1;
+
+	for (i = 0; i < mc.nr_streams; i++) {
+		mc.streams[i].fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (mc.streams[i].fd < 0 ||
+		    migrate_recv(mc.streams[i].fd, &shdr, sizeof(shdr)) != 0 ||
+		    memcmp(&shdr, &hdr, sizeof(hdr)) != 0) {
+			pr_err("%s: invalid data stream\n", __func__);
+			goto out;
+		}
+		migrate_sockopts(mc.streams[i].fd);
+	}
+
+	/* the guest memory, then the state of the VM */
+	err = 0;
+	for (i = 0; i < mc.nr_streams; i++) {
+		mc.streams[i].err = -1;
+		if (pthread_create(&mc.streams[i].tid, NULL, migrate_recv_thread,
+				&mc.streams[i]) != 0) {
+			err = -1;
+			break;
+		}
+	}
+	while (--i >= 0) {
+		pthread_join(mc.streams[i].tid, NULL);
+		if (mc.streams[i].err != 0)
+			err = -1;
+	}
+	if (err == 0)
+		err = migrate_recv_states(ctx, fd);
+
+	status = err;
+	if (migrate_send(fd, &status, sizeof(status), 0) != 0)
+		err = -1;
+	if (err == 0) {
+		migrate_stats(&mc, &pages, &bytes);
+		pr_notice("%s: VM migrated in %lu ms, %lu pages, %lu MB received\n",
+			__func__, (sw_load_now() - start) / 1000000UL, pages, bytes / MB);
+	}
+
+out:
+	if (fd >= 0)
+		close(fd);
+	if (lfd >= 0)
+		close(lfd);
+	migrate_ctx_free(&mc);
+	free(dup);
+	return err;
+}
@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/queue.h>
 #include <unistd.h>
@@ -24,6 +25,10 @@
 #include "pm.h"
 #include "vmmapi.h"
 #include "log.h"
+#include "io_hotspot.h"
+#include "snapshot.h"
+#include "coredump.h"
+#include "migration.h"
 
 #define INTR_STORM_MONITOR_PERIOD	10 /* 10 seconds */
 #define INTR_STORM_THRESHOLD	100000 /* 10K times per second */
@@ -235,6 +240,8 @@ struct vm_ops {
 
 static unsigned wakeup_reason = 0;
 
+#define ACK_TIMEOUT	1
+
 unsigned get_wakeup_reason(void)
 {
 	return wakeup_reason;
@@ -303,10 +310,120 @@ int monitor_register_vm_ops(struct monitor_vm_ops *mops, void *arg,
 	return 0;
 }
 
+/*
+ * The monitor commands which may take long (a blkrescan of a big disk, a
+ * snapshot, the power state changes) run on the monitor worker, one at a
+ * time in the order they came in. The threads polling the monitor sockets
+ * only queue them, and go on serving the quick ones (query, stats, ...).
+ * The work completes the command itself, usually with the ack.
+ */
+struct monitor_work {
+	void (*fn)(void *arg);
+	void *arg;
+	STAILQ_ENTRY(monitor_work) link;
+};
+
+static STAILQ_HEAD(, monitor_work) monitor_work_head = STAILQ_HEAD_INITIALIZER(monitor_work_head);
+static pthread_mutex_t monitor_work_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t monitor_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t monitor_worker_once = PTHREAD_ONCE_INIT;
+static bool monitor_worker_started;
+
+/* for DM_STATS */
+static unsigned int monitor_work_pending;
+static uint64_t monitor_work_done;
+static time_t monitor_start_time;
+
+static void *monitor_worker(void *arg)
+{
+	struct monitor_work *work;
+
+	for (;;) {
+		pthread_mutex_lock(&monitor_work_mtx);
+		while (STAILQ_EMPTY(&monitor_work_head))
+			pthread_cond_wait(&monitor_work_cond, &monitor_work_mtx);
+		work = STAILQ_FIRST(&monitor_work_head);
+		STAILQ_REMOVE_HEAD(&monitor_work_head, link);
+		pthread_mutex_unlock(&monitor_work_mtx);
+
+		work->fn(work->arg);
+		free(work);
+
+		__atomic_sub_fetch(&monitor_work_pending, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&monitor_work_done, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+static void monitor_worker_start(void)
+{
+	pthread_t tid;
+
+	if (pthread_create(&tid, NULL, monitor_worker, NULL) != 0) {
+		pr_err("%s: fail to create the monitor worker\n", __func__);
+		return;
+	}
+	pthread_setname_np(tid, "monitor_worker");
+	pthread_detach(tid);
+	monitor_worker_started = true;
+}
+
+/*
+ * Run fn(arg) on the monitor worker. Returns -1 if it can't be queued, the
+ * caller runs it itself then.
+ */
+int monitor_queue_work(void (*fn)(void *arg), void *arg)
+{
+	struct monitor_work *work;
+
+	pthread_once(&monitor_worker_once, monitor_worker_start);
+	if (!monitor_worker_started)
+		return -1;
+
+	work = calloc(1, sizeof(*work));
+	if (work == NULL)
+		return -1;
+	work->fn = fn;
+	work->arg = arg;
+
+	__atomic_add_fetch(&monitor_work_pending, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&monitor_work_mtx);
+	STAILQ_INSERT_TAIL(&monitor_work_head, work, link);
+	pthread_cond_signal(&monitor_work_cond);
+	pthread_mutex_unlock(&monitor_work_mtx);
+
+	return 0;
+}
+
+/*
+ * Tell acrnd the VM_SUSPEND_* mode of the VM, so that it does not have to
+ * ask every DM for it. Without acrnd, nothing is sent.
+ */
+void monitor_notify_state(int state)
+{
+	int acrnd_fd;
+	struct mngr_msg req;
+
+	acrnd_fd = mngr_open_un("acrnd", MNGR_CLIENT);
+	if (acrnd_fd < 0)
+		return;
+
+	memset(&req, 0, sizeof(req));
+	req.magic = MNGR_MSG_MAGIC;
+	req.msgid = DM_NOTIFY;
+	req.timestamp = time(NULL);
+	strncpy(req.data.dm_notify.name, vmname,
+			sizeof(req.data.dm_notify.name) - 1);
+	req.data.dm_notify.state = state;
+
+	mngr_send_msg(acrnd_fd, &req, NULL, ACK_TIMEOUT);
+	mngr_close(acrnd_fd);
+}
+
 static int monitor_fd = -1;
 
 /* handlers */
-#define ACK_TIMEOUT	1
 
 #define DEFINE_HANDLER(name, func)				\
 static void name(struct mngr_msg *msg, int client_fd, void *param)	\
@@ -421,6 +538,20 @@ static void handle_query(struct mngr_msg *msg, int client_fd, void *param)
 	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
 }
 
+static void handle_io_hotspots(struct mngr_msg *msg, int client_fd, void *param)
+{
+	struct mngr_msg ack;
+
+	ack.magic = MNGR_MSG_MAGIC;
+	ack.msgid = msg->msgid;
+	ack.timestamp = msg->timestamp;
+	ack.data.io_hotspots.reset = msg->data.io_hotspots.reset;
+
+	io_hotspot_get(&ack.data.io_hotspots, msg->data.io_hotspots.reset != 0);
+
+	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
+}
+
 static void handle_blkrescan(struct mngr_msg *msg, int client_fd, void *param)
 {
 	struct mngr_msg ack;
@@ -450,6 +581,168 @@ static void handle_blkrescan(struct mngr_msg *msg, int client_fd, void *param)
 	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
 }
 
+static void handle_snapshot(struct mngr_msg *msg, int client_fd, void *param)
+{
+	struct vmctx *ctx = param;
+	struct mngr_msg ack;
+
+	ack.magic = MNGR_MSG_MAGIC;
+	ack.msgid = msg->msgid;
+	ack.timestamp = msg->timestamp;
+
+	msg->data.snapshot_path[PARAM_LEN - 1] = '\0';
+	ack.data.err = vm_snapshot(ctx, msg->data.snapshot_path);
+
+	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
+}
+
+static void handle_dump(struct mngr_msg *msg, int client_fd, void *param)
+{
+	struct vmctx *ctx = param;
+	struct mngr_msg ack;
+
+	ack.magic = MNGR_MSG_MAGIC;
+	ack.msgid = msg->msgid;
+	ack.timestamp = msg->timestamp;
+
+	msg->data.snapshot_path[PARAM_LEN - 1] = '\0';
+	ack.data.err = vm_dump(ctx, msg->data.snapshot_path);
+
+	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
+}
+
+static void handle_migrate(struct mngr_msg *msg, int client_fd, void *param)
+{
+	struct vmctx *ctx = param;
+	struct mngr_msg ack;
+
+	ack.magic = MNGR_MSG_MAGIC;
+	ack.msgid = msg->msgid;
+	ack.timestamp = msg->timestamp;
+
+	msg->data.snapshot_path[PARAM_LEN - 1] = '\0';
+	ack.data.err = vm_migrate(ctx, msg->data.snapshot_path);
+
+	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
+}
+
+static void handle_stats(struct mngr_msg *msg, int client_fd, void *param)
+{
+	struct mngr_msg ack;
+	struct dm_stats *stats = &ack.data.stats;
+	struct vmctx *ctx = param;
+	uint64_t ioreqs[DM_STATS_IOREQ_TYPES];
+	struct acrn_vm_rdt_mon mon;
+	size_t shared, released;
+	int i;
+
+	memset(&ack, 0, sizeof(ack));
+	ack.magic = MNGR_MSG_MAGIC;
+	ack.msgid = msg->msgid;
+	ack.timestamp = msg->timestamp;
+
+	/* counters only, nothing is paused or locked for long */
+	stats->uptime = time(NULL) - monitor_start_time;
+	dm_get_ioreq_stats(ioreqs, DM_STATS_IOREQ_TYPES);
+	for (i = 0; i < DM_STATS_IOREQ_TYPES; i++)
+		stats->ioreqs[i] = ioreqs[i];
+	hugetlb_get_stats(ctx, &released, &shared);
+	stats->mem_shared = shared;
+	stats->mem_released = released;
+	stats->cmds_pending = __atomic_load_n(&monitor_work_pending, __ATOMIC_RELAXED);
+	stats->cmds_done = __atomic_load_n(&monitor_work_done, __ATOMIC_RELAXED);
+	if (vm_get_rdt_mon(ctx, &mon) == 0) {
+		stats->rdt_events = mon.events;
+		stats->rmid = mon.rmid;
+		stats->llc_occupancy = mon.llc_occupancy;
+		stats->mbm_total = mon.mbm_total;
+		stats->mbm_local = mon.mbm_local;
+	}
+
+	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
+}
+
+static void handle_latency(struct mngr_msg *msg, int client_fd, void *param)
+{
+	struct mngr_msg ack;
+	struct dm_latency *dl = &ack.data.latency;
+	struct vmctx *ctx = param;
+	struct acrn_vm_latency lat;
+	int i, j;
+
+	memset(&ack, 0, sizeof(ack));
+	ack.magic = MNGR_MSG_MAGIC;
+	ack.msgid = msg->msgid;
+	ack.timestamp = msg->timestamp;
+
+	memset(&lat, 0, sizeof(lat));
+	lat.cmd = msg->data.latency.cmd;
+	dl->cmd = msg->data.latency.cmd;
+	dl->err = vm_latency_probe(ctx, &lat);
+	if (!dl->err) {
+		dl->enabled = lat.enabled;
+		for (i = 0; i < DM_LAT_TYPES; i++) {
+			dl->hist[i].count = lat.hist[i].count;
+			dl->hist[i].sum_ns = lat.hist[i].sum_ns;
+			dl->hist[i].max_ns = lat.hist[i].max_ns;
+			for (j = 0; j < DM_LAT_BUCKETS; j++)
+				dl->hist[i].bucket[j] = lat.hist[i].bucket[j];
+		}
+	}
+
+	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
+}
+
+/*
+ * A command of a mngr client for the monitor worker: the message is copied
+ * and the client fd duplicated, the client may be gone by the time the
+ * handler acks.
+ */
+struct monitor_cmd {
+	void (*handler)(struct mngr_msg *msg, int client_fd, void *param);
+	void *param;
+	struct mngr_msg msg;
+	int client_fd;
+};
+
+static void run_monitor_cmd(void *arg)
+{
+	struct monitor_cmd *cmd = arg;
+
+	cmd->handler(&cmd->msg, cmd->client_fd, cmd->param);
+	close(cmd->client_fd);
+	free(cmd);
+}
+
+/* the mngr handler of the slow commands, param is their struct monitor_cmd template */
+static void queue_monitor_cmd(struct mngr_msg *msg, int client_fd, void *param)
+{
+	const struct monitor_cmd *tmpl = param;
+	struct monitor_cmd *cmd;
+
+	cmd = malloc(sizeof(*cmd));
+	if (cmd != NULL) {
+		*cmd = *tmpl;
+		cmd->msg = *msg;
+		cmd->client_fd = dup(client_fd);
+		if ((cmd->client_fd >= 0) && (monitor_queue_work(run_monitor_cmd, cmd) == 0))
+			return;
+		if (cmd->client_fd >= 0)
+			close(cmd->client_fd);
+		free(cmd);
+	}
+
+	tmpl->handler(msg, client_fd, tmpl->param);
+}
+
+static struct monitor_cmd stop_cmd = { .handler = handle_stop };
+static struct monitor_cmd suspend_cmd = { .handler = handle_suspend };
+static struct monitor_cmd resume_cmd = { .handler = handle_resume };
+static struct monitor_cmd blkrescan_cmd = { .handler = handle_blkrescan };
+static struct monitor_cmd snapshot_cmd = { .handler = handle_snapshot };
+static struct monitor_cmd dump_cmd = { .handler = handle_dump };
+static struct monitor_cmd migrate_cmd = { .handler = handle_migrate };
+
 static struct monitor_vm_ops pmc_ops = {
 	.stop       = NULL,
 	.resume     = vm_monitor_resume,
@@ -484,12 +777,23 @@ int monitor_init(struct vmctx *ctx)
 		goto server_err;
 	}
 
+	monitor_start_time = time(NULL);
+	snapshot_cmd.param = ctx;
+	dump_cmd.param = ctx;
+	migrate_cmd.param = ctx;
+
 	ret = 0;
-	ret += mngr_add_handler(monitor_fd, DM_STOP, handle_stop, NULL);
-	ret += mngr_add_handler(monitor_fd, DM_SUSPEND, handle_suspend, NULL);
-	ret += mngr_add_handler(monitor_fd, DM_RESUME, handle_resume, NULL);
+	ret += mngr_add_handler(monitor_fd, DM_STOP, queue_monitor_cmd, &stop_cmd);
+	ret += mngr_add_handler(monitor_fd, DM_SUSPEND, queue_monitor_cmd, &suspend_cmd);
+	ret += mngr_add_handler(monitor_fd, DM_RESUME, queue_monitor_cmd, &resume_cmd);
 	ret += mngr_add_handler(monitor_fd, DM_QUERY, handle_query, NULL);
-	ret += mngr_add_handler(monitor_fd, DM_BLKRESCAN, handle_blkrescan, NULL);
+	ret += mngr_add_handler(monitor_fd, DM_BLKRESCAN, queue_monitor_cmd, &blkrescan_cmd);
+	ret += mngr_add_handler(monitor_fd, DM_IO_HOTSPOTS, handle_io_hotspots, NULL);
+	ret += mngr_add_handler(monitor_fd, DM_SNAPSHOT, queue_monitor_cmd, &snapshot_cmd);
+	ret += mngr_add_handler(monitor_fd, DM_STATS, handle_stats, ctx);
+	ret += mngr_add_handler(monitor_fd, DM_LATENCY, handle_latency, ctx);
+	ret += mngr_add_handler(monitor_fd, DM_DUMP, queue_monitor_cmd, &dump_cmd);
+	ret += mngr_add_handler(monitor_fd, DM_MIGRATE, queue_monitor_cmd, &migrate_cmd);
 
 	if (ret) {
 		pr_err("%s %d\r\n", __func__, __LINE__);
@@ -500,6 +804,8 @@ int monitor_init(struct vmctx *ctx)
 
 	start_intr_storm_monitor(ctx);
 
+	monitor_notify_state(VM_SUSPEND_NONE);
+
 	return 0;
 
  handlers_err:
@@ -512,8 +818,10 @@ int monitor_init(struct vmctx *ctx)
 
 void monitor_close(void)
 {
-	if (monitor_fd >= 0)
+	if (monitor_fd >= 0) {
 		mngr_close(monitor_fd);
+		monitor_notify_state(VM_SUSPEND_POWEROFF);
+	}
 
 	stop_intr_storm_monitor();
 }
@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * The vCPUs of a User VM are grouped by the host node of their pCPU, a
+ * virtual node per host node. The guest RAM is split between the virtual
+ * nodes in proportion to their vCPUs, in the order of the vCPUs, and
+ * hugetlb.c reserves the huge pages of each part on its host node and binds
+ * the part to it. With --vnuma the guest sees the virtual nodes in its SRAT
+ * and SLIT as well, without it the guest memory is still local to the vCPUs
+ * as long as they are on a single node.
+ *
+ * The Service VM CPU N is assumed to be the pCPU N, as --cpu_affinity does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "dm.h"
+#include "vmmapi.h"
+#include "acpi.h"
+#include "numa.h"
+#include "log.h"
+
+#define NUMA_MAX_VCPUS		64
+#define NUMA_MAX_HOST_NODES	64
+#define NUMA_LOCAL_DISTANCE	10
+#define NUMA_REMOTE_DISTANCE	20
+
+struct vnode {
+	int host_node;
+	int nr_vcpus;
+	int nr_ranges;
+	struct numa_mem_range ranges[2];
+};
+
+static struct vnode vnodes[NUMA_MAX_VNODES];
+static int nr_vnodes;
+static int vcpu_vnodes[NUMA_MAX_VCPUS];
+static int numa_ncpu;
+
+/* the host node of a Service VM CPU, -1 if unknown */
+static int host_node_of_cpu(int cpu)
+{
+	char path[64];
+	struct dirent *entry;
+	DIR *dir;
+	int node = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(path);
+	if (dir == NULL)
+		return -1;
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (sscanf(entry->d_name, "node%d", &node) == 1)
+			break;
+		node = -1;
+	}
+	closedir(dir);
+
+	return node;
+}
+
+/*
+ * Group the vCPUs by the host node of their pCPU. Without a node for each
+ * vCPU the memory is left to the default policy of the Service VM, which is
+ * only an error when the nodes are to be exposed.
+ */
+int numa_init(int ncpu)
+{
+	uint64_t bitmask = vm_get_cpu_affinity_dm();
+	int i, v, pcpu, node;
+
+	nr_vnodes = 0;
+	numa_ncpu = 0;
+	memset(vnodes, 0, sizeof(vnodes));
+
+	if ((bitmask == 0UL) || (ncpu > NUMA_MAX_VCPUS)) {
+		if (vnuma) {
+			pr_err("%s: --vnuma needs the pCPUs of the vCPUs in --cpu_affinity\n", __func__);
+			return -1;
+		}
+		return 0;
+	}
+
+	for (i = 0; i < ncpu; i++) {
+		pcpu = pcpuid_from_vcpuid(bitmask, i);
+		node = (pcpu < 0) ? -1 : host_node_of_cpu(pcpu);
+		if ((node < 0) || (node >= NUMA_MAX_HOST_NODES)) {
+			pr_warn("%s: no host node for pCPU %d, guest memory not placed\n",
+				__func__, pcpu);
+			nr_vnodes = 0;
+			return vnuma ? -1 : 0;
+		}
+
+		for (v = 0; v < nr_vnodes; v++) {
+			if (vnodes[v].host_node == node)
+				break;
+		}
+		if (v == nr_vnodes) {
+			if (nr_vnodes == NUMA_MAX_VNODES) {
+				pr_err("%s: vCPUs on more than %d host nodes\n",
+					__func__, NUMA_MAX_VNODES);
+				nr_vnodes = 0;
+				return -1;
+			}
+			vnodes[v].host_node = node;
+			nr_vnodes++;
+		}
+
+		vnodes[v].nr_vcpus++;
+		vcpu_vnodes[i] = v;
+	}
+	numa_ncpu = ncpu;
+
+	for (v = 0; v < nr_vnodes; v++)
+		pr_info("vnode %d: host node %d, %d vCPUs\n", v,
+			vnodes[v].host_node, vnodes[v].nr_vcpus);
+	if ((nr_vnodes > 1) && !vnuma)
+		pr_notice("the vCPUs span %d host nodes, --vnuma exposes them to the guest\n",
+			nr_vnodes);
+
+	return 0;
+}
+
+/* the RAM offset off, aligned on align within lowmem or highmem */
+static uint64_t align_ram_offset(struct vmctx *ctx, uint64_t off, uint64_t align)
+{
+	if (off <= ctx->lowmem)
+		return MIN(ALIGN_DOWN(off + align / 2, align), ctx->lowmem);
+
+	return ctx->lowmem + MIN(ALIGN_DOWN(off - ctx->lowmem + align / 2, align),
+		ctx->highmem);
+}
+
+static void add_range(struct vnode *vn, uint64_t gpa, uint64_t len)
+{
+	if (len == 0UL)
+		return;
+
+	vn->ranges[vn->nr_ranges].gpa = gpa;
+	vn->ranges[vn->nr_ranges].len = len;
+	vn->nr_ranges++;
+}
+
+/*
+ * Split the guest RAM, lowmem then highmem, between the virtual nodes. The
+ * boundaries are aligned on the largest huge page backing the memory, a
+ * huge page can't be bound to two nodes. Without room for a part per node
+ * the memory is not placed, which is an error with --vnuma.
+ */
+int numa_layout(struct vmctx *ctx, uint64_t align)
+{
+	uint64_t total = ctx->lowmem + ctx->highmem;
+	uint64_t start = 0, end;
+	int v, vcpus = 0;
+	struct vnode *vn;
+
+	for (v = 0; v < nr_vnodes; v++) {
+		vn = &vnodes[v];
+		vcpus += vn->nr_vcpus;
+		end = (v == nr_vnodes - 1) ? total :
+			align_ram_offset(ctx, total * vcpus / numa_ncpu, align);
+		if (end <= start) {
+			pr_warn("%s: 0x%lx of memory is too little for %d nodes, not placed\n",
+				__func__, total, nr_vnodes);
+			nr_vnodes = 0;
+			return vnuma ? -1 : 0;
+		}
+
+		vn->nr_ranges = 0;
+		if (start < ctx->lowmem)
+			add_range(vn, start, MIN(end, ctx->lowmem) - start);
+		if (end > ctx->lowmem)
+			add_range(vn, ctx->highmem_gpa_base + MAX(start, ctx->lowmem) - ctx->lowmem,
+				end - MAX(start, ctx->lowmem));
+		start = end;
+	}
+
+	return 0;
+}
+
+/*
+ * Bind the guest RAM of each virtual node to its host node, once its huge
+ * pages are reserved there and before they are faulted in.
+ */
+void numa_bind_memory(struct vmctx *ctx)
+{
+	unsigned long mask;
+	struct vnode *vn;
+	int v, r;
+
+	for (v = 0; v < nr_vnodes; v++) {
+		vn = &vnodes[v];
+		mask = 1UL << vn->host_node;
+		for (r = 0; r < vn->nr_ranges; r++) {
+			if (syscall(SYS_mbind, ctx->baseaddr + vn->ranges[r].gpa,
+				vn->ranges[r].len, MPOL_BIND, &mask,
+				sizeof(mask) * 8 + 1, 0) != 0)
+				pr_warn("%s: fail to bind gpa 0x%lx to node %d: %s\n",
+					__func__, vn->ranges[r].gpa, vn->host_node,
+					strerror(errno));
+		}
+	}
+}
+
+int numa_nr_vnodes(void)
+{
+	return nr_vnodes;
+}
+
+int numa_host_node(int vnode)
+{
+	return vnodes[vnode].host_node;
+}
+
+int numa_vcpu_vnode(int vcpu_id)
+{
+	return vcpu_vnodes[vcpu_id];
+}
+
+int numa_vnode_ranges(int vnode, struct numa_mem_range *ranges)
+{
+	memcpy(ranges, vnodes[vnode].ranges,
+		vnodes[vnode].nr_ranges * sizeof(struct numa_mem_range));
+
+	return vnodes[vnode].nr_ranges;
+}
+
+/* the distance between two virtual nodes, that of their host nodes */
+int numa_distance(int from, int to)
+{
+	char path[64];
+	FILE *fp;
+	int i, d, dist = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/distance",
+		vnodes[from].host_node);
+	fp = fopen(path, "r");
+	if (fp != NULL) {
+		for (i = 0; i <= vnodes[to].host_node; i++) {
+			if (fscanf(fp, "%d", &d) != 1)
+				break;
+			if (i == vnodes[to].host_node)
+				dist = d;
+		}
+		fclose(fp);
+	}
+
+	if (dist < NUMA_LOCAL_DISTANCE)
+		dist = (from == to) ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+
+	return dist;
+}
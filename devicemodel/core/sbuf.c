@@ -44,6 +44,88 @@ uint32_t sbuf_get(struct shared_buf *sbuf, uint8_t *data)
 	return sbuf->ele_size;
 }
 
+/**
+ * Get the elements buffered in sbuf in place, without consuming them.
+ *
+ * span[0] starts at the head, span[1] at the base of the buffer if the
+ * elements wrap around its end, and is empty otherwise. The elements stay
+ * valid until they are handed back to the producer with sbuf_commit(), so
+ * this is not to be used on a sbuf with OVERWRITE_EN.
+ *
+ * return: the number of bytes buffered, span[0].len + span[1].len.
+ */
+uint32_t sbuf_peek(struct shared_buf *sbuf, struct sbuf_span span[2])
+{
+	uint32_t head, tail;
+	void *base;
+
+	if ((sbuf == NULL) || (span == NULL))
+		return 0;
+
+	head = sbuf->head;
+	tail = sbuf->tail;
+	/* read the elements only after the tail publishing them */
+	mb();
+
+	base = (void *)sbuf + SBUF_HEAD_SIZE;
+	span[0].data = base + head;
+	span[1].data = base;
+	if (tail >= head) {
+		span[0].len = tail - head;
+		span[1].len = 0;
+	} else {
+		span[0].len = sbuf->size - head;
+		span[1].len = tail;
+	}
+
+	return span[0].len + span[1].len;
+}
+
+/**
+ * Consume the first len bytes returned by sbuf_peek(), with a single update
+ * of the head however many elements they hold.
+ *
+ * @pre len <= the bytes returned by the last sbuf_peek()
+ */
+int sbuf_commit(struct shared_buf *sbuf, uint32_t len)
+{
+	if ((sbuf == NULL) || ((len % sbuf->ele_size) != 0U))
+		return -EINVAL;
+
+	/* make sure the elements are read before the producer reuses them */
+	mb();
+
+	sbuf->head = sbuf_next_ptr(sbuf->head, len, sbuf->size);
+
+	return 0;
+}
+
+/**
+ * Copy up to max_num elements to data, data must have room for
+ * max_num * ele_size bytes.
+ *
+ * return: the number of elements got.
+ */
+uint32_t sbuf_get_batch(struct shared_buf *sbuf, uint8_t *data, uint32_t max_num)
+{
+	struct sbuf_span span[2];
+	uint32_t len, first;
+
+	if ((sbuf == NULL) || (data == NULL))
+		return 0;
+
+	len = sbuf_peek(sbuf, span);
+	if (len > max_num * sbuf->ele_size)
+		len = max_num * sbuf->ele_size;
+	first = (len < span[0].len) ? len : span[0].len;
+
+	memcpy(data, span[0].data, first);
+	memcpy(data + first, span[1].data, len - first);
+	sbuf_commit(sbuf, len);
+
+	return len / sbuf->ele_size;
+}
+
 int sbuf_clear_buffered(struct shared_buf *sbuf)
 {
 	if (sbuf == NULL)
@@ -0,0 +1,420 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Snapshot and restore of a User VM
+ *
+ * The monitor asks for a snapshot (DM_SNAPSHOT, "acrnctl snapshot"): the VM
+ * is paused, the state of its vCPUs and of its vIOAPIC is read from the
+ * hypervisor, the PCI devices save theirs (see pci_snapshot()) and the guest
+ * memory is written out, skipping its zero pages. The VM then goes on from
+ * the state just saved: it is reset in the hypervisor and the states are set
+ * back, the devices are not touched.
+ *
+ * A new acrn-dm started with the same command line plus --restore <file>
+ * creates the VM and its devices as usual, but instead of building the guest
+ * tables and loading the software it reads the guest memory back with
+ * sw_load_images(), in parallel, and sets the vIOAPIC, the vCPUs and the
+ * devices to their saved state before the vCPUs start. With --mem_template
+ * the lowmem above MEM_TEMPLATE_BASE and the highmem come from a template the
+ * VMs restored from the same snapshot share copy-on-write, see hugetlb.c:
+ * only the first of them reads it from the snapshot.
+ *
+ * The file:
+ *	struct snapshot_header
+ *	struct acrn_vcpu_state, one per vCPU
+ *	struct acrn_vioapic_state
+ *	the device records, dev_size bytes from dev_off
+ *	the lowmem, the highmem then the biosmem, from mem_off (aligned to
+ *	2MB), the zero pages are holes in the file
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include "dm.h"
+#include "vmmapi.h"
+#include "pci_core.h"
+#include "sw_load.h"
+#include "log.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC		"ACRNSNAP"
+#define SNAPSHOT_VERSION	1U
+#define SNAPSHOT_MEM_ALIGN	(2UL * MB)
+#define SNAPSHOT_PAGE_SIZE	4096UL
+
+struct snapshot_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	nr_vcpus;
+	uint64_t	lowmem;
+	uint64_t	highmem;
+	uint64_t	biosmem;
+	uint64_t	highmem_gpa_base;
+	uint64_t	dev_off;
+	uint64_t	dev_size;
+	uint64_t	mem_off;
+};
+
+/* the regions of the guest memory, in the order of the file */
+struct snapshot_mem {
+	char	*hva;
+	size_t	size;
+};
+
+static int
+snapshot_mem_regions(struct vmctx *ctx, struct snapshot_mem *mem)
+{
+	mem[0] = (struct snapshot_mem) { ctx->baseaddr, ctx->lowmem };
+	mem[1] = (struct snapshot_mem) {
+		ctx->baseaddr + ctx->highmem_gpa_base, ctx->highmem };
+	mem[2] = (struct snapshot_mem) {
+		ctx->baseaddr + 4 * GB - ctx->biosmem, ctx->biosmem };
+
+	return 3;
+}
+
+int
+snapshot_write(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			pr_err("%s: %s\n", __func__, (ret < 0) ? strerror(errno) : "short write");
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+int
+snapshot_read(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = read(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			pr_err("%s: %s\n", __func__, (ret < 0) ? strerror(errno) : "truncated file");
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+int
+snapshot_pwrite(int fd, const char *buf, size_t len, off_t off)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = pwrite(fd, buf, len, off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			pr_err("%s: %s\n", __func__, (ret < 0) ? strerror(errno) : "short write");
+			return -1;
+		}
+		buf += ret;
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static bool
+snapshot_zero_page(const char *page)
+{
+	const uint64_t *p = (const uint64_t *)page;
+	size_t i;
+
+	for (i = 0; i < SNAPSHOT_PAGE_SIZE / sizeof(*p); i++) {
+		if (p[i] != 0)
+			return false;
+	}
+
+	return true;
+}
+
+/* Write the non-zero runs of pages of a region at off, the rest stays a hole */
+int
+snapshot_write_mem(int fd, const char *hva, size_t size, off_t off)
+{
+	size_t start, end;
+
+	for (start = 0; start < size; start = end) {
+		while (start < size && snapshot_zero_page(hva + start))
+			start += SNAPSHOT_PAGE_SIZE;
+		for (end = start; end < size && !snapshot_zero_page(hva + end); )
+			end += SNAPSHOT_PAGE_SIZE;
+		if (end > start &&
+		    snapshot_pwrite(fd, hva + start, end - start, off + start) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Set the saved state of the vIOAPIC and of the launched vCPUs */
+int
+snapshot_set_states(struct vmctx *ctx, struct acrn_vcpu_state *states, int nr,
+		struct acrn_vioapic_state *vioapic)
+{
+	int i;
+
+	if (vm_set_vioapic_state(ctx, vioapic) != 0)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		if (states[i].launched != 0 &&
+		    vm_set_vcpu_state(ctx, &states[i]) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Pause the VM and read the state of its vCPUs and of its vIOAPIC. A paused
+ * VM cannot go on without them, it is restarted if they cannot be read.
+ */
+int
+snapshot_pause(struct vmctx *ctx, struct acrn_vcpu_state *states,
+		struct acrn_vioapic_state *vioapic)
+{
+	int i;
+
+	vm_pause(ctx);
+	vm_clear_ioreq(ctx);
+
+	for (i = 0; i < ctx->vcpu_num; i++) {
+		states[i].vcpu_id = i;
+		if (vm_get_vcpu_state(ctx, &states[i]) != 0)
+			break;
+	}
+	if (i < ctx->vcpu_num || vm_get_vioapic_state(ctx, vioapic) != 0) {
+		pr_err("%s: could not read the state of the VM, restarting it\n", __func__);
+		vm_suspend(ctx, VM_SUSPEND_FULL_RESET);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Let a VM paused by snapshot_pause() go on from the states it read */
+int
+snapshot_resume(struct vmctx *ctx, struct acrn_vcpu_state *states,
+		struct acrn_vioapic_state *vioapic)
+{
+	vm_reset(ctx);
+	if (snapshot_set_states(ctx, states, ctx->vcpu_num, vioapic) != 0) {
+		pr_err("%s: could not set the state of the VM back, restarting it\n", __func__);
+		vm_suspend(ctx, VM_SUSPEND_FULL_RESET);
+		return -1;
+	}
+	vm_run(ctx);
+
+	return 0;
+}
+
+static int
+snapshot_capable(void)
+{
+	if (lapic_pt || trusty_enabled) {
+		pr_err("%s: VMs with LAPIC passthrough or a secure world are not supported\n",
+			__func__);
+		return -1;
+	}
+
+	return pci_snapshot_capable();
+}
+
+int
+vm_snapshot(struct vmctx *ctx, const char *path)
+{
+	struct snapshot_header hdr;
+	struct snapshot_mem mem[3];
+	struct acrn_vcpu_state *states;
+	struct acrn_vioapic_state vioapic;
+	uint64_t start = sw_load_now();
+	off_t off;
+	int fd, i, nr, err = -1;
+
+	if (snapshot_capable() != 0)
+		return -1;
+
+	states = calloc(ctx->vcpu_num, sizeof(*states));
+	if (states == NULL)
+		return -1;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		pr_err("%s: could not create %s (%s)\n", __func__, path, strerror(errno));
+		free(states);
+		return -1;
+	}
+
+	if (snapshot_pause(ctx, states, &vioapic) != 0)
+		goto out;
+
+	bzero(&hdr, sizeof(hdr));
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.nr_vcpus = ctx->vcpu_num;
+	hdr.lowmem = ctx->lowmem;
+	hdr.highmem = ctx->highmem;
+	hdr.biosmem = ctx->biosmem;
+	hdr.highmem_gpa_base = ctx->highmem_gpa_base;
+
+	/* the header is written again once the offsets are known */
+	if (snapshot_write(fd, &hdr, sizeof(hdr)) != 0 ||
+	    snapshot_write(fd, states, ctx->vcpu_num * sizeof(*states)) != 0 ||
+	    snapshot_write(fd, &vioapic, sizeof(vioapic)) != 0)
+		goto resume;
+
+	hdr.dev_off = lseek(fd, 0, SEEK_CUR);
+	ioreq_emul_lock(true);
+	err = pci_snapshot(ctx, fd);
+	ioreq_emul_unlock();
+	if (err != 0)
+		goto resume;
+	err = -1;
+	hdr.dev_size = lseek(fd, 0, SEEK_CUR) - hdr.dev_off;
+
+	hdr.mem_off = roundup(hdr.dev_off + hdr.dev_size, SNAPSHOT_MEM_ALIGN);
+	off = hdr.mem_off;
+	nr = snapshot_mem_regions(ctx, mem);
+	for (i = 0; i < nr; i++) {
+		if (snapshot_write_mem(fd, mem[i].hva, mem[i].size, off) != 0)
+			goto resume;
+		off += mem[i].size;
+	}
+
+	if (ftruncate(fd, off) != 0 ||
+	    snapshot_pwrite(fd, (char *)&hdr, sizeof(hdr), 0) != 0 ||
+	    fdatasync(fd) != 0)
+		goto resume;
+
+	err = 0;
+	pr_notice("%s: VM saved to %s in %lu ms\n", __func__, path,
+		(sw_load_now() - start) / 1000000UL);
+
+resume:
+	/* the VM goes on from the state just saved */
+	if (snapshot_resume(ctx, states, &vioapic) != 0)
+		err = -1;
+
+out:
+	close(fd);
+	if (err != 0)
+		unlink(path);
+	free(states);
+	return err;
+}
+
+int
+vm_restore(struct vmctx *ctx, const char *path)
+{
+	struct snapshot_header hdr;
+	struct snapshot_mem mem[3];
+	struct sw_load_image imgs[3];
+	struct acrn_vcpu_state *states = NULL;
+	struct acrn_vioapic_state vioapic;
+	uint64_t start = sw_load_now();
+	off_t off;
+	size_t size;
+	bool shared;
+	int fd, i, nr, nimgs = 0, err = -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		pr_err("%s: could not open %s (%s)\n", __func__, path, strerror(errno));
+		return -1;
+	}
+
+	if (snapshot_read(fd, &hdr, sizeof(hdr)) != 0)
+		goto out;
+	if (memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != SNAPSHOT_VERSION) {
+		pr_err("%s: %s is not a snapshot of this version\n", __func__, path);
+		goto out;
+	}
+	if (hdr.nr_vcpus != ctx->vcpu_num || hdr.lowmem != ctx->lowmem ||
+	    hdr.highmem != ctx->highmem || hdr.biosmem != ctx->biosmem ||
+	    hdr.highmem_gpa_base != ctx->highmem_gpa_base) {
+		pr_err("%s: the vCPUs or the memory of the VM differ from %s\n", __func__, path);
+		goto out;
+	}
+
+	states = calloc(hdr.nr_vcpus, sizeof(*states));
+	if (states == NULL ||
+	    snapshot_read(fd, states, hdr.nr_vcpus * sizeof(*states)) != 0 ||
+	    snapshot_read(fd, &vioapic, sizeof(vioapic)) != 0)
+		goto out;
+
+	off = hdr.mem_off;
+	nr = snapshot_mem_regions(ctx, mem);
+	shared = hugetlb_template_populated();
+	for (i = 0; i < nr; i++) {
+		size = mem[i].size;
+		/* a populated memory template has the lowmem above MEM_TEMPLATE_BASE and the highmem */
+		if (shared && (i == 0))
+			size = MIN(size, MEM_TEMPLATE_BASE);
+		else if (shared && (i == 1))
+			size = 0;
+
+		if (size > 0) {
+			imgs[nimgs++] = (struct sw_load_image) {
+				.path = path,
+				.fd = fd,
+				.offset = off,
+				.dst = mem[i].hva,
+				.size = size,
+			};
+		}
+		off += mem[i].size;
+	}
+	if ((sw_load_images(imgs, nimgs) != 0) || (hugetlb_seal_template(ctx) != 0))
+		goto out;
+
+	if (snapshot_set_states(ctx, states, hdr.nr_vcpus, &vioapic) != 0)
+		goto out;
+
+	if (lseek(fd, hdr.dev_off, SEEK_SET) != (off_t)hdr.dev_off ||
+	    pci_restore(ctx, fd) != 0)
+		goto out;
+
+	err = 0;
+	pr_notice("%s: VM restored from %s in %lu ms\n", __func__, path,
+		(sw_load_now() - start) / 1000000UL);
+
+out:
+	close(fd);
+	free(states);
+	return err;
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * The phases are timed with CLOCK_MONOTONIC from the start of main(), or from
+ * vm_create() for a VM started again after a reset. The hypervisor times
+ * create_vm, start_vm and the first VM entry from the start of create_vm:
+ * that happens in the VM_CREATE phase, just after it begins, so its times are
+ * placed on the timeline from the beginning of that phase.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <cjson/cJSON.h>
+
+#include "dm.h"
+#include "log.h"
+#include "startup_timeline.h"
+
+struct startup_span {
+	uint64_t begin;		/* ns of CLOCK_MONOTONIC, 0 if the phase did not run */
+	uint64_t end;
+};
+
+static const char *const startup_phase_names[STARTUP_PHASE_COUNT] = {
+	[STARTUP_DM_INIT]	= "dm_init",
+	[STARTUP_VM_CREATE]	= "vm_create",
+	[STARTUP_SETUP_MEMORY]	= "setup_memory",
+	[STARTUP_INIT_VDEVS]	= "init_vdevs",
+	[STARTUP_BUILD_TABLES]	= "build_tables",
+	[STARTUP_SW_LOAD]	= "sw_load",
+	[STARTUP_ADD_CPU]	= "add_cpu",
+};
+
+static pthread_mutex_t startup_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct startup_span startup_spans[STARTUP_PHASE_COUNT];
+
+static uint64_t
+startup_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+void
+startup_phase_begin(enum startup_phase phase)
+{
+	uint64_t now = startup_now();
+	int i;
+
+	pthread_mutex_lock(&startup_mtx);
+	/* a VM started again after a reset gets a new timeline */
+	if (phase == STARTUP_VM_CREATE && startup_spans[STARTUP_VM_CREATE].begin != 0) {
+		for (i = 0; i < STARTUP_PHASE_COUNT; i++)
+			startup_spans[i].begin = startup_spans[i].end = 0;
+	}
+	startup_spans[phase].begin = now;
+	startup_spans[phase].end = 0;
+	pthread_mutex_unlock(&startup_mtx);
+}
+
+void
+startup_phase_end(enum startup_phase phase)
+{
+	uint64_t now = startup_now();
+
+	pthread_mutex_lock(&startup_mtx);
+	startup_spans[phase].end = now;
+	pthread_mutex_unlock(&startup_mtx);
+}
+
+/* called with startup_mtx held */
+static uint64_t
+startup_origin(void)
+{
+	return startup_spans[STARTUP_DM_INIT].begin ? startup_spans[STARTUP_DM_INIT].begin :
+		startup_spans[STARTUP_VM_CREATE].begin;
+}
+
+void
+startup_timeline_log(void)
+{
+	uint64_t origin;
+	int i;
+
+	pthread_mutex_lock(&startup_mtx);
+	origin = startup_origin();
+	for (i = 0; i < STARTUP_PHASE_COUNT; i++) {
+		if (startup_spans[i].begin == 0 || startup_spans[i].end == 0)
+			continue;
+		pr_notice("startup: %-12s at %8lu us took %8lu us\n", startup_phase_names[i],
+			(startup_spans[i].begin - origin) / 1000,
+			(startup_spans[i].end - startup_spans[i].begin) / 1000);
+	}
+	pthread_mutex_unlock(&startup_mtx);
+}
+
+static void
+startup_add_phase(cJSON *phases, const char *name, uint64_t start_us, uint64_t duration_us)
+{
+	cJSON *phase = cJSON_CreateObject();
+
+	if (phase == NULL)
+		return;
+	cJSON_AddStringToObject(phase, "phase", name);
+	cJSON_AddNumberToObject(phase, "start_us", (double)start_us);
+	cJSON_AddNumberToObject(phase, "duration_us", (double)duration_us);
+	cJSON_AddItemToArray(phases, phase);
+}
+
+/*
+ * Adds to event_obj:
+ *	"startup_timeline": {
+ *		"vm_name": ...,
+ *		"phases": [{"phase": ..., "start_us": ..., "duration_us": ...}, ...],
+ *		"total_us": ...
+ *	}
+ * where the phases of the hypervisor are "hv_create_vm", "hv_wait_start"
+ * (until ACRN-DM starts the VM) and "hv_start_vm" (until the first VM entry),
+ * and total_us runs up to the first VM entry.
+ */
+void
+startup_timeline_add_json(cJSON *event_obj, const struct startup_event_data *hv)
+{
+	cJSON *timeline, *phases;
+	uint64_t origin, anchor, total = 0;
+	int i;
+
+	timeline = cJSON_CreateObject();
+	if (timeline == NULL)
+		return;
+	phases = cJSON_CreateArray();
+	if (phases == NULL) {
+		cJSON_Delete(timeline);
+		return;
+	}
+	cJSON_AddStringToObject(timeline, "vm_name", vmname ? vmname : "");
+	cJSON_AddItemToObject(timeline, "phases", phases);
+
+	pthread_mutex_lock(&startup_mtx);
+	origin = startup_origin();
+	for (i = 0; i < STARTUP_PHASE_COUNT; i++) {
+		if (startup_spans[i].begin == 0 || startup_spans[i].end == 0)
+			continue;
+		startup_add_phase(phases, startup_phase_names[i],
+			(startup_spans[i].begin - origin) / 1000,
+			(startup_spans[i].end - startup_spans[i].begin) / 1000);
+		total = (startup_spans[i].end - origin) / 1000;
+	}
+	if (origin != 0) {
+		anchor = (startup_spans[STARTUP_VM_CREATE].begin - origin) / 1000;
+		startup_add_phase(phases, "hv_create_vm", anchor, hv->created_us);
+		startup_add_phase(phases, "hv_wait_start", anchor + hv->created_us,
+			hv->started_us - hv->created_us);
+		startup_add_phase(phases, "hv_start_vm", anchor + hv->started_us,
+			hv->entry_us - hv->started_us);
+		if (anchor + hv->entry_us > total)
+			total = anchor + hv->entry_us;
+	}
+	pthread_mutex_unlock(&startup_mtx);
+
+	cJSON_AddNumberToObject(timeline, "total_us", (double)total);
+	cJSON_AddItemToObject(event_obj, "startup_timeline", timeline);
+}
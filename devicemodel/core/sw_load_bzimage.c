@@ -161,26 +161,19 @@ acrn_parse_ramdisk(char *arg)
 }
 
 static int
-acrn_prepare_ramdisk(struct vmctx *ctx)
+acrn_check_ramdisk(struct vmctx *ctx)
 {
-	FILE *fp;
-	long len;
-	size_t read;
+	size_t len;
 
-	fp = fopen(ramdisk_path, "r");
-	if (fp == NULL) {
+	if (check_image(ramdisk_path, 0, &len) != 0) {
 		pr_err("SW_LOAD ERR: could not open ramdisk file %s\n",
 				ramdisk_path);
 		return -1;
 	}
 
-	fseek(fp, 0, SEEK_END);
-	len = ftell(fp);
-
 	if (len != ramdisk_size) {
 		fprintf(stderr,
 			"SW_LOAD ERR: ramdisk file changed\n");
-		fclose(fp);
 		return -1;
 	}
 
@@ -190,70 +183,69 @@ acrn_prepare_ramdisk(struct vmctx *ctx)
 	if (ctx->lowmem <= (RAMDISK_LOAD_SIZE + 2*KB + KERNEL_LOAD_OFF(ctx))) {
 		pr_err("SW_LOAD ERR: the size of ramdisk file is too big"
 			" file len=0x%lx\n", len);
-		fclose(fp);
-		return -1;
-	}
-
-	fseek(fp, 0, SEEK_SET);
-	read = fread(ctx->baseaddr + RAMDISK_LOAD_OFF(ctx),
-			sizeof(char), len, fp);
-	if (read < len) {
-		pr_err("SW_LOAD ERR: could not read the whole ramdisk file,"
-				" file len=%ld, read %lu\n", len, read);
-		fclose(fp);
 		return -1;
 	}
-	fclose(fp);
-	pr_info("SW_LOAD: ramdisk %s size %lu copied to guest 0x%lx\n",
-			ramdisk_path, ramdisk_size, RAMDISK_LOAD_OFF(ctx));
 
 	return 0;
 }
 
 static int
-acrn_prepare_kernel(struct vmctx *ctx)
+acrn_check_kernel(struct vmctx *ctx)
 {
-	FILE *fp;
-	long len;
-	size_t read;
+	size_t len;
 
-	fp = fopen(kernel_path, "r");
-	if (fp == NULL) {
+	if (check_image(kernel_path, 0, &len) != 0) {
 		pr_err("SW_LOAD ERR: could not open kernel file %s\n",
 				kernel_path);
 		return -1;
 	}
 
-	fseek(fp, 0, SEEK_END);
-	len = ftell(fp);
-
 	if (len != kernel_size) {
 		fprintf(stderr,
 			"SW_LOAD ERR: kernel file changed\n");
-		fclose(fp);
 		return -1;
 	}
 
 	if ((len + KERNEL_LOAD_OFF(ctx)) > RAMDISK_LOAD_OFF(ctx)) {
 		pr_err("SW_LOAD ERR: need big system memory to fit image\n");
-		fclose(fp);
 		return -1;
 	}
 
-	fseek(fp, 0, SEEK_SET);
-	read = fread(ctx->baseaddr + KERNEL_LOAD_OFF(ctx),
-			sizeof(char), len, fp);
-	if (read < len) {
-		pr_err("SW_LOAD ERR: could not read the whole kernel file,"
-				" file len=%ld, read %lu\n", len, read);
-		fclose(fp);
-		return -1;
+	return 0;
+}
+
+/*
+ * The kernel and the ramdisk are read at the same time.
+ */
+static int
+acrn_prepare_images(struct vmctx *ctx)
+{
+	struct sw_load_image imgs[2];
+	int nr = 0;
+
+	if (with_ramdisk) {
+		if (acrn_check_ramdisk(ctx) != 0)
+			return -1;
+		imgs[nr++] = (struct sw_load_image) {
+			.path = ramdisk_path,
+			.fd = -1,
+			.dst = ctx->baseaddr + RAMDISK_LOAD_OFF(ctx),
+			.size = ramdisk_size,
+		};
 	}
-	fclose(fp);
-	pr_info("SW_LOAD: kernel %s size %lu copied to guest 0x%lx\n",
-			kernel_path, kernel_size, KERNEL_LOAD_OFF(ctx));
 
-	return 0;
+	if (with_kernel) {
+		if (acrn_check_kernel(ctx) != 0)
+			return -1;
+		imgs[nr++] = (struct sw_load_image) {
+			.path = kernel_path,
+			.fd = -1,
+			.dst = ctx->baseaddr + KERNEL_LOAD_OFF(ctx),
+			.size = kernel_size,
+		};
+	}
+
+	return (nr > 0) ? sw_load_images(imgs, nr) : 0;
 }
 
 static int
@@ -318,16 +310,11 @@ acrn_sw_load_bzimage(struct vmctx *ctx)
 				BOOTARGS_LOAD_OFF(ctx));
 	}
 
-	if (with_ramdisk) {
-		ret = acrn_prepare_ramdisk(ctx);
-		if (ret)
-			return ret;
-	}
+	ret = acrn_prepare_images(ctx);
+	if (ret)
+		return ret;
 
 	if (with_kernel) {
-		ret = acrn_prepare_kernel(ctx);
-		if (ret)
-			return ret;
 		setup_size = acrn_get_bzimage_setup_size(ctx);
 		if (setup_size <= 0)
 			return -1;
@@ -28,6 +28,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/param.h>
 
 #include "vmmapi.h"
 #include "sw_load.h"
@@ -159,6 +165,166 @@ check_image(char *path, size_t size_limit, size_t *size)
 	return 0;
 }
 
+/*
+ * Image loading
+ *
+ * The images are read straight into the guest memory with pread(): the
+ * images of one load are cut into chunks of SW_LOAD_CHUNK bytes, which a
+ * few threads read in parallel. A kernel and its ramdisk, or the OVMF code
+ * and variables, load at the same time, and the readahead of slow storage
+ * is kept busy on several chunks of a large ramdisk.
+ */
+#define SW_LOAD_CHUNK		(8UL * 1024UL * 1024UL)
+#define SW_LOAD_THREADS		4
+
+struct sw_load_ctx {
+	struct sw_load_image	*imgs;
+	int			nr;
+	uint64_t		start;		/* ns of CLOCK_MONOTONIC */
+	pthread_mutex_t		mtx;		/* protects the 3 fields below */
+	int			cur;		/* image of the next chunk */
+	size_t			off;		/* offset of the next chunk */
+	int			err;
+};
+
+uint64_t
+sw_load_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int
+sw_load_read(int fd, char *dst, size_t len, off_t off)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = pread(fd, dst, len, off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return (ret < 0) ? -errno : -EIO;
+		dst += ret;
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static void *
+sw_load_worker(void *arg)
+{
+	struct sw_load_ctx *lctx = arg;
+	struct sw_load_image *img;
+	size_t off, len;
+	int err;
+
+	for (;;) {
+		pthread_mutex_lock(&lctx->mtx);
+		while (lctx->cur < lctx->nr && lctx->off >= lctx->imgs[lctx->cur].size) {
+			lctx->cur++;
+			lctx->off = 0;
+		}
+		if (lctx->err != 0 || lctx->cur >= lctx->nr) {
+			pthread_mutex_unlock(&lctx->mtx);
+			break;
+		}
+		img = &lctx->imgs[lctx->cur];
+		off = lctx->off;
+		len = MIN(SW_LOAD_CHUNK, img->size - off);
+		lctx->off += len;
+		pthread_mutex_unlock(&lctx->mtx);
+
+		err = sw_load_read(img->fd, (char *)img->dst + off, len,
+				img->offset + off);
+
+		pthread_mutex_lock(&lctx->mtx);
+		if (err != 0 && lctx->err == 0) {
+			lctx->err = err;
+			pr_err("SW_LOAD ERR: could not read %s at 0x%lx (%s)\n",
+				img->path, off, strerror(-err));
+		}
+		img->loaded += len;
+		if (img->loaded == img->size)
+			img->ns = sw_load_now() - lctx->start;
+		pthread_mutex_unlock(&lctx->mtx);
+	}
+
+	return NULL;
+}
+
+/*
+ * Read the nr images into the guest memory, in parallel.
+ *
+ * An image is read from its fd if it is not -1, it is left open, else from
+ * its path, starting at its offset in the file. The time each image took is logged and returned in its ns.
+ */
+int
+sw_load_images(struct sw_load_image *imgs, int nr)
+{
+	struct sw_load_ctx lctx = { .imgs = imgs, .nr = nr };
+	pthread_t tids[SW_LOAD_THREADS];
+	bool opened[nr];
+	size_t nchunks = 0;
+	int i, nthreads, err = 0;
+
+	pthread_mutex_init(&lctx.mtx, NULL);
+	for (i = 0; i < nr; i++) {
+		opened[i] = false;
+		imgs[i].loaded = 0;
+		imgs[i].ns = 0;
+		if (imgs[i].fd < 0) {
+			imgs[i].fd = open(imgs[i].path, O_RDONLY | O_CLOEXEC);
+			if (imgs[i].fd < 0) {
+				pr_err("SW_LOAD ERR: could not open %s (%s)\n",
+					imgs[i].path, strerror(errno));
+				err = -1;
+				break;
+			}
+			opened[i] = true;
+		}
+		posix_fadvise(imgs[i].fd, imgs[i].offset, imgs[i].size,
+			POSIX_FADV_SEQUENTIAL);
+		posix_fadvise(imgs[i].fd, imgs[i].offset, imgs[i].size,
+			POSIX_FADV_WILLNEED);
+		nchunks += howmany(imgs[i].size, SW_LOAD_CHUNK);
+	}
+
+	if (err == 0) {
+		lctx.start = sw_load_now();
+		nthreads = MIN(SW_LOAD_THREADS, nchunks);
+		for (i = 1; i < nthreads; i++) {
+			if (pthread_create(&tids[i], NULL, sw_load_worker, &lctx) != 0)
+				break;
+		}
+		nthreads = i;
+		/* this thread is a worker as well */
+		sw_load_worker(&lctx);
+		for (i = 1; i < nthreads; i++)
+			pthread_join(tids[i], NULL);
+
+		err = (lctx.err != 0) ? -1 : 0;
+		for (i = 0; (err == 0) && (i < nr); i++)
+			pr_info("SW_LOAD: %s size 0x%lx read to %p in %lu us\n",
+				imgs[i].path, imgs[i].size, imgs[i].dst,
+				imgs[i].ns / 1000UL);
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (opened[i]) {
+			close(imgs[i].fd);
+			imgs[i].fd = -1;
+		}
+	}
+	pthread_mutex_destroy(&lctx.mtx);
+
+	return err;
+}
+
 /* Assumption:
  * the range [start, start + size] belongs to one entry of e820 table
  */
@@ -295,14 +461,23 @@ acrn_create_e820_table(struct vmctx *ctx, struct e820_entry *e820)
 int
 acrn_sw_load(struct vmctx *ctx)
 {
+	uint64_t start = sw_load_now();
+	int ret;
+
 	if (vsbl_file_name)
-		return acrn_sw_load_vsbl(ctx);
+		ret = acrn_sw_load_vsbl(ctx);
 	else if ((ovmf_file_name != NULL) ^ (ovmf_code_file_name && ovmf_vars_file_name))
-		return acrn_sw_load_ovmf(ctx);
+		ret = acrn_sw_load_ovmf(ctx);
 	else if (kernel_file_name)
-		return acrn_sw_load_bzimage(ctx);
+		ret = acrn_sw_load_bzimage(ctx);
 	else if (elf_file_name)
-		return acrn_sw_load_elf(ctx);
+		ret = acrn_sw_load_elf(ctx);
 	else
-		return -1;
+		ret = -1;
+
+	if (ret == 0)
+		pr_info("SW_LOAD: software loaded in %lu us\n",
+			(sw_load_now() - start) / 1000UL);
+
+	return ret;
 }
@@ -149,11 +149,11 @@ acrn_parse_ovmf(char *arg)
 static int
 acrn_prepare_ovmf(struct vmctx *ctx)
 {
-	int i, flags, fd;
+	int i, flags, fd, nr = 0, ret = -1;
 	char *path, *addr;
-	size_t size, size_limit, cur_size, read;
+	size_t size, size_limit, cur_size;
 	struct flock fl;
-	FILE *fp;
+	struct sw_load_image imgs[2];
 
 	if (ovmf_file_name) {
 		path = ovmf_file_name;
@@ -174,7 +174,7 @@ acrn_prepare_ovmf(struct vmctx *ctx)
 		if (fd == -1) {
 			pr_err("SW_LOAD ERR: could not open ovmf file: %s (%s)\n",
 				path, strerror(errno));
-			return -1;
+			goto out;
 		}
 
 		/* acquire read lock over the entire file */
@@ -189,18 +189,18 @@ acrn_prepare_ovmf(struct vmctx *ctx)
 				"ovmf file: %s (%s)\n",
 				path, strerror(errno));
 			close(fd);
-			return -1;
+			goto out;
 		}
 
 		if (check_image(path, size_limit, &cur_size) != 0) {
 			close(fd);
-			return -1;
+			goto out;
 		}
 
 		if (cur_size != size) {
 			pr_err("SW_LOAD ERR: ovmf file %s changed\n", path);
 			close(fd);
-			return -1;
+			goto out;
 		}
 
 		if (flags == O_RDWR) {
@@ -216,7 +216,7 @@ acrn_prepare_ovmf(struct vmctx *ctx)
 					"ovmf file: %s (%s)\n",
 					path, strerror(errno));
 				close(fd);
-				return -1;
+				goto out;
 			}
 
 			mmap_vars = mmap(NULL, OVMF_NVSTORAGE_SZ, PROT_WRITE,
@@ -227,32 +227,17 @@ acrn_prepare_ovmf(struct vmctx *ctx)
 					"ovmf file: %s (%s)\n",
 					path, strerror(errno));
 				close(fd);
-				return -1;
+				goto out;
 			}
 		}
 
-		fp = fdopen(fd, "r");
-
-		if (fp == NULL) {
-			pr_err("SW_LOAD ERR: could not fdopen "
-				"ovmf file: %s (%s)\n",
-				path, strerror(errno));
-			close(fd);
-			return -1;
-		}
-
-		fseek(fp, 0, SEEK_SET);
-		read = fread(addr, sizeof(char), size, fp);
-		fclose(fp);
-
-		if (read < size) {
-			pr_err("SW_LOAD ERR: could not read whole partition blob %s\n",
-				path);
-			return -1;
-		}
-
-		pr_info("SW_LOAD: partition blob %s size 0x%lx copied to addr %p\n",
-			path, size, addr);
+		/* the fd stays open, and locked, until the images are read */
+		imgs[nr++] = (struct sw_load_image) {
+			.path = path,
+			.fd = fd,
+			.dst = addr,
+			.size = size,
+		};
 
 		if (!ovmf_file_name) {
 			addr += size;
@@ -264,7 +249,14 @@ acrn_prepare_ovmf(struct vmctx *ctx)
 			break;
 	}
 
-	return 0;
+	/* the variables and the code are read at the same time */
+	ret = sw_load_images(imgs, nr);
+
+out:
+	for (i = 0; i < nr; i++)
+		close(imgs[i].fd);
+
+	return ret;
 }
 
 int
@@ -7,6 +7,7 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/timerfd.h>
 
 #include "vmmapi.h"
@@ -19,30 +20,142 @@
  * Compare with sigevent mechanism, timerfd has a advantage that it could
  * avoid race condition on resource accessing in the async sigev thread.
  *
+ * The acrn_timers of one clock do not have a timerfd each: they are queued
+ * by deadline on a timer base, whose single timerfd is armed at the
+ * earliest deadline. One expiration runs the callbacks of every timer due,
+ * so the DM has one fd and one mevent wakeup for all of its timers instead
+ * of one per timer.
+ *
  * Please note timerfd and epoll are all Linux specific. If the code need to be
  * ported to other OS, we can modify the api with POSIX timers and sigevent
  * mechanism.
  */
 
+struct timer_base {
+	int32_t clockid;
+	int32_t fd;
+	struct mevent *mevp;
+	uint32_t users;			/* acrn_timers initialized on the base */
+	uint64_t armed;			/* deadline the timerfd is armed at, 0 if none */
+	TAILQ_HEAD(, acrn_timer) queue;	/* armed timers, by deadline */
+};
+
+static struct timer_base timer_bases[] = {
+	{ .clockid = CLOCK_REALTIME, .fd = -1 },
+	{ .clockid = CLOCK_MONOTONIC, .fd = -1 },
+};
+
+/* Protects the timer bases and the deadlines of the timers on them */
+static pthread_mutex_t timer_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static struct timer_base *
+timer_get_base(int32_t clockid)
+{
+	struct timer_base *base = NULL;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(timer_bases); i++) {
+		if (timer_bases[i].clockid == clockid) {
+			base = &timer_bases[i];
+			break;
+		}
+	}
+
+	return base;
+}
+
+static inline uint64_t
+ts_to_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * NS_PER_SEC + ts->tv_nsec;
+}
+
+static inline void
+ns_to_ts(uint64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / NS_PER_SEC;
+	ts->tv_nsec = ns % NS_PER_SEC;
+}
+
+static uint64_t
+timer_base_now(struct timer_base *base)
+{
+	struct timespec now;
+
+	clock_gettime(base->clockid, &now);
+	return ts_to_ns(&now);
+}
+
+/*
+ * Arm the timerfd at the earliest deadline, or disarm it.
+ *
+ * @pre timer_mtx is held
+ */
+static void
+timer_base_rearm(struct timer_base *base)
+{
+	struct acrn_timer *first = TAILQ_FIRST(&base->queue);
+	struct itimerspec its = { 0 };
+	uint64_t deadline = (first != NULL) ? first->deadline : 0UL;
+
+	if (deadline != base->armed) {
+		ns_to_ts(deadline, &its.it_value);
+		if (timerfd_settime(base->fd, TFD_TIMER_ABSTIME, &its, NULL) == 0)
+			base->armed = deadline;
+		else
+			pr_err("acrn_timer timerfd settime error");
+	}
+}
+
+/*
+ * @pre timer_mtx is held
+ */
+static void
+timer_base_dequeue(struct timer_base *base, struct acrn_timer *timer)
+{
+	if (timer->queued) {
+		TAILQ_REMOVE(&base->queue, timer, link);
+		timer->queued = false;
+	}
+}
+
+/*
+ * @pre timer_mtx is held
+ */
+static void
+timer_base_enqueue(struct timer_base *base, struct acrn_timer *timer)
+{
+	struct acrn_timer *next;
+
+	timer_base_dequeue(base, timer);
+	TAILQ_FOREACH(next, &base->queue, link) {
+		if (next->deadline > timer->deadline)
+			break;
+	}
+	if (next != NULL)
+		TAILQ_INSERT_BEFORE(next, timer, link);
+	else
+		TAILQ_INSERT_TAIL(&base->queue, timer, link);
+	timer->queued = true;
+}
+
 static void
 timer_handler(int fd __attribute__((unused)),
 		  enum ev_type t __attribute__((unused)),
 		  void *arg)
 {
-	struct acrn_timer *timer = arg;
-	uint64_t nexp;
+	struct timer_base *base = arg;
+	struct acrn_timer *timer;
+	uint64_t nexp, now;
 	ssize_t size;
 	void (*cb)(void *, uint64_t);
-
-	if (timer == NULL) {
-		return;
-	}
+	void *param;
 
 	/* Consume I/O event for default EPOLLLT type.
 	 * Here is a temporary solution, the processing could be moved to
 	 * mevent.c once EVF_TIMER is supported.
 	 */
-	size = read(timer->fd, &nexp, sizeof(nexp));
+	size = read(base->fd, &nexp, sizeof(nexp));
 
 	if (size < 0) {
 		if (errno != EAGAIN) {
@@ -51,59 +164,107 @@ timer_handler(int fd __attribute__((unused)),
 		return;
 	}
 
-	/* check the validity of timer expiration. */
-	if ((size == 0) || (nexp == 0))
-		return;
+	pthread_mutex_lock(&timer_mtx);
+	base->armed = 0UL;
+	/* the timers re-armed by the callbacks to expire already wait for the next round */
+	now = timer_base_now(base);
+	while (((timer = TAILQ_FIRST(&base->queue)) != NULL) && (timer->deadline <= now)) {
+		timer_base_dequeue(base, timer);
+		nexp = 1UL;
+		if (timer->interval != 0UL) {
+			nexp += (now - timer->deadline) / timer->interval;
+			timer->deadline += nexp * timer->interval;
+			timer_base_enqueue(base, timer);
+		}
 
-	if ((cb = timer->callback) != NULL) {
-		(*cb)(timer->callback_param, nexp);
+		cb = timer->callback;
+		param = timer->callback_param;
+		/* the callback may re-arm or stop its own timer */
+		pthread_mutex_unlock(&timer_mtx);
+		if (cb != NULL) {
+			(*cb)(param, nexp);
+		}
+		pthread_mutex_lock(&timer_mtx);
 	}
+	timer_base_rearm(base);
+	pthread_mutex_unlock(&timer_mtx);
 }
 
 int32_t
 acrn_timer_init(struct acrn_timer *timer, void (*cb)(void *, uint64_t),
 		void *param)
 {
+	struct timer_base *base;
+	int32_t ret = 0;
+
 	if ((timer == NULL) || (cb == NULL)) {
 		return -1;
 	}
 
 	timer->fd = -1;
-	if ((timer->clockid == CLOCK_REALTIME) ||
-			(timer->clockid == CLOCK_MONOTONIC)) {
-		timer->fd = timerfd_create(timer->clockid,
-					TFD_NONBLOCK | TFD_CLOEXEC);
-	} else {
+	timer->mevp = NULL;
+	base = timer_get_base(timer->clockid);
+	if (base == NULL) {
 		pr_err("acrn_timer clockid is not supported.\n");
-	}
-
-	if (timer->fd <= 0) {
-		pr_err("acrn_timer create failed.\n");
 		return -1;
 	}
 
-	timer->mevp = mevent_add(timer->fd, EVF_READ, timer_handler, timer, NULL, NULL);
-	if (timer->mevp == NULL) {
-		close(timer->fd);
-		pr_err("acrn_timer mevent add failed.\n");
-		return -1;
+	pthread_mutex_lock(&timer_mtx);
+	if (base->users == 0U) {
+		base->fd = timerfd_create(base->clockid, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (base->fd < 0) {
+			pr_err("acrn_timer create failed.\n");
+			ret = -1;
+		} else {
+			base->mevp = mevent_add(base->fd, EVF_READ, timer_handler, base, NULL, NULL);
+			if (base->mevp == NULL) {
+				close(base->fd);
+				base->fd = -1;
+				pr_err("acrn_timer mevent add failed.\n");
+				ret = -1;
+			} else {
+				base->armed = 0UL;
+				TAILQ_INIT(&base->queue);
+			}
+		}
 	}
 
-	timer->callback = cb;
-	timer->callback_param = param;
+	if (ret == 0) {
+		base->users++;
+		timer->fd = base->fd;
+		timer->mevp = base->mevp;
+		timer->callback = cb;
+		timer->callback_param = param;
+		timer->deadline = 0UL;
+		timer->interval = 0UL;
+		timer->queued = false;
+	}
+	pthread_mutex_unlock(&timer_mtx);
 
-	return 0;
+	return ret;
 }
 
 void
 acrn_timer_deinit(struct acrn_timer *timer)
 {
+	struct timer_base *base;
+
 	if (timer == NULL) {
 		return;
 	}
 
 	if (timer->mevp != NULL) {
-		mevent_delete_close(timer->mevp);
+		base = timer_get_base(timer->clockid);
+		pthread_mutex_lock(&timer_mtx);
+		timer_base_dequeue(base, timer);
+		if (--base->users == 0U) {
+			mevent_delete_close(base->mevp);
+			base->mevp = NULL;
+			base->fd = -1;
+		} else {
+			timer_base_rearm(base);
+		}
+		pthread_mutex_unlock(&timer_mtx);
 		timer->mevp = NULL;
 	}
 
@@ -112,36 +273,70 @@ acrn_timer_deinit(struct acrn_timer *timer)
 	timer->callback_param = NULL;
 }
 
-int32_t
-acrn_timer_settime(struct acrn_timer *timer, const struct itimerspec *new_value)
+static int32_t
+acrn_timer_set(struct acrn_timer *timer, const struct itimerspec *new_value, bool abs)
 {
-	if (timer == NULL) {
+	struct timer_base *base;
+
+	if ((timer == NULL) || (timer->mevp == NULL) || (new_value == NULL) ||
+			(new_value->it_value.tv_nsec < 0) || (new_value->it_value.tv_nsec >= NS_PER_SEC) ||
+			(new_value->it_interval.tv_nsec < 0) || (new_value->it_interval.tv_nsec >= NS_PER_SEC)) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	return timerfd_settime(timer->fd, 0, new_value, NULL);
+	base = timer_get_base(timer->clockid);
+	pthread_mutex_lock(&timer_mtx);
+	if ((new_value->it_value.tv_sec == 0) && (new_value->it_value.tv_nsec == 0)) {
+		timer_base_dequeue(base, timer);
+	} else {
+		timer->deadline = ts_to_ns(&new_value->it_value);
+		if (!abs) {
+			timer->deadline += timer_base_now(base);
+		}
+		timer->interval = ts_to_ns(&new_value->it_interval);
+		timer_base_enqueue(base, timer);
+	}
+	timer_base_rearm(base);
+	pthread_mutex_unlock(&timer_mtx);
+
+	return 0;
+}
+
+int32_t
+acrn_timer_settime(struct acrn_timer *timer, const struct itimerspec *new_value)
+{
+	return acrn_timer_set(timer, new_value, false);
 }
 
 int32_t
 acrn_timer_settime_abs(struct acrn_timer *timer,
 		const struct itimerspec *new_value)
 {
-	if (timer == NULL) {
-		errno = EINVAL;
-		return -1;
-	}
-
-	return timerfd_settime(timer->fd, TFD_TIMER_ABSTIME, new_value, NULL);
+	return acrn_timer_set(timer, new_value, true);
 }
 
 int32_t
 acrn_timer_gettime(struct acrn_timer *timer, struct itimerspec *cur_value)
 {
-	if (timer == NULL) {
+	struct timer_base *base;
+	uint64_t now;
+
+	if ((timer == NULL) || (timer->mevp == NULL) || (cur_value == NULL)) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	return timerfd_gettime(timer->fd, cur_value);
+	base = timer_get_base(timer->clockid);
+	*cur_value = (struct itimerspec){ 0 };
+	pthread_mutex_lock(&timer_mtx);
+	if (timer->queued) {
+		now = timer_base_now(base);
+		/* an expired timer not handled yet has 1ns left, like a timerfd */
+		ns_to_ts((timer->deadline > now) ? (timer->deadline - now) : 1UL, &cur_value->it_value);
+		ns_to_ts(timer->interval, &cur_value->it_interval);
+	}
+	pthread_mutex_unlock(&timer_mtx);
+
+	return 0;
 }
@@ -6,6 +6,8 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
 #include <stdbool.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -23,6 +25,7 @@
 #include <cjson/cJSON.h>
 #include "monitor.h"
 #include "timer.h"
+#include "startup_timeline.h"
 
 #define VM_EVENT_ELE_SIZE (sizeof(struct vm_event))
 
@@ -33,21 +36,40 @@
 
 #define THROTTLE_WINDOW	1U /* time window for throttle counter, in secs*/
 
+#define VM_EVENT_ARENA_SIZE	4096U /* a monitor write, see CLIENT_BUF_LEN */
+
 #define BROKEN_TIME ((time_t)-1)
 
+/*
+ * The JSON text of the events, one object per line, sent to the monitor in
+ * one write per wakeup of the vm_event thread. The buffer is reused and the
+ * events are serialized straight into it, without a cJSON tree.
+ */
+struct vm_event_arena {
+	pthread_mutex_t mtx;
+	size_t len;
+	char buf[VM_EVENT_ARENA_SIZE];
+};
+
 typedef void (*vm_event_handler)(struct vmctx *ctx, struct vm_event *event);
-typedef void (*vm_event_generate_jdata)(cJSON *event_obj, struct vm_event *event);
+typedef bool (*vm_event_generate_jdata)(struct vm_event_arena *arena, struct vm_event *event);
+typedef void (*vm_event_merge)(struct vm_event *pending, struct vm_event *event);
 
 static int epoll_fd;
 static bool started = false;
 static char hv_vm_event_page[4096] __aligned(4096);
 static char dm_vm_event_page[4096] __aligned(4096);
 static pthread_t vm_event_tid;
+static struct vm_event_arena ve_arena = {
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+};
 
 static void general_event_handler(struct vmctx *ctx, struct vm_event *event);
 static void rtc_chg_event_handler(struct vmctx *ctx, struct vm_event *event);
 
-static void gen_rtc_chg_jdata(cJSON *event_obj, struct vm_event *event);
+static bool gen_rtc_chg_jdata(struct vm_event_arena *arena, struct vm_event *event);
+static bool gen_startup_jdata(struct vm_event_arena *arena, struct vm_event *event);
+static void merge_rtc_chg(struct vm_event *pending, struct vm_event *event);
 
 enum event_source_type {
 	EVENT_SOURCE_TYPE_HV,
@@ -63,11 +85,17 @@ struct vm_event_tunnel {
 	bool enabled;
 };
 
+/*
+ * The events over throttle_rate in a window are coalesced into one, emitted
+ * at the end of the window with the number of events it stands for.
+ */
 struct event_throttle_ctl {
 	struct acrn_timer timer;
 	pthread_mutex_t mtx;
 	uint32_t event_counter;
-	uint32_t throttle_count;	/* how many events has been throttled(dropped) */
+	uint32_t throttle_count;	/* how many events has been throttled(coalesced) */
+	uint32_t pending_count;		/* events coalesced into pending in this window */
+	struct vm_event pending;
 	bool	is_up;
 };
 
@@ -76,12 +104,14 @@ struct vm_event_proc {
 	uint32_t	throttle_rate; /* how many events allowed per sec */
 	struct event_throttle_ctl throttle_ctl;
 	vm_event_generate_jdata gen_jdata_handler; /* how to transtfer vm_event data to json txt */
+	vm_event_merge merge_handler;	/* how to coalesce an event into the pending one, the last one wins if NULL */
 };
 
 static struct vm_event_proc ve_proc[VM_EVENT_COUNT] = {
 	[VM_EVENT_RTC_CHG] = {
 		.ve_handler = rtc_chg_event_handler,
 		.gen_jdata_handler = gen_rtc_chg_jdata,
+		.merge_handler = merge_rtc_chg,
 		.throttle_rate = 1,
 	},
 	[VM_EVENT_POWEROFF] = {
@@ -94,6 +124,11 @@ static struct vm_event_proc ve_proc[VM_EVENT_COUNT] = {
 		.gen_jdata_handler = NULL,
 		.throttle_rate = 1,
 	},
+	[VM_EVENT_STARTUP] = {
+		.ve_handler = general_event_handler,
+		.gen_jdata_handler = gen_startup_jdata,
+		.throttle_rate = 1,
+	},
 };
 
 static inline struct vm_event_proc *get_vm_event_proc(struct vm_event *event)
@@ -105,6 +140,82 @@ static inline struct vm_event_proc *get_vm_event_proc(struct vm_event *event)
 	return proc;
 }
 
+/* append to the arena, false if it doesn't fit */
+static bool arena_printf(struct vm_event_arena *arena, const char *fmt, ...)
+{
+	size_t room = sizeof(arena->buf) - arena->len;
+	va_list args;
+	int n;
+
+	va_start(args, fmt);
+	n = vsnprintf(arena->buf + arena->len, room, fmt, args);
+	va_end(args);
+	if (n < 0 || (size_t)n >= room)
+		return false;
+
+	arena->len += n;
+	return true;
+}
+
+static void arena_flush(struct vm_event_arena *arena)
+{
+	if (arena->len != 0) {
+		vm_monitor_send_vm_event(arena->buf);
+		arena->len = 0;
+		arena->buf[0] = '\0';
+	}
+}
+
+/* {"vm_event": type, <event data>[, "coalesced": n]} */
+static bool format_vm_event(struct vm_event_arena *arena, struct vm_event *event, uint32_t coalesced)
+{
+	struct vm_event_proc *proc = get_vm_event_proc(event);
+
+	if (!arena_printf(arena, "{\"vm_event\":%u", event->type))
+		return false;
+	if (proc && proc->gen_jdata_handler && !(proc->gen_jdata_handler)(arena, event))
+		return false;
+	if (coalesced > 1 && !arena_printf(arena, ",\"coalesced\":%u", coalesced))
+		return false;
+
+	return arena_printf(arena, "}\n");
+}
+
+/*
+ * Queue the event for the monitor. The events of the vm_event thread are
+ * sent once it drained the tunnels, those of the timers right away.
+ */
+static void send_vm_event(struct vm_event *event, uint32_t coalesced)
+{
+	struct vm_event_arena *arena = &ve_arena;
+	size_t start;
+
+	pthread_mutex_lock(&arena->mtx);
+	start = arena->len;
+	if (!format_vm_event(arena, event, coalesced)) {
+		/* full, send what is there and try again */
+		arena->len = start;
+		arena->buf[start] = '\0';
+		arena_flush(arena);
+		if (!format_vm_event(arena, event, coalesced)) {
+			pr_err("%s: vm_event %d too large, dropped\n", __func__, event->type);
+			arena->len = 0;
+			arena->buf[0] = '\0';
+		}
+	}
+	if (!started || !pthread_equal(pthread_self(), vm_event_tid))
+		arena_flush(arena);
+	pthread_mutex_unlock(&arena->mtx);
+}
+
+static void flush_vm_events(void)
+{
+	pthread_mutex_lock(&ve_arena.mtx);
+	arena_flush(&ve_arena);
+	pthread_mutex_unlock(&ve_arena.mtx);
+}
+
+/* Whether the event is over the rate of its type, it is then coalesced */
 static bool event_throttle(struct vm_event *event)
 {
 	struct vm_event_proc *proc;
@@ -124,8 +235,11 @@ static bool event_throttle(struct vm_event *event)
 			} else {
 				ret = true;
 				ctl->throttle_count++;
-				pr_notice("event %d throttle: %d dropped\n",
-					event->type, ctl->throttle_count);
+				if (ctl->pending_count == 0 || proc->merge_handler == NULL)
+					ctl->pending = *event;
+				else
+					(proc->merge_handler)(&ctl->pending, event);
+				ctl->pending_count++;
 			}
 			pthread_mutex_unlock(&ctl->mtx);
 		}
@@ -133,12 +247,29 @@ static bool event_throttle(struct vm_event *event)
 	return ret;
 }
 
+/* A new window: the events coalesced in the last one are emitted as one */
 void throttle_timer_cb(void *arg, uint64_t nexp)
 {
 	struct event_throttle_ctl *ctl = (struct event_throttle_ctl *)arg;
+	struct vm_event pending;
+	uint32_t coalesced;
+
 	pthread_mutex_lock(&ctl->mtx);
 	ctl->event_counter = 0;
+	coalesced = ctl->pending_count;
+	if (coalesced != 0) {
+		pending = ctl->pending;
+		ctl->pending_count = 0;
+		/* it takes a slot of the new window */
+		ctl->event_counter = 1;
+	}
 	pthread_mutex_unlock(&ctl->mtx);
+
+	if (coalesced != 0) {
+		pr_notice("event %d throttle: %u coalesced, %u in total\n",
+			pending.type, coalesced, ctl->throttle_count);
+		send_vm_event(&pending, coalesced);
+	}
 }
 
 static void vm_event_throttle_init(struct vmctx *ctx)
@@ -152,6 +283,7 @@ static void vm_event_throttle_init(struct vmctx *ctx)
 		ctl = &ve_proc[i].throttle_ctl;
 		ctl->event_counter = 0U;
 		ctl->throttle_count = 0U;
+		ctl->pending_count = 0U;
 		ctl->is_up = false;
 		pthread_mutex_init(&ctl->mtx, NULL);
 		ctl->timer.clockid = CLOCK_MONOTONIC;
@@ -186,42 +318,10 @@ static void vm_event_throttle_deinit(void)
 	}
 }
 
-static char *generate_vm_event_message(struct vm_event *event)
-{
-	char *event_msg = NULL;
-	cJSON *val;
-	cJSON *event_obj = cJSON_CreateObject();
-	struct vm_event_proc *proc;
-
-	if (event_obj == NULL)
-		return NULL;
-	val = cJSON_CreateNumber(event->type);
-	if (val == NULL)
-		return NULL;
-	cJSON_AddItemToObject(event_obj, "vm_event", val);
-
-	proc = get_vm_event_proc(event);
-	if (proc && proc->gen_jdata_handler) {
-		(proc->gen_jdata_handler)(event_obj, event);
-	}
-
-	event_msg = cJSON_Print(event_obj);
-	if (event_msg == NULL)
-		fprintf(stderr, "Failed to generate vm_event message.\n");
-
-	cJSON_Delete(event_obj);
-
-	return event_msg;
-}
-
 static void emit_vm_event(struct vmctx *ctx, struct vm_event *event)
 {
 	if (!event_throttle(event)) {
-		char *msg = generate_vm_event_message(event);
-		if (msg != NULL) {
-			vm_monitor_send_vm_event(msg);
-			free(msg);
-		}
+		send_vm_event(event, 1);
 	}
 }
 
@@ -230,19 +330,42 @@ static void general_event_handler(struct vmctx *ctx, struct vm_event *event)
 	emit_vm_event(ctx, event);
 }
 
-static void gen_rtc_chg_jdata(cJSON *event_obj, struct vm_event *event)
+static bool gen_rtc_chg_jdata(struct vm_event_arena *arena, struct vm_event *event)
 {
 	struct rtc_change_event_data *data = (struct rtc_change_event_data *)event->event_data;
-	cJSON *val;
 
-	val = cJSON_CreateNumber(data->delta_time);
-	if (val != NULL) {
-		cJSON_AddItemToObject(event_obj, "delta_time", val);
-	}
-	val = cJSON_CreateNumber(data->last_time);
-	if (val != NULL) {
-		cJSON_AddItemToObject(event_obj, "last_time", val);
-	}
+	return arena_printf(arena, ",\"delta_time\":%ld,\"last_time\":%ld",
+		(long)data->delta_time, (long)data->last_time);
+}
+
+/* the RTC changes of a window add up, from the time before the first one */
+static void merge_rtc_chg(struct vm_event *pending, struct vm_event *event)
+{
+	struct rtc_change_event_data *sum = (struct rtc_change_event_data *)pending->event_data;
+	struct rtc_change_event_data *data = (struct rtc_change_event_data *)event->event_data;
+
+	sum->delta_time += data->delta_time;
+}
+
+/* once per VM, the timeline keeps its cJSON tree */
+static bool gen_startup_jdata(struct vm_event_arena *arena, struct vm_event *event)
+{
+	cJSON *event_obj = cJSON_CreateObject();
+	char *text;
+	bool ret = true;
+
+	if (event_obj == NULL)
+		return true;
+
+	startup_timeline_add_json(event_obj, (struct startup_event_data *)event->event_data);
+	text = cJSON_PrintUnformatted(event_obj);
+	/* the members of {...} */
+	if (text != NULL && strlen(text) > 2)
+		ret = arena_printf(arena, ",%.*s", (int)strlen(text) - 2, text + 1);
+	free(text);
+	cJSON_Delete(event_obj);
+
+	return ret;
 }
 
 /* assume we only have one unique rtc source */
@@ -306,7 +429,10 @@ static void rtc_chg_timer_cb(void *arg, uint64_t nexp)
 static void *vm_event_thread(void *param)
 {
 	int n, i;
-	struct vm_event ve;
+	struct vm_event *ve;
+	struct sbuf_span span[2];
+	uint32_t len, off;
+	int s;
 	eventfd_t val;
 	struct vm_event_tunnel *tunnel;
 	struct vmctx *ctx = param;
@@ -326,21 +452,28 @@ static void *vm_event_thread(void *param)
 				tunnel = eventlist[i].data.ptr;
 				eventfd_read(tunnel->kick_fd, &val);
 				if (tunnel && tunnel->enabled) {
-					while (!sbuf_is_empty(tunnel->sbuf)) {
-						struct vm_event_proc *proc;
-						sbuf_get(tunnel->sbuf, (uint8_t*)&ve);
-						pr_dbg("%ld vm event from%d %d\n", val, tunnel->type, ve.type);
-						proc = get_vm_event_proc(&ve);
-						if (proc && proc->ve_handler) {
-							(proc->ve_handler)(ctx, &ve);
-						} else {
-							pr_warn("%s: unhandled vm event type %d\n", __func__, ve.type);
+					/* handle the events in place, and hand them back to the producer at once */
+					while ((len = sbuf_peek(tunnel->sbuf, span)) != 0) {
+						for (s = 0; s < 2; s++) {
+							for (off = 0; off < span[s].len; off += VM_EVENT_ELE_SIZE) {
+								struct vm_event_proc *proc;
+								ve = (struct vm_event *)(span[s].data + off);
+								pr_dbg("%ld vm event from%d %d\n", val, tunnel->type, ve->type);
+								proc = get_vm_event_proc(ve);
+								if (proc && proc->ve_handler) {
+									(proc->ve_handler)(ctx, ve);
+								} else {
+									pr_warn("%s: unhandled vm event type %d\n", __func__, ve->type);
+								}
+							}
 						}
-
+						sbuf_commit(tunnel->sbuf, len);
 					}
 				}
 			}
 		}
+		/* one monitor write for the events of this wakeup */
+		flush_vm_events();
 	}
 	return NULL;
 }
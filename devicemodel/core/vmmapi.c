@@ -201,6 +201,13 @@ vm_create(const char *name, uint64_t req_buf, int *vcpu_num)
 		create_vm.vm_flag |= GUEST_FLAG_IO_COMPLETION_POLLING;
 	}
 
+	/*
+	 * the display refreshes the framebuffers the guest wrote to only, the
+	 * live dumps copy again the pages written to while they copy
+	 */
+	if (gfx_ui || !is_rtvm)
+		create_vm.vm_flag |= GUEST_FLAG_DIRTY_LOG;
+
 	create_vm.ioreq_buf = req_buf;
 	while (retry > 0) {
 		error = ioctl(ctx->fd, ACRN_IOCTL_CREATE_VM, &create_vm);
@@ -216,6 +223,7 @@ vm_create(const char *name, uint64_t req_buf, int *vcpu_num)
 	}
 
 	*vcpu_num = create_vm.vcpu_num;
+	ctx->vcpu_num = create_vm.vcpu_num;
 	ctx->vmid = create_vm.vmid;
 
 	return ctx;
@@ -281,6 +289,41 @@ vm_notify_request_done(struct vmctx *ctx, int vcpu)
 	return error;
 }
 
+int
+vm_notify_request_done_batch(struct vmctx *ctx, uint64_t vcpu_bitmap)
+{
+	int error = 0, vcpu;
+	static bool batch_unsupported = false;
+	struct acrn_ioreq_notify_batch notify;
+
+	if (!batch_unsupported) {
+		bzero(&notify, sizeof(notify));
+		notify.vmid = ctx->vmid;
+		notify.vcpu_bitmap = vcpu_bitmap;
+
+		error = ioctl(ctx->fd, ACRN_IOCTL_NOTIFY_REQUEST_FINISH_BATCH, &notify);
+		if (error == 0)
+			return 0;
+
+		if (errno != ENOTTY) {
+			pr_err("ACRN_IOCTL_NOTIFY_REQUEST_FINISH_BATCH ioctl() returned an error: %s\n",
+				errormsg(errno));
+			return error;
+		}
+
+		/* The HSM doesn't support batched notification, fall back to one by one */
+		pr_info("%s: batched ioreq notification is not supported by HSM\n", __func__);
+		batch_unsupported = true;
+	}
+
+	for (vcpu = 0; vcpu < 64; vcpu++) {
+		if ((vcpu_bitmap & (1UL << vcpu)) != 0UL)
+			error |= vm_notify_request_done(ctx, vcpu);
+	}
+
+	return error;
+}
+
 void
 vm_destroy(struct vmctx *ctx)
 {
@@ -308,6 +351,119 @@ vm_setup_asyncio(struct vmctx *ctx, uint64_t base)
 	return error;
 }
 
+/*
+ * Get the pages of [gpa, gpa + size) written to since the last call, in
+ * bitmap. No error message, it is polled: -1 with errno set.
+ */
+int
+vm_get_dirty_log(struct vmctx *ctx, uint64_t gpa, uint64_t size, uint64_t *bitmap)
+{
+	struct acrn_vm_dirty_log log;
+
+	memset(&log, 0, sizeof(log));
+	log.gpa = gpa;
+	log.size = size;
+	log.bitmap = (uint64_t)bitmap;
+	return ioctl(ctx->fd, ACRN_IOCTL_GET_DIRTY_LOG, &log);
+}
+
+/*
+ * Tell the hypervisor the nr ranges of guest RAM the DM maps on demand, none
+ * if nr is 0. An HSM without the ioctl leaves all the accesses synchronous.
+ */
+int
+vm_set_lazy_memory(struct vmctx *ctx, const vm_paddr_t *gpa, const size_t *len, int nr)
+{
+	struct acrn_vm_lazy_memory lazy_mem;
+	int i, error;
+
+	memset(&lazy_mem, 0, sizeof(lazy_mem));
+	for (i = 0; (i < nr) && (i < ACRN_VM_LAZY_MEMORY_RANGES); i++) {
+		lazy_mem.gpa[i] = gpa[i];
+		lazy_mem.size[i] = len[i];
+	}
+
+	error = ioctl(ctx->fd, ACRN_IOCTL_SET_LAZY_MEMORY, &lazy_mem);
+	if (error && (errno != ENOTTY)) {
+		pr_err("ACRN_IOCTL_SET_LAZY_MEMORY ioctl() returned an error: %s\n", errormsg(errno));
+	}
+
+	return error;
+}
+
+int
+vm_setup_coalesced_mmio(struct vmctx *ctx, uint64_t base)
+{
+	int error;
+
+	error = ioctl(ctx->fd, ACRN_IOCTL_SETUP_COALESCED_MMIO_RING, base);
+	/* an HSM without the ioctl leaves all the MMIO writes synchronous */
+	if (error && (errno != ENOTTY)) {
+		pr_err("ACRN_IOCTL_SETUP_COALESCED_MMIO_RING ioctl() returned an error: %s\n", errormsg(errno));
+	}
+
+	return error;
+}
+
+int
+vm_add_coalesced_mmio(struct vmctx *ctx, uint64_t addr, uint32_t len)
+{
+	struct acrn_coalesced_mmio_zone zone = { .addr = addr, .len = len };
+	int error;
+
+	error = ioctl(ctx->fd, ACRN_IOCTL_ADD_COALESCED_MMIO, &zone);
+	if (error) {
+		pr_err("ACRN_IOCTL_ADD_COALESCED_MMIO ioctl() returned an error: %s\n", errormsg(errno));
+	}
+
+	return error;
+}
+
+int
+vm_remove_coalesced_mmio(struct vmctx *ctx, uint64_t addr, uint32_t len)
+{
+	struct acrn_coalesced_mmio_zone zone = { .addr = addr, .len = len };
+	int error;
+
+	error = ioctl(ctx->fd, ACRN_IOCTL_REMOVE_COALESCED_MMIO, &zone);
+	if (error) {
+		pr_err("ACRN_IOCTL_REMOVE_COALESCED_MMIO ioctl() returned an error: %s\n", errormsg(errno));
+	}
+
+	return error;
+}
+
+int
+vm_set_tsc_counter(struct vmctx *ctx, struct acrn_tsc_counter *counter)
+{
+	int error;
+
+	error = ioctl(ctx->fd, ACRN_IOCTL_SET_TSC_COUNTER, counter);
+	/* an HSM without the ioctl leaves the counter reads to the device model */
+	if (error && (errno != ENOTTY)) {
+		pr_err("ACRN_IOCTL_SET_TSC_COUNTER ioctl() returned an error: %s\n", errormsg(errno));
+	}
+
+	return error;
+}
+
+/*
+ * Issue the hypercalls of mc in one go, their results are in mc->entries[].
+ * The params are the ones of the hypercalls, HSM passes them as they are.
+ */
+int
+vm_multicall(struct vmctx *ctx, struct acrn_multicall *mc)
+{
+	int error;
+
+	error = ioctl(ctx->fd, ACRN_IOCTL_MULTICALL, mc);
+	if (error) {
+		pr_err("ACRN_IOCTL_MULTICALL ioctl() returned an error: %s\n", errormsg(errno));
+	}
+
+	return error;
+}
+
 int
 vm_parse_memsize(const char *optarg, size_t *ret_memsize)
 {
@@ -368,6 +524,23 @@ vm_map_memseg_vma(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
 	return error;
 }
 
+int
+vm_unmap_memseg(struct vmctx *ctx, vm_paddr_t gpa, size_t len)
+{
+	struct acrn_vm_memmap memmap;
+	int error;
+	bzero(&memmap, sizeof(struct acrn_vm_memmap));
+	/* the HSM only unmaps segments of the MMIO type, the EPT doesn't tell them apart */
+	memmap.type = ACRN_MEMMAP_MMIO;
+	memmap.len = len;
+	memmap.user_vm_pa = gpa;
+	error = ioctl(ctx->fd, ACRN_IOCTL_UNSET_MEMSEG, &memmap);
+	if (error) {
+		pr_err("ACRN_IOCTL_UNSET_MEMSEG ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
 int
 vm_setup_memory(struct vmctx *ctx, size_t memsize)
 {
@@ -419,6 +592,10 @@ vm_unsetup_memory(struct vmctx *ctx)
  *
  * In particular return NULL if [gaddr, gaddr+len) falls in guest MMIO region.
  * The instruction emulation code depends on this behavior.
+ *
+ * The range may be written through the pointer, by the DM or by a system
+ * call: the pages of it shared with a memory template get their private copy
+ * first.
  */
 void *
 vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len)
@@ -427,7 +604,8 @@ vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len)
 	if (ctx->lowmem > 0) {
 		if (gaddr < ctx->lowmem && len <= ctx->lowmem &&
 		    gaddr + len <= ctx->lowmem)
-			return (ctx->baseaddr + gaddr);
+			return (hugetlb_unshare_memory(ctx, gaddr, len) == 0) ?
+				(ctx->baseaddr + gaddr) : NULL;
 	}
 
 	if (ctx->highmem > 0) {
@@ -435,7 +613,8 @@ vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len)
 			if (gaddr < ctx->highmem_gpa_base + ctx->highmem &&
 			    len <= ctx->highmem &&
 			    gaddr + len <= ctx->highmem_gpa_base + ctx->highmem)
-				return (ctx->baseaddr + gaddr);
+				return (hugetlb_unshare_memory(ctx, gaddr, len) == 0) ?
+					(ctx->baseaddr + gaddr) : NULL;
 		}
 	}
 
@@ -653,6 +832,29 @@ vm_remove_hv_vdev(struct vmctx *ctx, struct acrn_vdev *dev)
 	return error;
 }
 
+int
+vm_add_vdev_cfg_shadow(struct vmctx *ctx, struct acrn_vdev_cfg_shadow *shadow)
+{
+	int error;
+	error = ioctl(ctx->fd, ACRN_IOCTL_ADD_VDEV_CFG_SHADOW, shadow);
+	/* an HSM without the ioctl leaves all the configuration accesses to us */
+	if (error && (errno != ENOTTY)) {
+		pr_err("ACRN_IOCTL_ADD_VDEV_CFG_SHADOW ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
+int
+vm_remove_vdev_cfg_shadow(struct vmctx *ctx, struct acrn_vdev_cfg_shadow *shadow)
+{
+	int error;
+	error = ioctl(ctx->fd, ACRN_IOCTL_REMOVE_VDEV_CFG_SHADOW, shadow);
+	if (error) {
+		pr_err("ACRN_IOCTL_REMOVE_VDEV_CFG_SHADOW ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
 int
 vm_set_ptdev_intx_info(struct vmctx *ctx, uint16_t virt_bdf, uint16_t phys_bdf,
 		       int virt_pin, int phys_pin, bool pic_pin)
@@ -705,6 +907,80 @@ vm_set_vcpu_regs(struct vmctx *ctx, struct acrn_vcpu_regs *vcpu_regs)
 	return error;
 }
 
+int
+vm_get_vcpu_state(struct vmctx *ctx, struct acrn_vcpu_state *state)
+{
+	int error;
+	error = ioctl(ctx->fd, ACRN_IOCTL_GET_VCPU_STATE, state);
+	if (error) {
+		pr_err("ACRN_IOCTL_GET_VCPU_STATE ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
+int
+vm_set_vcpu_state(struct vmctx *ctx, struct acrn_vcpu_state *state)
+{
+	int error;
+	error = ioctl(ctx->fd, ACRN_IOCTL_SET_VCPU_STATE, state);
+	if (error) {
+		pr_err("ACRN_IOCTL_SET_VCPU_STATE ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
+int
+vm_get_vioapic_state(struct vmctx *ctx, struct acrn_vioapic_state *state)
+{
+	int error;
+	error = ioctl(ctx->fd, ACRN_IOCTL_GET_VIOAPIC_STATE, state);
+	if (error) {
+		pr_err("ACRN_IOCTL_GET_VIOAPIC_STATE ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
+int
+vm_set_vioapic_state(struct vmctx *ctx, struct acrn_vioapic_state *state)
+{
+	int error;
+	error = ioctl(ctx->fd, ACRN_IOCTL_SET_VIOAPIC_STATE, state);
+	if (error) {
+		pr_err("ACRN_IOCTL_SET_VIOAPIC_STATE ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
+/* polled by the stats of acrnctl, not logged: the HSM may not have it */
+int
+vm_get_rdt_mon(struct vmctx *ctx, struct acrn_vm_rdt_mon *mon)
+{
+	return ioctl(ctx->fd, ACRN_IOCTL_GET_VM_RDT_MON, mon);
+}
+
+int
+vm_latency_probe(struct vmctx *ctx, struct acrn_vm_latency *lat)
+{
+	int error;
+	error = ioctl(ctx->fd, ACRN_IOCTL_VM_LATENCY_PROBE, lat);
+	if (error) {
+		pr_err("ACRN_IOCTL_VM_LATENCY_PROBE ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
+int
+vm_get_vcpu_sched_stats(struct vmctx *ctx, struct acrn_vcpu_sched_stats *stats)
+{
+	return ioctl(ctx->fd, ACRN_IOCTL_GET_VCPU_SCHED_STATS, stats);
+}
+
+int
+vm_get_vcpu_exit_stats(struct vmctx *ctx, struct acrn_vcpu_exit_stats *stats)
+{
+	return ioctl(ctx->fd, ACRN_IOCTL_GET_VCPU_EXIT_STATS, stats);
+}
+
 int
 vm_get_cpu_state(struct vmctx *ctx, void *state_buf)
 {
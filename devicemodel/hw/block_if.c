@@ -30,8 +30,12 @@
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
 #include <linux/falloc.h>
 #include <linux/fs.h>
+#include <linux/io_uring.h>
 #include <errno.h>
 #include <err.h>
 #include <fcntl.h>
@@ -44,8 +48,11 @@
 
 #include "dm.h"
 #include "block_if.h"
+#include "block_sparse.h"
 #include "ahci.h"
 #include "dm_string.h"
+#include "iothread.h"
+#include "vmmapi.h"
 #include "log.h"
 
 /*
@@ -62,10 +69,33 @@
 
 #define BLOCKIF_SIG	0xb109b109
 
-#define BLOCKIF_NUMTHR	8
-#define BLOCKIF_MAXREQ	(64 + BLOCKIF_NUMTHR)
+/*
+ * Default and maximum number of worker threads and of queued requests, per
+ * disk. A disk takes up to <queue depth> + <worker threads> requests.
+ */
+#define BLOCKIF_NUMTHR		8
+#define BLOCKIF_NUMTHR_MAX	64
+#define BLOCKIF_QDEPTH		64
+#define BLOCKIF_QDEPTH_MAX	1024
+
+/* Limits of a batch of contiguous requests merged into one preadv/pwritev */
+#define BLOCKIF_MERGE_IOV_MAX	(4 * BLOCKIF_IOV_MAX)
+#define BLOCKIF_MERGE_SIZE_MAX	(1 << 20)
+
+/* Upper bound of the O_DIRECT alignment probed on regular files */
+#define BLOCKIF_DIO_ALIGN_MAX	4096
 #define MAX_DISCARD_SEGMENT	256
 
+/*
+ * With the io_uring engine every request takes at most two SQEs (a write and
+ * its linked fsync in writethru mode). The guest memory is registered in
+ * chunks of at most 1GB, the per buffer limit of the kernel.
+ */
+#define BLOCKIF_URING_BUFS_MAX	64
+#define BLOCKIF_URING_BUF_SIZE	(1UL << 30)
+/* Tags the user_data of the fsync linked to a write, elements are aligned */
+#define BLOCKIF_URING_SYNC_TAG	1UL
+
 /*
  * Debug printf
  */
@@ -80,6 +110,18 @@ enum blockop {
 	BOP_DISCARD
 };
 
+enum blockif_aio {
+	BLOCKIF_AIO_THREADS,
+	BLOCKIF_AIO_IO_URING
+};
+
+/* the disks with no backing file, for the benchmarks of the virtio datapath */
+enum blockif_synth {
+	BLOCKIF_SYNTH_NONE,
+	BLOCKIF_SYNTH_NULL,	/* null:<size>, the data is discarded, reads leave the buffers alone */
+	BLOCKIF_SYNTH_RAM	/* ram:<size>, the data is kept in anonymous memory */
+};
+
 enum blockstat {
 	BST_FREE,
 	BST_BLOCK,
@@ -95,6 +137,74 @@ struct blockif_elem {
 	enum blockstat	     status;
 	pthread_t            tid;
 	off_t		     block;
+	int		     pending;	/* CQEs still expected, io_uring only */
+	int		     err;
+	struct blockif_elem *merge_next;	/* next request of a merged batch */
+};
+
+/* Aligned buffer of a worker thread for the misaligned O_DIRECT requests */
+struct blockif_bounce {
+	void			*buf;
+	size_t			size;
+};
+
+struct blockif_uring {
+	int			fd;
+	int			evfd;
+	unsigned int		sq_entries;
+	unsigned int		sq_mask;
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_array;
+	unsigned int		sqe_tail;	/* next SQE to fill */
+	struct io_uring_sqe	*sqes;
+	unsigned int		cq_mask;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	struct io_uring_cqe	*cqes;
+	void			*sq_ring;
+	size_t			sq_ring_sz;
+	void			*cq_ring;
+	size_t			cq_ring_sz;
+	size_t			sqes_sz;
+	bool			fixed_file;
+	struct iovec		bufs[BLOCKIF_URING_BUFS_MAX];
+	int			nbufs;
+	pthread_mutex_t		cq_mtx;		/* serializes the reapers */
+	struct iothread_mevent	aevt;
+};
+
+/*
+ * A submission queue of a disk, with its own request elements, lock and
+ * workers, so that the queues of a multiqueue device don't contend.
+ */
+struct blockif_queue {
+	struct blockif_ctxt	*bc;
+	int			closing;
+	int			numthr;
+	pthread_t		*btid;
+	pthread_mutex_t		mtx;
+	pthread_cond_t		cond;
+
+	/* Request elements and free/pending/busy queues */
+	TAILQ_HEAD(, blockif_elem) freeq;
+	TAILQ_HEAD(, blockif_elem) pendq;
+	TAILQ_HEAD(, blockif_elem) busyq;
+	TAILQ_HEAD(, blockif_elem) uringq;	/* submitted to the io_uring */
+	struct blockif_elem	*reqs;
+
+	/*
+	 * io_uring engine: reads, writes and flushes are submitted to the ring
+	 * straight from blockif_request() and completed from the iothread, the
+	 * worker thread only handles discards, the rejected writes and the
+	 * O_DIRECT requests needing a bounce buffer.
+	 */
+	struct blockif_uring	*uring;
+	struct iothread_ctx	*ioctx;		/* reaps the io_uring */
+
+	/* requests accepted, under mtx, see blockif_get_stats() */
+	uint64_t		ops[BOP_DISCARD + 1];
+	uint64_t		bytes[BOP_WRITE + 1];
 };
 
 struct blockif_ctxt {
@@ -112,16 +222,17 @@ struct blockif_ctxt {
 	int			max_discard_sectors;
 	int			max_discard_seg;
 	int			discard_sector_alignment;
-	int			closing;
-	pthread_t		btid[BLOCKIF_NUMTHR];
-	pthread_mutex_t		mtx;
-	pthread_cond_t		cond;
-
-	/* Request elements and free/pending/busy queues */
-	TAILQ_HEAD(, blockif_elem) freeq;
-	TAILQ_HEAD(, blockif_elem) pendq;
-	TAILQ_HEAD(, blockif_elem) busyq;
-	struct blockif_elem	reqs[BLOCKIF_MAXREQ];
+	int			direct;		/* opened with O_DIRECT */
+	int			merge;		/* merge contiguous requests */
+	int			dio_align;	/* offset/memory alignment of O_DIRECT */
+	int			maxreq;		/* request elements per queue */
+	struct sparse_image	*sparse;	/* NULL for raw images */
+	enum blockif_synth	synth;		/* fd is -1 unless BLOCKIF_SYNTH_NONE */
+	char			*ram;		/* the contents of a BLOCKIF_SYNTH_RAM disk */
+
+	/* The submission queues, blockif_req.qidx selects one */
+	int			nqueues;
+	struct blockif_queue	*queues;
 
 	/* write cache enable */
 	uint8_t			wce;
@@ -150,7 +261,7 @@ blockif_flush_cache(struct blockif_ctxt *bc)
 	int err;
 
 	err = 0;
-	if (!bc->wce) {
+	if (!bc->wce && bc->fd >= 0) {
 		if (fsync(bc->fd))
 			err = errno;
 	}
@@ -158,19 +269,19 @@ blockif_flush_cache(struct blockif_ctxt *bc)
 }
 
 static int
-blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
+blockif_enqueue(struct blockif_queue *bq, struct blockif_req *breq,
 		enum blockop op)
 {
 	struct blockif_elem *be, *tbe;
 	off_t off;
 	int i;
 
-	be = TAILQ_FIRST(&bc->freeq);
+	be = TAILQ_FIRST(&bq->freeq);
 	if (be == NULL || be->status != BST_FREE) {
 		WPRINTF(("%s: failed to get element from freeq\n", __func__));
 		return 0;
 	}
-	TAILQ_REMOVE(&bc->freeq, be, link);
+	TAILQ_REMOVE(&bq->freeq, be, link);
 	be->req = breq;
 	be->op = op;
 	switch (op) {
@@ -186,12 +297,12 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 		off = 1 << (sizeof(off_t) - 1);
 	}
 	be->block = off;
-	TAILQ_FOREACH(tbe, &bc->pendq, link) {
+	TAILQ_FOREACH(tbe, &bq->pendq, link) {
 		if (tbe->block == breq->offset)
 			break;
 	}
 	if (tbe == NULL) {
-		TAILQ_FOREACH(tbe, &bc->busyq, link) {
+		TAILQ_FOREACH(tbe, &bq->busyq, link) {
 			if (tbe->block == breq->offset)
 				break;
 		}
@@ -200,46 +311,46 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 		be->status = BST_PEND;
 	else
 		be->status = BST_BLOCK;
-	TAILQ_INSERT_TAIL(&bc->pendq, be, link);
+	TAILQ_INSERT_TAIL(&bq->pendq, be, link);
 	return (be->status == BST_PEND);
 }
 
 static int
-blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
+blockif_dequeue(struct blockif_queue *bq, pthread_t t, struct blockif_elem **bep)
 {
 	struct blockif_elem *be;
 
-	TAILQ_FOREACH(be, &bc->pendq, link) {
+	TAILQ_FOREACH(be, &bq->pendq, link) {
 		if (be->status == BST_PEND)
 			break;
 	}
 	if (be == NULL)
 		return 0;
-	TAILQ_REMOVE(&bc->pendq, be, link);
+	TAILQ_REMOVE(&bq->pendq, be, link);
 	be->status = BST_BUSY;
 	be->tid = t;
-	TAILQ_INSERT_TAIL(&bc->busyq, be, link);
+	TAILQ_INSERT_TAIL(&bq->busyq, be, link);
 	*bep = be;
 	return 1;
 }
 
 static void
-blockif_complete(struct blockif_ctxt *bc, struct blockif_elem *be)
+blockif_complete(struct blockif_queue *bq, struct blockif_elem *be)
 {
 	struct blockif_elem *tbe;
 
 	if (be->status == BST_DONE || be->status == BST_BUSY)
-		TAILQ_REMOVE(&bc->busyq, be, link);
+		TAILQ_REMOVE(&bq->busyq, be, link);
 	else
-		TAILQ_REMOVE(&bc->pendq, be, link);
-	TAILQ_FOREACH(tbe, &bc->pendq, link) {
+		TAILQ_REMOVE(&bq->pendq, be, link);
+	TAILQ_FOREACH(tbe, &bq->pendq, link) {
 		if (tbe->req->offset == be->block)
 			tbe->status = BST_PEND;
 	}
 	be->tid = 0;
 	be->status = BST_FREE;
 	be->req = NULL;
-	TAILQ_INSERT_TAIL(&bc->freeq, be, link);
+	TAILQ_INSERT_TAIL(&bq->freeq, be, link);
 }
 
 static int
@@ -300,7 +411,11 @@ blockif_process_discard(struct blockif_ctxt *bc, struct blockif_req *br)
 		segment = 1;
 	}
 	for (i = 0; i < segment; i++) {
-		if (bc->isblk) {
+		if (bc->synth != BLOCKIF_SYNTH_NONE) {
+			if (bc->ram != NULL)
+				madvise(bc->ram + arg[i][0], arg[i][1], MADV_DONTNEED);
+			err = 0;
+		} else if (bc->isblk) {
 			err = ioctl(bc->fd, BLKDISCARD, arg[i]);
 		} else {
 			/* FALLOC_FL_PUNCH_HOLE:
@@ -326,19 +441,251 @@ blockif_process_discard(struct blockif_ctxt *bc, struct blockif_req *br)
 	return 0;
 }
 
+/*
+ * With O_DIRECT, the file offset and every guest buffer of a request have to
+ * be aligned to bc->dio_align, otherwise it goes through a bounce buffer.
+ */
+static bool
+blockif_dio_aligned(struct blockif_ctxt *bc, struct blockif_req *br)
+{
+	uintptr_t mask;
+	int i;
+
+	if (!bc->direct)
+		return true;
+
+	mask = bc->dio_align - 1;
+	if ((br->offset + bc->sub_file_start_lba) & mask)
+		return false;
+	for (i = 0; i < br->iovcnt; i++) {
+		if (((uintptr_t)br->iov[i].iov_base | br->iov[i].iov_len) & mask)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Read or write a misaligned O_DIRECT request through the bounce buffer of the
+ * worker, grown on demand. The guests see a logical block size of at least
+ * bc->dio_align, so normally only the guest buffers are misaligned; a write
+ * with a misaligned offset or size becomes a read-modify-write of the blocks
+ * at both ends. Returns the number of bytes of the request transferred.
+ */
+static ssize_t
+blockif_bounce_rw(struct blockif_ctxt *bc, struct blockif_req *br,
+		struct blockif_bounce *bb, bool write)
+{
+	off_t off, astart;
+	size_t mask, head, total, alen, done, n;
+	ssize_t len;
+	void *buf;
+	int i;
+
+	total = 0;
+	for (i = 0; i < br->iovcnt; i++)
+		total += br->iov[i].iov_len;
+
+	mask = bc->dio_align - 1;
+	off = br->offset + bc->sub_file_start_lba;
+	astart = off & ~(off_t)mask;
+	head = off - astart;
+	alen = (head + total + mask) & ~mask;
+	if (alen == 0)
+		return 0;
+
+	if (bb->size < alen) {
+		if (posix_memalign(&buf, bc->dio_align, alen) != 0) {
+			errno = ENOMEM;
+			return -1;
+		}
+		free(bb->buf);
+		bb->buf = buf;
+		bb->size = alen;
+	}
+
+	if (write) {
+		if (head != 0 || alen != total) {
+			memset(bb->buf, 0, alen);
+			if (pread(bc->fd, bb->buf, alen, astart) < 0)
+				return -1;
+		}
+		for (i = 0, done = head; i < br->iovcnt; i++) {
+			memcpy((char *)bb->buf + done, br->iov[i].iov_base,
+				br->iov[i].iov_len);
+			done += br->iov[i].iov_len;
+		}
+		len = pwrite(bc->fd, bb->buf, alen, astart);
+		if (len < 0)
+			return -1;
+		return ((size_t)len > head) ? MIN((size_t)len - head, total) : 0;
+	}
+
+	len = pread(bc->fd, bb->buf, alen, astart);
+	if (len < 0)
+		return -1;
+	n = ((size_t)len > head) ? MIN((size_t)len - head, total) : 0;
+	for (i = 0, done = 0; i < br->iovcnt && done < n; i++) {
+		memcpy(br->iov[i].iov_base, (char *)bb->buf + head + done,
+			MIN(br->iov[i].iov_len, n - done));
+		done += MIN(br->iov[i].iov_len, n - done);
+	}
+	return n;
+}
+
+/*
+ * Elevator stage: once a worker has dequeued a read or write, it also takes
+ * the queued requests of the same type continuing it on disk, typically the
+ * small sequential requests serialized by blockif_enqueue(), up to the iovec
+ * and size limits. The caller holds bq->mtx.
+ */
+static void
+blockif_merge(struct blockif_queue *bq, struct blockif_elem *be, pthread_t t)
+{
+	struct blockif_ctxt *bc = bq->bc;
+	struct blockif_elem *last, *tbe;
+	off_t size;
+	int iovcnt;
+
+	be->merge_next = NULL;
+	if ((be->op != BOP_READ && be->op != BOP_WRITE) ||
+			!blockif_dio_aligned(bc, be->req))
+		return;
+
+	last = be;
+	iovcnt = be->req->iovcnt;
+	size = be->block - be->req->offset;
+	for (;;) {
+		TAILQ_FOREACH(tbe, &bq->pendq, link) {
+			if (tbe->op == be->op && tbe->req->offset == last->block)
+				break;
+		}
+		if (tbe == NULL || !blockif_dio_aligned(bc, tbe->req) ||
+				iovcnt + tbe->req->iovcnt > BLOCKIF_MERGE_IOV_MAX ||
+				size + (tbe->block - tbe->req->offset) > BLOCKIF_MERGE_SIZE_MAX)
+			break;
+
+		TAILQ_REMOVE(&bq->pendq, tbe, link);
+		tbe->status = BST_BUSY;
+		tbe->tid = t;
+		tbe->merge_next = NULL;
+		TAILQ_INSERT_TAIL(&bq->busyq, tbe, link);
+		iovcnt += tbe->req->iovcnt;
+		size += tbe->block - tbe->req->offset;
+		last->merge_next = tbe;
+		last = tbe;
+	}
+}
+
+/* the I/O of the synthetic disks, stopping at the end of the disk like a file */
+static ssize_t
+blockif_synth_rw(struct blockif_ctxt *bc, const struct iovec *iov, int iovcnt,
+		off_t offset, bool write)
+{
+	ssize_t done = 0;
+	size_t n;
+	int i;
+
+	for (i = 0; i < iovcnt && offset < bc->size; i++) {
+		n = MIN(iov[i].iov_len, (size_t)(bc->size - offset));
+		if (bc->ram != NULL) {
+			if (write)
+				memcpy(bc->ram + offset, iov[i].iov_base, n);
+			else
+				memcpy(iov[i].iov_base, bc->ram + offset, n);
+		}
+		offset += n;
+		done += n;
+	}
+
+	return done;
+}
+
+static ssize_t
+blockif_preadv(struct blockif_ctxt *bc, const struct iovec *iov, int iovcnt,
+		off_t offset)
+{
+	if (bc->synth != BLOCKIF_SYNTH_NONE)
+		return blockif_synth_rw(bc, iov, iovcnt, offset, false);
+	if (bc->sparse)
+		return sparse_preadv(bc->sparse, iov, iovcnt, offset);
+	return preadv(bc->fd, iov, iovcnt, offset + bc->sub_file_start_lba);
+}
+
+static ssize_t
+blockif_pwritev(struct blockif_ctxt *bc, const struct iovec *iov, int iovcnt,
+		off_t offset)
+{
+	if (bc->synth != BLOCKIF_SYNTH_NONE)
+		return blockif_synth_rw(bc, iov, iovcnt, offset, true);
+	if (bc->sparse)
+		return sparse_pwritev(bc->sparse, iov, iovcnt, offset);
+	return pwritev(bc->fd, iov, iovcnt, offset + bc->sub_file_start_lba);
+}
+
+/* Process a merged batch with one syscall and complete each of its requests */
 static void
-blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
+blockif_proc_merged(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct iovec iov[BLOCKIF_MERGE_IOV_MAX];
+	struct blockif_elem *tbe;
+	struct blockif_req *br;
+	ssize_t len, n;
+	int iovcnt, err;
+
+	iovcnt = 0;
+	for (tbe = be; tbe != NULL; tbe = tbe->merge_next) {
+		br = tbe->req;
+		memcpy(&iov[iovcnt], br->iov, br->iovcnt * sizeof(struct iovec));
+		iovcnt += br->iovcnt;
+	}
+
+	err = 0;
+	if (be->op == BOP_READ)
+		len = blockif_preadv(bc, iov, iovcnt, be->req->offset);
+	else if (bc->rdonly) {
+		len = -1;
+		errno = EROFS;
+	} else
+		len = blockif_pwritev(bc, iov, iovcnt, be->req->offset);
+	if (len < 0)
+		err = errno;
+	else if (be->op == BOP_WRITE)
+		err = blockif_flush_cache(bc);
+
+	for (tbe = be; tbe != NULL; tbe = tbe->merge_next) {
+		br = tbe->req;
+		if (len > 0) {
+			n = MIN(len, tbe->block - br->offset);
+			br->resid -= n;
+			len -= n;
+		}
+		tbe->status = BST_DONE;
+		(*br->callback)(br, err);
+	}
+}
+
+static void
+blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be,
+		struct blockif_bounce *bb)
 {
 	struct blockif_req *br;
 	ssize_t len;
 	int err;
 
+	if (be->merge_next != NULL) {
+		blockif_proc_merged(bc, be);
+		return;
+	}
+
 	br = be->req;
 	err = 0;
 	switch (be->op) {
 	case BOP_READ:
-		len = preadv(bc->fd, br->iov, br->iovcnt,
-				 br->offset + bc->sub_file_start_lba);
+		if (!blockif_dio_aligned(bc, br))
+			len = blockif_bounce_rw(bc, br, bb, false);
+		else
+			len = blockif_preadv(bc, br->iov, br->iovcnt,
+					br->offset);
 		if (len < 0)
 			err = errno;
 		else
@@ -350,8 +697,11 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
 			break;
 		}
 
-		len = pwritev(bc->fd, br->iov, br->iovcnt,
-				  br->offset + bc->sub_file_start_lba);
+		if (!blockif_dio_aligned(bc, br))
+			len = blockif_bounce_rw(bc, br, bb, true);
+		else
+			len = blockif_pwritev(bc, br->iov, br->iovcnt,
+					br->offset);
 		if (len < 0)
 			err = errno;
 		else {
@@ -360,7 +710,7 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
 		}
 		break;
 	case BOP_FLUSH:
-		if (fsync(bc->fd))
+		if (bc->fd >= 0 && fsync(bc->fd))
 			err = errno;
 		break;
 	case BOP_DISCARD:
@@ -379,33 +729,392 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
 static void *
 blockif_thr(void *arg)
 {
-	struct blockif_ctxt *bc;
-	struct blockif_elem *be;
+	struct blockif_queue *bq;
+	struct blockif_elem *be, *next;
+	struct blockif_bounce bb = { NULL, 0 };
 	pthread_t t;
 
-	bc = arg;
+	bq = arg;
 	t = pthread_self();
 
-	pthread_mutex_lock(&bc->mtx);
+	pthread_mutex_lock(&bq->mtx);
 
 	for (;;) {
-		while (blockif_dequeue(bc, t, &be)) {
-			pthread_mutex_unlock(&bc->mtx);
-			blockif_proc(bc, be);
-			pthread_mutex_lock(&bc->mtx);
-			blockif_complete(bc, be);
+		while (blockif_dequeue(bq, t, &be)) {
+			if (bq->bc->merge)
+				blockif_merge(bq, be, t);
+			else
+				be->merge_next = NULL;
+			pthread_mutex_unlock(&bq->mtx);
+			blockif_proc(bq->bc, be, &bb);
+			pthread_mutex_lock(&bq->mtx);
+			for (; be != NULL; be = next) {
+				next = be->merge_next;
+				be->merge_next = NULL;
+				blockif_complete(bq, be);
+			}
 		}
 		/* Check ctxt status here to see if exit requested */
-		if (bc->closing)
+		if (bq->closing)
 			break;
-		pthread_cond_wait(&bc->cond, &bc->mtx);
+		pthread_cond_wait(&bq->cond, &bq->mtx);
 	}
 
-	pthread_mutex_unlock(&bc->mtx);
+	pthread_mutex_unlock(&bq->mtx);
+	free(bb.buf);
 	pthread_exit(NULL);
 	return NULL;
 }
 
+static int
+blockif_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+		unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, NULL, 0);
+}
+
+static int
+blockif_uring_register(int fd, unsigned int opcode, const void *arg,
+		unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Get the next free SQE, the caller holds bq->mtx. The SQEs become visible to
+ * the kernel in blockif_uring_submit().
+ */
+static struct io_uring_sqe *
+blockif_uring_get_sqe(struct blockif_uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head, idx;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sqe_tail - head >= ring->sq_entries)
+		return NULL;
+
+	idx = ring->sqe_tail & ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[idx] = idx;
+	ring->sqe_tail++;
+	return sqe;
+}
+
+/*
+ * Submit the SQEs filled since the last submission, the caller holds bq->mtx.
+ * On failure nothing has been consumed by the kernel and the SQEs are dropped.
+ */
+static int
+blockif_uring_submit(struct blockif_uring *ring)
+{
+	unsigned int tail, n;
+	int ret;
+
+	tail = *ring->sq_tail;
+	n = ring->sqe_tail - tail;
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+	do {
+		ret = blockif_uring_enter(ring->fd, n, 0, 0);
+	} while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+	if (ret < 0) {
+		ret = errno;
+		WPRINTF(("%s: io_uring_enter failed, errno %d\n", __func__, ret));
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+		ring->sqe_tail = tail;
+		return ret;
+	}
+	return 0;
+}
+
+static void
+blockif_uring_set_file(struct blockif_queue *bq, struct io_uring_sqe *sqe)
+{
+	if (bq->uring->fixed_file) {
+		sqe->fd = 0;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	} else
+		sqe->fd = bq->bc->fd;
+}
+
+/*
+ * Return the registered buffer covering the data of \p br, or -1. Only single
+ * segment requests can use READ_FIXED/WRITE_FIXED.
+ */
+static int
+blockif_uring_buf_index(struct blockif_uring *ring, struct blockif_req *br)
+{
+	uintptr_t start, end, base;
+	int i;
+
+	if (br->iovcnt != 1)
+		return -1;
+
+	start = (uintptr_t)br->iov[0].iov_base;
+	end = start + br->iov[0].iov_len;
+	for (i = 0; i < ring->nbufs; i++) {
+		base = (uintptr_t)ring->bufs[i].iov_base;
+		if (start >= base && end <= base + ring->bufs[i].iov_len)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Submit a read, write or flush to the io_uring, the caller holds bq->mtx and
+ * has checked that freeq is not empty.
+ */
+static int
+blockif_uring_request(struct blockif_queue *bq, struct blockif_req *breq,
+		enum blockop op)
+{
+	struct blockif_uring *ring = bq->uring;
+	struct io_uring_sqe *sqe;
+	struct blockif_elem *be;
+	int idx, err;
+
+	be = TAILQ_FIRST(&bq->freeq);
+	TAILQ_REMOVE(&bq->freeq, be, link);
+	be->req = breq;
+	be->op = op;
+	be->status = BST_BUSY;
+	be->pending = 0;
+	be->err = 0;
+
+	/* the ring has two SQEs for every element */
+	sqe = blockif_uring_get_sqe(ring);
+	if (op == BOP_FLUSH) {
+		sqe->opcode = IORING_OP_FSYNC;
+	} else {
+		idx = blockif_uring_buf_index(ring, breq);
+		if (idx >= 0) {
+			sqe->opcode = (op == BOP_READ) ?
+				IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+			sqe->addr = (uintptr_t)breq->iov[0].iov_base;
+			sqe->len = breq->iov[0].iov_len;
+			sqe->buf_index = idx;
+		} else {
+			sqe->opcode = (op == BOP_READ) ?
+				IORING_OP_READV : IORING_OP_WRITEV;
+			sqe->addr = (uintptr_t)breq->iov;
+			sqe->len = breq->iovcnt;
+		}
+		sqe->off = breq->offset + bq->bc->sub_file_start_lba;
+	}
+	blockif_uring_set_file(bq, sqe);
+	sqe->user_data = (uintptr_t)be;
+	be->pending++;
+
+	/* writethru: the fsync only starts once the write has completed */
+	if (op == BOP_WRITE && !bq->bc->wce) {
+		sqe->flags |= IOSQE_IO_LINK;
+		sqe = blockif_uring_get_sqe(ring);
+		sqe->opcode = IORING_OP_FSYNC;
+		blockif_uring_set_file(bq, sqe);
+		sqe->user_data = (uintptr_t)be | BLOCKIF_URING_SYNC_TAG;
+		be->pending++;
+	}
+
+	err = blockif_uring_submit(ring);
+	if (err) {
+		be->status = BST_FREE;
+		be->req = NULL;
+		TAILQ_INSERT_TAIL(&bq->freeq, be, link);
+	} else
+		TAILQ_INSERT_TAIL(&bq->uringq, be, link);
+
+	return err;
+}
+
+/*
+ * Reap the CQEs and complete the requests they finish, the caller holds
+ * ring->cq_mtx.
+ */
+static void
+blockif_uring_reap(struct blockif_queue *bq)
+{
+	struct blockif_uring *ring = bq->uring;
+	struct io_uring_cqe *cqe;
+	struct blockif_elem *be;
+	struct blockif_req *br;
+	unsigned int head, tail;
+	uint64_t data;
+	int res;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		cqe = &ring->cqes[head & ring->cq_mask];
+		data = cqe->user_data;
+		res = cqe->res;
+		head++;
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+		/* the IORING_OP_ASYNC_CANCEL requests carry no element */
+		if (data == 0)
+			continue;
+
+		be = (struct blockif_elem *)(uintptr_t)(data & ~BLOCKIF_URING_SYNC_TAG);
+		br = be->req;
+		if (res < 0) {
+			/* the first error wins over the -ECANCELED of the linked fsync */
+			if (be->err == 0)
+				be->err = -res;
+		} else if ((data & BLOCKIF_URING_SYNC_TAG) == 0 && be->op != BOP_FLUSH)
+			br->resid -= res;
+
+		if (--be->pending > 0)
+			continue;
+
+		be->status = BST_DONE;
+		(*br->callback)(br, be->err);
+
+		pthread_mutex_lock(&bq->mtx);
+		TAILQ_REMOVE(&bq->uringq, be, link);
+		be->status = BST_FREE;
+		be->req = NULL;
+		TAILQ_INSERT_TAIL(&bq->freeq, be, link);
+		pthread_mutex_unlock(&bq->mtx);
+
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	}
+}
+
+/* iothread handler of the eventfd signaled on every CQE */
+static void
+blockif_uring_complete(void *arg)
+{
+	struct blockif_queue *bq = arg;
+
+	pthread_mutex_lock(&bq->uring->cq_mtx);
+	blockif_uring_reap(bq);
+	pthread_mutex_unlock(&bq->uring->cq_mtx);
+}
+
+static void
+blockif_uring_unmap(struct blockif_uring *ring)
+{
+	if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_sz);
+	if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+	if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_sz);
+}
+
+static int
+blockif_uring_init(struct blockif_queue *bq)
+{
+	struct io_uring_params p;
+	struct blockif_uring *ring;
+
+	ring = calloc(1, sizeof(struct blockif_uring));
+	if (ring == NULL) {
+		WPRINTF(("%s: calloc returns NULL\n", __func__));
+		return -1;
+	}
+	ring->evfd = -1;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, 2 * bq->bc->maxreq, &p);
+	if (ring->fd < 0) {
+		WPRINTF(("%s: io_uring_setup failed, errno %d\n", __func__, errno));
+		free(ring);
+		return -1;
+	}
+
+	ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+			ring->sqes == MAP_FAILED) {
+		WPRINTF(("%s: failed to map the io_uring\n", __func__));
+		goto err;
+	}
+
+	ring->sq_entries = p.sq_entries;
+	ring->sq_mask = *(unsigned int *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_head = (unsigned int *)((char *)ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)((char *)ring->sq_ring + p.sq_off.tail);
+	ring->sq_array = (unsigned int *)((char *)ring->sq_ring + p.sq_off.array);
+	ring->sqe_tail = *ring->sq_tail;
+	ring->cq_mask = *(unsigned int *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+	ring->cq_head = (unsigned int *)((char *)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)((char *)ring->cq_ring + p.cq_off.tail);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+
+	ring->fixed_file = (blockif_uring_register(ring->fd,
+				IORING_REGISTER_FILES, &bq->bc->fd, 1) == 0);
+
+	ring->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring->evfd < 0 || blockif_uring_register(ring->fd,
+				IORING_REGISTER_EVENTFD, &ring->evfd, 1) < 0) {
+		WPRINTF(("%s: failed to set up the completion eventfd\n", __func__));
+		goto err;
+	}
+
+	pthread_mutex_init(&ring->cq_mtx, NULL);
+	ring->aevt.run = blockif_uring_complete;
+	ring->aevt.arg = bq;
+	ring->aevt.fd = ring->evfd;
+	bq->uring = ring;
+	if (iothread_add(bq->ioctx, ring->evfd, &ring->aevt) < 0) {
+		bq->uring = NULL;
+		pthread_mutex_destroy(&ring->cq_mtx);
+		goto err;
+	}
+
+	return 0;
+err:
+	if (ring->evfd >= 0)
+		close(ring->evfd);
+	blockif_uring_unmap(ring);
+	close(ring->fd);
+	free(ring);
+	return -1;
+}
+
+static void
+blockif_uring_deinit(struct blockif_queue *bq)
+{
+	struct blockif_uring *ring = bq->uring;
+	bool busy;
+
+	iothread_del(bq->ioctx, ring->evfd);
+
+	/* Wait for the requests in flight, nothing can be submitted anymore */
+	pthread_mutex_lock(&ring->cq_mtx);
+	for (;;) {
+		pthread_mutex_lock(&bq->mtx);
+		busy = !TAILQ_EMPTY(&bq->uringq);
+		pthread_mutex_unlock(&bq->mtx);
+		if (!busy)
+			break;
+		if (blockif_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+				errno != EINTR)
+			break;
+		blockif_uring_reap(bq);
+	}
+	pthread_mutex_unlock(&ring->cq_mtx);
+
+	bq->uring = NULL;
+	pthread_mutex_destroy(&ring->cq_mtx);
+	close(ring->evfd);
+	blockif_uring_unmap(ring);
+	close(ring->fd);
+	free(ring);
+}
+
 static void
 blockif_sigcont_handler(int signal)
 {
@@ -440,6 +1149,32 @@ blockif_init(void)
 	signal(SIGCONT, blockif_sigcont_handler);
 }
 
+/*
+ * The O_DIRECT alignment of \p fd: the logical block size of a block device,
+ * and for a regular file the smallest size of an aligned read that the file
+ * system accepts.
+ */
+static int
+blockif_dio_align(int fd)
+{
+	void *buf;
+	ssize_t ret;
+	int align;
+
+	if (ioctl(fd, BLKSSZGET, &align) == 0 && align > 0)
+		return align;
+
+	for (align = DEV_BSIZE; align < BLOCKIF_DIO_ALIGN_MAX; align <<= 1) {
+		if (posix_memalign(&buf, align, align) != 0)
+			break;
+		ret = pread(fd, buf, align, 0);
+		free(buf);
+		if (ret >= 0 || errno != EINVAL)
+			return align;
+	}
+	return BLOCKIF_DIO_ALIGN_MAX;
+}
+
 /*
  * This function checks if the sub file range, specified by sub_start and
  * sub_size, has any overlap with other sub file ranges with write access.
@@ -487,10 +1222,133 @@ sub_file_unlock(struct blockif_ctxt *bc)
 }
 
 
-struct blockif_ctxt *
-blockif_open(const char *optstr, const char *ident)
+static int
+blockif_queue_init(struct blockif_queue *bq, struct blockif_ctxt *bc, int qidx,
+		int numthr, enum blockif_aio aio, struct iothread_ctx *ioctx,
+		const char *ident)
 {
 	char tname[MAXCOMLEN + 1];
+	int i;
+
+	bq->bc = bc;
+	bq->ioctx = ioctx;
+	bq->reqs = calloc(bc->maxreq, sizeof(struct blockif_elem));
+	bq->btid = calloc(numthr, sizeof(pthread_t));
+	if (bq->reqs == NULL || bq->btid == NULL) {
+		pr_err("calloc");
+		free(bq->reqs);
+		free(bq->btid);
+		return -1;
+	}
+
+	pthread_mutex_init(&bq->mtx, NULL);
+	pthread_cond_init(&bq->cond, NULL);
+	TAILQ_INIT(&bq->freeq);
+	TAILQ_INIT(&bq->pendq);
+	TAILQ_INIT(&bq->busyq);
+	TAILQ_INIT(&bq->uringq);
+	for (i = 0; i < bc->maxreq; i++) {
+		bq->reqs[i].status = BST_FREE;
+		TAILQ_INSERT_HEAD(&bq->freeq, &bq->reqs[i], link);
+	}
+
+	bq->numthr = numthr;
+	if (aio == BLOCKIF_AIO_IO_URING) {
+		if (blockif_uring_init(bq) == 0)
+			bq->numthr = 1;
+		else
+			pr_err("blockif: io_uring unavailable, using threads\n");
+	}
+
+	for (i = 0; i < bq->numthr; i++) {
+		if (snprintf(tname, sizeof(tname), "blk-%s-%d",
+					ident, qidx * bq->numthr + i) >= sizeof(tname)) {
+			pr_err("blk thread name too long");
+		}
+		pthread_create(&bq->btid[i], NULL, blockif_thr, bq);
+		pthread_setname_np(bq->btid[i], tname);
+	}
+
+	return 0;
+}
+
+static void
+blockif_queue_deinit(struct blockif_queue *bq)
+{
+	void *jval;
+	int i;
+
+	/*
+	 * Stop the block i/o thread
+	 */
+	pthread_mutex_lock(&bq->mtx);
+	bq->closing = 1;
+	pthread_cond_broadcast(&bq->cond);
+	pthread_mutex_unlock(&bq->mtx);
+
+	for (i = 0; i < bq->numthr; i++)
+		pthread_join(bq->btid[i], &jval);
+
+	if (bq->uring)
+		blockif_uring_deinit(bq);
+
+	/* XXX Cancel queued i/o's ??? */
+
+	free(bq->reqs);
+	free(bq->btid);
+}
+
+/* <n>[K|M|G|T], in bytes */
+static int
+blockif_parse_size(const char *str, off_t *size)
+{
+	char *end;
+	long val;
+	int shift;
+
+	if (dm_strtol(str, &end, 10, &val))
+		return -1;
+
+	switch (*end) {
+	case '\0':
+		shift = 0;
+		break;
+	case 'K':
+	case 'k':
+		shift = 10;
+		break;
+	case 'M':
+	case 'm':
+		shift = 20;
+		break;
+	case 'G':
+	case 'g':
+		shift = 30;
+		break;
+	case 'T':
+	case 't':
+		shift = 40;
+		break;
+	default:
+		return -1;
+	}
+	if ((*end != '\0' && end[1] != '\0') || val <= 0 || val > (LONG_MAX >> shift))
+		return -1;
+
+	*size = (off_t)val << shift;
+	return 0;
+}
+
+/*
+ * Open the backing file of a disk with \p queue_num submission queues. The
+ * io_uring of queue n, if any, is reaped by iothread n % iothreads->num, or by
+ * the default iothread if \p iothreads is NULL.
+ */
+struct blockif_ctxt *
+blockif_open(const char *optstr, const char *ident, int queue_num,
+		struct iothreads_info *iothreads)
+{
+	struct iothread_ctx *ioctx;
 	/* char name[MAXPATHLEN]; */
 	char *nopt, *xopts, *cp;
 	struct blockif_ctxt *bc;
@@ -506,6 +1364,14 @@ blockif_open(const char *optstr, const char *ident)
 	int sub_file_assign;
 	int max_discard_sectors, max_discard_seg, discard_sector_alignment;
 	off_t probe_arg[] = {0, 0};
+	enum blockif_aio aio;
+	int numthr, qdepth;
+	int direct, dio_align, merge;
+	int sparse;
+	char *backing;
+	struct sparse_image *si;
+	enum blockif_synth synth;
+	char *ram;
 
 	pthread_once(&blockif_once, blockif_init);
 
@@ -526,6 +1392,17 @@ blockif_open(const char *optstr, const char *ident)
 
 	candiscard = 0;
 
+	aio = BLOCKIF_AIO_THREADS;
+	numthr = BLOCKIF_NUMTHR;
+	qdepth = BLOCKIF_QDEPTH;
+	direct = 0;
+	dio_align = 0;
+	merge = 0;
+	sparse = 0;
+	backing = NULL;
+	si = NULL;
+	ram = NULL;
+
 	/*
 	 * The first element in the optstring is always a pathname.
 	 * Optional elements follow
@@ -579,12 +1456,100 @@ blockif_open(const char *optstr, const char *ident)
 				sub_file_assign = 1;
 			else
 				goto err;
+		} else if (!strncmp(cp, "workers=", strlen("workers="))) {
+			/* workers=<number of worker threads> */
+			if (dm_strtoi(cp + strlen("workers="), NULL, 10, &numthr) ||
+				numthr < 1 || numthr > BLOCKIF_NUMTHR_MAX) {
+				pr_err("workers must be 1 to %d\n", BLOCKIF_NUMTHR_MAX);
+				goto err;
+			}
+		} else if (!strncmp(cp, "qdepth=", strlen("qdepth="))) {
+			/* qdepth=<number of queued requests> */
+			if (dm_strtoi(cp + strlen("qdepth="), NULL, 10, &qdepth) ||
+				qdepth < 1 || qdepth > BLOCKIF_QDEPTH_MAX) {
+				pr_err("qdepth must be 1 to %d\n", BLOCKIF_QDEPTH_MAX);
+				goto err;
+			}
+		} else if (!strcmp(cp, "direct")) {
+			direct = 1;
+		} else if (!strcmp(cp, "merge")) {
+			merge = 1;
+		} else if (!strcmp(cp, "aio=threads")) {
+			aio = BLOCKIF_AIO_THREADS;
+		} else if (!strcmp(cp, "aio=io_uring")) {
+			aio = BLOCKIF_AIO_IO_URING;
+		} else if (!strcmp(cp, "format=raw")) {
+			sparse = 0;
+		} else if (!strcmp(cp, "format=sparse")) {
+			sparse = 1;
+		} else if (!strncmp(cp, "backing=", strlen("backing="))) {
+			backing = cp + strlen("backing=");
 		} else {
 			pr_err("Invalid device option \"%s\"\n", cp);
 			goto err;
 		}
 	}
 
+	/*
+	 * The metadata of sparse images is only accessed through the cached
+	 * tables of the worker threads, the other options would bypass them.
+	 */
+	if (sparse) {
+		if (direct || sub_file_assign) {
+			pr_err("format=sparse is not supported with direct or range\n");
+			goto err;
+		}
+		if (candiscard) {
+			WPRINTF(("not support DISCARD on sparse images\n"));
+			candiscard = 0;
+		}
+		aio = BLOCKIF_AIO_THREADS;
+	} else if (backing != NULL) {
+		pr_err("backing is only supported with format=sparse\n");
+		goto err;
+	}
+
+	/*
+	 * null:<size> and ram:<size> in place of the path are disks without
+	 * backing file, to measure the overhead of the device model alone.
+	 */
+	if (!strncmp(nopt, "null:", strlen("null:")))
+		synth = BLOCKIF_SYNTH_NULL;
+	else if (!strncmp(nopt, "ram:", strlen("ram:")))
+		synth = BLOCKIF_SYNTH_RAM;
+	else
+		synth = BLOCKIF_SYNTH_NONE;
+
+	if (synth != BLOCKIF_SYNTH_NONE) {
+		if (sparse || direct || sub_file_assign) {
+			pr_err("%s is not supported with format=sparse, direct or range\n", nopt);
+			goto err;
+		}
+		if (blockif_parse_size(strchr(nopt, ':') + 1, &size) ||
+				size < DEV_BSIZE || (size & (DEV_BSIZE - 1))) {
+			pr_err("Invalid size of %s, should be a multiple of %d\n",
+					nopt, DEV_BSIZE);
+			goto err;
+		}
+		if (synth == BLOCKIF_SYNTH_RAM) {
+			ram = mmap(NULL, size, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (ram == MAP_FAILED) {
+				ram = NULL;
+				pr_err("Could not allocate %s\n", nopt);
+				goto err;
+			}
+		}
+
+		/* the workers, without a file there is nothing to submit to a ring */
+		aio = BLOCKIF_AIO_THREADS;
+		memset(&sbuf, 0, sizeof(sbuf));
+		sectsz = DEV_BSIZE;
+		psectsz = DEV_BSIZE;
+		psectoff = 0;
+		goto sized;
+	}
+
 	/*
 	 * To support "writeback" and "writethru" mode switch during runtime,
 	 * O_SYNC is not used directly, as O_SYNC flag cannot dynamic change
@@ -592,10 +1557,10 @@ blockif_open(const char *optstr, const char *ident)
 	 * operation to emulate it.
 	 */
 
-	fd = open(nopt, ro ? O_RDONLY : O_RDWR);
+	fd = open(nopt, (ro ? O_RDONLY : O_RDWR) | (direct ? O_DIRECT : 0));
 	if (fd < 0 && !ro) {
 		/* Attempt a r/w fail with a r/o open */
-		fd = open(nopt, O_RDONLY);
+		fd = open(nopt, O_RDONLY | (direct ? O_DIRECT : 0));
 		ro = 1;
 	}
 
@@ -616,7 +1581,24 @@ blockif_open(const char *optstr, const char *ident)
 	sectsz = DEV_BSIZE;
 	psectsz = psectoff = 0;
 
-	if (S_ISBLK(sbuf.st_mode)) {
+	if (sparse) {
+		if (!S_ISREG(sbuf.st_mode)) {
+			pr_err("sparse image %s must be a regular file\n", nopt);
+			goto err;
+		}
+		si = sparse_open(fd, ro, backing);
+		if (si == NULL) {
+			pr_err("Could not open sparse image %s\n", nopt);
+			goto err;
+		}
+		size = sparse_size(si);
+		if (size < DEV_BSIZE || (size & (DEV_BSIZE - 1))) {
+			WPRINTF(("%s size not corret, should be multiple of %d\n",
+						nopt, DEV_BSIZE));
+			goto err;
+		}
+		psectsz = sbuf.st_blksize;
+	} else if (S_ISBLK(sbuf.st_mode)) {
 		/* get size */
 		err_code = ioctl(fd, BLKGETSIZE, &sz);
 		if (err_code) {
@@ -666,6 +1648,7 @@ blockif_open(const char *optstr, const char *ident)
 		psectsz = sbuf.st_blksize;
 	}
 
+sized:
 	if (ssopt != 0) {
 		if (!powerof2(ssopt) || !powerof2(pssopt) || ssopt < 512 ||
 		    ssopt > pssopt) {
@@ -694,12 +1677,36 @@ blockif_open(const char *optstr, const char *ident)
 		psectoff = 0;
 	}
 
+	/*
+	 * Have the guests issue O_DIRECT compatible offsets and sizes by
+	 * emulating a logical block size of at least the required alignment.
+	 */
+	if (direct) {
+		dio_align = blockif_dio_align(fd);
+		if (ssopt != 0 && ssopt < dio_align) {
+			pr_err("Sector size %d is below the direct I/O alignment %d\n",
+				ssopt, dio_align);
+			goto err;
+		}
+		if (sectsz < dio_align)
+			sectsz = dio_align;
+		if (psectsz < sectsz)
+			psectsz = sectsz;
+	}
+
 	bc = calloc(1, sizeof(struct blockif_ctxt));
 	if (bc == NULL) {
 		pr_err("calloc");
 		goto err;
 	}
 
+	bc->queues = calloc(queue_num, sizeof(struct blockif_queue));
+	if (bc->queues == NULL) {
+		pr_err("calloc");
+		free(bc);
+		goto err;
+	}
+
 	if (sub_file_assign) {
 		DPRINTF(("sector size is %d\n", sectsz));
 		bc->sub_file_assign = 1;
@@ -737,23 +1744,26 @@ blockif_open(const char *optstr, const char *ident)
 	bc->psectsz = psectsz;
 	bc->psectoff = psectoff;
 	bc->wce = writeback;
-	pthread_mutex_init(&bc->mtx, NULL);
-	pthread_cond_init(&bc->cond, NULL);
-	TAILQ_INIT(&bc->freeq);
-	TAILQ_INIT(&bc->pendq);
-	TAILQ_INIT(&bc->busyq);
-	for (i = 0; i < BLOCKIF_MAXREQ; i++) {
-		bc->reqs[i].status = BST_FREE;
-		TAILQ_INSERT_HEAD(&bc->freeq, &bc->reqs[i], link);
-	}
-
-	for (i = 0; i < BLOCKIF_NUMTHR; i++) {
-		if (snprintf(tname, sizeof(tname), "blk-%s-%d",
-					ident, i) >= sizeof(tname)) {
-			pr_err("blk thread name too long");
+	bc->direct = direct;
+	bc->merge = merge;
+	bc->dio_align = dio_align;
+	bc->maxreq = qdepth + numthr;
+	bc->sparse = si;
+	bc->synth = synth;
+	bc->ram = ram;
+	for (i = 0; i < queue_num; i++) {
+		ioctx = (iothreads && iothreads->num > 0) ?
+			iothreads->ioctx_base[i % iothreads->num] : NULL;
+		if (blockif_queue_init(&bc->queues[i], bc, i, numthr, aio,
+					ioctx, ident) < 0) {
+			while (--i >= 0)
+				blockif_queue_deinit(&bc->queues[i]);
+			sub_file_unlock(bc);
+			free(bc->queues);
+			free(bc);
+			goto err;
 		}
-		pthread_create(&bc->btid[i], NULL, blockif_thr, bc);
-		pthread_setname_np(bc->btid[i], tname);
+		bc->nqueues++;
 	}
 
 	/* free strdup memory */
@@ -768,27 +1778,47 @@ err:
 	if (nopt)
 		free(nopt);
 
+	if (si)
+		sparse_close(si);
+	if (ram)
+		munmap(ram, size);
 	if (fd >= 0)
 		close(fd);
 	return NULL;
 }
 
+/* Requests of single queue users, e.g. AHCI, may leave qidx at 0 */
+static struct blockif_queue *
+blockif_req_queue(struct blockif_ctxt *bc, struct blockif_req *breq)
+{
+	if (breq->qidx < 0 || breq->qidx >= bc->nqueues)
+		return &bc->queues[0];
+	return &bc->queues[breq->qidx];
+}
+
 static int
 blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 		enum blockop op)
 {
+	struct blockif_queue *bq = blockif_req_queue(bc, breq);
 	int err;
 
 	err = 0;
 
-	pthread_mutex_lock(&bc->mtx);
-	if (!TAILQ_EMPTY(&bc->freeq)) {
+	pthread_mutex_lock(&bq->mtx);
+	if (!TAILQ_EMPTY(&bq->freeq) && bq->uring != NULL &&
+			(op == BOP_FLUSH ||
+			 (op == BOP_READ && blockif_dio_aligned(bc, breq)) ||
+			 (op == BOP_WRITE && !bc->rdonly &&
+			  blockif_dio_aligned(bc, breq)))) {
+		err = blockif_uring_request(bq, breq, op);
+	} else if (!TAILQ_EMPTY(&bq->freeq)) {
 		/*
 		 * Enqueue and inform the block i/o thread
 		 * that there is work available
 		 */
-		if (blockif_enqueue(bc, breq, op))
-			pthread_cond_signal(&bc->cond);
+		if (blockif_enqueue(bq, breq, op))
+			pthread_cond_signal(&bq->cond);
 	} else {
 		/*
 		 * Callers are not allowed to enqueue more than
@@ -798,7 +1828,12 @@ blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 		 */
 		err = E2BIG;
 	}
-	pthread_mutex_unlock(&bc->mtx);
+	if (err == 0) {
+		bq->ops[op]++;
+		if (op == BOP_READ || op == BOP_WRITE)
+			bq->bytes[op] += breq->resid;
+	}
+	pthread_mutex_unlock(&bq->mtx);
 
 	return err;
 }
@@ -827,16 +1862,61 @@ blockif_discard(struct blockif_ctxt *bc, struct blockif_req *breq)
 	return blockif_request(bc, breq, BOP_DISCARD);
 }
 
+void
+blockif_get_stats(struct blockif_ctxt *bc, struct blockif_stats *stats)
+{
+	struct blockif_queue *bq;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < bc->nqueues; i++) {
+		bq = &bc->queues[i];
+		pthread_mutex_lock(&bq->mtx);
+		stats->reads += bq->ops[BOP_READ];
+		stats->writes += bq->ops[BOP_WRITE];
+		stats->flushes += bq->ops[BOP_FLUSH];
+		stats->discards += bq->ops[BOP_DISCARD];
+		stats->read_bytes += bq->bytes[BOP_READ];
+		stats->write_bytes += bq->bytes[BOP_WRITE];
+		pthread_mutex_unlock(&bq->mtx);
+	}
+}
+
 int
 blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 {
+	struct blockif_queue *bq = blockif_req_queue(bc, breq);
 	struct blockif_elem *be;
 
-	pthread_mutex_lock(&bc->mtx);
+	pthread_mutex_lock(&bq->mtx);
+	/*
+	 * Requests submitted to the io_uring are cancelled asynchronously and
+	 * complete with ECANCELED via their normal callback path, unless they
+	 * are too far along already.
+	 */
+	TAILQ_FOREACH(be, &bq->uringq, link) {
+		if (be->req == breq)
+			break;
+	}
+	if (be != NULL) {
+		struct io_uring_sqe *sqe;
+
+		sqe = blockif_uring_get_sqe(bq->uring);
+		if (sqe != NULL) {
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->fd = -1;
+			sqe->addr = (uintptr_t)be;
+			sqe->user_data = 0;
+			(void)blockif_uring_submit(bq->uring);
+		}
+		pthread_mutex_unlock(&bq->mtx);
+		return -EBUSY;
+	}
+
 	/*
 	 * Check pending requests.
 	 */
-	TAILQ_FOREACH(be, &bc->pendq, link) {
+	TAILQ_FOREACH(be, &bq->pendq, link) {
 		if (be->req == breq)
 			break;
 	}
@@ -844,8 +1924,8 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 		/*
 		 * Found it.
 		 */
-		blockif_complete(bc, be);
-		pthread_mutex_unlock(&bc->mtx);
+		blockif_complete(bq, be);
+		pthread_mutex_unlock(&bq->mtx);
 
 		return 0;
 	}
@@ -853,7 +1933,7 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 	/*
 	 * Check in-flight requests.
 	 */
-	TAILQ_FOREACH(be, &bc->busyq, link) {
+	TAILQ_FOREACH(be, &bq->busyq, link) {
 		if (be->req == breq)
 			break;
 	}
@@ -861,7 +1941,7 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 		/*
 		 * Didn't find it.
 		 */
-		pthread_mutex_unlock(&bc->mtx);
+		pthread_mutex_unlock(&bq->mtx);
 		return -1;
 	}
 
@@ -893,7 +1973,7 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 		pthread_mutex_unlock(&bse.mtx);
 	}
 
-	pthread_mutex_unlock(&bc->mtx);
+	pthread_mutex_unlock(&bq->mtx);
 
 	/*
 	 * The processing thread has been interrupted.  Since it's not
@@ -905,33 +1985,86 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 int
 blockif_close(struct blockif_ctxt *bc)
 {
-	void *jval;
 	int i;
 
 	sub_file_unlock(bc);
 
-	/*
-	 * Stop the block i/o thread
-	 */
-	pthread_mutex_lock(&bc->mtx);
-	bc->closing = 1;
-	pthread_cond_broadcast(&bc->cond);
-	pthread_mutex_unlock(&bc->mtx);
-
-	for (i = 0; i < BLOCKIF_NUMTHR; i++)
-		pthread_join(bc->btid[i], &jval);
-
-	/* XXX Cancel queued i/o's ??? */
+	for (i = 0; i < bc->nqueues; i++)
+		blockif_queue_deinit(&bc->queues[i]);
 
 	/*
 	 * Release resources
 	 */
-	close(bc->fd);
+	if (bc->sparse)
+		sparse_close(bc->sparse);
+	if (bc->ram)
+		munmap(bc->ram, bc->size);
+	if (bc->fd >= 0)
+		close(bc->fd);
+	free(bc->queues);
 	free(bc);
 
 	return 0;
 }
 
+/*
+ * Register the guest memory with the io_urings of \p bc, so that the single
+ * segment requests use IORING_OP_READ_FIXED/WRITE_FIXED and skip the page
+ * pinning on every request. Failing that, e.g. because of RLIMIT_MEMLOCK,
+ * the requests simply don't use the fixed buffers.
+ */
+int
+blockif_register_mem(struct blockif_ctxt *bc, struct vmctx *ctx)
+{
+	struct iovec bufs[BLOCKIF_URING_BUFS_MAX];
+	struct blockif_uring *ring;
+	struct {
+		char *base;
+		size_t size;
+	} regions[2];
+	size_t off, len;
+	int i, n, ret = 0;
+
+	regions[0].base = ctx->baseaddr;
+	regions[0].size = ctx->lowmem;
+	regions[1].base = ctx->baseaddr + ctx->highmem_gpa_base;
+	regions[1].size = ctx->highmem;
+
+	n = 0;
+	for (i = 0; i < 2; i++) {
+		for (off = 0; off < regions[i].size; off += len) {
+			if (n == BLOCKIF_URING_BUFS_MAX) {
+				WPRINTF(("%s: guest memory partially registered\n",
+					__func__));
+				goto reg;
+			}
+			len = MIN(regions[i].size - off, BLOCKIF_URING_BUF_SIZE);
+			bufs[n].iov_base = regions[i].base + off;
+			bufs[n].iov_len = len;
+			n++;
+		}
+	}
+
+reg:
+	for (i = 0; i < bc->nqueues && n > 0; i++) {
+		ring = bc->queues[i].uring;
+		if (ring == NULL)
+			continue;
+
+		if (blockif_uring_register(ring->fd, IORING_REGISTER_BUFFERS,
+					bufs, n) < 0) {
+			WPRINTF(("%s: failed to register guest memory, errno %d\n",
+				__func__, errno));
+			ret = -1;
+			continue;
+		}
+		memcpy(ring->bufs, bufs, n * sizeof(struct iovec));
+		ring->nbufs = n;
+	}
+
+	return ret;
+}
+
 /*
  * Return virtual C/H/S values for a given block. Use the algorithm
  * outlined in the VHD specification to calculate values.
@@ -1004,7 +2137,7 @@ blockif_psectsz(struct blockif_ctxt *bc, int *size, int *off)
 int
 blockif_queuesz(struct blockif_ctxt *bc)
 {
-	return (BLOCKIF_MAXREQ - 1);
+	return (bc->maxreq - 1);
 }
 
 int
@@ -1055,7 +2188,7 @@ blockif_flush_all(struct blockif_ctxt *bc)
 	int err;
 
 	err=0;
-	if (fsync(bc->fd))
+	if (bc->fd >= 0 && fsync(bc->fd))
 		err = errno;
 	return err;
 }
@@ -0,0 +1,674 @@
+/*
+ * Copyright (C) 2026 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Sparse disk image format.
+ *
+ * The image is split in clusters of 1 << cluster_bits bytes. Cluster 0 holds
+ * the header, the L1 table follows it and the rest of the file is made of L2
+ * tables and data clusters, allocated in order at the end of the file.
+ *
+ * Each L1 entry is the file offset of an L2 table (0 if not allocated yet), an
+ * L2 table is one cluster of 64-bit entries mapping consecutive guest clusters:
+ *   0                  - not allocated, read from the backing image (if any)
+ *                        or as zeros
+ *   SPARSE_CLUSTER_ZERO - zero cluster, read as zeros without any I/O
+ *   other               - file offset of the data cluster
+ *
+ * The whole L1 table is kept in memory and L2 tables are cached on first use,
+ * so a lookup never costs an extra read after warmup. The first write to a
+ * cluster not allocated yet copies the untouched parts from the backing image
+ * into a new cluster (copy-on-write), unless the write covers the whole
+ * cluster with zeros, in which case the cluster is only marked as zero.
+ *
+ * Metadata is written after the data it points to and is made durable by the
+ * same fsync() as the data, i.e. it has the write cache semantics of the disk.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block_sparse.h"
+#include "log.h"
+
+#define SPARSE_MAGIC		"ACRNSPAR"
+#define SPARSE_VERSION		1U
+#define SPARSE_CLUSTER_BITS	16U	/* 64KB clusters */
+#define SPARSE_CLUSTER_BITS_MIN	12U
+#define SPARSE_CLUSTER_BITS_MAX	21U
+#define SPARSE_BACKING_MAX	256U
+#define SPARSE_CLUSTER_ZERO	1ULL
+#define SPARSE_IOV_MAX		1024
+
+struct sparse_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	cluster_bits;
+	uint64_t	size;		/* virtual disk size in bytes */
+	uint64_t	l1_offset;
+	uint32_t	l1_entries;
+	uint32_t	backing_len;
+	char		backing[SPARSE_BACKING_MAX];
+} __attribute__((packed));
+
+struct sparse_image {
+	int		fd;
+	int		backing_fd;	/* -1 without a backing image */
+	int		rdonly;
+	off_t		size;
+	uint32_t	cluster_bits;
+	size_t		cluster_size;
+	uint32_t	l2_entries;	/* entries per L2 table */
+	uint32_t	l1_entries;
+	off_t		l1_offset;
+	uint64_t	*l1;
+	uint64_t	**l2;		/* cached L2 tables, NULL if not loaded */
+	off_t		next_free;	/* file offset of the next new cluster */
+	void		*cow_buf;	/* one cluster, used under mtx */
+	pthread_mutex_t	mtx;		/* protects the tables and allocation */
+};
+
+/* Where a guest cluster reads from */
+enum sparse_map {
+	SPARSE_MAP_DATA,
+	SPARSE_MAP_BACKING,
+	SPARSE_MAP_ZERO,
+};
+
+static ssize_t
+sparse_pread_full(int fd, void *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = pread(fd, (char *)buf + done, len - done, off + done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+static ssize_t
+sparse_pwrite_full(int fd, const void *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = pwrite(fd, (const char *)buf + done, len - done, off + done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += n;
+	}
+	return done;
+}
+
+/* Build in @out the part [@skip, @skip + @len) of the @iov buffer list */
+static int
+sparse_iov_slice(const struct iovec *iov, int iovcnt, size_t skip, size_t len,
+		struct iovec *out)
+{
+	int i, n = 0;
+	size_t l;
+
+	for (i = 0; i < iovcnt && len > 0; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		if (n == SPARSE_IOV_MAX)
+			return -1;
+		l = MIN(iov[i].iov_len - skip, len);
+		out[n].iov_base = (char *)iov[i].iov_base + skip;
+		out[n].iov_len = l;
+		n++;
+		len -= l;
+		skip = 0;
+	}
+	return n;
+}
+
+static void
+sparse_iov_memset(const struct iovec *iov, int iovcnt, size_t skip)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		memset((char *)iov[i].iov_base + skip, 0, iov[i].iov_len - skip);
+		skip = 0;
+	}
+}
+
+static bool
+sparse_iov_is_zero(const struct iovec *iov, int iovcnt)
+{
+	const uint8_t *p;
+	size_t j;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		p = iov[i].iov_base;
+		for (j = 0; j < iov[i].iov_len; j++)
+			if (p[j] != 0)
+				return false;
+	}
+	return true;
+}
+
+static void
+sparse_iov_to_buf(const struct iovec *iov, int iovcnt, void *buf)
+{
+	char *p = buf;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+}
+
+/* @pre si->mtx is held */
+static uint64_t *
+sparse_l2_get(struct sparse_image *si, uint32_t l1_idx)
+{
+	uint64_t *l2;
+
+	if (si->l2[l1_idx] != NULL || si->l1[l1_idx] == 0)
+		return si->l2[l1_idx];
+
+	l2 = malloc(si->cluster_size);
+	if (l2 == NULL)
+		return NULL;
+	if (sparse_pread_full(si->fd, l2, si->cluster_size,
+			si->l1[l1_idx]) != (ssize_t)si->cluster_size) {
+		pr_err("sparse: failed to read L2 table %u\n", l1_idx);
+		free(l2);
+		return NULL;
+	}
+	si->l2[l1_idx] = l2;
+	return l2;
+}
+
+/*
+ * Look up the guest cluster containing @offset, the file offset of a data
+ * cluster is returned in @phys.
+ *
+ * @pre si->mtx is held
+ */
+static int
+sparse_lookup_locked(struct sparse_image *si, off_t offset, off_t *phys)
+{
+	uint64_t cluster = offset >> si->cluster_bits;
+	uint32_t l1_idx = cluster / si->l2_entries;
+	uint64_t *l2, entry;
+
+	if (si->l1[l1_idx] == 0)
+		entry = 0;
+	else {
+		l2 = sparse_l2_get(si, l1_idx);
+		if (l2 == NULL)
+			return -1;
+		entry = l2[cluster % si->l2_entries];
+	}
+
+	if (entry == SPARSE_CLUSTER_ZERO)
+		return SPARSE_MAP_ZERO;
+	if (entry != 0) {
+		*phys = entry;
+		return SPARSE_MAP_DATA;
+	}
+	return (si->backing_fd >= 0) ? SPARSE_MAP_BACKING : SPARSE_MAP_ZERO;
+}
+
+static int
+sparse_lookup(struct sparse_image *si, off_t offset, off_t *phys)
+{
+	int map;
+
+	pthread_mutex_lock(&si->mtx);
+	map = sparse_lookup_locked(si, offset, phys);
+	pthread_mutex_unlock(&si->mtx);
+	return map;
+}
+
+/* @pre si->mtx is held */
+static off_t
+sparse_alloc_cluster(struct sparse_image *si)
+{
+	off_t off = si->next_free;
+
+	si->next_free += si->cluster_size;
+	return off;
+}
+
+/*
+ * Point the L2 entry of @cluster to @entry, allocating the table if needed.
+ *
+ * @pre si->mtx is held
+ */
+static int
+sparse_set_entry(struct sparse_image *si, uint64_t cluster, uint64_t entry)
+{
+	uint32_t l1_idx = cluster / si->l2_entries;
+	uint32_t l2_idx = cluster % si->l2_entries;
+	uint64_t *l2;
+	off_t off;
+
+	l2 = sparse_l2_get(si, l1_idx);
+	if (l2 == NULL) {
+		if (si->l1[l1_idx] != 0)
+			return -1;
+
+		l2 = calloc(1, si->cluster_size);
+		if (l2 == NULL)
+			return -1;
+		off = sparse_alloc_cluster(si);
+		l2[l2_idx] = entry;
+		if (sparse_pwrite_full(si->fd, l2, si->cluster_size, off) < 0) {
+			free(l2);
+			return -1;
+		}
+		if (sparse_pwrite_full(si->fd, &off, sizeof(off),
+				si->l1_offset + l1_idx * sizeof(uint64_t)) < 0) {
+			free(l2);
+			return -1;
+		}
+		si->l1[l1_idx] = off;
+		si->l2[l1_idx] = l2;
+		return 0;
+	}
+
+	if (sparse_pwrite_full(si->fd, &entry, sizeof(entry),
+			si->l1[l1_idx] + l2_idx * sizeof(uint64_t)) < 0)
+		return -1;
+	l2[l2_idx] = entry;
+	return 0;
+}
+
+/*
+ * Write to a guest cluster with no data cluster yet: @len bytes of @iov at
+ * @offset, all within the cluster.
+ */
+static ssize_t
+sparse_cow(struct sparse_image *si, const struct iovec *iov, int iovcnt,
+		off_t offset, size_t len)
+{
+	off_t start = offset & ~((off_t)si->cluster_size - 1);
+	size_t skip = offset - start;
+	off_t phys;
+	int map;
+	ssize_t ret = -1;
+
+	pthread_mutex_lock(&si->mtx);
+
+	/* Raced with another writer of the cluster? */
+	map = sparse_lookup_locked(si, offset, &phys);
+	if (map < 0)
+		goto out;
+	if (map == SPARSE_MAP_DATA) {
+		pthread_mutex_unlock(&si->mtx);
+		return pwritev(si->fd, iov, iovcnt, phys + skip);
+	}
+
+	if (len == si->cluster_size && sparse_iov_is_zero(iov, iovcnt)) {
+		if (map == SPARSE_MAP_ZERO)
+			ret = len;
+		else if (sparse_set_entry(si, start >> si->cluster_bits,
+				SPARSE_CLUSTER_ZERO) == 0)
+			ret = len;
+		goto out;
+	}
+
+	if (len < si->cluster_size) {
+		if (map == SPARSE_MAP_BACKING) {
+			ret = sparse_pread_full(si->backing_fd, si->cow_buf,
+					si->cluster_size, start);
+			if (ret < 0)
+				goto out;
+			memset((char *)si->cow_buf + ret, 0,
+					si->cluster_size - ret);
+			ret = -1;
+		} else
+			memset(si->cow_buf, 0, si->cluster_size);
+	}
+	sparse_iov_to_buf(iov, iovcnt, (char *)si->cow_buf + skip);
+
+	phys = sparse_alloc_cluster(si);
+	if (sparse_pwrite_full(si->fd, si->cow_buf, si->cluster_size,
+			phys) < 0)
+		goto out;
+	if (sparse_set_entry(si, start >> si->cluster_bits, phys) == 0)
+		ret = len;
+out:
+	pthread_mutex_unlock(&si->mtx);
+	return ret;
+}
+
+ssize_t
+sparse_preadv(struct sparse_image *si, const struct iovec *iov, int iovcnt,
+		off_t offset)
+{
+	struct iovec slice[SPARSE_IOV_MAX];
+	size_t total = 0, len, chunk, mask = si->cluster_size - 1;
+	off_t phys, nphys;
+	ssize_t n;
+	int i, cnt, map;
+
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (offset >= si->size)
+		return 0;
+	total = MIN(total, (size_t)(si->size - offset));
+
+	for (len = 0; len < total; len += chunk) {
+		map = sparse_lookup(si, offset + len, &phys);
+		if (map < 0) {
+			errno = EIO;
+			return -1;
+		}
+		chunk = MIN(si->cluster_size - ((offset + len) & mask),
+				total - len);
+
+		/* Coalesce the following clusters read from the same place */
+		while (len + chunk < total) {
+			n = sparse_lookup(si, offset + len + chunk, &nphys);
+			if (n != map || (map == SPARSE_MAP_DATA &&
+					nphys != phys + (off_t)(((offset + len) &
+					mask) + chunk)))
+				break;
+			chunk += MIN(si->cluster_size, total - len - chunk);
+		}
+
+		cnt = sparse_iov_slice(iov, iovcnt, len, chunk, slice);
+		if (cnt < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		switch (map) {
+		case SPARSE_MAP_ZERO:
+			sparse_iov_memset(slice, cnt, 0);
+			continue;
+		case SPARSE_MAP_BACKING:
+			n = preadv(si->backing_fd, slice, cnt, offset + len);
+			break;
+		default:
+			n = preadv(si->fd, slice, cnt,
+					phys + ((offset + len) & mask));
+			break;
+		}
+		if (n < 0)
+			return -1;
+		/* The backing image may be shorter */
+		if ((size_t)n < chunk)
+			sparse_iov_memset(slice, cnt, n);
+	}
+	return total;
+}
+
+ssize_t
+sparse_pwritev(struct sparse_image *si, const struct iovec *iov, int iovcnt,
+		off_t offset)
+{
+	struct iovec slice[SPARSE_IOV_MAX];
+	size_t total = 0, len, chunk, mask = si->cluster_size - 1;
+	off_t phys;
+	ssize_t n;
+	int i, cnt, map;
+
+	if (si->rdonly) {
+		errno = EROFS;
+		return -1;
+	}
+
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (offset + (off_t)total > si->size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (len = 0; len < total; len += chunk) {
+		chunk = MIN(si->cluster_size - ((offset + len) & mask),
+				total - len);
+		cnt = sparse_iov_slice(iov, iovcnt, len, chunk, slice);
+		if (cnt < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		map = sparse_lookup(si, offset + len, &phys);
+		if (map < 0) {
+			errno = EIO;
+			return -1;
+		}
+		if (map == SPARSE_MAP_DATA)
+			n = pwritev(si->fd, slice, cnt,
+					phys + ((offset + len) & mask));
+		else
+			n = sparse_cow(si, slice, cnt, offset + len, chunk);
+		if (n < 0) {
+			if (errno == 0)
+				errno = EIO;
+			return -1;
+		}
+	}
+	return total;
+}
+
+static int
+sparse_open_backing(const char *path, off_t *size)
+{
+	struct stat sbuf;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		pr_err("sparse: could not open backing image %s\n", path);
+		return -1;
+	}
+	if (fstat(fd, &sbuf) < 0) {
+		close(fd);
+		return -1;
+	}
+	*size = sbuf.st_size;
+	if (S_ISBLK(sbuf.st_mode) && ioctl(fd, BLKGETSIZE64, size) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Write the header and an empty L1 table of a new image */
+static int
+sparse_create(int fd, const char *backing, off_t size,
+		struct sparse_header *hdr)
+{
+	size_t cluster_size = 1UL << SPARSE_CLUSTER_BITS;
+	uint64_t l2_span = (cluster_size / sizeof(uint64_t)) * cluster_size;
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, SPARSE_MAGIC, sizeof(hdr->magic));
+	hdr->version = SPARSE_VERSION;
+	hdr->cluster_bits = SPARSE_CLUSTER_BITS;
+	hdr->size = size;
+	hdr->l1_offset = cluster_size;
+	hdr->l1_entries = (size + l2_span - 1) / l2_span;
+	hdr->backing_len = strnlen(backing, SPARSE_BACKING_MAX);
+	memcpy(hdr->backing, backing, hdr->backing_len);
+
+	/* The L1 table is all zeros, extending the file is enough */
+	if (ftruncate(fd, hdr->l1_offset +
+			roundup(hdr->l1_entries * sizeof(uint64_t),
+				cluster_size)) < 0)
+		return -1;
+	if (sparse_pwrite_full(fd, hdr, sizeof(*hdr), 0) < 0)
+		return -1;
+	return fsync(fd);
+}
+
+struct sparse_image *
+sparse_open(int fd, int rdonly, const char *backing)
+{
+	struct sparse_image *si;
+	struct sparse_header hdr;
+	char path[SPARSE_BACKING_MAX + 1];
+	struct stat sbuf;
+	off_t backing_size = 0;
+	size_t l1_size;
+
+	if (fstat(fd, &sbuf) < 0)
+		return NULL;
+
+	si = calloc(1, sizeof(*si));
+	if (si == NULL)
+		return NULL;
+	si->fd = fd;
+	si->backing_fd = -1;
+	si->rdonly = rdonly;
+
+	if (sbuf.st_size == 0) {
+		/* A new overlay gets its size from the backing image */
+		if (backing == NULL || rdonly) {
+			pr_err("sparse: empty image needs a writable file and a backing image\n");
+			goto err;
+		}
+		if (strlen(backing) > SPARSE_BACKING_MAX) {
+			pr_err("sparse: backing image path too long\n");
+			goto err;
+		}
+		si->backing_fd = sparse_open_backing(backing, &backing_size);
+		if (si->backing_fd < 0)
+			goto err;
+		if (backing_size == 0 || sparse_create(fd, backing,
+				backing_size, &hdr) < 0) {
+			pr_err("sparse: failed to create the image\n");
+			goto err;
+		}
+	} else if (sparse_pread_full(fd, &hdr, sizeof(hdr), 0) !=
+			sizeof(hdr)) {
+		pr_err("sparse: failed to read the header\n");
+		goto err;
+	}
+
+	if (memcmp(hdr.magic, SPARSE_MAGIC, sizeof(hdr.magic)) ||
+			hdr.version != SPARSE_VERSION ||
+			hdr.cluster_bits < SPARSE_CLUSTER_BITS_MIN ||
+			hdr.cluster_bits > SPARSE_CLUSTER_BITS_MAX ||
+			hdr.backing_len > SPARSE_BACKING_MAX ||
+			hdr.size == 0) {
+		pr_err("sparse: invalid image header\n");
+		goto err;
+	}
+
+	si->cluster_bits = hdr.cluster_bits;
+	si->cluster_size = 1UL << hdr.cluster_bits;
+	si->l2_entries = si->cluster_size / sizeof(uint64_t);
+	si->size = hdr.size;
+	si->l1_entries = hdr.l1_entries;
+	si->l1_offset = hdr.l1_offset;
+	if ((uint64_t)si->l1_entries * si->l2_entries <
+			(hdr.size + si->cluster_size - 1) >> si->cluster_bits ||
+			(si->l1_offset & (si->cluster_size - 1)) ||
+			si->l1_offset == 0) {
+		pr_err("sparse: invalid L1 table\n");
+		goto err;
+	}
+
+	/* The backing image given on the command line overrides the header */
+	if (si->backing_fd < 0 && (backing != NULL || hdr.backing_len > 0)) {
+		if (backing == NULL) {
+			memcpy(path, hdr.backing, hdr.backing_len);
+			path[hdr.backing_len] = '\0';
+			backing = path;
+		}
+		si->backing_fd = sparse_open_backing(backing, &backing_size);
+		if (si->backing_fd < 0)
+			goto err;
+	}
+
+	l1_size = si->l1_entries * sizeof(uint64_t);
+	si->l1 = malloc(l1_size);
+	si->l2 = calloc(si->l1_entries, sizeof(uint64_t *));
+	si->cow_buf = malloc(si->cluster_size);
+	if (si->l1 == NULL || si->l2 == NULL || si->cow_buf == NULL)
+		goto err;
+	if (sparse_pread_full(fd, si->l1, l1_size, si->l1_offset) !=
+			(ssize_t)l1_size) {
+		pr_err("sparse: failed to read the L1 table\n");
+		goto err;
+	}
+
+	if (fstat(fd, &sbuf) < 0)
+		goto err;
+	si->next_free = roundup(MAX(sbuf.st_size, si->l1_offset +
+			(off_t)roundup(l1_size, si->cluster_size)),
+			si->cluster_size);
+
+	pthread_mutex_init(&si->mtx, NULL);
+	return si;
+
+err:
+	if (si->backing_fd >= 0)
+		close(si->backing_fd);
+	free(si->cow_buf);
+	free(si->l2);
+	free(si->l1);
+	free(si);
+	return NULL;
+}
+
+void
+sparse_close(struct sparse_image *si)
+{
+	uint32_t i;
+
+	for (i = 0; i < si->l1_entries; i++)
+		free(si->l2[i]);
+	free(si->l2);
+	free(si->l1);
+	free(si->cow_buf);
+	if (si->backing_fd >= 0)
+		close(si->backing_fd);
+	pthread_mutex_destroy(&si->mtx);
+	free(si);
+}
+
+off_t
+sparse_size(struct sparse_image *si)
+{
+	return si->size;
+}
+
+int
+sparse_cluster_size(struct sparse_image *si)
+{
+	return si->cluster_size;
+}
@@ -43,10 +43,14 @@
 #include "ahci.h"
 #include "block_if.h"
 #include "ata.h"
+#include "timer.h"
 
 #define	DEF_PORTS	6	/* Intel ICH8 AHCI supports 6 ports */
 #define	MAX_PORTS	32	/* AHCI supports 32 ports */
 
+/* at most this long an NCQ completion waits for the others to be reported */
+#define	AHCI_SDB_COALESCE_NS	50000
+
 #define	PxSIG_ATA	0x00000101 /* ATA drive */
 #define	PxSIG_ATAPI	0xeb140101 /* ATAPI drive */
 
@@ -132,6 +136,9 @@ struct ahci_port {
 	uint8_t asc;
 	u_int ccs;
 	uint32_t pending;
+	uint32_t sdb_done;	/* NCQ slots completed, not reported yet */
+	struct acrn_timer sdb_timer;
+	int sdb_timer_armed;
 
 	uint32_t clb;
 	uint32_t clbu;
@@ -351,6 +358,27 @@ ahci_write_fis_piosetup(struct ahci_port *p)
 	ahci_write_fis(p, FIS_TYPE_PIOSETUP, fis);
 }
 
+/* Report the NCQ completions held back by ahci_complete_ncq() */
+static void
+ahci_post_sdb(struct ahci_port *p)
+{
+	uint8_t fis[8];
+
+	if (p->sdb_done == 0)
+		return;
+
+	memset(fis, 0, sizeof(fis));
+	fis[0] = FIS_TYPE_SETDEVBITS;
+	fis[1] = (1 << 6);
+	fis[2] = (ATA_S_READY | ATA_S_DSC) & 0x77;
+	*(uint32_t *)(fis + 4) = p->sdb_done;
+	p->sact &= ~p->sdb_done;
+	p->sdb_done = 0;
+	p->tfd &= ~0x77;
+	p->tfd |= fis[2];
+	ahci_write_fis(p, FIS_TYPE_SETDEVBITS, fis);
+}
+
 static void
 ahci_write_fis_sdb(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t tfd)
 {
@@ -358,6 +386,8 @@ ahci_write_fis_sdb(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t tfd)
 	uint8_t error;
 
 	error = (tfd >> 8) & 0xff;
+	if (tfd & ATA_S_ERROR)
+		ahci_post_sdb(p);
 	tfd &= 0x77;
 	memset(fis, 0, sizeof(fis));
 	fis[0] = FIS_TYPE_SETDEVBITS;
@@ -370,14 +400,54 @@ ahci_write_fis_sdb(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t tfd)
 		p->err_cfis[3] = error;
 		memcpy(&p->err_cfis[4], cfis + 4, 16);
 	} else {
-		*(uint32_t *)(fis + 4) = (1 << slot);
-		p->sact &= ~(1 << slot);
+		p->sdb_done |= (1 << slot);
+		*(uint32_t *)(fis + 4) = p->sdb_done;
+		p->sact &= ~p->sdb_done;
+		p->sdb_done = 0;
 	}
 	p->tfd &= ~0x77;
 	p->tfd |= tfd;
 	ahci_write_fis(p, FIS_TYPE_SETDEVBITS, fis);
 }
 
+/*
+ * Complete an NCQ command without error. While other NCQ commands of the
+ * port are in flight, the SDB FIS and the interrupt it raises are held back
+ * for AHCI_SDB_COALESCE_NS at most: the commands completing meanwhile are
+ * all reported by one FIS, in its SActive bits.
+ */
+static void
+ahci_complete_ncq(struct ahci_port *p, int slot)
+{
+	struct itimerspec delay;
+
+	p->sdb_done |= (1 << slot);
+	if ((p->pending & p->sact & ~(1 << slot)) != 0) {
+		if (p->sdb_timer_armed)
+			return;
+
+		memset(&delay, 0, sizeof(delay));
+		delay.it_value.tv_nsec = AHCI_SDB_COALESCE_NS;
+		if (acrn_timer_settime(&p->sdb_timer, &delay) == 0) {
+			p->sdb_timer_armed = 1;
+			return;
+		}
+	}
+	ahci_post_sdb(p);
+}
+
+static void
+ahci_sdb_timer_handler(void *arg, uint64_t nexp)
+{
+	struct ahci_port *p;
+
+	p = arg;
+	pthread_mutex_lock(&p->ahci_dev->mtx);
+	p->sdb_timer_armed = 0;
+	ahci_post_sdb(p);
+	pthread_mutex_unlock(&p->ahci_dev->mtx);
+}
+
 static void
 ahci_write_fis_d2h(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t tfd)
 {
@@ -457,6 +527,7 @@ ahci_check_stopped(struct ahci_port *p)
 			p->cmd &= ~(AHCI_P_CMD_CR | AHCI_P_CMD_CCS_MASK);
 			p->ci = 0;
 			p->sact = 0;
+			p->sdb_done = 0;
 			p->waitforclear = 0;
 		}
 	}
@@ -513,6 +584,7 @@ ahci_port_reset(struct ahci_port *pr)
 {
 	pr->serr = 0;
 	pr->sact = 0;
+	pr->sdb_done = 0;
 	pr->xfermode = ATA_UDMA6;
 	pr->mult_sectors = 128;
 
@@ -1946,7 +2018,9 @@ ata_ioreq_cb(struct blockif_req *br, int err)
 		tfd = ATA_S_READY | ATA_S_DSC;
 	else
 		tfd = (ATA_E_ABORT << 8) | ATA_S_READY | ATA_S_ERROR;
-	if (ncq)
+	if (ncq && !err)
+		ahci_complete_ncq(p, slot);
+	else if (ncq)
 		ahci_write_fis_sdb(p, slot, cfis, tfd);
 	else
 		ahci_write_fis_d2h(p, slot, cfis, tfd);
@@ -2405,7 +2479,7 @@ pci_ahci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts, int atapi)
 		 */
 		snprintf(bident, sizeof(bident), "%02x:%02x:%02x", dev->slot,
 		    dev->func, p);
-		bctxt = blockif_open(opts, bident);
+		bctxt = blockif_open(opts, bident, 1, NULL);
 		if (bctxt == NULL) {
 			ahci_dev->ports = p;
 			ret = 1;
@@ -2448,6 +2522,13 @@ pci_ahci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts, int atapi)
 			goto open_fail;
 		}
 
+		ahci_dev->port[p].sdb_timer.clockid = CLOCK_MONOTONIC;
+		if (acrn_timer_init(&ahci_dev->port[p].sdb_timer,
+				ahci_sdb_timer_handler, &ahci_dev->port[p])) {
+			ret = -1;
+			goto open_fail;
+		}
+
 		ahci_dev->pi |= (1 << p);
 		if (ahci_dev->port[p].ioqsz < slots)
 			slots = ahci_dev->port[p].ioqsz;
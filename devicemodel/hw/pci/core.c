@@ -35,6 +35,8 @@
 #include <strings.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
 
 #include "dm.h"
 #include "vmmapi.h"
@@ -48,6 +50,7 @@
 #include "sw_load.h"
 #include "log.h"
 #include "vdisplay.h"
+#include "snapshot.h"
 
 #define CONF1_ADDR_PORT    0x0cf8
 #define CONF1_DATA_PORT    0x0cfc
@@ -108,6 +111,7 @@ static void pci_lintr_update(struct pci_vdev *dev);
 static void pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus, int slot,
 		      int func, int coff, int bytes, uint32_t *val);
 static void pci_emul_free_msixcap(struct pci_vdev *pdi);
+static void pci_emul_unshadow_cfg(struct vmctx *ctx, struct pci_vdev *dev);
 
 int compare_io_rgns(const void *data1, const void *data2)
 {
@@ -500,8 +504,9 @@ pci_emul_io_handler(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 	struct pci_vdev *pdi = arg;
 	struct pci_vdev_ops *ops = pdi->dev_ops;
 	uint64_t offset;
-	int i;
+	int i, ret = -1;
 
+	pthread_mutex_lock(&pdi->emul_lock);
 	for (i = 0; i <= PCI_BARMAX; i++) {
 		if (pdi->bar[i].type == PCIBAR_IO &&
 		    port >= pdi->bar[i].addr &&
@@ -514,10 +519,12 @@ pci_emul_io_handler(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 			} else
 				(*ops->vdev_barwrite)(ctx, vcpu, pdi, i, offset,
 				                      bytes, bar_value(bytes, *eax));
-			return 0;
+			ret = 0;
+			break;
 		}
 	}
-	return -1;
+	pthread_mutex_unlock(&pdi->emul_lock);
+	return ret;
 }
 
 static int
@@ -536,6 +543,7 @@ pci_emul_mem_handler(struct vmctx *ctx, int vcpu, int dir, uint64_t addr,
 
 	offset = addr - pdi->bar[bidx].addr;
 
+	pthread_mutex_lock(&pdi->emul_lock);
 	if (dir == MEM_F_WRITE) {
 		if (size == 8) {
 			(*ops->vdev_barwrite)(ctx, vcpu, pdi, bidx, offset,
@@ -564,6 +572,7 @@ pci_emul_mem_handler(struct vmctx *ctx, int vcpu, int dir, uint64_t addr,
 			*val = bar_value(size, *val);
 		}
 	}
+	pthread_mutex_unlock(&pdi->emul_lock);
 
 	return 0;
 }
@@ -628,7 +637,7 @@ modify_bar_registration(struct pci_vdev *dev, int idx, int registration)
 		iop.port = dev->bar[idx].addr;
 		iop.size = dev->bar[idx].size;
 		if (registration) {
-			iop.flags = IOPORT_F_INOUT;
+			iop.flags = IOPORT_F_INOUT | IOPORT_F_MT_SAFE;
 			iop.handler = pci_emul_io_handler;
 			iop.arg = dev;
 			error = register_inout(&iop);
@@ -642,7 +651,7 @@ modify_bar_registration(struct pci_vdev *dev, int idx, int registration)
 		mr.base = dev->bar[idx].addr;
 		mr.size = dev->bar[idx].size;
 		if (registration) {
-			mr.flags = MEM_F_RW;
+			mr.flags = MEM_F_RW | MEM_F_MT_SAFE;
 			mr.handler = pci_emul_mem_handler;
 			mr.arg1 = dev;
 			mr.arg2 = idx;
@@ -1045,6 +1054,7 @@ pci_emul_init(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 	pdi->slot = slot;
 	pdi->func = func;
 	pthread_mutex_init(&pdi->lintr.lock, NULL);
+	pthread_mutex_init(&pdi->emul_lock, NULL);
 	pdi->lintr.pin = 0;
 	pdi->lintr.state = IDLE;
 	pdi->lintr.pirq_pin = 0;
@@ -1066,8 +1076,10 @@ pci_emul_init(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 	err = (*ops->vdev_init)(ctx, pdi, fi->fi_param);
 	if (err == 0)
 		fi->fi_devi = pdi;
-	else
+	else {
+		pthread_mutex_destroy(&pdi->emul_lock);
 		free(pdi);
+	}
 
 	return err;
 }
@@ -1076,6 +1088,8 @@ static void
 pci_emul_deinit(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 		int func, struct funcinfo *fi)
 {
+	if (fi->fi_devi)
+		pci_emul_unshadow_cfg(ctx, fi->fi_devi);
 	if (ops->vdev_deinit && fi->fi_devi)
 		(*ops->vdev_deinit)(ctx, fi->fi_devi, fi->fi_param);
 	if (fi->fi_param)
@@ -1085,6 +1099,7 @@ pci_emul_deinit(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 		pci_lintr_release(fi->fi_devi);
 		pci_emul_free_bars(fi->fi_devi);
 		pci_emul_free_msixcap(fi->fi_devi);
+		pthread_mutex_destroy(&fi->fi_devi->emul_lock);
 		free(fi->fi_devi);
 	}
 }
@@ -1482,6 +1497,90 @@ pci_emul_ecfg_handler(struct vmctx *ctx, int vcpu, int dir, uint64_t addr,
 	return 0;
 }
 
+static void
+pci_emul_cfg_shadow_trap(struct acrn_vdev_cfg_shadow *shadow, int off, int len)
+{
+	int i;
+
+	for (i = off; i < off + len; i++)
+		shadow->dm_map[i / 64] |= 1UL << (i % 64);
+}
+
+/*
+ * Let the hypervisor serve the config accesses to a virtio device which need
+ * no emulation here, so that the guest probing its PCI devices does not wait
+ * for the Service VM on each of them. The hypervisor returns what a read of
+ * the config space returns now, emulates the BARs with their masks and still
+ * sends us the accesses to the registers marked in dm_map and the writes
+ * moving a BAR.
+ */
+static void
+pci_emul_shadow_cfg(struct vmctx *ctx, struct pci_vdev *dev)
+{
+	struct acrn_vdev_cfg_shadow shadow;
+	struct pci_vdev_ops *ops = dev->dev_ops;
+	uint32_t val;
+	int off, idx, capoff, nextoff;
+
+	if ((strncmp(ops->class_name, "virtio-", 7) && strncmp(ops->class_name, "vhost-", 6)) ||
+	    ops->vdev_cfgread != NULL || ops->vdev_cfgwrite != NULL)
+		return;
+
+	bzero(&shadow, sizeof(shadow));
+	shadow.bdf = PCI_BDF(dev->bus, dev->slot, dev->func);
+	for (off = 0; off < ACRN_VDEV_CFG_SHADOW_SIZE; off += 4) {
+		pci_cfgrw(ctx, 0, 1, dev->bus, dev->slot, dev->func, off, 4, &val);
+		memcpy(&shadow.cfg[off], &val, sizeof(val));
+	}
+
+	/* the BARs take the same bits of a write as pci_cfgrw() */
+	for (idx = 0; idx <= PCI_BARMAX; idx++) {
+		switch (dev->bar[idx].type) {
+		case PCIBAR_IO:
+			shadow.bar_mask[idx] = ~(dev->bar[idx].size - 1) & 0xffff;
+			break;
+		case PCIBAR_MEM32:
+		case PCIBAR_MEM64:
+			shadow.bar_mask[idx] = (uint32_t)~(dev->bar[idx].size - 1);
+			break;
+		case PCIBAR_MEMHI64:
+			shadow.bar_mask[idx] = (uint32_t)(~(dev->bar[idx - 1].size - 1) >> 32);
+			break;
+		default:
+			break;
+		}
+	}
+
+	pci_emul_cfg_shadow_trap(&shadow, PCIR_COMMAND, 4);
+	pci_emul_cfg_shadow_trap(&shadow, PCIR_CACHELNSZ, 2);
+	pci_emul_cfg_shadow_trap(&shadow, PCIR_INTLINE, 1);
+
+	/* the capabilities but their IDs and next pointers, which are read-only */
+	if (pci_get_cfgdata16(dev, PCIR_STATUS) & PCIM_STATUS_CAPPRESENT) {
+		for (capoff = pci_get_cfgdata8(dev, PCIR_CAP_PTR); capoff != 0; capoff = nextoff) {
+			nextoff = pci_get_cfgdata8(dev, capoff + 1);
+			pci_emul_cfg_shadow_trap(&shadow, capoff + 2,
+				((nextoff != 0) ? nextoff : dev->capend + 1) - capoff - 2);
+		}
+	}
+
+	if (vm_add_vdev_cfg_shadow(ctx, &shadow) == 0)
+		dev->cfg_shadowed = true;
+}
+
+static void
+pci_emul_unshadow_cfg(struct vmctx *ctx, struct pci_vdev *dev)
+{
+	struct acrn_vdev_cfg_shadow shadow;
+
+	if (dev->cfg_shadowed) {
+		bzero(&shadow, sizeof(shadow));
+		shadow.bdf = PCI_BDF(dev->bus, dev->slot, dev->func);
+		vm_remove_vdev_cfg_shadow(ctx, &shadow);
+		dev->cfg_shadowed = false;
+	}
+}
+
 #define	BUSIO_ROUNDUP		32
 #define	BUSMEM_ROUNDUP		(1024 * 1024)
 
@@ -1628,6 +1727,7 @@ init_pci(struct vmctx *ctx)
 				if (ops && ops->vdev_phys_access)
 					ops->vdev_phys_access(ctx,
 						fi->fi_devi);
+				pci_emul_shadow_cfg(ctx, fi->fi_devi);
 			}
 		}
 	}
@@ -1773,6 +1873,220 @@ deinit_pci(struct vmctx *ctx)
 	}
 }
 
+/*
+ * Snapshot of the PCI devices, see snapshot.c
+ *
+ * A record per device: struct pci_snapshot_rec, the MSI-X table entries,
+ * then dev_size bytes written by the vdev_snapshot hook of the device. The
+ * records end with one of bdf PCI_SNAPSHOT_END.
+ */
+#define PCI_SNAPSHOT_END	0xffffffffU
+
+struct pci_snapshot_rec {
+	uint32_t	bdf;
+	uint32_t	dev_size;	/* of the device state that follows */
+	char		class_name[32];
+	uint32_t	msix_count;	/* MSI-X table entries that follow */
+	uint32_t	reserved;
+	uint8_t		cfgdata[PCI_REGMAX + 1];
+};
+
+static struct pci_vdev *
+pci_snapshot_next(int *bus, int *slot, int *func)
+{
+	struct businfo *bi;
+	struct pci_vdev *dev;
+
+	for (; *bus < MAXBUSES; (*bus)++, *slot = 0) {
+		bi = pci_businfo[*bus];
+		if (bi == NULL)
+			continue;
+		for (; *slot < MAXSLOTS; (*slot)++, *func = 0) {
+			for (; *func < MAXFUNCS; (*func)++) {
+				dev = bi->slotinfo[*slot].si_funcs[*func].fi_devi;
+				if (dev != NULL) {
+					(*func)++;
+					return dev;
+				}
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * The config space of a passthrough device and the state of the physical
+ * device behind it cannot be saved.
+ */
+int
+pci_snapshot_capable(void)
+{
+	struct pci_vdev *dev;
+	int bus = 0, slot = 0, func = 0;
+
+	while ((dev = pci_snapshot_next(&bus, &slot, &func)) != NULL) {
+		if (is_pt_pci(dev)) {
+			pr_err("%s: %x:%x.%x is a passthrough device\n", __func__,
+				dev->bus, dev->slot, dev->func);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int
+pci_snapshot(struct vmctx *ctx, int fd)
+{
+	struct pci_snapshot_rec rec;
+	struct pci_vdev_ops *ops;
+	struct pci_vdev *dev;
+	off_t off;
+	int bus = 0, slot = 0, func = 0;
+
+	while ((dev = pci_snapshot_next(&bus, &slot, &func)) != NULL) {
+		ops = dev->dev_ops;
+		bzero(&rec, sizeof(rec));
+		rec.bdf = PCI_BDF(dev->bus, dev->slot, dev->func);
+		strncpy(rec.class_name, ops->class_name, sizeof(rec.class_name) - 1);
+		rec.msix_count = (dev->msix.table != NULL) ? dev->msix.table_count : 0;
+		memcpy(rec.cfgdata, dev->cfgdata, sizeof(rec.cfgdata));
+
+		off = lseek(fd, 0, SEEK_CUR);
+		if (snapshot_write(fd, &rec, sizeof(rec)) != 0 ||
+		    snapshot_write(fd, dev->msix.table,
+				rec.msix_count * sizeof(struct msix_table_entry)) != 0)
+			return -1;
+
+		if (ops->vdev_snapshot != NULL) {
+			if ((*ops->vdev_snapshot)(ctx, dev, fd) != 0) {
+				pr_err("%s: could not save %s at %x:%x.%x\n", __func__,
+					ops->class_name, dev->bus, dev->slot, dev->func);
+				return -1;
+			}
+			rec.dev_size = lseek(fd, 0, SEEK_CUR) - off - sizeof(rec) -
+				rec.msix_count * sizeof(struct msix_table_entry);
+			if (pwrite(fd, &rec.dev_size, sizeof(rec.dev_size),
+				   off + offsetof(struct pci_snapshot_rec, dev_size)) !=
+			    sizeof(rec.dev_size))
+				return -1;
+		} else {
+			pr_notice("%s: only the config space of %s at %x:%x.%x is saved\n",
+				__func__, ops->class_name, dev->bus, dev->slot, dev->func);
+		}
+	}
+
+	bzero(&rec, sizeof(rec));
+	rec.bdf = PCI_SNAPSHOT_END;
+	return snapshot_write(fd, &rec, sizeof(rec));
+}
+
+/* Write the MSI or MSI-X capability at capoff back, its message control last */
+static void
+pci_restore_msicap(struct vmctx *ctx, struct pci_vdev *dev, const uint8_t *cfg,
+		int capoff)
+{
+	uint32_t val;
+	int off, end;
+
+	end = cfg[capoff + 1] ? cfg[capoff + 1] : dev->capend + 1;
+	for (off = capoff + 4; off + 4 <= end; off += 4) {
+		memcpy(&val, &cfg[off], sizeof(val));
+		pci_cfgrw(ctx, 0, 0, dev->bus, dev->slot, dev->func, off, 4, &val);
+	}
+
+	val = cfg[capoff + 2] | (cfg[capoff + 3] << 8);
+	pci_cfgrw(ctx, 0, 0, dev->bus, dev->slot, dev->func, capoff + 2, 2, &val);
+}
+
+/*
+ * The config space is written back the way the guest would: the BARs with the
+ * decoding off, the MSI and MSI-X capabilities, then the command register.
+ */
+static void
+pci_restore_cfg(struct vmctx *ctx, struct pci_vdev *dev, const uint8_t *cfg)
+{
+	uint32_t val;
+	int idx, capoff;
+
+	val = 0;
+	pci_cfgrw(ctx, 0, 0, dev->bus, dev->slot, dev->func, PCIR_COMMAND, 2, &val);
+	for (idx = 0; idx <= PCI_BARMAX; idx++) {
+		if (dev->bar[idx].type == PCIBAR_NONE)
+			continue;
+		memcpy(&val, &cfg[PCIR_BAR(idx)], sizeof(val));
+		pci_cfgrw(ctx, 0, 0, dev->bus, dev->slot, dev->func, PCIR_BAR(idx), 4, &val);
+	}
+
+	if (pci_get_cfgdata16(dev, PCIR_STATUS) & PCIM_STATUS_CAPPRESENT) {
+		for (capoff = pci_get_cfgdata8(dev, PCIR_CAP_PTR); capoff != 0;
+		     capoff = pci_get_cfgdata8(dev, capoff + 1)) {
+			if (cfg[capoff] == PCIY_MSI || cfg[capoff] == PCIY_MSIX)
+				pci_restore_msicap(ctx, dev, cfg, capoff);
+		}
+	}
+
+	val = cfg[PCIR_INTLINE];
+	pci_cfgrw(ctx, 0, 0, dev->bus, dev->slot, dev->func, PCIR_INTLINE, 1, &val);
+	val = cfg[PCIR_COMMAND] | (cfg[PCIR_COMMAND + 1] << 8);
+	pci_cfgrw(ctx, 0, 0, dev->bus, dev->slot, dev->func, PCIR_COMMAND, 2, &val);
+}
+
+int
+pci_restore(struct vmctx *ctx, int fd)
+{
+	struct pci_snapshot_rec rec;
+	struct pci_vdev_ops *ops;
+	struct pci_vdev *dev;
+	struct businfo *bi;
+	size_t msix_size;
+	off_t end;
+	int bus, slot, func;
+
+	for (;;) {
+		if (snapshot_read(fd, &rec, sizeof(rec)) != 0)
+			return -1;
+		if (rec.bdf == PCI_SNAPSHOT_END)
+			break;
+
+		bus = (rec.bdf >> 8) & 0xff;
+		slot = (rec.bdf >> 3) & 0x1f;
+		func = rec.bdf & 0x7;
+		bi = pci_businfo[bus];
+		dev = (bi != NULL) ? bi->slotinfo[slot].si_funcs[func].fi_devi : NULL;
+		rec.class_name[sizeof(rec.class_name) - 1] = '\0';
+		if (dev == NULL || strcmp(dev->dev_ops->class_name, rec.class_name) ||
+		    rec.msix_count != ((dev->msix.table != NULL) ? dev->msix.table_count : 0)) {
+			pr_err("%s: %s at %x:%x.%x is not configured the same way\n", __func__,
+				rec.class_name, bus, slot, func);
+			return -1;
+		}
+		ops = dev->dev_ops;
+
+		msix_size = rec.msix_count * sizeof(struct msix_table_entry);
+		if (snapshot_read(fd, dev->msix.table, msix_size) != 0)
+			return -1;
+		pci_restore_cfg(ctx, dev, rec.cfgdata);
+
+		end = lseek(fd, 0, SEEK_CUR) + rec.dev_size;
+		if (ops->vdev_restore != NULL && rec.dev_size > 0 &&
+		    (*ops->vdev_restore)(ctx, dev, fd) != 0) {
+			pr_err("%s: could not restore %s at %x:%x.%x\n", __func__,
+				ops->class_name, dev->bus, dev->slot, dev->func);
+			return -1;
+		}
+		if (lseek(fd, end, SEEK_SET) != end)
+			return -1;
+
+		/* the BARs have moved since the shadow was registered */
+		if (dev->cfg_shadowed)
+			pci_emul_shadow_cfg(ctx, dev);
+	}
+
+	return 0;
+}
+
 static void
 pci_apic_prt_entry(int bus, int slot, int pin, int pirq_pin, int ioapic_irq,
 		   void *arg)
@@ -0,0 +1,475 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * The device the hvbench payload (misc/debug_tools/hvbench) reports to. Its
+ * I/O port and MMIO BARs are the targets of the I/O requests the payload
+ * times, it collects the results, writes them as JSON and powers the VM off
+ * once the payload is done:
+ *
+ *   -s <slot>,hvbench,report=<file>[,iters=<n>][,<op>=<cycles>...]
+ *
+ * An <op>=<cycles> is the highest median, in TSC cycles, the operation may
+ * take: the DM exits with 1 if one took longer or the payload faulted, for a
+ * CI to catch the regressions. The ops are cpuid, pio_hv, pio_dm, mmio_dm,
+ * hypercall, ipi, irq_msi, irq_irqfd and irq_intx.
+ *
+ * The device raises the interrupts of the irq_* ops from a thread of its own,
+ * with the latency probe of the hypervisor running: the report also has the
+ * latencies it measured, from the interrupts posted to the vCPU to their ack
+ * by the payload through ACRN_MSR_LAT_ACK, and from the passthrough interrupts
+ * of the VM, if any, in the hypervisor to posted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "vmmapi.h"
+#include "mevent.h"
+#include "hvbench.h"
+#include "types.h"
+#include "log.h"
+
+#define HVBENCH_ITERS_DEFAULT	10000U
+
+/* the delay before raising an interrupt, in us */
+#define HVBENCH_IRQ_DELAY_MIN	20
+#define HVBENCH_IRQ_DELAY_RANGE	80
+
+static const char *const hvbench_ops[HVBENCH_OP_NUM] = {
+	[HVBENCH_OP_CPUID] = "cpuid",
+	[HVBENCH_OP_PIO_HV] = "pio_hv",
+	[HVBENCH_OP_PIO_DM] = "pio_dm",
+	[HVBENCH_OP_MMIO_DM] = "mmio_dm",
+	[HVBENCH_OP_HYPERCALL] = "hypercall",
+	[HVBENCH_OP_IPI] = "ipi",
+	[HVBENCH_OP_IRQ_MSI] = "irq_msi",
+	[HVBENCH_OP_IRQ_IRQFD] = "irq_irqfd",
+	[HVBENCH_OP_IRQ_INTX] = "irq_intx",
+};
+
+struct hvbench_vdev {
+	char *report;
+	uint32_t iters;
+	uint32_t max_p50[HVBENCH_OP_NUM];	/* 0 if none */
+	struct hvbench_result results[HVBENCH_OP_NUM];
+	bool done;
+
+	struct pci_vdev *dev;
+	pthread_t irq_tid;
+	pthread_mutex_t irq_mtx;
+	pthread_cond_t irq_cond;
+	int irq_op;		/* to raise, -1 if none */
+	int irq_status;		/* of the last HVBENCH_REG_IRQ write */
+	volatile uint64_t irq_tsc;
+	int irqfd;		/* eventfd of the irqfd, -1 until the first irq_irqfd */
+	bool lat_started;	/* the latency probe of the hypervisor */
+	bool closing;
+};
+
+static int
+hvbench_parse(struct hvbench_vdev *bench, char *opts)
+{
+	char *opt, *val;
+	unsigned int n;
+	int i;
+
+	while ((opt = strsep(&opts, ",")) != NULL) {
+		val = strchr(opt, '=');
+		if (val == NULL)
+			goto invalid;
+		*val++ = '\0';
+
+		if (!strcmp(opt, "report")) {
+			free(bench->report);
+			bench->report = strdup(val);
+			continue;
+		}
+
+		if (dm_strtoui(val, NULL, 10, &n) || n == 0)
+			goto invalid;
+
+		if (!strcmp(opt, "iters")) {
+			if (n > HVBENCH_ITERS_MAX)
+				goto invalid;
+			bench->iters = n;
+			continue;
+		}
+
+		for (i = 0; i < HVBENCH_OP_NUM; i++) {
+			if (!strcmp(opt, hvbench_ops[i])) {
+				bench->max_p50[i] = n;
+				break;
+			}
+		}
+		if (i == HVBENCH_OP_NUM)
+			goto invalid;
+	}
+
+	if (bench->report == NULL) {
+		pr_err("hvbench: needs report=<file>\n");
+		return -1;
+	}
+
+	return 0;
+
+invalid:
+	pr_err("hvbench: invalid option %s\n", opt);
+	return -1;
+}
+
+static void
+hvbench_set_result(struct vmctx *ctx, struct hvbench_vdev *bench, uint64_t gpa)
+{
+	struct hvbench_result *res;
+
+	res = paddr_guest2host(ctx, gpa, sizeof(*res));
+	if (res == NULL || res->op >= HVBENCH_OP_NUM) {
+		pr_err("hvbench: invalid result at gpa 0x%lx\n", gpa);
+		return;
+	}
+
+	bench->results[res->op] = *res;
+	if (res->count == 0)
+		pr_notice("hvbench: %s not available\n", hvbench_ops[res->op]);
+	else
+		pr_notice("hvbench: %s min %u p50 %u p99 %u max %u cycles\n", hvbench_ops[res->op],
+				res->min, res->p50, res->p99, res->max);
+}
+
+static void
+hvbench_report_lat(FILE *fp, const char *name, const struct acrn_lat_hist *hist)
+{
+	uint32_t b;
+
+	fprintf(fp, "\n    \"%s\": {\"count\": %lu, \"mean_ns\": %lu, \"max_ns\": %lu,\n"
+			"      \"log2_hist_ns\": [", name, hist->count,
+			hist->count ? hist->sum_ns / hist->count : 0, hist->max_ns);
+	for (b = 0; b < ACRN_LAT_BUCKETS; b++)
+		fprintf(fp, "%s%lu", (b == 0) ? "" : ", ", hist->bucket[b]);
+	fprintf(fp, "]}");
+}
+
+/* write the report, return whether all the medians are within their limit */
+static bool
+hvbench_report(struct vmctx *ctx, struct hvbench_vdev *bench)
+{
+	struct hvbench_result *res;
+	struct acrn_vm_latency lat;
+	bool pass = true, regressed;
+	FILE *fp;
+	int i, b;
+
+	fp = fopen(bench->report, "w");
+	if (fp == NULL)
+		pr_err("hvbench: failed to open %s: %s\n", bench->report, strerror(errno));
+
+	if (fp)
+		fprintf(fp, "{\n  \"iters\": %u,\n  \"ops\": {", bench->iters);
+	for (i = 0; i < HVBENCH_OP_NUM; i++) {
+		res = &bench->results[i];
+		regressed = (res->count != 0) && (bench->max_p50[i] != 0) && (res->p50 > bench->max_p50[i]);
+		if (regressed) {
+			pr_err("hvbench: %s p50 %u cycles, above %u\n", hvbench_ops[i],
+					res->p50, bench->max_p50[i]);
+			pass = false;
+		}
+		if (fp == NULL || res->count == 0)
+			continue;
+
+		fprintf(fp, "%s\n    \"%s\": {\"count\": %u, \"mean\": %lu, \"min\": %u, "
+				"\"p50\": %u, \"p99\": %u, \"max\": %u, \"regressed\": %s,\n"
+				"      \"log2_hist\": [",
+				(i == 0) ? "" : ",", hvbench_ops[i], res->count, res->total / res->count,
+				res->min, res->p50, res->p99, res->max, regressed ? "true" : "false");
+		for (b = 0; b < HVBENCH_HIST_BUCKETS; b++)
+			fprintf(fp, "%s%u", (b == 0) ? "" : ", ", res->hist[b]);
+		fprintf(fp, "]}");
+	}
+
+	if (fp)
+		fprintf(fp, "\n  },");
+
+	if (bench->lat_started) {
+		memset(&lat, 0, sizeof(lat));
+		lat.cmd = ACRN_LAT_CMD_STOP;
+		if (vm_latency_probe(ctx, &lat) == 0 && fp) {
+			fprintf(fp, "\n  \"hv_latency\": {");
+			hvbench_report_lat(fp, "posted_to_ack", &lat.hist[ACRN_LAT_ACK]);
+			fprintf(fp, ",");
+			hvbench_report_lat(fp, "passthrough_to_posted", &lat.hist[ACRN_LAT_IRQ]);
+			fprintf(fp, "\n  },");
+		}
+	}
+
+	if (fp) {
+		fprintf(fp, "\n  \"pass\": %s\n}\n", pass ? "true" : "false");
+		if (fclose(fp) != 0) {
+			pr_err("hvbench: failed to write %s\n", bench->report);
+			pass = false;
+		}
+	} else
+		pass = false;
+
+	return pass;
+}
+
+/* the MSI of the device through an irqfd, registered on first use */
+static int
+hvbench_irqfd_init(struct vmctx *ctx, struct hvbench_vdev *bench)
+{
+	struct acrn_irqfd irqfd;
+
+	if (bench->irqfd >= 0)
+		return 0;
+	if (!pci_msi_enabled(bench->dev))
+		return -1;
+
+	bench->irqfd = eventfd(0, EFD_CLOEXEC);
+	if (bench->irqfd < 0)
+		return -1;
+
+	memset(&irqfd, 0, sizeof(irqfd));
+	irqfd.fd = bench->irqfd;
+	irqfd.msi.msi_addr = bench->dev->msi.addr;
+	irqfd.msi.msi_data = bench->dev->msi.msg_data;
+	if (vm_irqfd(ctx, &irqfd) < 0) {
+		close(bench->irqfd);
+		bench->irqfd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+hvbench_irqfd_deinit(struct vmctx *ctx, struct hvbench_vdev *bench)
+{
+	struct acrn_irqfd irqfd;
+
+	if (bench->irqfd < 0)
+		return;
+
+	memset(&irqfd, 0, sizeof(irqfd));
+	irqfd.fd = bench->irqfd;
+	irqfd.flags = ACRN_IRQFD_FLAG_DEASSIGN;
+	vm_irqfd(ctx, &irqfd);
+	close(bench->irqfd);
+	bench->irqfd = -1;
+}
+
+/* check the interrupt can be raised and hand it to the irq thread */
+static int
+hvbench_irq_request(struct vmctx *ctx, struct hvbench_vdev *bench, uint64_t op)
+{
+	struct acrn_vm_latency lat;
+
+	if (op == HVBENCH_OP_IRQ_MSI) {
+		if (!pci_msi_enabled(bench->dev))
+			return -1;
+	} else if (op == HVBENCH_OP_IRQ_IRQFD) {
+		if (hvbench_irqfd_init(ctx, bench) < 0)
+			return -1;
+	} else if (op != HVBENCH_OP_IRQ_INTX)
+		return -1;
+
+	if (!bench->lat_started) {
+		memset(&lat, 0, sizeof(lat));
+		lat.cmd = ACRN_LAT_CMD_START;
+		bench->lat_started = (vm_latency_probe(ctx, &lat) == 0);
+	}
+
+	pthread_mutex_lock(&bench->irq_mtx);
+	bench->irq_op = (int)op;
+	pthread_cond_signal(&bench->irq_cond);
+	pthread_mutex_unlock(&bench->irq_mtx);
+
+	return 0;
+}
+
+/* raise the interrupts after a random delay, for the payload to wait for them */
+static void *
+hvbench_irq_thread(void *arg)
+{
+	struct hvbench_vdev *bench = arg;
+	struct timespec delay;
+	unsigned int seed = 1;
+	int op;
+
+	pthread_mutex_lock(&bench->irq_mtx);
+	for (;;) {
+		while (bench->irq_op < 0 && !bench->closing)
+			pthread_cond_wait(&bench->irq_cond, &bench->irq_mtx);
+		if (bench->closing)
+			break;
+		op = bench->irq_op;
+		bench->irq_op = -1;
+		pthread_mutex_unlock(&bench->irq_mtx);
+
+		delay.tv_sec = 0;
+		delay.tv_nsec = (HVBENCH_IRQ_DELAY_MIN + rand_r(&seed) % HVBENCH_IRQ_DELAY_RANGE) * 1000L;
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &delay, NULL);
+
+		bench->irq_tsc = rdtsc();
+		if (op == HVBENCH_OP_IRQ_MSI)
+			pci_generate_msi(bench->dev, 0);
+		else if (op == HVBENCH_OP_IRQ_IRQFD)
+			eventfd_write(bench->irqfd, 1);
+		else
+			pci_lintr_assert(bench->dev);
+
+		pthread_mutex_lock(&bench->irq_mtx);
+	}
+	pthread_mutex_unlock(&bench->irq_mtx);
+
+	return NULL;
+}
+
+static void
+hvbench_bar_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
+		int baridx, uint64_t offset, int size, uint64_t value)
+{
+	struct hvbench_vdev *bench = dev->arg;
+
+	if (baridx != HVBENCH_PIO_BAR || size != 4)
+		return;
+
+	switch (offset) {
+	case HVBENCH_REG_RESULT:
+		hvbench_set_result(ctx, bench, value);
+		break;
+	case HVBENCH_REG_IRQ:
+		bench->irq_status = hvbench_irq_request(ctx, bench, value);
+		break;
+	case HVBENCH_REG_IRQ_ACK:
+		pci_lintr_deassert(dev);
+		break;
+	case HVBENCH_REG_DONE:
+		if (bench->done)
+			break;
+		bench->done = true;
+		if (value != 0)
+			pr_err("hvbench: the payload faulted on vector %lu\n", value - 1);
+		if (!hvbench_report(ctx, bench) || value != 0)
+			dm_set_exit_code(1);
+		vm_suspend(ctx, VM_SUSPEND_POWEROFF);
+		mevent_notify();
+		break;
+	default:
+		break;
+	}
+}
+
+static uint64_t
+hvbench_bar_read(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
+		int baridx, uint64_t offset, int size)
+{
+	struct hvbench_vdev *bench = dev->arg;
+	uint64_t val = 0;
+
+	if (baridx == HVBENCH_PIO_BAR) {
+		if (offset == HVBENCH_REG_ID)
+			val = HVBENCH_MAGIC;
+		else if (offset == HVBENCH_REG_ITERS)
+			val = bench->iters;
+		else if (offset == HVBENCH_REG_IRQ)
+			val = (uint32_t)bench->irq_status;
+		else if (offset == HVBENCH_REG_IRQ_TSC)
+			val = (uint32_t)bench->irq_tsc;
+		else if (offset == HVBENCH_REG_IRQ_TSC + 4)
+			val = (uint32_t)(bench->irq_tsc >> 32);
+	}
+
+	return val;
+}
+
+static int
+hvbench_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct hvbench_vdev *bench;
+	char *tmp;
+	int ret;
+
+	bench = calloc(1, sizeof(*bench));
+	if (bench == NULL)
+		return -1;
+	bench->iters = HVBENCH_ITERS_DEFAULT;
+	bench->irq_op = -1;
+	bench->irqfd = -1;
+
+	tmp = opts ? strdup(opts) : NULL;
+	ret = hvbench_parse(bench, tmp);
+	free(tmp);
+	if (ret != 0) {
+		free(bench->report);
+		free(bench);
+		return -1;
+	}
+
+	dev->arg = bench;
+	pci_set_cfgdata16(dev, PCIR_VENDOR, HVBENCH_VENDOR_ID);
+	pci_set_cfgdata16(dev, PCIR_DEVICE, HVBENCH_DEVICE_ID);
+	pci_set_cfgdata8(dev, PCIR_CLASS, PCIC_BASEPERIPH);
+	pci_set_cfgdata8(dev, PCIR_SUBCLASS, PCIS_BASEPERIPH_OTHER);
+
+	if (pci_emul_add_msicap(dev, 1) != 0 ||
+	    pci_emul_alloc_bar(dev, HVBENCH_PIO_BAR, PCIBAR_IO, HVBENCH_PIO_SIZE) != 0 ||
+	    pci_emul_alloc_bar(dev, HVBENCH_MMIO_BAR, PCIBAR_MEM32, HVBENCH_MMIO_SIZE) != 0)
+		goto fail;
+	pci_lintr_request(dev);
+
+	bench->dev = dev;
+	pthread_mutex_init(&bench->irq_mtx, NULL);
+	pthread_cond_init(&bench->irq_cond, NULL);
+	if (pthread_create(&bench->irq_tid, NULL, hvbench_irq_thread, bench) != 0)
+		goto fail;
+	pthread_setname_np(bench->irq_tid, "hvbench");
+
+	return 0;
+
+fail:
+	dev->arg = NULL;
+	free(bench->report);
+	free(bench);
+	return -1;
+}
+
+static void
+hvbench_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct hvbench_vdev *bench = dev->arg;
+
+	if (bench == NULL)
+		return;
+
+	pthread_mutex_lock(&bench->irq_mtx);
+	bench->closing = true;
+	pthread_cond_signal(&bench->irq_cond);
+	pthread_mutex_unlock(&bench->irq_mtx);
+	pthread_join(bench->irq_tid, NULL);
+	hvbench_irqfd_deinit(ctx, bench);
+
+	free(bench->report);
+	free(bench);
+	dev->arg = NULL;
+}
+
+struct pci_vdev_ops pci_ops_hvbench = {
+	.class_name	= "hvbench",
+	.vdev_init	= hvbench_init,
+	.vdev_deinit	= hvbench_deinit,
+	.vdev_barwrite	= hvbench_bar_write,
+	.vdev_barread	= hvbench_bar_read,
+};
+DEFINE_PCI_DEVTYPE(pci_ops_hvbench);
@@ -44,6 +44,7 @@
 #include "vmmapi.h"
 #include "dm_string.h"
 #include "log.h"
+#include "acrn_ivshmem_virtio.h"
 
 #define	IVSHMEM_MMIO_BAR	0
 #define	IVSHMEM_MSIX_BAR	1
@@ -76,8 +77,51 @@ struct pci_ivshmem_vdev {
 	void		*addr;
 	uint32_t	size;
 	bool		is_hv_land;
+	uint16_t	virtio_id;
+	uint8_t		virtio_role;
+};
+
+/* the virtio devices that can run over an HV-land region */
+static const struct {
+	const char	*name;
+	uint16_t	id;
+} ivshmem_virtio_devs[] = {
+	{"net",		1},
+	{"console",	3},
+	{"vsock",	19},
 };
 
+static int
+parse_ivshmem_virtio(struct pci_ivshmem_vdev *ivshmem_vdev, char *opts)
+{
+	char *opt;
+	int i;
+
+	while ((opt = strsep(&opts, ",")) != NULL) {
+		if (!strncmp(opt, "virtio=", 7)) {
+			opt += 7;
+			for (i = 0; i < ARRAY_SIZE(ivshmem_virtio_devs); i++) {
+				if (!strcmp(opt, ivshmem_virtio_devs[i].name)) {
+					ivshmem_vdev->virtio_id = ivshmem_virtio_devs[i].id;
+					break;
+				}
+			}
+			if (i == ARRAY_SIZE(ivshmem_virtio_devs)) {
+				pr_warn("unsupported virtio device over ivshmem: %s\n", opt);
+				return -1;
+			}
+		} else if (!strcmp(opt, "frontend")) {
+			ivshmem_vdev->virtio_role = IVSHMEM_VIRTIO_FRONTEND;
+		} else if (!strcmp(opt, "backend")) {
+			ivshmem_vdev->virtio_role = IVSHMEM_VIRTIO_BACKEND;
+		} else if (*opt != '\0') {
+			pr_warn("invalid ivshmem option %s\n", opt);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 static int
 create_ivshmem_from_dm(struct vmctx *ctx, struct pci_vdev *vdev,
 		const char *name, uint32_t size)
@@ -148,6 +192,8 @@ create_ivshmem_from_hv(struct vmctx *ctx, struct pci_vdev *vdev,
 		const char *shm_name, uint32_t shm_size)
 {
 	struct acrn_vdev dev = {};
+	struct acrn_ivshmem_config *cfg = (struct acrn_ivshmem_config *)dev.args;
+	struct pci_ivshmem_vdev *ivshmem_vdev = (struct pci_ivshmem_vdev *) vdev->arg;
 	uint64_t addr = 0;
 
 	dev.id.fields.vendor = IVSHMEM_VENDOR_ID;
@@ -166,7 +212,10 @@ create_ivshmem_from_hv(struct vmctx *ctx, struct pci_vdev *vdev,
 	addr = pci_get_cfgdata32(vdev, PCIR_BAR(IVSHMEM_MEM_BAR + 1));
 	dev.io_addr[IVSHMEM_MEM_BAR + 1] = addr;
 	dev.io_size[IVSHMEM_MEM_BAR] = shm_size;
-	strncpy((char*)dev.args, shm_name, 32);
+	/* the hypervisor compares the whole field, a 32-char name has no NUL */
+	memcpy(cfg->shm_name, shm_name, strnlen(shm_name, sizeof(cfg->shm_name)));
+	cfg->virtio_id = ivshmem_vdev->virtio_id;
+	cfg->virtio_role = ivshmem_vdev->virtio_role;
 	return vm_add_hv_vdev(ctx, &dev);
 }
 
@@ -255,7 +304,10 @@ pci_ivshmem_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	bool is_hv_land;
 	int rc;
 
-	/* ivshmem device usage: "-s N,ivshmem,shm_name,shm_size" */
+	/*
+	 * ivshmem device usage:
+	 * "-s N,ivshmem,shm_name,shm_size[,virtio=net|console|vsock,frontend|backend]"
+	 */
 	tmp = orig = strdup(opts);
 	if (!orig) {
 		pr_warn("No memory for strdup\n");
@@ -299,6 +351,17 @@ pci_ivshmem_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	ivshmem_vdev->is_hv_land = is_hv_land;
 	dev->arg = ivshmem_vdev;
 
+	if (*tmp == ',') {
+		tmp++;
+		if (parse_ivshmem_virtio(ivshmem_vdev, tmp) != 0)
+			goto err;
+		/* the transport needs the doorbells of the HV-land server */
+		if (ivshmem_vdev->virtio_id != 0 && !is_hv_land) {
+			pr_warn("virtio over ivshmem needs an hv:/ region\n");
+			goto err;
+		}
+	}
+
 	/* initialize config space */
 	pci_set_cfgdata16(dev, PCIR_VENDOR, IVSHMEM_VENDOR_ID);
 	pci_set_cfgdata16(dev, PCIR_DEVICE, IVSHMEM_DEVICE_ID);
@@ -147,6 +147,89 @@ cfginit_cap(struct vmctx *ctx, struct passthru_dev *ptdev)
 	return 0;
 }
 
+static void
+shadow_cfg(struct passthru_dev *ptdev, int reg, int width)
+{
+	uint32_t val = read_config(ptdev->phys_dev, reg, width);
+	int word;
+
+	memcpy(&ptdev->cfg_shadow[reg], &val, width);
+	for (word = reg >> 1; word < ((reg + width + 1) >> 1); word++)
+		ptdev->cfg_shadow_map[word >> 6] |= 1UL << (word & 0x3f);
+}
+
+static bool
+is_cfg_shadowed(struct passthru_dev *ptdev, int reg, int width)
+{
+	int word;
+	bool ret = true;
+
+	for (word = reg >> 1; word < ((reg + width + 1) >> 1); word++) {
+		if ((ptdev->cfg_shadow_map[word >> 6] & (1UL << (word & 0x3f))) == 0) {
+			ret = false;
+			break;
+		}
+	}
+	return ret;
+}
+
+/*
+ * The guest keeps polling the IDs and the capabilities of the devices, and
+ * each read of the physical config space is a sysfs access. Cache the
+ * registers the PCI spec defines as read-only: the IDs, the capability
+ * headers and the capability registers. Status, control and vendor specific
+ * registers are still read from the device.
+ */
+static void
+cfginit_shadow(struct passthru_dev *ptdev)
+{
+	struct pci_device *phys_dev = ptdev->phys_dev;
+	uint32_t hdr;
+	int ptr, cap, cnt, version;
+
+	memset(ptdev->cfg_shadow_map, 0, sizeof(ptdev->cfg_shadow_map));
+
+	shadow_cfg(ptdev, PCIR_VENDOR, 4);
+	shadow_cfg(ptdev, PCIR_REVID, 4);
+	shadow_cfg(ptdev, PCIR_SUBVEND_0, 4);
+
+	if (read_config(phys_dev, PCIR_STATUS, 2) & PCIM_STATUS_CAPPRESENT) {
+		shadow_cfg(ptdev, PCIR_CAP_PTR, 1);
+		ptr = read_config(phys_dev, PCIR_CAP_PTR, 1);
+		for (cnt = 0; ptr >= PCIR_MAXLAT + 1 && ptr != 0xff && cnt < 48; cnt++) {
+			cap = read_config(phys_dev, ptr + PCICAP_ID, 1);
+			if (cap == PCIY_PMG || cap == PCIY_PCIAF) {
+				shadow_cfg(ptdev, ptr, 4);
+			} else if (cap == PCIY_EXPRESS) {
+				shadow_cfg(ptdev, ptr, 4);
+				shadow_cfg(ptdev, ptr + PCIER_DEVICE_CAP, 4);
+				shadow_cfg(ptdev, ptr + PCIER_LINK_CAP, 4);
+				shadow_cfg(ptdev, ptr + PCIER_SLOT_CAP, 4);
+				version = read_config(phys_dev, ptr + PCIER_FLAGS, 2) & PCIEM_FLAGS_VERSION;
+				if (version >= 2) {
+					shadow_cfg(ptdev, ptr + PCIER_DEVICE_CAP2, 4);
+					shadow_cfg(ptdev, ptr + PCIER_LINK_CAP2, 4);
+				}
+			} else if (cap != PCIY_MSI && cap != PCIY_MSIX && cap != PCIY_VENDOR) {
+				/* the rest of MSI/MSI-X is emulated, the vendor ones vary */
+				shadow_cfg(ptdev, ptr, 2);
+			}
+			ptr = read_config(phys_dev, ptr + PCICAP_NEXTPTR, 1);
+		}
+	}
+
+	if (ptdev->pcie_cap) {
+		ptr = PCIR_EXTCAP;
+		for (cnt = 0; ptr >= PCIR_EXTCAP && ptr <= PCIE_REGMAX - 3 && cnt < 480; cnt++) {
+			hdr = read_config(phys_dev, ptr, 4);
+			if (hdr == 0 || hdr == 0xffffffff)
+				break;
+			shadow_cfg(ptdev, ptr, 4);
+			ptr = PCI_EXTCAP_NEXTPTR(hdr);
+		}
+	}
+}
+
 static int
 passthru_set_power_state(struct passthru_dev *ptdev, uint16_t dpsts) {
 	int ret = -1;
@@ -419,6 +502,7 @@ cfginit(struct vmctx *ctx, struct passthru_dev *ptdev, int bus,
 		    bus, slot, func);
 		return -1;
 	}
+	cfginit_shadow(ptdev);
 
 	/* Check MSI or MSIX capabilities */
 	if (ptdev->msi.capoff == 0 && ptdev->msix.capoff == 0) {
@@ -1037,7 +1121,10 @@ passthru_cfgread(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		*rv = pci_get_cfgdata32(dev, coff);
 	} else if (ptdev->has_virt_pcicfg_regs && ptdev->has_virt_pcicfg_regs(coff))
 		*rv = pci_get_cfgdata32(dev, coff);
-	else
+	else if (is_cfg_shadowed(ptdev, coff, bytes)) {
+		*rv = 0;
+		memcpy(rv, &ptdev->cfg_shadow[coff], bytes);
+	} else
 		*rv = read_config(ptdev->phys_dev, coff, bytes);
 
 	return 0;
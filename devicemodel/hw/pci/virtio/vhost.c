@@ -31,6 +31,8 @@ static int vhost_debug;
        do { if (vhost_debug) pr_dbg(LOG_TAG fmt, ##args); } while (0)
 #define WPRINTF(fmt, args...) pr_err(LOG_TAG fmt, ##args)
 
+static const struct vhost_backend_ops vhost_kernel_ops;
+
 inline
 int vhost_kernel_ioctl(struct vhost_dev *vdev,
 		       unsigned long int request,
@@ -54,6 +56,8 @@ vhost_kernel_init(struct vhost_dev *vdev, struct virtio_base *base,
 	vdev->fd = fd;
 	vdev->vq_idx = vq_idx;
 	vdev->busyloop_timeout = busyloop_timeout;
+	vdev->ops = (vdev->backend == VHOST_BACKEND_USER) ?
+		&vhost_user_ops : &vhost_kernel_ops;
 }
 
 static void
@@ -324,7 +328,7 @@ vhost_vq_start(struct vhost_dev *vdev, int idx)
 	/* VHOST_SET_VRING_NUM */
 	ring.index = idx;
 	ring.num = vqi->qsize;
-	rc = vhost_kernel_set_vring_num(vdev, &ring);
+	rc = vdev->ops->set_vring_num(vdev, &ring);
 	if (rc < 0) {
 		WPRINTF("set_vring_num failed: idx = %d\n", idx);
 		goto fail_vring;
@@ -332,7 +336,7 @@ vhost_vq_start(struct vhost_dev *vdev, int idx)
 
 	/* VHOST_SET_VRING_BASE */
 	ring.num = vqi->last_avail;
-	rc = vhost_kernel_set_vring_base(vdev, &ring);
+	rc = vdev->ops->set_vring_base(vdev, &ring);
 	if (rc < 0) {
 		WPRINTF("set_vring_base failed: idx = %d, last_avail = %d\n",
 			idx, vqi->last_avail);
@@ -346,7 +350,7 @@ vhost_vq_start(struct vhost_dev *vdev, int idx)
 	addr.used_user_addr = (uintptr_t)vqi->used;
 	addr.log_guest_addr = (uintptr_t)NULL;
 	addr.flags = 0;
-	rc = vhost_kernel_set_vring_addr(vdev, &addr);
+	rc = vdev->ops->set_vring_addr(vdev, &addr);
 	if (rc < 0) {
 		WPRINTF("set_vring_addr failed: idx = %d\n", idx);
 		goto fail_vring;
@@ -355,7 +359,7 @@ vhost_vq_start(struct vhost_dev *vdev, int idx)
 	/* VHOST_SET_VRING_CALL */
 	file.index = idx;
 	file.fd = vq->call_fd;
-	rc = vhost_kernel_set_vring_call(vdev, &file);
+	rc = vdev->ops->set_vring_call(vdev, &file);
 	if (rc < 0) {
 		WPRINTF("set_vring_call failed\n");
 		goto fail_vring;
@@ -364,18 +368,32 @@ vhost_vq_start(struct vhost_dev *vdev, int idx)
 	/* VHOST_SET_VRING_KICK */
 	file.index = idx;
 	file.fd = vq->kick_fd;
-	rc = vhost_kernel_set_vring_kick(vdev, &file);
+	rc = vdev->ops->set_vring_kick(vdev, &file);
 	if (rc < 0) {
 		WPRINTF("set_vring_kick failed: idx = %d", idx);
 		goto fail_vring_kick;
 	}
 
+	/* vhost-user rings start disabled with the protocol features */
+	if (vdev->ops->set_vring_enable) {
+		rc = vdev->ops->set_vring_enable(vdev, idx, true);
+		if (rc < 0) {
+			WPRINTF("set_vring_enable failed: idx = %d\n", idx);
+			goto fail_vring_enable;
+		}
+	}
+
 	return 0;
 
+fail_vring_enable:
+	file.index = idx;
+	file.fd = -1;
+	vdev->ops->set_vring_kick(vdev, &file);
+
 fail_vring_kick:
 	file.index = idx;
 	file.fd = -1;
-	vhost_kernel_set_vring_call(vdev, &file);
+	vdev->ops->set_vring_call(vdev, &file);
 fail_vring:
 	vhost_vq_register_eventfd(vdev, idx, false);
 fail:
@@ -405,18 +423,21 @@ vhost_vq_stop(struct vhost_dev *vdev, int idx)
 	}
 	vqi = &vdev->base->queues[q_idx];
 
+	if (vdev->ops->set_vring_enable)
+		vdev->ops->set_vring_enable(vdev, idx, false);
+
 	file.index = idx;
 	file.fd = -1;
 
 	/* VHOST_SET_VRING_KICK */
-	vhost_kernel_set_vring_kick(vdev, &file);
+	vdev->ops->set_vring_kick(vdev, &file);
 
 	/* VHOST_SET_VRING_CALL */
-	vhost_kernel_set_vring_call(vdev, &file);
+	vdev->ops->set_vring_call(vdev, &file);
 
 	/* VHOST_GET_VRING_BASE */
 	ring.index = idx;
-	rc = vhost_kernel_get_vring_base(vdev, &ring);
+	rc = vdev->ops->get_vring_base(vdev, &ring);
 	if (rc < 0)
 		WPRINTF("get_vring_base failed: idx = %d", idx);
 	else
@@ -493,6 +514,22 @@ vhost_set_mem_table(struct vhost_dev *vdev)
 	return 0;
 }
 
+static const struct vhost_backend_ops vhost_kernel_ops = {
+	.set_mem_table			= vhost_set_mem_table,
+	.set_vring_addr			= vhost_kernel_set_vring_addr,
+	.set_vring_num			= vhost_kernel_set_vring_num,
+	.set_vring_base			= vhost_kernel_set_vring_base,
+	.get_vring_base			= vhost_kernel_get_vring_base,
+	.set_vring_kick			= vhost_kernel_set_vring_kick,
+	.set_vring_call			= vhost_kernel_set_vring_call,
+	.set_vring_busyloop_timeout	= vhost_kernel_set_vring_busyloop_timeout,
+	.set_vring_enable		= NULL,
+	.set_features			= vhost_kernel_set_features,
+	.get_features			= vhost_kernel_get_features,
+	.set_owner			= vhost_kernel_set_owner,
+	.reset_device			= vhost_kernel_reset_device,
+};
+
 /**
  * @brief vhost_dev initialization.
  *
@@ -501,7 +538,8 @@ vhost_set_mem_table(struct vhost_dev *vdev)
  *
  * @param vdev Pointer to struct vhost_dev.
  * @param base Pointer to struct virtio_base.
- * @param fd fd of the vhost chardev.
+ * @param fd fd of the vhost chardev, or of the vhost-user socket if
+ * vdev->backend is VHOST_BACKEND_USER.
  * @param vq_idx The first virtqueue which would be used by this vhost dev.
  * @param vhost_features Subset of vhost features which would be enabled.
  * @param vhost_ext_features Specific vhost internal features to be enabled.
@@ -539,7 +577,7 @@ vhost_dev_init(struct vhost_dev *vdev,
 
 	vhost_kernel_init(vdev, base, fd, vq_idx, busyloop_timeout);
 
-	rc = vhost_kernel_get_features(vdev, &features);
+	rc = vdev->ops->get_features(vdev, &features);
 	if (rc < 0) {
 		WPRINTF("vhost_get_features failed\n");
 		goto fail;
@@ -562,8 +600,10 @@ vhost_dev_init(struct vhost_dev *vdev,
 	 * mediator or configuration of device model(specified by
 	 * vhost_features), they should be disabled in device_caps,
 	 * which expose as virtio host_features for virtio FE driver.
+	 * Bits only the backend offers (e.g. the vhost-user ones) are
+	 * left alone.
 	 */
-	vdev->base->device_caps &= ~(vhost_features ^ features);
+	vdev->base->device_caps &= ~(vhost_features & ~features);
 	vdev->started = false;
 
 	return 0;
@@ -634,7 +674,7 @@ vhost_dev_start(struct vhost_dev *vdev)
 		goto fail;
 	}
 
-	rc = vhost_kernel_set_owner(vdev);
+	rc = vdev->ops->set_owner(vdev);
 	if (rc < 0) {
 		WPRINTF("vhost_set_owner failed\n");
 		goto fail;
@@ -643,7 +683,7 @@ vhost_dev_start(struct vhost_dev *vdev)
 	/* set vhost internal features */
 	features = (vdev->base->negotiated_caps & vdev->vhost_features) |
 		vdev->vhost_ext_features;
-	rc = vhost_kernel_set_features(vdev, features);
+	rc = vdev->ops->set_features(vdev, features);
 	if (rc < 0) {
 		WPRINTF("set_features failed\n");
 		goto fail;
@@ -651,7 +691,7 @@ vhost_dev_start(struct vhost_dev *vdev)
 	DPRINTF("set_features: 0x%lx\n", features);
 
 	/* set memory table */
-	rc = vhost_set_mem_table(vdev);
+	rc = vdev->ops->set_mem_table(vdev);
 	if (rc < 0) {
 		WPRINTF("set_mem_table failed\n");
 		goto fail;
@@ -662,7 +702,7 @@ vhost_dev_start(struct vhost_dev *vdev)
 		state.num = vdev->busyloop_timeout;
 		for (i = 0; i < vdev->nvqs; i++) {
 			state.index = i;
-			rc = vhost_kernel_set_vring_busyloop_timeout(vdev,
+			rc = vdev->ops->set_vring_busyloop_timeout(vdev,
 				&state);
 			if (rc < 0) {
 				WPRINTF("set_busyloop_timeout failed\n");
@@ -709,7 +749,7 @@ vhost_dev_stop(struct vhost_dev *vdev)
 	 * 1) resources of the vhost dev are freed
 	 * 2) vhost virtqueues are reset
 	 */
-	rc = vhost_kernel_reset_device(vdev);
+	rc = vdev->ops->reset_device(vdev);
 	if (rc < 0) {
 		WPRINTF("vhost_reset_device failed\n");
 		rc = -1;
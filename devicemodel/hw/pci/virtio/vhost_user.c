@@ -0,0 +1,489 @@
+/*
+ * Copyright (C) 2026 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * vhost-user transport of the vhost data plane.
+ *
+ * The vhost requests are carried as messages over a UNIX domain socket to a
+ * backend process, e.g. a DPDK or OVS switch, instead of ioctls on a vhost
+ * chardev. Eventfds and the fds of the guest memory are passed along with the
+ * messages as SCM_RIGHTS ancillary data, so the guest memory must be backed
+ * by shareable fds, which is the case with hugetlb.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/vhost.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "vmmapi.h"
+#include "log.h"
+#include "vhost.h"
+
+static int vhost_user_debug;
+#define LOG_TAG "vhost-user: "
+#define DPRINTF(fmt, args...) \
+	do { if (vhost_user_debug) pr_dbg(LOG_TAG fmt, ##args); } while (0)
+#define WPRINTF(fmt, args...) pr_err(LOG_TAG fmt, ##args)
+
+#define VHOST_USER_GET_FEATURES			1
+#define VHOST_USER_SET_FEATURES			2
+#define VHOST_USER_SET_OWNER			3
+#define VHOST_USER_SET_MEM_TABLE		5
+#define VHOST_USER_SET_VRING_NUM		8
+#define VHOST_USER_SET_VRING_ADDR		9
+#define VHOST_USER_SET_VRING_BASE		10
+#define VHOST_USER_GET_VRING_BASE		11
+#define VHOST_USER_SET_VRING_KICK		12
+#define VHOST_USER_SET_VRING_CALL		13
+#define VHOST_USER_GET_PROTOCOL_FEATURES	15
+#define VHOST_USER_SET_PROTOCOL_FEATURES	16
+#define VHOST_USER_SET_VRING_ENABLE		18
+
+#define VHOST_USER_VERSION		0x1
+#define VHOST_USER_VERSION_MASK		0x3
+#define VHOST_USER_REPLY_MASK		(0x1 << 2)
+#define VHOST_USER_NEED_REPLY_MASK	(0x1 << 3)
+
+/* payload flag of SET_VRING_KICK/CALL when no fd is passed */
+#define VHOST_USER_VRING_NOFD_MASK	(0x1 << 8)
+
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK	3
+#define VHOST_USER_PROTOCOL_FEATURES \
+	(1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK)
+
+#define VHOST_USER_MEMORY_MAX_NREGIONS	8
+
+struct vhost_user_mem_region {
+	uint64_t guest_phys_addr;
+	uint64_t memory_size;
+	uint64_t userspace_addr;
+	uint64_t mmap_offset;
+};
+
+struct vhost_user_memory {
+	uint32_t nregions;
+	uint32_t padding;
+	struct vhost_user_mem_region regions[VHOST_USER_MEMORY_MAX_NREGIONS];
+};
+
+struct vhost_user_msg {
+	uint32_t request;
+	uint32_t flags;
+	uint32_t size;		/* size of the payload */
+	union {
+		uint64_t u64;
+		struct vhost_vring_state state;
+		struct vhost_vring_addr addr;
+		struct vhost_user_memory memory;
+	} payload;
+} __attribute__((packed));
+
+#define VHOST_USER_HDR_SIZE	offsetof(struct vhost_user_msg, payload)
+
+static int
+vhost_user_send(struct vhost_dev *vdev, struct vhost_user_msg *msg,
+		int *fds, int nfds)
+{
+	char control[CMSG_SPACE(VHOST_USER_MEMORY_MAX_NREGIONS * sizeof(int))];
+	struct msghdr msgh;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	ssize_t rc;
+
+	iov.iov_base = msg;
+	iov.iov_len = VHOST_USER_HDR_SIZE + msg->size;
+
+	memset(&msgh, 0, sizeof(msgh));
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+
+	if (nfds > 0) {
+		memset(control, 0, sizeof(control));
+		msgh.msg_control = control;
+		msgh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+
+	do {
+		rc = sendmsg(vdev->fd, &msgh, MSG_NOSIGNAL);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc != iov.iov_len) {
+		WPRINTF("failed to send request %d, errno = %d\n",
+			msg->request, errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+vhost_user_recv(struct vhost_dev *vdev, struct vhost_user_msg *msg,
+		uint32_t request)
+{
+	ssize_t rc;
+
+	do {
+		rc = recv(vdev->fd, msg, VHOST_USER_HDR_SIZE, MSG_WAITALL);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc != VHOST_USER_HDR_SIZE) {
+		WPRINTF("failed to receive reply of request %d, errno = %d\n",
+			request, errno);
+		return -1;
+	}
+
+	if (msg->request != request ||
+		(msg->flags & VHOST_USER_VERSION_MASK) != VHOST_USER_VERSION ||
+		!(msg->flags & VHOST_USER_REPLY_MASK) ||
+		msg->size > sizeof(msg->payload)) {
+		WPRINTF("bad reply of request %d: request %d, flags 0x%x\n",
+			request, msg->request, msg->flags);
+		return -1;
+	}
+
+	if (msg->size) {
+		do {
+			rc = recv(vdev->fd, &msg->payload, msg->size,
+				MSG_WAITALL);
+		} while (rc < 0 && errno == EINTR);
+
+		if (rc != msg->size) {
+			WPRINTF("short reply of request %d\n", request);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+vhost_user_init_msg(struct vhost_user_msg *msg, uint32_t request,
+		    uint32_t size)
+{
+	memset(msg, 0, VHOST_USER_HDR_SIZE);
+	msg->request = request;
+	msg->flags = VHOST_USER_VERSION;
+	msg->size = size;
+}
+
+/*
+ * Wait for the ack of a request sent with VHOST_USER_NEED_REPLY_MASK, a
+ * non-zero payload means the backend failed the request.
+ */
+static int
+vhost_user_wait_ack(struct vhost_dev *vdev, uint32_t request)
+{
+	struct vhost_user_msg msg;
+
+	if (vhost_user_recv(vdev, &msg, request) < 0)
+		return -1;
+
+	if (msg.size != sizeof(msg.payload.u64) || msg.payload.u64 != 0) {
+		WPRINTF("request %d is nacked\n", request);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+vhost_user_set_u64(struct vhost_dev *vdev, uint32_t request, uint64_t u64)
+{
+	struct vhost_user_msg msg;
+
+	vhost_user_init_msg(&msg, request, sizeof(msg.payload.u64));
+	msg.payload.u64 = u64;
+	return vhost_user_send(vdev, &msg, NULL, 0);
+}
+
+static int
+vhost_user_get_u64(struct vhost_dev *vdev, uint32_t request, uint64_t *u64)
+{
+	struct vhost_user_msg msg;
+
+	vhost_user_init_msg(&msg, request, 0);
+	if (vhost_user_send(vdev, &msg, NULL, 0) < 0)
+		return -1;
+
+	if (vhost_user_recv(vdev, &msg, request) < 0)
+		return -1;
+
+	if (msg.size != sizeof(msg.payload.u64)) {
+		WPRINTF("bad payload size %d of request %d\n",
+			msg.size, request);
+		return -1;
+	}
+
+	*u64 = msg.payload.u64;
+	return 0;
+}
+
+static int
+vhost_user_set_vring(struct vhost_dev *vdev, uint32_t request,
+		     struct vhost_vring_state *ring)
+{
+	struct vhost_user_msg msg;
+
+	vhost_user_init_msg(&msg, request, sizeof(msg.payload.state));
+	msg.payload.state = *ring;
+	return vhost_user_send(vdev, &msg, NULL, 0);
+}
+
+static int
+vhost_user_set_vring_file(struct vhost_dev *vdev, uint32_t request,
+			  struct vhost_vring_file *file)
+{
+	struct vhost_user_msg msg;
+	int fd = file->fd;
+
+	vhost_user_init_msg(&msg, request, sizeof(msg.payload.u64));
+	msg.payload.u64 = file->index;
+	if (fd < 0)
+		msg.payload.u64 |= VHOST_USER_VRING_NOFD_MASK;
+
+	return vhost_user_send(vdev, &msg, &fd, fd < 0 ? 0 : 1);
+}
+
+static int
+vhost_user_set_mem_table(struct vhost_dev *vdev)
+{
+	struct vm_memfd_region regions[VHOST_USER_MEMORY_MAX_NREGIONS];
+	int fds[VHOST_USER_MEMORY_MAX_NREGIONS];
+	struct vhost_user_msg msg;
+	bool need_reply;
+	int i, nregions;
+
+	nregions = vm_get_memfd_regions(vdev->base->dev->vmctx, regions,
+				VHOST_USER_MEMORY_MAX_NREGIONS);
+	if (nregions <= 0) {
+		WPRINTF("guest memory can't be shared, %s\n", nregions ?
+			"too many regions" : "hugetlb is required");
+		return -1;
+	}
+
+	/* only the used regions are sent */
+	vhost_user_init_msg(&msg, VHOST_USER_SET_MEM_TABLE,
+		offsetof(struct vhost_user_memory, regions) +
+		nregions * sizeof(struct vhost_user_mem_region));
+	msg.payload.memory.nregions = nregions;
+	msg.payload.memory.padding = 0;
+	for (i = 0; i < nregions; i++) {
+		msg.payload.memory.regions[i].guest_phys_addr = regions[i].gpa;
+		msg.payload.memory.regions[i].memory_size = regions[i].size;
+		msg.payload.memory.regions[i].userspace_addr =
+			(uintptr_t)regions[i].hva;
+		msg.payload.memory.regions[i].mmap_offset =
+			regions[i].fd_offset;
+		fds[i] = regions[i].fd;
+		DPRINTF("[%d][0x%lx -> %p, 0x%lx]\n", i, regions[i].gpa,
+			regions[i].hva, regions[i].size);
+	}
+
+	/* the rings must not be started before the memory is mapped */
+	need_reply = vdev->protocol_features &
+		(1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK);
+	if (need_reply)
+		msg.flags |= VHOST_USER_NEED_REPLY_MASK;
+
+	if (vhost_user_send(vdev, &msg, fds, nregions) < 0)
+		return -1;
+
+	return need_reply ?
+		vhost_user_wait_ack(vdev, VHOST_USER_SET_MEM_TABLE) : 0;
+}
+
+static int
+vhost_user_set_vring_addr(struct vhost_dev *vdev,
+			  struct vhost_vring_addr *addr)
+{
+	struct vhost_user_msg msg;
+
+	vhost_user_init_msg(&msg, VHOST_USER_SET_VRING_ADDR,
+			    sizeof(msg.payload.addr));
+	msg.payload.addr = *addr;
+	return vhost_user_send(vdev, &msg, NULL, 0);
+}
+
+static int
+vhost_user_set_vring_num(struct vhost_dev *vdev,
+			 struct vhost_vring_state *ring)
+{
+	return vhost_user_set_vring(vdev, VHOST_USER_SET_VRING_NUM, ring);
+}
+
+static int
+vhost_user_set_vring_base(struct vhost_dev *vdev,
+			  struct vhost_vring_state *ring)
+{
+	return vhost_user_set_vring(vdev, VHOST_USER_SET_VRING_BASE, ring);
+}
+
+static int
+vhost_user_get_vring_base(struct vhost_dev *vdev,
+			  struct vhost_vring_state *ring)
+{
+	struct vhost_user_msg msg;
+
+	if (vhost_user_set_vring(vdev, VHOST_USER_GET_VRING_BASE, ring) < 0)
+		return -1;
+
+	if (vhost_user_recv(vdev, &msg, VHOST_USER_GET_VRING_BASE) < 0)
+		return -1;
+
+	if (msg.size != sizeof(msg.payload.state)) {
+		WPRINTF("bad payload size %d of get_vring_base\n", msg.size);
+		return -1;
+	}
+
+	*ring = msg.payload.state;
+	return 0;
+}
+
+static int
+vhost_user_set_vring_kick(struct vhost_dev *vdev,
+			  struct vhost_vring_file *file)
+{
+	return vhost_user_set_vring_file(vdev, VHOST_USER_SET_VRING_KICK, file);
+}
+
+static int
+vhost_user_set_vring_call(struct vhost_dev *vdev,
+			  struct vhost_vring_file *file)
+{
+	return vhost_user_set_vring_file(vdev, VHOST_USER_SET_VRING_CALL, file);
+}
+
+static int
+vhost_user_set_vring_busyloop_timeout(struct vhost_dev *vdev,
+				      struct vhost_vring_state *s)
+{
+	/* polling is up to the backend */
+	return 0;
+}
+
+static int
+vhost_user_set_vring_enable(struct vhost_dev *vdev, int idx, bool enable)
+{
+	struct vhost_vring_state ring;
+
+	/* without the protocol features the rings are enabled on kick */
+	if (!(vdev->vhost_ext_features &
+		(1ULL << VHOST_USER_F_PROTOCOL_FEATURES)))
+		return 0;
+
+	ring.index = idx;
+	ring.num = enable;
+	return vhost_user_set_vring(vdev, VHOST_USER_SET_VRING_ENABLE, &ring);
+}
+
+static int
+vhost_user_set_features(struct vhost_dev *vdev, uint64_t features)
+{
+	return vhost_user_set_u64(vdev, VHOST_USER_SET_FEATURES, features);
+}
+
+static int
+vhost_user_get_features(struct vhost_dev *vdev, uint64_t *features)
+{
+	uint64_t protocol_features;
+
+	if (vhost_user_get_u64(vdev, VHOST_USER_GET_FEATURES, features) < 0)
+		return -1;
+
+	if (!(*features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)))
+		return 0;
+
+	if (vhost_user_get_u64(vdev, VHOST_USER_GET_PROTOCOL_FEATURES,
+			       &protocol_features) < 0)
+		return -1;
+
+	vdev->protocol_features = protocol_features &
+		VHOST_USER_PROTOCOL_FEATURES;
+	DPRINTF("protocol features: 0x%lx\n", vdev->protocol_features);
+
+	return vhost_user_set_u64(vdev, VHOST_USER_SET_PROTOCOL_FEATURES,
+				  vdev->protocol_features);
+}
+
+static int
+vhost_user_set_owner(struct vhost_dev *vdev)
+{
+	struct vhost_user_msg msg;
+
+	vhost_user_init_msg(&msg, VHOST_USER_SET_OWNER, 0);
+	return vhost_user_send(vdev, &msg, NULL, 0);
+}
+
+static int
+vhost_user_reset_device(struct vhost_dev *vdev)
+{
+	/*
+	 * The rings are already stopped by GET_VRING_BASE and RESET_OWNER is
+	 * deprecated, the next start sets up the backend from scratch.
+	 */
+	return 0;
+}
+
+const struct vhost_backend_ops vhost_user_ops = {
+	.set_mem_table			= vhost_user_set_mem_table,
+	.set_vring_addr			= vhost_user_set_vring_addr,
+	.set_vring_num			= vhost_user_set_vring_num,
+	.set_vring_base			= vhost_user_set_vring_base,
+	.get_vring_base			= vhost_user_get_vring_base,
+	.set_vring_kick			= vhost_user_set_vring_kick,
+	.set_vring_call			= vhost_user_set_vring_call,
+	.set_vring_busyloop_timeout	= vhost_user_set_vring_busyloop_timeout,
+	.set_vring_enable		= vhost_user_set_vring_enable,
+	.set_features			= vhost_user_set_features,
+	.get_features			= vhost_user_get_features,
+	.set_owner			= vhost_user_set_owner,
+	.reset_device			= vhost_user_reset_device,
+};
+
+int
+vhost_user_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strnlen(path, sizeof(addr.sun_path)) >= sizeof(addr.sun_path)) {
+		WPRINTF("socket path %s is too long\n", path);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		WPRINTF("failed to create socket, errno = %d\n", errno);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		WPRINTF("failed to connect to %s, errno = %d\n", path, errno);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
@@ -42,6 +42,9 @@
 #include "hsm_ioctl_defs.h"
 #include "iothread.h"
 #include "vmmapi.h"
+#include "snapshot.h"
+#include "migration.h"
+#include "metrics.h"
 #include <errno.h>
 
 /*
@@ -58,6 +61,8 @@
 
 static uint8_t virtio_poll_enabled;
 static size_t virtio_poll_interval;
+static uint32_t virtio_intr_max_events;
+static uint32_t virtio_intr_max_usec;
 
 static
 void iothread_handler(void *arg)
@@ -68,14 +73,194 @@ void iothread_handler(void *arg)
 	struct virtio_vq_info *vq = &base->queues[idx];
 
 	if (viothrd->iothread_run) {
-		if (base->mtx)
-			pthread_mutex_lock(base->mtx);
+		/*
+		 * Only the queue is locked, so that the queues of a multiqueue
+		 * device run in parallel: the qnotify of an iothread device
+		 * must only touch queue specific data.
+		 */
+		pthread_mutex_lock(&vq->mtx);
 		(*viothrd->iothread_run)(base, vq);
-		if (base->mtx)
-			pthread_mutex_unlock(base->mtx);
+		pthread_mutex_unlock(&vq->mtx);
 	}
 }
 
+/*
+ * With VIRTIO_RING_F_EVENT_IDX the driver ignores VRING_USED_F_NO_NOTIFY and
+ * only kicks once it makes the avail entry at <avail_event> available, so
+ * suppression is leaving <avail_event> behind and re-enabling is moving it to
+ * the next entry to be fetched.
+ */
+static inline void
+vq_update_avail_event(struct virtio_vq_info *vq)
+{
+	if (vq->base->negotiated_caps & (1 << VIRTIO_RING_F_EVENT_IDX))
+		VQ_AVAIL_EVENT_IDX(vq) = vq->last_avail;
+}
+
+/*
+ * Turn the guest notifications (kicks) of the queue on or off, with the used
+ * ring flags or, for a packed ring, the device event suppression flags.
+ */
+static void
+vq_set_notify(struct virtio_vq_info *vq, bool enable)
+{
+	if (vq->packed) {
+		vq->device_event->flags = enable ?
+			VRING_PACKED_EVENT_FLAG_ENABLE :
+			VRING_PACKED_EVENT_FLAG_DISABLE;
+	} else if (enable) {
+		vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+		vq_update_avail_event(vq);
+	} else
+		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+}
+
+/*
+ * Busy-poll hooks of the iothread (--iothread_busy_poll): the queue is polled
+ * instead of kicked, with VRING_USED_F_NO_NOTIFY set so that the guest does
+ * not trap to notify it.
+ */
+static bool
+iothread_vq_poll(void *arg)
+{
+	struct virtio_iothread *viothrd = arg;
+
+	if (!viothrd->iothread_run || !vq_has_descs(&viothrd->base->queues[viothrd->idx]))
+		return false;
+
+	iothread_handler(arg);
+	return true;
+}
+
+static void
+iothread_vq_poll_notify(void *arg, bool enable)
+{
+	struct virtio_iothread *viothrd = arg;
+	struct virtio_vq_info *vq = &viothrd->base->queues[viothrd->idx];
+
+	viothrd->busy_polling = !enable;
+	if (!vq_ring_ready(vq))
+		return;
+
+	vq_set_notify(vq, enable);
+	/* the caller re-checks the avail ring after turning notifications on */
+	atomic_thread_fence();
+}
+
+/*
+ * Kick of a notify region registered as one ioeventfd: the eventfd does not
+ * tell which queue was kicked, so run every queue with available descriptors.
+ */
+static bool
+iothread_notify_region_poll(void *arg)
+{
+	struct virtio_base *base = arg;
+	bool work = false;
+	int idx;
+
+	for (idx = 0; idx < base->vops->nvq; idx++)
+		work |= iothread_vq_poll(&base->queues[idx].viothrd);
+
+	return work;
+}
+
+static void
+iothread_notify_region_handler(void *arg)
+{
+	iothread_notify_region_poll(arg);
+}
+
+static void
+iothread_notify_region_poll_notify(void *arg, bool enable)
+{
+	struct virtio_base *base = arg;
+	int idx;
+
+	for (idx = 0; idx < base->vops->nvq; idx++)
+		iothread_vq_poll_notify(&base->queues[idx].viothrd, enable);
+}
+
+/* The iothread serving queue idx, NULL for the default one */
+static struct iothread_ctx *
+virtio_vq_iothread(struct virtio_base *base, int idx)
+{
+	if (base->iothreads.num == 0)
+		return NULL;
+	return base->iothreads.ioctx_base[idx % base->iothreads.num];
+}
+
+static void
+virtio_set_vq_iothread_run(struct virtio_base *base, struct virtio_vq_info *vq, int idx)
+{
+	struct virtio_ops *vops = base->vops;
+
+	if (vops->qnotify)
+		vq->viothrd.iothread_run = vops->qnotify;
+	else if (vq->notify)
+		vq->viothrd.iothread_run = vq->notify;
+	else
+		vq->viothrd.iothread_run = NULL;
+	vq->viothrd.base = base;
+	vq->viothrd.idx = idx;
+}
+
+/*
+ * A multiqueue modern device with an MMIO notify BAR is kicked through a
+ * single ioeventfd covering all its notify addresses, so it takes one
+ * ioeventfd/asyncio slot instead of one per queue. Returns -1 if that is not
+ * applicable or not supported by the HSM, the queues are then registered one
+ * by one.
+ */
+static int
+virtio_set_notify_region_iothread(struct virtio_base *base, bool is_register)
+{
+	int idx;
+
+	if (!is_register) {
+		if (!base->notify_ioevent_started)
+			return -1;
+		if (!virtio_register_notify_ioeventfd(base, false, base->notify_kick_fd)
+			&& !iothread_del(virtio_vq_iothread(base, 0), base->notify_kick_fd)) {
+			base->notify_ioevent_started = false;
+			close(base->notify_kick_fd);
+			base->notify_kick_fd = -1;
+		}
+		return 0;
+	}
+
+	if (base->notify_ioevent_started)
+		return 0;
+	/* the queues of a device with several iothreads are to run in parallel */
+	if (!(base->device_caps & (1UL << VIRTIO_F_VERSION_1)) ||
+		base->modern_pio_bar_idx || !base->modern_mmio_bar_idx ||
+		base->vops->nvq < 2 || base->iothreads.num > 1)
+		return -1;
+
+	base->notify_kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (base->notify_kick_fd < 0)
+		return -1;
+
+	for (idx = 0; idx < base->vops->nvq; idx++)
+		virtio_set_vq_iothread_run(base, &base->queues[idx], idx);
+	base->notify_iomvt.arg = base;
+	base->notify_iomvt.run = iothread_notify_region_handler;
+	base->notify_iomvt.fd = base->notify_kick_fd;
+	base->notify_iomvt.poll = iothread_notify_region_poll;
+	base->notify_iomvt.poll_notify = iothread_notify_region_poll_notify;
+
+	if (!iothread_add(virtio_vq_iothread(base, 0), base->notify_kick_fd, &base->notify_iomvt)) {
+		if (!virtio_register_notify_ioeventfd(base, true, base->notify_kick_fd)) {
+			base->notify_ioevent_started = true;
+			return 0;
+		}
+		iothread_del(virtio_vq_iothread(base, 0), base->notify_kick_fd);
+	}
+	close(base->notify_kick_fd);
+	base->notify_kick_fd = -1;
+
+	return -1;
+}
+
 void
 virtio_set_iothread(struct virtio_base *base,
 			  bool is_register)
@@ -84,6 +269,9 @@ virtio_set_iothread(struct virtio_base *base,
 	struct virtio_ops *vops;
 	int idx;
 
+	if (!virtio_set_notify_region_iothread(base, is_register))
+		return;
+
 	vops = base->vops;
 	for (idx = 0; idx < vops->nvq; idx++) {
 		vq = &base->queues[idx];
@@ -94,24 +282,20 @@ virtio_set_iothread(struct virtio_base *base,
 		if (is_register) {
 			vq->viothrd.kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 
-			if (vops->qnotify)
-				vq->viothrd.iothread_run = vops->qnotify;
-			else if (vq->notify)
-				vq->viothrd.iothread_run = vq->notify;
-			else
-				vq->viothrd.iothread_run = NULL;
-			vq->viothrd.base = base;
-			vq->viothrd.idx = idx;
+			virtio_set_vq_iothread_run(base, vq, idx);
 			vq->viothrd.iomvt.arg = &vq->viothrd;
 			vq->viothrd.iomvt.run = iothread_handler;
 			vq->viothrd.iomvt.fd = vq->viothrd.kick_fd;
+			vq->viothrd.iomvt.poll = iothread_vq_poll;
+			vq->viothrd.iomvt.poll_notify = iothread_vq_poll_notify;
 
-			if (!iothread_add(vq->viothrd.kick_fd, &vq->viothrd.iomvt))
+			vq->viothrd.ioctx = virtio_vq_iothread(base, idx);
+			if (!iothread_add(vq->viothrd.ioctx, vq->viothrd.kick_fd, &vq->viothrd.iomvt))
 				if (!virtio_register_ioeventfd(base, idx, true, vq->viothrd.kick_fd))
 					vq->viothrd.ioevent_started = true;
 		} else {
 			if (!virtio_register_ioeventfd(base, idx, false, vq->viothrd.kick_fd))
-				if (!iothread_del(vq->viothrd.kick_fd)) {
+				if (!iothread_del(vq->viothrd.ioctx, vq->viothrd.kick_fd)) {
 					vq->viothrd.ioevent_started = false;
 					if (vq->viothrd.kick_fd) {
 						close(vq->viothrd.kick_fd);
@@ -161,7 +345,7 @@ virtio_poll_timer(void *arg, uint64_t nexp)
 		vq = &base->queues[i];
 		if(!vq_ring_ready(vq))
 			continue;
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+		vq_set_notify(vq, false);
 		/* TODO: call notify when necessary */
 		if (vq->notify)
 			(*vq->notify)(DEV_STRUCT(base), vq);
@@ -194,6 +378,7 @@ virtio_linkup(struct virtio_base *base, struct virtio_ops *vops,
 	      struct virtio_vq_info *queues,
 	      int backend_type)
 {
+	pthread_mutexattr_t attr;
 	int i;
 
 	/* base and pci_virtio_dev addresses must match */
@@ -207,9 +392,42 @@ virtio_linkup(struct virtio_base *base, struct virtio_ops *vops,
 	base->backend_type = backend_type;
 
 	base->queues = queues;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
 	for (i = 0; i < vops->nvq; i++) {
 		queues[i].base = base;
 		queues[i].num = i;
+		pthread_mutex_init(&queues[i].mtx, &attr);
+		pthread_mutex_init(&queues[i].intr_mtx, NULL);
+	}
+	pthread_mutexattr_destroy(&attr);
+}
+
+/**
+ * @brief Add the depth of the virtqueues of a device to a metrics snapshot.
+ *
+ * The depth is the number of chains the driver made available that the
+ * device has not taken yet, packed rings are not reported.
+ *
+ * @param mo The metrics snapshot.
+ * @param base Pointer to struct virtio_base.
+ * @param dev Value of the dev label of the device.
+ */
+void
+virtio_metrics_queues(struct metrics_out *mo, struct virtio_base *base,
+		      const char *dev)
+{
+	struct virtio_vq_info *vq;
+	int i;
+
+	for (i = 0; i < base->vops->nvq; i++) {
+		vq = &base->queues[i];
+		if (!vq_ring_ready(vq) || vq->packed)
+			continue;
+		metrics_add(mo, "acrn_virtio_queue_depth", METRIC_GAUGE,
+			"Chains available in the virtqueue, not taken by the device yet",
+			(uint16_t)(vq->avail->idx - vq->last_avail),
+			"dev=\"%s\",queue=\"%d\"", dev, i);
 	}
 }
 
@@ -253,6 +471,16 @@ virtio_reset_dev(struct virtio_base *base)
 		vq->gpa_used[0] = 0;
 		vq->gpa_used[1] = 0;
 		vq->enabled = 0;
+		vq->packed = false;
+		vq->used_idx = 0;
+		free(vq->chain_ndescs);
+		vq->chain_ndescs = NULL;
+		vq->pdesc = NULL;
+		vq->driver_event = NULL;
+		vq->device_event = NULL;
+		acrn_timer_deinit(&vq->intr_timer);
+		vq->intr_pending = 0;
+		vq->intr_armed = false;
 	}
 	base->negotiated_caps = 0;
 	base->curq = 0;
@@ -394,6 +622,71 @@ error:
 	pr_err("%s: vq enable failed\n", __func__);
 }
 
+/*
+ * Packed ring flavour of virtio_vq_enable(): the gpa of the desc array is the
+ * descriptor ring, the avail and used ones are the driver and device event
+ * suppression structures. The free-running ring indexes need a power of 2
+ * queue size.
+ */
+static int
+virtio_vq_enable_packed(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	uint16_t qsz = vq->qsize;
+	uint64_t phys;
+	char *vb;
+
+	if (qsz == 0 || (qsz & (qsz - 1)) != 0) {
+		pr_err("%s: packed ring size %u is not a power of 2\n",
+			base->vops->name, qsz);
+		return -1;
+	}
+
+	phys = (((uint64_t)vq->gpa_desc[1]) << 32) | vq->gpa_desc[0];
+	vb = paddr_guest2host(base->dev->vmctx, phys,
+			qsz * sizeof(struct vring_packed_desc));
+	if (!vb)
+		return -1;
+	vq->pdesc = (struct vring_packed_desc *)vb;
+
+	phys = (((uint64_t)vq->gpa_avail[1]) << 32) | vq->gpa_avail[0];
+	vb = paddr_guest2host(base->dev->vmctx, phys,
+			sizeof(struct vring_packed_desc_event));
+	if (!vb)
+		return -1;
+	vq->driver_event = (struct vring_packed_desc_event *)vb;
+
+	phys = (((uint64_t)vq->gpa_used[1]) << 32) | vq->gpa_used[0];
+	vb = paddr_guest2host(base->dev->vmctx, phys,
+			sizeof(struct vring_packed_desc_event));
+	if (!vb)
+		return -1;
+	vq->device_event = (struct vring_packed_desc_event *)vb;
+
+	free(vq->chain_ndescs);
+	vq->chain_ndescs = calloc(2 * qsz, sizeof(uint16_t));
+	if (!vq->chain_ndescs)
+		return -1;
+
+	vq->desc = NULL;
+	vq->avail = NULL;
+	vq->used = NULL;
+	vq->packed = true;
+	vq->device_event->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+
+	/* Start at 0 when we use it. */
+	vq->last_avail = 0;
+	vq->used_idx = 0;
+	vq->save_used = 0;
+
+	/* Mark queue as enabled. */
+	vq->enabled = true;
+
+	/* Mark queue as allocated after initialization is complete. */
+	mb();
+	vq->flags = VQ_ALLOC;
+	return 0;
+}
+
 /*
  * Initialize the currently-selected virtio queue (base->curq).
  * The guest just gave us the gpa of desc array, avail ring and
@@ -412,6 +705,12 @@ virtio_vq_enable(struct virtio_base *base)
 	vq = &base->queues[base->curq];
 	qsz = vq->qsize;
 
+	if (base->negotiated_caps & (1UL << VIRTIO_F_RING_PACKED)) {
+		if (virtio_vq_enable_packed(base, vq) < 0)
+			goto error;
+		return;
+	}
+
 	/* descriptors */
 	phys = (((uint64_t)vq->gpa_desc[1]) << 32) | vq->gpa_desc[0];
 	size = qsz * sizeof(struct vring_desc);
@@ -460,24 +759,126 @@ virtio_vq_enable(struct virtio_base *base)
  *        fails.
  */
 static inline int
-_vq_record(int i, volatile struct vring_desc *vd, struct vmctx *ctx,
-	   struct iovec *iov, int n_iov, uint16_t *flags) {
+_vq_record(int i, uint64_t addr, uint32_t len, uint16_t vd_flags,
+	   struct vmctx *ctx, struct iovec *iov, int n_iov, uint16_t *flags) {
 
 	void *host_addr;
 
 	if (i >= n_iov)
 		return -1;
-	host_addr = paddr_guest2host(ctx, vd->addr, vd->len);
+	host_addr = paddr_guest2host(ctx, addr, len);
 	if (!host_addr)
 		return -1;
 	iov[i].iov_base = host_addr;
-	iov[i].iov_len = vd->len;
+	iov[i].iov_len = len;
 	if (flags != NULL)
-		flags[i] = vd->flags;
+		flags[i] = vd_flags;
 	return 0;
 }
 #define	VQ_MAX_DESCRIPTORS	512	/* see below */
 
+/* descriptor flags handed to the caller, without the packed AVAIL/USED bits */
+#define VQ_DESC_FLAGS \
+	(VRING_DESC_F_NEXT | VRING_DESC_F_WRITE | VRING_DESC_F_INDIRECT)
+
+/*
+ * Packed ring flavour of vq_getchain(). The chain is the run of descriptors
+ * from last_avail up to the first one without NEXT, and its buffer id, taken
+ * from the last descriptor, is returned in *pidx. The ring descriptors taken
+ * by the chain are recorded for vq_relchain() and vq_retchain().
+ */
+static int
+vq_getchain_packed(struct virtio_vq_info *vq, uint16_t *pidx,
+		   struct iovec *iov, int n_iov, uint16_t *flags)
+{
+	volatile struct vring_packed_desc *vd, *vindir;
+	struct virtio_base *base = vq->base;
+	const char *name = base->vops->name;
+	struct vmctx *ctx = base->dev->vmctx;
+	uint16_t mask = vq->qsize - 1;
+	uint16_t vd_flags, id;
+	u_int i, n, j, n_indir;
+
+	if (!vq_has_descs(vq))
+		return 0;
+
+	/* read the descriptors after their flags, x86 keeps loads in order */
+	atomic_signal_fence();
+
+	i = 0;
+	for (n = 0; n < vq->qsize; n++) {
+		vd = &vq->pdesc[(vq->last_avail + n) & mask];
+		vd_flags = vd->flags & VQ_DESC_FLAGS;
+		if ((vd_flags & VRING_DESC_F_INDIRECT) == 0) {
+			if (i >= VQ_MAX_DESCRIPTORS)
+				goto loopy;
+			if (_vq_record(i, vd->addr, vd->len, vd_flags,
+					ctx, iov, n_iov, flags)) {
+				pr_err("%s: mapping to host failed\r\n", name);
+				return -1;
+			}
+			i++;
+		} else if ((base->device_caps &
+		    (1 << VIRTIO_RING_F_INDIRECT_DESC)) == 0 ||
+		    (vd_flags & VRING_DESC_F_NEXT)) {
+			pr_err("%s: descriptor has forbidden INDIRECT flag, "
+			    "driver confused?\r\n",
+			    name);
+			return -1;
+		} else {
+			n_indir = vd->len / sizeof(struct vring_packed_desc);
+			if ((vd->len % sizeof(struct vring_packed_desc)) ||
+			    n_indir == 0) {
+				pr_err("%s: invalid indir len 0x%x, "
+				    "driver confused?\r\n",
+				    name, (u_int)vd->len);
+				return -1;
+			}
+			vindir = paddr_guest2host(ctx, vd->addr, vd->len);
+			if (!vindir) {
+				pr_err("%s cannot get host memory\r\n", name);
+				return -1;
+			}
+			/* the whole table is one buffer, in order */
+			for (j = 0; j < n_indir; j++) {
+				if (i >= VQ_MAX_DESCRIPTORS)
+					goto loopy;
+				if (_vq_record(i, vindir[j].addr, vindir[j].len,
+						vindir[j].flags & VRING_DESC_F_WRITE,
+						ctx, iov, n_iov, flags)) {
+					pr_err("%s: mapping to host failed\r\n",
+						name);
+					return -1;
+				}
+				i++;
+			}
+		}
+		if ((vd_flags & VRING_DESC_F_NEXT) == 0)
+			break;
+	}
+	if (n == vq->qsize)
+		goto loopy;
+
+	id = vd->id;
+	if (id >= vq->qsize) {
+		pr_err("%s: buffer id %u out of range, driver confused?\r\n",
+		    name, id);
+		return -1;
+	}
+
+	n++;
+	vq->chain_ndescs[id] = n;
+	vq->chain_ndescs[vq->qsize + ((vq->last_avail + n - 1) & mask)] = n;
+	vq->last_avail += n;
+	*pidx = id;
+	return i;
+
+loopy:
+	pr_err("%s: descriptor loop? count > %d - driver confused?\r\n",
+	    name, i);
+	return -1;
+}
+
 /*
  * Examine the chain of descriptors starting at the "next one" to
  * make sure that they describe a sensible request.  If so, return
@@ -530,6 +931,9 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 	struct virtio_base *base;
 	const char *name;
 
+	if (vq->packed)
+		return vq_getchain_packed(vq, pidx, iov, n_iov, flags);
+
 	base = vq->base;
 	name = base->vops->name;
 
@@ -568,6 +972,17 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 	ctx = base->dev->vmctx;
 	*pidx = next = vq->avail->ring[idx & (vq->qsize - 1)];
 	vq->last_avail++;
+
+	/*
+	 * Ask for a kick on the next entry unless notifications are off, and
+	 * order it before the caller checks the avail ring again, or an entry
+	 * made available meanwhile would neither be kicked nor seen.
+	 */
+	if (!(vq->used->flags & VRING_USED_F_NO_NOTIFY) &&
+	    (base->negotiated_caps & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+		VQ_AVAIL_EVENT_IDX(vq) = vq->last_avail;
+		atomic_thread_fence();
+	}
 	for (i = 0; i < VQ_MAX_DESCRIPTORS; next = vdir->next) {
 		if (next >= vq->qsize) {
 			pr_err("%s: descriptor index %u out of range, "
@@ -577,7 +992,8 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 		}
 		vdir = &vq->desc[next];
 		if ((vdir->flags & VRING_DESC_F_INDIRECT) == 0) {
-			if (_vq_record(i, vdir, ctx, iov, n_iov, flags)) {
+			if (_vq_record(i, vdir->addr, vdir->len, vdir->flags,
+					ctx, iov, n_iov, flags)) {
 				pr_err("%s: mapping to host failed\r\n", name);
 				return -1;
 			}
@@ -619,7 +1035,8 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 					    name);
 					return -1;
 				}
-				if (_vq_record(i, vp, ctx, iov, n_iov, flags)) {
+				if (_vq_record(i, vp->addr, vp->len, vp->flags,
+						ctx, iov, n_iov, flags)) {
 					pr_err("%s: mapping to host failed\r\n", name);
 					return -1;
 				}
@@ -654,7 +1071,97 @@ loopy:
 void
 vq_retchain(struct virtio_vq_info *vq)
 {
-	vq->last_avail--;
+	if (vq->packed)
+		vq_retchains(vq, 1);
+	else
+		vq->last_avail--;
+}
+
+/*
+ * Return the last n request chains handled back to the available queue,
+ * e.g. the ones gathered for a merged rx buffer in excess of the frame.
+ */
+void
+vq_retchains(struct virtio_vq_info *vq, uint16_t n_chains)
+{
+	/* a packed chain spans the ring descriptors recorded at its last slot */
+	if (vq->packed) {
+		while (n_chains-- > 0)
+			vq->last_avail -= vq->chain_ndescs[vq->qsize +
+				((vq->last_avail - 1) & (vq->qsize - 1))];
+	} else
+		vq->last_avail -= n_chains;
+}
+
+/*
+ * Packed ring flavour of vq_relchain(): write the used descriptor in the next
+ * used slot and skip the ring descriptors the chain took.
+ */
+static void
+vq_relchain_packed(struct virtio_vq_info *vq, uint16_t id, uint32_t iolen)
+{
+	volatile struct vring_packed_desc *vd;
+	uint16_t flags;
+
+	if (id >= vq->qsize) {
+		pr_err("%s: buffer id %u out of range\r\n",
+			vq->base->vops->name, id);
+		return;
+	}
+
+	vd = &vq->pdesc[vq->used_idx & (vq->qsize - 1)];
+	flags = (vq->used_idx & vq->qsize) ? 0 :
+		((1 << VRING_PACKED_DESC_F_AVAIL) |
+		 (1 << VRING_PACKED_DESC_F_USED));
+	vd->id = id;
+	vd->len = iolen;
+	/* the flags publish the descriptor, x86 keeps stores in order */
+	atomic_signal_fence();
+	vd->flags = flags;
+	vq->used_idx += vq->chain_ndescs[id];
+}
+
+/*
+ * Whether the used descriptors written since the last interrupt call for
+ * one, per the driver event suppression structure of a packed ring.
+ */
+static int
+vq_packed_need_intr(struct virtio_vq_info *vq)
+{
+	uint16_t old_idx, new_idx, off_wrap;
+	u_int qsz = vq->qsize, event_idx;
+	int diff;
+
+	old_idx = vq->save_used;
+	vq->save_used = new_idx = vq->used_idx;
+	if (new_idx == old_idx)
+		return 0;
+
+	switch (vq->driver_event->flags) {
+	case VRING_PACKED_EVENT_FLAG_DISABLE:
+		return 0;
+	case VRING_PACKED_EVENT_FLAG_DESC:
+		if (!(vq->base->negotiated_caps &
+			(1 << VIRTIO_RING_F_EVENT_IDX)))
+			return 1;
+		/*
+		 * Turn the offset and wrap counter into the free-running index
+		 * closest to the used one, then it is the split ring check.
+		 */
+		off_wrap = vq->driver_event->off_wrap;
+		event_idx = (new_idx & ~(2 * qsz - 1)) +
+			((off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) ? 0 : qsz) +
+			(off_wrap & (qsz - 1));
+		diff = (int16_t)(event_idx - new_idx);
+		if (diff > (int)qsz)
+			event_idx -= 2 * qsz;
+		else if (diff < -(int)qsz)
+			event_idx += 2 * qsz;
+		return (uint16_t)(new_idx - event_idx - 1) <
+			(uint16_t)(new_idx - old_idx);
+	default:
+		return 1;
+	}
 }
 
 /*
@@ -664,6 +1171,39 @@ vq_retchain(struct virtio_vq_info *vq)
  * (This chain is the one you handled when you called vq_getchain()
  * and used its positive return value.)
  */
+/*
+ * Log the buffers of the chain at idx the device may have written to, for a
+ * migration in progress, see migrate_log_dirty().
+ */
+static void
+vq_log_chain(struct virtio_vq_info *vq, uint16_t idx)
+{
+	volatile struct vring_desc *vd, *vindir;
+	u_int i, j, next, n_indir;
+
+	next = idx;
+	for (i = 0; (i < VQ_MAX_DESCRIPTORS) && (next < vq->qsize); i++) {
+		vd = &vq->desc[next];
+		if (vd->flags & VRING_DESC_F_INDIRECT) {
+			n_indir = vd->len / 16;
+			vindir = paddr_guest2host(vq->base->dev->vmctx, vd->addr, vd->len);
+			for (j = 0, next = 0; (vindir != NULL) && (j < n_indir) &&
+			     (next < n_indir); j++) {
+				if (vindir[next].flags & VRING_DESC_F_WRITE)
+					migrate_log_dirty(vindir[next].addr, vindir[next].len);
+				if ((vindir[next].flags & VRING_DESC_F_NEXT) == 0)
+					break;
+				next = vindir[next].next;
+			}
+		} else if (vd->flags & VRING_DESC_F_WRITE) {
+			migrate_log_dirty(vd->addr, vd->len);
+		}
+		if ((vd->flags & VRING_DESC_F_NEXT) == 0)
+			break;
+		next = vd->next;
+	}
+}
+
 void
 vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
 {
@@ -681,6 +1221,14 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
 	 * (I apologize for the two fields named idx; the
 	 * virtio spec calls the one that vue points to, "id"...)
 	 */
+	if (vq->packed) {
+		vq_relchain_packed(vq, idx, iolen);
+		return;
+	}
+
+	if (migrate_logging)
+		vq_log_chain(vq, idx);
+
 	mask = vq->qsize - 1;
 	vuh = vq->used;
 
@@ -706,6 +1254,94 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
  * processing -- it's possible that descriptors became available after
  * that point.  (It's also typically a constant 1/True as well.)
  */
+/*
+ * Deliver the interrupt held back by vq_moderate_intr(), if it was not
+ * flushed in the meantime by the event count.
+ */
+static void
+vq_intr_timer(void *arg, uint64_t nexp)
+{
+	struct virtio_vq_info *vq = arg;
+	bool fire;
+
+	pthread_mutex_lock(&vq->intr_mtx);
+	vq->intr_armed = false;
+	fire = (vq->intr_pending != 0);
+	if (fire) {
+		vq->intr_pending = 0;
+		clock_gettime(CLOCK_MONOTONIC, &vq->intr_last);
+	}
+	pthread_mutex_unlock(&vq->intr_mtx);
+
+	if (fire)
+		vq_interrupt(vq->base, vq);
+}
+
+/*
+ * Interrupt moderation: a queue that was quiet for max_usec interrupts
+ * right away, so the latency of sparse requests is unchanged. Under load
+ * the interrupts are held back until max_events of them were coalesced or
+ * the moderation timer expires max_usec later, whichever comes first.
+ */
+static void
+vq_moderate_intr(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	struct timespec now;
+	uint64_t since;
+	bool fire = false;
+
+	if (virtio_intr_max_events <= 1 || vq->intr_timer.mevp == NULL) {
+		vq_interrupt(base, vq);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&vq->intr_mtx);
+	since = (now.tv_sec - vq->intr_last.tv_sec) * 1000000UL +
+		(now.tv_nsec - vq->intr_last.tv_nsec) / 1000;
+	if (vq->intr_pending == 0 && since >= virtio_intr_max_usec) {
+		fire = true;
+	} else if (++vq->intr_pending >= virtio_intr_max_events) {
+		fire = true;
+	} else if (!vq->intr_armed) {
+		vq->intr_armed = true;
+		virtio_start_timer(&vq->intr_timer, 0,
+				   virtio_intr_max_usec * 1000UL);
+	}
+	if (fire) {
+		vq->intr_pending = 0;
+		vq->intr_last = now;
+	}
+	pthread_mutex_unlock(&vq->intr_mtx);
+
+	if (fire)
+		vq_interrupt(base, vq);
+}
+
+/*
+ * Set up the moderation timers once the driver is ready, they are torn
+ * down again by virtio_reset_dev().
+ */
+static void
+vq_init_intr_moderation(struct virtio_base *base)
+{
+	struct virtio_vq_info *vq;
+	int i;
+
+	if (virtio_intr_max_events <= 1)
+		return;
+
+	for (i = 0; i < base->vops->nvq; i++) {
+		vq = &base->queues[i];
+		if (vq->intr_timer.mevp != NULL)
+			continue;
+		vq->intr_timer.clockid = CLOCK_MONOTONIC;
+		if (acrn_timer_init(&vq->intr_timer, vq_intr_timer, vq) != 0)
+			pr_err("%s: failed to init the moderation timer of vq %d\n",
+				base->vops->name, i);
+	}
+}
+
 void
 vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 {
@@ -713,7 +1349,7 @@ vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 	uint16_t event_idx, new_idx, old_idx;
 	int intr;
 
-	if (!vq || !vq->used)
+	if (!vq || (!vq->used && !vq->packed))
 		return;
 
 	/*
@@ -729,6 +1365,12 @@ vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 	atomic_thread_fence();
 
 	base = vq->base;
+	if (vq->packed) {
+		if (vq_packed_need_intr(vq))
+			vq_moderate_intr(base, vq);
+		return;
+	}
+
 	old_idx = vq->save_used;
 	vq->save_used = new_idx = vq->used->idx;
 	if (used_all_avail &&
@@ -747,7 +1389,7 @@ vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 		    !(vq->avail->flags & VRING_AVAIL_F_NO_INTERRUPT);
 	}
 	if (intr)
-		vq_interrupt(base, vq);
+		vq_moderate_intr(base, vq);
 }
 
 /**
@@ -768,8 +1410,10 @@ void vq_clear_used_ring_flags(struct virtio_base *base, struct virtio_vq_info *v
 	/* we should never unmask notification in polling mode */
 	if (virtio_poll_enabled && backend_type == BACKEND_VBSU && polling_in_progress == 1)
 		return;
+	if (vq->viothrd.busy_polling)
+		return;
 
-	vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+	vq_set_notify(vq, true);
 }
 
 struct config_reg {
@@ -1085,6 +1729,8 @@ bad:
 			 */
 			virtio_start_timer(&base->polling_timer, 5, 0);
 		}
+		if (value & VIRTIO_CONFIG_S_DRIVER_OK)
+			vq_init_intr_moderation(base);
 		if (!virtio_poll_enabled &&
 			base->backend_type == BACKEND_VBSU &&
 			base->iothread) {
@@ -1525,6 +2171,8 @@ virtio_common_cfg_write(struct pci_vdev *dev, uint64_t offset, int size,
 				virtio_set_iothread(base, false);
 			}
 		}
+		if (value & VIRTIO_CONFIG_S_DRIVER_OK)
+			vq_init_intr_moderation(base);
 		/* TODO: virtio poll mode for modern devices */
 		break;
 	case VIRTIO_PCI_COMMON_Q_SELECT:
@@ -1958,6 +2606,214 @@ virtio_pci_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		base->vops->name, baridx);
 }
 
+/*
+ * Snapshot of a virtio device, see snapshot.c: the transport state the
+ * driver has set up. It is restored by writing the registers again the way
+ * the driver did, with the legacy or the modern interface, then the queues
+ * go on from their used index: the requests in flight are done again.
+ */
+struct virtio_snapshot {
+	uint64_t	negotiated_caps;
+	uint8_t		status;
+	uint8_t		reserved;
+	uint16_t	msix_cfg_idx;
+	uint16_t	nvq;
+	uint16_t	reserved2;
+};
+
+struct virtio_snapshot_vq {
+	uint16_t	qsize;
+	uint16_t	msix_idx;
+	uint32_t	pfn;
+	uint32_t	gpa_desc[2];
+	uint32_t	gpa_avail[2];
+	uint32_t	gpa_used[2];
+	uint8_t		enabled;
+	uint8_t		reserved[3];
+};
+
+int
+virtio_snapshot(struct vmctx *ctx, struct pci_vdev *dev, int fd)
+{
+	struct virtio_base *base = dev->arg;
+	struct virtio_snapshot snap;
+	struct virtio_snapshot_vq *svq;
+	struct virtio_vq_info *vq;
+	int i, ret;
+
+	if (base->backend_type != BACKEND_VBSU ||
+	    (base->negotiated_caps & (1UL << VIRTIO_F_RING_PACKED))) {
+		pr_err("%s: vhost backends and packed rings are not supported\n",
+			base->vops->name);
+		return -1;
+	}
+
+	svq = calloc(base->vops->nvq, sizeof(*svq));
+	if (svq == NULL)
+		return -1;
+
+	VIRTIO_BASE_LOCK(base);
+	bzero(&snap, sizeof(snap));
+	snap.negotiated_caps = base->negotiated_caps;
+	snap.status = base->status;
+	snap.msix_cfg_idx = base->msix_cfg_idx;
+	snap.nvq = base->vops->nvq;
+	for (i = 0; i < base->vops->nvq; i++) {
+		vq = &base->queues[i];
+		svq[i].qsize = vq->qsize;
+		svq[i].msix_idx = vq->msix_idx;
+		svq[i].pfn = vq->pfn;
+		memcpy(svq[i].gpa_desc, vq->gpa_desc, sizeof(svq[i].gpa_desc));
+		memcpy(svq[i].gpa_avail, vq->gpa_avail, sizeof(svq[i].gpa_avail));
+		memcpy(svq[i].gpa_used, vq->gpa_used, sizeof(svq[i].gpa_used));
+		svq[i].enabled = vq_ring_ready(vq);
+
+		/* the device wrote to its used rings, a migration sends them again */
+		if (migrate_logging && svq[i].enabled)
+			migrate_log_dirty((char *)vq->used - ctx->baseaddr,
+				sizeof(uint16_t) * 3 + sizeof(struct vring_used_elem) * vq->qsize);
+	}
+	VIRTIO_BASE_UNLOCK(base);
+
+	ret = snapshot_write(fd, &snap, sizeof(snap));
+	if (ret == 0)
+		ret = snapshot_write(fd, svq, snap.nvq * sizeof(*svq));
+	free(svq);
+	return ret;
+}
+
+static void
+virtio_restore_modern(struct virtio_base *base, struct virtio_snapshot *snap,
+		struct virtio_snapshot_vq *svq)
+{
+	struct pci_vdev *dev = base->dev;
+	struct virtio_vq_info *vq;
+	int i;
+
+	VIRTIO_BASE_LOCK(base);
+	virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_GFSELECT, 4, 0);
+	virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_GF, 4, snap->negotiated_caps & 0xffffffff);
+	virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_GFSELECT, 4, 1);
+	virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_GF, 4, snap->negotiated_caps >> 32);
+	virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_STATUS, 1,
+		snap->status & ~VIRTIO_CONFIG_S_DRIVER_OK);
+	virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_MSIX, 2, snap->msix_cfg_idx);
+
+	for (i = 0; i < snap->nvq; i++) {
+		virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_Q_SELECT, 2, i);
+		virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_Q_SIZE, 2, svq[i].qsize);
+		virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_Q_MSIX, 2, svq[i].msix_idx);
+		virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_Q_DESCLO, 4, svq[i].gpa_desc[0]);
+		virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_Q_DESCHI, 4, svq[i].gpa_desc[1]);
+		virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_Q_AVAILLO, 4, svq[i].gpa_avail[0]);
+		virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_Q_AVAILHI, 4, svq[i].gpa_avail[1]);
+		virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_Q_USEDLO, 4, svq[i].gpa_used[0]);
+		virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_Q_USEDHI, 4, svq[i].gpa_used[1]);
+		if (svq[i].enabled) {
+			virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_Q_ENABLE, 2, 1);
+			vq = &base->queues[i];
+			if (vq->used != NULL)
+				vq->last_avail = vq->save_used = vq->used->idx;
+		}
+	}
+	VIRTIO_BASE_UNLOCK(base);
+}
+
+static void
+virtio_restore_legacy(struct vmctx *ctx, struct virtio_base *base,
+		struct virtio_snapshot *snap, struct virtio_snapshot_vq *svq)
+{
+	struct pci_vdev *dev = base->dev;
+	struct virtio_vq_info *vq;
+	int bar = base->legacy_pio_bar_idx;
+	bool msix = pci_msix_enabled(dev);
+	int i;
+
+	virtio_pci_legacy_write(ctx, 0, dev, bar, VIRTIO_PCI_GUEST_FEATURES, 4,
+		snap->negotiated_caps & 0xffffffff);
+	virtio_pci_legacy_write(ctx, 0, dev, bar, VIRTIO_PCI_STATUS, 1,
+		snap->status & ~VIRTIO_CONFIG_S_DRIVER_OK);
+	if (msix)
+		virtio_pci_legacy_write(ctx, 0, dev, bar, VIRTIO_MSI_CONFIG_VECTOR, 2,
+			snap->msix_cfg_idx);
+
+	for (i = 0; i < snap->nvq; i++) {
+		virtio_pci_legacy_write(ctx, 0, dev, bar, VIRTIO_PCI_QUEUE_SEL, 2, i);
+		if (msix)
+			virtio_pci_legacy_write(ctx, 0, dev, bar, VIRTIO_MSI_QUEUE_VECTOR, 2,
+				svq[i].msix_idx);
+		if (svq[i].enabled) {
+			virtio_pci_legacy_write(ctx, 0, dev, bar, VIRTIO_PCI_QUEUE_PFN, 4,
+				svq[i].pfn);
+			VIRTIO_BASE_LOCK(base);
+			vq = &base->queues[i];
+			if (vq->used != NULL)
+				vq->last_avail = vq->save_used = vq->used->idx;
+			VIRTIO_BASE_UNLOCK(base);
+		}
+	}
+}
+
+int
+virtio_restore(struct vmctx *ctx, struct pci_vdev *dev, int fd)
+{
+	struct virtio_base *base = dev->arg;
+	struct virtio_snapshot snap;
+	struct virtio_snapshot_vq *svq;
+	struct virtio_vq_info *vq;
+	bool modern;
+	int i;
+
+	if (snapshot_read(fd, &snap, sizeof(snap)) != 0)
+		return -1;
+	if (snap.nvq != base->vops->nvq) {
+		pr_err("%s: %u queues saved, %d now\n", base->vops->name,
+			snap.nvq, base->vops->nvq);
+		return -1;
+	}
+
+	svq = calloc(snap.nvq, sizeof(*svq));
+	if (svq == NULL)
+		return -1;
+	if (snapshot_read(fd, svq, snap.nvq * sizeof(*svq)) != 0) {
+		free(svq);
+		return -1;
+	}
+
+	modern = (snap.negotiated_caps & (1UL << VIRTIO_F_VERSION_1)) != 0;
+	if (modern)
+		virtio_restore_modern(base, &snap, svq);
+	else
+		virtio_restore_legacy(ctx, base, &snap, svq);
+
+	if (snap.status & VIRTIO_CONFIG_S_DRIVER_OK) {
+		if (modern) {
+			VIRTIO_BASE_LOCK(base);
+			virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_STATUS, 1, snap.status);
+			VIRTIO_BASE_UNLOCK(base);
+		} else {
+			virtio_pci_legacy_write(ctx, 0, dev, base->legacy_pio_bar_idx,
+				VIRTIO_PCI_STATUS, 1, snap.status);
+		}
+
+		/* the kicks of the requests in flight were taken by the old instance */
+		VIRTIO_BASE_LOCK(base);
+		for (i = 0; i < snap.nvq; i++) {
+			vq = &base->queues[i];
+			if (!svq[i].enabled || !vq_ring_ready(vq))
+				continue;
+			if (vq->notify)
+				(*vq->notify)(DEV_STRUCT(base), vq);
+			else if (base->vops->qnotify)
+				(*base->vops->qnotify)(DEV_STRUCT(base), vq);
+		}
+		VIRTIO_BASE_UNLOCK(base);
+	}
+
+	free(svq);
+	return 0;
+}
+
 /**
  * @brief Get the virtio poll parameters
  *
@@ -1981,6 +2837,74 @@ acrn_parse_virtio_poll_interval(const char *optarg)
 	return 0;
 }
 
+/**
+ * @brief Get the virtio interrupt moderation parameters
+ *
+ * @param optarg Pointer to parameters string, <max_events>,<max_usec>.
+ *
+ * @return fail -1 success 0
+ */
+int
+acrn_parse_virtio_intr_moderation(const char *optarg)
+{
+	unsigned long events, usec;
+	char *ptr;
+
+	events = strtoul(optarg, &ptr, 0);
+	if (*ptr != ',')
+		return -1;
+	usec = strtoul(ptr + 1, &ptr, 0);
+	if (*ptr != '\0')
+		return -1;
+
+	/* hold back at most 256 interrupts for at most 10ms */
+	if (events < 2 || events > 256 || usec < 1 || usec > 10000)
+		return -1;
+
+	virtio_intr_max_events = events;
+	virtio_intr_max_usec = usec;
+
+	return 0;
+}
+
+/*
+ * Register one ioeventfd covering the notify addresses of all the queues of a
+ * modern device with an MMIO notify BAR.
+ */
+int virtio_register_notify_ioeventfd(struct virtio_base *base, bool is_register, int fd)
+{
+	struct acrn_ioeventfd ioeventfd = {0};
+	struct pcibar *bar;
+	int rc;
+
+	if (!base->modern_mmio_bar_idx ||
+		base->vops->nvq * VIRTIO_MODERN_NOTIFY_OFF_MULT > VIRTIO_CAP_NOTIFY_SIZE)
+		return -1;
+
+	bar = &base->dev->bar[base->modern_mmio_bar_idx];
+	ioeventfd.fd = fd;
+	ioeventfd.flags = ACRN_IOEVENTFD_FLAG_WILDCARD;
+	if (!is_register)
+		ioeventfd.flags |= ACRN_IOEVENTFD_FLAG_DEASSIGN;
+	else if (base->iothread)
+		ioeventfd.flags |= ACRN_IOEVENTFD_FLAG_ASYNCIO;
+	ioeventfd.addr = bar->addr + VIRTIO_CAP_NOTIFY_OFFSET;
+	ioeventfd.len = base->vops->nvq * VIRTIO_MODERN_NOTIFY_OFF_MULT;
+
+	pr_info("[ioeventfd: %d][0x%lx@%d][flags: 0x%x] notify region %s\r\n",
+		ioeventfd.fd, ioeventfd.addr, ioeventfd.len, ioeventfd.flags,
+		is_register ? "register" : "unregister");
+
+	rc = vm_ioeventfd(base->dev->vmctx, &ioeventfd);
+	if (rc < 0) {
+		/* an HSM without wildcard support rejects it, not an error */
+		pr_info("notify region ioeventfd not available, errno = %d\n",
+			errno);
+		return -1;
+	}
+	return 0;
+}
+
 int virtio_register_ioeventfd(struct virtio_base *base, int idx, bool is_register, int fd)
 {
 	struct acrn_ioeventfd ioeventfd = {0};
@@ -27,6 +27,7 @@
 #include "virtio_kernel.h"
 #include "vmmapi.h"			/* for vmctx */
 #include "log.h"
+#include "dm_string.h"
 
 /*
  * Size of queue was chosen experimentaly in a way
@@ -36,6 +37,14 @@
  */
 #define VIRTIO_AUDIO_RINGSZ	1024
 
+/*
+ * Bounds of the "qsize=<n>" option. The VBS-K mediator drains every buffer
+ * the guest made available on a kick, so a larger ring lets the guest queue
+ * more periods ahead and kick less often; the size must be a power of 2.
+ */
+#define VIRTIO_AUDIO_RINGSZ_MIN	64
+#define VIRTIO_AUDIO_RINGSZ_MAX	4096
+
 /*
  * Queue definitions.
  * Audio mediator uses two queues: one for interrupt and the other for messages.
@@ -217,8 +226,8 @@ virtio_audio_k_set_status(void *base, uint64_t status)
 	struct virtio_audio *virt_audio;
 	int nvq;
 	struct msix_table_entry *mte;
-	uint64_t msix_addr = 0;
-	uint32_t msix_data = 0;
+	uint64_t msix_addr;
+	uint32_t msix_data;
 	int rc, i, j;
 
 	virt_audio = (struct virtio_audio *)base;
@@ -243,7 +252,16 @@ virtio_audio_k_set_status(void *base, uint64_t status)
 					virt_audio->base.dev->bar[0].addr + 16,
 					2);
 
+		if (rc < 0) {
+			WPRINTF(("virtio_audio: kernel_dev_set failed, ret %d\n",
+				 rc));
+			return;
+		}
+
 		for (i = 0; i < nvq; i++) {
+			/* a vq without vector must not inherit the previous one */
+			msix_addr = 0;
+			msix_data = 0;
 			if (virt_audio->vq[i].msix_idx
 				!= VIRTIO_MSI_NO_VECTOR) {
 				j = virt_audio->vq[i].msix_idx;
@@ -276,13 +294,58 @@ virtio_audio_k_set_status(void *base, uint64_t status)
 	}
 }
 
+/*
+ * Parse "qsize=<n>", the size of the rings shared with the mediator.
+ */
+static int
+virtio_audio_parse_opts(char *opts, uint16_t *qsize)
+{
+	char *cp, *tmp, *opt;
+	unsigned int val;
+
+	*qsize = VIRTIO_AUDIO_RINGSZ;
+	if (opts == NULL)
+		return 0;
+
+	tmp = cp = strdup(opts);
+	if (!cp) {
+		WPRINTF(("virtio_audio: strdup returns NULL\n"));
+		return -1;
+	}
+
+	while ((opt = strsep(&cp, ",")) != NULL) {
+		if (*opt == '\0')
+			continue;
+		if (strncmp(opt, "qsize=", 6) == 0 &&
+		    dm_strtoui(opt + 6, NULL, 0, &val) == 0 &&
+		    val >= VIRTIO_AUDIO_RINGSZ_MIN &&
+		    val <= VIRTIO_AUDIO_RINGSZ_MAX && (val & (val - 1)) == 0) {
+			*qsize = (uint16_t)val;
+		} else {
+			WPRINTF(("virtio_audio: invalid option %s, qsize is a "
+				 "power of 2 in [%d, %d]\n", opt,
+				 VIRTIO_AUDIO_RINGSZ_MIN,
+				 VIRTIO_AUDIO_RINGSZ_MAX));
+			free(tmp);
+			return -1;
+		}
+	}
+
+	free(tmp);
+	return 0;
+}
+
 static int
 virtio_audio_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
 	struct virtio_audio *virt_audio;
 
 	pthread_mutexattr_t attr;
-	int rc;
+	uint16_t qsize;
+	int rc, i;
+
+	if (virtio_audio_parse_opts(opts, &qsize) < 0)
+		return -1;
 
 	virt_audio = calloc(1, sizeof(struct virtio_audio));
 	if (!virt_audio) {
@@ -330,11 +393,8 @@ virtio_audio_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	virt_audio->vbs_k.kstatus = VIRTIO_DEV_INIT_SUCCESS;
 	virt_audio->base.mtx = &virt_audio->mtx;
 
-	/* vq[0] and vq[1] are for interrupt and messages */
-	virt_audio->vq[0].qsize = VIRTIO_AUDIO_RINGSZ;
-	virt_audio->vq[1].qsize = VIRTIO_AUDIO_RINGSZ;
-	virt_audio->vq[2].qsize = VIRTIO_AUDIO_RINGSZ;
-	virt_audio->vq[3].qsize = VIRTIO_AUDIO_RINGSZ;
+	for (i = 0; i < VIRTIO_AUDIO_VQ_NUM; i++)
+		virt_audio->vq[i].qsize = qsize;
 
 	/* initialize config space */
 	pci_set_cfgdata16(dev, PCIR_DEVICE, VIRTIO_DEV_AUDIO);
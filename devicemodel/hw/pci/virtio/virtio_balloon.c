@@ -0,0 +1,333 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * virtio memory balloon device emulation, with free page reporting.
+ *
+ * The guest hands 4K pages back through the inflate queue and its free page
+ * ranges through the reporting queue. Guest memory is backed by huge pages,
+ * so it is only given back to the Service VM by whole 2M pages: they are
+ * unmapped from the guest and punched out of the hugetlbfs file. The next
+ * guest access to such a page reaches the device model as an MMIO request,
+ * which populates and maps it again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "dm.h"
+#include "dm_string.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "vmmapi.h"
+
+#define VIRTIO_BALLOON_RINGSZ	128
+
+#define VIRTIO_BALLOON_F_DEFLATE_ON_OOM	2	/* deflate balloon on guest OOM */
+#define VIRTIO_BALLOON_F_REPORTING	5	/* free page reporting */
+
+/* no stats queue nor free page hinting, so the reporting queue comes third */
+#define VIRTIO_BALLOON_INFLATEQ		0
+#define VIRTIO_BALLOON_DEFLATEQ		1
+#define VIRTIO_BALLOON_REPORTQ		2
+#define VIRTIO_BALLOON_MAXQ		3
+
+#define VIRTIO_BALLOON_PFN_SHIFT	12
+#define BALLOON_CHUNK_SHIFT		21
+#define BALLOON_CHUNK_SIZE		(1UL << BALLOON_CHUNK_SHIFT)
+#define BALLOON_CHUNK_PAGES		(BALLOON_CHUNK_SIZE >> VIRTIO_BALLOON_PFN_SHIFT)
+
+#define VIRTIO_BALLOON_S_HOSTCAPS	((1UL << VIRTIO_BALLOON_F_DEFLATE_ON_OOM) | \
+					(1UL << VIRTIO_BALLOON_F_REPORTING) | \
+					(1UL << VIRTIO_RING_F_EVENT_IDX))
+
+struct virtio_balloon_config {
+	uint32_t num_pages;	/* pages the guest is asked to give back */
+	uint32_t actual;	/* pages the guest gave back */
+} __attribute__((packed));
+
+struct virtio_balloon {
+	struct virtio_base base;
+	struct virtio_vq_info vqs[VIRTIO_BALLOON_MAXQ];
+	pthread_mutex_t mtx;
+	struct vmctx *ctx;
+	struct virtio_balloon_config cfg;
+	/* inflated 4K pages per 2M chunk of guest memory */
+	uint16_t *chunk_pages;
+	size_t nchunks;
+};
+
+static int virtio_balloon_debug;
+#define DPRINTF(params) do { if (virtio_balloon_debug) pr_dbg params; } while (0)
+#define WPRINTF(params) (pr_err params)
+
+static void virtio_balloon_reset(void *);
+static void virtio_balloon_notify(void *, struct virtio_vq_info *);
+static int virtio_balloon_cfgread(void *, int, int, uint32_t *);
+static int virtio_balloon_cfgwrite(void *, int, int, uint32_t);
+
+static struct virtio_ops virtio_balloon_ops = {
+	"virtio_balloon",		/* our name */
+	VIRTIO_BALLOON_MAXQ,		/* we support 3 virtqueues */
+	sizeof(struct virtio_balloon_config), /* config reg size */
+	virtio_balloon_reset,		/* reset */
+	virtio_balloon_notify,		/* device-wide qnotify */
+	virtio_balloon_cfgread,		/* read virtio config */
+	virtio_balloon_cfgwrite,	/* write virtio config */
+	NULL,				/* apply negotiated features */
+	NULL,				/* called on guest set status */
+};
+
+static void
+virtio_balloon_reset(void *vdev)
+{
+	struct virtio_balloon *balloon = vdev;
+
+	DPRINTF(("virtio_balloon: device reset requested\n"));
+	virtio_reset_dev(&balloon->base);
+	balloon->cfg.actual = 0;
+}
+
+static int
+virtio_balloon_cfgread(void *vdev, int offset, int size, uint32_t *retval)
+{
+	struct virtio_balloon *balloon = vdev;
+
+	memcpy(retval, (uint8_t *)&balloon->cfg + offset, size);
+	return 0;
+}
+
+static int
+virtio_balloon_cfgwrite(void *vdev, int offset, int size, uint32_t val)
+{
+	struct virtio_balloon *balloon = vdev;
+
+	if (offset == offsetof(struct virtio_balloon_config, actual))
+		balloon->cfg.actual = val;
+	else
+		DPRINTF(("virtio_balloon: write to readonly reg %d\n", offset));
+
+	return 0;
+}
+
+/*
+ * Release the part of [gpa, gpa + len) that is guest RAM, the first 2M hold
+ * ranges the device model emulates itself so they are kept.
+ */
+static size_t
+virtio_balloon_release(struct virtio_balloon *balloon, uint64_t gpa, uint64_t len)
+{
+	struct vmctx *ctx = balloon->ctx;
+	uint64_t start, end;
+	size_t released = 0;
+
+	start = (gpa > BALLOON_CHUNK_SIZE) ? gpa : BALLOON_CHUNK_SIZE;
+	end = (gpa + len < ctx->lowmem) ? (gpa + len) : ctx->lowmem;
+	if (start < end)
+		released += hugetlb_release_memory(ctx, start, end - start);
+
+	start = (gpa > ctx->highmem_gpa_base) ? gpa : ctx->highmem_gpa_base;
+	end = (gpa + len < ctx->highmem_gpa_base + ctx->highmem) ?
+		(gpa + len) : (ctx->highmem_gpa_base + ctx->highmem);
+	if (start < end)
+		released += hugetlb_release_memory(ctx, start, end - start);
+
+	return released;
+}
+
+static void
+virtio_balloon_inflate(struct virtio_balloon *balloon, uint32_t pfn)
+{
+	uint64_t chunk = pfn >> (BALLOON_CHUNK_SHIFT - VIRTIO_BALLOON_PFN_SHIFT);
+
+	if ((chunk >= balloon->nchunks) || (balloon->chunk_pages[chunk] >= BALLOON_CHUNK_PAGES))
+		return;
+
+	balloon->chunk_pages[chunk]++;
+	/* the whole chunk is in the balloon now */
+	if (balloon->chunk_pages[chunk] == BALLOON_CHUNK_PAGES)
+		virtio_balloon_release(balloon, chunk << BALLOON_CHUNK_SHIFT, BALLOON_CHUNK_SIZE);
+}
+
+static void
+virtio_balloon_deflate(struct virtio_balloon *balloon, uint32_t pfn)
+{
+	uint64_t chunk = pfn >> (BALLOON_CHUNK_SHIFT - VIRTIO_BALLOON_PFN_SHIFT);
+
+	if ((chunk >= balloon->nchunks) || (balloon->chunk_pages[chunk] == 0))
+		return;
+
+	/* the guest is about to use it, don't wait for it to fault */
+	if (balloon->chunk_pages[chunk] == BALLOON_CHUNK_PAGES) {
+		if (hugetlb_refault_memory(balloon->ctx, chunk << BALLOON_CHUNK_SHIFT) != 0)
+			WPRINTF(("virtio_balloon: fail to refault gpa 0x%lx\n",
+				chunk << BALLOON_CHUNK_SHIFT));
+	}
+	balloon->chunk_pages[chunk]--;
+}
+
+static void
+virtio_balloon_notify(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_balloon *balloon = vdev;
+	struct iovec iov[VIRTIO_BALLOON_RINGSZ];
+	uint16_t idx, flags[VIRTIO_BALLOON_RINGSZ];
+	uint32_t *pfns;
+	size_t i, j;
+	int n;
+
+	while (vq_has_descs(vq)) {
+		n = vq_getchain(vq, &idx, iov, VIRTIO_BALLOON_RINGSZ, flags);
+		if (n <= 0) {
+			WPRINTF(("virtio_balloon: fail to getchain!\n"));
+			break;
+		}
+
+		for (i = 0; i < (size_t)n; i++) {
+			if (vq == &balloon->vqs[VIRTIO_BALLOON_REPORTQ]) {
+				/* the buffers are the free pages themselves */
+				virtio_balloon_release(balloon,
+					(uint64_t)((char *)iov[i].iov_base - (char *)balloon->ctx->baseaddr),
+					iov[i].iov_len);
+				continue;
+			}
+
+			pfns = iov[i].iov_base;
+			for (j = 0; j < iov[i].iov_len / sizeof(uint32_t); j++) {
+				if (vq == &balloon->vqs[VIRTIO_BALLOON_INFLATEQ])
+					virtio_balloon_inflate(balloon, pfns[j]);
+				else
+					virtio_balloon_deflate(balloon, pfns[j]);
+			}
+		}
+
+		vq_relchain(vq, idx, 0);
+	}
+	vq_endchains(vq, 1);
+}
+
+static int
+virtio_balloon_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_balloon *balloon;
+	pthread_mutexattr_t attr;
+	char *opt, *val;
+	unsigned long size = 0;
+	int rc, i;
+
+	while ((opt = strsep(&opts, ",")) != NULL) {
+		val = opt;
+		opt = strsep(&val, "=");
+		if ((strcmp(opt, "size") == 0) && (val != NULL)) {
+			/* initial balloon size in MB */
+			if (dm_strtoul(val, NULL, 10, &size) != 0) {
+				WPRINTF(("virtio_balloon: invalid size %s\n", val));
+				return -1;
+			}
+		} else if (strlen(opt) > 0) {
+			WPRINTF(("virtio_balloon: unknown option %s\n", opt));
+		}
+	}
+
+	balloon = calloc(1, sizeof(struct virtio_balloon));
+	if (!balloon) {
+		WPRINTF(("virtio_balloon: calloc returns NULL\n"));
+		return -1;
+	}
+
+	balloon->ctx = ctx;
+	balloon->nchunks = (ctx->highmem_gpa_base + ctx->highmem) >> BALLOON_CHUNK_SHIFT;
+	balloon->chunk_pages = calloc(balloon->nchunks, sizeof(uint16_t));
+	if (!balloon->chunk_pages) {
+		WPRINTF(("virtio_balloon: calloc returns NULL\n"));
+		free(balloon);
+		return -1;
+	}
+	balloon->cfg.num_pages = (uint32_t)((size << 20) >> VIRTIO_BALLOON_PFN_SHIFT);
+
+	/* init mutex attribute properly */
+	rc = pthread_mutexattr_init(&attr);
+	if (rc)
+		DPRINTF(("mutexattr init failed with erro %d!\n", rc));
+	if (virtio_uses_msix()) {
+		rc = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_DEFAULT);
+		if (rc)
+			DPRINTF(("virtio_msix: mutexattr_settype failed with "
+				"error %d!\n", rc));
+	} else {
+		rc = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+		if (rc)
+			DPRINTF(("virtio_intx: mutexattr_settype failed with "
+				"error %d!\n", rc));
+	}
+	rc = pthread_mutex_init(&balloon->mtx, &attr);
+	if (rc)
+		DPRINTF(("mutex init failed with error %d!\n", rc));
+
+	virtio_linkup(&balloon->base, &virtio_balloon_ops, balloon, dev,
+		      balloon->vqs, BACKEND_VBSU);
+	balloon->base.mtx = &balloon->mtx;
+	balloon->base.device_caps = VIRTIO_BALLOON_S_HOSTCAPS;
+	for (i = 0; i < VIRTIO_BALLOON_MAXQ; i++)
+		balloon->vqs[i].qsize = VIRTIO_BALLOON_RINGSZ;
+
+	/* initialize config space */
+	pci_set_cfgdata16(dev, PCIR_DEVICE, VIRTIO_DEV_BALLOON);
+	pci_set_cfgdata16(dev, PCIR_VENDOR, VIRTIO_VENDOR);
+	pci_set_cfgdata8(dev, PCIR_CLASS, PCIC_OTHER);
+	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, VIRTIO_TYPE_BALLOON);
+	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
+
+	if (virtio_interrupt_init(&balloon->base, virtio_uses_msix()))
+		goto fail;
+
+	virtio_set_io_bar(&balloon->base, 0);
+
+	/* the guest RAM it may release, see virtio_balloon_release() */
+	if (hugetlb_register_refault(ctx) != 0) {
+		WPRINTF(("virtio_balloon: fail to register the guest RAM ranges\n"));
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	free(balloon->chunk_pages);
+	free(balloon);
+	return -1;
+}
+
+static void
+virtio_balloon_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_balloon *balloon = dev->arg;
+
+	if (balloon == NULL) {
+		DPRINTF(("%s: balloon is NULL\n", __func__));
+		return;
+	}
+
+	hugetlb_unregister_refault(ctx);
+
+	virtio_balloon_reset(balloon);
+	free(balloon->chunk_pages);
+	free(balloon);
+}
+
+struct pci_vdev_ops pci_ops_virtio_balloon = {
+	.class_name	= "virtio-balloon",
+	.vdev_init	= virtio_balloon_init,
+	.vdev_deinit	= virtio_balloon_deinit,
+	.vdev_barwrite	= virtio_pci_write,
+	.vdev_barread	= virtio_pci_read
+};
+DEFINE_PCI_DEVTYPE(pci_ops_virtio_balloon);
@@ -42,8 +42,16 @@
 #include "virtio.h"
 #include "block_if.h"
 #include "monitor.h"
+#include "metrics.h"
 
+/*
+ * The ring is sized after the queue size of the backing blockif, so that the
+ * guest can't queue more requests than the blockif accepts. VIRTIO_BLK_RINGSZ
+ * is used for the dummy backend of "nodisk".
+ */
 #define VIRTIO_BLK_RINGSZ	64
+#define VIRTIO_BLK_RINGSZ_MAX	1024
+#define VIRTIO_BLK_MQ_MAX	16
 #define VIRTIO_BLK_MAX_OPTS_LEN	256
 
 #define VIRTIO_BLK_S_OK	0
@@ -62,6 +70,8 @@
 /* Device can toggle its cache between writeback and writethrough modes */
 #define	VIRTIO_BLK_F_CONFIG_WCE	(1 << 11)
 
+#define	VIRTIO_BLK_F_MQ		(1 << 12)	/* Multiple request queues */
+
 #define	VIRTIO_BLK_F_DISCARD	(1 << 13)
 
 /*
@@ -71,7 +81,8 @@
 	(VIRTIO_BLK_F_SEG_MAX |						    \
 	VIRTIO_BLK_F_BLK_SIZE |						    \
 	VIRTIO_BLK_F_TOPOLOGY |						    \
-	(1 << VIRTIO_RING_F_INDIRECT_DESC))	/* indirect descriptors */
+	(1 << VIRTIO_RING_F_INDIRECT_DESC) |	/* indirect descriptors */  \
+	(1 << VIRTIO_RING_F_EVENT_IDX))		/* event index suppression */
 
 /*
  * Writeback cache bits
@@ -101,8 +112,8 @@ struct virtio_blk_config {
 	} topology;
 	uint8_t	writeback;
 	uint8_t unused;
-	/* Reserve for num_queues when VIRTIO_BLK_F_MQ is support*/
-	uint16_t reserve;
+	/* The number of request queues, valid with VIRTIO_BLK_F_MQ */
+	uint16_t num_queues;
 	/* The maximum discard sectors (in 512-byte sectors) for one segment */
 	uint32_t max_discard_sectors;
 	/* The maximum number of discard segments */
@@ -156,12 +167,15 @@ struct virtio_blk_ioreq {
 struct virtio_blk {
 	struct virtio_base base;
 	pthread_mutex_t mtx;
-	struct virtio_vq_info vq;
+	struct virtio_vq_info *vqs;
+	int num_vqs;
+	struct virtio_ops ops;	/* virtio_blk_ops with num_vqs queues */
 	struct virtio_blk_config cfg;
 	bool dummy_bctxt; /* Used in blockrescan. Indicate if the bctxt can be used */
 	struct blockif_ctxt *bc;
 	char ident[VIRTIO_BLK_BLK_ID_BYTES + 1];
-	struct virtio_blk_ioreq ios[VIRTIO_BLK_RINGSZ];
+	struct virtio_blk_ioreq *ios;	/* nios per queue, queue after queue */
+	int nios;
 	uint8_t original_wce;
 };
 
@@ -172,7 +186,7 @@ static int virtio_blk_cfgwrite(void *, int, int, uint32_t);
 
 static struct virtio_ops virtio_blk_ops = {
 	"virtio_blk",		/* our name */
-	1,			/* we support 1 virtqueue */
+	1,			/* 1 virtqueue, unless mq=<num> */
 	sizeof(struct virtio_blk_config), /* config reg size */
 	virtio_blk_reset,	/* reset */
 	virtio_blk_notify,	/* device-wide qnotify */
@@ -186,9 +200,15 @@ static void
 virtio_blk_reset(void *vdev)
 {
 	struct virtio_blk *blk = vdev;
+	int i;
 
 	DPRINTF(("virtio_blk: device reset requested !\n"));
+	/* the iothreads only hold the locks of the queues */
+	for (i = 0; i < blk->num_vqs; i++)
+		pthread_mutex_lock(&blk->vqs[i].mtx);
 	virtio_reset_dev(&blk->base);
+	for (i = blk->num_vqs - 1; i >= 0; i--)
+		pthread_mutex_unlock(&blk->vqs[i].mtx);
 	/* Reset virtio-blk device only on valid bctxt*/
 	if (!blk->dummy_bctxt)
 		blockif_set_wce(blk->bc, blk->original_wce);
@@ -199,6 +219,7 @@ virtio_blk_done(struct blockif_req *br, int err)
 {
 	struct virtio_blk_ioreq *io = br->param;
 	struct virtio_blk *blk = io->blk;
+	struct virtio_vq_info *vq = &blk->vqs[br->qidx];
 
 	if (err)
 		DPRINTF(("virtio_blk: done with error = %d\n\r", err));
@@ -215,10 +236,10 @@ virtio_blk_done(struct blockif_req *br, int err)
 	 * Return the descriptor back to the host.
 	 * We wrote 1 byte (our status) to host.
 	 */
-	pthread_mutex_lock(&blk->mtx);
-	vq_relchain(&blk->vq, io->idx, 1);
-	vq_endchains(&blk->vq, !vq_has_descs(&blk->vq));
-	pthread_mutex_unlock(&blk->mtx);
+	pthread_mutex_lock(&vq->mtx);
+	vq_relchain(vq, io->idx, 1);
+	vq_endchains(vq, !vq_has_descs(vq));
+	pthread_mutex_unlock(&vq->mtx);
 }
 
 static void
@@ -259,7 +280,13 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 		return;
 	}
 
-	io = &blk->ios[idx];
+	if (idx >= blk->nios) {
+		WPRINTF(("%s: descriptor %d beyond the ring size\n", __func__, idx));
+		virtio_blk_abort(vq, idx);
+		return;
+	}
+
+	io = &blk->ios[vq->num * blk->nios + idx];
 	if ((flags[0] & VRING_DESC_F_WRITE) != 0) {
 		WPRINTF(("%s: the type for hdr should not be VRING_DESC_F_WRITE\n", __func__));
 		virtio_blk_abort(vq, idx);
@@ -383,6 +410,9 @@ virtio_blk_notify(void *vdev, struct virtio_vq_info *vq)
 	if (!vq_has_descs(vq))
 		return;
 
+	/* serializes with virtio_blk_done() on the queue */
+	pthread_mutex_lock(&vq->mtx);
+
 	/*
 	 * The two while loop here is to avoid the race:
 	 *
@@ -403,6 +433,7 @@ virtio_blk_notify(void *vdev, struct virtio_vq_info *vq)
 		vq_clear_used_ring_flags(&blk->base, vq);
 		mb();
 	} while (vq_has_descs(vq));
+	pthread_mutex_unlock(&vq->mtx);
 }
 
 static uint64_t
@@ -420,6 +451,9 @@ virtio_blk_get_caps(struct virtio_blk *blk, bool wb)
 	if (blockif_is_ro(blk->bc))
 		caps |= VIRTIO_BLK_F_RO;
 
+	if (blk->num_vqs > 1)
+		caps |= VIRTIO_BLK_F_MQ;
+
 	return caps;
 }
 
@@ -447,6 +481,7 @@ virtio_blk_update_config_space(struct virtio_blk *blk)
 	    (sto != 0) ? ((sts - sto) / sectsz) : 0;
 	blk->cfg.topology.min_io_size = 0;
 	blk->cfg.writeback = blockif_get_wce(blk->bc);
+	blk->cfg.num_queues = blk->num_vqs;
 	blk->original_wce = blk->cfg.writeback; /* save for reset */
 	if (blockif_candiscard(blk->bc)) {
 		blk->cfg.max_discard_sectors = blockif_max_discard_sectors(blk->bc);
@@ -456,6 +491,50 @@ virtio_blk_update_config_space(struct virtio_blk *blk)
 	blk->base.device_caps =
 		virtio_blk_get_caps(blk, !!blk->cfg.writeback);
 }
+/* The largest power of 2 ring the queue of the blockif can hold */
+static int
+virtio_blk_ringsz(struct blockif_ctxt *bctxt)
+{
+	int qsz, ringsz;
+
+	if (bctxt == NULL)
+		return VIRTIO_BLK_RINGSZ;
+
+	qsz = blockif_queuesz(bctxt);
+	ringsz = VIRTIO_BLK_RINGSZ_MAX;
+	while (ringsz > qsz && ringsz > 1)
+		ringsz >>= 1;
+
+	return ringsz;
+}
+
+static void
+virtio_blk_metrics(struct metrics_out *mo, void *arg)
+{
+	struct virtio_blk *blk = arg;
+	struct blockif_stats st;
+	char dev[16];
+
+	snprintf(dev, sizeof(dev), "blk-%d:%d", blk->base.dev->slot, blk->base.dev->func);
+	virtio_metrics_queues(mo, &blk->base, dev);
+	if (blk->dummy_bctxt)
+		return;
+
+	blockif_get_stats(blk->bc, &st);
+	metrics_add(mo, "acrn_block_reads_total", METRIC_COUNTER,
+		"Read requests of the block device", st.reads, "dev=\"%s\"", dev);
+	metrics_add(mo, "acrn_block_writes_total", METRIC_COUNTER,
+		"Write requests of the block device", st.writes, "dev=\"%s\"", dev);
+	metrics_add(mo, "acrn_block_flushes_total", METRIC_COUNTER,
+		"Flush requests of the block device", st.flushes, "dev=\"%s\"", dev);
+	metrics_add(mo, "acrn_block_discards_total", METRIC_COUNTER,
+		"Discard requests of the block device", st.discards, "dev=\"%s\"", dev);
+	metrics_add(mo, "acrn_block_read_bytes_total", METRIC_COUNTER,
+		"Bytes read by the block device", st.read_bytes, "dev=\"%s\"", dev);
+	metrics_add(mo, "acrn_block_write_bytes_total", METRIC_COUNTER,
+		"Bytes written by the block device", st.write_bytes, "dev=\"%s\"", dev);
+}
+
 static int
 virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
@@ -468,7 +547,8 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	u_char digest[16];
 	struct virtio_blk *blk;
 	bool use_iothread;
-	int i;
+	struct iothreads_info iothreads;
+	int i, num_vqs;
 	pthread_mutexattr_t attr;
 	int rc;
 
@@ -476,6 +556,7 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	/* Assume the bctxt is valid, until identified otherwise */
 	dummy_bctxt = false;
 	use_iothread = false;
+	num_vqs = 1;
 
 	if (opts == NULL) {
 		pr_err("virtio_blk: backing device required\n");
@@ -500,23 +581,51 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		WPRINTF(("%s: strdup failed\n", __func__));
 		return -1;
 	}
-	if (strstr(opts, "nodisk") == NULL) {
-		opt = strsep(&opts_tmp, ",");
-		if (strcmp("iothread", opt) == 0) {
+
+	/* The iothread and mq=<num> options come before the backing file */
+	while (opts_tmp != NULL) {
+		if (strncmp("iothread", opts_tmp, strlen("iothread")) == 0) {
+			opt = strsep(&opts_tmp, ",");
+			if (iothread_parse_options(opt, &iothreads) < 0) {
+				pr_err("Invalid iothread option %s\n", opt);
+				free(opts_start);
+				return -1;
+			}
 			use_iothread = true;
-		} else {
-			/* The opts_start is truncated by strsep, opts_tmp is also
-			 * changed by strsetp, so use opts which points to the
-			 * original parameter string
-			 */
-			opts_tmp = opts;
-		}
-		bctxt = blockif_open(opts_tmp, bident);
+		} else if (strncmp("mq=", opts_tmp, strlen("mq=")) == 0) {
+			opt = strsep(&opts_tmp, ",");
+			if (dm_strtoi(opt + strlen("mq="), NULL, 10, &num_vqs) ||
+				num_vqs < 1 || num_vqs > VIRTIO_BLK_MQ_MAX) {
+				pr_err("virtio_blk: mq must be 1 to %d\n",
+					VIRTIO_BLK_MQ_MAX);
+				if (use_iothread)
+					iothread_release(&iothreads);
+				free(opts_start);
+				return -1;
+			}
+		} else
+			break;
+	}
+	if (opts_tmp == NULL) {
+		pr_err("virtio_blk: backing device required\n");
+		if (use_iothread)
+			iothread_release(&iothreads);
+		free(opts_start);
+		return -1;
+	}
+
+	if (strstr(opts_tmp, "nodisk") == NULL) {
+		bctxt = blockif_open(opts_tmp, bident, num_vqs,
+				use_iothread ? &iothreads : NULL);
 		if (bctxt == NULL) {
 			pr_err("Could not open backing file");
+			if (use_iothread)
+				iothread_release(&iothreads);
 			free(opts_start);
 			return -1;
 		}
+		if (blockif_register_mem(bctxt, ctx) < 0)
+			pr_warn("virtio_blk: guest memory not registered for io_uring\n");
 	} else {
 		dummy_bctxt = true;
 	}
@@ -527,6 +636,10 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	blk = calloc(1, sizeof(struct virtio_blk));
 	if (!blk) {
 		WPRINTF(("virtio_blk: calloc returns NULL\n"));
+		if (bctxt)
+			blockif_close(bctxt);
+		if (use_iothread)
+			iothread_release(&iothreads);
 		return -1;
 	}
 
@@ -534,13 +647,30 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	/* Update virtio-blk device struct of dummy ctxt*/
 	blk->dummy_bctxt = dummy_bctxt;
 
-	for (i = 0; i < VIRTIO_BLK_RINGSZ; i++) {
+	blk->num_vqs = num_vqs;
+	blk->nios = virtio_blk_ringsz(bctxt);
+	blk->vqs = calloc(num_vqs, sizeof(struct virtio_vq_info));
+	blk->ios = calloc(num_vqs * blk->nios, sizeof(struct virtio_blk_ioreq));
+	if (!blk->vqs || !blk->ios) {
+		WPRINTF(("virtio_blk: calloc returns NULL\n"));
+		if (bctxt)
+			blockif_close(bctxt);
+		if (use_iothread)
+			iothread_release(&iothreads);
+		free(blk->vqs);
+		free(blk->ios);
+		free(blk);
+		return -1;
+	}
+
+	for (i = 0; i < num_vqs * blk->nios; i++) {
 		struct virtio_blk_ioreq *io = &blk->ios[i];
 
 		io->req.callback = virtio_blk_done;
 		io->req.param = io;
+		io->req.qidx = i / blk->nios;
 		io->blk = blk;
-		io->idx = i;
+		io->idx = i % blk->nios;
 	}
 
 	/* init mutex attribute properly to avoid deadlock */
@@ -558,12 +688,17 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 					"error %d!\n", rc));
 
 	/* init virtio struct and virtqueues */
-	virtio_linkup(&blk->base, &virtio_blk_ops, blk, dev, &blk->vq, BACKEND_VBSU);
+	blk->ops = virtio_blk_ops;
+	blk->ops.nvq = num_vqs;
+	virtio_linkup(&blk->base, &blk->ops, blk, dev, blk->vqs, BACKEND_VBSU);
 	blk->base.iothread = use_iothread;
+	if (use_iothread)
+		blk->base.iothreads = iothreads;
 	blk->base.mtx = &blk->mtx;
 
-	blk->vq.qsize = VIRTIO_BLK_RINGSZ;
-	/* blk->vq.vq_notify = we have no per-queue notify */
+	/* we have no per-queue notify */
+	for (i = 0; i < num_vqs; i++)
+		blk->vqs[i].qsize = blk->nios;
 
 	/*
 	 * Create an identifier for the backing file. Use parts of the
@@ -609,11 +744,18 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		/* call close only for valid bctxt */
 		if (!blk->dummy_bctxt)
 			blockif_close(blk->bc);
+		if (use_iothread)
+			iothread_release(&iothreads);
+		free(blk->vqs);
+		free(blk->ios);
 		free(blk);
 		return -1;
 	}
 	virtio_set_io_bar(&blk->base, 0);
 
+	if (metrics_register(virtio_blk_metrics, blk) < 0)
+		pr_err("virtio_blk: failed to register its metrics\n");
+
 	/*
 	 * Register ops for virtio-blk Rescan
 	 */
@@ -637,6 +779,7 @@ virtio_blk_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	if (dev->arg) {
 		DPRINTF(("virtio_blk: deinit\n"));
 		blk = (struct virtio_blk *) dev->arg;
+		metrics_unregister(blk);
 		/* De-init virtio-blk device only on valid bctxt*/
 		if (!blk->dummy_bctxt) {
 			bctxt = blk->bc;
@@ -645,6 +788,11 @@ virtio_blk_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 			blockif_close(bctxt);
 		}
 		virtio_reset_dev(&blk->base);
+		/* re-created by the init of the next guest boot */
+		if (blk->base.iothread)
+			iothread_release(&blk->base.iothreads);
+		free(blk->vqs);
+		free(blk->ios);
 		free(blk);
 	}
 }
@@ -744,11 +892,21 @@ virtio_blk_rescan(struct vmctx *ctx, struct pci_vdev *dev, char *newpath)
 
 	pr_err("name=%s, Path=%s, ident=%s\n", dev->name, newpath, bident);
 	/* update the bctxt for the virtio-blk device */
-	bctxt = blockif_open(newpath, bident);
+	bctxt = blockif_open(newpath, bident, blk->num_vqs,
+			blk->base.iothread ? &blk->base.iothreads : NULL);
 	if (bctxt == NULL) {
 		pr_err("Error opening backing file\n");
 		goto end;
 	}
+	if (blockif_register_mem(bctxt, ctx) < 0)
+		pr_warn("virtio_blk: guest memory not registered for io_uring\n");
+
+	/* The ring was sized for the dummy backend already */
+	if (blockif_queuesz(bctxt) < blk->nios) {
+		pr_err("The queue of the new backing file is shorter than the ring\n");
+		blockif_close(bctxt);
+		goto end;
+	}
 
 	blk->bc = bctxt;
 	blk->dummy_bctxt = false;
@@ -820,6 +978,8 @@ struct pci_vdev_ops pci_ops_virtio_blk = {
 	.vdev_init	= virtio_blk_init,
 	.vdev_deinit	= virtio_blk_deinit,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_snapshot	= virtio_snapshot,
+	.vdev_restore	= virtio_restore
 };
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_blk);
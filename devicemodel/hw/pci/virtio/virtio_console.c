@@ -51,6 +51,8 @@
 #define	VIRTIO_CONSOLE_RINGSZ	64
 #define	VIRTIO_CONSOLE_MAXPORTS	16
 #define	VIRTIO_CONSOLE_MAXQ	(VIRTIO_CONSOLE_MAXPORTS * 2 + 2)
+/* chains moved by one readv()/writev() of a backend */
+#define	VIRTIO_CONSOLE_BATCH	VIRTIO_CONSOLE_RINGSZ
 
 #define	VIRTIO_CONSOLE_DEVICE_READY	0
 #define	VIRTIO_CONSOLE_DEVICE_ADD	1
@@ -67,7 +69,8 @@
 #define	VIRTIO_CONSOLE_S_HOSTCAPS	\
 	(VIRTIO_CONSOLE_F_SIZE |	\
 	VIRTIO_CONSOLE_F_MULTIPORT |	\
-	VIRTIO_CONSOLE_F_EMERG_WRITE)
+	VIRTIO_CONSOLE_F_EMERG_WRITE |	\
+	(1 << VIRTIO_RING_F_EVENT_IDX))
 
 static int virtio_console_debug;
 #define DPRINTF(params) do {           \
@@ -272,8 +275,8 @@ virtio_console_add_port(struct virtio_console *console, const char *name,
 }
 
 static void
-virtio_console_control_tx(struct virtio_console_port *port, void *arg,
-			  struct iovec *iov, int niov __attribute__((unused)))
+virtio_console_control_msg(struct virtio_console_port *port,
+			   struct iovec *iov)
 {
 	struct virtio_console *console;
 	struct virtio_console_port *tmp;
@@ -318,6 +321,17 @@ virtio_console_control_tx(struct virtio_console_port *port, void *arg,
 	}
 }
 
+/* Each iovec is a chain of its own, holding one control message */
+static void
+virtio_console_control_tx(struct virtio_console_port *port, void *arg,
+			  struct iovec *iov, int niov)
+{
+	int i;
+
+	for (i = 0; i < niov; i++)
+		virtio_console_control_msg(port, &iov[i]);
+}
+
 static void
 virtio_console_announce_port(struct virtio_console_port *port)
 {
@@ -379,30 +393,44 @@ virtio_console_control_send(struct virtio_console *console,
 	vq_endchains(vq, 1);
 }
 
+/*
+ * The chains available are handed to the port together, the backend writes
+ * them with one writev(). They are all released before the interrupt.
+ */
 static void
 virtio_console_notify_tx(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_console *console;
 	struct virtio_console_port *port;
-	struct iovec iov[1];
-	uint16_t idx;
+	struct iovec iov[VIRTIO_CONSOLE_BATCH];
+	uint16_t idx[VIRTIO_CONSOLE_BATCH];
 	uint16_t flags[8];
+	int i, n;
 
 	console = vdev;
 	port = virtio_console_vq_to_port(console, vq);
 
 	while (vq_has_descs(vq)) {
-		if (vq_getchain(vq, &idx, iov, 1, flags) < 1) {
-			pr_err("%s: fail to getchain!\n", __func__);
-			break;
+		for (n = 0; (n < VIRTIO_CONSOLE_BATCH) && vq_has_descs(vq); n++) {
+			if (vq_getchain(vq, &idx[n], &iov[n], 1, flags) < 1) {
+				pr_err("%s: fail to getchain!\n", __func__);
+				break;
+			}
 		}
+		if (n == 0)
+			break;
+
 		if ((port != NULL) && (port->cb != NULL))
-			port->cb(port, port->arg, iov, 1);
+			port->cb(port, port->arg, iov, n);
 
 		/*
-		 * Release this chain and handle more
+		 * Release these chains and handle more
 		 */
-		vq_relchain(vq, idx, 0);
+		for (i = 0; i < n; i++)
+			vq_relchain(vq, idx[i], 0);
+
+		if (n < VIRTIO_CONSOLE_BATCH)
+			break;
 	}
 	vq_endchains(vq, 1);	/* Generate interrupt if appropriate. */
 }
@@ -459,10 +487,11 @@ virtio_console_backend_read(int fd __attribute__((unused)),
 	struct virtio_console_port *port;
 	struct virtio_console_backend *be = arg;
 	struct virtio_vq_info *vq;
-	struct iovec iov;
+	struct iovec iov[VIRTIO_CONSOLE_BATCH];
+	uint16_t idx[VIRTIO_CONSOLE_BATCH];
 	static char dummybuf[2048];
-	int len, n;
-	uint16_t idx;
+	int len, n, i, used;
+	size_t total, chunk;
 
 	port = be->port;
 	vq = virtio_console_port_to_vq(port, true);
@@ -482,15 +511,25 @@ virtio_console_backend_read(int fd __attribute__((unused)),
 		return;
 	}
 
+	/*
+	 * The chains available are filled by one readv(), the ones left
+	 * empty are returned. A short read means the backend is drained.
+	 */
 	do {
-		n = vq_getchain(vq, &idx, &iov, 1, NULL);
-		if (n < 1){
-			pr_err("%s: fail to getchain!\n", __func__);
-			break;
+		total = 0;
+		for (n = 0; (n < VIRTIO_CONSOLE_BATCH) && vq_has_descs(vq); n++) {
+			if (vq_getchain(vq, &idx[n], &iov[n], 1, NULL) < 1) {
+				pr_err("%s: fail to getchain!\n", __func__);
+				break;
+			}
+			total += iov[n].iov_len;
 		}
-		len = readv(be->fd, &iov, n);
+		if (n == 0)
+			break;
+
+		len = readv(be->fd, iov, n);
 		if (len <= 0) {
-			vq_retchain(vq);
+			vq_retchains(vq, n);
 			vq_endchains(vq, 0);
 
 			/* no data available */
@@ -506,7 +545,17 @@ virtio_console_backend_read(int fd __attribute__((unused)),
 			goto close;
 		}
 
-		vq_relchain(vq, idx, len);
+		for (i = 0, used = 0; (i < n) && (used < len); i++) {
+			chunk = iov[i].iov_len;
+			if (chunk > (size_t)(len - used))
+				chunk = len - used;
+			vq_relchain(vq, idx[i], chunk);
+			used += chunk;
+		}
+		if (i < n)
+			vq_retchains(vq, n - i);
+		if ((size_t)len < total)
+			break;
 	} while (vq_has_descs(vq));
 
 	vq_endchains(vq, 1);
@@ -1209,6 +1258,8 @@ struct pci_vdev_ops pci_ops_virtio_console = {
 	.vdev_init	= virtio_console_init,
 	.vdev_deinit	= virtio_console_deinit,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_snapshot	= virtio_snapshot,
+	.vdev_restore	= virtio_restore
 };
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_console);
@@ -97,7 +97,7 @@ static int gpio_debug;
 #define DPRINTF(params) do { if (gpio_debug) pr_dbg params; } while (0)
 #define WPRINTF(params) (pr_err params)
 
-#define BIT(x) (1 << (x))
+#define BIT(x) (1UL << (x))
 
 /* Virtio GPIO supports maximum number of virtual gpio */
 #define VIRTIO_GPIO_MAX_VLINES	64
@@ -110,7 +110,11 @@ static int gpio_debug;
 
 /* Virtio GPIO capabilities */
 #define VIRTIO_GPIO_F_CHIP	1
-#define VIRTIO_GPIO_S_HOSTCAPS	VIRTIO_GPIO_F_CHIP
+#define VIRTIO_GPIO_F_MULTI	2	/* GPIO_REQ_{GET,SET}_MULTIPLE */
+#define VIRTIO_GPIO_S_HOSTCAPS	(VIRTIO_GPIO_F_CHIP | VIRTIO_GPIO_F_MULTI)
+
+/* The line events read at once, for one interrupt */
+#define GPIO_IRQ_EVENTS_MAX	16
 
 #define IRQ_TYPE_NONE		0
 #define IRQ_TYPE_EDGE_RISING	(1 << 0)
@@ -161,6 +165,8 @@ enum virtio_gpio_request_command {
 	GPIO_REQ_OUTPUT_DIRECTION	= 3,
 	GPIO_REQ_GET_DIRECTION		= 4,
 	GPIO_REQ_SET_CONFIG		= 5,
+	GPIO_REQ_GET_MULTIPLE		= 6,
+	GPIO_REQ_SET_MULTIPLE		= 7,
 
 	GPIO_REQ_MAX
 };
@@ -186,6 +192,21 @@ struct virtio_gpio_response {
 	uint8_t	data;
 } __attribute__((packed));
 
+/*
+ * The requests on several lines at once, told from the single line ones by
+ * their size: mask has a bit per virtual gpio.
+ */
+struct virtio_gpio_multi_request {
+	uint8_t		cmd;
+	uint64_t	mask;
+	uint64_t	values;	/* of GPIO_REQ_SET_MULTIPLE */
+} __attribute__((packed));
+
+struct virtio_gpio_multi_response {
+	int8_t		err;
+	uint64_t	values;	/* of GPIO_REQ_GET_MULTIPLE */
+} __attribute__((packed));
+
 struct virtio_gpio_info {
 	struct virtio_gpio_request	req;
 	struct virtio_gpio_response	rsp;
@@ -219,6 +240,19 @@ struct gpio_line {
 	uint64_t		config;	/* gpio configuration */
 	struct native_gpio_chip	*chip;	/* parent gpio chip */
 	struct gpio_irq_desc	*irq;	/* connect to irq descriptor */
+	struct gpio_line_group	*group;	/* the group holding it, fd is -1 */
+	int	gindex;			/* index in the group */
+};
+
+/*
+ * The lines of a chip the User VM reads, or writes, together. They share a
+ * single line handle, kept open until one of them changes its direction or
+ * configuration, so that the lines of a multiple request take one ioctl.
+ */
+struct gpio_line_group {
+	int	fd;			/* line handle, -1 if none */
+	int	nline;
+	struct gpio_line	*lines[GPIOHANDLES_MAX];
 };
 
 struct native_gpio_chip {
@@ -228,6 +262,7 @@ struct native_gpio_chip {
 	int	fd;			/* native gpio chip fd */
 	uint32_t		ngpio;	/* gpio line numbers */
 	struct gpio_line	*lines;	/* gpio lines in the chip */
+	struct gpio_line_group	groups[2];	/* by direction, 0 output, 1 input */
 };
 
 struct gpio_irq_desc {
@@ -271,6 +306,9 @@ static void record_intr_statistics(struct gpio_irq_chip *chip, uint64_t mask);
 static void gpio_pio_write(struct virtio_gpio *gpio, int n, uint64_t reg);
 static uint32_t gpio_pio_read(struct virtio_gpio *gpio, int n);
 static void native_gpio_close_line(struct gpio_line *line);
+static bool gpio_irq_has_pending_intr(struct gpio_irq_desc *desc);
+static int native_gpio_open_line(struct gpio_line *line, unsigned int flags,
+		unsigned int value);
 
 static void
 virtio_gpio_abort(struct virtio_vq_info *vq, uint16_t idx)
@@ -302,7 +340,7 @@ native_gpio_update_line_info(struct gpio_line *line)
 	 * if it is already used by virtio gpio model,
 	 * it is not set to busy state
 	 */
-	if (line->fd > 0)
+	if (line->fd > 0 || line->group)
 		line->busy = false;
 
 	/* 0 means output, 1 means input */
@@ -310,11 +348,34 @@ native_gpio_update_line_info(struct gpio_line *line)
 	strncpy(line->name, info.name, sizeof(line->name) - 1);
 }
 
+/* back to a handle per line, if reopen */
+static void
+native_gpio_release_group(struct gpio_line_group *grp, bool reopen)
+{
+	struct gpio_line *line;
+	int i;
+
+	if (grp->fd < 0)
+		return;
+
+	close(grp->fd);
+	grp->fd = -1;
+	for (i = 0; i < grp->nline; i++) {
+		line = grp->lines[i];
+		line->group = NULL;
+		if (reopen)
+			native_gpio_open_line(line, 0, 0);
+	}
+	grp->nline = 0;
+}
+
 static void
 native_gpio_close_chip(struct native_gpio_chip *chip)
 {
 	int i;
 	if (chip) {
+		native_gpio_release_group(&chip->groups[0], false);
+		native_gpio_release_group(&chip->groups[1], false);
 		memset(chip->name, 0, sizeof(chip->name));
 		memset(chip->label, 0, sizeof(chip->label));
 		memset(chip->dev_name, 0, sizeof(chip->dev_name));
@@ -336,6 +397,10 @@ native_gpio_close_chip(struct native_gpio_chip *chip)
 static void
 native_gpio_close_line(struct gpio_line *line)
 {
+	/* the other lines of its group get their own handle back */
+	if (line->group)
+		native_gpio_release_group(line->group, true);
+
 	if (line->fd > 0) {
 		close(line->fd);
 		line->fd = -1;
@@ -386,15 +451,123 @@ native_gpio_open_line(struct gpio_line *line, unsigned int flags,
 	return rc;
 }
 
+/* whether the line can join the group of its chip for dir */
+static bool
+native_gpio_groupable(struct gpio_line *line, int dir)
+{
+	if (line->busy || line->irq->fd >= 0 || (line->fd < 0 && !line->group))
+		return false;
+
+	/*
+	 * The values of an output group are set all at once, so only the lines
+	 * the User VM drove, whose value is known, are grouped.
+	 */
+	if (dir == 0)
+		return line->dir == 0 && line->config == GPIOHANDLE_REQUEST_OUTPUT;
+	return line->dir == 1 && (line->config & ~GPIOHANDLE_REQUEST_INPUT) == 0;
+}
+
+/*
+ * Add the lines to the group of their chip for dir, which keeps the lines
+ * it had, and return it, or NULL if the line handle could not be requested.
+ */
+static struct gpio_line_group *
+native_gpio_group_lines(struct native_gpio_chip *chip, struct gpio_line **lines,
+		int n, int dir)
+{
+	struct gpio_line_group *grp;
+	struct gpiohandle_request req;
+	struct gpio_line *line;
+	int i, nline;
+
+	grp = &chip->groups[dir];
+	for (i = 0; i < n; i++) {
+		if (lines[i]->group != grp)
+			break;
+	}
+	if (i == n)
+		return grp;
+
+	nline = grp->nline;
+	if (grp->fd >= 0) {
+		close(grp->fd);
+		grp->fd = -1;
+	}
+	for (i = 0; i < n && nline < GPIOHANDLES_MAX; i++) {
+		if (lines[i]->group != grp) {
+			native_gpio_close_line(lines[i]);
+			grp->lines[nline++] = lines[i];
+		}
+	}
+	grp->nline = nline;
+
+	memset(&req, 0, sizeof(req));
+	req.lines = nline;
+	req.flags = dir ? GPIOHANDLE_REQUEST_INPUT : GPIOHANDLE_REQUEST_OUTPUT;
+	strncpy(req.consumer_label, "acrn_dm", sizeof(req.consumer_label) - 1);
+	for (i = 0; i < nline; i++) {
+		line = grp->lines[i];
+		req.lineoffsets[i] = line->offset;
+		req.default_values[i] = line->value;
+	}
+	if (ioctl(chip->fd, GPIO_GET_LINEHANDLE_IOCTL, &req) < 0) {
+		WPRINTF(("ioctl GPIO_GET_LINEHANDLE_IOCTL of %d lines error %s\n",
+				nline, strerror(errno)));
+		for (i = 0; i < nline; i++) {
+			line = grp->lines[i];
+			line->group = NULL;
+			native_gpio_open_line(line, 0, 0);
+		}
+		grp->nline = 0;
+		return NULL;
+	}
+
+	grp->fd = req.fd;
+	for (i = 0; i < nline; i++) {
+		line = grp->lines[i];
+		line->fd = -1;
+		line->group = grp;
+		line->gindex = i;
+	}
+	return grp;
+}
+
+/* set the lines of the group to their value */
+static int
+native_gpio_group_set(struct gpio_line_group *grp)
+{
+	struct gpiohandle_data data;
+	int i;
+
+	memset(&data, 0, sizeof(data));
+	for (i = 0; i < grp->nline; i++)
+		data.values[i] = grp->lines[i]->value;
+	if (ioctl(grp->fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data) < 0) {
+		WPRINTF(("ioctl GPIOHANDLE_SET_LINE_VALUES_IOCTL error %s\n",
+				strerror(errno)));
+		return -1;
+	}
+	return 0;
+}
+
 static int
 gpio_set_value(struct virtio_gpio *gpio, unsigned int offset,
 		unsigned int value)
 {
 	struct gpio_line *line;
 	struct gpiohandle_data data;
-	int rc;
+	int rc, old;
 
 	line = gpio->vlines[offset];
+	if (line->group) {
+		old = line->value;
+		line->value = value;
+		if (native_gpio_group_set(line->group) < 0) {
+			line->value = old;
+			return -1;
+		}
+		return 0;
+	}
 	if (line->busy || line->fd < 0) {
 		WPRINTF(("failed to set gpio%d value, busy:%d, fd:%d\n",
 				offset, line->busy, line->fd));
@@ -426,7 +599,7 @@ gpio_get_value(struct virtio_gpio *gpio, unsigned int offset)
 		return -1;
 	}
 
-	fd = line->fd;
+	fd = line->group ? line->group->fd : line->fd;
 	if (fd < 0) {
 
 		/*
@@ -449,7 +622,102 @@ gpio_get_value(struct virtio_gpio *gpio, unsigned int offset)
 				strerror(errno)));
 		return -1;
 	}
-	return data.values[0];
+	return data.values[line->group ? line->gindex : 0];
+}
+
+/*
+ * The lines of mask which can share a handle are read, or set, with one
+ * ioctl per chip; the others one by one.
+ */
+static int
+gpio_get_values(struct virtio_gpio *gpio, uint64_t mask, uint64_t *values)
+{
+	struct gpio_line *lines[VIRTIO_GPIO_MAX_VLINES];
+	struct gpio_line_group *grp;
+	struct gpiohandle_data data;
+	struct gpio_line *line;
+	int c, i, n, rc;
+
+	*values = 0;
+	for (c = 0; c < gpio->nchip; c++) {
+		n = 0;
+		for (i = 0; i < gpio->nvline; i++) {
+			line = gpio->vlines[i];
+			if ((mask & BIT(i)) && line->chip == &gpio->chips[c] &&
+					native_gpio_groupable(line, 1))
+				lines[n++] = line;
+		}
+		if (n < 2)
+			continue;
+
+		grp = native_gpio_group_lines(&gpio->chips[c], lines, n, 1);
+		memset(&data, 0, sizeof(data));
+		if (!grp || ioctl(grp->fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data) < 0)
+			continue;
+		for (i = 0; i < grp->nline; i++) {
+			line = grp->lines[i];
+			if (!(mask & BIT(line->voffset)))
+				continue;
+			if (data.values[i])
+				*values |= BIT(line->voffset);
+			mask &= ~BIT(line->voffset);
+		}
+	}
+
+	for (i = 0; i < gpio->nvline; i++) {
+		if (!(mask & BIT(i)))
+			continue;
+		rc = gpio_get_value(gpio, i);
+		if (rc < 0)
+			return -1;
+		if (rc)
+			*values |= BIT(i);
+	}
+	return 0;
+}
+
+static int
+gpio_set_values(struct virtio_gpio *gpio, uint64_t mask, uint64_t values)
+{
+	struct gpio_line *lines[VIRTIO_GPIO_MAX_VLINES];
+	int olds[VIRTIO_GPIO_MAX_VLINES];
+	struct gpio_line_group *grp;
+	struct gpio_line *line;
+	int c, i, n;
+
+	for (c = 0; c < gpio->nchip; c++) {
+		n = 0;
+		for (i = 0; i < gpio->nvline; i++) {
+			line = gpio->vlines[i];
+			if ((mask & BIT(i)) && line->chip == &gpio->chips[c] &&
+					native_gpio_groupable(line, 0))
+				lines[n++] = line;
+		}
+		if (n < 2)
+			continue;
+
+		grp = native_gpio_group_lines(&gpio->chips[c], lines, n, 0);
+		if (!grp)
+			continue;
+		for (i = 0; i < n; i++) {
+			olds[i] = lines[i]->value;
+			lines[i]->value = !!(values & BIT(lines[i]->voffset));
+		}
+		if (native_gpio_group_set(grp) < 0) {
+			for (i = 0; i < n; i++)
+				lines[i]->value = olds[i];
+			continue;
+		}
+		for (i = 0; i < n; i++)
+			mask &= ~BIT(lines[i]->voffset);
+	}
+
+	for (i = 0; i < gpio->nvline; i++) {
+		if ((mask & BIT(i)) &&
+				gpio_set_value(gpio, i, !!(values & BIT(i))) < 0)
+			return -1;
+	}
+	return 0;
 }
 
 static int
@@ -557,6 +825,43 @@ gpio_request_handler(struct virtio_gpio *gpio, struct virtio_gpio_request *req,
 	print_virtio_gpio_info(req, rsp, false);
 }
 
+static void
+gpio_multi_request_handler(struct virtio_gpio *gpio,
+		struct virtio_gpio_multi_request *req,
+		struct virtio_gpio_multi_response *rsp)
+{
+	uint64_t lines, values = 0;
+	int rc;
+
+	lines = gpio->nvline < 64 ? BIT(gpio->nvline) - 1 : ~0UL;
+	if (req->mask & ~lines) {
+		WPRINTF(("discards the gpio request, command:%u, mask:0x%lx\n",
+				req->cmd, req->mask));
+		rsp->err = -1;
+		return;
+	}
+
+	DPRINTF(("<<<< gpio mask=0x%lx, cmd=%u, values=0x%lx\n",
+			req->mask, req->cmd, req->values));
+	switch (req->cmd) {
+	case GPIO_REQ_GET_MULTIPLE:
+		rc = gpio_get_values(gpio, req->mask, &values);
+		break;
+	case GPIO_REQ_SET_MULTIPLE:
+		rc = gpio_set_values(gpio, req->mask, req->values);
+		break;
+	default:
+		WPRINTF(("invalid gpio multiple request command:%d\n", req->cmd));
+		rc = -1;
+		break;
+	}
+
+	rsp->err = rc < 0 ? -1 : 0;
+	rsp->values = values;
+	DPRINTF((">>>> gpio mask=0x%lx, err=%d, values=0x%lx\n",
+			req->mask, rsp->err, rsp->values));
+}
+
 static void virtio_gpio_reset(void *vdev)
 {
 	struct virtio_gpio *gpio;
@@ -624,6 +929,8 @@ virtio_gpio_proc(struct virtio_gpio *gpio, struct iovec *iov, int n)
 	struct virtio_gpio_data *data;
 	struct virtio_gpio_request *req;
 	struct virtio_gpio_response *rsp;
+	struct virtio_gpio_multi_request *mreq;
+	struct virtio_gpio_multi_response *mrsp;
 	struct gpio_line *line;
 	int i, len, rc;
 
@@ -651,6 +958,17 @@ virtio_gpio_proc(struct virtio_gpio *gpio, struct iovec *iov, int n)
 						sizeof(data[0].name) - 1);
 		}
 		rc = gpio->nvline;
+	} else if (n == 2 && iov[0].iov_len == sizeof(*mreq)) {
+		mreq = iov[0].iov_base;
+		mrsp = iov[1].iov_base;
+		len = iov[1].iov_len;
+		if (len != sizeof(*mrsp)) {
+			WPRINTF(("virtio gpio, invalid rsp size %d\n", len));
+			return 0;
+		}
+
+		gpio_multi_request_handler(gpio, mreq, mrsp);
+		rc = sizeof(*mrsp);
 	} else if (n == 2) { /* handle gpio operations requests */
 		req = iov[0].iov_base;
 		len = iov[0].iov_len;
@@ -686,7 +1004,7 @@ virtio_gpio_notify(void *vdev, struct virtio_vq_info *vq)
 
 	idx = vq->qsize;
 	gpio = (struct virtio_gpio *)vdev;
-	if (vq_has_descs(vq)) {
+	while (vq_has_descs(vq)) {
 		n = vq_getchain(vq, &idx, iov, 2, NULL);
 		if (n < 1 || n >= 3) {
 			WPRINTF(("virtio gpio, invalid chain number %d\n", n));
@@ -735,6 +1053,8 @@ native_gpio_open_chip(struct native_gpio_chip *chip, const char *name)
 	}
 	chip->fd = fd;
 	chip->ngpio = info.lines;
+	chip->groups[0].fd = -1;
+	chip->groups[1].fd = -1;
 	strncpy(chip->name, info.name, sizeof(chip->name) - 1);
 	strncpy(chip->label, info.label, sizeof(chip->label) - 1);
 	strncpy(chip->dev_name, name, sizeof(chip->dev_name) - 1);
@@ -938,6 +1258,25 @@ gpio_irq_deliver_intr(struct virtio_gpio *gpio, uint64_t mask)
 		WPRINTF(("virtio gpio failed to send an IRQ, mask %lu", mask));
 }
 
+/*
+ * If all interrupts in service are acknowledged, then send the pending ones,
+ * coalesced in a single event. Called with intr_mtx held.
+ */
+static void
+gpio_irq_flush_intr(struct virtio_gpio *gpio)
+{
+	struct gpio_irq_chip *chip;
+
+	chip = &gpio->irq_chip;
+	if (!chip->intr_service && chip->intr_pending) {
+		chip->intr_service = chip->intr_pending;
+		chip->intr_pending = 0;
+
+		/* deliver interrupt */
+		gpio_irq_deliver_intr(gpio, chip->intr_service);
+	}
+}
+
 static void
 gpio_irq_generate_intr(struct virtio_gpio *gpio, int pin)
 {
@@ -955,18 +1294,7 @@ gpio_irq_generate_intr(struct virtio_gpio *gpio, int pin)
 
 	/* set it to pending mask */
 	chip->intr_pending |= BIT(pin);
-
-	/*
-	 * if all interrupts in service are acknowledged, then send pending
-	 * interrupts.
-	 */
-	if (!chip->intr_service) {
-		chip->intr_service = chip->intr_pending;
-		chip->intr_pending = 0;
-
-		/* deliver interrupt */
-		gpio_irq_deliver_intr(gpio, chip->intr_service);
-	}
+	gpio_irq_flush_intr(gpio);
 	pthread_mutex_unlock(&chip->intr_mtx);
 }
 
@@ -975,45 +1303,56 @@ gpio_irq_set_pin_state(int fd __attribute__((unused)),
 		enum ev_type t __attribute__((unused)),
 		void *arg)
 {
-	struct gpioevent_data data;
+	struct gpioevent_data data[GPIO_IRQ_EVENTS_MAX];
 	struct virtio_gpio *gpio;
 	struct gpio_irq_desc *desc;
-	int err;
+	bool intr = false;
+	int err, i;
 
 	desc = (struct gpio_irq_desc *) arg;
 	gpio = (struct virtio_gpio *) desc->data;
 
-	/* get pin state */
-	memset(&data, 0, sizeof(data));
-	err = read(desc->fd, &data, sizeof(data));
-	if (err != sizeof(data)) {
+	/*
+	 * get pin state, with the events of a burst read at once and
+	 * coalesced in a single interrupt
+	 */
+	memset(data, 0, sizeof(data));
+	err = read(desc->fd, data, sizeof(data));
+	if (err < (int)sizeof(data[0]) || err % sizeof(data[0])) {
 		WPRINTF(("virtio gpio, gpio mevent read error %s, len %d\n",
 				strerror(errno), err));
 		return;
 	}
 
-	if (data.id == GPIOEVENT_EVENT_RISING_EDGE) {
+	for (i = 0; i < err / sizeof(data[0]); i++) {
+		if (data[i].id == GPIOEVENT_EVENT_RISING_EDGE) {
 
-		/* pin level is high */
-		desc->level = 1;
+			/* pin level is high */
+			desc->level = 1;
 
-		/* jitter protection */
-		if ((desc->mode & IRQ_TYPE_EDGE_RISING)
-				|| (desc->mode & IRQ_TYPE_LEVEL_HIGH)) {
-			gpio_irq_generate_intr(gpio, desc->pin);
-		}
-	} else if (data.id == GPIOEVENT_EVENT_FALLING_EDGE) {
+			/* jitter protection */
+			if ((desc->mode & IRQ_TYPE_EDGE_RISING)
+					|| (desc->mode & IRQ_TYPE_LEVEL_HIGH))
+				intr = true;
+		} else if (data[i].id == GPIOEVENT_EVENT_FALLING_EDGE) {
 
-		/* pin level is low */
-		desc->level = 0;
+			/* pin level is low */
+			desc->level = 0;
 
-		/* jitter protection */
-		if ((desc->mode & IRQ_TYPE_EDGE_FALLING)
-				|| (desc->mode & IRQ_TYPE_LEVEL_LOW)) {
-			gpio_irq_generate_intr(gpio, desc->pin);
-		}
-	} else
-		WPRINTF(("virtio gpio, undefined GPIO event id %d\n", data.id));
+			/* jitter protection */
+			if ((desc->mode & IRQ_TYPE_EDGE_FALLING)
+					|| (desc->mode & IRQ_TYPE_LEVEL_LOW))
+				intr = true;
+		} else
+			WPRINTF(("virtio gpio, undefined GPIO event id %d\n",
+					data[i].id));
+	}
+
+	/* a level interrupt only if the pin is still at its level */
+	if (desc->mode & IRQ_TYPE_LEVEL_MASK)
+		intr = gpio_irq_has_pending_intr(desc);
+	if (intr)
+		gpio_irq_generate_intr(gpio, desc->pin);
 }
 
 static void
@@ -1146,11 +1485,23 @@ gpio_irq_has_pending_intr(struct gpio_irq_desc *desc)
 	return false;
 }
 
+/*
+ * Acknowledge the pin, raise it again if its level is still active, and send
+ * the interrupts that became pending while the ones in service were.
+ */
 static void
-gpio_irq_clear_intr(struct gpio_irq_chip *chip, int pin)
+gpio_irq_clear_intr(struct virtio_gpio *gpio, int pin)
 {
+	struct gpio_irq_chip *chip;
+	struct gpio_irq_desc *desc;
+
+	chip = &gpio->irq_chip;
+	desc = &chip->descs[pin];
 	pthread_mutex_lock(&chip->intr_mtx);
 	chip->intr_service &= ~BIT(pin);
+	if (!desc->mask && gpio_irq_has_pending_intr(desc))
+		chip->intr_pending |= BIT(pin);
+	gpio_irq_flush_intr(gpio);
 	pthread_mutex_unlock(&chip->intr_mtx);
 }
 
@@ -1200,9 +1551,7 @@ virtio_gpio_irq_proc(struct virtio_gpio *gpio, struct iovec *iov, uint16_t flag)
 		 * For level trigger, we need to check the level value
 		 * for next interrupt.
 		 */
-		gpio_irq_clear_intr(chip, req->pin);
-		if (gpio_irq_has_pending_intr(desc))
-			gpio_irq_generate_intr(gpio, req->pin);
+		gpio_irq_clear_intr(gpio, req->pin);
 		break;
 	case IRQ_ACTION_MASK:
 		desc->mask = true;
@@ -1234,7 +1583,7 @@ virtio_irq_notify(void *vdev, struct virtio_vq_info *vq)
 
 	idx = vq->qsize;
 	gpio = (struct virtio_gpio *)vdev;
-	if (vq_has_descs(vq)) {
+	while (vq_has_descs(vq)) {
 		n = vq_getchain(vq, &idx, iov, 1, &flag);
 		if (n != 1) {
 			WPRINTF(("virtio gpio, invalid irq chain %d\n", n));
@@ -1247,10 +1596,10 @@ virtio_irq_notify(void *vdev, struct virtio_vq_info *vq)
 		 * Release this chain and handle more
 		 */
 		vq_relchain(vq, idx, 1);
-
-		/* Generate interrupt if appropriate. */
-		vq_endchains(vq, 1);
 	}
+
+	/* Generate interrupt if appropriate, once for all the requests. */
+	vq_endchains(vq, 1);
 }
 
 static void
@@ -1593,6 +1942,8 @@ print_virtio_gpio_info(struct virtio_gpio_request *req,
 		"GPIO_REQ_OUTPUT_DIRECTION",
 		"GPIO_REQ_GET_DIRECTION",
 		"GPIO_REQ_SET_CONFIG",
+		"GPIO_REQ_GET_MULTIPLE",
+		"GPIO_REQ_SET_MULTIPLE",
 		"GPIO_REQ_MAX",
 	};
 
@@ -44,6 +44,12 @@
 #define VIRTIO_GPU_RINGSZ	64
 #define VIRTIO_GPU_MAXSEGS	256
 
+/*
+ * Workers for the transfers to the 2D resources, see
+ * virtio_gpu_queue_transfer().
+ */
+#define VIRTIO_GPU_WORKERS	2
+
 /*
  * Feature bits
  */
@@ -74,6 +80,7 @@
 #define VIRTIO_GPU_FLAG_FENCE	(1 << 0)
 #define VIRTIO_GPU_VGA_FB_SIZE	16 * MB
 #define VIRTIO_GPU_VGA_DMEMSZ	128
+#define VIRTIO_GPU_VGA_FB_PAGES	((VIRTIO_GPU_VGA_FB_SIZE) / 4096)
 #define VIRTIO_GPU_EDID_SIZE	384
 #define VIRTIO_GPU_VGA_IOPORT_OFFSET	0x400
 #define VIRTIO_GPU_VGA_IOPORT_SIZE	(0x3e0 - 0x3c0)
@@ -219,6 +226,8 @@ struct virtio_gpu_resource_2d {
 	uint32_t iovcnt;
 	bool blob;
 	struct dma_buf_info *dma_info;
+	/* transferred from the guest but not flushed to the scanouts yet */
+	pixman_region16_t damage;
 	LIST_ENTRY(virtio_gpu_resource_2d) link;
 };
 
@@ -356,6 +365,10 @@ struct virtio_gpu_scanout {
 	pixman_image_t *cur_img;
 	struct dma_buf_info *dma_buf;
 	bool is_active;
+	/* the fenced flushes completed at the next vblank of the scanout */
+	uint16_t vblank_idx[VIRTIO_GPU_RINGSZ];
+	uint32_t vblank_iolen[VIRTIO_GPU_RINGSZ];
+	int vblank_nr;
 };
 
 /*
@@ -374,10 +387,27 @@ struct virtio_gpu {
 	struct vga vga;
 	pthread_mutex_t	vga_thread_mtx;
 	int32_t vga_thread_status;
+	/* pages of the VGA framebuffer written to, from the EPT dirty log */
+	uint64_t vga_dirty[VIRTIO_GPU_VGA_FB_PAGES / 64];
+	bool vga_dirty_log_off;
 	uint8_t edid[VIRTIO_GPU_EDID_SIZE];
 	bool is_blob_supported;
 	int scanout_num;
 	struct virtio_gpu_scanout *gpu_scanouts;
+	/* serializes the accesses to the control queue with the workers */
+	pthread_mutex_t ctrlq_mtx;
+	pthread_t workers[VIRTIO_GPU_WORKERS];
+	int nr_workers;
+	bool workers_exit;
+	/* protects the jobs and the damage regions of the resources */
+	pthread_mutex_t job_mtx;
+	pthread_cond_t job_cond;
+	pthread_cond_t job_done_cond;
+	STAILQ_HEAD(, virtio_gpu_job) jobs;
+	/* queued or running */
+	int jobs_pending;
+	/* the display delivers vblank events, see virtio_gpu_vblank() */
+	bool vblank_flush;
 };
 
 struct virtio_gpu_command {
@@ -390,12 +420,26 @@ struct virtio_gpu_command {
 	uint32_t iolen;
 };
 
+/*
+ * A VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D run by a worker. It completes its
+ * descriptor chain itself.
+ */
+struct virtio_gpu_job {
+	struct virtio_gpu_command cmd;
+	struct iovec iov[2];
+	uint16_t idx;
+	struct virtio_gpu_resource_2d *r2d;
+	struct virtio_gpu_transfer_to_host_2d req;
+	STAILQ_ENTRY(virtio_gpu_job) link;
+};
+
 static void virtio_gpu_reset(void *vdev);
 static int virtio_gpu_cfgread(void *, int, int, uint32_t *);
 static int virtio_gpu_cfgwrite(void *, int, int, uint32_t);
 static void virtio_gpu_neg_features(void *, uint64_t);
 static void virtio_gpu_set_status(void *, uint64_t);
 static void * virtio_gpu_vga_render(void *param);
+static void virtio_gpu_wait_transfers(struct virtio_gpu *gpu);
 
 static struct virtio_ops virtio_gpu_ops = {
 	"virtio-gpu",			/* our name */
@@ -450,9 +494,11 @@ virtio_gpu_reset(void *vdev)
 {
 	struct virtio_gpu *gpu;
 	struct virtio_gpu_resource_2d *r2d;
+	int i;
 
 	pr_dbg("Resetting virtio-gpu device.\n");
 	gpu = vdev;
+	virtio_gpu_wait_transfers(gpu);
 	while (LIST_FIRST(&gpu->r2d_list)) {
 		r2d = LIST_FIRST(&gpu->r2d_list);
 		if (r2d) {
@@ -470,6 +516,7 @@ virtio_gpu_reset(void *vdev)
 				free(r2d->iov);
 				r2d->iov = NULL;
 			}
+			pixman_region_fini(&r2d->damage);
 			free(r2d);
 		}
 	}
@@ -481,6 +528,10 @@ virtio_gpu_reset(void *vdev)
 		pthread_create(&gpu->vga.tid, NULL, virtio_gpu_vga_render, (void *)gpu);
 	}
 	pthread_mutex_unlock(&gpu->vga_thread_mtx);
+	pthread_mutex_lock(&gpu->ctrlq_mtx);
+	for (i = 0; i < gpu->scanout_num; i++)
+		gpu->gpu_scanouts[i].vblank_nr = 0;
+	pthread_mutex_unlock(&gpu->ctrlq_mtx);
 	virtio_reset_dev(&gpu->base);
 }
 
@@ -723,6 +774,7 @@ virtio_gpu_cmd_resource_create_2d(struct virtio_gpu_command *cmd)
 		free(r2d);
 		resp.type = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
 	} else {
+		pixman_region_init(&r2d->damage);
 		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
 		LIST_INSERT_HEAD(&cmd->gpu->r2d_list, r2d, link);
 	}
@@ -759,6 +811,7 @@ virtio_gpu_cmd_resource_unref(struct virtio_gpu_command *cmd)
 			free(r2d->iov);
 			r2d->iov = NULL;
 		}
+		pixman_region_fini(&r2d->damage);
 		free(r2d);
 		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
 	} else {
@@ -930,18 +983,75 @@ virtio_gpu_cmd_set_scanout(struct virtio_gpu_command *cmd)
 	}
 }
 
+static bool
+virtio_gpu_transfer_in_bounds(struct virtio_gpu_resource_2d *r2d,
+		struct virtio_gpu_rect *r)
+{
+	if ((r->x > r2d->width) ||
+	    (r->y > r2d->height) ||
+	    (r->width > r2d->width) ||
+	    (r->height > r2d->height) ||
+	    (r->x + r->width > r2d->width) ||
+	    (r->y + r->height > r2d->height))
+		return false;
+
+	return true;
+}
+
+/* Copy the rectangle of the transfer from the backing pages to the image */
 static void
-virtio_gpu_cmd_transfer_to_host_2d(struct virtio_gpu_command *cmd)
+virtio_gpu_transfer_2d(struct virtio_gpu_resource_2d *r2d,
+		struct virtio_gpu_transfer_to_host_2d *req)
 {
-	struct virtio_gpu_transfer_to_host_2d req;
-	struct virtio_gpu_resource_2d *r2d;
-	struct virtio_gpu_ctrl_hdr resp;
 	uint32_t src_offset, dst_offset, stride, bpp, h;
 	pixman_format_code_t format;
 	void *img_data, *dst, *src;
 	int i, done, bytes, total;
 	int width, height;
 
+	pixman_image_ref(r2d->image);
+	stride = pixman_image_get_stride(r2d->image);
+	format = pixman_image_get_format(r2d->image);
+	bpp = PIXMAN_FORMAT_BPP(format) / 8;
+	img_data = pixman_image_get_data(r2d->image);
+	width = (req->r.width < r2d->width) ? req->r.width : r2d->width;
+	height = (req->r.height < r2d->height) ? req->r.height : r2d->height;
+	for (h = 0; h < height; h++) {
+		src_offset = req->offset + stride * h;
+		dst_offset = (req->r.y + h) * stride + (req->r.x * bpp);
+		dst = img_data + dst_offset;
+		done = 0;
+		total = width * bpp;
+		for (i = 0; i < r2d->iovcnt; i++) {
+			if ((r2d->iov[i].iov_base == 0) || (r2d->iov[i].iov_len == 0)) {
+				continue;
+			}
+
+			if (src_offset < r2d->iov[i].iov_len) {
+				src = r2d->iov[i].iov_base + src_offset;
+				bytes = ((total - done) < (r2d->iov[i].iov_len - src_offset)) ?
+					 (total - done) : (r2d->iov[i].iov_len - src_offset);
+				memcpy((dst + done), src, bytes);
+				src_offset = 0;
+				done += bytes;
+				if (done >= total) {
+					break;
+				}
+			} else {
+				src_offset -= r2d->iov[i].iov_len;
+			}
+		}
+	}
+	pixman_image_unref(r2d->image);
+}
+
+static void
+virtio_gpu_cmd_transfer_to_host_2d(struct virtio_gpu_command *cmd)
+{
+	struct virtio_gpu_transfer_to_host_2d req;
+	struct virtio_gpu_resource_2d *r2d;
+	struct virtio_gpu_ctrl_hdr resp;
+
 	memcpy(&req, cmd->iov[0].iov_base, sizeof(req));
 	memset(&resp, 0, sizeof(resp));
 	virtio_gpu_update_resp_fence(&cmd->hdr, &resp);
@@ -961,49 +1071,13 @@ virtio_gpu_cmd_transfer_to_host_2d(struct virtio_gpu_command *cmd)
 		return;
 	}
 
-	if ((req.r.x > r2d->width) ||
-	    (req.r.y > r2d->height) ||
-	    (req.r.width > r2d->width) ||
-	    (req.r.height > r2d->height) ||
-	    (req.r.x + req.r.width > r2d->width) ||
-	    (req.r.y + req.r.height > r2d->height)) {
+	if (!virtio_gpu_transfer_in_bounds(r2d, &req.r)) {
 		pr_err("%s: transfer bounds outside resource.\n", __func__);
 		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
 	} else {
-		pixman_image_ref(r2d->image);
-		stride = pixman_image_get_stride(r2d->image);
-		format = pixman_image_get_format(r2d->image);
-		bpp = PIXMAN_FORMAT_BPP(format) / 8;
-		img_data = pixman_image_get_data(r2d->image);
-		width = (req.r.width < r2d->width) ? req.r.width : r2d->width;
-		height = (req.r.height < r2d->height) ? req.r.height : r2d->height;
-		for (h = 0; h < height; h++) {
-			src_offset = req.offset + stride * h;
-			dst_offset = (req.r.y + h) * stride + (req.r.x * bpp);
-			dst = img_data + dst_offset;
-			done = 0;
-			total = width * bpp;
-			for (i = 0; i < r2d->iovcnt; i++) {
-				if ((r2d->iov[i].iov_base == 0) || (r2d->iov[i].iov_len == 0)) {
-					continue;
-				}
-
-				if (src_offset < r2d->iov[i].iov_len) {
-					src = r2d->iov[i].iov_base + src_offset;
-					bytes = ((total - done) < (r2d->iov[i].iov_len - src_offset)) ?
-						 (total - done) : (r2d->iov[i].iov_len - src_offset);
-					memcpy((dst + done), src, bytes);
-					src_offset = 0;
-					done += bytes;
-					if (done >= total) {
-						break;
-					}
-				} else {
-					src_offset -= r2d->iov[i].iov_len;
-				}
-			}
-		}
-		pixman_image_unref(r2d->image);
+		virtio_gpu_transfer_2d(r2d, &req);
+		pixman_region_union_rect(&r2d->damage, &r2d->damage,
+				req.r.x, req.r.y, req.r.width, req.r.height);
 		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
 	}
 
@@ -1011,6 +1085,156 @@ virtio_gpu_cmd_transfer_to_host_2d(struct virtio_gpu_command *cmd)
 	memcpy(cmd->iov[1].iov_base, &resp, sizeof(resp));
 }
 
+/*
+ * The transfers of a frame are copied by the workers while the display
+ * thread goes on with the control queue, the cursor and the other
+ * scanouts. The other commands wait for them in virtio_gpu_wait_transfers():
+ * they may use the resources being copied to, and the fence a command
+ * signals tells the guest the commands before it are done as well.
+ */
+static void *
+virtio_gpu_worker(void *param)
+{
+	struct virtio_gpu *gpu;
+	struct virtio_gpu_job *job;
+	struct virtio_gpu_ctrl_hdr resp;
+	struct virtio_vq_info *vq;
+
+	gpu = (struct virtio_gpu *)param;
+	pthread_mutex_lock(&gpu->job_mtx);
+	for (;;) {
+		while (STAILQ_EMPTY(&gpu->jobs) && !gpu->workers_exit)
+			pthread_cond_wait(&gpu->job_cond, &gpu->job_mtx);
+		if (gpu->workers_exit)
+			break;
+		job = STAILQ_FIRST(&gpu->jobs);
+		STAILQ_REMOVE_HEAD(&gpu->jobs, link);
+		pthread_mutex_unlock(&gpu->job_mtx);
+
+		virtio_gpu_transfer_2d(job->r2d, &job->req);
+		memset(&resp, 0, sizeof(resp));
+		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
+		memcpy(job->cmd.iov[1].iov_base, &resp, sizeof(resp));
+
+		pthread_mutex_lock(&gpu->job_mtx);
+		pixman_region_union_rect(&job->r2d->damage, &job->r2d->damage,
+				job->req.r.x, job->req.r.y,
+				job->req.r.width, job->req.r.height);
+		pthread_mutex_unlock(&gpu->job_mtx);
+
+		vq = job->cmd.vq;
+		pthread_mutex_lock(&gpu->ctrlq_mtx);
+		vq_relchain(vq, job->idx, sizeof(resp));
+		vq_endchains(vq, 1);
+		pthread_mutex_unlock(&gpu->ctrlq_mtx);
+		free(job);
+
+		pthread_mutex_lock(&gpu->job_mtx);
+		gpu->jobs_pending--;
+		if (gpu->jobs_pending == 0)
+			pthread_cond_broadcast(&gpu->job_done_cond);
+	}
+	pthread_mutex_unlock(&gpu->job_mtx);
+
+	return NULL;
+}
+
+/*
+ * Hand a valid unfenced transfer to a 2D resource over to the workers.
+ * Returns -1 for the caller to run it.
+ */
+static int
+virtio_gpu_queue_transfer(struct virtio_gpu_command *cmd, uint16_t idx)
+{
+	struct virtio_gpu *gpu;
+	struct virtio_gpu_transfer_to_host_2d req;
+	struct virtio_gpu_resource_2d *r2d;
+	struct virtio_gpu_job *job;
+
+	gpu = cmd->gpu;
+	if ((gpu->nr_workers == 0) || (cmd->iovcnt < 2) ||
+	    (cmd->hdr.flags & VIRTIO_GPU_FLAG_FENCE))
+		return -1;
+
+	memcpy(&req, cmd->iov[0].iov_base, sizeof(req));
+	r2d = virtio_gpu_find_resource_2d(gpu, req.resource_id);
+	if ((r2d == NULL) || r2d->blob || !virtio_gpu_transfer_in_bounds(r2d, &req.r))
+		return -1;
+
+	job = calloc(1, sizeof(*job));
+	if (job == NULL)
+		return -1;
+	job->cmd = *cmd;
+	job->iov[0] = cmd->iov[0];
+	job->iov[1] = cmd->iov[1];
+	job->cmd.iov = job->iov;
+	job->idx = idx;
+	job->r2d = r2d;
+	job->req = req;
+
+	pthread_mutex_lock(&gpu->job_mtx);
+	STAILQ_INSERT_TAIL(&gpu->jobs, job, link);
+	gpu->jobs_pending++;
+	pthread_cond_signal(&gpu->job_cond);
+	pthread_mutex_unlock(&gpu->job_mtx);
+
+	return 0;
+}
+
+static void
+virtio_gpu_wait_transfers(struct virtio_gpu *gpu)
+{
+	pthread_mutex_lock(&gpu->job_mtx);
+	while (gpu->jobs_pending > 0)
+		pthread_cond_wait(&gpu->job_done_cond, &gpu->job_mtx);
+	pthread_mutex_unlock(&gpu->job_mtx);
+}
+
+static void
+virtio_gpu_start_workers(struct virtio_gpu *gpu)
+{
+	char tname[MAXCOMLEN + 1];
+	int i;
+
+	pthread_mutex_init(&gpu->ctrlq_mtx, NULL);
+	pthread_mutex_init(&gpu->job_mtx, NULL);
+	pthread_cond_init(&gpu->job_cond, NULL);
+	pthread_cond_init(&gpu->job_done_cond, NULL);
+	STAILQ_INIT(&gpu->jobs);
+
+	for (i = 0; i < VIRTIO_GPU_WORKERS; i++) {
+		if (pthread_create(&gpu->workers[i], NULL,
+				virtio_gpu_worker, gpu) != 0) {
+			pr_err("%s: failed to create worker %d, the transfers"
+				" run on the display thread\n", __func__, i);
+			break;
+		}
+		snprintf(tname, sizeof(tname), "virtio-gpu-%d", i);
+		pthread_setname_np(gpu->workers[i], tname);
+		gpu->nr_workers++;
+	}
+}
+
+static void
+virtio_gpu_stop_workers(struct virtio_gpu *gpu)
+{
+	int i;
+
+	virtio_gpu_wait_transfers(gpu);
+	pthread_mutex_lock(&gpu->job_mtx);
+	gpu->workers_exit = true;
+	pthread_cond_broadcast(&gpu->job_cond);
+	pthread_mutex_unlock(&gpu->job_mtx);
+	for (i = 0; i < gpu->nr_workers; i++)
+		pthread_join(gpu->workers[i], NULL);
+	gpu->nr_workers = 0;
+
+	pthread_cond_destroy(&gpu->job_done_cond);
+	pthread_cond_destroy(&gpu->job_cond);
+	pthread_mutex_destroy(&gpu->job_mtx);
+	pthread_mutex_destroy(&gpu->ctrlq_mtx);
+}
+
 static bool
 virtio_gpu_scanout_needs_flush(struct virtio_gpu *gpu,
 			      int scanout_id,
@@ -1051,7 +1275,10 @@ virtio_gpu_scanout_needs_flush(struct virtio_gpu *gpu,
 		return false;
 }
 
-static void
+/*
+ * Returns the first scanout updated by the flush, -1 if there is none.
+ */
+static int
 virtio_gpu_cmd_resource_flush(struct virtio_gpu_command *cmd)
 {
 	struct virtio_gpu_resource_flush req;
@@ -1061,11 +1288,14 @@ virtio_gpu_cmd_resource_flush(struct virtio_gpu_command *cmd)
 	struct virtio_gpu *gpu;
 	int i;
 	struct virtio_gpu_scanout *gpu_scanout;
+	pixman_region16_t flush_damage, scanout_damage;
 	int bytes_pp;
+	int flushed = -1;
 
 	gpu = cmd->gpu;
 	memcpy(&req, cmd->iov[0].iov_base, sizeof(req));
 	memset(&resp, 0, sizeof(resp));
+	memset(&surf, 0, sizeof(surf));
 	virtio_gpu_update_resp_fence(&cmd->hdr, &resp);
 
 	r2d = virtio_gpu_find_resource_2d(gpu, req.resource_id);
@@ -1074,7 +1304,7 @@ virtio_gpu_cmd_resource_flush(struct virtio_gpu_command *cmd)
 				req.resource_id);
 		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
 		memcpy(cmd->iov[1].iov_base, &resp, sizeof(resp));
-		return;
+		return flushed;
 	}
 	if (r2d->blob) {
 		virtio_gpu_dmabuf_ref(r2d->dma_info);
@@ -1085,12 +1315,32 @@ virtio_gpu_cmd_resource_flush(struct virtio_gpu_command *cmd)
 			surf.dma_info.dmabuf_fd = r2d->dma_info->dmabuf_fd;
 			surf.surf_type = SURFACE_DMABUF;
 			vdpy_surface_update(gpu->vdpy_handle, i, &surf);
+			if (flushed < 0)
+				flushed = i;
 		}
 		virtio_gpu_dmabuf_unref(r2d->dma_info);
 		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
 		memcpy(cmd->iov[1].iov_base, &resp, sizeof(resp));
-		return;
+		return flushed;
 	}
+
+	/*
+	 * Only the part of the flushed rectangle the guest has transferred to
+	 * since the last flush is uploaded. Nothing is rendered if there is
+	 * none, the desktop has not changed.
+	 */
+	pixman_region_init_rect(&flush_damage, req.r.x, req.r.y,
+			req.r.width, req.r.height);
+	pixman_region_intersect(&flush_damage, &flush_damage, &r2d->damage);
+	if (!pixman_region_not_empty(&flush_damage)) {
+		pixman_region_fini(&flush_damage);
+		cmd->iolen = sizeof(resp);
+		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
+		memcpy(cmd->iov[1].iov_base, &resp, sizeof(resp));
+		return flushed;
+	}
+
+	pixman_region_init(&scanout_damage);
 	pixman_image_ref(r2d->image);
 	bytes_pp = PIXMAN_FORMAT_BPP(r2d->format) / 8;
 	for (i = 0; i < gpu->scanout_num; i++) {
@@ -1098,6 +1348,18 @@ virtio_gpu_cmd_resource_flush(struct virtio_gpu_command *cmd)
 			continue;
 
 		gpu_scanout = gpu->gpu_scanouts + i;
+		/* the damage in the coordinates of the scanout */
+		pixman_region_intersect_rect(&scanout_damage, &flush_damage,
+				gpu_scanout->scanout_rect.x,
+				gpu_scanout->scanout_rect.y,
+				gpu_scanout->scanout_rect.width,
+				gpu_scanout->scanout_rect.height);
+		if (!pixman_region_not_empty(&scanout_damage))
+			continue;
+		pixman_region_translate(&scanout_damage,
+				-(int)gpu_scanout->scanout_rect.x,
+				-(int)gpu_scanout->scanout_rect.y);
+		surf.damage = &scanout_damage;
 		surf.pixel = pixman_image_get_data(r2d->image);
 		surf.x = gpu_scanout->scanout_rect.x;
 		surf.y = gpu_scanout->scanout_rect.y;
@@ -1108,12 +1370,66 @@ virtio_gpu_cmd_resource_flush(struct virtio_gpu_command *cmd)
 		surf.surf_type = SURFACE_PIXMAN;
 		surf.pixel += bytes_pp * surf.x + surf.y * surf.stride;
 		vdpy_surface_update(gpu->vdpy_handle, i, &surf);
+		if (flushed < 0)
+			flushed = i;
 	}
 	pixman_image_unref(r2d->image);
+	pixman_region_subtract(&r2d->damage, &r2d->damage, &flush_damage);
+	pixman_region_fini(&scanout_damage);
+	pixman_region_fini(&flush_damage);
 
 	cmd->iolen = sizeof(resp);
 	resp.type = VIRTIO_GPU_RESP_OK_NODATA;
 	memcpy(cmd->iov[1].iov_base, &resp, sizeof(resp));
+	return flushed;
+}
+
+/*
+ * With vsync=fifo a fenced flush is completed at the next vblank of its
+ * scanout, after the frame has been presented: the guest waiting for the
+ * fence renders its next frame in step with the monitor.
+ *
+ * @pre the caller holds ctrlq_mtx
+ */
+static void
+virtio_gpu_defer_to_vblank(struct virtio_gpu *gpu, int scanout_id,
+		uint16_t idx, uint32_t iolen)
+{
+	struct virtio_gpu_scanout *gpu_scanout;
+
+	gpu_scanout = gpu->gpu_scanouts + scanout_id;
+	if (gpu_scanout->vblank_nr < VIRTIO_GPU_RINGSZ) {
+		gpu_scanout->vblank_idx[gpu_scanout->vblank_nr] = idx;
+		gpu_scanout->vblank_iolen[gpu_scanout->vblank_nr] = iolen;
+		gpu_scanout->vblank_nr++;
+	} else {
+		vq_relchain(&gpu->vq[VIRTIO_GPU_CONTROLQ], idx, iolen);
+	}
+}
+
+static void
+virtio_gpu_vblank(void *data, int scanout_id)
+{
+	struct virtio_gpu *gpu;
+	struct virtio_gpu_scanout *gpu_scanout;
+	struct virtio_vq_info *vq;
+	int i;
+
+	gpu = (struct virtio_gpu *)data;
+	if (scanout_id >= gpu->scanout_num)
+		return;
+
+	gpu_scanout = gpu->gpu_scanouts + scanout_id;
+	vq = &gpu->vq[VIRTIO_GPU_CONTROLQ];
+	pthread_mutex_lock(&gpu->ctrlq_mtx);
+	if (gpu_scanout->vblank_nr > 0) {
+		for (i = 0; i < gpu_scanout->vblank_nr; i++)
+			vq_relchain(vq, gpu_scanout->vblank_idx[i],
+					gpu_scanout->vblank_iolen[i]);
+		gpu_scanout->vblank_nr = 0;
+		vq_endchains(vq, 1);
+	}
+	pthread_mutex_unlock(&gpu->ctrlq_mtx);
 }
 
 static int udmabuf_fd(void)
@@ -1254,6 +1570,7 @@ virtio_gpu_cmd_create_blob(struct virtio_gpu_command *cmd)
 	}
 
 	r2d->resource_id = req.resource_id;
+	pixman_region_init(&r2d->damage);
 
 	if (req.nr_entries > 0) {
 		entries = calloc(req.nr_entries, sizeof(struct virtio_gpu_mem_entry));
@@ -1412,30 +1729,41 @@ virtio_gpu_ctrl_bh(void *data)
 	struct virtio_gpu_command cmd;
 	struct iovec iov[VIRTIO_GPU_MAXSEGS];
 	uint16_t flags[VIRTIO_GPU_MAXSEGS];
-	int n;
+	int n, scanout_id;
 	uint16_t idx;
 
 	vq = (struct virtio_vq_info *)data;
 	vdev = (struct virtio_gpu *)(vq->base);
 	cmd.gpu = vdev;
+	cmd.vq = vq;
 	cmd.iolen = 0;
 
+	pthread_mutex_lock(&vdev->ctrlq_mtx);
 	while (vq_has_descs(vq)) {
 		n = vq_getchain(vq, &idx, iov, VIRTIO_GPU_MAXSEGS, flags);
 		if (n < 0) {
 			pr_err("virtio-gpu: invalid descriptors\n");
-			return;
+			break;
 		}
 		if (n == 0) {
 			pr_err("virtio-gpu: get no available descriptors\n");
-			return;
+			break;
 		}
+		pthread_mutex_unlock(&vdev->ctrlq_mtx);
 
 		cmd.iovcnt = n;
 		cmd.iov = iov;
 		memcpy(&cmd.hdr, iov[0].iov_base,
 			sizeof(struct virtio_gpu_ctrl_hdr));
 
+		if ((cmd.hdr.type == VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D) &&
+		    (virtio_gpu_queue_transfer(&cmd, idx) == 0)) {
+			/* completed by a worker */
+			pthread_mutex_lock(&vdev->ctrlq_mtx);
+			continue;
+		}
+		virtio_gpu_wait_transfers(vdev);
+
 		switch (cmd.hdr.type) {
 		case VIRTIO_GPU_CMD_GET_EDID:
 			virtio_gpu_cmd_get_edid(&cmd);
@@ -1462,7 +1790,14 @@ virtio_gpu_ctrl_bh(void *data)
 			virtio_gpu_cmd_transfer_to_host_2d(&cmd);
 			break;
 		case VIRTIO_GPU_CMD_RESOURCE_FLUSH:
-			virtio_gpu_cmd_resource_flush(&cmd);
+			scanout_id = virtio_gpu_cmd_resource_flush(&cmd);
+			if ((scanout_id >= 0) && vdev->vblank_flush &&
+			    (cmd.hdr.flags & VIRTIO_GPU_FLAG_FENCE)) {
+				pthread_mutex_lock(&vdev->ctrlq_mtx);
+				virtio_gpu_defer_to_vblank(vdev, scanout_id,
+						idx, cmd.iolen);
+				continue;
+			}
 			break;
 		case VIRTIO_GPU_CMD_RESOURCE_CREATE_BLOB:
 			if (!virtio_gpu_blob_supported(vdev)) {
@@ -1483,9 +1818,11 @@ virtio_gpu_ctrl_bh(void *data)
 			break;
 		}
 
+		pthread_mutex_lock(&vdev->ctrlq_mtx);
 		vq_relchain(vq, idx, cmd.iolen); /* Release the chain */
 	}
 	vq_endchains(vq, 1);	/* Generate interrupt if appropriate. */
+	pthread_mutex_unlock(&vdev->ctrlq_mtx);
 }
 
 static void
@@ -1592,10 +1929,67 @@ virtio_gpu_notify_cursorq(void *vdev, struct virtio_vq_info *vq)
 	vdpy_submit_bh(gpu->vdpy_handle, &gpu->cursor_bh);
 }
 
+/*
+ * Get the scanlines of the VBE framebuffer in BAR0 the guest wrote to since
+ * the last call, from the EPT dirty log. Returns -1 if the log cannot be
+ * read, the whole framebuffer is to be refreshed then.
+ */
+static int
+virtio_gpu_vga_damage(struct virtio_gpu *gpu, pixman_region16_t *damage)
+{
+	struct pci_vdev *dev;
+	struct surface *surf;
+	uint64_t size, start, end;
+	uint32_t pages, page, last, y0, y1;
+
+	dev = gpu->base.dev;
+	surf = &gpu->vga.surf;
+	if (gpu->vga_dirty_log_off || (surf->stride == 0) || (dev->bar[0].addr == 0))
+		return -1;
+
+	size = roundup2((uint64_t)surf->stride * surf->height, 4096);
+	if (size > VIRTIO_GPU_VGA_FB_SIZE)
+		return -1;
+
+	if (vm_get_dirty_log(dev->vmctx, dev->bar[0].addr, size, gpu->vga_dirty) != 0) {
+		pr_info("%s: no dirty log (%s), the VGA framebuffer is refreshed "
+			"in full\n", __func__, strerror(errno));
+		gpu->vga_dirty_log_off = true;
+		return -1;
+	}
+
+	pixman_region_init(damage);
+	pages = size / 4096;
+	for (page = 0; page < pages; page = last) {
+		if (!(gpu->vga_dirty[page / 64] & (1UL << (page % 64)))) {
+			last = page + 1;
+			continue;
+		}
+		for (last = page + 1; last < pages; last++) {
+			if (!(gpu->vga_dirty[last / 64] & (1UL << (last % 64))))
+				break;
+		}
+
+		/* the scanlines the run of dirty pages overlaps */
+		start = (uint64_t)page * 4096;
+		end = (uint64_t)last * 4096;
+		y0 = start / surf->stride;
+		y1 = (end + surf->stride - 1) / surf->stride;
+		if (y1 > surf->height)
+			y1 = surf->height;
+		if (y1 > y0)
+			pixman_region_union_rect(damage, damage, 0, y0,
+					surf->width, y1 - y0);
+	}
+
+	return 0;
+}
+
 static void
 virtio_gpu_vga_bh(void *param)
 {
 	struct virtio_gpu *gpu;
+	pixman_region16_t damage;
 
 	gpu = (struct virtio_gpu*)param;
 
@@ -1610,7 +2004,18 @@ virtio_gpu_vga_bh(void *param)
 		vdpy_surface_set(gpu->vdpy_handle, 0, &gpu->vga.surf);
 	}
 
-	vdpy_surface_update(gpu->vdpy_handle, 0, &gpu->vga.surf);
+	/* Only the scanlines the guest wrote to are uploaded */
+	if (virtio_gpu_vga_damage(gpu, &damage) != 0) {
+		vdpy_surface_update(gpu->vdpy_handle, 0, &gpu->vga.surf);
+		return;
+	}
+
+	if (pixman_region_not_empty(&damage)) {
+		gpu->vga.surf.damage = &damage;
+		vdpy_surface_update(gpu->vdpy_handle, 0, &gpu->vga.surf);
+		gpu->vga.surf.damage = NULL;
+	}
+	pixman_region_fini(&damage);
 }
 
 static void *
@@ -1699,6 +2104,7 @@ virtio_gpu_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	gpu->vdpy_handle = vdpy_init(&gpu->scanout_num);
 	gpu->base.mtx = &gpu->mtx;
 	gpu->base.device_caps = VIRTIO_GPU_S_HOSTCAPS;
+	virtio_gpu_start_workers(gpu);
 
 	if ((gpu->scanout_num < 0) || (gpu->scanout_num > 2)) {
 		pr_err("%s: return incorrect scanout num %d\n", gpu->scanout_num);
@@ -1710,6 +2116,8 @@ virtio_gpu_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		free(gpu);
 		return -1;
 	}
+	gpu->vblank_flush = vdpy_register_vblank(gpu->vdpy_handle,
+			virtio_gpu_vblank, gpu);
 
 	if (vm_allow_dmabuf(gpu->base.dev->vmctx)) {
 		FILE *fp;
@@ -1875,6 +2283,9 @@ virtio_gpu_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	if (!gpu)
 		return;
 
+	/* no virtio_gpu_vblank() runs once this returns */
+	if (gpu->vblank_flush)
+		vdpy_register_vblank(gpu->vdpy_handle, NULL, NULL);
 	gpu->vga.enable = false;
 
 	pthread_mutex_lock(&gpu->vga_thread_mtx);
@@ -1910,6 +2321,7 @@ virtio_gpu_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	free(gpu->gpu_scanouts);
 	gpu->gpu_scanouts = NULL;
 
+	virtio_gpu_stop_workers(gpu);
 	pthread_mutex_destroy(&gpu->vga_thread_mtx);
 	while (LIST_FIRST(&gpu->r2d_list)) {
 		r2d = LIST_FIRST(&gpu->r2d_list);
@@ -1928,6 +2340,7 @@ virtio_gpu_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 				free(r2d->iov);
 				r2d->iov = NULL;
 			}
+			pixman_region_fini(&r2d->damage);
 			free(r2d);
 		}
 	}
@@ -34,6 +34,13 @@
 /* Hyper dmabuf uses two queues one for Rx and one for Tx */
 #define HYPER_DMABUF_VQ_NUM 2
 
+/*
+ * With the zero_copy option, the shared buffers are exported from the guest
+ * memory the VBS-K backend maps, and only the buffer handles and the fences
+ * cross the virtqueues. Offered once the backend took the guest memory.
+ */
+#define HYPER_DMABUF_F_ZERO_COPY 0
+
 const char *hyper_dmabuf_vbs_dev_path = "/dev/vbs_hyper_dmabuf";
 
 static int virtio_hyper_dmabuf_debug;
@@ -54,6 +61,7 @@ struct virtio_hyper_dmabuf {
 	struct virtio_base base;
 	struct virtio_vq_info vq[HYPER_DMABUF_VQ_NUM];
 	pthread_mutex_t mtx;
+	bool zero_copy;
 };
 
 static int virtio_hyper_dmabuf_k_init(void);
@@ -250,6 +258,17 @@ virtio_hyper_dmabuf_set_status(void *base, uint64_t status)
 				return;
 			}
 		}
+		/* the reset of the backend dropped the guest memory */
+		if ((hyper_dmabuf->base.negotiated_caps &
+		     (1UL << HYPER_DMABUF_F_ZERO_COPY)) &&
+		    vbs_kernel_set_mem_table(vbs_k_hyper_dmabuf_fd,
+					     hyper_dmabuf->base.dev->vmctx) < 0) {
+			WPRINTF("virtio_hyper_dmabuf: zero copy negotiated, ");
+			WPRINTF("guest memory not mapped\n");
+			kstatus = VIRTIO_DEV_START_FAILED;
+			return;
+		}
+
 		rc = virtio_hyper_dmabuf_k_start();
 		if (rc < 0) {
 			WPRINTF("virtio_hyper_dmabuf:");
@@ -313,6 +332,16 @@ virtio_hyper_dmabuf_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 	hyper_dmabuf->base.mtx = &hyper_dmabuf->mtx;
 
+	hyper_dmabuf->zero_copy = (opts != NULL) &&
+		(strcmp(opts, "zero_copy") == 0);
+	if (hyper_dmabuf->zero_copy && kstatus == VIRTIO_DEV_INIT_SUCCESS) {
+		if (vbs_kernel_set_mem_table(vbs_k_hyper_dmabuf_fd, ctx) == 0)
+			hyper_dmabuf->base.device_caps |=
+				1UL << HYPER_DMABUF_F_ZERO_COPY;
+		else
+			WPRINTF("virtio_hyper_dmabuf: zero copy not available\n");
+	}
+
 	hyper_dmabuf->vq[0].qsize = HYPER_DMABUF_RINGSZ;
 	hyper_dmabuf->vq[1].qsize = HYPER_DMABUF_RINGSZ;
 
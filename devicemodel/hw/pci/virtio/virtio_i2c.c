@@ -78,8 +78,14 @@ static int virtio_i2c_debug=0;
 #define VIRTIO_I2C_FLAGS_FAIL_NEXT	1 << 0
 #define VIRTIO_I2C_FLAGS_M_RD		1 << 1
 
+/* the messages of a group of requests, run with one I2C_RDWR per adapter */
+#define VIRTIO_I2C_BATCH_MAX	I2C_RDWR_IOCTL_MAX_MSGS
+/* the batches queued to an adapter before the requests wait for it */
+#define VIRTIO_I2C_QUEUE_DEPTH	8
+
 #define VIRTIO_I2C_F_ZERO_LENGTH_REQUEST 0
 #define VIRTIO_I2C_HOSTCAPS   (1UL << VIRTIO_F_VERSION_1) | \
+                              (1UL << VIRTIO_F_RING_PACKED) | \
                               (1UL << VIRTIO_I2C_F_ZERO_LENGTH_REQUEST)
 
 static int acpi_i2c_adapter_num = 0;
@@ -112,10 +118,32 @@ struct virtio_i2c_in_hdr {
 	uint8_t status;
 };
 
+struct virtio_i2c;
+
+struct virtio_i2c_batch {
+	int			n;
+	uint16_t		idx[VIRTIO_I2C_BATCH_MAX];
+	struct i2c_msg		msgs[VIRTIO_I2C_BATCH_MAX];
+	struct virtio_i2c_in_hdr	*in_hdr[VIRTIO_I2C_BATCH_MAX];
+};
+
+/*
+ * Each adapter runs its batches in order on a worker of its own, so that a
+ * slow bus does not hold up the others.
+ */
 struct native_i2c_adapter {
 	int 		fd;
 	int 		bus;
 	bool 		i2cdev_enable[MAX_I2C_VDEV];
+	struct virtio_i2c	*vi2c;
+	pthread_t	tid;
+	pthread_mutex_t	mtx;
+	pthread_cond_t	cond;
+	struct virtio_i2c_batch	*queue[VIRTIO_I2C_QUEUE_DEPTH];
+	int		head;
+	int		count;
+	bool		started;
+	bool		closing;
 };
 
 /*
@@ -134,6 +162,7 @@ struct virtio_i2c {
 	pthread_mutex_t req_mtx;
 	pthread_cond_t req_cond;
 	int in_process;
+	int inflight;		/* batches queued to the adapters or running */
 	int closing;
 };
 
@@ -406,42 +435,153 @@ native_adapter_find(struct virtio_i2c *vi2c, uint16_t addr)
 	return NULL;
 }
 
-static uint8_t
-native_adapter_proc(struct virtio_i2c *vi2c, struct i2c_msg *msg)
+/*
+ * The batch is a group of requests, each but the last with
+ * VIRTIO_I2C_FLAGS_FAIL_NEXT: the messages of a run to the same adapter are
+ * a single transfer, with repeated starts as the group of the driver is an
+ * i2c_transfer(), and the messages after one that failed fail.
+ */
+static void
+virtio_i2c_batch_run(struct virtio_i2c *vi2c, struct virtio_i2c_batch *batch)
 {
-	int ret;
-	uint16_t addr;
 	struct i2c_rdwr_ioctl_data work_queue;
 	struct native_i2c_adapter *adapter;
-	uint8_t status;
+	struct i2c_msg *msg;
+	int i, j = 0, k, ret;
+
+	for (i = 0; i < batch->n; i = j) {
+		adapter = native_adapter_find(vi2c, batch->msgs[i].addr);
+		for (j = i + 1; j < batch->n && adapter &&
+				native_adapter_find(vi2c, batch->msgs[j].addr) == adapter; j++)
+			;
+
+		if (adapter) {
+			work_queue.nmsgs = j - i;
+			work_queue.msgs = &batch->msgs[i];
+			ret = ioctl(adapter->fd, I2C_RDWR, &work_queue);
+		} else {
+			DPRINTF("%s: could not find device for addr %x\n", __func__,
+					batch->msgs[i].addr);
+			ret = -1;
+		}
+
+		/* I2C_RDWR returns the number of messages done */
+		for (k = i; k < j; k++) {
+			msg = &batch->msgs[k];
+			batch->in_hdr[k]->status = (ret > k - i) ? I2C_MSG_OK : I2C_MSG_ERR;
+			if (msg->len)
+				DPRINTF("i2c_core: i2c msg: flags=0x%x, addr=0x%x, len=0x%x buf=%x\n",
+						msg->flags,
+						msg->addr,
+						msg->len,
+						msg->buf[0]);
+			else
+				DPRINTF("i2c_core: i2c msg: flags=0x%x, addr=0x%x, len=0x%x\n",
+						msg->flags,
+						msg->addr,
+						msg->len);
+		}
+		if (ret < j - i)
+			break;
+	}
+	for (k = j; k < batch->n; k++)
+		batch->in_hdr[k]->status = I2C_MSG_ERR;
+}
+
+/* hand the requests back to the driver, from any thread */
+static void
+virtio_i2c_batch_done(struct virtio_i2c *vi2c, struct virtio_i2c_batch *batch)
+{
+	struct virtio_vq_info *vq = &vi2c->vq;
+	int i;
+
+	pthread_mutex_lock(&vq->mtx);
+	for (i = 0; i < batch->n; i++)
+		vq_relchain(vq, batch->idx[i], 1);
+	vq_endchains(vq, 0);
+	pthread_mutex_unlock(&vq->mtx);
+	free(batch);
+
+	pthread_mutex_lock(&vi2c->req_mtx);
+	vi2c->inflight--;
+	pthread_cond_broadcast(&vi2c->req_cond);
+	pthread_mutex_unlock(&vi2c->req_mtx);
+}
 
-	addr = msg->addr;
-	adapter = native_adapter_find(vi2c, addr);
-	if (!adapter) {
-		DPRINTF("%s: could not find device for addr %x\n", __func__, msg->addr);
-		return I2C_MSG_ERR;
+static void *
+native_adapter_thread(void *arg)
+{
+	struct native_i2c_adapter *adapter = arg;
+	struct virtio_i2c_batch *batch;
+
+	for (;;) {
+		pthread_mutex_lock(&adapter->mtx);
+		while (!adapter->count && !adapter->closing)
+			pthread_cond_wait(&adapter->cond, &adapter->mtx);
+
+		/* the queued batches are run before closing */
+		if (!adapter->count) {
+			pthread_mutex_unlock(&adapter->mtx);
+			return NULL;
+		}
+		batch = adapter->queue[adapter->head];
+		adapter->head = (adapter->head + 1) % VIRTIO_I2C_QUEUE_DEPTH;
+		adapter->count--;
+		pthread_cond_broadcast(&adapter->cond);
+		pthread_mutex_unlock(&adapter->mtx);
+
+		virtio_i2c_batch_run(adapter->vi2c, batch);
+		virtio_i2c_batch_done(adapter->vi2c, batch);
 	}
+}
 
-	work_queue.nmsgs = 1;
-	work_queue.msgs = msg;
-
-	ret = ioctl(adapter->fd, I2C_RDWR, &work_queue);
-	if (ret < 0)
-		status = I2C_MSG_ERR;
-	else
-		status = I2C_MSG_OK;
-	if (msg->len)
-		DPRINTF("i2c_core: i2c msg: flags=0x%x, addr=0x%x, len=0x%x buf=%x\n",
-				msg->flags,
-				msg->addr,
-				msg->len,
-				msg->buf[0]);
-	else
-		DPRINTF("i2c_core: i2c msg: flags=0x%x, addr=0x%x, len=0x%x\n",
-				msg->flags,
-				msg->addr,
-				msg->len);
-	return status;
+/* queue the batch to the worker of the adapter, waiting while it is full */
+static void
+native_adapter_submit(struct native_i2c_adapter *adapter, struct virtio_i2c_batch *batch)
+{
+	pthread_mutex_lock(&adapter->mtx);
+	while (adapter->count == VIRTIO_I2C_QUEUE_DEPTH)
+		pthread_cond_wait(&adapter->cond, &adapter->mtx);
+	adapter->queue[(adapter->head + adapter->count) % VIRTIO_I2C_QUEUE_DEPTH] = batch;
+	adapter->count++;
+	pthread_cond_broadcast(&adapter->cond);
+	pthread_mutex_unlock(&adapter->mtx);
+}
+
+static int
+native_adapter_start(struct native_i2c_adapter *adapter, struct virtio_i2c *vi2c)
+{
+	char tname[MAXCOMLEN + 1];
+
+	adapter->vi2c = vi2c;
+	pthread_mutex_init(&adapter->mtx, NULL);
+	pthread_cond_init(&adapter->cond, NULL);
+	if (pthread_create(&adapter->tid, NULL, native_adapter_thread, adapter)) {
+		WPRINTF("failed to create the worker of i2c-%d\n", adapter->bus);
+		pthread_cond_destroy(&adapter->cond);
+		pthread_mutex_destroy(&adapter->mtx);
+		return -1;
+	}
+	snprintf(tname, sizeof(tname), "virtio-i2c-%d", adapter->bus);
+	pthread_setname_np(adapter->tid, tname);
+	adapter->started = true;
+	return 0;
+}
+
+static void
+native_adapter_stop(struct native_i2c_adapter *adapter)
+{
+	if (!adapter->started)
+		return;
+
+	pthread_mutex_lock(&adapter->mtx);
+	adapter->closing = true;
+	pthread_cond_broadcast(&adapter->cond);
+	pthread_mutex_unlock(&adapter->mtx);
+	pthread_join(adapter->tid, NULL);
+	pthread_cond_destroy(&adapter->cond);
+	pthread_mutex_destroy(&adapter->mtx);
+	adapter->started = false;
 }
 
 static struct native_i2c_adapter *
@@ -512,6 +652,7 @@ native_adapter_remove(struct virtio_i2c *vi2c)
 	for (i = 0; i < MAX_NATIVE_I2C_ADAPTER; i++) {
 		native_adapter = vi2c->native_adapter[i];
 		if (native_adapter) {
+			native_adapter_stop(native_adapter);
 			if (native_adapter->fd > 0)
 				close(native_adapter->fd);
 			free(native_adapter);
@@ -532,6 +673,29 @@ virtio_i2c_req_stop(struct virtio_i2c *vi2c)
 	pthread_join(vi2c->req_tid, &jval);
 }
 
+/* hand the batch to the worker of the adapter of its first message */
+static void
+virtio_i2c_batch_submit(struct virtio_i2c *vi2c, struct virtio_i2c_batch *batch)
+{
+	struct native_i2c_adapter *adapter;
+
+	pthread_mutex_lock(&vi2c->req_mtx);
+	vi2c->inflight++;
+	pthread_mutex_unlock(&vi2c->req_mtx);
+
+	adapter = native_adapter_find(vi2c, batch->msgs[0].addr);
+	if (adapter) {
+		native_adapter_submit(adapter, batch);
+	} else {
+		virtio_i2c_batch_run(vi2c, batch);
+		virtio_i2c_batch_done(vi2c, batch);
+	}
+}
+
+/*
+ * Gather the requests of the driver into batches, a batch per group, for the
+ * workers of the adapters, which complete them.
+ */
 static void *
 virtio_i2c_proc_thread(void *arg)
 {
@@ -539,16 +703,17 @@ virtio_i2c_proc_thread(void *arg)
 	struct virtio_vq_info *vq = &vi2c->vq;
 	struct iovec iov[3];
 	uint16_t idx, flags[3];
-	struct i2c_msg msg;
+	struct i2c_msg *msg;
 	int n;
-	bool fail_next = false;
+	bool more;
 	struct virtio_i2c_out_hdr *out_hdr;
-	struct virtio_i2c_in_hdr *in_hdr;
+	struct virtio_i2c_batch *batch = NULL;
 
 	for (;;) {
 		pthread_mutex_lock(&vi2c->req_mtx);
 
 		vi2c->in_process = 0;
+		pthread_cond_broadcast(&vi2c->req_cond);
 		while (!vq_has_descs(vq) && !vi2c->closing)
 			pthread_cond_wait(&vi2c->req_cond, &vi2c->req_mtx);
 
@@ -559,11 +724,27 @@ virtio_i2c_proc_thread(void *arg)
 		vi2c->in_process = 1;
 		pthread_mutex_unlock(&vi2c->req_mtx);
 		do {
+			pthread_mutex_lock(&vq->mtx);
 			n = vq_getchain(vq, &idx, iov, 3, flags);
+			pthread_mutex_unlock(&vq->mtx);
 			if (n < 2 || n > 3) {
 				WPRINTF("virtio_i2c_proc: failed to get iov from virtqueue\n");
+				more = vq_has_descs(vq);
 				continue;
 			}
+			if (!batch) {
+				batch = calloc(1, sizeof(*batch));
+				if (!batch) {
+					WPRINTF("virtio_i2c_proc: failed to allocate a batch\n");
+					pthread_mutex_lock(&vq->mtx);
+					vq_retchains(vq, 1);
+					pthread_mutex_unlock(&vq->mtx);
+					break;
+				}
+			}
+			msg = &batch->msgs[batch->n];
+			batch->idx[batch->n] = idx;
+
 			out_hdr = iov[0].iov_base;
 			/* From v1.2-cs01 virtio spec, 7-bit address is defined as:
 			 * -----------------------------------------------------------
@@ -572,21 +753,22 @@ virtio_i2c_proc_thread(void *arg)
 			 * 7-bit address|0 |0 |0 |0 |0 |0 |0|0|A6|A5|A4|A3|A2|A1|A0|0|
 			 * -------------+--+--+--+--+--+--+-+-+--+--+--+--+--+--+--+-+
 			 */
-			msg.addr = out_hdr->addr >> 1;
+			msg->addr = out_hdr->addr >> 1;
 			if (out_hdr->flags & VIRTIO_I2C_FLAGS_M_RD)
-				msg.flags = I2C_M_RD;
+				msg->flags = I2C_M_RD;
 			else
-				msg.flags = I2C_NO_FLAGS;
+				msg->flags = I2C_NO_FLAGS;
 			if (n == 3) {
-				msg.buf = iov[1].iov_base;
-				msg.len = iov[1].iov_len;
-				in_hdr = iov[2].iov_base;
+				msg->buf = iov[1].iov_base;
+				msg->len = iov[1].iov_len;
+				batch->in_hdr[batch->n] = iov[2].iov_base;
 			} else {
 				// this is a zero-length request
-				msg.buf = NULL;
-				msg.len = 0;
-				in_hdr = iov[1].iov_base;
+				msg->buf = NULL;
+				msg->len = 0;
+				batch->in_hdr[batch->n] = iov[1].iov_base;
 			}
+			batch->n++;
 
 			/*
 			 * From v1.2-cs01 virtio spec:
@@ -595,19 +777,13 @@ virtio_i2c_proc_thread(void *arg)
 			 * If this bit is set and a device fails to process the current request, it needs to
 			 * fail the next request instead of attempting to execute it.
 			 */
-			if (!fail_next) {
-				in_hdr->status = native_adapter_proc(vi2c, &msg);
-				if ((out_hdr->flags & VIRTIO_I2C_FLAGS_FAIL_NEXT) && (in_hdr->status == I2C_MSG_ERR))
-					fail_next = true;
-			} else {
-				in_hdr->status = I2C_MSG_ERR;
+			more = vq_has_descs(vq);
+			if (!(out_hdr->flags & VIRTIO_I2C_FLAGS_FAIL_NEXT) ||
+					batch->n == VIRTIO_I2C_BATCH_MAX || !more) {
+				virtio_i2c_batch_submit(vi2c, batch);
+				batch = NULL;
 			}
-			vq_relchain(vq, idx, 1);
-
-			if (!(out_hdr->flags & VIRTIO_I2C_FLAGS_FAIL_NEXT))
-				fail_next = false;
-		} while (vq_has_descs(vq));
-		vq_endchains(vq, 0);
+		} while (more);
 	}
 }
 
@@ -763,7 +939,15 @@ virtio_i2c_reset(void *vdev)
 	struct virtio_i2c *vi2c = vdev;
 
 	DPRINTF("device reset requested !\n");
+	/* the requests in flight are completed first */
+	pthread_mutex_lock(&vi2c->req_mtx);
+	while (vi2c->in_process || vi2c->inflight)
+		pthread_cond_wait(&vi2c->req_cond, &vi2c->req_mtx);
+	pthread_mutex_unlock(&vi2c->req_mtx);
+
+	pthread_mutex_lock(&vi2c->vq.mtx);
 	virtio_reset_dev(&vi2c->base);
+	pthread_mutex_unlock(&vi2c->vq.mtx);
 }
 
 static void
@@ -786,7 +970,7 @@ virtio_i2c_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	u_char digest[16];
 	struct virtio_i2c *vi2c;
 	pthread_mutexattr_t attr;
-	int rc = -1;
+	int i, rc = -1;
 
 	vi2c = calloc(1, sizeof(struct virtio_i2c));
 	if (!vi2c) {
@@ -869,6 +1053,12 @@ virtio_i2c_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	vi2c->closing = 0;
 	pthread_mutex_init(&vi2c->req_mtx, NULL);
 	pthread_cond_init(&vi2c->req_cond, NULL);
+	for (i = 0; i < vi2c->native_adapter_num; i++) {
+		if (native_adapter_start(vi2c->native_adapter[i], vi2c)) {
+			rc = -1;
+			goto fail;
+		}
+	}
 	pthread_create(&vi2c->req_tid, NULL, virtio_i2c_proc_thread, vi2c);
 	pthread_setname_np(vi2c->req_tid, "virtio-i2c");
 	return 0;
@@ -891,9 +1081,9 @@ virtio_i2c_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		vi2c = (struct virtio_i2c *) dev->arg;
 		virtio_i2c_req_stop(vi2c);
 		native_adapter_remove(vi2c);
+		virtio_i2c_reset(vi2c);
 		pthread_mutex_destroy(&vi2c->req_mtx);
 		pthread_mutex_destroy(&vi2c->mtx);
-		virtio_i2c_reset(vi2c);
 		acpi_i2c_adapter_num--;
 		assert(acpi_i2c_adapter_num >= 0);
 		free(vi2c);
@@ -40,6 +40,14 @@
 
 #define IPU_VBS_DEV_PATH "/dev/vbs_ipu"
 
+/*
+ * With the zero_copy option, the IPU output buffers are allocated from the
+ * guest memory the VBS-K backend maps, and only the buffer handles and the
+ * fences cross the virtqueues. Offered once the backend took the guest
+ * memory, the frames are copied otherwise.
+ */
+#define VIRTIO_IPU_F_ZERO_COPY	0
+
 static int ipu_log_level;
 #define TAG "virtio_ipu: "
 #define LERR 1
@@ -52,6 +60,7 @@ struct virtio_ipu {
 	struct virtio_base base;
 	struct virtio_vq_info vq[VIRTIO_IPU_VQ_NUM];
 	pthread_mutex_t mtx;
+	bool zero_copy;
 	/* VBS-K variables */
 	struct {
 		enum VBS_K_STATUS ipu_kstatus;
@@ -271,6 +280,15 @@ virtio_ipu_set_status(void *base, uint64_t status)
 				return;
 			}
 		}
+		/* the reset of the backend dropped the guest memory */
+		if ((ipu->base.negotiated_caps & (1UL << VIRTIO_IPU_F_ZERO_COPY)) &&
+		    vbs_kernel_set_mem_table(ipu->vbs_k.ipu_fd,
+					     ipu->base.dev->vmctx) < 0) {
+			IPRINTF(LWRN, "zero copy negotiated, guest memory not mapped\n");
+			ipu->vbs_k.ipu_kstatus = VIRTIO_DEV_START_FAILED;
+			return;
+		}
+
 		rc = virtio_ipu_k_start(ipu);
 		if (rc < 0) {
 			IPRINTF(LWRN, "kernel_start() failed\n");
@@ -297,6 +315,7 @@ virtio_ipu_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	}
 	ipu->vbs_k.ipu_kstatus = VIRTIO_DEV_INITIAL;
 	ipu->vbs_k.ipu_fd = -1;
+	ipu->zero_copy = (opts != NULL) && (strcmp(opts, "zero_copy") == 0);
 
 	/* init mutex attribute properly */
 	rc = pthread_mutexattr_init(&attr);
@@ -334,6 +353,13 @@ virtio_ipu_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	ipu->vbs_k.ipu_kstatus = VIRTIO_DEV_INIT_SUCCESS;
 	ipu->base.mtx = &ipu->mtx;
 
+	if (ipu->zero_copy) {
+		if (vbs_kernel_set_mem_table(ipu->vbs_k.ipu_fd, ctx) == 0)
+			ipu->base.device_caps |= 1UL << VIRTIO_IPU_F_ZERO_COPY;
+		else
+			pr_warn(TAG "zero copy not available, frames are copied\n");
+	}
+
 	ipu->vq[0].qsize = VIRTIO_IPU_RINGSZ;
 	ipu->vq[1].qsize = VIRTIO_IPU_RINGSZ;
 
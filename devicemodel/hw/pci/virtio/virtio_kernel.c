@@ -8,8 +8,11 @@
 /* Routines to notify the VBS-K in kernel */
 
 #include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include "virtio_kernel.h"
+#include "vmmapi.h"
 #include "log.h"
 
 static int virtio_kernel_debug;
@@ -94,3 +97,46 @@ vbs_kernel_stop(int fd)
 	DPRINTF(("%s\n", __func__));
 	return VIRTIO_SUCCESS;
 }
+
+/**
+ * @brief Share the guest memory with the virtio kernel module.
+ *
+ * @param fd File descriptor representing virtio backend in kernel module.
+ * @param ctx Pointer to the VM context.
+ *
+ * @return 0 on OK, -1 if the guest memory can't be shared or the module
+ * doesn't take it.
+ */
+int
+vbs_kernel_set_mem_table(int fd, struct vmctx *ctx)
+{
+	struct vm_memfd_region regions[VBS_MAX_MEM_REGIONS];
+	struct vbs_mem_table table;
+	int i, nregions;
+
+	nregions = vm_get_memfd_regions(ctx, regions, VBS_MAX_MEM_REGIONS);
+	if (nregions <= 0) {
+		WPRINTF(("%s: guest memory can't be shared, %s\n", __func__,
+			nregions ? "too many regions" : "hugetlb is required"));
+		return -1;
+	}
+
+	memset(&table, 0, sizeof(table));
+	table.nregions = nregions;
+	for (i = 0; i < nregions; i++) {
+		table.regions[i].gpa = regions[i].gpa;
+		table.regions[i].size = regions[i].size;
+		table.regions[i].fd_offset = regions[i].fd_offset;
+		table.regions[i].fd = regions[i].fd;
+		DPRINTF(("%s: [%d] gpa 0x%lx size 0x%lx\n", __func__, i,
+			regions[i].gpa, regions[i].size));
+	}
+
+	/* an older module fails with ENOTTY, the buffers are copied then */
+	if (ioctl(fd, VBS_K_SET_MEM_TABLE, &table) < 0) {
+		WPRINTF(("%s: the module doesn't map the guest memory\n", __func__));
+		return -1;
+	}
+
+	return VIRTIO_SUCCESS;
+}
@@ -306,6 +306,12 @@ struct vmei_host_client {
 	int                          client_fd;
 
 	struct mevent                *rx_mevp;
+	/*
+	 * client_fd dup'ed, watched for room in the native driver while
+	 * messages wait in send_bufs: mevent takes one event per fd.
+	 */
+	int                          tx_fd;
+	struct mevent                *tx_mevp;
 	uint8_t                      *recv_buf;
 	size_t                       recv_buf_sz;
 	int                          recv_offset;
@@ -349,9 +355,7 @@ struct virtio_mei {
 
 	struct mei_virtio_cfg           *config;
 
-	pthread_t                       tx_thread;
 	pthread_mutex_t                 tx_mutex;
-	pthread_cond_t                  tx_cond;
 
 	pthread_t                       rx_thread;
 	pthread_mutex_t                 rx_mutex;
@@ -376,16 +380,12 @@ vmei_set_status(struct virtio_mei *vmei, enum vmei_status status)
 static void
 vmei_rx_teardown(void *param)
 {
-	unsigned int i;
 	struct vmei_host_client *hclient = param;
 
 	if (hclient->client_fd > -1) {
 		close(hclient->client_fd);
 		hclient->client_fd = -1;
 	}
-	for (i = 0; i < VMEI_IOBUFS_MAX; i++)
-		free(hclient->send_bufs.bufs[i].iov_base);
-	free(hclient->recv_buf);
 	free(hclient);
 }
 
@@ -403,6 +403,10 @@ vmei_host_client_destroy(const struct refcnt *ref)
 	LIST_REMOVE(hclient, list);
 	pthread_mutex_unlock(&mclient->list_mutex);
 
+	/* deleted first: the teardown of rx_mevp frees the client */
+	if (hclient->tx_mevp)
+		mevent_delete_close(hclient->tx_mevp);
+
 	if (hclient->rx_mevp)
 		mevent_delete(hclient->rx_mevp);
 	else
@@ -414,11 +418,18 @@ vmei_host_client_create(struct vmei_me_client *mclient, uint8_t host_addr)
 {
 	struct vmei_host_client *hclient;
 	size_t size = mclient->props.max_msg_length;
+	uint8_t *buf;
 	unsigned int i;
 
-	hclient = calloc(1, sizeof(*hclient));
-	if (!hclient)
+	/*
+	 * The send_bufs and the recv_buf of the client come with it, in a
+	 * single allocation, and are reused for all its messages.
+	 */
+	hclient = calloc(1, sizeof(*hclient) + (VMEI_IOBUFS_MAX + 1) * size);
+	if (!hclient) {
+		WPRINTF("host client allocation failed\n");
 		return NULL;
+	}
 
 	hclient->ref = (struct refcnt){vmei_host_client_destroy, 1};
 
@@ -427,6 +438,8 @@ vmei_host_client_create(struct vmei_me_client *mclient, uint8_t host_addr)
 	hclient->mclient   = mclient;
 	hclient->client_fd = -1;
 	hclient->rx_mevp   = NULL;
+	hclient->tx_fd     = -1;
+	hclient->tx_mevp   = NULL;
 
 	/* HBM and fixed address doesn't provide flow control
 	 * make the receiving part always available.
@@ -435,19 +448,11 @@ vmei_host_client_create(struct vmei_me_client *mclient, uint8_t host_addr)
 		hclient->recv_creds = 1;
 
 	/* setup send_buf and recv_buf for the client */
-	for (i = 0; i < VMEI_IOBUFS_MAX; i++) {
-		hclient->send_bufs.bufs[i].iov_base = calloc(1, size);
-		if (!hclient->send_bufs.bufs[i].iov_base) {
-			HCL_WARN(hclient, "allocation failed\n");
-			goto fail;
-		}
-	}
+	buf = (uint8_t *)(hclient + 1);
+	for (i = 0; i < VMEI_IOBUFS_MAX; i++)
+		hclient->send_bufs.bufs[i].iov_base = buf + i * size;
 
-	hclient->recv_buf = calloc(1, size);
-	if (!hclient->recv_buf) {
-		HCL_WARN(hclient, "allocation failed\n");
-		goto fail;
-	}
+	hclient->recv_buf = buf + VMEI_IOBUFS_MAX * size;
 	hclient->send_bufs.buf_sz = size;
 	hclient->recv_buf_sz = size;
 
@@ -456,15 +461,6 @@ vmei_host_client_create(struct vmei_me_client *mclient, uint8_t host_addr)
 	pthread_mutex_unlock(&mclient->list_mutex);
 
 	return hclient;
-
-fail:
-	for (i = 0; i < VMEI_IOBUFS_MAX; i++)
-		free(hclient->send_bufs.bufs[i].iov_base);
-	memset(&hclient->send_bufs, 0, sizeof(hclient->send_bufs));
-	free(hclient->recv_buf);
-	free(hclient);
-
-	return NULL;
 }
 
 static struct vmei_host_client*
@@ -1439,7 +1435,6 @@ vmei_host_client_native_write(struct vmei_host_client *hclient)
 	struct virtio_mei *vmei = vmei_host_client_to_vmei(hclient);
 	ssize_t len, lencnt = 0;
 	int err;
-	unsigned int iovcnt, i;
 	struct vmei_circular_iobufs *bufs = &hclient->send_bufs;
 
 	if (!vmei)
@@ -1457,42 +1452,130 @@ vmei_host_client_native_write(struct vmei_host_client *hclient)
 		return 0;
 	}
 
+	/*
+	 * r_idx moves past each message written, so the ones left are
+	 * where the next write picks up if the driver has no room for them.
+	 */
 	while (bufs->i_idx != bufs->r_idx) {
-		/*
-		 * calculate number of entries
-		 * while taking care of wraparound
-		 */
-		iovcnt = (bufs->i_idx > bufs->r_idx) ?
-			 (bufs->i_idx - bufs->r_idx) :
-			 (VMEI_IOBUFS_MAX - bufs->r_idx);
-
-		for (i = 0; i < iovcnt; i++) {
-			len = writev(hclient->client_fd,
-				     &bufs->bufs[bufs->r_idx + i],
-				     1);
-			if (len < 0) {
-				err = -errno;
-				if (err != -EAGAIN)
-					WPRINTF("write failed! error[%d]\n",
-						errno);
-				if (err == -ENODEV)
-					vmei_set_status(vmei,
-							VMEI_STS_PENDING_RESET);
-				return -errno;
-			}
-
-			lencnt += len;
-
-			bufs->bufs[bufs->r_idx + i].iov_len = 0;
-			bufs->complete[bufs->r_idx + i] = 0;
+		len = writev(hclient->client_fd, &bufs->bufs[bufs->r_idx], 1);
+		if (len < 0) {
+			err = -errno;
+			if (err != -EAGAIN)
+				WPRINTF("write failed! error[%d]\n", -err);
+			if (err == -ENODEV)
+				vmei_set_status(vmei, VMEI_STS_PENDING_RESET);
+			return err;
 		}
 
-		bufs->r_idx = (bufs->i_idx > bufs->r_idx) ? bufs->i_idx : 0;
+		lencnt += len;
+
+		bufs->bufs[bufs->r_idx].iov_len = 0;
+		bufs->complete[bufs->r_idx] = 0;
+		bufs->r_idx = (bufs->r_idx + 1) % VMEI_IOBUFS_MAX;
 	}
 
 	return lencnt;
 }
 
+static int
+vmei_host_ready_send_buffers(struct vmei_host_client *hclient)
+{
+	struct vmei_circular_iobufs *bufs = &hclient->send_bufs;
+
+	return bufs->complete[bufs->r_idx];
+}
+
+static void vmei_tx_callback(int fd, enum ev_type type, void *param);
+
+/*
+ * Watch the client fd for room in the native driver, the rest of the
+ * messages is written by vmei_tx_callback() then.
+ */
+static void
+vmei_host_client_wait_writable(struct vmei_host_client *hclient)
+{
+	if (hclient->tx_mevp) {
+		mevent_enable(hclient->tx_mevp);
+		return;
+	}
+
+	hclient->tx_fd = dup(hclient->client_fd);
+	if (hclient->tx_fd < 0) {
+		HCL_WARN(hclient, "TX: dup failed %d\n", errno);
+		return;
+	}
+
+	hclient->tx_mevp = mevent_add(hclient->tx_fd, EVF_WRITE,
+			vmei_tx_callback, hclient, NULL, NULL);
+	if (!hclient->tx_mevp) {
+		HCL_WARN(hclient, "TX: failed to watch the client fd\n");
+		close(hclient->tx_fd);
+		hclient->tx_fd = -1;
+	}
+}
+
+/**
+ * vmei_host_client_flush() write the complete messages of the client
+ *    to the native driver, or wait for room in it.
+ *
+ * @hclient: host client
+ *
+ * Locking: Must run under tx mutex
+ * Return:
+ *	true - all the messages are written, the caller sends the
+ *	       FE client a flow control message, with the tx mutex released
+ */
+static bool
+vmei_host_client_flush(struct vmei_host_client *hclient)
+{
+	struct virtio_mei *vmei = vmei_host_client_to_vmei(hclient);
+	ssize_t len;
+
+	if (!vmei || vmei->status == VMEI_STS_RESET)
+		return false;
+
+	if (!vmei_host_ready_send_buffers(hclient))
+		return false;
+
+	len = vmei_host_client_native_write(hclient);
+	if (len == -EAGAIN) {
+		vmei_host_client_wait_writable(hclient);
+		return false;
+	}
+	if (len < 0) {
+		HCL_WARN(hclient, "TX:send failed %zd\n", len);
+		return false;
+	}
+
+	return !vmei_host_ready_send_buffers(hclient);
+}
+
+static void
+vmei_tx_callback(int fd, enum ev_type type, void *param)
+{
+	struct vmei_host_client *hclient = param;
+	struct virtio_mei *vmei = vmei_host_client_to_vmei(hclient);
+	bool sent;
+
+	if (!vmei)
+		return;
+
+	if (!vmei_host_client_get(hclient)) {
+		DPRINTF("TX: client has been released.\n");
+		return;
+	}
+
+	pthread_mutex_lock(&vmei->tx_mutex);
+	mevent_disable(hclient->tx_mevp);
+	sent = vmei_host_client_flush(hclient);
+	pthread_mutex_unlock(&vmei->tx_mutex);
+
+	if (sent)
+		vmei_hbm_flow_ctl_req(hclient);
+
+	vmei_host_client_put(hclient);
+}
+
 static void
 vmei_proc_tx(struct virtio_mei *vmei, struct virtio_vq_info *vq)
 {
@@ -1506,6 +1589,7 @@ vmei_proc_tx(struct virtio_mei *vmei, struct virtio_vq_info *vq)
 	size_t data_len;
 	uint8_t i_idx;
 	struct vmei_circular_iobufs *bufs;
+	bool sent = false;
 
 	struct vmei_host_client *hclient  = NULL;
 
@@ -1594,9 +1678,11 @@ vmei_proc_tx(struct virtio_mei *vmei, struct virtio_vq_info *vq)
 		bufs->i_idx++;
 		if (bufs->i_idx >= VMEI_IOBUFS_MAX) /* wraparound */
 			bufs->i_idx = 0;
-		pthread_cond_signal(&vmei->tx_cond);
+		sent = vmei_host_client_flush(hclient);
 	}
 	pthread_mutex_unlock(&vmei->tx_mutex);
+	if (sent)
+		vmei_hbm_flow_ctl_req(hclient);
 	vmei_host_client_put(hclient);
 out:
 	/* chain is processed, release it and set tlen */
@@ -1648,82 +1734,7 @@ vmei_notify_tx(void *data, struct virtio_vq_info *vq)
 	pthread_mutex_unlock(&vmei->tx_mutex);
 }
 
-static int
-vmei_host_ready_send_buffers(struct vmei_host_client *hclient)
-{
-	struct vmei_circular_iobufs *bufs = &hclient->send_bufs;
-
-	return bufs->complete[bufs->r_idx];
-}
-
-/**
- * Thread which will handle processing native writes
- */
-static void *vmei_tx_thread(void *param)
-{
-	struct virtio_mei *vmei = param;
-	struct timespec max_wait = {0, 0};
-	int err, pending_cnt = 0;
-
-	pthread_mutex_lock(&vmei->tx_mutex);
-
-	while (vmei->status != VMEI_STST_DEINIT) {
-		struct vmei_me_client *me;
-		struct vmei_host_client *e;
-		ssize_t len;
-		int send_ready;
-
-		if (pending_cnt == 0) {
-			err = pthread_cond_wait(&vmei->tx_cond,
-						&vmei->tx_mutex);
-			if (err)
-				goto out;
-		} else {
-			max_wait.tv_sec = time(NULL) + 2;
-			max_wait.tv_nsec = 0;
-			err = pthread_cond_timedwait(&vmei->tx_cond,
-						     &vmei->tx_mutex,
-						     &max_wait);
-			if (err && err != ETIMEDOUT)
-				goto out;
-
-			pending_cnt = 0;
-		}
-
-		pthread_mutex_lock(&vmei->list_mutex);
-		LIST_FOREACH(me, &vmei->active_clients, list) {
-			pthread_mutex_lock(&me->list_mutex);
-			LIST_FOREACH(e, &me->connections, list) {
-				if (!vmei_host_ready_send_buffers(e))
-					continue;
-
-				len = vmei_host_client_native_write(e);
-				if (len < 0 && len != -EAGAIN) {
-					HCL_WARN(e, "TX:send failed %zd\n",
-						 len);
-					pthread_mutex_unlock(&me->list_mutex);
-					goto unlock;
-				}
-				if (vmei->status == VMEI_STS_RESET) {
-					pthread_mutex_unlock(&me->list_mutex);
-					goto unlock;
-				}
-
-				send_ready = vmei_host_ready_send_buffers(e);
-				pending_cnt += send_ready;
-				if (!send_ready)
-					vmei_hbm_flow_ctl_req(e);
-			}
-			pthread_mutex_unlock(&me->list_mutex);
-		}
-unlock:
-		pthread_mutex_unlock(&vmei->list_mutex);
-	}
-
-out:
-	pthread_mutex_unlock(&vmei->tx_mutex);
-	pthread_exit(NULL);
-}
+static void vmei_rx_run(struct virtio_mei *vmei, struct virtio_vq_info *vq);
 
 /*
  * A completed read guarantees that a client message is completed,
@@ -1765,6 +1776,7 @@ vmei_rx_callback(int fd, enum ev_type type, void *param)
 {
 	struct vmei_host_client *hclient = param;
 	struct virtio_mei *vmei = vmei_host_client_to_vmei(hclient);
+	struct virtio_vq_info *vq;
 	ssize_t ret;
 
 	if (!vmei)
@@ -1774,6 +1786,7 @@ vmei_rx_callback(int fd, enum ev_type type, void *param)
 		DPRINTF("RX: client has been released, ignore data.\n");
 		return;
 	}
+	vq = &vmei->vqs[VMEI_RXQ];
 
 	pthread_mutex_lock(&vmei->rx_mutex);
 	if (vmei->status != VMEI_STS_READY) {
@@ -1784,6 +1797,7 @@ vmei_rx_callback(int fd, enum ev_type type, void *param)
 	if (hclient->recv_offset) {
 		/* still has data in recv_buf, wait guest reading */
 		HCL_DBG(hclient, "data in recv_buf, wait for User VM reading.\n");
+		mevent_disable(hclient->rx_mevp);
 		goto out;
 	}
 
@@ -1795,10 +1809,22 @@ vmei_rx_callback(int fd, enum ev_type type, void *param)
 	}
 	vmei->rx_need_sched = true;
 
+	/*
+	 * The fd is not watched while recv_buf holds a message, it would
+	 * keep the event firing; vmei_proc_vclient_rx() watches it again.
+	 */
+	mevent_disable(hclient->rx_mevp);
+
 	HCL_DBG(hclient, "RX: read %zd bytes from the FW\n", ret);
 
-	/* wake up rx thread. */
-	pthread_cond_signal(&vmei->rx_cond);
+	/*
+	 * Hand the message to the User VM right away if it has rx buffers,
+	 * or wake up the rx thread to wait for them.
+	 */
+	if (vq_ring_ready(vq) && vq_has_descs(vq))
+		vmei_rx_run(vmei, vq);
+	else
+		pthread_cond_signal(&vmei->rx_cond);
 
 out:
 	pthread_mutex_unlock(&vmei->rx_mutex);
@@ -1856,10 +1882,11 @@ vmei_proc_vclient_rx(struct vmei_host_client *hclient,
 	if (complete) {
 		hclient->recv_offset = 0;
 		hclient->recv_handled = 0;
-		if (hclient->host_addr) {
+		if (hclient->host_addr)
 			hclient->recv_creds--;
-			mevent_disable(hclient->rx_mevp);
-		}
+		/* without credit, the flow control of the FE client watches it again */
+		if (hclient->recv_creds)
+			mevent_enable(hclient->rx_mevp);
 	}
 
 	vq_relchain(vq, idx, len);
@@ -1908,15 +1935,28 @@ found:
 	}
 
 	vmei_proc_vclient_rx(hclient, vq);
-	pthread_mutex_lock(&vmei->tx_mutex);
-	if (vmei_host_ready_send_buffers(hclient))
-		pthread_cond_signal(&vmei->tx_cond);
-	pthread_mutex_unlock(&vmei->tx_mutex);
 	vmei_host_client_put(hclient);
 
 	return true;
 }
 
+/*
+ * Hand the messages of all the clients with data to the User VM, as long
+ * as it has rx buffers, and complete their chains at once.
+ *
+ * Locking: Must run under rx mutex
+ */
+static void
+vmei_rx_run(struct virtio_mei *vmei, struct virtio_vq_info *vq)
+{
+	do {
+		vmei->rx_need_sched = vmei_proc_rx(vmei, vq);
+	} while (vmei->rx_need_sched && vq_has_descs(vq));
+
+	/* at least one avail ring element has been processed */
+	vq_endchains(vq, !vq_has_descs(vq));
+}
+
 /*
  * Thread which will handle processing of RX desc
  */
@@ -1956,12 +1996,7 @@ static void *vmei_rx_thread(void *param)
 
 		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
 
-		do {
-			vmei->rx_need_sched = vmei_proc_rx(vmei, vq);
-		} while (vmei->rx_need_sched && vq_has_descs(vq));
-
-		/* at least one avail ring element has been processed */
-		vq_endchains(vq, !vq_has_descs(vq));
+		vmei_rx_run(vmei, vq);
 	}
 
 out:
@@ -2055,9 +2090,6 @@ static int
 vmei_stop(struct virtio_mei *vmei)
 {
 	vmei_set_status(vmei, VMEI_STST_DEINIT);
-	pthread_mutex_lock(&vmei->tx_mutex);
-	pthread_cond_signal(&vmei->tx_cond);
-	pthread_mutex_unlock(&vmei->tx_mutex);
 
 	pthread_mutex_lock(&vmei->rx_mutex);
 	pthread_cond_signal(&vmei->rx_cond);
@@ -2066,7 +2098,6 @@ vmei_stop(struct virtio_mei *vmei)
 	vmei_virtual_fw_reset(vmei);
 
 	pthread_join(vmei->rx_thread, NULL);
-	pthread_join(vmei->tx_thread, NULL);
 
 	vmei_free_me_clients(vmei);
 
@@ -2357,14 +2388,10 @@ init:
 	LIST_INIT(&vmei->active_clients);
 
 	/*
-	 * tx stuff, thread, mutex, cond
+	 * tx stuff: the messages are written to the native driver as the
+	 * User VM completes them, or when it has room for them again.
 	 */
 	pthread_mutex_init(&vmei->tx_mutex, NULL);
-	pthread_cond_init(&vmei->tx_cond, NULL);
-	pthread_create(&vmei->tx_thread, NULL,
-		       vmei_tx_thread, vmei);
-	snprintf(tname, sizeof(tname), "vmei-%d:%d tx", dev->slot, dev->func);
-	pthread_setname_np(vmei->tx_thread, tname);
 
 	/*
 	 * rx stuff
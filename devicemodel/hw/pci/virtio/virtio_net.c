@@ -51,9 +51,14 @@
 #include "virtio.h"
 #include "vhost.h"
 #include "dm_string.h"
+#include "metrics.h"
 
 #define VIRTIO_NET_RINGSZ	1024
 #define VIRTIO_NET_MAXSEGS	256
+#define VIRTIO_NET_CTLQ_RINGSZ	64
+#define VIRTIO_NET_CTL_MAXSEGS	8
+#define VIRTIO_NET_MQ_MAX	16	/* max queue pairs */
+#define VIRTIO_NET_TX_BATCH	32	/* tx chains harvested per pass */
 
 /*
  * Host capabilities.  Note that we only offer a few of these.
@@ -77,10 +82,25 @@
 #define	VIRTIO_NET_F_CTRL_VLAN	(1 << 19) /* control channel VLAN filtering */
 #define	VIRTIO_NET_F_GUEST_ANNOUNCE \
 				(1 << 21) /* guest can send gratuitous pkts */
+#define	VIRTIO_NET_F_MQ		(1 << 22) /* multiple queue pairs */
 
 #define VIRTIO_NET_S_HOSTCAPS      \
 	(VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_STATUS | \
-	(1 << VIRTIO_F_NOTIFY_ON_EMPTY) | (1 << VIRTIO_RING_F_INDIRECT_DESC))
+	(1 << VIRTIO_F_NOTIFY_ON_EMPTY) | (1 << VIRTIO_RING_F_INDIRECT_DESC) | \
+	(1 << VIRTIO_RING_F_EVENT_IDX))
+
+/*
+ * Offloads offered when the tap device passes the virtio-net header
+ * through (IFF_VNET_HDR) and takes offload settings (TUNSETOFFLOAD).
+ */
+#define VIRTIO_NET_S_OFFLOADCAPS \
+	(VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM | \
+	VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_HOST_TSO6 | \
+	VIRTIO_NET_F_HOST_ECN | VIRTIO_NET_F_GUEST_TSO4 | \
+	VIRTIO_NET_F_GUEST_TSO6 | VIRTIO_NET_F_GUEST_ECN)
+
+/* Largest frame the tap device passes with the guest TSO offloads on */
+#define VIRTIO_NET_GSO_MAXLEN	(65535 + ETHER_HDR_LEN + 4)
 
 #define VIRTIO_NET_S_VHOSTCAPS      \
 	((1 << VIRTIO_F_NOTIFY_ON_EMPTY) | (1 << VIRTIO_RING_F_INDIRECT_DESC) | \
@@ -96,16 +116,31 @@
 struct virtio_net_config {
 	uint8_t  mac[6];
 	uint16_t status;
+	uint16_t max_virtqueue_pairs;
 } __attribute__((packed));
 
 /*
- * Queue definitions.
+ * Queue definitions. Queue pair n uses the virtqueues 2n (RX) and 2n + 1
+ * (TX), the control queue comes after the last pair when MQ is offered.
  */
 #define VIRTIO_NET_RXQ	0
 #define VIRTIO_NET_TXQ	1
-#define VIRTIO_NET_CTLQ	2	/* NB: not yet supported */
+#define VIRTIO_NET_PAIRQ	2	/* virtqueues per queue pair */
+
+/*
+ * Control queue commands
+ */
+struct virtio_net_ctrl_hdr {
+	uint8_t		class;
+	uint8_t		cmd;
+} __attribute__((packed));
+
+#define VIRTIO_NET_OK	0
+#define VIRTIO_NET_ERR	1
 
-#define VIRTIO_NET_MAXQ	3
+#define VIRTIO_NET_CTRL_MQ			4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET		0
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN		1
 
 /*
  * Fixed network header size
@@ -132,24 +167,70 @@ static int virtio_net_debug;
  */
 struct vhost_net {
 	struct vhost_dev vdev;
-	struct vhost_vq vqs[VIRTIO_NET_MAXQ - 1];
+	struct vhost_vq vqs[VIRTIO_NET_PAIRQ];
 	int tapfd;
 	bool vhost_started;
 };
 
 /*
- * Per-device struct
+ * A tx chain harvested from the ring, iov[0] is the virtio-net header and
+ * one spare segment is left after the packet for padding.
  */
-struct virtio_net {
-	struct virtio_base base;
-	struct virtio_vq_info queues[VIRTIO_NET_MAXQ - 1];
-	pthread_mutex_t mtx;
+struct virtio_net_txpkt {
+	struct iovec	iov[VIRTIO_NET_MAXSEGS + 1];
+	int		iovcnt;		/* packet segments, header excluded */
+	int		len;		/* packet length */
+	uint32_t	tlen;		/* chain length, header included */
+	uint16_t	idx;
+};
+
+/*
+ * Per-queue pair struct, each pair has its own tap queue, rx event and
+ * tx thread (or vhost device).
+ */
+struct virtio_net_qpair {
+	struct virtio_net *net;
+	int		idx;
+	struct virtio_vq_info *rxq;
+	struct virtio_vq_info *txq;
 	struct mevent	*mevp;
 
 	int		tapfd;
+	int		loopfd;		/* null=loopback: tx end of the socket pair */
 
 	int		rx_ready;
 
+	pthread_mutex_t	rx_mtx;
+	int		rx_in_progress;
+	pthread_t	tx_tid;
+	pthread_mutex_t	tx_mtx;
+	pthread_cond_t	tx_cond;
+	int		tx_in_progress;
+	struct virtio_net_txpkt *txpkts;	/* VIRTIO_NET_TX_BATCH entries */
+
+	struct vhost_net *vhost_net;
+
+	/* read by the metrics thread, may be slightly off */
+	uint64_t	rx_packets;
+	uint64_t	rx_bytes;
+	uint64_t	tx_packets;
+	uint64_t	tx_bytes;
+};
+
+/*
+ * Per-device struct
+ */
+struct virtio_net {
+	struct virtio_base base;
+	struct virtio_vq_info *queues;
+	struct virtio_ops ops;		/* virtio_net_ops with our queue count */
+	pthread_mutex_t mtx;
+
+	struct virtio_net_qpair *qpairs;
+	int		nqpairs;
+	int		curr_qpairs;	/* pairs enabled by the driver */
+	int		nmevents;	/* rx events left to tear down */
+
 	volatile int	resetting;	/* set and checked outside lock */
 	volatile int	closing;	/* stop the tx i/o thread */
 
@@ -157,21 +238,21 @@ struct virtio_net {
 
 	struct virtio_net_config config;
 
-	pthread_mutex_t	rx_mtx;
-	int		rx_in_progress;
 	int		rx_vhdrlen;
 	int		rx_merge;	/* merged rx bufs in use */
-	pthread_t	tx_tid;
-	pthread_mutex_t	tx_mtx;
-	pthread_cond_t	tx_cond;
-	int		tx_in_progress;
+	int		rx_maxlen;	/* largest frame expected, header excluded */
 
-	void (*virtio_net_rx)(struct virtio_net *net);
-	void (*virtio_net_tx)(struct virtio_net *net, struct iovec *iov,
-			     int iovcnt, int len);
+	bool		tap_vnet_hdr;	/* tap reads/writes the virtio-net header */
+	bool		tap_offload;	/* tap takes TUNSETOFFLOAD */
+	int		tap_mtu;
+	bool		null_backend;	/* null=discard or null=loopback, no tap */
+
+	bool (*virtio_net_rx)(struct virtio_net_qpair *qp);
+	void (*virtio_net_tx)(struct virtio_net_qpair *qp,
+			     struct virtio_net_txpkt *pkts, int npkts);
 
-	struct vhost_net *vhost_net;
 	bool		use_vhost;
+	bool		vhost_user;
 };
 
 static void virtio_net_reset(void *vdev);
@@ -184,14 +265,14 @@ static void virtio_net_neg_features(void *vdev, uint64_t negotiated_features);
 static void virtio_net_set_status(void *vdev, uint64_t status);
 static void virtio_net_teardown(void *param);
 static struct vhost_net *vhost_net_init(struct virtio_base *base, int vhostfd,
-	int tapfd, int vq_idx);
+	int tapfd, int vq_idx, enum vhost_backend_type backend);
 static int vhost_net_deinit(struct vhost_net *vhost_net);
 static int vhost_net_start(struct vhost_net *vhost_net);
 static int vhost_net_stop(struct vhost_net *vhost_net);
 
 static struct virtio_ops virtio_net_ops = {
 	"vtnet",			/* our name */
-	VIRTIO_NET_MAXQ - 1,		/* we currently support 2 virtqueues */
+	VIRTIO_NET_PAIRQ,		/* 2 virtqueues without MQ */
 	sizeof(struct virtio_net_config), /* config reg size */
 	virtio_net_reset,		/* reset */
 	NULL,				/* device-wide qnotify -- not used */
@@ -268,36 +349,72 @@ ether_aton(const char *a, struct ether_addr *e)
  * If the transmit thread is active then stall until it is done.
  */
 static void
-virtio_net_txwait(struct virtio_net *net)
+virtio_net_txwait(struct virtio_net_qpair *qp)
 {
-	pthread_mutex_lock(&net->tx_mtx);
-	while (net->tx_in_progress) {
-		pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_lock(&qp->tx_mtx);
+	while (qp->tx_in_progress) {
+		pthread_mutex_unlock(&qp->tx_mtx);
 		usleep(10000);
-		pthread_mutex_lock(&net->tx_mtx);
+		pthread_mutex_lock(&qp->tx_mtx);
 	}
-	pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_unlock(&qp->tx_mtx);
 }
 
 /*
  * If the receive thread is active then stall until it is done.
  */
 static void
-virtio_net_rxwait(struct virtio_net *net)
+virtio_net_rxwait(struct virtio_net_qpair *qp)
 {
-	pthread_mutex_lock(&net->rx_mtx);
-	while (net->rx_in_progress) {
-		pthread_mutex_unlock(&net->rx_mtx);
+	pthread_mutex_lock(&qp->rx_mtx);
+	while (qp->rx_in_progress) {
+		pthread_mutex_unlock(&qp->rx_mtx);
 		usleep(10000);
-		pthread_mutex_lock(&net->rx_mtx);
+		pthread_mutex_lock(&qp->rx_mtx);
 	}
-	pthread_mutex_unlock(&net->rx_mtx);
+	pthread_mutex_unlock(&qp->rx_mtx);
+}
+
+/*
+ * Attach or detach a queue of a multiqueue tap device, the kernel only
+ * steers received packets to the attached queues.
+ */
+static int
+virtio_net_tap_set_queue(int tapfd, bool attach)
+{
+	struct ifreq ifr;
+
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = attach ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+	return ioctl(tapfd, TUNSETQUEUE, (void *)&ifr);
+}
+
+/*
+ * Enable the first @n queue pairs, the others get no rx traffic.
+ */
+static int
+virtio_net_set_qpairs(struct virtio_net *net, int n)
+{
+	int i, rc = 0;
+
+	for (i = 1; i < net->nqpairs; i++) {
+		if (net->qpairs[i].tapfd < 0 || net->null_backend)
+			continue;
+		if (virtio_net_tap_set_queue(net->qpairs[i].tapfd, i < n) < 0) {
+			WPRINTF(("vtnet: failed to %s tap queue %d: %d\n",
+				i < n ? "attach" : "detach", i, errno));
+			rc = -1;
+		}
+	}
+	net->curr_qpairs = n;
+	return rc;
 }
 
 static void
 virtio_net_reset(void *vdev)
 {
 	struct virtio_net *net = vdev;
+	int i;
 
 	DPRINTF(("vtnet: device reset requested !\n"));
 
@@ -307,61 +424,91 @@ virtio_net_reset(void *vdev)
 	 * Wait for the transmit and receive threads to finish their
 	 * processing.
 	 */
-	virtio_net_txwait(net);
-	virtio_net_rxwait(net);
+	for (i = 0; i < net->nqpairs; i++) {
+		virtio_net_txwait(&net->qpairs[i]);
+		virtio_net_rxwait(&net->qpairs[i]);
+		net->qpairs[i].rx_ready = 0;
+	}
 
-	net->rx_ready = 0;
 	net->rx_merge = 1;
 	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
+	net->rx_maxlen = VIRTIO_NET_GSO_MAXLEN;
 
 	/* now reset rings, MSI-X vectors, and negotiated capabilities */
 	virtio_reset_dev(&net->base);
 
+	/* Only the first queue pair is used until the driver asks for more */
+	if (net->curr_qpairs != 1)
+		virtio_net_set_qpairs(net, 1);
+
 	net->resetting = 0;
 	net->closing = 0;
 }
 
 /*
- * Send signal to tx I/O thread and wait till it exits
+ * Send signal to tx I/O threads and wait till they exit
  */
 static void
 virtio_net_tx_stop(struct virtio_net *net)
 {
+	struct virtio_net_qpair *qp;
 	void *jval;
+	int i;
+
+	for (i = 0; i < net->nqpairs; i++) {
+		qp = &net->qpairs[i];
+		pthread_mutex_lock(&qp->tx_mtx);
+		net->closing = 1;
+		pthread_cond_broadcast(&qp->tx_cond);
+		pthread_mutex_unlock(&qp->tx_mtx);
+	}
 
-	pthread_mutex_lock(&net->tx_mtx);
-	net->closing = 1;
-	pthread_cond_broadcast(&net->tx_cond);
-	pthread_mutex_unlock(&net->tx_mtx);
-
-	pthread_join(net->tx_tid, &jval);
+	for (i = 0; i < net->nqpairs; i++)
+		pthread_join(net->qpairs[i].tx_tid, &jval);
 }
 
 /*
- * Called to send a buffer chain out to the tap device
+ * Called to send a batch of buffer chains out to the tap device. A tap
+ * write carries exactly one frame, so there is no multi-packet write
+ * to use here.
  */
 static void
-virtio_net_tap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
-		  int len)
+virtio_net_tap_tx(struct virtio_net_qpair *qp, struct virtio_net_txpkt *pkts,
+		  int npkts)
 {
 	static char pad[60]; /* all zero bytes */
+	struct iovec *iov;
+	int i, iovcnt, fd;
 	ssize_t ret;
 
-	if (net->tapfd == -1)
+	/* null=loopback sends to the other end of the rx socket */
+	fd = (qp->loopfd >= 0) ? qp->loopfd : qp->tapfd;
+	if (fd == -1)
 		return;
 
-	/*
-	 * If the length is < 60, pad out to that and add the
-	 * extra zero'd segment to the iov. It is guaranteed that
-	 * there is always an extra iov available by the caller.
-	 */
-	if (len < 60) {
-		iov[iovcnt].iov_base = pad;
-		iov[iovcnt].iov_len = 60 - len;
-		iovcnt++;
+	for (i = 0; i < npkts; i++) {
+		/* The header carries the checksum and GSO requests */
+		if (qp->net->tap_vnet_hdr) {
+			iov = &pkts[i].iov[0];
+			iovcnt = pkts[i].iovcnt + 1;
+		} else {
+			iov = &pkts[i].iov[1];
+			iovcnt = pkts[i].iovcnt;
+		}
+
+		/*
+		 * If the length is < 60, pad out to that and add the
+		 * extra zero'd segment to the iov. It is guaranteed that
+		 * there is always an extra iov available by the caller.
+		 */
+		if (pkts[i].len < 60) {
+			iov[iovcnt].iov_base = pad;
+			iov[iovcnt].iov_len = 60 - pkts[i].len;
+			iovcnt++;
+		}
+		ret = writev(fd, iov, iovcnt);
+		(void)ret; /*avoid compiler warning*/
 	}
-	ret = writev(net->tapfd, iov, iovcnt);
-	(void)ret; /*avoid compiler warning*/
 }
 
 /*
@@ -400,52 +547,52 @@ rx_iov_trim(struct iovec *iov, int *niov, int tlen)
 	return riov;
 }
 
-static void
-virtio_net_tap_rx(struct virtio_net *net)
+static bool
+virtio_net_tap_rx(struct virtio_net_qpair *qp)
 {
 	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov;
+	struct virtio_net *net = qp->net;
 	struct virtio_vq_info *vq;
 	void *vrx;
 	int len, n;
 	uint16_t idx;
 	ssize_t ret;
+	bool more = true;
 
 	/*
 	 * Should never be called without a valid tap fd
 	 */
-	if (net->tapfd == -1) {
+	if (qp->tapfd == -1) {
 		WPRINTF(("vtnet: tapfd == -1\n"));
-		return;
+		return false;
 	}
 
 	/*
 	 * But, will be called when the rx ring hasn't yet
 	 * been set up or the guest is resetting the device.
 	 */
-	if (!net->rx_ready || net->resetting) {
+	if (!qp->rx_ready || net->resetting) {
 		/*
 		 * Drop the packet and try later.
 		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
-		(void)ret; /*avoid compiler warning*/
+		ret = read(qp->tapfd, dummybuf, sizeof(dummybuf));
 
-		return;
+		return ret >= 0;
 	}
 
 	/*
 	 * Check for available rx buffers
 	 */
-	vq = &net->queues[VIRTIO_NET_RXQ];
+	vq = qp->rxq;
 	if (!vq_has_descs(vq)) {
 		/*
 		 * Drop the packet and try later.  Interrupt on
 		 * empty, if that's negotiated.
 		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
-		(void)ret; /*avoid compiler warning*/
+		ret = read(qp->tapfd, dummybuf, sizeof(dummybuf));
 
 		vq_endchains(vq, 1);
-		return;
+		return ret >= 0;
 	}
 
 	do {
@@ -455,7 +602,8 @@ virtio_net_tap_rx(struct virtio_net *net)
 		n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
 		if (n < 1 || n > VIRTIO_NET_MAXSEGS) {
 			WPRINTF(("vtnet: virtio_net_tap_rx: vq_getchain = %d\n", n));
-			return;
+			more = false;
+			break;
 		}
 		/*
 		 * Get a pointer to the rx header, and use the
@@ -463,19 +611,25 @@ virtio_net_tap_rx(struct virtio_net *net)
 		 */
 		vrx = iov[0].iov_base;
 		riov = rx_iov_trim(iov, &n, net->rx_vhdrlen);
-		if (riov == NULL)
-			return;
+		if (riov == NULL) {
+			vq_retchain(vq);
+			more = false;
+			break;
+		}
 
-		len = readv(net->tapfd, riov, n);
+		len = readv(qp->tapfd, riov, n);
 
-		if (len < 0 && errno == EWOULDBLOCK) {
+		if (len < 0) {
 			/*
-			 * No more packets, but still some avail ring
-			 * entries.  Interrupt if needed/appropriate.
+			 * No more packets (or a read error), but still
+			 * some avail ring entries. Notify the guest once
+			 * of the whole batch if needed/appropriate.
 			 */
+			if (errno != EWOULDBLOCK)
+				WPRINTF(("vtnet: tap read failed: %d\n", errno));
 			vq_retchain(vq);
 			vq_endchains(vq, 0);
-			return;
+			return false;
 		}
 
 		/*
@@ -483,6 +637,8 @@ virtio_net_tap_rx(struct virtio_net *net)
 		 * number of buffers if merged rx bufs were negotiated.
 		 */
 		memset(vrx, 0, net->rx_vhdrlen);
+		qp->rx_packets++;
+		qp->rx_bytes += len;
 
 		if (net->rx_merge) {
 			struct virtio_net_rxhdr *vrxh;
@@ -497,75 +653,234 @@ virtio_net_tap_rx(struct virtio_net *net)
 		vq_relchain(vq, idx, len + net->rx_vhdrlen);
 	} while (vq_has_descs(vq));
 
-	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
+	/*
+	 * One interrupt for all the chains filled, if needed, including
+	 * for NOTIFY_ON_EMPTY. The tap device may have more frames for the
+	 * chains the guest adds meanwhile.
+	 */
 	vq_endchains(vq, 1);
+	return more;
 }
 
-static void
+/*
+ * Receive frames with the virtio-net header written by the tap device,
+ * which is passed to the guest unchanged. With merged rx buffers a frame
+ * may span several chains, enough of them for the largest frame expected
+ * are gathered before each read and the ones left unused are returned.
+ */
+static bool
+virtio_net_tap_rx_vhdr(struct virtio_net_qpair *qp)
+{
+	struct iovec iov[VIRTIO_NET_MAXSEGS];
+	uint16_t idx[VIRTIO_NET_MAXSEGS];
+	uint32_t clen[VIRTIO_NET_MAXSEGS];
+	struct virtio_net *net = qp->net;
+	struct virtio_vq_info *vq = qp->rxq;
+	struct virtio_net_rxhdr *vrxh;
+	int i, n, niov, nchains, nused;
+	size_t need, room;
+	ssize_t len, ret;
+	bool more = true;
+
+	if (qp->tapfd == -1) {
+		WPRINTF(("vtnet: tapfd == -1\n"));
+		return false;
+	}
+
+	if (!qp->rx_ready || net->resetting || !vq_has_descs(vq)) {
+		/*
+		 * Drop the packet and try later.  Interrupt on
+		 * empty, if that's negotiated.
+		 */
+		ret = read(qp->tapfd, dummybuf, sizeof(dummybuf));
+
+		if (qp->rx_ready && !net->resetting)
+			vq_endchains(vq, 1);
+		return ret >= 0;
+	}
+
+	need = net->rx_vhdrlen + net->rx_maxlen;
+	do {
+		niov = 0;
+		nchains = 0;
+		room = 0;
+		while (room < need && nchains < VIRTIO_NET_MAXSEGS &&
+				vq_has_descs(vq)) {
+			n = vq_getchain(vq, &idx[nchains], &iov[niov],
+					VIRTIO_NET_MAXSEGS - niov, NULL);
+			if (n > VIRTIO_NET_MAXSEGS - niov && nchains > 0) {
+				/* Does not fit, leave it for the next frame */
+				vq_retchain(vq);
+				break;
+			}
+			if (n < 1 || n > VIRTIO_NET_MAXSEGS - niov) {
+				WPRINTF(("vtnet: virtio_net_tap_rx: vq_getchain = %d\n",
+					n));
+				vq_retchains(vq, nchains);
+				more = false;
+				goto done;
+			}
+			clen[nchains] = 0;
+			for (i = 0; i < n; i++)
+				clen[nchains] += iov[niov + i].iov_len;
+			room += clen[nchains];
+			niov += n;
+			nchains++;
+
+			/* Without merged buffers a frame fits in one chain */
+			if (!net->rx_merge)
+				break;
+		}
+
+		if (iov[0].iov_len < net->rx_vhdrlen) {
+			WPRINTF(("vtnet: rx header of %lu bytes\n",
+				iov[0].iov_len));
+			vq_retchains(vq, nchains);
+			more = false;
+			goto done;
+		}
+
+		len = readv(qp->tapfd, iov, niov);
+		if (len < 0) {
+			/*
+			 * No more packets (or a read error), but still
+			 * some avail ring entries. Notify the guest once
+			 * of the whole batch if needed/appropriate.
+			 */
+			if (errno != EWOULDBLOCK)
+				WPRINTF(("vtnet: tap read failed: %d\n", errno));
+			vq_retchains(vq, nchains);
+			vq_endchains(vq, 0);
+			return false;
+		}
+
+		qp->rx_packets++;
+		qp->rx_bytes += len - net->rx_vhdrlen;
+
+		/* Count the chains the frame landed in */
+		nused = 0;
+		room = 0;
+		do {
+			room += clen[nused++];
+		} while (room < len && nused < nchains);
+
+		/* The tap device leaves num_buffers alone */
+		if (net->rx_merge) {
+			vrxh = iov[0].iov_base;
+			vrxh->vrh_bufs = nused;
+		}
+
+		room = len;
+		for (i = 0; i < nused; i++) {
+			vq_relchain(vq, idx[i], MIN(room, clen[i]));
+			room -= MIN(room, clen[i]);
+		}
+		vq_retchains(vq, nchains - nused);
+	} while (vq_has_descs(vq));
+
+done:
+	/*
+	 * One interrupt for all the chains filled, if needed, including
+	 * for NOTIFY_ON_EMPTY.
+	 */
+	vq_endchains(vq, 1);
+	return more;
+}
+
+/*
+ * Batched mevent handler: returns true while the tap device may have more
+ * frames, one call fills at most the chains available in the rx queue.
+ */
+static bool
 virtio_net_rx_callback(int fd, enum ev_type type, void *param)
 {
-	struct virtio_net *net = param;
+	struct virtio_net_qpair *qp = param;
+	bool more;
 
-	pthread_mutex_lock(&net->rx_mtx);
-	net->rx_in_progress = 1;
-	net->virtio_net_rx(net);
-	net->rx_in_progress = 0;
-	pthread_mutex_unlock(&net->rx_mtx);
+	pthread_mutex_lock(&qp->rx_mtx);
+	qp->rx_in_progress = 1;
+	more = qp->net->virtio_net_rx(qp);
+	qp->rx_in_progress = 0;
+	pthread_mutex_unlock(&qp->rx_mtx);
 
+	return more;
 }
 
 static void
 virtio_net_ping_rxq(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_net *net = vdev;
+	struct virtio_net_qpair *qp = &net->qpairs[vq->num / VIRTIO_NET_PAIRQ];
 
 	/*
 	 * A qnotify means that the rx process can now begin
 	 */
-	if (net->rx_ready == 0) {
-		net->rx_ready = 1;
+	if (qp->rx_ready == 0) {
+		qp->rx_ready = 1;
 		if (vq->used != NULL) {
 			vq->used->flags |= VRING_USED_F_NO_NOTIFY;
 		}
 	}
 }
 
-static void
-virtio_net_proctx(struct virtio_net *net, struct virtio_vq_info *vq)
+/*
+ * Harvest up to VIRTIO_NET_TX_BATCH chains, hand them to the backend in
+ * one call and release them. Returns the number of chains processed.
+ */
+static int
+virtio_net_proctx(struct virtio_net_qpair *qp, struct virtio_vq_info *vq)
 {
-	struct iovec iov[VIRTIO_NET_MAXSEGS + 1];
-	int i, n;
-	int plen, tlen;
-	uint16_t idx;
+	struct virtio_net_txpkt *pkt;
+	int i, n, npkts;
 
-	/*
-	 * Obtain chain of descriptors.  The first one is
-	 * really the header descriptor, so we need to sum
-	 * up two lengths: packet length and transfer length.
-	 */
-	n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
-	if (n < 1 || n > VIRTIO_NET_MAXSEGS) {
-		WPRINTF(("vtnet: virtio_net_proctx: vq_getchain = %d\n", n));
-		return;
-	}
-	plen = 0;
-	tlen = iov[0].iov_len;
-	for (i = 1; i < n; i++) {
-		plen += iov[i].iov_len;
-		tlen += iov[i].iov_len;
+	for (npkts = 0; npkts < VIRTIO_NET_TX_BATCH && vq_has_descs(vq);
+			npkts++) {
+		pkt = &qp->txpkts[npkts];
+
+		/*
+		 * Obtain chain of descriptors.  The first one is
+		 * really the header descriptor, so we need to sum
+		 * up two lengths: packet length and transfer length.
+		 */
+		n = vq_getchain(vq, &pkt->idx, pkt->iov, VIRTIO_NET_MAXSEGS,
+				NULL);
+		if (n < 1 || n > VIRTIO_NET_MAXSEGS) {
+			WPRINTF(("vtnet: virtio_net_proctx: vq_getchain = %d\n",
+				n));
+			break;
+		}
+		pkt->iovcnt = n - 1;
+		pkt->len = 0;
+		pkt->tlen = pkt->iov[0].iov_len;
+		for (i = 1; i < n; i++) {
+			pkt->len += pkt->iov[i].iov_len;
+			pkt->tlen += pkt->iov[i].iov_len;
+		}
+
+		DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r",
+			pkt->len, n));
 	}
 
-	DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, n));
-	net->virtio_net_tx(net, &iov[1], n - 1, plen);
+	if (npkts == 0)
+		return 0;
+
+	qp->net->virtio_net_tx(qp, qp->txpkts, npkts);
+
+	/* chains are processed, release them and set tlen */
+	for (i = 0; i < npkts; i++) {
+		qp->tx_bytes += qp->txpkts[i].len;
+		vq_relchain(vq, qp->txpkts[i].idx, qp->txpkts[i].tlen);
+	}
+	qp->tx_packets += npkts;
 
-	/* chain is processed, release it and set tlen */
-	vq_relchain(vq, idx, tlen);
+	return npkts;
 }
 
 static void
 virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_net *net = vdev;
+	struct virtio_net_qpair *qp = &net->qpairs[vq->num / VIRTIO_NET_PAIRQ];
 
 	/*
 	 * Any ring entries to process?
@@ -574,11 +889,11 @@ virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 		return;
 
 	/* Signal the tx thread for processing */
-	pthread_mutex_lock(&net->tx_mtx);
+	pthread_mutex_lock(&qp->tx_mtx);
 	vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-	if (net->tx_in_progress == 0)
-		pthread_cond_signal(&net->tx_cond);
-	pthread_mutex_unlock(&net->tx_mtx);
+	if (qp->tx_in_progress == 0)
+		pthread_cond_signal(&qp->tx_cond);
+	pthread_mutex_unlock(&qp->tx_mtx);
 }
 
 /*
@@ -587,27 +902,28 @@ virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 static void *
 virtio_net_tx_thread(void *param)
 {
-	struct virtio_net *net = param;
-	struct virtio_vq_info *vq = &net->queues[VIRTIO_NET_TXQ];
+	struct virtio_net_qpair *qp = param;
+	struct virtio_net *net = qp->net;
+	struct virtio_vq_info *vq = qp->txq;
 
 	/*
 	 * Let us wait till the tx queue pointers get initialised &
 	 * first tx signaled
 	 */
-	pthread_mutex_lock(&net->tx_mtx);
+	pthread_mutex_lock(&qp->tx_mtx);
 
 	while (!net->closing && !vq_ring_ready(vq))
-		pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
+		pthread_cond_wait(&qp->tx_cond, &qp->tx_mtx);
 
 	if (net->closing) {
 		WPRINTF(("vtnet tx thread closing...\n"));
-		pthread_mutex_unlock(&net->tx_mtx);
+		pthread_mutex_unlock(&qp->tx_mtx);
 		return NULL;
 	}
 
 	for (;;) {
 		/* note - tx mutex is locked here */
-		net->tx_in_progress = 0;
+		qp->tx_in_progress = 0;
 
 		/*
 		 * Checking the avail ring here serves two purposes:
@@ -621,26 +937,26 @@ virtio_net_tx_thread(void *param)
 			if (!net->resetting && vq_has_descs(vq))
 				break;
 
-			pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
+			pthread_cond_wait(&qp->tx_cond, &qp->tx_mtx);
 
 			if (net->closing) {
 				WPRINTF(("vtnet tx thread closing...\n"));
-				pthread_mutex_unlock(&net->tx_mtx);
+				pthread_mutex_unlock(&qp->tx_mtx);
 				return NULL;
 			}
 		}
 
 		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-		net->tx_in_progress = 1;
-		pthread_mutex_unlock(&net->tx_mtx);
+		qp->tx_in_progress = 1;
+		pthread_mutex_unlock(&qp->tx_mtx);
 
 		do {
 			/*
 			 * Run through entries, placing them into
-			 * iovecs and sending when an end-of-packet
-			 * is found
+			 * iovecs and sending them in batches
 			 */
-			virtio_net_proctx(net, vq);
+			if (virtio_net_proctx(qp, vq) == 0)
+				break;
 		} while (vq_has_descs(vq));
 
 		/*
@@ -648,17 +964,77 @@ virtio_net_tx_thread(void *param)
 		 */
 		vq_endchains(vq, 1);
 
-		pthread_mutex_lock(&net->tx_mtx);
+		pthread_mutex_lock(&qp->tx_mtx);
 	}
 }
 
-#ifdef notyet
+static uint8_t
+virtio_net_ctrl_mq(struct virtio_net *net, uint8_t cmd, uint8_t *data,
+		   size_t len)
+{
+	uint16_t pairs;
+
+	if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET || len < sizeof(pairs))
+		return VIRTIO_NET_ERR;
+
+	memcpy(&pairs, data, sizeof(pairs));
+	if (pairs < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN || pairs > net->nqpairs) {
+		WPRINTF(("vtnet: invalid number of queue pairs %d\n", pairs));
+		return VIRTIO_NET_ERR;
+	}
+
+	DPRINTF(("vtnet: %d queue pairs enabled\n", pairs));
+	if (virtio_net_set_qpairs(net, pairs) < 0)
+		return VIRTIO_NET_ERR;
+	return VIRTIO_NET_OK;
+}
+
 static void
 virtio_net_ping_ctlq(void *vdev, struct virtio_vq_info *vq)
 {
-	DPRINTF(("vtnet: control qnotify!\n\r"));
+	struct virtio_net *net = vdev;
+	struct iovec iov[VIRTIO_NET_CTL_MAXSEGS];
+	struct virtio_net_ctrl_hdr *hdr;
+	uint8_t buf[64], ack;
+	size_t len, l;
+	uint16_t idx;
+	int i, n;
+
+	while (vq_has_descs(vq)) {
+		/*
+		 * The command header and data are followed by the
+		 * device-writable ack byte.
+		 */
+		n = vq_getchain(vq, &idx, iov, VIRTIO_NET_CTL_MAXSEGS, NULL);
+		if (n < 2 || n > VIRTIO_NET_CTL_MAXSEGS) {
+			WPRINTF(("vtnet: virtio_net_ping_ctlq: vq_getchain = %d\n",
+				n));
+			return;
+		}
+
+		len = 0;
+		for (i = 0; i < n - 1; i++) {
+			l = MIN(iov[i].iov_len, sizeof(buf) - len);
+			memcpy(buf + len, iov[i].iov_base, l);
+			len += l;
+		}
+
+		ack = VIRTIO_NET_ERR;
+		hdr = (struct virtio_net_ctrl_hdr *)buf;
+		if (len >= sizeof(*hdr) && hdr->class == VIRTIO_NET_CTRL_MQ)
+			ack = virtio_net_ctrl_mq(net, hdr->cmd,
+				buf + sizeof(*hdr), len - sizeof(*hdr));
+		else if (len >= sizeof(*hdr))
+			DPRINTF(("vtnet: unsupported control class %d cmd %d\n",
+				hdr->class, hdr->cmd));
+
+		if (iov[n - 1].iov_len >= sizeof(ack))
+			*(uint8_t *)iov[n - 1].iov_base = ack;
+		vq_relchain(vq, idx, sizeof(ack));
+	}
+
+	vq_endchains(vq, 1);
 }
-#endif
 
 static int
 virtio_net_parsemac(char *mac_str, uint8_t *mac_addr)
@@ -712,6 +1088,32 @@ virtio_net_get_ifindex(char *devname)
 	return ifindex;
 }
 
+static int
+virtio_net_get_mtu(char *devname)
+{
+	struct ifreq ifr;
+	int fd;
+	int mtu = ETHERMTU;
+
+	fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		WPRINTF(("%s: Unable to open control socket", __func__));
+		return mtu;
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, devname, IFNAMSIZ);
+	ifr.ifr_name[IFNAMSIZ - 1] = '\0';
+
+	if (ioctl(fd, SIOCGIFMTU, &ifr) < 0)
+		WPRINTF(("%s: Unable to get the MTU of %s\n", __func__, devname));
+	else
+		mtu = ifr.ifr_mtu;
+
+	close(fd);
+	return mtu;
+}
+
 static bool
 virtio_net_is_macvtap(char *devname, int *ifindex)
 {
@@ -737,9 +1139,14 @@ virtio_net_is_macvtap(char *devname, int *ifindex)
 	return true;
 }
 
+/*
+ * @flags are the IFF_ flags wanted besides IFF_TAP and IFF_NO_PI, the ones
+ * the tap device does not support are cleared.
+ */
 static int
-virtio_net_tap_open(char *devname)
+virtio_net_tap_open(char *devname, int *flags)
 {
+	unsigned int features;
 	char tbuf[IFNAMSIZ];
 	int tunfd, rc, macvtap_index;
 	struct ifreq ifr;
@@ -762,8 +1169,13 @@ virtio_net_tap_open(char *devname)
 		return -1;
 	}
 
+	if ((*flags & IFF_VNET_HDR) &&
+		(ioctl(tunfd, TUNGETFEATURES, &features) < 0 ||
+		 !(features & IFF_VNET_HDR)))
+		*flags &= ~IFF_VNET_HDR;
+
 	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	ifr.ifr_flags = IFF_TAP | IFF_NO_PI | *flags;
 
 	if (*devname) {
 		strncpy(ifr.ifr_name, devname, IFNAMSIZ);
@@ -782,12 +1194,31 @@ virtio_net_tap_open(char *devname)
 	return tunfd;
 }
 
+/*
+ * Set the TUN_F_ offloads of all the tap queues, i.e. which checksum and
+ * GSO requests the tap device may pass up to the guest.
+ */
+static int
+virtio_net_tap_set_offload(struct virtio_net *net, unsigned int offload)
+{
+	int i, rc = 0;
+
+	for (i = 0; i < net->nqpairs; i++) {
+		if (net->qpairs[i].tapfd < 0)
+			continue;
+		if (ioctl(net->qpairs[i].tapfd, TUNSETOFFLOAD, offload) < 0)
+			rc = -1;
+	}
+	return rc;
+}
+
 static void
 virtio_net_tap_setup(struct virtio_net *net, char *devname)
 {
+	struct virtio_net_qpair *qp;
 	char tbuf[IFNAMSIZ];
 	int vhost_fd = -1;
-	int rc;
+	int i, rc, flags;
 
 	rc = snprintf(tbuf, IFNAMSIZ, "%s", devname);
 	if (rc < 0 || rc >= IFNAMSIZ) /* give warning if error or truncation happens */
@@ -796,50 +1227,230 @@ virtio_net_tap_setup(struct virtio_net *net, char *devname)
 	net->virtio_net_rx = virtio_net_tap_rx;
 	net->virtio_net_tx = virtio_net_tap_tx;
 
-	net->tapfd = virtio_net_tap_open(tbuf);
-	if (net->tapfd == -1) {
-		WPRINTF(("open of tap device %s failed\n", tbuf));
-		return;
-	}
-	DPRINTF(("open of tap device %s success!\n", tbuf));
+	/*
+	 * The vhost-net driver builds the virtio-net header itself
+	 * (VHOST_NET_F_VIRTIO_NET_HDR), so only the userspace backend has
+	 * the tap device pass it through.
+	 */
+	flags = net->use_vhost ? 0 : IFF_VNET_HDR;
+	if (net->nqpairs > 1)
+		flags |= IFF_MULTI_QUEUE;
 
 	/*
-	 * Set non-blocking and register for read
-	 * notifications with the event loop
+	 * Each queue pair opens a queue of the tap device, the later ones
+	 * use the name the first open returned.
 	 */
-	int opt = 1;
+	for (i = 0; i < net->nqpairs; i++) {
+		qp = &net->qpairs[i];
+		qp->tapfd = virtio_net_tap_open(tbuf, &flags);
+		if (qp->tapfd == -1) {
+			WPRINTF(("open of tap device %s queue %d failed\n",
+				tbuf, i));
+			goto fail;
+		}
 
-	if (ioctl(net->tapfd, FIONBIO, &opt) < 0) {
-		WPRINTF(("tap device O_NONBLOCK failed\n"));
-		close(net->tapfd);
-		net->tapfd = -1;
+		/*
+		 * Set non-blocking and register for read
+		 * notifications with the event loop
+		 */
+		int opt = 1;
+
+		if (ioctl(qp->tapfd, FIONBIO, &opt) < 0) {
+			WPRINTF(("tap device O_NONBLOCK failed\n"));
+			goto fail;
+		}
 	}
+	DPRINTF(("open of tap device %s success!\n", tbuf));
 
+	if (flags & IFF_VNET_HDR) {
+		net->tap_vnet_hdr = true;
+		net->virtio_net_rx = virtio_net_tap_rx_vhdr;
+		net->tap_mtu = virtio_net_get_mtu(tbuf);
+
+		/* Offloads stay off until the guest negotiates them */
+		net->tap_offload = (virtio_net_tap_set_offload(net,
+			TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN)
+			== 0);
+		virtio_net_tap_set_offload(net, 0);
+	}
+
+	/* Only the first queue pair is used until the driver asks for more */
+	if (net->nqpairs > 1)
+		virtio_net_set_qpairs(net, 1);
+
+	/* One vhost device per queue pair, or none at all */
 	if (net->use_vhost) {
-		vhost_fd = open("/dev/vhost-net", O_RDWR);
-		if (vhost_fd < 0)
-			WPRINTF(("open of vhost-net failed\n"));
-		else {
-			net->vhost_net = vhost_net_init(&net->base, vhost_fd,
-				net->tapfd, 0);
-			if (!net->vhost_net) {
+		for (i = 0; i < net->nqpairs; i++) {
+			qp = &net->qpairs[i];
+			vhost_fd = open("/dev/vhost-net", O_RDWR);
+			if (vhost_fd < 0) {
+				WPRINTF(("open of vhost-net failed\n"));
+				break;
+			}
+			qp->vhost_net = vhost_net_init(&net->base, vhost_fd,
+				qp->tapfd, i * VIRTIO_NET_PAIRQ,
+				VHOST_BACKEND_KERNEL);
+			if (!qp->vhost_net) {
 				WPRINTF(("vhost_net_init failed, fallback "
 					"to userspace virtio\n"));
 				close(vhost_fd);
 				vhost_fd = -1;
+				break;
+			}
+		}
+		if (vhost_fd < 0) {
+			while (--i >= 0) {
+				qp = &net->qpairs[i];
+				vhost_net_deinit(qp->vhost_net);
+				free(qp->vhost_net);
+				qp->vhost_net = NULL;
 			}
 		}
 	}
 
 	if (vhost_fd < 0) {
-		net->mevp = mevent_add(net->tapfd, EVF_READ,
-				       virtio_net_rx_callback, net,
-				       virtio_net_teardown, net);
-		if (net->mevp == NULL) {
+		for (i = 0; i < net->nqpairs; i++) {
+			qp = &net->qpairs[i];
+			qp->mevp = mevent_add_batch(qp->tapfd, EVF_READ,
+					      virtio_net_rx_callback, qp,
+					      virtio_net_teardown, qp);
+			if (qp->mevp == NULL) {
+				WPRINTF(("Could not register event\n"));
+				close(qp->tapfd);
+				qp->tapfd = -1;
+				continue;
+			}
+			net->nmevents++;
+		}
+	}
+	return;
+
+fail:
+	for (i = 0; i < net->nqpairs; i++) {
+		qp = &net->qpairs[i];
+		if (qp->tapfd >= 0) {
+			close(qp->tapfd);
+			qp->tapfd = -1;
+		}
+	}
+}
+
+/* tx frames sent to nowhere, no rx */
+static void
+virtio_net_null_tx(struct virtio_net_qpair *qp, struct virtio_net_txpkt *pkts,
+		   int npkts)
+{
+}
+
+/*
+ * Backends without a tap device, to measure the overhead of the device model
+ * alone: null=discard drops the tx frames, null=loopback sends them back to
+ * the rx queue of their queue pair through a socket pair, virtio-net header
+ * included. Neither takes offloads.
+ */
+static int
+virtio_net_null_setup(struct virtio_net *net, char *mode)
+{
+	struct virtio_net_qpair *qp;
+	int i, sv[2];
+
+	net->null_backend = true;
+	if (strcmp(mode, "discard") == 0) {
+		net->virtio_net_rx = virtio_net_tap_rx;
+		net->virtio_net_tx = virtio_net_null_tx;
+		return 0;
+	} else if (strcmp(mode, "loopback") != 0) {
+		pr_err("vtnet: null must be discard or loopback\n");
+		return -1;
+	}
+
+	net->tap_vnet_hdr = true;
+	net->tap_mtu = ETHERMTU;
+	net->virtio_net_rx = virtio_net_tap_rx_vhdr;
+	net->virtio_net_tx = virtio_net_tap_tx;
+
+	for (i = 0; i < net->nqpairs; i++) {
+		qp = &net->qpairs[i];
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+					0, sv) < 0) {
+			WPRINTF(("vtnet: socketpair failed: %d\n", errno));
+			break;
+		}
+		qp->tapfd = sv[0];
+		qp->loopfd = sv[1];
+		qp->mevp = mevent_add_batch(qp->tapfd, EVF_READ,
+				      virtio_net_rx_callback, qp,
+				      virtio_net_teardown, qp);
+		if (qp->mevp == NULL) {
 			WPRINTF(("Could not register event\n"));
-			close(net->tapfd);
-			net->tapfd = -1;
+			break;
 		}
+		net->nmevents++;
+	}
+	if (i < net->nqpairs) {
+		close(net->qpairs[i].tapfd);
+		close(net->qpairs[i].loopfd);
+		net->qpairs[i].tapfd = -1;
+		net->qpairs[i].loopfd = -1;
+	}
+
+	return 0;
+}
+
+/*
+ * The data plane is served by a vhost-user backend process, the device model
+ * only emulates the config space. The backend handles the offloads itself.
+ */
+static void
+virtio_net_vhost_user_setup(struct virtio_net *net, char *path)
+{
+	struct virtio_net_qpair *qp = &net->qpairs[0];
+	int fd;
+
+	fd = vhost_user_connect(path);
+	if (fd < 0) {
+		WPRINTF(("connect to vhost-user backend %s failed\n", path));
+		return;
+	}
+
+	net->base.device_caps |= VIRTIO_NET_S_OFFLOADCAPS;
+	qp->vhost_net = vhost_net_init(&net->base, fd, -1, 0,
+				       VHOST_BACKEND_USER);
+	if (!qp->vhost_net) {
+		WPRINTF(("vhost_net_init of vhost-user backend failed\n"));
+		net->base.device_caps &= ~VIRTIO_NET_S_OFFLOADCAPS;
+		close(fd);
+	}
+}
+
+/* the packets of vhost-net never go through the device model */
+static void
+virtio_net_metrics(struct metrics_out *mo, void *arg)
+{
+	struct virtio_net *net = arg;
+	struct virtio_net_qpair *qp;
+	char dev[16];
+	int i;
+
+	if (net->use_vhost)
+		return;
+
+	snprintf(dev, sizeof(dev), "net-%d:%d", net->base.dev->slot, net->base.dev->func);
+	virtio_metrics_queues(mo, &net->base, dev);
+	for (i = 0; i < net->nqpairs; i++) {
+		qp = &net->qpairs[i];
+		metrics_add(mo, "acrn_net_rx_packets_total", METRIC_COUNTER,
+			"Packets received by the network device", qp->rx_packets,
+			"dev=\"%s\",queue=\"%d\"", dev, i);
+		metrics_add(mo, "acrn_net_rx_bytes_total", METRIC_COUNTER,
+			"Bytes received by the network device", qp->rx_bytes,
+			"dev=\"%s\",queue=\"%d\"", dev, i);
+		metrics_add(mo, "acrn_net_tx_packets_total", METRIC_COUNTER,
+			"Packets sent by the network device", qp->tx_packets,
+			"dev=\"%s\",queue=\"%d\"", dev, i);
+		metrics_add(mo, "acrn_net_tx_bytes_total", METRIC_COUNTER,
+			"Bytes sent by the network device", qp->tx_bytes,
+			"dev=\"%s\",queue=\"%d\"", dev, i);
 	}
 }
 
@@ -860,7 +1471,9 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	char *opt = NULL;
 	int mac_provided;
 	pthread_mutexattr_t attr;
-	int rc;
+	struct virtio_net_qpair *qp;
+	int nqpairs, nvqs;
+	int i, rc;
 
 	net = calloc(1, sizeof(struct virtio_net));
 	if (!net) {
@@ -886,18 +1499,23 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	 * Read the MAC address if specified
 	 */
 	mac_provided = 0;
-	net->vhost_net = NULL;
+	nqpairs = 1;
 	if (opts != NULL) {
 		int err;
 
 		devopts = vtopts = strdup(opts);
 		if (!devopts) {
 			WPRINTF(("virtio_net: strdup returns NULL\n"));
-			free(net);
-			return -1;
+			rc = -1;
+			goto fail;
 		}
 
-		(void) strsep(&vtopts, ",");
+		opt = strsep(&vtopts, ",");
+		if (opt && !strncmp(opt, "vhost-user=", 11)) {
+			net->use_vhost = true;
+			net->vhost_user = true;
+		} else if (opt && !strncmp(opt, "null=", 5))
+			net->null_backend = true;
 
 		while ((opt = strsep(&vtopts, ",")) != NULL) {
 			if (strcmp("vhost", opt) == 0)
@@ -906,45 +1524,96 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 				err = virtio_net_parsemac(opt,
 					net->config.mac);
 				if (err != 0) {
-					free(devopts);
-					free(net);
-					return err;
+					rc = err;
+					goto fail;
 				}
 				mac_provided = 1;
+			} else if (!strncmp(opt, "mq=", 3)) {
+				if (dm_strtoi(opt + 3, NULL, 10, &nqpairs) ||
+					nqpairs < 1 ||
+					nqpairs > VIRTIO_NET_MQ_MAX) {
+					pr_err("mq must be 1 to %d\n",
+						VIRTIO_NET_MQ_MAX);
+					rc = -1;
+					goto fail;
+				}
 			}
 		}
 	}
 
-	virtio_linkup(&net->base, &virtio_net_ops, net, dev, net->queues,
+	if (net->null_backend && net->use_vhost) {
+		pr_err("vhost is not supported with null\n");
+		rc = -1;
+		goto fail;
+	}
+
+	/* The backend process gets only one queue pair */
+	if (net->vhost_user && nqpairs > 1) {
+		pr_err("mq is not supported with vhost-user\n");
+		rc = -1;
+		goto fail;
+	}
+
+	/* The control queue is only needed to enable the extra pairs */
+	nvqs = nqpairs * VIRTIO_NET_PAIRQ + (nqpairs > 1 ? 1 : 0);
+	net->queues = calloc(nvqs, sizeof(struct virtio_vq_info));
+	net->qpairs = calloc(nqpairs, sizeof(struct virtio_net_qpair));
+	for (i = 0; net->qpairs && i < nqpairs; i++) {
+		net->qpairs[i].txpkts = calloc(VIRTIO_NET_TX_BATCH,
+				sizeof(struct virtio_net_txpkt));
+		if (!net->qpairs[i].txpkts)
+			break;
+	}
+	if (!net->queues || !net->qpairs || i < nqpairs) {
+		WPRINTF(("virtio_net: calloc returns NULL\n"));
+		rc = -1;
+		goto fail;
+	}
+	net->nqpairs = nqpairs;
+	net->curr_qpairs = nqpairs;
+
+	net->ops = virtio_net_ops;
+	net->ops.nvq = nvqs;
+	virtio_linkup(&net->base, &net->ops, net, dev, net->queues,
 		      net->use_vhost ? BACKEND_VHOST : BACKEND_VBSU);
 	net->base.mtx = &net->mtx;
 	net->base.device_caps = VIRTIO_NET_S_HOSTCAPS;
 
-	net->queues[VIRTIO_NET_RXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_RXQ].notify = virtio_net_ping_rxq;
-	net->queues[VIRTIO_NET_TXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_TXQ].notify = virtio_net_ping_txq;
-#ifdef notyet
-	net->queues[VIRTIO_NET_CTLQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_CTLQ].notify = virtio_net_ping_ctlq;
-#endif
+	for (i = 0; i < nqpairs; i++) {
+		qp = &net->qpairs[i];
+		qp->net = net;
+		qp->idx = i;
+		qp->rxq = &net->queues[i * VIRTIO_NET_PAIRQ + VIRTIO_NET_RXQ];
+		qp->txq = &net->queues[i * VIRTIO_NET_PAIRQ + VIRTIO_NET_TXQ];
+		qp->rxq->qsize = VIRTIO_NET_RINGSZ;
+		qp->rxq->notify = virtio_net_ping_rxq;
+		qp->txq->qsize = VIRTIO_NET_RINGSZ;
+		qp->txq->notify = virtio_net_ping_txq;
 
-	/*
-	 * Attempt to open the tap device
-	 */
-	net->tapfd = -1;
+		/*
+		 * Attempt to open the tap device
+		 */
+		qp->tapfd = -1;
+		qp->loopfd = -1;
+	}
+	if (nqpairs > 1) {
+		net->queues[nvqs - 1].qsize = VIRTIO_NET_CTLQ_RINGSZ;
+		net->queues[nvqs - 1].notify = virtio_net_ping_ctlq;
+	}
 
 	if (!devopts) {
 		WPRINTF(("virtio_net: invalid optional argument\n"));
-		free(net);
-		return -1;
+		rc = -1;
+		goto fail;
 	}
 
 	if (opts != NULL) {
 		vtopts = tmp = strdup(opts);
 	}
 
-	if ((tmp != NULL) && (strncmp(tmp, "tap", 3) == 0)) {
+	if ((tmp != NULL) && ((strncmp(tmp, "tap", 3) == 0) ||
+		(strncmp(tmp, "vhost-user=", 11) == 0) ||
+		(strncmp(tmp, "null=", 5) == 0))) {
 		type = strsep(&tmp, "=");
 		name = strsep(&tmp, ",");
 	}
@@ -958,6 +1627,11 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 		if (strcmp(type, "tap") == 0) {
 			virtio_net_tap_setup(net, name);
+		} else if (strcmp(type, "vhost-user") == 0) {
+			virtio_net_vhost_user_setup(net, name);
+		} else if (strcmp(type, "null") == 0) {
+			if (virtio_net_null_setup(net, name) < 0)
+				net->null_backend = false;
 		}
 	}
 
@@ -996,6 +1670,7 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 	free(vtopts);
 	free(devopts);
+	devopts = NULL;
 
 	/* initialize config space */
 	pci_set_cfgdata16(dev, PCIR_DEVICE, VIRTIO_DEV_NET);
@@ -1007,14 +1682,21 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	else
 		pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
-	/* Link is up if we managed to open tap device */
-	net->config.status = (opts == NULL || net->tapfd >= 0);
+	/* Link is up if we managed to open tap device or reach the backend */
+	net->config.status = (opts == NULL || net->qpairs[0].tapfd >= 0 ||
+		net->qpairs[0].vhost_net != NULL || net->null_backend);
+
+	if (nqpairs > 1) {
+		net->base.device_caps |= VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ;
+		net->config.max_virtqueue_pairs = nqpairs;
+	}
+	if (net->tap_offload)
+		net->base.device_caps |= VIRTIO_NET_S_OFFLOADCAPS;
 
 	/* use BAR 1 to map MSI-X table and PBA, if we're using MSI-X */
 	if (virtio_interrupt_init(&net->base, virtio_uses_msix())) {
-		if (net)
-			free(net);
-		return -1;
+		rc = -1;
+		goto fail;
 	}
 
 	/* use BAR 0 to map config regs in IO space */
@@ -1025,24 +1707,46 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 	net->rx_merge = 1;
 	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
-	net->rx_in_progress = 0;
-	pthread_mutex_init(&net->rx_mtx, NULL);
+	net->rx_maxlen = VIRTIO_NET_GSO_MAXLEN;
 
 	/*
-	 * Initialize tx semaphore & spawn TX processing thread.
-	 * As of now, only one thread for TX desc processing is
-	 * spawned.
+	 * Initialize tx semaphores & spawn one TX processing thread
+	 * per queue pair.
 	 */
-	net->tx_in_progress = 0;
-	pthread_mutex_init(&net->tx_mtx, NULL);
-	pthread_cond_init(&net->tx_cond, NULL);
-	pthread_create(&net->tx_tid, NULL, virtio_net_tx_thread,
-		       (void *)net);
-	snprintf(tname, sizeof(tname), "vtnet-%d:%d tx", dev->slot,
-		 dev->func);
-	pthread_setname_np(net->tx_tid, tname);
+	for (i = 0; i < nqpairs; i++) {
+		qp = &net->qpairs[i];
+		qp->rx_in_progress = 0;
+		pthread_mutex_init(&qp->rx_mtx, NULL);
+
+		qp->tx_in_progress = 0;
+		pthread_mutex_init(&qp->tx_mtx, NULL);
+		pthread_cond_init(&qp->tx_cond, NULL);
+		pthread_create(&qp->tx_tid, NULL, virtio_net_tx_thread,
+			       (void *)qp);
+		/* i < VIRTIO_NET_MQ_MAX, the narrowed index keeps the name in tname */
+		if (nqpairs > 1)
+			snprintf(tname, sizeof(tname), "vtnet-%d:%d tx%d",
+				 dev->slot, dev->func, (uint8_t)i);
+		else
+			snprintf(tname, sizeof(tname), "vtnet-%d:%d tx",
+				 dev->slot, dev->func);
+		pthread_setname_np(qp->tx_tid, tname);
+	}
+
+	if (metrics_register(virtio_net_metrics, net) < 0)
+		pr_err("vtnet: failed to register its metrics\n");
 
 	return 0;
+
+fail:
+	/* the arrays not allocated yet are NULL from calloc() */
+	for (i = 0; net->qpairs && i < nqpairs; i++)
+		free(net->qpairs[i].txpkts);
+	free(net->queues);
+	free(net->qpairs);
+	free(devopts);
+	free(net);
+	return rc;
 }
 
 static int
@@ -1080,6 +1784,42 @@ virtio_net_cfgread(void *vdev, int offset, int size, uint32_t *retval)
 	return 0;
 }
 
+/*
+ * Match the tap header size and offloads to the negotiated features, the
+ * TUN_F_ flags describe what the guest can receive.
+ */
+static void
+virtio_net_tap_neg_offload(struct virtio_net *net)
+{
+	unsigned int offload = 0;
+	int i;
+
+	for (i = 0; i < net->nqpairs && !net->null_backend; i++) {
+		if (net->qpairs[i].tapfd >= 0 &&
+			ioctl(net->qpairs[i].tapfd, TUNSETVNETHDRSZ,
+				&net->rx_vhdrlen) < 0)
+			WPRINTF(("vtnet: TUNSETVNETHDRSZ failed: %d\n", errno));
+	}
+
+	if (net->features & VIRTIO_NET_F_GUEST_CSUM) {
+		offload |= TUN_F_CSUM;
+		if (net->features & VIRTIO_NET_F_GUEST_TSO4)
+			offload |= TUN_F_TSO4;
+		if (net->features & VIRTIO_NET_F_GUEST_TSO6)
+			offload |= TUN_F_TSO6;
+		if (net->features & VIRTIO_NET_F_GUEST_ECN)
+			offload |= TUN_F_TSO_ECN;
+	}
+	if (net->tap_offload && virtio_net_tap_set_offload(net, offload) < 0)
+		WPRINTF(("vtnet: TUNSETOFFLOAD 0x%x failed\n", offload));
+
+	/* Frames only exceed the MTU with the guest TSO offloads on */
+	if (offload & (TUN_F_TSO4 | TUN_F_TSO6))
+		net->rx_maxlen = VIRTIO_NET_GSO_MAXLEN;
+	else
+		net->rx_maxlen = net->tap_mtu + ETHER_HDR_LEN + 4;
+}
+
 static void
 virtio_net_neg_features(void *vdev, uint64_t negotiated_features)
 {
@@ -1092,75 +1832,126 @@ virtio_net_neg_features(void *vdev, uint64_t negotiated_features)
 		/* non-merge rx header is 2 bytes shorter */
 		net->rx_vhdrlen -= 2;
 	}
+
+	if (net->tap_vnet_hdr)
+		virtio_net_tap_neg_offload(net);
 }
 
 static void
 virtio_net_set_status(void *vdev, uint64_t status)
 {
 	struct virtio_net *net = vdev;
-	int rc;
-
-	if (!net->vhost_net)
-		return;
-
-	if (!net->vhost_net->vhost_started &&
-		(status & VIRTIO_CONFIG_S_DRIVER_OK)) {
-		if (net->mevp)
-			mevent_disable(net->mevp);
-
-		rc = vhost_net_start(net->vhost_net);
-		if (rc < 0) {
-			WPRINTF(("vhost_net_start failed\n"));
-			return;
+	struct virtio_net_qpair *qp;
+	int i, rc;
+
+	for (i = 0; i < net->nqpairs; i++) {
+		qp = &net->qpairs[i];
+		if (!qp->vhost_net)
+			continue;
+
+		if (!qp->vhost_net->vhost_started &&
+			(status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+			if (qp->mevp)
+				mevent_disable(qp->mevp);
+
+			rc = vhost_net_start(qp->vhost_net);
+			if (rc < 0) {
+				WPRINTF(("vhost_net_start failed\n"));
+				return;
+			}
+		} else if (qp->vhost_net->vhost_started &&
+			((status & VIRTIO_CONFIG_S_DRIVER_OK) == 0)) {
+			rc = vhost_net_stop(qp->vhost_net);
+			if (rc < 0)
+				WPRINTF(("vhost_net_stop failed\n"));
 		}
-	} else if (net->vhost_net->vhost_started &&
-		((status & VIRTIO_CONFIG_S_DRIVER_OK) == 0)) {
-		rc = vhost_net_stop(net->vhost_net);
-		if (rc < 0)
-			WPRINTF(("vhost_net_stop failed\n"));
 	}
 }
 
+static void
+virtio_net_free(struct virtio_net *net)
+{
+	int i;
+
+	virtio_reset_dev(&net->base);
+	for (i = 0; i < net->nqpairs; i++)
+		free(net->qpairs[i].txpkts);
+	free(net->qpairs);
+	free(net->queues);
+	free(net);
+}
+
 static void
 virtio_net_teardown(void *param)
 {
+	struct virtio_net_qpair *qp;
 	struct virtio_net *net;
 
-	net = (struct virtio_net *)param;
-	if (!net)
+	qp = (struct virtio_net_qpair *)param;
+	if (!qp)
 		return;
+	net = qp->net;
 
-	if (net->tapfd >= 0) {
-		close(net->tapfd);
-		net->tapfd = -1;
+	if (qp->tapfd >= 0) {
+		close(qp->tapfd);
+		qp->tapfd = -1;
 	} else
 		pr_err("net->tapfd is -1!\n");
+	if (qp->loopfd >= 0) {
+		close(qp->loopfd);
+		qp->loopfd = -1;
+	}
 
-	virtio_reset_dev(&net->base);
-	free(net);
+	/* The last rx event torn down releases the device */
+	if (__sync_sub_and_fetch(&net->nmevents, 1) == 0)
+		virtio_net_free(net);
 }
 
 static void
 virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
+	struct mevent *mevp[VIRTIO_NET_MQ_MAX];
+	struct virtio_net_qpair *qp;
 	struct virtio_net *net;
+	int i, n;
 
 	if (dev->arg) {
 		net = (struct virtio_net *) dev->arg;
 
+		metrics_unregister(net);
 		virtio_net_tx_stop(net);
 
-		if (net->vhost_net) {
-			vhost_net_stop(net->vhost_net);
-			vhost_net_deinit(net->vhost_net);
-			free(net->vhost_net);
-			net->vhost_net = NULL;
+		/*
+		 * The rx events may be torn down (and the device freed) by
+		 * the mevent thread as soon as they are deleted, so collect
+		 * them first.
+		 */
+		n = 0;
+		for (i = 0; i < net->nqpairs; i++) {
+			qp = &net->qpairs[i];
+			if (qp->vhost_net) {
+				vhost_net_stop(qp->vhost_net);
+				vhost_net_deinit(qp->vhost_net);
+				free(qp->vhost_net);
+				qp->vhost_net = NULL;
+			}
+
+			if (qp->mevp != NULL)
+				mevp[n++] = qp->mevp;
+			else if (qp->tapfd >= 0) {
+				close(qp->tapfd);
+				qp->tapfd = -1;
+				if (qp->loopfd >= 0) {
+					close(qp->loopfd);
+					qp->loopfd = -1;
+				}
+			}
 		}
 
-		if (net->mevp != NULL)
-			mevent_delete(net->mevp);
-		else
-			virtio_net_teardown(net);
+		if (n == 0)
+			virtio_net_free(net);
+		for (i = 0; i < n; i++)
+			mevent_delete(mevp[i]);
 
 		DPRINTF(("%s: done\n", __func__));
 	} else
@@ -1168,7 +1959,8 @@ virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 }
 
 static struct vhost_net *
-vhost_net_init(struct virtio_base *base, int vhostfd, int tapfd, int vq_idx)
+vhost_net_init(struct virtio_base *base, int vhostfd, int tapfd, int vq_idx,
+	       enum vhost_backend_type backend)
 {
 	struct vhost_net *vhost_net = NULL;
 	uint64_t vhost_features = VIRTIO_NET_S_VHOSTCAPS;
@@ -1176,6 +1968,12 @@ vhost_net_init(struct virtio_base *base, int vhostfd, int tapfd, int vq_idx)
 	uint32_t busyloop_timeout = 0;
 	int rc;
 
+	/* vhost-user backends build the virtio-net header and offloads */
+	if (backend == VHOST_BACKEND_USER) {
+		vhost_features |= VIRTIO_NET_S_OFFLOADCAPS;
+		vhost_ext_features = 1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
+	}
+
 	vhost_net = calloc(1, sizeof(struct vhost_net));
 	if (!vhost_net) {
 		WPRINTF(("vhost init out of memory\n"));
@@ -1185,6 +1983,7 @@ vhost_net_init(struct virtio_base *base, int vhostfd, int tapfd, int vq_idx)
 	/* pre-init before calling vhost_dev_init */
 	vhost_net->vdev.nvqs = ARRAY_SIZE(vhost_net->vqs);
 	vhost_net->vdev.vqs = vhost_net->vqs;
+	vhost_net->vdev.backend = backend;
 	vhost_net->tapfd = tapfd;
 
 	rc = vhost_dev_init(&vhost_net->vdev, base, vhostfd, vq_idx,
@@ -1269,6 +2068,8 @@ struct pci_vdev_ops pci_ops_virtio_net = {
 	.vdev_init	= virtio_net_init,
 	.vdev_deinit	= virtio_net_deinit,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_snapshot	= virtio_snapshot,
+	.vdev_restore	= virtio_restore
 };
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_net);
@@ -36,6 +36,8 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/random.h>
 
 #include "dm.h"
 #include "pci_core.h"
@@ -45,6 +47,20 @@
 
 #define VIRTIO_RND_RINGSZ	64
 
+/*
+ * The entropy is served from a pool in memory, refilled by a thread of its
+ * own from getrandom() once it is half empty, so that the requests of the
+ * guest do not wait for the reads of the kernel.
+ */
+#define VIRTIO_RND_POOL_SIZE	(64 * 1024)
+#define VIRTIO_RND_REFILL_SIZE	4096
+
+/* the least the rate limiter waits for, in bytes */
+#define VIRTIO_RND_RATE_MIN	64
+
+/* VBS-U only, VBS-K negotiates its own ring features */
+#define VIRTIO_RND_S_HOSTCAPS	(1 << VIRTIO_RING_F_EVENT_IDX)
+
 /*
  * Per-device struct
  */
@@ -59,6 +75,20 @@ struct virtio_rnd {
 	pthread_t rx_tid;
 	pthread_mutex_t	rx_mtx;
 	pthread_cond_t rx_cond;
+	bool closing;
+
+	/* the pool, a ring of pool_count bytes from pool_head */
+	uint8_t *pool;
+	size_t pool_head;
+	size_t pool_count;
+	pthread_t refill_tid;
+	pthread_mutex_t pool_mtx;
+	pthread_cond_t pool_cond;	/* pool refilled or drained, or closing */
+
+	/* a token bucket of bytes, holding a second of rate */
+	uint64_t rate;			/* bytes per second, 0 for no limit */
+	uint64_t tokens;
+	struct timespec tokens_ts;
 	/* VBS-K variables */
 	struct {
 		enum VBS_K_STATUS status;
@@ -297,6 +327,127 @@ virtio_rnd_reset(void *base)
 	}
 }
 
+static void *
+virtio_rnd_refill(void *param)
+{
+	struct virtio_rnd *rnd = param;
+	uint8_t buf[VIRTIO_RND_REFILL_SIZE];
+	size_t room, tail, n;
+	ssize_t len;
+
+	pthread_mutex_lock(&rnd->pool_mtx);
+	for (;;) {
+		while (rnd->pool_count >= VIRTIO_RND_POOL_SIZE / 2 && !rnd->closing)
+			pthread_cond_wait(&rnd->pool_cond, &rnd->pool_mtx);
+		if (rnd->closing)
+			break;
+
+		/* fill it up, a chunk at a time */
+		while ((room = VIRTIO_RND_POOL_SIZE - rnd->pool_count) != 0 &&
+				!rnd->closing) {
+			pthread_mutex_unlock(&rnd->pool_mtx);
+			len = getrandom(buf, MIN(room, sizeof(buf)), 0);
+			if (len < 0 && errno == ENOSYS)
+				len = read(rnd->fd, buf, MIN(room, sizeof(buf)));
+			if (len <= 0) {
+				if (errno != EINTR) {
+					WPRINTF(("virtio_rnd: failed to get entropy, %s\n",
+						 strerror(errno)));
+					sleep(1);
+				}
+				pthread_mutex_lock(&rnd->pool_mtx);
+				continue;
+			}
+			pthread_mutex_lock(&rnd->pool_mtx);
+
+			tail = (rnd->pool_head + rnd->pool_count) % VIRTIO_RND_POOL_SIZE;
+			n = MIN((size_t)len, VIRTIO_RND_POOL_SIZE - tail);
+			memcpy(rnd->pool + tail, buf, n);
+			memcpy(rnd->pool, buf + n, len - n);
+			rnd->pool_count += len;
+			pthread_cond_broadcast(&rnd->pool_cond);
+		}
+	}
+	pthread_mutex_unlock(&rnd->pool_mtx);
+
+	return NULL;
+}
+
+/* add the tokens of the time since the last ones, called with pool_mtx */
+static void
+virtio_rnd_add_tokens(struct virtio_rnd *rnd)
+{
+	struct timespec now;
+	uint64_t us, add;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - rnd->tokens_ts.tv_sec) * 1000000UL +
+		(now.tv_nsec - rnd->tokens_ts.tv_nsec) / 1000;
+	if (us > 1000000UL)
+		us = 1000000UL;
+
+	/* the time of a fraction of a token is kept for the next ones */
+	add = us * rnd->rate / 1000000UL;
+	if (add) {
+		rnd->tokens = MIN(rnd->tokens + add, rnd->rate);
+		rnd->tokens_ts = now;
+	}
+}
+
+/*
+ * Take up to len bytes of the pool, within the rate limit. Without wait,
+ * return 0 rather than wait for them; return -1 if closing.
+ */
+static ssize_t
+virtio_rnd_take(struct virtio_rnd *rnd, uint8_t *buf, size_t len, bool wait)
+{
+	struct timespec ts;
+	uint64_t ns;
+	size_t n, m;
+
+	pthread_mutex_lock(&rnd->pool_mtx);
+	for (;;) {
+		if (rnd->closing) {
+			pthread_mutex_unlock(&rnd->pool_mtx);
+			return -1;
+		}
+
+		n = MIN(len, rnd->pool_count);
+		if (rnd->rate) {
+			virtio_rnd_add_tokens(rnd);
+			n = MIN(n, rnd->tokens);
+		}
+		if (n || !wait)
+			break;
+
+		if (rnd->pool_count == 0) {
+			pthread_cond_wait(&rnd->pool_cond, &rnd->pool_mtx);
+		} else {
+			/* until the tokens of a few bytes have come */
+			ns = MIN(len, VIRTIO_RND_RATE_MIN) * 1000000000UL / rnd->rate;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += (ts.tv_nsec + ns) / 1000000000UL;
+			ts.tv_nsec = (ts.tv_nsec + ns) % 1000000000UL;
+			pthread_cond_timedwait(&rnd->pool_cond, &rnd->pool_mtx, &ts);
+		}
+	}
+
+	m = MIN(n, VIRTIO_RND_POOL_SIZE - rnd->pool_head);
+	memcpy(buf, rnd->pool + rnd->pool_head, m);
+	memcpy(buf + m, rnd->pool, n - m);
+	rnd->pool_head = (rnd->pool_head + n) % VIRTIO_RND_POOL_SIZE;
+	rnd->pool_count -= n;
+	if (rnd->rate)
+		rnd->tokens -= n;
+
+	/* wake the refill up once half empty */
+	if (rnd->pool_count < VIRTIO_RND_POOL_SIZE / 2)
+		pthread_cond_broadcast(&rnd->pool_cond);
+	pthread_mutex_unlock(&rnd->pool_mtx);
+
+	return n;
+}
+
 static void *
 virtio_rnd_get_entropy(void *param)
 {
@@ -305,6 +456,7 @@ virtio_rnd_get_entropy(void *param)
 	struct iovec iov;
 	uint16_t idx;
 	ssize_t len;
+	int done;
 
 	for (;;) {
 		pthread_mutex_lock(&rnd->rx_mtx);
@@ -315,30 +467,39 @@ virtio_rnd_get_entropy(void *param)
 		 *  - avoid vring processing due to spurious wakeups
 		 *  - catch missing notifications before acquiring rx_mtx
 		 */
-		while (!vq_has_descs(vq))
+		while (!vq_has_descs(vq) && !rnd->closing)
 			pthread_cond_wait(&rnd->rx_cond, &rnd->rx_mtx);
 
+		if (rnd->closing) {
+			pthread_mutex_unlock(&rnd->rx_mtx);
+			return NULL;
+		}
 		rnd->in_progress = 1;
 		pthread_mutex_unlock(&rnd->rx_mtx);
 
+		done = 0;
 		do {
 			if (vq_getchain(vq, &idx, &iov, 1, NULL) < 1) {
 				pr_err("%s: fail to getchain!\n", __func__);
 				break;
 			}
-			len = read(rnd->fd, iov.iov_base, iov.iov_len);
+			len = virtio_rnd_take(rnd, iov.iov_base, iov.iov_len, false);
+			if (len == 0) {
+				/* hand the ones done to the guest before waiting */
+				if (done)
+					vq_endchains(vq, 1);
+				done = 0;
+				len = virtio_rnd_take(rnd, iov.iov_base, iov.iov_len, true);
+			}
 			if (len <= 0) {
 				vq_retchain(vq);
 				vq_endchains(vq, 0);
-
-				/* no data available */
-				if (len == -1 && errno == EAGAIN)
-					return NULL;
-				break;
+				return NULL;
 			}
 
 			/* release this chain and handle more */
 			vq_relchain(vq, idx, len);
+			done++;
 		} while (vq_has_descs(vq));
 
 		/* at least one avail ring element has been processed */
@@ -373,12 +534,18 @@ virtio_rnd_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	char *vbs_k_opt = NULL;
 	enum VBS_K_STATUS kstat = VIRTIO_DEV_INITIAL;
 	char tname[MAXCOMLEN + 1];
+	unsigned long rate = 0;
 
 	while ((opt = strsep(&opts, ",")) != NULL) {
-		/* vbs_k_opt should be kernel=on */
+		/* vbs_k_opt should be kernel=on, or rate=<bytes per second> */
 		vbs_k_opt = strsep(&opt, "=");
 		DPRINTF(("vbs_k_opt is %s\n", vbs_k_opt));
-		if (opt != NULL) {
+		if (opt != NULL && !strcmp(vbs_k_opt, "rate")) {
+			if (dm_strtoul(opt, NULL, 10, &rate)) {
+				WPRINTF(("virtio_rnd: invalid rate %s\n", opt));
+				return -1;
+			}
+		} else if (opt != NULL) {
 			if (strncmp(opt, "on", 2) == 0)
 				kstat = VIRTIO_DEV_PRE_INIT;
 			WPRINTF(("virtio_rnd: VBS-K initializing..."));
@@ -399,6 +566,14 @@ virtio_rnd_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		WPRINTF(("virtio_rnd: calloc returns NULL\n"));
 		goto fail;
 	}
+	rnd->pool = malloc(VIRTIO_RND_POOL_SIZE);
+	if (!rnd->pool) {
+		WPRINTF(("virtio_rnd: failed to allocate the pool\n"));
+		goto fail;
+	}
+	rnd->rate = rate;
+	rnd->tokens = rate;
+	clock_gettime(CLOCK_MONOTONIC, &rnd->tokens_ts);
 
 	rnd->vbs_k.status = kstat;
 
@@ -438,6 +613,7 @@ virtio_rnd_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	    rnd->vbs_k.status != VIRTIO_DEV_INIT_SUCCESS) {
 		DPRINTF(("%s: fallback to VBS-U...\n", __func__));
 		virtio_linkup(&rnd->base, &virtio_rnd_ops, rnd, dev, &rnd->vq, BACKEND_VBSU);
+		rnd->base.device_caps = VIRTIO_RND_S_HOSTCAPS;
 	}
 
 	rnd->base.mtx = &rnd->mtx;
@@ -461,6 +637,14 @@ virtio_rnd_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	virtio_set_io_bar(&rnd->base, 0);
 
 	rnd->in_progress = 0;
+	pthread_mutex_init(&rnd->pool_mtx, NULL);
+	pthread_cond_init(&rnd->pool_cond, NULL);
+	pthread_create(&rnd->refill_tid, NULL, virtio_rnd_refill,
+		       (void *)rnd);
+	snprintf(tname, sizeof(tname), "vtrnd-%d:%d pool", dev->slot,
+		 dev->func);
+	pthread_setname_np(rnd->refill_tid, tname);
+
 	pthread_mutex_init(&rnd->rx_mtx, NULL);
 	pthread_cond_init(&rnd->rx_cond, NULL);
 	pthread_create(&rnd->rx_tid, NULL, virtio_rnd_get_entropy,
@@ -478,6 +662,7 @@ fail:
 			/* VBS-K is in use */
 			close(rnd->vbs_k.fd);
 		}
+		free(rnd->pool);
 		free(rnd);
 	}
 	return -1;
@@ -495,8 +680,15 @@ virtio_rnd_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		return;
 	}
 
-	pthread_cancel(rnd->rx_tid);
+	pthread_mutex_lock(&rnd->rx_mtx);
+	rnd->closing = true;
+	pthread_cond_signal(&rnd->rx_cond);
+	pthread_mutex_unlock(&rnd->rx_mtx);
+	pthread_mutex_lock(&rnd->pool_mtx);
+	pthread_cond_broadcast(&rnd->pool_cond);
+	pthread_mutex_unlock(&rnd->pool_mtx);
 	pthread_join(rnd->rx_tid, &jval);
+	pthread_join(rnd->refill_tid, &jval);
 
 	if (rnd->vbs_k.status == VIRTIO_DEV_STARTED) {
 		DPRINTF(("%s: deinit virtio_rnd_k!\n", __func__));
@@ -515,6 +707,7 @@ virtio_rnd_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	}
 	virtio_rnd_reset(rnd);
 	DPRINTF(("%s: free struct virtio_rnd!\n", __func__));
+	free(rnd->pool);
 	free(rnd);
 }
 
@@ -524,6 +717,8 @@ struct pci_vdev_ops pci_ops_virtio_rnd = {
 	.vdev_init	= virtio_rnd_init,
 	.vdev_deinit	= virtio_rnd_deinit,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_snapshot	= virtio_snapshot,
+	.vdev_restore	= virtio_restore
 };
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_rnd);
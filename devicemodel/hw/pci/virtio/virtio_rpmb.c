@@ -477,6 +477,8 @@ rpmb_keybox_retrieve(__u8 mode, __u8 *key)
 {
 	int ret;
 	uint32_t i;
+	uint32_t count;
+	uint32_t batch;
 	uint32_t block_num;
 	rpmb_block_t *block_table;
 	uint8_t *attkb = NULL;
@@ -528,8 +530,11 @@ rpmb_keybox_retrieve(__u8 mode, __u8 *key)
 
 		rpmb_bara_init(block_table, kb_size);
 		block_num = (kb_size - 1) / RPMB_BLOCK_SIZE + 1;
-		for (i = 0; i < block_num; i++) {
-			ret = rpmb_write_block(mode, key, block_table->attkb_addr + i, attkb + i * RPMB_BLOCK_SIZE, 1);
+		/* The simulated RPMB takes the key box in a few writes, a physical one block by block */
+		batch = (mode == RPMB_SIM_MODE) ? RPMB_SIM_MAX_REL_WRITE : 1;
+		for (i = 0; i < block_num; i += count) {
+			count = (block_num - i < batch) ? block_num - i : batch;
+			ret = rpmb_write_block(mode, key, block_table->attkb_addr + i, attkb + i * RPMB_BLOCK_SIZE, count);
 			if (ret) {
 				DPRINTF(("rpmb write key box fail!\n"));
 				goto out;
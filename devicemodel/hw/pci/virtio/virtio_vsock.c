@@ -0,0 +1,1190 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * virtio-vsock device served in the device model
+ *
+ * Unlike vhost-vsock, which hands the rings to the vsock transport of the
+ * service VM kernel, the stream connections of the guest end here and are
+ * forwarded to UNIX sockets of the host:
+ *
+ *   -s <slot>,virtio-vsock,cid=<cid>[,iothread[=...]][,port=<p>:<path>]...
+ *	[,listen=<p>:<path>]...
+ *
+ * port=<p>:<path> connects the guest connections to port <p> of the host to
+ * the UNIX socket listening at <path>; the connections to any other port are
+ * refused. listen=<p>:<path> listens at <path> and connects the clients
+ * accepted there to port <p> of the guest.
+ *
+ * The payload is moved between the guest buffers and the sockets by
+ * readv()/sendmsg() on the mapped guest memory, without a bounce buffer:
+ * only what a socket does not take at once is copied aside, within the
+ * credit the guest was granted. The sockets are watched by the iothreads.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "iothread.h"
+#include "dm_string.h"
+
+#define VIRTIO_VSOCK_RXQ	0
+#define VIRTIO_VSOCK_TXQ	1
+#define VIRTIO_VSOCK_EVTQ	2
+#define VIRTIO_VSOCK_MAXQ	3
+
+#define VIRTIO_VSOCK_RINGSZ	128
+#define VIRTIO_VSOCK_MAXSEGS	64
+
+#define VIRTIO_VSOCK_S_HOSTCAPS	\
+	((1UL << VIRTIO_F_VERSION_1) | (1UL << VIRTIO_RING_F_EVENT_IDX))
+
+#define VSOCK_CID_HOST		2
+#define VSOCK_TYPE_STREAM	1
+
+#define VSOCK_OP_REQUEST	1
+#define VSOCK_OP_RESPONSE	2
+#define VSOCK_OP_RST		3
+#define VSOCK_OP_SHUTDOWN	4
+#define VSOCK_OP_RW		5
+#define VSOCK_OP_CREDIT_UPDATE	6
+#define VSOCK_OP_CREDIT_REQUEST	7
+
+#define VSOCK_SHUTDOWN_RCV	(1U << 0)
+#define VSOCK_SHUTDOWN_SEND	(1U << 1)
+
+/* The data of the guest in flight to a host socket, the credit it gets */
+#define VSOCK_BUF_ALLOC		(256U * 1024U)
+/* Tell the guest about the space freed once it is this large */
+#define VSOCK_CREDIT_THRESH	(VSOCK_BUF_ALLOC / 4U)
+
+#define VSOCK_MAX_CONNS		128
+#define VSOCK_MAX_PORTS		8
+#define VSOCK_MAX_RSTS		16
+#define VSOCK_LISTEN_BACKLOG	16
+/* The host ports of the connections accepted on a listen= socket */
+#define VSOCK_HOST_PORT_BASE	0x40000000U
+
+/* The control packets a connection owes the guest */
+#define VSOCK_PEND_REQUEST	(1U << 0)
+#define VSOCK_PEND_RESPONSE	(1U << 1)
+#define VSOCK_PEND_CREDIT	(1U << 2)
+#define VSOCK_PEND_SHUTDOWN	(1U << 3)
+#define VSOCK_PEND_RST		(1U << 4)
+
+struct virtio_vsock_hdr {
+	uint64_t src_cid;
+	uint64_t dst_cid;
+	uint32_t src_port;
+	uint32_t dst_port;
+	uint32_t len;
+	uint16_t type;
+	uint16_t op;
+	uint32_t flags;
+	uint32_t buf_alloc;
+	uint32_t fwd_cnt;
+} __attribute__((packed));
+
+struct virtio_vsock_cfg {
+	uint64_t guest_cid;
+} __attribute__((packed));
+
+enum vsock_conn_state {
+	VSOCK_CONN_FREE = 0,
+	VSOCK_CONN_CONNECTING,		/* REQUEST sent, waiting for RESPONSE */
+	VSOCK_CONN_ESTABLISHED,
+	VSOCK_CONN_CLOSING,		/* the socket is gone, RST pending */
+};
+
+struct virtio_vsock_dev;
+
+struct vsock_conn {
+	struct virtio_vsock_dev *vsock;
+	enum vsock_conn_state state;
+	int fd;
+	uint32_t guest_port;
+	uint32_t host_port;
+	uint32_t pending;		/* VSOCK_PEND_* */
+
+	/* guest to host */
+	uint32_t fwd_cnt;		/* bytes of the guest written to the socket */
+	uint32_t fwd_cnt_sent;		/* the fwd_cnt the guest knows about */
+	char *backlog;			/* what the socket did not take yet */
+	uint32_t backlog_len;
+	bool guest_shut_send;
+
+	/* host to guest */
+	uint32_t peer_buf_alloc;
+	uint32_t peer_fwd_cnt;
+	uint32_t tx_cnt;		/* bytes sent to the guest */
+	bool guest_shut_rcv;
+	bool eof;
+
+	/*
+	 * The slots are never freed, an event of a closed connection still
+	 * in flight in the iothread finds a free or reused slot.
+	 */
+	struct iothread_mevent aevt;
+};
+
+struct vsock_port {
+	uint32_t port;
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	int listen_fd;			/* -1 for a port=, guest to host */
+	struct iothread_mevent aevt;
+	struct virtio_vsock_dev *vsock;
+};
+
+struct virtio_vsock_dev {
+	struct virtio_base base;
+	struct virtio_vq_info queues[VIRTIO_VSOCK_MAXQ];
+	pthread_mutex_t mtx;
+	struct virtio_vsock_cfg cfg;
+	struct iothread_ctx *ioctx;
+
+	struct vsock_port ports[VSOCK_MAX_PORTS];
+	int nports;
+	struct vsock_conn conns[VSOCK_MAX_CONNS];
+	uint32_t next_host_port;
+
+	/* RST to packets of no connection, as (guest port, host port) */
+	struct {
+		uint32_t guest_port;
+		uint32_t host_port;
+	} rsts[VSOCK_MAX_RSTS];
+	int nrsts;
+
+	bool rx_full;			/* the guest ran out of RX buffers */
+	bool rx_used;			/* RX buffers used since vq_endchains() */
+};
+
+static int virtio_vsock_debug;
+#define DPRINTF(params) do { if (virtio_vsock_debug) pr_dbg params; } while (0)
+#define WPRINTF(params) (pr_err params)
+
+static void vsock_conn_kick(struct vsock_conn *conn);
+
+/* Copy len bytes at offset off of the iovecs from or to buf */
+static size_t
+vsock_iov_copy(struct iovec *iov, int niov, size_t off, void *buf, size_t len,
+		bool to_iov)
+{
+	size_t done = 0, n;
+	int i;
+
+	for (i = 0; (i < niov) && (done < len); i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+		n = iov[i].iov_len - off;
+		if (n > len - done)
+			n = len - done;
+		if (to_iov)
+			memcpy((char *)iov[i].iov_base + off, (char *)buf + done, n);
+		else
+			memcpy((char *)buf + done, (char *)iov[i].iov_base + off, n);
+		done += n;
+		off = 0;
+	}
+
+	return done;
+}
+
+/* Set out to the len bytes of the iovecs past the first off ones */
+static int
+vsock_iov_slice(struct iovec *iov, int niov, size_t off, size_t len,
+		struct iovec *out)
+{
+	int i, n = 0;
+
+	for (i = 0; (i < niov) && (len > 0); i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+		out[n].iov_base = (char *)iov[i].iov_base + off;
+		out[n].iov_len = iov[i].iov_len - off;
+		if (out[n].iov_len > len)
+			out[n].iov_len = len;
+		len -= out[n].iov_len;
+		off = 0;
+		n++;
+	}
+
+	return n;
+}
+
+static struct vsock_conn *
+vsock_conn_find(struct virtio_vsock_dev *vsock, uint32_t guest_port,
+		uint32_t host_port)
+{
+	struct vsock_conn *conn;
+	int i;
+
+	for (i = 0; i < VSOCK_MAX_CONNS; i++) {
+		conn = &vsock->conns[i];
+		if ((conn->state != VSOCK_CONN_FREE) &&
+		    (conn->guest_port == guest_port) &&
+		    (conn->host_port == host_port))
+			return conn;
+	}
+
+	return NULL;
+}
+
+static struct vsock_conn *
+vsock_conn_alloc(struct virtio_vsock_dev *vsock, int fd, uint32_t guest_port,
+		uint32_t host_port)
+{
+	struct vsock_conn *conn;
+	int i;
+
+	for (i = 0; i < VSOCK_MAX_CONNS; i++) {
+		conn = &vsock->conns[i];
+		if (conn->state == VSOCK_CONN_FREE) {
+			conn->fd = fd;
+			conn->guest_port = guest_port;
+			conn->host_port = host_port;
+			conn->aevt.fd = fd;
+			return conn;
+		}
+	}
+
+	WPRINTF(("vsock: out of connections\n"));
+	return NULL;
+}
+
+static void
+vsock_conn_close_fd(struct vsock_conn *conn)
+{
+	if (conn->fd < 0)
+		return;
+
+	if (conn->aevt.events)
+		iothread_del(conn->vsock->ioctx, conn->fd);
+	conn->aevt.events = 0;
+	close(conn->fd);
+	conn->fd = -1;
+}
+
+static void
+vsock_conn_free(struct vsock_conn *conn)
+{
+	DPRINTF(("vsock: close %u <-> %u\n", conn->guest_port,
+		conn->host_port));
+
+	vsock_conn_close_fd(conn);
+	free(conn->backlog);
+	conn->backlog = NULL;
+	conn->backlog_len = 0;
+	conn->pending = 0;
+	conn->fwd_cnt = 0;
+	conn->fwd_cnt_sent = 0;
+	conn->guest_shut_send = false;
+	conn->peer_buf_alloc = 0;
+	conn->peer_fwd_cnt = 0;
+	conn->tx_cnt = 0;
+	conn->guest_shut_rcv = false;
+	conn->eof = false;
+	conn->state = VSOCK_CONN_FREE;
+}
+
+/* Drop the socket and have the connection reset */
+static void
+vsock_conn_reset(struct vsock_conn *conn)
+{
+	vsock_conn_close_fd(conn);
+	conn->state = VSOCK_CONN_CLOSING;
+	conn->pending = VSOCK_PEND_RST;
+}
+
+/* Reset a connection the device does not know about */
+static void
+vsock_queue_rst(struct virtio_vsock_dev *vsock, uint32_t guest_port,
+		uint32_t host_port)
+{
+	if (vsock->nrsts == VSOCK_MAX_RSTS)
+		return;
+
+	vsock->rsts[vsock->nrsts].guest_port = guest_port;
+	vsock->rsts[vsock->nrsts].host_port = host_port;
+	vsock->nrsts++;
+}
+
+static int
+vsock_rx_getchain(struct virtio_vsock_dev *vsock, uint16_t *idx,
+		struct iovec *iov)
+{
+	struct virtio_vq_info *vq = &vsock->queues[VIRTIO_VSOCK_RXQ];
+	int n;
+
+	if (!vq_ring_ready(vq) || !vq_has_descs(vq)) {
+		vsock->rx_full = true;
+		return -1;
+	}
+
+	n = vq_getchain(vq, idx, iov, VIRTIO_VSOCK_MAXSEGS, NULL);
+	if (n < 1) {
+		vsock->rx_full = true;
+		return -1;
+	}
+
+	return n;
+}
+
+static void
+vsock_rx_fill_hdr(struct virtio_vsock_dev *vsock, struct virtio_vsock_hdr *hdr,
+		uint32_t guest_port, uint32_t host_port, uint16_t op,
+		uint32_t flags, uint32_t len)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->src_cid = VSOCK_CID_HOST;
+	hdr->dst_cid = vsock->cfg.guest_cid;
+	hdr->src_port = host_port;
+	hdr->dst_port = guest_port;
+	hdr->len = len;
+	hdr->type = VSOCK_TYPE_STREAM;
+	hdr->op = op;
+	hdr->flags = flags;
+	hdr->buf_alloc = VSOCK_BUF_ALLOC;
+}
+
+static void
+vsock_rx_put(struct virtio_vsock_dev *vsock, uint16_t idx, struct iovec *iov,
+		int n, struct virtio_vsock_hdr *hdr)
+{
+	vsock_iov_copy(iov, n, 0, hdr, sizeof(*hdr), true);
+	vq_relchain(&vsock->queues[VIRTIO_VSOCK_RXQ], idx,
+		sizeof(*hdr) + hdr->len);
+	vsock->rx_used = true;
+}
+
+/* Send a payload-less packet, false if the guest has no buffer for it */
+static bool
+vsock_rx_ctl(struct virtio_vsock_dev *vsock, struct vsock_conn *conn,
+		uint32_t guest_port, uint32_t host_port, uint16_t op,
+		uint32_t flags)
+{
+	struct iovec iov[VIRTIO_VSOCK_MAXSEGS];
+	struct virtio_vsock_hdr hdr;
+	uint16_t idx;
+	int n;
+
+	n = vsock_rx_getchain(vsock, &idx, iov);
+	if (n < 0)
+		return false;
+
+	vsock_rx_fill_hdr(vsock, &hdr, guest_port, host_port, op, flags, 0);
+	if (conn) {
+		hdr.fwd_cnt = conn->fwd_cnt;
+		conn->fwd_cnt_sent = conn->fwd_cnt;
+	}
+	vsock_rx_put(vsock, idx, iov, n, &hdr);
+
+	return true;
+}
+
+static void
+vsock_rx_done(struct virtio_vsock_dev *vsock)
+{
+	struct virtio_vq_info *vq = &vsock->queues[VIRTIO_VSOCK_RXQ];
+
+	if (vsock->rx_used) {
+		vsock->rx_used = false;
+		vq_endchains(vq, !vq_has_descs(vq));
+	}
+}
+
+static void
+vsock_rx_rsts(struct virtio_vsock_dev *vsock)
+{
+	int i;
+
+	for (i = 0; i < vsock->nrsts; i++) {
+		if (!vsock_rx_ctl(vsock, NULL, vsock->rsts[i].guest_port,
+				vsock->rsts[i].host_port, VSOCK_OP_RST, 0))
+			break;
+	}
+	if (i > 0) {
+		memmove(vsock->rsts, vsock->rsts + i,
+			(vsock->nrsts - i) * sizeof(vsock->rsts[0]));
+		vsock->nrsts -= i;
+	}
+}
+
+/* Send the control packets the connection owes the guest, in order */
+static void
+vsock_conn_rx_ctl(struct vsock_conn *conn)
+{
+	struct virtio_vsock_dev *vsock = conn->vsock;
+	uint32_t bit;
+	uint16_t op;
+
+	while (conn->pending) {
+		if (conn->pending & VSOCK_PEND_RST) {
+			bit = VSOCK_PEND_RST;
+			op = VSOCK_OP_RST;
+		} else if (conn->pending & VSOCK_PEND_REQUEST) {
+			bit = VSOCK_PEND_REQUEST;
+			op = VSOCK_OP_REQUEST;
+		} else if (conn->pending & VSOCK_PEND_RESPONSE) {
+			bit = VSOCK_PEND_RESPONSE;
+			op = VSOCK_OP_RESPONSE;
+		} else if (conn->pending & VSOCK_PEND_CREDIT) {
+			bit = VSOCK_PEND_CREDIT;
+			op = VSOCK_OP_CREDIT_UPDATE;
+		} else {
+			bit = VSOCK_PEND_SHUTDOWN;
+			op = VSOCK_OP_SHUTDOWN;
+		}
+
+		if (!vsock_rx_ctl(vsock, conn, conn->guest_port,
+				conn->host_port, op,
+				(op == VSOCK_OP_SHUTDOWN) ? VSOCK_SHUTDOWN_SEND : 0))
+			break;
+		conn->pending &= ~bit;
+
+		if (op == VSOCK_OP_RST) {
+			vsock_conn_free(conn);
+			break;
+		}
+	}
+}
+
+/* Read the socket right into the RX buffers, within the credit of the guest */
+static void
+vsock_conn_rx_data(struct vsock_conn *conn)
+{
+	struct virtio_vsock_dev *vsock = conn->vsock;
+	struct iovec iov[VIRTIO_VSOCK_MAXSEGS], data[VIRTIO_VSOCK_MAXSEGS];
+	struct virtio_vsock_hdr hdr;
+	uint32_t in_flight, credit;
+	uint16_t idx;
+	ssize_t len;
+	int n, ndata;
+
+	while ((conn->state == VSOCK_CONN_ESTABLISHED) && !conn->eof &&
+	       !conn->guest_shut_rcv && !conn->pending) {
+		in_flight = conn->tx_cnt - conn->peer_fwd_cnt;
+		if (in_flight >= conn->peer_buf_alloc)
+			break;
+		credit = conn->peer_buf_alloc - in_flight;
+
+		n = vsock_rx_getchain(vsock, &idx, iov);
+		if (n < 0)
+			break;
+
+		ndata = vsock_iov_slice(iov, n, sizeof(hdr), credit, data);
+		if (ndata == 0) {
+			vq_retchain(&vsock->queues[VIRTIO_VSOCK_RXQ]);
+			WPRINTF(("vsock: RX buffer too small\n"));
+			break;
+		}
+
+		len = readv(conn->fd, data, ndata);
+		if (len <= 0) {
+			vq_retchain(&vsock->queues[VIRTIO_VSOCK_RXQ]);
+			if ((len < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+				break;
+			/* the other end is done sending */
+			conn->eof = true;
+			conn->pending |= VSOCK_PEND_SHUTDOWN;
+			break;
+		}
+
+		vsock_rx_fill_hdr(vsock, &hdr, conn->guest_port,
+			conn->host_port, VSOCK_OP_RW, 0, len);
+		hdr.fwd_cnt = conn->fwd_cnt;
+		conn->fwd_cnt_sent = conn->fwd_cnt;
+		conn->pending &= ~VSOCK_PEND_CREDIT;
+		conn->tx_cnt += len;
+		vsock_rx_put(vsock, idx, iov, n, &hdr);
+	}
+}
+
+/* Wait for what the connection can make progress on next */
+static void
+vsock_conn_update_events(struct vsock_conn *conn)
+{
+	struct virtio_vsock_dev *vsock = conn->vsock;
+	uint32_t events = 0;
+
+	if ((conn->state != VSOCK_CONN_ESTABLISHED) || (conn->fd < 0))
+		return;
+
+	if (!conn->eof && !conn->guest_shut_rcv && !conn->pending &&
+	    !vsock->rx_full &&
+	    (conn->tx_cnt - conn->peer_fwd_cnt < conn->peer_buf_alloc))
+		events |= EPOLLIN;
+	if (conn->backlog_len > 0)
+		events |= EPOLLOUT;
+
+	if (events == conn->aevt.events)
+		return;
+
+	if (events == 0) {
+		iothread_del(vsock->ioctx, conn->fd);
+		conn->aevt.events = 0;
+	} else if (conn->aevt.events == 0) {
+		conn->aevt.events = events;
+		if (iothread_add(vsock->ioctx, conn->fd, &conn->aevt) < 0) {
+			conn->aevt.events = 0;
+			vsock_conn_reset(conn);
+		}
+	} else {
+		conn->aevt.events = events;
+		iothread_mod(vsock->ioctx, conn->fd, &conn->aevt);
+	}
+}
+
+static void
+vsock_conn_kick(struct vsock_conn *conn)
+{
+	vsock_conn_rx_ctl(conn);
+	if (conn->state == VSOCK_CONN_FREE)
+		return;
+	vsock_conn_rx_data(conn);
+	vsock_conn_rx_ctl(conn);
+	if (conn->state == VSOCK_CONN_FREE)
+		return;
+	vsock_conn_update_events(conn);
+}
+
+static void
+vsock_kick_all(struct virtio_vsock_dev *vsock)
+{
+	struct vsock_conn *conn;
+	int i;
+
+	vsock_rx_rsts(vsock);
+	for (i = 0; i < VSOCK_MAX_CONNS; i++) {
+		conn = &vsock->conns[i];
+		if (conn->state != VSOCK_CONN_FREE)
+			vsock_conn_kick(conn);
+	}
+}
+
+static void
+vsock_conn_credit(struct vsock_conn *conn)
+{
+	if (conn->fwd_cnt - conn->fwd_cnt_sent >= VSOCK_CREDIT_THRESH)
+		conn->pending |= VSOCK_PEND_CREDIT;
+}
+
+static ssize_t
+vsock_conn_send(struct vsock_conn *conn, struct iovec *iov, int niov)
+{
+	struct msghdr msg;
+	ssize_t len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = niov;
+	len = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if ((len < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+		len = 0;
+
+	return len;
+}
+
+/* Write what the socket did not take before */
+static void
+vsock_conn_drain(struct vsock_conn *conn)
+{
+	struct iovec iov;
+	ssize_t len;
+
+	if ((conn->fd < 0) || (conn->backlog_len == 0))
+		return;
+
+	iov.iov_base = conn->backlog;
+	iov.iov_len = conn->backlog_len;
+	len = vsock_conn_send(conn, &iov, 1);
+	if (len < 0) {
+		vsock_conn_reset(conn);
+		return;
+	}
+
+	conn->backlog_len -= len;
+	memmove(conn->backlog, conn->backlog + len, conn->backlog_len);
+	conn->fwd_cnt += len;
+	vsock_conn_credit(conn);
+
+	if ((conn->backlog_len == 0) && conn->guest_shut_send)
+		shutdown(conn->fd, SHUT_WR);
+}
+
+/* Forward the payload of an RW packet of the guest to the socket */
+static void
+vsock_conn_tx_data(struct vsock_conn *conn, struct iovec *iov, int niov,
+		uint32_t len)
+{
+	struct iovec data[VIRTIO_VSOCK_MAXSEGS];
+	ssize_t sent = 0;
+	size_t left;
+	int ndata;
+
+	ndata = vsock_iov_slice(iov, niov, sizeof(struct virtio_vsock_hdr),
+			len, data);
+	if ((ndata == 0) || (conn->fd < 0) || conn->guest_shut_send)
+		return;
+
+	if (conn->backlog_len + len > VSOCK_BUF_ALLOC) {
+		WPRINTF(("vsock: the guest overran its credit\n"));
+		vsock_conn_reset(conn);
+		return;
+	}
+
+	if (conn->backlog_len == 0) {
+		sent = vsock_conn_send(conn, data, ndata);
+		if (sent < 0) {
+			vsock_conn_reset(conn);
+			return;
+		}
+		conn->fwd_cnt += sent;
+		vsock_conn_credit(conn);
+	}
+
+	left = 0;
+	for (; ndata > 0; ndata--)
+		left += data[ndata - 1].iov_len;
+	left -= sent;
+	if (left == 0)
+		return;
+
+	if (conn->backlog == NULL) {
+		conn->backlog = malloc(VSOCK_BUF_ALLOC);
+		if (conn->backlog == NULL) {
+			vsock_conn_reset(conn);
+			return;
+		}
+	}
+	vsock_iov_copy(iov, niov, sizeof(struct virtio_vsock_hdr) + sent,
+		conn->backlog + conn->backlog_len, left, false);
+	conn->backlog_len += left;
+}
+
+static struct vsock_port *
+vsock_port_find(struct virtio_vsock_dev *vsock, uint32_t port)
+{
+	int i;
+
+	for (i = 0; i < vsock->nports; i++) {
+		if ((vsock->ports[i].listen_fd < 0) &&
+		    (vsock->ports[i].port == port))
+			return &vsock->ports[i];
+	}
+
+	return NULL;
+}
+
+/* A connection request of the guest to a port of the host */
+static struct vsock_conn *
+vsock_conn_connect(struct virtio_vsock_dev *vsock, struct virtio_vsock_hdr *hdr)
+{
+	struct sockaddr_un addr;
+	struct vsock_port *port;
+	struct vsock_conn *conn;
+	int fd;
+
+	port = vsock_port_find(vsock, hdr->dst_port);
+	if (port == NULL)
+		return NULL;
+
+	/* a full backlog of the listener refuses rather than blocks */
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return NULL;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	/* port->path has the size of sun_path and is NUL terminated */
+	memcpy(addr.sun_path, port->path, sizeof(addr.sun_path));
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		DPRINTF(("vsock: connect to %s failed: %s\n", port->path,
+			strerror(errno)));
+		close(fd);
+		return NULL;
+	}
+
+	conn = vsock_conn_alloc(vsock, fd, hdr->src_port, hdr->dst_port);
+	if (conn == NULL) {
+		close(fd);
+		return NULL;
+	}
+	conn->state = VSOCK_CONN_ESTABLISHED;
+	conn->pending = VSOCK_PEND_RESPONSE;
+
+	DPRINTF(("vsock: guest port %u connected to %s\n", conn->guest_port,
+		port->path));
+	return conn;
+}
+
+static void
+vsock_tx_pkt(struct virtio_vsock_dev *vsock, struct virtio_vsock_hdr *hdr,
+		struct iovec *iov, int niov)
+{
+	struct vsock_conn *conn;
+
+	if ((hdr->src_cid != vsock->cfg.guest_cid) ||
+	    (hdr->dst_cid != VSOCK_CID_HOST))
+		return;
+
+	if (hdr->type != VSOCK_TYPE_STREAM) {
+		if (hdr->op != VSOCK_OP_RST)
+			vsock_queue_rst(vsock, hdr->src_port, hdr->dst_port);
+		return;
+	}
+
+	conn = vsock_conn_find(vsock, hdr->src_port, hdr->dst_port);
+	if (conn == NULL) {
+		if (hdr->op == VSOCK_OP_REQUEST)
+			conn = vsock_conn_connect(vsock, hdr);
+		if ((conn == NULL) && (hdr->op != VSOCK_OP_RST))
+			vsock_queue_rst(vsock, hdr->src_port, hdr->dst_port);
+		if (conn == NULL)
+			return;
+	}
+
+	conn->peer_buf_alloc = hdr->buf_alloc;
+	conn->peer_fwd_cnt = hdr->fwd_cnt;
+
+	switch (hdr->op) {
+	case VSOCK_OP_REQUEST:
+		break;
+	case VSOCK_OP_RESPONSE:
+		if (conn->state == VSOCK_CONN_CONNECTING)
+			conn->state = VSOCK_CONN_ESTABLISHED;
+		break;
+	case VSOCK_OP_RW:
+		if (conn->state == VSOCK_CONN_ESTABLISHED)
+			vsock_conn_tx_data(conn, iov, niov, hdr->len);
+		break;
+	case VSOCK_OP_CREDIT_UPDATE:
+		break;
+	case VSOCK_OP_CREDIT_REQUEST:
+		conn->pending |= VSOCK_PEND_CREDIT;
+		break;
+	case VSOCK_OP_SHUTDOWN:
+		if (hdr->flags & VSOCK_SHUTDOWN_RCV)
+			conn->guest_shut_rcv = true;
+		if (hdr->flags & VSOCK_SHUTDOWN_SEND) {
+			conn->guest_shut_send = true;
+			if ((conn->fd >= 0) && (conn->backlog_len == 0))
+				shutdown(conn->fd, SHUT_WR);
+		}
+		/* the guest closed, it waits for the RST */
+		if (conn->guest_shut_rcv && conn->guest_shut_send)
+			vsock_conn_reset(conn);
+		break;
+	case VSOCK_OP_RST:
+		vsock_conn_free(conn);
+		return;
+	default:
+		vsock_conn_reset(conn);
+		break;
+	}
+
+	vsock_conn_kick(conn);
+}
+
+static void
+virtio_vsock_tx_notify(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_vsock_dev *vsock = vdev;
+	struct iovec iov[VIRTIO_VSOCK_MAXSEGS];
+	struct virtio_vsock_hdr hdr;
+	uint16_t idx;
+	int n;
+
+	pthread_mutex_lock(&vsock->mtx);
+	vsock_rx_rsts(vsock);
+	while (vq_has_descs(vq)) {
+		n = vq_getchain(vq, &idx, iov, VIRTIO_VSOCK_MAXSEGS, NULL);
+		if (n < 1) {
+			WPRINTF(("vsock: failed to get a TX chain\n"));
+			break;
+		}
+
+		/* The payload goes to the socket before the chain is released */
+		if (vsock_iov_copy(iov, n, 0, &hdr, sizeof(hdr), false) ==
+		    sizeof(hdr))
+			vsock_tx_pkt(vsock, &hdr, iov, n);
+		vq_relchain(vq, idx, 0);
+	}
+	vq_endchains(vq, 1);
+	vsock_rx_rsts(vsock);
+	vsock_rx_done(vsock);
+	pthread_mutex_unlock(&vsock->mtx);
+}
+
+static void
+virtio_vsock_rx_notify(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_vsock_dev *vsock = vdev;
+
+	pthread_mutex_lock(&vsock->mtx);
+	if (vsock->rx_full) {
+		vsock->rx_full = false;
+		vsock_kick_all(vsock);
+		vsock_rx_done(vsock);
+	}
+	pthread_mutex_unlock(&vsock->mtx);
+}
+
+static void
+virtio_vsock_evt_notify(void *vdev, struct virtio_vq_info *vq)
+{
+	/* no event is sent: the transport is never reset under the guest */
+}
+
+static void
+vsock_conn_event(void *arg)
+{
+	struct vsock_conn *conn = arg;
+	struct virtio_vsock_dev *vsock = conn->vsock;
+
+	pthread_mutex_lock(&vsock->mtx);
+	if ((conn->state != VSOCK_CONN_FREE) && (conn->fd >= 0)) {
+		vsock_conn_drain(conn);
+		vsock_conn_kick(conn);
+		vsock_rx_done(vsock);
+	}
+	pthread_mutex_unlock(&vsock->mtx);
+}
+
+static uint32_t
+vsock_alloc_host_port(struct virtio_vsock_dev *vsock, uint32_t guest_port)
+{
+	uint32_t port;
+
+	do {
+		port = vsock->next_host_port++;
+		if (vsock->next_host_port == 0)
+			vsock->next_host_port = VSOCK_HOST_PORT_BASE;
+	} while (vsock_conn_find(vsock, guest_port, port));
+
+	return port;
+}
+
+/* A client of a listen= socket, connect it to the port of the guest */
+static void
+vsock_port_accept(void *arg)
+{
+	struct vsock_port *port = arg;
+	struct virtio_vsock_dev *vsock = port->vsock;
+	struct vsock_conn *conn;
+	int fd;
+
+	pthread_mutex_lock(&vsock->mtx);
+	while ((fd = accept4(port->listen_fd, NULL, NULL,
+			SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		conn = vsock_conn_alloc(vsock, fd, port->port,
+				vsock_alloc_host_port(vsock, port->port));
+		if (conn == NULL) {
+			close(fd);
+			continue;
+		}
+		conn->state = VSOCK_CONN_CONNECTING;
+		conn->pending = VSOCK_PEND_REQUEST;
+		vsock_conn_kick(conn);
+	}
+	vsock_rx_done(vsock);
+	pthread_mutex_unlock(&vsock->mtx);
+}
+
+static int
+vsock_port_listen(struct virtio_vsock_dev *vsock, struct vsock_port *port)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	/* port->path has the size of sun_path and is NUL terminated */
+	memcpy(addr.sun_path, port->path, sizeof(addr.sun_path));
+	unlink(port->path);
+	if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+	    (listen(fd, VSOCK_LISTEN_BACKLOG) < 0)) {
+		WPRINTF(("vsock: failed to listen at %s: %s\n", port->path,
+			strerror(errno)));
+		close(fd);
+		return -1;
+	}
+
+	port->listen_fd = fd;
+	port->aevt.run = vsock_port_accept;
+	port->aevt.arg = port;
+	port->aevt.fd = fd;
+	port->aevt.events = EPOLLIN;
+	if (iothread_add(vsock->ioctx, fd, &port->aevt) < 0) {
+		close(fd);
+		port->listen_fd = -1;
+		unlink(port->path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* port=<p>:<path> or listen=<p>:<path> */
+static int
+vsock_parse_port(struct virtio_vsock_dev *vsock, char *opt, bool listen)
+{
+	struct vsock_port *port;
+	char *path;
+	uint32_t p;
+
+	if (vsock->nports == VSOCK_MAX_PORTS) {
+		WPRINTF(("vsock: at most %d ports\n", VSOCK_MAX_PORTS));
+		return -1;
+	}
+
+	path = strchr(opt, ':');
+	if ((path == NULL) || (path[1] == '\0')) {
+		WPRINTF(("vsock: a port needs <port>:<path>\n"));
+		return -1;
+	}
+	*path++ = '\0';
+	if (dm_strtoui(opt, NULL, 10, &p) ||
+	    (strlen(path) >= sizeof(port->path))) {
+		WPRINTF(("vsock: invalid port %s:%s\n", opt, path));
+		return -1;
+	}
+
+	port = &vsock->ports[vsock->nports];
+	port->port = p;
+	strncpy(port->path, path, sizeof(port->path) - 1);
+	port->listen_fd = -1;
+	port->vsock = vsock;
+	if (listen && (vsock_port_listen(vsock, port) < 0))
+		return -1;
+	vsock->nports++;
+
+	return 0;
+}
+
+static void
+vsock_close_all(struct virtio_vsock_dev *vsock)
+{
+	int i;
+
+	for (i = 0; i < VSOCK_MAX_CONNS; i++) {
+		if (vsock->conns[i].state != VSOCK_CONN_FREE)
+			vsock_conn_free(&vsock->conns[i]);
+	}
+	vsock->nrsts = 0;
+	vsock->rx_full = false;
+	vsock->rx_used = false;
+}
+
+static void
+virtio_vsock_reset(void *vdev)
+{
+	struct virtio_vsock_dev *vsock = vdev;
+
+	DPRINTF(("vsock: device reset requested\n"));
+	pthread_mutex_lock(&vsock->mtx);
+	vsock_close_all(vsock);
+	virtio_reset_dev(&vsock->base);
+	pthread_mutex_unlock(&vsock->mtx);
+}
+
+static int
+virtio_vsock_read_cfg(void *vdev, int offset, int size, uint32_t *retval)
+{
+	struct virtio_vsock_dev *vsock = vdev;
+	void *ptr;
+
+	ptr = (uint8_t *)&vsock->cfg + offset;
+	memcpy(retval, ptr, size);
+
+	return 0;
+}
+
+static struct virtio_ops virtio_vsock_ops = {
+	"virtio-vsock",			/* our name */
+	VIRTIO_VSOCK_MAXQ,		/* we support 3 virtqueues */
+	sizeof(struct virtio_vsock_cfg), /* config reg size */
+	virtio_vsock_reset,		/* reset */
+	NULL,				/* device-wide qnotify -- not used */
+	virtio_vsock_read_cfg,		/* read PCI config */
+	NULL,				/* write PCI config */
+	NULL,				/* apply negotiated features */
+	NULL,				/* called on guest set status */
+};
+
+static void
+vsock_close_ports(struct virtio_vsock_dev *vsock)
+{
+	struct vsock_port *port;
+	int i;
+
+	for (i = 0; i < vsock->nports; i++) {
+		port = &vsock->ports[i];
+		if (port->listen_fd >= 0) {
+			iothread_del(vsock->ioctx, port->listen_fd);
+			close(port->listen_fd);
+			unlink(port->path);
+			port->listen_fd = -1;
+		}
+	}
+	vsock->nports = 0;
+}
+
+static int
+virtio_vsock_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_vsock_dev *vsock;
+	struct iothreads_info iothreads;
+	bool use_iothread = false;
+	pthread_mutexattr_t attr;
+	char *devopts, *tmp, *opt;
+	uint64_t cid = 0;
+	int i, rc = -1;
+
+	if (opts == NULL) {
+		WPRINTF(("vsock: must have a valid guest cid\n"));
+		return -1;
+	}
+
+	vsock = calloc(1, sizeof(struct virtio_vsock_dev));
+	if (!vsock) {
+		WPRINTF(("vsock: memory allocate failed\n"));
+		return -1;
+	}
+	vsock->next_host_port = VSOCK_HOST_PORT_BASE;
+	for (i = 0; i < VSOCK_MAX_CONNS; i++) {
+		vsock->conns[i].vsock = vsock;
+		vsock->conns[i].fd = -1;
+		vsock->conns[i].aevt.run = vsock_conn_event;
+		vsock->conns[i].aevt.arg = &vsock->conns[i];
+	}
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&vsock->mtx, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	/* The iothread option comes first, the ports are watched by it */
+	devopts = tmp = strdup(opts);
+	if (!devopts) {
+		WPRINTF(("vsock: strdup failed\n"));
+		goto fail;
+	}
+	while ((opt = strsep(&tmp, ",")) != NULL) {
+		if (!strncmp(opt, "iothread", strlen("iothread"))) {
+			if (iothread_parse_options(opt, &iothreads) < 0) {
+				WPRINTF(("vsock: invalid iothread option %s\n",
+					opt));
+				goto fail;
+			}
+			use_iothread = true;
+			vsock->ioctx = iothreads.ioctx_base[0];
+		} else if (!strncmp(opt, "cid=", strlen("cid="))) {
+			if (dm_strtoul(opt + strlen("cid="), NULL, 10, &cid))
+				cid = 0;
+		} else if (!strncmp(opt, "port=", strlen("port="))) {
+			if (vsock_parse_port(vsock, opt + strlen("port="),
+					false) < 0)
+				goto fail;
+		} else if (!strncmp(opt, "listen=", strlen("listen="))) {
+			if (vsock_parse_port(vsock, opt + strlen("listen="),
+					true) < 0)
+				goto fail;
+		} else if (*opt != '\0') {
+			WPRINTF(("vsock: unknown option %s\n", opt));
+			goto fail;
+		}
+	}
+
+	if (cid <= VSOCK_CID_HOST || cid >= UINT32_MAX) {
+		WPRINTF(("vsock: guest cid has to be 0x3~0xfffffffe\n"));
+		goto fail;
+	}
+	vsock->cfg.guest_cid = cid;
+
+	virtio_linkup(&vsock->base, &virtio_vsock_ops, vsock, dev,
+		vsock->queues, BACKEND_VBSU);
+	vsock->base.mtx = &vsock->mtx;
+	vsock->base.device_caps = VIRTIO_VSOCK_S_HOSTCAPS;
+	vsock->base.iothread = use_iothread;
+	if (use_iothread)
+		vsock->base.iothreads = iothreads;
+
+	for (i = 0; i < VIRTIO_VSOCK_MAXQ; i++)
+		vsock->queues[i].qsize = VIRTIO_VSOCK_RINGSZ;
+	vsock->queues[VIRTIO_VSOCK_RXQ].notify = virtio_vsock_rx_notify;
+	vsock->queues[VIRTIO_VSOCK_TXQ].notify = virtio_vsock_tx_notify;
+	vsock->queues[VIRTIO_VSOCK_EVTQ].notify = virtio_vsock_evt_notify;
+
+	/* initialize config space */
+	pci_set_cfgdata16(dev, PCIR_DEVICE, VIRTIO_DEV_VSOCK);
+	pci_set_cfgdata16(dev, PCIR_VENDOR, VIRTIO_VENDOR);
+	pci_set_cfgdata8(dev, PCIR_CLASS, PCIC_NETWORK);
+	pci_set_cfgdata16(dev, PCIR_REVID, 1);
+
+	virtio_set_modern_bar(&vsock->base, false);
+
+	if (virtio_interrupt_init(&vsock->base, virtio_uses_msix()))
+		goto fail;
+
+	rc = 0;
+fail:
+	free(devopts);
+	if (rc < 0) {
+		vsock_close_ports(vsock);
+		if (use_iothread)
+			iothread_release(&iothreads);
+		pthread_mutex_destroy(&vsock->mtx);
+		free(vsock);
+		dev->arg = NULL;
+	}
+	return rc;
+}
+
+static void
+virtio_vsock_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_vsock_dev *vsock = dev->arg;
+
+	if (vsock == NULL)
+		return;
+
+	pthread_mutex_lock(&vsock->mtx);
+	vsock_close_ports(vsock);
+	vsock_close_all(vsock);
+	pthread_mutex_unlock(&vsock->mtx);
+	/* re-created by the init of the next guest boot */
+	if (vsock->base.iothread)
+		iothread_release(&vsock->base.iothreads);
+	pthread_mutex_destroy(&vsock->mtx);
+	free(vsock);
+	dev->arg = NULL;
+}
+
+struct pci_vdev_ops pci_ops_virtio_vsock = {
+	.class_name	= "virtio-vsock",
+	.vdev_init	= virtio_vsock_init,
+	.vdev_deinit	= virtio_vsock_deinit,
+	.vdev_barwrite	= virtio_pci_write,
+	.vdev_barread	= virtio_pci_read
+};
+DEFINE_PCI_DEVTYPE(pci_ops_virtio_vsock);
@@ -430,6 +430,12 @@ struct pci_xhci_vdev {
 	int		vbdp_dev_num;
 	struct pci_xhci_vbdp_dev_state vbdp_devs[XHCI_MAX_VIRT_PORTS];
 
+	/* interrupter moderation, see pci_xhci_assert_interrupt() */
+	pthread_mutex_t	intr_mtx;
+	struct acrn_timer intr_timer;
+	struct timespec	last_intr;
+	bool		intr_deferred;
+
 	pthread_t	async_thread;
 	bool	async_transfer;
 	pthread_cond_t	async_cond;
@@ -1566,13 +1572,8 @@ pci_xhci_trb_next(struct pci_xhci_vdev *xdev,
 }
 
 static void
-pci_xhci_assert_interrupt(struct pci_xhci_vdev *xdev)
+pci_xhci_fire_interrupt(struct pci_xhci_vdev *xdev)
 {
-
-	xdev->rtsregs.intrreg.erdp |= XHCI_ERDP_LO_BUSY;
-	xdev->rtsregs.intrreg.iman |= XHCI_IMAN_INTR_PEND;
-	xdev->opregs.usbsts |= XHCI_STS_EINT;
-
 	/* only trigger interrupt if permitted */
 	if ((xdev->opregs.usbcmd & XHCI_CMD_INTE) &&
 	    (xdev->rtsregs.intrreg.iman & XHCI_IMAN_INTR_ENA)) {
@@ -1583,6 +1584,65 @@ pci_xhci_assert_interrupt(struct pci_xhci_vdev *xdev)
 	}
 }
 
+static void
+pci_xhci_intr_timer_handler(void *arg, uint64_t nexp)
+{
+	struct pci_xhci_vdev *xdev;
+
+	xdev = arg;
+	pthread_mutex_lock(&xdev->intr_mtx);
+	xdev->intr_deferred = false;
+	clock_gettime(CLOCK_MONOTONIC, &xdev->last_intr);
+	pthread_mutex_unlock(&xdev->intr_mtx);
+
+	/* the guest may have handled the events meanwhile */
+	if (xdev->rtsregs.intrreg.iman & XHCI_IMAN_INTR_PEND)
+		pci_xhci_fire_interrupt(xdev);
+}
+
+/*
+ * The interrupts are moderated as the interval of IMOD asks (xHCI spec
+ * 4.17.2): an interrupt raised sooner than the interval after the previous
+ * one is deferred to the end of the interval, the events inserted in the
+ * meantime are signaled by it as well.
+ */
+static void
+pci_xhci_assert_interrupt(struct pci_xhci_vdev *xdev)
+{
+	struct itimerspec delay;
+	struct timespec now;
+	uint64_t interval, elapsed;
+
+	xdev->rtsregs.intrreg.erdp |= XHCI_ERDP_LO_BUSY;
+	xdev->rtsregs.intrreg.iman |= XHCI_IMAN_INTR_PEND;
+	xdev->opregs.usbsts |= XHCI_STS_EINT;
+
+	interval = XHCI_IMOD_IVAL_GET(xdev->rtsregs.intrreg.imod) * 250UL;
+
+	pthread_mutex_lock(&xdev->intr_mtx);
+	if (xdev->intr_deferred) {
+		pthread_mutex_unlock(&xdev->intr_mtx);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - xdev->last_intr.tv_sec) * 1000000000UL +
+		now.tv_nsec - xdev->last_intr.tv_nsec;
+	if (interval && (elapsed < interval)) {
+		memset(&delay, 0, sizeof(delay));
+		delay.it_value.tv_nsec = interval - elapsed;
+		if (acrn_timer_settime(&xdev->intr_timer, &delay) == 0) {
+			xdev->intr_deferred = true;
+			pthread_mutex_unlock(&xdev->intr_mtx);
+			return;
+		}
+	}
+	xdev->last_intr = now;
+	pthread_mutex_unlock(&xdev->intr_mtx);
+
+	pci_xhci_fire_interrupt(xdev);
+}
+
 static void
 pci_xhci_deassert_interrupt(struct pci_xhci_vdev *xdev)
 {
@@ -2976,8 +3036,9 @@ pci_xhci_xfer_complete(struct pci_xhci_vdev *xdev, struct usb_xfer *xfer,
 			edtla = 0;
 		}
 
+		/* one interrupt for all the events, raised by the caller */
 		*do_intr = 1;
-		if (pci_xhci_insert_event(xdev, &evtrb, 1) != 0) {
+		if (pci_xhci_insert_event(xdev, &evtrb, 0) != 0) {
 			UPRINTF(LFTL, "Failed to inject xfer complete event!\r\n");
 			return err;
 		}
@@ -3066,7 +3127,7 @@ pci_xhci_try_usb_xfer(struct pci_xhci_vdev *xdev,
 		else if (dev->dev_ue->ue_devtype == USB_DEV_STATIC) {
 			err = pci_xhci_xfer_complete(xdev, xfer, slot, epid,
 						     &do_intr);
-			if (err == XHCI_TRB_ERROR_SUCCESS && do_intr)
+			if (do_intr)
 				pci_xhci_assert_interrupt(xdev);
 
 			pci_xhci_free_usb_xfer(dev, devep->ep_xfer);
@@ -3100,10 +3161,28 @@ pci_xhci_handle_transfer(struct pci_xhci_vdev *xdev,
 	uint32_t		trbflags;
 	int			do_intr, err;
 	int			do_retry;
+	bool			batch_tds;
 
 	ep_ctx->dwEpCtx0 = FIELD_REPLACE(ep_ctx->dwEpCtx0,
 					 XHCI_ST_EPCTX_RUNNING, 0x7, 0);
 
+	/*
+	 * The TDs of the bulk and interrupt endpoints of a passthrough
+	 * device are gathered up to the end of the ring and handed to it at
+	 * once, it keeps a transfer in flight for each of them.
+	 */
+	switch (XHCI_EPCTX_1_EPTYPE_GET(ep_ctx->dwEpCtx1)) {
+	case XHCI_EPTYPE_BULK_OUT:
+	case XHCI_EPTYPE_INT_OUT:
+	case XHCI_EPTYPE_BULK_IN:
+	case XHCI_EPTYPE_INT_IN:
+		batch_tds = (dev->dev_ue->ue_devtype == USB_DEV_PORT_MAPPER);
+		break;
+	default:
+		batch_tds = false;
+		break;
+	}
+
 	xfer = devep->ep_xfer;
 	pthread_mutex_lock(&devep->mtx);
 
@@ -3301,6 +3380,9 @@ retry:
 		if (XHCI_TRB_3_TYPE_GET(trbflags) == XHCI_TRB_TYPE_EVENT_DATA)
 			continue;
 
+		if (batch_tds)
+			continue;
+
 		/* handle current batch that requires interrupt on complete */
 		if (trbflags & XHCI_TRB_3_IOC_BIT) {
 			UPRINTF(LDBG, "trb IOC bit set\r\n");
@@ -4481,27 +4563,49 @@ pci_xhci_async_enqueue(struct pci_xhci_vdev *xdev, uint64_t offset, uint64_t val
 	pthread_mutex_unlock(&xdev->async_tmx);
 }
 
+/*
+ * The doorbells rung while the previous ones were handled are handled as a
+ * batch under one lock of the controller. A doorbell rung again in the
+ * batch is handled once: the ring is walked up to its end, through the TRBs
+ * the second ring announced as well.
+ */
 static void *
 pci_xhci_ansyc_thread(void *data)
 {
 	struct pci_xhci_vdev *xdev;
-	struct pci_xhci_async_request_node *request;
+	struct pci_xhci_async_request_node *request, *prev;
+	STAILQ_HEAD(, pci_xhci_async_request_node) batch;
 
 	xdev = data;
+	STAILQ_INIT(&batch);
 	pthread_mutex_lock(&xdev->async_tmx);
 	while (xdev->async_transfer || !STAILQ_EMPTY(&xdev->async_head)) {
 		if(STAILQ_EMPTY(&xdev->async_head))
 			pthread_cond_wait(&xdev->async_cond, &xdev->async_tmx);
-		if ((request = STAILQ_FIRST(&xdev->async_head)) == NULL) {
+		if (STAILQ_EMPTY(&xdev->async_head))
 			continue;
-		}
+		STAILQ_CONCAT(&batch, &xdev->async_head);
 		pthread_mutex_unlock(&xdev->async_tmx);
+
 		pthread_mutex_lock(&xdev->mtx);
-		pci_xhci_dbregs_write(xdev, request->offset, request->value);
+		STAILQ_FOREACH(request, &batch, link) {
+			STAILQ_FOREACH(prev, &batch, link) {
+				if ((prev == request) ||
+				    ((prev->offset == request->offset) &&
+				     (prev->value == request->value)))
+					break;
+			}
+			if (prev == request)
+				pci_xhci_dbregs_write(xdev, request->offset,
+						request->value);
+		}
 		pthread_mutex_unlock(&xdev->mtx);
+
+		while ((request = STAILQ_FIRST(&batch)) != NULL) {
+			STAILQ_REMOVE_HEAD(&batch, link);
+			free(request);
+		}
 		pthread_mutex_lock(&xdev->async_tmx);
-		STAILQ_REMOVE_HEAD(&xdev->async_head, link);
-		free(request);
 	}
 	pthread_mutex_unlock(&xdev->async_tmx);
 	return NULL;
@@ -4629,6 +4733,13 @@ pci_xhci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 	pthread_mutex_init(&xdev->mtx, NULL);
 
+	pthread_mutex_init(&xdev->intr_mtx, NULL);
+	xdev->intr_timer.clockid = CLOCK_MONOTONIC;
+	error = acrn_timer_init(&xdev->intr_timer, pci_xhci_intr_timer_handler,
+			xdev);
+	if (error)
+		goto done;
+
 	/* create vbdp_thread */
 	xdev->vbdp_polling = true;
 	sem_init(&xdev->vbdp_sem, 0, 0);
@@ -4709,6 +4820,9 @@ pci_xhci_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	pthread_cond_destroy(&xdev->async_cond);
 	pthread_mutex_destroy(&xdev->async_tmx);
 
+	acrn_timer_deinit(&xdev->intr_timer);
+	pthread_mutex_destroy(&xdev->intr_mtx);
+
 	pthread_mutex_destroy(&xdev->mtx);
 	free(xdev);
 	xhci_in_use = 0;
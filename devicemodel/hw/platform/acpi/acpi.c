@@ -74,6 +74,7 @@
 #include "vssram.h"
 #include "vmmapi.h"
 #include "mmio_dev.h"
+#include "numa.h"
 
 /*
  * Define the base address of the ACPI tables, and the offsets to
@@ -91,7 +92,9 @@
 #define NHLT_OFFSET		0x400
 #define TPM2_OFFSET		0xC00
 #define RTCT_OFFSET		0xF00
-#define DSDT_OFFSET		0x1100
+#define SRAT_OFFSET		0x1100
+#define SLIT_OFFSET		0x1900
+#define DSDT_OFFSET		0x1A00
 
 #define	ASL_TEMPLATE	"dm.XXXXXXX"
 #define ASL_SUFFIX	".aml"
@@ -196,6 +199,13 @@ basl_fwrite_rsdt(FILE *fp, struct vmctx *ctx)
 			    basl_acpi_base + RTCT_OFFSET);
 	}
 
+	if (acpi_table_is_valid(SRAT_ENTRY_NO)) {
+		EFPRINTF(fp, "[0004]\t\tACPI Table Address %u : %08X\n", num++,
+			    basl_acpi_base + SRAT_OFFSET);
+		EFPRINTF(fp, "[0004]\t\tACPI Table Address %u : %08X\n", num++,
+			    basl_acpi_base + SLIT_OFFSET);
+	}
+
 	EFFLUSH(fp);
 
 	return 0;
@@ -243,6 +253,13 @@ basl_fwrite_xsdt(FILE *fp, struct vmctx *ctx)
 			    basl_acpi_base + RTCT_OFFSET);
 	}
 
+	if (acpi_table_is_valid(SRAT_ENTRY_NO)) {
+		EFPRINTF(fp, "[0004]\t\tACPI Table Address %u : 00000000%08X\n", num++,
+			    basl_acpi_base + SRAT_OFFSET);
+		EFPRINTF(fp, "[0004]\t\tACPI Table Address %u : 00000000%08X\n", num++,
+			    basl_acpi_base + SLIT_OFFSET);
+	}
+
 	EFFLUSH(fp);
 
 	return 0;
@@ -681,6 +698,117 @@ basl_fwrite_mcfg(FILE *fp, struct vmctx *ctx)
 	return 0;
 }
 
+/* A proximity domain per virtual node, see numa.c */
+static int
+basl_fwrite_srat(FILE *fp, struct vmctx *ctx)
+{
+	struct numa_mem_range ranges[2];
+	uint64_t guest_pcpu_bitmask;
+	int i, v, nr, pcpu_id, lapic_id;
+
+	guest_pcpu_bitmask = vm_get_cpu_affinity_dm();
+
+	EFPRINTF(fp, "/*\n");
+	EFPRINTF(fp, " * dm SRAT template\n");
+	EFPRINTF(fp, " */\n");
+	EFPRINTF(fp, "[0004]\t\tSignature : \"SRAT\"\n");
+	EFPRINTF(fp, "[0004]\t\tTable Length : 00000000\n");
+	EFPRINTF(fp, "[0001]\t\tRevision : 03\n");
+	EFPRINTF(fp, "[0001]\t\tChecksum : 00\n");
+	EFPRINTF(fp, "[0006]\t\tOem ID : \"DM \"\n");
+	EFPRINTF(fp, "[0008]\t\tOem Table ID : \"DMSRAT  \"\n");
+	EFPRINTF(fp, "[0004]\t\tOem Revision : 00000001\n");
+
+	/* iasl will fill in the compiler ID/revision fields */
+	EFPRINTF(fp, "[0004]\t\tAsl Compiler ID : \"xxxx\"\n");
+	EFPRINTF(fp, "[0004]\t\tAsl Compiler Revision : 00000000\n");
+	EFPRINTF(fp, "\n");
+
+	EFPRINTF(fp, "[0004]\t\tTable Revision : 00000001\n");
+	EFPRINTF(fp, "[0008]\t\tReserved : 0000000000000000\n");
+	EFPRINTF(fp, "\n");
+
+	/* the local APIC IDs of the MADT */
+	for (i = 0; i < basl_ncpu; i++) {
+		pcpu_id = pcpuid_from_vcpuid(guest_pcpu_bitmask, i);
+		lapic_id = lapicid_from_pcpuid(pcpu_id);
+		if (lapic_id == -1) {
+			pr_err("Failed to retrieve the local APIC ID for pCPU %d\n", pcpu_id);
+			return -1;
+		}
+
+		EFPRINTF(fp, "[0001]\t\tSubtable Type : 00\n");
+		EFPRINTF(fp, "[0001]\t\tLength : 10\n");
+		EFPRINTF(fp, "[0001]\t\tProximity Domain Low(8) : %02X\n",
+			numa_vcpu_vnode(i));
+		EFPRINTF(fp, "[0001]\t\tApic ID : %02X\n", lapic_id);
+		EFPRINTF(fp, "[0004]\t\tFlags (decoded below) : 00000001\n");
+		EFPRINTF(fp, "\t\t\tEnabled : 1\n");
+		EFPRINTF(fp, "[0001]\t\tLocal Sapic EID : 00\n");
+		EFPRINTF(fp, "[0003]\t\tProximity Domain High(24) : 000000\n");
+		EFPRINTF(fp, "[0004]\t\tClock Domain : 00000000\n");
+		EFPRINTF(fp, "\n");
+	}
+
+	for (v = 0; v < numa_nr_vnodes(); v++) {
+		nr = numa_vnode_ranges(v, ranges);
+		for (i = 0; i < nr; i++) {
+			EFPRINTF(fp, "[0001]\t\tSubtable Type : 01\n");
+			EFPRINTF(fp, "[0001]\t\tLength : 28\n");
+			EFPRINTF(fp, "[0004]\t\tProximity Domain : %08X\n", v);
+			EFPRINTF(fp, "[0002]\t\tReserved1 : 0000\n");
+			EFPRINTF(fp, "[0008]\t\tBase Address : %016lX\n", ranges[i].gpa);
+			EFPRINTF(fp, "[0008]\t\tAddress Length : %016lX\n", ranges[i].len);
+			EFPRINTF(fp, "[0004]\t\tReserved2 : 00000000\n");
+			EFPRINTF(fp, "[0004]\t\tFlags (decoded below) : 00000001\n");
+			EFPRINTF(fp, "\t\t\tEnabled : 1\n");
+			EFPRINTF(fp, "\t\t\tHot Pluggable : 0\n");
+			EFPRINTF(fp, "\t\t\tNon-Volatile : 0\n");
+			EFPRINTF(fp, "[0008]\t\tReserved3 : 0000000000000000\n");
+			EFPRINTF(fp, "\n");
+		}
+	}
+
+	EFFLUSH(fp);
+
+	return 0;
+}
+
+/* The distances of the host nodes of the virtual nodes */
+static int
+basl_fwrite_slit(FILE *fp, struct vmctx *ctx)
+{
+	int i, j, n = numa_nr_vnodes();
+
+	EFPRINTF(fp, "/*\n");
+	EFPRINTF(fp, " * dm SLIT template\n");
+	EFPRINTF(fp, " */\n");
+	EFPRINTF(fp, "[0004]\t\tSignature : \"SLIT\"\n");
+	EFPRINTF(fp, "[0004]\t\tTable Length : 00000000\n");
+	EFPRINTF(fp, "[0001]\t\tRevision : 01\n");
+	EFPRINTF(fp, "[0001]\t\tChecksum : 00\n");
+	EFPRINTF(fp, "[0006]\t\tOem ID : \"DM \"\n");
+	EFPRINTF(fp, "[0008]\t\tOem Table ID : \"DMSLIT  \"\n");
+	EFPRINTF(fp, "[0004]\t\tOem Revision : 00000001\n");
+
+	/* iasl will fill in the compiler ID/revision fields */
+	EFPRINTF(fp, "[0004]\t\tAsl Compiler ID : \"xxxx\"\n");
+	EFPRINTF(fp, "[0004]\t\tAsl Compiler Revision : 00000000\n");
+	EFPRINTF(fp, "\n");
+
+	EFPRINTF(fp, "[0008]\t\tLocalities : %016X\n", n);
+	for (i = 0; i < n; i++) {
+		EFPRINTF(fp, "[%04d]\t\tLocality %d :", n, i);
+		for (j = 0; j < n; j++)
+			EFPRINTF(fp, " %02X", numa_distance(i, j) & 0xff);
+		EFPRINTF(fp, "\n");
+	}
+
+	EFFLUSH(fp);
+
+	return 0;
+}
+
 static int
 basl_fwrite_nhlt(FILE *fp, struct vmctx *ctx)
 {
@@ -1080,6 +1208,8 @@ static struct {
 	{ basl_fwrite_facs, FACS_OFFSET, true  },
 	{ basl_fwrite_nhlt, NHLT_OFFSET, false }, /*valid with audio ptdev*/
 	{ basl_fwrite_tpm2, TPM2_OFFSET, false },
+	{ basl_fwrite_srat, SRAT_OFFSET, false }, /*valid with --vnuma*/
+	{ basl_fwrite_slit, SLIT_OFFSET, false },
 	{ basl_fwrite_dsdt, DSDT_OFFSET, true  }
 };
 
@@ -1223,6 +1353,11 @@ acpi_build(struct vmctx *ctx, int ncpu)
 	if (getenv("ACPI_KEEPTMPS"))
 		basl_keep_temps = 1;
 
+	if (vnuma && (numa_nr_vnodes() > 0)) {
+		acpi_table_enable(SRAT_ENTRY_NO);
+		acpi_table_enable(SLIT_ENTRY_NO);
+	}
+
 	i = 0;
 	err = basl_make_templates();
 
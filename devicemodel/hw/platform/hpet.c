@@ -117,6 +117,8 @@ struct vhpet {
 	uint64_t	isr;		/* Interrupt Status */
 	uint32_t	countbase;	/* HPET counter base value */
 	struct timespec	countbase_ts;	/* uptime corresponding to base value */
+	uint64_t	countbase_tsc;	/* TSC corresponding to base value */
+	uint64_t	tsc_hz;		/* non-zero if the hypervisor reads the counter */
 
 	struct {
 		uint64_t	cap_config;	/* Configuration */
@@ -172,6 +174,62 @@ vhpet_counter_enabled(struct vhpet *vhpet)
 	return ((vhpet->config & HPET_CNF_ENABLE) != 0);
 }
 
+/*
+ * While the hypervisor emulates the reads of the main counter from the TSC,
+ * the counter of the device model follows the TSC too, computed the same
+ * way, so that the guest and the timers agree on it.
+ */
+static uint64_t
+vhpet_tsc_to_ticks(struct vhpet *vhpet, uint64_t tsc)
+{
+	return (tsc / vhpet->tsc_hz) * HPET_FREQ +
+		((tsc % vhpet->tsc_hz) * HPET_FREQ) / vhpet->tsc_hz;
+}
+
+/* TSC frequency from the ACRN timing leaf, 0 if unknown */
+static uint64_t
+vhpet_get_tsc_hz(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	do_cpuid(0x40000000, 0, &eax, &ebx, &ecx, &edx);
+	if (eax < 0x40000010)
+		return 0;
+
+	do_cpuid(0x40000010, 0, &eax, &ebx, &ecx, &edx);
+	return (uint64_t)eax * 1000;
+}
+
+/*
+ * Hand the main counter over to the hypervisor: reads of it then no longer
+ * exit to the device model. Writes still do, and call this again.
+ */
+static void
+vhpet_sync_counter(struct vhpet *vhpet, bool active)
+{
+	struct acrn_tsc_counter counter = {
+		.addr = VHPET_BASE + HPET_MAIN_COUNTER,
+		.value = vhpet->countbase,
+		.tsc = vhpet->countbase_tsc,
+		.mask = 0xffffffff,
+		.freq = HPET_FREQ,
+	};
+
+	if (vhpet->tsc_hz == 0)
+		return;
+
+	if (active) {
+		counter.flags = ACRN_TSC_COUNTER_ACTIVE;
+		if (vhpet_counter_enabled(vhpet))
+			counter.flags |= ACRN_TSC_COUNTER_RUNNING;
+	}
+
+	if (vm_set_tsc_counter(vhpet->vm, &counter) && active) {
+		DPRINTF(("hpet counter left to the device model\n"));
+		vhpet->tsc_hz = 0;
+	}
+}
+
 static inline bool
 vhpet_timer_msi_enabled(struct vhpet *vhpet, int n)
 {
@@ -205,15 +263,19 @@ vhpet_counter(struct vhpet *vhpet, struct timespec *nowptr)
 		if (clock_gettime(CLOCK_MONOTONIC, &now))
 			pr_dbg("clock_gettime returned: %s", strerror(errno));
 
-		/* delta = now - countbase_ts */
-		if (timespeccmp(&now, &vhpet->countbase_ts, <)) {
-			pr_dbg("vhpet counter going backwards");
-			vhpet->countbase_ts = now;
-		}
+		if (vhpet->tsc_hz != 0) {
+			val += vhpet_tsc_to_ticks(vhpet, rdtsc() - vhpet->countbase_tsc);
+		} else {
+			/* delta = now - countbase_ts */
+			if (timespeccmp(&now, &vhpet->countbase_ts, <)) {
+				pr_dbg("vhpet counter going backwards");
+				vhpet->countbase_ts = now;
+			}
 
-		delta = now;
-		timespecsub(&delta, &vhpet->countbase_ts);
-		val += vhpet_ts_to_ticks(&delta);
+			delta = now;
+			timespecsub(&delta, &vhpet->countbase_ts);
+			val += vhpet_ts_to_ticks(&delta);
+		}
 
 		if (nowptr != NULL)
 			*nowptr = now;
@@ -550,6 +612,8 @@ vhpet_start_counting(struct vhpet *vhpet)
 
 	if (clock_gettime(CLOCK_MONOTONIC, &vhpet->countbase_ts))
 		pr_dbg("clock_gettime returned: %s", strerror(errno));
+	vhpet->countbase_tsc = rdtsc();
+	vhpet_sync_counter(vhpet, true);
 
 	/* Restart the timers based on the main counter base value */
 	for (i = 0; i < VHPET_NUM_TIMERS; i++) {
@@ -571,6 +635,7 @@ vhpet_stop_counting(struct vhpet *vhpet, uint32_t counter,
 
 	/* Update the main counter base value */
 	vhpet->countbase = counter;
+	vhpet_sync_counter(vhpet, true);
 
 	for (i = 0; i < VHPET_NUM_TIMERS; i++) {
 		if (vhpet_timer_enabled(vhpet, i))
@@ -775,6 +840,8 @@ vhpet_mmio_write(struct vhpet *vhpet, int vcpuid, uint64_t gpa, uint64_t *wval,
 		vhpet->countbase = val64;
 		if (vhpet_counter_enabled(vhpet))
 			vhpet_start_counting(vhpet);
+		else
+			vhpet_sync_counter(vhpet, true);
 		goto done;
 	}
 
@@ -1019,6 +1086,9 @@ vhpet_init(struct vmctx *ctx)
 		goto done;
 	}
 
+	vhpet->tsc_hz = vhpet_get_tsc_hz();
+	vhpet_sync_counter(vhpet, true);
+
 	vhpet->inited = true;
 
 done:
@@ -1039,6 +1109,7 @@ vhpet_deinit(struct vmctx *ctx)
 		goto done;
 
 	vhpet_deinit_timers(vhpet);
+	vhpet_sync_counter(vhpet, false);
 	unregister_mem(&vhpet_mr);
 
 	vhpet->inited = false;
@@ -25,21 +25,40 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <openssl/hmac.h>
 #include <openssl/opensslv.h>
 #if OPENSSL_VERSION_NUMBER >= 0x30000000L
 #include <openssl/evp.h>
+#include <openssl/params.h>
+#include <openssl/core_names.h>
 #endif
 
 #include "rpmb.h"
 #include "rpmb_sim.h"
 #include "log.h"
 
-static FILE *rpmb_fd = NULL;
+/*
+ * The simulated RPMB file is mapped once, on first use, and stays mapped
+ * for the life of the DM. Writes only dirty the mapping; the dirty range is
+ * synced with rpmb_sim_sync() before the response of the command is
+ * returned, so a command costs one sync at most, or two for a data write:
+ * its blocks are synced before the write counter is bumped, so the counter
+ * never reaches the disk ahead of the data it authenticates.
+ */
+static uint8_t *rpmb_map = NULL;
+static size_t rpmb_dirty_start;
+static size_t rpmb_dirty_end;
+static pthread_mutex_t rpmb_sim_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * 0~6 is magic
@@ -66,223 +85,304 @@ static int virtio_rpmb_debug = 1;
 #define DPRINTF(params) do { if (virtio_rpmb_debug) pr_dbg params; } while (0)
 #define WPRINTF(params) (pr_err params)
 
-/* Make rpmb_mac compatible for different openssl versions */
+/* Make the HMAC primitives compatible for different openssl versions */
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
-int rpmb_mac(const uint8_t *key, const struct rpmb_frame *frames,
-			size_t frame_cnt, uint8_t *mac)
+typedef HMAC_CTX *rpmb_hmac_t;
+
+static rpmb_hmac_t hmac_new(void)
 {
-	int i;
-	int hmac_ret;
-	unsigned int md_len;
-	HMAC_CTX hmac_ctx;
+	HMAC_CTX *ctx = calloc(1, sizeof(*ctx));
 
-	HMAC_CTX_init(&hmac_ctx);
-	hmac_ret = HMAC_Init_ex(&hmac_ctx, key, 32, EVP_sha256(), NULL);
-	if (!hmac_ret) {
-		DPRINTF(("HMAC_Init_ex failed\n"));
-		goto err;
-	}
+	if (ctx)
+		HMAC_CTX_init(ctx);
+	return ctx;
+}
 
-	for (i = 0; i < frame_cnt; i++) {
-		hmac_ret = HMAC_Update(&hmac_ctx, frames[i].data, 284);
-		if (!hmac_ret) {
-			DPRINTF(("HMAC_Update failed\n"));
-			goto err;
-		}
-	}
+/* A NULL key restarts the context with the key it was last set up with */
+static int hmac_init(rpmb_hmac_t ctx, const uint8_t *key)
+{
+	if (key)
+		return HMAC_Init_ex(ctx, key, 32, EVP_sha256(), NULL);
+	return HMAC_Init_ex(ctx, NULL, 0, NULL, NULL);
+}
 
-	hmac_ret = HMAC_Final(&hmac_ctx, mac, &md_len);
+static int hmac_update(rpmb_hmac_t ctx, const uint8_t *data, size_t len)
+{
+	return HMAC_Update(ctx, data, len);
+}
+
+static int hmac_final(rpmb_hmac_t ctx, uint8_t *mac)
+{
+	unsigned int md_len;
+
+	if (!HMAC_Final(ctx, mac, &md_len))
+		return 0;
 	if (md_len != 32) {
 		DPRINTF(("bad md_len %d != 32.\n", md_len));
-		goto err;
+		return 0;
 	}
+	return 1;
+}
+#elif OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX *rpmb_hmac_t;
 
-	if (!hmac_ret) {
-		DPRINTF(("HMAC_Final failed\n"));
-		goto err;
-	}
+static EVP_MAC *hmac_alg;
 
-err:
-	HMAC_CTX_cleanup(&hmac_ctx);
+static rpmb_hmac_t hmac_new(void)
+{
+	if (hmac_alg == NULL)
+		hmac_alg = EVP_MAC_fetch(NULL, "HMAC", NULL);
+	if (hmac_alg == NULL)
+		return NULL;
+	return EVP_MAC_CTX_new(hmac_alg);
+}
 
-	return hmac_ret ? 0 : -1;
+/* A NULL key restarts the context with the key it was last set up with */
+static int hmac_init(rpmb_hmac_t ctx, const uint8_t *key)
+{
+	static char digest[] = "SHA256";
+	OSSL_PARAM params[] = {
+		OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+		OSSL_PARAM_construct_end()
+	};
+
+	if (key)
+		return EVP_MAC_init(ctx, key, 32, params);
+	return EVP_MAC_init(ctx, NULL, 0, NULL);
 }
-#elif OPENSSL_VERSION_NUMBER >= 0x30000000L
-int rpmb_mac(const uint8_t *key, const struct rpmb_frame *frames,
-			size_t frame_cnt, uint8_t *mac)
+
+static int hmac_update(rpmb_hmac_t ctx, const uint8_t *data, size_t len)
+{
+	return EVP_MAC_update(ctx, data, len);
+}
+
+static int hmac_final(rpmb_hmac_t ctx, uint8_t *mac)
 {
-	int i;
-	int hmac_ret;
 	size_t md_len;
-	EVP_MAC_CTX *hmac_ctx;
-	EVP_MAC *hmac = EVP_MAC_fetch(NULL, "HMAC", NULL);
 
-	hmac_ctx = EVP_MAC_CTX_new(hmac);
-	if (hmac_ctx == NULL) {
-		DPRINTF(("get hmac_ctx failed\n"));
-		EVP_MAC_free(hmac);
-		return -1;
+	if (!EVP_MAC_final(ctx, mac, &md_len, 32))
+		return 0;
+	if (md_len != 32) {
+		DPRINTF(("bad md_len %zu != 32.\n", md_len));
+		return 0;
 	}
+	return 1;
+}
+#else
+typedef HMAC_CTX *rpmb_hmac_t;
 
-	hmac_ret = EVP_MAC_init(hmac_ctx, key, 32, NULL);
-	if (!hmac_ret) {
-		DPRINTF(("HMAC_Init_ex failed\n"));
-		goto err;
-	}
+static rpmb_hmac_t hmac_new(void)
+{
+	return HMAC_CTX_new();
+}
 
-	for (i = 0; i < frame_cnt; i++) {
-		hmac_ret = EVP_MAC_update(hmac_ctx, frames[i].data, 284);
-		if (!hmac_ret) {
-			DPRINTF(("HMAC_Update failed\n"));
-			goto err;
-		}
-	}
+/* A NULL key restarts the context with the key it was last set up with */
+static int hmac_init(rpmb_hmac_t ctx, const uint8_t *key)
+{
+	if (key)
+		return HMAC_Init_ex(ctx, key, 32, EVP_sha256(), NULL);
+	return HMAC_Init_ex(ctx, NULL, 0, NULL, NULL);
+}
+
+static int hmac_update(rpmb_hmac_t ctx, const uint8_t *data, size_t len)
+{
+	return HMAC_Update(ctx, data, len);
+}
 
-	hmac_ret = EVP_MAC_final(hmac_ctx, mac, &md_len, 32);
+static int hmac_final(rpmb_hmac_t ctx, uint8_t *mac)
+{
+	unsigned int md_len;
+
+	if (!HMAC_Final(ctx, mac, &md_len))
+		return 0;
 	if (md_len != 32) {
 		DPRINTF(("bad md_len %d != 32.\n", md_len));
-		goto err;
+		return 0;
 	}
+	return 1;
+}
+#endif
 
-	if (!hmac_ret) {
-		DPRINTF(("HMAC_Final failed\n"));
-		goto err;
-	}
+/*
+ * The keyed HMAC contexts, reused from one call to the next. A frame is
+ * MACed with the key of the simulated RPMB and with the virtual key of the
+ * User VM in turn, so a context is kept per key and the least recently
+ * keyed one is reset with the key of a new caller.
+ */
+#define RPMB_MAC_CTX_NUM	4
 
-err:
-	EVP_MAC_CTX_free(hmac_ctx);
-	EVP_MAC_free(hmac);
+static struct rpmb_mac_ctx {
+	uint8_t key[32];
+	bool keyed;
+	rpmb_hmac_t ctx;
+} rpmb_mac_ctxs[RPMB_MAC_CTX_NUM];
+static uint32_t rpmb_mac_next;
+static pthread_mutex_t rpmb_mac_mtx = PTHREAD_MUTEX_INITIALIZER;
 
-	return hmac_ret ? 0 : -1;
-}
-#else
 int rpmb_mac(const uint8_t *key, const struct rpmb_frame *frames,
 			size_t frame_cnt, uint8_t *mac)
 {
-	int i;
-	int hmac_ret;
-	unsigned int md_len;
-	HMAC_CTX *hmac_ctx;
+	size_t i;
+	int ret = -1;
+	struct rpmb_mac_ctx *mc = NULL;
 
-	hmac_ctx = HMAC_CTX_new();
-	if (hmac_ctx == NULL) {
-		DPRINTF(("get hmac_ctx failed\n"));
-		return -1;
+	pthread_mutex_lock(&rpmb_mac_mtx);
+	for (i = 0; i < RPMB_MAC_CTX_NUM; i++) {
+		if (rpmb_mac_ctxs[i].keyed && !memcmp(rpmb_mac_ctxs[i].key, key, 32)) {
+			mc = &rpmb_mac_ctxs[i];
+			break;
+		}
 	}
 
-	hmac_ret = HMAC_Init_ex(hmac_ctx, key, 32, EVP_sha256(), NULL);
-	if (!hmac_ret) {
+	if (mc == NULL) {
+		mc = &rpmb_mac_ctxs[rpmb_mac_next];
+		rpmb_mac_next = (rpmb_mac_next + 1) % RPMB_MAC_CTX_NUM;
+
+		mc->keyed = false;
+		if (mc->ctx == NULL)
+			mc->ctx = hmac_new();
+		if (mc->ctx == NULL) {
+			DPRINTF(("get hmac_ctx failed\n"));
+			goto err;
+		}
+
+		if (!hmac_init(mc->ctx, key)) {
+			DPRINTF(("HMAC_Init_ex failed\n"));
+			goto err;
+		}
+		memcpy(mc->key, key, 32);
+		mc->keyed = true;
+	} else if (!hmac_init(mc->ctx, NULL)) {
 		DPRINTF(("HMAC_Init_ex failed\n"));
+		mc->keyed = false;
 		goto err;
 	}
 
 	for (i = 0; i < frame_cnt; i++) {
-		hmac_ret = HMAC_Update(hmac_ctx, frames[i].data, 284);
-		if (!hmac_ret) {
+		if (!hmac_update(mc->ctx, frames[i].data, 284)) {
 			DPRINTF(("HMAC_Update failed\n"));
 			goto err;
 		}
 	}
 
-	hmac_ret = HMAC_Final(hmac_ctx, mac, &md_len);
-	if (md_len != 32) {
-		DPRINTF(("bad md_len %d != 32.\n", md_len));
-		goto err;
-	}
-
-	if (!hmac_ret) {
+	if (!hmac_final(mc->ctx, mac)) {
 		DPRINTF(("HMAC_Final failed\n"));
 		goto err;
 	}
 
-err:
-	HMAC_CTX_free(hmac_ctx);
+	ret = 0;
 
-	return hmac_ret ? 0 : -1;
-}
-#endif
+err:
+	pthread_mutex_unlock(&rpmb_mac_mtx);
 
-static void rpmb_sim_close(void)
-{
-	fclose(rpmb_fd);
-	rpmb_fd = NULL;
+	return ret;
 }
 
-static int file_write(FILE *fp, const void *buf, size_t size, off_t offset)
+static int file_write(const void *buf, size_t size, off_t offset)
 {
-	size_t rc = 0;
-
-	if (fseek(fp, offset, SEEK_SET)) {
-		DPRINTF(("%s:Seek to %ld failed.\n", __func__, offset));
+	if (offset < 0 || size > TEEDATA_SIZE || offset > TEEDATA_SIZE - size) {
+		DPRINTF(("%s: write of %zu bytes at %ld is out of range.\n", __func__, size, offset));
 		return -1;
 	}
 
-	rc = fwrite(buf, sizeof(char), size, fp);
-	if (rc != size) {
-		return -1;
-	}
+	memcpy(rpmb_map + offset, buf, size);
 
-	/* The flow of file writing sync should be:
-	   C lib caches--->fflush--->disk caches--->fsync--->disk */
-	if (fflush(fp) < 0) {
-		return -1;
-	}
+	if (offset < rpmb_dirty_start)
+		rpmb_dirty_start = offset;
+	if (offset + size > rpmb_dirty_end)
+		rpmb_dirty_end = offset + size;
 
-	if (fsync(fileno(fp)) < 0) {
-		DPRINTF(("%s: fsync failed\n", __func__));
+	return size;
+}
+
+static int file_read(void *buf, size_t size, off_t offset)
+{
+	if (offset < 0 || size > TEEDATA_SIZE || offset > TEEDATA_SIZE - size) {
+		DPRINTF(("%s: read of %zu bytes at %ld is out of range.\n", __func__, size, offset));
 		return -1;
 	}
 
-	return rc;
+	memcpy(buf, rpmb_map + offset, size);
+
+	return size;
 }
 
-static int file_read(FILE *fp, void *buf, size_t size, off_t offset)
+/* Write the dirty range of the mapping back to the file */
+static int rpmb_sim_sync(void)
 {
-	size_t rc = 0;
+	size_t start;
+	size_t page_size = sysconf(_SC_PAGESIZE);
 
-	if (fseek(fp, offset, SEEK_SET)) {
-		DPRINTF(("%s:Seek to %ld failed.\n", __func__, offset));
-		return -1;
-	}
+	if (rpmb_dirty_end <= rpmb_dirty_start)
+		return 0;
 
-	rc = fread(buf, sizeof(char), size, fp);
-	if (rc == size) {
-		return rc;
-	} else {
+	start = rpmb_dirty_start & ~(page_size - 1);
+	if (msync(rpmb_map + start, rpmb_dirty_end - start, MS_SYNC) < 0) {
+		DPRINTF(("%s: msync failed: %s\n", __func__, strerror(errno)));
 		return -1;
 	}
+
+	rpmb_dirty_start = TEEDATA_SIZE;
+	rpmb_dirty_end = 0;
+
+	return 0;
 }
 
 static int rpmb_sim_open(const char *rpmb_devname)
 {
-	uint8_t data = 0;
-	rpmb_fd = fopen(rpmb_devname, "rb+");
-
-	if (rpmb_fd == NULL) {
-		/*if the rpmb device file does not exist, create a new file*/
-		rpmb_fd = fopen(rpmb_devname, "wb+");
-		DPRINTF(("rpmb device file(%s) does not exist, create a new file\n", rpmb_devname));
-		/* Write 0 to the last byte to enable 4MB length access */
-		if (rpmb_fd == NULL || file_write(rpmb_fd, &data, 1, TEEDATA_SIZE - 1) < 0) {
-			DPRINTF(("Failed to initialize simulated rpmb to 0.\n"));
-			rpmb_fd = NULL;
-		}
-	}
+	int fd;
+	struct stat st;
+	void *map;
+
+	if (rpmb_map)
+		return 0;
 
-	if (rpmb_fd == NULL) {
+	fd = open(rpmb_devname, O_RDWR | O_CREAT, 0600);
+	if (fd < 0) {
 		DPRINTF(("%s: unable (%d) to open rpmb device '%s': %s\n",
 			__func__, errno, rpmb_devname, strerror(errno)));
 		return -1;
 	}
 
+	if (fstat(fd, &st) < 0)
+		goto err;
+
+	if (st.st_size < TEEDATA_SIZE) {
+		/*
+		 * A new rpmb device file, or a short one: extend it with zeros
+		 * to enable 4MB length access.
+		 */
+		DPRINTF(("rpmb device file(%s) is %ld bytes, extend it\n", rpmb_devname, (long)st.st_size));
+		if (ftruncate(fd, TEEDATA_SIZE) < 0 || fsync(fd) < 0) {
+			DPRINTF(("Failed to initialize simulated rpmb to 0.\n"));
+			goto err;
+		}
+	}
+
+	map = mmap(NULL, TEEDATA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto err;
+
+	/* The mapping holds its own reference to the file */
+	close(fd);
+	rpmb_map = map;
+	rpmb_dirty_start = TEEDATA_SIZE;
+	rpmb_dirty_end = 0;
+
 	return 0;
+
+err:
+	DPRINTF(("%s: unable (%d) to map rpmb device '%s': %s\n",
+		__func__, errno, rpmb_devname, strerror(errno)));
+	close(fd);
+	return -1;
 }
 
 static int get_counter(uint32_t *counter)
 {
 	int rc = 0;
 
-	rc = file_read(rpmb_fd, counter, sizeof(*counter), WRITER_COUNTER_ADDR);
+	rc = file_read(counter, sizeof(*counter), WRITER_COUNTER_ADDR);
 	if (rc < 0)
 	{
 		DPRINTF(("%s failed.\n", __func__));
@@ -300,7 +400,7 @@ static int set_counter(const uint32_t *counter)
 	uint32_t cnt = *counter;
 
 	swap32(cnt);
-	rc = file_write(rpmb_fd, &cnt, sizeof(cnt), WRITER_COUNTER_ADDR);
+	rc = file_write(&cnt, sizeof(cnt), WRITER_COUNTER_ADDR);
 	if (rc < 0)
 	{
 		DPRINTF(("%s failed.\n", __func__));
@@ -315,7 +415,7 @@ static int is_key_programmed(void)
 	int rc = 0;
 	uint8_t magic[KEY_MAGIC_LENGTH] = {0};
 
-	rc = file_read(rpmb_fd, magic, KEY_MAGIC_LENGTH, KEY_MAGIC_ADDR);
+	rc = file_read(magic, KEY_MAGIC_LENGTH, KEY_MAGIC_ADDR);
 	if (rc < 0)
 	{
 		DPRINTF(("%s read magic failed.\n", __func__));
@@ -332,7 +432,7 @@ static int get_key(uint8_t *key)
 {
 	int rc = 0;
 
-	rc = file_read(rpmb_fd, key, 32, KEY_ADDR);
+	rc = file_read(key, 32, KEY_ADDR);
 	if (rc < 0)
 	{
 		DPRINTF(("%s failed.\n", __func__));
@@ -346,14 +446,14 @@ static int program_key(const uint8_t *key)
 {
 	int rc = 0;
 
-	rc = file_write(rpmb_fd, key, 32, KEY_ADDR);
+	rc = file_write(key, 32, KEY_ADDR);
 	if (rc < 0)
 	{
 		DPRINTF(("%s failed at set key.\n", __func__));
 		return -1;
 	}
 
-	rc = file_write(rpmb_fd, KEY_MAGIC, KEY_MAGIC_LENGTH, KEY_MAGIC_ADDR);
+	rc = file_write(KEY_MAGIC, KEY_MAGIC_LENGTH, KEY_MAGIC_ADDR);
 	if (rc < 0)
 	{
 		DPRINTF(("%s failed at set magic.\n", __func__));
@@ -408,7 +508,6 @@ static int rpmb_sim_write(const struct rpmb_frame* in_frame, uint32_t in_cnt,
 	uint32_t counter;
 	uint16_t addr;
 	uint16_t block_count;
-	uint8_t data[256*in_cnt];
 
 	if (in_cnt == 0 || in_frame == NULL)
 		return -EINVAL;
@@ -416,7 +515,7 @@ static int rpmb_sim_write(const struct rpmb_frame* in_frame, uint32_t in_cnt,
 	if (in_frame[0].req_resp != swap16(RPMB_REQ_DATA_WRITE))
 		return -EINVAL;
 
-	if (in_cnt > 2) {
+	if (in_cnt > RPMB_SIM_MAX_REL_WRITE) {
 		err = RPMB_RES_GENERAL_FAILURE;
 		goto out;
 	}
@@ -472,11 +571,16 @@ static int rpmb_sim_write(const struct rpmb_frame* in_frame, uint32_t in_cnt,
 		goto out;
 	}
 
-	for (i = 0; i < in_cnt; i++)
-		memcpy(data + i * 256, in_frame[i].data, 256);
+	for (i = 0; i < block_count; i++) {
+		if (file_write(in_frame[i].data, 256, 256 * (addr + i)) < 0) {
+			DPRINTF(("%s write_with_retry failed.\n", __func__));
+			goto out;
+		}
+	}
 
-	if (file_write(rpmb_fd, data, sizeof(data), 256 * addr) < 0) {
-		DPRINTF(("%s write_with_retry failed.\n", __func__));
+	/* The blocks must be on the disk before the counter authenticating them */
+	if (rpmb_sim_sync()) {
+		DPRINTF(("%s rpmb_sim_sync failed.\n", __func__));
 		goto out;
 	}
 
@@ -512,7 +616,6 @@ static int rpmb_sim_read(const struct rpmb_frame* in_frame, uint32_t in_cnt,
 	uint8_t key[32];
 	uint8_t mac[32];
 	uint16_t addr;
-	uint8_t data[256*out_cnt];
 
 	if (in_cnt != 1 || in_frame == NULL)
 		return -EINVAL;
@@ -535,11 +638,6 @@ static int rpmb_sim_read(const struct rpmb_frame* in_frame, uint32_t in_cnt,
 		goto out;
 	}
 
-	if (file_read(rpmb_fd, data, sizeof(data), 256 * addr) < 0) {
-		DPRINTF(("%s read_with_retry failed.\n", __func__));
-		goto out;
-	}
-
 	err = RPMB_RES_OK;
 
 out:
@@ -550,7 +648,11 @@ out:
 			out_frame[i].req_resp = swap16(RPMB_RESP_DATA_READ);
 			out_frame[i].block_count = swap16(out_cnt);
 			out_frame[i].addr = in_frame[0].addr;
-			memcpy(out_frame[i].data, data+256*i, 256);
+			/* The blocks are copied from the mapping straight into the frames */
+			if (err == RPMB_RES_OK && file_read(out_frame[i].data, 256, 256 * (addr + i)) < 0) {
+				DPRINTF(("%s read_with_retry failed.\n", __func__));
+				err = RPMB_RES_READ_FAILURE;
+			}
 		}
 		if (get_key(key))
 			DPRINTF(("%s, get_key failed.\n", __func__));
@@ -610,15 +712,16 @@ int is_use_sim_rpmb(void)
 {
 	int ret;
 
+	pthread_mutex_lock(&rpmb_sim_mtx);
 	ret = rpmb_sim_open(RPMB_SIM_PATH_NAME);
 	if (ret) {
 		DPRINTF(("%s: rpmb_sim_open failed\n", __func__));
+		pthread_mutex_unlock(&rpmb_sim_mtx);
 		return 0;
 	}
 
 	ret = is_key_programmed();
-
-	rpmb_sim_close();
+	pthread_mutex_unlock(&rpmb_sim_mtx);
 
 	return ret;
 }
@@ -628,10 +731,11 @@ int rpmb_sim_key_init(uint8_t *key)
 	int ret;
 	uint32_t counter = 0;
 
+	pthread_mutex_lock(&rpmb_sim_mtx);
 	ret = rpmb_sim_open(RPMB_SIM_PATH_NAME);
 	if (ret) {
 		DPRINTF(("%s: rpmb_sim_open failed\n", __func__));
-		return ret;
+		goto out;
 	}
 
 	if (!is_key_programmed()) {
@@ -653,7 +757,9 @@ int rpmb_sim_key_init(uint8_t *key)
 	}
 
 out:
-	rpmb_sim_close();
+	if (rpmb_sim_sync())
+		ret = -1;
+	pthread_mutex_unlock(&rpmb_sim_mtx);
 
 	return ret;
 }
@@ -673,8 +779,8 @@ static int rpmb_sim_operations(const void *rel_write_data, size_t rel_write_size
 
 	if (rel_write_size) {
 		size_t nframe = rel_write_size/RPMB_FRAME_SIZE;
-		struct rpmb_frame rel_write_frame[nframe];
-		memcpy(rel_write_frame, rel_write_data, sizeof(rel_write_frame));
+		const struct rpmb_frame *rel_write_frame = rel_write_data;
+
 		if (rel_write_frame[0].req_resp == swap16(RPMB_REQ_DATA_WRITE))  {
 			if (write_size/RPMB_FRAME_SIZE &&
 					((struct rpmb_frame*)write_data)->req_resp == swap16(RPMB_REQ_RESULT_READ))
@@ -734,17 +840,21 @@ int rpmb_sim_send(const void *r)
 		}
 	}
 
+	pthread_mutex_lock(&rpmb_sim_mtx);
 	ret = rpmb_sim_open(RPMB_SIM_PATH_NAME);
 	if (ret) {
 		DPRINTF(("%s: rpmb_sim_open failed\n", __func__));
+		pthread_mutex_unlock(&rpmb_sim_mtx);
 		goto err_response;
 	}
 
-	/* execute rpmb command */
+	/* execute rpmb command, and sync what it wrote before its response is seen */
 	ret = rpmb_sim_operations(frame_rel_write, rel_write_size,
 							 frame_write, write_size,
 							 frame_read, read_size);
-	rpmb_sim_close();
+	if (rpmb_sim_sync())
+		ret = -1;
+	pthread_mutex_unlock(&rpmb_sim_mtx);
 
 	if (ret) {
 		DPRINTF(("%s: rpmb_sim_operations failed\n", __func__));
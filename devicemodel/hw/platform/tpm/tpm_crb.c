@@ -153,9 +153,15 @@ struct tpm_crb_vdev {
 	uint8_t data_buffer[TPM_CRB_DATA_BUFFER_SIZE];
 	TPMCommBuffer cmd;
 
+	/*
+	 * The commands run in request_thread: a write of CTRL_START only
+	 * hands the command over, the vCPU resumes at once and polls
+	 * CTRL_START, which reads 1 until the command has completed.
+	 */
 	pthread_t request_thread;
 	pthread_mutex_t request_mutex;
 	pthread_cond_t request_cond;
+	bool stopping;
 };
 
 static uint64_t mmio_read(void *addr, int size)
@@ -252,38 +258,35 @@ static void tpm_crb_request_completed(struct tpm_crb_vdev *vdev, int err)
 	}
 }
 
-static void tpm_crb_request_deliver(void *arg)
+static void *tpm_crb_request_deliver(void *arg)
 {
 	struct tpm_crb_vdev *tpm_vdev = (struct tpm_crb_vdev *)arg;
+	TPMCommBuffer cmd;
 	int ret;
 
-	while (1) {
-		ret = pthread_mutex_lock(&tpm_vdev->request_mutex);
-		if (ret) {
-			DPRINTF("ERROR: Failed to acquire mutex lock(%d)\n", ret);
-			break;
+	pthread_mutex_lock(&tpm_vdev->request_mutex);
+	while (!tpm_vdev->stopping) {
+		if (tpm_vdev->crb_regs.regs.ctrl_start == CRB_CTRL_CMD_COMPLETED) {
+			ret = pthread_cond_wait(&tpm_vdev->request_cond, &tpm_vdev->request_mutex);
+			if (ret) {
+				DPRINTF("ERROR: Failed to wait condition(%d)\n", ret);
+				break;
+			}
+			continue;
 		}
 
-		while (!ret &&
-		       tpm_vdev->crb_regs.regs.ctrl_start == CRB_CTRL_CMD_COMPLETED) {
-			ret = pthread_cond_wait(
-					&tpm_vdev->request_cond, &tpm_vdev->request_mutex);
-		}
+		/* run the command unlocked, the registers stay accessible meanwhile */
+		cmd = tpm_vdev->cmd;
+		pthread_mutex_unlock(&tpm_vdev->request_mutex);
 
-		if (ret) {
-			DPRINTF("ERROR: Failed to wait condition(%d)\n", ret);
-			break;
-		}
+		ret = swtpm_handle_request(&cmd);
 
-		ret = swtpm_handle_request(&tpm_vdev->cmd);
+		pthread_mutex_lock(&tpm_vdev->request_mutex);
 		tpm_crb_request_completed(tpm_vdev, ret);
-
-		ret = pthread_mutex_unlock(&tpm_vdev->request_mutex);
-		if (ret) {
-			DPRINTF("ERROR: Failed to release mutex lock(%d)\n", ret);
-			break;
-		}
 	}
+	pthread_mutex_unlock(&tpm_vdev->request_mutex);
+
+	return NULL;
 }
 
 static void crb_reg_write(struct tpm_crb_vdev *tpm_vdev, uint64_t addr, int size, uint64_t val)
@@ -502,7 +505,7 @@ int init_tpm_crb(struct vmctx *ctx)
 		goto fail_cond;
 	}
 
-	error = pthread_create(&tpm_vdev->request_thread, NULL, (void *)&tpm_crb_request_deliver, (void *)tpm_vdev);
+	error = pthread_create(&tpm_vdev->request_thread, NULL, tpm_crb_request_deliver, (void *)tpm_vdev);
 	if (error) {
 		WPRINTF("Failed init request thread!\n");
 		goto fail_thread;
@@ -535,7 +538,6 @@ void deinit_tpm_crb(struct vmctx *ctx)
 {
 	struct mem_range mr;
 	struct tpm_crb_vdev *tpm_vdev = (struct tpm_crb_vdev *)ctx->tpm_dev;
-	void *status;
 
 	mr.name = "tpm_crb_reg";
 	mr.base = get_vtpm_crb_mmio_addr();
@@ -547,11 +549,12 @@ void deinit_tpm_crb(struct vmctx *ctx)
 	mr.size = TPM_CRB_DATA_BUFFER_SIZE;
 	unregister_mem(&mr);
 
-	pthread_cancel(tpm_vdev->request_thread);
-	pthread_join(tpm_vdev->request_thread, &status);
-	if (status != PTHREAD_CANCELED) {
-		WPRINTF("Failed to cancel TPM command request thread!\n");
-	}
+	/* a command in flight is completed first */
+	pthread_mutex_lock(&tpm_vdev->request_mutex);
+	tpm_vdev->stopping = true;
+	pthread_cond_signal(&tpm_vdev->request_cond);
+	pthread_mutex_unlock(&tpm_vdev->request_mutex);
+	pthread_join(tpm_vdev->request_thread, NULL);
 
 	pthread_cond_destroy(&tpm_vdev->request_cond);
 	pthread_mutex_destroy(&tpm_vdev->request_mutex);
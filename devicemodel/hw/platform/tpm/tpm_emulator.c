@@ -18,6 +18,7 @@
 #include <stdbool.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "vmmapi.h"
 #include "tpm_internal.h"
@@ -128,6 +129,10 @@ typedef struct  {
  * cur_locty_number: to store the last set locality
  * established_flag & established_flag_cached: used in
  *    swtpm_get_tpm_established_flag, to store tpm establish flag.
+ * ctrl_mtx: serializes the Ctrl channel, used by the CRB request thread
+ *    and by the vCPUs.
+ * cancel_resp_pending: number of CMD_CANCEL_TPM_CMD responses not read
+ *    yet, swtpm_cancel_cmd does not wait for them.
  */
 typedef struct swtpm_context {
 	int ctrl_chan_fd;
@@ -135,6 +140,8 @@ typedef struct swtpm_context {
 	uint8_t cur_locty_number; /* last set locality */
 	unsigned int established_flag:1;
 	unsigned int established_flag_cached:1;
+	pthread_mutex_t ctrl_mtx;
+	unsigned int cancel_resp_pending;
 } swtpm_context;
 
 /* Align with definition in SWTPM */
@@ -159,7 +166,9 @@ enum {
 	CMD_GET_INFO,			/* 0x12 */
 };
 
-static swtpm_context tpm_context;
+static swtpm_context tpm_context = {
+	.ctrl_mtx = PTHREAD_MUTEX_INITIALIZER,
+};
 
 
 static inline uint16_t tpm_cmd_get_tag(const void *b)
@@ -418,6 +427,21 @@ static int swtpm_ctrlcmd(int ctrl_chan_fd, unsigned long cmd, void *msg,
 	if (!buf)
 		return -1;
 
+	pthread_mutex_lock(&tpm_context.ctrl_mtx);
+
+	/* the responses come in order, the ones of the cancellations first */
+	while (tpm_context.cancel_resp_pending > 0) {
+		ptm_res res;
+
+		if (ctrl_chan_read(ctrl_chan_fd, (uint8_t *)&res, sizeof(res)) != sizeof(res)) {
+			pr_err("%s failed to read a cancel response\n", __func__);
+			goto end;
+		}
+		tpm_context.cancel_resp_pending--;
+		if (res != 0)
+			pr_err("swtpm: Failed to cancel TPM: 0x%x", __builtin_bswap32(res));
+	}
+
 	memcpy(buf, &cmd_no, sizeof(cmd_no));
 	memcpy(buf + sizeof(cmd_no), msg, msg_len_in);
 
@@ -438,6 +462,7 @@ static int swtpm_ctrlcmd(int ctrl_chan_fd, unsigned long cmd, void *msg,
 	ret = 0;
 
 end:
+	pthread_mutex_unlock(&tpm_context.ctrl_mtx);
 	free(buf);
 	return ret;
 }
@@ -761,16 +786,22 @@ bool swtpm_get_tpm_established_flag(void)
 	return tpm_context.established_flag;
 }
 
+/*
+ * Called on the MMIO exit of the vCPU while a command runs, so it does not
+ * wait for SWTPM to answer: the response is read by the next Ctrl channel
+ * command.
+ */
 void swtpm_cancel_cmd(void)
 {
-	ptm_res res = 0;
+	uint32_t cmd_no = __builtin_bswap32(CMD_CANCEL_TPM_CMD);
 
-	if (swtpm_ctrlcmd(tpm_context.ctrl_chan_fd, CMD_CANCEL_TPM_CMD, &res, 0,
-				sizeof(res), NULL, 0) < 0) {
+	pthread_mutex_lock(&tpm_context.ctrl_mtx);
+	if (ctrl_chan_write(tpm_context.ctrl_chan_fd, (uint8_t *)&cmd_no,
+				sizeof(cmd_no), NULL, 0) != sizeof(cmd_no))
 		pr_err("swtpm: Could not cancel command: %s", strerror(errno));
-	} else if (res != 0) {
-		pr_err("swtpm: Failed to cancel TPM: 0x%x", __builtin_bswap32(res));
-	}
+	else
+		tpm_context.cancel_resp_pending++;
+	pthread_mutex_unlock(&tpm_context.ctrl_mtx);
 }
 
 int init_tpm_emulator(const char *sock_path)
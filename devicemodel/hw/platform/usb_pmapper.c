@@ -366,8 +366,12 @@ errout:
 	return NULL;
 }
 
+/*
+ * Gather the blocks not handed to libusb yet, up to the end of the first TD
+ * if one_td is set.
+ */
 static int
-usb_dev_prepare_xfer(struct usb_xfer *xfer, int *head, int *tail)
+usb_dev_prepare_xfer(struct usb_xfer *xfer, int *head, int *tail, bool one_td)
 {
 	int i, idx, size, first;
 	struct usb_block *block = NULL;
@@ -389,9 +393,17 @@ usb_dev_prepare_xfer(struct usb_xfer *xfer, int *head, int *tail)
 
 		switch (block->type) {
 		case USB_DATA_PART:
+			size += block->blen;
+			block->stat = USB_BLOCK_HANDLING;
+			break;
 		case USB_DATA_FULL:
 			size += block->blen;
 			block->stat = USB_BLOCK_HANDLING;
+			if (one_td) {
+				*head = first;
+				*tail = index_inc(idx, xfer->max_blk_cnt);
+				return size;
+			}
 			break;
 		case USB_DATA_NONE:
 			block->stat = USB_BLOCK_HANDLED;
@@ -746,40 +758,22 @@ usb_dev_reset(void *pdata)
 	return rc;
 }
 
-int
-usb_dev_data(void *pdata, struct usb_xfer *xfer, int dir, int epctx)
+static void
+usb_dev_submit(struct usb_dev *udev, struct usb_xfer *xfer, int dir,
+		int epctx, uint8_t type, int head, int tail, int size)
 {
-	struct usb_dev *udev;
 	struct usb_dev_req *r;
 	struct usb_native_devinfo *info;
 	int rc = 0, epid;
-	uint8_t type;
-	int i, idx, buf_idx, head, tail, size;
+	int i, idx, buf_idx;
 	struct usb_block *b;
 	static const char * const type_str[] = {"CTRL", "ISO", "BULK", "INT"};
 	static const char * const dir_str[] = {"OUT", "IN"};
 	int framelen = 0, framecnt = 0;
 	uint16_t maxp;
 
-	udev = pdata;
 	info = &udev->info;
-	xfer->status = USB_ERR_NORMAL_COMPLETION;
-	size = usb_dev_prepare_xfer(xfer, &head, &tail);
-	if (size <= 0)
-		goto done;
-
-	type = usb_dev_get_ep_type(udev, dir ? TOKEN_IN : TOKEN_OUT, epctx);
-	if (type > USB_ENDPOINT_INT) {
-		xfer->status = USB_ERR_IOERROR;
-		goto done;
-	}
-
 	epid = dir ? (0x80 | epctx) : epctx;
-	if (!(dir == USB_XFER_IN || dir == USB_XFER_OUT)) {
-		xfer->status = USB_ERR_IOERROR;
-		goto done;
-	}
-
 	maxp = usb_dev_get_ep_maxp(udev, dir, epctx);
 	if (type == USB_ENDPOINT_ISOC) {
 		/* need to double check it, there might be some non-spec
@@ -811,7 +805,7 @@ usb_dev_data(void *pdata, struct usb_xfer *xfer, int dir, int epctx)
 			USB_ENDPOINT_ISOC ? framecnt : 0);
 	if (!r) {
 		xfer->status = USB_ERR_IOERROR;
-		goto done;
+		return;
 	}
 
 	r->buf_size = size;
@@ -877,12 +871,14 @@ usb_dev_data(void *pdata, struct usb_xfer *xfer, int dir, int epctx)
 
 	} else {
 		UPRINTF(LFTL, "%s: wrong endpoint type %d\r\n", __func__, type);
+		xfer->reqs[head] = NULL;
 		if (r->buffer)
 			free(r->buffer);
 		if (r->trn)
 			libusb_free_transfer(r->trn);
 		free(r);
 		xfer->status = USB_ERR_INVAL;
+		return;
 	}
 
 	rc = libusb_submit_transfer(r->trn);
@@ -890,6 +886,41 @@ usb_dev_data(void *pdata, struct usb_xfer *xfer, int dir, int epctx)
 		xfer->status = USB_ERR_IOERROR;
 		UPRINTF(LDBG, "libusb_submit_transfer fail: %d\n", rc);
 	}
+}
+
+/*
+ * Each TD of a bulk or interrupt endpoint is submitted as a transfer of its
+ * own, the transfers of the TDs the xHCI handed over at once are all in
+ * flight. The frames of an isochronous endpoint are submitted together.
+ */
+int
+usb_dev_data(void *pdata, struct usb_xfer *xfer, int dir, int epctx)
+{
+	struct usb_dev *udev;
+	uint8_t type;
+	int head, tail, size;
+	bool one_td;
+
+	udev = pdata;
+	xfer->status = USB_ERR_NORMAL_COMPLETION;
+
+	type = usb_dev_get_ep_type(udev, dir ? TOKEN_IN : TOKEN_OUT, epctx);
+	if (type > USB_ENDPOINT_INT) {
+		xfer->status = USB_ERR_IOERROR;
+		goto done;
+	}
+
+	if (!(dir == USB_XFER_IN || dir == USB_XFER_OUT)) {
+		xfer->status = USB_ERR_IOERROR;
+		goto done;
+	}
+
+	one_td = (type == USB_ENDPOINT_BULK) || (type == USB_ENDPOINT_INT);
+	while ((size = usb_dev_prepare_xfer(xfer, &head, &tail, one_td)) > 0) {
+		usb_dev_submit(udev, xfer, dir, epctx, type, head, tail, size);
+		if (!one_td || (xfer->status != USB_ERR_NORMAL_COMPLETION))
+			break;
+	}
 done:
 	return xfer->status;
 }
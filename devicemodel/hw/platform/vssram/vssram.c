@@ -464,7 +464,9 @@ static int vssram_ept_map_buffer(struct vmctx *ctx, struct vssram_buf *buf_desc)
 	}
 	error = ioctl(ctx->fd, ACRN_IOCTL_SET_MEMSEG, &memmap);
 	if (error) {
-		pr_err("ACRN_IOCTL_SET_MEMSEG ioctl() returned an error: %s\n", errormsg(errno));
+		/* the hypervisor refuses buffers beyond the share of the VM in the scenario */
+		pr_err("ACRN_IOCTL_SET_MEMSEG ioctl() returned an error: %s, "
+			"is the Software SRAM size of the VM in the scenario large enough?\n", errormsg(errno));
 	}
 	return error;
 };
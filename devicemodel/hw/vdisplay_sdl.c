@@ -16,6 +16,9 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libdrm/drm_fourcc.h>
 #include "log.h"
 #include "vdisplay.h"
 #include "atomic.h"
@@ -33,6 +36,29 @@
 #define VDPY_MIN_HEIGHT 480
 #define transto_10bits(color) (uint16_t)(color * 1024 + 0.5)
 #define VSCREEN_MAX_NUM 2
+/* dmabufs of blob resources kept imported for each screen */
+#define VDPY_DMABUF_IMPORTS 4
+#define VDPY_DEFAULT_REFRESH_RATE 60
+/* an unchanged screen is redrawn at this interval when frames are paced */
+#define VDPY_IDLE_REDRAW_NS 100000000UL
+
+/*
+ * When the frames of the guest reach the screen, the "vsync=" option.
+ *
+ * VDPY_PRESENT_IMMEDIATE: each update is presented at once, the screens are
+ * redrawn by a 30fps timer in between.
+ * VDPY_PRESENT_MAILBOX: an update replaces the frame waiting for the next
+ * refresh tick, the tick runs at the refresh rate of the monitor and
+ * presents the screens with a new frame only.
+ * VDPY_PRESENT_FIFO: as mailbox, the presents wait for the vertical blank
+ * and the guest gets a vblank event after each tick: virtio-gpu completes
+ * the fenced flushes then, so the guest renders one frame per refresh.
+ */
+enum vdpy_present_mode {
+	VDPY_PRESENT_IMMEDIATE = 0,
+	VDPY_PRESENT_MAILBOX,
+	VDPY_PRESENT_FIFO,
+};
 
 static unsigned char default_raw_argb[VDPY_DEFAULT_WIDTH * VDPY_DEFAULT_HEIGHT * 4];
 
@@ -52,6 +78,19 @@ struct egl_display_ops {
 	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC glEGLImageTargetTexture2DOES;
 };
 
+struct dmabuf_import {
+	/* the inode of the dmabuf, 0 for a free entry */
+	ino_t ino;
+	uint32_t fourcc;
+	uint32_t offset;
+	uint32_t stride;
+	uint32_t width;
+	uint32_t height;
+	uint64_t last_use;
+	EGLImage egl_img;
+	SDL_Texture *tex;
+};
+
 struct vscreen {
 	struct display_info info;
 	int pscreen_id;
@@ -66,14 +105,22 @@ struct vscreen {
 	struct surface surf;
 	struct cursor cur;
 	SDL_Texture *surf_tex;
+	/* surf_tex belongs to one of the imports */
+	bool surf_tex_imported;
 	SDL_Texture *cur_tex;
 	SDL_Texture *bogus_tex;
 	int surf_updates;
 	int cur_updates;
+	/* a new frame or cursor waits for the next refresh tick */
+	bool frame_pending;
 	SDL_Window *win;
 	SDL_Renderer *renderer;
 	pixman_image_t *img;
-	EGLImage egl_img;
+	struct dmabuf_import imports[VDPY_DMABUF_IMPORTS];
+	uint64_t import_seq;
+	/* the dmabuf shown by copy, see vdpy_dmabuf_map() */
+	void *dmabuf_map;
+	size_t dmabuf_map_len;
 	/* Record the update_time that is activated from guest_vm */
 	struct timespec last_time;
 };
@@ -86,6 +133,9 @@ static struct display {
 	/* Add one UI_timer(33ms) to render the buffers from guest_vm */
 	struct acrn_timer ui_timer;
 	struct vdpy_display_bh ui_timer_bh;
+	enum vdpy_present_mode present_mode;
+	vdpy_vblank_cb vblank_cb;
+	void *vblank_data;
 	// protect the request_list
 	pthread_mutex_t vdisplay_mutex;
 	// receive the signal that request is submitted
@@ -579,7 +629,7 @@ sdl_gl_display_init(void)
 {
 	struct egl_display_ops *gl_ops = &vdpy.gl_ops;
 	struct vscreen *vscr;
-	int i;
+	int i, j;
 
 	/* obtain the eglDisplay/eglContext */
 	vdpy.eglDisplay = eglGetCurrentDisplay();
@@ -598,7 +648,8 @@ sdl_gl_display_init(void)
 
 	for (i = 0; i < vdpy.vscrs_num; i++) {
 		vscr = vdpy.vscrs + i;
-		vscr->egl_img = EGL_NO_IMAGE_KHR;
+		for (j = 0; j < VDPY_DMABUF_IMPORTS; j++)
+			vscr->imports[j].egl_img = EGL_NO_IMAGE_KHR;
 	}
 
 	if ((gl_ops->eglCreateImageKHR == NULL) ||
@@ -636,13 +687,180 @@ static void sdl_gl_prepare_draw(struct vscreen *vscr)
 	return;
 }
 
+/* Drop the texture and the mapping of the current surface of the screen */
+static void
+vdpy_surface_release(struct vscreen *vscr)
+{
+	if (vscr->surf_tex && !vscr->surf_tex_imported)
+		SDL_DestroyTexture(vscr->surf_tex);
+	vscr->surf_tex = NULL;
+	vscr->surf_tex_imported = false;
+
+	if (vscr->dmabuf_map) {
+		munmap(vscr->dmabuf_map, vscr->dmabuf_map_len);
+		vscr->dmabuf_map = NULL;
+		vscr->dmabuf_map_len = 0;
+	}
+}
+
+static void
+vdpy_dmabuf_import_fini(struct dmabuf_import *imp)
+{
+	if (imp->tex) {
+		SDL_DestroyTexture(imp->tex);
+		imp->tex = NULL;
+	}
+	if (imp->egl_img != EGL_NO_IMAGE_KHR) {
+		vdpy.gl_ops.eglDestroyImageKHR(vdpy.eglDisplay, imp->egl_img);
+		imp->egl_img = EGL_NO_IMAGE_KHR;
+	}
+	imp->ino = 0;
+}
+
+/*
+ * Look the dmabuf of the surface up in the imports of the screen, import it
+ * into a texture in place of the least recently used one if it is not
+ * there. A guest flipping between a few blob resources imports each of them
+ * once.
+ *
+ * The imports are keyed by the inode of the dmabuf rather than its fd or
+ * the id of its resource, both may be reused for another buffer. The
+ * EGLImage holds a reference to the dmabuf, its inode is not reused while
+ * it is cached.
+ */
+static struct dmabuf_import *
+vdpy_dmabuf_import(struct vscreen *vscr, struct surface *surf)
+{
+	struct egl_display_ops *gl_ops = &vdpy.gl_ops;
+	struct dmabuf_import *imp, *victim;
+	struct stat st;
+	EGLint attrs[64];
+	int i;
+
+	if (!vdpy.egl_dmabuf_supported)
+		return NULL;
+
+	if (fstat(surf->dma_info.dmabuf_fd, &st) != 0)
+		return NULL;
+
+	victim = &vscr->imports[0];
+	for (i = 0; i < VDPY_DMABUF_IMPORTS; i++) {
+		imp = &vscr->imports[i];
+		if ((imp->ino == st.st_ino) &&
+		    (imp->fourcc == surf->dma_info.surf_fourcc) &&
+		    (imp->offset == surf->dma_info.dmabuf_offset) &&
+		    (imp->stride == surf->stride) &&
+		    (imp->width == surf->width) &&
+		    (imp->height == surf->height)) {
+			imp->last_use = ++vscr->import_seq;
+			return imp;
+		}
+		if (imp->last_use < victim->last_use)
+			victim = imp;
+	}
+
+	imp = victim;
+	vdpy_dmabuf_import_fini(imp);
+
+	i = 0;
+	attrs[i++] = EGL_WIDTH;
+	attrs[i++] = surf->width;
+	attrs[i++] = EGL_HEIGHT;
+	attrs[i++] = surf->height;
+	attrs[i++] = EGL_LINUX_DRM_FOURCC_EXT;
+	attrs[i++] = surf->dma_info.surf_fourcc;
+	attrs[i++] = EGL_DMA_BUF_PLANE0_FD_EXT;
+	attrs[i++] = surf->dma_info.dmabuf_fd;
+	attrs[i++] = EGL_DMA_BUF_PLANE0_PITCH_EXT;
+	attrs[i++] = surf->stride;
+	attrs[i++] = EGL_DMA_BUF_PLANE0_OFFSET_EXT;
+	attrs[i++] = surf->dma_info.dmabuf_offset;
+	attrs[i++] = EGL_NONE;
+
+	imp->egl_img = gl_ops->eglCreateImageKHR(vdpy.eglDisplay,
+			EGL_NO_CONTEXT,
+			EGL_LINUX_DMA_BUF_EXT,
+			NULL, attrs);
+	if (imp->egl_img == EGL_NO_IMAGE_KHR) {
+		pr_err("Failed in eglCreateImageKHR.\n");
+		return NULL;
+	}
+
+	imp->tex = SDL_CreateTexture(vscr->renderer,
+			SDL_PIXELFORMAT_EXTERNAL_OES,
+			SDL_TEXTUREACCESS_STATIC,
+			surf->width, surf->height);
+	if (imp->tex == NULL) {
+		pr_err("Failed to create SDL_texture for dmabuf.\n");
+		vdpy_dmabuf_import_fini(imp);
+		return NULL;
+	}
+	SDL_GL_BindTexture(imp->tex, NULL, NULL);
+	gl_ops->glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, imp->egl_img);
+
+	imp->ino = st.st_ino;
+	imp->fourcc = surf->dma_info.surf_fourcc;
+	imp->offset = surf->dma_info.dmabuf_offset;
+	imp->stride = surf->stride;
+	imp->width = surf->width;
+	imp->height = surf->height;
+	imp->last_use = ++vscr->import_seq;
+
+	return imp;
+}
+
+/*
+ * The copy fallback of a dmabuf which cannot be imported: it is mapped and
+ * shown as a pixman surface, uploaded whole at each update.
+ */
+static void *
+vdpy_dmabuf_map(struct surface *surf, struct surface *map_surf, size_t *len)
+{
+	pixman_format_code_t format;
+	void *map;
+
+	switch (surf->dma_info.surf_fourcc) {
+	case DRM_FORMAT_XRGB8888:
+		format = PIXMAN_x8r8g8b8;
+		break;
+	case DRM_FORMAT_ABGR8888:
+		format = PIXMAN_a8b8g8r8;
+		break;
+	case DRM_FORMAT_XBGR8888:
+		format = PIXMAN_x8b8g8r8;
+		break;
+	default:
+		format = PIXMAN_a8r8g8b8;
+		break;
+	}
+
+	*len = surf->dma_info.dmabuf_offset + (size_t)surf->stride * surf->height;
+	map = mmap(NULL, *len, PROT_READ, MAP_SHARED,
+			surf->dma_info.dmabuf_fd, 0);
+	if (map == MAP_FAILED) {
+		pr_err("Failed to map the dmabuf: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	*map_surf = *surf;
+	map_surf->surf_type = SURFACE_PIXMAN;
+	map_surf->surf_format = format;
+	map_surf->pixel = (uint8_t *)map + surf->dma_info.dmabuf_offset;
+	map_surf->damage = NULL;
+
+	return map;
+}
+
 void
 vdpy_surface_set(int handle, int scanout_id, struct surface *surf)
 {
 	pixman_image_t *src_img;
 	int format;
-	int access, i;
 	struct vscreen *vscr;
+	struct dmabuf_import *imp;
+	struct surface map_surf;
+	void *map = NULL;
+	size_t map_len = 0;
 
 	if (handle != vdpy.s.n_connect) {
 		return;
@@ -660,6 +878,29 @@ vdpy_surface_set(int handle, int scanout_id, struct surface *surf)
 
 	vscr = vdpy.vscrs + scanout_id;
 
+	if (surf && (surf->surf_type == SURFACE_DMABUF)) {
+		imp = vdpy_dmabuf_import(vscr, surf);
+		if (imp) {
+			vdpy_surface_release(vscr);
+			vscr->surf_tex = imp->tex;
+			vscr->surf_tex_imported = true;
+			vscr->surf = *surf;
+			vscr->guest_width = surf->width;
+			vscr->guest_height = surf->height;
+			if (vscr->img) {
+				pixman_image_unref(vscr->img);
+				vscr->img = NULL;
+			}
+			SDL_SetWindowTitle(vscr->win, "ACRN Virtual Monitor");
+			return;
+		}
+
+		map = vdpy_dmabuf_map(surf, &map_surf, &map_len);
+		if (map == NULL)
+			return;
+		surf = &map_surf;
+	}
+
 	if (surf == NULL ) {
 		vscr->surf.width = 0;
 		vscr->surf.height = 0;
@@ -680,110 +921,69 @@ vdpy_surface_set(int handle, int scanout_id, struct surface *surf)
 			surf->stride);
 		if (src_img == NULL) {
 			pr_err("failed to create pixman_image\n");
+			if (map)
+				munmap(map, map_len);
 			return;
 		}
 		vscr->surf = *surf;
 		vscr->guest_width = surf->width;
 		vscr->guest_height = surf->height;
-	} else if (surf->surf_type == SURFACE_DMABUF) {
-		src_img = NULL;
-		vscr->surf = *surf;
-		vscr->guest_width = surf->width;
-		vscr->guest_height = surf->height;
 	} else {
 		/* Unsupported type */
 		return;
 	}
 
-	if (vscr->surf_tex) {
-		SDL_DestroyTexture(vscr->surf_tex);
-	}
-	if (surf && (surf->surf_type == SURFACE_DMABUF)) {
-		access = SDL_TEXTUREACCESS_STATIC;
-		format = SDL_PIXELFORMAT_EXTERNAL_OES;
-	} else {
-		access = SDL_TEXTUREACCESS_STREAMING;
+	vdpy_surface_release(vscr);
+	vscr->dmabuf_map = map;
+	vscr->dmabuf_map_len = map_len;
+
+	format = SDL_PIXELFORMAT_ARGB8888;
+	switch (pixman_image_get_format(src_img)) {
+	case PIXMAN_a8r8g8b8:
+	case PIXMAN_x8r8g8b8:
 		format = SDL_PIXELFORMAT_ARGB8888;
-		switch (pixman_image_get_format(src_img)) {
-		case PIXMAN_a8r8g8b8:
-		case PIXMAN_x8r8g8b8:
-			format = SDL_PIXELFORMAT_ARGB8888;
-			break;
-		case PIXMAN_a8b8g8r8:
-		case PIXMAN_x8b8g8r8:
-			format = SDL_PIXELFORMAT_ABGR8888;
-			break;
-		case PIXMAN_r8g8b8a8:
-			format = SDL_PIXELFORMAT_RGBA8888;
-		case PIXMAN_r8g8b8x8:
-			format = SDL_PIXELFORMAT_RGBX8888;
-			break;
-		case PIXMAN_b8g8r8a8:
-		case PIXMAN_b8g8r8x8:
-			format = SDL_PIXELFORMAT_BGRA8888;
-			break;
-		default:
-			pr_err("Unsupported format. %x\n",
-					pixman_image_get_format(src_img));
-		}
+		break;
+	case PIXMAN_a8b8g8r8:
+	case PIXMAN_x8b8g8r8:
+		format = SDL_PIXELFORMAT_ABGR8888;
+		break;
+	case PIXMAN_r8g8b8a8:
+		format = SDL_PIXELFORMAT_RGBA8888;
+	case PIXMAN_r8g8b8x8:
+		format = SDL_PIXELFORMAT_RGBX8888;
+		break;
+	case PIXMAN_b8g8r8a8:
+	case PIXMAN_b8g8r8x8:
+		format = SDL_PIXELFORMAT_BGRA8888;
+		break;
+	default:
+		pr_err("Unsupported format. %x\n",
+				pixman_image_get_format(src_img));
 	}
 	vscr->surf_tex = SDL_CreateTexture(vscr->renderer,
-			format, access,
+			format, SDL_TEXTUREACCESS_STREAMING,
 			vscr->guest_width, vscr->guest_height);
 
 	if (vscr->surf_tex == NULL) {
 		pr_err("Failed to create SDL_texture for surface.\n");
 	}
 
-	/* For the surf_switch, it will be updated in surface_update */
-	if (!surf) {
+	/*
+	 * For the surf_switch, it will be updated in surface_update. The
+	 * contents of a SURFACE_PIXMAN surface are uploaded now, the updates
+	 * upload its damaged parts only.
+	 */
+	if (surf) {
+		SDL_UpdateTexture(vscr->surf_tex, NULL,
+				  surf->pixel,
+				  surf->stride);
+	} else {
 		SDL_UpdateTexture(vscr->surf_tex, NULL,
 				  pixman_image_get_data(src_img),
 				  pixman_image_get_stride(src_img));
 		sdl_gl_prepare_draw(vscr);
 		SDL_RenderCopy(vscr->renderer, vscr->surf_tex, NULL, NULL);
 		SDL_RenderPresent(vscr->renderer);
-	} else if (surf->surf_type == SURFACE_DMABUF) {
-		EGLImageKHR egl_img = EGL_NO_IMAGE_KHR;
-		EGLint attrs[64];
-		struct egl_display_ops *gl_ops;
-
-		gl_ops = &vdpy.gl_ops;
-		i = 0;
-		attrs[i++] = EGL_WIDTH;
-		attrs[i++] = surf->width;
-		attrs[i++] = EGL_HEIGHT;
-		attrs[i++] = surf->height;
-		attrs[i++] = EGL_LINUX_DRM_FOURCC_EXT;
-		attrs[i++] = surf->dma_info.surf_fourcc;
-		attrs[i++] = EGL_DMA_BUF_PLANE0_FD_EXT;
-		attrs[i++] = surf->dma_info.dmabuf_fd;
-		attrs[i++] = EGL_DMA_BUF_PLANE0_PITCH_EXT;
-		attrs[i++] = surf->stride;
-		attrs[i++] = EGL_DMA_BUF_PLANE0_OFFSET_EXT;
-		attrs[i++] = surf->dma_info.dmabuf_offset;
-		attrs[i++] = EGL_NONE;
-
-		egl_img = gl_ops->eglCreateImageKHR(vdpy.eglDisplay,
-				EGL_NO_CONTEXT,
-				EGL_LINUX_DMA_BUF_EXT,
-				NULL, attrs);
-		if (egl_img == EGL_NO_IMAGE_KHR) {
-			pr_err("Failed in eglCreateImageKHR.\n");
-			return;
-		}
-
-		SDL_GL_BindTexture(vscr->surf_tex, NULL, NULL);
-		gl_ops->glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, egl_img);
-		if (vscr->egl_img != EGL_NO_IMAGE_KHR)
-			gl_ops->eglDestroyImageKHR(vdpy.eglDisplay,
-					vscr->egl_img);
-
-		/* In theory the created egl_img can be released after it is bound
-		 * to texture.
-		 * Now it is released next time so that it is controlled correctly
-		 */
-		vscr->egl_img = egl_img;
 	}
 
 	if (vscr->img)
@@ -816,6 +1016,31 @@ vdpy_cursor_position_transformation(struct display *vdpy, int scanout_id, SDL_Re
 	rect->h = (vscr->cur.height * vscr->height) / vscr->guest_height;
 }
 
+/*
+ * Upload only the damaged rectangles of the surface to the texture, one
+ * glTexSubImage2D() for each with the OpenGL renderers of SDL.
+ */
+static void
+vdpy_surface_upload_damage(struct vscreen *vscr, struct surface *surf)
+{
+	pixman_box16_t *boxes;
+	SDL_Rect rect;
+	int i, num, bytes_pp;
+
+	bytes_pp = PIXMAN_FORMAT_BPP(surf->surf_format) / 8;
+	boxes = pixman_region_rectangles(surf->damage, &num);
+	for (i = 0; i < num; i++) {
+		rect.x = boxes[i].x1;
+		rect.y = boxes[i].y1;
+		rect.w = boxes[i].x2 - boxes[i].x1;
+		rect.h = boxes[i].y2 - boxes[i].y1;
+		SDL_UpdateTexture(vscr->surf_tex, &rect,
+			  (uint8_t *)surf->pixel + rect.y * surf->stride +
+			  rect.x * bytes_pp,
+			  surf->stride);
+	}
+}
+
 void
 vdpy_surface_update(int handle, int scanout_id, struct surface *surf)
 {
@@ -842,10 +1067,29 @@ vdpy_surface_update(int handle, int scanout_id, struct surface *surf)
 	}
 
 	vscr = vdpy.vscrs + scanout_id;
-	if (surf->surf_type == SURFACE_PIXMAN)
+	if (surf->surf_type == SURFACE_PIXMAN) {
+		if (surf->damage == NULL) {
+			SDL_UpdateTexture(vscr->surf_tex, NULL,
+				  surf->pixel,
+				  surf->stride);
+		} else if (pixman_region_not_empty(surf->damage)) {
+			vdpy_surface_upload_damage(vscr, surf);
+		} else {
+			/* nothing has changed, skip the frame */
+			return;
+		}
+	} else if (vscr->dmabuf_map) {
+		/* the copy fallback of a dmabuf */
 		SDL_UpdateTexture(vscr->surf_tex, NULL,
-			  surf->pixel,
-			  surf->stride);
+			  vscr->surf.pixel,
+			  vscr->surf.stride);
+	}
+
+	if (vdpy.present_mode != VDPY_PRESENT_IMMEDIATE) {
+		/* presented by the next refresh tick */
+		vscr->frame_pending = true;
+		return;
+	}
 
 	sdl_gl_prepare_draw(vscr);
 	SDL_RenderCopy(vscr->renderer, vscr->surf_tex, NULL, NULL);
@@ -905,6 +1149,7 @@ vdpy_cursor_define(int handle, int scanout_id, struct cursor *cur)
 	SDL_SetTextureBlendMode(vscr->cur_tex, SDL_BLENDMODE_BLEND);
 	vscr->cur = *cur;
 	SDL_UpdateTexture(vscr->cur_tex, NULL, cur->data, cur->width * 4);
+	vscr->frame_pending = true;
 }
 
 void
@@ -926,6 +1171,43 @@ vdpy_cursor_move(int handle, int scanout_id, uint32_t x, uint32_t y)
 	 */
 	vscr->cur.x = x;
 	vscr->cur.y = y;
+	vscr->frame_pending = true;
+}
+
+static int
+vdpy_refresh_rate(int pscreen_id)
+{
+	SDL_DisplayMode mode;
+
+	if ((SDL_GetCurrentDisplayMode(pscreen_id, &mode) != 0) ||
+	    (mode.refresh_rate <= 0))
+		return VDPY_DEFAULT_REFRESH_RATE;
+
+	return mode.refresh_rate;
+}
+
+static void
+vdpy_sdl_ui_present(struct display *ui_vdpy, int scanout_id)
+{
+	SDL_Rect cursor_rect;
+	struct vscreen *vscr;
+
+	vscr = ui_vdpy->vscrs + scanout_id;
+	sdl_gl_prepare_draw(vscr);
+	SDL_RenderCopy(vscr->renderer, vscr->surf_tex, NULL, NULL);
+
+	/* This should be handled after rendering the surface_texture.
+	 * Otherwise it will be hidden
+	 */
+	if (vscr->cur_tex) {
+		vdpy_cursor_position_transformation(ui_vdpy, scanout_id, &cursor_rect);
+		SDL_RenderCopy(vscr->renderer, vscr->cur_tex,
+				NULL, &cursor_rect);
+	}
+
+	SDL_RenderPresent(vscr->renderer);
+	vscr->frame_pending = false;
+	clock_gettime(CLOCK_MONOTONIC, &vscr->last_time);
 }
 
 static void
@@ -934,8 +1216,9 @@ vdpy_sdl_ui_refresh(void *data)
 	struct display *ui_vdpy;
 	struct timespec cur_time;
 	uint64_t elapsed_time;
-	SDL_Rect cursor_rect;
 	struct vscreen *vscr;
+	vdpy_vblank_cb vblank_cb;
+	void *vblank_data;
 	int i;
 
 	ui_vdpy = (struct display *)data;
@@ -952,24 +1235,32 @@ vdpy_sdl_ui_refresh(void *data)
 		elapsed_time = (cur_time.tv_sec - vscr->last_time.tv_sec) * 1000000000 +
 				cur_time.tv_nsec - vscr->last_time.tv_nsec;
 
-		/* the time interval is less than 10ms. Skip it */
-		if (elapsed_time < 10000000)
-			return;
-
-		sdl_gl_prepare_draw(vscr);
-		SDL_RenderCopy(vscr->renderer, vscr->surf_tex, NULL, NULL);
-
-		/* This should be handled after rendering the surface_texture.
-		 * Otherwise it will be hidden
-		 */
-		if (vscr->cur_tex) {
-			vdpy_cursor_position_transformation(ui_vdpy, i, &cursor_rect);
-			SDL_RenderCopy(vscr->renderer, vscr->cur_tex,
-					NULL, &cursor_rect);
+		if (ui_vdpy->present_mode == VDPY_PRESENT_IMMEDIATE) {
+			/* the time interval is less than 10ms. Skip it */
+			if (elapsed_time < 10000000)
+				return;
+		} else if (!vscr->frame_pending &&
+			   (elapsed_time < VDPY_IDLE_REDRAW_NS)) {
+			/* nothing new to show */
+			continue;
 		}
 
-		SDL_RenderPresent(vscr->renderer);
+		vdpy_sdl_ui_present(ui_vdpy, i);
+	}
+
+	/*
+	 * The callback runs under vdisplay_mutex so that
+	 * vdpy_register_vblank() can't return while it still uses the data
+	 * being unregistered.
+	 */
+	pthread_mutex_lock(&ui_vdpy->vdisplay_mutex);
+	vblank_cb = ui_vdpy->vblank_cb;
+	vblank_data = ui_vdpy->vblank_data;
+	if (vblank_cb) {
+		for (i = 0; i < vdpy.vscrs_num; i++)
+			vblank_cb(vblank_data, i);
 	}
+	pthread_mutex_unlock(&ui_vdpy->vdisplay_mutex);
 }
 
 static void
@@ -1054,7 +1345,9 @@ vdpy_create_vscreen_window(struct vscreen *vscr)
 	pr_info("SDL display bind to screen %d: [%d,%d,%d,%d].\n", vscr->pscreen_id,
 			vscr->org_x, vscr->org_y, vscr->width, vscr->height);
 
-	vscr->renderer = SDL_CreateRenderer(vscr->win, -1, 0);
+	vscr->renderer = SDL_CreateRenderer(vscr->win, -1,
+			(vdpy.present_mode == VDPY_PRESENT_FIFO) ?
+			SDL_RENDERER_PRESENTVSYNC : 0);
 	if (vscr->renderer == NULL) {
 		pr_err("Failed to Create GL_Renderer \n");
 		return -1;
@@ -1079,7 +1372,7 @@ vdpy_sdl_display_thread(void *data)
 	struct itimerspec ui_timer_spec;
 
 	struct vscreen *vscr;
-	int i;
+	int i, j;
 
 	for (i = 0; i < vdpy.vscrs_num; i++) {
 		vscr = vdpy.vscrs + i;
@@ -1106,12 +1399,20 @@ vdpy_sdl_display_thread(void *data)
 	vdpy.ui_timer_bh.data = &vdpy;
 	vdpy.ui_timer.clockid = CLOCK_MONOTONIC;
 	acrn_timer_init(&vdpy.ui_timer, vdpy_sdl_ui_timer, &vdpy);
-	ui_timer_spec.it_interval.tv_sec = 0;
-	ui_timer_spec.it_interval.tv_nsec = 33000000;
-	/* Wait for 5s to start the timer */
-	ui_timer_spec.it_value.tv_sec = 5;
-	ui_timer_spec.it_value.tv_nsec = 0;
-	/* Start one periodic timer to refresh UI based on 30fps */
+	if (vdpy.present_mode == VDPY_PRESENT_IMMEDIATE) {
+		ui_timer_spec.it_interval.tv_sec = 0;
+		ui_timer_spec.it_interval.tv_nsec = 33000000;
+		/* Wait for 5s to start the timer */
+		ui_timer_spec.it_value.tv_sec = 5;
+		ui_timer_spec.it_value.tv_nsec = 0;
+	} else {
+		/* one refresh tick per frame of the monitor */
+		ui_timer_spec.it_interval.tv_sec = 0;
+		ui_timer_spec.it_interval.tv_nsec = 1000000000 /
+			vdpy_refresh_rate(vdpy.vscrs[0].pscreen_id);
+		ui_timer_spec.it_value = ui_timer_spec.it_interval;
+	}
+	/* Start one periodic timer to refresh UI */
 	acrn_timer_settime(&vdpy.ui_timer, &ui_timer_spec);
 
 	pr_info("SDL display thread is created\n");
@@ -1127,18 +1428,25 @@ vdpy_sdl_display_thread(void *data)
 			pthread_cond_wait(&vdpy.vdisplay_signal,
 					  &vdpy.vdisplay_mutex);
 
-		/* the bh_task is handled in vdisplay_mutex lock */
+		/*
+		 * The bh_task runs without vdisplay_mutex: a present waiting
+		 * for the vertical blank does not hold up the submitters. A
+		 * task submitted again while it runs is queued again.
+		 */
 		while (!TAILQ_EMPTY(&vdpy.request_list)) {
 			bh = TAILQ_FIRST(&vdpy.request_list);
 
 			TAILQ_REMOVE(&vdpy.request_list, bh, link);
+			bh->bh_flag &= ~ACRN_BH_PENDING;
+			pthread_mutex_unlock(&vdpy.vdisplay_mutex);
 
 			bh->task_cb(bh->data);
 
+			pthread_mutex_lock(&vdpy.vdisplay_mutex);
 			if (atomic_load(&bh->bh_flag) & ACRN_BH_FREE) {
 				free(bh);
 				bh = NULL;
-			} else {
+			} else if ((bh->bh_flag & ACRN_BH_PENDING) == 0) {
 				/* free is owned by the submitter */
 				atomic_store(&bh->bh_flag, ACRN_BH_DONE);
 			}
@@ -1159,18 +1467,16 @@ vdpy_sdl_display_thread(void *data)
 			vscr->img = NULL;
 		}
 		/* Continue to thread cleanup */
-		if (vscr->surf_tex) {
-			SDL_DestroyTexture(vscr->surf_tex);
-			vscr->surf_tex = NULL;
-		}
+		vdpy_surface_release(vscr);
 		if (vscr->cur_tex) {
 			SDL_DestroyTexture(vscr->cur_tex);
 			vscr->cur_tex = NULL;
 		}
 
-		if (vdpy.egl_dmabuf_supported && (vscr->egl_img != EGL_NO_IMAGE_KHR))
-			vdpy.gl_ops.eglDestroyImageKHR(vdpy.eglDisplay,
-						vscr->egl_img);
+		if (vdpy.egl_dmabuf_supported) {
+			for (j = 0; j < VDPY_DMABUF_IMPORTS; j++)
+				vdpy_dmabuf_import_fini(&vscr->imports[j]);
+		}
 	}
 
 sdl_fail:
@@ -1197,6 +1503,25 @@ sdl_fail:
 	return NULL;
 }
 
+/*
+ * The vblank events, on the display thread after each refresh tick. Only
+ * delivered with vsync=fifo, false otherwise.
+ */
+bool
+vdpy_register_vblank(int handle, vdpy_vblank_cb cb, void *data)
+{
+	if ((handle != vdpy.s.n_connect) ||
+	    (vdpy.present_mode != VDPY_PRESENT_FIFO))
+		return false;
+
+	/* waits for a running callback, none is called with the old data after */
+	pthread_mutex_lock(&vdpy.vdisplay_mutex);
+	vdpy.vblank_cb = cb;
+	vdpy.vblank_data = data;
+	pthread_mutex_unlock(&vdpy.vdisplay_mutex);
+	return true;
+}
+
 bool vdpy_submit_bh(int handle, struct vdpy_display_bh *bh_task)
 {
 	bool bh_ok = false;
@@ -1375,10 +1700,24 @@ int vdpy_parse_cmd_option(const char *opts)
 	}
 	vdpy.vscrs_num = 0;
 
+	vdpy.present_mode = VDPY_PRESENT_MAILBOX;
 	stropts = strdup(opts);
 	while ((str = strsep(&stropts, ",")) != NULL) {
 		vscr = vdpy.vscrs + vdpy.vscrs_num;
-		if ((tmp = strcasestr(str, "geometry=fullscreen")) != NULL) {
+		if ((tmp = strcasestr(str, "vsync=")) != NULL) {
+			tmp += strlen("vsync=");
+			if (strcasecmp(tmp, "off") == 0) {
+				vdpy.present_mode = VDPY_PRESENT_IMMEDIATE;
+			} else if (strcasecmp(tmp, "mailbox") == 0) {
+				vdpy.present_mode = VDPY_PRESENT_MAILBOX;
+			} else if (strcasecmp(tmp, "fifo") == 0) {
+				vdpy.present_mode = VDPY_PRESENT_FIFO;
+			} else {
+				pr_err("incorrect vsync option. Should be"
+						" off, mailbox or fifo\n");
+				error = -1;
+			}
+		} else if ((tmp = strcasestr(str, "geometry=fullscreen")) != NULL) {
 			snum = sscanf(tmp, "geometry=fullscreen:%d", &vscr->pscreen_id);
 			if (snum != 1) {
 				vscr->pscreen_id = 0;
@@ -296,6 +296,7 @@ vga_render(struct gfx_ctx *gc, void *arg)
 {
 	struct vga_vdev *vd = arg;
 
+	drain_coalesced_mmio();
 	vga_check_size(gc, vd);
 
 	if (vga_in_reset(vd)) {
@@ -1329,6 +1330,8 @@ vga_init(struct gfx_ctx *gc, int io_only)
 		pr_err("%s: failed to register mem fallback.\n", __func__);
 		return NULL;
 	}
+	/* the reads drain the posted writes first, so do vga_render() */
+	register_coalesced_mmio(vd->mr.base, vd->mr.size);
 
 	vd->vga_ram = calloc(256, KB);
 	if (!vd->vga_ram) {
@@ -1506,6 +1509,7 @@ void vga_deinit(struct vga *vga)
 		}
 	}
 
+	unregister_coalesced_mmio(vd->mr.base, vd->mr.size);
 	rc = unregister_mem_fallback(&vd->mr);
 	if (rc == -1) {
 		pr_err("%s: fail to unregister mem fallback.\n", __func__);
@@ -92,6 +92,8 @@ struct acpi_madt_local_apic {
 
 /* All dynamic table entry no. */
 #define NHLT_ENTRY_NO		8
+#define SRAT_ENTRY_NO		10
+#define SLIT_ENTRY_NO		11
 
 #define EFPRINTF(...) fprintf(__VA_ARGS__)
 #define EFFLUSH(x) fflush(x)
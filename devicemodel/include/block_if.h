@@ -36,6 +36,7 @@
 #ifndef _BLOCK_IF_H_
 #define _BLOCK_IF_H_
 
+#include <stdint.h>
 #include <sys/uio.h>
 #include <sys/unistd.h>
 
@@ -48,10 +49,25 @@ struct blockif_req {
 	ssize_t		resid;
 	void		(*callback)(struct blockif_req *req, int err);
 	void		*param;
+	int		qidx;	/* submission queue, see blockif_open() */
+};
+
+/* the requests accepted since the open, see blockif_get_stats() */
+struct blockif_stats {
+	uint64_t	reads;
+	uint64_t	writes;
+	uint64_t	flushes;
+	uint64_t	discards;
+	uint64_t	read_bytes;
+	uint64_t	write_bytes;
 };
 
 struct blockif_ctxt;
-struct blockif_ctxt *blockif_open(const char *optstr, const char *ident);
+struct vmctx;
+struct iothreads_info;
+struct blockif_ctxt *blockif_open(const char *optstr, const char *ident,
+		int queue_num, struct iothreads_info *iothreads);
+int	blockif_register_mem(struct blockif_ctxt *bc, struct vmctx *ctx);
 off_t	blockif_size(struct blockif_ctxt *bc);
 void	blockif_chs(struct blockif_ctxt *bc, uint16_t *c, uint8_t *h,
 		    uint8_t *s);
@@ -65,6 +81,7 @@ int	blockif_write(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_flush(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_discard(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq);
+void	blockif_get_stats(struct blockif_ctxt *bc, struct blockif_stats *stats);
 int	blockif_close(struct blockif_ctxt *bc);
 uint8_t	blockif_get_wce(struct blockif_ctxt *bc);
 void	blockif_set_wce(struct blockif_ctxt *bc, uint8_t wce);
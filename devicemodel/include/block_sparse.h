@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2026 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Sparse (thin-provisioned) disk images for block_if, see block_sparse.c for
+ * the format. All the routines are thread safe.
+ */
+
+#ifndef _BLOCK_SPARSE_H_
+#define _BLOCK_SPARSE_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct sparse_image;
+
+struct sparse_image *sparse_open(int fd, int rdonly, const char *backing);
+void	sparse_close(struct sparse_image *si);
+off_t	sparse_size(struct sparse_image *si);
+int	sparse_cluster_size(struct sparse_image *si);
+ssize_t	sparse_preadv(struct sparse_image *si, const struct iovec *iov,
+		int iovcnt, off_t offset);
+ssize_t	sparse_pwritev(struct sparse_image *si, const struct iovec *iov,
+		int iovcnt, off_t offset);
+
+#endif /* _BLOCK_SPARSE_H_ */
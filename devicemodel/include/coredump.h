@@ -0,0 +1,18 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Live dump of a User VM to an ELF core file crash can open, see coredump.c.
+ */
+
+#ifndef _COREDUMP_H_
+#define _COREDUMP_H_
+
+struct vmctx;
+
+int vm_dump(struct vmctx *ctx, const char *path);
+
+#endif /* _COREDUMP_H_ */
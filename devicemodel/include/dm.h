@@ -51,6 +51,8 @@ extern bool pt_tpm2;
 extern bool ssram;
 extern bool vtpm2;
 extern bool is_winvm;
+extern bool gfx_ui;
+extern bool vnuma;
 
 /**
  * @brief Convert guest physical address to host virtual address
@@ -66,4 +68,36 @@ int  virtio_uses_msix(void);
 size_t high_bios_size(void);
 void init_debugexit(void);
 void deinit_debugexit(void);
+
+/**
+ * @brief Serialize device emulation against the ioreq workers
+ *
+ * With --ioreq_workers the I/O requests of different vCPUs are emulated in
+ * parallel. Handlers registered with IOPORT_F_MT_SAFE/MEM_F_MT_SAFE do their
+ * own locking and run with the lock held shared, any other emulation (legacy
+ * devices, PCI config space) has to hold it exclusively. Both are no-ops when
+ * the requests are emulated by vm_loop() itself.
+ *
+ * @param exclusive Whether the caller needs exclusive access.
+ */
+void ioreq_emul_lock(bool exclusive);
+void ioreq_emul_unlock(void);
+
+/**
+ * @brief Get the numbers of I/O requests handled so far
+ *
+ * @param counts Filled with the numbers of port I/O, MMIO, PCI config space,
+ *        write-protect and string port I/O requests, in this order, 0
+ *        beyond them.
+ * @param num Number of entries of counts.
+ */
+void dm_get_ioreq_stats(uint64_t *counts, int num);
+void dm_get_ioreq_time(uint64_t *ns, int num);
+
+/**
+ * @brief Set the exit status of the DM for when the VM powers off
+ *
+ * @param code The status, 0 unless a device has set one.
+ */
+void dm_set_exit_code(int code);
 #endif
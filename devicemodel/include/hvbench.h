@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * The interface between the hvbench PCI device and the benchmark payload of
+ * misc/debug_tools/hvbench, shared by both. The payload finds the device on
+ * bus 0 by its IDs, times each operation HVBENCH_REG_ITERS times and hands
+ * the device the result of each in its memory.
+ */
+
+#ifndef _HVBENCH_H_
+#define _HVBENCH_H_
+
+#include <stdint.h>
+
+#define HVBENCH_VENDOR_ID	0x8086
+#define HVBENCH_DEVICE_ID	0x4256
+
+/* BAR0, I/O ports */
+#define HVBENCH_PIO_BAR		0
+#define HVBENCH_PIO_SIZE	0x20
+#define HVBENCH_REG_ID		0x0	/* read: HVBENCH_MAGIC, the timed I/O port read */
+#define HVBENCH_REG_ITERS	0x4	/* read: the samples to take of each operation */
+#define HVBENCH_REG_RESULT	0x8	/* write: GPA of a struct hvbench_result */
+#define HVBENCH_REG_DONE	0xc	/* write: the payload is done, 0 or the vector it faulted on + 1 */
+#define HVBENCH_REG_IRQ		0x10	/* write: an HVBENCH_OP_IRQ_*, raised after a random delay;
+					 * read: 0 if the last one written is on its way */
+#define HVBENCH_REG_IRQ_ACK	0x14	/* write: lower the INTx line */
+#define HVBENCH_REG_IRQ_TSC	0x18	/* read: low then high dword of the TSC the last interrupt was
+					 * raised at, in the Service VM */
+
+/* BAR1, memory, any read is the timed MMIO read */
+#define HVBENCH_MMIO_BAR	1
+#define HVBENCH_MMIO_SIZE	0x1000
+
+#define HVBENCH_MAGIC		0x4e454248U	/* "HBEN" */
+#define HVBENCH_ITERS_MAX	1000000U
+
+enum hvbench_op {
+	HVBENCH_OP_CPUID,	/* CPUID leaf 0, emulated by the hypervisor */
+	HVBENCH_OP_PIO_HV,	/* read of port 0xcf8, emulated by the hypervisor */
+	HVBENCH_OP_PIO_DM,	/* read of HVBENCH_REG_ID, an I/O request to the DM */
+	HVBENCH_OP_MMIO_DM,	/* read of BAR1, an I/O request to the DM */
+	HVBENCH_OP_HYPERCALL,	/* KVM_HC_VAPIC_POLL_IRQ, needs the KVM paravirtual interface */
+	HVBENCH_OP_IPI,		/* self IPI, from the write of the ICR to the handler */
+	/* from the DM raising the interrupt to the handler, with MSI 0 and the INTx line */
+	HVBENCH_OP_IRQ_MSI,	/* the MSI, with vm_lapic_msi() */
+	HVBENCH_OP_IRQ_IRQFD,	/* the MSI, with an irqfd */
+	HVBENCH_OP_IRQ_INTX,	/* INTx, a level interrupt of the vIOAPIC, with vm_set_gsi_irq() */
+	HVBENCH_OP_NUM,
+};
+
+#define HVBENCH_HIST_BUCKETS	32
+
+/* TSC cycles per operation */
+struct hvbench_result {
+	uint32_t op;
+	uint32_t count;		/* 0 if the operation is not available */
+	uint64_t total;
+	uint32_t min;
+	uint32_t p50;
+	uint32_t p99;
+	uint32_t max;
+	uint32_t hist[HVBENCH_HIST_BUCKETS];	/* bucket n: [2^n, 2^(n+1)) cycles, 0 in bucket 0 */
+};
+
+#endif
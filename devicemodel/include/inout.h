@@ -50,6 +50,7 @@ struct inout_port {
 #define	IOPORT_F_IN		0x1
 #define	IOPORT_F_OUT		0x2
 #define	IOPORT_F_INOUT		(IOPORT_F_IN | IOPORT_F_OUT)
+#define	IOPORT_F_MT_SAFE	0x4	/* handler serializes itself, see ioreq_emul_lock() */
 
 /*
  * The following flags are used internally and must not be used by
@@ -71,6 +72,8 @@ struct inout_port {
 
 void	init_inout(void);
 int	emulate_inout(struct vmctx *ctx, int *pvcpu, struct acrn_pio_request *req);
+int	emulate_inout_string(struct vmctx *ctx, int *pvcpu,
+		struct acrn_pio_string_request *req);
 int	register_inout(struct inout_port *iop);
 int	unregister_inout(struct inout_port *iop);
 
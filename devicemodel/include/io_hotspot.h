@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Sampler of the port I/O and MMIO accesses the device model emulates most,
+ * see io_hotspot.c. The hypervisor samples the ones it traps on, with the
+ * guest RIP, on its own.
+ */
+
+#ifndef _IO_HOTSPOT_H_
+#define _IO_HOTSPOT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* one in 2^IO_HOTSPOT_SAMPLE_SHIFT accesses is sampled */
+#define IO_HOTSPOT_SAMPLE_SHIFT	4
+
+#define IO_HOTSPOT_PIO		0
+#define IO_HOTSPOT_MMIO		1
+
+struct io_hotspots;
+
+extern uint64_t io_hotspot_seen;
+
+/* cheap enough to call on every access */
+static inline bool
+io_hotspot_sample_due(void)
+{
+	uint64_t seen = __atomic_add_fetch(&io_hotspot_seen, 1, __ATOMIC_RELAXED);
+
+	return (seen & ((1UL << IO_HOTSPOT_SAMPLE_SHIFT) - 1)) == 0;
+}
+
+void io_hotspot_sample(int type, uint64_t addr, const char *dev);
+void io_hotspot_get(struct io_hotspots *out, bool reset);
+
+#endif
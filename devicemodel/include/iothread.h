@@ -7,14 +7,50 @@
 #ifndef	_iothread_CTX_H_
 #define	_iothread_CTX_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <sched.h>
+
+#define IOTHREAD_NUM			40
+#define IOTHREADS_PER_DEV_MAX		8
+
+struct iothread_ctx;
+
 struct iothread_mevent {
 	void (*run)(void *);
 	void *arg;
 	int fd;
+	/*
+	 * Optional busy-poll hooks, used with --iothread_busy_poll:
+	 * poll() handles whatever work is pending and returns whether there
+	 * was any, poll_notify() turns the notifications (kicks) of the
+	 * sender off while the iothread polls and back on before it sleeps.
+	 */
+	bool (*poll)(void *);
+	void (*poll_notify)(void *, bool enable);
+	/*
+	 * The epoll events to wait for. 0 stands for EPOLLIN on an eventfd,
+	 * which is read out before run() is called; any other fd (a socket)
+	 * is left for run() to handle.
+	 */
+	uint32_t events;
 };
-int iothread_add(int fd, struct iothread_mevent *aevt);
-int iothread_del(int fd);
+
+/* The iothreads of a device, its virtqueue n is served by ioctx_base[n % num] */
+struct iothreads_info {
+	struct iothread_ctx *ioctx_base[IOTHREADS_PER_DEV_MAX];
+	int num;
+};
+
+/* A NULL ioctx stands for the default iothread */
+int iothread_add(struct iothread_ctx *ioctx, int fd, struct iothread_mevent *aevt);
+int iothread_del(struct iothread_ctx *ioctx, int fd);
+int iothread_mod(struct iothread_ctx *ioctx, int fd, struct iothread_mevent *aevt);
+struct iothread_ctx *iothread_create(const cpu_set_t *cpuset);
+int iothread_parse_options(char *opt, struct iothreads_info *info);
+void iothread_release(struct iothreads_info *info);
 int iothread_init(void);
 void iothread_deinit(void);
+int acrn_parse_iothread_busy_poll(const char *opt);
 
 #endif
@@ -49,6 +49,7 @@ struct mem_range {
 #define	MEM_F_WRITE		0x2
 #define	MEM_F_RW		(MEM_F_READ | MEM_F_WRITE)
 #define	MEM_F_IMMUTABLE		0x4	/* mem_range cannot be unregistered */
+#define	MEM_F_MT_SAFE		0x8	/* handler serializes itself, see ioreq_emul_lock() */
 
 int	emulate_mem(struct vmctx *ctx, struct acrn_mmio_request *mmio_req);
 int	register_mem(struct mem_range *memp);
@@ -57,4 +58,14 @@ int	unregister_mem(struct mem_range *memp);
 int	unregister_mem_fallback(struct mem_range *memp);
 void	init_mem(void);
 
+/*
+ * Coalesced MMIO: the writes of the guest to a zone are posted to a ring by
+ * the hypervisor, the vCPU does not wait for them. For write-only registers
+ * and memory whose writes need no response, e.g. the VGA memory.
+ */
+int	init_coalesced_mmio(struct vmctx *ctx);
+int	register_coalesced_mmio(uint64_t addr, uint32_t len);
+int	unregister_coalesced_mmio(uint64_t addr, uint32_t len);
+void	drain_coalesced_mmio(void);
+
 #endif	/* _MEM_H_ */
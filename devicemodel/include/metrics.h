@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Runtime metrics of the device model, see metrics.c. The devices keep
+ * plain counters and register a source which reads them when a snapshot
+ * is taken; nothing is done on their paths for it.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* the snapshots of the VMs, served by acrnd */
+#define METRICS_PATH	"/run/acrn/metrics"
+
+#define METRIC_COUNTER	"counter"
+#define METRIC_GAUGE	"gauge"
+
+struct vmctx;
+struct metrics_out;
+
+/* the I/O requests are timed, set by --metrics */
+extern bool metrics_enabled;
+
+/*
+ * Add a sample of @name to the snapshot, @labels is printf-like and may be
+ * NULL, the vm label is added to all of them. @name, @type and @help must
+ * live as long as the source.
+ */
+void metrics_add(struct metrics_out *mo, const char *name, const char *type,
+		const char *help, uint64_t value, const char *labels, ...)
+		__attribute__((format(printf, 6, 7)));
+
+/* @fn is called with @arg for each snapshot, from the metrics thread */
+int metrics_register(void (*fn)(struct metrics_out *mo, void *arg), void *arg);
+void metrics_unregister(void *arg);
+
+int acrn_parse_metrics(const char *opt);
+int metrics_init(struct vmctx *ctx, int ncpus);
+void metrics_deinit(void);
+
+#endif
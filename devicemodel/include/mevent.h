@@ -29,6 +29,8 @@
 #ifndef	_MEVENT_H_
 #define	_MEVENT_H_
 
+#include <stdbool.h>
+
 enum ev_type {
 	EVF_READ,
 	EVF_WRITE,
@@ -43,6 +45,9 @@ struct mevent;
 struct mevent *mevent_add(int fd, enum ev_type type,
 			  void (*run)(int, enum ev_type, void *), void *param,
 			  void (*teardown)(void *), void *teardown_param);
+struct mevent *mevent_add_batch(int fd, enum ev_type type,
+			  bool (*run)(int, enum ev_type, void *), void *param,
+			  void (*teardown)(void *), void *teardown_param);
 int	mevent_enable(struct mevent *evp);
 int	mevent_disable(struct mevent *evp);
 int	mevent_delete(struct mevent *evp);
@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Live migration of a User VM to an acrn-dm started with the same command
+ * line plus --incoming on another host, see migration.c.
+ */
+
+#ifndef _MIGRATION_H_
+#define _MIGRATION_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct vmctx;
+
+int vm_migrate(struct vmctx *ctx, const char *spec);
+int vm_incoming(struct vmctx *ctx, const char *spec);
+
+/*
+ * The device model writes to the guest memory through its own mapping, which
+ * is not in the EPT dirty log: while a migration runs, the devices log the
+ * guest memory they write to with migrate_log_dirty().
+ */
+extern bool migrate_logging;
+
+void migrate_log_dirty(uint64_t gpa, uint64_t len);
+
+#endif /* _MIGRATION_H_ */
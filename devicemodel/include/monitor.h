@@ -34,9 +34,13 @@ int monitor_register_vm_ops(struct monitor_vm_ops *ops, void *arg,
 /* helper functions for vm_ops callback developer */
 unsigned get_wakeup_reason(void);
 int set_wakeup_timer(time_t t);
+void monitor_notify_state(int state);
 int acrn_parse_intr_monitor(const char *opt);
 int vm_monitor_blkrescan(void *arg, char *devargs);
 
 int vm_monitor_send_vm_event(const char *msg);
 
+/* run a slow monitor command off the monitor sockets, 0 or -1 */
+int monitor_queue_work(void (*fn)(void *arg), void *arg);
+
 #endif
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * NUMA placement of the guest memory on the host nodes of the pCPUs of the
+ * vCPUs, and the virtual nodes exposed with --vnuma, see numa.c.
+ */
+
+#ifndef _NUMA_H_
+#define _NUMA_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define NUMA_MAX_VNODES		8
+
+struct vmctx;
+
+struct numa_mem_range {
+	uint64_t gpa;
+	uint64_t len;
+};
+
+int numa_init(int ncpu);
+int numa_layout(struct vmctx *ctx, uint64_t align);
+void numa_bind_memory(struct vmctx *ctx);
+
+int numa_nr_vnodes(void);
+int numa_host_node(int vnode);
+int numa_vcpu_vnode(int vcpu_id);
+int numa_vnode_ranges(int vnode, struct numa_mem_range *ranges);
+int numa_distance(int from, int to);
+
+#endif /* _NUMA_H_ */
@@ -39,6 +39,9 @@ struct passthru_dev {
 	bool need_rombar;
 	char *rom_buffer;
 	bool (*has_virt_pcicfg_regs)(int offset);
+	/* copies of the read-only config registers, one map bit per word */
+	uint8_t cfg_shadow[PCIE_REGMAX + 1];
+	uint64_t cfg_shadow_map[(PCIE_REGMAX + 1) / 128];
 };
 
 #endif
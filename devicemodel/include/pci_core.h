@@ -90,6 +90,10 @@ struct pci_vdev_ops {
 	uint64_t  (*vdev_barread)(struct vmctx *ctx, int vcpu,
 				struct pci_vdev *pi, int baridx,
 				uint64_t offset, int size);
+
+	/* snapshot of the device state after its config space, 0 on success */
+	int	(*vdev_snapshot)(struct vmctx *ctx, struct pci_vdev *pi, int fd);
+	int	(*vdev_restore)(struct vmctx *ctx, struct pci_vdev *pi, int fd);
 };
 
 /*
@@ -178,6 +182,9 @@ struct pci_vdev {
 
 	void	*arg;		/* devemu-private data */
 
+	pthread_mutex_t	emul_lock;	/* serializes BAR accesses from the ioreq workers */
+	bool	cfg_shadowed;	/* the hypervisor serves the static config accesses */
+
 	uint8_t	cfgdata[PCI_REGMAX + 1];
 	/* 0..5 is used for PCI MMIO/IO bar. 6 is used for PCI ROMbar */
 	struct pcibar bar[PCI_BARMAX + 2];
@@ -309,6 +316,9 @@ typedef void (*pci_lintr_cb)(int b, int s, int pin, int pirq_pin,
 
 int	init_pci(struct vmctx *ctx);
 void	deinit_pci(struct vmctx *ctx);
+int	pci_snapshot_capable(void);
+int	pci_snapshot(struct vmctx *ctx, int fd);
+int	pci_restore(struct vmctx *ctx, int fd);
 void	msicap_cfgwrite(struct pci_vdev *pi, int capoff, int offset,
 			int bytes, uint32_t val);
 void	msixcap_cfgwrite(struct pci_vdev *pi, int capoff, int offset,
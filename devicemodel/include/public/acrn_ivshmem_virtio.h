@@ -0,0 +1 @@
+../../../hypervisor/include/public/acrn_ivshmem_virtio.h
\ No newline at end of file
@@ -81,6 +81,24 @@
 	_IO(ACRN_IOCTL_TYPE, 0x15)
 #define ACRN_IOCTL_SET_VCPU_REGS	\
 	_IOW(ACRN_IOCTL_TYPE, 0x16, struct acrn_vcpu_regs)
+#define ACRN_IOCTL_GET_VCPU_STATE	\
+	_IOWR(ACRN_IOCTL_TYPE, 0x17, struct acrn_vcpu_state)
+#define ACRN_IOCTL_SET_VCPU_STATE	\
+	_IOW(ACRN_IOCTL_TYPE, 0x18, struct acrn_vcpu_state)
+#define ACRN_IOCTL_GET_VIOAPIC_STATE	\
+	_IOR(ACRN_IOCTL_TYPE, 0x19, struct acrn_vioapic_state)
+#define ACRN_IOCTL_SET_VIOAPIC_STATE	\
+	_IOW(ACRN_IOCTL_TYPE, 0x1a, struct acrn_vioapic_state)
+#define ACRN_IOCTL_GET_VM_RDT_MON	\
+	_IOR(ACRN_IOCTL_TYPE, 0x1b, struct acrn_vm_rdt_mon)
+#define ACRN_IOCTL_VM_LATENCY_PROBE	\
+	_IOWR(ACRN_IOCTL_TYPE, 0x1c, struct acrn_vm_latency)
+#define ACRN_IOCTL_GET_VCPU_SCHED_STATS	\
+	_IOWR(ACRN_IOCTL_TYPE, 0x1d, struct acrn_vcpu_sched_stats)
+#define ACRN_IOCTL_GET_VCPU_EXIT_STATS	\
+	_IOWR(ACRN_IOCTL_TYPE, 0x1e, struct acrn_vcpu_exit_stats)
+#define ACRN_IOCTL_GET_CPU_UTIL		\
+	_IOR(ACRN_IOCTL_TYPE, 0x1f, struct acrn_cpu_util)
 
 /* IRQ and Interrupts */
 #define ACRN_IOCTL_INJECT_MSI		\
@@ -101,12 +119,18 @@
 	_IO(ACRN_IOCTL_TYPE, 0x34)
 #define ACRN_IOCTL_CLEAR_VM_IOREQ	\
 	_IO(ACRN_IOCTL_TYPE, 0x35)
+#define ACRN_IOCTL_NOTIFY_REQUEST_FINISH_BATCH \
+	_IOW(ACRN_IOCTL_TYPE, 0x36, struct acrn_ioreq_notify_batch)
 
 /* Guest memory management */
 #define ACRN_IOCTL_SET_MEMSEG		\
 	_IOW(ACRN_IOCTL_TYPE, 0x41, struct acrn_vm_memmap)
 #define ACRN_IOCTL_UNSET_MEMSEG		\
 	_IOW(ACRN_IOCTL_TYPE, 0x42, struct acrn_vm_memmap)
+#define ACRN_IOCTL_GET_DIRTY_LOG	\
+	_IOW(ACRN_IOCTL_TYPE, 0x43, struct acrn_vm_dirty_log)
+#define ACRN_IOCTL_SET_LAZY_MEMORY	\
+	_IOW(ACRN_IOCTL_TYPE, 0x44, struct acrn_vm_lazy_memory)
 
 /* PCI assignment*/
 #define ACRN_IOCTL_SET_PTDEV_INTR	\
@@ -125,6 +149,10 @@
 	_IOW(ACRN_IOCTL_TYPE, 0x59, struct acrn_vdev)
 #define ACRN_IOCTL_DESTROY_VDEV	\
 	_IOW(ACRN_IOCTL_TYPE, 0x5A, struct acrn_vdev)
+#define ACRN_IOCTL_ADD_VDEV_CFG_SHADOW	\
+	_IOW(ACRN_IOCTL_TYPE, 0x5B, struct acrn_vdev_cfg_shadow)
+#define ACRN_IOCTL_REMOVE_VDEV_CFG_SHADOW	\
+	_IOW(ACRN_IOCTL_TYPE, 0x5C, struct acrn_vdev_cfg_shadow)
 
 /* Power management */
 #define ACRN_IOCTL_PM_GET_CPU_STATE	\
@@ -140,6 +168,22 @@
 #define ACRN_IOCTL_SETUP_ASYNCIO	\
 	_IOW(ACRN_IOCTL_TYPE, 0x90, __u64)
 
+/* Coalesced MMIO */
+#define ACRN_IOCTL_SETUP_COALESCED_MMIO_RING	\
+	_IOW(ACRN_IOCTL_TYPE, 0x91, __u64)
+#define ACRN_IOCTL_ADD_COALESCED_MMIO	\
+	_IOW(ACRN_IOCTL_TYPE, 0x92, struct acrn_coalesced_mmio_zone)
+#define ACRN_IOCTL_REMOVE_COALESCED_MMIO	\
+	_IOW(ACRN_IOCTL_TYPE, 0x93, struct acrn_coalesced_mmio_zone)
+
+/* Counter registers read from the TSC */
+#define ACRN_IOCTL_SET_TSC_COUNTER	\
+	_IOW(ACRN_IOCTL_TYPE, 0x94, struct acrn_tsc_counter)
+
+/* Hypercalls in bulk */
+#define ACRN_IOCTL_MULTICALL		\
+	_IOWR(ACRN_IOCTL_TYPE, 0x95, struct acrn_multicall)
+
 /* VM EVENT */
 #define ACRN_IOCTL_SETUP_VM_EVENT_RING	\
 	_IOW(ACRN_IOCTL_TYPE, 0xa0, __u64)
@@ -190,6 +234,43 @@ struct acrn_vm_memmap {
 	__u64	len;
 };
 
+/* log the pages accessed instead of the pages written to */
+#define ACRN_VM_DIRTY_LOG_ACCESSED	(1U << 0)
+
+/**
+ * @brief get and clear the dirty log of a guest memory range
+ *
+ * Needs a VM created with GUEST_FLAG_DIRTY_LOG, see HC_VM_GET_DIRTY_LOG.
+ */
+struct acrn_vm_dirty_log {
+	__u32	flags;
+	__u32	reserved;
+	/** page aligned guest physical address of the range */
+	__u64	gpa;
+	/** page aligned size of the range */
+	__u64	size;
+	/** user address of the bitmap, one bit per page of the range, set
+	 *  if the page was written to since the last call
+	 */
+	__u64	bitmap;
+};
+
+#define ACRN_VM_LAZY_MEMORY_RANGES	2
+
+/**
+ * @brief the guest RAM ranges the DM maps on demand
+ *
+ * A vCPU of the User VM accessing a page of them the EPT doesn't map may run
+ * another task of the guest until the DM mapped it, see HC_VM_SET_LAZY_MEMORY.
+ * The ranges of size 0 are unused.
+ */
+struct acrn_vm_lazy_memory {
+	/** page aligned guest physical address of each range */
+	__u64	gpa[ACRN_VM_LAZY_MEMORY_RANGES];
+	/** page aligned size of each range */
+	__u64	size[ACRN_VM_LAZY_MEMORY_RANGES];
+};
+
 /* Type of interrupt of a passthrough device */
 #define ACRN_PTDEV_IRQ_INTX	0
 #define ACRN_PTDEV_IRQ_MSI	1
@@ -228,12 +309,26 @@ struct acrn_ioreq_notify {
 	__u32	vcpu;
 };
 
+/**
+ * @brief data strcture to notify hypervisor a batch of ioreqs are handled
+ */
+struct acrn_ioreq_notify_batch {
+	/** VM id to identify ioreq client */
+	__u16	vmid;
+	__u16	reserved;
+	__u32	reserved1;
+	/** bitmap of the ioreq submitters, bit n for vcpu n */
+	__u64	vcpu_bitmap;
+};
+
 #define ACRN_PLATFORM_LAPIC_IDS_MAX	64
 struct acrn_ioeventfd {
 #define ACRN_IOEVENTFD_FLAG_PIO		0x01
 #define ACRN_IOEVENTFD_FLAG_DATAMATCH	0x02
 #define ACRN_IOEVENTFD_FLAG_DEASSIGN	0x04
 #define ACRN_IOEVENTFD_FLAG_ASYNCIO	0x08
+/* match any access within [addr, addr + len), the data is not matched */
+#define ACRN_IOEVENTFD_FLAG_WILDCARD	0x10
        /** file descriptor of the eventfd of this ioeventfd */
        int32_t fd;
        /** flag for ioeventfd ioctl */
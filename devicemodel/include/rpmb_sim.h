@@ -41,6 +41,9 @@ static inline uint16_t swap16(uint16_t val)
 		| ((val & (uint16_t)0xff00U) >> 8);
 }
 
+/* Most blocks the simulated RPMB takes in one authenticated data write */
+#define RPMB_SIM_MAX_REL_WRITE	32
+
 int rpmb_mac(const uint8_t *key, const struct rpmb_frame *frames,
 		size_t frame_cnt, uint8_t *mac);
 int is_use_sim_rpmb(void);
@@ -31,7 +31,16 @@ static inline void sbuf_add_flags(struct shared_buf *sbuf, uint64_t flags)
         sbuf->flags |= flags;
 }
 
+/* Contiguous elements buffered in a shared_buf, see sbuf_peek() */
+struct sbuf_span {
+	void *data;
+	uint32_t len;		/* in bytes, a multiple of ele_size */
+};
+
 uint32_t sbuf_get(struct shared_buf *sbuf, uint8_t *data);
+uint32_t sbuf_get_batch(struct shared_buf *sbuf, uint8_t *data, uint32_t max_num);
+uint32_t sbuf_peek(struct shared_buf *sbuf, struct sbuf_span span[2]);
+int sbuf_commit(struct shared_buf *sbuf, uint32_t len);
 uint32_t sbuf_put(struct shared_buf *sbuf, uint8_t *data, uint32_t max_len);
 int sbuf_clear_buffered(struct shared_buf *sbuf);
 void sbuf_init(struct shared_buf *sbuf, uint32_t total_size, uint32_t ele_size);
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Snapshot of a User VM to a file and restore of it in a new instance of
+ * acrn-dm, started with the same command line plus --restore, see snapshot.c.
+ */
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct vmctx;
+struct acrn_vcpu_state;
+struct acrn_vioapic_state;
+
+int vm_snapshot(struct vmctx *ctx, const char *path);
+int vm_restore(struct vmctx *ctx, const char *path);
+
+/* for the vdev_snapshot and vdev_restore hooks of the devices: 0 or -1 */
+int snapshot_write(int fd, const void *buf, size_t len);
+int snapshot_read(int fd, void *buf, size_t len);
+
+/* for the live dump and the migration, see coredump.c and migration.c */
+int snapshot_pwrite(int fd, const char *buf, size_t len, off_t off);
+int snapshot_write_mem(int fd, const char *hva, size_t size, off_t off);
+int snapshot_pause(struct vmctx *ctx, struct acrn_vcpu_state *states,
+		struct acrn_vioapic_state *vioapic);
+int snapshot_resume(struct vmctx *ctx, struct acrn_vcpu_state *states,
+		struct acrn_vioapic_state *vioapic);
+int snapshot_set_states(struct vmctx *ctx, struct acrn_vcpu_state *states, int nr,
+		struct acrn_vioapic_state *vioapic);
+
+#endif /* _SNAPSHOT_H_ */
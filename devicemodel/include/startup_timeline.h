@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Start-up timeline of the VM: how long each phase of main() took, merged
+ * with what the hypervisor reports on the first VM entry of the BSP (see
+ * VM_EVENT_STARTUP), see startup_timeline.c.
+ */
+
+#ifndef _STARTUP_TIMELINE_H_
+#define _STARTUP_TIMELINE_H_
+
+#include <acrn_common.h>
+
+enum startup_phase {
+	STARTUP_DM_INIT,	/* from the start of main() to vm_create(), first boot only */
+	STARTUP_VM_CREATE,
+	STARTUP_SETUP_MEMORY,	/* hugetlb reservation and mapping */
+	STARTUP_INIT_VDEVS,
+	STARTUP_BUILD_TABLES,	/* MP table and ACPI tables */
+	STARTUP_SW_LOAD,
+	STARTUP_ADD_CPU,
+	STARTUP_PHASE_COUNT,
+};
+
+struct cJSON;
+
+void startup_phase_begin(enum startup_phase phase);
+void startup_phase_end(enum startup_phase phase);
+void startup_timeline_log(void);
+void startup_timeline_add_json(struct cJSON *event_obj, const struct startup_event_data *hv);
+
+#endif /* _STARTUP_TIMELINE_H_ */
@@ -70,7 +70,20 @@ int acrn_parse_guest_part_info(char *arg); /* obsolete interface */
 char *get_bootargs(void);
 void vsbl_set_bdf(int bnum, int snum, int fnum);
 
+/* An image to read into the guest memory with sw_load_images() */
+struct sw_load_image {
+	const char *path;
+	int fd;			/* -1 to open path */
+	off_t offset;		/* of the image in the file */
+	void *dst;		/* in the guest memory */
+	size_t size;
+	size_t loaded;		/* private to sw_load_images() */
+	uint64_t ns;		/* time it took to read */
+};
+
 int check_image(char *path, size_t size_limit, size_t *size);
+uint64_t sw_load_now(void);
+int sw_load_images(struct sw_load_image *imgs, int nr);
 uint32_t acrn_create_e820_table(struct vmctx *ctx, struct e820_entry *e820);
 int add_e820_entry(struct e820_entry *e820, int len, uint64_t start,
 	uint64_t size, uint32_t type);
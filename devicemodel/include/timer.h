@@ -7,14 +7,26 @@
 #define _TIMER_H_
 
 #include <time.h>  // for struct itimerspec
+#include <stdbool.h>
 #include <sys/param.h>
+#include <sys/queue.h>
 
+/*
+ * fd and mevp are those of the timer base of the clock, shared by all of its
+ * timers, they are only valid (not -1 and NULL) once the timer is initialized.
+ */
 struct acrn_timer {
 	int32_t fd;
 	int32_t clockid;
 	struct mevent *mevp;
 	void (*callback)(void *, uint64_t);
 	void *callback_param;
+
+	/* private to timer.c */
+	TAILQ_ENTRY(acrn_timer) link;
+	bool queued;
+	uint64_t deadline;	/* ns of clockid */
+	uint64_t interval;	/* ns, 0 for a one-shot timer */
 };
 
 int32_t
@@ -38,11 +38,32 @@ struct vbs_dev_info {
 	uint64_t pio_range_len;	/* PIO bar address initialized by guest OS */
 };
 
+/*
+ * The memfd backed guest memory, for a VBS-K backend to map the guest buffers
+ * instead of copying them. The fds are those of the DM, the backend takes its
+ * own references.
+ */
+#define VBS_MAX_MEM_REGIONS	8
+struct vbs_mem_region {
+	uint64_t gpa;
+	uint64_t size;
+	uint64_t fd_offset;
+	int32_t fd;
+	uint32_t reserved;
+};
+
+struct vbs_mem_table {
+	uint32_t nregions;
+	uint32_t reserved;
+	struct vbs_mem_region regions[VBS_MAX_MEM_REGIONS];
+};
+
 /* reuse vhost ioctl index */
 #define VBS_K_IOCTL	0xAF
 
 #define VBS_K_SET_DEV _IOW(VBS_K_IOCTL, 0x00, struct vbs_dev_info)
 #define VBS_K_SET_VQ _IOW(VBS_K_IOCTL, 0x01, struct vbs_vqs_info)
 #define VBS_K_RESET_DEV _IO(VBS_K_IOCTL, 0x02)
+#define VBS_K_SET_MEM_TABLE _IOW(VBS_K_IOCTL, 0x03, struct vbs_mem_table)
 
 #endif /* _VBS_COMMON_IF_H_ */
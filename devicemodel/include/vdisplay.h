@@ -64,6 +64,11 @@ struct surface {
 	uint32_t bpp;
 	uint32_t stride;
 	void *pixel;
+	/*
+	 * The part of a SURFACE_PIXMAN surface changed since its last update,
+	 * in the coordinates of the surface. NULL for the whole surface.
+	 */
+	pixman_region16_t *damage;
 	struct  {
 		int dmabuf_fd;
 		uint32_t surf_fourcc;
@@ -84,6 +89,9 @@ struct cursor {
 	void *data;
 };
 
+/* called on the display thread after a refresh tick of the scanout */
+typedef void (*vdpy_vblank_cb)(void *data, int scanout_id);
+
 int vdpy_parse_cmd_option(const char *opts);
 int gfx_ui_init();
 int vdpy_init(int *num_vscreens);
@@ -91,6 +99,7 @@ void vdpy_get_display_info(int handle, int scanout_id, struct display_info *info
 void vdpy_surface_set(int handle, int scanout_id, struct surface *surf);
 void vdpy_surface_update(int handle, int scanout_id, struct surface *surf);
 bool vdpy_submit_bh(int handle, struct vdpy_display_bh *bh);
+bool vdpy_register_vblank(int handle, vdpy_vblank_cb cb, void *data);
 void vdpy_get_edid(int handle, int scanout_id, uint8_t *edid, size_t size);
 void vdpy_cursor_define(int handle, int scanout_id, struct cursor *cur);
 void vdpy_cursor_move(int handle, int scanout_id, uint32_t x, uint32_t y);
@@ -14,6 +14,8 @@
 #ifndef __VHOST_H__
 #define __VHOST_H__
 
+#include <linux/vhost.h>
+
 #include "virtio.h"
 
 /**
@@ -23,6 +25,55 @@
  *
  */
 
+/**
+ * @brief transports of the vhost data plane
+ */
+enum vhost_backend_type {
+	VHOST_BACKEND_KERNEL = 0,	/**< vhost chardev, e.g. /dev/vhost-net */
+	VHOST_BACKEND_USER,		/**< vhost-user UNIX domain socket */
+};
+
+/**
+ * @brief vhost-user feature bit for the protocol features negotiation,
+ * to be passed in the vhost_ext_features of vhost_dev_init
+ */
+#define VHOST_USER_F_PROTOCOL_FEATURES	30
+
+struct vhost_dev;
+
+/**
+ * @brief operations of a vhost transport
+ *
+ * The vring requests take the index of the virtqueue in the vhost_dev.
+ */
+struct vhost_backend_ops {
+	int (*set_mem_table)(struct vhost_dev *vdev);
+	int (*set_vring_addr)(struct vhost_dev *vdev,
+			      struct vhost_vring_addr *addr);
+	int (*set_vring_num)(struct vhost_dev *vdev,
+			     struct vhost_vring_state *ring);
+	int (*set_vring_base)(struct vhost_dev *vdev,
+			      struct vhost_vring_state *ring);
+	int (*get_vring_base)(struct vhost_dev *vdev,
+			      struct vhost_vring_state *ring);
+	int (*set_vring_kick)(struct vhost_dev *vdev,
+			      struct vhost_vring_file *file);
+	int (*set_vring_call)(struct vhost_dev *vdev,
+			      struct vhost_vring_file *file);
+	int (*set_vring_busyloop_timeout)(struct vhost_dev *vdev,
+					  struct vhost_vring_state *s);
+	int (*set_vring_enable)(struct vhost_dev *vdev, int idx, bool enable);
+	int (*set_features)(struct vhost_dev *vdev, uint64_t features);
+	int (*get_features)(struct vhost_dev *vdev, uint64_t *features);
+	int (*set_owner)(struct vhost_dev *vdev);
+	int (*reset_device)(struct vhost_dev *vdev);
+};
+
+/**
+ * @brief vhost-user transport operations, see vhost_user.c
+ */
+extern const struct vhost_backend_ops vhost_user_ops;
+
 struct vhost_vq {
 	int kick_fd;		/**< fd of kick eventfd */
 	int call_fd;		/**< fd of call eventfd */
@@ -47,10 +98,25 @@ struct vhost_dev {
 	int nvqs;
 
 	/**
-	 * vhost chardev fd
+	 * vhost chardev fd, or vhost-user socket fd
 	 */
 	int fd;
 
+	/**
+	 * transport, to be set before vhost_dev_init
+	 */
+	enum vhost_backend_type backend;
+
+	/**
+	 * operations of the transport
+	 */
+	const struct vhost_backend_ops *ops;
+
+	/**
+	 * vhost-user protocol features negotiated with the backend
+	 */
+	uint64_t protocol_features;
+
 	/**
 	 * first vq's index in virtio_vq_info
 	 */
@@ -143,4 +209,13 @@ int vhost_dev_stop(struct vhost_dev *vdev);
  * @return 0 on success and -1 on failure.
  */
 int vhost_kernel_ioctl(struct vhost_dev *vdev, unsigned long int request, void *arg);
+
+/**
+ * @brief connect to a vhost-user backend.
+ *
+ * @param path Path of the UNIX domain socket the backend listens on.
+ *
+ * @return the connected socket fd on success and -1 on failure.
+ */
+int vhost_user_connect(const char *path);
 #endif /* __VHOST_H__ */
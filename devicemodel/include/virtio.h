@@ -124,6 +124,15 @@
  * notify, when descriptors are added to the corresponding ring.
  * (These are provided only for interrupt optimization and need
  * not be implemented.)
+ *
+ * A device that sets VIRTIO_F_RING_PACKED in its device_caps (along
+ * with VIRTIO_F_VERSION_1) may instead get a packed ring: a single
+ * ring of 16-byte descriptors that the guest makes available by
+ * flipping their AVAIL/USED flag bits to its wrap counter, and that
+ * the device overwrites in place with used descriptors.  The driver
+ * and device event suppression structures replace the ring flags
+ * and event indices.  vq_getchain(), vq_relchain() and vq_endchains()
+ * handle both layouts, with the buffer id of the chain as its index.
  */
 
 #include <linux/virtio_ring.h>
@@ -219,6 +228,7 @@ enum {
 #define	VIRTIO_VENDOR		0x1AF4
 #define	VIRTIO_DEV_NET		0x1000
 #define	VIRTIO_DEV_BLOCK	0x1001
+#define	VIRTIO_DEV_BALLOON	0x1002
 #define	VIRTIO_DEV_CONSOLE	0x1003
 #define	VIRTIO_DEV_RANDOM	0x1005
 #define	VIRTIO_DEV_GPU		0x1050
@@ -347,6 +357,7 @@ struct virtio_base {
 	struct virtio_ops *vops;	/**< virtio operations */
 	int	flags;			/**< VIRTIO_* flags from above */
 	bool	iothread;
+	struct iothreads_info iothreads;	/**< iothreads of the device, default one if none */
 	pthread_mutex_t *mtx;		/**< POSIX mutex, if any */
 	struct pci_vdev *dev;		/**< PCI device instance */
 	uint64_t negotiated_caps;	/**< negotiated capabilities */
@@ -366,6 +377,9 @@ struct virtio_base {
 	int backend_type;               /**< VBSU, VBSK or VHOST */
 	struct acrn_timer polling_timer; /**< timer for polling mode */
 	int polling_in_progress;        /**< The polling status */
+	int notify_kick_fd;		/**< eventfd of the whole notify region, if kicked as one */
+	bool notify_ioevent_started;	/**< notify region registered as one ioeventfd */
+	struct iothread_mevent notify_iomvt;
 };
 
 #define	VIRTIO_BASE_LOCK(vb)					\
@@ -427,6 +441,8 @@ struct virtio_iothread {
 	int idx;
 	int kick_fd;
 	bool	ioevent_started;
+	bool	busy_polling;	/* guest notifications are off while the iothread polls */
+	struct iothread_ctx *ioctx;	/* iothread serving the queue */
 	struct iothread_mevent iomvt;
 	void (*iothread_run)(void *, struct virtio_vq_info *);
 };
@@ -447,6 +463,7 @@ struct virtio_vq_info {
 
 	uint32_t pfn;		/**< PFN of virt queue (not shifted!) */
 	struct virtio_iothread viothrd;
+	pthread_mutex_t mtx;	/**< held by the iothread running the queue */
 
 	volatile struct vring_desc *desc;
 				/**< descriptor array */
@@ -459,6 +476,32 @@ struct virtio_vq_info {
 	uint32_t gpa_avail[2];	/**< gpa of avail_ring */
 	uint32_t gpa_used[2];	/**< gpa of used_ring */
 	bool enabled;		/**< whether the virtqueue is enabled */
+
+	/*
+	 * Packed ring (VIRTIO_F_RING_PACKED), in place of desc/avail/used.
+	 * last_avail and used_idx run freely, the slot is the index modulo
+	 * qsize and the wrap counter is 1 while the qsize bit is clear.
+	 */
+	bool packed;		/**< whether the ring is packed */
+	uint16_t used_idx;	/**< packed: next used slot */
+	uint16_t *chain_ndescs;	/**< packed: ring descriptors of each chain,
+				     by buffer id then by last slot */
+	volatile struct vring_packed_desc *pdesc;
+				/**< packed: descriptor ring */
+	volatile struct vring_packed_desc_event *driver_event;
+				/**< packed: driver event suppression */
+	volatile struct vring_packed_desc_event *device_event;
+				/**< packed: device event suppression */
+
+	/*
+	 * Interrupt moderation (--virtio_intr_moderation), taken by
+	 * vq_endchains() and the moderation timer.
+	 */
+	pthread_mutex_t intr_mtx;
+	struct acrn_timer intr_timer;	/**< flushes the held interrupt */
+	uint32_t intr_pending;	/**< interrupts held since the last one */
+	bool intr_armed;	/**< whether intr_timer is running */
+	struct timespec intr_last;	/**< time of the last interrupt */
 };
 
 /* as noted above, these are sort of backwards, name-wise */
@@ -493,6 +536,16 @@ static inline bool
 vq_has_descs(struct virtio_vq_info *vq)
 {
 	bool ret = false;
+	uint16_t flags, wrap;
+
+	if (vq_ring_ready(vq) && vq->packed) {
+		/* available: AVAIL matches the wrap counter, USED does not */
+		flags = vq->pdesc[vq->last_avail & (vq->qsize - 1)].flags;
+		wrap = !(vq->last_avail & vq->qsize);
+		return ((flags >> VRING_PACKED_DESC_F_AVAIL) & 1) == wrap &&
+			((flags >> VRING_PACKED_DESC_F_USED) & 1) != wrap;
+	}
+
 	if (vq_ring_ready(vq) && vq->last_avail != vq->avail->idx) {
 		if ((uint16_t)((u_int)vq->avail->idx - vq->last_avail) > vq->qsize)
 			pr_err ("%s: no valid descriptor\n", vq->base->vops->name);
@@ -553,6 +606,10 @@ virtio_config_changed(struct virtio_base *vb)
 
 struct iovec;
 
+struct metrics_out;
+void virtio_metrics_queues(struct metrics_out *mo, struct virtio_base *base,
+			   const char *dev);
+
 /**
  * @brief Link a virtio_base to its constants, the virtio device,
  * and the PCI emulation.
@@ -578,6 +635,15 @@ void virtio_linkup(struct virtio_base *base, struct virtio_ops *vops,
  */
 int acrn_parse_virtio_poll_interval(const char *optarg);
 
+/**
+ * @brief Get the virtio interrupt moderation parameters
+ *
+ * @param optarg Pointer to parameters string, <max_events>,<max_usec>.
+ *
+ * @return fail -1 success 0
+ */
+int acrn_parse_virtio_intr_moderation(const char *optarg);
+
 /**
  * @brief Initialize MSI-X vector capabilities if we're to use MSI-X,
  * or MSI capabilities if not.
@@ -653,6 +719,14 @@ int vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
  */
 void vq_retchain(struct virtio_vq_info *vq);
 
+/**
+ * @brief Return the last request chains handled back to the available ring.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param n_chains Number of chains to return.
+ */
+void vq_retchains(struct virtio_vq_info *vq, uint16_t n_chains);
+
 /**
  * @brief Return specified request chain to the guest,
  * setting its I/O length to the provided value.
@@ -735,6 +809,34 @@ void virtio_pci_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
  */
 int virtio_set_modern_bar(struct virtio_base *base, bool use_notify_pio);
 
+/**
+ * @brief Save the transport state of a virtio device.
+ *
+ * The vdev_snapshot hook of the virtio devices with no state of their own
+ * besides their virtqueues.
+ *
+ * @param ctx Pointer to struct vmctx representing VM context.
+ * @param dev Pointer to struct pci_vdev which emulates a PCI device.
+ * @param fd File the state is written to.
+ *
+ * @return 0 on success and non-zero on fail.
+ */
+int virtio_snapshot(struct vmctx *ctx, struct pci_vdev *dev, int fd);
+
+/**
+ * @brief Restore the transport state of a virtio device.
+ *
+ * The vdev_restore hook matching virtio_snapshot(), the virtqueues go on
+ * from their used index.
+ *
+ * @param ctx Pointer to struct vmctx representing VM context.
+ * @param dev Pointer to struct pci_vdev which emulates a PCI device.
+ * @param fd File the state is read from.
+ *
+ * @return 0 on success and non-zero on fail.
+ */
+int virtio_restore(struct vmctx *ctx, struct pci_vdev *dev, int fd);
+
 /**
  * @}
  */
@@ -757,4 +859,5 @@ int virtio_set_modern_pio_bar(
 		struct virtio_base *base, int barnum);
 
 int virtio_register_ioeventfd(struct virtio_base *base, int idx, bool is_register, int fd);
+int virtio_register_notify_ioeventfd(struct virtio_base *base, bool is_register, int fd);
 #endif	/* _VIRTIO_H_ */
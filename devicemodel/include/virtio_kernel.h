@@ -12,6 +12,8 @@
 
 #include "vbs_common_if.h"		/* data format between VBS-U & VBS-K */
 
+struct vmctx;
+
 /**
  * @brief APIs for virtio backend in kernel module
  *
@@ -67,6 +69,20 @@ int vbs_kernel_start(int fd, struct vbs_dev_info *dev,
  */
 int vbs_kernel_stop(int fd);
 
+/**
+ * @brief Share the guest memory with the virtio kernel module.
+ *
+ * Hands the memfd backed guest memory to the backend, which maps the guest
+ * buffers in place of copying them, see struct vbs_mem_table.
+ *
+ * @param fd File descriptor representing virtio backend in kernel module.
+ * @param ctx Pointer to the VM context.
+ *
+ * @return 0 on OK, -1 if the guest memory can't be shared or the module
+ * doesn't take it.
+ */
+int vbs_kernel_set_mem_table(int fd, struct vmctx *ctx);
+
 /**
  * @}
  */
@@ -57,6 +57,7 @@ struct vmctx {
 	size_t  highmem;
 	char    *baseaddr;
 	char    *name;
+	int	vcpu_num;
 
 	/* fields to track virtual devices */
 	void *atkbdc_base;
@@ -78,6 +79,9 @@ struct vmctx {
 #define	PROT_RW		(PROT_READ | PROT_WRITE)
 #define	PROT_ALL	(PROT_READ | PROT_WRITE | PROT_EXEC)
 
+/* the guest memory below is private to a VM sharing a memory template */
+#define	MEM_TEMPLATE_BASE	(2 * MB)
+
 struct vm_lapic_msi {
 	uint64_t	msg;
 	uint64_t	addr;
@@ -94,6 +98,21 @@ struct vm_mem_region {
 };
 bool	vm_find_memfd_region(struct vmctx *ctx, vm_paddr_t gpa,
 			     struct vm_mem_region *ret_region);
+
+struct vm_memfd_region {
+	vm_paddr_t gpa;
+	uint64_t size;
+	char *hva;
+	uint64_t fd_offset;
+	int fd;
+};
+/*
+ * Fill 'regions' with the memfd backed guest memory mappings, for sharing the
+ * guest memory with another process. Returns the number of regions, 0 if the
+ * guest memory is not memfd backed and -1 if there are more than 'max'.
+ */
+int	vm_get_memfd_regions(struct vmctx *ctx, struct vm_memfd_region *regions,
+			     int max);
 bool    vm_allow_dmabuf(struct vmctx *ctx);
 /*
  * Create a device memory segment identified by 'segid'.
@@ -107,7 +126,15 @@ int	vm_create_ioreq_client(struct vmctx *ctx);
 int	vm_destroy_ioreq_client(struct vmctx *ctx);
 int	vm_attach_ioreq_client(struct vmctx *ctx);
 int	vm_notify_request_done(struct vmctx *ctx, int vcpu);
+int	vm_notify_request_done_batch(struct vmctx *ctx, uint64_t vcpu_bitmap);
 int	vm_setup_asyncio(struct vmctx *ctx, uint64_t base);
+int	vm_get_dirty_log(struct vmctx *ctx, uint64_t gpa, uint64_t size, uint64_t *bitmap);
+int	vm_set_lazy_memory(struct vmctx *ctx, const vm_paddr_t *gpa, const size_t *len, int nr);
+int	vm_setup_coalesced_mmio(struct vmctx *ctx, uint64_t base);
+int	vm_add_coalesced_mmio(struct vmctx *ctx, uint64_t addr, uint32_t len);
+int	vm_remove_coalesced_mmio(struct vmctx *ctx, uint64_t addr, uint32_t len);
+int	vm_set_tsc_counter(struct vmctx *ctx, struct acrn_tsc_counter *counter);
+int	vm_multicall(struct vmctx *ctx, struct acrn_multicall *mc);
 void	vm_clear_ioreq(struct vmctx *ctx);
 const char *vm_state_to_str(enum vm_suspend_how idx);
 void	vm_set_suspend_mode(enum vm_suspend_how how);
@@ -119,12 +146,21 @@ void	vm_destroy(struct vmctx *ctx);
 int	vm_parse_memsize(const char *optarg, size_t *memsize);
 int	vm_map_memseg_vma(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
 	uint64_t vma, int prot);
+int	vm_unmap_memseg(struct vmctx *ctx, vm_paddr_t gpa, size_t len);
 int	vm_setup_memory(struct vmctx *ctx, size_t len);
 void	vm_unsetup_memory(struct vmctx *ctx);
 bool	init_hugetlb(void);
 void	uninit_hugetlb(void);
 int	hugetlb_setup_memory(struct vmctx *ctx);
 void	hugetlb_unsetup_memory(struct vmctx *ctx);
+size_t	hugetlb_release_memory(struct vmctx *ctx, vm_paddr_t gpa, size_t len);
+int	hugetlb_refault_memory(struct vmctx *ctx, vm_paddr_t gpa);
+int	hugetlb_unshare_memory(struct vmctx *ctx, vm_paddr_t gpa, size_t len);
+int	hugetlb_register_refault(struct vmctx *ctx);
+void	hugetlb_unregister_refault(struct vmctx *ctx);
+bool	hugetlb_template_populated(void);
+void	hugetlb_get_stats(struct vmctx *ctx, size_t *released, size_t *shared);
+int	hugetlb_seal_template(struct vmctx *ctx);
 void	*vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len);
 uint32_t vm_get_lowmem_limit(struct vmctx *ctx);
 size_t	vm_get_lowmem_size(struct vmctx *ctx);
@@ -147,10 +183,20 @@ int	vm_reset_ptdev_intx_info(struct vmctx *ctx, uint16_t virt_bdf,
 	uint16_t phys_bdf, int virt_pin, bool pic_pin);
 int	vm_add_hv_vdev(struct vmctx *ctx, struct acrn_vdev *dev);
 int	vm_remove_hv_vdev(struct vmctx *ctx, struct acrn_vdev *dev);
+int	vm_add_vdev_cfg_shadow(struct vmctx *ctx, struct acrn_vdev_cfg_shadow *shadow);
+int	vm_remove_vdev_cfg_shadow(struct vmctx *ctx, struct acrn_vdev_cfg_shadow *shadow);
 
 int	acrn_parse_cpu_affinity(char *arg);
 uint64_t vm_get_cpu_affinity_dm(void);
 int	vm_set_vcpu_regs(struct vmctx *ctx, struct acrn_vcpu_regs *cpu_regs);
+int	vm_get_vcpu_state(struct vmctx *ctx, struct acrn_vcpu_state *state);
+int	vm_set_vcpu_state(struct vmctx *ctx, struct acrn_vcpu_state *state);
+int	vm_get_vioapic_state(struct vmctx *ctx, struct acrn_vioapic_state *state);
+int	vm_set_vioapic_state(struct vmctx *ctx, struct acrn_vioapic_state *state);
+int	vm_get_rdt_mon(struct vmctx *ctx, struct acrn_vm_rdt_mon *mon);
+int	vm_latency_probe(struct vmctx *ctx, struct acrn_vm_latency *lat);
+int	vm_get_vcpu_sched_stats(struct vmctx *ctx, struct acrn_vcpu_sched_stats *stats);
+int	vm_get_vcpu_exit_stats(struct vmctx *ctx, struct acrn_vcpu_exit_stats *stats);
 
 int	vm_get_cpu_state(struct vmctx *ctx, void *state_buf);
 int	vm_intr_monitor(struct vmctx *ctx, void *intr_buf);
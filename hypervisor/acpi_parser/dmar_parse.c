@@ -79,81 +79,58 @@ static int32_t handle_dmar_devscope(struct dmar_dev_scope *dev_scope, void *addr
 	return ret;
 }
 
-static uint32_t get_drhd_dev_scope_cnt(struct acpi_dmar_hardware_unit *drhd)
-{
-	struct acpi_dmar_device_scope *scope;
-	char *start;
-	char *end;
-	uint32_t count = 0;
-
-	start = (char *)drhd + sizeof(struct acpi_dmar_hardware_unit);
-	end = (char *)drhd + drhd->header.length;
-
-	while (start < end) {
-		scope = (struct acpi_dmar_device_scope *)start;
-		if ((scope->entry_type != ACPI_DMAR_SCOPE_TYPE_NOT_USED) &&
-			(scope->entry_type < ACPI_DMAR_SCOPE_TYPE_RESERVED)) {
-			count++;
-		}
-		start += scope->length;
-	}
-	return count;
-}
-
 /**
  * @Application constraint: The dedicated DMAR unit for Intel integrated GPU
  * shall be available on the physical platform.
  */
 static int32_t handle_one_drhd(struct acpi_dmar_hardware_unit *acpi_drhd, struct dmar_drhd *drhd)
 {
-	struct dmar_dev_scope *dev_scope;
+	struct dmar_dev_scope dev_scope;
 	struct acpi_dmar_device_scope *ads;
 	int32_t remaining, consumed;
 	char *cp;
-	uint32_t dev_count;
+	uint32_t dev_count = 0U;
 
 	drhd->segment = acpi_drhd->segment;
 	drhd->flags = acpi_drhd->flags;
 	drhd->reg_base_addr = acpi_drhd->address;
 
-	dev_count = get_drhd_dev_scope_cnt(acpi_drhd);
-	ASSERT(dev_count <= MAX_DRHD_DEVSCOPES, "parsed dev_count > MAX_DRHD_DEVSCOPES");
-
-	drhd->dev_cnt = dev_count;
-
 	remaining = (int32_t)(acpi_drhd->header.length - sizeof(struct acpi_dmar_hardware_unit));
 
-	dev_scope = drhd->devices;
-
+	/* the device scopes are counted as they are parsed, in a single pass */
 	while (remaining > 0) {
 		cp = (char *)acpi_drhd + acpi_drhd->header.length - remaining;
 
-		consumed = handle_dmar_devscope(dev_scope, cp, remaining);
+		consumed = handle_dmar_devscope(&dev_scope, cp, remaining);
+		if (consumed <= 0) {
+			break;
+		}
 
 		/* Disable GPU IOMMU due to gvt-d hasn’t been enabled on APL yet. */
 		if (is_apl_platform()) {
 			if ((((uint32_t)drhd->segment << 16U) |
-		     	     ((uint32_t)dev_scope->bus << 8U) |
-		     	     dev_scope->devfun) == CONFIG_IGD_SBDF) {
+			     ((uint32_t)dev_scope.bus << 8U) |
+			     dev_scope.devfun) == CONFIG_IGD_SBDF) {
 				drhd->ignore = true;
 			}
 		}
 
-		if (consumed <= 0) {
-			break;
-		}
-
 		remaining -= consumed;
 		/* skip IOAPIC & HPET */
 		ads = (struct acpi_dmar_device_scope *)cp;
-		if ((ads->entry_type != ACPI_DMAR_SCOPE_TYPE_NOT_USED) &&
-			(ads->entry_type < ACPI_DMAR_SCOPE_TYPE_RESERVED)) {
-			dev_scope++;
-		} else {
+		if ((ads->entry_type == ACPI_DMAR_SCOPE_TYPE_NOT_USED) ||
+			(ads->entry_type >= ACPI_DMAR_SCOPE_TYPE_RESERVED)) {
 			pr_dbg("drhd: skip dev_scope type %d", ads->entry_type);
+		} else if (dev_count < MAX_DRHD_DEVSCOPES) {
+			drhd->devices[dev_count] = dev_scope;
+			dev_count++;
+		} else {
+			ASSERT(false, "parsed dev_count > MAX_DRHD_DEVSCOPES");
 		}
 	}
 
+	drhd->dev_cnt = dev_count;
+
 	return 0;
 }
 
@@ -10,35 +10,36 @@
 #include <vpci.h>
 
 /*
+ * The config tools generate prelaunched_ptdevs sorted by pbdf, a PT device
+ * of the pre-launched VMs is found by a binary search on it.
+ *
  * @pre pdev != NULL;
  */
 static bool allocate_to_prelaunched_vm(struct pci_pdev *pdev)
 {
 	bool found = false;
-	uint16_t vmid;
-	uint16_t pci_idx;
-	struct acrn_vm_config *vm_config;
+	uint16_t low = 0U, high = prelaunched_ptdev_num, mid;
+	const struct acrn_prelaunched_ptdev *ptdev;
 	struct acrn_vm_pci_dev_config *dev_config;
 
-	for (vmid = 0U; (vmid < CONFIG_MAX_VM_NUM) && !found; vmid++) {
-		vm_config = get_vm_config(vmid);
-		if (vm_config->load_order == PRE_LAUNCHED_VM) {
-			for (pci_idx = 0U; pci_idx < vm_config->pci_dev_num; pci_idx++) {
-				dev_config = &vm_config->pci_devs[pci_idx];
-				if ((dev_config->emu_type == PCI_DEV_TYPE_PTDEV) &&
-						bdf_is_equal(dev_config->pbdf, pdev->bdf)) {
-					dev_config->pdev = pdev;
-					found = true;
-					break;
-				}
-			}
+	while (low < high) {
+		mid = low + ((high - low) >> 1U);
+		ptdev = &prelaunched_ptdevs[mid];
+		if (ptdev->pbdf.value == pdev->bdf.value) {
+			dev_config = &get_vm_config(ptdev->vm_id)->pci_devs[ptdev->dev_idx];
+			dev_config->pdev = pdev;
+			found = true;
+			break;
+		} else if (ptdev->pbdf.value < pdev->bdf.value) {
+			low = mid + 1U;
+		} else {
+			high = mid;
 		}
 	}
 
 	return found;
 }
 
-
 /*
  * @brief Initialize a acrn_vm_pci_dev_config structure
  *
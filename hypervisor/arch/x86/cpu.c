@@ -26,6 +26,7 @@
 #include <asm/msr.h>
 #include <asm/host_pm.h>
 #include <ptdev.h>
+#include <sbuf.h>
 #include <logmsg.h>
 #include <asm/rdt.h>
 #include <asm/sgx.h>
@@ -195,6 +196,8 @@ void init_pcpu_pre(bool is_bsp)
 #ifdef CONFIG_VCAT_ENABLED
 		init_intercepted_cat_msr_list();
 #endif
+		/* emulated_guest_msrs[] is complete from here on */
+		init_emulated_msr_index();
 
 		/* NOTE: this must call after MMCONFIG is parsed in acpi_fixup() and before APs are INIT.
 		 * We only support platform with MMIO based CFG space access.
@@ -255,6 +258,7 @@ void init_pcpu_post(uint16_t pcpu_id)
 				HV_BUILD_BOARD, HV_BUILD_USER, ticks_to_us(start_tick));
 
 		pr_acrnlog("Detect processor: %s", (get_pcpu_info())->model_name);
+		log_boot_phase("TSC calibrated");
 
 		pr_dbg("Core %hu is up", BSP_CPU_ID);
 
@@ -266,20 +270,24 @@ void init_pcpu_post(uint16_t pcpu_id)
 
 		/* Initialize interrupts */
 		init_interrupt(BSP_CPU_ID);
+		init_smp_call_queue(BSP_CPU_ID);
 
 		timer_init();
+		init_idle_governor();
 		setup_notification();
 		setup_pi_notification();
 
 		if (init_iommu() != 0) {
 			panic("failed to initialize iommu!");
 		}
+		log_boot_phase("IOMMU initialized");
 
 #ifdef CONFIG_IVSHMEM_ENABLED
 		init_ivshmem_shared_memory();
 #endif
 		init_pci_pdev_list(); /* init_iommu must come before this */
 		ptdev_init();
+		sbuf_notify_init();
 
 		if (init_sgx() != 0) {
 			panic("failed to initialize sgx!");
@@ -292,12 +300,18 @@ void init_pcpu_post(uint16_t pcpu_id)
 
 		init_vept();
 
+#ifdef CONFIG_RDT_ENABLED
+		init_rdt_mon();
+#endif
+		log_boot_phase("platform initialized");
+
 		pcpu_sync = ALL_CPUS_MASK;
 		/* Start all secondary cores */
 		startup_paddr = prepare_trampoline();
 		if (!start_pcpus(AP_MASK)) {
 			panic("Failed to start all secondary cores!");
 		}
+		log_boot_phase("APs started");
 
 		ASSERT(get_pcpu_id() == BSP_CPU_ID, "");
 	} else {
@@ -307,6 +321,7 @@ void init_pcpu_post(uint16_t pcpu_id)
 
 		/* Initialize secondary processor interrupts. */
 		init_interrupt(pcpu_id);
+		init_smp_call_queue(pcpu_id);
 
 		timer_init();
 		ptdev_init();
@@ -350,26 +365,52 @@ static uint16_t get_pcpu_id_from_lapic_id(uint32_t lapic_id)
 	return pcpu_id;
 }
 
-static void start_pcpu(uint16_t pcpu_id)
+/**
+ * @pre The TSC is calibrated
+ *
+ * Log the time the BSP took to reach a boot phase, from the start of
+ * init_pcpu_pre().
+ */
+void log_boot_phase(const char *phase)
 {
+	pr_acrnlog("HV boot: %s at +%luus", phase, ticks_to_us(cpu_ticks() - start_tick));
+}
+
+/**
+ * @brief Start all cpus if the bit is set in mask except itself
+ *
+ * The cpus are all started at once, each finds its stack by its LAPIC ID.
+ *
+ * @param[in] mask bits mask of cpus which should be started
+ *
+ * @return true if all cpus set in mask are started
+ * @return false if there are any cpus set in mask aren't started
+ */
+bool start_pcpus(uint64_t mask)
+{
+	uint16_t i;
+	uint16_t pcpu_id = get_pcpu_id();
+	uint64_t expected_start_mask = mask;
 	uint32_t timeout;
 
-	/* Update the stack for pcpu */
+	/* Avoid start itself */
+	bitmap_clear_nolock(pcpu_id, &expected_start_mask);
+
 	stac();
-	write_trampoline_stack_sym(pcpu_id);
+	prepare_ap_stacks(expected_start_mask);
 	clac();
 
 	/* Using the MFENCE to make sure trampoline code
 	 * has been updated (clflush) into memory beforing start APs.
 	 */
 	cpu_memory_barrier();
-	send_startup_ipi(pcpu_id, startup_paddr);
+	send_startup_ipi(expected_start_mask, startup_paddr);
 
-	/* Wait until the pcpu with pcpu_id is running and set the active bitmap or
+	/* Wait until all the started pcpus are running and set the active bitmap or
 	 * configured time-out has expired
 	 */
 	timeout = CPU_UP_TIMEOUT * 1000U;
-	while (!is_pcpu_active(pcpu_id) && (timeout != 0U)) {
+	while (((pcpu_active_bitmap & expected_start_mask) != expected_start_mask) && (timeout != 0U)) {
 		/* Delay 10us */
 		udelay(10U);
 
@@ -377,37 +418,14 @@ static void start_pcpu(uint16_t pcpu_id)
 		timeout -= 10U;
 	}
 
-	/* Check to see if expected CPU is actually up */
-	if (!is_pcpu_active(pcpu_id)) {
-		pr_fatal("Secondary CPU%hu failed to come up", pcpu_id);
-		pcpu_set_current_state(pcpu_id, PCPU_STATE_DEAD);
-	}
-}
-
-
-/**
- * @brief Start all cpus if the bit is set in mask except itself
- *
- * @param[in] mask bits mask of cpus which should be started
- *
- * @return true if all cpus set in mask are started
- * @return false if there are any cpus set in mask aren't started
- */
-bool start_pcpus(uint64_t mask)
-{
-	uint16_t i;
-	uint16_t pcpu_id = get_pcpu_id();
-	uint64_t expected_start_mask = mask;
-
+	/* Check to see if expected CPUs are actually up */
 	i = ffs64(expected_start_mask);
 	while (i != INVALID_BIT_INDEX) {
 		bitmap_clear_nolock(i, &expected_start_mask);
-
-		if (pcpu_id == i) {
-			continue; /* Avoid start itself */
+		if (!is_pcpu_active(i)) {
+			pr_fatal("Secondary CPU%hu failed to come up", i);
+			pcpu_set_current_state(i, PCPU_STATE_DEAD);
 		}
-
-		start_pcpu(i);
 		i = ffs64(expected_start_mask);
 	}
 
@@ -468,7 +486,7 @@ void cpu_do_idle(void)
 	uint16_t pcpu_id = get_pcpu_id();
 
 	if (per_cpu(mode_to_idle, pcpu_id) == IDLE_MODE_HLT) {
-		asm_safe_hlt();
+		enter_idle_state(pcpu_id);
 	} else {
 		struct acrn_vcpu *vcpu = get_ever_run_vcpu(pcpu_id);
 
@@ -530,18 +548,6 @@ static void print_hv_banner(void)
 	printf(boot_msg);
 }
 
-static
-inline void asm_monitor(volatile const uint64_t *addr, uint64_t ecx, uint64_t edx)
-{
-	asm volatile("monitor\n" : : "a" (addr), "c" (ecx), "d" (edx));
-}
-
-static
-inline void asm_mwait(uint64_t eax, uint64_t ecx)
-{
-	asm volatile("mwait\n" : : "a" (eax), "c" (ecx));
-}
-
 /* wait until *sync == wake_sync */
 void wait_sync_change(volatile const uint64_t *sync, uint64_t wake_sync)
 {
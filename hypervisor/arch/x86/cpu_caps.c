@@ -25,6 +25,7 @@
 #define VAPIC_FEATURE_TPR_SHADOW	(1U << 3U)
 #define VAPIC_FEATURE_POST_INTR		(1U << 4U)
 #define VAPIC_FEATURE_VX2APIC_MODE	(1U << 5U)
+#define VAPIC_FEATURE_IPIV		(1U << 6U)
 
 /* BASIC features: must supported by the physical platform and will enabled by default */
 #define APICV_BASIC_FEATURE	(VAPIC_FEATURE_TPR_SHADOW | VAPIC_FEATURE_VIRT_ACCESS | VAPIC_FEATURE_VX2APIC_MODE)
@@ -268,6 +269,13 @@ static void detect_apicv_cap(void)
 		features |= VAPIC_FEATURE_POST_INTR;
 	}
 
+	/* the 64 bits of the tertiary controls MSR are the allowed 1-settings */
+	msr_val = msr_read(MSR_IA32_VMX_PROCBASED_CTLS);
+	if (is_ctrl_setting_allowed(msr_val, VMX_PROCBASED_CTLS_TERTIARY) &&
+			((msr_read(MSR_IA32_VMX_PROCBASED_CTLS3) & VMX_PROCBASED_CTLS3_IPIV) != 0UL)) {
+		features |= VAPIC_FEATURE_IPIV;
+	}
+
 	cpu_caps.apicv_features = features;
 
 	vlapic_set_apicv_ops();
@@ -405,6 +413,12 @@ bool is_apicv_advanced_feature_supported(void)
 	return ((cpu_caps.apicv_features & APICV_ADVANCED_FEATURE) == APICV_ADVANCED_FEATURE);
 }
 
+/* IPI virtualization posts through the PIDs, so it needs the advanced features too */
+bool is_ipiv_supported(void)
+{
+	return is_apicv_advanced_feature_supported() && ((cpu_caps.apicv_features & VAPIC_FEATURE_IPIV) != 0U);
+}
+
 bool pcpu_has_vmx_ept_vpid_cap(uint64_t bit_mask)
 {
 	return ((cpu_caps.vmx_ept_vpid & bit_mask) != 0U);
@@ -10,11 +10,13 @@
 #include <asm/guest/vm.h>
 #include <asm/vtd.h>
 #include <ptdev.h>
+#include <softirq.h>
 #include <asm/per_cpu.h>
 #include <asm/ioapic.h>
 #include <asm/pgtable.h>
 #include <asm/irq.h>
 #include <asm/guest/optee.h>
+#include <ticks.h>
 
 /*
  * Check if the IRQ is single-destination and return the destination vCPU if so.
@@ -102,6 +104,9 @@ static void ptirq_free_irte(const struct ptirq_remapping_info *entry)
 }
 
 /*
+ * The IRTE of a remapped mode MSI targets the pCPUs its destination vCPUs
+ * run on when it is built, see ptirq_msi_follow_vcpu() for when they move.
+ *
  * pid_paddr = 0: invalid address, indicate that remapped mode shall be used
  *
  * pid_paddr != 0: physical address of posted interrupt descriptor, indicate
@@ -132,6 +137,7 @@ static void ptirq_build_physical_msi(struct acrn_vm *vm,
 	}
 
 	dest_mask = calculate_logical_dest_mask(pdmask);
+	entry->vdmask = (pid_paddr == 0UL) ? vdmask : 0UL;
 
 	/* Using phys_irq as index in the corresponding IOMMU */
 	irte.value.lo_64 = 0UL;
@@ -341,13 +347,15 @@ static struct ptirq_remapping_info *add_msix_remapping(struct acrn_vm *vm,
 	return entry;
 }
 
-/* deactive & remove mapping entry of vbdf:entry_nr for vm */
-static void
+/* deactive & remove mapping entry of vbdf:entry_nr for vm
+ * - return the IRTE index of the entry, which the caller shall free
+ */
+static uint16_t
 remove_msix_remapping(const struct acrn_vm *vm, uint16_t phys_bdf, uint32_t entry_nr)
 {
 	struct ptirq_remapping_info *entry;
 	DEFINE_MSI_SID(phys_sid, phys_bdf, entry_nr);
-	struct intr_source intr_src;
+	uint16_t irte_idx = INVALID_IRTE_ID;
 
 	entry = find_ptirq_entry(PTDEV_INTR_MSI, &phys_sid, NULL);
 	if ((entry != NULL) && (entry->vm == vm)) {
@@ -356,9 +364,7 @@ remove_msix_remapping(const struct acrn_vm *vm, uint16_t phys_bdf, uint32_t entr
 			ptirq_deactivate_entry(entry);
 		}
 
-		intr_src.is_msi = true;
-		intr_src.src.msi.value = entry->phys_sid.msi_id.bdf;
-		dmar_free_irte(&intr_src, entry->irte_idx);
+		irte_idx = entry->irte_idx;
 
 		dev_dbg(DBG_LEVEL_IRQ, "VM%d MSIX remove vector mapping vbdf-pbdf:0x%x-0x%x idx=%d",
 			vm->vm_id, entry->virt_sid.msi_id.bdf, phys_bdf, entry_nr);
@@ -366,6 +372,7 @@ remove_msix_remapping(const struct acrn_vm *vm, uint16_t phys_bdf, uint32_t entr
 		ptirq_release_entry(entry);
 	}
 
+	return irte_idx;
 }
 
 /* add intx entry for a vm, based on intx id (phys_pin)
@@ -526,27 +533,34 @@ static void ptirq_handle_intx(struct acrn_vm *vm,
 
 void ptirq_softirq(uint16_t pcpu_id)
 {
-	while (1) {
-		struct ptirq_remapping_info *entry = ptirq_dequeue_softirq(pcpu_id);
-		struct msi_info *vmsi;
-
-		if (entry == NULL) {
-			break;
-		}
+	struct ptirq_remapping_info *batch[PTIRQ_SOFTIRQ_BATCH];
+	struct ptirq_remapping_info *entry;
+	struct msi_info *vmsi;
+	uint32_t count, i;
+	uint64_t intr_tsc;
+
+	/* the entries are handled with the interrupts on, a batch at a time */
+	do {
+		count = ptirq_dequeue_softirq(pcpu_id, batch, PTIRQ_SOFTIRQ_BATCH);
+
+		for (i = 0U; i < count; i++) {
+			entry = batch[i];
+			vmsi = &entry->vmsi;
+
+			/* skip any inactive entry */
+			if (!is_entry_active(entry)) {
+				/* service next item */
+				continue;
+			}
 
-		vmsi = &entry->vmsi;
+			/* an interrupt coming during the injection is measured on its own */
+			intr_tsc = entry->intr_tsc;
+			entry->intr_tsc = 0UL;
 
-		/* skip any inactive entry */
-		if (!is_entry_active(entry)) {
-			/* service next item */
-			continue;
-		}
-
-		/* handle real request */
-		if (entry->intr_type == PTDEV_INTR_INTX) {
-			ptirq_handle_intx(entry->vm, entry);
-		} else {
-			if (vmsi != NULL) {
+			/* handle real request */
+			if (entry->intr_type == PTDEV_INTR_INTX) {
+				ptirq_handle_intx(entry->vm, entry);
+			} else {
 				/* TODO: vmsi destmode check required */
 				(void)vlapic_inject_msi(entry->vm, vmsi->addr.full, vmsi->data.full);
 				dev_dbg(DBG_LEVEL_PTIRQ, "dev-assign: irq=0x%x MSI VR: 0x%x-0x%x",
@@ -555,10 +569,20 @@ void ptirq_softirq(uint16_t pcpu_id)
 				dev_dbg(DBG_LEVEL_PTIRQ, " vmsi_addr: 0x%lx vmsi_data: 0x%x",
 					vmsi->addr.full, vmsi->data.full);
 			}
+
+			if (intr_tsc != 0UL) {
+				lat_probe_record(&entry->vm->lat_probe, ACRN_LAT_IRQ, cpu_ticks() - intr_tsc);
+			}
+
+			handle_x86_tee_int(entry, pcpu_id);
 		}
 
-		handle_x86_tee_int(entry, pcpu_id);
-	}
+		/* a burst of interrupts waits for the timers and, over the budget, for the next exit */
+		if ((count == PTIRQ_SOFTIRQ_BATCH) && softirq_should_yield(pcpu_id)) {
+			fire_softirq(SOFTIRQ_PTDEV);
+			break;
+		}
+	} while (count == PTIRQ_SOFTIRQ_BATCH);
 }
 
 void ptirq_intx_ack(struct acrn_vm *vm, uint32_t virt_gsi, enum intx_ctlr vgsi_ctlr)
@@ -842,11 +866,26 @@ void ptirq_remove_intx_remapping(const struct acrn_vm *vm, uint32_t gsi, bool pi
 void ptirq_remove_msix_remapping(const struct acrn_vm *vm, uint16_t phys_bdf,
 		uint32_t vector_count)
 {
-	uint32_t i;
+	uint16_t irte_idx[DMAR_QI_BATCH_SIZE];
+	uint16_t nr_irte;
+	struct intr_source intr_src;
+	uint32_t i = 0U;
 
-	for (i = 0U; i < vector_count; i++) {
+	intr_src.is_msi = true;
+	intr_src.src.msi.value = phys_bdf;
+
+	/* the IRTEs of up to DMAR_QI_BATCH_SIZE vectors are freed with a single invalidation wait */
+	while (i < vector_count) {
+		nr_irte = 0U;
 		spinlock_obtain(&ptdev_lock);
-		remove_msix_remapping(vm, phys_bdf, i);
+		while ((i < vector_count) && (nr_irte < DMAR_QI_BATCH_SIZE)) {
+			irte_idx[nr_irte] = remove_msix_remapping(vm, phys_bdf, i);
+			if (irte_idx[nr_irte] != INVALID_IRTE_ID) {
+				nr_irte++;
+			}
+			i++;
+		}
+		dmar_free_irtes(&intr_src, irte_idx, nr_irte);
 		spinlock_release(&ptdev_lock);
 	}
 }
@@ -863,3 +902,32 @@ void ptirq_remove_configured_intx_remappings(const struct acrn_vm *vm)
 		ptirq_remove_intx_remapping(vm, vm_config->pt_intx[i].virt_gsi, false, false);
 	}
 }
+
+/*
+ * In posted mode the IOMMU notifies the pCPU in the PID of the vCPU, which
+ * follows it. In remapped mode the physical interrupt would keep going to
+ * the old pCPU and reach the vCPU from there by IPI, so rebuild the IRTE
+ * in place. The index, and so the MSI programmed in the device, is kept.
+ * Without an IOMMU the device itself holds the destination and is left alone.
+ */
+void ptirq_msi_follow_vcpu(struct acrn_vcpu *vcpu)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct ptirq_remapping_info *entry;
+	uint16_t idx;
+
+	if (!is_lapic_pt_configured(vm)) {
+		for (idx = 0U; idx < CONFIG_MAX_PT_IRQ_ENTRIES; idx++) {
+			entry = &ptirq_entries[idx];
+			if ((entry->vm == vm) && (entry->intr_type == PTDEV_INTR_MSI) &&
+					((entry->vdmask & (1UL << vcpu->vcpu_id)) != 0UL)) {
+				spinlock_obtain(&ptdev_lock);
+				if (is_entry_active(entry) && (entry->irte_idx != INVALID_IRTE_ID)) {
+					ptirq_build_physical_msi(vm, entry, irq_to_vector(entry->allocated_pirq),
+						0UL, entry->irte_idx);
+				}
+				spinlock_release(&ptdev_lock);
+			}
+		}
+	}
+}
@@ -56,17 +56,33 @@
  *                  (c) The Maximum number of PCI devices for ACRN and the Maximum number of virtual PCI devices
  *                      for VM both are get_e820_ram_size()
  */
-static uint64_t get_ept_page_num(void)
+static uint64_t get_ept_page_num(uint16_t vm_id)
 {
 	uint64_t ept_pd_page_num = PD_PAGE_NUM(get_e820_ram_size() + MEM_4G) + CONFIG_MAX_PCI_DEV_NUM * 6U;
 	uint64_t ept_pt_page_num = PT_PAGE_NUM(get_e820_ram_size() + MEM_4G) + CONFIG_MAX_PCI_DEV_NUM * 6U;
+	uint64_t page_num = ept_pd_page_num + ept_pt_page_num;
 
-	return roundup((EPT_PML4_PAGE_NUM + EPT_PDPT_PAGE_NUM + ept_pd_page_num + ept_pt_page_num), 64U);
+	/*
+	 * The config tools size the PD and PT pages of a pre-launched VM the same way,
+	 * over its own memory and PCI devices instead of the host ones.
+	 */
+	if (get_vm_config(vm_id)->ept_page_num != 0U) {
+		page_num = get_vm_config(vm_id)->ept_page_num;
+	}
+
+	return roundup((EPT_PML4_PAGE_NUM + EPT_PDPT_PAGE_NUM + page_num), 64U);
 }
 
-uint64_t get_total_ept_4k_pages_size(void)
+static uint64_t get_total_ept_page_num(void)
 {
-	return CONFIG_MAX_VM_NUM * (get_ept_page_num()) * PAGE_SIZE;
+	uint64_t total = 0UL;
+	uint16_t vm_id;
+
+	for (vm_id = 0U; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
+		total += get_ept_page_num(vm_id);
+	}
+
+	return total;
 }
 
 static struct page *ept_pages[CONFIG_MAX_VM_NUM];
@@ -78,19 +94,19 @@ static struct page_pool ept_page_pool[CONFIG_MAX_VM_NUM];
 
 static void reserve_ept_bitmap(void)
 {
-	uint32_t i;
+	uint16_t vm_id;
 	uint64_t bitmap_base;
 	uint64_t bitmap_size;
-	uint64_t bitmap_offset;
+	uint64_t bitmap_offset = 0UL;
 
-	bitmap_size = (get_ept_page_num() * CONFIG_MAX_VM_NUM) / 8;
-	bitmap_offset = get_ept_page_num() / 8;
+	bitmap_size = get_total_ept_page_num() / 8U;
 
 	bitmap_base = e820_alloc_memory(bitmap_size, MEM_SIZE_MAX);
 	set_paging_supervisor(bitmap_base, bitmap_size);
 
-	for(i = 0; i < CONFIG_MAX_VM_NUM; i++){
-		ept_page_bitmap[i] = (uint64_t *)(void *)(bitmap_base + bitmap_offset * i);
+	for (vm_id = 0U; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
+		ept_page_bitmap[vm_id] = (uint64_t *)(void *)(bitmap_base + bitmap_offset);
+		bitmap_offset += get_ept_page_num(vm_id) / 8U;
 	}
 }
 
@@ -100,15 +116,15 @@ static void reserve_ept_bitmap(void)
 void reserve_buffer_for_ept_pages(void)
 {
 	uint64_t page_base;
+	uint64_t total_size = get_total_ept_page_num() * PAGE_SIZE;
 	uint16_t vm_id;
-	uint32_t offset = 0U;
+	uint64_t offset = 0UL;
 
-	page_base = e820_alloc_memory(get_total_ept_4k_pages_size(), MEM_SIZE_MAX);
-	set_paging_supervisor(page_base, get_total_ept_4k_pages_size());
+	page_base = e820_alloc_memory(total_size, MEM_SIZE_MAX);
+	set_paging_supervisor(page_base, total_size);
 	for (vm_id = 0U; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
 		ept_pages[vm_id] = (struct page *)(void *)(page_base + offset);
-		/* assume each VM has same amount of EPT pages */
-		offset += get_ept_page_num() * PAGE_SIZE;
+		offset += get_ept_page_num(vm_id) * PAGE_SIZE;
 	}
 
 	reserve_ept_bitmap();
@@ -168,24 +184,30 @@ static inline void ept_recover_exe_right(uint64_t *entry)
 	*entry |= EPT_EXE;
 }
 
+/*
+ * The usage of the EPT page pool of a VM, to check the pages reserved by
+ * get_ept_page_num() against what the VMs really use.
+ *
+ * @pre vm_id < CONFIG_MAX_VM_NUM
+ */
+void get_ept_page_pool_stats(uint16_t vm_id, struct page_pool_stats *stats)
+{
+	get_page_pool_stats(&ept_page_pool[vm_id], stats);
+}
+
 void init_ept_pgtable(struct pgtable *table, uint16_t vm_id)
 {
 	struct acrn_vm *vm = get_vm_from_vmid(vm_id);
 
-	ept_page_pool[vm_id].start_page = ept_pages[vm_id];
-	ept_page_pool[vm_id].bitmap_size = get_ept_page_num() / 64;
-	ept_page_pool[vm_id].bitmap = ept_page_bitmap[vm_id];
-	ept_page_pool[vm_id].dummy_page = &ept_dummy_pages[vm_id];
-
-	spinlock_init(&ept_page_pool[vm_id].lock);
-	memset((void *)ept_page_pool[vm_id].bitmap, 0, ept_page_pool[vm_id].bitmap_size * sizeof(uint64_t));
-	ept_page_pool[vm_id].last_hint_id = 0UL;
+	init_page_pool(&ept_page_pool[vm_id], ept_pages[vm_id], ept_page_bitmap[vm_id], get_ept_page_num(vm_id),
+		&ept_dummy_pages[vm_id]);
 
 	table->pool = &ept_page_pool[vm_id];
 	table->default_access_right = EPT_RWX;
 	table->pgentry_present_mask = EPT_RWX;
 	table->clflush_pagewalk = ept_clflush_pagewalk;
 	table->large_page_support = ept_large_page_support;
+	table->merge_large_page = true;
 
 	/* Mitigation for issue "Machine Check Error on Page Size Change" */
 	if (is_ept_force_4k_ipage()) {
@@ -284,7 +306,7 @@ uint64_t service_vm_hpa2gpa(uint64_t hpa)
 	return hpa;
 }
 
-int32_t ept_misconfig_vmexit_handler(__unused struct acrn_vcpu *vcpu)
+int32_t ept_misconfig_vmexit_handler(struct acrn_vcpu *vcpu)
 {
 	int32_t status;
 
@@ -292,10 +314,10 @@ int32_t ept_misconfig_vmexit_handler(__unused struct acrn_vcpu *vcpu)
 
 	/* TODO - EPT Violation handler */
 	pr_fatal("%s, Guest linear address: 0x%016lx ",
-			__func__, exec_vmread(VMX_GUEST_LINEAR_ADDR));
+			__func__, vcpu_get_exit_guest_linear_addr(vcpu));
 
 	pr_fatal("%s, Guest physical address: 0x%016lx ",
-			__func__, exec_vmread64(VMX_GUEST_PHYSICAL_ADDR_FULL));
+			__func__, vcpu_get_exit_guest_phys_addr(vcpu));
 
 	ASSERT(status == 0, "EPT Misconfiguration is not handled.\n");
 
@@ -304,13 +326,55 @@ int32_t ept_misconfig_vmexit_handler(__unused struct acrn_vcpu *vcpu)
 	return status;
 }
 
-static inline void ept_flush_guest(struct acrn_vm *vm)
+static void ept_flush_guest(struct acrn_vm *vm)
 {
 	uint16_t i;
 	struct acrn_vcpu *vcpu;
-	/* Here doesn't do the real flush, just makes the request which will be handled before vcpu vmenter */
-	foreach_vcpu(i, vm, vcpu) {
-		vcpu_make_request(vcpu, ACRN_REQUEST_EPT_FLUSH);
+
+	if (get_cpu_var(ept_batch_vm) == vm) {
+		get_cpu_var(ept_batch_flush) = true;
+	} else {
+		/*
+		 * Here doesn't do the real flush, just makes the request which will be handled before vcpu vmenter.
+		 * A vCPU with the request still pending hasn't entered the guest since, so it isn't kicked again.
+		 */
+		foreach_vcpu(i, vm, vcpu) {
+			if (!bitmap_test_and_set_lock(ACRN_REQUEST_EPT_FLUSH, &vcpu->arch.pending_req)) {
+				kick_vcpu(vcpu);
+			}
+		}
+	}
+}
+
+/*
+ * The EPT updates of vm made on this pCPU until ept_end_batch() request a
+ * single flush there. The hypervisor doesn't preempt a pCPU in the middle of
+ * an exit handler, so the batch can't be seen by another caller. Batches of
+ * the same VM nest, the outermost one flushes.
+ *
+ * @pre (get_cpu_var(ept_batch_vm) == NULL) || (get_cpu_var(ept_batch_vm) == vm)
+ */
+void ept_begin_batch(struct acrn_vm *vm)
+{
+	if (get_cpu_var(ept_batch_depth) == 0U) {
+		get_cpu_var(ept_batch_vm) = vm;
+		get_cpu_var(ept_batch_flush) = false;
+	}
+	get_cpu_var(ept_batch_depth)++;
+}
+
+/*
+ * @pre get_cpu_var(ept_batch_vm) == vm
+ * @pre get_cpu_var(ept_batch_depth) > 0U
+ */
+void ept_end_batch(struct acrn_vm *vm)
+{
+	get_cpu_var(ept_batch_depth)--;
+	if (get_cpu_var(ept_batch_depth) == 0U) {
+		get_cpu_var(ept_batch_vm) = NULL;
+		if (get_cpu_var(ept_batch_flush)) {
+			ept_flush_guest(vm);
+		}
 	}
 }
 
@@ -336,16 +400,32 @@ void ept_modify_mr(struct acrn_vm *vm, uint64_t *pml4_page,
 		uint64_t prot_set, uint64_t prot_clr)
 {
 	uint64_t local_prot = prot_set;
+	struct page_pool *pool = vm->arch_vm.ept_pgtable.pool;
+	uint64_t used_pages, freed_pages;
+	bool flush;
 
 	dev_dbg(DBG_LEVEL_EPT, "%s,vm[%d] gpa 0x%lx size 0x%lx\n", __func__, vm->vm_id, gpa, size);
 
 	spinlock_obtain(&vm->ept_lock);
 
+	used_pages = pool->stats.used_pages;
+	freed_pages = pool->stats.freed_pages;
 	pgtable_modify_or_del_map(pml4_page, gpa, size, local_prot, prot_clr, &(vm->arch_vm.ept_pgtable), MR_MODIFY);
 
+	/*
+	 * Only granting more access rights to the leaf entries leaves nothing
+	 * stale that could be used: an access denied by a translation cached
+	 * before causes an EPT violation, which drops it, and is then retried.
+	 * A split or a merge changes the page sizes, so it is flushed.
+	 */
+	flush = (prot_clr != 0UL) || ((local_prot & ~EPT_RWX) != 0UL) ||
+		(pool->stats.used_pages != used_pages) || (pool->stats.freed_pages != freed_pages);
+
 	spinlock_release(&vm->ept_lock);
 
-	ept_flush_guest(vm);
+	if (flush) {
+		ept_flush_guest(vm);
+	}
 }
 /**
  * @pre [gpa,gpa+size) has been mapped into host physical memory region
@@ -363,6 +443,52 @@ void ept_del_mr(struct acrn_vm *vm, uint64_t *pml4_page, uint64_t gpa, uint64_t
 	ept_flush_guest(vm);
 }
 
+bool is_ept_ad_enabled(const struct acrn_vm *vm)
+{
+	return (is_dirty_log_configured(vm) && pcpu_has_vmx_ept_vpid_cap(VMX_EPT_AD));
+}
+
+/*
+ * Set the bits of the pages [gpa, gpa + (pages << PAGE_SHIFT)) whose EPT
+ * entry has flag, EPT_ACCESSED or EPT_DIRTY, in bitmap and clear it. A large
+ * page is reported as a whole. The processor doesn't set the flag again for
+ * a translation it cached with it, so the cleared ones are flushed.
+ *
+ * @pre is_ept_ad_enabled(vm) && mem_aligned_check(gpa, PAGE_SIZE)
+ * @pre bitmap has pages bits, all clear
+ */
+void ept_clear_access_log(struct acrn_vm *vm, uint64_t gpa, uint64_t pages, uint64_t flag, uint64_t *bitmap)
+{
+	const uint64_t *pgentry;
+	uint64_t pg_size = 0UL, addr;
+	uint64_t idx = 0UL, i, n;
+	bool flush = false;
+
+	spinlock_obtain(&vm->ept_lock);
+	while (idx < pages) {
+		addr = gpa + (idx << PAGE_SHIFT);
+		n = 1UL;
+		pgentry = pgtable_lookup_entry((uint64_t *)vm->arch_vm.nworld_eptp, addr, &pg_size, &vm->arch_vm.ept_pgtable);
+		if (pgentry != NULL) {
+			/* the rest of the (large) page addr is in */
+			n = min((pg_size - (addr & (pg_size - 1UL))) >> PAGE_SHIFT, pages - idx);
+			/* the processor sets the flags with locked operations too */
+			if (bitmap_test_and_clear_lock(ffs64(flag), (uint64_t *)pgentry)) {
+				for (i = idx; i < (idx + n); i++) {
+					bitmap[i >> 6U] |= (1UL << (i & 0x3FUL));
+				}
+				flush = true;
+			}
+		}
+		idx += n;
+	}
+	spinlock_release(&vm->ept_lock);
+
+	if (flush) {
+		ept_flush_guest(vm);
+	}
+}
+
 /**
  * @pre pge != NULL && size > 0.
  */
@@ -50,6 +50,36 @@ enum vm_paging_mode get_vcpu_paging_mode(struct acrn_vcpu *vcpu)
 	return ret;
 }
 
+/*
+ * gpa2hva() for the guest paging-structure pages, which costs an EPT walk
+ * per level. The guest entries themselves are read again on each walk, only
+ * the EPT translation of their pages is kept: until the next EPT flush of
+ * the vCPU, or a switch to the EPT of the other world.
+ */
+static void *pw_gpa2hva(struct acrn_vcpu *vcpu, uint64_t gpa)
+{
+	struct pw_cache_entry *entry = &vcpu->arch.pw_cache[(gpa >> PAGE_SHIFT) & (PW_CACHE_SIZE - 1U)];
+	void *eptp = get_eptp(vcpu->vm);
+	void *hva;
+
+	if (vcpu->arch.pw_cache_eptp != eptp) {
+		(void)memset((void *)vcpu->arch.pw_cache, 0U, sizeof(vcpu->arch.pw_cache));
+		vcpu->arch.pw_cache_eptp = eptp;
+	}
+
+	if ((entry->hva != NULL) && (entry->gpa == (gpa & PAGE_MASK))) {
+		hva = (void *)((uint64_t)entry->hva + (gpa & (PAGE_SIZE - 1UL)));
+	} else {
+		hva = gpa2hva(vcpu->vm, gpa);
+		if (hva != NULL) {
+			entry->gpa = gpa & PAGE_MASK;
+			entry->hva = (void *)((uint64_t)hva & PAGE_MASK);
+		}
+	}
+
+	return hva;
+}
+
 /* TODO: Add code to check for Revserved bits, SMAP and PKE when do translation
  * during page walk */
 static int32_t local_gva2gpa_common(struct acrn_vcpu *vcpu, const struct page_walk_info *pw_info,
@@ -78,7 +108,7 @@ static int32_t local_gva2gpa_common(struct acrn_vcpu *vcpu, const struct page_wa
 			i--;
 
 			addr = addr & IA32E_REF_MASK;
-			base = gpa2hva(vcpu->vm, addr);
+			base = pw_gpa2hva(vcpu, addr);
 			if (base == NULL) {
 				fault = 1;
 			} else {
@@ -205,7 +235,7 @@ static int32_t local_gva2gpa_pae(struct acrn_vcpu *vcpu, struct page_walk_info *
 	int32_t ret = -EFAULT;
 
 	addr = get_pae_pdpt_addr(pw_info->top_entry);
-	base = (uint64_t *)gpa2hva(vcpu->vm, addr);
+	base = (uint64_t *)pw_gpa2hva(vcpu, addr);
 	if (base != NULL) {
 		index = (uint32_t)gva >> 30U;
 		stac();
@@ -13,11 +13,19 @@
 #include <asm/vmx.h>
 #include <asm/guest/hyperv.h>
 #include <asm/tsc.h>
+#include <asm/cpu_caps.h>
+#include <ticks.h>
 
 #define DBG_LEVEL_HYPERV		6U
 
 /* Partition Reference Counter (HV_X64_MSR_TIME_REF_COUNT) */
 #define CPUID3A_TIME_REF_COUNT_MSR	(1U << 1U)
+/* Synthetic interrupt controller MSRs (HV_X64_MSR_SCONTROL to HV_X64_MSR_SINT15) */
+#define CPUID3A_SYNIC_MSRS		(1U << 2U)
+/* Synthetic timer MSRs (HV_X64_MSR_STIMERn_CONFIG/HV_X64_MSR_STIMERn_COUNT) */
+#define CPUID3A_SYNTH_TIMER_MSRS	(1U << 3U)
+/* APIC access MSRs (HV_X64_MSR_EOI/HV_X64_MSR_ICR/HV_X64_MSR_TPR) and VP assist page */
+#define CPUID3A_APIC_ACCESS_MSRS	(1U << 4U)
 /* Hypercall MSRs (HV_X64_MSR_GUEST_OS_ID and HV_X64_MSR_HYPERCALL) */
 #define CPUID3A_HYPERCALL_MSR		(1U << 5U)
 /* Access virtual processor index MSR (HV_X64_MSR_VP_INDEX) */
@@ -28,6 +36,38 @@
 #define CPUID3A_ACCESS_FREQUENCY_MSRS	(1U << 11U)
 /* Frequency MSRs available */
 #define CPUID3D_FREQ_MSRS_AVAILABLE	(1U << 8U)
+/* Synthetic timers can be in direct mode */
+#define CPUID3D_STIMER_DIRECT_MODE	(1U << 19U)
+/* Relaxed timing, no watchdog timeouts when the vCPUs are descheduled */
+#define CPUID4A_RELAXED_TIMING		(1U << 5U)
+/* AutoEOI of the SINTs is deprecated */
+#define CPUID4A_DEPRECATE_AUTOEOI	(1U << 9U)
+/* Spinlock retries before notifying a long spin wait, all ones for never */
+#define CPUID4B_NO_SPIN_WAIT_NOTIFY	0xFFFFFFFFU
+
+#define HV_SCONTROL_ENABLE		(1UL << 0U)
+#define HV_SYNIC_VERSION		1UL
+
+#define HVMSG_NONE			0U
+#define HVMSG_TIMER_EXPIRED		0x80000010U
+#define HV_MSG_FLAG_PENDING		(1U << 0U)
+
+/* a slot of the SynIC message page, one for each SINT */
+struct HV_MESSAGE {
+	uint32_t message_type;
+	uint8_t payload_size;
+	uint8_t message_flags;
+	uint16_t reserved;
+	uint64_t origination_id;
+	uint64_t payload[30];
+};
+
+struct HV_TIMER_MESSAGE_PAYLOAD {
+	uint32_t timer_index;
+	uint32_t reserved;
+	uint64_t expiration_time;
+	uint64_t delivery_time;
+};
 
 struct HV_REFERENCE_TSC_PAGE {
 	uint32_t tsc_sequence;
@@ -103,6 +143,213 @@ hyperv_get_ReferenceTime(struct acrn_vm *vm)
 	return hyperv_scale_tsc(vm->arch_vm.hyperv.tsc_scale) - vm->arch_vm.hyperv.tsc_offset;
 }
 
+/* reference time in 100ns units to TSC ticks */
+static inline uint64_t
+hyperv_ref_to_ticks(uint64_t ref)
+{
+	uint64_t tsc_khz = get_tsc_khz();
+
+	return (ref < (UINT64_MAX / tsc_khz)) ? max((ref * tsc_khz) / 10000UL, 1UL) : (UINT64_MAX / 10000UL);
+}
+
+static inline bool
+hyperv_apic_access_supported(const struct acrn_vm *vm)
+{
+	/* with APICv advanced, EOIs of edge triggered vectors don't exit */
+	return !is_apicv_advanced_feature_supported() && !is_lapic_pt_configured(vm);
+}
+
+/*
+ * Put the message of the expiration in the SINTx slot of the message page and
+ * raise the SINTx vector. Return false if the slot is still busy, the guest
+ * writes HV_X64_MSR_EOM once it is free and the message is sent again then.
+ * A message the SynIC can't take, e.g. its SINT is masked, is dropped.
+ */
+static bool
+hyperv_stimer_send_msg(struct hyperv_stimer *stimer)
+{
+	struct acrn_vcpu *vcpu = stimer->vcpu;
+	struct acrn_hyperv_vcpu *hv = &vcpu->arch.hyperv;
+	union hyperv_sint_msr sint = hv->sint[stimer->config.sintx];
+	struct HV_TIMER_MESSAGE_PAYLOAD payload;
+	struct HV_MESSAGE *msg;
+	bool sent = true;
+
+	if (((hv->scontrol & HV_SCONTROL_ENABLE) != 0UL) && (hv->simp.enabled == 1U) && (sint.masked == 0U)) {
+		msg = (struct HV_MESSAGE *)gpa2hva(vcpu->vm, hv->simp.gpfn << PAGE_SHIFT);
+		if (msg != NULL) {
+			msg = &msg[stimer->config.sintx];
+			payload.timer_index = stimer->index;
+			payload.reserved = 0U;
+			payload.expiration_time = stimer->exp_time;
+			payload.delivery_time = stimer->exp_time +
+				u64_mul_u64_shr64(cpu_ticks() - stimer->exp_tsc, vcpu->vm->arch_vm.hyperv.tsc_scale);
+
+			stac();
+			if (msg->message_type == HVMSG_NONE) {
+				msg->payload_size = (uint8_t)sizeof(payload);
+				msg->message_flags = 0U;
+				msg->origination_id = 0UL;
+				(void)memcpy_s(msg->payload, sizeof(msg->payload), &payload, sizeof(payload));
+				cpu_write_memory_barrier();
+				msg->message_type = HVMSG_TIMER_EXPIRED;
+			} else {
+				msg->message_flags |= HV_MSG_FLAG_PENDING;
+				sent = false;
+			}
+			clac();
+
+			if (sent && (sint.polling == 0U)) {
+				vlapic_set_intr(vcpu, (uint32_t)sint.vector, LAPIC_TRIG_EDGE);
+			}
+		}
+	}
+
+	return sent;
+}
+
+/* timer softirq, on the pCPU the timer was added on */
+static void
+hyperv_stimer_expired(void *data)
+{
+	struct hyperv_stimer *stimer = (struct hyperv_stimer *)data;
+	struct hv_timer *timer = &stimer->timer;
+	uint64_t now = cpu_ticks();
+	uint64_t period, periods;
+
+	if (stimer->config.direct_mode == 1U) {
+		vlapic_set_intr(stimer->vcpu, (uint32_t)stimer->config.apic_vector, LAPIC_TRIG_EDGE);
+	} else {
+		stimer->msg_pending = !hyperv_stimer_send_msg(stimer);
+	}
+
+	if (stimer->config.periodic == 1U) {
+		/* the periods missed are skipped, timer_softirq() keeps the timer re-added here */
+		period = hyperv_ref_to_ticks(stimer->count);
+		periods = ((now - timer->timeout) / period) + 1UL;
+		stimer->exp_time += periods * stimer->count;
+		stimer->exp_tsc = timer->timeout + (periods * period);
+		update_timer(timer, stimer->exp_tsc, 0UL);
+		(void)add_timer(timer);
+	} else {
+		stimer->config.enabled = 0U;
+	}
+}
+
+/*
+ * (Re)start the timer after a write to its MSRs. The count of a periodic
+ * timer is its period, the one of a one-shot timer the reference time it
+ * expires at.
+ *
+ * @pre the VMCS of stimer->vcpu is loaded
+ */
+static void
+hyperv_stimer_start(struct hyperv_stimer *stimer)
+{
+	uint64_t now = hyperv_get_ReferenceTime(stimer->vcpu->vm);
+
+	del_timer(&stimer->timer);
+	stimer->msg_pending = false;
+
+	if ((stimer->config.enabled == 1U) && (stimer->count != 0UL) &&
+			((stimer->config.direct_mode == 1U) || (stimer->config.sintx != 0U))) {
+		stimer->exp_time = (stimer->config.periodic == 1U) ? (now + stimer->count) : stimer->count;
+		stimer->exp_tsc = cpu_ticks();
+		if (stimer->exp_time > now) {
+			stimer->exp_tsc += hyperv_ref_to_ticks(stimer->exp_time - now);
+		}
+		update_timer(&stimer->timer, stimer->exp_tsc, 0UL);
+		(void)add_timer(&stimer->timer);
+	}
+}
+
+static void
+hyperv_stimer_wrmsr(struct acrn_vcpu *vcpu, uint32_t msr, uint64_t wval)
+{
+	uint32_t offset = msr - HV_X64_MSR_STIMER0_CONFIG;
+	struct hyperv_stimer *stimer = &vcpu->arch.hyperv.stimer[offset >> 1U];
+
+	if ((offset & 1U) == 0U) {
+		stimer->config.val64 = wval;
+	} else {
+		stimer->count = wval;
+		if (wval == 0UL) {
+			stimer->config.enabled = 0U;
+		} else if (stimer->config.auto_enable == 1U) {
+			stimer->config.enabled = 1U;
+		} else {
+			/* the count takes effect once the timer is enabled */
+		}
+	}
+	hyperv_stimer_start(stimer);
+}
+
+static uint64_t
+hyperv_stimer_rdmsr(const struct acrn_vcpu *vcpu, uint32_t msr)
+{
+	uint32_t offset = msr - HV_X64_MSR_STIMER0_CONFIG;
+	const struct hyperv_stimer *stimer = &vcpu->arch.hyperv.stimer[offset >> 1U];
+
+	return ((offset & 1U) == 0U) ? stimer->config.val64 : stimer->count;
+}
+
+/* the guest freed a message slot, send the messages that found it busy */
+static void
+hyperv_synic_eom(struct acrn_vcpu *vcpu)
+{
+	struct hyperv_stimer *stimer;
+	uint32_t i;
+
+	for (i = 0U; i < HV_STIMER_COUNT; i++) {
+		stimer = &vcpu->arch.hyperv.stimer[i];
+		if (stimer->msg_pending) {
+			stimer->msg_pending = !hyperv_stimer_send_msg(stimer);
+		}
+	}
+}
+
+/*
+ * The first dword of the VP assist page is the APIC assist, bit 0 of it lets
+ * the guest skip the EOI, see vlapic_sync_lazy_eoi().
+ */
+static void
+hyperv_setup_vp_assist_page(struct acrn_vcpu *vcpu, uint64_t val)
+{
+	union hyperv_page_msr *vp_assist_page = &vcpu->arch.hyperv.vp_assist_page;
+	uint32_t *apic_assist = NULL;
+
+	vp_assist_page->val64 = val;
+	if (vp_assist_page->enabled == 1U) {
+		apic_assist = (uint32_t *)gpa2hva(vcpu->vm, vp_assist_page->gpfn << PAGE_SHIFT);
+		if (apic_assist != NULL) {
+			stac();
+			*apic_assist = 0U;
+			clac();
+		}
+	}
+	vlapic_set_lazy_eoi(vcpu_vlapic(vcpu), apic_assist);
+}
+
+static uint32_t
+hyperv_apic_msr_to_x2apic_msr(uint32_t msr)
+{
+	uint32_t x2apic_msr;
+
+	switch (msr) {
+	case HV_X64_MSR_EOI:
+		x2apic_msr = MSR_IA32_EXT_APIC_EOI;
+		break;
+	case HV_X64_MSR_ICR:
+		x2apic_msr = MSR_IA32_EXT_APIC_ICR;
+		break;
+	default:
+		x2apic_msr = MSR_IA32_EXT_APIC_TPR;
+		break;
+	}
+
+	return x2apic_msr;
+}
+
 static void
 hyperv_setup_hypercall_page(const struct acrn_vcpu *vcpu, uint64_t val)
 {
@@ -169,10 +416,46 @@ hyperv_wrmsr(struct acrn_vcpu *vcpu, uint32_t msr, uint64_t wval)
 	case HV_X64_MSR_REFERENCE_TSC:
 		hyperv_setup_tsc_page(vcpu, wval);
 		break;
+	case HV_X64_MSR_EOI:
+	case HV_X64_MSR_ICR:
+	case HV_X64_MSR_TPR:
+		if (hyperv_apic_access_supported(vcpu->vm)) {
+			ret = vlapic_pv_msr_write(vcpu_vlapic(vcpu), hyperv_apic_msr_to_x2apic_msr(msr), wval);
+		} else {
+			ret = -1;
+		}
+		break;
+	case HV_X64_MSR_VP_ASSIST_PAGE:
+		if (hyperv_apic_access_supported(vcpu->vm)) {
+			hyperv_setup_vp_assist_page(vcpu, wval);
+		} else {
+			ret = -1;
+		}
+		break;
+	case HV_X64_MSR_SCONTROL:
+		vcpu->arch.hyperv.scontrol = wval;
+		break;
+	case HV_X64_MSR_SIEFP:
+		/* no event flags are ever signaled */
+		vcpu->arch.hyperv.siefp.val64 = wval;
+		break;
+	case HV_X64_MSR_SIMP:
+		vcpu->arch.hyperv.simp.val64 = wval;
+		break;
+	case HV_X64_MSR_EOM:
+		hyperv_synic_eom(vcpu);
+		break;
+	case HV_X64_MSR_SINT0 ... HV_X64_MSR_SINT15:
+		vcpu->arch.hyperv.sint[msr - HV_X64_MSR_SINT0].val64 = wval;
+		break;
+	case HV_X64_MSR_STIMER0_CONFIG ... HV_X64_MSR_STIMER3_COUNT:
+		hyperv_stimer_wrmsr(vcpu, msr, wval);
+		break;
 	case HV_X64_MSR_VP_INDEX:
 	case HV_X64_MSR_TIME_REF_COUNT:
 	case HV_X64_MSR_TSC_FREQUENCY:
 	case HV_X64_MSR_APIC_FREQUENCY:
+	case HV_X64_MSR_SVERSION:
 		/* read only */
 		/* fallthrough */
 	default:
@@ -215,6 +498,39 @@ hyperv_rdmsr(struct acrn_vcpu *vcpu, uint32_t msr, uint64_t *rval)
 		/* vLAPIC freq is the same as TSC freq */
 		*rval = get_tsc_khz() * 1000UL;
 		break;
+	case HV_X64_MSR_EOI:
+	case HV_X64_MSR_ICR:
+	case HV_X64_MSR_TPR:
+		if (hyperv_apic_access_supported(vcpu->vm)) {
+			ret = vlapic_pv_msr_read(vcpu_vlapic(vcpu), hyperv_apic_msr_to_x2apic_msr(msr), rval);
+		} else {
+			ret = -1;
+		}
+		break;
+	case HV_X64_MSR_VP_ASSIST_PAGE:
+		*rval = vcpu->arch.hyperv.vp_assist_page.val64;
+		break;
+	case HV_X64_MSR_SCONTROL:
+		*rval = vcpu->arch.hyperv.scontrol;
+		break;
+	case HV_X64_MSR_SVERSION:
+		*rval = HV_SYNIC_VERSION;
+		break;
+	case HV_X64_MSR_SIEFP:
+		*rval = vcpu->arch.hyperv.siefp.val64;
+		break;
+	case HV_X64_MSR_SIMP:
+		*rval = vcpu->arch.hyperv.simp.val64;
+		break;
+	case HV_X64_MSR_EOM:
+		*rval = 0UL;
+		break;
+	case HV_X64_MSR_SINT0 ... HV_X64_MSR_SINT15:
+		*rval = vcpu->arch.hyperv.sint[msr - HV_X64_MSR_SINT0].val64;
+		break;
+	case HV_X64_MSR_STIMER0_CONFIG ... HV_X64_MSR_STIMER3_COUNT:
+		*rval = hyperv_stimer_rdmsr(vcpu, msr);
+		break;
 	default:
 		pr_err("hv: %s: unexpected MSR[0x%x] read", __func__, msr);
 		ret = -1;
@@ -254,8 +570,57 @@ hyperv_init_time(struct acrn_vm *vm)
 		__func__, tsc_scale, tsc_offset);
 }
 
+/*
+ * Stop the synthetic timers and bring the SynIC to its reset state, all SINTs
+ * masked.
+ */
 void
-hyperv_init_vcpuid_entry(uint32_t leaf, uint32_t subleaf, uint32_t flags,
+hyperv_reset_vcpu(struct acrn_vcpu *vcpu)
+{
+	struct acrn_hyperv_vcpu *hv = &vcpu->arch.hyperv;
+	uint32_t i;
+
+	for (i = 0U; i < HV_STIMER_COUNT; i++) {
+		del_timer(&hv->stimer[i].timer);
+	}
+	(void)memset(hv, 0U, sizeof(*hv));
+
+	for (i = 0U; i < HV_SYNIC_SINT_COUNT; i++) {
+		hv->sint[i].masked = 1U;
+	}
+	for (i = 0U; i < HV_STIMER_COUNT; i++) {
+		hv->stimer[i].vcpu = vcpu;
+		hv->stimer[i].index = i;
+		initialize_timer(&hv->stimer[i].timer, hyperv_stimer_expired, &hv->stimer[i], 0UL, 0UL);
+	}
+}
+
+/*
+ * The synthetic timers are in the timer heap of the pCPU they were added on,
+ * move them with the vCPU: out on the old pCPU, in once it runs on the new one.
+ */
+void
+hyperv_migrate_vcpu(struct acrn_vcpu *vcpu, bool out)
+{
+	struct hyperv_stimer *stimer;
+	uint32_t i;
+
+	for (i = 0U; i < HV_STIMER_COUNT; i++) {
+		stimer = &vcpu->arch.hyperv.stimer[i];
+		if (out) {
+			stimer->migrated = timer_is_started(&stimer->timer);
+			del_timer(&stimer->timer);
+		} else if (stimer->migrated) {
+			stimer->migrated = false;
+			(void)add_timer(&stimer->timer);
+		} else {
+			/* it was not running */
+		}
+	}
+}
+
+void
+hyperv_init_vcpuid_entry(const struct acrn_vm *vm, uint32_t leaf, uint32_t subleaf, uint32_t flags,
 			 struct vcpuid_entry *entry)
 {
 	entry->leaf = leaf;
@@ -278,14 +643,22 @@ hyperv_init_vcpuid_entry(uint32_t leaf, uint32_t subleaf, uint32_t flags,
 	case 0x40000003U: /* HV supported feature */
 		entry->eax = CPUID3A_HYPERCALL_MSR | CPUID3A_VP_INDEX_MSR |
 			CPUID3A_TIME_REF_COUNT_MSR | CPUID3A_REFERENCE_TSC_MSR |
-			CPUID3A_ACCESS_FREQUENCY_MSRS;
+			CPUID3A_ACCESS_FREQUENCY_MSRS | CPUID3A_SYNIC_MSRS |
+			CPUID3A_SYNTH_TIMER_MSRS;
+		if (hyperv_apic_access_supported(vm)) {
+			entry->eax |= CPUID3A_APIC_ACCESS_MSRS;
+		}
 		entry->ebx = 0U;
 		entry->ecx = 0U;
-		entry->edx = CPUID3D_FREQ_MSRS_AVAILABLE;
+		entry->edx = CPUID3D_FREQ_MSRS_AVAILABLE | CPUID3D_STIMER_DIRECT_MODE;
 		break;
 	case 0x40000004U: /* HV Recommended hypercall usage */
-		entry->eax = 0U;
-		entry->ebx = 0U;
+		/*
+		 * No long spin wait notifications, there is no hypercall to take
+		 * them and the pause-loop exiting already yields spinning vCPUs.
+		 */
+		entry->eax = CPUID4A_RELAXED_TIMING | CPUID4A_DEPRECATE_AUTOEOI;
+		entry->ebx = CPUID4B_NO_SPIN_WAIT_NOTIFY;
 		entry->ecx = 0U;
 		entry->edx = 0U;
 		break;
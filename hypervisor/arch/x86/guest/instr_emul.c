@@ -83,6 +83,8 @@
 #define VIE_OP_TYPE_BITTEST	14U
 #define VIE_OP_TYPE_TEST	15U
 #define VIE_OP_TYPE_XCHG	16U
+#define VIE_OP_TYPE_CMPXCHG	17U
+#define VIE_OP_TYPE_XADD	18U
 
 /* struct vie_op.op_flags */
 #define VIE_OP_F_IMM		(1U << 0U)  /* 16/32-bit immediate operand */
@@ -100,6 +102,13 @@
 #define VIE_OP_F_WORD_OP	(1U << 6U)  /* 16-bit operands. */
 
 static const struct instr_emul_vie_op two_byte_opcodes[256] = {
+	[0xB0] = {
+		.op_type = VIE_OP_TYPE_CMPXCHG,
+		.op_flags = VIE_OP_F_BYTE_OP,
+	},
+	[0xB1] = {
+		.op_type = VIE_OP_TYPE_CMPXCHG,
+	},
 	[0xB6] = {
 		.op_type = VIE_OP_TYPE_MOVZX,
 		.op_flags = VIE_OP_F_BYTE_OP,
@@ -116,6 +125,13 @@ static const struct instr_emul_vie_op two_byte_opcodes[256] = {
 		.op_type = VIE_OP_TYPE_MOVSX,
 		.op_flags = VIE_OP_F_BYTE_OP,
 	},
+	[0xC0] = {
+		.op_type = VIE_OP_TYPE_XADD,
+		.op_flags = VIE_OP_F_BYTE_OP,
+	},
+	[0xC1] = {
+		.op_type = VIE_OP_TYPE_XADD,
+	},
 };
 
 static const struct instr_emul_vie_op one_byte_opcodes[256] = {
@@ -745,6 +761,23 @@ build_getcc(getcc16, uint16_t)
 build_getcc(getcc32, uint32_t)
 build_getcc(getcc64, uint64_t)
 
+/*
+ * Return the status flags that would result from doing (x + y).
+ */
+#define build_getaddcc(name, type)				\
+static uint64_t name(type x, type y)				\
+{								\
+	uint64_t rflags;					\
+								\
+	__asm __volatile("add %2,%1; pushfq; popq %0" :		\
+			"=r" (rflags), "+r" (x) : "m" (y));	\
+	return rflags;						\
+}
+build_getaddcc(getaddcc8, uint8_t)
+build_getaddcc(getaddcc16, uint16_t)
+build_getaddcc(getaddcc32, uint32_t)
+build_getaddcc(getaddcc64, uint64_t)
+
 /**
  * @pre opsize = 1, 2, 4 or 8
  */
@@ -769,6 +802,30 @@ static uint64_t getcc(uint8_t opsize, uint64_t x, uint64_t y)
 	return rflags;
 }
 
+/**
+ * @pre opsize = 1, 2, 4 or 8
+ */
+static uint64_t getaddcc(uint8_t opsize, uint64_t x, uint64_t y)
+{
+	uint64_t rflags;
+	switch (opsize) {
+	case 1U:
+		rflags = getaddcc8((uint8_t) x, (uint8_t) y);
+		break;
+	case 2U:
+		rflags = getaddcc16((uint16_t) x, (uint16_t) y);
+		break;
+	case 4U:
+		rflags = getaddcc32((uint32_t) x, (uint32_t) y);
+		break;
+	default:	/* opsize == 8 */
+		rflags = getaddcc64(x, y);
+		break;
+	}
+
+	return rflags;
+}
+
 static int32_t emulate_mov(struct acrn_vcpu *vcpu, const struct instr_emul_vie *vie)
 {
 	int32_t error;
@@ -1675,6 +1732,116 @@ static __attribute__((noinline)) int32_t emulate_xchg_for_splitlock(struct acrn_
 	return ret;
 }
 
+/* the ModRM:reg operand of a locked read-modify-write, byte registers included */
+static uint64_t splitlock_read_reg(const struct acrn_vcpu *vcpu, const struct instr_emul_vie *vie, uint8_t opsize)
+{
+	uint64_t val;
+
+	if (opsize == 1U) {
+		val = vie_read_bytereg(vcpu, vie);
+	} else {
+		val = vm_get_register(vcpu, (enum cpu_reg_name)(vie->reg));
+	}
+
+	return val;
+}
+
+static void splitlock_write_reg(struct acrn_vcpu *vcpu, const struct instr_emul_vie *vie, uint64_t val, uint8_t opsize)
+{
+	if (opsize == 1U) {
+		vie_write_bytereg(vcpu, vie, (uint8_t)val);
+	} else {
+		vie_update_register(vcpu, (enum cpu_reg_name)(vie->reg), val, opsize);
+	}
+}
+
+/*
+ * LOCK CMPXCHG r/m, r: the destination is written either way, with the
+ * source if it matched the accumulator, with itself otherwise, so that a
+ * read-only page faults as on the bare metal.
+ *
+ * 0F B0/r:		cmpxchg r/m8, r8
+ * 0F B1/r:		cmpxchg r/m16, r16
+ * 0F B1/r:		cmpxchg r/m32, r32
+ * REX.W + 0F B1/r:	cmpxchg r/m64, r64
+ */
+static __attribute__((noinline)) int32_t emulate_cmpxchg_for_splitlock(struct acrn_vcpu *vcpu,
+	const struct instr_emul_vie *vie)
+{
+	uint8_t opsize = ((vie->op.op_flags & VIE_OP_F_BYTE_OP) != 0U) ? 1U : vie->opsize;
+	uint64_t acc, src, data = 0UL, rflags2;
+	uint32_t err_code = 0U;
+	uint64_t fault_addr;
+	int32_t ret;
+
+	acc = vm_get_register(vcpu, CPU_REG_RAX) & size2mask[opsize];
+	src = splitlock_read_reg(vcpu, vie, opsize);
+
+	ret = copy_from_gva(vcpu, &data, vie->gva, opsize, &err_code, &fault_addr);
+	if (ret == 0) {
+		rflags2 = getcc(opsize, acc, data);
+		err_code = PAGE_FAULT_WR_FLAG;
+		ret = copy_to_gva(vcpu, (acc == data) ? &src : &data, vie->gva, opsize, &err_code, &fault_addr);
+		if (ret == 0) {
+			if (acc != data) {
+				vie_update_register(vcpu, CPU_REG_RAX, data, opsize);
+			}
+			vie_update_rflags(vcpu, rflags2, RFLAGS_STATUS_BITS);
+		}
+	}
+
+	if (ret < 0) {
+		pr_err("Error copy cmpxchg data!");
+		if (ret == -EFAULT) {
+			vcpu_inject_pf(vcpu, fault_addr, err_code);
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * LOCK XADD r/m, r: the sum goes to the destination and its old value to
+ * the source register.
+ *
+ * 0F C0/r:		xadd r/m8, r8
+ * 0F C1/r:		xadd r/m16, r16
+ * 0F C1/r:		xadd r/m32, r32
+ * REX.W + 0F C1/r:	xadd r/m64, r64
+ */
+static __attribute__((noinline)) int32_t emulate_xadd_for_splitlock(struct acrn_vcpu *vcpu,
+	const struct instr_emul_vie *vie)
+{
+	uint8_t opsize = ((vie->op.op_flags & VIE_OP_F_BYTE_OP) != 0U) ? 1U : vie->opsize;
+	uint64_t src, sum, data = 0UL, rflags2;
+	uint32_t err_code = 0U;
+	uint64_t fault_addr;
+	int32_t ret;
+
+	src = splitlock_read_reg(vcpu, vie, opsize);
+
+	ret = copy_from_gva(vcpu, &data, vie->gva, opsize, &err_code, &fault_addr);
+	if (ret == 0) {
+		rflags2 = getaddcc(opsize, data, src);
+		sum = data + src;
+		err_code = PAGE_FAULT_WR_FLAG;
+		ret = copy_to_gva(vcpu, &sum, vie->gva, opsize, &err_code, &fault_addr);
+		if (ret == 0) {
+			splitlock_write_reg(vcpu, vie, data, opsize);
+			vie_update_rflags(vcpu, rflags2, RFLAGS_STATUS_BITS);
+		}
+	}
+
+	if (ret < 0) {
+		pr_err("Error copy xadd data!");
+		if (ret == -EFAULT) {
+			vcpu_inject_pf(vcpu, fault_addr, err_code);
+		}
+	}
+
+	return ret;
+}
+
 static int32_t vie_init(struct instr_emul_vie *vie, struct acrn_vcpu *vcpu)
 {
 	uint32_t inst_len = vcpu->arch.inst_len;
@@ -1812,6 +1979,8 @@ static int32_t decode_prefixes(struct instr_emul_vie *vie, enum vm_cpu_mode cpu_
 				vie->repz_present = 1U;
 			} else if (x == 0xF2U) {
 				vie->repnz_present = 1U;
+			} else if (x == 0xF0U) {
+				vie->lock_present = 1U;
 			} else if (segment_override(x, &vie->segment_register)) {
 				vie->seg_override = 1U;
 			} else {
@@ -2336,6 +2505,42 @@ static int32_t instr_check_gva(struct acrn_vcpu *vcpu, enum vm_cpu_mode cpu_mode
 	return ret;
 }
 
+/*
+ * The decoding only depends on the instruction bytes, the CPU mode and the
+ * default operand size, so a hit on all three gives the same result without
+ * decoding. The entry is picked by RIP, the sites a driver loop hits.
+ */
+static int32_t cached_decode_instruction(struct acrn_vcpu *vcpu, enum vm_cpu_mode cpu_mode, bool cs_d)
+{
+	struct instr_emul_ctxt *emul_ctxt = &vcpu->inst_ctxt;
+	struct vie_cache_entry *entry = &emul_ctxt->cache[vcpu_get_rip(vcpu) & (VIE_CACHE_SIZE - 1U)];
+	struct instr_emul_vie *vie = &emul_ctxt->vie;
+	bool hit;
+	uint8_t i;
+	int32_t ret = 0;
+
+	hit = ((entry->vie.decoded != 0U) && (entry->cpu_mode == (uint8_t)cpu_mode) && (entry->cs_d == cs_d) &&
+		(entry->vie.num_valid == vie->num_valid));
+	for (i = 0U; hit && (i < vie->num_valid); i++) {
+		hit = (entry->vie.inst[i] == vie->inst[i]);
+	}
+
+	if (hit) {
+		(void)memcpy_s((void *)vie, sizeof(struct instr_emul_vie), (void *)&entry->vie,
+			sizeof(struct instr_emul_vie));
+	} else {
+		ret = local_decode_instruction(cpu_mode, cs_d, vie);
+		if (ret == 0) {
+			(void)memcpy_s((void *)&entry->vie, sizeof(struct instr_emul_vie), (void *)vie,
+				sizeof(struct instr_emul_vie));
+			entry->cpu_mode = (uint8_t)cpu_mode;
+			entry->cs_d = cs_d;
+		}
+	}
+
+	return ret;
+}
+
  /* @retval >=0 on success
   * @retval -EINVAL on any failure if (full_decode == true).
   * @retval -EINVAL on any failure except unknown instruction if (full_decode == false).
@@ -2361,7 +2566,7 @@ int32_t decode_instruction(struct acrn_vcpu *vcpu, bool full_decode)
 		csar = exec_vmread32(VMX_GUEST_CS_ATTR);
 		cpu_mode = get_vcpu_mode(vcpu);
 
-		retval = local_decode_instruction(cpu_mode, seg_desc_def32(csar), &emul_ctxt->vie);
+		retval = cached_decode_instruction(vcpu, cpu_mode, seg_desc_def32(csar));
 
 		if (retval != 0) {
 			if (full_decode) {
@@ -2451,6 +2656,20 @@ int32_t emulate_instruction(struct acrn_vcpu *vcpu)
 				error = -EINVAL;
 			}
 			break;
+		case VIE_OP_TYPE_CMPXCHG:
+			if (vcpu->arch.emulating_lock) {
+				error = emulate_cmpxchg_for_splitlock(vcpu, vie);
+			} else {
+				error = -EINVAL;
+			}
+			break;
+		case VIE_OP_TYPE_XADD:
+			if (vcpu->arch.emulating_lock) {
+				error = emulate_xadd_for_splitlock(vcpu, vie);
+			} else {
+				error = -EINVAL;
+			}
+			break;
 		default:
 			error = -EINVAL;
 			break;
@@ -2466,3 +2685,18 @@ bool is_current_opcode_xchg(struct acrn_vcpu *vcpu)
 {
 	return (vcpu->inst_ctxt.vie.op.op_type == VIE_OP_TYPE_XCHG);
 }
+
+/* a LOCK-prefixed instruction emulate_instruction() can do atomically with the other vCPUs paused */
+bool is_current_instr_locked_rmw(struct acrn_vcpu *vcpu)
+{
+	const struct instr_emul_vie *vie = &vcpu->inst_ctxt.vie;
+
+	return ((vie->lock_present != 0U) &&
+		((vie->op.op_type == VIE_OP_TYPE_CMPXCHG) || (vie->op.op_type == VIE_OP_TYPE_XADD)));
+}
+
+/* the length of the decoded instruction, which may be shorter than the bytes fetched */
+uint32_t current_instr_len(struct acrn_vcpu *vcpu)
+{
+	return vcpu->inst_ctxt.vie.num_processed;
+}
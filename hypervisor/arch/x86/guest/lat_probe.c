@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <types.h>
+#include <rtl.h>
+#include <util.h>
+#include <ticks.h>
+#include <asm/lib/bits.h>
+#include <asm/guest/lat_probe.h>
+
+void lat_probe_init(struct lat_probe *lp)
+{
+	(void)memset(lp, 0U, sizeof(*lp));
+	spinlock_init(&lp->lock);
+}
+
+/**
+ * @pre type < ACRN_LAT_TYPES
+ *
+ * The samples of a VM come from several pCPUs: the ones its vCPUs run on
+ * and the ones its passthrough interrupts land on.
+ */
+void lat_probe_record(struct lat_probe *lp, uint32_t type, uint64_t ticks)
+{
+	struct acrn_lat_hist *hist = &lp->hist[type];
+	uint64_t ns = (ticks * 1000000UL) / cpu_tickrate();
+	uint32_t bucket = 0U;
+
+	if (ns != 0UL) {
+		bucket = min(fls64(ns) + 1U, ACRN_LAT_BUCKETS - 1U);
+	}
+
+	spinlock_obtain(&lp->lock);
+	if (lp->enabled) {
+		hist->count++;
+		hist->sum_ns += ns;
+		hist->max_ns = max(hist->max_ns, ns);
+		hist->bucket[bucket]++;
+	}
+	spinlock_release(&lp->lock);
+}
+
+/*
+ * Run lat->cmd and return the state of the probe in lat.
+ */
+void lat_probe_ctl(struct lat_probe *lp, struct acrn_vm_latency *lat)
+{
+	spinlock_obtain(&lp->lock);
+	if (lat->cmd == ACRN_LAT_CMD_START) {
+		(void)memset(lp->hist, 0U, sizeof(lp->hist));
+		lp->enabled = true;
+	} else if (lat->cmd == ACRN_LAT_CMD_STOP) {
+		lp->enabled = false;
+	} else {
+		/* ACRN_LAT_CMD_GET */
+	}
+	lat->enabled = lp->enabled ? 1U : 0U;
+	(void)memcpy_s(lat->hist, sizeof(lat->hist), lp->hist, sizeof(lp->hist));
+	spinlock_release(&lp->lock);
+}
@@ -12,8 +12,123 @@
 #include <asm/cpu_caps.h>
 #include <logmsg.h>
 #include <errno.h>
+#include <ticks.h>
+#include <util.h>
+#include <asm/guest/instr_emul.h>
 #include <asm/guest/lock_instr_emul.h>
 
+void lock_sites_init(struct lock_sites *ls)
+{
+	spinlock_init(&ls->lock);
+	ls->total = 0UL;
+	ls->reported = 0UL;
+	ls->report_tsc = 0UL;
+	(void)memset((void *)ls->site, 0U, sizeof(ls->site));
+}
+
+/* Whether the instruction at rip was found not to be emulated in the hypervisor */
+static bool lock_site_single_step(struct lock_sites *ls, uint64_t rip)
+{
+	bool single_step = false;
+	uint32_t i;
+
+	spinlock_obtain(&ls->lock);
+	for (i = 0U; i < LOCK_SITE_NUM; i++) {
+		if ((ls->site[i].count != 0UL) && (ls->site[i].rip == rip)) {
+			single_step = ls->site[i].single_step;
+			break;
+		}
+	}
+	spinlock_release(&ls->lock);
+
+	return single_step;
+}
+
+/*
+ * Count an emulation at rip, and learn whether the hypervisor could do it
+ * without single-stepping the guest. At most once per LOCK_SITE_REPORT_MS,
+ * the emulations since the last report are logged with the RIP counted most,
+ * so that a guest hammering a split lock shows up without the shell.
+ */
+static void lock_site_record(struct acrn_vm *vm, uint64_t rip, bool in_hv)
+{
+	struct lock_sites *ls = &vm->lock_sites;
+	struct lock_site *site = NULL, *victim = &ls->site[0];
+	struct lock_site hot;
+	uint64_t now = cpu_ticks(), delta = 0UL;
+	uint32_t i;
+
+	spinlock_obtain(&ls->lock);
+	for (i = 0U; i < LOCK_SITE_NUM; i++) {
+		if ((ls->site[i].count != 0UL) && (ls->site[i].rip == rip)) {
+			site = &ls->site[i];
+			break;
+		}
+		if (ls->site[i].count < victim->count) {
+			victim = &ls->site[i];
+		}
+	}
+
+	if (site == NULL) {
+		/* the count is inherited, an over-estimate of the new RIP */
+		site = victim;
+		site->rip = rip;
+		site->in_hv = 0UL;
+	}
+	site->count++;
+	site->single_step = !in_hv;
+	if (in_hv) {
+		site->in_hv++;
+	}
+	ls->total++;
+
+	if ((now - ls->report_tsc) >= ((uint64_t)LOCK_SITE_REPORT_MS * TICKS_PER_MS)) {
+		hot = ls->site[0];
+		for (i = 1U; i < LOCK_SITE_NUM; i++) {
+			if (ls->site[i].count > hot.count) {
+				hot = ls->site[i];
+			}
+		}
+		delta = ls->total - ls->reported;
+		ls->reported = ls->total;
+		ls->report_tsc = now;
+	}
+	spinlock_release(&ls->lock);
+
+	if (delta != 0UL) {
+		pr_warn("VM%u: %lu split-lock/uc-lock emulations since the last report, most at RIP 0x%lx (%lu, %lu in HV)",
+			vm->vm_id, delta, hot.rip, hot.count, hot.in_hv);
+	}
+}
+
+/*
+ * Copy the sites, the most counted first, and the total of the emulations.
+ * reset starts the counting over, the single-step sites are learned again.
+ */
+void lock_sites_get(struct lock_sites *ls, struct lock_site *out, uint64_t *total, bool reset)
+{
+	struct lock_site tmp;
+	uint32_t i, j;
+
+	spinlock_obtain(&ls->lock);
+	(void)memcpy_s((void *)out, sizeof(ls->site), (void *)ls->site, sizeof(ls->site));
+	*total = ls->total;
+	if (reset) {
+		ls->total = 0UL;
+		ls->reported = 0UL;
+		(void)memset((void *)ls->site, 0U, sizeof(ls->site));
+	}
+	spinlock_release(&ls->lock);
+
+	for (i = 1U; i < LOCK_SITE_NUM; i++) {
+		tmp = out[i];
+		for (j = i; (j > 0U) && (out[j - 1U].count < tmp.count); j--) {
+			out[j] = out[j - 1U];
+		}
+		out[j] = tmp;
+	}
+}
+
 static bool is_guest_ac_enabled(struct acrn_vcpu *vcpu)
 {
 	bool ret = false;
@@ -68,12 +183,55 @@ void vcpu_complete_lock_instr_emulation(struct acrn_vcpu *cur_vcpu)
 	}
 }
 
+/*
+ * Emulate a LOCK CMPXCHG/XADD while the other vCPUs are paused, which costs
+ * one VM exit where single-stepping the instruction without its LOCK prefix
+ * costs two, and keeps the other vCPUs paused for a shorter time. The
+ * hypervisor doesn't take the bus lock itself, it would trip the split-lock
+ * detection the emulation is there for. Other instructions, and those at a
+ * RIP that failed to decode before, are left to single-stepping.
+ *
+ * @retval 0 the instruction is retired
+ * @retval -EFAULT a fault is injected in place of the instruction
+ * @retval -EINVAL the instruction is to be single-stepped
+ */
+static int32_t emulate_locked_rmw(struct acrn_vcpu *vcpu, uint64_t rip)
+{
+	int32_t status = -EINVAL;
+
+	if (!lock_site_single_step(&vcpu->vm->lock_sites, rip)) {
+		/* The exit doesn't give the length, fetch at most the rest of the page */
+		vcpu->arch.inst_len = (uint32_t)min((uint64_t)VIE_INST_SIZE, PAGE_SIZE - (rip & (PAGE_SIZE - 1UL)));
+		status = decode_instruction(vcpu, false);
+		if (status >= 0) {
+			if (is_current_instr_locked_rmw(vcpu)) {
+				vcpu->arch.inst_len = current_instr_len(vcpu);
+				vcpu->arch.emulating_lock = true;
+				status = emulate_instruction(vcpu);
+				vcpu->arch.emulating_lock = false;
+				if ((status < 0) && (status != -EFAULT)) {
+					status = -EINVAL;
+				}
+			} else {
+				status = -EINVAL;
+			}
+		} else if (status != -EFAULT) {
+			status = -EINVAL;
+		} else {
+			/* the fault is injected by decode_instruction() */
+		}
+	}
+
+	return status;
+}
+
 int32_t emulate_lock_instr(struct acrn_vcpu *vcpu, uint32_t exception_vector, bool *queue_exception)
 {
 	int32_t status = 0;
 	uint8_t inst[1];
 	uint32_t err_code = 0U;
 	uint64_t fault_addr;
+	uint64_t rip = vcpu_get_rip(vcpu);
 
 	/* Queue the exception by default if the exception cannot be handled. */
 	*queue_exception = true;
@@ -88,7 +246,7 @@ int32_t emulate_lock_instr(struct acrn_vcpu *vcpu, uint32_t exception_vector, bo
 		switch (exception_vector) {
 		case IDT_AC:
 		case IDT_GP:
-			status = copy_from_gva(vcpu, inst, vcpu_get_rip(vcpu), 1U, &err_code, &fault_addr);
+			status = copy_from_gva(vcpu, inst, rip, 1U, &err_code, &fault_addr);
 			if (status < 0) {
 				pr_err("Error copy instruction from Guest!");
 				if (status == -EFAULT) {
@@ -109,15 +267,33 @@ int32_t emulate_lock_instr(struct acrn_vcpu *vcpu, uint32_t exception_vector, bo
 					 */
 					vcpu_kick_lock_instr_emulation(vcpu);
 
-					/*
-					 * Skip the LOCK prefix and re-execute the instruction.
-					 */
-					vcpu->arch.inst_len = 1U;
+					status = -EINVAL;
 					if (vcpu->vm->hw.created_vcpus > 1U) {
-						/* Enable MTF to start single-stepping execution */
-						vcpu->arch.proc_vm_exec_ctrls |= VMX_PROCBASED_CTLS_MON_TRAP;
-						exec_vmwrite32(VMX_PROC_VM_EXEC_CONTROLS, vcpu->arch.proc_vm_exec_ctrls);
-						vcpu->arch.emulating_lock = true;
+						status = emulate_locked_rmw(vcpu, rip);
+					}
+
+					if (status == 0) {
+						/* Retired in the hypervisor, no single-stepping needed */
+						vcpu_complete_lock_instr_emulation(vcpu);
+						lock_site_record(vcpu->vm, rip, true);
+					} else if (status == -EFAULT) {
+						/* A fault is injected in place of the instruction */
+						vcpu_complete_lock_instr_emulation(vcpu);
+						status = 0;
+					} else {
+						lock_site_record(vcpu->vm, rip, false);
+						status = 0;
+
+						/*
+						 * Skip the LOCK prefix and re-execute the instruction.
+						 */
+						vcpu->arch.inst_len = 1U;
+						if (vcpu->vm->hw.created_vcpus > 1U) {
+							/* Enable MTF to start single-stepping execution */
+							vcpu->arch.proc_vm_exec_ctrls |= VMX_PROCBASED_CTLS_MON_TRAP;
+							exec_vmwrite32(VMX_PROC_VM_EXEC_CONTROLS, vcpu->arch.proc_vm_exec_ctrls);
+							vcpu->arch.emulating_lock = true;
+						}
 					}
 
 					/* Skip the #AC/#GP, we have emulated it. */
@@ -154,6 +330,7 @@ int32_t emulate_lock_instr(struct acrn_vcpu *vcpu, uint32_t exception_vector, bo
 							 * Notify other vcpus of the guest to restart execution.
 							 */
 							vcpu_complete_lock_instr_emulation(vcpu);
+							lock_site_record(vcpu->vm, rip, true);
 
 							/* Do not inject #AC/#GP, we have emulated it */
 							*queue_exception = false;
@@ -717,7 +717,7 @@ static void reset_vvmcs(struct acrn_vcpu *vcpu)
 	for (idx = 0U; idx < MAX_ACTIVE_VVMCS_NUM; idx++) {
 		vvmcs = &vcpu->arch.nested.vvmcs[idx];
 		vvmcs->host_state_dirty = false;
-		vvmcs->control_fields_dirty = false;
+		vvmcs->control_fields_dirty = 0U;
 		vvmcs->vmcs12_gpa = INVALID_GPA;
 		vvmcs->ref_cnt = 0;
 
@@ -808,6 +808,8 @@ int32_t vmxoff_vmexit_handler(struct acrn_vcpu *vcpu)
 		vcpu->arch.nested.in_l2_guest = false;
 
 		reset_vvmcs(vcpu);
+		/* L1 no longer runs L2 guests, give back the shadow EPTs it left cached */
+		flush_cached_vept_desc();
 		nested_vmx_result(VMsucceed, 0);
 	}
 
@@ -917,6 +919,41 @@ int32_t vmread_vmexit_handler(struct acrn_vcpu *vcpu)
 	return 0;
 }
 
+/*
+ * @brief the VMCS12_DIRTY_* group a VMWRITE to vmcs_field makes dirty, 0 if none
+ *
+ * Each group is merged to VMCS02 on its own at the next nested VM entry, so
+ * e.g. an updated VM-entry control doesn't redo the MSR bitmap translation
+ * and the shadow EPT lookup.
+ */
+static uint32_t vmcs12_dirty_group(uint32_t vmcs_field)
+{
+	uint32_t group;
+
+	switch (vmcs_field) {
+	case VMX_MSR_BITMAP_FULL:
+		group = VMCS12_DIRTY_MSR_BITMAP;
+		break;
+	case VMX_EPT_POINTER_FULL:
+		group = VMCS12_DIRTY_EPTP;
+		break;
+	case VMX_ENTRY_CONTROLS:
+		group = VMCS12_DIRTY_ENTRY_CTLS;
+		break;
+	case VMX_EXIT_CONTROLS:
+		group = VMCS12_DIRTY_EXIT_CTLS;
+		break;
+	case VMX_VPID:
+		group = VMCS12_DIRTY_VPID;
+		break;
+	default:
+		group = 0U;
+		break;
+	}
+
+	return group;
+}
+
 /*
  * @brief emulate VMWRITE instruction from L1
  * @pre vcpu != NULL
@@ -951,18 +988,12 @@ int32_t vmwrite_vmexit_handler(struct acrn_vcpu *vcpu)
 					cur_vvmcs->host_state_dirty = true;
 				}
 
-				if ((vmcs_field == VMX_MSR_BITMAP_FULL)
-					|| (vmcs_field == VMX_EPT_POINTER_FULL)
-					|| (vmcs_field == VMX_VPID)
-					|| (vmcs_field == VMX_ENTRY_CONTROLS)
-					|| (vmcs_field == VMX_EXIT_CONTROLS)) {
-					cur_vvmcs->control_fields_dirty = true;
-
-					if (vmcs_field == VMX_EPT_POINTER_FULL) {
-						if (cur_vvmcs->vmcs12.ept_pointer != vmcs_value) {
-							put_vept_desc(cur_vvmcs->vmcs12.ept_pointer);
-							get_vept_desc(vmcs_value);
-						}
+				cur_vvmcs->control_fields_dirty |= vmcs12_dirty_group(vmcs_field);
+
+				if (vmcs_field == VMX_EPT_POINTER_FULL) {
+					if (cur_vvmcs->vmcs12.ept_pointer != vmcs_value) {
+						put_vept_desc(cur_vvmcs->vmcs12.ept_pointer);
+						get_vept_desc(vmcs_value);
 					}
 				}
 
@@ -997,33 +1028,44 @@ static void sync_vmcs02_to_vmcs12(struct acrn_vmcs12 *vmcs12)
  * @pre vcpu != NULL
  * @pre VMCS02 (as an ordinary VMCS) is current
  */
-static void merge_and_sync_control_fields(struct acrn_vcpu *vcpu, struct acrn_vmcs12 *vmcs12)
+static void merge_and_sync_control_fields(struct acrn_vcpu *vcpu, struct acrn_vmcs12 *vmcs12, uint32_t dirty)
 {
 	uint64_t value64;
 
 	/* Sync VMCS fields that are not shadowing. Don't need to sync these fields back to VMCS12. */
 
-	exec_vmwrite(VMX_MSR_BITMAP_FULL, gpa2hpa(vcpu->vm, vmcs12->msr_bitmap));
-	exec_vmwrite(VMX_EPT_POINTER_FULL, get_shadow_eptp(vmcs12->ept_pointer));
+	if ((dirty & VMCS12_DIRTY_MSR_BITMAP) != 0U) {
+		exec_vmwrite(VMX_MSR_BITMAP_FULL, gpa2hpa(vcpu->vm, vmcs12->msr_bitmap));
+	}
 
-	/* For VM-execution, entry and exit controls */
-	value64 = vmcs12->vm_entry_controls;
-	if ((value64 & VMX_ENTRY_CTLS_LOAD_EFER) != VMX_ENTRY_CTLS_LOAD_EFER) {
-		/*
-		 * L1 hypervisor wishes to use its IA32_EFER for L2 guest so we turn on the
-		 * VMX_ENTRY_CTLS_LOAD_EFER on VMCS02.
-		 */
-		value64 |= VMX_ENTRY_CTLS_LOAD_EFER;
-		exec_vmwrite(VMX_GUEST_IA32_EFER_FULL, vcpu_get_efer(vcpu));
+	if ((dirty & VMCS12_DIRTY_EPTP) != 0U) {
+		exec_vmwrite(VMX_EPT_POINTER_FULL, get_shadow_eptp(vmcs12->ept_pointer));
 	}
 
-	exec_vmwrite(VMX_ENTRY_CONTROLS, value64);
+	/* For VM-execution, entry and exit controls */
+	if ((dirty & VMCS12_DIRTY_ENTRY_CTLS) != 0U) {
+		value64 = vmcs12->vm_entry_controls;
+		if ((value64 & VMX_ENTRY_CTLS_LOAD_EFER) != VMX_ENTRY_CTLS_LOAD_EFER) {
+			/*
+			 * L1 hypervisor wishes to use its IA32_EFER for L2 guest so we turn on the
+			 * VMX_ENTRY_CTLS_LOAD_EFER on VMCS02.
+			 */
+			value64 |= VMX_ENTRY_CTLS_LOAD_EFER;
+			exec_vmwrite(VMX_GUEST_IA32_EFER_FULL, vcpu_get_efer(vcpu));
+		}
+
+		exec_vmwrite(VMX_ENTRY_CONTROLS, value64);
+	}
 
-	/* Host is alway runing in 64-bit mode */
-	value64 = vmcs12->vm_exit_controls | VMX_EXIT_CTLS_HOST_ADDR64;
-	exec_vmwrite(VMX_EXIT_CONTROLS, value64);
+	if ((dirty & VMCS12_DIRTY_EXIT_CTLS) != 0U) {
+		/* Host is alway runing in 64-bit mode */
+		value64 = vmcs12->vm_exit_controls | VMX_EXIT_CTLS_HOST_ADDR64;
+		exec_vmwrite(VMX_EXIT_CONTROLS, value64);
+	}
 
-	exec_vmwrite(VMX_VPID, vmcs12->vpid);
+	if ((dirty & VMCS12_DIRTY_VPID) != 0U) {
+		exec_vmwrite(VMX_VPID, vmcs12->vpid);
+	}
 }
 
 /**
@@ -1042,7 +1084,7 @@ static void sync_vmcs12_to_vmcs02(struct acrn_vcpu *vcpu, struct acrn_vmcs12 *vm
 		exec_vmwrite(vmcs_shadowing_fields[idx], val64);
 	}
 
-	merge_and_sync_control_fields(vcpu, vmcs12);
+	merge_and_sync_control_fields(vcpu, vmcs12, VMCS12_DIRTY_ALL_CTLS);
 }
 
 /*
@@ -1143,7 +1185,7 @@ static void clear_vvmcs(struct acrn_vcpu *vcpu, struct acrn_vvmcs *vvmcs)
 
 	/* Cleanup per VVMCS dirty flags */
 	vvmcs->host_state_dirty = false;
-	vvmcs->control_fields_dirty = false;
+	vvmcs->control_fields_dirty = 0U;
 }
 
 /*
@@ -1496,9 +1538,9 @@ static void nested_vmentry(struct acrn_vcpu *vcpu, bool is_launch)
 		/* as an ordinary VMCS, VMCS02 is active and currernt when L2 guest is running */
 		load_va_vmcs(cur_vvmcs->vmcs02);
 
-		if (cur_vvmcs->control_fields_dirty) {
-			cur_vvmcs->control_fields_dirty = false;
-			merge_and_sync_control_fields(vcpu, vmcs12);
+		if (cur_vvmcs->control_fields_dirty != 0U) {
+			merge_and_sync_control_fields(vcpu, vmcs12, cur_vvmcs->control_fields_dirty);
+			cur_vvmcs->control_fields_dirty = 0U;
 		}
 
 		/* vCPU is in guest mode from this point */
@@ -0,0 +1,533 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <types.h>
+#include <errno.h>
+#include <asm/guest/vm.h>
+#include <asm/guest/vlapic.h>
+#include <asm/guest/virq.h>
+#include <asm/guest/pvclock.h>
+#include <asm/guest/guest_memory.h>
+#include <asm/guest/ept.h>
+#include <asm/vmx.h>
+#include <asm/cpu.h>
+#include <asm/cpu_caps.h>
+#include <asm/cpufeatures.h>
+#include <asm/tsc.h>
+#include <asm/lib/bits.h>
+#include <io_req.h>
+#include <schedule.h>
+#include <logmsg.h>
+
+#define NSEC_PER_SEC	1000000000UL
+
+/*
+ * The system time of a VM counts from its creation on the host TSC, the
+ * same for all its vCPUs whatever their TSC offsets. A vCPU whose guest TSC
+ * is set only gets a new tsc_timestamp, its clock goes on.
+ *
+ * The steal time of a vCPU is the wait_ticks of its thread, the time it was
+ * runnable but waited for its pCPU. It is published each time the vCPU is
+ * switched in, the guest reads it from the vCPU only.
+ *
+ * An asynchronous page fault lets the guest run another task while the
+ * device model maps a page of its lazy memory again, with one I/O request
+ * in flight per vCPU, in the slot of the vCPU.
+ */
+
+/* the scale of the steal time, set with the first MSR_KVM_STEAL_TIME */
+static uint32_t steal_mul;
+static int8_t steal_shift;
+
+/* a * mul >> 32, on the 128 bits of a * mul */
+static inline uint64_t mul_u64_u32_shr32(uint64_t a, uint32_t mul)
+{
+	uint64_t hi, lo;
+
+	asm volatile ("mulq %3" :
+		"=d" (hi), "=a" (lo) :
+		"a" (a), "r" ((uint64_t)mul));
+
+	return (hi << 32U) | (lo >> 32U);
+}
+
+/* the tsc_to_system_mul and tsc_shift of the TSC frequency, as KVM derives them */
+static void pvclock_time_scale(uint32_t *mul, int8_t *shift)
+{
+	uint64_t tps = (uint64_t)get_tsc_khz() * 1000UL;
+	uint64_t scaled = NSEC_PER_SEC;
+	uint32_t tps32;
+	int8_t s = 0;
+
+	while ((tps > (scaled * 2UL)) || ((tps & 0xFFFFFFFF00000000UL) != 0UL)) {
+		tps >>= 1U;
+		s--;
+	}
+
+	tps32 = (uint32_t)tps;
+	while ((tps32 <= scaled) || ((scaled & 0xFFFFFFFF00000000UL) != 0UL)) {
+		if (((scaled & 0xFFFFFFFF00000000UL) != 0UL) || ((tps32 & 0x80000000U) != 0U)) {
+			scaled >>= 1U;
+		} else {
+			tps32 <<= 1U;
+		}
+		s++;
+	}
+
+	*mul = (uint32_t)((scaled << 32U) / tps32);
+	*shift = s;
+}
+
+/* TSC ticks to ns, rounded the way the guest does */
+static uint64_t pvclock_scale(uint64_t ticks, uint32_t mul, int8_t shift)
+{
+	uint64_t delta = ticks;
+
+	if (shift < 0) {
+		delta >>= (uint8_t)(-shift);
+	} else {
+		delta <<= (uint8_t)shift;
+	}
+
+	return mul_u64_u32_shr32(delta, mul);
+}
+
+/**
+ * @pre vcpu == get_running_vcpu(get_pcpu_id()), its VMCS is loaded
+ *
+ * Publish a new tsc_timestamp and system_time for the vCPU, at its
+ * registration and each time its TSC offset changes.
+ */
+void pvclock_update(struct acrn_vcpu *vcpu)
+{
+	struct pvclock_vcpu_time_info *p = vcpu->arch.pvclock;
+	uint64_t host_tsc;
+	uint32_t mul;
+	int8_t shift;
+
+	if (p != NULL) {
+		pvclock_time_scale(&mul, &shift);
+		host_tsc = rdtsc();
+
+		stac();
+		p->version |= 1U;
+		cpu_write_memory_barrier();
+		p->tsc_timestamp = host_tsc + exec_vmread64(VMX_TSC_OFFSET_FULL);
+		p->system_time = pvclock_scale(host_tsc - vcpu->vm->create_tsc, mul, shift);
+		p->tsc_to_system_mul = mul;
+		p->tsc_shift = shift;
+		p->flags = pcpu_has_cap(X86_FEATURE_INVA_TSC) ? (uint8_t)PVCLOCK_TSC_STABLE_BIT : 0U;
+		cpu_write_memory_barrier();
+		p->version++;
+		clac();
+	}
+}
+
+/*
+ * The pvclock structures are written through the HVA of their GPA, they
+ * must not cross a page.
+ */
+static void *pvclock_gpa2hva(struct acrn_vcpu *vcpu, uint64_t gpa, uint64_t size)
+{
+	void *hva = NULL;
+
+	if ((gpa & PAGE_MASK) == ((gpa + size - 1UL) & PAGE_MASK)) {
+		hva = gpa2hva(vcpu->vm, gpa);
+	}
+
+	return hva;
+}
+
+static int32_t pvclock_set_wall_clock(struct acrn_vcpu *vcpu, uint64_t gpa)
+{
+	struct pvclock_wall_clock *wc = pvclock_gpa2hva(vcpu, gpa, sizeof(*wc));
+	uint64_t now_ns, boot_ns = 0UL;
+	time_t wall = vrtc_get_wall_time(vcpu->vm);
+	uint32_t mul;
+	int8_t shift;
+	int32_t ret = -EINVAL;
+
+	if (wc != NULL) {
+		pvclock_time_scale(&mul, &shift);
+		now_ns = pvclock_scale(rdtsc() - vcpu->vm->create_tsc, mul, shift);
+		if ((wall > 0) && (((uint64_t)wall * NSEC_PER_SEC) > now_ns)) {
+			boot_ns = ((uint64_t)wall * NSEC_PER_SEC) - now_ns;
+		}
+
+		stac();
+		wc->version |= 1U;
+		cpu_write_memory_barrier();
+		wc->sec = (uint32_t)(boot_ns / NSEC_PER_SEC);
+		wc->nsec = (uint32_t)(boot_ns % NSEC_PER_SEC);
+		cpu_write_memory_barrier();
+		wc->version++;
+		clac();
+		ret = 0;
+	}
+
+	return ret;
+}
+
+static int32_t pvclock_set_steal_time(struct acrn_vcpu *vcpu, uint64_t val)
+{
+	struct kvm_steal_time *st = NULL;
+	int32_t ret = 0;
+
+	if ((val & KVM_STEAL_TIME_RESERVED) != 0UL) {
+		ret = -EINVAL;
+	} else if ((val & KVM_STEAL_TIME_ENABLE) != 0UL) {
+		st = pvclock_gpa2hva(vcpu, val & ~(KVM_STEAL_TIME_ENABLE | KVM_STEAL_TIME_RESERVED), sizeof(*st));
+		if (st == NULL) {
+			pr_err("%s: vm%d vcpu%d invalid steal time GPA 0x%lx", __func__,
+					vcpu->vm->vm_id, vcpu->vcpu_id, val);
+			ret = -EINVAL;
+		} else {
+			pvclock_time_scale(&steal_mul, &steal_shift);
+		}
+	} else {
+		/* disabled */
+	}
+
+	if (ret == 0) {
+		/* it counts from now on, the guest zeroes the structure before */
+		vcpu->arch.steal_time = st;
+		vcpu->arch.steal_time_msr = val;
+		vcpu->arch.steal_ticks = vcpu->thread_obj.stats.wait_ticks;
+	}
+
+	return ret;
+}
+
+/**
+ * @pre vcpu is being switched in on its pCPU, its thread stats are up to date
+ */
+void pvclock_steal_switch_in(struct acrn_vcpu *vcpu)
+{
+	struct kvm_steal_time *st = vcpu->arch.steal_time;
+	uint64_t wait = vcpu->thread_obj.stats.wait_ticks;
+
+	if (st != NULL) {
+		stac();
+		st->version |= 1U;
+		cpu_write_memory_barrier();
+		st->steal += pvclock_scale(wait - vcpu->arch.steal_ticks, steal_mul, steal_shift);
+		st->preempted = 0U;
+		cpu_write_memory_barrier();
+		st->version++;
+		clac();
+		vcpu->arch.steal_ticks = wait;
+	}
+}
+
+/*
+ * A vCPU switched out while runnable is preempted, the guest does not spin
+ * on its locks nor picks its CPU as idle meanwhile (vcpu_is_preempted()).
+ */
+void pvclock_steal_switch_out(struct acrn_vcpu *vcpu, bool preempted)
+{
+	struct kvm_steal_time *st = vcpu->arch.steal_time;
+
+	if ((st != NULL) && preempted) {
+		stac();
+		st->preempted = (uint8_t)KVM_VCPU_PREEMPTED;
+		clac();
+	}
+}
+
+/*
+ * PV EOI is the lazy EOI of the vLAPIC, the KVM flag has the same meaning
+ * as the APIC assist of Hyper-V: a VM with both uses the one it set last.
+ * The vLAPIC offers it only when it injects the interrupts itself, without
+ * APICv advanced; with it the EOIs of edge vectors take no exit anyway.
+ */
+static int32_t pvclock_set_pv_eoi(struct acrn_vcpu *vcpu, uint64_t val)
+{
+	uint32_t *flag = NULL;
+	int32_t ret = 0;
+
+	if ((val & KVM_PV_EOI_RESERVED) != 0UL) {
+		ret = -EINVAL;
+	} else if ((val & KVM_PV_EOI_ENABLE) != 0UL) {
+		flag = pvclock_gpa2hva(vcpu, val & ~(KVM_PV_EOI_ENABLE | KVM_PV_EOI_RESERVED), sizeof(*flag));
+		if (flag == NULL) {
+			pr_err("%s: vm%d vcpu%d invalid PV EOI GPA 0x%lx", __func__,
+					vcpu->vm->vm_id, vcpu->vcpu_id, val);
+			ret = -EINVAL;
+		}
+	} else {
+		/* disabled */
+	}
+
+	if (ret == 0) {
+		vlapic_set_lazy_eoi(vcpu_vlapic(vcpu), flag);
+		vcpu->arch.pv_eoi_msr = val;
+	}
+
+	return ret;
+}
+
+static int32_t pvclock_set_async_pf(struct acrn_vcpu *vcpu, uint64_t val)
+{
+	struct kvm_vcpu_pv_apf_data *apf = NULL;
+	int32_t ret = 0;
+
+	if ((val & KVM_ASYNC_PF_RESERVED) != 0UL) {
+		ret = -EINVAL;
+	} else if ((val & KVM_ASYNC_PF_ENABLED) != 0UL) {
+		/* "page ready" is only an interrupt, as for the guests which know KVM_FEATURE_ASYNC_PF_INT */
+		if ((val & KVM_ASYNC_PF_DELIVERY_AS_INT) != 0UL) {
+			apf = pvclock_gpa2hva(vcpu, val & ~(KVM_ASYNC_PF_ENABLED | KVM_ASYNC_PF_SEND_ALWAYS |
+					KVM_ASYNC_PF_DELIVERY_AS_PF_VMEXIT | KVM_ASYNC_PF_DELIVERY_AS_INT), sizeof(*apf));
+		}
+		if (apf == NULL) {
+			pr_err("%s: vm%d vcpu%d invalid async PF MSR 0x%lx", __func__,
+					vcpu->vm->vm_id, vcpu->vcpu_id, val);
+			ret = -EINVAL;
+		}
+	} else {
+		/* disabled */
+	}
+
+	if (ret == 0) {
+		/* a page mapped meanwhile is not announced anymore, the guest starts over */
+		vcpu->arch.apf = apf;
+		vcpu->arch.apf_msr = val;
+		vcpu->arch.apf_ready = 0U;
+	}
+
+	return ret;
+}
+
+static bool is_lazy_memory(const struct acrn_vm *vm, uint64_t gpa)
+{
+	const struct acrn_lazy_memory *lazy_mem = &vm->lazy_mem;
+	uint32_t i;
+	bool ret = false;
+
+	for (i = 0U; i < ACRN_LAZY_MEMORY_RANGES; i++) {
+		if ((gpa >= lazy_mem->gpa[i]) && ((gpa - lazy_mem->gpa[i]) < lazy_mem->size[i])) {
+			ret = true;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Like KVM, the guest is told a page is not present only where it could take
+ * an interrupt: in user mode, or in kernel mode too if it asked for it, with
+ * the interrupts enabled and no event to deliver.
+ */
+static bool can_async_pf(struct acrn_vcpu *vcpu)
+{
+	struct kvm_vcpu_pv_apf_data *apf = vcpu->arch.apf;
+	uint32_t cpl, flags;
+	bool ret = false;
+
+	if ((apf != NULL) && (vcpu->arch.apf_token == 0U) && (vcpu->arch.apf_ready == 0U) &&
+			(vcpu->arch.apf_int_msr >= 32UL) && !vcpu->vm->sw.is_polling_ioreq) {
+		stac();
+		flags = apf->flags;
+		clac();
+		cpl = (exec_vmread32(VMX_GUEST_CS_ATTR) >> 5U) & 3U;
+
+		ret = (flags == 0U) && ((cpl == 3U) || ((vcpu->arch.apf_msr & KVM_ASYNC_PF_SEND_ALWAYS) != 0UL)) &&
+			is_guest_irq_enabled(vcpu) && ((vcpu->arch.idt_vectoring_info & VMX_INT_INFO_VALID) == 0U) &&
+			!bitmap_test(ACRN_REQUEST_EXCP, &vcpu->arch.pending_req) &&
+			!bitmap_test(ACRN_REQUEST_NMI, &vcpu->arch.pending_req);
+	}
+
+	return ret;
+}
+
+/**
+ * @pre vcpu == get_running_vcpu(get_pcpu_id()), its VMCS is loaded
+ *
+ * An access to a page of the lazy memory the EPT does not map: send the
+ * device model the request to map it, as for an instruction fetch, and
+ * inject the "page not present" #PF rather than waiting for it. The access
+ * is retried once the guest got the page ready.
+ *
+ * @return whether the access is taken as an asynchronous page fault
+ */
+bool pvclock_async_pf(struct acrn_vcpu *vcpu, uint64_t gpa)
+{
+	struct io_request *io_req = &vcpu->req;
+	struct acrn_mmio_request *mmio_req = &io_req->reqs.mmio_request;
+	uint32_t token;
+	bool ret = false;
+
+	if (is_postlaunched_vm(vcpu->vm) && is_lazy_memory(vcpu->vm, gpa) &&
+			(gpa2hpa(vcpu->vm, gpa) == INVALID_HPA) && can_async_pf(vcpu)) {
+		/* the token is never 0, which is none, nor ~0U, which wakes up all the tasks */
+		vcpu->arch.apf_seq = (vcpu->arch.apf_seq + 1U) & 0xfffffU;
+		if (vcpu->arch.apf_seq == 0U) {
+			vcpu->arch.apf_seq = 1U;
+		}
+		token = (vcpu->arch.apf_seq << 12U) | (uint32_t)vcpu->vcpu_id;
+
+		io_req->io_type = ACRN_IOREQ_TYPE_MMIO;
+		mmio_req->direction = ACRN_IOREQ_DIR_READ;
+		mmio_req->address = gpa;
+		mmio_req->size = 0UL;
+		mmio_req->value = 0UL;
+
+		/* set before the device model can complete it, see notify_ioreq_finish() */
+		vcpu->arch.apf_token = token;
+		if (acrn_insert_request_nowait(vcpu, io_req) == 0) {
+			stac();
+			vcpu->arch.apf->flags = KVM_PV_REASON_PAGE_NOT_PRESENT;
+			clac();
+			vcpu_inject_pf(vcpu, token, 0U);
+			ret = true;
+		} else {
+			vcpu->arch.apf_token = 0U;
+		}
+	}
+
+	return ret;
+}
+
+/* tell the guest a page is ready, once it acknowledged the previous one */
+static void pvclock_async_pf_deliver(struct acrn_vcpu *vcpu)
+{
+	struct kvm_vcpu_pv_apf_data *apf = vcpu->arch.apf;
+	bool delivered = false;
+
+	if ((apf != NULL) && (vcpu->arch.apf_ready != 0U)) {
+		stac();
+		if (apf->token == 0U) {
+			apf->token = vcpu->arch.apf_ready;
+			delivered = true;
+		}
+		clac();
+
+		if (delivered) {
+			vcpu->arch.apf_ready = 0U;
+			vlapic_set_intr(vcpu, (uint32_t)vcpu->arch.apf_int_msr, LAPIC_TRIG_EDGE);
+		}
+	}
+}
+
+/**
+ * @pre vcpu == get_running_vcpu(get_pcpu_id())
+ *
+ * On ACRN_REQUEST_ASYNC_PF, the device model completed the request of the
+ * page: free the slot and tell the guest.
+ */
+void pvclock_async_pf_ready(struct acrn_vcpu *vcpu)
+{
+	if ((vcpu->arch.apf_token != 0U) && complete_async_ioreq(vcpu)) {
+		vcpu->arch.apf_ready = vcpu->arch.apf_token;
+		vcpu->arch.apf_token = 0U;
+		pvclock_async_pf_deliver(vcpu);
+	}
+}
+
+/**
+ * @pre vcpu == get_running_vcpu(get_pcpu_id())
+ *
+ * Wait for the request of the asynchronous page fault, before the vCPU puts
+ * another one in its slot. It polls for ACRN_REQUEST_ASYNC_PF as the polling
+ * mode does for the completion: the event of the slot is only signaled for
+ * the requests the vCPU waits for.
+ */
+void pvclock_async_pf_flush(struct acrn_vcpu *vcpu)
+{
+	while (vcpu->arch.apf_token != 0U) {
+		if (bitmap_test_and_clear_lock(ACRN_REQUEST_ASYNC_PF, &vcpu->arch.pending_req)) {
+			pvclock_async_pf_ready(vcpu);
+		} else {
+			asm_pause();
+			if (need_reschedule(pcpuid_from_vcpu(vcpu))) {
+				schedule();
+			}
+		}
+	}
+}
+
+/**
+ * @pre is_pv_clock_configured(vcpu->vm)
+ */
+int32_t pvclock_wrmsr(struct acrn_vcpu *vcpu, uint32_t msr, uint64_t val)
+{
+	int32_t ret = 0;
+
+	if (msr == MSR_KVM_WALL_CLOCK_NEW) {
+		ret = pvclock_set_wall_clock(vcpu, val);
+	} else if (msr == MSR_KVM_STEAL_TIME) {
+		ret = pvclock_set_steal_time(vcpu, val);
+	} else if (msr == MSR_KVM_PV_EOI_EN) {
+		ret = pvclock_set_pv_eoi(vcpu, val);
+	} else if (msr == MSR_KVM_ASYNC_PF_EN) {
+		ret = pvclock_set_async_pf(vcpu, val);
+	} else if (msr == MSR_KVM_ASYNC_PF_INT) {
+		if ((val & ~KVM_ASYNC_PF_VECTOR_MASK) != 0UL) {
+			ret = -EINVAL;
+		} else {
+			vcpu->arch.apf_int_msr = val;
+		}
+	} else if (msr == MSR_KVM_ASYNC_PF_ACK) {
+		if ((val & KVM_ASYNC_PF_ACK) != 0UL) {
+			pvclock_async_pf_deliver(vcpu);
+		}
+	} else if ((val & KVM_SYSTEM_TIME_ENABLE) == 0UL) {
+		vcpu->arch.pvclock = NULL;
+		vcpu->arch.pvclock_msr = val;
+	} else {
+		vcpu->arch.pvclock = pvclock_gpa2hva(vcpu, val & ~KVM_SYSTEM_TIME_ENABLE,
+				sizeof(struct pvclock_vcpu_time_info));
+		if (vcpu->arch.pvclock != NULL) {
+			vcpu->arch.pvclock_msr = val;
+			pvclock_update(vcpu);
+		} else {
+			pr_err("%s: vm%d vcpu%d invalid pvclock GPA 0x%lx", __func__,
+					vcpu->vm->vm_id, vcpu->vcpu_id, val);
+			vcpu->arch.pvclock_msr = 0UL;
+			ret = -EINVAL;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @pre is_pv_clock_configured(vcpu->vm)
+ */
+int32_t pvclock_rdmsr(const struct acrn_vcpu *vcpu, uint32_t msr, uint64_t *val)
+{
+	/* the wall clock is written once per write, nothing is kept of it, nor of the ACK */
+	if (msr == MSR_KVM_SYSTEM_TIME_NEW) {
+		*val = vcpu->arch.pvclock_msr;
+	} else if (msr == MSR_KVM_STEAL_TIME) {
+		*val = vcpu->arch.steal_time_msr;
+	} else if (msr == MSR_KVM_PV_EOI_EN) {
+		*val = vcpu->arch.pv_eoi_msr;
+	} else if (msr == MSR_KVM_ASYNC_PF_EN) {
+		*val = vcpu->arch.apf_msr;
+	} else if (msr == MSR_KVM_ASYNC_PF_INT) {
+		*val = vcpu->arch.apf_int_msr;
+	} else {
+		*val = 0UL;
+	}
+
+	return 0;
+}
+
+void pvclock_reset(struct acrn_vcpu *vcpu)
+{
+	vcpu->arch.pvclock = NULL;
+	vcpu->arch.pvclock_msr = 0UL;
+	vcpu->arch.steal_time = NULL;
+	vcpu->arch.steal_time_msr = 0UL;
+	vcpu->arch.pv_eoi_msr = 0UL;
+	vcpu->arch.pv_unhalted = false;
+	vcpu->arch.apf = NULL;
+	vcpu->arch.apf_msr = 0UL;
+	vcpu->arch.apf_int_msr = 0UL;
+	vcpu->arch.apf_token = 0U;
+	vcpu->arch.apf_ready = 0U;
+}
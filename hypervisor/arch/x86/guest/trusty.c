@@ -160,56 +160,101 @@ static void save_world_ctx(struct acrn_vcpu *vcpu, struct ext_context *ext_ctx)
 	}
 }
 
-static void load_world_ctx(struct acrn_vcpu *vcpu, const struct ext_context *ext_ctx)
+/*
+ * VMWRITE a field of the next world, unless the previous world left the same
+ * value in it: both worlds mostly run in 64-bit mode with the same flat
+ * segments and control registers, so most of the fields are left alone.
+ */
+static inline void load_world_field(uint32_t field, uint64_t prev, uint64_t next)
+{
+	if (prev != next) {
+		exec_vmwrite64(field, next);
+	}
+}
+
+static inline void load_world_msr(uint32_t msr, uint64_t prev, uint64_t next)
+{
+	if (prev != next) {
+		msr_write(msr, next);
+	}
+}
+
+/*
+ * A register left pending by the previous world keeps its bit set, the next
+ * world's value is written then.
+ */
+static inline void load_world_reg(struct acrn_vcpu *vcpu, uint32_t reg, uint64_t prev, uint64_t next)
+{
+	if (prev != next) {
+		bitmap_set_nolock((uint16_t)reg, &vcpu->reg_updated);
+	}
+}
+
+#define load_world_segment(prev, next, SEG_NAME)					\
+{											\
+	load_world_field(SEG_NAME##_SEL, (prev).selector, (next).selector);		\
+	load_world_field(SEG_NAME##_BASE, (prev).base, (next).base);			\
+	load_world_field(SEG_NAME##_LIMIT, (prev).limit, (next).limit);			\
+	load_world_field(SEG_NAME##_ATTR, (prev).attr, (next).attr);			\
+}
+
+/*
+ * The context of the previous world was just saved from the VMCS and the
+ * MSRs, only what differs in the next world is loaded.
+ */
+static void load_world_ctx(struct acrn_vcpu *vcpu, const struct guest_cpu_context *prev,
+		const struct guest_cpu_context *next)
 {
+	const struct ext_context *prev_ext = &prev->ext_ctx;
+	const struct ext_context *ext_ctx = &next->ext_ctx;
 	uint32_t i;
 
 	/* mark to update on-demand run_context for efer/rflags/rsp/rip/cr0/cr4 */
-	bitmap_set_nolock(CPU_REG_EFER, &vcpu->reg_updated);
-	bitmap_set_nolock(CPU_REG_RFLAGS, &vcpu->reg_updated);
+	load_world_reg(vcpu, CPU_REG_EFER, prev->run_ctx.ia32_efer, next->run_ctx.ia32_efer);
+	load_world_reg(vcpu, CPU_REG_RFLAGS, prev->run_ctx.rflags, next->run_ctx.rflags);
 	bitmap_set_nolock(CPU_REG_RSP, &vcpu->reg_updated);
 	bitmap_set_nolock(CPU_REG_RIP, &vcpu->reg_updated);
-	bitmap_set_nolock(CPU_REG_CR0, &vcpu->reg_updated);
-	bitmap_set_nolock(CPU_REG_CR4, &vcpu->reg_updated);
+	load_world_reg(vcpu, CPU_REG_CR0, prev->run_ctx.cr0, next->run_ctx.cr0);
+	load_world_reg(vcpu, CPU_REG_CR4, prev->run_ctx.cr4, next->run_ctx.cr4);
 
 	/* VMCS Execution field */
-	exec_vmwrite64(VMX_TSC_OFFSET_FULL, ext_ctx->tsc_offset);
+	load_world_field(VMX_TSC_OFFSET_FULL, prev_ext->tsc_offset, ext_ctx->tsc_offset);
 
 	/* VMCS GUEST field */
 	exec_vmwrite(VMX_GUEST_CR3, ext_ctx->cr3);
-	exec_vmwrite(VMX_GUEST_DR7, ext_ctx->dr7);
-	exec_vmwrite64(VMX_GUEST_IA32_DEBUGCTL_FULL, ext_ctx->ia32_debugctl);
-	exec_vmwrite64(VMX_GUEST_IA32_PAT_FULL, ext_ctx->ia32_pat);
-	exec_vmwrite32(VMX_GUEST_IA32_SYSENTER_CS, ext_ctx->ia32_sysenter_cs);
-	exec_vmwrite(VMX_GUEST_IA32_SYSENTER_ESP, ext_ctx->ia32_sysenter_esp);
-	exec_vmwrite(VMX_GUEST_IA32_SYSENTER_EIP, ext_ctx->ia32_sysenter_eip);
-	load_segment(ext_ctx->cs, VMX_GUEST_CS);
-	load_segment(ext_ctx->ss, VMX_GUEST_SS);
-	load_segment(ext_ctx->ds, VMX_GUEST_DS);
-	load_segment(ext_ctx->es, VMX_GUEST_ES);
-	load_segment(ext_ctx->fs, VMX_GUEST_FS);
-	load_segment(ext_ctx->gs, VMX_GUEST_GS);
-	load_segment(ext_ctx->tr, VMX_GUEST_TR);
-	load_segment(ext_ctx->ldtr, VMX_GUEST_LDTR);
+	load_world_field(VMX_GUEST_DR7, prev_ext->dr7, ext_ctx->dr7);
+	load_world_field(VMX_GUEST_IA32_DEBUGCTL_FULL, prev_ext->ia32_debugctl, ext_ctx->ia32_debugctl);
+	load_world_field(VMX_GUEST_IA32_PAT_FULL, prev_ext->ia32_pat, ext_ctx->ia32_pat);
+	load_world_field(VMX_GUEST_IA32_SYSENTER_CS, prev_ext->ia32_sysenter_cs, ext_ctx->ia32_sysenter_cs);
+	load_world_field(VMX_GUEST_IA32_SYSENTER_ESP, prev_ext->ia32_sysenter_esp, ext_ctx->ia32_sysenter_esp);
+	load_world_field(VMX_GUEST_IA32_SYSENTER_EIP, prev_ext->ia32_sysenter_eip, ext_ctx->ia32_sysenter_eip);
+	load_world_segment(prev_ext->cs, ext_ctx->cs, VMX_GUEST_CS);
+	load_world_segment(prev_ext->ss, ext_ctx->ss, VMX_GUEST_SS);
+	load_world_segment(prev_ext->ds, ext_ctx->ds, VMX_GUEST_DS);
+	load_world_segment(prev_ext->es, ext_ctx->es, VMX_GUEST_ES);
+	load_world_segment(prev_ext->fs, ext_ctx->fs, VMX_GUEST_FS);
+	load_world_segment(prev_ext->gs, ext_ctx->gs, VMX_GUEST_GS);
+	load_world_segment(prev_ext->tr, ext_ctx->tr, VMX_GUEST_TR);
+	load_world_segment(prev_ext->ldtr, ext_ctx->ldtr, VMX_GUEST_LDTR);
 	/* Only base and limit for IDTR and GDTR */
-	exec_vmwrite(VMX_GUEST_IDTR_BASE, ext_ctx->idtr.base);
-	exec_vmwrite(VMX_GUEST_GDTR_BASE, ext_ctx->gdtr.base);
-	exec_vmwrite32(VMX_GUEST_IDTR_LIMIT, ext_ctx->idtr.limit);
-	exec_vmwrite32(VMX_GUEST_GDTR_LIMIT, ext_ctx->gdtr.limit);
+	load_world_field(VMX_GUEST_IDTR_BASE, prev_ext->idtr.base, ext_ctx->idtr.base);
+	load_world_field(VMX_GUEST_GDTR_BASE, prev_ext->gdtr.base, ext_ctx->gdtr.base);
+	load_world_field(VMX_GUEST_IDTR_LIMIT, prev_ext->idtr.limit, ext_ctx->idtr.limit);
+	load_world_field(VMX_GUEST_GDTR_LIMIT, prev_ext->gdtr.limit, ext_ctx->gdtr.limit);
 
 	/* MSRs which not in the VMCS */
-	msr_write(MSR_IA32_STAR, ext_ctx->ia32_star);
-	msr_write(MSR_IA32_LSTAR, ext_ctx->ia32_lstar);
-	msr_write(MSR_IA32_FMASK, ext_ctx->ia32_fmask);
-	msr_write(MSR_IA32_KERNEL_GS_BASE, ext_ctx->ia32_kernel_gs_base);
-	msr_write(MSR_IA32_TSC_AUX, ext_ctx->tsc_aux);
+	load_world_msr(MSR_IA32_STAR, prev_ext->ia32_star, ext_ctx->ia32_star);
+	load_world_msr(MSR_IA32_LSTAR, prev_ext->ia32_lstar, ext_ctx->ia32_lstar);
+	load_world_msr(MSR_IA32_FMASK, prev_ext->ia32_fmask, ext_ctx->ia32_fmask);
+	load_world_msr(MSR_IA32_KERNEL_GS_BASE, prev_ext->ia32_kernel_gs_base, ext_ctx->ia32_kernel_gs_base);
+	load_world_msr(MSR_IA32_TSC_AUX, prev_ext->tsc_aux, ext_ctx->tsc_aux);
 
 	/* XSAVE area */
 	rstore_xsave_area(vcpu, ext_ctx);
 
 	/* For MSRs need isolation between worlds */
 	for (i = 0U; i < NUM_WORLD_MSRS; i++) {
-		vcpu->arch.guest_msrs[i] = vcpu->arch.contexts[!vcpu->arch.cur_context].world_msrs[i];
+		vcpu->arch.guest_msrs[i] = next->world_msrs[i];
 	}
 }
 
@@ -230,7 +275,7 @@ void switch_world(struct acrn_vcpu *vcpu, int32_t next_world)
 	save_world_ctx(vcpu, &arch->contexts[!next_world].ext_ctx);
 
 	/* load next world context */
-	load_world_ctx(vcpu, &arch->contexts[next_world].ext_ctx);
+	load_world_ctx(vcpu, &arch->contexts[!next_world], &arch->contexts[next_world]);
 
 	/* Copy SMC parameters: RDI, RSI, RDX, RBX */
 	copy_smc_param(&arch->contexts[!next_world].run_ctx,
@@ -9,6 +9,7 @@
 #include <asm/guest/vcpu.h>
 #include <asm/guest/virq.h>
 #include <asm/lib/bits.h>
+#include <asm/lib/atomic.h>
 #include <asm/vmx.h>
 #include <logmsg.h>
 #include <asm/cpufeatures.h>
@@ -16,12 +17,15 @@
 #include <asm/per_cpu.h>
 #include <asm/init.h>
 #include <asm/guest/vm.h>
+#include <asm/host_pm.h>
 #include <asm/guest/vmcs.h>
 #include <asm/mmu.h>
 #include <lib/sprintf.h>
 #include <asm/lapic.h>
 #include <asm/irq.h>
 #include <console.h>
+#include <ticks.h>
+#include <asm/rdt.h>
 
 /* stack_frame is linked with the sequence of stack operation in arch_switch_to() */
 struct stack_frame {
@@ -132,6 +136,46 @@ void vcpu_set_rflags(struct acrn_vcpu *vcpu, uint64_t val)
 	bitmap_set_nolock(CPU_REG_RFLAGS, &vcpu->reg_updated);
 }
 
+uint64_t vcpu_get_exit_qualification(struct acrn_vcpu *vcpu)
+{
+	if (!bitmap32_test_and_set_nolock(EXIT_INFO_QUALIFICATION, &vcpu->arch.exit_info_cached)) {
+		vcpu->arch.exit_qualification = exec_vmread(VMX_EXIT_QUALIFICATION);
+	}
+	return vcpu->arch.exit_qualification;
+}
+
+uint64_t vcpu_get_exit_guest_phys_addr(struct acrn_vcpu *vcpu)
+{
+	if (!bitmap32_test_and_set_nolock(EXIT_INFO_GUEST_PHYS_ADDR, &vcpu->arch.exit_info_cached)) {
+		vcpu->arch.exit_guest_phys_addr = exec_vmread64(VMX_GUEST_PHYSICAL_ADDR_FULL);
+	}
+	return vcpu->arch.exit_guest_phys_addr;
+}
+
+uint64_t vcpu_get_exit_guest_linear_addr(struct acrn_vcpu *vcpu)
+{
+	if (!bitmap32_test_and_set_nolock(EXIT_INFO_GUEST_LINEAR_ADDR, &vcpu->arch.exit_info_cached)) {
+		vcpu->arch.exit_guest_linear_addr = exec_vmread(VMX_GUEST_LINEAR_ADDR);
+	}
+	return vcpu->arch.exit_guest_linear_addr;
+}
+
+uint32_t vcpu_get_exit_intr_info(struct acrn_vcpu *vcpu)
+{
+	if (!bitmap32_test_and_set_nolock(EXIT_INFO_INTR_INFO, &vcpu->arch.exit_info_cached)) {
+		vcpu->arch.exit_intr_info = exec_vmread32(VMX_EXIT_INT_INFO);
+	}
+	return vcpu->arch.exit_intr_info;
+}
+
+uint32_t vcpu_get_exit_intr_err_code(struct acrn_vcpu *vcpu)
+{
+	if (!bitmap32_test_and_set_nolock(EXIT_INFO_INTR_ERR_CODE, &vcpu->arch.exit_info_cached)) {
+		vcpu->arch.exit_intr_err_code = exec_vmread32(VMX_EXIT_INT_ERROR_CODE);
+	}
+	return vcpu->arch.exit_intr_err_code;
+}
+
 uint64_t vcpu_get_guest_msr(const struct acrn_vcpu *vcpu, uint32_t msr)
 {
 	uint32_t index = vmsr_get_guest_msr_index(msr);
@@ -243,12 +287,14 @@ static void vcpu_reset_internal(struct acrn_vcpu *vcpu, enum reset_mode mode)
 
 	vcpu->launched = false;
 	vcpu->arch.nr_sipi = 0U;
+	vcpu->arch.restore.pending = false;
 
 	vcpu->arch.exception_info.exception = VECTOR_INVALID;
 	vcpu->arch.cur_context = NORMAL_WORLD;
 	vcpu->arch.lapic_pt_enabled = false;
 	vcpu->arch.irq_window_enabled = false;
 	vcpu->arch.emulating_lock = false;
+	vcpu->arch.pw_cache_eptp = NULL;
 	(void)memset((void *)vcpu->arch.vmcs, 0U, PAGE_SIZE);
 
 	for (i = 0; i < NR_WORLD; i++) {
@@ -258,6 +304,12 @@ static void vcpu_reset_internal(struct acrn_vcpu *vcpu, enum reset_mode mode)
 
 	vlapic = vcpu_vlapic(vcpu);
 	vlapic_reset(vlapic, apicv_ops, mode);
+	pvclock_reset(vcpu);
+	vcpu->arch.hcall_args_gpa = 0UL;
+	vcpu->arch.hcall_args = NULL;
+#ifdef CONFIG_HYPERV_ENABLED
+	hyperv_reset_vcpu(vcpu);
+#endif
 
 	reset_vcpu_regs(vcpu, mode);
 
@@ -405,6 +457,404 @@ void set_vcpu_regs(struct acrn_vcpu *vcpu, struct acrn_regs *vcpu_regs)
 			vcpu_regs->cr0);
 }
 
+/* the emulated MSRs a vCPU state carries besides the ones it has fields for */
+static const uint32_t vcpu_state_msrs[] = {
+	MSR_IA32_TSC_ADJUST,
+	MSR_IA32_MCG_STATUS,
+	MSR_IA32_XSS,
+	MSR_IA32_UMWAIT_CONTROL,
+	MSR_IA32_PM_ENABLE,
+	MSR_IA32_HWP_REQUEST,
+};
+
+static void save_state_segment(struct acrn_segment *dst, const struct segment_sel *src)
+{
+	dst->base = src->base;
+	dst->limit = src->limit;
+	dst->attr = src->attr;
+	dst->selector = src->selector;
+}
+
+static void load_state_segment(struct segment_sel *dst, const struct acrn_segment *src)
+{
+	dst->base = src->base;
+	dst->limit = src->limit;
+	dst->attr = src->attr;
+	dst->selector = src->selector;
+}
+
+/*
+ * Runs on the pCPU the VMCS of the paused vCPU was last loaded on: the fields
+ * the hypervisor does not cache are only in the VMCS.
+ */
+struct vcpu_state_call {
+	struct acrn_vcpu *vcpu;
+	struct acrn_vcpu_state *state;
+};
+
+static void save_vcpu_state(void *data)
+{
+	struct vcpu_state_call *call = (struct vcpu_state_call *)data;
+	struct acrn_vcpu *vcpu = call->vcpu;
+	struct acrn_vcpu_state *state = call->state;
+	struct ext_context *ectx = &(vcpu->arch.contexts[vcpu->arch.cur_context].ext_ctx);
+	struct segment_sel seg;
+	void **vmcs_ptr = &get_cpu_var(vmcs_run);
+	void *prev = *vmcs_ptr;
+	uint32_t i, intr_info;
+
+	if (prev != (void *)vcpu->arch.vmcs) {
+		load_va_vmcs(vcpu->arch.vmcs);
+	}
+
+	(void)memcpy_s(&state->gprs, sizeof(state->gprs), &vcpu->arch.contexts[vcpu->arch.cur_context].run_ctx.cpu_regs,
+			sizeof(struct acrn_gp_regs));
+	state->rip = vcpu_get_rip(vcpu);
+	state->rflags = vcpu_get_rflags(vcpu);
+	state->gprs.rsp = exec_vmread(VMX_GUEST_RSP);
+	state->cr0 = vcpu_get_cr0(vcpu);
+	state->cr2 = vcpu_get_cr2(vcpu);
+	state->cr3 = exec_vmread(VMX_GUEST_CR3);
+	state->cr4 = vcpu_get_cr4(vcpu);
+	state->dr7 = exec_vmread(VMX_GUEST_DR7);
+	state->ia32_efer = vcpu_get_efer(vcpu);
+	state->ia32_pat = exec_vmread64(VMX_GUEST_IA32_PAT_FULL);
+	state->ia32_sysenter_cs = exec_vmread32(VMX_GUEST_IA32_SYSENTER_CS);
+	state->ia32_sysenter_esp = exec_vmread(VMX_GUEST_IA32_SYSENTER_ESP);
+	state->ia32_sysenter_eip = exec_vmread(VMX_GUEST_IA32_SYSENTER_EIP);
+	state->tsc = vcpu->vm->pause_tsc + exec_vmread64(VMX_TSC_OFFSET_FULL);
+	state->interruptibility = exec_vmread32(VMX_GUEST_INTERRUPTIBILITY_INFO);
+
+	save_segment(seg, VMX_GUEST_CS);
+	save_state_segment(&state->cs, &seg);
+	save_segment(seg, VMX_GUEST_SS);
+	save_state_segment(&state->ss, &seg);
+	save_segment(seg, VMX_GUEST_DS);
+	save_state_segment(&state->ds, &seg);
+	save_segment(seg, VMX_GUEST_ES);
+	save_state_segment(&state->es, &seg);
+	save_segment(seg, VMX_GUEST_FS);
+	save_state_segment(&state->fs, &seg);
+	save_segment(seg, VMX_GUEST_GS);
+	save_state_segment(&state->gs, &seg);
+	save_segment(seg, VMX_GUEST_LDTR);
+	save_state_segment(&state->ldtr, &seg);
+	save_segment(seg, VMX_GUEST_TR);
+	save_state_segment(&state->tr, &seg);
+	state->gdt.base = exec_vmread(VMX_GUEST_GDTR_BASE);
+	state->gdt.limit = (uint16_t)exec_vmread32(VMX_GUEST_GDTR_LIMIT);
+	state->idt.base = exec_vmread(VMX_GUEST_IDTR_BASE);
+	state->idt.limit = (uint16_t)exec_vmread32(VMX_GUEST_IDTR_LIMIT);
+
+	vlapic_get_state(vcpu_vlapic(vcpu), state->lapic, &state->tsc_deadline);
+	/* an external interrupt about to be injected goes back to the IRR */
+	intr_info = exec_vmread32(VMX_ENTRY_INT_INFO_FIELD);
+	if (((intr_info & VMX_INT_INFO_VALID) != 0U) && ((intr_info & VMX_INT_TYPE_MASK) == VMX_INT_TYPE_EXT_INT)) {
+		i = (uint32_t)offsetof(struct lapic_regs, irr) + (((intr_info & 0xffU) >> 5U) * 16U);
+		state->lapic[i + ((intr_info & 0x1fU) >> 3U)] |= (uint8_t)(1U << (intr_info & 0x7U));
+	}
+
+	if (prev != (void *)vcpu->arch.vmcs) {
+		if (prev != NULL) {
+			load_va_vmcs(prev);
+		} else {
+			*vmcs_ptr = (void *)vcpu->arch.vmcs;
+		}
+	}
+
+	state->ia32_star = ectx->ia32_star;
+	state->ia32_cstar = ectx->ia32_cstar;
+	state->ia32_lstar = ectx->ia32_lstar;
+	state->ia32_fmask = ectx->ia32_fmask;
+	state->ia32_kernel_gs_base = ectx->ia32_kernel_gs_base;
+	state->tsc_aux = ectx->tsc_aux;
+	state->xcr0 = ectx->xcr0;
+	(void)memcpy_s(state->xsave, ACRN_VCPU_STATE_XSAVE_SIZE, &ectx->xs_area, XSAVE_STATE_AREA_SIZE);
+	state->apic_base = vlapic_get_apicbase(vcpu_vlapic(vcpu));
+
+	for (i = 0U; i < ARRAY_SIZE(vcpu_state_msrs); i++) {
+		state->msrs[i].msr = vcpu_state_msrs[i];
+		state->msrs[i].value = vcpu_get_guest_msr(vcpu, vcpu_state_msrs[i]);
+	}
+	state->nr_msrs = ARRAY_SIZE(vcpu_state_msrs);
+}
+
+/**
+ * @brief Take the state of a vCPU of a paused VM
+ *
+ * @pre vcpu->vm->state == VM_PAUSED
+ */
+void get_vcpu_state(struct acrn_vcpu *vcpu, struct acrn_vcpu_state *state)
+{
+	struct vcpu_state_call call = { .vcpu = vcpu, .state = state };
+
+	(void)memset(state, 0U, sizeof(*state));
+	state->vcpu_id = vcpu->vcpu_id;
+	if (vcpu->launched) {
+		state->launched = 1U;
+		smp_call_function(1UL << pcpuid_from_vcpu(vcpu), save_vcpu_state, &call);
+	}
+}
+
+/*
+ * The XSETBV rules, plus only the state components the platform has.
+ * init_vmcs() sets vcpu->arch.xsave_enabled only at the first VM entry, it
+ * follows pcpu_has_cap(X86_FEATURE_XSAVES) though (see rstore_xsave_area()).
+ */
+static bool is_state_xcr0_valid(uint64_t xcr0)
+{
+	struct cpuinfo_x86 *cpu_info = get_pcpu_info();
+	uint64_t supported = ((uint64_t)cpu_info->cpuid_leaves[FEAT_D_0_EDX] << 32U) |
+			cpu_info->cpuid_leaves[FEAT_D_0_EAX];
+	bool ret;
+
+	if (!pcpu_has_cap(X86_FEATURE_XSAVES)) {
+		/* XSETBV is #UD for the guest, so XCR0 stays at its reset value */
+		ret = (xcr0 == XSAVE_FPU);
+	} else {
+		ret = ((xcr0 & 0x01UL) != 0UL) && ((xcr0 & XCR0_RESERVED_BITS) == 0UL) &&
+			((xcr0 & (XCR0_SSE | XCR0_AVX)) != XCR0_AVX) &&
+			((xcr0 & (XCR0_BNDREGS | XCR0_BNDCSR)) == 0UL) &&
+			((xcr0 & ~supported) == 0UL);
+	}
+
+	return ret;
+}
+
+/* the checks of the WRMSR emulation; the MSRs the hypervisor owns must be unchanged */
+static bool is_state_msr_valid(const struct acrn_vcpu *vcpu, uint32_t msr, uint64_t value)
+{
+	bool ret;
+
+	switch (msr) {
+	case MSR_IA32_TSC_ADJUST:
+		ret = true;
+		break;
+	case MSR_IA32_MCG_STATUS:
+		ret = (value == 0UL);
+		break;
+	case MSR_IA32_XSS:
+		ret = (value == 0UL) || (pcpu_has_cap(X86_FEATURE_XSAVES) &&
+			((value & ~(MSR_IA32_XSS_PT | MSR_IA32_XSS_HDC)) == 0UL));
+		break;
+	case MSR_IA32_UMWAIT_CONTROL:
+		/* bit 1 and bits 63:32 are reserved */
+		ret = (value == vcpu_get_guest_msr(vcpu, msr)) ||
+			(pcpu_has_cap(X86_FEATURE_WAITPKG) && ((value & ~0xfffffffdUL) == 0UL));
+		break;
+	case MSR_IA32_HWP_REQUEST:
+		ret = (value == vcpu_get_guest_msr(vcpu, msr)) || (is_vhwp_configured(vcpu->vm) &&
+			((value & (MSR_IA32_HWP_REQUEST_RSV_BITS | MSR_IA32_HWP_REQUEST_PKG_CTL)) == 0UL));
+		break;
+	case MSR_IA32_PM_ENABLE:
+		/* set by the hypervisor */
+		ret = (value == vcpu_get_guest_msr(vcpu, msr));
+		break;
+	default:
+		ret = false;
+		break;
+	}
+
+	return ret;
+}
+
+static bool is_state_msrs_valid(const struct acrn_vcpu *vcpu, const struct acrn_vcpu_state *state,
+		uint64_t *xss)
+{
+	uint32_t i;
+	bool ret = true;
+
+	*xss = vcpu_get_guest_msr(vcpu, MSR_IA32_XSS);
+	for (i = 0U; i < state->nr_msrs; i++) {
+		if (!is_state_msr_valid(vcpu, state->msrs[i].msr, state->msrs[i].value)) {
+			pr_err("%s: invalid MSR 0x%x: 0x%lx", __func__, state->msrs[i].msr, state->msrs[i].value);
+			ret = false;
+			break;
+		}
+		if (state->msrs[i].msr == MSR_IA32_XSS) {
+			*xss = state->msrs[i].value;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * rstore_xsave_area() runs XRSTORS on the area with XCR0 | XSAVE_SSE and the
+ * guest XSS loaded: a header it would fault on must not get that far.
+ */
+static bool is_state_xsave_valid(const struct acrn_vcpu_state *state, uint64_t xss)
+{
+	union xsave_header xsave_hdr;
+	uint64_t allowed = state->xcr0 | XSAVE_SSE | xss;
+	uint32_t i;
+	bool ret;
+
+	(void)memcpy_s(&xsave_hdr, sizeof(xsave_hdr), &state->xsave[XSAVE_LEGACY_AREA_SIZE], sizeof(xsave_hdr));
+	ret = ((xsave_hdr.hdr.xcomp_bv & XSAVE_COMPACTED_FORMAT) != 0UL) &&
+		((xsave_hdr.hdr.xcomp_bv & ~(XSAVE_COMPACTED_FORMAT | allowed)) == 0UL) &&
+		((xsave_hdr.hdr.xstate_bv & ~xsave_hdr.hdr.xcomp_bv) == 0UL);
+	/* bytes 63:16 of the header are reserved */
+	for (i = 2U; i < (XSAVE_HEADER_AREA_SIZE / sizeof(uint64_t)); i++) {
+		if (xsave_hdr.value[i] != 0UL) {
+			ret = false;
+		}
+	}
+
+	return ret;
+}
+
+/* the VM-entry checks on the guest control registers and EFER, SDM 27.3.1.1 */
+static bool is_state_ctrl_regs_valid(const struct acrn_vcpu_state *state)
+{
+	uint64_t efer = state->ia32_efer;
+	bool long_mode = ((efer & MSR_IA32_EFER_LME_BIT) != 0UL) && ((state->cr0 & CR0_PG) != 0UL);
+
+	return is_valid_cr0_cr4(state->cr0, state->cr4) && ((state->cr0 >> 32U) == 0UL) &&
+		(((state->cr0 & CR0_PG) == 0UL) || ((state->cr0 & CR0_PE) != 0UL)) &&
+		((state->cr3 >> get_pcpu_info()->phys_bits) == 0UL) &&
+		((efer & ~(MSR_IA32_EFER_SCE_BIT | MSR_IA32_EFER_LME_BIT |
+			MSR_IA32_EFER_LMA_BIT | MSR_IA32_EFER_NXE_BIT)) == 0UL) &&
+		(((efer & MSR_IA32_EFER_LMA_BIT) != 0UL) == long_mode) &&
+		(!long_mode || ((state->cr4 & CR4_PAE) != 0UL));
+}
+
+/* the VM-entry checks on CS and TR, SDM 27.3.1.2: both usable and present, TR a busy TSS */
+static bool is_state_segments_valid(const struct acrn_vcpu_state *state)
+{
+	uint32_t tr_type = state->tr.attr & 0xfU;
+
+	return ((state->cs.attr & 0x10080U) == 0x80U) &&
+		((state->tr.attr & 0x10090U) == 0x80U) && ((tr_type == 0x3U) || (tr_type == 0xbU));
+}
+
+static bool is_state_pat_valid(uint64_t pat)
+{
+	uint32_t i;
+	bool ret = true;
+
+	for (i = 0U; i < 8U; i++) {
+		if (is_pat_mem_type_invalid((pat >> (i * 8U)) & 0xffUL)) {
+			ret = false;
+		}
+	}
+
+	return ret;
+}
+
+/* the state comes from the Service VM: nothing the VM entry or XRSTORS would fault on */
+static bool is_vcpu_state_valid(const struct acrn_vcpu *vcpu, const struct acrn_vcpu_state *state)
+{
+	uint64_t xss;
+
+	return is_state_msrs_valid(vcpu, state, &xss) && is_state_xcr0_valid(state->xcr0) &&
+		is_state_xsave_valid(state, xss) && is_state_ctrl_regs_valid(state) &&
+		is_state_segments_valid(state) && is_state_pat_valid(state->ia32_pat);
+}
+
+/**
+ * @brief Load the state of a vCPU of a VM not started yet
+ *
+ * The registers the VMCS initialization takes from the vCPU context are set
+ * here, the others by finish_vcpu_restore() once the VMCS is initialized:
+ * start_vm() then launches the vCPU along with the BSP.
+ *
+ * @pre vcpu->vm->state == VM_CREATED
+ * @pre !vcpu->launched
+ */
+int32_t set_vcpu_state(struct acrn_vcpu *vcpu, const struct acrn_vcpu_state *state)
+{
+	struct ext_context *ectx = &(vcpu->arch.contexts[vcpu->arch.cur_context].ext_ctx);
+	struct run_context *ctx = &(vcpu->arch.contexts[vcpu->arch.cur_context].run_ctx);
+	struct acrn_vcpu_restore *restore = &vcpu->arch.restore;
+	uint32_t i;
+	int32_t ret = 0;
+
+	if ((state->launched == 0U) || (state->nr_msrs > ACRN_VCPU_STATE_MSRS) ||
+			!is_vcpu_state_valid(vcpu, state)) {
+		ret = -EINVAL;
+	} else {
+		load_state_segment(&ectx->cs, &state->cs);
+		load_state_segment(&ectx->ss, &state->ss);
+		load_state_segment(&ectx->ds, &state->ds);
+		load_state_segment(&ectx->es, &state->es);
+		load_state_segment(&ectx->fs, &state->fs);
+		load_state_segment(&ectx->gs, &state->gs);
+		load_state_segment(&ectx->ldtr, &state->ldtr);
+		load_state_segment(&ectx->tr, &state->tr);
+		ectx->gdtr.base = state->gdt.base;
+		ectx->gdtr.limit = state->gdt.limit;
+		ectx->idtr.base = state->idt.base;
+		ectx->idtr.limit = state->idt.limit;
+
+		(void)memcpy_s(&(ctx->cpu_regs), sizeof(struct acrn_gp_regs), &state->gprs, sizeof(struct acrn_gp_regs));
+		vcpu_set_rip(vcpu, state->rip);
+		vcpu_set_efer(vcpu, state->ia32_efer);
+		vcpu_set_rsp(vcpu, state->gprs.rsp);
+		vcpu_set_rflags(vcpu, state->rflags);
+		vcpu_set_cr2(vcpu, state->cr2);
+
+		/* written to the VMCS by init_vmcs */
+		ctx->cr0 = state->cr0;
+		ectx->cr3 = state->cr3;
+		ctx->cr4 = state->cr4;
+		set_vcpu_mode(vcpu, state->cs.attr, state->ia32_efer, state->cr0);
+
+		ectx->ia32_star = state->ia32_star;
+		ectx->ia32_cstar = state->ia32_cstar;
+		ectx->ia32_lstar = state->ia32_lstar;
+		ectx->ia32_fmask = state->ia32_fmask;
+		ectx->ia32_kernel_gs_base = state->ia32_kernel_gs_base;
+		ectx->tsc_aux = state->tsc_aux;
+		ectx->xcr0 = state->xcr0;
+		(void)memcpy_s(&ectx->xs_area, XSAVE_STATE_AREA_SIZE, state->xsave, ACRN_VCPU_STATE_XSAVE_SIZE);
+		ectx->ia32_pat = state->ia32_pat;
+		ectx->ia32_sysenter_cs = (uint32_t)state->ia32_sysenter_cs;
+		ectx->ia32_sysenter_esp = state->ia32_sysenter_esp;
+		ectx->ia32_sysenter_eip = state->ia32_sysenter_eip;
+		ectx->dr7 = state->dr7;
+
+		for (i = 0U; i < state->nr_msrs; i++) {
+			vcpu_set_guest_msr(vcpu, state->msrs[i].msr, state->msrs[i].value);
+		}
+
+		vlapic_set_state(vcpu_vlapic(vcpu), state->lapic);
+
+		restore->tsc = state->tsc;
+		restore->apic_base = state->apic_base;
+		restore->tsc_deadline = state->tsc_deadline;
+		restore->interruptibility = state->interruptibility;
+		restore->pending = true;
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Complete the restore of a vCPU on its first VM entry
+ *
+ * Called on the pCPU of the vCPU right after init_vmcs(): the guest TSC goes
+ * on from the snapshot as of the start of the VM, the same for all its vCPUs.
+ */
+void finish_vcpu_restore(struct acrn_vcpu *vcpu)
+{
+	struct ext_context *ectx = &(vcpu->arch.contexts[vcpu->arch.cur_context].ext_ctx);
+	struct acrn_vcpu_restore *restore = &vcpu->arch.restore;
+
+	exec_vmwrite(VMX_GUEST_DR7, ectx->dr7);
+	exec_vmwrite64(VMX_GUEST_IA32_PAT_FULL, ectx->ia32_pat);
+	vcpu_set_guest_msr(vcpu, MSR_IA32_PAT, ectx->ia32_pat);
+	exec_vmwrite32(VMX_GUEST_IA32_SYSENTER_CS, ectx->ia32_sysenter_cs);
+	exec_vmwrite(VMX_GUEST_IA32_SYSENTER_ESP, ectx->ia32_sysenter_esp);
+	exec_vmwrite(VMX_GUEST_IA32_SYSENTER_EIP, ectx->ia32_sysenter_eip);
+	exec_vmwrite32(VMX_GUEST_INTERRUPTIBILITY_INFO, restore->interruptibility);
+
+	(void)vlapic_set_apicbase(vcpu_vlapic(vcpu), restore->apic_base);
+	set_guest_tsc(vcpu, restore->tsc + (cpu_ticks() - vcpu->vm->start_tsc));
+	vlapic_restore_timer(vcpu_vlapic(vcpu), restore->tsc_deadline);
+	restore->pending = false;
+}
+
 static struct acrn_regs realmode_init_vregs = {
 	.gdt = {
 		.limit = 0xFFFFU,
@@ -550,6 +1000,8 @@ int32_t create_vcpu(uint16_t pcpu_id, struct acrn_vm *vm, struct acrn_vcpu **rtn
 
 		/* Initialize the parent VM reference */
 		vcpu->vm = vm;
+		vcpu->io_cache.mmio_idx = IO_HANDLER_CACHE_INVALID;
+		vcpu->io_cache.pio_idx = IO_HANDLER_CACHE_INVALID;
 
 		/* Initialize the virtual ID for this VCPU */
 		/* FIXME:
@@ -598,11 +1050,19 @@ int32_t create_vcpu(uint16_t pcpu_id, struct acrn_vm *vm, struct acrn_vcpu **rtn
 		 */
 		vcpu->arch.pid.control.bits.nv = POSTED_INTR_VECTOR + vm->vm_id;
 
-		/* ACRN does not support vCPU migration, one vCPU always runs on
-		 * the same pCPU, so PI's ndst is never changed after startup.
+		/* The vCPU stays on this pCPU unless the scheduler migrates it,
+		 * see context_migrate() which moves ndst along.
 		 */
 		vcpu->arch.pid.control.bits.ndst = per_cpu(lapic_id, pcpu_id);
 
+		/*
+		 * The vLAPIC takes the APIC ID of this pCPU, see vlapic_create(),
+		 * and keeps it when migrated.
+		 */
+		if (per_cpu(lapic_id, pcpu_id) < IPIV_PID_TABLE_ENTRIES) {
+			vm->arch_vm.pid_table[per_cpu(lapic_id, pcpu_id)] = hva2hpa(get_pi_desc(vcpu)) | PID_POINTER_VALID;
+		}
+
 		/* Create per vcpu vlapic */
 		vlapic_create(vcpu, pcpu_id);
 
@@ -677,6 +1137,32 @@ static void write_cached_registers(struct acrn_vcpu *vcpu)
 	}
 }
 
+/*
+ * The CLOS of the guest only has to be in MSR_IA32_PQR_ASSOC while the vCPU
+ * thread has the pCPU, so it is loaded at the first VMEntry after the thread is
+ * switched in. A vCPU running with the CLOS of the hypervisor loads that one:
+ * the vCPU switched out before it on a shared pCPU may have left another.
+ * The idle thread restores the CLOS of the hypervisor when it is switched in.
+ *
+ * The MSR is only written when the value changes, vCPUs of the same CLOS
+ * following each other on a pCPU don't access it. The hypervisor work done on
+ * behalf of the vCPU runs with the CLOS of the guest, it is spared the two MSR
+ * accesses the MSR load lists took on each VMExit and VMEntry.
+ */
+static void load_guest_pqr_assoc(struct acrn_vcpu *vcpu)
+{
+	struct msr_store_area *msr_area = &vcpu->arch.msr_area;
+
+	if (!msr_area->pqr_assoc_loaded) {
+		if (msr_area->switch_pqr_assoc) {
+			write_pqr_assoc(msr_area->guest_pqr_assoc);
+		} else {
+			restore_hv_pqr_assoc();
+		}
+		msr_area->pqr_assoc_loaded = true;
+	}
+}
+
 /*
  * @pre vcpu != NULL
  */
@@ -693,6 +1179,8 @@ int32_t run_vcpu(struct acrn_vcpu *vcpu)
 		write_cached_registers(vcpu);
 	}
 
+	load_guest_pqr_assoc(vcpu);
+
 	if (is_vcpu_in_l2_guest(vcpu)) {
 		int32_t launch_type;
 
@@ -728,6 +1216,10 @@ int32_t run_vcpu(struct acrn_vcpu *vcpu)
 			}
 #endif
 
+			if (is_vcpu_bsp(vcpu)) {
+				report_vm_startup(vcpu->vm);
+			}
+
 			/* Set vcpu launched */
 			vcpu->launched = true;
 
@@ -758,8 +1250,17 @@ int32_t run_vcpu(struct acrn_vcpu *vcpu)
 				exec_vmwrite(VMX_GUEST_RIP, vcpu_get_rip(vcpu) + vcpu->arch.inst_len);
 			}
 
-			/* Resume the VM */
-			status = exec_vmentry(ctx, VM_RESUME, ibrs_type);
+			if (vcpu->arch.vmcs_migrated) {
+				/* VMCLEAR on the old pCPU reset the launch state of the VMCS */
+				vcpu->arch.vmcs_migrated = false;
+				if (ibrs_type == IBRS_RAW) {
+					msr_write(MSR_IA32_PRED_CMD, PRED_SET_IBPB);
+				}
+				status = exec_vmentry(ctx, VM_LAUNCH, ibrs_type);
+			} else {
+				/* Resume the VM */
+				status = exec_vmentry(ctx, VM_RESUME, ibrs_type);
+			}
 		}
 
 		cs_attr = exec_vmread32(VMX_GUEST_CS_ATTR);
@@ -769,6 +1270,7 @@ int32_t run_vcpu(struct acrn_vcpu *vcpu)
 	}
 
 	vcpu->reg_cached = 0UL;
+	vcpu->arch.exit_info_cached = 0U;
 
 	/* Obtain current VCPU instruction length */
 	vcpu->arch.inst_len = exec_vmread32(VMX_EXIT_INSTR_LEN);
@@ -797,6 +1299,9 @@ int32_t run_vcpu(struct acrn_vcpu *vcpu)
 void offline_vcpu(struct acrn_vcpu *vcpu)
 {
 	vlapic_free(vcpu);
+#ifdef CONFIG_HYPERV_ENABLED
+	hyperv_reset_vcpu(vcpu);
+#endif
 	per_cpu(ever_run_vcpu, pcpuid_from_vcpu(vcpu)) = NULL;
 
 	/* This operation must be atomic to avoid contention with posted interrupt handler */
@@ -911,11 +1416,46 @@ void rstore_xsave_area(const struct acrn_vcpu *vcpu, const struct ext_context *e
  * will call them every thread switch. We can implement lazy context swtich , which
  * only do context swtich when really need.
  */
+/*
+ * A vCPU preempted while runnable picks up its posted interrupts once switched
+ * back in, so VT-d is told to suppress their notification meanwhile rather
+ * than interrupt the thread running in its place. A vCPU that blocks, e.g. in
+ * HLT, keeps the notification as its wakeup vector: NV is the per-VM
+ * POSTED_INTR_VECTOR + vm_id and NDST this pCPU, so outside non-root mode it
+ * lands in vcpu_handle_pi_notification(), which wakes the vCPU directly.
+ */
+static void pi_switch_out(struct acrn_vcpu *vcpu)
+{
+	if (is_apicv_advanced_feature_supported() && !vcpu->thread_obj.be_blocking) {
+		bitmap_set_lock(POSTED_INTR_SN, &(get_pi_desc(vcpu)->control.value));
+	}
+}
+
+static void pi_switch_in(struct acrn_vcpu *vcpu)
+{
+	struct pi_desc *pid = get_pi_desc(vcpu);
+
+	if (is_apicv_advanced_feature_supported() && bitmap_test(POSTED_INTR_SN, &(pid->control.value))) {
+		bitmap_clear_lock(POSTED_INTR_SN, &(pid->control.value));
+		/* interrupts posted while suppressed are in the PIR without ON set */
+		if ((pid->pir[0] | pid->pir[1] | pid->pir[2] | pid->pir[3]) != 0UL) {
+			bitmap_set_lock(POSTED_INTR_ON, &(pid->control.value));
+			vcpu_make_request(vcpu, ACRN_REQUEST_EVENT);
+		}
+	}
+}
+
 static void context_switch_out(struct thread_object *prev)
 {
 	struct acrn_vcpu *vcpu = container_of(prev, struct acrn_vcpu, thread_obj);
 	struct ext_context *ectx = &(vcpu->arch.contexts[vcpu->arch.cur_context].ext_ctx);
 
+	pi_switch_out(vcpu);
+	pvclock_steal_switch_out(vcpu, !prev->be_blocking);
+	/* the next thread on the pCPU loads its CLOS, if it has another one */
+	vcpu->arch.msr_area.pqr_assoc_loaded = false;
+	vpmu_switch_out(vcpu);
+
 	/* We don't flush TLB as we assume each vcpu has different vpid */
 	ectx->ia32_star = msr_read(MSR_IA32_STAR);
 	ectx->ia32_cstar = msr_read(MSR_IA32_CSTAR);
@@ -934,6 +1474,18 @@ static void context_switch_in(struct thread_object *next)
 	uint64_t vmsr_val;
 
 	load_vmcs(vcpu);
+	load_vcpu_freq_policy(vcpu);
+	if (vcpu->arch.vmcs_migrated) {
+		/* the host state still describes the old pCPU */
+		init_host_state();
+		if (vcpu->arch.vtimer_migrated) {
+			vcpu->arch.vtimer_migrated = false;
+			(void)add_timer(&vcpu_vlapic(vcpu)->vtimer.timer);
+		}
+#ifdef CONFIG_HYPERV_ENABLED
+		hyperv_migrate_vcpu(vcpu, false);
+#endif
+	}
 
 	msr_write(MSR_IA32_STAR, ectx->ia32_star);
 	msr_write(MSR_IA32_CSTAR, ectx->ia32_cstar);
@@ -952,9 +1504,70 @@ static void context_switch_in(struct thread_object *next)
 	load_iwkey(vcpu);
 
 	rstore_xsave_area(vcpu, ectx);
+
+	vpmu_switch_in(vcpu);
+	pi_switch_in(vcpu);
+	pvclock_steal_switch_in(vcpu);
 }
 
 
+#ifdef CONFIG_SCHED_BALANCE_ENABLED
+/*
+ * @pre get_pcpu_id() == pcpuid_from_vcpu(vcpu)
+ *
+ * Called on the old pCPU of a queued vCPU thread: release the VMCS there and
+ * move the per-pCPU state of the vCPU over to pcpu_id. context_switch_in()
+ * rebuilds the host state and run_vcpu() relaunches the VMCS on the new pCPU.
+ */
+static bool context_migrate(struct thread_object *obj, uint16_t pcpu_id)
+{
+	struct acrn_vcpu *vcpu = container_of(obj, struct acrn_vcpu, thread_obj);
+	struct hv_timer *timer = &vcpu_vlapic(vcpu)->vtimer.timer;
+	uint16_t old_pcpu_id = pcpuid_from_vcpu(vcpu);
+	uint16_t vm_id = vcpu->vm->vm_id;
+	bool ret = false;
+
+	/*
+	 * The posted interrupt handler finds the vCPU by vm_id in vcpu_array, so a
+	 * pCPU can only host one vCPU of each VM.
+	 */
+	if (vcpu->launched && (vcpu->state == VCPU_RUNNING) &&
+			(atomic_cmpxchg64((volatile uint64_t *)&per_cpu(vcpu_array, pcpu_id)[vm_id],
+				0UL, (uint64_t)vcpu) == 0UL)) {
+		per_cpu(vcpu_array, old_pcpu_id)[vm_id] = NULL;
+		vcpu->arch.pid.control.bits.ndst = per_cpu(lapic_id, pcpu_id);
+		if (per_cpu(ever_run_vcpu, old_pcpu_id) == vcpu) {
+			per_cpu(ever_run_vcpu, old_pcpu_id) = NULL;
+		}
+		per_cpu(ever_run_vcpu, pcpu_id) = vcpu;
+
+		clear_va_vmcs(vcpu->arch.vmcs);
+		if (per_cpu(vmcs_run, old_pcpu_id) == (void *)vcpu->arch.vmcs) {
+			per_cpu(vmcs_run, old_pcpu_id) = NULL;
+		}
+		vcpu->arch.vmcs_migrated = true;
+
+		/* the vLAPIC timer is in the timer heap of the old pCPU */
+		vcpu->arch.vtimer_migrated = timer_is_started(timer);
+		del_timer(timer);
+#ifdef CONFIG_HYPERV_ENABLED
+		hyperv_migrate_vcpu(vcpu, true);
+#endif
+
+		/* drop the translations the new pCPU may hold from an earlier stay */
+		bitmap_set_lock(ACRN_REQUEST_VPID_FLUSH, &vcpu->arch.pending_req);
+		bitmap_set_lock(ACRN_REQUEST_EPT_FLUSH, &vcpu->arch.pending_req);
+		/* and pick up the interrupts posted while the move was in flight */
+		bitmap_set_lock(ACRN_REQUEST_EVENT, &vcpu->arch.pending_req);
+		/* the remapped mode MSIs are retargeted from the new pCPU */
+		bitmap_set_lock(ACRN_REQUEST_PTIRQ_AFFINITY, &vcpu->arch.pending_req);
+		ret = true;
+	}
+
+	return ret;
+}
+#endif
+
 /**
  * @pre vcpu != NULL
  * @pre vcpu->state == VCPU_INIT
@@ -986,6 +1599,13 @@ int32_t prepare_vcpu(struct acrn_vm *vm, uint16_t pcpu_id)
 		vcpu->thread_obj.host_sp = build_stack_frame(vcpu);
 		vcpu->thread_obj.switch_out = context_switch_out;
 		vcpu->thread_obj.switch_in = context_switch_in;
+#ifdef CONFIG_SCHED_BALANCE_ENABLED
+		vcpu->thread_obj.migrate = context_migrate;
+		/* vCPUs of RT VMs and of VMs passing the LAPIC or VMX through stay pinned */
+		if (!is_rt_vm(vm) && !is_lapic_pt_configured(vm) && !is_nvmx_configured(vm)) {
+			vcpu->thread_obj.pcpu_bitmap = vm->hw.cpu_affinity;
+		}
+#endif
 		init_thread_data(&vcpu->thread_obj, &get_vm_config(vm->vm_id)->sched_params);
 		for (i = 0; i < VCPU_EVENT_NUM; i++) {
 			init_event(&vcpu->events[i]);
@@ -18,12 +18,11 @@
 #include <asm/rdt.h>
 #include <asm/guest/vcat.h>
 
-static inline const struct vcpuid_entry *local_find_vcpuid_entry(const struct acrn_vcpu *vcpu,
+static inline const struct vcpuid_entry *scan_vcpuid_entries(const struct acrn_vm *vm,
 					uint32_t leaf, uint32_t subleaf)
 {
 	uint32_t i = 0U, nr, half;
 	const struct vcpuid_entry *found_entry = NULL;
-	struct acrn_vm *vm = vcpu->vm;
 
 	nr = vm->vcpuid_entry_nr;
 	half = nr >> 1U;
@@ -51,6 +50,43 @@ static inline const struct vcpuid_entry *local_find_vcpuid_entry(const struct ac
 	return found_entry;
 }
 
+/*
+ * The leaves that vcpuid_leaf_slot() indexes directly find their entries by
+ * vcpuid_leaf_first[], and the subleaves of a leaf, which mostly come as 0..n-1,
+ * by their index from there. The other leaves are searched in vcpuid_entries[].
+ */
+static inline const struct vcpuid_entry *local_find_vcpuid_entry(const struct acrn_vcpu *vcpu,
+					uint32_t leaf, uint32_t subleaf)
+{
+	const struct acrn_vm *vm = vcpu->vm;
+	const struct vcpuid_entry *found_entry = NULL, *tmp;
+	uint32_t slot = vcpuid_leaf_slot(leaf);
+	uint32_t first, nr, i;
+
+	if (slot == VCPUID_OTHER_LEAF_SLOT) {
+		found_entry = scan_vcpuid_entries(vm, leaf, subleaf);
+	} else if (vm->vcpuid_leaf_first[slot] != VCPUID_NO_ENTRY) {
+		first = vm->vcpuid_leaf_first[slot];
+		nr = vm->vcpuid_leaf_nr[slot];
+		tmp = &vm->vcpuid_entries[first];
+		if ((tmp->flags & CPUID_CHECK_SUBLEAF) == 0U) {
+			found_entry = tmp;
+		} else if ((subleaf < nr) && (vm->vcpuid_entries[first + subleaf].subleaf == subleaf)) {
+			found_entry = &vm->vcpuid_entries[first + subleaf];
+		} else {
+			for (i = first; (i < (first + nr)) && (found_entry == NULL); i++) {
+				if (vm->vcpuid_entries[i].subleaf == subleaf) {
+					found_entry = &vm->vcpuid_entries[i];
+				}
+			}
+		}
+	} else {
+		/* the VM has no entry for this leaf */
+	}
+
+	return found_entry;
+}
+
 static inline const struct vcpuid_entry *find_vcpuid_entry(const struct acrn_vcpu *vcpu,
 					uint32_t leaf_arg, uint32_t subleaf)
 {
@@ -248,6 +284,40 @@ static void init_vcpuid_entry(uint32_t leaf, uint32_t subleaf,
 		entry->edx = 0U;
 		break;
 
+	/*
+	 * Leaf 0x40000100 - KVM signature, for the paravirtual clock.
+	 *
+	 * EAX: The maximum KVM leaf.
+	 * EBX, ECX, EDX: "KVMKVMKVM\0\0\0".
+	 */
+	case KVM_CPUID_SIGNATURE:
+	{
+		static const char kvm_sig[12] = "KVMKVMKVM\0\0";
+		const uint32_t *sigptr = (const uint32_t *)kvm_sig;
+
+		entry->eax = KVM_CPUID_FEATURES;
+		entry->ebx = sigptr[0];
+		entry->ecx = sigptr[1];
+		entry->edx = sigptr[2];
+		break;
+	}
+
+	/*
+	 * Leaf 0x40000101 - KVM features.
+	 *
+	 * EAX: The paravirtual clock MSRs and its stable bit, the steal time and
+	 *      PV EOI MSRs, the kick of the PV spinlocks, the asynchronous page
+	 *      faults with "page ready" as an interrupt.
+	 * EBX, ECX, EDX: RESERVED (reserved fields are set to zero).
+	 */
+	case KVM_CPUID_FEATURES:
+		entry->eax = KVM_FEATURE_CLOCKSOURCE2 | KVM_FEATURE_CLOCKSOURCE_STABLE_BIT | KVM_FEATURE_STEAL_TIME |
+			KVM_FEATURE_PV_EOI | KVM_FEATURE_PV_UNHALT | KVM_FEATURE_ASYNC_PF | KVM_FEATURE_ASYNC_PF_INT;
+		entry->ebx = 0U;
+		entry->ecx = 0U;
+		entry->edx = 0U;
+		break;
+
 	default:
 		cpuid_subleaf(leaf, subleaf, &entry->eax, &entry->ebx, &entry->ecx, &entry->edx);
 		break;
@@ -454,16 +524,23 @@ static int32_t set_vcpuid_extended_function(struct acrn_vm *vm)
 		}
 #ifdef CONFIG_HYPERV_ENABLED
 		else {
-			hyperv_init_vcpuid_entry(0x40000001U, 0U, 0U, &entry);
+			hyperv_init_vcpuid_entry(vm, 0x40000001U, 0U, 0U, &entry);
 		}
 #endif
+		if (is_pv_ipi_configured(vm)) {
+			entry.eax |= GUEST_CAPS_PV_IPI;
+		}
+		if (is_pv_timer_configured(vm)) {
+			entry.eax |= GUEST_CAPS_PV_TIMER;
+		}
+		entry.eax |= GUEST_CAPS_LAT_ACK;
 		result = set_vcpuid_entry(vm, &entry);
 	}
 
 #ifdef CONFIG_HYPERV_ENABLED
 	if (result == 0) {
 		for (i = 0x40000002U; i <= 0x40000006U; i++) {
-			hyperv_init_vcpuid_entry(i, 0U, 0U, &entry);
+			hyperv_init_vcpuid_entry(vm, i, 0U, 0U, &entry);
 			result = set_vcpuid_entry(vm, &entry);
 			if (result != 0) {
 				break;
@@ -477,6 +554,15 @@ static int32_t set_vcpuid_extended_function(struct acrn_vm *vm)
 		result = set_vcpuid_entry(vm, &entry);
 	}
 
+	if ((result == 0) && is_pv_clock_configured(vm)) {
+		init_vcpuid_entry(KVM_CPUID_SIGNATURE, 0U, 0U, &entry);
+		result = set_vcpuid_entry(vm, &entry);
+		if (result == 0) {
+			init_vcpuid_entry(KVM_CPUID_FEATURES, 0U, 0U, &entry);
+			result = set_vcpuid_entry(vm, &entry);
+		}
+	}
+
 	if (result == 0) {
 		init_vcpuid_entry(0x80000000U, 0U, 0U, &entry);
 		result = set_vcpuid_entry(vm, &entry);
@@ -502,6 +588,27 @@ static inline bool is_percpu_related(uint32_t leaf)
 	return ((leaf == 0x1U) || (leaf == 0xbU) || (leaf == 0xdU) || (leaf == 0x19U) || (leaf == 0x80000001U) || (leaf == 0x2U) || (leaf == 0x1aU));
 }
 
+/*
+ * @pre vcpuid_entries[] is sorted by leaf
+ */
+static void build_vcpuid_leaf_index(struct acrn_vm *vm)
+{
+	uint32_t i, slot;
+
+	(void)memset((void *)vm->vcpuid_leaf_first, VCPUID_NO_ENTRY, sizeof(vm->vcpuid_leaf_first));
+	(void)memset((void *)vm->vcpuid_leaf_nr, 0U, sizeof(vm->vcpuid_leaf_nr));
+
+	for (i = 0U; i < vm->vcpuid_entry_nr; i++) {
+		slot = vcpuid_leaf_slot(vm->vcpuid_entries[i].leaf);
+		if (slot != VCPUID_OTHER_LEAF_SLOT) {
+			if (vm->vcpuid_leaf_first[slot] == VCPUID_NO_ENTRY) {
+				vm->vcpuid_leaf_first[slot] = (uint8_t)i;
+			}
+			vm->vcpuid_leaf_nr[slot]++;
+		}
+	}
+}
+
 int32_t set_vcpuid_entries(struct acrn_vm *vm)
 {
 	int32_t result;
@@ -545,8 +652,12 @@ int32_t set_vcpuid_entries(struct acrn_vm *vm)
 					}
 				}
 				break;
-			/* MONITOR/MWAIT */
+			/* MONITOR/MWAIT, the C-states the VM may enter are the ones of its _CST */
 			case 0x05U:
+				if (is_mwait_pt_configured(vm)) {
+					init_vcpuid_entry(i, 0U, 0U, &entry);
+					result = set_vcpuid_entry(vm, &entry);
+				}
 				break;
 			case 0x06U:
 				init_vcpuid_entry(i, 0U, CPUID_CHECK_SUBLEAF, &entry);
@@ -580,11 +691,16 @@ int32_t set_vcpuid_entries(struct acrn_vm *vm)
 				result = set_vcpuid_sgx(vm);
 				break;
 			/* These features are disabled */
-			/* PMU is not supported except for core partition VM, like RTVM */
+			/* PMU is not supported except for core partition VM, like RTVM, and the vPMU */
 			case 0x0aU:
 				if (is_pmu_pt_configured(vm)) {
 					init_vcpuid_entry(i, 0U, 0U, &entry);
 					result = set_vcpuid_entry(vm, &entry);
+				} else {
+					init_vcpuid_entry(i, 0U, 0U, &entry);
+					if (vpmu_get_cpuid_0ah(vm, &entry)) {
+						result = set_vcpuid_entry(vm, &entry);
+					}
 				}
 				break;
 
@@ -623,6 +739,10 @@ int32_t set_vcpuid_entries(struct acrn_vm *vm)
 		if (result == 0) {
 			result = set_vcpuid_extended_function(vm);
 		}
+
+		if (result == 0) {
+			build_vcpuid_leaf_index(vm);
+		}
 	}
 
 	return result;
@@ -664,9 +784,11 @@ static void guest_cpuid_01h(struct acrn_vcpu *vcpu, uint32_t *eax, uint32_t *ebx
 	}
 
 	/*
-	 * Hide MONITOR/MWAIT.
+	 * Hide MONITOR/MWAIT unless they are passed through.
 	 */
-	*ecx &= ~CPUID_ECX_MONITOR;
+	if (!is_mwait_pt_configured(vcpu->vm)) {
+		*ecx &= ~CPUID_ECX_MONITOR;
+	}
 
 	*ecx &= ~CPUID_ECX_OSXSAVE;
 	if ((*ecx & CPUID_ECX_XSAVE) != 0U) {
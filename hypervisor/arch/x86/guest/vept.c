@@ -18,6 +18,7 @@
 #define CONFIG_MAX_GUEST_EPT_NUM	(MAX_ACTIVE_VVMCS_NUM * MAX_VCPUS_PER_VM)
 static struct vept_desc vept_desc_bucket[CONFIG_MAX_GUEST_EPT_NUM];
 static spinlock_t vept_desc_bucket_lock;
+static uint64_t vept_release_seq;
 
 /*
  * For simplicity, total platform RAM size is considered to calculate the
@@ -106,30 +107,83 @@ static void free_sept_table(uint64_t *shadow_eptp)
 }
 
 /*
- * @brief Convert a guest EPTP to the associated vept_desc.
- * @return struct vept_desc * if existed.
- * @return NULL if non-existed.
+ * @pre vept_desc_bucket_lock is held
  */
-static struct vept_desc *find_vept_desc(uint64_t guest_eptp)
+static struct vept_desc *lookup_vept_desc(uint64_t guest_eptp)
 {
 	uint32_t i;
 	struct vept_desc *desc = NULL;
 
-	if (guest_eptp) {
-		spinlock_obtain(&vept_desc_bucket_lock);
-		for (i = 0L; i < CONFIG_MAX_GUEST_EPT_NUM; i++) {
+	if (guest_eptp != 0UL) {
+		for (i = 0U; (i < CONFIG_MAX_GUEST_EPT_NUM) && (desc == NULL); i++) {
 			/* Find an existed vept_desc of the guest EPTP */
 			if (vept_desc_bucket[i].guest_eptp == guest_eptp) {
 				desc = &vept_desc_bucket[i];
-				break;
 			}
 		}
-		spinlock_release(&vept_desc_bucket_lock);
 	}
 
 	return desc;
 }
 
+/*
+ * @brief Convert a guest EPTP to the associated vept_desc.
+ * @return struct vept_desc * if existed.
+ * @return NULL if non-existed.
+ */
+static struct vept_desc *find_vept_desc(uint64_t guest_eptp)
+{
+	struct vept_desc *desc;
+
+	spinlock_obtain(&vept_desc_bucket_lock);
+	desc = lookup_vept_desc(guest_eptp);
+	spinlock_release(&vept_desc_bucket_lock);
+
+	return desc;
+}
+
+/*
+ * @brief Release the shadow EPT of a vept_desc that is only cached
+ *
+ * @pre vept_desc_bucket_lock is held
+ * @pre desc->ref_count == 0 && desc->shadow_eptp != 0
+ */
+static void evict_vept_desc(struct vept_desc *desc)
+{
+	dev_dbg(VETP_LOG_LEVEL, "[%s], vept_desc[%llx] shadow_eptp[%llx] guest_eptp[%llx]",
+			__func__, desc, desc->shadow_eptp, desc->guest_eptp);
+	free_sept_table((void *)(desc->shadow_eptp & PAGE_MASK));
+	free_page(&sept_page_pool, (struct page *)(desc->shadow_eptp & PAGE_MASK));
+	/* Flush the hardware TLB */
+	invept((void *)(desc->shadow_eptp & PAGE_MASK));
+	desc->shadow_eptp = 0UL;
+	desc->guest_eptp = 0UL;
+}
+
+/*
+ * @pre vept_desc_bucket_lock is held
+ */
+static void evict_cached_vept_descs(void)
+{
+	uint32_t i;
+
+	for (i = 0U; i < CONFIG_MAX_GUEST_EPT_NUM; i++) {
+		if ((vept_desc_bucket[i].shadow_eptp != 0UL) && (vept_desc_bucket[i].ref_count == 0U)) {
+			evict_vept_desc(&vept_desc_bucket[i]);
+		}
+	}
+}
+
+/*
+ * @brief Drop all the shadow EPTs no VMCS12 refers to any more
+ */
+void flush_cached_vept_desc(void)
+{
+	spinlock_obtain(&vept_desc_bucket_lock);
+	evict_cached_vept_descs();
+	spinlock_release(&vept_desc_bucket_lock);
+}
+
 /*
  * @brief Convert a guest EPTP to a shadow EPTP.
  * @return 0 if non-existed.
@@ -146,30 +200,41 @@ uint64_t get_shadow_eptp(uint64_t guest_eptp)
  * @brief Get a vept_desc to cache a guest EPTP
  *
  * If there is already an existed vept_desc associated with given guest_eptp,
- * increase its ref_count and return it. If there is not existed vept_desc
- * for guest_eptp, create one and initialize it.
+ * increase its ref_count and return it, this reuses the shadow EPT it cached
+ * since the last VMCS12 referring to it was released. If there is not existed
+ * vept_desc for guest_eptp, create one in an empty vept_desc, or else in the
+ * least recently used cached one, and initialize it.
  *
  * @return a vept_desc which associate the guest EPTP with a shadow EPTP
  */
 struct vept_desc *get_vept_desc(uint64_t guest_eptp)
 {
 	uint32_t i;
-	struct vept_desc *desc = NULL;
+	struct vept_desc *desc = NULL, *empty = NULL, *lru = NULL, *iter;
 
 	if (guest_eptp != 0UL) {
 		spinlock_obtain(&vept_desc_bucket_lock);
-		for (i = 0L; i < CONFIG_MAX_GUEST_EPT_NUM; i++) {
-			/* Find an existed vept_desc of the guest EPTP address bits */
-			if (vept_desc_bucket[i].guest_eptp == guest_eptp) {
-				desc = &vept_desc_bucket[i];
+		for (i = 0U; (i < CONFIG_MAX_GUEST_EPT_NUM) && (desc == NULL); i++) {
+			iter = &vept_desc_bucket[i];
+			if (iter->guest_eptp == guest_eptp) {
+				/* Find an existed vept_desc of the guest EPTP address bits */
+				desc = iter;
 				desc->ref_count++;
-				break;
-			}
-			/* Get the first empty vept_desc for the guest EPTP */
-			if (!desc && (vept_desc_bucket[i].ref_count == 0UL)) {
-				desc = &vept_desc_bucket[i];
+			} else if (iter->shadow_eptp == 0UL) {
+				/* Get the first empty vept_desc for the guest EPTP */
+				empty = (empty == NULL) ? iter : empty;
+			} else if ((iter->ref_count == 0U) && ((lru == NULL) || (iter->release_seq < lru->release_seq))) {
+				lru = iter;
+			} else {
+				/* in use by another VMCS12 */
 			}
 		}
+
+		if ((desc == NULL) && (empty == NULL) && (lru != NULL)) {
+			evict_vept_desc(lru);
+			empty = lru;
+		}
+		desc = (desc != NULL) ? desc : empty;
 		ASSERT(desc != NULL, "Get vept_desc failed!");
 
 		/* A new vept_desc, initialize it */
@@ -191,26 +256,29 @@ struct vept_desc *get_vept_desc(uint64_t guest_eptp)
 /*
  * @brief Put a vept_desc who associate with a guest_eptp
  *
- * If ref_count of the vept_desc, then release all resources used by it.
+ * If ref_count of the vept_desc drops to 0, its shadow EPT stays cached until
+ * the vept_desc is needed for another guest EPTP, the shadow EPT pages run
+ * low or L1 leaves VMX operation.
+ *
+ * Like the translations the processor caches for an EPTP, which SDM 28.3.1
+ * allows to persist while no VMCS refers to it, the cached shadow EPT entries
+ * only go stale by L1 EPT changes that L1 has to follow with an INVEPT anyway,
+ * and invept_vmexit_handler() drops them then.
  */
 void put_vept_desc(uint64_t guest_eptp)
 {
 	struct vept_desc *desc = NULL;
 
 	if (guest_eptp != 0UL) {
-		desc = find_vept_desc(guest_eptp);
 		spinlock_obtain(&vept_desc_bucket_lock);
-		if (desc) {
+		desc = lookup_vept_desc(guest_eptp);
+		if ((desc != NULL) && (desc->ref_count > 0U)) {
 			desc->ref_count--;
-			if (desc->ref_count == 0UL) {
+			if (desc->ref_count == 0U) {
+				vept_release_seq++;
+				desc->release_seq = vept_release_seq;
 				dev_dbg(VETP_LOG_LEVEL, "[%s], vept_desc[%llx] ref[%d] shadow_eptp[%llx] guest_eptp[%llx]",
 						__func__, desc, desc->ref_count, desc->shadow_eptp, desc->guest_eptp);
-				free_sept_table((void *)(desc->shadow_eptp & PAGE_MASK));
-				free_page(&sept_page_pool, (struct page *)(desc->shadow_eptp & PAGE_MASK));
-				/* Flush the hardware TLB */
-				invept((void *)(desc->shadow_eptp & PAGE_MASK));
-				desc->shadow_eptp = 0UL;
-				desc->guest_eptp = 0UL;
 			}
 		}
 		spinlock_release(&vept_desc_bucket_lock);
@@ -366,9 +434,9 @@ static bool is_ept_entry_misconfig(uint64_t ept_entry, enum _page_table_level pt
 	return is_misconfig;
 }
 
-static bool is_access_violation(uint64_t ept_entry)
+static bool is_access_violation(struct acrn_vcpu *vcpu, uint64_t ept_entry)
 {
-	uint64_t exit_qual = exec_vmread(VMX_EXIT_QUALIFICATION);
+	uint64_t exit_qual = vcpu_get_exit_qualification(vcpu);
 	bool access_violation = false;
 
 	if (/* Caused by data read */
@@ -395,7 +463,7 @@ bool handle_l2_ept_violation(struct acrn_vcpu *vcpu)
 {
 	uint64_t guest_eptp = vcpu->arch.nested.current_vvmcs->vmcs12.ept_pointer;
 	struct vept_desc *desc = find_vept_desc(guest_eptp);
-	uint64_t l2_ept_violation_gpa = exec_vmread(VMX_GUEST_PHYSICAL_ADDR_FULL);
+	uint64_t l2_ept_violation_gpa = vcpu_get_exit_guest_phys_addr(vcpu);
 	enum _page_table_level pt_level;
 	uint64_t guest_ept_entry, shadow_ept_entry;
 	uint64_t *p_guest_ept_page, *p_shadow_ept_page;
@@ -405,6 +473,15 @@ bool handle_l2_ept_violation(struct acrn_vcpu *vcpu)
 	ASSERT(desc != NULL, "Invalid shadow EPTP!");
 
 	spinlock_obtain(&vept_desc_bucket_lock);
+
+	/*
+	 * The pool is sized for about one shadow of the whole RAM, leave it to the
+	 * shadow EPTs in use once it runs low. The stats are only a hint here.
+	 */
+	if ((sept_page_pool.stats.used_pages * 4UL) > (calc_sept_page_num() * 3UL)) {
+		evict_cached_vept_descs();
+	}
+
 	stac();
 
 	p_shadow_ept_page = (uint64_t *)(desc->shadow_eptp & PAGE_MASK);
@@ -428,7 +505,7 @@ bool handle_l2_ept_violation(struct acrn_vcpu *vcpu)
 			break;
 		}
 
-		if (is_access_violation(guest_ept_entry)) {
+		if (is_access_violation(vcpu, guest_ept_entry)) {
 			break;
 		}
 
@@ -502,21 +579,18 @@ int32_t invept_vmexit_handler(struct acrn_vcpu *vcpu)
 			nested_vmx_result(VMfailValid, VMXERR_INVEPT_INVVPID_INVALID_OPERAND);
 		} else if (type == 1 && (ept_cap_vmsr & VMX_EPT_INVEPT_SINGLE_CONTEXT) != 0UL) {
 			/* Single-context invalidation */
-			/* Find corresponding vept_desc of the invalidated EPTP */
-			desc = get_vept_desc(operand_gla_ept.eptp);
-			if (desc) {
-				spinlock_obtain(&vept_desc_bucket_lock);
-				if (desc->shadow_eptp != 0UL) {
-					/*
-					 * Since ACRN does not know which paging entries are changed,
-					 * Remove all the shadow EPT entries that ACRN created for L2 VM
-					 */
-					free_sept_table((void *)(desc->shadow_eptp & PAGE_MASK));
-					invept((void *)(desc->shadow_eptp & PAGE_MASK));
-				}
-				spinlock_release(&vept_desc_bucket_lock);
-				put_vept_desc(operand_gla_ept.eptp);
+			/* Find corresponding vept_desc of the invalidated EPTP, in use or cached */
+			spinlock_obtain(&vept_desc_bucket_lock);
+			desc = lookup_vept_desc(operand_gla_ept.eptp);
+			if ((desc != NULL) && (desc->shadow_eptp != 0UL)) {
+				/*
+				 * Since ACRN does not know which paging entries are changed,
+				 * Remove all the shadow EPT entries that ACRN created for L2 VM
+				 */
+				free_sept_table((void *)(desc->shadow_eptp & PAGE_MASK));
+				invept((void *)(desc->shadow_eptp & PAGE_MASK));
 			}
+			spinlock_release(&vept_desc_bucket_lock);
 			nested_vmx_result(VMsucceed, 0);
 		} else if ((type == 2) && (ept_cap_vmsr & VMX_EPT_INVEPT_GLOBAL_CONTEXT) != 0UL) {
 			/* Global invalidation */
@@ -545,13 +619,7 @@ int32_t invept_vmexit_handler(struct acrn_vcpu *vcpu)
 void init_vept(void)
 {
 	init_vept_pool();
-	sept_page_pool.start_page = sept_pages;
-	sept_page_pool.bitmap_size = calc_sept_page_num() / 64U;
-	sept_page_pool.bitmap = sept_page_bitmap;
-        sept_page_pool.dummy_page = NULL;
-	spinlock_init(&sept_page_pool.lock);
-	memset((void *)sept_page_pool.bitmap, 0, sept_page_pool.bitmap_size * sizeof(uint64_t));
-	sept_page_pool.last_hint_id = 0UL;
+	init_page_pool(&sept_page_pool, sept_pages, sept_page_bitmap, calc_sept_page_num(), NULL);
 
 	spinlock_init(&vept_desc_bucket_lock);
 }
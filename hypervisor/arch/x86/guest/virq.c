@@ -15,6 +15,7 @@
 #include <asm/guest/vmcs.h>
 #include <asm/guest/vm.h>
 #include <asm/guest/lock_instr_emul.h>
+#include <asm/guest/assign.h>
 #include <trace.h>
 #include <logmsg.h>
 #include <asm/irq.h>
@@ -97,7 +98,7 @@ static uint8_t get_exception_type(uint32_t vector)
 	return type;
 }
 
-static bool is_guest_irq_enabled(struct acrn_vcpu *vcpu)
+bool is_guest_irq_enabled(struct acrn_vcpu *vcpu)
 {
 	uint64_t guest_rflags, guest_state;
 	bool status = false;
@@ -323,7 +324,7 @@ int32_t external_interrupt_vmexit_handler(struct acrn_vcpu *vcpu)
 	struct intr_excp_ctx ctx;
 	int32_t ret;
 
-	intr_info = exec_vmread32(VMX_EXIT_INT_INFO);
+	intr_info = vcpu_get_exit_intr_info(vcpu);
 	if (((intr_info & VMX_INT_INFO_VALID) == 0U) ||
 		(((intr_info & VMX_INT_TYPE_MASK) >> 8U)
 		!= VMX_INT_TYPE_EXT_INT)) {
@@ -360,6 +361,9 @@ int32_t acrn_handle_pending_request(struct acrn_vcpu *vcpu)
 		/* make sure ACRN_REQUEST_INIT_VMCS handler as the first one */
 		if (bitmap_test_and_clear_lock(ACRN_REQUEST_INIT_VMCS, pending_req_bits)) {
 			init_vmcs(vcpu);
+			if (arch->restore.pending) {
+				finish_vcpu_restore(vcpu);
+			}
 		}
 
 		if (bitmap_test_and_clear_lock(ACRN_REQUEST_TRP_FAULT, pending_req_bits)) {
@@ -375,6 +379,7 @@ int32_t acrn_handle_pending_request(struct acrn_vcpu *vcpu)
 			}
 
 			if (bitmap_test_and_clear_lock(ACRN_REQUEST_EPT_FLUSH, pending_req_bits)) {
+				vcpu->arch.pw_cache_eptp = NULL;
 				invept(vcpu->vm->arch_vm.nworld_eptp);
 				if (vcpu->vm->sworld_control.flag.active != 0UL) {
 					invept(vcpu->vm->arch_vm.sworld_eptp);
@@ -393,6 +398,14 @@ int32_t acrn_handle_pending_request(struct acrn_vcpu *vcpu)
 				handle_smp_call();
 			}
 
+			if (bitmap_test_and_clear_lock(ACRN_REQUEST_PTIRQ_AFFINITY, pending_req_bits)) {
+				ptirq_msi_follow_vcpu(vcpu);
+			}
+
+			if (bitmap_test_and_clear_lock(ACRN_REQUEST_ASYNC_PF, pending_req_bits)) {
+				pvclock_async_pf_ready(vcpu);
+			}
+
 		}
 	}
 
@@ -506,7 +519,7 @@ int32_t exception_vmexit_handler(struct acrn_vcpu *vcpu)
 	pr_dbg(" Handling guest exception");
 
 	/* Obtain VM-Exit information field pg 2912 */
-	intinfo = exec_vmread32(VMX_EXIT_INT_INFO);
+	intinfo = vcpu_get_exit_intr_info(vcpu);
 	if ((intinfo & VMX_INT_INFO_VALID) != 0U) {
 		exception_vector = intinfo & 0xFFU;
 		/* Check if exception caused by the guest is a HW exception.
@@ -514,7 +527,7 @@ int32_t exception_vmexit_handler(struct acrn_vcpu *vcpu)
 		 * error code to be conveyed to get via the stack
 		 */
 		if ((intinfo & VMX_INT_INFO_ERR_CODE_VALID) != 0U) {
-			int_err_code = exec_vmread32(VMX_EXIT_INT_ERROR_CODE);
+			int_err_code = vcpu_get_exit_intr_err_code(vcpu);
 
 			/* get current privilege level and fault address */
 			cpl = exec_vmread32(VMX_GUEST_CS_ATTR);
@@ -61,6 +61,12 @@
 
 #define DBG_LEVEL_VLAPIC		6U
 
+/* logical destination models a vLAPIC is filed under, see vlapic_file_logical_dest() */
+#define VLAPIC_DEST_NONE		0U	/* matches no logical destination */
+#define VLAPIC_DEST_FLAT		1U
+#define VLAPIC_DEST_CLUSTER		2U
+#define VLAPIC_DEST_OTHER		3U	/* checked for every logical destination */
+
 static inline struct acrn_vcpu *vlapic2vcpu(const struct acrn_vlapic *vlapic)
 {
 	return container_of(container_of(vlapic, struct acrn_vcpu_arch, vlapic), struct acrn_vcpu, arch);
@@ -106,6 +112,8 @@ static void vlapic_x2apic_self_ipi_handler(struct acrn_vlapic *vlapic);
 static void vlapic_set_error(struct acrn_vlapic *vlapic, uint32_t mask);
 
 static void vlapic_timer_expired(void *data);
+static int32_t vlapic_read(struct acrn_vlapic *vlapic, uint32_t offset_arg, uint64_t *data);
+static int32_t vlapic_write(struct acrn_vlapic *vlapic, uint32_t offset, uint64_t data);
 
 static inline bool vlapic_enabled(const struct acrn_vlapic *vlapic)
 {
@@ -125,19 +133,54 @@ vm_lapic_from_vcpu_id(struct acrn_vm *vm, uint16_t vcpu_id)
 	return vcpu_vlapic(vcpu);
 }
 
-static uint16_t vm_apicid2vcpu_id(struct acrn_vm *vm, uint32_t lapicid)
+static inline bool is_dest_vcpu_valid(const struct acrn_vm *vm, uint16_t vcpu_id)
 {
-	uint16_t i;
-	struct acrn_vcpu *vcpu;
-	uint16_t cpu_id = INVALID_CPU_ID;
+	return (vcpu_id < vm->hw.created_vcpus) && (vm->hw.vcpu_array[vcpu_id].state != VCPU_OFFLINE);
+}
 
-	foreach_vcpu(i, vm, vcpu) {
-		if (vcpu_vlapic(vcpu)->vapic_id == lapicid) {
-			cpu_id = vcpu->vcpu_id;
-			break;
+/*
+ * The APIC ID of a vLAPIC never changes, so it is hashed once when the vCPU
+ * is created and the entries of a VM are only dropped with the VM.
+ */
+static void vlapic_hash_apicid(struct acrn_vlapic *vlapic)
+{
+	struct acrn_vcpu *vcpu = vlapic2vcpu(vlapic);
+	uint16_t *hash = vcpu->vm->arch_vm.vlapic_apicid_hash;
+	uint32_t i = vlapic->vapic_id % VLAPIC_APICID_HASH_SIZE;
+
+	while (hash[i] != INVALID_CPU_ID) {
+		i = (i + 1U) % VLAPIC_APICID_HASH_SIZE;
+	}
+	hash[i] = vcpu->vcpu_id;
+}
+
+static uint16_t vlapic_lookup_apicid(struct acrn_vm *vm, uint32_t lapicid)
+{
+	const uint16_t *hash = vm->arch_vm.vlapic_apicid_hash;
+	uint32_t i = lapicid % VLAPIC_APICID_HASH_SIZE;
+	uint16_t vcpu_id, cpu_id = INVALID_CPU_ID;
+	bool done = false;
+
+	while (!done) {
+		vcpu_id = hash[i];
+		if (vcpu_id == INVALID_CPU_ID) {
+			done = true;
+		} else if ((vm->hw.vcpu_array[vcpu_id].arch.vlapic.vapic_id == lapicid) &&
+				is_dest_vcpu_valid(vm, vcpu_id)) {
+			cpu_id = vcpu_id;
+			done = true;
+		} else {
+			i = (i + 1U) % VLAPIC_APICID_HASH_SIZE;
 		}
 	}
 
+	return cpu_id;
+}
+
+uint16_t vm_apicid2vcpu_id(struct acrn_vm *vm, uint32_t lapicid)
+{
+	uint16_t cpu_id = vlapic_lookup_apicid(vm, lapicid);
+
 	if (cpu_id == INVALID_CPU_ID) {
 		pr_err("%s: bad lapicid %lu", __func__, lapicid);
 	}
@@ -146,16 +189,132 @@ static uint16_t vm_apicid2vcpu_id(struct acrn_vm *vm, uint32_t lapicid)
 
 }
 
+static inline uint32_t x2apic_ldr(uint32_t apic_id)
+{
+	uint32_t logical_id, cluster_id;
+
+	logical_id = apic_id & LOGICAL_ID_MASK;
+	cluster_id = (apic_id & CLUSTER_ID_MASK) >> 4U;
+	return (cluster_id << 16U) | (1U << logical_id);
+}
+
+/* @pre The caller holds vm->arch_vm.vlapic_dest_lock */
+static void vlapic_update_logical_dest(struct vm_arch *arch_vm, uint32_t model, uint32_t ldr,
+		uint64_t vcpu_mask, bool add)
+{
+	uint64_t *dest = NULL;
+	uint32_t logical_id = 0U, i;
+
+	switch (model) {
+	case VLAPIC_DEST_FLAT:
+		dest = arch_vm->vlapic_flat_dest;
+		logical_id = ldr >> 24U;
+		break;
+	case VLAPIC_DEST_CLUSTER:
+		dest = arch_vm->vlapic_cluster_dest[ldr >> 28U];
+		logical_id = (ldr >> 24U) & 0xfU;
+		break;
+	case VLAPIC_DEST_OTHER:
+		dest = &arch_vm->vlapic_other_dest;
+		logical_id = 1U;
+		break;
+	default:
+		/* nothing to file */
+		break;
+	}
+
+	for (i = 0U; i < 8U; i++) {
+		if ((logical_id & (1U << i)) != 0U) {
+			if (add) {
+				dest[i] |= vcpu_mask;
+			} else {
+				dest[i] &= ~vcpu_mask;
+			}
+		}
+	}
+}
+
+/*
+ * File the logical ID of a vLAPIC in the lookup tables of its VM, to be
+ * called whenever its LDR, DFR or x2APIC mode changes. x2APIC vLAPICs are
+ * found through the APIC ID hash instead as their LDR is derived from the
+ * APIC ID, unless it was clobbered, e.g. by an INIT.
+ */
+static void vlapic_file_logical_dest(struct acrn_vlapic *vlapic)
+{
+	struct acrn_vcpu *vcpu = vlapic2vcpu(vlapic);
+	struct vm_arch *arch_vm = &vcpu->vm->arch_vm;
+	uint32_t ldr = vlapic->apic_page.ldr.v;
+	uint32_t dfr = vlapic->apic_page.dfr.v & APIC_DFR_MODEL_MASK;
+	uint32_t model;
+	uint64_t rflags;
+
+	if (is_x2apic_enabled(vlapic)) {
+		model = (ldr == x2apic_ldr(vlapic->vapic_id)) ? VLAPIC_DEST_NONE : VLAPIC_DEST_OTHER;
+	} else if (dfr == APIC_DFR_MODEL_FLAT) {
+		model = VLAPIC_DEST_FLAT;
+	} else if (dfr == APIC_DFR_MODEL_CLUSTER) {
+		model = VLAPIC_DEST_CLUSTER;
+	} else {
+		model = VLAPIC_DEST_NONE;
+	}
+
+	spinlock_irqsave_obtain(&arch_vm->vlapic_dest_lock, &rflags);
+	seqcount_write_begin(&arch_vm->vlapic_dest_seq);
+	vlapic_update_logical_dest(arch_vm, vlapic->filed_model, vlapic->filed_ldr, 1UL << vcpu->vcpu_id, false);
+	vlapic_update_logical_dest(arch_vm, model, ldr, 1UL << vcpu->vcpu_id, true);
+	seqcount_write_end(&arch_vm->vlapic_dest_seq);
+	vlapic->filed_model = model;
+	vlapic->filed_ldr = ldr;
+	spinlock_irqrestore_release(&arch_vm->vlapic_dest_lock, rflags);
+}
+
+/*
+ * The vCPUs that may match the logical destination 'dest', a superset the
+ * caller narrows down with is_dest_field_matched().
+ */
+static uint64_t vlapic_logical_dest_candidates(struct acrn_vm *vm, uint32_t dest)
+{
+	const struct vm_arch *arch_vm = &vm->arch_vm;
+	uint64_t dmask;
+	uint32_t seq, i;
+	uint16_t vcpu_id;
+
+	do {
+		seq = seqcount_read_begin(&arch_vm->vlapic_dest_seq);
+		dmask = arch_vm->vlapic_other_dest;
+		for (i = 0U; i < 8U; i++) {
+			if ((dest & (1U << i)) != 0U) {
+				dmask |= arch_vm->vlapic_flat_dest[i];
+			}
+		}
+		for (i = 0U; i < 4U; i++) {
+			if ((dest & (1U << i)) != 0U) {
+				dmask |= arch_vm->vlapic_cluster_dest[(dest >> 4U) & 0xfU][i];
+			}
+		}
+	} while (seqcount_read_retry(&arch_vm->vlapic_dest_seq, seq));
+
+	for (i = 0U; i < 16U; i++) {
+		if ((dest & (1U << i)) != 0U) {
+			vcpu_id = vlapic_lookup_apicid(vm, ((dest >> 16U) << 4U) | i);
+			if (vcpu_id != INVALID_CPU_ID) {
+				bitmap_set_nolock(vcpu_id, &dmask);
+			}
+		}
+	}
+
+	return dmask;
+}
+
 static inline void vlapic_build_x2apic_id(struct acrn_vlapic *vlapic)
 {
 	struct lapic_regs *lapic;
-	uint32_t logical_id, cluster_id;
 
 	lapic = &(vlapic->apic_page);
 	lapic->id.v = vlapic->vapic_id;
-	logical_id = lapic->id.v & LOGICAL_ID_MASK;
-	cluster_id = (lapic->id.v & CLUSTER_ID_MASK) >> 4U;
-	lapic->ldr.v = (cluster_id << 16U) | (1U << logical_id);
+	lapic->ldr.v = x2apic_ldr(lapic->id.v);
+	vlapic_file_logical_dest(vlapic);
 }
 
 static inline uint32_t vlapic_find_isrv(const struct acrn_vlapic *vlapic)
@@ -196,6 +355,7 @@ vlapic_write_dfr(struct acrn_vlapic *vlapic)
 	} else {
 		dev_dbg(DBG_LEVEL_VLAPIC, "DFR in Unknown Model %#x", lapic->dfr);
 	}
+	vlapic_file_logical_dest(vlapic);
 }
 
 static void
@@ -206,6 +366,7 @@ vlapic_write_ldr(struct acrn_vlapic *vlapic)
 	lapic = &(vlapic->apic_page);
 	lapic->ldr.v &= ~APIC_LDR_RESERVED;
 	dev_dbg(DBG_LEVEL_VLAPIC, "vlapic LDR set to %#x", lapic->ldr);
+	vlapic_file_logical_dest(vlapic);
 }
 
 static inline uint32_t
@@ -260,6 +421,17 @@ static void vlapic_init_timer(struct acrn_vlapic *vlapic)
 /**
  * @pre vlapic != NULL
  */
+/*
+ * Tell the guest the TSC deadline timer is not armed, so that it goes through
+ * IA32_TSC_DEADLINE for its next deadline.
+ */
+static inline void vlapic_pv_timer_disarmed(const struct acrn_vlapic *vlapic)
+{
+	if (vlapic->vtimer.pv_page != NULL) {
+		vlapic->vtimer.pv_page->armed = 0UL;
+	}
+}
+
 static void vlapic_reset_timer(struct acrn_vlapic *vlapic)
 {
 	struct hv_timer *timer;
@@ -267,6 +439,7 @@ static void vlapic_reset_timer(struct acrn_vlapic *vlapic)
 	timer = &vlapic->vtimer.timer;
 	del_timer(timer);
 	update_timer(timer, 0UL, 0UL);
+	vlapic_pv_timer_disarmed(vlapic);
 }
 
 static bool
@@ -309,6 +482,7 @@ static void vlapic_update_lvtt(struct acrn_vlapic *vlapic,
 		 */
 		del_timer(timer);
 		update_timer(timer, 0UL, 0UL);
+		vlapic_pv_timer_disarmed(vlapic);
 
 		vtimer->mode = timer_mode;
 	}
@@ -363,11 +537,14 @@ static void vlapic_write_icrtmr(struct acrn_vlapic *vlapic)
 	}
 }
 
-uint64_t vlapic_get_tsc_deadline_msr(const struct acrn_vlapic *vlapic)
+uint64_t vlapic_get_tsc_deadline_msr(struct acrn_vlapic *vlapic)
 {
 	uint64_t ret;
 	struct acrn_vcpu *vcpu = vlapic2vcpu(vlapic);
 
+	/* return the deadline the guest may have moved in its PV timer page */
+	vlapic_sync_pv_timer(vlapic);
+
 	if (is_lapic_pt_enabled(vcpu)) {
 		/* If physical TSC_DEADLINE is zero which means it's not armed (automatically disarmed
 		 * after timer triggered), return 0 and reset the virtual TSC_DEADLINE;
@@ -414,6 +591,10 @@ void vlapic_set_tsc_deadline_msr(struct acrn_vlapic *vlapic, uint64_t val_arg)
 		}
 	} else if (vlapic_lvtt_tsc_deadline(vlapic)) {
 		vcpu_set_guest_msr(vcpu, MSR_IA32_TSC_DEADLINE, val);
+		if (vlapic->vtimer.pv_page != NULL) {
+			vlapic->vtimer.pv_page->deadline = val;
+			vlapic->vtimer.pv_page->armed = val;
+		}
 
 		timer = &vlapic->vtimer.timer;
 		del_timer(timer);
@@ -445,12 +626,22 @@ vlapic_write_esr(struct acrn_vlapic *vlapic)
 	vlapic->esr_pending = 0U;
 }
 
+/*
+ * With the EOI broadcast suppressed (SVR bit 12), the guest EOIs the vIOAPIC
+ * through its EOI register, so no LAPIC EOI needs to reach the vIOAPIC.
+ */
+static inline bool is_eoi_broadcast_suppressed(const struct acrn_vlapic *vlapic)
+{
+	return ((vlapic->apic_page.svr.v & APIC_SVR_EOI_SUPPRESSION) != 0U);
+}
+
 static void
 vlapic_set_tmr(struct acrn_vlapic *vlapic, uint32_t vector, bool level)
 {
 	struct lapic_reg *tmrptr = &(vlapic->apic_page.tmr[0]);
 	if (level) {
-		if (!bitmap32_test_and_set_lock((uint16_t)(vector & 0x1fU), &tmrptr[(vector & 0xffU) >> 5U].v)) {
+		if (!bitmap32_test_and_set_lock((uint16_t)(vector & 0x1fU), &tmrptr[(vector & 0xffU) >> 5U].v) &&
+				!is_eoi_broadcast_suppressed(vlapic)) {
 			vcpu_set_eoi_exit_bitmap(vlapic2vcpu(vlapic), vector);
 		}
 	} else {
@@ -477,6 +668,25 @@ vlapic_reset_tmr(struct acrn_vlapic *vlapic)
 	vcpu_reset_eoi_exit_bitmaps(vlapic2vcpu(vlapic));
 }
 
+/* the EOIs of the level triggered vectors exit only while they are broadcast */
+static void
+vlapic_update_eoi_exit(struct acrn_vlapic *vlapic)
+{
+	struct lapic_reg *tmrptr = &(vlapic->apic_page.tmr[0]);
+	struct acrn_vcpu *vcpu = vlapic2vcpu(vlapic);
+	uint32_t vector;
+
+	for (vector = 0U; vector < 256U; vector++) {
+		if (bitmap32_test((uint16_t)(vector & 0x1fU), &tmrptr[vector >> 5U].v)) {
+			if (is_eoi_broadcast_suppressed(vlapic)) {
+				vcpu_clear_eoi_exit_bitmap(vcpu, vector);
+			} else {
+				vcpu_set_eoi_exit_bitmap(vcpu, vector);
+			}
+		}
+	}
+}
+
 static void apicv_basic_accept_intr(struct acrn_vlapic *vlapic, uint32_t vector, bool level)
 {
 	struct lapic_regs *lapic;
@@ -511,10 +721,15 @@ static void apicv_advanced_accept_intr(struct acrn_vlapic *vlapic, uint32_t vect
 		 * 2. If target vCPU is in non-root mode(running),
 		 *    send PI notification to vCPU and hardware will
 		 *    sync PIR to vIRR automatically.
+		 * Only the first vector posted since the PIR was last synced
+		 * gets here, the later ones ride on the same notification.
+		 * Neither is needed while the vCPU is preempted, it syncs the
+		 * PIR when switched back in, see pi_switch_in().
 		 */
 		bitmap_set_lock(ACRN_REQUEST_EVENT, &vcpu->arch.pending_req);
 
-		if (get_pcpu_id() != pcpuid_from_vcpu(vcpu)) {
+		if ((get_pcpu_id() != pcpuid_from_vcpu(vcpu)) &&
+				!bitmap_test(POSTED_INTR_SN, &(vcpu->arch.pid.control.value))) {
 			apicv_trigger_pi_anv(pcpuid_from_vcpu(vcpu), (uint32_t)vcpu->arch.pid.control.bits.nv);
 		}
 	}
@@ -526,6 +741,7 @@ static void apicv_advanced_accept_intr(struct acrn_vlapic *vlapic, uint32_t vect
 static void vlapic_accept_intr(struct acrn_vlapic *vlapic, uint32_t vector, bool level)
 {
 	struct lapic_regs *lapic;
+	struct acrn_vcpu *vcpu = vlapic2vcpu(vlapic);
 	ASSERT(vector <= NR_MAX_VECTOR, "invalid vector %u", vector);
 
 	lapic = &(vlapic->apic_page);
@@ -533,7 +749,11 @@ static void vlapic_accept_intr(struct acrn_vlapic *vlapic, uint32_t vector, bool
 		dev_dbg(DBG_LEVEL_VLAPIC, "vlapic is software disabled, ignoring interrupt %u", vector);
 	} else {
 		vlapic->ops->accept_intr(vlapic, vector, level);
-		signal_event(&vlapic2vcpu(vlapic)->events[VCPU_EVENT_VIRTUAL_INTERRUPT]);
+		/* the next ACRN_MSR_LAT_ACK acks the first interrupt posted since the last one */
+		if (lat_probe_enabled(&vcpu->vm->lat_probe) && (vcpu->lat_post_tsc == 0UL)) {
+			vcpu->lat_post_tsc = cpu_ticks();
+		}
+		signal_event(&vcpu->events[VCPU_EVENT_VIRTUAL_INTERRUPT]);
 	}
 }
 
@@ -816,13 +1036,12 @@ vlapic_process_eoi(struct acrn_vlapic *vlapic)
 		vlapic->isrv = vlapic_find_isrv(vlapic);
 		vlapic_update_ppr(vlapic);
 
-		if (bitmap32_test((uint16_t)bitpos, &tmrptr[i].v)) {
-			/*
-			 * Per Intel SDM 10.8.5, Software can inhibit the broadcast of
-			 * EOI by setting bit 12 of the Spurious Interrupt Vector
-			 * Register of the LAPIC.
-			 * TODO: Check if the bit 12 "Suppress EOI Broadcasts" is set.
-			 */
+		/*
+		 * Per Intel SDM 10.8.5, Software can inhibit the broadcast of
+		 * EOI by setting bit 12 of the Spurious Interrupt Vector
+		 * Register of the LAPIC.
+		 */
+		if (bitmap32_test((uint16_t)bitpos, &tmrptr[i].v) && !is_eoi_broadcast_suppressed(vlapic)) {
 			vioapic_broadcast_eoi(vlapic2vcpu(vlapic)->vm, vector);
 		}
 
@@ -998,9 +1217,8 @@ uint64_t
 vlapic_calc_dest_noshort(struct acrn_vm *vm, bool is_broadcast,
 		uint32_t dest, bool phys, bool lowprio)
 {
-	uint64_t dmask = 0UL;
+	uint64_t dmask = 0UL, candidates;
 	struct acrn_vlapic *vlapic, *lowprio_dest = NULL;
-	struct acrn_vcpu *vcpu;
 	uint16_t vcpu_id;
 
 	if (is_broadcast) {
@@ -1014,9 +1232,12 @@ vlapic_calc_dest_noshort(struct acrn_vm *vm, bool is_broadcast,
 		 * Logical mode: "dest" is message destination addr
 		 * to be compared with the logical APIC ID in LDR.
 		 */
-		foreach_vcpu(vcpu_id, vm, vcpu) {
+		candidates = vlapic_logical_dest_candidates(vm, dest);
+		while (candidates != 0UL) {
+			vcpu_id = ffs64(candidates);
+			bitmap_clear_nolock(vcpu_id, &candidates);
 			vlapic = vm_lapic_from_vcpu_id(vm, vcpu_id);
-			if (!is_dest_field_matched(vlapic, dest)) {
+			if (!is_dest_vcpu_valid(vm, vcpu_id) || !is_dest_field_matched(vlapic, dest)) {
 				continue;
 			}
 
@@ -1197,6 +1418,42 @@ static void vlapic_write_icrlo(struct acrn_vlapic *vlapic)
 	}
 }
 
+/*
+ * Deliver a fixed or NMI IPI from vcpu to each vCPU whose APIC ID is
+ * base_apicid plus the index of a bit set in apicids, as HC_SEND_IPI does.
+ * APIC IDs without a vCPU are skipped, like physical destinations of the ICR.
+ */
+int32_t vlapic_send_ipi_mask(struct acrn_vcpu *vcpu, uint32_t icr_low, uint32_t base_apicid, uint64_t apicids)
+{
+	uint32_t vec = icr_low & APIC_VECTOR_MASK;
+	uint32_t mode = icr_low & APIC_DELMODE_MASK;
+	uint64_t pending = apicids;
+	uint64_t apic_id;
+	uint16_t i, vcpu_id;
+	int32_t ret = 0;
+
+	if (((mode != APIC_DELMODE_FIXED) && (mode != APIC_DELMODE_NMI)) ||
+			((mode == APIC_DELMODE_FIXED) && (vec < 16U))) {
+		ret = -EINVAL;
+	} else {
+		while (pending != 0UL) {
+			i = ffs64(pending);
+			bitmap_clear_nolock(i, &pending);
+			apic_id = (uint64_t)base_apicid + i;
+			vcpu_id = (apic_id <= UINT32_MAX) ? vlapic_lookup_apicid(vcpu->vm, (uint32_t)apic_id) : INVALID_CPU_ID;
+			if (vcpu_id != INVALID_CPU_ID) {
+				if (mode == APIC_DELMODE_FIXED) {
+					vlapic_set_intr(vcpu_from_vid(vcpu->vm, vcpu_id), vec, LAPIC_TRIG_EDGE);
+				} else {
+					vcpu_inject_nmi(vcpu_from_vid(vcpu->vm, vcpu_id));
+				}
+			}
+		}
+	}
+
+	return ret;
+}
+
 static inline uint32_t vlapic_find_highest_irr(const struct acrn_vlapic *vlapic)
 {
 	const struct lapic_regs *lapic = &(vlapic->apic_page);
@@ -1291,6 +1548,63 @@ static void vlapic_get_deliverable_intr(struct acrn_vlapic *vlapic, uint32_t vec
 	vlapic_update_ppr(vlapic);
 }
 
+/*
+ * Lazy EOI, the APIC assist of Hyper-V and the PV EOI of KVM: when the vector
+ * injected is the only one in service, it is edge triggered and no other is
+ * requested, bit 0 of *lazy_eoi is set and the guest may clear it in place of
+ * writing the EOI.
+ * The EOI is then done here before the vLAPIC state is looked at again.
+ * keep is false when the guest has to write the EOI if it didn't clear it yet,
+ * as the vector in service holds back another one.
+ */
+static void vlapic_sync_lazy_eoi(struct acrn_vlapic *vlapic, bool keep)
+{
+	uint32_t flag;
+
+	if (vlapic->lazy_eoi_pending) {
+		stac();
+		flag = *vlapic->lazy_eoi;
+		if (((flag & 1U) != 0U) && !keep) {
+			*vlapic->lazy_eoi = flag & ~1U;
+		}
+		clac();
+
+		if ((flag & 1U) == 0U) {
+			vlapic->lazy_eoi_pending = false;
+			vlapic_process_eoi(vlapic);
+		} else if (!keep) {
+			vlapic->lazy_eoi_pending = false;
+		} else {
+			/* the vector is still in service */
+		}
+	}
+}
+
+/*
+ * @pre vlapic->isrv == vector
+ */
+static void vlapic_offer_lazy_eoi(struct acrn_vlapic *vlapic, uint32_t vector, bool nested)
+{
+	const struct lapic_reg *tmrptr = &vlapic->apic_page.tmr[0];
+
+	if ((vlapic->lazy_eoi != NULL) && !nested && (vlapic_find_highest_irr(vlapic) == 0U) &&
+			!bitmap32_test((uint16_t)(vector & 0x1fU), &tmrptr[vector >> 5U].v)) {
+		stac();
+		*vlapic->lazy_eoi |= 1U;
+		clac();
+		vlapic->lazy_eoi_pending = true;
+	}
+}
+
+/*
+ * @pre vlapic != NULL
+ */
+void vlapic_set_lazy_eoi(struct acrn_vlapic *vlapic, uint32_t *flag)
+{
+	vlapic_sync_lazy_eoi(vlapic, false);
+	vlapic->lazy_eoi = flag;
+}
+
 static void
 vlapic_write_svr(struct acrn_vlapic *vlapic)
 {
@@ -1313,6 +1627,7 @@ vlapic_write_svr(struct acrn_vlapic *vlapic)
 			 */
 			dev_dbg(DBG_LEVEL_VLAPIC, "vlapic is software-disabled");
 			del_timer(&vlapic->vtimer.timer);
+			vlapic_pv_timer_disarmed(vlapic);
 
 			vlapic_mask_lvts(vlapic);
 			/* the only one enabled LINT0-ExtINT vlapic disabled */
@@ -1338,6 +1653,10 @@ vlapic_write_svr(struct acrn_vlapic *vlapic)
 			}
 		}
 	}
+
+	if ((changed & APIC_SVR_EOI_SUPPRESSION) != 0U) {
+		vlapic_update_eoi_exit(vlapic);
+	}
 }
 
 static int32_t vlapic_read(struct acrn_vlapic *vlapic, uint32_t offset_arg, uint64_t *data)
@@ -1348,6 +1667,8 @@ static int32_t vlapic_read(struct acrn_vlapic *vlapic, uint32_t offset_arg, uint
 	uint32_t offset = offset_arg;
 	*data = 0UL;
 
+	vlapic_sync_lazy_eoi(vlapic, true);
+
 	if (offset > sizeof(*lapic)) {
 		ret = -EACCES;
 	} else {
@@ -1466,6 +1787,7 @@ static int32_t vlapic_write(struct acrn_vlapic *vlapic, uint32_t offset, uint64_
 
 	dev_dbg(DBG_LEVEL_VLAPIC, "vlapic write offset %#x, data %#lx", offset, data);
 
+	vlapic_sync_lazy_eoi(vlapic, true);
 	if (offset <= sizeof(*lapic)) {
 		switch (offset) {
 		case APIC_OFFSET_ID:
@@ -1582,7 +1904,7 @@ vlapic_reset(struct acrn_vlapic *vlapic, const struct acrn_apicv_ops *ops, enum
 			lapic->id.v <<= APIC_ID_SHIFT;
 		}
 	}
-	lapic->version.v = VLAPIC_VERSION;
+	lapic->version.v = VLAPIC_VERSION | APIC_VER_EOI_SUPPRESSION;
 	lapic->version.v |= (VLAPIC_MAXLVT_INDEX << MAXLVTSHIFT);
 	lapic->dfr.v = 0xffffffffU;
 	lapic->svr.v = APIC_SVR_VECTOR;
@@ -1593,12 +1915,18 @@ vlapic_reset(struct acrn_vlapic *vlapic, const struct acrn_apicv_ops *ops, enum
 	lapic->dcr_timer.v = 0U;
 	vlapic_write_dcr(vlapic);
 	vlapic_reset_timer(vlapic);
+	/* the guest registers these again once it is up */
+	vlapic->vtimer.pv_page = NULL;
+	vlapic->lazy_eoi = NULL;
+	vlapic->lazy_eoi_pending = false;
 
 	vlapic->svr_last = lapic->svr.v;
 
 	vlapic->isrv = 0U;
 
 	vlapic->ops = ops;
+
+	vlapic_file_logical_dest(vlapic);
 }
 
 void vlapic_restore(struct acrn_vlapic *vlapic, const struct lapic_regs *regs)
@@ -1626,6 +1954,104 @@ void vlapic_restore(struct acrn_vlapic *vlapic, const struct lapic_regs *regs)
 	lapic->ccr_timer = regs->ccr_timer;
 	lapic->dcr_timer = regs->dcr_timer;
 	vlapic_write_dcr(vlapic);
+	vlapic_file_logical_dest(vlapic);
+}
+
+static uint32_t lapic_state_reg(const uint8_t *regs, uint32_t offset)
+{
+	uint32_t val;
+
+	(void)memcpy_s(&val, sizeof(val), &regs[offset], sizeof(val));
+	return val;
+}
+
+static void lapic_state_set_reg(uint8_t *regs, uint32_t offset, uint32_t val)
+{
+	(void)memcpy_s(&regs[offset], sizeof(val), &val, sizeof(val));
+}
+
+/**
+ * @brief Save the vLAPIC of a paused vCPU
+ *
+ * The registers are saved at their offsets in the xAPIC page, the pending
+ * posted interrupts in the IRR and the current count of the timer in the CCR.
+ *
+ * @pre regs has ACRN_VCPU_STATE_LAPIC_SIZE bytes
+ * @pre the vCPU is not running
+ */
+void vlapic_get_state(struct acrn_vlapic *vlapic, uint8_t *regs, uint64_t *tsc_deadline)
+{
+	const struct pi_desc *pid = get_pi_desc(vlapic2vcpu(vlapic));
+	uint32_t i, irr;
+
+	(void)memcpy_s(regs, ACRN_VCPU_STATE_LAPIC_SIZE, &vlapic->apic_page, ACRN_VCPU_STATE_LAPIC_SIZE);
+	for (i = 0U; i < 8U; i++) {
+		irr = lapic_state_reg(regs, (uint32_t)offsetof(struct lapic_regs, irr) + (i * 16U));
+		irr |= (uint32_t)(pid->pir[i >> 1U] >> ((i & 1U) * 32U));
+		lapic_state_set_reg(regs, (uint32_t)offsetof(struct lapic_regs, irr) + (i * 16U), irr);
+	}
+	lapic_state_set_reg(regs, (uint32_t)offsetof(struct lapic_regs, ccr_timer), vlapic_get_ccr(vlapic));
+	*tsc_deadline = vlapic_get_tsc_deadline_msr(vlapic);
+}
+
+/**
+ * @brief Load the vLAPIC of a vCPU not launched yet from its saved state
+ *
+ * The pending interrupts are accepted again, the in-service ones are dropped:
+ * the guest takes them from its restored stack as the state was saved at an
+ * instruction boundary. The timer is armed by vlapic_restore_timer.
+ *
+ * @pre regs has ACRN_VCPU_STATE_LAPIC_SIZE bytes
+ */
+void vlapic_set_state(struct acrn_vlapic *vlapic, const uint8_t *regs)
+{
+	struct lapic_regs *lapic = &(vlapic->apic_page);
+	struct acrn_vcpu *vcpu = vlapic2vcpu(vlapic);
+	uint32_t i, irr, tmr, bit;
+
+	lapic->tpr.v = lapic_state_reg(regs, (uint32_t)offsetof(struct lapic_regs, tpr));
+	lapic->apr.v = lapic_state_reg(regs, (uint32_t)offsetof(struct lapic_regs, apr));
+	lapic->ppr.v = lapic_state_reg(regs, (uint32_t)offsetof(struct lapic_regs, ppr));
+	lapic->ldr.v = lapic_state_reg(regs, (uint32_t)offsetof(struct lapic_regs, ldr));
+	lapic->dfr.v = lapic_state_reg(regs, (uint32_t)offsetof(struct lapic_regs, dfr));
+	lapic->svr.v = lapic_state_reg(regs, (uint32_t)offsetof(struct lapic_regs, svr));
+	vlapic_write_svr(vlapic);
+	for (i = APIC_LVT_TIMER; i <= APIC_LVT_ERROR; i++) {
+		lapic->lvt[i].v = lapic_state_reg(regs, (uint32_t)offsetof(struct lapic_regs, lvt) + (i * 16U));
+	}
+	lapic->lvt_cmci.v = lapic_state_reg(regs, (uint32_t)offsetof(struct lapic_regs, lvt_cmci));
+	vlapic_update_lvtt(vlapic, lapic->lvt[APIC_LVT_TIMER].v);
+	lapic->icr_timer.v = lapic_state_reg(regs, (uint32_t)offsetof(struct lapic_regs, icr_timer));
+	lapic->dcr_timer.v = lapic_state_reg(regs, (uint32_t)offsetof(struct lapic_regs, dcr_timer));
+	vlapic_write_dcr(vlapic);
+	vlapic_file_logical_dest(vlapic);
+
+	for (i = 0U; i < 8U; i++) {
+		irr = lapic_state_reg(regs, (uint32_t)offsetof(struct lapic_regs, irr) + (i * 16U));
+		tmr = lapic_state_reg(regs, (uint32_t)offsetof(struct lapic_regs, tmr) + (i * 16U));
+		while (irr != 0U) {
+			bit = (uint32_t)ffs64((uint64_t)irr);
+			irr &= ~(1U << bit);
+			vlapic_set_intr(vcpu, (i * 32U) + bit, (tmr & (1U << bit)) != 0U);
+		}
+	}
+}
+
+/**
+ * @brief Arm the timer of a restored vLAPIC
+ *
+ * The TSC deadline is in guest TSC, so the TSC offset of the vCPU has to be
+ * restored first. A one-shot or periodic timer restarts its initial count.
+ */
+void vlapic_restore_timer(struct acrn_vlapic *vlapic, uint64_t tsc_deadline)
+{
+	if (vlapic_lvtt_tsc_deadline(vlapic)) {
+		vlapic_set_tsc_deadline_msr(vlapic, tsc_deadline);
+	} else if (vlapic->apic_page.icr_timer.v != 0U) {
+		vlapic_write_icrtmr(vlapic);
+	} else {
+		/* no action: the timer is stopped */
+	}
 }
 
 uint64_t vlapic_get_apicbase(const struct acrn_vlapic *vlapic)
@@ -1975,6 +2401,82 @@ int32_t vlapic_inject_msi(struct acrn_vm *vm, uint64_t addr, uint64_t data)
 	return ret;
 }
 
+/*
+ * @pre vlapic != NULL
+ */
+void vlapic_set_pv_timer_page(struct acrn_vlapic *vlapic, struct acrn_pv_timer_page *page)
+{
+	struct acrn_vcpu *vcpu = vlapic2vcpu(vlapic);
+
+	vlapic->vtimer.pv_page = page;
+	if (page != NULL) {
+		page->deadline = vcpu_get_guest_msr(vcpu, MSR_IA32_TSC_DEADLINE);
+		page->armed = (vlapic_lvtt_tsc_deadline(vlapic) && timer_is_started(&vlapic->vtimer.timer)) ?
+			page->deadline : 0UL;
+	}
+}
+
+/*
+ * Re-arm the TSC deadline timer for the deadline in the PV timer page if the
+ * guest moved it later or disarmed it there. The guest traps for any earlier
+ * deadline, so the armed one is never too late.
+ *
+ * @pre vlapic != NULL
+ */
+void vlapic_sync_pv_timer(struct acrn_vlapic *vlapic)
+{
+	struct acrn_pv_timer_page *page = vlapic->vtimer.pv_page;
+	uint64_t armed, deadline;
+
+	if ((page != NULL) && vlapic_lvtt_tsc_deadline(vlapic) && (page->armed != 0UL)) {
+		armed = page->armed;
+		deadline = page->deadline;
+		if ((deadline == 0UL) || (deadline > armed)) {
+			vlapic_set_tsc_deadline_msr(vlapic, deadline);
+		}
+	}
+}
+
+/*
+ * The timer is hit at the deadline it was armed for: follow the guest to a
+ * later deadline or a disarm in its PV timer page in place of injecting the
+ * interrupt. VMCS of the vCPU may not be loaded here, so the host TSC to
+ * re-arm at comes from the TSC timeout of the timer and the guest deadlines.
+ *
+ * Return true if there is no interrupt to inject.
+ *
+ * interrupt context, on the pCPU the timer was added on
+ */
+static bool vlapic_pv_timer_deferred(struct acrn_vlapic *vlapic)
+{
+	struct acrn_vcpu *vcpu = vlapic2vcpu(vlapic);
+	struct acrn_pv_timer_page *page = vlapic->vtimer.pv_page;
+	struct hv_timer *timer = &vlapic->vtimer.timer;
+	uint64_t armed, deadline;
+	bool deferred = false;
+
+	if ((page != NULL) && vlapic_lvtt_tsc_deadline(vlapic)) {
+		armed = vcpu_get_guest_msr(vcpu, MSR_IA32_TSC_DEADLINE);
+		deadline = page->deadline;
+		if (deadline == 0UL) {
+			vcpu_set_guest_msr(vcpu, MSR_IA32_TSC_DEADLINE, 0UL);
+			page->armed = 0UL;
+			deferred = true;
+		} else if (deadline > armed) {
+			vcpu_set_guest_msr(vcpu, MSR_IA32_TSC_DEADLINE, deadline);
+			page->armed = deadline;
+			/* timer_softirq() keeps the timeout of a one-shot timer re-added by its callback */
+			update_timer(timer, timer->timeout + (deadline - armed), 0UL);
+			(void)add_timer(timer);
+			deferred = true;
+		} else {
+			page->armed = 0UL;
+		}
+	}
+
+	return deferred;
+}
+
 /* interrupt context */
 static void vlapic_timer_expired(void *data)
 {
@@ -1986,8 +2488,12 @@ static void vlapic_timer_expired(void *data)
 	lapic = &(vlapic->apic_page);
 
 	/* inject vcpu timer interrupt if not masked */
-	if (!vlapic_lvtt_masked(vlapic)) {
+	if (!vlapic_pv_timer_deferred(vlapic) && !vlapic_lvtt_masked(vlapic)) {
 		vlapic_set_intr(vcpu, lapic->lvt[APIC_LVT_TIMER].v & APIC_LVTT_VECTOR, LAPIC_TRIG_EDGE);
+		if (lat_probe_enabled(&vcpu->vm->lat_probe)) {
+			lat_probe_record(&vcpu->vm->lat_probe, ACRN_LAT_TIMER,
+					cpu_ticks() - vlapic->vtimer.timer.timeout);
+		}
 	}
 }
 
@@ -2178,6 +2684,48 @@ int32_t vlapic_x2apic_write(struct acrn_vcpu *vcpu, uint32_t msr, uint64_t val)
 	return error;
 }
 
+/*
+ * EOI, ICR and TPR accesses through paravirtual MSRs such as HV_X64_MSR_EOI.
+ * They take the value of the x2APIC MSR given, whatever the vLAPIC mode is,
+ * so the ICR is one 64 bits value in xAPIC mode too.
+ *
+ * @pre vlapic != NULL
+ * @pre msr is MSR_IA32_EXT_APIC_EOI, MSR_IA32_EXT_APIC_ICR or MSR_IA32_EXT_APIC_TPR
+ */
+int32_t vlapic_pv_msr_read(struct acrn_vlapic *vlapic, uint32_t msr, uint64_t *val)
+{
+	uint32_t offset = x2apic_msr_to_regoff(msr);
+	uint64_t high;
+	int32_t ret;
+
+	ret = vlapic_read(vlapic, offset, val);
+	if ((ret == 0) && (offset == APIC_OFFSET_ICR_LOW) && !is_x2apic_enabled(vlapic)) {
+		ret = vlapic_read(vlapic, APIC_OFFSET_ICR_HI, &high);
+		*val |= high << 32U;
+	}
+
+	return ret;
+}
+
+/*
+ * @pre vlapic != NULL
+ * @pre msr is MSR_IA32_EXT_APIC_EOI, MSR_IA32_EXT_APIC_ICR or MSR_IA32_EXT_APIC_TPR
+ */
+int32_t vlapic_pv_msr_write(struct acrn_vlapic *vlapic, uint32_t msr, uint64_t val)
+{
+	uint32_t offset = x2apic_msr_to_regoff(msr);
+	int32_t ret = 0;
+
+	if ((offset == APIC_OFFSET_ICR_LOW) && !is_x2apic_enabled(vlapic)) {
+		ret = vlapic_write(vlapic, APIC_OFFSET_ICR_HI, val >> 32U);
+	}
+	if (ret == 0) {
+		ret = vlapic_write(vlapic, offset, val);
+	}
+
+	return ret;
+}
+
 /**
  *  @pre vcpu != NULL
  */
@@ -2204,6 +2752,9 @@ void vlapic_create(struct acrn_vcpu *vcpu, uint16_t pcpu_id)
 
 	/* Set vLAPIC ID to be same as pLAPIC ID */
 	vlapic->vapic_id = per_cpu(lapic_id, pcpu_id);
+	vlapic_hash_apicid(vlapic);
+	vlapic->filed_model = VLAPIC_DEST_NONE;
+	vlapic->filed_ldr = 0U;
 
 	dev_dbg(DBG_LEVEL_VLAPIC, "vlapic APIC ID : 0x%04x", vlapic->vapic_id);
 }
@@ -2263,12 +2814,16 @@ static void apicv_basic_inject_intr(struct acrn_vlapic *vlapic,
 		bool guest_irq_enabled, bool injected)
 {
 	uint32_t vector = 0U;
+	bool nested;
 
+	vlapic_sync_lazy_eoi(vlapic, vlapic_find_highest_irr(vlapic) == 0U);
 	if (guest_irq_enabled && (!injected)) {
 		vlapic_update_ppr(vlapic);
 		if (vlapic_find_deliverable_intr(vlapic, &vector)) {
 			exec_vmwrite32(VMX_ENTRY_INT_INFO_FIELD, VMX_INT_INFO_VALID | vector);
+			nested = (vlapic->isrv != 0U);
 			vlapic_get_deliverable_intr(vlapic, vector);
+			vlapic_offer_lazy_eoi(vlapic, vector, nested);
 		}
 	}
 
@@ -2467,7 +3022,7 @@ int32_t veoi_vmexit_handler(struct acrn_vcpu *vcpu)
 	tmrptr = &lapic->tmr[0];
 	idx = vector >> 5U;
 
-	if (bitmap32_test((uint16_t)(vector & 0x1fU), &tmrptr[idx].v)) {
+	if (bitmap32_test((uint16_t)(vector & 0x1fU), &tmrptr[idx].v) && !is_eoi_broadcast_suppressed(vlapic)) {
 		/* hook to vIOAPIC */
 		vioapic_broadcast_eoi(vcpu->vm, vector);
 	}
@@ -2522,6 +3077,13 @@ int32_t apic_write_vmexit_handler(struct acrn_vcpu *vcpu)
 		vlapic_write_esr(vlapic);
 		break;
 	case APIC_OFFSET_ICR_LOW:
+		/*
+		 * An x2APIC ICR write gets here when IPI virtualization passes
+		 * the MSR through, the CPU then stores all 64 bits at offset 300H.
+		 */
+		if (is_x2apic_enabled(vlapic)) {
+			vlapic->apic_page.icr_hi.v = vlapic->apic_page.icr_lo.pad[0];
+		}
 		vlapic_write_icrlo(vlapic);
 		break;
 	case APIC_OFFSET_CMCI_LVT:
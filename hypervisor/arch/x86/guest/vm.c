@@ -10,10 +10,12 @@
 #include <asm/per_cpu.h>
 #include <asm/lapic.h>
 #include <asm/guest/vm.h>
+#include <asm/host_pm.h>
 #include <asm/guest/vm_reset.h>
 #include <asm/guest/virq.h>
 #include <asm/lib/bits.h>
 #include <asm/e820.h>
+#include <asm/rdt.h>
 #include <boot.h>
 #include <asm/vtd.h>
 #include <reloc.h>
@@ -44,6 +46,8 @@
 #endif
 #include <asm/boot/ld_sym.h>
 #include <asm/guest/optee.h>
+#include <ticks.h>
+#include <vm_event.h>
 
 /* Local variables */
 
@@ -233,6 +237,84 @@ bool is_vtm_configured(const struct acrn_vm *vm)
 	return ((vm_config->guest_flags & GUEST_FLAG_VTM) != 0U);
 }
 
+/**
+ * @pre vm != NULL && vm_config != NULL && vm->vmid < CONFIG_MAX_VM_NUM
+ */
+bool is_dirty_log_configured(const struct acrn_vm *vm)
+{
+	struct acrn_vm_config *vm_config = get_vm_config(vm->vm_id);
+
+	return ((vm_config->guest_flags & GUEST_FLAG_DIRTY_LOG) != 0U);
+}
+
+/**
+ * @pre vm != NULL && vm_config != NULL && vm->vmid < CONFIG_MAX_VM_NUM
+ */
+bool is_pv_ipi_configured(const struct acrn_vm *vm)
+{
+	struct acrn_vm_config *vm_config = get_vm_config(vm->vm_id);
+
+	return ((vm_config->guest_flags & GUEST_FLAG_PV_IPI) != 0U);
+}
+
+/**
+ * @pre vm != NULL && vm_config != NULL && vm->vmid < CONFIG_MAX_VM_NUM
+ */
+bool is_pv_timer_configured(const struct acrn_vm *vm)
+{
+	struct acrn_vm_config *vm_config = get_vm_config(vm->vm_id);
+
+	return ((vm_config->guest_flags & GUEST_FLAG_PV_TIMER) != 0U);
+}
+
+/**
+ * @pre vm != NULL && vm_config != NULL && vm->vmid < CONFIG_MAX_VM_NUM
+ *
+ * The Service VM keeps its ACRN guest support, the KVM leaves would take
+ * precedence over it in Linux.
+ */
+bool is_pv_clock_configured(const struct acrn_vm *vm)
+{
+	struct acrn_vm_config *vm_config = get_vm_config(vm->vm_id);
+
+	return (((vm_config->guest_flags & GUEST_FLAG_PV_CLOCK) != 0U) && !is_service_vm(vm));
+}
+
+/**
+ * @pre vm != NULL && vm_config != NULL && vm->vmid < CONFIG_MAX_VM_NUM
+ */
+bool is_idle_pt_configured(const struct acrn_vm *vm)
+{
+	struct acrn_vm_config *vm_config = get_vm_config(vm->vm_id);
+
+	return ((vm_config->guest_flags & GUEST_FLAG_IDLE_PT) != 0U);
+}
+
+/**
+ * The vPMU is for VMs the hypervisor delivers the PMIs to, and which do not
+ * have the PMU passed through.
+ *
+ * @pre vm != NULL && vm_config != NULL && vm->vmid < CONFIG_MAX_VM_NUM
+ */
+bool is_vpmu_configured(const struct acrn_vm *vm)
+{
+	struct acrn_vm_config *vm_config = get_vm_config(vm->vm_id);
+
+	return (((vm_config->guest_flags & GUEST_FLAG_VPMU) != 0U) &&
+			!is_pmu_pt_configured(vm) && !is_lapic_pt_configured(vm));
+}
+
+/**
+ * MONITOR/MWAIT can only be given to the VM when the hypervisor did not have
+ * to turn them off, see disable_host_monitor_wait().
+ *
+ * @pre vm != NULL && vm_config != NULL && vm->vmid < CONFIG_MAX_VM_NUM
+ */
+bool is_mwait_pt_configured(const struct acrn_vm *vm)
+{
+	return (is_idle_pt_configured(vm) && has_monitor_cap());
+}
+
 /**
  * @brief VT-d PI posted mode can possibly be used for PTDEVs assigned
  * to this VM if platform supports VT-d PI AND lapic passthru is not configured
@@ -695,6 +777,8 @@ int32_t create_vm(uint16_t vm_id, uint64_t pcpu_bitmap, struct acrn_vm_config *v
 	vm = &vm_array[vm_id];
 	vm->vm_id = vm_id;
 	vm->hw.created_vcpus = 0U;
+	vm->create_tsc = cpu_ticks();
+	vm->startup_reported = false;
 
 	init_ept_pgtable(&vm->arch_vm.ept_pgtable, vm->vm_id);
 	vm->arch_vm.nworld_eptp = pgtable_create_root(&vm->arch_vm.ept_pgtable);
@@ -754,10 +838,32 @@ int32_t create_vm(uint16_t vm_id, uint64_t pcpu_bitmap, struct acrn_vm_config *v
 		spinlock_init(&vm->ept_lock);
 		spinlock_init(&vm->emul_mmio_lock);
 		spinlock_init(&vm->arch_vm.iwkey_backup_lock);
+		io_hotspot_init(&vm->io_hotspots);
+		lock_sites_init(&vm->lock_sites);
+		lat_probe_init(&vm->lat_probe);
+		tsc_counter_init(&vm->tsc_counter);
+		init_vm_freq_policy(vm);
+		reset_vm_rdt_mon(vm_id);
+		reset_ssram_share(vm_id);
 
 		vm->arch_vm.vlapic_mode = VM_VLAPIC_XAPIC;
+		(void)memset((void *)vm->arch_vm.pid_table, 0U, sizeof(vm->arch_vm.pid_table));
+		/* LAPIC passthrough disables posted interrupts on the switch to x2APIC */
+		vm->arch_vm.ipiv_enabled = is_ipiv_supported() && !is_lapic_pt_configured(vm);
+		(void)memset((void *)vm->arch_vm.vlapic_apicid_hash, 0xFFU, sizeof(vm->arch_vm.vlapic_apicid_hash));
+		(void)memset((void *)vm->arch_vm.vlapic_flat_dest, 0U, sizeof(vm->arch_vm.vlapic_flat_dest));
+		(void)memset((void *)vm->arch_vm.vlapic_cluster_dest, 0U, sizeof(vm->arch_vm.vlapic_cluster_dest));
+		vm->arch_vm.vlapic_other_dest = 0UL;
+		seqcount_init(&vm->arch_vm.vlapic_dest_seq);
+		spinlock_init(&vm->arch_vm.vlapic_dest_lock);
 		vm->intr_inject_delay_delta = 0UL;
 		vm->nr_emul_mmio_regions = 0U;
+		vm->nr_emul_mmio_index = 0U;
+		vm->emul_mmio_overlap = false;
+		seqcount_init(&vm->emul_mmio_seq);
+		spinlock_init(&vm->asyncio_lock);
+		seqcount_init(&vm->asyncio_seq);
+		reset_asyncio(vm);
 		vm->vcpuid_entry_nr = 0U;
 
 		/* Set up IO bit-mask such that VM exit occurs on
@@ -812,6 +918,8 @@ int32_t create_vm(uint16_t vm_id, uint64_t pcpu_bitmap, struct acrn_vm_config *v
 			*rtn_vm = vm;
 			vm->sw.io_shared_page = NULL;
 			vm->sw.asyncio_sbuf = NULL;
+			vm->sw.coalesced_mmio_sbuf = NULL;
+			(void)memset(&vm->lazy_mem, 0U, sizeof(vm->lazy_mem));
 			if ((vm_config->load_order == POST_LAUNCHED_VM)
 				&& ((vm_config->guest_flags & GUEST_FLAG_IO_COMPLETION_POLLING) != 0U)) {
 				/* enable IO completion polling mode per its guest flags in vm_config. */
@@ -857,6 +965,7 @@ int32_t create_vm(uint16_t vm_id, uint64_t pcpu_bitmap, struct acrn_vm_config *v
 	if ((status != 0) && (vm->arch_vm.nworld_eptp != NULL)) {
 		(void)memset(vm->arch_vm.nworld_eptp, 0U, PAGE_SIZE);
 	}
+	vm->created_tsc = cpu_ticks();
 
 	return status;
 }
@@ -981,14 +1090,45 @@ int32_t shutdown_vm(struct acrn_vm *vm)
  */
 void start_vm(struct acrn_vm *vm)
 {
-	struct acrn_vcpu *bsp = NULL;
+	struct acrn_vcpu *vcpu = NULL;
+	uint16_t i;
 
+	vm->start_tsc = cpu_ticks();
 	vm->state = VM_RUNNING;
 
-	/* Only start BSP (vid = 0) and let BSP start other APs */
-	bsp = vcpu_from_vid(vm, BSP_CPU_ID);
-	vcpu_make_request(bsp, ACRN_REQUEST_INIT_VMCS);
-	launch_vcpu(bsp);
+	/*
+	 * Only start BSP (vid = 0) and let BSP start other APs, but for the
+	 * APs restored from a snapshot, which were running already.
+	 */
+	foreach_vcpu(i, vm, vcpu) {
+		if ((i == BSP_CPU_ID) || vcpu->arch.restore.pending) {
+			vcpu_make_request(vcpu, ACRN_REQUEST_INIT_VMCS);
+			launch_vcpu(vcpu);
+		}
+	}
+}
+
+/**
+ * Tell ACRN-DM how long the hypervisor took to create and start a
+ * post-launched VM, called on the first VM entry of its BSP. Only the first
+ * start after create_vm() is reported, not the ones after a reset.
+ *
+ * @pre vm != NULL
+ */
+void report_vm_startup(struct acrn_vm *vm)
+{
+	struct vm_event event;
+	struct startup_event_data *data = (struct startup_event_data *)event.event_data;
+	uint64_t now = cpu_ticks();
+
+	if (is_postlaunched_vm(vm) && !vm->startup_reported) {
+		vm->startup_reported = true;
+		event.type = VM_EVENT_STARTUP;
+		data->created_us = ticks_to_us(vm->created_tsc - vm->create_tsc);
+		data->started_us = ticks_to_us(vm->start_tsc - vm->create_tsc);
+		data->entry_us = ticks_to_us(now - vm->create_tsc);
+		(void)send_vm_event(vm, &event);
+	}
 }
 
 /**
@@ -1055,6 +1195,7 @@ void pause_vm(struct acrn_vm *vm)
 		foreach_vcpu(i, vm, vcpu) {
 			zombie_vcpu(vcpu, VCPU_ZOMBIE);
 		}
+		vm->pause_tsc = cpu_ticks();
 		vm->state = VM_PAUSED;
 	}
 }
@@ -1091,7 +1232,8 @@ void resume_vm_from_s3(struct acrn_vm *vm, uint32_t wakeup_vec)
 	launch_vcpu(bsp);
 }
 
-static uint8_t loaded_pre_vm_nr = 0U;
+/* pre-launched VMs prepared, or failed to, on their own pCPUs side by side */
+static volatile uint32_t loaded_pre_vm_nr = 0U;
 /**
  * Prepare to create vm/vcpu for vm
  *
@@ -1135,14 +1277,16 @@ int32_t prepare_vm(uint16_t vm_id, struct acrn_vm_config *vm_config)
 					pr_err("Loading pre-launched VMs timeout!");
 					break;
 				}
+				asm_pause();
 			}
 		}
 
 		err = prepare_os_image(vm);
+	}
 
-		if (is_prelaunched_vm(vm)) {
-			loaded_pre_vm_nr++;
-		}
+	/* a pre-launched VM that failed has no module left to protect either */
+	if (vm_config->load_order == PRE_LAUNCHED_VM) {
+		atomic_inc32((uint32_t *)&loaded_pre_vm_nr);
 	}
 
 	return err;
@@ -11,6 +11,7 @@
 #include <asm/per_cpu.h>
 #include <asm/guest/vm_reset.h>
 #include <vm_event.h>
+#include <flightrec.h>
 
 /**
  * @pre vm != NULL
@@ -20,6 +21,9 @@ void triple_fault_shutdown_vm(struct acrn_vcpu *vcpu)
 	struct acrn_vm *vm = vcpu->vm;
 	struct vm_event trp_event;
 
+	pr_acrnlog("VM%hu triple fault", vm->vm_id);
+	flightrec_dump(true);
+
 	if (is_postlaunched_vm(vm)) {
 		struct io_request *io_req = &vcpu->req;
 
@@ -38,6 +38,8 @@ static const struct hc_dispatch hc_dispatch_table[] = {
 		.handler = hcall_service_vm_offline_cpu},
 	[HC_IDX(HC_SET_CALLBACK_VECTOR)] = {
 		.handler = hcall_set_callback_vector},
+	[HC_IDX(HC_SET_HCALL_ARGS_PAGE)] = {
+		.handler = hcall_set_hcall_args_page},
 	[HC_IDX(HC_CREATE_VM)] = {
 		.handler = hcall_create_vm},
 	[HC_IDX(HC_DESTROY_VM)] = {
@@ -52,10 +54,32 @@ static const struct hc_dispatch hc_dispatch_table[] = {
 		.handler = hcall_set_vcpu_regs},
 	[HC_IDX(HC_CREATE_VCPU)] = {
 		.handler = hcall_create_vcpu},
+	[HC_IDX(HC_GET_VCPU_SCHED_STATS)] = {
+		.handler = hcall_get_vcpu_sched_stats},
+	[HC_IDX(HC_GET_VCPU_EXIT_STATS)] = {
+		.handler = hcall_get_vcpu_exit_stats},
+	[HC_IDX(HC_GET_VM_IO_HOTSPOTS)] = {
+		.handler = hcall_get_vm_io_hotspots},
+	[HC_IDX(HC_GET_VCPU_STATE)] = {
+		.handler = hcall_get_vcpu_state},
+	[HC_IDX(HC_SET_VCPU_STATE)] = {
+		.handler = hcall_set_vcpu_state},
+	[HC_IDX(HC_GET_VIOAPIC_STATE)] = {
+		.handler = hcall_get_vioapic_state},
+	[HC_IDX(HC_SET_VIOAPIC_STATE)] = {
+		.handler = hcall_set_vioapic_state},
+	[HC_IDX(HC_VM_LATENCY_PROBE)] = {
+		.handler = hcall_vm_latency_probe},
 	[HC_IDX(HC_SET_IRQLINE)] = {
 		.handler = hcall_set_irqline},
 	[HC_IDX(HC_INJECT_MSI)] = {
 		.handler = hcall_inject_msi},
+	[HC_IDX(HC_SEND_IPI)] = {
+		.handler = hcall_send_ipi,
+		.permission_flags = GUEST_FLAG_PV_IPI},
+	[HC_IDX(HC_SET_PV_TIMER_PAGE)] = {
+		.handler = hcall_set_pv_timer_page,
+		.permission_flags = GUEST_FLAG_PV_TIMER},
 	[HC_IDX(HC_SET_IOREQ_BUFFER)] = {
 		.handler = hcall_set_ioreq_buffer},
 	[HC_IDX(HC_ASYNCIO_ASSIGN)] = {
@@ -64,12 +88,24 @@ static const struct hc_dispatch hc_dispatch_table[] = {
 		.handler = hcall_asyncio_deassign},
 	[HC_IDX(HC_NOTIFY_REQUEST_FINISH)] = {
 		.handler = hcall_notify_ioreq_finish},
+	[HC_IDX(HC_NOTIFY_REQUEST_FINISH_BATCH)] = {
+		.handler = hcall_notify_ioreq_finish_batch},
+	[HC_IDX(HC_ADD_COALESCED_MMIO)] = {
+		.handler = hcall_add_coalesced_mmio},
+	[HC_IDX(HC_REMOVE_COALESCED_MMIO)] = {
+		.handler = hcall_remove_coalesced_mmio},
+	[HC_IDX(HC_SET_TSC_COUNTER)] = {
+		.handler = hcall_set_tsc_counter},
 	[HC_IDX(HC_VM_SET_MEMORY_REGIONS)] = {
 		.handler = hcall_set_vm_memory_regions},
 	[HC_IDX(HC_VM_WRITE_PROTECT_PAGE)] = {
 		.handler = hcall_write_protect_page},
 	[HC_IDX(HC_VM_GPA2HPA)] = {
 		.handler = hcall_gpa_to_hpa},
+	[HC_IDX(HC_VM_GET_DIRTY_LOG)] = {
+		.handler = hcall_get_dirty_log},
+	[HC_IDX(HC_VM_SET_LAZY_MEMORY)] = {
+		.handler = hcall_set_lazy_memory},
 	[HC_IDX(HC_ASSIGN_PCIDEV)] = {
 		.handler = hcall_assign_pcidev},
 	[HC_IDX(HC_DEASSIGN_PCIDEV)] = {
@@ -82,12 +118,20 @@ static const struct hc_dispatch hc_dispatch_table[] = {
 		.handler = hcall_add_vdev},
 	[HC_IDX(HC_REMOVE_VDEV)] = {
 		.handler = hcall_remove_vdev},
+	[HC_IDX(HC_ADD_VDEV_CFG_SHADOW)] = {
+		.handler = hcall_add_vdev_cfg_shadow},
+	[HC_IDX(HC_REMOVE_VDEV_CFG_SHADOW)] = {
+		.handler = hcall_remove_vdev_cfg_shadow},
 	[HC_IDX(HC_SET_PTDEV_INTR_INFO)] = {
 		.handler = hcall_set_ptdev_intr_info},
 	[HC_IDX(HC_RESET_PTDEV_INTR_INFO)] = {
 		.handler = hcall_reset_ptdev_intr_info},
 	[HC_IDX(HC_PM_GET_CPU_STATE)] = {
 		.handler = hcall_get_cpu_pm_state},
+	[HC_IDX(HC_SET_VM_FREQ_POLICY)] = {
+		.handler = hcall_set_vm_freq_policy},
+	[HC_IDX(HC_GET_CPU_UTIL)] = {
+		.handler = hcall_get_cpu_util},
 	[HC_IDX(HC_VM_INTR_MONITOR)] = {
 		.handler = hcall_vm_intr_monitor},
 	[HC_IDX(HC_SETUP_SBUF)] = {
@@ -98,6 +142,12 @@ static const struct hc_dispatch hc_dispatch_table[] = {
 		.handler = hcall_profiling_ops},
 	[HC_IDX(HC_GET_HW_INFO)] = {
 		.handler = hcall_get_hw_info},
+	[HC_IDX(HC_SET_TRACE_MASK)] = {
+		.handler = hcall_set_trace_mask},
+	[HC_IDX(HC_SET_CLOS_CONFIG)] = {
+		.handler = hcall_set_clos_config},
+	[HC_IDX(HC_GET_VM_RDT_MON)] = {
+		.handler = hcall_get_vm_rdt_mon},
 	[HC_IDX(HC_INITIALIZE_TRUSTY)] = {
 		.handler = hcall_initialize_trusty,
 		.permission_flags = GUEST_FLAG_SECURE_WORLD_ENABLED},
@@ -138,7 +188,7 @@ static bool is_guest_hypercall(struct acrn_vm *vm)
 	bool ret = true;
 
 	if ((guest_flags & (GUEST_FLAG_SECURE_WORLD_ENABLED |
-		GUEST_FLAG_TEE | GUEST_FLAG_REE)) == 0UL) {
+		GUEST_FLAG_TEE | GUEST_FLAG_REE | GUEST_FLAG_PV_IPI)) == 0UL) {
 		ret = false;
 	}
 
@@ -185,9 +235,13 @@ struct acrn_vm *parse_target_vm(struct acrn_vm *service_vm, uint64_t hcall_id, u
 	case HC_GET_API_VERSION:
 	case HC_SERVICE_VM_OFFLINE_CPU:
 	case HC_SET_CALLBACK_VECTOR:
+	case HC_SET_HCALL_ARGS_PAGE:
 	case HC_SETUP_HV_NPK_LOG:
 	case HC_PROFILING_OPS:
 	case HC_GET_HW_INFO:
+	case HC_SET_TRACE_MASK:
+	case HC_SET_CLOS_CONFIG:
+	case HC_GET_CPU_UTIL:
 		target_vm = service_vm;
 		break;
 	default:
@@ -206,21 +260,17 @@ struct acrn_vm *parse_target_vm(struct acrn_vm *service_vm, uint64_t hcall_id, u
 	return target_vm;
 }
 
-static int32_t dispatch_hypercall(struct acrn_vcpu *vcpu)
+static int32_t dispatch_hcall(struct acrn_vcpu *vcpu, uint64_t hcall_id, uint64_t param1, uint64_t param2)
 {
 	int32_t ret = -ENOTTY;
 	struct acrn_vm *vm = vcpu->vm;
-	uint64_t guest_flags = get_vm_config(vm->vm_id)->guest_flags;  /* hypercall ID from guest */
-	uint64_t hcall_id = vcpu_get_gpreg(vcpu, CPU_REG_R8);  /* hypercall ID from guest */
+	uint64_t guest_flags = get_vm_config(vm->vm_id)->guest_flags;
 
 	if (HC_IDX(hcall_id) < ARRAY_SIZE(hc_dispatch_table)) {
 		const struct hc_dispatch *dispatch = &(hc_dispatch_table[HC_IDX(hcall_id)]);
 		uint64_t permission_flags = dispatch->permission_flags;
 
 		if (dispatch->handler != NULL) {
-			uint64_t param1 = vcpu_get_gpreg(vcpu, CPU_REG_RDI);  /* hypercall param1 from guest */
-			uint64_t param2 = vcpu_get_gpreg(vcpu, CPU_REG_RSI);  /* hypercall param2 from guest */
-
 			if ((permission_flags == 0UL) && is_service_vm(vm) && !is_ree_vm(vm)) {
 				/* A permission_flags of 0 indicates that this hypercall is for Service VM to manage
 				 * post-launched VMs.
@@ -250,17 +300,93 @@ static int32_t dispatch_hypercall(struct acrn_vcpu *vcpu)
 	return ret;
 }
 
+/*
+ * Run the hypercalls of the acrn_multicall at GPA param1 one after the other,
+ * each through the dispatch table as if the Service VM had issued it, and
+ * return their results in place. It saves the Service VM a VM exit per
+ * hypercall.
+ */
+static int32_t dispatch_multicall(struct acrn_vcpu *vcpu, uint64_t param1)
+{
+	struct acrn_multicall mc;
+	struct acrn_multicall_entry *entry;
+	int32_t ret = -EINVAL;
+	uint32_t i;
+
+	if ((copy_hcall_arg(vcpu, &mc, param1, sizeof(mc)) == 0) && (mc.count <= ACRN_MULTICALL_MAX)) {
+		for (i = 0U; i < mc.count; i++) {
+			entry = &mc.entries[i];
+			if (entry->hcall_id == HC_MULTICALL) {
+				entry->result = -EINVAL;
+			} else {
+				entry->result = dispatch_hcall(vcpu, entry->hcall_id, entry->param1, entry->param2);
+			}
+		}
+		ret = copy_hcall_result(vcpu, &mc, param1, sizeof(mc));
+	}
+
+	return ret;
+}
+
+static int32_t dispatch_hypercall(struct acrn_vcpu *vcpu)
+{
+	int32_t ret;
+	struct acrn_vm *vm = vcpu->vm;
+	uint64_t hcall_id = vcpu_get_gpreg(vcpu, CPU_REG_R8);  /* hypercall ID from guest */
+	uint64_t param1 = vcpu_get_gpreg(vcpu, CPU_REG_RDI);  /* hypercall param1 from guest */
+	uint64_t param2 = vcpu_get_gpreg(vcpu, CPU_REG_RSI);  /* hypercall param2 from guest */
+
+	if (hcall_id == HC_MULTICALL) {
+		/* for the Service VM only, like the hypercalls of permission_flags 0 */
+		if (is_service_vm(vm) && !is_ree_vm(vm)) {
+			ret = dispatch_multicall(vcpu, param1);
+		} else {
+			ret = -ENOTTY;
+		}
+	} else {
+		ret = dispatch_hcall(vcpu, hcall_id, param1, param2);
+	}
+
+	return ret;
+}
+
 /*
  * Pass return value to Service VM by register rax.
  * This function should always return 0 since we shouldn't
  * deal with hypercall error in hypervisor.
  */
+/*
+ * The VMs seen as KVM guests (the KVM paravirtual interface, without the ACRN
+ * guest hypercalls) use the KVM ABI, see KVM_HC_KICK_CPU.
+ */
+static bool is_kvm_hypercall(struct acrn_vm *vm)
+{
+	return (!is_service_vm(vm) && !is_guest_hypercall(vm) && is_pv_clock_configured(vm));
+}
+
+static int32_t dispatch_kvm_hypercall(struct acrn_vcpu *vcpu)
+{
+	uint64_t nr = vcpu_get_gpreg(vcpu, CPU_REG_RAX);
+	int32_t ret = -KVM_ENOSYS;
+
+	if (nr == KVM_HC_KICK_CPU) {
+		ret = hcall_pv_kick(vcpu, vcpu->vm, vcpu_get_gpreg(vcpu, CPU_REG_RBX),
+				vcpu_get_gpreg(vcpu, CPU_REG_RCX));
+	} else if (nr == KVM_HC_VAPIC_POLL_IRQ) {
+		/* a no-op, the pending interrupts are injected on the VM entry anyway */
+		ret = 0;
+	}
+
+	return ret;
+}
+
 int32_t vmcall_vmexit_handler(struct acrn_vcpu *vcpu)
 {
 	int32_t ret;
 	struct acrn_vm *vm = vcpu->vm;
+	bool kvm_abi = is_kvm_hypercall(vm);
 	/* hypercall ID from guest*/
-	uint64_t hypcall_id = vcpu_get_gpreg(vcpu, CPU_REG_R8);
+	uint64_t hypcall_id = vcpu_get_gpreg(vcpu, kvm_abi ? CPU_REG_RAX : CPU_REG_R8);
 
 	/*
 	 * The following permission checks are applied to hypercalls.
@@ -273,12 +399,14 @@ int32_t vmcall_vmexit_handler(struct acrn_vcpu *vcpu)
 	 *    guest flags. Attempts to invoke an unpermitted hypercall will make a vCPU see -EINVAL as the return
 	 *    value. No exception is triggered in this case.
 	 */
-	if (!is_service_vm(vm) && !is_guest_hypercall(vm)) {
+	if (!is_service_vm(vm) && !is_guest_hypercall(vm) && !kvm_abi) {
 		vcpu_inject_ud(vcpu);
 		ret = -ENODEV;
 	} else if (!is_hypercall_from_ring0()) {
 		vcpu_inject_gp(vcpu, 0U);
 		ret = -EACCES;
+	} else if (kvm_abi) {
+		ret = dispatch_kvm_hypercall(vcpu);
 	} else {
 		ret = dispatch_hypercall(vcpu);
 	}
@@ -10,6 +10,7 @@
 #include <asm/guest/vmcs.h>
 #include <asm/guest/vcpu.h>
 #include <asm/guest/vm.h>
+#include <asm/guest/ept.h>
 #include <asm/vmx.h>
 #include <asm/gdt.h>
 #include <asm/pgtable.h>
@@ -19,6 +20,10 @@
 #include <asm/guest/vmexit.h>
 #include <logmsg.h>
 
+/* PAUSE-loop exiting defaults, in TSC cycles */
+#define PLE_GAP_DEFAULT		128U
+#define PLE_WINDOW_DEFAULT	4096U
+
 /* rip, rsp, ia32_efer and rflags are written to VMCS in start_vcpu */
 static void init_guest_vmx(struct acrn_vcpu *vcpu, uint64_t cr0, uint64_t cr3,
 	uint64_t cr4)
@@ -53,8 +58,12 @@ static void init_guest_vmx(struct acrn_vcpu *vcpu, uint64_t cr0, uint64_t cr3,
 	load_segment(ectx->ldtr, VMX_GUEST_LDTR);
 
 	/* init guest ia32_misc_enable value for guest read */
-	vcpu_set_guest_msr(vcpu, MSR_IA32_MISC_ENABLE,
-		(msr_read(MSR_IA32_MISC_ENABLE) & (~MSR_IA32_MISC_ENABLE_MONITOR_ENA)));
+	if (is_mwait_pt_configured(vcpu->vm)) {
+		vcpu_set_guest_msr(vcpu, MSR_IA32_MISC_ENABLE, msr_read(MSR_IA32_MISC_ENABLE));
+	} else {
+		vcpu_set_guest_msr(vcpu, MSR_IA32_MISC_ENABLE,
+			(msr_read(MSR_IA32_MISC_ENABLE) & (~MSR_IA32_MISC_ENABLE_MONITOR_ENA)));
+	}
 
 	vcpu_set_guest_msr(vcpu, MSR_IA32_PERF_CTL, msr_read(MSR_IA32_PERF_CTL));
 
@@ -264,6 +273,7 @@ static void init_exec_ctrl(struct acrn_vcpu *vcpu)
 	uint32_t value32;
 	uint64_t value64;
 	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_vm_config *vm_config;
 
 	/* Log messages to show initializing VMX execution controls */
 	pr_dbg("Initialize execution control ");
@@ -317,7 +327,19 @@ static void init_exec_ctrl(struct acrn_vcpu *vcpu)
 	/*
 	 * Enable MONITOR/MWAIT cause a VM-EXIT.
 	 */
-	value32 |= VMX_PROCBASED_CTLS_MWAIT | VMX_PROCBASED_CTLS_MONITOR;
+	if (!is_mwait_pt_configured(vcpu->vm)) {
+		value32 |= VMX_PROCBASED_CTLS_MWAIT | VMX_PROCBASED_CTLS_MONITOR;
+	}
+
+	/*
+	 * The vCPUs of a VM with idle passthrough own their pCPUs, there is no
+	 * other thread to yield them to, so let HLT idle the pCPU natively. The
+	 * interrupts sent to the vCPU wake it, either posted or through the
+	 * external-interrupt VM exit of the kick IPI and the following injection.
+	 */
+	if (is_idle_pt_configured(vcpu->vm)) {
+		value32 &= ~VMX_PROCBASED_CTLS_HLT;
+	}
 
 	vcpu->arch.proc_vm_exec_ctrls = value32;
 	exec_vmwrite32(VMX_PROC_VM_EXEC_CONTROLS, value32);
@@ -332,6 +354,11 @@ static void init_exec_ctrl(struct acrn_vcpu *vcpu)
 			VMX_PROCBASED_CTLS2_RDTSCP | VMX_PROCBASED_CTLS2_UNRESTRICT | VMX_PROCBASED_CTLS2_XSVE_XRSTR |
 			VMX_PROCBASED_CTLS2_PAUSE_LOOP | VMX_PROCBASED_CTLS2_UWAIT_PAUSE);
 
+	/* No other thread could use the pCPU a spinning vCPU of such a VM would give up */
+	if (is_idle_pt_configured(vcpu->vm)) {
+		value32 &= ~VMX_PROCBASED_CTLS2_PAUSE_LOOP;
+	}
+
 	/* SDM Vol3, 25.3,  setting "enable INVPCID" VM-execution to 1 with "INVLPG exiting" disabled,
 	 * passes-through INVPCID instruction to guest if the instruction is supported.
 	 */
@@ -376,6 +403,17 @@ static void init_exec_ctrl(struct acrn_vcpu *vcpu)
 		/* Enable KeyLocker if support */
 		value64 = check_vmx_ctrl_64(MSR_IA32_VMX_PROCBASED_CTLS3, VMX_PROCBASED_CTLS3_LOADIWKEY);
 
+		/*
+		 * Fixed IPIs in physical mode and without shorthand to a vCPU in
+		 * the PID-pointer table are posted by the CPU, the others still
+		 * cause an APIC-write VM exit and go through vlapic_write_icrlo().
+		 */
+		if (vm->arch_vm.ipiv_enabled) {
+			value64 |= VMX_PROCBASED_CTLS3_IPIV;
+			exec_vmwrite64(VMX_PID_POINTER_TABLE_ADDR_FULL, hva2hpa(vm->arch_vm.pid_table));
+			exec_vmwrite16(VMX_LAST_PID_POINTER_INDEX, (uint16_t)(IPIV_PID_TABLE_ENTRIES - 1U));
+		}
+
 		exec_vmwrite64(VMX_PROC_VM_EXEC_CONTROLS3_FULL, value64);
 		pr_dbg("VMX_PROC_VM_EXEC_CONTROLS3: 0x%llx ", value64);
 	}
@@ -407,6 +445,10 @@ static void init_exec_ctrl(struct acrn_vcpu *vcpu)
 	 * on VMX_EPT_VPID_CAP
 	 */
 	value64 = hva2hpa(vm->arch_vm.nworld_eptp) | (3UL << 3U) | 6UL;
+	if (is_ept_ad_enabled(vm)) {
+		/* bit 6 enables the accessed and dirty flags */
+		value64 |= (1UL << 6U);
+	}
 	exec_vmwrite64(VMX_EPT_POINTER_FULL, value64);
 	pr_dbg("VMX_EPT_POINTER: 0x%016lx ", value64);
 
@@ -481,8 +523,9 @@ static void init_exec_ctrl(struct acrn_vcpu *vcpu)
 	exec_vmwrite(VMX_CR3_TARGET_3, 0UL);
 
 	/* Setup PAUSE-loop exiting - 24.6.13 */
-	exec_vmwrite(VMX_PLE_GAP, 128U);
-	exec_vmwrite(VMX_PLE_WINDOW, 4096U);
+	vm_config = get_vm_config(vm->vm_id);
+	exec_vmwrite(VMX_PLE_GAP, (vm_config->ple_gap != 0U) ? vm_config->ple_gap : PLE_GAP_DEFAULT);
+	exec_vmwrite(VMX_PLE_WINDOW, (vm_config->ple_window != 0U) ? vm_config->ple_window : PLE_WINDOW_DEFAULT);
 }
 
 static void init_entry_ctrl(const struct acrn_vcpu *vcpu)
@@ -581,6 +624,8 @@ void init_vmcs(struct acrn_vcpu *vcpu)
 	init_guest_state(vcpu);
 	init_entry_ctrl(vcpu);
 	init_exit_ctrl(vcpu);
+	/* after the entry and exit controls, which it switches */
+	init_vpmu(vcpu);
 }
 
 /**
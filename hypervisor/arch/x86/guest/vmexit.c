@@ -23,19 +23,24 @@
 #include <trace.h>
 #include <asm/rtcm.h>
 #include <debug/console.h>
+#include <ticks.h>
 
 /*
  * According to "SDM APPENDIX C VMX BASIC EXIT REASONS",
  * there are 65 Basic Exit Reasons.
  */
-#define NR_VMX_EXIT_REASONS	70U
+#define NR_VMX_EXIT_REASONS	ACRN_VMEXIT_REASONS
+
+/* adaptive HLT polling window, see hlt_vmexit_handler() */
+#define HALT_POLL_START_US	10U
+#define HALT_POLL_MAX_US	200U
 
 static int32_t triple_fault_vmexit_handler(struct acrn_vcpu *vcpu);
 static int32_t unhandled_vmexit_handler(struct acrn_vcpu *vcpu);
 static int32_t xsetbv_vmexit_handler(struct acrn_vcpu *vcpu);
 static int32_t wbinvd_vmexit_handler(struct acrn_vcpu *vcpu);
 static int32_t undefined_vmexit_handler(struct acrn_vcpu *vcpu);
-static int32_t pause_vmexit_handler(__unused struct acrn_vcpu *vcpu);
+static int32_t pause_vmexit_handler(struct acrn_vcpu *vcpu);
 static int32_t hlt_vmexit_handler(struct acrn_vcpu *vcpu);
 static int32_t mtf_vmexit_handler(struct acrn_vcpu *vcpu);
 static int32_t loadiwkey_vmexit_handler(struct acrn_vcpu *vcpu);
@@ -75,7 +80,7 @@ static const struct vm_exit_dispatch dispatch_table[NR_VMX_EXIT_REASONS] = {
 	[VMX_EXIT_REASON_INVLPG] = {
 		.handler = unhandled_vmexit_handler,},
 	[VMX_EXIT_REASON_RDPMC] = {
-		.handler = undefined_vmexit_handler},
+		.handler = rdpmc_vmexit_handler},
 	[VMX_EXIT_REASON_RDTSC] = {
 		.handler = unhandled_vmexit_handler},
 	[VMX_EXIT_REASON_RSM] = {
@@ -210,10 +215,33 @@ static const struct vm_exit_dispatch dispatch_table[NR_VMX_EXIT_REASONS] = {
 		.handler = loadiwkey_vmexit_handler}
 };
 
+/*
+ * Account the time from the start of vmexit_handler() to the end of the exit
+ * handler, which includes any wait of the handler, e.g. for the I/O request
+ * sent to the Device Model. Two TSC reads and a few increments per exit, so
+ * it is kept on in release builds too. The pCPU totals feed get_pcpu_util().
+ */
+static void vmexit_account(struct acrn_vcpu *vcpu, uint16_t basic_exit_reason, uint64_t start)
+{
+	struct acrn_vmexit_stats *stats = &vcpu->exit_stats[basic_exit_reason];
+	uint64_t delta = cpu_ticks() - start;
+	uint16_t bucket = 0U;
+
+	if (delta >= (1UL << 9U)) {
+		bucket = (uint16_t)min(fls64(delta) - 8U, ACRN_VMEXIT_LAT_BUCKETS - 1U);
+	}
+	stats->count++;
+	stats->ticks += delta;
+	stats->lat[bucket]++;
+	get_cpu_var(nr_exits)++;
+	get_cpu_var(exit_ticks) += delta;
+}
+
 int32_t vmexit_handler(struct acrn_vcpu *vcpu)
 {
 	struct vm_exit_dispatch *dispatch = NULL;
 	uint16_t basic_exit_reason;
+	uint64_t start = cpu_ticks();
 	int32_t ret;
 
 	if (get_pcpu_id() != pcpuid_from_vcpu(vcpu)) {
@@ -261,8 +289,8 @@ int32_t vmexit_handler(struct acrn_vcpu *vcpu)
 
 			/* See if an exit qualification is necessary for this exit handler */
 			if (dispatch->need_exit_qualification != 0U) {
-				/* Get exit qualification */
-				vcpu->arch.exit_qualification = exec_vmread(VMX_EXIT_QUALIFICATION);
+				/* Get exit qualification, the handler reads vcpu->arch.exit_qualification */
+				(void)vcpu_get_exit_qualification(vcpu);
 			}
 
 			/* exit dispatch handling */
@@ -280,6 +308,8 @@ int32_t vmexit_handler(struct acrn_vcpu *vcpu)
 			} else {
 				ret = dispatch->handler(vcpu);
 			}
+
+			vmexit_account(vcpu, basic_exit_reason, start);
 		}
 	}
 
@@ -301,12 +331,12 @@ static int32_t mwait_monitor_vmexit_handler (struct acrn_vcpu *vcpu)
 static int32_t unhandled_vmexit_handler(struct acrn_vcpu *vcpu)
 {
 	pr_fatal("Error: Unhandled VM exit condition from guest at 0x%016lx ",
-			exec_vmread(VMX_GUEST_RIP));
+			vcpu_get_rip(vcpu));
 
 	pr_fatal("Exit Reason: 0x%016lx ", vcpu->arch.exit_reason);
 
 	pr_err("Exit qualification: 0x%016lx ",
-			exec_vmread(VMX_EXIT_QUALIFICATION));
+			vcpu_get_exit_qualification(vcpu));
 
 	TRACE_2L(TRACE_VMEXIT_UNHANDLED, vcpu->arch.exit_reason, 0UL);
 
@@ -332,23 +362,96 @@ static int32_t mtf_vmexit_handler(struct acrn_vcpu *vcpu)
 static int32_t triple_fault_vmexit_handler(struct acrn_vcpu *vcpu)
 {
 	pr_fatal("VM%d: triple fault @ guest RIP 0x%016lx, exit qualification: 0x%016lx",
-		vcpu->vm->vm_id, exec_vmread(VMX_GUEST_RIP), exec_vmread(VMX_EXIT_QUALIFICATION));
+		vcpu->vm->vm_id, vcpu_get_rip(vcpu), vcpu_get_exit_qualification(vcpu));
 	triple_fault_shutdown_vm(vcpu);
 
 	return 0;
 }
 
-static int32_t pause_vmexit_handler(__unused struct acrn_vcpu *vcpu)
+/*
+ * A PAUSE-loop exit means the vCPU spins, most likely on a lock held by a
+ * sibling vCPU that is preempted. As the vCPUs of a VM are all on different
+ * pCPUs, boost the first queued sibling (starting after this vCPU, so the
+ * boosts rotate) to run next on its pCPU, and give up this pCPU meanwhile.
+ */
+/*
+ * A vCPU spinning on a lock: boost a sibling, likely the lock holder, and
+ * yield. The guests with the KVM PV spinlocks halt instead, see hcall_pv_kick().
+ */
+static int32_t pause_vmexit_handler(struct acrn_vcpu *vcpu)
 {
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_vcpu *sibling;
+	uint16_t i;
+	bool boosted = false;
+
+	for (i = 1U; (i < vm->hw.created_vcpus) && !boosted; i++) {
+		sibling = &vm->hw.vcpu_array[(vcpu->vcpu_id + i) % vm->hw.created_vcpus];
+		if (sibling->state == VCPU_RUNNING) {
+			boosted = boost_thread(&sibling->thread_obj);
+		}
+	}
+
 	yield_current();
 	return 0;
 }
 
+static inline bool hlt_can_wake(struct acrn_vcpu *vcpu)
+{
+	return (vcpu->arch.pending_req != 0UL) || vlapic_has_pending_intr(vcpu) || vcpu->arch.pv_unhalted;
+}
+
+/*
+ * Spin for up to halt_poll_ticks waiting for an interrupt, unless another
+ * thread wants the pCPU. Returns true if the vCPU can resume.
+ */
+static bool halt_poll(struct acrn_vcpu *vcpu, uint64_t start)
+{
+	uint16_t pcpu_id = pcpuid_from_vcpu(vcpu);
+	bool woken = false;
+
+	while (!woken && ((cpu_ticks() - start) < vcpu->arch.halt_poll_ticks) && !need_reschedule(pcpu_id)) {
+		asm_pause();
+		woken = hlt_can_wake(vcpu);
+	}
+
+	return woken;
+}
+
+/*
+ * The poll window adapts to how long the vCPU stays halted, as KVM's
+ * halt_poll_ns does: it grows while wakeups come shortly after the window,
+ * and shrinks once the vCPU sleeps for longer than the polling is worth.
+ */
 static int32_t hlt_vmexit_handler(struct acrn_vcpu *vcpu)
 {
-	if ((vcpu->arch.pending_req == 0UL) && (!vlapic_has_pending_intr(vcpu))) {
-		wait_event(&vcpu->events[VCPU_EVENT_VIRTUAL_INTERRUPT]);
+	uint64_t max_ticks = us_to_ticks(HALT_POLL_MAX_US);
+	uint64_t start, halted;
+
+	/* don't wake up for a timer the guest disarmed or moved in its PV timer page */
+	vlapic_sync_pv_timer(vcpu_vlapic(vcpu));
+	if (!hlt_can_wake(vcpu)) {
+		start = cpu_ticks();
+		if (!halt_poll(vcpu, start)) {
+			wait_event(&vcpu->events[VCPU_EVENT_VIRTUAL_INTERRUPT]);
+		}
+		halted = cpu_ticks() - start;
+
+		/* the window is kept when the vCPU is woken up while polling */
+		if (halted > vcpu->arch.halt_poll_ticks) {
+			if (halted < max_ticks) {
+				vcpu->arch.halt_poll_ticks = (vcpu->arch.halt_poll_ticks == 0UL) ?
+					us_to_ticks(HALT_POLL_START_US) : min(vcpu->arch.halt_poll_ticks << 1U, max_ticks);
+			} else {
+				vcpu->arch.halt_poll_ticks >>= 1U;
+				if (vcpu->arch.halt_poll_ticks < us_to_ticks(HALT_POLL_START_US)) {
+					vcpu->arch.halt_poll_ticks = 0UL;
+				}
+			}
+		}
 	}
+	/* a kick wakes up one halt, also one to come if it came first */
+	vcpu->arch.pv_unhalted = false;
 	return 0;
 }
 
@@ -361,6 +464,7 @@ int32_t cpuid_vmexit_handler(struct acrn_vcpu *vcpu)
 	rcx = vcpu_get_gpreg(vcpu, CPU_REG_RCX);
 	rdx = vcpu_get_gpreg(vcpu, CPU_REG_RDX);
 	TRACE_2L(TRACE_VMEXIT_CPUID, rax, rcx);
+	vcpu->cpuid_exits[vcpuid_leaf_slot((uint32_t)rax)]++;
 	guest_cpuid(vcpu, (uint32_t *)&rax, (uint32_t *)&rbx,
 		(uint32_t *)&rcx, (uint32_t *)&rdx);
 	vcpu_set_gpreg(vcpu, CPU_REG_RAX, rax);
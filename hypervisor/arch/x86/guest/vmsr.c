@@ -12,6 +12,7 @@
 #include <asm/guest/vcpu.h>
 #include <asm/guest/virq.h>
 #include <asm/guest/vm.h>
+#include <asm/host_pm.h>
 #include <asm/vmx.h>
 #include <asm/sgx.h>
 #include <asm/guest/guest_pm.h>
@@ -20,9 +21,11 @@
 #include <asm/cpufeatures.h>
 #include <asm/rdt.h>
 #include <asm/tsc.h>
+#include <ticks.h>
 #include <trace.h>
 #include <logmsg.h>
 #include <asm/guest/vcat.h>
+#include <asm/guest/pvclock.h>
 
 #define INTERCEPT_DISABLE		(0U)
 #define INTERCEPT_READ			(1U << 0U)
@@ -110,6 +113,13 @@ static uint32_t emulated_guest_msrs[NUM_EMULATED_MSRS] = {
 	 */
 };
 
+/* emulated_guest_msrs[] sorted by MSR, with the index of each, see vmsr_get_guest_msr_index() */
+struct emulated_msr_index {
+	uint32_t msr;
+	uint32_t index;
+};
+static struct emulated_msr_index emulated_msr_index[NUM_EMULATED_MSRS];
+
 static const uint32_t mtrr_msrs[] = {
 	MSR_IA32_MTRR_CAP,
 	MSR_IA32_MTRR_DEF_TYPE,
@@ -292,17 +302,55 @@ static const uint32_t unsupported_msrs[] = {
 	IA32_HW_FEEDBACK_THREAD_CONFIG,
 };
 
-/* emulated_guest_msrs[] shares same indexes with array vcpu->arch->guest_msrs[] */
-uint32_t vmsr_get_guest_msr_index(uint32_t msr)
+/*
+ * Sort emulated_guest_msrs[] into emulated_msr_index[] once, on the BSP and
+ * after init_intercepted_cat_msr_list(), it doesn't change afterwards.
+ */
+void init_emulated_msr_index(void)
 {
-	uint32_t index;
+	struct emulated_msr_index tmp;
+	uint32_t i, j;
 
-	for (index = 0U; index < NUM_EMULATED_MSRS; index++) {
-		if (emulated_guest_msrs[index] == msr) {
-			break;
+	for (i = 0U; i < NUM_EMULATED_MSRS; i++) {
+		tmp.msr = emulated_guest_msrs[i];
+		tmp.index = i;
+		for (j = i; (j > 0U) && (emulated_msr_index[j - 1U].msr > tmp.msr); j--) {
+			emulated_msr_index[j] = emulated_msr_index[j - 1U];
+		}
+		emulated_msr_index[j] = tmp;
+	}
+}
+
+/*
+ * Every vcpu_get/set_guest_msr() looks the index up, so it is searched in the
+ * sorted emulated_msr_index[] rather than emulated_guest_msrs[].
+ *
+ * @return index into emulated_guest_msrs[], NUM_EMULATED_MSRS if msr isn't in it
+ */
+static uint32_t lookup_emulated_msr(uint32_t msr)
+{
+	uint32_t low = 0U, high = NUM_EMULATED_MSRS, mid;
+	uint32_t index = NUM_EMULATED_MSRS;
+
+	while ((low < high) && (index == NUM_EMULATED_MSRS)) {
+		mid = low + ((high - low) >> 1U);
+		if (emulated_msr_index[mid].msr == msr) {
+			index = emulated_msr_index[mid].index;
+		} else if (emulated_msr_index[mid].msr < msr) {
+			low = mid + 1U;
+		} else {
+			high = mid;
 		}
 	}
 
+	return index;
+}
+
+/* emulated_guest_msrs[] shares same indexes with array vcpu->arch->guest_msrs[] */
+uint32_t vmsr_get_guest_msr_index(uint32_t msr)
+{
+	uint32_t index = lookup_emulated_msr(msr);
+
 	if (index == NUM_EMULATED_MSRS) {
 		pr_err("%s, MSR %x is not defined in array emulated_guest_msrs[]", __func__, msr);
 	}
@@ -310,6 +358,31 @@ uint32_t vmsr_get_guest_msr_index(uint32_t msr)
 	return index;
 }
 
+/* Count a RDMSR/WRMSR exit for the msr_stats shell command */
+static void vmsr_count_exit(struct acrn_vcpu *vcpu, uint32_t msr)
+{
+	uint32_t slot;
+
+	if (is_x2apic_msr(msr)) {
+		slot = VMSR_EXIT_X2APIC_SLOT + (msr - 0x800U);
+	} else {
+		slot = lookup_emulated_msr(msr);
+		if (slot == NUM_EMULATED_MSRS) {
+			slot = VMSR_EXIT_OTHER_SLOT;
+		}
+	}
+
+	vcpu->msr_exits[slot]++;
+}
+
+/*
+ * @pre slot < VMSR_EXIT_OTHER_SLOT
+ */
+uint32_t vmsr_exit_slot_to_msr(uint32_t slot)
+{
+	return (slot < VMSR_EXIT_X2APIC_SLOT) ? emulated_guest_msrs[slot] : (0x800U + (slot - VMSR_EXIT_X2APIC_SLOT));
+}
+
 static void enable_msr_interception(uint8_t *bitmap, uint32_t msr_arg, uint32_t mode)
 {
 	uint32_t read_offset = 0U;
@@ -363,7 +436,11 @@ static void intercept_x2apic_msrs(uint8_t *msr_bitmap_arg, uint32_t mode)
  */
 static void prepare_auto_msr_area(struct acrn_vcpu *vcpu)
 {
+	uint32_t rmid;
+
 	vcpu->arch.msr_area.count = 0U;
+	vcpu->arch.msr_area.switch_pqr_assoc = false;
+	vcpu->arch.msr_area.pqr_assoc_loaded = false;
 
 	/* in HV, disable perf/PMC counting, just count in guest VM */
 	if (is_pmu_pt_configured(vcpu->vm)) {
@@ -374,27 +451,27 @@ static void prepare_auto_msr_area(struct acrn_vcpu *vcpu)
 		vcpu->arch.msr_area.count++;
 	}
 
-	if (is_platform_rdt_capable()) {
+	rmid = get_vm_rmid(vcpu->vm->vm_id);
+	if (is_platform_rdt_capable() || (rmid != 0U)) {
 		struct acrn_vm_config *cfg = get_vm_config(vcpu->vm->vm_id);
-		uint16_t vcpu_clos;
+		uint16_t vcpu_clos = hv_clos;
 
-		ASSERT(cfg->pclosids != NULL, "error, cfg->pclosids is NULL");
+		if (is_platform_rdt_capable()) {
+			ASSERT(cfg->pclosids != NULL, "error, cfg->pclosids is NULL");
 
-		vcpu_clos = cfg->pclosids[vcpu->vcpu_id%cfg->num_pclosids];
+			vcpu_clos = cfg->pclosids[vcpu->vcpu_id%cfg->num_pclosids];
+		}
 
 		/* RDT: only load/restore MSR_IA32_PQR_ASSOC when hv and guest have different settings
 		 * vCAT: always load/restore MSR_IA32_PQR_ASSOC
+		 * RDT monitoring: the RMID of the VM is always different from the one of hv (0)
 		 */
-		if (is_vcat_configured(vcpu->vm) || (vcpu_clos != hv_clos)) {
-			vcpu->arch.msr_area.guest[vcpu->arch.msr_area.count].msr_index = MSR_IA32_PQR_ASSOC;
-			vcpu->arch.msr_area.guest[vcpu->arch.msr_area.count].value = clos2pqr_msr(vcpu_clos);
-			vcpu->arch.msr_area.host[vcpu->arch.msr_area.count].msr_index = MSR_IA32_PQR_ASSOC;
-			vcpu->arch.msr_area.host[vcpu->arch.msr_area.count].value = clos2pqr_msr(hv_clos);
-			vcpu->arch.msr_area.index_of_pqr_assoc = vcpu->arch.msr_area.count;
-			vcpu->arch.msr_area.count++;
-
-			pr_acrnlog("switch clos for VM %u vcpu_id %u, host 0x%x, guest 0x%x",
-				vcpu->vm->vm_id, vcpu->vcpu_id, hv_clos, vcpu_clos);
+		if (is_vcat_configured(vcpu->vm) || (vcpu_clos != hv_clos) || (rmid != 0U)) {
+			vcpu->arch.msr_area.guest_pqr_assoc = clos_rmid2pqr_msr(vcpu_clos, rmid);
+			vcpu->arch.msr_area.switch_pqr_assoc = true;
+
+			pr_acrnlog("switch clos for VM %u vcpu_id %u, host 0x%x, guest 0x%x, rmid %u",
+				vcpu->vm->vm_id, vcpu->vcpu_id, hv_clos, vcpu_clos, rmid);
 		}
 	}
 
@@ -517,7 +594,10 @@ void init_msr_emulation(struct acrn_vcpu *vcpu)
 		enable_msr_interception(msr_bitmap, mtrr_msrs[i], INTERCEPT_READ_WRITE);
 	}
 
-	/* for core partition VM (like RTVM), passthrou PMC MSRs for performance profiling/tuning; hide to other VMs */
+	/*
+	 * for core partition VM (like RTVM), passthrou PMC MSRs for performance profiling/tuning; hide to other VMs,
+	 * or emulate them for the vPMU, see vpmu_read_msr()
+	 */
 	if (!is_pmu_pt_configured(vcpu->vm)) {
 		for (i = 0U; i < ARRAY_SIZE(pmc_msrs); i++) {
 			enable_msr_interception(msr_bitmap, pmc_msrs[i], INTERCEPT_READ_WRITE);
@@ -626,6 +706,7 @@ int32_t rdmsr_vmexit_handler(struct acrn_vcpu *vcpu)
 
 	/* Read the msr value */
 	msr = (uint32_t)vcpu_get_gpreg(vcpu, CPU_REG_RCX);
+	vmsr_count_exit(vcpu, msr);
 
 	/* Do the required processing for each msr case */
 	switch (msr) {
@@ -637,6 +718,17 @@ int32_t rdmsr_vmexit_handler(struct acrn_vcpu *vcpu)
 	case HV_X64_MSR_TIME_REF_COUNT:
 	case HV_X64_MSR_TSC_FREQUENCY:
 	case HV_X64_MSR_APIC_FREQUENCY:
+	case HV_X64_MSR_EOI:
+	case HV_X64_MSR_ICR:
+	case HV_X64_MSR_TPR:
+	case HV_X64_MSR_VP_ASSIST_PAGE:
+	case HV_X64_MSR_SCONTROL:
+	case HV_X64_MSR_SVERSION:
+	case HV_X64_MSR_SIEFP:
+	case HV_X64_MSR_SIMP:
+	case HV_X64_MSR_EOM:
+	case HV_X64_MSR_SINT0 ... HV_X64_MSR_SINT15:
+	case HV_X64_MSR_STIMER0_CONFIG ... HV_X64_MSR_STIMER3_COUNT:
 	{
 		err = hyperv_rdmsr(vcpu, msr, &v);
 		break;
@@ -826,6 +918,37 @@ int32_t rdmsr_vmexit_handler(struct acrn_vcpu *vcpu)
 		break;
 	}
 #endif
+	case MSR_IA32_PMC0 ... (MSR_IA32_PMC0 + VPMU_MAX_GP_COUNTERS - 1U):
+	case MSR_IA32_PERFEVTSEL0 ... (MSR_IA32_PERFEVTSEL0 + VPMU_MAX_GP_COUNTERS - 1U):
+	case MSR_IA32_FIXED_CTR0 ... (MSR_IA32_FIXED_CTR0 + VPMU_MAX_FIXED_COUNTERS - 1U):
+	case MSR_IA32_FIXED_CTR_CTL ... MSR_IA32_PERF_GLOBAL_OVF_CTRL:
+	{
+		err = vpmu_read_msr(vcpu, msr, &v);
+		break;
+	}
+	case ACRN_MSR_LAT_ACK:
+	{
+		v = 0UL;
+		break;
+	}
+	case MSR_KVM_WALL_CLOCK_NEW:
+	case MSR_KVM_SYSTEM_TIME_NEW:
+	case MSR_KVM_STEAL_TIME:
+	case MSR_KVM_PV_EOI_EN:
+	case MSR_KVM_ASYNC_PF_EN:
+	case MSR_KVM_ASYNC_PF_INT:
+	case MSR_KVM_ASYNC_PF_ACK:
+	{
+		if (is_pv_clock_configured(vcpu->vm)) {
+			err = pvclock_rdmsr(vcpu, msr, &v);
+		} else {
+			pr_warn("%s(): vm%d vcpu%d reading MSR %lx not supported",
+				__func__, vcpu->vm->vm_id, vcpu->vcpu_id, msr);
+			err = -EACCES;
+			v = 0UL;
+		}
+		break;
+	}
 	default:
 	{
 		if (is_x2apic_msr(msr)) {
@@ -904,7 +1027,7 @@ static void set_tsc_msr_interception(struct acrn_vcpu *vcpu, bool interception)
 /**
  * @pre vcpu != NULL
  */
-static void set_guest_tsc(struct acrn_vcpu *vcpu, uint64_t guest_tsc)
+void set_guest_tsc(struct acrn_vcpu *vcpu, uint64_t guest_tsc)
 {
 	uint64_t tsc_delta, tsc_offset_delta, tsc_adjust;
 
@@ -921,6 +1044,9 @@ static void set_guest_tsc(struct acrn_vcpu *vcpu, uint64_t guest_tsc)
 	exec_vmwrite64(VMX_TSC_OFFSET_FULL, tsc_delta);
 
 	set_tsc_msr_interception(vcpu, tsc_delta != 0UL);
+
+	/* the guest TSC of the last tsc_timestamp has moved */
+	pvclock_update(vcpu);
 }
 
 /*
@@ -970,6 +1096,8 @@ static void set_guest_tsc_adjust(struct acrn_vcpu *vcpu, uint64_t tsc_adjust)
 	vcpu_set_guest_msr(vcpu, MSR_IA32_TSC_ADJUST, tsc_adjust);
 
 	set_tsc_msr_interception(vcpu, (tsc_offset + tsc_adjust_delta) != 0UL);
+
+	pvclock_update(vcpu);
 }
 
 /**
@@ -987,10 +1115,10 @@ static void set_guest_ia32_misc_enalbe(struct acrn_vcpu *vcpu, uint64_t v)
 		vcpu_set_efer(vcpu, vcpu_get_efer(vcpu) & ~MSR_IA32_EFER_NXE_BIT);
 	}
 
-	/* MONITOR/MWAIT is hide.
+	/* MONITOR/MWAIT is hide unless it is passed through.
 	 * MISC_ENABLE_MONITOR_ENA should not be set.
 	 */
-	if ((v & MSR_IA32_MISC_ENABLE_MONITOR_ENA) != 0UL) {
+	if (((v & MSR_IA32_MISC_ENABLE_MONITOR_ENA) != 0UL) && !is_mwait_pt_configured(vcpu->vm)) {
 		vcpu_inject_gp(vcpu, 0U);
 		update_vmsr = false;
 	}
@@ -1011,6 +1139,7 @@ int32_t wrmsr_vmexit_handler(struct acrn_vcpu *vcpu)
 
 	/* Read the MSR ID */
 	msr = (uint32_t)vcpu_get_gpreg(vcpu, CPU_REG_RCX);
+	vmsr_count_exit(vcpu, msr);
 
 	/* Get the MSR contents */
 	v = (vcpu_get_gpreg(vcpu, CPU_REG_RDX) << 32U) |
@@ -1026,6 +1155,17 @@ int32_t wrmsr_vmexit_handler(struct acrn_vcpu *vcpu)
 	case HV_X64_MSR_TIME_REF_COUNT:
 	case HV_X64_MSR_TSC_FREQUENCY:
 	case HV_X64_MSR_APIC_FREQUENCY:
+	case HV_X64_MSR_EOI:
+	case HV_X64_MSR_ICR:
+	case HV_X64_MSR_TPR:
+	case HV_X64_MSR_VP_ASSIST_PAGE:
+	case HV_X64_MSR_SCONTROL:
+	case HV_X64_MSR_SVERSION:
+	case HV_X64_MSR_SIEFP:
+	case HV_X64_MSR_SIMP:
+	case HV_X64_MSR_EOM:
+	case HV_X64_MSR_SINT0 ... HV_X64_MSR_SINT15:
+	case HV_X64_MSR_STIMER0_CONFIG ... HV_X64_MSR_STIMER3_COUNT:
 	{
 		err = hyperv_wrmsr(vcpu, msr, v);
 		break;
@@ -1104,7 +1244,9 @@ int32_t wrmsr_vmexit_handler(struct acrn_vcpu *vcpu)
 	{
 		if (is_vhwp_configured(vcpu->vm) &&
 			((v & (MSR_IA32_HWP_REQUEST_RSV_BITS | MSR_IA32_HWP_REQUEST_PKG_CTL)) == 0)) {
-			msr_write(msr, v);
+			/* kept for the switches of the vCPU on a shared pCPU */
+			vcpu_set_guest_msr(vcpu, msr, v);
+			load_vcpu_freq_policy(vcpu);
 		} else {
 			err = -EACCES;
 		}
@@ -1257,6 +1399,40 @@ int32_t wrmsr_vmexit_handler(struct acrn_vcpu *vcpu)
 		break;
 	}
 #endif
+	case MSR_IA32_PMC0 ... (MSR_IA32_PMC0 + VPMU_MAX_GP_COUNTERS - 1U):
+	case MSR_IA32_PERFEVTSEL0 ... (MSR_IA32_PERFEVTSEL0 + VPMU_MAX_GP_COUNTERS - 1U):
+	case MSR_IA32_FIXED_CTR0 ... (MSR_IA32_FIXED_CTR0 + VPMU_MAX_FIXED_COUNTERS - 1U):
+	case MSR_IA32_FIXED_CTR_CTL ... MSR_IA32_PERF_GLOBAL_OVF_CTRL:
+	{
+		err = vpmu_write_msr(vcpu, msr, v);
+		break;
+	}
+	case ACRN_MSR_LAT_ACK:
+	{
+		/* v is the vector acked, the latency is that of the first interrupt posted since the last ack */
+		if (vcpu->lat_post_tsc != 0UL) {
+			lat_probe_record(&vcpu->vm->lat_probe, ACRN_LAT_ACK, cpu_ticks() - vcpu->lat_post_tsc);
+			vcpu->lat_post_tsc = 0UL;
+		}
+		break;
+	}
+	case MSR_KVM_WALL_CLOCK_NEW:
+	case MSR_KVM_SYSTEM_TIME_NEW:
+	case MSR_KVM_STEAL_TIME:
+	case MSR_KVM_PV_EOI_EN:
+	case MSR_KVM_ASYNC_PF_EN:
+	case MSR_KVM_ASYNC_PF_INT:
+	case MSR_KVM_ASYNC_PF_ACK:
+	{
+		if (is_pv_clock_configured(vcpu->vm)) {
+			err = pvclock_wrmsr(vcpu, msr, v);
+		} else {
+			pr_warn("%s(): vm%d vcpu%d writing MSR %lx not supported",
+				__func__, vcpu->vm->vm_id, vcpu->vcpu_id, msr);
+			err = -EACCES;
+		}
+		break;
+	}
 	default:
 	{
 		if (is_x2apic_msr(msr)) {
@@ -1303,6 +1479,13 @@ void update_msr_bitmap_x2apic_apicv(struct acrn_vcpu *vcpu)
 		 */
 		enable_msr_interception(msr_bitmap, MSR_IA32_EXT_APIC_EOI, INTERCEPT_DISABLE);
 		enable_msr_interception(msr_bitmap, MSR_IA32_EXT_APIC_SELF_IPI, INTERCEPT_DISABLE);
+		/*
+		 * With IPI virtualization the ICR writes it can't post cause an
+		 * APIC-write VM exit in place of the WRMSR one.
+		 */
+		if (vcpu->vm->arch_vm.ipiv_enabled) {
+			enable_msr_interception(msr_bitmap, MSR_IA32_EXT_APIC_ICR, INTERCEPT_DISABLE);
+		}
 	}
 
 	enable_msr_interception(msr_bitmap, MSR_IA32_EXT_APIC_TPR, INTERCEPT_DISABLE);
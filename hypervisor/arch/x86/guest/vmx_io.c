@@ -14,6 +14,9 @@
 #include <asm/guest/vmexit.h>
 #include <asm/vmx.h>
 #include <asm/guest/ept.h>
+#include <asm/guest/guest_memory.h>
+#include <asm/guest/virq.h>
+#include <asm/mmu.h>
 #include <asm/pgtable.h>
 #include <trace.h>
 #include <logmsg.h>
@@ -58,6 +61,143 @@ emulate_pio_complete(struct acrn_vcpu *vcpu, const struct io_request *io_req)
 }
 
 
+/**
+ * @brief General complete-work for string port I/O emulation
+ *
+ * The registers are advanced when the request is made, only a read of an
+ * element crossing a page is left: it is stored to the guest here.
+ *
+ * @pre io_req->io_type == ACRN_IOREQ_TYPE_PORTIO_STRING
+ */
+void
+emulate_pio_string_complete(struct acrn_vcpu *vcpu, const struct io_request *io_req)
+{
+	const struct acrn_pio_string_request *str_req = &io_req->reqs.pio_string_request;
+	uint32_t value = str_req->value;
+	uint32_t err_code = PAGE_FAULT_WR_FLAG;
+	uint64_t fault_addr;
+
+	if ((str_req->direction == ACRN_IOREQ_DIR_READ) && ((str_req->flags & ACRN_PIO_STRING_VALUE) != 0U)) {
+		if (copy_to_gva(vcpu, &value, io_req->pio_string_gva, (uint32_t)str_req->size,
+				&err_code, &fault_addr) < 0) {
+			vcpu_inject_pf(vcpu, fault_addr, err_code);
+		}
+	}
+}
+
+/*
+ * The new value of a register used by a string instruction with the address
+ * size \p mask: a 16-bit update keeps the upper bits, a 32-bit one clears them.
+ */
+static uint64_t string_reg_update(uint64_t old, uint64_t val, uint64_t mask)
+{
+	return (mask == 0xFFFFUL) ? ((old & ~mask) | (val & mask)) : (val & mask);
+}
+
+/**
+ * @brief The handler of VM exits on ins/outs, with or without rep
+ *
+ * All the iterations whose elements are in the guest page of the current one
+ * are emulated by a single ACRN_IOREQ_TYPE_PORTIO_STRING request, an element
+ * crossing the page goes alone in the request. RCX and RSI/RDI are advanced
+ * past them here, and the instruction is executed again if iterations are
+ * left, so the guest takes its interrupts between the chunks. The guest
+ * linear address from the VMCS has the segment applied already.
+ */
+static int32_t pio_string_instr_vmexit_handler(struct acrn_vcpu *vcpu, uint64_t exit_qual)
+{
+	struct io_request *io_req = &vcpu->req;
+	struct acrn_pio_string_request *str_req = &io_req->reqs.pio_string_request;
+	uint64_t size = vm_exit_io_instruction_size(exit_qual) + 1UL;
+	bool in = (vm_exit_io_instruction_access_direction(exit_qual) != 0UL);
+	bool rep = (vm_exit_io_instruction_is_rep_prefixed(exit_qual) != 0UL);
+	bool down = ((vcpu_get_rflags(vcpu) & RFLAGS_D) != 0UL);
+	uint32_t reg = in ? CPU_REG_RDI : CPU_REG_RSI;
+	uint32_t err_code = in ? PAGE_FAULT_WR_FLAG : 0U;
+	uint64_t gva = exec_vmread(VMX_GUEST_LINEAR_ADDR);
+	uint64_t mask, count, n, offset, gpa, fault_addr, reg_val;
+	int32_t status = 0;
+
+	/* bits 9:7 of the VM-exit instruction information are the address size */
+	switch ((exec_vmread32(VMX_INSTR_INFO) >> 7U) & 0x7U) {
+	case 0U:
+		mask = 0xFFFFUL;
+		break;
+	case 1U:
+		mask = 0xFFFFFFFFUL;
+		break;
+	default:
+		mask = ~0UL;
+		break;
+	}
+
+	count = rep ? (vcpu_get_gpreg(vcpu, CPU_REG_RCX) & mask) : 1UL;
+
+	(void)memset(str_req, 0U, sizeof(*str_req));
+	io_req->io_type = ACRN_IOREQ_TYPE_PORTIO_STRING;
+	str_req->direction = in ? ACRN_IOREQ_DIR_READ : ACRN_IOREQ_DIR_WRITE;
+	str_req->address = vm_exit_io_instruction_port_number(exit_qual);
+	str_req->size = size;
+	if (down) {
+		str_req->flags |= ACRN_PIO_STRING_DOWN;
+	}
+
+	if (count == 0UL) {
+		/* no action: a rep with a zero count */
+	} else if (gva2gpa(vcpu, gva, &gpa, &err_code) < 0) {
+		/* -EFAULT, the arguments are valid */
+		vcpu_inject_pf(vcpu, gva, err_code);
+		vcpu_retain_rip(vcpu);
+	} else if (gpa2hva(vcpu->vm, gpa) == NULL) {
+		/* the instruction moves the data from or to memory, not MMIO */
+		vcpu_inject_gp(vcpu, 0U);
+		vcpu_retain_rip(vcpu);
+	} else {
+		offset = gpa & ~PAGE_MASK;
+		if ((offset + size) > PAGE_SIZE) {
+			n = 0UL;
+		} else if (down) {
+			n = (offset / size) + 1UL;
+		} else {
+			n = (PAGE_SIZE - offset) / size;
+		}
+
+		if (n == 0UL) {
+			n = 1UL;
+			str_req->flags |= ACRN_PIO_STRING_VALUE;
+			io_req->pio_string_gva = gva;
+			if (!in) {
+				if (copy_from_gva(vcpu, &str_req->value, gva, (uint32_t)size, &err_code, &fault_addr) < 0) {
+					vcpu_inject_pf(vcpu, fault_addr, err_code);
+					vcpu_retain_rip(vcpu);
+					n = 0UL;
+				}
+			}
+		} else {
+			n = min(n, count);
+			str_req->gpa = down ? (gpa - ((n - 1UL) * size)) : gpa;
+		}
+		str_req->count = n;
+
+		if (n != 0UL) {
+			reg_val = vcpu_get_gpreg(vcpu, reg);
+			reg_val = string_reg_update(reg_val, down ? (reg_val - (n * size)) : (reg_val + (n * size)), mask);
+			vcpu_set_gpreg(vcpu, reg, reg_val);
+			if (rep) {
+				vcpu_set_gpreg(vcpu, CPU_REG_RCX,
+					string_reg_update(vcpu_get_gpreg(vcpu, CPU_REG_RCX), count - n, mask));
+				if (count > n) {
+					vcpu_retain_rip(vcpu);
+				}
+			}
+
+			status = emulate_io(vcpu, io_req);
+		}
+	}
+
+	return status;
+}
+
 /**
  * @brief The handler of VM exits on I/O instructions
  *
@@ -74,28 +214,49 @@ int32_t pio_instr_vmexit_handler(struct acrn_vcpu *vcpu)
 
 	exit_qual = vcpu->arch.exit_qualification;
 
-	io_req->io_type = ACRN_IOREQ_TYPE_PORTIO;
-	pio_req->size = vm_exit_io_instruction_size(exit_qual) + 1UL;
-	pio_req->address = vm_exit_io_instruction_port_number(exit_qual);
-	if (vm_exit_io_instruction_access_direction(exit_qual) == 0UL) {
-		mask = 0xFFFFFFFFU >> (32U - (8U * pio_req->size));
-		pio_req->direction = ACRN_IOREQ_DIR_WRITE;
-		pio_req->value = (uint32_t)vcpu_get_gpreg(vcpu, CPU_REG_RAX) & mask;
-	} else {
-		pio_req->direction = ACRN_IOREQ_DIR_READ;
-	}
-
 	TRACE_4I(TRACE_VMEXIT_IO_INSTRUCTION,
-		(uint32_t)pio_req->address,
-		(uint32_t)pio_req->direction,
-		(uint32_t)pio_req->size,
+		(uint32_t)vm_exit_io_instruction_port_number(exit_qual),
+		(uint32_t)vm_exit_io_instruction_access_direction(exit_qual),
+		(uint32_t)vm_exit_io_instruction_size(exit_qual) + 1U,
 		(uint32_t)cur_context_idx);
 
-	status = emulate_io(vcpu, io_req);
+	if (vm_exit_io_instruction_is_string(exit_qual) != 0UL) {
+		status = pio_string_instr_vmexit_handler(vcpu, exit_qual);
+	} else {
+		io_req->io_type = ACRN_IOREQ_TYPE_PORTIO;
+		pio_req->size = vm_exit_io_instruction_size(exit_qual) + 1UL;
+		pio_req->address = vm_exit_io_instruction_port_number(exit_qual);
+		if (vm_exit_io_instruction_access_direction(exit_qual) == 0UL) {
+			mask = 0xFFFFFFFFU >> (32U - (8U * pio_req->size));
+			pio_req->direction = ACRN_IOREQ_DIR_WRITE;
+			pio_req->value = (uint32_t)vcpu_get_gpreg(vcpu, CPU_REG_RAX) & mask;
+		} else {
+			pio_req->direction = ACRN_IOREQ_DIR_READ;
+		}
+
+		status = emulate_io(vcpu, io_req);
+	}
 
 	return status;
 }
 
+/*
+ * ept_modify_mr() doesn't flush when it only grants access rights, so the
+ * access may have faulted on a translation cached before. The EPT violation
+ * dropped it, the access only has to be retried then.
+ */
+static bool ept_access_allowed(const struct acrn_vcpu *vcpu, uint64_t gpa, uint64_t exit_qual)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	void *eptp = (vcpu->arch.cur_context == NORMAL_WORLD) ? vm->arch_vm.nworld_eptp : vm->arch_vm.sworld_eptp;
+	const uint64_t *pgentry;
+	uint64_t pg_size = 0UL;
+
+	/* bit 0~2 of the exit qualification are the read, write and fetch access, as the EPT_RWX bits */
+	pgentry = pgtable_lookup_entry((uint64_t *)eptp, gpa, &pg_size, &vm->arch_vm.ept_pgtable);
+	return ((pgentry != NULL) && (((exit_qual & EPT_RWX) & ~(*pgentry)) == 0UL));
+}
+
 int32_t ept_violation_vmexit_handler(struct acrn_vcpu *vcpu)
 {
 	int32_t status = -EINVAL, ret;
@@ -107,12 +268,32 @@ int32_t ept_violation_vmexit_handler(struct acrn_vcpu *vcpu)
 	/* Handle page fault from guest */
 	exit_qual = vcpu->arch.exit_qualification;
 	/* Get the guest physical address */
-	gpa = exec_vmread64(VMX_GUEST_PHYSICAL_ADDR_FULL);
+	gpa = vcpu_get_exit_guest_phys_addr(vcpu);
 
 	TRACE_2L(TRACE_VMEXIT_EPT_VIOLATION, exit_qual, gpa);
 
-	/*caused by instruction fetch */
-	if ((exit_qual & 0x4UL) != 0UL) {
+	if (ept_access_allowed(vcpu, gpa, exit_qual)) {
+		vcpu_retain_rip(vcpu);
+		status = 0;
+	} else if (pvclock_async_pf(vcpu, gpa)) {
+		/* the guest runs another task until the device model mapped the page again */
+		vcpu_retain_rip(vcpu);
+		status = 0;
+	} else if (((exit_qual & 0x4UL) != 0UL) && is_postlaunched_vm(vcpu->vm) && (gpa2hpa(vcpu->vm, gpa) == INVALID_HPA)) {
+		/*
+		 * An instruction fetch from guest memory the device model unmapped,
+		 * e.g. given back by its balloon. Ask it to map the page again
+		 * with a read of size 0 and retry, there is nothing to emulate.
+		 */
+		io_req->io_type = ACRN_IOREQ_TYPE_MMIO;
+		mmio_req->direction = ACRN_IOREQ_DIR_READ;
+		mmio_req->address = gpa;
+		mmio_req->size = 0UL;
+		mmio_req->value = 0UL;
+		vcpu_retain_rip(vcpu);
+		status = emulate_io(vcpu, io_req);
+	} else if ((exit_qual & 0x4UL) != 0UL) {
+		/*caused by instruction fetch */
 		/* TODO: check wehther the gpa is not a MMIO address. */
 		if (vcpu->arch.cur_context == NORMAL_WORLD) {
 			ept_modify_mr(vcpu->vm, (uint64_t *)vcpu->vm->arch_vm.nworld_eptp,
@@ -177,7 +358,7 @@ int32_t ept_violation_vmexit_handler(struct acrn_vcpu *vcpu)
 			}
 		}
 		if (ret <= 0) {
-			pr_acrnlog("Guest Linear Address: 0x%016lx", exec_vmread(VMX_GUEST_LINEAR_ADDR));
+			pr_acrnlog("Guest Linear Address: 0x%016lx", vcpu_get_exit_guest_linear_addr(vcpu));
 			pr_acrnlog("Guest Physical Address address: 0x%016lx", gpa);
 		}
 	}
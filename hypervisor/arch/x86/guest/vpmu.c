@@ -0,0 +1,432 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <types.h>
+#include <errno.h>
+#include <logmsg.h>
+#include <irq.h>
+#include <asm/irq.h>
+#include <asm/cpuid.h>
+#include <asm/cpufeatures.h>
+#include <asm/msr.h>
+#include <asm/vmx.h>
+#include <asm/apicreg.h>
+#include <asm/per_cpu.h>
+#include <asm/guest/vcpu.h>
+#include <asm/guest/virq.h>
+#include <asm/guest/vcpuid.h>
+#include <asm/guest/vm.h>
+#include <asm/guest/vlapic.h>
+#include <asm/guest/vpmu.h>
+
+/*
+ * The counters of a vCPU are in the PMU from its switch in to its switch out,
+ * and only count in non-root mode: IA32_PERF_GLOBAL_CTRL is loaded with the
+ * value of the guest on VM entry and with 0 on VM exit. All the PMU MSRs stay
+ * intercepted, the counters are read and written in the PMU while loaded and
+ * in struct acrn_vpmu otherwise.
+ *
+ * The hypervisor profiling (PROFILING_ON) takes the PMU of a pCPU from the
+ * guests while it samples, see vpmu_set_host_owned(): the counters of the
+ * vCPUs are saved and frozen until it stops.
+ */
+
+#define VPMU_VERSION			2U
+#define PERF_CAP_FW_WRITE		(1UL << 13U)	/* full width writes with IA32_A_PMCx */
+#define EVTSEL_RESERVED_BITS		0xFFFFFFFF00000000UL
+#define FIXED_CTR_CTL_BITS		4U
+
+static bool vpmu_capable;
+static bool vpmu_full_width;
+static uint32_t host_0ah_eax, host_0ah_ebx, host_0ah_edx;
+
+static bool vpmu_host_owned[MAX_PCPU_NUM];
+static struct acrn_vcpu *vpmu_loaded_vcpu[MAX_PCPU_NUM];
+
+static inline uint8_t vpmu_nr_gp(void)
+{
+	return (uint8_t)min((host_0ah_eax >> 8U) & 0xFFU, VPMU_MAX_GP_COUNTERS);
+}
+
+static inline uint8_t vpmu_nr_fixed(void)
+{
+	return (uint8_t)min(host_0ah_edx & 0x1FU, VPMU_MAX_FIXED_COUNTERS);
+}
+
+static inline uint64_t vpmu_counter_bits(const struct acrn_vpmu *vpmu)
+{
+	return ((1UL << vpmu->nr_gp) - 1UL) | (((1UL << vpmu->nr_fixed) - 1UL) << 32U);
+}
+
+#ifndef PROFILING_ON
+static void vpmu_pmi_handler(__unused uint32_t irq, __unused void *data)
+{
+	(void)vpmu_handle_pmi();
+}
+#endif
+
+/**
+ * @pre pcpu_id == get_pcpu_id()
+ */
+#ifdef PROFILING_ON
+void init_vpmu_pcpu(__unused uint16_t pcpu_id)
+#else
+void init_vpmu_pcpu(uint16_t pcpu_id)
+#endif
+{
+	uint32_t ecx;
+	uint64_t entry_ctls, exit_ctls;
+
+	/* the pCPUs are identical, each of them may probe before the BSP is done */
+	cpuid_subleaf(0xAU, 0U, &host_0ah_eax, &host_0ah_ebx, &ecx, &host_0ah_edx);
+	entry_ctls = msr_read(MSR_IA32_VMX_ENTRY_CTLS) >> 32U;
+	exit_ctls = msr_read(MSR_IA32_VMX_EXIT_CTLS) >> 32U;
+	vpmu_capable = ((host_0ah_eax & 0xFFU) >= VPMU_VERSION) &&
+			((entry_ctls & VMX_ENTRY_CTLS_LOAD_PERF) != 0UL) &&
+			((exit_ctls & VMX_EXIT_CTLS_LOAD_PERF) != 0UL);
+	vpmu_full_width = pcpu_has_cap(X86_FEATURE_PDCM) &&
+			((msr_read(MSR_IA32_PERF_CAPABILITIES) & PERF_CAP_FW_WRITE) != 0UL);
+
+	if (vpmu_capable) {
+#ifndef PROFILING_ON
+		/* with the profiling built in, its PMI handler hands the PMIs of the guests over */
+		if ((pcpu_id == BSP_CPU_ID) && (request_irq(PMI_IRQ, vpmu_pmi_handler, NULL, IRQF_NONE) < 0)) {
+			pr_err("vPMU: failed to add the PMI isr");
+		}
+#endif
+		msr_write(MSR_IA32_EXT_APIC_LVT_PMI, PMI_VECTOR);
+	}
+}
+
+/**
+ * @pre vcpu != NULL && vcpu->vm != NULL
+ */
+void init_vpmu(struct acrn_vcpu *vcpu)
+{
+	struct acrn_vpmu *vpmu = &vcpu->arch.vpmu;
+	bool reload = vpmu->loaded;
+
+	if (reload) {
+		vpmu_switch_out(vcpu);
+	}
+
+	(void)memset(vpmu, 0U, sizeof(*vpmu));
+	if (vpmu_capable && is_vpmu_configured(vcpu->vm)) {
+		vpmu->enabled = true;
+		vpmu->nr_gp = vpmu_nr_gp();
+		vpmu->nr_fixed = vpmu_nr_fixed();
+		vpmu->gp_mask = (1UL << ((host_0ah_eax >> 16U) & 0xFFU)) - 1UL;
+		vpmu->fixed_mask = (1UL << ((host_0ah_edx >> 5U) & 0xFFU)) - 1UL;
+	}
+
+	if (reload) {
+		vpmu_switch_in(vcpu);
+	}
+}
+
+/**
+ * Architectural performance monitoring leaf of a VM with a vPMU: version 2,
+ * with at most the counters init_msr_emulation() intercepts.
+ *
+ * @pre vm != NULL && entry != NULL
+ */
+bool vpmu_get_cpuid_0ah(const struct acrn_vm *vm, struct vcpuid_entry *entry)
+{
+	bool ret = false;
+
+	if (vpmu_capable && is_vpmu_configured(vm)) {
+		entry->eax = VPMU_VERSION | ((uint32_t)vpmu_nr_gp() << 8U) | (host_0ah_eax & 0xFFFF0000U);
+		entry->ebx = host_0ah_ebx;
+		entry->ecx = 0U;
+		entry->edx = (uint32_t)vpmu_nr_fixed() | (host_0ah_edx & 0x1FE0U);
+		ret = true;
+	}
+
+	return ret;
+}
+
+static void vpmu_write_pmc(uint32_t idx, uint64_t val)
+{
+	if (vpmu_full_width) {
+		msr_write(MSR_IA32_A_PMC0 + idx, val);
+	} else {
+		/* the PMU sign extends bit 31, enough for the -period the guests write */
+		msr_write(MSR_IA32_PMC0 + idx, val);
+	}
+}
+
+/*
+ * @pre vcpu == get_running_vcpu(get_pcpu_id()) and its VMCS is the current one
+ */
+static void vpmu_load(struct acrn_vcpu *vcpu)
+{
+	struct acrn_vpmu *vpmu = &vcpu->arch.vpmu;
+	uint32_t i;
+
+	for (i = 0U; i < vpmu->nr_gp; i++) {
+		vpmu_write_pmc(i, vpmu->pmc[i]);
+		msr_write(MSR_IA32_PERFEVTSEL0 + i, vpmu->evtsel[i]);
+	}
+	for (i = 0U; i < vpmu->nr_fixed; i++) {
+		msr_write(MSR_IA32_FIXED_CTR0 + i, vpmu->fixed_ctr[i]);
+	}
+	msr_write(MSR_IA32_FIXED_CTR_CTL, vpmu->fixed_ctr_ctl);
+
+	exec_vmwrite64(VMX_GUEST_IA32_PERF_CTL_FULL, vpmu->global_ctrl);
+	exec_vmwrite64(VMX_HOST_IA32_PERF_CTL_FULL, 0UL);
+	exec_vmwrite32(VMX_ENTRY_CONTROLS, exec_vmread32(VMX_ENTRY_CONTROLS) | VMX_ENTRY_CTLS_LOAD_PERF);
+	exec_vmwrite32(VMX_EXIT_CONTROLS, exec_vmread32(VMX_EXIT_CONTROLS) | VMX_EXIT_CTLS_LOAD_PERF);
+
+	vpmu->loaded = true;
+	vpmu_loaded_vcpu[get_pcpu_id()] = vcpu;
+}
+
+/*
+ * @pre vcpu->arch.vpmu.loaded and the VMCS of vcpu is the current one
+ */
+static void vpmu_save(struct acrn_vcpu *vcpu)
+{
+	struct acrn_vpmu *vpmu = &vcpu->arch.vpmu;
+	uint64_t status;
+	uint32_t i;
+
+	for (i = 0U; i < vpmu->nr_gp; i++) {
+		msr_write(MSR_IA32_PERFEVTSEL0 + i, 0UL);
+		vpmu->pmc[i] = msr_read(MSR_IA32_PMC0 + i) & vpmu->gp_mask;
+	}
+	msr_write(MSR_IA32_FIXED_CTR_CTL, 0UL);
+	for (i = 0U; i < vpmu->nr_fixed; i++) {
+		vpmu->fixed_ctr[i] = msr_read(MSR_IA32_FIXED_CTR0 + i) & vpmu->fixed_mask;
+	}
+
+	/* the overflows are kept for the guest, and not left to the next owner */
+	status = msr_read(MSR_IA32_PERF_GLOBAL_STATUS) & vpmu_counter_bits(vpmu);
+	vpmu->global_status |= status;
+	msr_write(MSR_IA32_PERF_GLOBAL_OVF_CTRL, status);
+
+	exec_vmwrite32(VMX_ENTRY_CONTROLS, exec_vmread32(VMX_ENTRY_CONTROLS) & ~VMX_ENTRY_CTLS_LOAD_PERF);
+	exec_vmwrite32(VMX_EXIT_CONTROLS, exec_vmread32(VMX_EXIT_CONTROLS) & ~VMX_EXIT_CTLS_LOAD_PERF);
+
+	vpmu->loaded = false;
+	vpmu_loaded_vcpu[get_pcpu_id()] = NULL;
+}
+
+void vpmu_switch_in(struct acrn_vcpu *vcpu)
+{
+	if (vcpu->arch.vpmu.enabled && !vpmu_host_owned[get_pcpu_id()]) {
+		vpmu_load(vcpu);
+	}
+}
+
+void vpmu_switch_out(struct acrn_vcpu *vcpu)
+{
+	if (vcpu->arch.vpmu.loaded) {
+		vpmu_save(vcpu);
+	}
+}
+
+/**
+ * Called on each pCPU when the hypervisor profiling starts or stops using
+ * the PMU.
+ */
+void vpmu_set_host_owned(bool host_owned)
+{
+	uint16_t pcpu_id = get_pcpu_id();
+	struct acrn_vcpu *vcpu;
+
+	if (vpmu_capable && (vpmu_host_owned[pcpu_id] != host_owned)) {
+		vpmu_host_owned[pcpu_id] = host_owned;
+		if (host_owned) {
+			vcpu = vpmu_loaded_vcpu[pcpu_id];
+			if (vcpu != NULL) {
+				vpmu_save(vcpu);
+			}
+		} else {
+			vcpu = get_running_vcpu(pcpu_id);
+			if ((vcpu != NULL) && vcpu->arch.vpmu.enabled) {
+				vpmu_load(vcpu);
+			}
+			/* the profiling leaves the PMI masked */
+			msr_write(MSR_IA32_EXT_APIC_LVT_PMI, PMI_VECTOR);
+		}
+	}
+}
+
+/**
+ * Forward a PMI to the vCPU whose counters are loaded on the pCPU.
+ *
+ * @return false if the PMU is owned by the hypervisor profiling.
+ */
+bool vpmu_handle_pmi(void)
+{
+	uint16_t pcpu_id = get_pcpu_id();
+	struct acrn_vcpu *vcpu = vpmu_loaded_vcpu[pcpu_id];
+	bool handled = false;
+
+	if (vpmu_capable && !vpmu_host_owned[pcpu_id]) {
+		if (vcpu != NULL) {
+			/* the guest reads and clears the overflows in IA32_PERF_GLOBAL_STATUS */
+			(void)vlapic_set_local_intr(vcpu->vm, vcpu->vcpu_id, APIC_LVT_PMC);
+		}
+		/* the delivery of the PMI masked the LVT entry */
+		msr_write(MSR_IA32_EXT_APIC_LVT_PMI, PMI_VECTOR);
+		handled = true;
+	}
+
+	return handled;
+}
+
+/**
+ * @pre vcpu != NULL && val != NULL
+ */
+int32_t vpmu_read_msr(struct acrn_vcpu *vcpu, uint32_t msr, uint64_t *val)
+{
+	struct acrn_vpmu *vpmu = &vcpu->arch.vpmu;
+	uint32_t idx;
+	int32_t err = 0;
+
+	if (!vpmu->enabled) {
+		err = -EACCES;
+	} else if ((msr >= MSR_IA32_PMC0) && (msr < (MSR_IA32_PMC0 + vpmu->nr_gp))) {
+		idx = msr - MSR_IA32_PMC0;
+		*val = vpmu->loaded ? (msr_read(msr) & vpmu->gp_mask) : vpmu->pmc[idx];
+	} else if ((msr >= MSR_IA32_PERFEVTSEL0) && (msr < (MSR_IA32_PERFEVTSEL0 + vpmu->nr_gp))) {
+		*val = vpmu->evtsel[msr - MSR_IA32_PERFEVTSEL0];
+	} else if ((msr >= MSR_IA32_FIXED_CTR0) && (msr < (MSR_IA32_FIXED_CTR0 + vpmu->nr_fixed))) {
+		idx = msr - MSR_IA32_FIXED_CTR0;
+		*val = vpmu->loaded ? (msr_read(msr) & vpmu->fixed_mask) : vpmu->fixed_ctr[idx];
+	} else {
+		switch (msr) {
+		case MSR_IA32_FIXED_CTR_CTL:
+			*val = vpmu->fixed_ctr_ctl;
+			break;
+		case MSR_IA32_PERF_GLOBAL_CTRL:
+			*val = vpmu->global_ctrl;
+			break;
+		case MSR_IA32_PERF_GLOBAL_STATUS:
+			*val = vpmu->global_status;
+			if (vpmu->loaded) {
+				*val |= msr_read(msr) & vpmu_counter_bits(vpmu);
+			}
+			break;
+		case MSR_IA32_PERF_GLOBAL_OVF_CTRL:
+			*val = 0UL;
+			break;
+		default:
+			err = -EACCES;
+			break;
+		}
+	}
+
+	return err;
+}
+
+/**
+ * @pre vcpu != NULL
+ */
+int32_t vpmu_write_msr(struct acrn_vcpu *vcpu, uint32_t msr, uint64_t val)
+{
+	struct acrn_vpmu *vpmu = &vcpu->arch.vpmu;
+	uint64_t bits;
+	uint32_t idx;
+	int32_t err = 0;
+
+	if (!vpmu->enabled) {
+		err = -EACCES;
+	} else if ((msr >= MSR_IA32_PMC0) && (msr < (MSR_IA32_PMC0 + vpmu->nr_gp))) {
+		idx = msr - MSR_IA32_PMC0;
+		vpmu->pmc[idx] = val & vpmu->gp_mask;
+		if (vpmu->loaded) {
+			vpmu_write_pmc(idx, vpmu->pmc[idx]);
+		}
+	} else if ((msr >= MSR_IA32_PERFEVTSEL0) && (msr < (MSR_IA32_PERFEVTSEL0 + vpmu->nr_gp))) {
+		if ((val & EVTSEL_RESERVED_BITS) != 0UL) {
+			err = -EACCES;
+		} else {
+			vpmu->evtsel[msr - MSR_IA32_PERFEVTSEL0] = val;
+			if (vpmu->loaded) {
+				msr_write(msr, val);
+			}
+		}
+	} else if ((msr >= MSR_IA32_FIXED_CTR0) && (msr < (MSR_IA32_FIXED_CTR0 + vpmu->nr_fixed))) {
+		idx = msr - MSR_IA32_FIXED_CTR0;
+		vpmu->fixed_ctr[idx] = val & vpmu->fixed_mask;
+		if (vpmu->loaded) {
+			msr_write(msr, vpmu->fixed_ctr[idx]);
+		}
+	} else {
+		switch (msr) {
+		case MSR_IA32_FIXED_CTR_CTL:
+			if ((val >> (vpmu->nr_fixed * FIXED_CTR_CTL_BITS)) != 0UL) {
+				err = -EACCES;
+			} else {
+				vpmu->fixed_ctr_ctl = val;
+				if (vpmu->loaded) {
+					msr_write(msr, val);
+				}
+			}
+			break;
+		case MSR_IA32_PERF_GLOBAL_CTRL:
+			if ((val & ~vpmu_counter_bits(vpmu)) != 0UL) {
+				err = -EACCES;
+			} else {
+				vpmu->global_ctrl = val;
+				if (vpmu->loaded) {
+					exec_vmwrite64(VMX_GUEST_IA32_PERF_CTL_FULL, val);
+				}
+			}
+			break;
+		case MSR_IA32_PERF_GLOBAL_OVF_CTRL:
+			/* the buffer overflow and condition changed bits have nothing to clear */
+			bits = val & vpmu_counter_bits(vpmu);
+			vpmu->global_status &= ~bits;
+			if (vpmu->loaded) {
+				msr_write(msr, bits);
+			}
+			break;
+		default:
+			/* IA32_PERF_GLOBAL_STATUS is read-only */
+			err = -EACCES;
+			break;
+		}
+	}
+
+	return err;
+}
+
+/*
+ * RDPMC exits for all the VMs but those with the PMU passed through. The
+ * CPL and CR4.PCE checks have priority over the VM exit.
+ */
+int32_t rdpmc_vmexit_handler(struct acrn_vcpu *vcpu)
+{
+	const struct acrn_vpmu *vpmu = &vcpu->arch.vpmu;
+	uint32_t ecx = (uint32_t)vcpu_get_gpreg(vcpu, CPU_REG_RCX);
+	uint32_t idx = ecx & ~(1U << 30U);
+	uint32_t msr, nr;
+	uint64_t v = 0UL;
+
+	if (!vpmu->enabled) {
+		vcpu_inject_ud(vcpu);
+	} else {
+		/* ECX[30] selects the fixed counters, the index is bound by those the vPMU exposes */
+		if ((ecx & (1U << 30U)) != 0U) {
+			msr = MSR_IA32_FIXED_CTR0;
+			nr = vpmu->nr_fixed;
+		} else {
+			msr = MSR_IA32_PMC0;
+			nr = vpmu->nr_gp;
+		}
+		if ((idx >= nr) || (vpmu_read_msr(vcpu, msr + idx, &v) != 0)) {
+			vcpu_inject_gp(vcpu, 0U);
+		} else {
+			vcpu_set_gpreg(vcpu, CPU_REG_RAX, v & 0xFFFFFFFFUL);
+			vcpu_set_gpreg(vcpu, CPU_REG_RDX, v >> 32U);
+		}
+	}
+
+	return 0;
+}
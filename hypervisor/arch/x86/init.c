@@ -12,6 +12,7 @@
 #include <asm/vmx.h>
 #include <asm/guest/vm.h>
 #include <logmsg.h>
+#include <flightrec.h>
 #include <asm/seed.h>
 #include <asm/boot/ld_sym.h>
 #include <boot.h>
@@ -51,12 +52,14 @@ static void init_debug_post(uint16_t pcpu_id)
 	}
 
 	profiling_setup();
+	flightrec_init(pcpu_id);
 }
 
 /*TODO: move into guest-vcpu module */
 static void init_guest_mode(uint16_t pcpu_id)
 {
 	vmx_on();
+	init_vpmu_pcpu(pcpu_id);
 
 	launch_vms(pcpu_id);
 }
@@ -70,6 +73,9 @@ static void init_pcpu_comm_post(void)
 	init_pcpu_post(pcpu_id);
 	init_debug_post(pcpu_id);
 	init_guest_mode(pcpu_id);
+	if (pcpu_id == BSP_CPU_ID) {
+		log_boot_phase("VMs launched");
+	}
 	run_idle_thread();
 }
 
@@ -12,10 +12,12 @@
 #include <asm/irq.h>
 #include <asm/idt.h>
 #include <asm/ioapic.h>
+#include <flightrec.h>
 #include <asm/lapic.h>
 #include <dump.h>
 #include <logmsg.h>
 #include <asm/vmx.h>
+#include <ticks.h>
 
 static spinlock_t x86_irq_spinlock = { .head = 0U, .tail = 0U, };
 
@@ -186,12 +188,15 @@ void dispatch_interrupt(const struct intr_excp_ctx *ctx)
 	uint32_t irq = vector_to_irq[vr];
 	struct x86_irq_data *irqd;
 
+	get_cpu_var(irq_tsc) = cpu_ticks();
+
 	/* The value from vector_to_irq[] must be:
 	 * IRQ_INVALID, which means the vector is not allocated;
 	 * or
 	 * < NR_IRQS, which is the irq number it bound with;
 	 * Any other value means there is something wrong.
 	 */
+	flightrec_put(FLIGHTREC_IRQ, vr, irq);
 	if (irq < NR_IRQS) {
 		irqd = &irq_data[irq];
 
@@ -196,20 +196,35 @@ uint32_t get_cur_lapic_id(void)
 	return lapic_id;
 }
 
+static void send_icr_mask(uint64_t dest_mask, union apic_icr icr)
+{
+	union apic_icr dest_icr = icr;
+	uint64_t mask = dest_mask;
+	uint16_t pcpu_id;
+
+	pcpu_id = ffs64(mask);
+	while (pcpu_id < MAX_PCPU_NUM) {
+		bitmap_clear_nolock(pcpu_id, &mask);
+		dest_icr.value_32.hi_32 = per_cpu(lapic_id, pcpu_id);
+		msr_write(MSR_IA32_EXT_APIC_ICR, dest_icr.value);
+		pcpu_id = ffs64(mask);
+	}
+}
+
 void
-send_startup_ipi(uint16_t dest_pcpu_id, uint64_t cpu_startup_start_address)
+send_startup_ipi(uint64_t dest_mask, uint64_t cpu_startup_start_address)
 {
 	union apic_icr icr;
 	struct cpuinfo_x86 *cpu_info = get_pcpu_info();
 
+	/* Each step goes to all the pCPUs, the delays are paid once */
 	icr.value = 0U;
-	icr.value_32.hi_32 = per_cpu(lapic_id, dest_pcpu_id);
 
 	/* Assert INIT IPI */
 	icr.bits.destination_mode = INTR_LAPIC_ICR_PHYSICAL;
 	icr.bits.shorthand = INTR_LAPIC_ICR_USE_DEST_ARRAY;
 	icr.bits.delivery_mode = INTR_LAPIC_ICR_INIT;
-	msr_write(MSR_IA32_EXT_APIC_ICR, icr.value);
+	send_icr_mask(dest_mask, icr);
 
 	/* Give 10ms for INIT sequence to complete for old processors.
 	 * BWG states that a delay cannot be avoided between the INIT IPI
@@ -228,7 +243,7 @@ send_startup_ipi(uint16_t dest_pcpu_id, uint64_t cpu_startup_start_address)
 	icr.bits.shorthand = INTR_LAPIC_ICR_USE_DEST_ARRAY;
 	icr.bits.delivery_mode = INTR_LAPIC_ICR_STARTUP;
 	icr.bits.vector = (uint8_t)(cpu_startup_start_address >> 12U);
-	msr_write(MSR_IA32_EXT_APIC_ICR, icr.value);
+	send_icr_mask(dest_mask, icr);
 
 	if (cpu_info->displayfamily == 6U) {
 		udelay(10U); /* 10us is enough for Modern processors */
@@ -237,7 +252,7 @@ send_startup_ipi(uint16_t dest_pcpu_id, uint64_t cpu_startup_start_address)
 	}
 
 	/* Send another start IPI as per the Intel Arch specification */
-	msr_write(MSR_IA32_EXT_APIC_ICR, icr.value);
+	send_icr_mask(dest_mask, icr);
 }
 
 void send_dest_ipi_mask(uint32_t dest_mask, uint32_t vector)
@@ -4,6 +4,24 @@
  */
 #include <types.h>
 
+/*
+ * REP MOVSB/STOSB cost a start-up time that dominates below SMALL_MEM_SIZE
+ * bytes, which are moved with plain loads and stores instead. From
+ * NT_MEM_SIZE bytes on, the stores are non-temporal (MOVNTI) so that image
+ * loads and page fills do not evict the LLC lines of the RT VMs. MOVNTI
+ * works on general purpose registers, the guest vector state the
+ * hypervisor does not save is left alone.
+ */
+#define SMALL_MEM_SIZE	32U
+#define NT_MEM_SIZE	4096U
+
+/*
+ * The byte buffers are accessed in words through these: may_alias keeps
+ * the accesses clear of strict aliasing, aligned(1) allows any address.
+ */
+typedef uint64_t __attribute__((may_alias, aligned(1))) uint64_alias_t;
+typedef uint32_t __attribute__((may_alias, aligned(1))) uint32_alias_t;
+
 static inline void memset_erms(void *base, uint8_t v, size_t n)
 {
 	asm volatile("rep ; stosb"
@@ -11,15 +29,100 @@ static inline void memset_erms(void *base, uint8_t v, size_t n)
 			: "a" (v), "c"(n));
 }
 
+static inline void movnti(uint64_alias_t *d, uint64_t v)
+{
+	asm volatile("movnti %1, %0" : "=m"(*d) : "r"(v));
+}
+
+/* order the non-temporal stores before any later store */
+static inline void nt_fence(void)
+{
+	asm volatile("sfence" ::: "memory");
+}
+
+/* n < SMALL_MEM_SIZE, d and s do not overlap */
+static inline void memcpy_small(uint8_t *d, const uint8_t *s, size_t n)
+{
+	size_t i;
+
+	if (n >= 8U) {
+		for (i = 0U; (i + 8U) <= n; i += 8U) {
+			*(uint64_alias_t *)(d + i) = *(const uint64_alias_t *)(s + i);
+		}
+		/* the last 8 bytes, over the ones already copied */
+		*(uint64_alias_t *)(d + n - 8U) = *(const uint64_alias_t *)(s + n - 8U);
+	} else if (n >= 4U) {
+		*(uint32_alias_t *)d = *(const uint32_alias_t *)s;
+		*(uint32_alias_t *)(d + n - 4U) = *(const uint32_alias_t *)(s + n - 4U);
+	} else {
+		for (i = 0U; i < n; i++) {
+			d[i] = s[i];
+		}
+	}
+}
+
+/* n < SMALL_MEM_SIZE */
+static inline void memset_small(uint8_t *base, uint64_t pattern, size_t n)
+{
+	size_t i;
+
+	if (n >= 8U) {
+		for (i = 0U; (i + 8U) <= n; i += 8U) {
+			*(uint64_alias_t *)(base + i) = pattern;
+		}
+		*(uint64_alias_t *)(base + n - 8U) = pattern;
+	} else {
+		for (i = 0U; i < n; i++) {
+			base[i] = (uint8_t)pattern;
+		}
+	}
+}
+
+/* n >= NT_MEM_SIZE, d and s do not overlap */
+static void memcpy_nt(uint8_t *d, const uint8_t *s, size_t n)
+{
+	size_t head = (8U - ((uint64_t)d & 7UL)) & 7U;
+	size_t i, len = n - head;
+
+	memcpy_small(d, s, head);
+	for (i = 0U; (i + 8U) <= len; i += 8U) {
+		movnti((uint64_alias_t *)(d + head + i), *(const uint64_alias_t *)(s + head + i));
+	}
+	nt_fence();
+	memcpy_small(d + head + i, s + head + i, len - i);
+}
+
+/* n >= NT_MEM_SIZE */
+static void memset_nt(uint8_t *base, uint64_t pattern, size_t n)
+{
+	size_t head = (8U - ((uint64_t)base & 7UL)) & 7U;
+	size_t i, len = n - head;
+
+	memset_small(base, pattern, head);
+	for (i = 0U; (i + 8U) <= len; i += 8U) {
+		movnti((uint64_alias_t *)(base + head + i), pattern);
+	}
+	nt_fence();
+	memset_small(base + head + i, pattern, len - i);
+}
+
 void *memset(void *base, uint8_t v, size_t n)
 {
-	/*
-	 * Some CPUs support enhanced REP MOVSB/STOSB feature. It is recommended
-	 * to use it when possible.
-	 */
+	uint64_t pattern = 0x0101010101010101UL * v;
+
 	if ((base != NULL) && (n != 0U)) {
-		memset_erms(base, v, n);
-        }
+		if (n < SMALL_MEM_SIZE) {
+			memset_small((uint8_t *)base, pattern, n);
+		} else if (n < NT_MEM_SIZE) {
+			/*
+			 * Some CPUs support enhanced REP MOVSB/STOSB feature. It is recommended
+			 * to use it when possible.
+			 */
+			memset_erms(base, v, n);
+		} else {
+			memset_nt((uint8_t *)base, pattern, n);
+		}
+	}
 
 	return base;
 }
@@ -58,8 +161,12 @@ int32_t memcpy_s(void *d, size_t dmax, const void *s, size_t slen)
 	int32_t ret = -1;
 
 	if ((d != NULL) && (s != NULL) && (dmax >= slen) && ((d > (s + slen)) || (s > (d + dmax)))) {
-		if (slen != 0U) {
+		if (slen < SMALL_MEM_SIZE) {
+			memcpy_small((uint8_t *)d, (const uint8_t *)s, slen);
+		} else if (slen < NT_MEM_SIZE) {
 			memcpy_erms(d, s, slen);
+		} else {
+			memcpy_nt((uint8_t *)d, (const uint8_t *)s, slen);
 		}
 		ret = 0;
 	} else {
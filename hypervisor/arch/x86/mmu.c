@@ -233,14 +233,13 @@ void set_paging_x(uint64_t base, uint64_t size)
 
 void allocate_ppt_pages(void)
 {
-       uint64_t page_base;
+       uint64_t page_base, bitmap_base;
 
        page_base = e820_alloc_memory(sizeof(struct page) * get_ppt_page_num(), MEM_4G);
-       ppt_page_pool.bitmap = (uint64_t *)e820_alloc_memory(get_ppt_page_num()/8, MEM_4G);
+       bitmap_base = e820_alloc_memory(get_ppt_page_num()/8, MEM_4G);
 
-       ppt_page_pool.start_page = (struct page *)(void *)page_base;
-       ppt_page_pool.bitmap_size = get_ppt_page_num() / 64;
-       ppt_page_pool.dummy_page = NULL;
+       init_page_pool(&ppt_page_pool, (struct page *)(void *)page_base, (uint64_t *)(void *)bitmap_base,
+               get_ppt_page_num(), NULL);
 }
 
 void init_paging(void)
@@ -17,7 +17,41 @@
 
 static uint32_t notification_irq = IRQ_INVALID;
 
-static uint64_t smp_call_mask = 0UL;
+void init_smp_call_queue(uint16_t pcpu_id)
+{
+	struct smp_call_queue *queue = &per_cpu(smp_call_queue, pcpu_id);
+
+	spinlock_init(&queue->lock);
+	queue->head = 0U;
+	queue->tail = 0U;
+}
+
+/* Run the calls queued to this pCPU until its queue is empty */
+static void run_smp_calls(uint16_t pcpu_id)
+{
+	struct smp_call_queue *queue = &per_cpu(smp_call_queue, pcpu_id);
+	struct smp_call_entry entry;
+	uint64_t rflags;
+	bool empty = false;
+
+	while (!empty) {
+		spinlock_irqsave_obtain(&queue->lock, &rflags);
+		empty = (queue->head == queue->tail);
+		if (!empty) {
+			/* copy it out, the slot is reused as soon as head moves on */
+			entry = queue->entries[queue->head % SMP_CALL_QUEUE_SIZE];
+			queue->head++;
+		}
+		spinlock_irqrestore_release(&queue->lock, rflags);
+
+		if (!empty) {
+			entry.func(entry.data);
+			if (entry.pending != NULL) {
+				bitmap_clear_lock(pcpu_id, entry.pending);
+			}
+		}
+	}
+}
 
 /* run in interrupt context */
 static void kick_notification(__unused uint32_t irq, __unused void *data)
@@ -25,17 +59,7 @@ static void kick_notification(__unused uint32_t irq, __unused void *data)
 	/* Notification vector is used to kick target cpu out of non-root mode.
 	 * And it also serves for smp call.
 	 */
-	uint16_t pcpu_id = get_pcpu_id();
-
-	if (bitmap_test(pcpu_id, &smp_call_mask)) {
-		struct smp_call_info_data *smp_call =
-			&per_cpu(smp_call_info, pcpu_id);
-
-		if (smp_call->func != NULL) {
-			smp_call->func(smp_call->data);
-		}
-		bitmap_clear_lock(pcpu_id, &smp_call_mask);
-	}
+	run_smp_calls(get_pcpu_id());
 }
 
 void handle_smp_call(void)
@@ -43,40 +67,105 @@ void handle_smp_call(void)
 	kick_notification(0, NULL);
 }
 
-void smp_call_function(uint64_t mask, smp_call_func_t func, void *data)
+/*
+ * Queue a call to pcpu_id and notify it if its queue was empty; otherwise it
+ * is still draining and will run this one too. An async call identical to
+ * one still queued is coalesced into it. Returns false if the queue is full.
+ */
+static bool queue_smp_call(uint16_t pcpu_id, smp_call_func_t func, void *data, uint64_t *pending)
+{
+	struct smp_call_queue *queue = &per_cpu(smp_call_queue, pcpu_id);
+	struct smp_call_entry *entry;
+	struct acrn_vcpu *vcpu;
+	uint64_t rflags;
+	uint32_t i;
+	bool queued = false, notify = false;
+
+	spinlock_irqsave_obtain(&queue->lock, &rflags);
+	if (pending == NULL) {
+		for (i = queue->head; (i != queue->tail) && !queued; i++) {
+			entry = &queue->entries[i % SMP_CALL_QUEUE_SIZE];
+			queued = ((entry->func == func) && (entry->data == data) && (entry->pending == NULL));
+		}
+	}
+
+	if (!queued) {
+		queued = ((queue->tail - queue->head) < SMP_CALL_QUEUE_SIZE);
+		if (queued) {
+			notify = (queue->head == queue->tail);
+			entry = &queue->entries[queue->tail % SMP_CALL_QUEUE_SIZE];
+			entry->func = func;
+			entry->data = data;
+			entry->pending = pending;
+			queue->tail++;
+		}
+	}
+	spinlock_irqrestore_release(&queue->lock, rflags);
+
+	if (notify) {
+		vcpu = get_ever_run_vcpu(pcpu_id);
+		if ((vcpu != NULL) && (is_lapic_pt_enabled(vcpu))) {
+			vcpu_make_request(vcpu, ACRN_REQUEST_SMP_CALL);
+		} else {
+			send_single_ipi(pcpu_id, NOTIFY_VCPU_VECTOR);
+		}
+	}
+
+	return queued;
+}
+
+static void queue_smp_calls(uint64_t mask, smp_call_func_t func, void *data, uint64_t *pending)
 {
-	uint16_t pcpu_id;
-	struct smp_call_info_data *smp_call;
+	uint16_t pcpu_id = ffs64(mask);
+	uint16_t self = get_pcpu_id();
 
-	/* wait for previous smp call complete, which may run on other cpus */
-	while (atomic_cmpxchg64(&smp_call_mask, 0UL, mask) != 0UL);
-	pcpu_id = ffs64(mask);
 	while (pcpu_id < MAX_PCPU_NUM) {
 		bitmap_clear_nolock(pcpu_id, &mask);
-		if (pcpu_id == get_pcpu_id()) {
+		if (pcpu_id == self) {
 			func(data);
-			bitmap_clear_nolock(pcpu_id, &smp_call_mask);
 		} else if (is_pcpu_active(pcpu_id)) {
-			smp_call = &per_cpu(smp_call_info, pcpu_id);
-			smp_call->func = func;
-			smp_call->data = data;
-
-			struct acrn_vcpu *vcpu = get_ever_run_vcpu(pcpu_id);
-
-			if ((vcpu != NULL) && (is_lapic_pt_enabled(vcpu))) {
-				vcpu_make_request(vcpu, ACRN_REQUEST_SMP_CALL);
-			} else {
-				send_single_ipi(pcpu_id, NOTIFY_VCPU_VECTOR);
+			if (pending != NULL) {
+				bitmap_set_lock(pcpu_id, pending);
+			}
+			/* keep running the calls queued to us meanwhile, the target may be waiting on them */
+			while (!queue_smp_call(pcpu_id, func, data, pending)) {
+				run_smp_calls(self);
+				asm_pause();
 			}
 		} else {
 			/* pcpu is not in active, print error */
 			pr_err("pcpu_id %d not in active!", pcpu_id);
-			bitmap_clear_nolock(pcpu_id, &smp_call_mask);
 		}
 		pcpu_id = ffs64(mask);
 	}
-	/* wait for current smp call complete */
-	wait_sync_change(&smp_call_mask, 0UL);
+}
+
+/*
+ * Run func(data) on the pCPUs in mask and wait for all of them to finish.
+ * Calls from different pCPUs are queued side by side on each target.
+ */
+void smp_call_function(uint64_t mask, smp_call_func_t func, void *data)
+{
+	uint64_t pending = 0UL;
+	uint16_t self = get_pcpu_id();
+
+	queue_smp_calls(mask, func, data, &pending);
+
+	/* wait for the call to complete, serving the calls queued to us meanwhile */
+	while (pending != 0UL) {
+		run_smp_calls(self);
+		asm_pause();
+	}
+}
+
+/*
+ * Queue func(data) to the pCPUs in mask without waiting for it to run, so
+ * data must stay valid until then. A call identical to one still queued to
+ * a pCPU is only run once there.
+ */
+void smp_call_function_async(uint64_t mask, smp_call_func_t func, void *data)
+{
+	queue_smp_calls(mask, func, data, NULL);
 }
 
 static int32_t request_notification_irq(irq_action_t func, void *data)
@@ -7,26 +7,60 @@
 #include <asm/lib/bits.h>
 #include <asm/page.h>
 #include <logmsg.h>
+#include <util.h>
 
+/*
+ * @pre page_num is a multiple of 64
+ */
+void init_page_pool(struct page_pool *pool, struct page *start_page, uint64_t *bitmap,
+		uint64_t page_num, struct page *dummy_page)
+{
+	spinlock_init(&pool->lock);
+	pool->start_page = start_page;
+	pool->bitmap = bitmap;
+	pool->bitmap_size = page_num / 64UL;
+	(void)memset((void *)pool->bitmap, 0U, pool->bitmap_size * sizeof(uint64_t));
+	pool->last_hint_id = 0UL;
+	pool->free_list = NULL;
+	(void)memset(&pool->stats, 0U, sizeof(pool->stats));
+	pool->stats.total_pages = page_num;
+	pool->dummy_page = dummy_page;
+}
 
+/*
+ * Pages freed are reused first, most recently freed first as they are likely
+ * still in the cache, so the bitmap is only searched while the pool grows.
+ */
 struct page *alloc_page(struct page_pool *pool)
 {
 	struct page *page = NULL;
 	uint64_t loop_idx, idx, bit;
 
 	spinlock_obtain(&pool->lock);
-	for (loop_idx = pool->last_hint_id;
-		loop_idx < (pool->last_hint_id + pool->bitmap_size); loop_idx++) {
-		idx = loop_idx % pool->bitmap_size;
-		if (*(pool->bitmap + idx) != ~0UL) {
-			bit = ffz64(*(pool->bitmap + idx));
-			bitmap_set_nolock(bit, pool->bitmap + idx);
-			page = pool->start_page + ((idx << 6U) + bit);
-
-			pool->last_hint_id = idx;
-			break;
+	if (pool->free_list != NULL) {
+		page = pool->free_list;
+		pool->free_list = *(struct page **)(void *)page;
+	} else {
+		for (loop_idx = pool->last_hint_id;
+			loop_idx < (pool->last_hint_id + pool->bitmap_size); loop_idx++) {
+			idx = loop_idx % pool->bitmap_size;
+			if (*(pool->bitmap + idx) != ~0UL) {
+				bit = ffz64(*(pool->bitmap + idx));
+				bitmap_set_nolock(bit, pool->bitmap + idx);
+				page = pool->start_page + ((idx << 6U) + bit);
+
+				pool->last_hint_id = idx;
+				break;
+			}
 		}
 	}
+
+	if (page != NULL) {
+		pool->stats.used_pages++;
+		pool->stats.peak_pages = max(pool->stats.peak_pages, pool->stats.used_pages);
+	} else {
+		pool->stats.failed_allocs++;
+	}
 	spinlock_release(&pool->lock);
 
 	ASSERT(page != NULL, "no page aviable!");
@@ -45,15 +79,24 @@ struct page *alloc_page(struct page_pool *pool)
 }
 
 /*
- *@pre: ((page - pool->start_page) >> 6U) < pool->bitmap_size
+ *@pre: ((page - pool->start_page) >> 6U) < pool->bitmap_size || page == pool->dummy_page
  */
 void free_page(struct page_pool *pool, struct page *page)
 {
-	uint64_t idx, bit;
+	/* the dummy page is shared by all the failed allocations, it is never freed */
+	if (page != pool->dummy_page) {
+		spinlock_obtain(&pool->lock);
+		*(struct page **)(void *)page = pool->free_list;
+		pool->free_list = page;
+		pool->stats.used_pages--;
+		pool->stats.freed_pages++;
+		spinlock_release(&pool->lock);
+	}
+}
 
+void get_page_pool_stats(struct page_pool *pool, struct page_pool_stats *stats)
+{
 	spinlock_obtain(&pool->lock);
-	idx = (page - pool->start_page) >> 6U;
-	bit = (page - pool->start_page) & 0x3fUL;
-	bitmap_clear_nolock(bit, pool->bitmap + idx);
+	*stats = pool->stats;
 	spinlock_release(&pool->lock);
 }
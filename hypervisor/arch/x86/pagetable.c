@@ -256,6 +256,63 @@ static void modify_or_del_pdpte(const uint64_t *pml4e, uint64_t vaddr_start, uin
 	}
 }
 
+/*
+ * A PT page mapping its whole 2MB range contiguously with one set of
+ * attributes, e.g. once the sub-range a modify split off has been restored,
+ * is collapsed back into a 2MB large page and freed.
+ */
+static void try_to_merge_pgtable_page(const struct pgtable *table, uint64_t *pde)
+{
+	uint64_t *pt_page = pde_page_vaddr(*pde);
+	uint64_t first = *pt_page;
+	uint64_t prot = first & ~PDE_PFN_MASK;
+	uint64_t large_prot = prot;
+	uint64_t index;
+	bool uniform;
+
+	/* skip what the large page would map with other access rights, such as code pages under the MCE mitigation */
+	table->tweak_exe_right(&large_prot);
+	uniform = pgentry_present(table, first) && ((prot & PAGE_PSE) == 0UL) && (large_prot == prot) &&
+		mem_aligned_check(first & PDE_PFN_MASK, PDE_SIZE) && table->large_page_support(IA32E_PD, prot);
+
+	for (index = 1UL; (index < PTRS_PER_PTE) && uniform; index++) {
+		uniform = (pt_page[index] == (first + (index * PTE_SIZE)));
+	}
+
+	if (uniform) {
+		set_pgentry(pde, first | PAGE_PSE, table);
+		free_page(table->pool, (void *)pt_page);
+	}
+}
+
+/*
+ * Merge the PT pages left under [vaddr_start, vaddr_end) by splits or 4KB
+ * mappings back into 2MB large pages where possible. This is done once the
+ * whole range is mapped, so the freed pages are not reused by the same walk.
+ * The PDs are shared with the secure world of a trusty VM, so PDPT level
+ * entries are left alone.
+ */
+static void merge_pgtable_pages(uint64_t *pml4_page, uint64_t vaddr_start, uint64_t vaddr_end,
+		const struct pgtable *table)
+{
+	uint64_t vaddr = vaddr_start & PDE_MASK;
+	uint64_t *pml4e, *pdpte, *pde;
+
+	while (vaddr < vaddr_end) {
+		pml4e = pml4e_offset(pml4_page, vaddr);
+		if (pgentry_present(table, (*pml4e))) {
+			pdpte = pdpte_offset(pml4e, vaddr);
+			if (pgentry_present(table, (*pdpte)) && (pdpte_large(*pdpte) == 0UL)) {
+				pde = pde_offset(pdpte, vaddr);
+				if (pgentry_present(table, (*pde)) && (pde_large(*pde) == 0UL)) {
+					try_to_merge_pgtable_page(table, pde);
+				}
+			}
+		}
+		vaddr += PDE_SIZE;
+	}
+}
+
 /*
  * type: MR_MODIFY
  * modify [vaddr, vaddr + size ) memory type or page access right.
@@ -290,6 +347,10 @@ void pgtable_modify_or_del_map(uint64_t *pml4_page, uint64_t vaddr_base, uint64_
 			vaddr = vaddr_next;
 		}
 	}
+
+	if ((type == MR_MODIFY) && table->merge_large_page) {
+		merge_pgtable_pages(pml4_page, round_page_up(vaddr_base), vaddr_end, table);
+	}
 }
 
 /*
@@ -453,6 +514,10 @@ void pgtable_add_map(uint64_t *pml4_page, uint64_t paddr_base, uint64_t vaddr_ba
 		paddr += (vaddr_next - vaddr);
 		vaddr = vaddr_next;
 	}
+
+	if (table->merge_large_page) {
+		merge_pgtable_pages(pml4_page, round_page_up(vaddr_base), vaddr_end, table);
+	}
 }
 
 void *pgtable_create_root(const struct pgtable *table)
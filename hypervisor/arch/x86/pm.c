@@ -3,6 +3,7 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
+#include <errno.h>
 #include <acrn_common.h>
 #include <asm/default_acpi_info.h>
 #include <platform_acpi_info.h>
@@ -21,6 +22,11 @@
 #include <delay.h>
 #include <asm/board.h>
 #include <asm/cpuid.h>
+#include <asm/notify.h>
+#include <asm/guest/vm.h>
+#include <asm/cpufeatures.h>
+#include <ticks.h>
+#include <logmsg.h>
 
 struct cpu_context cpu_ctx;
 
@@ -178,7 +184,10 @@ static void resume_tsc(__unused void *data)
 void host_enter_s3(const struct pm_s_state_data *sstate_data, uint32_t pm1a_cnt_val, uint32_t pm1b_cnt_val)
 {
 	uint64_t pmain_entry_saved;
+	/* the TSC restarts in S3 and is set back by resume_tsc(), the phases are timed apart */
+	uint64_t start, suspend_us, resume_dev_us, resume_ap_us, resume_con_us;
 
+	start = rdtsc();
 	stac();
 
 	/* set ACRN wakeup vec instead */
@@ -210,15 +219,18 @@ void host_enter_s3(const struct pm_s_state_data *sstate_data, uint32_t pm1a_cnt_
 	suspend_ioapic();
 	suspend_iommu();
 	suspend_lapic();
+	suspend_us = ticks_to_us(rdtsc() - start);
 
 	asm_enter_s3(sstate_data, pm1a_cnt_val, pm1b_cnt_val);
 
+	start = rdtsc();
 	resume_lapic();
 	resume_iommu();
 	resume_ioapic();
 
 	vmx_on();
 	CPU_IRQ_ENABLE_ON_CONFIG();
+	resume_dev_us = ticks_to_us(rdtsc() - start);
 
 	/* restore the default main entry */
 	stac();
@@ -226,9 +238,11 @@ void host_enter_s3(const struct pm_s_state_data *sstate_data, uint32_t pm1a_cnt_
 	clac();
 
 	/* online all APs again */
+	start = rdtsc();
 	if (!start_pcpus(AP_MASK)) {
 		panic("Failed to start all APs!");
 	}
+	resume_ap_us = ticks_to_us(rdtsc() - start);
 
 	/* Restore TSC on all PCPU
 	 * Caution: There should no timer setup before TSC resumed.
@@ -236,7 +250,12 @@ void host_enter_s3(const struct pm_s_state_data *sstate_data, uint32_t pm1a_cnt_
 	smp_call_function(get_active_pcpu_bitmap(), resume_tsc, NULL);
 
 	/* console must be resumed after TSC restored since it will setup timer base on TSC */
+	start = rdtsc();
 	resume_console();
+	resume_con_us = ticks_to_us(rdtsc() - start);
+
+	pr_acrnlog("S3: suspend %luus, resume devices %luus, APs %luus, console %luus",
+			suspend_us, resume_dev_us, resume_ap_us, resume_con_us);
 }
 
 void reset_host(void)
@@ -275,6 +294,7 @@ void reset_host(void)
 }
 
 static enum acrn_cpufreq_policy_type cpufreq_policy = CPUFREQ_POLICY_PERFORMANCE;
+static bool hwp_enabled;
 
 void init_frequency_policy(void)
 {
@@ -295,9 +315,127 @@ void init_frequency_policy(void)
 	if ((cpuid_06_eax & CPUID_EAX_HWP) != 0U) {
 		/* If HWP is available, enable HWP early. This will unlock other HWP MSRs. */
 		msr_write(MSR_IA32_PM_ENABLE, 1U);
+		hwp_enabled = true;
 	}
 }
 
+/*
+ * The IA32_HWP_REQUEST of the current pCPU for a frequency policy, within the
+ * levels the pCPU allows: those of its cpufreq limits, only the guaranteed one
+ * with cpu_perf_policy=Nominal.
+ */
+static uint64_t hwp_request(const struct acrn_vm_freq_policy *policy)
+{
+	const struct acrn_cpufreq_limits *limits = &cpufreq_limits[get_pcpu_id()];
+	uint8_t lowest = limits->lowest_hwp_lvl, highest = limits->highest_hwp_lvl;
+	uint8_t min_perf, max_perf, desired_perf = 0U;
+
+	if (cpufreq_policy == CPUFREQ_POLICY_NOMINAL) {
+		lowest = limits->guaranteed_hwp_lvl;
+		highest = limits->guaranteed_hwp_lvl;
+	}
+
+	min_perf = min(max(policy->min_perf, lowest), highest);
+	max_perf = min(max(policy->max_perf, min_perf), highest);
+	if (policy->desired_perf != 0U) {
+		desired_perf = min(max(policy->desired_perf, min_perf), max_perf);
+	}
+
+	/* EPP | Desired_Performance(0: HWP auto) | Maximum_Performance | Minimum_Performance */
+	return ((uint64_t)policy->epp << 24U) | ((uint64_t)desired_perf << 16U) |
+		((uint64_t)max_perf << 8U) | (uint64_t)min_perf;
+}
+
+/* Load IA32_HWP_REQUEST of the current pCPU, unless it has the value already */
+static void write_hwp_request(uint64_t req)
+{
+	uint16_t pcpu_id = get_pcpu_id();
+
+	if (hwp_enabled && (per_cpu(hwp_request, pcpu_id) != req)) {
+		msr_write(MSR_IA32_HWP_REQUEST, req);
+		per_cpu(hwp_request, pcpu_id) = req;
+	}
+}
+
+/*
+ * RT VMs run at the highest level their pCPUs allow, which cpu_freq.py fixes
+ * for their pCPUs, the other VMs let HWP select it autonomously.
+ */
+void init_vm_freq_policy(struct acrn_vm *vm)
+{
+	if (is_rt_vm(vm)) {
+		vm->freq_policy.min_perf = 0xffU;
+		vm->freq_policy.epp = 0U;
+	} else {
+		vm->freq_policy.min_perf = 0U;
+		vm->freq_policy.epp = 0x80U;
+	}
+	vm->freq_policy.max_perf = 0xffU;
+	vm->freq_policy.desired_perf = 0U;
+	vm->freq_policy.reserved = 0U;
+}
+
+/*
+ * Called when a vCPU thread is switched in. A vHWP guest runs with the HWP
+ * request it wrote, if any.
+ */
+void load_vcpu_freq_policy(struct acrn_vcpu *vcpu)
+{
+	uint64_t req = 0UL;
+
+	if (is_vhwp_configured(vcpu->vm)) {
+		req = vcpu_get_guest_msr(vcpu, MSR_IA32_HWP_REQUEST);
+	}
+	if (req == 0UL) {
+		req = hwp_request(&vcpu->vm->freq_policy);
+	}
+	write_hwp_request(req);
+}
+
+/* Called when the idle thread is switched in */
+void restore_hv_freq_policy(void)
+{
+	write_hwp_request(per_cpu(hv_hwp_request, get_pcpu_id()));
+}
+
+static void smpcall_load_vm_freq_policy(void *data)
+{
+	struct acrn_vm *vm = (struct acrn_vm *)data;
+	struct acrn_vcpu *vcpu = get_running_vcpu(get_pcpu_id());
+
+	if ((vcpu != NULL) && (vcpu->vm == vm)) {
+		load_vcpu_freq_policy(vcpu);
+	}
+}
+
+/**
+ * @pre vm != NULL && policy != NULL
+ *
+ * The pCPUs running a vCPU of the VM load the new policy at once, the others
+ * when they switch one in.
+ */
+int32_t set_vm_freq_policy(struct acrn_vm *vm, const struct acrn_vm_freq_policy *policy)
+{
+	int32_t ret = -EINVAL;
+
+	if (!hwp_enabled) {
+		ret = -ENODEV;
+	} else if (is_vhwp_configured(vm)) {
+		/* the guest has its own HWP request */
+		ret = -EPERM;
+	} else if (policy->min_perf <= policy->max_perf) {
+		vm->freq_policy = *policy;
+		vm->freq_policy.reserved = 0U;
+		smp_call_function(get_vm_config(vm->vm_id)->cpu_affinity & get_active_pcpu_bitmap(),
+			smpcall_load_vm_freq_policy, vm);
+		ret = 0;
+	} else {
+		/* invalid range */
+	}
+
+	return ret;
+}
+
 /*
  * This Function is to be called by each pcpu after init_cpufreq().
  * It applies the frequency policy, which can be specified from boot parameters.
@@ -306,7 +444,8 @@ void init_frequency_policy(void)
  *   - cpu_perf_policy=Nominal: frequency is fixed to guaranteed HWP level or nominal p-state.
  * The default policy is 'Performance'.
  *
- * ACRN will not be governing pcpu's frequency after this.
+ * The request set here is the one of the hypervisor, the pCPU switches to the one of the
+ * frequency policy of a VM while a vCPU of the VM runs on it, see load_vcpu_freq_policy().
  */
 void apply_frequency_policy(void)
 {
@@ -329,7 +468,9 @@ void apply_frequency_policy(void)
 		}
 		/* EPP(0x80: default) | Desired_Performance(0: HWP auto) | Maximum_Performance | Minimum_Performance */
 		reg = (0x80UL << 24U) | (0x00UL << 16U) | (highest_lvl_req << 8U) | lowest_lvl_req;
-	    msr_write(MSR_IA32_HWP_REQUEST, reg);
+		msr_write(MSR_IA32_HWP_REQUEST, reg);
+		per_cpu(hv_hwp_request, get_pcpu_id()) = reg;
+		per_cpu(hwp_request, get_pcpu_id()) = reg;
 	} else if ((cpuid_01_ecx & CPUID_ECX_EST) != 0U) {
 		struct cpu_state_info *pm_s_state_data = get_cpu_pm_state_info();
 
@@ -354,3 +495,103 @@ void apply_frequency_policy(void)
 		/* If no frequency interface is presented, just let CPU run by itself. Do nothing here.*/
 	}
 }
+
+/*
+ * Idle governor of the pCPUs in HLT idle mode. It picks the deepest MWAIT
+ * C-state of the host C-state table whose exit latency fits the latency cap
+ * of the pCPU and which pays off within the idle time the pCPU expects: the
+ * shortest of the time to its next timer and of its recent idle periods.
+ */
+#define IDLE_RESIDENCY_FACTOR	3UL	/* a C-state pays off from 3 times its exit latency */
+#define IDLE_HISTORY_SHIFT	3U	/* each idle period weighs 1/8 in the idle history */
+#define RT_IDLE_LATENCY_US	2U	/* the pCPUs of RT VMs go no deeper than C1 */
+#define FFH_CLASS_MWAIT		2U	/* cx_reg.bit_offset of the native (MWAIT) FFH C-states */
+
+struct idle_state {
+	uint32_t hint;		/* the MWAIT hint */
+	uint32_t latency;	/* exit latency, in us */
+	uint64_t residency;	/* the idle time it pays off from, in TSC ticks */
+};
+
+static struct idle_state idle_states[MAX_CSTATE];
+static uint32_t idle_state_cnt;
+
+/**
+ * @pre Called on the BSP, after calibrate_tsc()
+ */
+void init_idle_governor(void)
+{
+	const struct cpu_state_info *info = get_cpu_pm_state_info();
+	const struct acrn_cstate_data *cx;
+	uint32_t cpuid_06_eax, unused, i;
+	bool deep_ok;
+
+	/* the LAPIC timer and the TSC must go on in the C-states deeper than C1 */
+	cpuid_subleaf(0x6U, 0U, &cpuid_06_eax, &unused, &unused, &unused);
+	deep_ok = ((cpuid_06_eax & CPUID_EAX_ARAT) != 0U) && pcpu_has_cap(X86_FEATURE_INVA_TSC);
+
+	idle_state_cnt = 0U;
+	if (has_monitor_cap() && (info->cx_data != NULL)) {
+		for (i = 0U; (i < info->cx_cnt) && (idle_state_cnt < MAX_CSTATE); i++) {
+			cx = &info->cx_data[i];
+			if ((cx->cx_reg.space_id == SPACE_FFixedHW) && (cx->cx_reg.bit_offset == FFH_CLASS_MWAIT) &&
+					((cx->type <= 1U) || deep_ok)) {
+				idle_states[idle_state_cnt].hint = (uint32_t)cx->cx_reg.address;
+				idle_states[idle_state_cnt].latency = cx->latency;
+				idle_states[idle_state_cnt].residency = us_to_ticks(cx->latency) * IDLE_RESIDENCY_FACTOR;
+				idle_state_cnt++;
+			}
+		}
+	}
+
+	pr_info("%s: %u MWAIT idle states%s", __func__, idle_state_cnt, deep_ok ? "" : ", C1 only");
+}
+
+/* the deepest exit latency the pCPU accepts, in us */
+static uint32_t idle_latency_cap(uint16_t pcpu_id)
+{
+	const struct acrn_vcpu *vcpu = get_ever_run_vcpu(pcpu_id);
+
+	return ((vcpu != NULL) && is_rt_vm(vcpu->vm)) ? RT_IDLE_LATENCY_US : ~0U;
+}
+
+/**
+ * @pre pcpu_id == get_pcpu_id(), interrupts are disabled
+ *
+ * Idle the pCPU until an interrupt or a reschedule request comes, HLT when
+ * no MWAIT C-state fits, and learn how long it stayed idle.
+ */
+void enter_idle_state(uint16_t pcpu_id)
+{
+	const struct idle_state *state = NULL;
+	uint64_t now = cpu_ticks();
+	uint64_t deadline = next_timer_deadline(pcpu_id);
+	uint64_t history = per_cpu(idle_history, pcpu_id);
+	uint64_t expected = 0UL;
+	uint32_t cap = idle_latency_cap(pcpu_id);
+	uint32_t i;
+
+	if (deadline > now) {
+		expected = min(history, deadline - now);
+	}
+
+	/* the table lists the C-states from the shallowest to the deepest */
+	for (i = 0U; i < idle_state_cnt; i++) {
+		if ((idle_states[i].latency <= cap) && (idle_states[i].residency <= expected)) {
+			state = &idle_states[i];
+		}
+	}
+
+	if (state == NULL) {
+		asm_safe_hlt();
+	} else {
+		/* a reschedule request from another pCPU wakes MWAIT before its IPI */
+		asm_monitor(&per_cpu(sched_ctl, pcpu_id).flags, 0UL, 0UL);
+		if (!need_reschedule(pcpu_id)) {
+			asm_safe_mwait(state->hint, 0UL);
+		}
+	}
+
+	per_cpu(idle_history, pcpu_id) = history - (history >> IDLE_HISTORY_SHIFT) +
+			((cpu_ticks() - now) >> IDLE_HISTORY_SHIFT);
+}
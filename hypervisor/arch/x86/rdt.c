@@ -16,6 +16,12 @@
 #include <asm/board.h>
 #include <asm/vm_config.h>
 #include <asm/msr.h>
+#include <asm/per_cpu.h>
+#include <asm/lib/spinlock.h>
+#include <asm/notify.h>
+#include <timer.h>
+#include <ticks.h>
+#include <acrn_common.h>
 
 const uint16_t hv_clos = 0U;
 /* RDT features can support different numbers of CLOS. Set the lowest numerical
@@ -42,13 +48,32 @@ const struct rdt_ins *get_rdt_res_ins(int res, uint16_t pcpu_id)
 	return ins;
 }
 
+static uint64_t clos_msr_value(const struct rdt_type *info, const struct rdt_ins *ins, uint32_t idx)
+{
+	uint64_t val = 0UL;
+	uint32_t res = info->res_id;
+	const union clos_config *cfg = ins->clos_config_array;
+
+	switch (res) {
+	case RDT_RESID_L3:
+	case RDT_RESID_L2:
+		val = (uint64_t)cfg[idx].clos_mask;
+		break;
+	case RDT_RESID_MBA:
+		val = (uint64_t)cfg[idx].mba_delay;
+		break;
+	default:
+		ASSERT(false, "Support only 3 RDT resources. res=%d is invalid", res);
+		break;
+	}
+	return val;
+}
+
 static void setup_res_clos_msr(uint16_t pcpu_id, struct rdt_type *info, struct rdt_ins *ins)
 {
 	uint16_t i;
 	uint32_t msr_index;
-	uint64_t val = 0;
 	uint32_t res = info->res_id;
-	union clos_config *cfg = ins->clos_config_array;
 
 	if (res != RDT_RESID_MBA && ins->res.cache.is_cdp_enabled) {
 		/* enable CDP before setting COS to simplify CAT mask remapping
@@ -58,19 +83,224 @@ static void setup_res_clos_msr(uint16_t pcpu_id, struct rdt_type *info, struct r
 	}
 
 	for (i = 0U; i < ins->num_clos_config; i++) {
-		switch (res) {
-		case RDT_RESOURCE_L3:
-		case RDT_RESOURCE_L2:
-			val = (uint64_t)cfg[i].clos_mask;
-			break;
-		case RDT_RESOURCE_MBA:
-			val = (uint64_t)cfg[i].mba_delay;
+		msr_index = info->msr_base + i;
+		msr_write_pcpu(msr_index, clos_msr_value(info, ins, i), pcpu_id);
+	}
+}
+
+/* The RMID is in the bits 9:0 of IA32_PQR_ASSOC */
+#define PQR_ASSOC_RMID_MASK	0x3FFUL
+
+/*
+ * RDT monitoring of the L3 (CMT/MBM): the vCPUs of VM n are tagged with RMID
+ * n + 1 while they run, and the hypervisor with RMID 0. On each L3, a timer
+ * of one of its pCPUs reads the LLC occupancy and the memory bandwidth
+ * counters of the RMIDs once per RDT_MON_PERIOD_MS, often enough for the MBM
+ * counters not to wrap in between.
+ *
+ * An RMID is used again by the next VM of the same ID: its LLC occupancy
+ * includes the lines of the previous one until they are evicted.
+ */
+#define RDT_MON_PERIOD_MS	1000U
+#define QM_CTR_ERROR		(1UL << 63U)
+#define QM_CTR_UNAVAILABLE	(1UL << 62U)
+#define RDT_MON_MBM_TOTAL	0U
+#define RDT_MON_MBM_LOCAL	1U
+
+struct rdt_mon_counter {
+	uint64_t last;		/* the last value read */
+	uint64_t bytes;		/* bytes counted since the first read */
+	bool primed;
+};
+
+/* The counters of the VMs on one L3, read by one of its pCPUs */
+struct rdt_mon_domain {
+	struct hv_timer timer;
+	uint64_t occupancy[CONFIG_MAX_VM_NUM];
+	struct rdt_mon_counter mbm[CONFIG_MAX_VM_NUM][2U];
+};
+
+static uint32_t mon_events;	/* ACRN_RDT_MON_*, the bits of CPUID.(0xF, 1):EDX */
+static uint32_t mon_max_rmid;
+static uint64_t mon_upscale;	/* bytes per unit of IA32_QM_CTR */
+static uint64_t mon_ctr_mask;	/* the width of the MBM counters */
+static struct rdt_mon_domain mon_domains[MAX_PCPU_NUM];
+/* the MBM bytes of the RMID of a VM when it was created */
+static uint64_t mon_vm_base[CONFIG_MAX_VM_NUM][2U];
+
+/* Called on the BSP, before the APs are started */
+void init_rdt_mon(void)
+{
+	uint32_t eax, ebx, ecx, edx, width;
+
+	if (pcpu_has_cap(X86_FEATURE_PQM)) {
+		cpuid_subleaf(CPUID_RDT_MONITORING, 0U, &eax, &ebx, &ecx, &edx);
+		/* EDX bit 1: L3 monitoring */
+		if ((edx & (1U << 1U)) != 0U) {
+			cpuid_subleaf(CPUID_RDT_MONITORING, 1U, &eax, &ebx, &ecx, &edx);
+			/* EAX bits 7:0: the MBM counter width, offset from 24 bits */
+			width = min(24U + (eax & 0xFFU), 62U);
+			mon_ctr_mask = (1UL << width) - 1UL;
+			mon_upscale = (uint64_t)ebx;
+			mon_max_rmid = min(ecx, (uint32_t)PQR_ASSOC_RMID_MASK);
+			mon_events = edx & (ACRN_RDT_MON_LLC_OCCUPANCY | ACRN_RDT_MON_MBM_TOTAL | ACRN_RDT_MON_MBM_LOCAL);
+		}
+	}
+
+	if (mon_events != 0U) {
+		pr_acrnlog("RDT monitoring: events 0x%x, max RMID %u, %lu bytes per unit",
+			mon_events, mon_max_rmid, mon_upscale);
+	}
+}
+
+/* @return the RMID of the VM, 0 if the VM is not monitored */
+uint32_t get_vm_rmid(uint16_t vm_id)
+{
+	uint32_t rmid = (uint32_t)vm_id + 1U;
+
+	if ((mon_events == 0U) || (rmid > mon_max_rmid)) {
+		rmid = 0U;
+	}
+	return rmid;
+}
+
+/* @return false if the counter could not be read */
+static bool read_qm_ctr(uint32_t rmid, uint32_t evt, uint64_t *val)
+{
+	uint64_t ctr;
+
+	msr_write(MSR_IA32_QM_EVTSEL, ((uint64_t)rmid << 32U) | (uint64_t)evt);
+	ctr = msr_read(MSR_IA32_QM_CTR);
+	*val = ctr & ~(QM_CTR_ERROR | QM_CTR_UNAVAILABLE);
+
+	return ((ctr & (QM_CTR_ERROR | QM_CTR_UNAVAILABLE)) == 0UL);
+}
+
+static void sample_mbm(struct rdt_mon_counter *cnt, uint32_t rmid, uint32_t evt)
+{
+	uint64_t val;
+
+	if (read_qm_ctr(rmid, evt, &val)) {
+		if (cnt->primed) {
+			cnt->bytes += ((val - cnt->last) & mon_ctr_mask) * mon_upscale;
+		}
+		cnt->last = val;
+		cnt->primed = true;
+	}
+}
+
+static void rdt_mon_sample(void *data)
+{
+	struct rdt_mon_domain *dom = (struct rdt_mon_domain *)data;
+	uint16_t vm_id;
+	uint32_t rmid;
+	uint64_t val;
+
+	for (vm_id = 0U; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
+		rmid = get_vm_rmid(vm_id);
+		if (rmid == 0U) {
 			break;
-		default:
-			ASSERT(res < RDT_NUM_RESOURCES, "Support only 3 RDT resources. res=%d is invalid", res);
 		}
-		msr_index = info->msr_base + i;
-		msr_write_pcpu(msr_index, val, pcpu_id);
+
+		if (((mon_events & ACRN_RDT_MON_LLC_OCCUPANCY) != 0U) &&
+				read_qm_ctr(rmid, RDT_MON_EVT_LLC_OCCUPANCY, &val)) {
+			dom->occupancy[vm_id] = val * mon_upscale;
+		}
+		if ((mon_events & ACRN_RDT_MON_MBM_TOTAL) != 0U) {
+			sample_mbm(&dom->mbm[vm_id][RDT_MON_MBM_TOTAL], rmid, RDT_MON_EVT_MBM_TOTAL);
+		}
+		if ((mon_events & ACRN_RDT_MON_MBM_LOCAL) != 0U) {
+			sample_mbm(&dom->mbm[vm_id][RDT_MON_MBM_LOCAL], rmid, RDT_MON_EVT_MBM_LOCAL);
+		}
+	}
+}
+
+/*
+ * The pCPU reading the counters of the L3 of cpu_mask: the first one no
+ * LAPIC passthrough VM may run on, the timers of the hypervisor do not fire
+ * on those.
+ */
+static uint16_t rdt_mon_sampler(uint64_t cpu_mask)
+{
+	uint64_t mask = cpu_mask;
+	uint16_t vm_id;
+	const struct acrn_vm_config *vm_config;
+
+	for (vm_id = 0U; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
+		vm_config = get_vm_config(vm_id);
+		if ((vm_config->guest_flags & GUEST_FLAG_LAPIC_PASSTHROUGH) != 0UL) {
+			mask &= ~vm_config->cpu_affinity;
+		}
+	}
+	return ffs64(mask);
+}
+
+static void setup_rdt_mon(uint16_t pcpu_id)
+{
+	const struct rdt_type *info = &res_cap_info[RDT_RESOURCE_L3];
+	struct rdt_mon_domain *dom = NULL;
+	uint64_t period_in_cycle;
+	uint32_t i;
+
+	if (mon_events != 0U) {
+		if (info->num_ins == 0U) {
+			/* no L3 in the board configuration, the platform is taken as one L3 */
+			if (pcpu_id == rdt_mon_sampler(ALL_CPUS_MASK)) {
+				dom = &mon_domains[0];
+			}
+		} else {
+			for (i = 0U; i < info->num_ins; i++) {
+				if (pcpu_id == rdt_mon_sampler(info->ins_array[i].cpu_mask)) {
+					dom = &mon_domains[i];
+					break;
+				}
+			}
+		}
+	}
+
+	if (dom != NULL) {
+		period_in_cycle = TICKS_PER_MS * RDT_MON_PERIOD_MS;
+		initialize_timer(&dom->timer, rdt_mon_sample, dom,
+			cpu_ticks() + period_in_cycle, period_in_cycle);
+		if (add_timer(&dom->timer) != 0) {
+			pr_err("Failed to add the RDT monitoring timer of pCPU %hu", pcpu_id);
+		}
+	}
+}
+
+static uint64_t vm_mbm_bytes(uint16_t vm_id, uint32_t type)
+{
+	uint64_t bytes = 0UL;
+	uint16_t i;
+
+	for (i = 0U; i < MAX_PCPU_NUM; i++) {
+		bytes += mon_domains[i].mbm[vm_id][type].bytes;
+	}
+	return bytes;
+}
+
+/* The MBM counters of the VM start from 0 */
+void reset_vm_rdt_mon(uint16_t vm_id)
+{
+	mon_vm_base[vm_id][RDT_MON_MBM_TOTAL] = vm_mbm_bytes(vm_id, RDT_MON_MBM_TOTAL);
+	mon_vm_base[vm_id][RDT_MON_MBM_LOCAL] = vm_mbm_bytes(vm_id, RDT_MON_MBM_LOCAL);
+}
+
+void get_vm_rdt_mon(uint16_t vm_id, struct acrn_vm_rdt_mon *mon)
+{
+	uint16_t i;
+
+	(void)memset(mon, 0U, sizeof(*mon));
+	mon->events = mon_events;
+	mon->rmid = get_vm_rmid(vm_id);
+	mon->period_ms = RDT_MON_PERIOD_MS;
+
+	if (mon->rmid != 0U) {
+		for (i = 0U; i < MAX_PCPU_NUM; i++) {
+			mon->llc_occupancy += mon_domains[i].occupancy[vm_id];
+		}
+		mon->mbm_total = vm_mbm_bytes(vm_id, RDT_MON_MBM_TOTAL) - mon_vm_base[vm_id][RDT_MON_MBM_TOTAL];
+		mon->mbm_local = vm_mbm_bytes(vm_id, RDT_MON_MBM_LOCAL) - mon_vm_base[vm_id][RDT_MON_MBM_LOCAL];
 	}
 }
 
@@ -91,7 +321,166 @@ void setup_clos(uint16_t pcpu_id)
 	}
 
 	/* set hypervisor RDT resource clos */
-	msr_write_pcpu(MSR_IA32_PQR_ASSOC, clos2pqr_msr(hv_clos), pcpu_id);
+	per_cpu(hv_pqr_assoc, pcpu_id) = clos_rmid2pqr_msr(hv_clos, 0U);
+	per_cpu(pqr_assoc, pcpu_id) = per_cpu(hv_pqr_assoc, pcpu_id);
+	msr_write_pcpu(MSR_IA32_PQR_ASSOC, per_cpu(pqr_assoc, pcpu_id), pcpu_id);
+
+	setup_rdt_mon(pcpu_id);
+}
+
+/* Serializes the runtime updates of the CLOS configurations */
+static spinlock_t clos_update_lock = { .head = 0U, .tail = 0U };
+
+struct clos_msr_update {
+	const struct rdt_type *info;
+	const struct rdt_ins *ins;
+	uint32_t idx;
+};
+
+/*
+ * The value is read from the configuration when the call runs, not when it
+ * is queued: the pCPUs of concurrent updates of an entry all end up with the
+ * last one.
+ */
+static void smpcall_write_clos_msr(void *data)
+{
+	const struct clos_msr_update *update = (const struct clos_msr_update *)data;
+
+	msr_write(update->info->msr_base + update->idx,
+		clos_msr_value(update->info, update->ins, update->idx));
+}
+
+/* The CLOS of a configuration entry, 2 entries (data, code) per CLOS with CDP */
+static uint16_t clos_config_to_clos(const struct rdt_type *info, const struct rdt_ins *ins, uint32_t idx)
+{
+	uint32_t clos = idx;
+
+	if ((info->res_id != RDT_RESID_MBA) && ins->res.cache.is_cdp_enabled) {
+		clos = idx >> 1U;
+	}
+	return (uint16_t)clos;
+}
+
+static bool is_rt_vm_clos(uint16_t clos)
+{
+	uint16_t vm_id, i;
+	const struct acrn_vm_config *vm_config;
+	bool ret = false;
+
+	for (vm_id = 0U; (vm_id < CONFIG_MAX_VM_NUM) && !ret; vm_id++) {
+		vm_config = get_vm_config(vm_id);
+		if ((vm_config->guest_flags & (GUEST_FLAG_RT | GUEST_FLAG_VCAT_ENABLED)) != 0UL) {
+			for (i = 0U; i < vm_config->num_pclosids; i++) {
+				if (vm_config->pclosids[i] == clos) {
+					ret = true;
+					break;
+				}
+			}
+		}
+	}
+	return ret;
+}
+
+/* A capacity bitmask is a contiguous run of set bits within cbm_len */
+static bool is_valid_cbm(const struct rdt_ins *ins, uint32_t cbm)
+{
+	uint64_t mask = (uint64_t)cbm;
+	uint64_t low = mask & (~mask + 1UL);
+
+	return ((mask != 0UL) && ((mask >> ins->res.cache.cbm_len) == 0UL) &&
+		(((mask + low) & mask) == 0UL));
+}
+
+/*
+ * The ways of a capacity bitmask must stay out of the ones of the CLOS
+ * reserved by the RT VMs, and the VMs managing their CLOS with vCAT.
+ */
+static bool overlaps_rt_vm_ways(const struct rdt_type *info, const struct rdt_ins *ins, uint32_t idx, uint32_t cbm)
+{
+	uint32_t i;
+	bool ret = false;
+
+	for (i = 0U; i < ins->num_clos_config; i++) {
+		if ((i != idx) && is_rt_vm_clos(clos_config_to_clos(info, ins, i)) &&
+				((ins->clos_config_array[i].clos_mask & cbm) != 0U)) {
+			ret = true;
+			break;
+		}
+	}
+	return ret;
+}
+
+/**
+ * Update the capacity bitmask (L2, L3) or the delay (MBA) of a configuration
+ * entry of the instance of the resource which pcpu_id belongs to, on all its
+ * pCPUs, before returning. With CDP, the entries of CLOS n are 2n (data) and
+ * 2n + 1 (code).
+ *
+ * The entries of the CLOS of the RT VMs and of the VMs with vCAT are
+ * reserved, and the ways of the former cannot be given to another CLOS.
+ *
+ * @return 0 on success, -EINVAL for an invalid resource, entry or value,
+ *         -EPERM for a reserved CLOS or ways.
+ */
+int32_t set_clos_config(uint32_t res_id, uint32_t idx, uint16_t pcpu_id, uint32_t value)
+{
+	struct rdt_type *info = NULL;
+	struct rdt_ins *ins = NULL;
+	struct clos_msr_update update;
+	int32_t ret = -EINVAL;
+	uint32_t res = RDT_NUM_RESOURCES;
+
+	if (res_id == RDT_RESID_L3) {
+		res = RDT_RESOURCE_L3;
+	} else if (res_id == RDT_RESID_L2) {
+		res = RDT_RESOURCE_L2;
+	} else if (res_id == RDT_RESID_MBA) {
+		res = RDT_RESOURCE_MBA;
+	} else {
+		/* invalid resource */
+	}
+
+	if ((res < RDT_NUM_RESOURCES) && (pcpu_id < get_pcpu_nums())) {
+		info = &res_cap_info[res];
+		ins = (struct rdt_ins *)get_rdt_res_ins((int)res, pcpu_id);
+	}
+
+	if ((ins != NULL) && (ins->num_closids > 0U) && (idx < ins->num_clos_config)) {
+		spinlock_obtain(&clos_update_lock);
+		if (res == RDT_RESOURCE_MBA) {
+			if (value <= ins->res.membw.mba_max) {
+				ret = 0;
+			}
+		} else if (is_valid_cbm(ins, value)) {
+			ret = overlaps_rt_vm_ways(info, ins, idx, value) ? -EPERM : 0;
+		} else {
+			/* invalid capacity bitmask */
+		}
+
+		if ((ret == 0) && is_rt_vm_clos(clos_config_to_clos(info, ins, idx))) {
+			ret = -EPERM;
+		}
+
+		if (ret == 0) {
+			if (res == RDT_RESOURCE_MBA) {
+				ins->clos_config_array[idx].mba_delay = (uint16_t)value;
+			} else {
+				ins->clos_config_array[idx].clos_mask = value;
+			}
+		}
+		spinlock_release(&clos_update_lock);
+
+		/* not under the lock, the pCPUs called may be waiting for it */
+		if (ret == 0) {
+			update.info = info;
+			update.ins = ins;
+			update.idx = idx;
+			smp_call_function(ins->cpu_mask & get_active_pcpu_bitmap(),
+				smpcall_write_clos_msr, &update);
+		}
+	}
+
+	return ret;
 }
 
 uint64_t clos2pqr_msr(uint16_t clos)
@@ -104,6 +493,28 @@ uint64_t clos2pqr_msr(uint16_t clos)
 	return pqr_assoc;
 }
 
+
+uint64_t clos_rmid2pqr_msr(uint16_t clos, uint32_t rmid)
+{
+	return (clos2pqr_msr(clos) & ~PQR_ASSOC_RMID_MASK) | ((uint64_t)rmid & PQR_ASSOC_RMID_MASK);
+}
+
+/* Load MSR_IA32_PQR_ASSOC of the current pCPU, unless it has the value already */
+void write_pqr_assoc(uint64_t pqr_assoc)
+{
+	uint16_t pcpu_id = get_pcpu_id();
+
+	if (per_cpu(pqr_assoc, pcpu_id) != pqr_assoc) {
+		msr_write(MSR_IA32_PQR_ASSOC, pqr_assoc);
+		per_cpu(pqr_assoc, pcpu_id) = pqr_assoc;
+	}
+}
+
+void restore_hv_pqr_assoc(void)
+{
+	write_pqr_assoc(per_cpu(hv_pqr_assoc, get_pcpu_id()));
+}
+
 static bool is_rdt_type_capable(struct rdt_type *info)
 {
 	uint32_t i;
@@ -141,6 +552,39 @@ uint64_t clos2pqr_msr(__unused uint16_t clos)
 	return 0UL;
 }
 
+uint64_t clos_rmid2pqr_msr(__unused uint16_t clos, __unused uint32_t rmid)
+{
+	return 0UL;
+}
+
+void write_pqr_assoc(__unused uint64_t pqr_assoc)
+{
+}
+
+void restore_hv_pqr_assoc(void)
+{
+}
+
+uint32_t get_vm_rmid(__unused uint16_t vm_id)
+{
+	return 0U;
+}
+
+void reset_vm_rdt_mon(__unused uint16_t vm_id)
+{
+}
+
+void get_vm_rdt_mon(__unused uint16_t vm_id, struct acrn_vm_rdt_mon *mon)
+{
+	(void)memset(mon, 0U, sizeof(*mon));
+}
+
+int32_t set_clos_config(__unused uint32_t res_id, __unused uint32_t idx, __unused uint16_t pcpu_id,
+		__unused uint32_t value)
+{
+	return -ENODEV;
+}
+
 bool is_platform_rdt_capable(void)
 {
 	return false;
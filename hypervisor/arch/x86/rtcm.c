@@ -12,6 +12,8 @@
 #include <asm/mmu.h>
 #include <asm/cpu_caps.h>
 #include <asm/rtcm.h>
+#include <asm/vm_config.h>
+#include <asm/lib/spinlock.h>
 
 
 static uint64_t ssram_bottom_hpa;
@@ -109,6 +111,22 @@ static void parse_rtct(void)
 	}
 }
 
+/* The config tool keeps the shares of the VMs within the Software SRAM the board reported */
+static void check_ssram_shares(void)
+{
+	uint16_t vm_id;
+	uint64_t shares = 0UL;
+
+	for (vm_id = 0U; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
+		shares += (uint64_t)get_vm_config(vm_id)->ssram_kb << 10U;
+	}
+
+	if (shares > get_software_sram_size()) {
+		pr_err("Software SRAM shares of the VMs (0x%lx bytes) exceed its size (0x%lx bytes)",
+			shares, get_software_sram_size());
+	}
+}
+
 /*
  * Function to initialize Software SRAM. Both BSP and APs shall call this function to
  * make sure Software SRAM is initialized, which is required by RTCM.
@@ -175,6 +193,7 @@ bool init_software_sram(bool is_bsp)
 				is_sw_sram_initialized = true;
 				pr_info("BSP Software SRAM has been initialized, base_hpa:0x%lx, top_hpa:0x%lx.\n",
 					ssram_bottom_hpa, ssram_top_hpa);
+				check_ssram_shares();
 			}
 			ret = disable_host_monitor_wait();
 		}
@@ -207,3 +226,67 @@ uint64_t get_software_sram_size(void)
 {
 	return (ssram_top_hpa - ssram_bottom_hpa);
 }
+
+bool is_software_sram_range(uint64_t hpa, uint64_t size)
+{
+	return is_software_sram_enabled() && (hpa >= ssram_bottom_hpa) && ((hpa + size) <= ssram_top_hpa);
+}
+
+/*
+ * Software SRAM shares of the RT VMs: the Software SRAM is handed out by the
+ * Service VM, each buffer mapped to a VM is taken out of the share its
+ * scenario configures (ssram_kb). A VM cannot map more than its share, so the
+ * shares, which the config tool keeps within the Software SRAM, are always
+ * left for their VMs however the other VMs are started.
+ *
+ * Without any share configured, a VM may map any of it, as the Software SRAM
+ * is then for one RT VM.
+ */
+static spinlock_t ssram_share_lock = { .head = 0U, .tail = 0U };
+static uint64_t ssram_mapped[CONFIG_MAX_VM_NUM];
+
+static bool is_ssram_shared(void)
+{
+	uint16_t vm_id;
+	bool ret = false;
+
+	for (vm_id = 0U; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
+		if (get_vm_config(vm_id)->ssram_kb != 0U) {
+			ret = true;
+			break;
+		}
+	}
+	return ret;
+}
+
+/* @return true if the VM may map size bytes of Software SRAM more, and they are taken out of its share */
+bool get_ssram_share(uint16_t vm_id, uint64_t size)
+{
+	uint64_t share = (uint64_t)get_vm_config(vm_id)->ssram_kb << 10U;
+	bool ret = true;
+
+	spinlock_obtain(&ssram_share_lock);
+	if (is_ssram_shared() && ((ssram_mapped[vm_id] + size) > share)) {
+		pr_err("VM%u: Software SRAM share of 0x%lx bytes exceeded", vm_id, share);
+		ret = false;
+	} else {
+		ssram_mapped[vm_id] += size;
+	}
+	spinlock_release(&ssram_share_lock);
+
+	return ret;
+}
+
+void put_ssram_share(uint16_t vm_id, uint64_t size)
+{
+	spinlock_obtain(&ssram_share_lock);
+	ssram_mapped[vm_id] -= min(size, ssram_mapped[vm_id]);
+	spinlock_release(&ssram_share_lock);
+}
+
+void reset_ssram_share(uint16_t vm_id)
+{
+	spinlock_obtain(&ssram_share_lock);
+	ssram_mapped[vm_id] = 0UL;
+	spinlock_release(&ssram_share_lock);
+}
@@ -42,16 +42,37 @@ void write_trampoline_sym(const void *sym, uint64_t val)
 	clflush(hva);
 }
 
-void write_trampoline_stack_sym(uint16_t pcpu_id)
-{
-	uint64_t *hva, stack_sym_addr;
-	hva = (uint64_t *)(hpa2hva(trampoline_start16_paddr) + trampoline_relo_addr(secondary_cpu_stack));
+/*
+ * The stacks of the APs by x2APIC ID, for the trampoline: all the APs
+ * started at once find theirs without the BSP waiting for each of them.
+ */
+struct ap_stack_entry {
+	uint64_t lapic_id;
+	uint64_t stack;
+};
 
-	stack_sym_addr = (uint64_t)&per_cpu(stack, pcpu_id)[CONFIG_STACK_SIZE - 1];
-	stack_sym_addr &= ~(CPU_STACK_ALIGN - 1UL);
-	*hva = stack_sym_addr;
+static struct ap_stack_entry ap_stacks[MAX_PCPU_NUM + 1U];
 
-	clflush(hva);
+void prepare_ap_stacks(uint64_t mask)
+{
+	uint16_t pcpu_id;
+	uint32_t n = 0U;
+	uint64_t stack;
+
+	for (pcpu_id = 0U; pcpu_id < MAX_PCPU_NUM; pcpu_id++) {
+		if ((mask & (1UL << pcpu_id)) != 0UL) {
+			stack = (uint64_t)&per_cpu(stack, pcpu_id)[CONFIG_STACK_SIZE - 1];
+			stack &= ~(CPU_STACK_ALIGN - 1UL);
+			ap_stacks[n].lapic_id = per_cpu(lapic_id, pcpu_id);
+			ap_stacks[n].stack = stack;
+			n++;
+		}
+	}
+	ap_stacks[n].lapic_id = 0UL;
+	ap_stacks[n].stack = 0UL;
+
+	/* The HV is identity mapped, the HVA of the table is its HPA */
+	write_trampoline_sym(ap_stack_table, (uint64_t)ap_stacks);
 }
 
 uint64_t get_trampoline_start16_paddr(void)
@@ -93,6 +93,7 @@ static inline uint64_t dmar_set_bitslice(uint64_t var, uint64_t mask, uint32_t p
 #define DMAR_INV_STATUS_WRITE_SHIFT	5U
 #define DMAR_INV_CONTEXT_CACHE_DESC	0x01UL
 #define DMAR_INV_IOTLB_DESC		0x02UL
+#define DMAR_INV_DEV_IOTLB_DESC		0x03UL
 #define DMAR_INV_IEC_DESC		0x04UL
 #define DMAR_INV_WAIT_DESC		0x05UL
 #define DMAR_INV_STATUS_WRITE		(1UL << DMAR_INV_STATUS_WRITE_SHIFT)
@@ -101,6 +102,9 @@ static inline uint64_t dmar_set_bitslice(uint64_t var, uint64_t mask, uint32_t p
 #define DMAR_INV_STATUS_DATA_SHIFT	32U
 #define DMAR_INV_STATUS_DATA		(DMAR_INV_STATUS_COMPLETED << DMAR_INV_STATUS_DATA_SHIFT)
 #define DMAR_INV_WAIT_DESC_LOWER	(DMAR_INV_STATUS_WRITE | DMAR_INV_WAIT_DESC | DMAR_INV_STATUS_DATA)
+/* a wait descriptor with the fence flag holds back the descriptors after it */
+#define DMAR_INV_FENCE			(1UL << 6U)
+#define DMAR_INV_FENCE_DESC_LOWER	(DMAR_INV_WAIT_DESC | DMAR_INV_FENCE)
 
 #define DMAR_IR_ENABLE_EIM_SHIFT	11UL
 #define DMAR_IR_ENABLE_EIM		(1UL << DMAR_IR_ENABLE_EIM_SHIFT)
@@ -187,6 +191,20 @@ static struct dmar_drhd_rt dmar_drhd_units[MAX_DRHDS];
 static bool iommu_page_walk_coherent = true;
 static struct dmar_info *platform_dmar_info = NULL;
 
+/*
+ * The DRHD and the source-id of each IOAPIC ID of the DMAR device scopes,
+ * indexed by register_hrhd_units() for ioapic_to_dmaru().
+ */
+#define IOAPIC_SCOPE_ID_NUM	256U
+
+struct ioapic_dmaru {
+	bool valid;
+	uint32_t drhd_index;
+	union pci_bdf sid;
+};
+
+static struct ioapic_dmaru ioapic_dmarus[IOAPIC_SCOPE_ID_NUM];
+
 /* Domain id 0 is reserved in some cases per VT-d */
 #define MAX_DOMAIN_NUM (CONFIG_MAX_VM_NUM + 1)
 
@@ -198,6 +216,25 @@ static inline uint16_t vmid_to_domainid(uint16_t vm_id)
 static int32_t dmar_register_hrhd(struct dmar_drhd_rt *dmar_unit);
 static struct dmar_drhd_rt *device_to_dmaru(uint8_t bus, uint8_t devfun);
 
+/* the first DRHD with a scope for an IOAPIC ID is the one it is remapped by */
+static void index_ioapic_scopes(uint32_t drhd_index, const struct dmar_drhd *drhd)
+{
+	struct ioapic_dmaru *entry;
+	uint32_t i;
+
+	for (i = 0U; i < drhd->dev_cnt; i++) {
+		if (drhd->devices[i].type == ACPI_DMAR_SCOPE_TYPE_IOAPIC) {
+			entry = &ioapic_dmarus[drhd->devices[i].id];
+			if (!entry->valid) {
+				entry->valid = true;
+				entry->drhd_index = drhd_index;
+				entry->sid.fields.bus = drhd->devices[i].bus;
+				entry->sid.fields.devfun = drhd->devices[i].devfun;
+			}
+		}
+	}
+}
+
 static int32_t register_hrhd_units(void)
 {
 	struct dmar_drhd_rt *drhd_rt;
@@ -209,6 +246,7 @@ static int32_t register_hrhd_units(void)
 		drhd_rt->index = i;
 		drhd_rt->drhd = &platform_dmar_info->drhd_units[i];
 		drhd_rt->dmar_irq = IRQ_INVALID;
+		index_ioapic_scopes(i, drhd_rt->drhd);
 
 		set_paging_supervisor(drhd_rt->drhd->reg_base_addr, PAGE_SIZE);
 
@@ -322,7 +360,9 @@ static void dmar_unit_show_capability(struct dmar_drhd_rt *dmar_unit)
 	pr_info("\tPSS:0x%x", iommu_ecap_pss(dmar_unit->ecap));
 	pr_info("\tPASID:%d", iommu_ecap_pasid(dmar_unit->ecap));
 	pr_info("\tDIT:%d", iommu_ecap_dit(dmar_unit->ecap));
-	pr_info("\tPDS:%d\n", iommu_ecap_pds(dmar_unit->ecap));
+	pr_info("\tPDS:%d", iommu_ecap_pds(dmar_unit->ecap));
+	pr_info("\tSMTS:%d", iommu_ecap_smts(dmar_unit->ecap));
+	pr_info("\tSLTS:%d\n", iommu_ecap_slts(dmar_unit->ecap));
 }
 #endif
 
@@ -494,32 +534,17 @@ static int32_t dmar_register_hrhd(struct dmar_drhd_rt *dmar_unit)
 static struct dmar_drhd_rt *ioapic_to_dmaru(uint16_t ioapic_id, union pci_bdf *sid)
 {
 	struct dmar_drhd_rt *dmar_unit = NULL;
-	uint32_t i, j;
-	bool found = false;
-
-	for (j = 0U; j < platform_dmar_info->drhd_count; j++) {
-		dmar_unit = &dmar_drhd_units[j];
-		for (i = 0U; i < dmar_unit->drhd->dev_cnt; i++) {
-			if ((dmar_unit->drhd->devices[i].type == ACPI_DMAR_SCOPE_TYPE_IOAPIC) &&
-					((uint16_t)dmar_unit->drhd->devices[i].id == ioapic_id)) {
-				sid->fields.devfun = dmar_unit->drhd->devices[i].devfun;
-				sid->fields.bus = dmar_unit->drhd->devices[i].bus;
-				found = true;
-				break;
-			}
-		}
-		if (found) {
-			break;
-		}
-	}
 
-	if (j == platform_dmar_info->drhd_count) {
-		dmar_unit = NULL;
+	if ((ioapic_id < IOAPIC_SCOPE_ID_NUM) && ioapic_dmarus[ioapic_id].valid) {
+		dmar_unit = &dmar_drhd_units[ioapic_dmarus[ioapic_id].drhd_index];
+		sid->fields.devfun = ioapic_dmarus[ioapic_id].sid.fields.devfun;
+		sid->fields.bus = ioapic_dmarus[ioapic_id].sid.fields.bus;
 	}
 
 	return dmar_unit;
 }
 
+/* the DRHD index of a device is kept in its pci_pdev, found through the pdev hash list */
 static struct dmar_drhd_rt *device_to_dmaru(uint8_t bus, uint8_t devfun)
 {
 	struct dmar_drhd_rt *dmaru = NULL;
@@ -541,21 +566,32 @@ static struct dmar_drhd_rt *device_to_dmaru(uint8_t bus, uint8_t devfun)
 	return dmaru;
 }
 
-static void dmar_issue_qi_request(struct dmar_drhd_rt *dmar_unit, struct dmar_entry invalidate_desc)
+/*
+ * Submit count invalidation descriptors followed by a single wait descriptor,
+ * and wait for that one only: it completes once all the descriptors before it
+ * are done. The queue is drained by each call, so it always has room for a
+ * batch of DMAR_QI_BATCH_SIZE.
+ *
+ * @pre (count > 0U) && (count <= DMAR_QI_BATCH_SIZE)
+ */
+static void dmar_issue_qi_requests(struct dmar_drhd_rt *dmar_unit, const struct dmar_entry *descs, uint16_t count)
 {
 	struct dmar_entry *invalidate_desc_ptr;
 	uint32_t qi_status = 0U;
 	uint64_t start;
+	uint16_t i;
 
 	spinlock_obtain(&(dmar_unit->lock));
 
-	invalidate_desc_ptr = (struct dmar_entry *)(dmar_unit->qi_queue + dmar_unit->qi_tail);
+	for (i = 0U; i < count; i++) {
+		invalidate_desc_ptr = (struct dmar_entry *)(dmar_unit->qi_queue + dmar_unit->qi_tail);
 
-	invalidate_desc_ptr->hi_64 = invalidate_desc.hi_64;
-	invalidate_desc_ptr->lo_64 = invalidate_desc.lo_64;
-	dmar_unit->qi_tail = (dmar_unit->qi_tail + DMAR_QI_INV_ENTRY_SIZE) % DMAR_INVALIDATION_QUEUE_SIZE;
+		invalidate_desc_ptr->hi_64 = descs[i].hi_64;
+		invalidate_desc_ptr->lo_64 = descs[i].lo_64;
+		dmar_unit->qi_tail = (dmar_unit->qi_tail + DMAR_QI_INV_ENTRY_SIZE) % DMAR_INVALIDATION_QUEUE_SIZE;
+	}
 
-	invalidate_desc_ptr++;
+	invalidate_desc_ptr = (struct dmar_entry *)(dmar_unit->qi_queue + dmar_unit->qi_tail);
 
 	invalidate_desc_ptr->hi_64 = hva2hpa(&qi_status);
 	invalidate_desc_ptr->lo_64 = DMAR_INV_WAIT_DESC_LOWER;
@@ -576,14 +612,20 @@ static void dmar_issue_qi_request(struct dmar_drhd_rt *dmar_unit, struct dmar_en
 	spinlock_release(&(dmar_unit->lock));
 }
 
+static void dmar_issue_qi_request(struct dmar_drhd_rt *dmar_unit, struct dmar_entry invalidate_desc)
+{
+	dmar_issue_qi_requests(dmar_unit, &invalidate_desc, 1U);
+}
+
 /*
  * did: domain id
  * sid: source id
  * fm: function mask
  * cirg: cache-invalidation request granularity
+ *
+ * return a descriptor with lo_64 == 0 for an unknown cirg
  */
-static void dmar_invalid_context_cache(struct dmar_drhd_rt *dmar_unit,
-	uint16_t did, uint16_t sid, uint8_t fm, enum dmar_cirg_type cirg)
+static struct dmar_entry dmar_context_cache_desc(uint16_t did, uint16_t sid, uint8_t fm, enum dmar_cirg_type cirg)
 {
 	struct dmar_entry invalidate_desc;
 
@@ -605,6 +647,14 @@ static void dmar_invalid_context_cache(struct dmar_drhd_rt *dmar_unit,
 		break;
 	}
 
+	return invalidate_desc;
+}
+
+static void dmar_invalid_context_cache(struct dmar_drhd_rt *dmar_unit,
+	uint16_t did, uint16_t sid, uint8_t fm, enum dmar_cirg_type cirg)
+{
+	struct dmar_entry invalidate_desc = dmar_context_cache_desc(did, sid, fm, cirg);
+
 	if (invalidate_desc.lo_64 != 0UL) {
 		dmar_issue_qi_request(dmar_unit, invalidate_desc);
 	}
@@ -615,8 +665,8 @@ static void dmar_invalid_context_cache_global(struct dmar_drhd_rt *dmar_unit)
 	dmar_invalid_context_cache(dmar_unit, 0U, 0U, 0U, DMAR_CIRG_GLOBAL);
 }
 
-static void dmar_invalid_iotlb(struct dmar_drhd_rt *dmar_unit, uint16_t did, uint64_t address, uint8_t am,
-			       bool hint, enum dmar_iirg_type iirg)
+/* return a descriptor with lo_64 == 0 for an unknown iirg */
+static struct dmar_entry dmar_iotlb_desc(uint16_t did, uint64_t address, uint8_t am, bool hint, enum dmar_iirg_type iirg)
 {
 	/* set Drain Reads & Drain Writes,
 	 * if hardware doesn't support it, will be ignored by hardware
@@ -648,11 +698,37 @@ static void dmar_invalid_iotlb(struct dmar_drhd_rt *dmar_unit, uint16_t did, uin
 		pr_err("unknown IIRG type");
 	}
 
+	return invalidate_desc;
+}
+
+static void dmar_invalid_iotlb(struct dmar_drhd_rt *dmar_unit, uint16_t did, uint64_t address, uint8_t am,
+			       bool hint, enum dmar_iirg_type iirg)
+{
+	struct dmar_entry invalidate_desc = dmar_iotlb_desc(did, address, am, hint, iirg);
+
 	if (invalidate_desc.lo_64 != 0UL) {
 		dmar_issue_qi_request(dmar_unit, invalidate_desc);
 	}
 }
 
+/*
+ * Invalidate all the translations the device-TLB of a device caches.
+ *
+ * sid: source id of the device
+ * pfsid: source id of the PF of the device if it is a VF, sid otherwise
+ * qdep: invalidate queue depth of the device
+ */
+static struct dmar_entry dmar_dev_iotlb_desc(uint16_t sid, uint16_t pfsid, uint16_t qdep)
+{
+	struct dmar_entry invalidate_desc;
+
+	invalidate_desc.lo_64 = DMAR_INV_DEV_IOTLB_DESC | dma_dev_iotlb_sid(sid) | dma_dev_iotlb_qdep(qdep) |
+				dma_dev_iotlb_pfsid(pfsid);
+	invalidate_desc.hi_64 = DMA_DEV_IOTLB_ADDR_ALL | DMA_DEV_IOTLB_SIZE;
+
+	return invalidate_desc;
+}
+
 /* Invalidate IOTLB globally,
  * all iotlb entries are invalidated,
  * all PASID-cache entries are invalidated,
@@ -685,8 +761,7 @@ static void dmar_set_intr_remap_table(struct dmar_drhd_rt *dmar_unit)
 	spinlock_release(&(dmar_unit->lock));
 }
 
-static void dmar_invalid_iec(struct dmar_drhd_rt *dmar_unit, uint16_t intr_index,
-				uint8_t index_mask, bool is_global)
+static struct dmar_entry dmar_iec_desc(uint16_t intr_index, uint8_t index_mask, bool is_global)
 {
 	struct dmar_entry invalidate_desc;
 
@@ -699,9 +774,13 @@ static void dmar_invalid_iec(struct dmar_drhd_rt *dmar_unit, uint16_t intr_index
 		invalidate_desc.lo_64 |= DMAR_IECI_INDEXED | dma_iec_index(intr_index, index_mask);
 	}
 
-	if (invalidate_desc.lo_64 != 0UL) {
-		dmar_issue_qi_request(dmar_unit, invalidate_desc);
-	}
+	return invalidate_desc;
+}
+
+static void dmar_invalid_iec(struct dmar_drhd_rt *dmar_unit, uint16_t intr_index,
+				uint8_t index_mask, bool is_global)
+{
+	dmar_issue_qi_request(dmar_unit, dmar_iec_desc(intr_index, index_mask, is_global));
 }
 
 static void dmar_invalid_iec_global(struct dmar_drhd_rt *dmar_unit)
@@ -950,10 +1029,10 @@ static void suspend_dmar(struct dmar_drhd_rt *dmar_unit)
 {
 	uint32_t i;
 
-	dmar_invalid_context_cache_global(dmar_unit);
-	dmar_invalid_iotlb_global(dmar_unit);
-	dmar_invalid_iec_global(dmar_unit);
-
+	/*
+	 * No invalidation here: the unit loses its caches in S3 and
+	 * enable_dmar() invalidates them all on resume anyway.
+	 */
 	disable_dmar(dmar_unit);
 
 	/* save IOMMU fault register state */
@@ -1001,7 +1080,52 @@ static bool is_dmar_unit_valid(const struct dmar_drhd_rt *dmar_unit, union pci_b
 	return valid;
 }
 
-/* @pre bus < ACFG_MAX_PCI_BUS_NUM */
+static bool is_ats_capable(const struct dmar_drhd_rt *dmar_unit, const struct pci_pdev *pdev)
+{
+	return ((iommu_ecap_dt(dmar_unit->ecap) != 0U) && (pdev != NULL) && (pdev->ats_capoff != 0U));
+}
+
+/*
+ * With ATS the device caches the translations of its DMA in its device-TLB,
+ * the DMA hitting this cache skips the IOTLB lookup of the DMAR unit and the
+ * page walk of a miss. The smallest translation unit is left to 4KB, the
+ * second-level tables have no smaller page.
+ *
+ * @pre pdev != NULL
+ */
+static void iommu_enable_ats(const struct pci_pdev *pdev)
+{
+	uint32_t ctrl = pci_pdev_read_cfg(pdev->bdf, pdev->ats_capoff + PCIR_ATS_CTRL, 2U);
+
+	ctrl = (ctrl & ~PCIM_ATS_CTRL_STU) | PCIM_ATS_CTRL_EN;
+	pci_pdev_write_cfg(pdev->bdf, pdev->ats_capoff + PCIR_ATS_CTRL, 2U, ctrl);
+}
+
+/* @pre pdev != NULL */
+static bool is_ats_enabled(const struct pci_pdev *pdev)
+{
+	uint32_t ctrl = pci_pdev_read_cfg(pdev->bdf, pdev->ats_capoff + PCIR_ATS_CTRL, 2U);
+
+	return ((ctrl & PCIM_ATS_CTRL_EN) != 0U);
+}
+
+/* @pre pdev != NULL */
+static void iommu_disable_ats(const struct pci_pdev *pdev)
+{
+	uint32_t ctrl = pci_pdev_read_cfg(pdev->bdf, pdev->ats_capoff + PCIR_ATS_CTRL, 2U);
+
+	pci_pdev_write_cfg(pdev->bdf, pdev->ats_capoff + PCIR_ATS_CTRL, 2U, ctrl & ~PCIM_ATS_CTRL_EN);
+}
+
+/*
+ * The context entry is built in legacy mode, its second-level pointer is the
+ * translation table of the domain, which is the EPT of the VM (see
+ * create_iommu_domain()). So DMA already walks the very page tables the vCPUs
+ * use, and a mapping change is made once. Scalable mode (SMTS) would only add
+ * a PASID directory and table on top to reach the same second-level table.
+ *
+ * @pre bus < ACFG_MAX_PCI_BUS_NUM
+ */
 static int32_t iommu_attach_device(const struct iommu_domain *domain, uint8_t bus, uint8_t devfun)
 {
 	struct dmar_drhd_rt *dmar_unit;
@@ -1010,8 +1134,10 @@ static int32_t iommu_attach_device(const struct iommu_domain *domain, uint8_t bu
 	struct dmar_entry *context;
 	struct dmar_entry *root_entry;
 	struct dmar_entry *context_entry;
+	const struct pci_pdev *pdev;
 	uint64_t hi_64 = 0UL;
 	uint64_t lo_64 = 0UL;
+	bool ats;
 	int32_t ret = -EINVAL;
 	/* source id */
 	union pci_bdf sid;
@@ -1056,12 +1182,14 @@ static int32_t iommu_attach_device(const struct iommu_domain *domain, uint8_t bu
 			pr_err("already present for %x:%x.%x", bus, sid.bits.d, sid.bits.f);
 			ret = -EBUSY;
 		} else {
-			/* setup context entry for the devfun */
-			/* TODO: add Device TLB support */
+			pdev = pci_find_pdev(sid.value);
+			ats = is_ats_capable(dmar_unit, pdev);
+
+			/* setup context entry for the devfun, letting it request translations for its device-TLB */
 			hi_64 = dmar_set_bitslice(hi_64, CTX_ENTRY_UPPER_AW_MASK, CTX_ENTRY_UPPER_AW_POS,
 					(uint64_t)width_to_agaw(domain->addr_width));
 			lo_64 = dmar_set_bitslice(lo_64, CTX_ENTRY_LOWER_TT_MASK, CTX_ENTRY_LOWER_TT_POS,
-					DMAR_CTX_TT_UNTRANSLATED);
+					ats ? DMAR_CTX_TT_ALL : DMAR_CTX_TT_UNTRANSLATED);
 			hi_64 = dmar_set_bitslice(hi_64, CTX_ENTRY_UPPER_DID_MASK, CTX_ENTRY_UPPER_DID_POS,
 				(uint64_t)vmid_to_domainid(domain->vm_id));
 			lo_64 = dmar_set_bitslice(lo_64, CTX_ENTRY_LOWER_SLPTPTR_MASK, CTX_ENTRY_LOWER_SLPTPTR_POS,
@@ -1071,6 +1199,9 @@ static int32_t iommu_attach_device(const struct iommu_domain *domain, uint8_t bu
 			context_entry->hi_64 = hi_64;
 			context_entry->lo_64 = lo_64;
 			iommu_flush_cache(context_entry, sizeof(struct dmar_entry));
+			if (ats) {
+				iommu_enable_ats(pdev);
+			}
 			ret = 0;
 		}
 	} else {
@@ -1091,6 +1222,10 @@ static int32_t iommu_detach_device(const struct iommu_domain *domain, uint8_t bu
 	struct dmar_entry *context;
 	struct dmar_entry *root_entry;
 	struct dmar_entry *context_entry;
+	struct dmar_entry invalidate_desc[5];
+	const struct pci_pdev *pdev;
+	uint16_t qdep, nr_descs = 3U;
+	bool ats;
 	/* source id */
 	union pci_bdf sid;
 	int32_t ret = -EINVAL;
@@ -1120,15 +1255,38 @@ static int32_t iommu_detach_device(const struct iommu_domain *domain, uint8_t bu
 			pr_err("%s: domain id mismatch", __func__);
 			ret = -EPERM;
 		} else {
+			pdev = pci_find_pdev(sid.value);
+			ats = is_ats_capable(dmar_unit, pdev) && is_ats_enabled(pdev);
+
 			/* clear the present bit first */
 			context_entry->lo_64 = 0UL;
 			context_entry->hi_64 = 0UL;
 			iommu_flush_cache(context_entry, sizeof(struct dmar_entry));
 
-			dmar_invalid_context_cache(dmar_unit, vmid_to_domainid(domain->vm_id), sid.value, 0U,
+			/*
+			 * One submission for all, the fences keep the IOTLB from being
+			 * invalidated before the context cache is, and the device-TLB
+			 * before the IOTLB is.
+			 */
+			invalidate_desc[0] = dmar_context_cache_desc(vmid_to_domainid(domain->vm_id), sid.value, 0U,
 							DMAR_CIRG_DEVICE);
-			dmar_invalid_iotlb(dmar_unit, vmid_to_domainid(domain->vm_id), 0UL, 0U, false,
+			invalidate_desc[1].hi_64 = 0UL;
+			invalidate_desc[1].lo_64 = DMAR_INV_FENCE_DESC_LOWER;
+			invalidate_desc[2] = dmar_iotlb_desc(vmid_to_domainid(domain->vm_id), 0UL, 0U, false,
 							DMAR_IIRG_DOMAIN);
+			if (ats) {
+				qdep = (uint16_t)pci_pdev_read_cfg(pdev->bdf, pdev->ats_capoff + PCIR_ATS_CAP, 2U) &
+					PCIM_ATS_CAP_QDEP;
+				invalidate_desc[3].hi_64 = 0UL;
+				invalidate_desc[3].lo_64 = DMAR_INV_FENCE_DESC_LOWER;
+				invalidate_desc[4] = dmar_dev_iotlb_desc(sid.value, pdev->pf_bdf.value, qdep);
+				nr_descs = 5U;
+			}
+			dmar_issue_qi_requests(dmar_unit, invalidate_desc, nr_descs);
+
+			if (ats) {
+				iommu_disable_ats(pdev);
+			}
 		}
 	} else {
 		if (is_dmar_unit_ignored(dmar_unit)) {
@@ -1271,26 +1429,61 @@ int32_t init_iommu(void)
 	return ret;
 }
 
-/* Allocate continuous IRTEs specified by num, num can be 1, 2, 4, 8, 16, 32 */
+/* the bits at which a naturally aligned block of 1 << order IRTEs starts in a bitmap word */
+static const uint64_t irte_block_starts[6] = {
+	0xFFFFFFFFFFFFFFFFUL,
+	0x5555555555555555UL,
+	0x1111111111111111UL,
+	0x0101010101010101UL,
+	0x0001000100010001UL,
+	0x0000000100000001UL,
+};
+
+/*
+ * The starts of the free blocks of num IRTEs in a word of irte_alloc_bitmap:
+ * a free bit stays set only if the num - 1 bits above it are free too.
+ *
+ * @pre num can be 1, 2, 4, 8, 16, 32
+ */
+static uint64_t free_irte_blocks(uint64_t alloc_word, uint16_t num)
+{
+	uint64_t free = ~alloc_word;
+	uint16_t span;
+
+	for (span = 1U; span < num; span <<= 1U) {
+		free &= free >> span;
+	}
+
+	return free & irte_block_starts[ffs64(num)];
+}
+
+/*
+ * Allocate continuous IRTEs specified by num, num can be 1, 2, 4, 8, 16, 32.
+ * The blocks are aligned on num, which a block never crosses a bitmap word
+ * for, so the lookup costs a few bit operations per word of 64 IRTEs.
+ */
 static uint16_t alloc_irtes(struct dmar_drhd_rt *dmar_unit, const uint16_t num)
 {
-	uint16_t irte_idx;
+	uint16_t irte_idx = INVALID_IRTE_ID;
 	uint64_t mask = (1UL << num) - 1U;
-	uint64_t test_mask;
+	uint64_t blocks;
+	uint16_t word, bit;
 
 	ASSERT((bitmap_weight(num) == 1U) && (num <= 32U));
 
 	spinlock_obtain(&dmar_unit->lock);
-	for (irte_idx = 0U; irte_idx < MAX_IR_ENTRIES; irte_idx += num) {
-		test_mask = mask << (irte_idx & 0x3FU);
-		if ((dmar_unit->irte_alloc_bitmap[irte_idx >> 6U] & test_mask) == 0UL) {
-			dmar_unit->irte_alloc_bitmap[irte_idx >> 6U] |= test_mask;
+	for (word = 0U; word < (MAX_IR_ENTRIES >> 6U); word++) {
+		blocks = free_irte_blocks(dmar_unit->irte_alloc_bitmap[word], num);
+		if (blocks != 0UL) {
+			bit = ffs64(blocks);
+			dmar_unit->irte_alloc_bitmap[word] |= mask << bit;
+			irte_idx = (word << 6U) + bit;
 			break;
 		}
 	}
 	spinlock_release(&dmar_unit->lock);
 
-	return (irte_idx < MAX_IR_ENTRIES) ? irte_idx: INVALID_IRTE_ID;
+	return irte_idx;
 }
 
 static bool is_irte_reserved(const struct dmar_drhd_rt *dmar_unit, uint16_t index)
@@ -1390,11 +1583,13 @@ int32_t dmar_assign_irte(const struct intr_source *intr_src, union dmar_ir_entry
 	return ret;
 }
 
-void dmar_free_irte(const struct intr_source *intr_src, uint16_t index)
+void dmar_free_irtes(const struct intr_source *intr_src, const uint16_t *index, uint16_t count)
 {
 	struct dmar_drhd_rt *dmar_unit;
 	union dmar_ir_entry *ir_table, *ir_entry;
+	struct dmar_entry invalidate_desc[DMAR_QI_BATCH_SIZE];
 	union pci_bdf sid;
+	uint16_t i, nr_desc = 0U;
 
 	if (intr_src->is_msi) {
 		dmar_unit = device_to_dmaru((uint8_t)intr_src->src.msi.bits.b, intr_src->src.msi.fields.devfun);
@@ -1402,19 +1597,35 @@ void dmar_free_irte(const struct intr_source *intr_src, uint16_t index)
 		dmar_unit = ioapic_to_dmaru(intr_src->src.ioapic_id, &sid);
 	}
 
-	if (is_dmar_unit_valid(dmar_unit, sid) && (index < MAX_IR_ENTRIES)) {
+	if (is_dmar_unit_valid(dmar_unit, sid)) {
 		ir_table = (union dmar_ir_entry *)hpa2hva(dmar_unit->ir_table_addr);
-		ir_entry = ir_table + index;
-		ir_entry->bits.remap.present = 0x0UL;
+		for (i = 0U; i < count; i++) {
+			if (index[i] < MAX_IR_ENTRIES) {
+				ir_entry = ir_table + index[i];
+				ir_entry->bits.remap.present = 0x0UL;
+				iommu_flush_cache(ir_entry, sizeof(union dmar_ir_entry));
+
+				invalidate_desc[nr_desc] = dmar_iec_desc(index[i], 0U, false);
+				nr_desc++;
+			}
+		}
 
-		iommu_flush_cache(ir_entry, sizeof(union dmar_ir_entry));
-		dmar_invalid_iec(dmar_unit, index, 0U, false);
+		/* the IRTEs can only be reused once the IEC no longer holds them */
+		if (nr_desc != 0U) {
+			dmar_issue_qi_requests(dmar_unit, invalidate_desc, nr_desc);
+		}
 
-		if (!is_irte_reserved(dmar_unit, index)) {
-			spinlock_obtain(&dmar_unit->lock);
-			bitmap_clear_nolock(index & 0x3FU, &dmar_unit->irte_alloc_bitmap[index >> 6U]);
-			spinlock_release(&dmar_unit->lock);
+		spinlock_obtain(&dmar_unit->lock);
+		for (i = 0U; i < count; i++) {
+			if ((index[i] < MAX_IR_ENTRIES) && !is_irte_reserved(dmar_unit, index[i])) {
+				bitmap_clear_nolock(index[i] & 0x3FU, &dmar_unit->irte_alloc_bitmap[index[i] >> 6U]);
+			}
 		}
+		spinlock_release(&dmar_unit->lock);
 	}
+}
 
+void dmar_free_irte(const struct intr_source *intr_src, uint16_t index)
+{
+	dmar_free_irtes(intr_src, &index, 1U);
 }
@@ -38,6 +38,17 @@
 
 static struct acpi_table_rsdp *acpi_rsdp;
 
+/* the tables listed by the XSDT/RSDT, see index_acpi_tbls() */
+#define ACPI_MAX_TABLES		64U
+
+struct acpi_tbl_entry {
+	char signature[ACPI_NAME_SIZE];
+	uint64_t address;
+};
+
+static struct acpi_tbl_entry acpi_tbls[ACPI_MAX_TABLES];
+static uint32_t acpi_tbl_count;
+
 static struct acpi_table_rsdp *found_rsdp(char *base, uint64_t length)
 {
 	struct acpi_table_rsdp *rsdp, *ret = NULL;
@@ -66,6 +77,58 @@ static struct acpi_table_rsdp *get_rsdp(void)
 	return acpi_rsdp;
 }
 
+static void index_acpi_tbl(uint64_t address)
+{
+	const struct acpi_table_header *table = (const struct acpi_table_header *)hpa2hva(address);
+
+	if (acpi_tbl_count < ACPI_MAX_TABLES) {
+		(void)memcpy_s(acpi_tbls[acpi_tbl_count].signature, ACPI_NAME_SIZE, table->signature, ACPI_NAME_SIZE);
+		acpi_tbls[acpi_tbl_count].address = address;
+		acpi_tbl_count++;
+	} else {
+		pr_err("%s: more than %u ACPI tables, 0x%lx ignored", __func__, ACPI_MAX_TABLES, address);
+	}
+}
+
+/*
+ * Walk the XSDT, or the RSDT if there is none, once and keep the signature
+ * and the address of each table for get_acpi_tbl().
+ */
+static void index_acpi_tbls(void)
+{
+	struct acpi_table_rsdp *rsdp;
+	struct acpi_table_rsdt *rsdt;
+	struct acpi_table_xsdt *xsdt;
+	uint32_t i, count;
+
+	/* the returned RSDP should always exist. Otherwise the hypervisor
+	 * can't be booted.
+	 */
+	rsdp = get_rsdp();
+
+	if ((rsdp->revision >= 2U) && (rsdp->xsdt_physical_address != 0UL)) {
+		/*
+		 * AcpiOsGetRootPointer only verifies the checksum for
+		 * the version 1.0 portion of the RSDP.  Version 2.0 has
+		 * an additional checksum that we verify first.
+		 */
+		xsdt = (struct acpi_table_xsdt *)hpa2hva(rsdp->xsdt_physical_address);
+		count = (xsdt->header.length - sizeof(struct acpi_table_header)) / sizeof(uint64_t);
+
+		for (i = 0U; i < count; i++) {
+			index_acpi_tbl(xsdt->table_offset_entry[i]);
+		}
+	} else {
+		/* Root table is an RSDT (32-bit physical addresses) */
+		rsdt = (struct acpi_table_rsdt *)hpa2hva((uint64_t)rsdp->rsdt_physical_address);
+		count = (rsdt->header.length - sizeof(struct acpi_table_header)) / sizeof(uint32_t);
+
+		for (i = 0U; i < count; i++) {
+			index_acpi_tbl((uint64_t)rsdt->table_offset_entry[i]);
+		}
+	}
+}
+
 void init_acpi(void)
 {
 	struct acpi_table_rsdp *rsdp = NULL;
@@ -106,61 +169,18 @@ void init_acpi(void)
 
 	/* After RSDP is parsed, it will be assigned to acpi_rsdp */
 	acpi_rsdp = rsdp;
-}
-
-static bool probe_table(uint64_t address, const char *signature)
-{
-	void *va =  hpa2hva(address);
-	struct acpi_table_header *table = (struct acpi_table_header *)va;
-	bool ret;
-
-	if (strncmp(table->signature, signature, ACPI_NAME_SIZE) != 0) {
-		ret = false;
-	} else {
-		ret = true;
-	}
-
-	return ret;
+	index_acpi_tbls();
 }
 
 void *get_acpi_tbl(const char *signature)
 {
-	struct acpi_table_rsdp *rsdp;
-	struct acpi_table_rsdt *rsdt;
-	struct acpi_table_xsdt *xsdt;
 	uint64_t addr = 0UL;
-	uint32_t i, count;
-
-	/* the returned RSDP should always exist. Otherwise the hypervisor
-	 * can't be booted.
-	 */
-	rsdp = get_rsdp();
+	uint32_t i;
 
-	if ((rsdp->revision >= 2U) && (rsdp->xsdt_physical_address != 0UL)) {
-		/*
-		 * AcpiOsGetRootPointer only verifies the checksum for
-		 * the version 1.0 portion of the RSDP.  Version 2.0 has
-		 * an additional checksum that we verify first.
-		 */
-		xsdt = (struct acpi_table_xsdt *)hpa2hva(rsdp->xsdt_physical_address);
-		count = (xsdt->header.length - sizeof(struct acpi_table_header)) / sizeof(uint64_t);
-
-		for (i = 0U; i < count; i++) {
-			if (probe_table(xsdt->table_offset_entry[i], signature)) {
-				addr = xsdt->table_offset_entry[i];
-				break;
-			}
-		}
-	} else {
-		/* Root table is an RSDT (32-bit physical addresses) */
-		rsdt = (struct acpi_table_rsdt *)hpa2hva((uint64_t)rsdp->rsdt_physical_address);
-		count = (rsdt->header.length - sizeof(struct acpi_table_header)) / sizeof(uint32_t);
-
-		for (i = 0U; i < count; i++) {
-			if (probe_table(rsdt->table_offset_entry[i], signature)) {
-				addr = rsdt->table_offset_entry[i];
-				break;
-			}
+	for (i = 0U; i < acpi_tbl_count; i++) {
+		if (strncmp(acpi_tbls[i].signature, signature, ACPI_NAME_SIZE) == 0) {
+			addr = acpi_tbls[i].address;
+			break;
 		}
 	}
 
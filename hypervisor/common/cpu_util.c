@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Utilization of the pCPUs and vCPUs, from the counters the scheduler and
+ * vmexit_handler() keep anyway. Nothing is sampled in the background: the
+ * readers, the top shell command and HC_GET_CPU_UTIL, snapshot the counters
+ * and take the difference from their previous snapshot.
+ */
+
+#include <asm/cpu.h>
+#include <asm/per_cpu.h>
+#include <asm/guest/vcpu.h>
+#include <asm/guest/vm.h>
+#include <schedule.h>
+#include <cpu_util.h>
+
+/**
+ * @pre pcpu_id < get_pcpu_nums() && util != NULL
+ */
+void get_pcpu_util(uint16_t pcpu_id, struct acrn_pcpu_util *util)
+{
+	struct sched_stats stats;
+
+	(void)memset(util, 0U, sizeof(*util));
+	if (is_pcpu_active(pcpu_id)) {
+		sched_get_stats(&per_cpu(idle, pcpu_id), &stats);
+		util->idle_ticks = stats.run_ticks;
+		util->hv_ticks = per_cpu(exit_ticks, pcpu_id);
+		util->nr_exits = per_cpu(nr_exits, pcpu_id);
+	}
+}
+
+/**
+ * @pre vcpu != NULL && util != NULL
+ */
+void get_vcpu_util(struct acrn_vcpu *vcpu, struct acrn_vcpu_util *util)
+{
+	struct sched_stats stats;
+	uint16_t reason;
+
+	(void)memset(util, 0U, sizeof(*util));
+	sched_get_stats(&vcpu->thread_obj, &stats);
+	util->vm_id = vcpu->vm->vm_id;
+	util->vcpu_id = vcpu->vcpu_id;
+	util->pcpu_id = pcpuid_from_vcpu(vcpu);
+	util->run_ticks = stats.run_ticks;
+	util->wait_ticks = stats.wait_ticks;
+	for (reason = 0U; reason < ACRN_VMEXIT_REASONS; reason++) {
+		util->exit_ticks += vcpu->exit_stats[reason].ticks;
+		util->nr_exits += vcpu->exit_stats[reason].count;
+	}
+}
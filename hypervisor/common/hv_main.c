@@ -9,11 +9,15 @@
 #include <asm/guest/vmcs.h>
 #include <asm/guest/vmexit.h>
 #include <asm/guest/virq.h>
+#include <asm/rdt.h>
+#include <asm/host_pm.h>
 #include <schedule.h>
 #include <profiling.h>
 #include <sprintf.h>
 #include <trace.h>
+#include <softirq.h>
 #include <logmsg.h>
+#include <flightrec.h>
 
 void vcpu_thread(struct thread_object *obj)
 {
@@ -55,6 +59,7 @@ void vcpu_thread(struct thread_object *obj)
 			continue;
 		}
 		TRACE_2L(TRACE_VM_EXIT, vcpu->arch.exit_reason, vcpu_get_rip(vcpu));
+		flightrec_put(FLIGHTREC_VM_EXIT, vcpu->arch.exit_reason, vcpu_get_rip(vcpu));
 
 		profiling_pre_vmexit_handler(vcpu);
 
@@ -85,12 +90,22 @@ void default_idle(__unused struct thread_object *obj)
 			cpu_dead();
 		} else if (need_shutdown_vm(pcpu_id)) {
 			shutdown_vm_from_idle(pcpu_id);
+		} else if (has_pending_softirq(pcpu_id)) {
+			/* left by a vCPU thread over its softirq budget */
+			do_softirq();
 		} else {
 			cpu_do_idle();
 		}
 	}
 }
 
+/* The hypervisor runs with its own CLOS and HWP request when the pCPU is idle */
+static void idle_switch_in(__unused struct thread_object *obj)
+{
+	restore_hv_pqr_assoc();
+	restore_hv_freq_policy();
+}
+
 void run_idle_thread(void)
 {
 	uint16_t pcpu_id = get_pcpu_id();
@@ -103,7 +118,7 @@ void run_idle_thread(void)
 	idle->pcpu_id = pcpu_id;
 	idle->thread_entry = default_idle;
 	idle->switch_out = NULL;
-	idle->switch_in = NULL;
+	idle->switch_in = idle_switch_in;
 	idle_params.prio = PRIO_IDLE;
 	init_thread_data(idle, &idle_params);
 
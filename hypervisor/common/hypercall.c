@@ -13,6 +13,7 @@
 #include <asm/per_cpu.h>
 #include <asm/lapic.h>
 #include <asm/guest/assign.h>
+#include <asm/guest/virq.h>
 #include <asm/guest/ept.h>
 #include <asm/mmu.h>
 #include <hypercall.h>
@@ -25,8 +26,13 @@
 #include <asm/rtcm.h>
 #include <asm/irq.h>
 #include <ticks.h>
+#include <asm/tsc.h>
 #include <asm/cpuid.h>
 #include <vroot_port.h>
+#include <trace.h>
+#include <asm/rdt.h>
+#include <asm/host_pm.h>
+#include <cpu_util.h>
 
 #define DBG_LEVEL_HYCALL	6U
 
@@ -458,13 +464,12 @@ int32_t hcall_set_irqline(__unused struct acrn_vcpu *vcpu, struct acrn_vm *targe
  */
 int32_t hcall_inject_msi(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, __unused uint64_t param1, uint64_t param2)
 {
-	struct acrn_vm *vm = vcpu->vm;
 	int32_t ret = -1;
 
 	if (is_severity_pass(target_vm->vm_id) && !is_poweroff_vm(target_vm)) {
 		struct acrn_msi_entry msi;
 
-		if (copy_from_gpa(vm, &msi, param2, sizeof(msi)) == 0) {
+		if (copy_hcall_arg(vcpu, &msi, param2, sizeof(msi)) == 0) {
 			ret = vlapic_inject_msi(target_vm, msi.msi_addr, msi.msi_data);
 		}
 	}
@@ -472,6 +477,95 @@ int32_t hcall_inject_msi(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, __un
 	return ret;
 }
 
+/**
+ * @brief send an IPI to several vCPUs
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm not used
+ * @param param1 bits 31:0 as the ICR low dword, bits 63:32 the APIC ID that
+ *               bit 0 of param2 stands for
+ * @param param2 bitmap of the destination APIC IDs
+ *
+ * @pre is_pv_ipi_configured(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_send_ipi(struct acrn_vcpu *vcpu, __unused struct acrn_vm *target_vm, uint64_t param1, uint64_t param2)
+{
+	return vlapic_send_ipi_mask(vcpu, (uint32_t)param1, (uint32_t)(param1 >> 32U), param2);
+}
+
+/**
+ * @brief wake up a vCPU halted on a PV spinlock
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm not used
+ * @param param1 not used, the flags of KVM_HC_KICK_CPU
+ * @param param2 APIC ID of the vCPU to wake up
+ *
+ * @pre is_pv_clock_configured(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_pv_kick(struct acrn_vcpu *vcpu, __unused struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_vcpu *target;
+	uint16_t vcpu_id = vm_apicid2vcpu_id(vm, (uint32_t)param2);
+	int32_t ret = -EINVAL;
+
+	if (vcpu_id != INVALID_CPU_ID) {
+		target = vcpu_from_vid(vm, vcpu_id);
+		/* seen by hlt_can_wake() before the wakeup, or by the next halt */
+		target->arch.pv_unhalted = true;
+		cpu_write_memory_barrier();
+		signal_event(&target->events[VCPU_EVENT_VIRTUAL_INTERRUPT]);
+		ret = 0;
+	}
+
+	return ret;
+}
+
+/**
+ * @brief register the PV timer page of a vCPU
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm not used
+ * @param param1 not used
+ * @param param2 guest physical address of the struct acrn_pv_timer_page, 0 to
+ *               unregister it
+ *
+ * @pre is_pv_timer_configured(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_pv_timer_page(struct acrn_vcpu *vcpu, __unused struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_pv_timer_page *page = NULL;
+	uint64_t hpa;
+	int32_t ret = -EINVAL;
+
+	if (param2 == 0UL) {
+		ret = 0;
+	} else if (mem_aligned_check(param2, sizeof(struct acrn_pv_timer_page)) && !is_lapic_pt_enabled(vcpu)) {
+		/* it can't cross a page boundary being aligned to its size */
+		hpa = gpa2hpa(vcpu->vm, param2);
+		if (hpa != INVALID_HPA) {
+			page = (struct acrn_pv_timer_page *)hpa2hva(hpa);
+			ret = 0;
+		} else {
+			pr_err("%s,vm[%hu] gpa 0x%lx,GPA is unmapping.", __func__, vcpu->vm->vm_id, param2);
+		}
+	} else {
+		/* LAPIC passthrough has no vLAPIC timer to defer */
+	}
+
+	if (ret == 0) {
+		vlapic_set_pv_timer_page(vcpu_vlapic(vcpu), page);
+	}
+
+	return ret;
+}
+
 /**
  * @brief set ioreq shared buffer
  *
@@ -545,6 +639,78 @@ int32_t hcall_setup_sbuf(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
 	return ret;
 }
 
+/**
+ * @brief Set the runtime enable mask of the trace events.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param param1 guest physical address. This gpa points to
+ *              struct acrn_trace_mask
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_trace_mask(struct acrn_vcpu *vcpu, __unused struct acrn_vm *target_vm,
+		uint64_t param1, __unused uint64_t param2)
+{
+	struct acrn_trace_mask tm;
+	int32_t ret = -EINVAL;
+
+	if (copy_from_gpa(vcpu->vm, &tm, param1, sizeof(tm)) == 0) {
+		trace_set_event_mask(tm.mask);
+		ret = 0;
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Update a CLOS configuration of a cache or MBA instance at runtime.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param param1 guest physical address. This gpa points to
+ *              struct acrn_clos_config
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_clos_config(struct acrn_vcpu *vcpu, __unused struct acrn_vm *target_vm,
+		uint64_t param1, __unused uint64_t param2)
+{
+	struct acrn_clos_config cfg;
+	int32_t ret = -EINVAL;
+
+	if ((copy_from_gpa(vcpu->vm, &cfg, param1, sizeof(cfg)) == 0) && (cfg.value <= 0xFFFFFFFFUL)) {
+		ret = set_clos_config(cfg.res, cfg.clos, cfg.pcpu_id, (uint32_t)cfg.value);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Get the cache and memory bandwidth monitoring counters of a VM.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vm_rdt_mon
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_get_vm_rdt_mon(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm_rdt_mon mon;
+	int32_t ret = -EINVAL;
+
+	if (!is_poweroff_vm(target_vm)) {
+		get_vm_rdt_mon(target_vm->vm_id, &mon);
+		ret = copy_to_gpa(vcpu->vm, &mon, param2, sizeof(mon));
+	}
+
+	return ret;
+}
+
 int32_t hcall_asyncio_assign(__unused struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
 		 __unused uint64_t param1, uint64_t param2)
 {
@@ -553,7 +719,8 @@ int32_t hcall_asyncio_assign(__unused struct acrn_vcpu *vcpu, struct acrn_vm *ta
 	int ret = -1;
 
 	if (copy_from_gpa(vm, &asyncio_info, param2, sizeof(asyncio_info)) == 0) {
-		add_asyncio(target_vm, asyncio_info.type, asyncio_info.addr, asyncio_info.fd);
+		add_asyncio(target_vm, asyncio_info.type, asyncio_info.addr, asyncio_info.len,
+				asyncio_info.fd);
 		ret = 0;
 	}
 	return ret;
@@ -574,36 +741,88 @@ int32_t hcall_asyncio_deassign(__unused struct acrn_vcpu *vcpu, struct acrn_vm *
 }
 
 /**
- * @brief notify request done
- *
- * Notify the requestor VCPU for the completion of an ioreq.
- * The function will return -1 if the target VM does not exist.
- *
- * @param target_vm Pointer to target VM data structure
- * @param param2 vcpu ID of the requestor
+ * @pre is_service_vm(vcpu->vm)
+ */
+int32_t hcall_add_coalesced_mmio(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_coalesced_mmio_zone zone;
+	int32_t ret = -EINVAL;
+
+	if (is_postlaunched_vm(target_vm) &&
+			(copy_from_gpa(vcpu->vm, &zone, param2, sizeof(zone)) == 0)) {
+		ret = add_coalesced_mmio(target_vm, &zone);
+	}
+	return ret;
+}
+
+/**
+ * @pre is_service_vm(vcpu->vm)
+ */
+int32_t hcall_remove_coalesced_mmio(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_coalesced_mmio_zone zone;
+	int32_t ret = -EINVAL;
+
+	if (is_postlaunched_vm(target_vm) &&
+			(copy_from_gpa(vcpu->vm, &zone, param2, sizeof(zone)) == 0)) {
+		ret = remove_coalesced_mmio(target_vm, &zone);
+	}
+	return ret;
+}
+
+/**
+ * @pre is_service_vm(vcpu->vm)
  *
- * @return 0 on success, non-zero on error.
+ * Called on a pCPU of the Service VM with the VMCS of vcpu loaded, the TSC
+ * offset of which turns the TSC of the Service VM into a host one.
  */
-int32_t hcall_notify_ioreq_finish(__unused struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+int32_t hcall_set_tsc_counter(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
 		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_tsc_counter counter;
+	int32_t ret = -EINVAL;
+
+	if (is_postlaunched_vm(target_vm) &&
+			(copy_from_gpa(vcpu->vm, &counter, param2, sizeof(counter)) == 0)) {
+		ret = set_tsc_counter(target_vm, &counter, counter.tsc - exec_vmread64(VMX_TSC_OFFSET_FULL));
+	}
+	return ret;
+}
+
+/**
+ * @pre target_vm != NULL
+ */
+static int32_t notify_ioreq_finish(struct acrn_vm *target_vm, uint64_t vcpu_bitmap, uint16_t first_vcpu_id)
 {
 	struct acrn_vcpu *target_vcpu;
 	int32_t ret = -1;
-	uint16_t vcpu_id = (uint16_t)param2;
+	uint64_t bitmap = vcpu_bitmap;
+	uint16_t vcpu_id;
 
 	/* make sure we have set req_buf */
 	if (is_severity_pass(target_vm->vm_id) &&
 	    (!is_poweroff_vm(target_vm)) && (target_vm->sw.io_shared_page != NULL)) {
-		dev_dbg(DBG_LEVEL_HYCALL, "[%d] NOTIFY_FINISH for vcpu %d",
-			target_vm->vm_id, vcpu_id);
+		dev_dbg(DBG_LEVEL_HYCALL, "[%d] NOTIFY_FINISH for vcpus 0x%lx",
+			target_vm->vm_id, vcpu_bitmap);
 
-		if (vcpu_id >= target_vm->hw.created_vcpus) {
+		if ((vcpu_bitmap == 0UL) || ((target_vm->hw.created_vcpus < 64U) &&
+			((vcpu_bitmap >> target_vm->hw.created_vcpus) != 0UL))) {
 			pr_err("%s, failed to get VCPU %d context from VM %d\n",
-				__func__, vcpu_id, target_vm->vm_id);
+				__func__, first_vcpu_id, target_vm->vm_id);
 		} else {
-			target_vcpu = vcpu_from_vid(target_vm, vcpu_id);
-			if (!target_vcpu->vm->sw.is_polling_ioreq) {
-				signal_event(&target_vcpu->events[VCPU_EVENT_IOREQ]);
+			vcpu_id = ffs64(bitmap);
+			while (vcpu_id < target_vm->hw.created_vcpus) {
+				bitmap_clear_nolock(vcpu_id, &bitmap);
+				target_vcpu = vcpu_from_vid(target_vm, vcpu_id);
+				if (target_vcpu->arch.apf_token != 0U) {
+					/* the vCPU did not wait for it, see pvclock_async_pf() */
+					vcpu_make_request(target_vcpu, ACRN_REQUEST_ASYNC_PF);
+				} else if (!target_vcpu->vm->sw.is_polling_ioreq) {
+					signal_event(&target_vcpu->events[VCPU_EVENT_IOREQ]);
+				}
+				vcpu_id = ffs64(bitmap);
 			}
 			ret = 0;
 		}
@@ -612,6 +831,47 @@ int32_t hcall_notify_ioreq_finish(__unused struct acrn_vcpu *vcpu, struct acrn_v
 	return ret;
 }
 
+/**
+ * @brief notify request done
+ *
+ * Notify the requestor VCPU for the completion of an ioreq.
+ * The function will return -1 if the target VM does not exist.
+ *
+ * @param target_vm Pointer to target VM data structure
+ * @param param2 vcpu ID of the requestor
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_notify_ioreq_finish(__unused struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	uint64_t vcpu_bitmap = 0UL;
+	uint16_t vcpu_id = (uint16_t)param2;
+
+	if (vcpu_id < MAX_VCPUS_PER_VM) {
+		bitmap_set_nolock(vcpu_id, &vcpu_bitmap);
+	}
+
+	return notify_ioreq_finish(target_vm, vcpu_bitmap, vcpu_id);
+}
+
+/**
+ * @brief notify a batch of requests done
+ *
+ * Notify all the requestor VCPUs in the bitmap for the completion of their
+ * ioreqs, so that the Service VM can retire several ioreqs with one hypercall.
+ *
+ * @param target_vm Pointer to target VM data structure
+ * @param param2 bitmap of vcpu IDs of the requestors
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_notify_ioreq_finish_batch(__unused struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	return notify_ioreq_finish(target_vm, param2, ffs64(param2));
+}
+
 /**
  *@pre is_service_vm(vm)
  *@pre gpa2hpa(vm, region->service_vm_gpa) != INVALID_HPA
@@ -619,7 +879,7 @@ int32_t hcall_notify_ioreq_finish(__unused struct acrn_vcpu *vcpu, struct acrn_v
 static void add_vm_memory_region(struct acrn_vm *vm, struct acrn_vm *target_vm,
 				const struct vm_memory_region *region,uint64_t *pml4_page)
 {
-	uint64_t prot = 0UL, base_paddr;
+	uint64_t prot = 0UL;
 	uint64_t hpa = gpa2hpa(vm, region->service_vm_gpa);
 
 	/* access right */
@@ -651,12 +911,8 @@ static void add_vm_memory_region(struct acrn_vm *vm, struct acrn_vm *target_vm,
 	 * TODO: We can enforce WB for any region has overlap with Software SRAM, for simplicity,
 	 * and leave it to Service VM to make sure it won't violate.
 	 */
-	if (is_software_sram_enabled()) {
-		base_paddr = get_software_sram_base();
-		if ((hpa >= base_paddr) &&
-			((hpa + region->size) <= (base_paddr + get_software_sram_size()))) {
-			prot |= EPT_WB;
-		}
+	if (is_software_sram_range(hpa, region->size)) {
+		prot |= EPT_WB;
 	}
 
 	/* create gpa to hpa EPT mapping */
@@ -677,12 +933,21 @@ static int32_t set_vm_memory_region(struct acrn_vm *vm,
 		if (region->type == MR_ADD) {
 			/* if the GPA range is Service VM valid GPA or not */
 			if (ept_is_valid_mr(vm, region->service_vm_gpa, region->size)) {
-				/* FIXME: how to filter the alias mapping ? */
-				add_vm_memory_region(vm, target_vm, region, pml4_page);
-				ret = 0;
+				/* Software SRAM is only mapped within the share of the VM */
+				if (!is_software_sram_range(gpa2hpa(vm, region->service_vm_gpa), region->size) ||
+						get_ssram_share(target_vm->vm_id, region->size)) {
+					/* FIXME: how to filter the alias mapping ? */
+					add_vm_memory_region(vm, target_vm, region, pml4_page);
+					ret = 0;
+				} else {
+					ret = -ENOMEM;
+				}
 			}
 		} else {
 			if (ept_is_valid_mr(target_vm, region->gpa, region->size)) {
+				if (is_software_sram_range(gpa2hpa(target_vm, region->gpa), region->size)) {
+					put_ssram_share(target_vm->vm_id, region->size);
+				}
 				ept_del_mr(target_vm, pml4_page, region->gpa, region->size);
 				ret = 0;
 			}
@@ -721,6 +986,7 @@ int32_t hcall_set_vm_memory_regions(struct acrn_vcpu *vcpu, struct acrn_vm *targ
 		if (!is_poweroff_vm(target_vm) &&
 		    (is_severity_pass(target_vm->vm_id) || (target_vm->state != VM_RUNNING))) {
 			idx = 0U;
+			ept_begin_batch(target_vm);
 			while (idx < regions.mr_num) {
 				if (copy_from_gpa(vm, &mr, regions.regions_gpa + idx * sizeof(mr), sizeof(mr)) != 0) {
 					pr_err("%s: Copy mr entry fail from vm\n", __func__);
@@ -733,6 +999,7 @@ int32_t hcall_set_vm_memory_regions(struct acrn_vcpu *vcpu, struct acrn_vm *targ
 				}
 				idx++;
 			}
+			ept_end_batch(target_vm);
 		} else {
 			pr_err("%p %s:target_vm is invalid or Targeting to service vm", target_vm, __func__);
 		}
@@ -816,6 +1083,86 @@ int32_t hcall_write_protect_page(struct acrn_vcpu *vcpu, struct acrn_vm *target_
 	return ret;
 }
 
+/* the pages whose bits HC_VM_GET_DIRTY_LOG collects at once */
+#define DIRTY_LOG_CHUNK_PAGES	4096UL
+
+/**
+ * @brief get and clear the dirty log of a guest memory range
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param2 guest physical address. This gpa points to
+ *              struct acrn_dirty_log
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_get_dirty_log(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_dirty_log log;
+	uint64_t bitmap[DIRTY_LOG_CHUNK_PAGES / 64UL];
+	uint64_t pages, idx, n, flag;
+	int32_t ret = -EINVAL;
+
+	if (!is_poweroff_vm(target_vm) && is_ept_ad_enabled(target_vm) &&
+			(copy_from_gpa(vm, &log, param2, sizeof(log)) == 0)) {
+		if (mem_aligned_check(log.gpa, PAGE_SIZE) && mem_aligned_check(log.size, PAGE_SIZE) &&
+				((log.flags & ~ACRN_DIRTY_LOG_ACCESSED) == 0U) &&
+				ept_is_valid_mr(target_vm, log.gpa, log.size)) {
+			flag = ((log.flags & ACRN_DIRTY_LOG_ACCESSED) != 0U) ? EPT_ACCESSED : EPT_DIRTY;
+			pages = log.size >> PAGE_SHIFT;
+			ret = 0;
+
+			/* flush the whole range once */
+			ept_begin_batch(target_vm);
+			for (idx = 0UL; (idx < pages) && (ret == 0); idx += n) {
+				n = min(pages - idx, DIRTY_LOG_CHUNK_PAGES);
+				(void)memset(bitmap, 0U, sizeof(bitmap));
+				ept_clear_access_log(target_vm, log.gpa + (idx << PAGE_SHIFT), n, flag, bitmap);
+				ret = copy_to_gpa(vm, bitmap, log.bitmap_gpa + (idx >> 3U), (uint32_t)((n + 7UL) >> 3U));
+			}
+			ept_end_batch(target_vm);
+		} else {
+			pr_err("%s: invalid range 0x%lx size 0x%lx or flags 0x%x", __func__, log.gpa, log.size, log.flags);
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @pre is_service_vm(vcpu->vm)
+ */
+int32_t hcall_set_lazy_memory(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_lazy_memory lazy_mem;
+	uint32_t i;
+	int32_t ret = -EINVAL;
+
+	if (is_postlaunched_vm(target_vm) && !is_poweroff_vm(target_vm) &&
+			(copy_from_gpa(vcpu->vm, &lazy_mem, param2, sizeof(lazy_mem)) == 0)) {
+		ret = 0;
+		for (i = 0U; i < ACRN_LAZY_MEMORY_RANGES; i++) {
+			if (!mem_aligned_check(lazy_mem.gpa[i], PAGE_SIZE) ||
+					!mem_aligned_check(lazy_mem.size[i], PAGE_SIZE) ||
+					((lazy_mem.gpa[i] + lazy_mem.size[i]) < lazy_mem.gpa[i])) {
+				pr_err("%s: invalid range 0x%lx size 0x%lx", __func__, lazy_mem.gpa[i], lazy_mem.size[i]);
+				ret = -EINVAL;
+			}
+		}
+
+		if (ret == 0) {
+			/* set with the guest memory, before the guest enables the asynchronous page faults */
+			target_vm->lazy_mem = lazy_mem;
+		}
+	}
+
+	return ret;
+}
+
 /**
  * @brief translate guest physical address to host physical address
  *
@@ -1089,6 +1436,31 @@ static bool is_pt_pstate(__unused const struct acrn_vm *vm)
 	return false;
 }
 
+/**
+ * @brief Set the frequency policy of a VM.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param2 guest physical address. This gpa points to
+ *              struct acrn_vm_freq_policy
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_vm_freq_policy(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm_freq_policy policy;
+	int32_t ret = -EINVAL;
+
+	if (!is_poweroff_vm(target_vm) &&
+			(copy_from_gpa(vcpu->vm, &policy, param2, sizeof(policy)) == 0)) {
+		ret = set_vm_freq_policy(target_vm, &policy);
+	}
+
+	return ret;
+}
+
 /**
  * @brief Get VCPU Power state.
  *
@@ -1235,14 +1607,335 @@ int32_t hcall_vm_intr_monitor(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
 }
 
 /**
- * @brief set upcall notifier vector
- *
- * This is the API that helps to switch the notifer vecotr. If this API is
- * not called, the hypervisor will use the default notifier vector(0xF3)
- * to notify the Service VM kernel.
+ * @brief Get the scheduling statistics of a vCPU.
  *
  * @param vcpu Pointer to vCPU that initiates the hypercall
- * @param param1 the expected notifier vector from guest
+ * @param target_vm Pointer to target VM data structure
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vcpu_sched_stats
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_get_vcpu_sched_stats(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_vcpu_sched_stats vstats;
+	struct sched_stats stats;
+	struct acrn_vcpu *target_vcpu;
+	int32_t ret = -EINVAL;
+
+	if (!is_poweroff_vm(target_vm) && (copy_from_gpa(vm, &vstats, param2, sizeof(vstats)) == 0) &&
+			(vstats.vcpu_id < target_vm->hw.created_vcpus)) {
+		target_vcpu = vcpu_from_vid(target_vm, vstats.vcpu_id);
+		sched_get_stats(&target_vcpu->thread_obj, &stats);
+
+		vstats.pcpu_id = pcpuid_from_vcpu(target_vcpu);
+		vstats.tsc_khz = get_tsc_khz();
+		vstats.run_ticks = stats.run_ticks;
+		vstats.wait_ticks = stats.wait_ticks;
+		vstats.nr_switches = stats.nr_switches;
+		(void)memcpy_s(vstats.wakeup_lat, sizeof(vstats.wakeup_lat), stats.wakeup_lat, sizeof(stats.wakeup_lat));
+
+		ret = copy_to_gpa(vm, &vstats, param2, sizeof(vstats));
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Get the VM exit statistics of a vCPU.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vcpu_exit_stats
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_get_vcpu_exit_stats(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_vcpu *target_vcpu;
+	uint16_t vcpu_id;
+	uint64_t tsc_khz = get_tsc_khz();
+	int32_t ret = -EINVAL;
+
+	/* the statistics are copied straight from the vCPU, they are too large for the stack */
+	if (!is_poweroff_vm(target_vm) && (copy_from_gpa(vm, &vcpu_id, param2, sizeof(vcpu_id)) == 0) &&
+			(vcpu_id < target_vm->hw.created_vcpus)) {
+		target_vcpu = vcpu_from_vid(target_vm, vcpu_id);
+
+		ret = copy_to_gpa(vm, &tsc_khz, param2 + offsetof(struct acrn_vcpu_exit_stats, tsc_khz),
+				sizeof(tsc_khz));
+		if (ret == 0) {
+			ret = copy_to_gpa(vm, target_vcpu->exit_stats,
+					param2 + offsetof(struct acrn_vcpu_exit_stats, reason),
+					sizeof(target_vcpu->exit_stats));
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Get the utilization counters of all the pCPUs and vCPUs.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param param1 guest physical address. This gpa points to data structure of
+ *              acrn_cpu_util
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_get_cpu_util(struct acrn_vcpu *vcpu, __unused struct acrn_vm *target_vm,
+		uint64_t param1, __unused uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_pcpu_util putil;
+	struct acrn_vcpu_util vutil;
+	struct acrn_vm *uvm;
+	struct acrn_vcpu *uvcpu;
+	uint16_t i, idx, nr_pcpus, nr_vcpus = 0U;
+	uint64_t tsc_khz = get_tsc_khz();
+	uint64_t tsc = cpu_ticks();
+	int32_t ret = 0;
+
+	/* entry by entry, the whole of it is too large for the stack */
+	nr_pcpus = min(get_pcpu_nums(), (uint16_t)ACRN_UTIL_MAX_PCPUS);
+	for (i = 0U; (i < nr_pcpus) && (ret == 0); i++) {
+		get_pcpu_util(i, &putil);
+		ret = copy_to_gpa(vm, &putil, param1 + offsetof(struct acrn_cpu_util, pcpu) +
+				(i * sizeof(putil)), sizeof(putil));
+	}
+
+	for (idx = 0U; (idx < CONFIG_MAX_VM_NUM) && (ret == 0); idx++) {
+		uvm = get_vm_from_vmid(idx);
+		if (is_poweroff_vm(uvm)) {
+			continue;
+		}
+		foreach_vcpu(i, uvm, uvcpu) {
+			if ((nr_vcpus >= ACRN_UTIL_MAX_VCPUS) || (ret != 0)) {
+				break;
+			}
+			get_vcpu_util(uvcpu, &vutil);
+			ret = copy_to_gpa(vm, &vutil, param1 + offsetof(struct acrn_cpu_util, vcpu) +
+					(nr_vcpus * sizeof(vutil)), sizeof(vutil));
+			nr_vcpus++;
+		}
+	}
+
+	if (ret == 0) {
+		ret = copy_to_gpa(vm, &nr_pcpus, param1 + offsetof(struct acrn_cpu_util, nr_pcpus),
+				sizeof(nr_pcpus));
+	}
+	if (ret == 0) {
+		ret = copy_to_gpa(vm, &nr_vcpus, param1 + offsetof(struct acrn_cpu_util, nr_vcpus),
+				sizeof(nr_vcpus));
+	}
+	if (ret == 0) {
+		ret = copy_to_gpa(vm, &tsc_khz, param1 + offsetof(struct acrn_cpu_util, tsc_khz),
+				sizeof(tsc_khz));
+	}
+	if (ret == 0) {
+		ret = copy_to_gpa(vm, &tsc, param1 + offsetof(struct acrn_cpu_util, tsc), sizeof(tsc));
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Get the I/O hotspots of a VM.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vm_io_hotspots
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_get_vm_io_hotspots(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_vm_io_hotspots hotspots;
+	uint32_t reset;
+	int32_t ret = -EINVAL;
+
+	if (!is_poweroff_vm(target_vm) && (copy_from_gpa(vm, &reset, param2, sizeof(reset)) == 0)) {
+		io_hotspot_get(&target_vm->io_hotspots, &hotspots, (reset != 0U));
+		hotspots.reset = reset;
+		ret = copy_to_gpa(vm, &hotspots, param2, sizeof(hotspots));
+	}
+
+	return ret;
+}
+
+/* a vCPU state is too big for the stack, the snapshot hypercalls share one */
+static struct acrn_vcpu_state vcpu_state_buf;
+static spinlock_t vcpu_state_lock = { .head = 0U, .tail = 0U };
+
+static bool is_snapshot_capable(const struct acrn_vm *target_vm)
+{
+	return is_postlaunched_vm(target_vm) && !is_lapic_pt_configured(target_vm) &&
+		(target_vm->sworld_control.flag.supported == 0UL);
+}
+
+/**
+ * @brief Get the state of a vCPU of a paused VM.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vcpu_state, with its vcpu_id filled in
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_get_vcpu_state(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	uint16_t vcpu_id;
+	int32_t ret = -EINVAL;
+
+	if (is_paused_vm(target_vm) && is_snapshot_capable(target_vm) &&
+			(copy_from_gpa(vm, &vcpu_id, param2, sizeof(vcpu_id)) == 0) &&
+			(vcpu_id < target_vm->hw.created_vcpus)) {
+		spinlock_obtain(&vcpu_state_lock);
+		get_vcpu_state(vcpu_from_vid(target_vm, vcpu_id), &vcpu_state_buf);
+		ret = copy_to_gpa(vm, &vcpu_state_buf, param2, sizeof(vcpu_state_buf));
+		spinlock_release(&vcpu_state_lock);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Load the state of a vCPU of a VM not started yet.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vcpu_state
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_vcpu_state(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_vcpu *target_vcpu;
+	int32_t ret = -EINVAL;
+
+	if (is_created_vm(target_vm) && is_snapshot_capable(target_vm)) {
+		spinlock_obtain(&vcpu_state_lock);
+		if ((copy_from_gpa(vm, &vcpu_state_buf, param2, sizeof(vcpu_state_buf)) == 0) &&
+				(vcpu_state_buf.vcpu_id < target_vm->hw.created_vcpus)) {
+			target_vcpu = vcpu_from_vid(target_vm, vcpu_state_buf.vcpu_id);
+			if (!target_vcpu->launched && is_valid_cr0_cr4(vcpu_state_buf.cr0, vcpu_state_buf.cr4)) {
+				ret = set_vcpu_state(target_vcpu, &vcpu_state_buf);
+			}
+		}
+		spinlock_release(&vcpu_state_lock);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Get the vIOAPIC state of a paused VM.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vioapic_state
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_get_vioapic_state(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vioapic_state state;
+	int32_t ret = -EINVAL;
+
+	if (is_paused_vm(target_vm) && is_snapshot_capable(target_vm)) {
+		(void)memset(&state, 0U, sizeof(state));
+		vioapic_get_state(target_vm, &state);
+		ret = copy_to_gpa(vcpu->vm, &state, param2, sizeof(state));
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Load the vIOAPIC state of a VM not started yet.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vioapic_state
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_vioapic_state(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vioapic_state state;
+	int32_t ret = -EINVAL;
+
+	if (is_created_vm(target_vm) && is_snapshot_capable(target_vm) &&
+			(copy_from_gpa(vcpu->vm, &state, param2, sizeof(state)) == 0)) {
+		ret = vioapic_set_state(target_vm, &state);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Start, stop or read the latency probe of a VM.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vm_latency
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_vm_latency_probe(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_vm_latency lat;
+	int32_t ret = -EINVAL;
+
+	if (!is_poweroff_vm(target_vm) &&
+			(copy_from_gpa(vm, &lat.cmd, param2, sizeof(lat.cmd)) == 0) &&
+			(lat.cmd <= ACRN_LAT_CMD_STOP)) {
+		lat_probe_ctl(&target_vm->lat_probe, &lat);
+		ret = copy_to_gpa(vm, &lat, param2, sizeof(lat));
+	}
+
+	return ret;
+}
+
+/**
+ * @brief set upcall notifier vector
+ *
+ * This is the API that helps to switch the notifer vecotr. If this API is
+ * not called, the hypervisor will use the default notifier vector(0xF3)
+ * to notify the Service VM kernel.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param param1 the expected notifier vector from guest
  *
  * @pre is_service_vm(vcpu->vm)
  * @return 0 on success, non-zero on error.
@@ -1263,6 +1956,94 @@ int32_t hcall_set_callback_vector(__unused struct acrn_vcpu *vcpu, __unused stru
 	return ret;
 }
 
+/**
+ * @brief register the hypercall argument page of a Service VM vCPU
+ *
+ * @param vcpu the vCPU the page is for, the caller
+ * @param target_vm not used
+ * @param param1 page aligned GPA of the page, 0 to unregister it
+ * @param param2 not used
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_hcall_args_page(struct acrn_vcpu *vcpu, __unused struct acrn_vm *target_vm,
+		uint64_t param1, __unused uint64_t param2)
+{
+	void *hva = NULL;
+	int32_t ret = -EINVAL;
+
+	if (param1 == 0UL) {
+		ret = 0;
+	} else if ((param1 & ~PAGE_MASK) == 0UL) {
+		hva = gpa2hva(vcpu->vm, param1);
+		if (hva != NULL) {
+			ret = 0;
+		}
+	} else {
+		/* not page aligned */
+	}
+
+	if (ret == 0) {
+		vcpu->arch.hcall_args_gpa = param1;
+		vcpu->arch.hcall_args = hva;
+	} else {
+		pr_err("%s: vcpu%d invalid argument page 0x%lx", __func__, vcpu->vcpu_id, param1);
+	}
+
+	return ret;
+}
+
+/*
+ * The HVA of [gpa, gpa + size) in the argument page of the vCPU, NULL if the
+ * range is not all in it. The GPA of the page was translated once at its
+ * registration, the Service VM memory is not remapped while it runs.
+ */
+static void *hcall_args_hva(const struct acrn_vcpu *vcpu, uint64_t gpa, uint32_t size)
+{
+	uint64_t offset = gpa - vcpu->arch.hcall_args_gpa;
+	void *hva = NULL;
+
+	if ((vcpu->arch.hcall_args != NULL) && (gpa >= vcpu->arch.hcall_args_gpa) &&
+			(offset < PAGE_SIZE) && ((uint64_t)size <= (PAGE_SIZE - offset))) {
+		hva = (void *)((uint8_t *)vcpu->arch.hcall_args + offset);
+	}
+
+	return hva;
+}
+
+int32_t copy_hcall_arg(struct acrn_vcpu *vcpu, void *h_ptr, uint64_t gpa, uint32_t size)
+{
+	void *hva = hcall_args_hva(vcpu, gpa, size);
+	int32_t ret = 0;
+
+	if (hva != NULL) {
+		stac();
+		(void)memcpy_s(h_ptr, size, hva, size);
+		clac();
+	} else {
+		ret = copy_from_gpa(vcpu->vm, h_ptr, gpa, size);
+	}
+
+	return ret;
+}
+
+int32_t copy_hcall_result(struct acrn_vcpu *vcpu, void *h_ptr, uint64_t gpa, uint32_t size)
+{
+	void *hva = hcall_args_hva(vcpu, gpa, size);
+	int32_t ret = 0;
+
+	if (hva != NULL) {
+		stac();
+		(void)memcpy_s(hva, size, h_ptr, size);
+		clac();
+	} else {
+		ret = copy_to_gpa(vcpu->vm, h_ptr, gpa, size);
+	}
+
+	return ret;
+}
+
 /*
  * @pre dev != NULL
  */
@@ -1357,3 +2138,57 @@ int32_t hcall_remove_vdev(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, __u
 	}
 	return ret;
 }
+
+/**
+ * @brief Shadow the configuration space of a PCI device emulated by ACRN-DM.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vdev_cfg_shadow
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_add_vdev_cfg_shadow(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	int32_t ret = -EINVAL;
+	struct acrn_vdev_cfg_shadow shadow;
+
+	if (is_postlaunched_vm(target_vm) && (is_created_vm(target_vm) || is_paused_vm(target_vm))) {
+		if (copy_from_gpa(vm, &shadow, param2, sizeof(shadow)) == 0) {
+			ret = vpci_add_cfg_shadow(&target_vm->vpci, &shadow);
+		}
+	} else {
+		pr_err("%s, vm[%d] is not a postlaunched VM, or not in CREATED/PAUSED status\n", __func__, target_vm->vm_id);
+	}
+	return ret;
+}
+
+/**
+ * @brief Stop shadowing the configuration space of a PCI device emulated by ACRN-DM.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vdev_cfg_shadow, only its bdf is used
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_remove_vdev_cfg_shadow(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	int32_t ret = -EINVAL;
+	uint16_t bdf;
+
+	if (is_postlaunched_vm(target_vm)) {
+		if (copy_from_gpa(vm, &bdf, param2 + offsetof(struct acrn_vdev_cfg_shadow, bdf), sizeof(bdf)) == 0) {
+			ret = vpci_remove_cfg_shadow(&target_vm->vpci, bdf);
+		}
+	}
+	return ret;
+}
@@ -116,30 +116,39 @@ static void ptirq_intr_delay_callback(void *data)
 	ptirq_enqueue_softirq(entry);
 }
 
-struct ptirq_remapping_info *ptirq_dequeue_softirq(uint16_t pcpu_id)
+/*
+ * The queue is only touched by its own pCPU, so it is enough to have the
+ * interrupts off around it. Taking up to max entries per such section
+ * instead of one keeps the number of those sections low under a burst of
+ * interrupts, while still bounding how long the interrupts stay off.
+ */
+uint32_t ptirq_dequeue_softirq(uint16_t pcpu_id, struct ptirq_remapping_info **entries, uint32_t max)
 {
 	uint64_t rflags;
-	struct ptirq_remapping_info *entry = NULL;
+	struct list_head *queue = &per_cpu(softirq_dev_entry_list, pcpu_id);
+	struct ptirq_remapping_info *entry;
+	uint64_t now = cpu_ticks();
+	uint32_t count = 0U;
 
 	CPU_INT_ALL_DISABLE(&rflags);
 
-	while (!list_empty(&get_cpu_var(softirq_dev_entry_list))) {
-		entry = get_first_item(&per_cpu(softirq_dev_entry_list, pcpu_id), struct ptirq_remapping_info, softirq_node);
+	while ((count < max) && !list_empty(queue)) {
+		entry = get_first_item(queue, struct ptirq_remapping_info, softirq_node);
 
 		list_del_init(&entry->softirq_node);
 
 		/* if Service VM, just dequeue, if User VM, check delay timer */
-		if (is_service_vm(entry->vm) || timer_expired(&entry->intr_delay_timer, cpu_ticks(), NULL)) {
-			break;
+		if (is_service_vm(entry->vm) || timer_expired(&entry->intr_delay_timer, now, NULL)) {
+			entries[count] = entry;
+			count++;
 		} else {
 			/* add it into timer list; dequeue next one */
 			(void)add_timer(&entry->intr_delay_timer);
-			entry = NULL;
 		}
 	}
 
 	CPU_INT_ALL_RESTORE(rflags);
-	return entry;
+	return count;
 }
 
 struct ptirq_remapping_info *ptirq_alloc_entry(struct acrn_vm *vm, uint32_t intr_type)
@@ -188,6 +197,11 @@ static void ptirq_interrupt_handler(__unused uint32_t irq, void *data)
 	struct ptirq_remapping_info *entry = (struct ptirq_remapping_info *) data;
 	bool to_enqueue = true;
 
+	/* the latency is measured from the first interrupt the injection is for */
+	if (lat_probe_enabled(&entry->vm->lat_probe) && (entry->intr_tsc == 0UL)) {
+		entry->intr_tsc = get_cpu_var(irq_tsc);
+	}
+
 	/*
 	 * "interrupt storm" detection & delay intr injection just for User VM
 	 * pass-thru devices, collect its data and delay injection if needed
@@ -287,21 +301,22 @@ void ptdev_release_all_entries(const struct acrn_vm *vm)
 uint32_t ptirq_get_intr_data(const struct acrn_vm *target_vm, uint64_t *buffer, uint32_t buffer_cnt)
 {
 	uint32_t index = 0U;
-	uint16_t i;
+	uint16_t i, bit;
+	uint64_t mask;
 	struct ptirq_remapping_info *entry;
 
-	for (i = 0U; i < CONFIG_MAX_PT_IRQ_ENTRIES; i++) {
-		entry = &ptirq_entries[i];
-		if (!is_entry_active(entry) || (entry->allocated_pirq == IRQ_INVALID)) {
-			continue;
-		}
-		if (entry->vm == target_vm) {
-			buffer[index] = entry->allocated_pirq;
-			buffer[index + 1U] = entry->intr_count;
-
-			index += 2U;
-			if (index > (buffer_cnt - 2U)) {
-				break;
+	/* only visit the allocated entries, the table is mostly empty */
+	for (i = 0U; (i < PTIRQ_BITMAP_ARRAY_SIZE) && ((index + 2U) <= buffer_cnt); i++) {
+		mask = ptirq_entry_bitmaps[i];
+		while ((mask != 0UL) && ((index + 2U) <= buffer_cnt)) {
+			bit = ffs64(mask);
+			bitmap_clear_nolock(bit, &mask);
+			entry = &ptirq_entries[(i << 6U) + bit];
+			if (is_entry_active(entry) && (entry->allocated_pirq != IRQ_INVALID) &&
+					(entry->vm == target_vm)) {
+				buffer[index] = entry->allocated_pirq;
+				buffer[index + 1U] = entry->intr_count;
+				index += 2U;
 			}
 		}
 	}
@@ -15,6 +15,8 @@
 #include <asm/cpu.h>
 #include <asm/per_cpu.h>
 #include <vm_event.h>
+#include <softirq.h>
+#include <sbuf.h>
 
 uint32_t sbuf_next_ptr(uint32_t pos_arg,
 		uint32_t span, uint32_t scope)
@@ -25,6 +27,35 @@ uint32_t sbuf_next_ptr(uint32_t pos_arg,
 	return pos;
 }
 
+/*
+ * The notification is sent from the softirq, as sbuf_put() may be called
+ * from anywhere in the hypervisor, e.g. with the vLAPIC lock held to trace.
+ */
+static void sbuf_notify_softirq(__unused uint16_t pcpu_id)
+{
+	arch_fire_hsm_interrupt();
+}
+
+void sbuf_notify_init(void)
+{
+	register_softirq(SOFTIRQ_SBUF, sbuf_notify_softirq);
+}
+
+/*
+ * Notify the consumer once, when the bytes buffered reach the watermark it
+ * asked for, and not for each of the puts above it.
+ */
+static void sbuf_check_watermark(const struct shared_buf *sbuf, uint32_t tail, uint32_t len)
+{
+	uint32_t head = sbuf->head;
+	uint32_t used;
+
+	used = (tail >= head) ? (tail - head) : ((sbuf->size - head) + tail);
+	if ((used >= sbuf->watermark) && ((used - len) < sbuf->watermark)) {
+		fire_softirq(SOFTIRQ_SBUF);
+	}
+}
+
 /**
  * The high caller should guarantee each time there must have
  * sbuf->ele_size data can be write form data and this function
@@ -74,12 +105,62 @@ uint32_t sbuf_put(struct shared_buf *sbuf, uint8_t *data)
 		}
 		sbuf->tail = next_tail;
 		ele_size = sbuf->ele_size;
+
+		if ((sbuf->flags & WATERMARK_NOTIFY_EN) != 0U) {
+			sbuf_check_watermark(sbuf, next_tail, ele_size);
+		}
 	}
 	clac();
 
 	return ele_size;
 }
 
+/**
+ * Put a record of len bytes in a sbuf with VARLEN_EN, whose data are a
+ * stream of bytes and not ele_size elements. The record is put whole or not
+ * at all: there is no overwrite, a record that does not fit is dropped and
+ * counted as an overrun.
+ *
+ * At most size - 1 bytes are buffered, head == tail still means empty.
+ *
+ * return:
+ * len:	write succeeded.
+ * 0:	no write, not enough room.
+ */
+uint32_t sbuf_put_bytes(struct shared_buf *sbuf, const uint8_t *data, uint32_t len)
+{
+	uint8_t *base = (uint8_t *)sbuf + SBUF_HEAD_SIZE;
+	uint32_t head, tail, room, first;
+	uint32_t ret = 0U;
+
+	stac();
+	head = sbuf->head;
+	tail = sbuf->tail;
+	room = (head > tail) ? (head - tail - 1U) : ((sbuf->size - tail) + head - 1U);
+
+	if (len > room) {
+		sbuf->overrun_cnt += sbuf->flags & OVERRUN_CNT_EN;
+	} else {
+		first = min(len, sbuf->size - tail);
+		(void)memcpy_s(base + tail, first, data, first);
+		if (first < len) {
+			(void)memcpy_s(base, len - first, data + first, len - first);
+		}
+		/* make sure write data before update tail */
+		cpu_write_memory_barrier();
+
+		sbuf->tail = sbuf_next_ptr(tail, len, sbuf->size);
+		ret = len;
+
+		if ((sbuf->flags & WATERMARK_NOTIFY_EN) != 0U) {
+			sbuf_check_watermark(sbuf, sbuf->tail, len);
+		}
+	}
+	clac();
+
+	return ret;
+}
+
 int32_t sbuf_setup_common(struct acrn_vm *vm, uint16_t cpu_id, uint32_t sbuf_id, uint64_t *hva)
 {
 	int32_t ret = 0;
@@ -97,6 +178,9 @@ int32_t sbuf_setup_common(struct acrn_vm *vm, uint16_t cpu_id, uint32_t sbuf_id,
 		case ACRN_VM_EVENT:
 			ret = init_vm_event(vm, hva);
 			break;
+		case ACRN_COALESCED_MMIO:
+			ret = init_coalesced_mmio(vm, hva);
+			break;
 		default:
 			pr_err("%s not support sbuf_id %d", __func__, sbuf_id);
 			ret = -1;
@@ -187,7 +187,7 @@ static int sched_bvt_init(struct sched_control *ctl)
 	ctl->priv = bvt_ctl;
 	INIT_LIST_HEAD(&bvt_ctl->runqueue);
 
-	/* The tick_timer is periodically */
+	/* The tick_timer is one-shot, armed by sched_bvt_pick_next() */
 	initialize_timer(&bvt_ctl->tick_timer, sched_tick_handler, ctl, 0, 0);
 
 	return ret;
@@ -309,6 +309,11 @@ static void sched_bvt_sleep(struct thread_object *obj)
 	runqueue_remove(obj);
 }
 
+/*
+ * The tick is re-armed by sched_bvt_pick_next() on the reschedule request that
+ * wake_thread() makes on the pCPU of the thread, with the run_countdown of the
+ * new runqueue.
+ */
 static void sched_bvt_wake(struct thread_object *obj)
 {
 	struct sched_bvt_data *data;
@@ -326,6 +331,46 @@ static void sched_bvt_wake(struct thread_object *obj)
 
 }
 
+/*
+ * Warp the thread just ahead of the current one. Only its evt is changed, so
+ * it is still charged in avt for the time it runs and update_vt() ends the
+ * warp once it is switched out.
+ */
+static void sched_bvt_boost(struct thread_object *obj)
+{
+	struct sched_bvt_data *data = (struct sched_bvt_data *)obj->data;
+	struct thread_object *current = obj->sched_ctl->curr_obj;
+	int64_t evt;
+
+	if ((current != NULL) && !is_idle_thread(current)) {
+		evt = ((struct sched_bvt_data *)current->data)->evt - 1;
+		if (data->evt > evt) {
+			data->evt = evt;
+			runqueue_remove(obj);
+			runqueue_add(obj);
+		}
+	}
+}
+
+/*
+ * Walk the runqueue from its tail, the thread that would wait the longest
+ * here is the one that gains the most from being moved.
+ */
+static struct thread_object *sched_bvt_pick_migration(struct sched_control *ctl, uint16_t pcpu_id)
+{
+	struct sched_bvt_control *bvt_ctl = (struct sched_bvt_control *)ctl->priv;
+	struct thread_object *obj = NULL;
+	struct list_head *pos;
+
+	for (pos = bvt_ctl->runqueue.prev; (pos != &bvt_ctl->runqueue) && (obj == NULL); pos = pos->prev) {
+		if (sched_can_migrate(container_of(pos, struct thread_object, data), pcpu_id)) {
+			obj = container_of(pos, struct thread_object, data);
+		}
+	}
+
+	return obj;
+}
+
 struct acrn_scheduler sched_bvt = {
 	.name		= "sched_bvt",
 	.init		= sched_bvt_init,
@@ -333,5 +378,7 @@ struct acrn_scheduler sched_bvt = {
 	.pick_next	= sched_bvt_pick_next,
 	.sleep		= sched_bvt_sleep,
 	.wake		= sched_bvt_wake,
+	.boost		= sched_bvt_boost,
+	.pick_migration	= sched_bvt_pick_migration,
 	.deinit		= sched_bvt_deinit,
 };
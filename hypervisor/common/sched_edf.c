@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <list.h>
+#include <asm/per_cpu.h>
+#include <schedule.h>
+#include <ticks.h>
+
+/*
+ * Earliest Deadline First with hard reservations: a thread with a budget may
+ * run for that long in each of its periods and, among those with budget left,
+ * the one whose period ends first runs. A thread that used up its budget is
+ * throttled until its next period starts. Threads without a budget run
+ * round-robin in the time the reservations leave over.
+ */
+
+/* time slice of the threads without a reservation */
+#define EDF_SLICE_MS		10U
+
+struct sched_edf_data {
+	/* keep list as the first item */
+	struct list_head list;
+	/* run time per period in cycles, 0 if the thread has no reservation */
+	uint64_t budget;
+	uint64_t period;
+	/* end of the current period */
+	uint64_t deadline;
+	/* budget, or time slice if there is no reservation, left */
+	uint64_t left;
+
+	uint64_t start_tsc;
+};
+
+static inline bool is_reserved(const struct sched_edf_data *data)
+{
+	return (data->budget != 0UL);
+}
+
+/*
+ * @pre obj != NULL
+ * @pre obj->data != NULL
+ */
+static bool is_inqueue(struct thread_object *obj)
+{
+	struct sched_edf_data *data = (struct sched_edf_data *)obj->data;
+	return !list_empty(&data->list);
+}
+
+static void sched_edf_tick_handler(void *param)
+{
+	struct sched_control *ctl = (struct sched_control *)param;
+
+	make_reschedule_request(ctl->pcpu_id);
+}
+
+/*
+ *@pre: ctl->pcpu_id == get_pcpu_id()
+ */
+static int sched_edf_init(struct sched_control *ctl)
+{
+	struct sched_edf_control *edf_ctl = &per_cpu(sched_edf_ctl, ctl->pcpu_id);
+
+	ASSERT(ctl->pcpu_id == get_pcpu_id(), "Init scheduler on wrong CPU!");
+
+	ctl->priv = edf_ctl;
+	INIT_LIST_HEAD(&edf_ctl->runqueue);
+
+	/* The tick_timer is one-shot, armed by sched_edf_pick_next() at the next budget or period end */
+	initialize_timer(&edf_ctl->tick_timer, sched_edf_tick_handler, ctl, 0, 0);
+
+	return 0;
+}
+
+static void sched_edf_deinit(struct sched_control *ctl)
+{
+	struct sched_edf_control *edf_ctl = (struct sched_edf_control *)ctl->priv;
+	del_timer(&edf_ctl->tick_timer);
+}
+
+static void sched_edf_init_data(struct thread_object *obj, struct sched_params *params)
+{
+	struct sched_edf_data *data;
+
+	data = (struct sched_edf_data *)obj->data;
+	INIT_LIST_HEAD(&data->list);
+	if ((params->edf_budget_us != 0U) && (params->edf_period_us != 0U)) {
+		data->period = us_to_ticks(params->edf_period_us);
+		data->budget = us_to_ticks(min(params->edf_budget_us, params->edf_period_us));
+		data->left = data->budget;
+	} else {
+		data->period = 0UL;
+		data->budget = 0UL;
+		data->left = EDF_SLICE_MS * TICKS_PER_MS;
+	}
+	/* the first period starts at the first wakeup */
+	data->deadline = 0UL;
+	data->start_tsc = 0UL;
+}
+
+/*
+ * Start the period now is in, skipping the ones the thread was blocked or
+ * throttled for.
+ *
+ * @pre is_reserved(data) && now >= data->deadline
+ */
+static void replenish(struct sched_edf_data *data, uint64_t now)
+{
+	data->deadline += (((now - data->deadline) / data->period) + 1UL) * data->period;
+	data->left = data->budget;
+}
+
+/* Charge the time obj ran since it was picked */
+static void charge(struct thread_object *obj, uint64_t now)
+{
+	struct sched_edf_control *edf_ctl = (struct sched_edf_control *)obj->sched_ctl->priv;
+	struct sched_edf_data *data = (struct sched_edf_data *)obj->data;
+	uint64_t ran = now - data->start_tsc;
+
+	data->left = (ran < data->left) ? (data->left - ran) : 0UL;
+	if (!is_reserved(data) && (data->left == 0UL)) {
+		data->left = EDF_SLICE_MS * TICKS_PER_MS;
+		if (is_inqueue(obj)) {
+			list_del_init(&data->list);
+			list_add_tail(&data->list, &edf_ctl->runqueue);
+		}
+	}
+}
+
+static struct thread_object *sched_edf_pick_next(struct sched_control *ctl)
+{
+	struct sched_edf_control *edf_ctl = (struct sched_edf_control *)ctl->priv;
+	struct thread_object *current = ctl->curr_obj;
+	struct thread_object *next = NULL, *iter_obj;
+	struct sched_edf_data *next_data = NULL, *iter_data;
+	struct list_head *pos;
+	uint64_t now = cpu_ticks();
+	uint64_t fire_tsc = UINT64_MAX;
+	bool shared = false;
+
+	if (!is_idle_thread(current)) {
+		charge(current, now);
+	}
+
+	del_timer(&edf_ctl->tick_timer);
+
+	/* the reserved thread with budget left and the earliest deadline */
+	list_for_each(pos, &edf_ctl->runqueue) {
+		iter_obj = container_of(pos, struct thread_object, data);
+		iter_data = (struct sched_edf_data *)iter_obj->data;
+		if (is_reserved(iter_data)) {
+			if (now >= iter_data->deadline) {
+				replenish(iter_data, now);
+			}
+			if (iter_data->left == 0UL) {
+				/* throttled, it may preempt the next thread once replenished */
+				fire_tsc = min(fire_tsc, iter_data->deadline);
+			} else if ((next_data == NULL) || (iter_data->deadline < next_data->deadline)) {
+				next = iter_obj;
+				next_data = iter_data;
+			} else {
+				/* it waits for a thread with an earlier deadline */
+			}
+		}
+	}
+
+	if (next != NULL) {
+		/* run it until its budget is used up or its period ends */
+		fire_tsc = min(fire_tsc, min(now + next_data->left, next_data->deadline));
+	} else {
+		/* the first thread without a reservation, they are queued round-robin */
+		list_for_each(pos, &edf_ctl->runqueue) {
+			iter_obj = container_of(pos, struct thread_object, data);
+			iter_data = (struct sched_edf_data *)iter_obj->data;
+			if (!is_reserved(iter_data)) {
+				if (next == NULL) {
+					next = iter_obj;
+					next_data = iter_data;
+				} else {
+					shared = true;
+				}
+			}
+		}
+		if (shared) {
+			fire_tsc = min(fire_tsc, now + next_data->left);
+		}
+	}
+
+	if (next != NULL) {
+		next_data->start_tsc = now;
+	} else {
+		next = &get_cpu_var(idle);
+	}
+
+	if (fire_tsc != UINT64_MAX) {
+		update_timer(&edf_ctl->tick_timer, fire_tsc, 0);
+		(void)add_timer(&edf_ctl->tick_timer);
+	}
+
+	return next;
+}
+
+static void sched_edf_sleep(struct thread_object *obj)
+{
+	struct sched_edf_data *data = (struct sched_edf_data *)obj->data;
+
+	list_del_init(&data->list);
+}
+
+/*
+ * A thread waking up with more budget left than its reservation allows for
+ * the rest of its period, i.e. left / (deadline - now) > budget / period,
+ * starts a new period, so a long sleep can't be cashed in as a burst.
+ */
+static void sched_edf_wake(struct thread_object *obj)
+{
+	struct sched_edf_control *edf_ctl = (struct sched_edf_control *)obj->sched_ctl->priv;
+	struct sched_edf_data *data = (struct sched_edf_data *)obj->data;
+	uint64_t now;
+
+	if (is_reserved(data)) {
+		now = cpu_ticks();
+		if ((now >= data->deadline) ||
+				((data->left * data->period) > ((data->deadline - now) * data->budget))) {
+			data->deadline = now + data->period;
+			data->left = data->budget;
+		}
+	}
+	list_add_tail(&data->list, &edf_ctl->runqueue);
+}
+
+struct acrn_scheduler sched_edf = {
+	.name		= "sched_edf",
+	.init		= sched_edf_init,
+	.init_data	= sched_edf_init_data,
+	.pick_next	= sched_edf_pick_next,
+	.sleep		= sched_edf_sleep,
+	.wake		= sched_edf_wake,
+	.deinit		= sched_edf_deinit,
+};
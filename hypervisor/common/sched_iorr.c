@@ -107,23 +107,16 @@ static void sched_tick_handler(void *param)
 int sched_iorr_init(struct sched_control *ctl)
 {
 	struct sched_iorr_control *iorr_ctl = &per_cpu(sched_iorr_ctl, ctl->pcpu_id);
-	uint64_t tick_period = TICKS_PER_MS;
-	int ret = 0;
 
 	ASSERT(get_pcpu_id() == ctl->pcpu_id, "Init scheduler on wrong CPU!");
 
 	ctl->priv = iorr_ctl;
 	INIT_LIST_HEAD(&iorr_ctl->runqueue);
 
-	/* The tick_timer is periodically */
-	initialize_timer(&iorr_ctl->tick_timer, sched_tick_handler, ctl,
-			cpu_ticks() + tick_period, tick_period);
+	/* The tick_timer is one-shot, armed by sched_iorr_update_tick() */
+	initialize_timer(&iorr_ctl->tick_timer, sched_tick_handler, ctl, 0UL, 0UL);
 
-	if (add_timer(&iorr_ctl->tick_timer) < 0) {
-		pr_err("Failed to add schedule tick timer!");
-		ret = -1;
-	}
-	return ret;
+	return 0;
 }
 
 void sched_iorr_deinit(struct sched_control *ctl)
@@ -141,6 +134,23 @@ void sched_iorr_init_data(struct thread_object *obj, __unused struct sched_param
 	data->left_cycles = data->slice_cycles = CONFIG_SLICE_MS * TICKS_PER_MS;
 }
 
+/*
+ * The tick only has to preempt the next thread when its slice runs out and
+ * another thread is runnable, so it is armed at that slice expiry and not at
+ * all when the next thread has the pCPU to itself. A thread waking up goes
+ * through the reschedule request of wake_thread(), which re-arms it here.
+ */
+static void sched_iorr_update_tick(struct sched_iorr_control *iorr_ctl, struct thread_object *next)
+{
+	struct sched_iorr_data *data = (struct sched_iorr_data *)next->data;
+
+	del_timer(&iorr_ctl->tick_timer);
+	if (!is_idle_thread(next) && (iorr_ctl->runqueue.next->next != &iorr_ctl->runqueue)) {
+		update_timer(&iorr_ctl->tick_timer, data->last_cycles + (uint64_t)data->left_cycles, 0UL);
+		(void)add_timer(&iorr_ctl->tick_timer);
+	}
+}
+
 static struct thread_object *sched_iorr_pick_next(struct sched_control *ctl)
 {
 	struct sched_iorr_control *iorr_ctl = (struct sched_iorr_control *)ctl->priv;
@@ -180,6 +190,8 @@ static struct thread_object *sched_iorr_pick_next(struct sched_control *ctl)
 		next = &get_cpu_var(idle);
 	}
 
+	sched_iorr_update_tick(iorr_ctl, next);
+
 	return next;
 }
 
@@ -188,11 +200,41 @@ static void sched_iorr_sleep(struct thread_object *obj)
 	runqueue_remove(obj);
 }
 
+/*
+ * The tick is re-armed by sched_iorr_pick_next() on the reschedule request that
+ * wake_thread() makes on the pCPU of the thread.
+ */
 static void sched_iorr_wake(struct thread_object *obj)
 {
 	runqueue_add_head(obj);
 }
 
+/* queue the thread first so it runs at the next pick_next() */
+static void sched_iorr_boost(struct thread_object *obj)
+{
+	runqueue_remove(obj);
+	runqueue_add_head(obj);
+}
+
+/*
+ * Walk the runqueue from its tail, the thread that would wait the longest
+ * here is the one that gains the most from being moved.
+ */
+static struct thread_object *sched_iorr_pick_migration(struct sched_control *ctl, uint16_t pcpu_id)
+{
+	struct sched_iorr_control *iorr_ctl = (struct sched_iorr_control *)ctl->priv;
+	struct thread_object *obj = NULL;
+	struct list_head *pos;
+
+	for (pos = iorr_ctl->runqueue.prev; (pos != &iorr_ctl->runqueue) && (obj == NULL); pos = pos->prev) {
+		if (sched_can_migrate(container_of(pos, struct thread_object, data), pcpu_id)) {
+			obj = container_of(pos, struct thread_object, data);
+		}
+	}
+
+	return obj;
+}
+
 struct acrn_scheduler sched_iorr = {
 	.name		= "sched_iorr",
 	.init		= sched_iorr_init,
@@ -200,5 +242,7 @@ struct acrn_scheduler sched_iorr = {
 	.pick_next	= sched_iorr_pick_next,
 	.sleep		= sched_iorr_sleep,
 	.wake		= sched_iorr_wake,
+	.boost		= sched_iorr_boost,
+	.pick_migration	= sched_iorr_pick_migration,
 	.deinit		= sched_iorr_deinit,
 };
@@ -7,12 +7,27 @@
 #include <rtl.h>
 #include <list.h>
 #include <asm/lib/bits.h>
+#include <asm/lib/atomic.h>
 #include <asm/cpu.h>
 #include <asm/per_cpu.h>
 #include <asm/lapic.h>
 #include <schedule.h>
 #include <sprintf.h>
 #include <asm/irq.h>
+#include <ticks.h>
+#include <misc_cfg.h>
+#include <flightrec.h>
+
+/*
+ * A queued thread switched out less than this ago is assumed to still have
+ * its working set in the caches of its pCPU and is not migrated.
+ */
+#define MIGRATION_COST_US	500U
+
+/* wake_state of a thread_object */
+#define WAKE_NONE		0U	/* not on a wake_list */
+#define WAKE_QUEUED		1U	/* on a wake_list, to be woken up when drained */
+#define WAKE_CANCELLED		2U	/* on a wake_list, put to sleep again since pushed */
 
 bool is_idle_thread(const struct thread_object *obj)
 {
@@ -47,6 +62,24 @@ void release_schedule_lock(uint16_t pcpu_id, uint64_t rflag)
 	spinlock_irqrestore_release(&ctl->scheduler_lock, rflag);
 }
 
+/*
+ * The thread may be migrated while we wait for the lock of its old pCPU, so
+ * retry until the lock held is the one of the pCPU it is on.
+ */
+static uint16_t obtain_thread_lock(const struct thread_object *obj, uint64_t *rflag)
+{
+	uint16_t pcpu_id = obj->pcpu_id;
+
+	obtain_schedule_lock(pcpu_id, rflag);
+	while (obj->pcpu_id != pcpu_id) {
+		release_schedule_lock(pcpu_id, *rflag);
+		pcpu_id = obj->pcpu_id;
+		obtain_schedule_lock(pcpu_id, rflag);
+	}
+
+	return pcpu_id;
+}
+
 static struct acrn_scheduler *get_scheduler(uint16_t pcpu_id)
 {
 	struct sched_control *ctl = &per_cpu(sched_ctl, pcpu_id);
@@ -61,6 +94,17 @@ uint16_t sched_get_pcpuid(const struct thread_object *obj)
 	return obj->pcpu_id;
 }
 
+/**
+ * @pre obj != NULL
+ * @pre the schedule lock of obj->pcpu_id is held
+ */
+bool sched_can_migrate(const struct thread_object *obj, uint16_t pcpu_id)
+{
+	return (obj != obj->sched_ctl->curr_obj) && (obj->status == THREAD_STS_RUNNABLE) && !obj->be_blocking &&
+		bitmap_test(pcpu_id, &obj->pcpu_bitmap) && (get_scheduler(pcpu_id) == obj->sched_ctl->scheduler) &&
+		((cpu_ticks() - obj->switch_out_tsc) >= us_to_ticks(MIGRATION_COST_US));
+}
+
 void init_sched(uint16_t pcpu_id)
 {
 	struct sched_control *ctl = &per_cpu(sched_ctl, pcpu_id);
@@ -70,6 +114,8 @@ void init_sched(uint16_t pcpu_id)
 
 	spinlock_init(&ctl->scheduler_lock);
 	ctl->flags = 0UL;
+	ctl->migrate_req = 0UL;
+	ctl->wake_list = NULL;
 	ctl->curr_obj = NULL;
 	ctl->pcpu_id = pcpu_id;
 #ifdef CONFIG_SCHED_NOOP
@@ -84,6 +130,10 @@ void init_sched(uint16_t pcpu_id)
 #ifdef CONFIG_SCHED_PRIO
 	ctl->scheduler = &sched_prio;
 #endif
+	/* the pCPUs configured for deadline scheduling use it in place of the above */
+	if ((SCHED_EDF_PCPU_BITMAP & (1UL << pcpu_id)) != 0UL) {
+		ctl->scheduler = &sched_edf;
+	}
 	if (ctl->scheduler->init != NULL) {
 		ctl->scheduler->init(ctl);
 	}
@@ -107,6 +157,8 @@ void init_thread_data(struct thread_object *obj, struct sched_params *params)
 	if (scheduler->init_data != NULL) {
 		scheduler->init_data(obj, params);
 	}
+	(void)memset(&obj->stats, 0U, sizeof(obj->stats));
+	obj->woken = false;
 	/* initial as BLOCKED status, so we can wake it up to run */
 	set_thread_status(obj, THREAD_STS_BLOCKED);
 	release_schedule_lock(obj->pcpu_id, rflag);
@@ -127,6 +179,55 @@ struct thread_object *sched_get_current(uint16_t pcpu_id)
 	return ctl->curr_obj;
 }
 
+static void sched_stats_switch_out(struct thread_object *obj, uint64_t now)
+{
+	obj->stats.run_ticks += now - obj->stats_tsc;
+	obj->stats_tsc = now;
+}
+
+static void sched_stats_switch_in(struct thread_object *obj, uint64_t now)
+{
+	uint64_t wait = now - obj->stats_tsc;
+	uint64_t us;
+	uint16_t bucket = 0U;
+
+	obj->stats.wait_ticks += wait;
+	obj->stats.nr_switches++;
+	if (obj->woken) {
+		us = ticks_to_us(wait);
+		if (us != 0UL) {
+			bucket = min(fls64(us) + 1U, SCHED_LAT_BUCKETS - 1U);
+		}
+		obj->stats.wakeup_lat[bucket]++;
+		obj->woken = false;
+	}
+	obj->stats_tsc = now;
+}
+
+/**
+ * @pre obj != NULL && stats != NULL
+ *
+ * Snapshot the scheduling statistics of obj, including the time it has been
+ * running or waiting for so far.
+ */
+void sched_get_stats(const struct thread_object *obj, struct sched_stats *stats)
+{
+	uint16_t pcpu_id;
+	uint64_t rflag, now;
+
+	pcpu_id = obtain_thread_lock(obj, &rflag);
+	now = cpu_ticks();
+	*stats = obj->stats;
+	if (is_running(obj)) {
+		stats->run_ticks += now - obj->stats_tsc;
+	} else if (obj->status == THREAD_STS_RUNNABLE) {
+		stats->wait_ticks += now - obj->stats_tsc;
+	} else {
+		/* blocked time is not accounted */
+	}
+	release_schedule_lock(pcpu_id, rflag);
+}
+
 /**
  * @pre delmode == DEL_MODE_IPI || delmode == DEL_MODE_INIT
  */
@@ -147,30 +248,151 @@ bool need_reschedule(uint16_t pcpu_id)
 	return bitmap_test(NEED_RESCHEDULE, &ctl->flags);
 }
 
+#ifdef CONFIG_SCHED_BALANCE_ENABLED
+/*
+ * Work stealing at idle: ask the first pCPU queueing a thread that can run
+ * here to push it over. The thread is moved by its own pCPU, which is the only
+ * one that can release the per-pCPU state (e.g. the VMCS) the thread holds.
+ */
+static void sched_pull_thread(uint16_t pcpu_id)
+{
+	struct sched_control *ctl;
+	uint16_t i;
+	uint64_t rflag;
+	bool found = false;
+
+	for (i = 0U; (i < get_pcpu_nums()) && !found; i++) {
+		ctl = &per_cpu(sched_ctl, i);
+		if ((i != pcpu_id) && is_pcpu_active(i) && (ctl->scheduler->pick_migration != NULL)) {
+			obtain_schedule_lock(i, &rflag);
+			if (ctl->scheduler->pick_migration(ctl, pcpu_id) != NULL) {
+				bitmap_set_nolock(pcpu_id, &ctl->migrate_req);
+				make_reschedule_request(i);
+				found = true;
+			}
+			release_schedule_lock(i, rflag);
+		}
+	}
+}
+
+/*
+ * Hand a queued thread over to each pCPU in migrate_req. The thread is taken
+ * off this runqueue and re-homed under the lock of this pCPU, then queued on
+ * the new pCPU under its lock, so no two schedule locks are ever held at once.
+ */
+static void sched_push_threads(struct sched_control *ctl)
+{
+	struct thread_object *obj;
+	uint16_t pcpu_id;
+	uint64_t rflag, new_rflag;
+
+	obtain_schedule_lock(ctl->pcpu_id, &rflag);
+	pcpu_id = ffs64(ctl->migrate_req);
+	while (pcpu_id != INVALID_BIT_INDEX) {
+		bitmap_clear_nolock(pcpu_id, &ctl->migrate_req);
+		obj = ctl->scheduler->pick_migration(ctl, pcpu_id);
+		if ((obj != NULL) && ((obj->migrate == NULL) || obj->migrate(obj, pcpu_id))) {
+			ctl->scheduler->sleep(obj);
+			obj->sched_ctl = &per_cpu(sched_ctl, pcpu_id);
+			obj->pcpu_id = pcpu_id;
+			release_schedule_lock(ctl->pcpu_id, rflag);
+
+			obtain_schedule_lock(pcpu_id, &new_rflag);
+			/* it may have been put to sleep on the new pCPU in between */
+			if (obj->status == THREAD_STS_RUNNABLE) {
+				obj->sched_ctl->scheduler->wake(obj);
+				make_reschedule_request(pcpu_id);
+			}
+			release_schedule_lock(pcpu_id, new_rflag);
+
+			obtain_schedule_lock(ctl->pcpu_id, &rflag);
+		}
+		pcpu_id = ffs64(ctl->migrate_req);
+	}
+	release_schedule_lock(ctl->pcpu_id, rflag);
+}
+#endif
+
+static void wake_thread_locked(struct thread_object *obj, uint16_t pcpu_id);
+
+/*
+ * Take the remote wakeups pushed since the last schedule() and process them
+ * in the order they were pushed.
+ */
+static void drain_wake_list(struct sched_control *ctl)
+{
+	struct thread_object *obj, *next, *chain = NULL;
+	uint16_t pcpu_id;
+	uint64_t rflag;
+
+	obj = (struct thread_object *)atomic_swap64((uint64_t *)&ctl->wake_list, 0UL);
+	while (obj != NULL) {
+		next = obj->wake_next;
+		obj->wake_next = chain;
+		chain = obj;
+		obj = next;
+	}
+
+	while (chain != NULL) {
+		obj = chain;
+		/* read the link first, obj may be pushed again once WAKE_NONE */
+		chain = obj->wake_next;
+		/*
+		 * Under the thread lock, so a sleep_thread() can't slip in between
+		 * the transition and the wake: a sleep newer than the wakeup has
+		 * already turned it into WAKE_CANCELLED then.
+		 */
+		pcpu_id = obtain_thread_lock(obj, &rflag);
+		if (atomic_swap32(&obj->wake_state, WAKE_NONE) == WAKE_QUEUED) {
+			wake_thread_locked(obj, pcpu_id);
+		}
+		release_schedule_lock(pcpu_id, rflag);
+	}
+}
+
 void schedule(void)
 {
 	uint16_t pcpu_id = get_pcpu_id();
 	struct sched_control *ctl = &per_cpu(sched_ctl, pcpu_id);
 	struct thread_object *next = &per_cpu(idle, pcpu_id);
 	struct thread_object *prev = ctl->curr_obj;
-	uint64_t rflag;
+	uint64_t rflag, now;
+
+	/*
+	 * Clear the request before draining: a wakeup pushed after this point
+	 * sets it again, so it can't be left on the wake_list unnoticed.
+	 */
+	bitmap_clear_lock(NEED_RESCHEDULE, &ctl->flags);
+	if (ctl->wake_list != NULL) {
+		drain_wake_list(ctl);
+	}
+
+#ifdef CONFIG_SCHED_BALANCE_ENABLED
+	if (ctl->migrate_req != 0UL) {
+		sched_push_threads(ctl);
+	}
+#endif
 
 	obtain_schedule_lock(pcpu_id, &rflag);
 	if (ctl->scheduler->pick_next != NULL) {
 		next = ctl->scheduler->pick_next(ctl);
 	}
-	bitmap_clear_lock(NEED_RESCHEDULE, &ctl->flags);
 
 	/* If we picked different sched object, switch context */
 	if (prev != next) {
+		now = cpu_ticks();
 		if (prev != NULL) {
 			if (prev->switch_out != NULL) {
 				prev->switch_out(prev);
 			}
 			set_thread_status(prev, prev->be_blocking ? THREAD_STS_BLOCKED : THREAD_STS_RUNNABLE);
 			prev->be_blocking = false;
+			prev->switch_out_tsc = now;
+			sched_stats_switch_out(prev, now);
 		}
 
+		/* the wait just ended is in the stats switch_in sees, e.g. for the steal time of a vCPU */
+		sched_stats_switch_in(next, now);
 		if (next->switch_in != NULL) {
 			next->switch_in(next);
 		}
@@ -178,6 +400,12 @@ void schedule(void)
 
 		ctl->curr_obj = next;
 		release_schedule_lock(pcpu_id, rflag);
+		flightrec_put_str(FLIGHTREC_SCHED, next->name);
+#ifdef CONFIG_SCHED_BALANCE_ENABLED
+		if (is_idle_thread(next)) {
+			sched_pull_thread(pcpu_id);
+		}
+#endif
 		arch_switch_to(&prev->host_sp, &next->host_sp);
 	} else {
 		release_schedule_lock(pcpu_id, rflag);
@@ -186,11 +414,14 @@ void schedule(void)
 
 void sleep_thread(struct thread_object *obj)
 {
-	uint16_t pcpu_id = obj->pcpu_id;
-	struct acrn_scheduler *scheduler = get_scheduler(pcpu_id);
+	uint16_t pcpu_id;
+	struct acrn_scheduler *scheduler;
 	uint64_t rflag;
 
-	obtain_schedule_lock(pcpu_id, &rflag);
+	pcpu_id = obtain_thread_lock(obj, &rflag);
+	scheduler = get_scheduler(pcpu_id);
+	/* a wakeup still on a wake_list happened before this sleep */
+	(void)atomic_cmpxchg32(&obj->wake_state, WAKE_QUEUED, WAKE_CANCELLED);
 	if (scheduler->sleep != NULL) {
 		scheduler->sleep(obj);
 	}
@@ -206,18 +437,23 @@ void sleep_thread(struct thread_object *obj)
 void sleep_thread_sync(struct thread_object *obj)
 {
 	sleep_thread(obj);
-	while (!is_blocked(obj)) {
+	/*
+	 * The thread_object may be freed after this, so wait for it to leave any
+	 * wake_list too, including ours if it was pushed here before a migration.
+	 */
+	while (!is_blocked(obj) || (obj->wake_state != WAKE_NONE)) {
+		if (get_cpu_var(sched_ctl).wake_list != NULL) {
+			drain_wake_list(&get_cpu_var(sched_ctl));
+		}
 		asm_pause();
 	}
 }
 
-void wake_thread(struct thread_object *obj)
+/* @pre the schedule lock of pcpu_id, the pCPU of obj, is held */
+static void wake_thread_locked(struct thread_object *obj, uint16_t pcpu_id)
 {
-	uint16_t pcpu_id = obj->pcpu_id;
 	struct acrn_scheduler *scheduler;
-	uint64_t rflag;
 
-	obtain_schedule_lock(pcpu_id, &rflag);
 	if (is_blocked(obj) || obj->be_blocking) {
 		scheduler = get_scheduler(pcpu_id);
 		if (scheduler->wake != NULL) {
@@ -225,18 +461,97 @@ void wake_thread(struct thread_object *obj)
 		}
 		if (is_blocked(obj)) {
 			set_thread_status(obj, THREAD_STS_RUNNABLE);
+			obj->stats_tsc = cpu_ticks();
+			obj->woken = true;
 			make_reschedule_request(pcpu_id);
 		}
 		obj->be_blocking = false;
 	}
+}
+
+static void do_wake_thread(struct thread_object *obj)
+{
+	uint16_t pcpu_id;
+	uint64_t rflag;
+
+	pcpu_id = obtain_thread_lock(obj, &rflag);
+	wake_thread_locked(obj, pcpu_id);
 	release_schedule_lock(pcpu_id, rflag);
 }
 
+/*
+ * Push obj to the wake_list of pcpu_id without taking its schedule lock. The
+ * pCPU is only kicked if no reschedule is pending there yet, so a burst of
+ * wakeups to the same pCPU costs one IPI.
+ */
+static void queue_wake_thread(struct thread_object *obj, uint16_t pcpu_id)
+{
+	struct sched_control *ctl = &per_cpu(sched_ctl, pcpu_id);
+	struct thread_object *head;
+
+	/* revive a cancelled wakeup that is still on a wake_list, or push a new one */
+	if ((atomic_cmpxchg32(&obj->wake_state, WAKE_CANCELLED, WAKE_QUEUED) == WAKE_NONE) &&
+			(atomic_cmpxchg32(&obj->wake_state, WAKE_NONE, WAKE_QUEUED) == WAKE_NONE)) {
+		do {
+			head = ctl->wake_list;
+			obj->wake_next = head;
+		} while (atomic_cmpxchg64((volatile uint64_t *)&ctl->wake_list,
+				(uint64_t)head, (uint64_t)obj) != (uint64_t)head);
+
+		if (!bitmap_test_and_set_lock(NEED_RESCHEDULE, &ctl->flags)) {
+			kick_pcpu(pcpu_id);
+		}
+	}
+}
+
+/*
+ * Wakeups from the pCPU of the thread are done right away. Remote ones, e.g.
+ * the ioreq completions of the DM, are queued to the pCPU of the thread and
+ * done by it in schedule().
+ */
+void wake_thread(struct thread_object *obj)
+{
+	uint16_t pcpu_id = obj->pcpu_id;
+
+	if (pcpu_id == get_pcpu_id()) {
+		do_wake_thread(obj);
+	} else {
+		queue_wake_thread(obj, pcpu_id);
+	}
+}
+
 void yield_current(void)
 {
 	make_reschedule_request(get_pcpu_id());
 }
 
+/**
+ * @pre obj != NULL
+ *
+ * Have the pCPU of obj switch to it at its next schedule() if it is queued
+ * there behind another thread, e.g. a vCPU preempted while holding a lock
+ * its siblings spin on. Returns false if obj isn't such a thread.
+ */
+bool boost_thread(struct thread_object *obj)
+{
+	uint16_t pcpu_id;
+	struct acrn_scheduler *scheduler;
+	uint64_t rflag;
+	bool ret = false;
+
+	pcpu_id = obtain_thread_lock(obj, &rflag);
+	scheduler = get_scheduler(pcpu_id);
+	if ((scheduler->boost != NULL) && (obj->status == THREAD_STS_RUNNABLE) &&
+			(obj != obj->sched_ctl->curr_obj)) {
+		scheduler->boost(obj);
+		make_reschedule_request(pcpu_id);
+		ret = true;
+	}
+	release_schedule_lock(pcpu_id, rflag);
+
+	return ret;
+}
+
 void run_thread(struct thread_object *obj)
 {
 	uint64_t rflag;
@@ -244,6 +559,7 @@ void run_thread(struct thread_object *obj)
 	obtain_schedule_lock(obj->pcpu_id, &rflag);
 	get_cpu_var(sched_ctl).curr_obj = obj;
 	set_thread_status(obj, THREAD_STS_RUNNING);
+	obj->stats_tsc = cpu_ticks();
 	release_schedule_lock(obj->pcpu_id, rflag);
 
 	if (obj->thread_entry != NULL) {
@@ -8,10 +8,26 @@
 #include <asm/lib/bits.h>
 #include <asm/cpu.h>
 #include <asm/per_cpu.h>
+#include <asm/lapic.h>
+#include <asm/irq.h>
+#include <schedule.h>
+#include <ticks.h>
 #include <softirq.h>
 
 static softirq_handler softirq_handlers[NR_SOFTIRQS];
 
+/*
+ * How long a softirq may run per do_softirq() on a vCPU thread, in us, 0 for
+ * no limit. A handler going over it is left pending until the next VM exit
+ * or the idle thread, so that it doesn't hold the VM entry back. Only the
+ * handlers checking softirq_should_yield() can stop early.
+ */
+static const uint32_t softirq_budget_us[NR_SOFTIRQS] = {
+	[SOFTIRQ_TIMER] = 0U,		/* the RT timers are never deferred */
+	[SOFTIRQ_PTDEV] = 50U,
+	[SOFTIRQ_SBUF] = 20U,
+};
+
 void init_softirq(void)
 {
 }
@@ -32,17 +48,62 @@ void fire_softirq(uint16_t nr)
 	bitmap_set_lock(nr, &per_cpu(softirq_pending, get_pcpu_id()));
 }
 
-static void do_softirq_internal(uint16_t cpu_id)
+/*
+ * Whether the running softirq handler should return, and fire its softirq
+ * again for what it has left: it is over its budget or a softirq of a higher
+ * priority is pending.
+ */
+bool softirq_should_yield(uint16_t cpu_id)
+{
+	return ((per_cpu(softirq_pending, cpu_id) & per_cpu(softirq_preempt_mask, cpu_id)) != 0UL) ||
+		(cpu_ticks() >= per_cpu(softirq_deadline, cpu_id));
+}
+
+bool has_pending_softirq(uint16_t cpu_id)
+{
+	return (per_cpu(softirq_pending, cpu_id) != 0UL);
+}
+
+/*
+ * The softirqs in *deferred went over their budget, they are not run again in
+ * this do_softirq().
+ */
+static void do_softirq_internal(uint16_t cpu_id, bool budgeted, uint64_t *deferred)
 {
 	volatile uint64_t *softirq_pending_bitmap =
 			&per_cpu(softirq_pending, cpu_id);
-	uint16_t nr = ffs64(*softirq_pending_bitmap);
+	struct softirq_stats *stats;
+	uint64_t start, end, delta;
+	uint16_t nr = ffs64(*softirq_pending_bitmap & ~(*deferred));
 
 	while (nr < NR_SOFTIRQS) {
 		bitmap_clear_lock(nr, softirq_pending_bitmap);
+
+		start = cpu_ticks();
+		if (budgeted && (softirq_budget_us[nr] != 0U)) {
+			per_cpu(softirq_deadline, cpu_id) = start + us_to_ticks(softirq_budget_us[nr]);
+		} else {
+			per_cpu(softirq_deadline, cpu_id) = ~0UL;
+		}
+		per_cpu(softirq_preempt_mask, cpu_id) = (1UL << nr) - 1UL;
+
 		(*softirq_handlers[nr])(cpu_id);
-		nr = ffs64(*softirq_pending_bitmap);
+
+		end = cpu_ticks();
+		delta = end - start;
+		stats = &per_cpu(softirq_stats, cpu_id)[nr];
+		stats->count++;
+		stats->ticks += delta;
+		if (delta > stats->max_ticks) {
+			stats->max_ticks = delta;
+		}
+		if (end >= per_cpu(softirq_deadline, cpu_id)) {
+			*deferred |= (1UL << nr);
+		}
+
+		nr = ffs64(*softirq_pending_bitmap & ~(*deferred));
 	}
+	per_cpu(softirq_preempt_mask, cpu_id) = 0UL;
 }
 
 /*
@@ -51,15 +112,38 @@ static void do_softirq_internal(uint16_t cpu_id)
 void do_softirq(void)
 {
 	uint16_t cpu_id = get_pcpu_id();
+	uint64_t deferred = 0UL;
+	uint64_t left;
+	uint16_t nr;
+	bool budgeted;
 
 	if (per_cpu(softirq_servicing, cpu_id) == 0U) {
 		per_cpu(softirq_servicing, cpu_id) = 1U;
 
+		/*
+		 * Nothing waits on the idle thread. A pCPU kicked by INIT has no
+		 * notification to come back with, its softirqs are all run.
+		 */
+		budgeted = !is_idle_thread(sched_get_current(cpu_id)) &&
+			(per_cpu(mode_to_kick_pcpu, cpu_id) == DEL_MODE_IPI);
+
 		CPU_IRQ_ENABLE_ON_CONFIG();
-		do_softirq_internal(cpu_id);
+		do_softirq_internal(cpu_id, budgeted, &deferred);
 		CPU_IRQ_DISABLE_ON_CONFIG();
 
-		do_softirq_internal(cpu_id);
+		do_softirq_internal(cpu_id, budgeted, &deferred);
+
+		left = per_cpu(softirq_pending, cpu_id) & deferred;
+		if (left != 0UL) {
+			nr = ffs64(left);
+			while (nr < NR_SOFTIRQS) {
+				per_cpu(softirq_stats, cpu_id)[nr].deferred++;
+				left &= ~(1UL << nr);
+				nr = ffs64(left);
+			}
+			/* an exit right after the VM entry, or the idle thread, runs them */
+			send_single_ipi(cpu_id, NOTIFY_VCPU_VECTOR);
+		}
 		per_cpu(softirq_servicing, cpu_id) = 0U;
 	}
 }
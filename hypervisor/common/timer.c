@@ -16,6 +16,7 @@
 #include <asm/irq.h>
 #include <ticks.h>
 #include <hw/hw_timer.h>
+#include <asm/lib/bits.h>
 
 #define MAX_TIMER_ACTIONS	32U
 #define MIN_TIMER_PERIOD_US	500U
@@ -39,7 +40,7 @@ bool timer_expired(const struct hv_timer *timer, uint64_t now, uint64_t *delta)
 
 bool timer_is_started(const struct hv_timer *timer)
 {
-	return (!list_empty(&timer->node));
+	return (timer->cpu_timer != NULL);
 }
 
 static void run_timer(const struct hv_timer *timer)
@@ -54,41 +55,201 @@ static void run_timer(const struct hv_timer *timer)
 
 static inline void update_physical_timer(struct per_cpu_timers *cpu_timer)
 {
-	struct hv_timer *timer = NULL;
+	/* the next event timer is the heap root */
+	if (cpu_timer->root != NULL) {
+		/* it is okay to program a expired time */
+		msr_write(MSR_IA32_TSC_DEADLINE, cpu_timer->root->timeout);
+	}
+}
 
-	/* find the next event timer */
-	if (!list_empty(&cpu_timer->timer_list)) {
-		timer = container_of((&cpu_timer->timer_list)->next,
-			struct hv_timer, node);
+/*
+ * The active timers of a pCPU are kept in a binary min-heap keyed on the
+ * timeout. The heap is a complete binary tree linked through the timers
+ * themselves, so that it needs no storage of its own: the bits of the 1-based
+ * position of a node below the leading one give the path from the root,
+ * 0 for left and 1 for right.
+ */
+static struct hv_timer *heap_node_at(const struct per_cpu_timers *cpu_timer, uint32_t pos)
+{
+	struct hv_timer *node = cpu_timer->root;
+	uint16_t bit = fls32(pos);
 
-		/* it is okay to program a expired time */
-		msr_write(MSR_IA32_TSC_DEADLINE, timer->timeout);
+	while ((bit > 0U) && (node != NULL)) {
+		bit--;
+		if ((pos & (1U << bit)) == 0U) {
+			node = node->left;
+		} else {
+			node = node->right;
+		}
 	}
+
+	return node;
 }
 
 /*
- * return true if we add the timer on the timer_list head
+ * Swap the timer with its parent in the heap.
+ *
+ * @pre timer->parent != NULL
  */
-static bool local_add_timer(struct per_cpu_timers *cpu_timer,
-			struct hv_timer *timer)
+static void heap_swap_with_parent(struct per_cpu_timers *cpu_timer, struct hv_timer *timer)
+{
+	struct hv_timer *parent = timer->parent;
+	struct hv_timer *grand = parent->parent;
+	struct hv_timer *left = timer->left;
+	struct hv_timer *right = timer->right;
+	struct hv_timer *sibling;
+
+	if (parent->left == timer) {
+		sibling = parent->right;
+		timer->left = parent;
+		timer->right = sibling;
+	} else {
+		sibling = parent->left;
+		timer->left = sibling;
+		timer->right = parent;
+	}
+	if (sibling != NULL) {
+		sibling->parent = timer;
+	}
+
+	parent->left = left;
+	parent->right = right;
+	if (left != NULL) {
+		left->parent = parent;
+	}
+	if (right != NULL) {
+		right->parent = parent;
+	}
+
+	parent->parent = timer;
+	timer->parent = grand;
+	if (grand == NULL) {
+		cpu_timer->root = timer;
+	} else if (grand->left == parent) {
+		grand->left = timer;
+	} else {
+		grand->right = timer;
+	}
+}
+
+/*
+ * return the number of levels the timer moved up
+ */
+static uint32_t heap_sift_up(struct per_cpu_timers *cpu_timer, struct hv_timer *timer)
+{
+	uint32_t depth = 0U;
+
+	while ((timer->parent != NULL) && (timer->timeout < timer->parent->timeout)) {
+		heap_swap_with_parent(cpu_timer, timer);
+		depth++;
+	}
+
+	return depth;
+}
+
+static void heap_sift_down(struct per_cpu_timers *cpu_timer, struct hv_timer *timer)
 {
-	struct list_head *pos, *prev;
-	struct hv_timer *tmp;
-	uint64_t tsc = timer->timeout;
+	struct hv_timer *min;
+	bool done = false;
 
-	prev = &cpu_timer->timer_list;
-	list_for_each(pos, &cpu_timer->timer_list) {
-		tmp = container_of(pos, struct hv_timer, node);
-		if (tmp->timeout < tsc) {
-			prev = &tmp->node;
+	while (!done) {
+		min = timer;
+		if ((timer->left != NULL) && (timer->left->timeout < min->timeout)) {
+			min = timer->left;
+		}
+		if ((timer->right != NULL) && (timer->right->timeout < min->timeout)) {
+			min = timer->right;
+		}
+
+		if (min == timer) {
+			done = true;
 		} else {
-			break;
+			heap_swap_with_parent(cpu_timer, min);
 		}
 	}
+}
 
-	list_add(&timer->node, prev);
+/*
+ * The last node of the heap takes the place of the removed timer and is
+ * sifted to its place.
+ *
+ * @pre timer->cpu_timer == cpu_timer
+ */
+static void heap_remove(struct per_cpu_timers *cpu_timer, struct hv_timer *timer)
+{
+	struct hv_timer *last = heap_node_at(cpu_timer, cpu_timer->nr_timers);
+
+	if (last->parent == NULL) {
+		cpu_timer->root = NULL;
+	} else if (last->parent->left == last) {
+		last->parent->left = NULL;
+	} else {
+		last->parent->right = NULL;
+	}
+	cpu_timer->nr_timers--;
+
+	if (last != timer) {
+		last->parent = timer->parent;
+		last->left = timer->left;
+		last->right = timer->right;
+		if (last->left != NULL) {
+			last->left->parent = last;
+		}
+		if (last->right != NULL) {
+			last->right->parent = last;
+		}
+		if (last->parent == NULL) {
+			cpu_timer->root = last;
+		} else if (last->parent->left == timer) {
+			last->parent->left = last;
+		} else {
+			last->parent->right = last;
+		}
+
+		if (heap_sift_up(cpu_timer, last) == 0U) {
+			heap_sift_down(cpu_timer, last);
+		}
+	}
 
-	return (prev == &cpu_timer->timer_list);
+	timer->parent = NULL;
+	timer->left = NULL;
+	timer->right = NULL;
+	timer->cpu_timer = NULL;
+}
+
+/*
+ * return the number of heap levels the insertion went through, the timer is
+ * the next one to expire if it ends up at the heap root
+ */
+static uint32_t local_add_timer(struct per_cpu_timers *cpu_timer,
+			struct hv_timer *timer)
+{
+	struct hv_timer *parent;
+	uint32_t pos = cpu_timer->nr_timers + 1U;
+	uint32_t depth;
+
+	timer->left = NULL;
+	timer->right = NULL;
+	timer->cpu_timer = cpu_timer;
+	if (pos == 1U) {
+		timer->parent = NULL;
+		cpu_timer->root = timer;
+	} else {
+		parent = heap_node_at(cpu_timer, pos >> 1U);
+		timer->parent = parent;
+		if ((pos & 1U) == 0U) {
+			parent->left = timer;
+		} else {
+			parent->right = timer;
+		}
+	}
+	cpu_timer->nr_timers = pos;
+
+	depth = heap_sift_up(cpu_timer, timer);
+	cpu_timer->nr_inserts++;
+	cpu_timer->insert_depth += depth;
+
+	return depth;
 }
 
 int32_t add_timer(struct hv_timer *timer)
@@ -97,11 +258,12 @@ int32_t add_timer(struct hv_timer *timer)
 	uint16_t pcpu_id;
 	int32_t ret = 0;
 	uint64_t rflags;
+	uint32_t depth;
 
 	if ((timer == NULL) || (timer->func == NULL) || (timer->timeout == 0UL)) {
 		ret = -EINVAL;
 	} else {
-		ASSERT(list_empty(&timer->node), "add timer again!\n");
+		ASSERT(timer->cpu_timer == NULL, "add timer again!\n");
 
 		/* limit minimal periodic timer cycle period */
 		if (timer->mode == TICK_MODE_PERIODIC) {
@@ -112,13 +274,14 @@ int32_t add_timer(struct hv_timer *timer)
 		cpu_timer = &per_cpu(cpu_timers, pcpu_id);
 
 		CPU_INT_ALL_DISABLE(&rflags);
-		/* update the physical timer if we're on the timer_list head */
-		if (local_add_timer(cpu_timer, timer)) {
+		depth = local_add_timer(cpu_timer, timer);
+		/* update the physical timer if we're on the heap root */
+		if (cpu_timer->root == timer) {
 			update_physical_timer(cpu_timer);
 		}
 		CPU_INT_ALL_RESTORE(rflags);
 
-		TRACE_2L(TRACE_TIMER_ACTION_ADDED, timer->timeout, 0UL);
+		TRACE_2L(TRACE_TIMER_ACTION_ADDED, timer->timeout, depth);
 	}
 
 	return ret;
@@ -140,7 +303,10 @@ void initialize_timer(struct hv_timer *timer,
 			timer->mode = TICK_MODE_ONESHOT;
 			timer->period_in_cycle = 0UL;
 		}
-		INIT_LIST_HEAD(&timer->node);
+		timer->parent = NULL;
+		timer->left = NULL;
+		timer->right = NULL;
+		timer->cpu_timer = NULL;
 	}
 }
 
@@ -163,25 +329,37 @@ void del_timer(struct hv_timer *timer)
 	uint64_t rflags;
 
 	CPU_INT_ALL_DISABLE(&rflags);
-	if ((timer != NULL) && !list_empty(&timer->node)) {
-		list_del_init(&timer->node);
+	if ((timer != NULL) && (timer->cpu_timer != NULL)) {
+		heap_remove(timer->cpu_timer, timer);
 	}
 	CPU_INT_ALL_RESTORE(rflags);
 }
 
+/**
+ * @pre pcpu_id == get_pcpu_id(), interrupts are disabled
+ */
+uint64_t next_timer_deadline(uint16_t pcpu_id)
+{
+	const struct per_cpu_timers *cpu_timer = &per_cpu(cpu_timers, pcpu_id);
+
+	return (cpu_timer->root != NULL) ? cpu_timer->root->timeout : ~0UL;
+}
+
 static void init_percpu_timer(uint16_t pcpu_id)
 {
 	struct per_cpu_timers *cpu_timer;
 
 	cpu_timer = &per_cpu(cpu_timers, pcpu_id);
-	INIT_LIST_HEAD(&cpu_timer->timer_list);
+	cpu_timer->root = NULL;
+	cpu_timer->nr_timers = 0U;
+	cpu_timer->nr_inserts = 0UL;
+	cpu_timer->insert_depth = 0UL;
 }
 
 static void timer_softirq(uint16_t pcpu_id)
 {
 	struct per_cpu_timers *cpu_timer;
 	struct hv_timer *timer;
-	const struct list_head *pos, *n;
 	uint32_t tries = MAX_TIMER_ACTIONS;
 	uint64_t current_tsc = cpu_ticks();
 
@@ -194,25 +372,26 @@ static void timer_softirq(uint16_t pcpu_id)
 	 * inside func(), it will infinitely loop here, because new added timer
 	 * already passed due to previously func()'s delay.
 	 */
-	list_for_each_safe(pos, n, &cpu_timer->timer_list) {
-		timer = container_of(pos, struct hv_timer, node);
+	timer = cpu_timer->root;
+	while ((timer != NULL) && (timer->timeout <= current_tsc) && (tries > 1U)) {
 		/* timer expried */
 		tries--;
-		if ((timer->timeout <= current_tsc) && (tries != 0U)) {
-			del_timer(timer);
-
-			run_timer(timer);
-
-			if (timer->mode == TICK_MODE_PERIODIC) {
-				/* update periodic timer fire tsc */
-				timer->timeout += timer->period_in_cycle;
-				(void)local_add_timer(cpu_timer, timer);
-			} else {
-				timer->timeout = 0UL;
-			}
+		del_timer(timer);
+
+		run_timer(timer);
+
+		if (timer->mode == TICK_MODE_PERIODIC) {
+			/* update periodic timer fire tsc */
+			timer->timeout += timer->period_in_cycle;
+			(void)local_add_timer(cpu_timer, timer);
+		} else if (!timer_is_started(timer)) {
+			/* unless func() re-added it */
+			timer->timeout = 0UL;
 		} else {
-			break;
+			/* func() re-added it for a later timeout */
 		}
+
+		timer = cpu_timer->root;
 	}
 
 	/* update nearest timer */
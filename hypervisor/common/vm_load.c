@@ -5,17 +5,97 @@
  */
 
 #include <asm/guest/vm.h>
+#include <asm/lib/atomic.h>
+#include <asm/notify.h>
+#include <asm/cpu.h>
 #include <vboot.h>
 #include <errno.h>
 #include <logmsg.h>
 
+#define IMAGE_CHUNK_SIZE	(2L * 1024L * 1024L)	/* each pCPU takes 2MB at a time */
+
+/*
+ * An image copy shared by the pCPUs of the VM, which take its chunks in
+ * turn. It lives on the stack of the pCPU loading the VM, which waits
+ * until no helper uses it any more.
+ */
+struct image_copy {
+	struct acrn_vm *vm;
+	uint8_t *src;
+	uint64_t gpa;
+	int64_t size;
+	int64_t next;			/* offset of the next chunk to take */
+	volatile uint32_t helpers;	/* helpers still in copy_image_helper() */
+	int32_t ret;
+};
+
+static void copy_image_chunks(struct image_copy *copy)
+{
+	int64_t offset = atomic_xadd64(&copy->next, IMAGE_CHUNK_SIZE);
+	uint32_t len;
+
+	while (offset < copy->size) {
+		len = (uint32_t)min(IMAGE_CHUNK_SIZE, copy->size - offset);
+		if (copy_to_gpa(copy->vm, copy->src + offset, copy->gpa + (uint64_t)offset, len) != 0) {
+			copy->ret = -EINVAL;
+		}
+		offset = atomic_xadd64(&copy->next, IMAGE_CHUNK_SIZE);
+	}
+}
+
+static void copy_image_helper(void *data)
+{
+	struct image_copy *copy = (struct image_copy *)data;
+
+	copy_image_chunks(copy);
+	/* the copy is gone as soon as the last helper is out */
+	atomic_dec32((uint32_t *)&copy->helpers);
+}
+
+/**
+ * @pre vm != NULL
+ *
+ * Copy an image to the VM with the help of its other pCPUs: the copies of
+ * several VMs run each on their own pCPUs, the copy of a large image is
+ * spread over all of them.
+ */
+int32_t copy_image_to_gpa(struct acrn_vm *vm, void *h_ptr, uint64_t gpa, uint32_t size)
+{
+	struct image_copy copy = {
+		.vm = vm, .src = (uint8_t *)h_ptr, .gpa = gpa, .size = (int64_t)size,
+		.next = 0L, .helpers = 0U, .ret = 0,
+	};
+	uint64_t helpers = 0UL;
+	uint16_t pcpu_id, self = get_pcpu_id();
+
+	if ((int64_t)size > IMAGE_CHUNK_SIZE) {
+		for (pcpu_id = 0U; pcpu_id < MAX_PCPU_NUM; pcpu_id++) {
+			if ((pcpu_id != self) && ((vm->hw.cpu_affinity & (1UL << pcpu_id)) != 0UL) &&
+					is_pcpu_active(pcpu_id)) {
+				helpers |= 1UL << pcpu_id;
+				copy.helpers++;
+			}
+		}
+	}
+
+	if (helpers != 0UL) {
+		smp_call_function_async(helpers, copy_image_helper, &copy);
+	}
+	copy_image_chunks(&copy);
+	while (copy.helpers != 0U) {
+		asm_pause();
+	}
+
+	return copy.ret;
+}
+
 /**
  * @pre sw_module != NULL
  */
 void load_sw_module(struct acrn_vm *vm, struct sw_module_info *sw_module)
 {
 	if ((sw_module->size != 0) && (sw_module->load_addr != NULL)) {
-		(void)copy_to_gpa(vm, sw_module->src_addr, (uint64_t)sw_module->load_addr, sw_module->size);
+		(void)copy_image_to_gpa(vm, sw_module->src_addr, (uint64_t)sw_module->load_addr, sw_module->size);
 	}
 }
 
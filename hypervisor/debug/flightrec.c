@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <types.h>
+#include <rtl.h>
+#include <asm/cpu.h>
+#include <asm/per_cpu.h>
+#include <ticks.h>
+#include <sbuf.h>
+#include <trace.h>
+#include <logmsg.h>
+#include <flightrec.h>
+
+/* an overwrite mode sbuf keeps (ele_num - 1) entries */
+#define FLIGHTREC_NR_ENTRIES	128U
+#define FLIGHTREC_BUF_SIZE	(SBUF_HEAD_SIZE + (FLIGHTREC_NR_ENTRIES * sizeof(struct trace_entry)))
+
+static uint8_t flightrec_buf[MAX_PCPU_NUM][FLIGHTREC_BUF_SIZE] __aligned(64);
+static volatile bool flightrec_frozen;
+
+static inline struct shared_buf *flightrec_sbuf(uint16_t pcpu_id)
+{
+	return (struct shared_buf *)flightrec_buf[pcpu_id];
+}
+
+void flightrec_init(uint16_t pcpu_id)
+{
+	struct shared_buf *sbuf = flightrec_sbuf(pcpu_id);
+
+	(void)memset(sbuf, 0U, SBUF_HEAD_SIZE);
+	sbuf->magic = SBUF_MAGIC;
+	sbuf->ele_num = FLIGHTREC_NR_ENTRIES;
+	sbuf->ele_size = (uint32_t)sizeof(struct trace_entry);
+	sbuf->size = FLIGHTREC_NR_ENTRIES * (uint32_t)sizeof(struct trace_entry);
+	sbuf->flags = OVERWRITE_EN | OVERRUN_CNT_EN;
+}
+
+static void flightrec_put_entry(uint32_t evid, struct trace_entry *entry)
+{
+	uint16_t pcpu_id = get_pcpu_id();
+	struct shared_buf *sbuf = flightrec_sbuf(pcpu_id);
+
+	if (!flightrec_frozen && (sbuf->magic == SBUF_MAGIC)) {
+		entry->tsc = cpu_ticks();
+		entry->id = evid;
+		entry->n_data = 2U;
+		entry->cpu = (uint8_t)pcpu_id;
+		(void)sbuf_put(sbuf, (uint8_t *)entry);
+	}
+}
+
+void flightrec_put(uint32_t evid, uint64_t e, uint64_t f)
+{
+	struct trace_entry entry;
+
+	entry.payload.fields_64.e = e;
+	entry.payload.fields_64.f = f;
+	flightrec_put_entry(evid, &entry);
+}
+
+void flightrec_put_str(uint32_t evid, const char *str)
+{
+	struct trace_entry entry;
+
+	(void)strncpy_s(entry.payload.str, sizeof(entry.payload.str), str, sizeof(entry.payload.str) - 1U);
+	flightrec_put_entry(evid, &entry);
+}
+
+static void flightrec_dump_entry(const struct trace_entry *entry)
+{
+	switch (entry->id) {
+	case FLIGHTREC_VM_EXIT:
+		pr_acrnlog("= 0x%016lx VM exit  reason=0x%lx rip=0x%lx", entry->tsc,
+				entry->payload.fields_64.e, entry->payload.fields_64.f);
+		break;
+	case FLIGHTREC_SCHED:
+		pr_acrnlog("= 0x%016lx switch  to %s", entry->tsc, entry->payload.str);
+		break;
+	case FLIGHTREC_IRQ:
+		pr_acrnlog("= 0x%016lx irq     vector=0x%lx irq=%lu", entry->tsc,
+				entry->payload.fields_64.e, entry->payload.fields_64.f);
+		break;
+	default:
+		pr_acrnlog("= 0x%016lx event %lu", entry->tsc, (uint64_t)entry->id);
+		break;
+	}
+}
+
+void flightrec_dump(bool thaw)
+{
+	const struct shared_buf *sbuf;
+	uint16_t pcpu_id;
+	uint32_t pos;
+
+	flightrec_frozen = true;
+	/* let the puts in flight on the other pCPUs land */
+	cpu_write_memory_barrier();
+
+	for (pcpu_id = 0U; pcpu_id < get_pcpu_nums(); pcpu_id++) {
+		sbuf = flightrec_sbuf(pcpu_id);
+		if (sbuf->magic != SBUF_MAGIC) {
+			continue;
+		}
+
+		pr_acrnlog("= Flight recorder of pCPU%hu, %u events overwritten:", pcpu_id, sbuf->overrun_cnt);
+		for (pos = sbuf->head; pos != sbuf->tail; pos = sbuf_next_ptr(pos, sbuf->ele_size, sbuf->size)) {
+			flightrec_dump_entry((const struct trace_entry *)((const uint8_t *)sbuf + SBUF_HEAD_SIZE + pos));
+		}
+	}
+
+	if (thaw) {
+		flightrec_frozen = false;
+	}
+}
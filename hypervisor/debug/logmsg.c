@@ -7,7 +7,6 @@
 #include <types.h>
 #include <asm/lib/atomic.h>
 #include <sprintf.h>
-#include <asm/lib/spinlock.h>
 #include <asm/per_cpu.h>
 #include <npk_log.h>
 #include <logmsg.h>
@@ -20,28 +19,116 @@
 
 struct acrn_logmsg_ctl {
 	int32_t seq;
-	spinlock_t lock;
+	/* set once the console timer drains the console rings */
+	bool console_deferred;
 };
 
 static struct acrn_logmsg_ctl logmsg_ctl;
 
+/*
+ * The messages for the console are queued per pCPU, and printed later by the
+ * console timer on the BSP, so the pCPUs logging at the same time neither
+ * wait for the UART nor for each other. Each ring has one producer, its pCPU,
+ * and one consumer, the console timer, so it needs no lock.
+ */
+#define CONSOLE_RING_SIZE	32U
+
+struct console_msg {
+	int32_t seq;
+	char buf[LOG_MESSAGE_MAX_SIZE];
+};
+
+struct console_ring {
+	volatile uint32_t head;	/* next to print, moved by the consumer */
+	volatile uint32_t tail;	/* next to fill, moved by the producer */
+	uint32_t dropped;	/* moved by the producer */
+	uint32_t dropped_shown;	/* moved by the consumer */
+	struct console_msg msgs[CONSOLE_RING_SIZE];
+};
+
+static struct console_ring console_rings[MAX_PCPU_NUM];
+
 void init_logmsg()
 {
 	logmsg_ctl.seq = 0;
+	logmsg_ctl.console_deferred = false;
+}
+
+void logmsg_defer_console(void)
+{
+	logmsg_ctl.console_deferred = true;
+}
+
+static void console_ring_put(uint16_t pcpu_id, int32_t seq, const char *buffer)
+{
+	struct console_ring *ring = &console_rings[pcpu_id];
+	uint32_t tail = ring->tail;
+	uint32_t next = (tail + 1U) % CONSOLE_RING_SIZE;
+
+	if (next == ring->head) {
+		/* the message is still in the memory log, if it is on */
+		ring->dropped++;
+	} else {
+		ring->msgs[tail].seq = seq;
+		(void)strncpy_s(ring->msgs[tail].buf, LOG_MESSAGE_MAX_SIZE, buffer, LOG_MESSAGE_MAX_SIZE - 1U);
+		/* make sure write the message before update tail */
+		cpu_write_memory_barrier();
+		ring->tail = next;
+	}
+}
+
+/*
+ * Print the queued console messages of all the pCPUs, merged in the order of
+ * their sequence numbers.
+ *
+ * @pre called by the console timer only, the single consumer of the rings
+ */
+void logmsg_flush_console(void)
+{
+	struct console_ring *ring, *min;
+	uint16_t pcpu_id;
+	uint32_t dropped;
+
+	do {
+		min = NULL;
+		for (pcpu_id = 0U; pcpu_id < get_pcpu_nums(); pcpu_id++) {
+			ring = &console_rings[pcpu_id];
+			if (ring->head != ring->tail) {
+				/* make sure read the message after the tail */
+				cpu_memory_barrier();
+				if ((min == NULL) || ((ring->msgs[ring->head].seq - min->msgs[min->head].seq) < 0)) {
+					min = ring;
+				}
+			}
+		}
 
-	spinlock_init(&(logmsg_ctl.lock));
+		if (min != NULL) {
+			printf("%s\n\r", min->msgs[min->head].buf);
+			min->head = (min->head + 1U) % CONSOLE_RING_SIZE;
+		}
+	} while (min != NULL);
+
+	for (pcpu_id = 0U; pcpu_id < get_pcpu_nums(); pcpu_id++) {
+		ring = &console_rings[pcpu_id];
+		dropped = ring->dropped - ring->dropped_shown;
+		if (dropped != 0U) {
+			ring->dropped_shown += dropped;
+			printf("[cpu=%hu] %u console messages dropped\n\r", pcpu_id, dropped);
+		}
+	}
 }
 
 void do_logmsg(uint32_t severity, const char *fmt, ...)
 {
 	va_list args;
-	uint64_t timestamp, rflags;
+	uint64_t timestamp;
 	uint16_t pcpu_id;
 	bool do_console_log;
 	bool do_mem_log;
 	bool do_npk_log;
 	char *buffer;
 	struct thread_object *current;
+	int32_t seq;
 
 	do_console_log = (severity <= console_loglevel);
 	do_mem_log = (severity <= mem_loglevel);
@@ -61,11 +148,12 @@ void do_logmsg(uint32_t severity, const char *fmt, ...)
 	pcpu_id = get_pcpu_id();
 	buffer = per_cpu(logbuf, pcpu_id);
 	current = sched_get_current(pcpu_id);
+	seq = atomic_inc_return(&logmsg_ctl.seq);
 
 	(void)memset(buffer, 0U, LOG_MESSAGE_MAX_SIZE);
 	/* Put time-stamp, CPU ID and severity into buffer */
 	snprintf(buffer, LOG_MESSAGE_MAX_SIZE, "[%luus][cpu=%hu][%s][sev=%u][seq=%u]:",
-			timestamp, pcpu_id, current->name, severity, atomic_inc_return(&logmsg_ctl.seq));
+			timestamp, pcpu_id, current->name, severity, seq);
 
 	/* Put message into remaining portion of local buffer */
 	va_start(args, fmt);
@@ -81,12 +169,12 @@ void do_logmsg(uint32_t severity, const char *fmt, ...)
 
 	/* Check whether output to stdout */
 	if (do_console_log) {
-		spinlock_irqsave_obtain(&(logmsg_ctl.lock), &rflags);
-
-		/* Send buffer to stdout */
-		printf("%s\n\r", buffer);
-
-		spinlock_irqrestore_release(&(logmsg_ctl.lock), rflags);
+		if (logmsg_ctl.console_deferred && (severity != LOG_FATAL)) {
+			console_ring_put(pcpu_id, seq, buffer);
+		} else {
+			/* a fatal message may be the last one, e.g. of a panic */
+			printf("%s\n\r", buffer);
+		}
 	}
 
 	/* Check whether output to memory */
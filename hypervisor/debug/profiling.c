@@ -13,6 +13,7 @@
 #include <asm/vmx.h>
 #include <asm/cpuid.h>
 #include <asm/guest/vm.h>
+#include <asm/guest/vpmu.h>
 #include <sprintf.h>
 #include <logmsg.h>
 #include <ticks.h>
@@ -28,6 +29,12 @@
 #define LVT_PERFCTR_BIT_UNMASK		0xFFFEFFFFU
 #define LVT_PERFCTR_BIT_MASK		0x10000U
 #define VALID_DEBUGCTL_BIT_MASK		0x1801U
+#define PERF_OVF_PEBS_BUFFER		(1UL << 62U)
+#define PERF_CAP_PEBS_FORMAT(cap)	((uint32_t)(((cap) >> 8U) & 0xFU))
+#define PERF_CAP_LBR_FORMAT(cap)	((uint32_t)((cap) & 0x3FU))
+#define LBR_FORMAT_INFO			5U
+#define PEBS_FORMAT_ADAPTIVE		4U
+#define PEBS_DATA_CFG_MEMINFO		(1UL << 0U)
 
 static uint64_t sep_collection_switch;
 static uint64_t socwatch_collection_switch;
@@ -92,6 +99,69 @@ static void profiling_initialize_pmi(void)
 		__func__,  get_pcpu_id());
 }
 
+/*
+ * Point the DS save area to the PEBS buffer of the pCPU. IA32_PEBS_ENABLE
+ * itself is programmed by the collector along with the counters.
+ */
+static void profiling_enable_pebs(struct sep_state *ss)
+{
+	struct profiling_ds_area *ds = &ss->ds_area;
+	const struct profiling_msr_op *msrop;
+	uint64_t base = (uint64_t)ss->pebs_buffer;
+	uint32_t i, ctr;
+
+	if ((msr_read(MSR_IA32_MISC_ENABLE) & MSR_IA32_MISC_ENABLE_PEBS_UNAVAIL) != 0UL) {
+		dev_dbg(DBG_LEVEL_ERR_PROFILING, "%s: PEBS unavailable on cpu%d",
+			__func__, get_pcpu_id());
+	} else {
+		(void)memset(ds, 0U, sizeof(*ds));
+		ds->pebs_buffer_base = base;
+		ds->pebs_index = base;
+		ds->pebs_absolute_maximum = base + PEBS_BUFFER_SIZE;
+		/*
+		 * Interrupt on each record, so that it is attributed to the vCPU
+		 * the hypervisor runs for at that time.
+		 */
+		ds->pebs_interrupt_threshold = base + PEBS_MIN_RECORD_SIZE;
+
+		/* the counters reload with the values the collector starts them with */
+		for (i = 0U; i < MAX_MSR_LIST_NUM; i++) {
+			msrop = &(ss->pmi_start_msr_list[ss->current_pmi_group_id][i]);
+			if (msrop->msr_id == (uint32_t)-1) {
+				break;
+			}
+			if ((msrop->msr_op_type == (uint8_t)MSR_OP_WRITE) &&
+					(msrop->reg_type == (uint8_t)PMU_MSR_DATA)) {
+				if ((msrop->msr_id >= MSR_IA32_A_PMC0) &&
+						(msrop->msr_id < (MSR_IA32_A_PMC0 + PEBS_NUM_CTR_RESET))) {
+					ctr = msrop->msr_id - MSR_IA32_A_PMC0;
+					ds->pebs_counter_reset[ctr] = msrop->value;
+				} else if ((msrop->msr_id >= MSR_IA32_PMC0) &&
+						(msrop->msr_id < (MSR_IA32_PMC0 + PEBS_NUM_CTR_RESET))) {
+					ctr = msrop->msr_id - MSR_IA32_PMC0;
+					ds->pebs_counter_reset[ctr] = msrop->value;
+				} else {
+					/* not a general counter */
+				}
+			}
+		}
+
+		ss->pebs_format = PERF_CAP_PEBS_FORMAT(msr_read(MSR_IA32_PERF_CAPABILITIES));
+		msr_write(MSR_IA32_DS_AREA, (uint64_t)ds);
+		ss->pebs_enabled = true;
+	}
+}
+
+static void profiling_disable_pebs(struct sep_state *ss)
+{
+	if (ss->pebs_enabled) {
+		msr_write(MSR_IA32_PEBS_ENABLE, 0UL);
+		msr_write(MSR_IA32_DS_AREA, 0UL);
+		ss->saved_pebs_enable = 0UL;
+		ss->pebs_enabled = false;
+	}
+}
+
 /*
  * Enable all the Performance Monitoring Control registers.
  */
@@ -113,6 +183,9 @@ static void profiling_enable_pmu(void)
 		return;
 	}
 
+	/* take the PMU from the vPMU of the guests */
+	vpmu_set_host_owned(true);
+
 	/* Unmask LAPIC LVT entry for PMC register */
 	lvt_perf_ctr = (uint32_t) msr_read(MSR_IA32_EXT_APIC_LVT_PMI);
 	dev_dbg(DBG_LEVEL_PROFILING, "%s: 0x%x, 0x%lx",
@@ -146,6 +219,12 @@ static void profiling_enable_pmu(void)
 		  (ss->guest_debugctl_value & VALID_DEBUGCTL_BIT_MASK));
 	}
 
+	if ((sep_collection_switch &
+				(1UL << (uint64_t)PEBS_PMU_SAMPLING)) > 0UL) {
+		profiling_enable_pebs(ss);
+	}
+	ss->lbr_format = PERF_CAP_LBR_FORMAT(msr_read(MSR_IA32_PERF_CAPABILITIES));
+
 	group_id = ss->current_pmi_group_id;
 	for (i = 0U; i < MAX_MSR_LIST_NUM; i++) {
 		msrop = &(ss->pmi_start_msr_list[group_id][i]);
@@ -209,6 +288,8 @@ static void profiling_disable_pmu(void)
 			}
 		}
 
+		profiling_disable_pebs(ss);
+
 		/* Mask LAPIC LVT entry for PMC register */
 		lvt_perf_ctr = (uint32_t) msr_read(MSR_IA32_EXT_APIC_LVT_PMI);
 
@@ -217,6 +298,9 @@ static void profiling_disable_pmu(void)
 
 		ss->pmu_state = PMU_SETUP;
 
+		/* give the PMU back to the vPMU of the guests */
+		vpmu_set_host_owned(false);
+
 		dev_dbg(DBG_LEVEL_PROFILING, "%s: exiting cpu%d",
 			__func__,  get_pcpu_id());
 	} else {
@@ -311,6 +395,9 @@ static int32_t profiling_generate_data(int32_t collector, uint32_t type)
 	void *payload = NULL;
 	struct shared_buf *sbuf = NULL;
 	struct sep_state *ss = &(get_cpu_var(profiling_info.s_state));
+	struct pebs_pmu_sample *pebs = &(get_cpu_var(profiling_info.pebs_sample));
+	uint64_t pebs_size = 0UL;
+	bool with_lbr = false;
 	struct sw_msr_op_info *sw_msrop
 		= &(get_cpu_var(profiling_info.sw_msr_info));
 	uint64_t rflags;
@@ -356,6 +443,19 @@ static int32_t profiling_generate_data(int32_t collector, uint32_t type)
 					+ LBR_PMU_SAMPLE_SIZE;
 				payload = &get_cpu_var(profiling_info.p_sample);
 				break;
+			case PEBS_PMU_SAMPLING:
+				/* the core sample, the PEBS records, then the LBRs if sampled */
+				pebs_size = PEBS_PMU_SAMPLE_HDR_SIZE
+					+ (pebs->num_records * PEBS_RECORD_SIZE);
+				with_lbr = ((sep_collection_switch &
+						(1UL << (uint64_t)LBR_PMU_SAMPLING)) > 0UL);
+				payload_size = CORE_PMU_SAMPLE_SIZE + pebs_size;
+				if (with_lbr) {
+					payload_size += LBR_PMU_SAMPLE_SIZE;
+					pkt_header.data_type |= (uint16_t)(1U << LBR_PMU_SAMPLING);
+				}
+				payload = &get_cpu_var(profiling_info.p_sample);
+				break;
 			case VM_SWITCH_TRACING:
 				payload_size = VM_SWITCH_TRACE_SIZE;
 				payload = &get_cpu_var(profiling_info.vm_trace);
@@ -384,8 +484,21 @@ static int32_t profiling_generate_data(int32_t collector, uint32_t type)
 				(void)sbuf_put(sbuf, (uint8_t *)&pkt_header + i * SEP_BUF_ENTRY_SIZE);
 			}
 
-			for (i = 0U; i < (((payload_size - 1U) / SEP_BUF_ENTRY_SIZE) + 1U); i++) {
-				(void)sbuf_put(sbuf, (uint8_t *)payload + i * SEP_BUF_ENTRY_SIZE);
+			if (type == PEBS_PMU_SAMPLING) {
+				/* the parts are whole entries, but not contiguous */
+				(void)profiling_sbuf_put_variable(sbuf,
+					(uint8_t *)payload, (uint32_t)CORE_PMU_SAMPLE_SIZE);
+				(void)profiling_sbuf_put_variable(sbuf,
+					(uint8_t *)pebs, (uint32_t)pebs_size);
+				if (with_lbr) {
+					(void)profiling_sbuf_put_variable(sbuf,
+						(uint8_t *)&get_cpu_var(profiling_info.p_sample).lsample,
+						(uint32_t)LBR_PMU_SAMPLE_SIZE);
+				}
+			} else {
+				for (i = 0U; i < (((payload_size - 1U) / SEP_BUF_ENTRY_SIZE) + 1U); i++) {
+					(void)sbuf_put(sbuf, (uint8_t *)payload + i * SEP_BUF_ENTRY_SIZE);
+				}
 			}
 
 			ss->samples_logged++;
@@ -569,6 +682,104 @@ static void profiling_handle_msrops(void)
 		__func__, get_pcpu_id());
 }
 
+/*
+ * Copy the PEBS records of the DS buffer in the PEBS sample, in the
+ * layout of struct pebs_record, and rewind the buffer.
+ */
+static void profiling_drain_pebs(struct sep_state *ss, struct pebs_pmu_sample *pebs)
+{
+	struct profiling_ds_area *ds = &ss->ds_area;
+	struct acrn_vcpu *vcpu = get_running_vcpu(get_pcpu_id());
+	struct pebs_record *out;
+	const uint64_t *rec;
+	uint64_t pos, rec_size;
+
+	(void)memset(pebs, 0U, PEBS_PMU_SAMPLE_HDR_SIZE);
+	for (pos = ds->pebs_buffer_base; pos < ds->pebs_index; pos += rec_size) {
+		if (pebs->num_records == NUM_PEBS_RECORD) {
+			ss->samples_dropped++;
+			break;
+		}
+		rec = (const uint64_t *)pos;
+		out = &pebs->records[pebs->num_records];
+		(void)memset(out, 0U, sizeof(*out));
+
+		if (ss->pebs_format >= PEBS_FORMAT_ADAPTIVE) {
+			/* the basic group, then the memory info group if configured */
+			rec_size = rec[0] >> 48U;
+			out->rip = rec[1];
+			out->applicable_counters = rec[2];
+			out->tsc = rec[3];
+			if ((rec[0] & PEBS_DATA_CFG_MEMINFO) != 0UL) {
+				out->data_linear_address = rec[4];
+				out->data_source = rec[5];
+				out->latency = rec[6];
+			}
+		} else {
+			/* RFLAGS, RIP and the GPRs, then the fields of each format */
+			out->rip = rec[1];
+			switch (ss->pebs_format) {
+			case 0U:
+				rec_size = 0x90UL;
+				break;
+			case 1U:
+				rec_size = 0xB0UL;
+				break;
+			case 2U:
+				rec_size = 0xC0UL;
+				break;
+			default:
+				rec_size = 0xC8UL;
+				out->tsc = rec[24];
+				break;
+			}
+			if (ss->pebs_format >= 1U) {
+				out->applicable_counters = rec[18];
+				out->data_linear_address = rec[19];
+				out->data_source = rec[20];
+				out->latency = rec[21];
+			}
+			if (ss->pebs_format >= 2U) {
+				/* the eventing IP, RIP is the one of the next instruction */
+				out->rip = rec[22];
+			}
+		}
+
+		if (vcpu != NULL) {
+			out->vm_id = vcpu->vm->vm_id;
+			out->vcpu_id = vcpu->vcpu_id;
+		} else {
+			out->vm_id = 0xFFFFU;
+			out->vcpu_id = 0xFFFFU;
+		}
+		pebs->num_records++;
+
+		if (rec_size == 0UL) {
+			break;
+		}
+	}
+
+	ds->pebs_index = ds->pebs_buffer_base;
+}
+
+static void profiling_read_lbr(const struct sep_state *ss, struct lbr_pmu_sample *lsample)
+{
+	uint32_t i;
+
+	lsample->lbr_tos = msr_read(MSR_CORE_LASTBRANCH_TOS);
+	for (i = 0U; i < LBR_NUM_REGISTERS; i++) {
+		lsample->lbr_from_ip[i]
+			= msr_read(MSR_CORE_LASTBRANCH_0_FROM_IP + i);
+		lsample->lbr_to_ip[i]
+			= msr_read(MSR_CORE_LASTBRANCH_0_TO_IP + i);
+		/* mispredict, cycle counts and the call stack flags */
+		if (ss->lbr_format >= LBR_FORMAT_INFO) {
+			lsample->lbr_info[i]
+				= msr_read(MSR_LASTBRANCH_INFO_0 + i);
+		}
+	}
+}
+
 /*
  * Interrupt handler for performance monitoring interrupts
  */
@@ -587,6 +798,12 @@ static void profiling_pmi_handler(uint32_t irq, __unused void *data)
 			__func__, get_pcpu_id());
 		return;
 	}
+
+	/* an overflow of the counters of a guest, while the profiling is off */
+	if (vpmu_handle_pmi()) {
+		return;
+	}
+
 	/* Stop all the counters first */
 	msr_write(MSR_IA32_PERF_GLOBAL_CTRL, 0x0U);
 
@@ -652,13 +869,15 @@ static void profiling_pmi_handler(uint32_t irq, __unused void *data)
 
 	if ((sep_collection_switch &
 				(1UL << (uint64_t)LBR_PMU_SAMPLING)) > 0UL) {
-		psample->lsample.lbr_tos = msr_read(MSR_CORE_LASTBRANCH_TOS);
-		for (i = 0U; i < LBR_NUM_REGISTERS; i++) {
-			psample->lsample.lbr_from_ip[i]
-				= msr_read(MSR_CORE_LASTBRANCH_0_FROM_IP + i);
-			psample->lsample.lbr_to_ip[i]
-				= msr_read(MSR_CORE_LASTBRANCH_0_TO_IP + i);
-		}
+		profiling_read_lbr(ss, &psample->lsample);
+	}
+
+	if (ss->pebs_enabled && ((perf_ovf_status & PERF_OVF_PEBS_BUFFER) != 0UL)) {
+		profiling_drain_pebs(ss, &get_cpu_var(profiling_info.pebs_sample));
+		/* Generate core pmu sample, pebs records and lbr data if any */
+		(void)profiling_generate_data(COLLECT_PROFILE_DATA, PEBS_PMU_SAMPLING);
+	} else if ((sep_collection_switch &
+				(1UL << (uint64_t)LBR_PMU_SAMPLING)) > 0UL) {
 		/* Generate core pmu sample and lbr data */
 		(void)profiling_generate_data(COLLECT_PROFILE_DATA, LBR_PMU_SAMPLING);
 	} else {
@@ -915,6 +1134,7 @@ int32_t profiling_get_version_info(struct acrn_vm *vm, uint64_t addr)
 	ver_info.supported_features = (int64_t)
 					((1U << (uint64_t)CORE_PMU_SAMPLING) |
 					(1U << (uint64_t)CORE_PMU_COUNTING) |
+					(1U << (uint64_t)PEBS_PMU_SAMPLING) |
 					(1U << (uint64_t)LBR_PMU_SAMPLING) |
 					(1U << (uint64_t)VM_SWITCH_TRACING));
 
@@ -999,7 +1219,9 @@ int32_t profiling_set_control(struct acrn_vm *vm, uint64_t addr)
 						profiling_stop_pmu();
 					}
 					break;
+				case PEBS_PMU_SAMPLING:
 				case LBR_PMU_SAMPLING:
+					/* taken into account on the next start of the PMU */
 					break;
 				case VM_SWITCH_TRACING:
 					break;
@@ -1299,6 +1521,16 @@ void profiling_ipi_handler(__unused void *data)
  */
 void profiling_vmenter_handler(__unused struct acrn_vcpu *vcpu)
 {
+	struct sep_state *ss = &get_cpu_var(profiling_info.s_state);
+
+	/* no PEBS in the guests, the records would go through their page tables */
+	if (ss->pebs_enabled) {
+		ss->saved_pebs_enable = msr_read(MSR_IA32_PEBS_ENABLE);
+		if (ss->saved_pebs_enable != 0UL) {
+			msr_write(MSR_IA32_PEBS_ENABLE, 0UL);
+		}
+	}
+
 	if (((get_cpu_var(profiling_info.s_state).pmu_state == PMU_RUNNING) &&
 			((sep_collection_switch &
 				(1UL << (uint64_t)VM_SWITCH_TRACING)) > 0UL)) ||
@@ -1319,6 +1551,11 @@ void profiling_pre_vmexit_handler(struct acrn_vcpu *vcpu)
 
 	exit_reason = vcpu->arch.exit_reason & 0xFFFFUL;
 
+	if (get_cpu_var(profiling_info.s_state).saved_pebs_enable != 0UL) {
+		msr_write(MSR_IA32_PEBS_ENABLE, get_cpu_var(profiling_info.s_state).saved_pebs_enable);
+		get_cpu_var(profiling_info.s_state).saved_pebs_enable = 0UL;
+	}
+
 	if ((get_cpu_var(profiling_info.s_state).pmu_state == PMU_RUNNING) ||
 		(get_cpu_var(profiling_info.soc_state) == SW_RUNNING)) {
 
@@ -1327,7 +1564,7 @@ void profiling_pre_vmexit_handler(struct acrn_vcpu *vcpu)
 			= exit_reason;
 		if (exit_reason == VMX_EXIT_REASON_EXTERNAL_INTERRUPT) {
 			get_cpu_var(profiling_info.vm_info).external_vector
-				= (int32_t)(exec_vmread(VMX_EXIT_INT_INFO) & 0xFFUL);
+				= (int32_t)(vcpu_get_exit_intr_info(vcpu) & 0xFFU);
 		} else {
 			get_cpu_var(profiling_info.vm_info).external_vector = -1;
 		}
@@ -21,7 +21,10 @@
 #include <version.h>
 #include <shell.h>
 #include <asm/guest/vmcs.h>
+#include <asm/guest/ept.h>
 #include <asm/host_pm.h>
+#include <ticks.h>
+#include <cpu_util.h>
 
 #define TEMP_STR_SIZE		60U
 #define MAX_STR_SIZE		256U
@@ -38,6 +41,15 @@ static int32_t shell_cmd_help(__unused int32_t argc, __unused char **argv);
 static int32_t shell_version(__unused int32_t argc, __unused char **argv);
 static int32_t shell_list_vm(__unused int32_t argc, __unused char **argv);
 static int32_t shell_list_vcpu(__unused int32_t argc, __unused char **argv);
+static int32_t shell_show_sched_stats(__unused int32_t argc, __unused char **argv);
+static int32_t shell_show_exit_stats(__unused int32_t argc, __unused char **argv);
+static int32_t shell_top(__unused int32_t argc, __unused char **argv);
+static int32_t shell_show_softirq_stats(__unused int32_t argc, __unused char **argv);
+static int32_t shell_show_io_hotspots(int32_t argc, char **argv);
+static int32_t shell_show_lock_sites(int32_t argc, char **argv);
+static int32_t shell_show_cpuid_stats(__unused int32_t argc, __unused char **argv);
+static int32_t shell_show_msr_stats(__unused int32_t argc, __unused char **argv);
+static int32_t shell_show_ept_pool(__unused int32_t argc, __unused char **argv);
 static int32_t shell_vcpu_dumpreg(int32_t argc, char **argv);
 static int32_t shell_dump_host_mem(int32_t argc, char **argv);
 static int32_t shell_dump_guest_mem(int32_t argc, char **argv);
@@ -77,6 +89,60 @@ static struct shell_cmd shell_cmds[] = {
 		.help_str	= SHELL_CMD_VCPU_LIST_HELP,
 		.fcn		= shell_list_vcpu,
 	},
+	{
+		.str		= SHELL_CMD_SCHED_STATS,
+		.cmd_param	= SHELL_CMD_SCHED_STATS_PARAM,
+		.help_str	= SHELL_CMD_SCHED_STATS_HELP,
+		.fcn		= shell_show_sched_stats,
+	},
+	{
+		.str		= SHELL_CMD_EXIT_STATS,
+		.cmd_param	= SHELL_CMD_EXIT_STATS_PARAM,
+		.help_str	= SHELL_CMD_EXIT_STATS_HELP,
+		.fcn		= shell_show_exit_stats,
+	},
+	{
+		.str		= SHELL_CMD_TOP,
+		.cmd_param	= SHELL_CMD_TOP_PARAM,
+		.help_str	= SHELL_CMD_TOP_HELP,
+		.fcn		= shell_top,
+	},
+	{
+		.str		= SHELL_CMD_SOFTIRQ_STATS,
+		.cmd_param	= SHELL_CMD_SOFTIRQ_STATS_PARAM,
+		.help_str	= SHELL_CMD_SOFTIRQ_STATS_HELP,
+		.fcn		= shell_show_softirq_stats,
+	},
+	{
+		.str		= SHELL_CMD_IO_HOTSPOTS,
+		.cmd_param	= SHELL_CMD_IO_HOTSPOTS_PARAM,
+		.help_str	= SHELL_CMD_IO_HOTSPOTS_HELP,
+		.fcn		= shell_show_io_hotspots,
+	},
+	{
+		.str		= SHELL_CMD_LOCK_SITES,
+		.cmd_param	= SHELL_CMD_LOCK_SITES_PARAM,
+		.help_str	= SHELL_CMD_LOCK_SITES_HELP,
+		.fcn		= shell_show_lock_sites,
+	},
+	{
+		.str		= SHELL_CMD_CPUID_STATS,
+		.cmd_param	= SHELL_CMD_CPUID_STATS_PARAM,
+		.help_str	= SHELL_CMD_CPUID_STATS_HELP,
+		.fcn		= shell_show_cpuid_stats,
+	},
+	{
+		.str		= SHELL_CMD_MSR_STATS,
+		.cmd_param	= SHELL_CMD_MSR_STATS_PARAM,
+		.help_str	= SHELL_CMD_MSR_STATS_HELP,
+		.fcn		= shell_show_msr_stats,
+	},
+	{
+		.str		= SHELL_CMD_EPT_POOL,
+		.cmd_param	= SHELL_CMD_EPT_POOL_PARAM,
+		.help_str	= SHELL_CMD_EPT_POOL_HELP,
+		.fcn		= shell_show_ept_pool,
+	},
 	{
 		.str		= SHELL_CMD_VCPU_DUMPREG,
 		.cmd_param	= SHELL_CMD_VCPU_DUMPREG_PARAM,
@@ -857,6 +923,430 @@ static int32_t shell_list_vcpu(__unused int32_t argc, __unused char **argv)
 	return 0;
 }
 
+static void shell_puts_sched_stats(const char *name, uint16_t pcpu_id, const struct thread_object *obj)
+{
+	char temp_str[MAX_STR_SIZE];
+	struct sched_stats stats;
+	size_t len;
+	uint16_t i;
+
+	sched_get_stats(obj, &stats);
+	snprintf(temp_str, MAX_STR_SIZE, "  %-16s %-10hu %-12lu %-12lu %-10lu\r\n", name, pcpu_id,
+			ticks_to_us(stats.run_ticks) / 1000UL, ticks_to_us(stats.wait_ticks) / 1000UL,
+			stats.nr_switches);
+	shell_puts(temp_str);
+
+	/* wakeup latencies in us, only the buckets hit */
+	len = snprintf(temp_str, MAX_STR_SIZE, "    wakeup latency(us):");
+	for (i = 0U; i < SCHED_LAT_BUCKETS; i++) {
+		if ((stats.wakeup_lat[i] != 0UL) && (len < MAX_STR_SIZE)) {
+			if (i < (SCHED_LAT_BUCKETS - 1U)) {
+				len += snprintf(temp_str + len, MAX_STR_SIZE - len, " <%lu:%lu",
+						1UL << i, stats.wakeup_lat[i]);
+			} else {
+				len += snprintf(temp_str + len, MAX_STR_SIZE - len, " >=%lu:%lu",
+						1UL << (i - 1U), stats.wakeup_lat[i]);
+			}
+		}
+	}
+	shell_puts(temp_str);
+	shell_puts("\r\n");
+}
+
+static int32_t shell_show_sched_stats(__unused int32_t argc, __unused char **argv)
+{
+	char name[TEMP_STR_SIZE];
+	struct acrn_vm *vm;
+	struct acrn_vcpu *vcpu;
+	uint16_t i, idx;
+
+	shell_puts("\r\nTHREAD             PCPU ID    RUN(ms)      WAIT(ms)     SWITCHES"
+		"\r\n======             =======    =======      ========     ========\r\n");
+
+	for (i = 0U; i < get_pcpu_nums(); i++) {
+		if (is_pcpu_active(i)) {
+			snprintf(name, TEMP_STR_SIZE, "idle%hu", i);
+			shell_puts_sched_stats(name, i, &per_cpu(idle, i));
+		}
+	}
+
+	for (idx = 0U; idx < CONFIG_MAX_VM_NUM; idx++) {
+		vm = get_vm_from_vmid(idx);
+		if (is_poweroff_vm(vm)) {
+			continue;
+		}
+		foreach_vcpu(i, vm, vcpu) {
+			snprintf(name, TEMP_STR_SIZE, "vm%hu:vcpu%hu", vm->vm_id, vcpu->vcpu_id);
+			shell_puts_sched_stats(name, pcpuid_from_vcpu(vcpu), &vcpu->thread_obj);
+		}
+	}
+
+	return 0;
+}
+
+static int32_t shell_show_exit_stats(__unused int32_t argc, __unused char **argv)
+{
+	char temp_str[MAX_STR_SIZE];
+	const struct acrn_vmexit_stats *stats;
+	struct acrn_vm *vm;
+	struct acrn_vcpu *vcpu;
+	uint16_t i, idx, reason;
+
+	shell_puts("\r\nVCPU           REASON   COUNT          TOTAL(us)      AVG(ns)"
+		"\r\n====           ======   =====          =========      =======\r\n");
+
+	for (idx = 0U; idx < CONFIG_MAX_VM_NUM; idx++) {
+		vm = get_vm_from_vmid(idx);
+		if (is_poweroff_vm(vm)) {
+			continue;
+		}
+		foreach_vcpu(i, vm, vcpu) {
+			for (reason = 0U; reason < ACRN_VMEXIT_REASONS; reason++) {
+				stats = &vcpu->exit_stats[reason];
+				if (stats->count != 0UL) {
+					snprintf(temp_str, MAX_STR_SIZE, "vm%hu:vcpu%-6hu 0x%-6hx %-14lu %-14lu %lu\r\n",
+						vm->vm_id, vcpu->vcpu_id, reason, stats->count, ticks_to_us(stats->ticks),
+						(ticks_to_us(stats->ticks) * 1000UL) / stats->count);
+					shell_puts(temp_str);
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* the previous snapshot of top, the utilization shown is since then */
+static uint64_t top_tsc;
+static struct acrn_pcpu_util top_pcpu[MAX_PCPU_NUM];
+static struct acrn_vcpu_util top_vcpu[CONFIG_MAX_VM_NUM][MAX_VCPUS_PER_VM];
+
+/* the growth of a counter, in per mille of span */
+static uint64_t top_permille(uint64_t cur, uint64_t prev, uint64_t span)
+{
+	/* lower than before, the counter was reset by a new VM */
+	uint64_t delta = (cur >= prev) ? (cur - prev) : cur;
+	uint64_t ret = 0UL;
+
+	if (span != 0UL) {
+		ret = min((delta * 1000UL) / span, 1000UL);
+	}
+
+	return ret;
+}
+
+static uint64_t top_rate(uint64_t cur, uint64_t prev, uint64_t span_us)
+{
+	uint64_t delta = (cur >= prev) ? (cur - prev) : cur;
+	uint64_t ret = 0UL;
+
+	if (span_us != 0UL) {
+		ret = (delta * 1000000UL) / span_us;
+	}
+
+	return ret;
+}
+
+static int32_t shell_top(__unused int32_t argc, __unused char **argv)
+{
+	char temp_str[MAX_STR_SIZE];
+	struct acrn_pcpu_util putil;
+	struct acrn_vcpu_util vutil;
+	const struct acrn_pcpu_util *pprev;
+	const struct acrn_vcpu_util *vprev;
+	struct acrn_vm *vm;
+	struct acrn_vcpu *vcpu;
+	uint64_t now = cpu_ticks();
+	uint64_t span = now - top_tsc;
+	uint64_t span_us = ticks_to_us(span);
+	uint64_t idle, hv, busy, run, wait, exit;
+	uint64_t vm_run, vm_wait, vm_exit;
+	uint16_t i, idx;
+
+	snprintf(temp_str, MAX_STR_SIZE, "\r\nover the last %lu ms\r\n", span_us / 1000UL);
+	shell_puts(temp_str);
+
+	shell_puts("\r\nPCPU   BUSY%    GUEST%   HV%      IDLE%    EXITS/s"
+		"\r\n====   =====    ======   ===      =====    =======\r\n");
+	for (i = 0U; i < get_pcpu_nums(); i++) {
+		if (is_pcpu_active(i)) {
+			get_pcpu_util(i, &putil);
+			pprev = &top_pcpu[i];
+			idle = top_permille(putil.idle_ticks, pprev->idle_ticks, span);
+			hv = top_permille(putil.hv_ticks, pprev->hv_ticks, span);
+			busy = 1000UL - idle;
+			snprintf(temp_str, MAX_STR_SIZE, "%-6hu %3lu.%lu    %3lu.%lu    %3lu.%lu    %3lu.%lu    %lu\r\n",
+				i, busy / 10UL, busy % 10UL, (busy - min(busy, hv)) / 10UL, (busy - min(busy, hv)) % 10UL,
+				hv / 10UL, hv % 10UL, idle / 10UL, idle % 10UL,
+				top_rate(putil.nr_exits, pprev->nr_exits, span_us));
+			shell_puts(temp_str);
+			top_pcpu[i] = putil;
+		}
+	}
+
+	shell_puts("\r\nVCPU           PCPU   RUN%     WAIT%    EXIT%    EXITS/s"
+		"\r\n====           ====   ====     =====    =====    =======\r\n");
+	for (idx = 0U; idx < CONFIG_MAX_VM_NUM; idx++) {
+		vm = get_vm_from_vmid(idx);
+		if (is_poweroff_vm(vm)) {
+			/* the next VM with this ID starts from zero */
+			(void)memset(top_vcpu[idx], 0U, sizeof(top_vcpu[idx]));
+			continue;
+		}
+		vm_run = 0UL;
+		vm_wait = 0UL;
+		vm_exit = 0UL;
+		foreach_vcpu(i, vm, vcpu) {
+			get_vcpu_util(vcpu, &vutil);
+			vprev = &top_vcpu[idx][vcpu->vcpu_id];
+			run = top_permille(vutil.run_ticks, vprev->run_ticks, span);
+			wait = top_permille(vutil.wait_ticks, vprev->wait_ticks, span);
+			exit = top_permille(vutil.exit_ticks, vprev->exit_ticks, span);
+			snprintf(temp_str, MAX_STR_SIZE, "vm%hu:vcpu%-6hu %-6hu %3lu.%lu    %3lu.%lu    %3lu.%lu    %lu\r\n",
+				vm->vm_id, vcpu->vcpu_id, vutil.pcpu_id, run / 10UL, run % 10UL,
+				wait / 10UL, wait % 10UL, exit / 10UL, exit % 10UL,
+				top_rate(vutil.nr_exits, vprev->nr_exits, span_us));
+			shell_puts(temp_str);
+			top_vcpu[idx][vcpu->vcpu_id] = vutil;
+			vm_run += run;
+			vm_wait += wait;
+			vm_exit += exit;
+		}
+		/* the VM as a whole, in percent of one pCPU */
+		snprintf(temp_str, MAX_STR_SIZE, "vm%-12hu %-6s %3lu.%lu    %3lu.%lu    %3lu.%lu\r\n",
+			vm->vm_id, "-", vm_run / 10UL, vm_run % 10UL, vm_wait / 10UL, vm_wait % 10UL,
+			vm_exit / 10UL, vm_exit % 10UL);
+		shell_puts(temp_str);
+	}
+	top_tsc = now;
+
+	return 0;
+}
+
+static int32_t shell_show_softirq_stats(__unused int32_t argc, __unused char **argv)
+{
+	static const char *const names[NR_SOFTIRQS] = {
+		[SOFTIRQ_TIMER] = "timer",
+		[SOFTIRQ_PTDEV] = "ptdev",
+		[SOFTIRQ_SBUF] = "sbuf",
+	};
+	char temp_str[MAX_STR_SIZE];
+	const struct softirq_stats *stats;
+	uint16_t i, nr;
+
+	shell_puts("\r\nPCPU   SOFTIRQ  COUNT          TOTAL(us)      AVG(ns)    MAX(us)    DEFERRED"
+		"\r\n====   =======  =====          =========      =======    =======    ========\r\n");
+
+	for (i = 0U; i < get_pcpu_nums(); i++) {
+		if (!is_pcpu_active(i)) {
+			continue;
+		}
+		for (nr = 0U; nr < NR_SOFTIRQS; nr++) {
+			stats = &per_cpu(softirq_stats, i)[nr];
+			if (stats->count != 0UL) {
+				snprintf(temp_str, MAX_STR_SIZE, "%-6hu %-8s %-14lu %-14lu %-10lu %-10lu %lu\r\n",
+					i, names[nr], stats->count, ticks_to_us(stats->ticks),
+					(ticks_to_us(stats->ticks) * 1000UL) / stats->count,
+					ticks_to_us(stats->max_ticks), stats->deferred);
+				shell_puts(temp_str);
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int32_t shell_show_io_hotspots(int32_t argc, char **argv)
+{
+	char temp_str[MAX_STR_SIZE];
+	struct acrn_vm_io_hotspots hotspots;
+	const struct acrn_io_hotspot *hs;
+	struct acrn_vm *vm;
+	bool reset = false;
+	uint16_t idx;
+	uint32_t i;
+	int32_t ret = 0;
+
+	if (argc == 2) {
+		if (strcmp(argv[1], "-r") == 0) {
+			reset = true;
+		} else {
+			ret = -EINVAL;
+		}
+	} else if (argc != 1) {
+		ret = -EINVAL;
+	} else {
+		/* no option */
+	}
+
+	if (ret == 0) {
+		shell_puts("\r\nVM   TYPE  ADDR                RIP                 COUNT          IN"
+			"\r\n==   ====  ====                ===                 =====          ==\r\n");
+
+		for (idx = 0U; idx < CONFIG_MAX_VM_NUM; idx++) {
+			vm = get_vm_from_vmid(idx);
+			if (is_poweroff_vm(vm)) {
+				continue;
+			}
+			io_hotspot_get(&vm->io_hotspots, &hotspots, reset);
+			for (i = 0U; i < ACRN_IO_HOTSPOT_NUM; i++) {
+				hs = &hotspots.hotspot[i];
+				if (hs->count == 0UL) {
+					break;
+				}
+				/* scale the sampled counts back to estimated accesses */
+				snprintf(temp_str, MAX_STR_SIZE, "vm%-2hu %-5s 0x%016lx  0x%016lx  %-14lu %s\r\n",
+					vm->vm_id, (hs->type == ACRN_IO_HOTSPOT_PIO) ? "PIO" : "MMIO", hs->addr, hs->rip,
+					hs->count << hotspots.sample_shift, (hs->in_hv != 0U) ? "HV" : "DM");
+				shell_puts(temp_str);
+			}
+		}
+	}
+
+	return ret;
+}
+
+static int32_t shell_show_lock_sites(int32_t argc, char **argv)
+{
+	char temp_str[MAX_STR_SIZE];
+	struct lock_site sites[LOCK_SITE_NUM];
+	struct acrn_vm *vm;
+	bool reset = false;
+	uint64_t total;
+	uint16_t idx;
+	uint32_t i;
+	int32_t ret = 0;
+
+	if (argc == 2) {
+		if (strcmp(argv[1], "-r") == 0) {
+			reset = true;
+		} else {
+			ret = -EINVAL;
+		}
+	} else if (argc != 1) {
+		ret = -EINVAL;
+	} else {
+		/* no option */
+	}
+
+	if (ret == 0) {
+		shell_puts("\r\nVM   RIP                 COUNT          IN_HV          TOTAL"
+			"\r\n==   ===                 =====          =====          =====\r\n");
+
+		for (idx = 0U; idx < CONFIG_MAX_VM_NUM; idx++) {
+			vm = get_vm_from_vmid(idx);
+			if (is_poweroff_vm(vm)) {
+				continue;
+			}
+			lock_sites_get(&vm->lock_sites, sites, &total, reset);
+			for (i = 0U; i < LOCK_SITE_NUM; i++) {
+				if (sites[i].count == 0UL) {
+					break;
+				}
+				snprintf(temp_str, MAX_STR_SIZE, "vm%-2hu 0x%016lx  %-14lu %-14lu %lu\r\n",
+					vm->vm_id, sites[i].rip, sites[i].count, sites[i].in_hv, total);
+				shell_puts(temp_str);
+			}
+		}
+	}
+
+	return ret;
+}
+
+static int32_t shell_show_cpuid_stats(__unused int32_t argc, __unused char **argv)
+{
+	char temp_str[MAX_STR_SIZE];
+	struct acrn_vm *vm;
+	struct acrn_vcpu *vcpu;
+	uint16_t i, idx;
+	uint32_t slot;
+
+	shell_puts("\r\nVCPU           LEAF         COUNT"
+		"\r\n====           ====         =====\r\n");
+
+	for (idx = 0U; idx < CONFIG_MAX_VM_NUM; idx++) {
+		vm = get_vm_from_vmid(idx);
+		if (is_poweroff_vm(vm)) {
+			continue;
+		}
+		foreach_vcpu(i, vm, vcpu) {
+			for (slot = 0U; slot < VCPUID_LEAF_SLOTS; slot++) {
+				if (vcpu->cpuid_exits[slot] != 0UL) {
+					snprintf(temp_str, MAX_STR_SIZE, "vm%hu:vcpu%-6hu 0x%-10x %lu\r\n",
+						vm->vm_id, vcpu->vcpu_id, vcpuid_slot_leaf(slot), vcpu->cpuid_exits[slot]);
+					shell_puts(temp_str);
+				}
+			}
+			if (vcpu->cpuid_exits[VCPUID_OTHER_LEAF_SLOT] != 0UL) {
+				snprintf(temp_str, MAX_STR_SIZE, "vm%hu:vcpu%-6hu %-12s %lu\r\n",
+					vm->vm_id, vcpu->vcpu_id, "other", vcpu->cpuid_exits[VCPUID_OTHER_LEAF_SLOT]);
+				shell_puts(temp_str);
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int32_t shell_show_msr_stats(__unused int32_t argc, __unused char **argv)
+{
+	char temp_str[MAX_STR_SIZE];
+	struct acrn_vm *vm;
+	struct acrn_vcpu *vcpu;
+	uint16_t i, idx;
+	uint32_t slot;
+
+	shell_puts("\r\nVCPU           MSR          COUNT"
+		"\r\n====           ===          =====\r\n");
+
+	for (idx = 0U; idx < CONFIG_MAX_VM_NUM; idx++) {
+		vm = get_vm_from_vmid(idx);
+		if (is_poweroff_vm(vm)) {
+			continue;
+		}
+		foreach_vcpu(i, vm, vcpu) {
+			for (slot = 0U; slot < VMSR_EXIT_OTHER_SLOT; slot++) {
+				if (vcpu->msr_exits[slot] != 0UL) {
+					snprintf(temp_str, MAX_STR_SIZE, "vm%hu:vcpu%-6hu 0x%-10x %lu\r\n",
+						vm->vm_id, vcpu->vcpu_id, vmsr_exit_slot_to_msr(slot), vcpu->msr_exits[slot]);
+					shell_puts(temp_str);
+				}
+			}
+			if (vcpu->msr_exits[VMSR_EXIT_OTHER_SLOT] != 0UL) {
+				snprintf(temp_str, MAX_STR_SIZE, "vm%hu:vcpu%-6hu %-12s %lu\r\n",
+					vm->vm_id, vcpu->vcpu_id, "other", vcpu->msr_exits[VMSR_EXIT_OTHER_SLOT]);
+				shell_puts(temp_str);
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int32_t shell_show_ept_pool(__unused int32_t argc, __unused char **argv)
+{
+	char temp_str[MAX_STR_SIZE];
+	struct page_pool_stats stats;
+	struct acrn_vm *vm;
+	uint16_t idx;
+
+	shell_puts("\r\nVM ID    TOTAL PAGES    USED PAGES    PEAK PAGES    FAILED ALLOCS"
+		"\r\n=====    ===========    ==========    ==========    =============\r\n");
+
+	for (idx = 0U; idx < CONFIG_MAX_VM_NUM; idx++) {
+		vm = get_vm_from_vmid(idx);
+		if (is_poweroff_vm(vm)) {
+			continue;
+		}
+		get_ept_page_pool_stats(idx, &stats);
+		snprintf(temp_str, MAX_STR_SIZE, "  %-6hu %-14lu %-13lu %-13lu %-13lu\r\n", idx,
+				stats.total_pages, stats.used_pages, stats.peak_pages, stats.failed_allocs);
+		shell_puts(temp_str);
+	}
+
+	return 0;
+}
+
 #define DUMPREG_SP_SIZE	32
 /* the input 'data' must != NULL and indicate a vcpu structure pointer */
 static void dump_vcpu_reg(void *data)
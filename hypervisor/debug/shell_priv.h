@@ -59,6 +59,46 @@ struct shell {
 #define SHELL_CMD_VCPU_LIST_PARAM	NULL
 #define SHELL_CMD_VCPU_LIST_HELP	"List all vCPUs in all VMs"
 
+#define SHELL_CMD_SCHED_STATS		"sched_stats"
+#define SHELL_CMD_SCHED_STATS_PARAM	NULL
+#define SHELL_CMD_SCHED_STATS_HELP	"Show run time, wait time, switches and wakeup latencies of all vCPUs and"\
+					" pCPU idle threads"
+
+#define SHELL_CMD_EXIT_STATS		"exit_stats"
+#define SHELL_CMD_EXIT_STATS_PARAM	NULL
+#define SHELL_CMD_EXIT_STATS_HELP	"Show the number and the handling time of the VM exits of all vCPUs,"					" per exit reason"
+
+#define SHELL_CMD_TOP			"top"
+#define SHELL_CMD_TOP_PARAM		NULL
+#define SHELL_CMD_TOP_HELP		"Show the busy, guest and hypervisor time of the pCPUs and the run, wait"\
+					" and VM exit time of the vCPUs, since the previous top or boot"
+
+#define SHELL_CMD_SOFTIRQ_STATS		"softirq_stats"
+#define SHELL_CMD_SOFTIRQ_STATS_PARAM	NULL
+#define SHELL_CMD_SOFTIRQ_STATS_HELP	"Show the runs, the time and the deferrals of the softirqs, per pCPU"
+
+#define SHELL_CMD_IO_HOTSPOTS		"io_hotspots"
+#define SHELL_CMD_IO_HOTSPOTS_PARAM	"[-r]"
+#define SHELL_CMD_IO_HOTSPOTS_HELP	"Show the port I/O and MMIO accesses the VMs trap on most, sampled, per guest"\
+					" RIP. -r clears the samples once shown"
+
+#define SHELL_CMD_LOCK_SITES		"lock_sites"
+#define SHELL_CMD_LOCK_SITES_PARAM	"[-r]"
+#define SHELL_CMD_LOCK_SITES_HELP	"Show the guest RIPs the VMs emulate split-lock and uc-lock instructions at"\
+					" most. -r clears the counts once shown"
+
+#define SHELL_CMD_CPUID_STATS		"cpuid_stats"
+#define SHELL_CMD_CPUID_STATS_PARAM	NULL
+#define SHELL_CMD_CPUID_STATS_HELP	"Show the number of CPUID VM exits of all vCPUs, per leaf"
+
+#define SHELL_CMD_MSR_STATS		"msr_stats"
+#define SHELL_CMD_MSR_STATS_PARAM	NULL
+#define SHELL_CMD_MSR_STATS_HELP	"Show the number of RDMSR/WRMSR VM exits of all vCPUs, per MSR"
+
+#define SHELL_CMD_EPT_POOL		"ept_pool"
+#define SHELL_CMD_EPT_POOL_PARAM	NULL
+#define SHELL_CMD_EPT_POOL_HELP		"Show the usage of the EPT page pool of all VMs"
+
 #define SHELL_CMD_VCPU_DUMPREG		"vcpu_dumpreg"
 #define SHELL_CMD_VCPU_DUMPREG_PARAM	"<vm id, vcpu id>"
 #define SHELL_CMD_VCPU_DUMPREG_HELP	"Dump registers for a specific vCPU"
@@ -7,6 +7,7 @@
 #include <types.h>
 #include <asm/per_cpu.h>
 #include <ticks.h>
+#include <rtl.h>
 #include <trace.h>
 
 #define TRACE_CUSTOM			0xFCU
@@ -14,30 +15,184 @@
 #define TRACE_FUNC_EXIT			0xFEU
 #define TRACE_STR			0xFFU
 
-/* sizeof(trace_entry) == 4 x 64bit */
-struct trace_entry {
-	uint64_t tsc; /* TSC */
-	uint64_t id:48;
-	uint8_t n_data; /* nr of data in trace_entry */
-	uint8_t cpu; /* pcpu id of trace_entry */
-
-	union {
-		struct {
-			uint32_t a, b, c, d;
-		} fields_32;
-		struct {
-			uint8_t a1, a2, a3, a4;
-			uint8_t b1, b2, b3, b4;
-			uint8_t c1, c2, c3, c4;
-			uint8_t d1, d2, d3, d4;
-		} fields_8;
-		struct {
-			uint64_t e;
-			uint64_t f;
-		} fields_64;
-		char str[16];
-	} payload;
-} __aligned(8);
+uint64_t trace_event_mask[TRACE_MASK_WORDS] = {
+	[0 ... (TRACE_MASK_WORDS - 1U)] = ~0UL
+};
+
+/*
+ * Compact trace format, used in place of trace_entry when the consumer sets
+ * VARLEN_EN on the trace sbuf of a pCPU. The sbuf then holds a stream of
+ * records, each starting with a tag byte:
+ *
+ * TRACE_REC_SYNC	u64 TSC, the base of the delta of the next event
+ * TRACE_REC_DEF	u8 tag, u8 kind, varint evid: the events with that tag are evid
+ * TRACE_REC_RAW	u8 kind, varint evid, then as an event with a tag
+ * >= TRACE_REC_TAG_BASE	varint TSC delta from the previous event, payload
+ *
+ * The payload of a TRACE_KIND_2L or TRACE_KIND_4I event is its fields as
+ * varints, the one of TRACE_KIND_6C its 6 bytes and the one of TRACE_KIND_STR
+ * a u8 length and the characters. Varints are base 128, least significant
+ * group first, with bit 7 set in all the bytes but the last one.
+ *
+ * A put into an empty sbuf starts over with a SYNC and new definitions, so the
+ * records after any point the consumer emptied the sbuf at decode on their own.
+ * The evids of the tags are looked up in a few slots from a hash of the evid,
+ * an evid that finds them all taken by others goes out as TRACE_REC_RAW.
+ */
+#define TRACE_REC_SYNC		0U
+#define TRACE_REC_DEF		1U
+#define TRACE_REC_RAW		2U
+#define TRACE_REC_TAG_BASE	3U
+#define TRACE_NR_TAGS		(256U - TRACE_REC_TAG_BASE)
+#define TRACE_TAG_PROBES	4U
+
+#define TRACE_KIND_2L		0U
+#define TRACE_KIND_4I		1U
+#define TRACE_KIND_6C		2U
+#define TRACE_KIND_STR		3U
+
+/* SYNC, DEF, the tag, the TSC delta and two 64-bit varints fit in it */
+#define TRACE_REC_MAX_SIZE	64U
+
+struct trace_compact {
+	uint64_t last_tsc;
+	uint32_t tag_evid[TRACE_NR_TAGS];
+	bool tag_used[TRACE_NR_TAGS];
+};
+
+static struct trace_compact trace_compact[MAX_PCPU_NUM];
+
+static uint32_t put_varint(uint8_t *buf, uint64_t v_arg)
+{
+	uint64_t v = v_arg;
+	uint32_t n = 0U;
+
+	while (v >= 0x80UL) {
+		buf[n] = (uint8_t)(v | 0x80UL);
+		v >>= 7U;
+		n++;
+	}
+	buf[n] = (uint8_t)v;
+
+	return n + 1U;
+}
+
+/* spread the VM exit events, 0x10000 + reason, away from the others */
+static inline uint32_t trace_tag_hash(uint32_t evid)
+{
+	return (((evid >> 16U) * 0x80U) + evid) % TRACE_NR_TAGS;
+}
+
+/*
+ * @pre n_data is one of 2, 4, 8 and 16, as set by the TRACE_* functions
+ */
+static void trace_put_compact(struct shared_buf *sbuf, uint16_t cpu_id, uint32_t evid, uint32_t n_data,
+		const struct trace_entry *entry)
+{
+	struct trace_compact *tc = &trace_compact[cpu_id];
+	uint8_t rec[TRACE_REC_MAX_SIZE];
+	uint64_t tsc = cpu_ticks();
+	uint32_t len = 0U, tag = TRACE_NR_TAGS;
+	uint32_t kind, slot, probe, n;
+	bool empty, define = false;
+
+	stac();
+	empty = (sbuf->head == sbuf->tail);
+	clac();
+	if (empty) {
+		rec[len] = (uint8_t)TRACE_REC_SYNC;
+		(void)memcpy_s(&rec[len + 1U], sizeof(tsc), &tsc, sizeof(tsc));
+		len += 1U + (uint32_t)sizeof(tsc);
+		tc->last_tsc = tsc;
+		(void)memset(tc->tag_used, 0U, sizeof(tc->tag_used));
+	}
+
+	switch (n_data) {
+	case 2U:
+		kind = TRACE_KIND_2L;
+		break;
+	case 4U:
+		kind = TRACE_KIND_4I;
+		break;
+	case 8U:
+		kind = TRACE_KIND_6C;
+		break;
+	default:
+		kind = TRACE_KIND_STR;
+		break;
+	}
+
+	for (probe = 0U; (probe < TRACE_TAG_PROBES) && (tag == TRACE_NR_TAGS); probe++) {
+		slot = (trace_tag_hash(evid) + probe) % TRACE_NR_TAGS;
+		if (!tc->tag_used[slot]) {
+			tag = slot;
+			define = true;
+		} else if (tc->tag_evid[slot] == evid) {
+			tag = slot;
+		} else {
+			/* taken by another evid, try the next slot */
+		}
+	}
+
+	if (tag == TRACE_NR_TAGS) {
+		rec[len] = (uint8_t)TRACE_REC_RAW;
+		rec[len + 1U] = (uint8_t)kind;
+		len += 2U;
+		len += put_varint(&rec[len], evid);
+	} else {
+		if (define) {
+			rec[len] = (uint8_t)TRACE_REC_DEF;
+			rec[len + 1U] = (uint8_t)(tag + TRACE_REC_TAG_BASE);
+			rec[len + 2U] = (uint8_t)kind;
+			len += 3U;
+			len += put_varint(&rec[len], evid);
+		}
+		rec[len] = (uint8_t)(tag + TRACE_REC_TAG_BASE);
+		len++;
+	}
+	len += put_varint(&rec[len], tsc - tc->last_tsc);
+
+	switch (kind) {
+	case TRACE_KIND_2L:
+		len += put_varint(&rec[len], entry->payload.fields_64.e);
+		len += put_varint(&rec[len], entry->payload.fields_64.f);
+		break;
+	case TRACE_KIND_4I:
+		len += put_varint(&rec[len], entry->payload.fields_32.a);
+		len += put_varint(&rec[len], entry->payload.fields_32.b);
+		len += put_varint(&rec[len], entry->payload.fields_32.c);
+		len += put_varint(&rec[len], entry->payload.fields_32.d);
+		break;
+	case TRACE_KIND_6C:
+		(void)memcpy_s(&rec[len], 6U, &entry->payload.fields_8, 6U);
+		len += 6U;
+		break;
+	default:
+		n = (uint32_t)strnlen_s(entry->payload.str, sizeof(entry->payload.str));
+		rec[len] = (uint8_t)n;
+		(void)memcpy_s(&rec[len + 1U], n, entry->payload.str, n);
+		len += 1U + n;
+		break;
+	}
+
+	/* a dropped record neither defines its tag nor moves the TSC base */
+	if (sbuf_put_bytes(sbuf, rec, len) == len) {
+		tc->last_tsc = tsc;
+		if (define) {
+			tc->tag_used[tag] = true;
+			tc->tag_evid[tag] = evid;
+		}
+	}
+}
+
+void trace_set_event_mask(const uint64_t *mask)
+{
+	uint32_t i;
+
+	for (i = 0U; i < TRACE_MASK_WORDS; i++) {
+		trace_event_mask[i] = mask[i];
+	}
+}
 
 static inline bool trace_check(uint16_t cpu_id)
 {
@@ -51,15 +206,24 @@ static inline bool trace_check(uint16_t cpu_id)
 static inline void trace_put(uint16_t cpu_id, uint32_t evid, uint32_t n_data, struct trace_entry *entry)
 {
 	struct shared_buf *sbuf = per_cpu(sbuf, cpu_id)[ACRN_TRACE];
+	bool varlen;
 
-	entry->tsc = cpu_ticks();
-	entry->id = evid;
-	entry->n_data = (uint8_t)n_data;
-	entry->cpu = (uint8_t)cpu_id;
-	(void)sbuf_put(sbuf, (uint8_t *)entry);
+	stac();
+	varlen = ((sbuf->flags & VARLEN_EN) != 0U);
+	clac();
+
+	if (varlen) {
+		trace_put_compact(sbuf, cpu_id, evid, n_data, entry);
+	} else {
+		entry->tsc = cpu_ticks();
+		entry->id = evid;
+		entry->n_data = (uint8_t)n_data;
+		entry->cpu = (uint8_t)cpu_id;
+		(void)sbuf_put(sbuf, (uint8_t *)entry);
+	}
 }
 
-void TRACE_2L(uint32_t evid, uint64_t e, uint64_t f)
+void trace_put_2l(uint32_t evid, uint64_t e, uint64_t f)
 {
 	struct trace_entry entry;
 	uint16_t cpu_id = get_pcpu_id();
@@ -73,7 +237,7 @@ void TRACE_2L(uint32_t evid, uint64_t e, uint64_t f)
 	trace_put(cpu_id, evid, 2U, &entry);
 }
 
-void TRACE_4I(uint32_t evid, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+void trace_put_4i(uint32_t evid, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
 {
 	struct trace_entry entry;
 	uint16_t cpu_id = get_pcpu_id();
@@ -89,7 +253,7 @@ void TRACE_4I(uint32_t evid, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
 	trace_put(cpu_id, evid, 4U, &entry);
 }
 
-void TRACE_6C(uint32_t evid, uint8_t a1, uint8_t a2, uint8_t a3, uint8_t a4, uint8_t b1, uint8_t b2)
+void trace_put_6c(uint32_t evid, uint8_t a1, uint8_t a2, uint8_t a3, uint8_t a4, uint8_t b1, uint8_t b2)
 {
 	struct trace_entry entry;
 	uint16_t cpu_id = get_pcpu_id();
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <types.h>
+#include <rtl.h>
+#include <util.h>
+#include <io_hotspot.h>
+
+/* log2(IO_HOTSPOT_WIDTH) */
+#define IO_HOTSPOT_WIDTH_SHIFT	8U
+
+static const uint64_t io_hotspot_seed[IO_HOTSPOT_DEPTH] = {
+	0x243f6a8885a308d3UL, 0x13198a2e03707344UL, 0xa4093822299f31d0UL, 0x082efa98ec4e6c89UL,
+};
+
+static inline uint64_t io_hotspot_key(uint16_t type, uint64_t addr, uint64_t rip)
+{
+	return addr ^ (rip * 0xff51afd7ed558ccdUL) ^ ((uint64_t)type << 63U);
+}
+
+static inline uint32_t io_hotspot_slot(uint64_t key, uint32_t row)
+{
+	return (uint32_t)(((key ^ io_hotspot_seed[row]) * 0x9e3779b97f4a7c15UL) >> (64U - IO_HOTSPOT_WIDTH_SHIFT));
+}
+
+void io_hotspot_init(struct io_hotspots *hs)
+{
+	(void)memset(hs, 0U, sizeof(*hs));
+	spinlock_init(&hs->lock);
+}
+
+/*
+ * The sketch is updated conservatively, only the rows at the minimum are
+ * bumped, which keeps the estimates of the colliding keys tighter.
+ */
+static uint32_t io_hotspot_count(struct io_hotspots *hs, uint64_t key)
+{
+	uint32_t row, slot[IO_HOTSPOT_DEPTH];
+	uint32_t est = ~0U;
+
+	for (row = 0U; row < IO_HOTSPOT_DEPTH; row++) {
+		slot[row] = io_hotspot_slot(key, row);
+		est = min(est, hs->sketch[row][slot[row]]);
+	}
+
+	if (est != ~0U) {
+		for (row = 0U; row < IO_HOTSPOT_DEPTH; row++) {
+			if (hs->sketch[row][slot[row]] == est) {
+				hs->sketch[row][slot[row]] = est + 1U;
+			}
+		}
+		est++;
+	}
+
+	return est;
+}
+
+/**
+ * @brief Record one sampled access of a VM
+ *
+ * A key already in the top table gets the new estimate, another one takes a
+ * free entry or replaces the coldest entry once its estimate is higher.
+ */
+void io_hotspot_sample(struct io_hotspots *hs, uint16_t type, uint64_t addr, uint64_t rip, bool in_hv)
+{
+	struct acrn_io_hotspot *entry = NULL;
+	uint64_t key = io_hotspot_key(type, addr, rip);
+	uint32_t i, est, coldest = 0U;
+
+	spinlock_obtain(&hs->lock);
+	hs->samples++;
+	est = io_hotspot_count(hs, key);
+
+	for (i = 0U; i < hs->nr_top; i++) {
+		if ((hs->top[i].addr == addr) && (hs->top[i].rip == rip) && (hs->top[i].type == type)) {
+			entry = &hs->top[i];
+			break;
+		}
+		if (hs->top[i].count < hs->top[coldest].count) {
+			coldest = i;
+		}
+	}
+
+	if (entry == NULL) {
+		if (hs->nr_top < ACRN_IO_HOTSPOT_NUM) {
+			entry = &hs->top[hs->nr_top];
+			hs->nr_top++;
+		} else if (est > hs->top[coldest].count) {
+			entry = &hs->top[coldest];
+		} else {
+			/* colder than the whole table, only counted in the sketch */
+		}
+
+		if (entry != NULL) {
+			entry->addr = addr;
+			entry->rip = rip;
+			entry->type = type;
+		}
+	}
+
+	if (entry != NULL) {
+		entry->count = est;
+		entry->in_hv = in_hv ? 1U : 0U;
+	}
+	spinlock_release(&hs->lock);
+}
+
+/**
+ * @brief Copy the hotspots of a VM out, the hottest first
+ */
+void io_hotspot_get(struct io_hotspots *hs, struct acrn_vm_io_hotspots *out, bool reset)
+{
+	struct acrn_io_hotspot tmp;
+	uint32_t i, j;
+
+	(void)memset(out, 0U, sizeof(*out));
+	out->sample_shift = IO_HOTSPOT_SAMPLE_SHIFT;
+
+	spinlock_obtain(&hs->lock);
+	out->samples = hs->samples;
+	for (i = 0U; i < hs->nr_top; i++) {
+		out->hotspot[i] = hs->top[i];
+	}
+	if (reset) {
+		hs->samples = 0UL;
+		hs->nr_top = 0U;
+		(void)memset(hs->sketch, 0U, sizeof(hs->sketch));
+		(void)memset(hs->top, 0U, sizeof(hs->top));
+	}
+	spinlock_release(&hs->lock);
+
+	/* at most ACRN_IO_HOTSPOT_NUM entries, sorted out of the lock */
+	for (i = 1U; i < ACRN_IO_HOTSPOT_NUM; i++) {
+		tmp = out->hotspot[i];
+		j = i;
+		while ((j > 0U) && (out->hotspot[j - 1U].count < tmp.count)) {
+			out->hotspot[j] = out->hotspot[j - 1U];
+			j--;
+		}
+		out->hotspot[j] = tmp;
+	}
+}
@@ -63,20 +63,41 @@ void reset_vm_ioreqs(struct acrn_vm *vm)
 	}
 }
 
-int add_asyncio(struct acrn_vm *vm, uint32_t type, uint64_t addr, uint64_t fd)
+static inline uint16_t asyncio_hash(uint32_t type, uint64_t addr)
 {
-	uint32_t i;
+	/* notify addresses are usually a few bytes apart, fold all the bits in */
+	return (uint16_t)(((addr ^ (uint64_t)type) * 0x9E3779B97F4A7C15UL) >> (64U - ASYNCIO_HASH_BITS));
+}
+
+/*
+ * The exact match descriptors are chained by hash, the ACRN_ASYNCIO_RANGE ones
+ * (at most a few per device) on a chain of their own.
+ */
+static inline uint16_t *asyncio_chain(struct acrn_vm *vm, uint32_t type, uint64_t addr)
+{
+	return ((type & ACRN_ASYNCIO_RANGE) != 0U) ? &vm->aio_ranges : &vm->aio_hash[asyncio_hash(type, addr)];
+}
+
+int add_asyncio(struct acrn_vm *vm, uint32_t type, uint64_t addr, uint32_t len, uint64_t fd)
+{
+	uint16_t i, *head;
 	int ret = -1;
 
-	if (addr != 0UL) {
+	if (vm->sw.asyncio_sbuf == NULL) {
+		pr_err("%s: the asyncio sbuf is not set up!", __func__);
+	} else if ((addr != 0UL) && (((type & ACRN_ASYNCIO_RANGE) == 0U) || (len != 0U))) {
 		spinlock_obtain(&vm->asyncio_lock);
 		for (i = 0U; i < ACRN_ASYNCIO_MAX; i++) {
 			if ((vm->aio_desc[i].addr == 0UL) && (vm->aio_desc[i].fd == 0UL)) {
+				head = asyncio_chain(vm, type, addr);
+				seqcount_write_begin(&vm->asyncio_seq);
 				vm->aio_desc[i].type = type;
+				vm->aio_desc[i].len = ((type & ACRN_ASYNCIO_RANGE) != 0U) ? len : 0U;
 				vm->aio_desc[i].addr = addr;
 				vm->aio_desc[i].fd = fd;
-				INIT_LIST_HEAD(&vm->aio_desc[i].list);
-				list_add(&vm->aio_desc[i].list, &vm->aiodesc_queue);
+				vm->aio_desc[i].next = *head;
+				*head = i;
+				seqcount_write_end(&vm->asyncio_seq);
 				ret = 0;
 				break;
 			}
@@ -86,32 +107,44 @@ int add_asyncio(struct acrn_vm *vm, uint32_t type, uint64_t addr, uint64_t fd)
 			pr_fatal("too much fastio, would not support!");
 		}
 	} else {
-		pr_err("%s: base = 0 is not supported!", __func__);
+		pr_err("%s: base = 0 or an empty range is not supported!", __func__);
 	}
 	return ret;
 }
 
 int remove_asyncio(struct acrn_vm *vm, uint32_t type, uint64_t addr, uint64_t fd)
 {
-	uint32_t i;
+	uint16_t i, steps = 0U, *link;
 	int ret = -1;
 
-	if (addr != 0UL) {
+	if (vm->sw.asyncio_sbuf == NULL) {
+		pr_err("%s: the asyncio sbuf is not set up!", __func__);
+	} else if (addr != 0UL) {
 		spinlock_obtain(&vm->asyncio_lock);
-		for (i = 0U; i < ACRN_ASYNCIO_MAX; i++) {
+		link = asyncio_chain(vm, type, addr);
+		i = *link;
+		/* bounded like asyncio_chain_lookup(), a broken chain must not hang the hypervisor */
+		while ((i < ACRN_ASYNCIO_MAX) && (steps < ACRN_ASYNCIO_MAX)) {
 			if ((vm->aio_desc[i].type == type)
 					&& (vm->aio_desc[i].addr == addr)
 					&& (vm->aio_desc[i].fd == fd)) {
+				seqcount_write_begin(&vm->asyncio_seq);
+				*link = vm->aio_desc[i].next;
 				vm->aio_desc[i].type = 0U;
+				vm->aio_desc[i].len = 0U;
 				vm->aio_desc[i].addr = 0UL;
 				vm->aio_desc[i].fd = 0UL;
-				list_del_init(&vm->aio_desc[i].list);
+				vm->aio_desc[i].next = ASYNCIO_INVALID_IDX;
+				seqcount_write_end(&vm->asyncio_seq);
 				ret = 0;
 				break;
 			}
+			link = &vm->aio_desc[i].next;
+			i = *link;
+			steps++;
 		}
 		spinlock_release(&vm->asyncio_lock);
-		if (i == ACRN_ASYNCIO_MAX) {
+		if (ret != 0) {
 			pr_fatal("Failed to find asyncio req on addr: %lx!", addr);
 		}
 	} else {
@@ -125,14 +158,58 @@ static inline bool has_complete_ioreq(const struct acrn_vcpu *vcpu)
 	return (get_io_req_state(vcpu->vm, vcpu->vcpu_id) == ACRN_IOREQ_STATE_COMPLETE);
 }
 
-static struct asyncio_desc *get_asyncio_desc(struct acrn_vcpu *vcpu, const struct io_request *io_req)
+static bool asyncio_match(const struct asyncio_desc *desc, uint32_t type, uint64_t addr)
+{
+	bool ret;
+
+	if (desc->type == type) {
+		ret = (desc->addr == addr);
+	} else if (desc->type == (type | ACRN_ASYNCIO_RANGE)) {
+		ret = (addr >= desc->addr) && (addr < (desc->addr + desc->len));
+	} else {
+		ret = false;
+	}
+
+	return ret;
+}
+
+/*
+ * Walk an aio_desc chain locklessly; the number of steps is bounded as the
+ * chain may be relinked under the reader.
+ */
+static bool asyncio_chain_lookup(const struct acrn_vm *vm, uint16_t head, uint32_t type, uint64_t addr,
+		uint64_t *fd)
+{
+	uint16_t i = head;
+	uint32_t steps = 0U;
+	bool found = false;
+
+	while ((i < ACRN_ASYNCIO_MAX) && (steps < ACRN_ASYNCIO_MAX)) {
+		if (asyncio_match(&vm->aio_desc[i], type, addr)) {
+			*fd = vm->aio_desc[i].fd;
+			found = true;
+			break;
+		}
+		i = vm->aio_desc[i].next;
+		steps++;
+	}
+
+	return found;
+}
+
+/*
+ * Look up the asyncio fd registered on the address \p io_req accesses
+ *
+ * This is on the path of every virtqueue kick, so the chains are walked
+ * without asyncio_lock: the walk is retried if add_asyncio()/remove_asyncio()
+ * changed the table meanwhile. An exact match takes precedence over a range.
+ */
+static bool get_asyncio_fd(struct acrn_vcpu *vcpu, const struct io_request *io_req, uint64_t *fd, uint64_t *data)
 {
 	uint64_t addr = 0UL;
-	uint32_t type;
-	struct list_head *pos;
-	struct asyncio_desc *iter_desc;
+	uint32_t type = 0U, seq;
 	struct acrn_vm *vm = vcpu->vm;
-	struct asyncio_desc *ret = NULL;
+	bool found = false;
 	struct shared_buf *sbuf =
 		(struct shared_buf *)vm->sw.asyncio_sbuf;
 
@@ -140,11 +217,13 @@ static struct asyncio_desc *get_asyncio_desc(struct acrn_vcpu *vcpu, const struc
 		switch (io_req->io_type) {
 		case ACRN_IOREQ_TYPE_PORTIO:
 			addr = io_req->reqs.pio_request.address;
+			*data = io_req->reqs.pio_request.value;
 			type = ACRN_ASYNCIO_PIO;
 			break;
 
 		case ACRN_IOREQ_TYPE_MMIO:
 			addr = io_req->reqs.mmio_request.address;
+			*data = io_req->reqs.mmio_request.value;
 			type = ACRN_ASYNCIO_MMIO;
 			break;
 		default:
@@ -152,31 +231,31 @@ static struct asyncio_desc *get_asyncio_desc(struct acrn_vcpu *vcpu, const struc
 		}
 
 		if (addr != 0UL) {
-			spinlock_obtain(&vm->asyncio_lock);
-				list_for_each(pos, &vm->aiodesc_queue) {
-					iter_desc = container_of(pos, struct asyncio_desc, list);
-					if ((iter_desc->addr == addr) && (iter_desc->type == type)) {
-						ret = iter_desc;
-						break;
-					}
+			do {
+				seq = seqcount_read_begin(&vm->asyncio_seq);
+				found = asyncio_chain_lookup(vm, vm->aio_hash[asyncio_hash(type, addr)], type, addr, fd);
+				if (!found) {
+					found = asyncio_chain_lookup(vm, vm->aio_ranges, type, addr, fd);
 				}
-			spinlock_release(&vm->asyncio_lock);
+			} while (seqcount_read_retry(&vm->asyncio_seq, seq));
 		}
 	}
 
-	return ret;
-
+	return found;
 }
-static int acrn_insert_asyncio(struct acrn_vcpu *vcpu, const uint64_t asyncio_fd)
+
+static int acrn_insert_asyncio(struct acrn_vcpu *vcpu, uint64_t asyncio_fd, uint64_t data)
 {
 	struct acrn_vm *vm = vcpu->vm;
 	struct shared_buf *sbuf =
 		(struct shared_buf *)vm->sw.asyncio_sbuf;
+	/* fd comes first, sbuf_put() copies as much of the entry as the sbuf takes */
+	struct acrn_asyncio_entry entry = { .fd = asyncio_fd, .data = data };
 	int ret = -ENODEV;
 
 	if (sbuf != NULL) {
 		spinlock_obtain(&vm->asyncio_lock);
-		while (sbuf_put(sbuf, (uint8_t *)&asyncio_fd) == 0U) {
+		while (sbuf_put(sbuf, (uint8_t *)&entry) == 0U) {
 			/* sbuf is full, try later.. */
 			spinlock_release(&vm->asyncio_lock);
 			asm_pause();
@@ -200,7 +279,7 @@ static int acrn_insert_asyncio(struct acrn_vcpu *vcpu, const uint64_t asyncio_fd
  *
  * @pre vcpu != NULL && io_req != NULL
  */
-int32_t acrn_insert_request(struct acrn_vcpu *vcpu, const struct io_request *io_req)
+static int32_t insert_request(struct acrn_vcpu *vcpu, const struct io_request *io_req, bool wait)
 {
 	struct acrn_io_request_buffer *req_buf = NULL;
 	struct acrn_io_request *acrn_io_req;
@@ -240,7 +319,9 @@ int32_t acrn_insert_request(struct acrn_vcpu *vcpu, const struct io_request *io_
 		arch_fire_hsm_interrupt();
 
 		/* Polling completion of the request in polling mode */
-		if (is_polling) {
+		if (!wait) {
+			/* completed by complete_async_ioreq() */
+		} else if (is_polling) {
 			while (true) {
 				if (has_complete_ioreq(vcpu)) {
 					/* we have completed ioreq pending */
@@ -261,6 +342,19 @@ int32_t acrn_insert_request(struct acrn_vcpu *vcpu, const struct io_request *io_
 	return ret;
 }
 
+int32_t acrn_insert_request(struct acrn_vcpu *vcpu, const struct io_request *io_req)
+{
+	/* the slot may still hold the request of an asynchronous page fault */
+	pvclock_async_pf_flush(vcpu);
+
+	return insert_request(vcpu, io_req, true);
+}
+
+int32_t acrn_insert_request_nowait(struct acrn_vcpu *vcpu, const struct io_request *io_req)
+{
+	return insert_request(vcpu, io_req, false);
+}
+
 uint32_t get_io_req_state(struct acrn_vm *vm, uint16_t vcpu_id)
 {
 	uint32_t state;
@@ -300,6 +394,17 @@ void set_io_req_state(struct acrn_vm *vm, uint16_t vcpu_id, uint32_t state)
 	}
 }
 
+/*
+ * Empty the asyncio chains. Done at VM creation too: add_asyncio() and
+ * remove_asyncio() rely on the chains being terminated by ASYNCIO_INVALID_IDX.
+ */
+void reset_asyncio(struct acrn_vm *vm)
+{
+	(void)memset(vm->aio_desc, 0U, sizeof(vm->aio_desc));
+	(void)memset(vm->aio_hash, 0xFFU, sizeof(vm->aio_hash));
+	vm->aio_ranges = ASYNCIO_INVALID_IDX;
+}
+
 int init_asyncio(struct acrn_vm *vm, uint64_t *hva)
 {
 	struct shared_buf *sbuf = (struct shared_buf *)hva;
@@ -307,10 +412,15 @@ int init_asyncio(struct acrn_vm *vm, uint64_t *hva)
 
 	stac();
 	if (sbuf != NULL) {
-		if (sbuf->magic == SBUF_MAGIC) {
+		if ((sbuf->magic == SBUF_MAGIC) && ((sbuf->ele_size == sizeof(uint64_t))
+				|| (sbuf->ele_size == sizeof(struct acrn_asyncio_entry)))) {
+			/* drop whatever a previous DM instance left registered */
+			spinlock_obtain(&vm->asyncio_lock);
+			seqcount_write_begin(&vm->asyncio_seq);
+			reset_asyncio(vm);
+			seqcount_write_end(&vm->asyncio_seq);
 			vm->sw.asyncio_sbuf = sbuf;
-			INIT_LIST_HEAD(&vm->aiodesc_queue);
-			spinlock_init(&vm->asyncio_lock);
+			spinlock_release(&vm->asyncio_lock);
 			ret = 0;
 		}
 	}
@@ -319,6 +429,101 @@ int init_asyncio(struct acrn_vm *vm, uint64_t *hva)
 	return ret;
 }
 
+int init_coalesced_mmio(struct acrn_vm *vm, uint64_t *hva)
+{
+	struct shared_buf *sbuf = (struct shared_buf *)hva;
+	int ret = -1;
+
+	stac();
+	if ((sbuf != NULL) && (sbuf->magic == SBUF_MAGIC) &&
+			(sbuf->ele_size == sizeof(struct acrn_coalesced_mmio_entry))) {
+		spinlock_init(&vm->cmmio_lock);
+		/* drop the zones a previous DM instance left */
+		vm->cmmio_zone_cnt = 0U;
+		vm->sw.coalesced_mmio_sbuf = sbuf;
+		ret = 0;
+	}
+	clac();
+
+	return ret;
+}
+
+int32_t add_coalesced_mmio(struct acrn_vm *vm, const struct acrn_coalesced_mmio_zone *zone)
+{
+	int32_t ret = -ENOMEM;
+
+	spinlock_obtain(&vm->cmmio_lock);
+	if (vm->sw.coalesced_mmio_sbuf == NULL) {
+		ret = -ENODEV;
+	} else if (vm->cmmio_zone_cnt < ACRN_COALESCED_MMIO_ZONE_MAX) {
+		vm->cmmio_zones[vm->cmmio_zone_cnt] = *zone;
+		vm->cmmio_zone_cnt++;
+		ret = 0;
+	} else {
+		pr_warn("%s: no room for the zone at 0x%lx", __func__, zone->addr);
+	}
+	spinlock_release(&vm->cmmio_lock);
+
+	return ret;
+}
+
+int32_t remove_coalesced_mmio(struct acrn_vm *vm, const struct acrn_coalesced_mmio_zone *zone)
+{
+	uint32_t i;
+	int32_t ret = -ENODEV;
+
+	spinlock_obtain(&vm->cmmio_lock);
+	for (i = 0U; i < vm->cmmio_zone_cnt; i++) {
+		if ((vm->cmmio_zones[i].addr == zone->addr) && (vm->cmmio_zones[i].len == zone->len)) {
+			vm->cmmio_zone_cnt--;
+			vm->cmmio_zones[i] = vm->cmmio_zones[vm->cmmio_zone_cnt];
+			ret = 0;
+			break;
+		}
+	}
+	spinlock_release(&vm->cmmio_lock);
+
+	return ret;
+}
+
+/**
+ * Post an MMIO write to a coalesced MMIO zone to the ACRN_COALESCED_MMIO
+ * sbuf, instead of an I/O request the vCPU has to wait for.
+ *
+ * @retval true the write is posted, it needs no more emulation
+ * @retval false it is not in a zone, or the sbuf is full
+ */
+static bool coalesced_mmio_write(struct acrn_vcpu *vcpu, const struct io_request *io_req)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	const struct acrn_mmio_request *mmio_req = &io_req->reqs.mmio_request;
+	struct acrn_coalesced_mmio_entry entry;
+	const struct acrn_coalesced_mmio_zone *zone;
+	uint32_t i;
+	bool posted = false;
+
+	if ((io_req->io_type == ACRN_IOREQ_TYPE_MMIO) && (mmio_req->direction == ACRN_IOREQ_DIR_WRITE) &&
+			(vm->sw.coalesced_mmio_sbuf != NULL) && (vm->cmmio_zone_cnt != 0U)) {
+		spinlock_obtain(&vm->cmmio_lock);
+		for (i = 0U; i < vm->cmmio_zone_cnt; i++) {
+			zone = &vm->cmmio_zones[i];
+			if ((mmio_req->address >= zone->addr) &&
+					((mmio_req->address + mmio_req->size) <= (zone->addr + zone->len))) {
+				entry.addr = mmio_req->address;
+				entry.size = (uint32_t)mmio_req->size;
+				entry.reserved = 0U;
+				entry.value = mmio_req->value;
+				posted = (sbuf_put((struct shared_buf *)vm->sw.coalesced_mmio_sbuf,
+						(uint8_t *)&entry) == sizeof(entry));
+				break;
+			}
+		}
+		spinlock_release(&vm->cmmio_lock);
+	}
+
+	return posted;
+}
+
 void set_hsm_notification_vector(uint32_t vector)
 {
 	acrn_hsm_notification_vector = vector;
@@ -345,7 +550,8 @@ static void emulate_mmio_complete(struct acrn_vcpu *vcpu, const struct io_reques
 {
 	const struct acrn_mmio_request *mmio_req = &io_req->reqs.mmio_request;
 
-	if (mmio_req->direction == ACRN_IOREQ_DIR_READ) {
+	/* a read of size 0 is an instruction fetch, it is retried and not emulated */
+	if ((mmio_req->direction == ACRN_IOREQ_DIR_READ) && (mmio_req->size != 0UL)) {
 		/* Emulate instruction and update vcpu register set */
 		(void)emulate_instruction(vcpu);
 	}
@@ -370,6 +576,14 @@ static void complete_ioreq(struct acrn_vcpu *vcpu, struct io_request *io_req)
 			io_req->reqs.mmio_request.value = acrn_io_req->reqs.mmio_request.value;
 			break;
 
+		case ACRN_IOREQ_TYPE_PCICFG:
+			io_req->reqs.pci_request.value = acrn_io_req->reqs.pci_request.value;
+			break;
+
+		case ACRN_IOREQ_TYPE_PORTIO_STRING:
+			io_req->reqs.pio_string_request.value = acrn_io_req->reqs.pio_string_request.value;
+			break;
+
 		default:
 			/*no actions are required for other cases.*/
 			break;
@@ -384,6 +598,17 @@ static void complete_ioreq(struct acrn_vcpu *vcpu, struct io_request *io_req)
 	clac();
 }
 
+bool complete_async_ioreq(struct acrn_vcpu *vcpu)
+{
+	bool ret = has_complete_ioreq(vcpu);
+
+	if (ret) {
+		complete_ioreq(vcpu, NULL);
+	}
+
+	return ret;
+}
+
 /**
  * @brief Complete-work of HSM requests for port I/O emulation
  *
@@ -453,6 +678,11 @@ static void dm_emulate_io_complete(struct acrn_vcpu *vcpu)
 				dm_emulate_pio_complete(vcpu);
 				break;
 
+			case ACRN_IOREQ_TYPE_PORTIO_STRING:
+				complete_ioreq(vcpu, &vcpu->req);
+				emulate_pio_string_complete(vcpu, &vcpu->req);
+				break;
+
 			default:
 				/*
 				 * ACRN_IOREQ_TYPE_WP can only be triggered on writes which do
@@ -542,7 +772,9 @@ hv_emulate_pio(struct acrn_vcpu *vcpu, struct io_request *io_req)
 	uint32_t idx;
 	struct acrn_vm *vm = vcpu->vm;
 	struct acrn_pio_request *pio_req = &io_req->reqs.pio_request;
-	struct vm_io_handler_desc *handler;
+	struct vm_io_handler_desc *handler = NULL;
+	struct io_handler_cache *cache = &vcpu->io_cache;
+	uint32_t gen = vm->emul_pio_gen;
 	io_read_fn_t io_read = NULL;
 	io_write_fn_t io_write = NULL;
 
@@ -554,20 +786,35 @@ hv_emulate_pio(struct acrn_vcpu *vcpu, struct io_request *io_req)
 	port = (uint16_t)pio_req->address;
 	size = (uint16_t)pio_req->size;
 
-	for (idx = 0U; idx < EMUL_PIO_IDX_MAX; idx++) {
-		handler = &(vm->emul_pio[idx]);
-
+	/*
+	 * Try the handler this vCPU hits last time first, unless ranges overlap:
+	 * the first match in emul_pio[] must win then.
+	 */
+	if ((cache->pio_gen == gen) && (cache->pio_idx < EMUL_PIO_IDX_MAX) && !vm->emul_pio_overlap) {
+		handler = &(vm->emul_pio[cache->pio_idx]);
 		if ((port < handler->port_start) || (port >= handler->port_end)) {
-			continue;
+			handler = NULL;
+		}
+	}
+
+	if (handler == NULL) {
+		for (idx = 0U; idx < EMUL_PIO_IDX_MAX; idx++) {
+			if ((port >= vm->emul_pio[idx].port_start) && (port < vm->emul_pio[idx].port_end)) {
+				handler = &(vm->emul_pio[idx]);
+				cache->pio_idx = (uint16_t)idx;
+				cache->pio_gen = gen;
+				break;
+			}
 		}
+	}
 
+	if (handler != NULL) {
 		if (handler->io_read != NULL) {
 			io_read = handler->io_read;
 		}
 		if (handler->io_write != NULL) {
 			io_write = handler->io_write;
 		}
-		break;
 	}
 
 	if ((pio_req->direction == ACRN_IOREQ_DIR_WRITE) && (io_write != NULL)) {
@@ -585,9 +832,186 @@ hv_emulate_pio(struct acrn_vcpu *vcpu, struct io_request *io_req)
 	pr_dbg("IO %s on port %04x, data %08x",
 		(pio_req->direction == ACRN_IOREQ_DIR_READ) ? "read" : "write", port, pio_req->value);
 
+	if (io_hotspot_sample_due(&vm->io_hotspots)) {
+		io_hotspot_sample(&vm->io_hotspots, ACRN_IO_HOTSPOT_PIO, port, vcpu_get_rip(vcpu), (status == 0));
+	}
+
 	return status;
 }
 
+/**
+ * Try handling a string port I/O request by the port I/O handler registered in
+ * the hypervisor, one access per element.
+ *
+ * The handlers take a plain port I/O request in vcpu->req, so it is turned
+ * into one for each access and back into the string request afterwards. If
+ * the first access finds no handler, the whole request goes to the HSM.
+ *
+ * @pre io_req == &vcpu->req
+ * @pre io_req->io_type == ACRN_IOREQ_TYPE_PORTIO_STRING
+ *
+ * @retval 0 Successfully emulated by registered handlers.
+ * @retval -ENODEV No proper handler found.
+ */
+static int32_t
+hv_emulate_pio_string(struct acrn_vcpu *vcpu, struct io_request *io_req)
+{
+	struct acrn_pio_string_request str_req = io_req->reqs.pio_string_request;
+	struct acrn_pio_request *pio_req = &io_req->reqs.pio_request;
+	bool down = ((str_req.flags & ACRN_PIO_STRING_DOWN) != 0U);
+	uint8_t *buf;
+	uint64_t i, idx;
+	int32_t status = 0;
+
+	if ((str_req.flags & ACRN_PIO_STRING_VALUE) != 0U) {
+		buf = (uint8_t *)&str_req.value;
+	} else {
+		buf = (uint8_t *)gpa2hva(vcpu->vm, str_req.gpa);
+	}
+
+	for (i = 0UL; (i < str_req.count) && (status == 0); i++) {
+		idx = down ? (str_req.count - 1UL - i) : i;
+
+		io_req->io_type = ACRN_IOREQ_TYPE_PORTIO;
+		pio_req->direction = str_req.direction;
+		pio_req->address = str_req.address;
+		pio_req->size = str_req.size;
+		pio_req->value = 0U;
+		if (str_req.direction == ACRN_IOREQ_DIR_WRITE) {
+			stac();
+			(void)memcpy_s(&pio_req->value, sizeof(pio_req->value), buf + (idx * str_req.size), str_req.size);
+			clac();
+		}
+
+		status = hv_emulate_pio(vcpu, io_req);
+		if ((status == 0) && (str_req.direction == ACRN_IOREQ_DIR_READ)) {
+			stac();
+			(void)memcpy_s(buf + (idx * str_req.size), str_req.size, &pio_req->value, str_req.size);
+			clac();
+		}
+	}
+
+	io_req->io_type = ACRN_IOREQ_TYPE_PORTIO_STRING;
+	io_req->reqs.pio_string_request = str_req;
+
+	return status;
+}
+
+/**
+ * @brief Get the position of the first indexed MMIO range starting at or above \p addr
+ *
+ * vm->emul_mmio_index is kept sorted by range_start, so a binary search is
+ * used. The caller shall hold vm->emul_mmio_lock or validate the result with
+ * vm->emul_mmio_seq.
+ */
+static uint16_t mmio_index_lower_bound(const struct acrn_vm *vm, uint64_t addr)
+{
+	uint16_t lo = 0U, hi = vm->nr_emul_mmio_index, mid;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) >> 1U);
+		if (vm->emul_mmio[vm->emul_mmio_index[mid]].range_start < addr) {
+			lo = mid + 1U;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/**
+ * @brief Check whether [\p address, \p address + \p size) falls in \p mmio_node
+ *
+ * @retval 0 The access falls in \p mmio_node which is copied to \p node.
+ * @retval -ENODEV The access does not overlap with \p mmio_node.
+ * @retval -EIO The access spans beyond the boundary of \p mmio_node.
+ */
+static int32_t match_mmio_node(const struct mem_io_node *mmio_node, uint64_t address, uint64_t size,
+		struct mem_io_node *node)
+{
+	int32_t ret = -ENODEV;
+
+	if ((mmio_node->read_write != NULL) && (address < mmio_node->range_end)
+			&& ((address + size) > mmio_node->range_start)) {
+		if ((address >= mmio_node->range_start) && ((address + size) <= mmio_node->range_end)) {
+			node->hold_lock = mmio_node->hold_lock;
+			node->read_write = mmio_node->read_write;
+			node->handler_private_data = mmio_node->handler_private_data;
+			node->range_start = mmio_node->range_start;
+			node->range_end = mmio_node->range_end;
+			ret = 0;
+		} else {
+			ret = -EIO;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Look up the MMIO node covering [\p address, \p address + \p size)
+ *
+ * Without overlapping ranges, the only candidate is the last range starting
+ * below the end of the access. Otherwise the first node in vm->emul_mmio the
+ * access overlaps with decides, as the linear scan this index replaced did.
+ *
+ * @param idx Output the index of the found node in vm->emul_mmio.
+ *
+ * @retval 0 A node is found and copied to \p node.
+ * @retval -ENODEV No node overlaps with the access.
+ * @retval -EIO The access spans beyond the boundary of a node.
+ */
+static int32_t lookup_mmio_node(const struct acrn_vm *vm, uint64_t address, uint64_t size,
+		struct mem_io_node *node, uint16_t *idx)
+{
+	int32_t ret = -ENODEV;
+	uint16_t pos = mmio_index_lower_bound(vm, address + size);
+	uint16_t i, first = CONFIG_MAX_EMULATED_MMIO_REGIONS;
+
+	if (!vm->emul_mmio_overlap) {
+		if (pos > 0U) {
+			first = vm->emul_mmio_index[pos - 1U];
+		}
+	} else {
+		/* only the ranges starting below the end of the access can overlap with it */
+		for (i = 0U; i < pos; i++) {
+			if ((vm->emul_mmio_index[i] < first) &&
+					(vm->emul_mmio[vm->emul_mmio_index[i]].range_end > address)) {
+				first = vm->emul_mmio_index[i];
+			}
+		}
+	}
+
+	if (first < CONFIG_MAX_EMULATED_MMIO_REGIONS) {
+		*idx = first;
+		ret = match_mmio_node(&(vm->emul_mmio[first]), address, size, node);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Recompute vm->emul_mmio_overlap after an update of the index
+ *
+ * @pre The caller holds vm->emul_mmio_lock
+ */
+static void update_mmio_overlap(struct acrn_vm *vm)
+{
+	uint16_t i;
+	uint64_t max_end = 0UL;
+	bool overlap = false;
+
+	for (i = 0U; i < vm->nr_emul_mmio_index; i++) {
+		if (vm->emul_mmio[vm->emul_mmio_index[i]].range_start < max_end) {
+			overlap = true;
+			break;
+		}
+		max_end = vm->emul_mmio[vm->emul_mmio_index[i]].range_end;
+	}
+	vm->emul_mmio_overlap = overlap;
+}
+
 /**
  * Use registered MMIO handlers on the given request if it falls in the range of
  * any of them.
@@ -602,57 +1026,79 @@ static int32_t
 hv_emulate_mmio(struct acrn_vcpu *vcpu, struct io_request *io_req)
 {
 	int32_t status = -ENODEV;
-	bool hold_lock = true;
-	uint16_t idx;
-	uint64_t address, size, base, end;
+	int32_t ret;
+	bool locked = false;
+	uint32_t seq;
+	uint16_t idx = IO_HANDLER_CACHE_INVALID;
+	uint64_t address, size;
+	struct acrn_vm *vm = vcpu->vm;
+	struct io_handler_cache *cache = &vcpu->io_cache;
 	struct acrn_mmio_request *mmio_req = &io_req->reqs.mmio_request;
-	struct mem_io_node *mmio_handler = NULL;
+	struct mem_io_node mmio_node;
 	hv_mem_io_handler_t read_write = NULL;
 	void *handler_private_data = NULL;
 
-	if (is_service_vm(vcpu->vm) || is_prelaunched_vm(vcpu->vm)) {
+	if (is_service_vm(vm) || is_prelaunched_vm(vm)) {
 		read_write = mmio_default_access_handler;
 	}
 
 	address = mmio_req->address;
 	size = mmio_req->size;
 
-	spinlock_obtain(&vcpu->vm->emul_mmio_lock);
-	for (idx = 0U; idx <= vcpu->vm->nr_emul_mmio_regions; idx++) {
-		mmio_handler = &(vcpu->vm->emul_mmio[idx]);
-		if (mmio_handler->read_write != NULL) {
-			base = mmio_handler->range_start;
-			end = mmio_handler->range_end;
-
-			if (((address + size) <= base) || (address >= end)) {
-				continue;
-			} else {
-				 if ((address >= base) && ((address + size) <= end)) {
-					hold_lock = mmio_handler->hold_lock;
-					read_write = mmio_handler->read_write;
-					handler_private_data = mmio_handler->handler_private_data;
-				} else {
-					pr_fatal("Err MMIO, address:0x%lx, size:%x", address, size);
-					status = -EIO;
-				}
-				break;
-			}
+	/* The index is read-mostly, look it up without contending on emul_mmio_lock */
+	do {
+		seq = seqcount_read_begin(&vm->emul_mmio_seq);
+		ret = -ENODEV;
+		idx = cache->mmio_idx;
+		if ((cache->mmio_seq == seq) && (idx < CONFIG_MAX_EMULATED_MMIO_REGIONS) &&
+				!vm->emul_mmio_overlap) {
+			/* Try the node this vCPU hits last time first */
+			ret = match_mmio_node(&(vm->emul_mmio[idx]), address, size, &mmio_node);
 		}
+		if (ret != 0) {
+			ret = lookup_mmio_node(vm, address, size, &mmio_node, &idx);
+		}
+	} while (seqcount_read_retry(&vm->emul_mmio_seq, seq));
+
+	if (ret == 0) {
+		cache->mmio_seq = seq;
+		cache->mmio_idx = idx;
 	}
 
-	if ((status == -ENODEV) && (read_write != NULL)) {
-		/* This mmio_handler will never modify once register, so we don't
-		 * need to hold the lock when handling the MMIO access.
+	if ((ret == 0) && mmio_node.hold_lock) {
+		/* This mmio_handler may be modified or unregistered concurrently, so
+		 * it is called with the lock held. Redo the lookup under the lock if
+		 * any update happened since the lockless one.
 		 */
-		if (!hold_lock) {
-			spinlock_release(&vcpu->vm->emul_mmio_lock);
+		spinlock_obtain(&vm->emul_mmio_lock);
+		locked = true;
+		if (seqcount_read_retry(&vm->emul_mmio_seq, seq)) {
+			ret = lookup_mmio_node(vm, address, size, &mmio_node, &idx);
 		}
+	}
+
+	if (ret == 0) {
+		read_write = mmio_node.read_write;
+		handler_private_data = mmio_node.handler_private_data;
+	} else if (ret == -EIO) {
+		pr_fatal("Err MMIO, address:0x%lx, size:%x", address, size);
+		status = -EIO;
+	} else {
+		/* no handler is registered for this address, use the default one if any */
+	}
+
+	/* only the device model can map the page of an instruction fetch back */
+	if ((status == -ENODEV) && (read_write != NULL) && (size != 0UL)) {
 		status = read_write(io_req, handler_private_data);
-		if (!hold_lock) {
-			spinlock_obtain(&vcpu->vm->emul_mmio_lock);
-		}
 	}
-	spinlock_release(&vcpu->vm->emul_mmio_lock);
+
+	if (locked) {
+		spinlock_release(&vm->emul_mmio_lock);
+	}
+
+	if (io_hotspot_sample_due(&vm->io_hotspots)) {
+		io_hotspot_sample(&vm->io_hotspots, ACRN_IO_HOTSPOT_MMIO, address, vcpu_get_rip(vcpu), (status == 0));
+	}
 
 	return status;
 }
@@ -681,7 +1127,7 @@ emulate_io(struct acrn_vcpu *vcpu, struct io_request *io_req)
 {
 	int32_t status;
 	struct acrn_vm_config *vm_config;
-	struct asyncio_desc *aio_desc;
+	uint64_t asyncio_fd, asyncio_data;
 
 	vm_config = get_vm_config(vcpu->vm->vm_id);
 
@@ -692,6 +1138,12 @@ emulate_io(struct acrn_vcpu *vcpu, struct io_request *io_req)
 			emulate_pio_complete(vcpu, io_req);
 		}
 		break;
+	case ACRN_IOREQ_TYPE_PORTIO_STRING:
+		status = hv_emulate_pio_string(vcpu, io_req);
+		if (status == 0) {
+			emulate_pio_string_complete(vcpu, io_req);
+		}
+		break;
 	case ACRN_IOREQ_TYPE_MMIO:
 	case ACRN_IOREQ_TYPE_WP:
 		status = hv_emulate_mmio(vcpu, io_req);
@@ -711,9 +1163,10 @@ emulate_io(struct acrn_vcpu *vcpu, struct io_request *io_req)
 		 *
 		 * ACRN insert request to HSM and inject upcall.
 		 */
-		aio_desc = get_asyncio_desc(vcpu, io_req);
-		if (aio_desc) {
-			status = acrn_insert_asyncio(vcpu, aio_desc->fd);
+		if (coalesced_mmio_write(vcpu, io_req)) {
+			status = 0;
+		} else if (get_asyncio_fd(vcpu, io_req, &asyncio_fd, &asyncio_data)) {
+			status = acrn_insert_asyncio(vcpu, asyncio_fd, asyncio_data);
 		} else {
 			status = acrn_insert_request(vcpu, io_req);
 			if (status == 0) {
@@ -736,6 +1189,24 @@ emulate_io(struct acrn_vcpu *vcpu, struct io_request *io_req)
 }
 
 
+/* Recompute vm->emul_pio_overlap after an update of emul_pio */
+static void update_pio_overlap(struct acrn_vm *vm)
+{
+	uint32_t i, j;
+	bool overlap = false;
+
+	for (i = 0U; (i < EMUL_PIO_IDX_MAX) && !overlap; i++) {
+		for (j = i + 1U; j < EMUL_PIO_IDX_MAX; j++) {
+			if ((vm->emul_pio[i].port_start < vm->emul_pio[j].port_end) &&
+					(vm->emul_pio[j].port_start < vm->emul_pio[i].port_end)) {
+				overlap = true;
+				break;
+			}
+		}
+	}
+	vm->emul_pio_overlap = overlap;
+}
+
 /**
  * @brief Register a port I/O handler
  *
@@ -756,6 +1227,9 @@ void register_pio_emulation_handler(struct acrn_vm *vm, uint32_t pio_idx,
 	vm->emul_pio[pio_idx].port_end = range->base + range->len;
 	vm->emul_pio[pio_idx].io_read = io_read_fn_ptr;
 	vm->emul_pio[pio_idx].io_write = io_write_fn_ptr;
+	update_pio_overlap(vm);
+	/* Invalidate handlers cached by vCPUs */
+	vm->emul_pio_gen++;
 }
 
 /**
@@ -764,28 +1238,34 @@ void register_pio_emulation_handler(struct acrn_vm *vm, uint32_t pio_idx,
  * This API find match MMIO node from \p vm.
  *
  * @param vm The VM to which the MMIO node is belong to.
+ * @param pos Output the position of the node in \p vm->emul_mmio_index.
+ *
+ * @pre The caller holds vm->emul_mmio_lock
  *
  * @return If there's a match mmio_node return it, otherwise return NULL;
  */
 static inline struct mem_io_node *find_match_mmio_node(struct acrn_vm *vm,
-				uint64_t start, uint64_t end)
+				uint64_t start, uint64_t end, uint16_t *pos)
 {
-	bool found = false;
-	uint16_t idx;
-	struct mem_io_node *mmio_node;
+	struct mem_io_node *mmio_node = NULL;
+	uint16_t i;
 
-	for (idx = 0U; idx < CONFIG_MAX_EMULATED_MMIO_REGIONS; idx++) {
-		mmio_node = &(vm->emul_mmio[idx]);
-		if ((mmio_node->range_start == start) && (mmio_node->range_end == end)) {
-			found = true;
+	/* overlapping ranges may share the same start */
+	for (i = mmio_index_lower_bound(vm, start); i < vm->nr_emul_mmio_index; i++) {
+		if (vm->emul_mmio[vm->emul_mmio_index[i]].range_start != start) {
+			break;
+		}
+		if (vm->emul_mmio[vm->emul_mmio_index[i]].range_end == end) {
+			mmio_node = &(vm->emul_mmio[vm->emul_mmio_index[i]]);
 			break;
 		}
 	}
 
-	if (!found) {
+	if (mmio_node == NULL) {
 		pr_info("%s, vm[%d] no match mmio region [0x%lx, 0x%lx] is found",
 				__func__, vm->vm_id, start, end);
-		mmio_node = NULL;
+	} else {
+		*pos = i;
 	}
 
 	return mmio_node;
@@ -803,15 +1283,22 @@ static inline struct mem_io_node *find_match_mmio_node(struct acrn_vm *vm,
 static inline struct mem_io_node *find_free_mmio_node(struct acrn_vm *vm)
 {
 	uint16_t idx;
-	struct mem_io_node *mmio_node = find_match_mmio_node(vm, 0UL, 0UL);
+	struct mem_io_node *mmio_node = NULL;
 
-	if (mmio_node != NULL) {
-		idx = (uint16_t)(uint64_t)(mmio_node - &(vm->emul_mmio[0U]));
-		if (vm->nr_emul_mmio_regions < idx) {
-			vm->nr_emul_mmio_regions = idx;
+	for (idx = 0U; idx < CONFIG_MAX_EMULATED_MMIO_REGIONS; idx++) {
+		if (vm->emul_mmio[idx].read_write == NULL) {
+			mmio_node = &(vm->emul_mmio[idx]);
+			if (vm->nr_emul_mmio_regions < idx) {
+				vm->nr_emul_mmio_regions = idx;
+			}
+			break;
 		}
 	}
 
+	if (mmio_node == NULL) {
+		pr_info("%s, vm[%d] no free mmio region is found", __func__, vm->vm_id);
+	}
+
 	return mmio_node;
 }
 
@@ -831,18 +1318,30 @@ void register_mmio_emulation_handler(struct acrn_vm *vm,
 	uint64_t end, void *handler_private_data, bool hold_lock)
 {
 	struct mem_io_node *mmio_node;
+	uint16_t pos, i;
 
 	/* Ensure both a read/write handler and range check function exist */
 	if ((read_write != NULL) && (end > start)) {
 		spinlock_obtain(&vm->emul_mmio_lock);
 		mmio_node = find_free_mmio_node(vm);
 		if (mmio_node != NULL) {
+			seqcount_write_begin(&vm->emul_mmio_seq);
 			/* Fill in information for this node */
 			mmio_node->hold_lock = hold_lock;
 			mmio_node->read_write = read_write;
 			mmio_node->handler_private_data = handler_private_data;
 			mmio_node->range_start = start;
 			mmio_node->range_end = end;
+
+			/* Insert it into the sorted index */
+			pos = mmio_index_lower_bound(vm, start);
+			for (i = vm->nr_emul_mmio_index; i > pos; i--) {
+				vm->emul_mmio_index[i] = vm->emul_mmio_index[i - 1U];
+			}
+			vm->emul_mmio_index[pos] = (uint16_t)(uint64_t)(mmio_node - &(vm->emul_mmio[0U]));
+			vm->nr_emul_mmio_index++;
+			update_mmio_overlap(vm);
+			seqcount_write_end(&vm->emul_mmio_seq);
 		}
 		spinlock_release(&vm->emul_mmio_lock);
 	}
@@ -862,17 +1361,33 @@ void unregister_mmio_emulation_handler(struct acrn_vm *vm,
 					uint64_t start, uint64_t end)
 {
 	struct mem_io_node *mmio_node;
+	uint16_t pos = 0U, i;
 
 	spinlock_obtain(&vm->emul_mmio_lock);
-	mmio_node = find_match_mmio_node(vm, start, end);
+	mmio_node = find_match_mmio_node(vm, start, end, &pos);
 	if (mmio_node != NULL) {
+		seqcount_write_begin(&vm->emul_mmio_seq);
+		for (i = pos; (i + 1U) < vm->nr_emul_mmio_index; i++) {
+			vm->emul_mmio_index[i] = vm->emul_mmio_index[i + 1U];
+		}
+		vm->nr_emul_mmio_index--;
 		(void)memset(mmio_node, 0U, sizeof(struct mem_io_node));
+		update_mmio_overlap(vm);
+		seqcount_write_end(&vm->emul_mmio_seq);
 	}
 	spinlock_release(&vm->emul_mmio_lock);
 }
 
 void deinit_emul_io(struct acrn_vm *vm)
 {
+	spinlock_obtain(&vm->emul_mmio_lock);
+	seqcount_write_begin(&vm->emul_mmio_seq);
+	vm->nr_emul_mmio_index = 0U;
+	vm->emul_mmio_overlap = false;
 	(void)memset(vm->emul_mmio, 0U, sizeof(vm->emul_mmio));
+	seqcount_write_end(&vm->emul_mmio_seq);
+	spinlock_release(&vm->emul_mmio_lock);
 	(void)memset(vm->emul_pio, 0U, sizeof(vm->emul_pio));
+	vm->emul_pio_overlap = false;
+	vm->emul_pio_gen++;
 }
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <types.h>
+#include <errno.h>
+#include <rtl.h>
+#include <asm/guest/vm.h>
+#include <asm/tsc.h>
+#include <io_req.h>
+#include <tsc_counter.h>
+#include <logmsg.h>
+
+void tsc_counter_init(struct tsc_counter *tc)
+{
+	(void)memset(tc, 0U, sizeof(*tc));
+	spinlock_init(&tc->lock);
+	seqcount_init(&tc->seq);
+}
+
+/*
+ * ticks * freq / tsc_hz, exact and without overflow while tsc_hz * freq < 2^64.
+ * ACRN-DM computes its own reads of the counter the same way.
+ */
+static inline uint64_t tsc_to_counter(uint64_t ticks, uint64_t freq, uint64_t tsc_hz)
+{
+	return ((ticks / tsc_hz) * freq) + (((ticks % tsc_hz) * freq) / tsc_hz);
+}
+
+/*
+ * Reads only, the writes to the counter go on to ACRN-DM, which sets it
+ * again with HC_SET_TSC_COUNTER before it completes them.
+ */
+static int32_t tsc_counter_access_handler(struct io_request *io_req, void *handler_private_data)
+{
+	struct tsc_counter *tc = (struct tsc_counter *)handler_private_data;
+	struct acrn_mmio_request *mmio = &io_req->reqs.mmio_request;
+	uint64_t value;
+	uint32_t seq;
+	int32_t ret = -ENODEV;
+
+	if (mmio->direction == ACRN_IOREQ_DIR_READ) {
+		do {
+			seq = seqcount_read_begin(&tc->seq);
+			value = tc->value;
+			if (tc->running) {
+				value += tsc_to_counter(rdtsc() - tc->host_tsc, tc->freq, tc->tsc_hz);
+			}
+			value = (value & tc->mask) >> ((mmio->address - tc->addr) * 8UL);
+		} while (seqcount_read_retry(&tc->seq, seq));
+
+		if (mmio->size < 8UL) {
+			value &= (1UL << (mmio->size * 8UL)) - 1UL;
+		}
+		mmio->value = value;
+		ret = 0;
+	}
+
+	return ret;
+}
+
+/**
+ * @pre vm != NULL && counter != NULL
+ *
+ * counter->value is the value of the counter at the host TSC host_tsc.
+ */
+int32_t set_tsc_counter(struct acrn_vm *vm, const struct acrn_tsc_counter *counter, uint64_t host_tsc)
+{
+	struct tsc_counter *tc = &vm->tsc_counter;
+	uint64_t tsc_hz = (uint64_t)get_tsc_khz() * 1000UL;
+	bool active = ((counter->flags & ACRN_TSC_COUNTER_ACTIVE) != 0U);
+	int32_t ret = 0;
+
+	if (active && ((counter->mask == 0UL) || (counter->freq == 0U) || ((uint64_t)counter->freq >= tsc_hz) ||
+			((counter->addr & 7UL) != 0UL))) {
+		pr_err("%s: vm%d invalid counter at 0x%lx, %u Hz", __func__, vm->vm_id, counter->addr, counter->freq);
+		ret = -EINVAL;
+	} else {
+		spinlock_obtain(&tc->lock);
+		if (tc->active && (!active || (tc->addr != counter->addr))) {
+			unregister_mmio_emulation_handler(vm, tc->addr, tc->addr + 8UL);
+			tc->active = false;
+		}
+
+		seqcount_write_begin(&tc->seq);
+		tc->running = ((counter->flags & ACRN_TSC_COUNTER_RUNNING) != 0U);
+		tc->addr = counter->addr;
+		tc->value = counter->value;
+		tc->host_tsc = host_tsc;
+		tc->mask = counter->mask;
+		tc->freq = counter->freq;
+		tc->tsc_hz = tsc_hz;
+		seqcount_write_end(&tc->seq);
+
+		if (active && !tc->active) {
+			register_mmio_emulation_handler(vm, tsc_counter_access_handler,
+					counter->addr, counter->addr + 8UL, tc, false);
+			tc->active = true;
+		}
+		spinlock_release(&tc->lock);
+	}
+
+	return ret;
+}
@@ -40,7 +40,8 @@
 #define	RTBL_RO_BITS	((uint32_t)0x00004000U | (uint32_t)0x00001000U) /*Remote IRR and Delivery Status bits*/
 
 #define DBG_LEVEL_VIOAPIC	6U
-#define ACRN_IOAPIC_VERSION	0x11U
+/* 0x20 has the EOI register the guest uses once it suppresses the EOI broadcast */
+#define ACRN_IOAPIC_VERSION	0x20U
 
 #define MASK_ALL_INTERRUPTS   0x0001000000010000UL
 
@@ -49,6 +50,34 @@ static inline struct acrn_vioapics *vm_ioapics(const struct acrn_vm *vm)
 	return (struct acrn_vioapics *)&(vm->arch_vm.vioapics);
 }
 
+/*
+ * Locking: the lock serializes the register accesses of the guest, ioregsel
+ * and the RTE updates. The line level and the Remote IRR of a pin are kept in
+ * bitmaps apart from rtbl and only changed with atomic bit operations, so the
+ * assert/deassert and EOI paths run without the lock and independent pins
+ * don't contend. They see an RTE whole, rtbl[] is stored 64 bits at a time.
+ * Every updater changes its bit before it reads the other state, and the RTE
+ * writer stores the RTE before it reads the level, so that at least one of
+ * two racing sides sees the other and delivers.
+ */
+
+/**
+ * @brief The RTE of a pin, with its Remote IRR
+ *
+ * @pre pin < vioapic->chipinfo.nr_pins
+ */
+static inline union ioapic_rte vioapic_rte(const struct acrn_single_vioapic *vioapic, uint32_t pin)
+{
+	union ioapic_rte rte;
+
+	rte.full = vioapic->rtbl[pin].full;
+	if (bitmap_test((uint16_t)(pin & 0x3FU), &vioapic->remote_irr[pin >> 6U])) {
+		rte.bits.remote_irr = IOAPIC_RTE_REM_IRR;
+	}
+
+	return rte;
+}
+
 /**
  * @pre pin < vioapic->chipinfo.nr_pins
  */
@@ -59,7 +88,7 @@ vioapic_generate_intr(struct acrn_single_vioapic *vioapic, uint32_t pin)
 	union ioapic_rte rte;
 	bool level, phys;
 
-	rte = vioapic->rtbl[pin];
+	rte.full = vioapic->rtbl[pin].full;
 
 	if (rte.bits.intr_mask == IOAPIC_RTE_MASK_SET) {
 		dev_dbg(DBG_LEVEL_VIOAPIC, "ioapic pin%hhu: masked", pin);
@@ -71,10 +100,7 @@ vioapic_generate_intr(struct acrn_single_vioapic *vioapic, uint32_t pin)
 		/* For level trigger irq, avoid send intr if
 		 * previous one hasn't received EOI
 		 */
-		if (!level || (vioapic->rtbl[pin].bits.remote_irr == 0UL)) {
-			if (level) {
-				vioapic->rtbl[pin].bits.remote_irr = IOAPIC_RTE_REM_IRR;
-			}
+		if (!level || !bitmap_test_and_set_lock((uint16_t)(pin & 0x3FU), &vioapic->remote_irr[pin >> 6U])) {
 			vector = rte.bits.vector;
 			dest = rte.bits.dest_field;
 			vlapic_receive_intr(vioapic->vm, level, dest, phys, delmode, vector, false);
@@ -88,24 +114,22 @@ vioapic_generate_intr(struct acrn_single_vioapic *vioapic, uint32_t pin)
 static void
 vioapic_set_pinstate(struct acrn_single_vioapic *vioapic, uint32_t pin, uint32_t level)
 {
-	uint32_t old_lvl;
+	bool old_lvl;
 	union ioapic_rte rte;
 
 	if (pin < vioapic->chipinfo.nr_pins) {
-		rte = vioapic->rtbl[pin];
-		old_lvl = (uint32_t)bitmap_test((uint16_t)(pin & 0x3FU), &vioapic->pin_state[pin >> 6U]);
 		if (level == 0U) {
 			/* clear pin_state and deliver interrupt according to polarity */
-			bitmap_clear_nolock((uint16_t)(pin & 0x3FU), &vioapic->pin_state[pin >> 6U]);
-			if ((rte.bits.intr_polarity == IOAPIC_RTE_INTPOL_ALO)
-				&& (old_lvl != level)) {
+			old_lvl = bitmap_test_and_clear_lock((uint16_t)(pin & 0x3FU), &vioapic->pin_state[pin >> 6U]);
+			rte.full = vioapic->rtbl[pin].full;
+			if ((rte.bits.intr_polarity == IOAPIC_RTE_INTPOL_ALO) && old_lvl) {
 				vioapic_generate_intr(vioapic, pin);
 			}
 		} else {
 			/* set pin_state and deliver intrrupt according to polarity */
-			bitmap_set_nolock((uint16_t)(pin & 0x3FU), &vioapic->pin_state[pin >> 6U]);
-			if ((rte.bits.intr_polarity == IOAPIC_RTE_INTPOL_AHI)
-				&& (old_lvl != level)) {
+			old_lvl = bitmap_test_and_set_lock((uint16_t)(pin & 0x3FU), &vioapic->pin_state[pin >> 6U]);
+			rte.full = vioapic->rtbl[pin].full;
+			if ((rte.bits.intr_polarity == IOAPIC_RTE_INTPOL_AHI) && !old_lvl) {
 				vioapic_generate_intr(vioapic, pin);
 			}
 		}
@@ -139,8 +163,7 @@ vgsi_to_vioapic_and_vpin(const struct acrn_vm *vm, uint32_t vgsi, uint32_t *vpin
 /**
  * @brief Set vIOAPIC IRQ line status.
  *
- * Similar with vioapic_set_irqline_lock(),but would not make sure
- * operation be done with ioapic lock.
+ * The pin state is updated atomically, this doesn't take the ioapic lock.
  *
  * @param[in] vm        Pointer to target VM
  * @param[in] vgsi   	Target GSI number
@@ -196,13 +219,8 @@ vioapic_set_irqline_nolock(const struct acrn_vm *vm, uint32_t vgsi, uint32_t ope
 void
 vioapic_set_irqline_lock(const struct acrn_vm *vm, uint32_t vgsi, uint32_t operation)
 {
-	uint64_t rflags;
-	struct acrn_single_vioapic *vioapic;
-
-	vioapic = vgsi_to_vioapic_and_vpin(vm, vgsi, NULL);
-	spinlock_irqsave_obtain(&(vioapic->lock), &rflags);
+	/* nothing left to lock, asserting a pin doesn't contend with the other pins or the RTE updates */
 	vioapic_set_irqline_nolock(vm, vgsi, operation);
-	spinlock_irqrestore_release(&(vioapic->lock), rflags);
 }
 
 static uint32_t
@@ -255,10 +273,14 @@ vioapic_indirect_read(struct acrn_single_vioapic *vioapic, uint32_t addr)
 				entry = find_ptirq_entry(PTDEV_INTR_INTX, &virt_sid, vioapic->vm);
 				if (entry != NULL) {
 					ioapic_get_rte(entry->allocated_pirq, &phys_rte);
-					vioapic->rtbl[pin].bits.remote_irr = phys_rte.bits.remote_irr;
+					if (phys_rte.bits.remote_irr != 0UL) {
+						bitmap_set_lock((uint16_t)(pin & 0x3FU), &vioapic->remote_irr[pin >> 6U]);
+					} else {
+						bitmap_clear_lock((uint16_t)(pin & 0x3FU), &vioapic->remote_irr[pin >> 6U]);
+					}
 				}
 			}
-			ret = vioapic->rtbl[pin].u.lo_32;
+			ret = vioapic_rte(vioapic, pin).u.lo_32;
 		}
 	}
 
@@ -318,7 +340,7 @@ static void vioapic_indirect_write(struct acrn_single_vioapic *vioapic, uint32_t
 		uint32_t rte_offset = addr_offset >> 1U;
 		pin = rte_offset;
 
-		last = vioapic->rtbl[pin];
+		last = vioapic_rte(vioapic, pin);
 		new = last;
 		if ((addr_offset & 1U) != 0U) {
 			new.u.hi_32 = data;
@@ -360,9 +382,16 @@ static void vioapic_indirect_write(struct acrn_single_vioapic *vioapic, uint32_t
 		}
 
 		if (wire_mode_valid) {
-			vioapic->rtbl[pin] = new;
+			/* the Remote IRR of a level RTE is read-only, left to the asserts and the EOIs */
+			if (new.bits.trigger_mode == IOAPIC_RTE_TRGRMODE_EDGE) {
+				bitmap_clear_lock((uint16_t)(pin & 0x3FU), &vioapic->remote_irr[pin >> 6U]);
+			}
 			dev_dbg(DBG_LEVEL_VIOAPIC, "ioapic pin%hhu: redir table entry %#lx",
-				pin, vioapic->rtbl[pin].full);
+				pin, new.full);
+			new.bits.remote_irr = 0UL;
+			vioapic->rtbl[pin].full = new.full;
+			/* store the RTE before reading the level, see vioapic_set_pinstate() */
+			cpu_memory_barrier();
 
 			/* remap for ptdev */
 			if ((new.bits.intr_mask == IOAPIC_RTE_MASK_CLR) || (last.bits.intr_mask  == IOAPIC_RTE_MASK_CLR)) {
@@ -378,8 +407,8 @@ static void vioapic_indirect_write(struct acrn_single_vioapic *vioapic, uint32_t
 			 * - previous interrupt has been EOIed
 			 * - pin level is asserted
 			 */
-			if ((vioapic->rtbl[pin].bits.intr_mask == IOAPIC_RTE_MASK_CLR) &&
-				(vioapic->rtbl[pin].bits.remote_irr == 0UL) &&
+			if ((new.bits.intr_mask == IOAPIC_RTE_MASK_CLR) &&
+				!bitmap_test((uint16_t)(pin & 0x3FU), &vioapic->remote_irr[pin >> 6U]) &&
 				vioapic_need_intr(vioapic, (uint16_t)pin)) {
 				dev_dbg(DBG_LEVEL_VIOAPIC, "ioapic pin%hhu: asserted at rtbl write", pin);
 				vioapic_generate_intr(vioapic, pin);
@@ -388,12 +417,15 @@ static void vioapic_indirect_write(struct acrn_single_vioapic *vioapic, uint32_t
 	}
 }
 
+static void vioapic_process_eoi(struct acrn_single_vioapic *vioapic, uint32_t vector);
+
 static void
 vioapic_mmio_rw(struct acrn_single_vioapic *vioapic, uint64_t gpa,
 		uint32_t *data, bool do_read)
 {
 	uint32_t offset;
 	uint64_t rflags;
+	uint32_t eoi_vector = 0U;
 
 	offset = (uint32_t)(gpa - vioapic->chipinfo.addr);
 
@@ -419,6 +451,14 @@ vioapic_mmio_rw(struct acrn_single_vioapic *vioapic, uint64_t gpa,
 						 vioapic->ioregsel, *data);
 		}
 		break;
+	case IOAPIC_EOIR:
+		/* the directed EOI of a guest which suppresses the LAPIC broadcast */
+		if (do_read) {
+			*data = 0U;
+		} else {
+			eoi_vector = *data & 0xFFU;
+		}
+		break;
 	default:
 		if (do_read) {
 			*data = 0xFFFFFFFFU;
@@ -427,6 +467,11 @@ vioapic_mmio_rw(struct acrn_single_vioapic *vioapic, uint64_t gpa,
 	}
 
 	spinlock_irqrestore_release(&(vioapic->lock), rflags);
+
+	/* vioapic_process_eoi() doesn't need the lock, and acks the passthrough pins without it */
+	if (eoi_vector != 0U) {
+		vioapic_process_eoi(vioapic, eoi_vector);
+	}
 }
 
 /*
@@ -437,7 +482,6 @@ vioapic_process_eoi(struct acrn_single_vioapic *vioapic, uint32_t vector)
 {
 	uint32_t pin, pincount = vioapic->chipinfo.nr_pins;
 	union ioapic_rte rte;
-	uint64_t rflags;
 
 	if ((vector < VECTOR_DYNAMIC_START) || (vector > NR_MAX_VECTOR)) {
 		pr_err("vioapic_process_eoi: invalid vector %u", vector);
@@ -447,7 +491,7 @@ vioapic_process_eoi(struct acrn_single_vioapic *vioapic, uint32_t vector)
 
 	/* notify device to ack if assigned pin */
 	for (pin = 0U; pin < pincount; pin++) {
-		rte = vioapic->rtbl[pin];
+		rte = vioapic_rte(vioapic, pin);
 		if ((rte.bits.vector != vector) ||
 			(rte.bits.remote_irr == 0U)) {
 			continue;
@@ -460,22 +504,19 @@ vioapic_process_eoi(struct acrn_single_vioapic *vioapic, uint32_t vector)
 	 * XXX keep track of the pins associated with this vector instead
 	 * of iterating on every single pin each time.
 	 */
-	spinlock_irqsave_obtain(&(vioapic->lock), &rflags);
 	for (pin = 0U; pin < pincount; pin++) {
-		rte = vioapic->rtbl[pin];
+		rte.full = vioapic->rtbl[pin].full;
 		if ((rte.bits.vector != vector) ||
-			(rte.bits.remote_irr == 0U)) {
+			!bitmap_test_and_clear_lock((uint16_t)(pin & 0x3FU), &vioapic->remote_irr[pin >> 6U])) {
 			continue;
 		}
 
-		vioapic->rtbl[pin].bits.remote_irr = 0U;
 		if (vioapic_need_intr(vioapic, (uint16_t)pin)) {
 			dev_dbg(DBG_LEVEL_VIOAPIC,
 				"ioapic pin%hhu: asserted at eoi", pin);
 			vioapic_generate_intr(vioapic, pin);
 		}
 	}
-	spinlock_irqrestore_release(&(vioapic->lock), rflags);
 }
 
 void vioapic_broadcast_eoi(const struct acrn_vm *vm, uint32_t vector)
@@ -503,6 +544,7 @@ static void reset_one_vioapic(struct acrn_single_vioapic *vioapic)
 	for (pin = 0U; pin < pincount; pin++) {
 		vioapic->rtbl[pin].full = MASK_ALL_INTERRUPTS;
 	}
+	(void)memset((void *)vioapic->remote_irr, 0U, sizeof(vioapic->remote_irr));
 	vioapic->chipinfo.id = 0U;
 	vioapic->ioregsel = 0U;
 }
@@ -605,5 +647,61 @@ void vioapic_get_rte(const struct acrn_vm *vm, uint32_t vgsi, union ioapic_rte *
 	uint32_t pin;
 	vioapic = vgsi_to_vioapic_and_vpin(vm, vgsi, &pin);
 
-	*rte = vioapic->rtbl[pin];
+	*rte = vioapic_rte(vioapic, pin);
+}
+
+/**
+ * @brief Save the vIOAPIC of a post-launched VM
+ *
+ * @pre is_postlaunched_vm(vm)
+ */
+void vioapic_get_state(const struct acrn_vm *vm, struct acrn_vioapic_state *state)
+{
+	struct acrn_single_vioapic *vioapic = &vm_ioapics(vm)->vioapic_array[0];
+	uint64_t rflags;
+	uint32_t pin;
+
+	spinlock_irqsave_obtain(&(vioapic->lock), &rflags);
+	state->id = vioapic->chipinfo.id;
+	state->ioregsel = vioapic->ioregsel;
+	state->nr_pins = vioapic->chipinfo.nr_pins;
+	for (pin = 0U; pin < vioapic->chipinfo.nr_pins; pin++) {
+		state->rte[pin] = vioapic_rte(vioapic, pin).full;
+	}
+	spinlock_irqrestore_release(&(vioapic->lock), rflags);
+}
+
+/**
+ * @brief Load the vIOAPIC of a post-launched VM not started yet
+ *
+ * The Remote IRR bits are cleared: the vLAPICs drop the in-service interrupts
+ * on restore, their EOIs would not reach the vIOAPIC. The line levels are left
+ * to the devices of ACRN-DM.
+ *
+ * @pre is_postlaunched_vm(vm)
+ */
+int32_t vioapic_set_state(struct acrn_vm *vm, const struct acrn_vioapic_state *state)
+{
+	struct acrn_single_vioapic *vioapic = &vm_ioapics(vm)->vioapic_array[0];
+	uint64_t rflags;
+	uint32_t pin;
+	int32_t ret = -EINVAL;
+
+	if (state->nr_pins == vioapic->chipinfo.nr_pins) {
+		spinlock_irqsave_obtain(&(vioapic->lock), &rflags);
+		vioapic->chipinfo.id = (uint8_t)state->id;
+		vioapic->ioregsel = state->ioregsel;
+		for (pin = 0U; pin < vioapic->chipinfo.nr_pins; pin++) {
+			vioapic->rtbl[pin].full = state->rte[pin];
+			vioapic->rtbl[pin].bits.remote_irr = 0U;
+		}
+		(void)memset((void *)vioapic->remote_irr, 0U, sizeof(vioapic->remote_irr));
+		if (vioapic->rtbl[0].bits.intr_mask == IOAPIC_RTE_MASK_CLR) {
+			vm->wire_mode = VPIC_WIRE_IOAPIC;
+		}
+		spinlock_irqrestore_release(&(vioapic->lock), rflags);
+		ret = 0;
+	}
+
+	return ret;
 }
@@ -12,6 +12,7 @@
 #include <errno.h>
 #include <ivshmem.h>
 #include <ivshmem_cfg.h>
+#include <acrn_ivshmem_virtio.h>
 #include "vpci_priv.h"
 
 /* config space of ivshmem device */
@@ -34,6 +35,29 @@
 #define	IVSHMEM_IV_POS_REG	0x8U
 #define	IVSHMEM_DOORBELL_REG	0xcU
 
+/*
+ * The extended doorbell of the HV-land ivshmem server, in the reserved part
+ * of BAR0. A doorbell written to IVSHMEM_DB_SEND_REG carries the 64 bits
+ * staged in IVSHMEM_DB_PAYLOAD_LO/HI_REG to the ring of the peer, which
+ * pops them with IVSHMEM_DB_RECV_REG. The peer is only interrupted when its
+ * ring turns non-empty, and not at all while it has IVSHMEM_DB_POLLED set.
+ */
+#define	IVSHMEM_DB_PAYLOAD_LO_REG	0x10U	/* WO */
+#define	IVSHMEM_DB_PAYLOAD_HI_REG	0x14U	/* WO */
+#define	IVSHMEM_DB_SEND_REG		0x18U	/* W: doorbell, R: status of the last send */
+#define	IVSHMEM_DB_CTRL_REG		0x1cU	/* RW */
+#define	IVSHMEM_DB_RECV_REG		0x20U	/* RO, pops an entry */
+#define	IVSHMEM_DB_RECV_LO_REG		0x24U	/* RO, payload of the popped entry */
+#define	IVSHMEM_DB_RECV_HI_REG		0x28U	/* RO */
+#define	IVSHMEM_DB_PENDING_REG		0x2cU	/* RO, entries left in the ring */
+
+#define	IVSHMEM_DB_POLLED		(1U << 0U)	/* IVSHMEM_DB_CTRL_REG: no notifications */
+#define	IVSHMEM_DB_SEND_FULL		(1U << 0U)	/* IVSHMEM_DB_SEND_REG: ring of the peer full */
+#define	IVSHMEM_DB_SEND_NO_PEER		(1U << 1U)
+#define	IVSHMEM_DB_RECV_VALID		(1U << 31U)	/* IVSHMEM_DB_RECV_REG: peer ID << 16 | vector */
+
+#define	IVSHMEM_DB_RING_SIZE		32U
+
 static struct ivshmem_shm_region mem_regions[8] = {
 	IVSHMEM_SHM_REGIONS
 };
@@ -46,6 +70,19 @@ union ivshmem_doorbell {
 	} reg;
 };
 
+struct ivshmem_db_entry {
+	uint16_t vector_index;
+	uint16_t peer_id;
+	uint64_t payload;
+};
+
+struct ivshmem_db_ring {
+	spinlock_t lock;
+	uint32_t head;
+	uint32_t tail;
+	struct ivshmem_db_entry entries[IVSHMEM_DB_RING_SIZE];
+};
+
 struct ivshmem_device {
 	struct pci_vdev* pcidev;
 	union {
@@ -64,6 +101,14 @@ struct ivshmem_device {
 		} regs;
 	} mmio;
 	struct ivshmem_shm_region *region;
+
+	/* the extended doorbell */
+	uint64_t db_payload;		/* staged by this device for its next send */
+	uint32_t db_send_status;
+	uint32_t db_ctrl;
+	struct ivshmem_db_entry db_recv;	/* the last entry popped by this device */
+	bool db_recv_valid;
+	struct ivshmem_db_ring db_ring;		/* the entries sent to this device */
 };
 
 static struct ivshmem_device ivshmem_dev[IVSHMEM_DEV_NUM];
@@ -74,9 +119,22 @@ void init_ivshmem_shared_memory()
 	uint32_t i;
 	uint64_t addr;
 
-	addr = e820_alloc_memory(roundup(IVSHMEM_SHM_SIZE, PDE_SIZE), MEM_SIZE_MAX);
+	/*
+	 * Each region is a power of 2 of at least 2MB, packed from a 2MB aligned
+	 * base, so every VM maps it with 2MB EPT leaves only and no page-table
+	 * page of its own below the PD. The regions are at most 512MB, 2MB is
+	 * the largest page they can all be mapped with.
+	 *
+	 * e820_alloc_memory() only aligns on 4KB, so take the slack for the 2MB
+	 * alignment of the base: the regions after it stay aligned as long as the
+	 * sizes are 2MB multiples, which the configuration schema enforces.
+	 */
+	addr = e820_alloc_memory(roundup(IVSHMEM_SHM_SIZE, PDE_SIZE) + PDE_SIZE - PAGE_SIZE, MEM_SIZE_MAX);
+	addr = roundup(addr, PDE_SIZE);
 	for (i = 0U; i < ARRAY_SIZE(mem_regions); i++) {
 		mem_regions[i].hpa = addr;
+		ASSERT(mem_aligned_check(addr, PDE_SIZE) && mem_aligned_check(mem_regions[i].size, PDE_SIZE),
+			"ivshmem region is not 2MB aligned");
 		addr += mem_regions[i].size;
 	}
 }
@@ -131,34 +189,135 @@ static void ivshmem_server_unbind_peer(struct pci_vdev *vdev)
 }
 
 /*
- * @pre src_ivs_dev != NULL
+ * @pre dest_ivs_dev != NULL
  */
-static void ivshmem_server_notify_peer(struct ivshmem_device *src_ivs_dev, uint16_t dest_peer_id, uint16_t vector_index)
+static void ivshmem_server_inject_msi(struct ivshmem_device *dest_ivs_dev, uint16_t vector_index)
 {
 	struct acrn_vm *dest_vm;
-	struct ivshmem_device *dest_ivs_dev;
 	struct msix_table_entry *entry;
-	struct ivshmem_shm_region *region = src_ivs_dev->region;
+
+	if (vpci_vmsix_enabled(dest_ivs_dev->pcidev) && (vector_index < dest_ivs_dev->pcidev->msix.table_count)) {
+		entry = &(dest_ivs_dev->pcidev->msix.table_entries[vector_index]);
+		if ((entry->vector_control & PCIM_MSIX_VCTRL_MASK) == 0U) {
+
+			dest_vm = vpci2vm(dest_ivs_dev->pcidev->vpci);
+			vlapic_inject_msi(dest_vm, entry->addr, entry->data);
+		} else {
+			pr_err("%s,target msix entry [%d] is masked.\n",
+				__func__, vector_index);
+		}
+	} else {
+		pr_err("%s,Invalid vector index [%d] or MSI-X is disabled.\n",
+			__func__, vector_index);
+	}
+}
+
+/*
+ * @pre src_ivs_dev != NULL
+ */
+static struct ivshmem_device *ivshmem_server_find_peer(const struct ivshmem_device *src_ivs_dev, uint16_t dest_peer_id)
+{
+	struct ivshmem_device *dest_ivs_dev = NULL;
 
 	if (dest_peer_id < MAX_IVSHMEM_PEER_NUM) {
+		dest_ivs_dev = src_ivs_dev->region->doorbell_peers[dest_peer_id];
+	}
+	if (dest_ivs_dev == NULL) {
+		pr_err("%s,Invalid peer, ID = %d.\n", __func__, dest_peer_id);
+	}
+	return dest_ivs_dev;
+}
 
-		dest_ivs_dev = region->doorbell_peers[dest_peer_id];
-		if ((dest_ivs_dev != NULL) && vpci_vmsix_enabled(dest_ivs_dev->pcidev)
-			&& (vector_index < dest_ivs_dev->pcidev->msix.table_count)) {
+/*
+ * @pre src_ivs_dev != NULL
+ */
+static void ivshmem_server_notify_peer(struct ivshmem_device *src_ivs_dev, uint16_t dest_peer_id, uint16_t vector_index)
+{
+	struct ivshmem_device *dest_ivs_dev = ivshmem_server_find_peer(src_ivs_dev, dest_peer_id);
 
-			entry = &(dest_ivs_dev->pcidev->msix.table_entries[vector_index]);
-			if ((entry->vector_control & PCIM_MSIX_VCTRL_MASK) == 0U) {
+	if (dest_ivs_dev != NULL) {
+		ivshmem_server_inject_msi(dest_ivs_dev, vector_index);
+	}
+}
 
-				dest_vm = vpci2vm(dest_ivs_dev->pcidev->vpci);
-				vlapic_inject_msi(dest_vm, entry->addr, entry->data);
-			} else {
-				pr_err("%s,target msix entry [%d] is masked.\n",
-					__func__, vector_index);
-			}
+/*
+ * Queue the staged payload of src_ivs_dev to the ring of the peer. The peer
+ * is interrupted only when its ring was empty: until it has drained the ring
+ * it sees the later entries without another interrupt. In polled mode it is
+ * not interrupted at all.
+ *
+ * @pre src_ivs_dev != NULL
+ */
+static void ivshmem_server_send_peer(struct ivshmem_device *src_ivs_dev, uint16_t dest_peer_id, uint16_t vector_index)
+{
+	struct ivshmem_device *dest_ivs_dev = ivshmem_server_find_peer(src_ivs_dev, dest_peer_id);
+	struct ivshmem_db_ring *ring;
+	struct ivshmem_db_entry *entry;
+	bool notify = false;
+
+	if (dest_ivs_dev != NULL) {
+		ring = &dest_ivs_dev->db_ring;
+		spinlock_obtain(&ring->lock);
+		if ((ring->tail - ring->head) < IVSHMEM_DB_RING_SIZE) {
+			entry = &ring->entries[ring->tail % IVSHMEM_DB_RING_SIZE];
+			entry->vector_index = vector_index;
+			entry->peer_id = (uint16_t)src_ivs_dev->mmio.regs.ivpos;
+			entry->payload = src_ivs_dev->db_payload;
+			notify = (ring->tail == ring->head) && ((dest_ivs_dev->db_ctrl & IVSHMEM_DB_POLLED) == 0U);
+			ring->tail++;
+			src_ivs_dev->db_send_status = 0U;
 		} else {
-			pr_err("%s,Invalid peer, ID = %d, vector index [%d] or MSI-X is disabled.\n",
-				__func__, dest_peer_id, vector_index);
+			src_ivs_dev->db_send_status = IVSHMEM_DB_SEND_FULL;
 		}
+		spinlock_release(&ring->lock);
+
+		if (notify) {
+			ivshmem_server_inject_msi(dest_ivs_dev, vector_index);
+		}
+	} else {
+		src_ivs_dev->db_send_status = IVSHMEM_DB_SEND_NO_PEER;
+	}
+}
+
+/*
+ * @pre ivs_dev != NULL
+ */
+static void ivshmem_server_recv(struct ivshmem_device *ivs_dev)
+{
+	struct ivshmem_db_ring *ring = &ivs_dev->db_ring;
+
+	spinlock_obtain(&ring->lock);
+	ivs_dev->db_recv_valid = (ring->head != ring->tail);
+	if (ivs_dev->db_recv_valid) {
+		ivs_dev->db_recv = ring->entries[ring->head % IVSHMEM_DB_RING_SIZE];
+		ring->head++;
+	}
+	spinlock_release(&ring->lock);
+}
+
+/*
+ * Leaving the polled mode with entries in the ring raises the vector of the
+ * oldest one, the sender did not when it queued them.
+ *
+ * @pre ivs_dev != NULL
+ */
+static void ivshmem_server_set_ctrl(struct ivshmem_device *ivs_dev, uint32_t ctrl)
+{
+	struct ivshmem_db_ring *ring = &ivs_dev->db_ring;
+	uint16_t vector_index = 0U;
+	bool notify;
+
+	spinlock_obtain(&ring->lock);
+	notify = ((ivs_dev->db_ctrl & IVSHMEM_DB_POLLED) != 0U) && ((ctrl & IVSHMEM_DB_POLLED) == 0U)
+		&& (ring->head != ring->tail);
+	if (notify) {
+		vector_index = ring->entries[ring->head % IVSHMEM_DB_RING_SIZE].vector_index;
+	}
+	ivs_dev->db_ctrl = ctrl & IVSHMEM_DB_POLLED;
+	spinlock_release(&ring->lock);
+
+	if (notify) {
+		ivshmem_server_inject_msi(ivs_dev, vector_index);
 	}
 }
 
@@ -184,6 +343,73 @@ static void create_ivshmem_device(struct pci_vdev *vdev)
 	 * states after VM reboot.
 	 */
 	memset(&ivshmem_dev[i].mmio, 0U, sizeof(uint32_t) * 4);
+	ivshmem_dev[i].db_payload = 0UL;
+	ivshmem_dev[i].db_send_status = 0U;
+	ivshmem_dev[i].db_ctrl = 0U;
+	ivshmem_dev[i].db_recv_valid = false;
+	spinlock_init(&ivshmem_dev[i].db_ring.lock);
+	ivshmem_dev[i].db_ring.head = 0U;
+	ivshmem_dev[i].db_ring.tail = 0U;
+}
+
+/*
+ * @pre ivs_dev != NULL
+ */
+static void ivshmem_db_mmio_access(struct ivshmem_device *ivs_dev, struct acrn_mmio_request *mmio, uint64_t offset)
+{
+	union ivshmem_doorbell doorbell;
+	const struct ivshmem_db_ring *ring = &ivs_dev->db_ring;
+
+	if (mmio->direction == ACRN_IOREQ_DIR_READ) {
+		switch (offset) {
+		case IVSHMEM_DB_SEND_REG:
+			mmio->value = ivs_dev->db_send_status;
+			break;
+		case IVSHMEM_DB_CTRL_REG:
+			mmio->value = ivs_dev->db_ctrl;
+			break;
+		case IVSHMEM_DB_RECV_REG:
+			ivshmem_server_recv(ivs_dev);
+			if (ivs_dev->db_recv_valid) {
+				mmio->value = IVSHMEM_DB_RECV_VALID | ((uint32_t)ivs_dev->db_recv.peer_id << 16U)
+					| ivs_dev->db_recv.vector_index;
+			} else {
+				mmio->value = 0UL;
+			}
+			break;
+		case IVSHMEM_DB_RECV_LO_REG:
+			mmio->value = ivs_dev->db_recv_valid ? (uint32_t)ivs_dev->db_recv.payload : 0U;
+			break;
+		case IVSHMEM_DB_RECV_HI_REG:
+			mmio->value = ivs_dev->db_recv_valid ? (uint32_t)(ivs_dev->db_recv.payload >> 32U) : 0U;
+			break;
+		case IVSHMEM_DB_PENDING_REG:
+			mmio->value = ring->tail - ring->head;
+			break;
+		default:
+			mmio->value = 0UL;
+			break;
+		}
+	} else {
+		switch (offset) {
+		case IVSHMEM_DB_PAYLOAD_LO_REG:
+			ivs_dev->db_payload = (ivs_dev->db_payload & ~0xffffffffUL) | (mmio->value & 0xffffffffUL);
+			break;
+		case IVSHMEM_DB_PAYLOAD_HI_REG:
+			ivs_dev->db_payload = (ivs_dev->db_payload & 0xffffffffUL) | (mmio->value << 32U);
+			break;
+		case IVSHMEM_DB_SEND_REG:
+			doorbell.val = (uint32_t)mmio->value;
+			ivshmem_server_send_peer(ivs_dev, doorbell.reg.peer_id, doorbell.reg.vector_index);
+			break;
+		case IVSHMEM_DB_CTRL_REG:
+			ivshmem_server_set_ctrl(ivs_dev, (uint32_t)mmio->value);
+			break;
+		default:
+			/* the rest is read-only or reserved */
+			break;
+		}
+	}
 }
 
 /*
@@ -223,6 +449,8 @@ static int32_t ivshmem_mmio_handler(struct io_request *io_req, void *data)
 				}
 			}
 		}
+	} else if ((mmio->size == 4U) && ((offset & 0x3U) == 0U) && (offset <= IVSHMEM_DB_PENDING_REG)) {
+		ivshmem_db_mmio_access(ivs_dev, mmio, offset);
 	}
 	return 0;
 }
@@ -370,16 +598,34 @@ static void deinit_ivshmem_vdev(struct pci_vdev *vdev)
  * @pre vm != NULL
  * @pre dev != NULL
  */
+/*
+ * Advertise the virtio device the VM runs over the region, and its side.
+ *
+ * @pre vdev != NULL
+ */
+static void init_ivshmem_virtio(struct pci_vdev *vdev, const struct acrn_ivshmem_config *cfg)
+{
+	if (cfg->virtio_id != 0U) {
+		spinlock_obtain(&vdev->lock);
+		pci_vdev_write_vcfg(vdev, PCIV_SUB_VENDOR_ID, 2U, IVSHMEM_VIRTIO_SUBVENDOR_ID);
+		pci_vdev_write_vcfg(vdev, PCIV_SUB_SYSTEM_ID, 2U, IVSHMEM_VIRTIO_SUBDEV_BASE + cfg->virtio_id);
+		pci_vdev_write_vcfg(vdev, PCIR_CLASS_CODE, 1U, cfg->virtio_role);
+		spinlock_release(&vdev->lock);
+	}
+}
+
 int32_t create_ivshmem_vdev(struct acrn_vm *vm, struct acrn_vdev *dev)
 {
 	uint32_t i;
 	struct acrn_vm_config *vm_config = get_vm_config(vm->vm_id);
 	struct acrn_vm_pci_dev_config *dev_config = NULL;
+	const struct acrn_ivshmem_config *cfg = (const struct acrn_ivshmem_config *)dev->args;
+	struct pci_vdev *vdev;
 	int32_t ret = -EINVAL;
 
 	for (i = 0U; i < vm_config->pci_dev_num; i++) {
 		dev_config = &vm_config->pci_devs[i];
-		if (strncmp(dev_config->shm_region_name, (char *)dev->args, sizeof(dev_config->shm_region_name)) == 0) {
+		if (strncmp(dev_config->shm_region_name, cfg->shm_name, sizeof(dev_config->shm_region_name)) == 0) {
 			struct ivshmem_shm_region *region = find_shm_region(dev_config->shm_region_name);
 			if ((region != NULL) && (region->size == dev->io_size[IVSHMEM_SHM_BAR])) {
 				spinlock_obtain(&vm->vpci.lock);
@@ -388,7 +634,8 @@ int32_t create_ivshmem_vdev(struct acrn_vm *vm, struct acrn_vdev *dev)
 				dev_config->vbar_base[IVSHMEM_MSIX_BAR] = (uint64_t) dev->io_addr[IVSHMEM_MSIX_BAR];
 				dev_config->vbar_base[IVSHMEM_SHM_BAR] = (uint64_t) dev->io_addr[IVSHMEM_SHM_BAR];
 				dev_config->vbar_base[IVSHMEM_SHM_BAR] |= ((uint64_t) dev->io_addr[IVSHMEM_SHM_BAR + 1U]) << 32U;
-				(void) vpci_init_vdev(&vm->vpci, dev_config, NULL);
+				vdev = vpci_init_vdev(&vm->vpci, dev_config, NULL);
+				init_ivshmem_virtio(vdev, cfg);
 				spinlock_release(&vm->vpci.lock);
 				ret = 0;
 			} else {
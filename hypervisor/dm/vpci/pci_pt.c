@@ -97,12 +97,17 @@ static void mask_one_msix_vector(const struct pci_vdev *vdev, uint32_t index)
 }
 
 
+static inline bool is_vmsix_entry_remapped(const struct pci_vdev *vdev, uint32_t index)
+{
+	return bitmap_test((uint16_t)(index & 0x3fU), &vdev->msix.remapped[index >> 6U]);
+}
+
 /**
  * @pre vdev != NULL
  * @pre vdev->vpci != NULL
  * @pre vdev->pdev != NULL
  */
-static void remap_one_vmsix_entry(const struct pci_vdev *vdev, uint32_t index)
+static void remap_one_vmsix_entry(struct pci_vdev *vdev, uint32_t index)
 {
 	const struct msix_table_entry *ventry;
 	struct msix_table_entry *pentry;
@@ -110,6 +115,7 @@ static void remap_one_vmsix_entry(const struct pci_vdev *vdev, uint32_t index)
 	int32_t ret;
 
 	mask_one_msix_vector(vdev, index);
+	bitmap_clear_nolock((uint16_t)(index & 0x3fU), &vdev->msix.remapped[index >> 6U]);
 	ventry = &vdev->msix.table_entries[index];
 	if ((ventry->vector_control & PCIM_MSIX_VCTRL_MASK) == 0U) {
 		info.addr.full = vdev->msix.table_entries[index].addr;
@@ -133,11 +139,41 @@ static void remap_one_vmsix_entry(const struct pci_vdev *vdev, uint32_t index)
 			mmio_write32(info.data.full, (void *)&(pentry->data));
 			mmio_write32(vdev->msix.table_entries[index].vector_control, (void *)&(pentry->vector_control));
 			clac();
+			bitmap_set_nolock((uint16_t)(index & 0x3fU), &vdev->msix.remapped[index >> 6U]);
 		}
 	}
 
 }
 
+/*
+ * Masking or unmasking a vector whose address and data were remapped
+ * already only needs the Mask bit of the physical entry, the IRTE and
+ * the physical address/data are still valid. Drivers toggling the Mask
+ * bit around their polling (NAPI, DPDK) then skip the rebuild of the
+ * IRTE and its invalidation on every unmask.
+ *
+ * @pre vdev != NULL
+ * @pre is_vmsix_entry_remapped(vdev, index)
+ */
+static void update_one_vmsix_mask(const struct pci_vdev *vdev, uint32_t index)
+{
+	struct msix_table_entry *pentry = get_msix_table_entry(vdev, index);
+
+	stac();
+	mmio_write32(vdev->msix.table_entries[index].vector_control, (void *)&(pentry->vector_control));
+	clac();
+}
+
+/*
+ * @pre mmio->address >= vdev->msix.mmio_gpa + vdev->msix.table_offset
+ */
+static bool is_vmsix_mask_write(const struct pci_vdev *vdev, const struct acrn_mmio_request *mmio)
+{
+	uint64_t entry_offset = (mmio->address - vdev->msix.mmio_gpa - vdev->msix.table_offset) % MSIX_TABLE_ENTRY_SIZE;
+
+	return ((entry_offset == PCI_MSIX_ENTRY_VECTOR_CONTROL) && (mmio->size == 4U));
+}
+
 /**
  * @pre io_req != NULL
  * @pre priv_data != NULL
@@ -156,6 +192,8 @@ static int32_t pt_vmsix_handle_table_mmio_access(struct io_request *io_req, void
 		if ((mmio->direction == ACRN_IOREQ_DIR_WRITE) && (index < vdev->msix.table_count)) {
 			if (vdev->msix.is_vmsix_on_msi) {
 				remap_one_vmsix_entry_on_msi(vdev, index);
+			} else if (is_vmsix_mask_write(vdev, mmio) && is_vmsix_entry_remapped(vdev, index)) {
+				update_one_vmsix_mask(vdev, index);
 			} else {
 				remap_one_vmsix_entry(vdev, index);
 			}
@@ -183,6 +221,7 @@ static void vdev_pt_unmap_msix(struct pci_vdev *vdev)
 		msix->table_entries[i].addr = 0U;
 		msix->table_entries[i].data = 0U;
 	}
+	(void)memset((void *)msix->remapped, 0U, sizeof(msix->remapped));
 
 	if (msix->mmio_gpa != 0UL) {
 		addr_lo = msix->mmio_gpa + msix->table_offset;
@@ -247,10 +286,11 @@ static void vdev_pt_unmap_mem_vbar(struct pci_vdev *vdev, uint32_t idx)
 static void vdev_pt_map_mem_vbar(struct pci_vdev *vdev, uint32_t idx)
 {
 	struct pci_vbar *vbar = &vdev->vbars[idx];
+	struct acrn_vm *vm = vpci2vm(vdev->vpci);
 
+	/* the MSI-X table is cut out of the BAR mapping again, flush both at once */
+	ept_begin_batch(vm);
 	if (vbar->base_gpa != 0UL) {
-		struct acrn_vm *vm = vpci2vm(vdev->vpci);
-
 		ept_add_mr(vm, (uint64_t *)(vm->arch_vm.nworld_eptp),
 			vbar->base_hpa, /* HPA (pbar) */
 			vbar->base_gpa, /* GPA (new vbar) */
@@ -261,6 +301,7 @@ static void vdev_pt_map_mem_vbar(struct pci_vdev *vdev, uint32_t idx)
 	if (has_msix_cap(vdev) && (idx == vdev->msix.table_bar)) {
 		vdev_pt_map_msix(vdev, true);
 	}
+	ept_end_batch(vm);
 }
 
 /**
@@ -498,6 +539,7 @@ void deinit_vmsix_pt(struct pci_vdev *vdev)
 		if (vdev->msix.table_count != 0U) {
 			ptirq_remove_msix_remapping(vpci2vm(vdev->vpci), vdev->pdev->bdf.value, vdev->msix.table_count);
 			(void)memset((void *)&vdev->msix.table_entries, 0U, sizeof(vdev->msix.table_entries));
+			(void)memset((void *)vdev->msix.remapped, 0U, sizeof(vdev->msix.remapped));
 			vdev->msix.is_vmsix_on_msi_programmed = false;
 		}
 	}
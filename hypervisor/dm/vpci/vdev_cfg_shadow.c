@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * The configuration space of the PCI devices ACRN-DM emulates for a
+ * post-launched VM, shadowed in the hypervisor.
+ *
+ * A guest enumerating its PCI devices reads the IDs, the class code, the
+ * header type, the capability list and sizes every BAR of every function: for
+ * a device emulated by ACRN-DM each of these accesses is an I/O request
+ * round trip to the Service VM. ACRN-DM registers with struct
+ * acrn_vdev_cfg_shadow what a read of the configuration space of such a device
+ * returns and which bytes it has to see the accesses to (the command and status
+ * registers, the capability bodies, ...). The hypervisor serves the other
+ * accesses: the reads from the template, the BARs with their masks, and only
+ * the writes moving a BAR go to ACRN-DM besides the accesses to its bytes.
+ */
+
+#include <asm/guest/vm.h>
+#include <errno.h>
+#include <logmsg.h>
+#include <pci.h>
+#include "vpci_priv.h"
+
+/**
+ * @pre vpci != NULL
+ * @pre vpci->cfg_shadows_lock is held
+ */
+static struct vdev_cfg_shadow *find_cfg_shadow(struct acrn_vpci *vpci, union pci_bdf bdf)
+{
+	struct vdev_cfg_shadow *shadow = NULL;
+	uint32_t i;
+
+	for (i = 0U; i < vpci->cfg_shadow_cnt; i++) {
+		if (vpci->cfg_shadows[i].bdf.value == bdf.value) {
+			shadow = &vpci->cfg_shadows[i];
+			break;
+		}
+	}
+
+	return shadow;
+}
+
+/**
+ * @pre vpci != NULL
+ * @pre info != NULL
+ */
+int32_t vpci_add_cfg_shadow(struct acrn_vpci *vpci, const struct acrn_vdev_cfg_shadow *info)
+{
+	struct vdev_cfg_shadow *shadow;
+	union pci_bdf bdf;
+	uint32_t i;
+	int32_t ret = 0;
+
+	bdf.value = info->bdf;
+	spinlock_obtain(&vpci->cfg_shadows_lock);
+	shadow = find_cfg_shadow(vpci, bdf);
+	if (shadow == NULL) {
+		if (vpci->cfg_shadow_cnt < MAX_VDEV_CFG_SHADOW_NUM) {
+			shadow = &vpci->cfg_shadows[vpci->cfg_shadow_cnt];
+			vpci->cfg_shadow_cnt++;
+		} else {
+			pr_warn("%s: no room to shadow %x:%x.%x\n", __func__, bdf.bits.b, bdf.bits.d, bdf.bits.f);
+			ret = -ENOMEM;
+		}
+	}
+
+	if (shadow != NULL) {
+		shadow->bdf = bdf;
+		(void)memcpy_s(shadow->bar_mask, sizeof(shadow->bar_mask), info->bar_mask, sizeof(info->bar_mask));
+		(void)memcpy_s(shadow->dm_map, sizeof(shadow->dm_map), info->dm_map, sizeof(info->dm_map));
+		(void)memcpy_s(shadow->cfg.data_8, sizeof(shadow->cfg.data_8), info->cfg, sizeof(info->cfg));
+		for (i = 0U; i < PCI_BAR_COUNT; i++) {
+			shadow->dm_bar[i] = shadow->cfg.data_32[pci_bar_offset(i) >> 2U];
+		}
+	}
+	spinlock_release(&vpci->cfg_shadows_lock);
+
+	return ret;
+}
+
+/**
+ * @pre vpci != NULL
+ */
+int32_t vpci_remove_cfg_shadow(struct acrn_vpci *vpci, uint16_t bdf)
+{
+	struct vdev_cfg_shadow *shadow;
+	union pci_bdf vbdf;
+	int32_t ret = -ENODEV;
+
+	vbdf.value = bdf;
+	spinlock_obtain(&vpci->cfg_shadows_lock);
+	shadow = find_cfg_shadow(vpci, vbdf);
+	if (shadow != NULL) {
+		vpci->cfg_shadow_cnt--;
+		*shadow = vpci->cfg_shadows[vpci->cfg_shadow_cnt];
+		ret = 0;
+	}
+	spinlock_release(&vpci->cfg_shadows_lock);
+
+	return ret;
+}
+
+/**
+ * @pre vpci != NULL
+ */
+bool vpci_has_cfg_shadow(struct acrn_vpci *vpci, union pci_bdf bdf)
+{
+	bool ret;
+
+	spinlock_obtain(&vpci->cfg_shadows_lock);
+	ret = (find_cfg_shadow(vpci, bdf) != NULL);
+	spinlock_release(&vpci->cfg_shadows_lock);
+
+	return ret;
+}
+
+/**
+ * @pre shadow != NULL
+ * @pre (offset + bytes) <= ACRN_VDEV_CFG_SHADOW_SIZE
+ */
+static bool is_dm_cfg_access(const struct vdev_cfg_shadow *shadow, uint32_t offset, uint32_t bytes)
+{
+	uint32_t i;
+	bool ret = false;
+
+	for (i = offset; i < (offset + bytes); i++) {
+		if ((shadow->dm_map[i >> 6U] & (1UL << (i & 0x3fU))) != 0UL) {
+			ret = true;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @pre vpci != NULL
+ * @pre val != NULL
+ *
+ * @retval 0 the read is served from the shadow
+ * @retval -ENODEV the read goes to ACRN-DM
+ */
+int32_t vpci_read_cfg_shadow(struct acrn_vpci *vpci, union pci_bdf bdf, uint32_t offset, uint32_t bytes, uint32_t *val)
+{
+	const struct vdev_cfg_shadow *shadow;
+	int32_t ret = 0;
+
+	spinlock_obtain(&vpci->cfg_shadows_lock);
+	shadow = find_cfg_shadow(vpci, bdf);
+	if (shadow == NULL) {
+		ret = -ENODEV;
+	} else if (offset >= ACRN_VDEV_CFG_SHADOW_SIZE) {
+		/* a zero header at offset 0x100 tells there is no extended capability */
+		*val = (offset < (ACRN_VDEV_CFG_SHADOW_SIZE + 4U)) ? 0U : ~0U;
+	} else if (is_dm_cfg_access(shadow, offset, bytes)) {
+		ret = -ENODEV;
+	} else {
+		switch (bytes) {
+		case 1U:
+			*val = shadow->cfg.data_8[offset];
+			break;
+		case 2U:
+			*val = shadow->cfg.data_16[offset >> 1U];
+			break;
+		default:
+			*val = shadow->cfg.data_32[offset >> 2U];
+			break;
+		}
+	}
+	spinlock_release(&vpci->cfg_shadows_lock);
+
+	return ret;
+}
+
+/**
+ * The BAR is sized with a write of all ones and restored afterwards: neither
+ * write moves the BAR ACRN-DM has, only a write of another address goes to it.
+ *
+ * @pre shadow != NULL
+ * @pre is_bar_offset(PCI_BAR_COUNT, offset)
+ */
+static int32_t write_cfg_shadow_bar(struct vdev_cfg_shadow *shadow, uint32_t offset, uint32_t val)
+{
+	uint32_t idx = pci_bar_index(offset);
+	uint32_t mask = shadow->bar_mask[idx];
+	uint32_t bar = (val & mask) | (shadow->cfg.data_32[offset >> 2U] & ~mask);
+	int32_t ret = 0;
+
+	shadow->cfg.data_32[offset >> 2U] = bar;
+	if ((val != ~0U) && (bar != shadow->dm_bar[idx])) {
+		shadow->dm_bar[idx] = bar;
+		ret = -ENODEV;
+	}
+
+	return ret;
+}
+
+/**
+ * @pre vpci != NULL
+ *
+ * @retval 0 the write is absorbed by the shadow
+ * @retval -ENODEV the write goes to ACRN-DM
+ */
+int32_t vpci_write_cfg_shadow(struct acrn_vpci *vpci, union pci_bdf bdf, uint32_t offset, uint32_t bytes, uint32_t val)
+{
+	struct vdev_cfg_shadow *shadow;
+	int32_t ret = 0;
+
+	spinlock_obtain(&vpci->cfg_shadows_lock);
+	shadow = find_cfg_shadow(vpci, bdf);
+	if (shadow == NULL) {
+		ret = -ENODEV;
+	} else if (offset >= ACRN_VDEV_CFG_SHADOW_SIZE) {
+		/* no action: the extended configuration space is not implemented */
+	} else if (is_bar_offset(PCI_BAR_COUNT, offset)) {
+		/* ACRN-DM ignores the writes to a BAR which are not a whole dword as well */
+		if (bytes == 4U) {
+			ret = write_cfg_shadow_bar(shadow, offset, val);
+		}
+	} else if (is_dm_cfg_access(shadow, offset, bytes)) {
+		ret = -ENODEV;
+	} else {
+		/* no action: a read-only register */
+	}
+	spinlock_release(&vpci->cfg_shadows_lock);
+
+	return ret;
+}
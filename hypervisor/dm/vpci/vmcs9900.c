@@ -52,7 +52,7 @@ static int32_t vmcs9900_mmio_handler(struct io_request *io_req, void *data)
 	if (mmio->direction == ACRN_IOREQ_DIR_READ) {
 		mmio->value = vuart_read_reg(vu, offset);
 	} else {
-		vuart_write_reg(vu, offset, (uint8_t) mmio->value);
+		vuart_write_burst(vu, offset, (uint32_t)mmio->value, (size_t)mmio->size);
 	}
 	return 0;
 }
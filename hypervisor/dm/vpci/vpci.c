@@ -38,6 +38,7 @@
 #include <asm/pci_dev.h>
 #include <hash.h>
 #include <board_info.h>
+#include <vroot_port.h>
 
 
 static int32_t vpci_init_vdevs(struct acrn_vm *vm);
@@ -88,12 +89,17 @@ static bool vpci_pio_cfgaddr_write(struct acrn_vcpu *vcpu, uint16_t addr, size_t
 
 			vbdf.value = cfg_addr->bits.bdf;
 			vdev = find_available_vdev(vpci, vbdf);
-			/* For post-launched VM, ACRN HV will only handle PT device,
-			 * all virtual PCI device and QUIRK PT device
+			/* For post-launched VM, ACRN HV will only handle PT device
+			 * and the virtual PCI devices with a shadowed configuration
+			 * space, all other virtual PCI device and QUIRK PT device
 			 * still need to deliver to ACRN DM to handle.
 			 */
-			if ((vdev == NULL) || is_quirk_ptdev(vdev)) {
+			if (vdev == NULL) {
+				ret = vpci_has_cfg_shadow(vpci, vbdf);
+			} else if (is_quirk_ptdev(vdev)) {
 				ret = false;
+			} else {
+				/* no action: a PT device */
 			}
 		}
 	}
@@ -101,6 +107,25 @@ static bool vpci_pio_cfgaddr_write(struct acrn_vcpu *vcpu, uint16_t addr, size_t
 	return ret;
 }
 
+/**
+ * ACRN DM has not seen the address of an access to a device with a shadowed
+ * configuration space, deliver the access as a PCI configuration request.
+ *
+ * @pre vcpu != NULL
+ */
+static void vpci_pio_to_pcicfg(struct acrn_vcpu *vcpu, union pci_bdf bdf, uint32_t offset)
+{
+	struct acrn_pci_request *pci_req = &vcpu->req.reqs.pci_request;
+
+	/* direction, size and value are at the same place in both requests */
+	vcpu->req.io_type = ACRN_IOREQ_TYPE_PCICFG;
+	(void)memset(pci_req->reserved, 0U, sizeof(pci_req->reserved));
+	pci_req->bus = (int32_t)bdf.bits.b;
+	pci_req->dev = (int32_t)bdf.bits.d;
+	pci_req->func = (int32_t)bdf.bits.f;
+	pci_req->reg = (int32_t)offset;
+}
+
 /**
  * @pre vcpu != NULL
  * @pre vcpu->vm != NULL
@@ -127,6 +152,9 @@ static bool vpci_pio_cfgdata_read(struct acrn_vcpu *vcpu, uint16_t addr, size_t
 		if (pci_is_valid_access(offset, bytes)) {
 			bdf.value = cfg_addr.bits.bdf;
 			ret = vpci_read_cfg(vpci, bdf, offset, bytes, &val);
+			if ((ret != 0) && vpci_has_cfg_shadow(vpci, bdf)) {
+				vpci_pio_to_pcicfg(vcpu, bdf, offset);
+			}
 		}
 	}
 
@@ -158,6 +186,9 @@ static bool vpci_pio_cfgdata_write(struct acrn_vcpu *vcpu, uint16_t addr, size_t
 		if (pci_is_valid_access(offset, bytes)) {
 			bdf.value = cfg_addr.bits.bdf;
 			ret = vpci_write_cfg(vpci, bdf, offset, bytes, val);
+			if ((ret != 0) && vpci_has_cfg_shadow(vpci, bdf)) {
+				vpci_pio_to_pcicfg(vcpu, bdf, offset);
+			}
 		}
 	}
 
@@ -248,6 +279,10 @@ int32_t init_vpci(struct acrn_vm *vm)
 		vm->vpci.res64.end = USER_VM_VIRT_PCI_MEMLIMIT64;
 	}
 
+	spinlock_init(&vm->vpci.vdevs_lock);
+	spinlock_init(&vm->vpci.cfg_shadows_lock);
+	seqcount_init(&vm->vpci.vdevs_seq);
+
 	/* Build up vdev list for vm */
 	ret = vpci_init_vdevs(vm);
 
@@ -289,7 +324,9 @@ void deinit_vpci(struct acrn_vm *vm)
 
 			if (parent_vdev != NULL) {
 				spinlock_obtain(&parent_vdev->vpci->lock);
+				spinlock_obtain(&parent_vdev->lock);
 				parent_vdev->vdev_ops->init_vdev(parent_vdev);
+				spinlock_release(&parent_vdev->lock);
 				spinlock_release(&parent_vdev->vpci->lock);
 			}
 		}
@@ -343,6 +380,28 @@ static void remove_vdev_pt_iommu_domain(const struct pci_vdev *vdev)
 	}
 }
 
+/**
+ * @brief Whether \p vdev found in \p vpci is available to it, see find_available_vdev()
+ */
+static bool is_vdev_available(const struct acrn_vpci *vpci, const struct pci_vdev *vdev)
+{
+	bool available = true;
+
+	if (vdev->user != vdev) {
+		if (vdev->user != NULL) {
+			/* the Service VM is able to access, if and only if the Service VM has higher severity than the User VM. */
+			if (get_vm_severity(vpci2vm(vpci)->vm_id) <
+					get_vm_severity(vpci2vm(vdev->user->vpci)->vm_id)) {
+				available = false;
+			}
+		} else {
+			available = false;
+		}
+	}
+
+	return available;
+}
+
 /**
  * @brief Find an available vdev structure with BDF from a specified vpci structure.
  *        If the vdev's vpci is the same as the specified vpci, the vdev is available.
@@ -362,19 +421,178 @@ static struct pci_vdev *find_available_vdev(struct acrn_vpci *vpci, union pci_bd
 {
 	struct pci_vdev *vdev = pci_find_vdev(vpci, bdf);
 
-	if ((vdev != NULL) && (vdev->user != vdev)) {
-		if (vdev->user != NULL) {
-			/* the Service VM is able to access, if and only if the Service VM has higher severity than the User VM. */
-			if (get_vm_severity(vpci2vm(vpci)->vm_id) <
-					get_vm_severity(vpci2vm(vdev->user->vpci)->vm_id)) {
-				vdev = NULL;
+	if ((vdev != NULL) && !is_vdev_available(vpci, vdev)) {
+		vdev = NULL;
+	}
+
+	return vdev;
+}
+
+/**
+ * @brief Find an available vdev like find_available_vdev() and return it locked.
+ *
+ * The lookup takes no vPCI wide lock, so accesses to different vdevs do not
+ * contend. It is retried if vdevs_hlist_heads changed meanwhile, or if the vdev
+ * was (de)assigned before its lock was obtained.
+ *
+ * @pre vpci != NULL
+ */
+static struct pci_vdev *lock_available_vdev(struct acrn_vpci *vpci, union pci_bdf bdf)
+{
+	struct pci_vdev *vdev;
+	uint32_t seq;
+	bool retry;
+
+	do {
+		seq = seqcount_read_begin(&vpci->vdevs_seq);
+		vdev = find_available_vdev(vpci, bdf);
+		retry = seqcount_read_retry(&vpci->vdevs_seq, seq);
+		if ((vdev != NULL) && !retry) {
+			spinlock_obtain(&vdev->lock);
+			if (seqcount_read_retry(&vpci->vdevs_seq, seq) || !is_vdev_available(vpci, vdev)) {
+				spinlock_release(&vdev->lock);
+				retry = true;
+			}
+		}
+	} while (retry);
+
+	return vdev;
+}
+
+/**
+ * @brief Link \p vdev in vdevs_hlist_heads under \p bdf, unlinking it first if \p relink
+ */
+static void vpci_link_vdev(struct acrn_vpci *vpci, struct pci_vdev *vdev, union pci_bdf bdf, bool relink)
+{
+	spinlock_obtain(&vpci->vdevs_lock);
+	seqcount_write_begin(&vpci->vdevs_seq);
+	if (relink) {
+		hlist_del(&vdev->link);
+	}
+	vdev->bdf.value = bdf.value;
+	hlist_add_head(&vdev->link, &vpci->vdevs_hlist_heads[hash64(bdf.value, VDEV_LIST_HASHBITS)]);
+	seqcount_write_end(&vpci->vdevs_seq);
+	spinlock_release(&vpci->vdevs_lock);
+}
+
+/**
+ * @pre offset and bytes are a naturally aligned access of 2 or 4 bytes
+ */
+static void shadow_pt_cfg(struct pci_vdev *vdev, uint32_t offset, uint32_t bytes)
+{
+	uint32_t word;
+
+	for (word = offset >> 1U; word < ((offset + bytes) >> 1U); word++) {
+		bitmap_set_nolock((uint16_t)(word & 0x3fU), &vdev->cfg_shadow[word >> 6U]);
+	}
+	pci_vdev_write_vcfg(vdev, offset, bytes, pci_pdev_read_cfg(vdev->pdev->bdf, offset, bytes));
+}
+
+static bool is_pt_cfg_shadowed(const struct pci_vdev *vdev, uint32_t offset, uint32_t bytes)
+{
+	uint32_t word;
+	bool shadowed = true;
+
+	for (word = offset >> 1U; word < ((offset + bytes + 1U) >> 1U); word++) {
+		if (!bitmap_test((uint16_t)(word & 0x3fU), &vdev->cfg_shadow[word >> 6U])) {
+			shadowed = false;
+			break;
+		}
+	}
+
+	return shadowed;
+}
+
+/**
+ * @pre vdev->pdev != NULL
+ */
+static void shadow_pt_caps(struct pci_vdev *vdev)
+{
+	const struct pci_pdev *pdev = vdev->pdev;
+	uint32_t pos, limit;
+	uint16_t flags;
+	uint8_t cap;
+
+	/* minimum 4 bytes per cap, guard against malformed lists */
+	limit = (PCI_CONFIG_SPACE_SIZE - PCI_CFG_HEADER_LENGTH) / 4U;
+	pos = pci_pdev_read_cfg(pdev->bdf, PCIR_CAP_PTR, 1U) & ~0x3U;
+	while ((pos >= PCI_CFG_HEADER_LENGTH) && (pos < PCI_CONFIG_SPACE_SIZE) && (limit > 0U)) {
+		cap = (uint8_t)pci_pdev_read_cfg(pdev->bdf, pos + PCICAP_ID, 1U);
+		if ((cap == PCIY_PMC) || (cap == PCIY_AF)) {
+			shadow_pt_cfg(vdev, pos, 4U);
+		} else if (cap == PCIY_PCIE) {
+			shadow_pt_cfg(vdev, pos, 4U);
+			shadow_pt_cfg(vdev, pos + PCIR_PCIE_DEVCAP, 4U);
+			shadow_pt_cfg(vdev, pos + PCIR_PCIE_LINKCAP, 4U);
+			shadow_pt_cfg(vdev, pos + PCIR_PCIE_SLOTCAP, 4U);
+			flags = (uint16_t)pci_pdev_read_cfg(pdev->bdf, pos + PCIER_FLAGS, 2U);
+			if ((flags & PCIEM_FLAGS_VERSION) >= 2U) {
+				shadow_pt_cfg(vdev, pos + PCIR_PCIE_DEVCAP2, 4U);
+				shadow_pt_cfg(vdev, pos + PCIR_PCIE_LINKCAP2, 4U);
 			}
+		} else if ((cap != PCIY_MSI) && (cap != PCIY_MSIX) && (cap != PCIY_VENDOR)) {
+			/* capability ID and next pointer */
+			shadow_pt_cfg(vdev, pos, 2U);
 		} else {
-			vdev = NULL;
+			/* emulated, or vendor specific */
 		}
+
+		pos = pci_pdev_read_cfg(pdev->bdf, pos + PCICAP_NEXTPTR, 1U) & ~0x3U;
+		limit--;
 	}
+}
 
-	return vdev;
+/**
+ * @pre vdev->pdev != NULL
+ */
+static void shadow_pt_ext_caps(struct pci_vdev *vdev)
+{
+	const struct pci_pdev *pdev = vdev->pdev;
+	uint32_t pos, hdr, limit;
+
+	/* minimum 8 bytes per cap */
+	limit = (PCIE_CONFIG_SPACE_SIZE - PCI_CONFIG_SPACE_SIZE) / 8U;
+	pos = PCI_ECAP_BASE_PTR;
+	hdr = pci_pdev_read_cfg(pdev->bdf, pos, 4U);
+	while ((hdr != 0U) && (hdr != ~0U) && (limit > 0U)) {
+		/* the headers of SR-IOV and of the capability hiding it are emulated */
+		if ((pos != pdev->sriov.capoff) && ((pos != pdev->sriov.pre_pos) || !pdev->sriov.hide_sriov)) {
+			shadow_pt_cfg(vdev, pos, 4U);
+		}
+
+		pos = PCI_ECAP_NEXT(hdr);
+		if (pos < PCI_CONFIG_SPACE_SIZE) {
+			break;
+		}
+		hdr = pci_pdev_read_cfg(pdev->bdf, pos, 4U);
+		limit--;
+	}
+}
+
+/**
+ * @brief Shadow the read-only registers of the physical capabilities in cfgdata
+ *
+ * The guests re-read the capability lists and the capability registers of a
+ * device many times while probing it, each one a slow uncached config access.
+ * The header is emulated already; of the capabilities, the headers and the
+ * capability registers of the PM, PCIe and AF capabilities never change, so
+ * they are read once here. The status and control registers, the vendor
+ * specific capabilities and the capabilities emulated (MSI, MSI-X and SR-IOV)
+ * are not shadowed.
+ *
+ * @pre vdev->pdev != NULL
+ */
+static void init_pt_cfg_shadow(struct pci_vdev *vdev)
+{
+	(void)memset((void *)vdev->cfg_shadow, 0U, sizeof(vdev->cfg_shadow));
+
+	/* with MSI-X emulated on MSI, the capability list is patched in cfgdata */
+	if (!vdev->msix.is_vmsix_on_msi) {
+		shadow_pt_caps(vdev);
+		if (vdev->pdev->pcie_capoff != 0U) {
+			shadow_pt_ext_caps(vdev);
+		}
+	}
 }
 
 static void vpci_init_pt_dev(struct pci_vdev *vdev)
@@ -391,6 +609,7 @@ static void vpci_init_pt_dev(struct pci_vdev *vdev)
 	init_vmsix_pt(vdev);
 	init_vsriov(vdev);
 	init_vdev_pt(vdev, false);
+	init_pt_cfg_shadow(vdev);
 
 	assign_vdev_pt_iommu_domain(vdev);
 }
@@ -568,10 +787,14 @@ static int32_t read_pt_dev_cfg(struct pci_vdev *vdev, uint32_t offset,
 		if ((offset == vdev->pdev->sriov.pre_pos) && (vdev->pdev->sriov.hide_sriov)) {
 			*val = pci_vdev_read_vcfg(vdev, offset, bytes);
 		} else if (!is_quirk_ptdev(vdev)) {
-			/* passthru to physical device */
-			*val = pci_pdev_read_cfg(vdev->pdev->bdf, offset, bytes);
-			if ((vdev->pdev->bdf.value == CONFIG_IGD_SBDF) && (offset == PCIR_ASLS_CTL)) {
+			if (is_pt_cfg_shadowed(vdev, offset, bytes)) {
 				*val = pci_vdev_read_vcfg(vdev, offset, bytes);
+			} else {
+				/* passthru to physical device */
+				*val = pci_pdev_read_cfg(vdev->pdev->bdf, offset, bytes);
+				if ((vdev->pdev->bdf.value == CONFIG_IGD_SBDF) && (offset == PCIR_ASLS_CTL)) {
+					*val = pci_vdev_read_vcfg(vdev, offset, bytes);
+				}
 			}
 		} else {
 			ret = -ENODEV;
@@ -597,13 +820,13 @@ static int32_t vpci_read_cfg(struct acrn_vpci *vpci, union pci_bdf bdf,
 	int32_t ret = 0;
 	struct pci_vdev *vdev;
 
-	spinlock_obtain(&vpci->lock);
-	vdev = find_available_vdev(vpci, bdf);
+	vdev = lock_available_vdev(vpci, bdf);
 	if (vdev != NULL) {
 		ret = vdev->vdev_ops->read_vdev_cfg(vdev, offset, bytes, val);
+		spinlock_release(&vdev->lock);
 	} else {
 		if (is_postlaunched_vm(vpci2vm(vpci))) {
-			ret = -ENODEV;
+			ret = vpci_read_cfg_shadow(vpci, bdf, offset, bytes, val);
 		} else if (is_plat_hidden_pdev(bdf)) {
 			/* expose and pass through platform hidden devices */
 			*val = pci_pdev_read_cfg(bdf, offset, bytes);
@@ -611,7 +834,6 @@ static int32_t vpci_read_cfg(struct acrn_vpci *vpci, union pci_bdf bdf,
 			/* no action: e.g., PCI scan */
 		}
 	}
-	spinlock_release(&vpci->lock);
 	return ret;
 }
 
@@ -624,13 +846,13 @@ static int32_t vpci_write_cfg(struct acrn_vpci *vpci, union pci_bdf bdf,
 	int32_t ret = 0;
 	struct pci_vdev *vdev;
 
-	spinlock_obtain(&vpci->lock);
-	vdev = find_available_vdev(vpci, bdf);
+	vdev = lock_available_vdev(vpci, bdf);
 	if (vdev != NULL) {
 		ret = vdev->vdev_ops->write_vdev_cfg(vdev, offset, bytes, val);
+		spinlock_release(&vdev->lock);
 	} else {
 		if (is_postlaunched_vm(vpci2vm(vpci))) {
-			ret = -ENODEV;
+			ret = vpci_write_cfg_shadow(vpci, bdf, offset, bytes, val);
 		} else if (is_plat_hidden_pdev(bdf)) {
 			/* expose and pass through platform hidden devices */
 			pci_pdev_write_cfg(bdf, offset, bytes, val);
@@ -639,7 +861,6 @@ static int32_t vpci_write_cfg(struct acrn_vpci *vpci, union pci_bdf bdf,
 				bdf.bits.b, bdf.bits.d, bdf.bits.f, offset, val);
 		}
 	}
-	spinlock_release(&vpci->lock);
 	return ret;
 }
 
@@ -649,7 +870,7 @@ static int32_t vpci_write_cfg(struct acrn_vpci *vpci, union pci_bdf bdf,
  * The function vpci_init_vdev is used to initialize a vdev structure with a PCI device configuration(dev_config)
  * on a specified vPCI bus(vpci). If the function vpci_init_vdev initializes a SRIOV Virtual Function(VF) vdev structure,
  * the parameter parent_pf_vdev is the VF associated Physical Function(PF) vdev structure, otherwise the parameter parent_pf_vdev is NULL.
- * The caller of the function vpci_init_vdev should guarantee execution atomically.
+ * The vdev is initialized with its lock held, the updates of the vdev list are serialized by vpci->vdevs_lock.
  *
  * @param vpci              Pointer to a vpci structure
  * @param dev_config        Pointer to a dev_config structure of the vdev
@@ -663,16 +884,21 @@ static int32_t vpci_write_cfg(struct acrn_vpci *vpci, union pci_bdf bdf,
  */
 struct pci_vdev *vpci_init_vdev(struct acrn_vpci *vpci, struct acrn_vm_pci_dev_config *dev_config, struct pci_vdev *parent_pf_vdev)
 {
-	struct pci_vdev *vdev = &vpci->pci_vdevs[vpci->pci_vdev_cnt];
+	struct pci_vdev *vdev;
 
+	spinlock_obtain(&vpci->vdevs_lock);
+	vdev = &vpci->pci_vdevs[vpci->pci_vdev_cnt];
 	vpci->pci_vdev_cnt++;
+	spinlock_release(&vpci->vdevs_lock);
+
 	vdev->vpci = vpci;
-	vdev->bdf.value = dev_config->vbdf.value;
 	vdev->pdev = dev_config->pdev;
 	vdev->pci_dev_config = dev_config;
 	vdev->phyfun = parent_pf_vdev;
+	spinlock_init(&vdev->lock);
 
-	hlist_add_head(&vdev->link, &vpci->vdevs_hlist_heads[hash64(dev_config->vbdf.value, VDEV_LIST_HASHBITS)]);
+	spinlock_obtain(&vdev->lock);
+	vpci_link_vdev(vpci, vdev, dev_config->vbdf, false);
 	if (dev_config->vdev_ops != NULL) {
 		vdev->vdev_ops = dev_config->vdev_ops;
 	} else {
@@ -683,6 +909,7 @@ struct pci_vdev *vpci_init_vdev(struct acrn_vpci *vpci, struct acrn_vm_pci_dev_c
 	}
 
 	vdev->vdev_ops->init_vdev(vdev);
+	spinlock_release(&vdev->lock);
 
 	return vdev;
 }
@@ -744,12 +971,14 @@ int32_t vpci_assign_pcidev(struct acrn_vm *tgt_vm, struct acrn_pcidev *pcidev)
 			pdev_restore_bar(vdev_in_service_vm->pdev);
 		}
 
+		spinlock_obtain(&vdev_in_service_vm->lock);
 		vdev_in_service_vm->vdev_ops->deinit_vdev(vdev_in_service_vm);
 
 		vpci = &(tgt_vm->vpci);
 
 		spinlock_obtain(&tgt_vm->vpci.lock);
 		vdev = vpci_init_vdev(vpci, vdev_in_service_vm->pci_dev_config, vdev_in_service_vm->phyfun);
+		spinlock_obtain(&vdev->lock);
 		pci_vdev_write_vcfg(vdev, PCIR_INTERRUPT_LINE, 1U, pcidev->intr_line);
 		pci_vdev_write_vcfg(vdev, PCIR_INTERRUPT_PIN, 1U, pcidev->intr_pin);
 		for (idx = 0U; idx < vdev->nr_bars; idx++) {
@@ -768,17 +997,18 @@ int32_t vpci_assign_pcidev(struct acrn_vm *tgt_vm, struct acrn_pcidev *pcidev)
 
 		if (ret == 0) {
 			vdev->flags |= pcidev->type;
-			vdev->bdf.value = pcidev->virt_bdf;
+			bdf.value = pcidev->virt_bdf;
 			/*We should re-add the vdev to hashlist since its vbdf has changed */
-			hlist_del(&vdev->link);
-			hlist_add_head(&vdev->link, &vpci->vdevs_hlist_heads[hash64(vdev->bdf.value, VDEV_LIST_HASHBITS)]);
+			vpci_link_vdev(vpci, vdev, bdf, true);
 			vdev->parent_user = vdev_in_service_vm;
 			vdev_in_service_vm->user = vdev;
 		} else {
 			vdev->vdev_ops->deinit_vdev(vdev);
 			vdev_in_service_vm->vdev_ops->init_vdev(vdev_in_service_vm);
 		}
+		spinlock_release(&vdev->lock);
 		spinlock_release(&tgt_vm->vpci.lock);
+		spinlock_release(&vdev_in_service_vm->lock);
 	} else {
 		pr_fatal("%s, can't find PCI device %x:%x.%x for vm[%d] %x:%x.%x\n", __func__,
 			pcidev->phys_bdf >> 8U, (pcidev->phys_bdf >> 3U) & 0x1fU, pcidev->phys_bdf & 0x7U,
@@ -788,6 +1018,10 @@ int32_t vpci_assign_pcidev(struct acrn_vm *tgt_vm, struct acrn_pcidev *pcidev)
 	}
 	spinlock_release(&service_vm->vpci.lock);
 
+	if (ret == 0) {
+		vrp_notify_slot(tgt_vm, bdf, true);
+	}
+
 	return ret;
 }
 
@@ -809,13 +1043,19 @@ int32_t vpci_deassign_pcidev(struct acrn_vm *tgt_vm, struct acrn_pcidev *pcidev)
 			(vdev->pdev->bdf.value == pcidev->phys_bdf)) {
 		parent_vdev = vdev->parent_user;
 
+		spinlock_obtain(&vdev->lock);
 		vdev->vdev_ops->deinit_vdev(vdev);
+		spinlock_release(&vdev->lock);
 
 		if (parent_vdev != NULL) {
 			spinlock_obtain(&parent_vdev->vpci->lock);
+			spinlock_obtain(&parent_vdev->lock);
 			parent_vdev->vdev_ops->init_vdev(parent_vdev);
+			spinlock_release(&parent_vdev->lock);
 			spinlock_release(&parent_vdev->vpci->lock);
 		}
+
+		vrp_notify_slot(tgt_vm, bdf, false);
 	} else {
 		pr_fatal("%s, can't find PCI device %x:%x.%x for vm[%d] %x:%x.%x\n", __func__,
 			pcidev->phys_bdf >> 8U, (pcidev->phys_bdf >> 3U) & 0x1fU, pcidev->phys_bdf & 0x7U,
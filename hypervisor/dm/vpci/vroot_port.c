@@ -8,12 +8,14 @@
 #include <logmsg.h>
 #include <pci.h>
 #include <asm/guest/vm.h>
+#include <asm/guest/vlapic.h>
 #include <acrn_common.h>
 #include "vroot_port.h"
 
 #include "vpci_priv.h"
 
 #define PCIE_CAP_VPOS		0x40				/* pcie capability reg position */
+#define MSI_CAP_VPOS		0x80U				/* msi capability reg position */
 #define PTM_CAP_VPOS		PCI_ECAP_BASE_PTR	/* ptm capability reg postion */
 
 static void init_vrp(struct pci_vdev *vdev)
@@ -66,6 +68,17 @@ static void init_vrp(struct pci_vdev *vdev)
 	pci_vdev_write_vcfg(vdev, PCIE_CAP_VPOS + PCIR_PCIE_DEVCTRL, 2U,
 			(vdev->pci_dev_config->vrp_max_payload << 5) & PCIM_PCIE_DEV_CTRL_MAX_PAYLOAD);
 
+	/* The slot is hot-plug capable: the link reports the Data Link Layer Link
+	 * Active state, a change of the presence or of the link state is signaled
+	 * by the MSI below once the guest enabled it in the slot control.
+	 */
+	pci_vdev_write_vcfg(vdev, PCIE_CAP_VPOS + PCICAP_NEXTPTR, 1U, MSI_CAP_VPOS);
+	pci_vdev_write_vcfg(vdev, PCIE_CAP_VPOS + PCIR_PCIE_LINKCAP, 4U, PCIM_PCIE_LINK_DLLLARC);
+
+	/* msi capability registers, one 64-bit message */
+	pci_vdev_write_vcfg(vdev, MSI_CAP_VPOS + PCICAP_ID, 1U, PCIY_MSI);
+	pci_vdev_write_vcfg(vdev, MSI_CAP_VPOS + PCIR_MSI_CTRL, 2U, PCIM_MSICTRL_64BIT);
+
 	vdev->parent_user = NULL;
 	vdev->user = vdev;
 }
@@ -84,10 +97,53 @@ static int32_t read_vrp_cfg(struct pci_vdev *vdev, uint32_t offset,
 	return 0;
 }
 
-static int32_t write_vrp_cfg(__unused struct pci_vdev *vdev, __unused uint32_t offset,
-	__unused uint32_t bytes, __unused uint32_t val)
+/*
+ * @brief the read-only and the write-1-to-clear bits of the dword at \p offset
+ */
+static void get_vrp_cfg_masks(uint32_t offset, uint32_t *ro_mask, uint32_t *rw1c_mask)
+{
+	*ro_mask = 0U;
+	*rw1c_mask = 0U;
+
+	switch (offset) {
+	case PCIE_CAP_VPOS:
+	case PCIE_CAP_VPOS + PCIR_PCIE_LINKCAP:
+	case PCIE_CAP_VPOS + PCIR_PCIE_SLOTCAP:
+		*ro_mask = ~0U;
+		break;
+	case PCIE_CAP_VPOS + PCIR_PCIE_LINKCTRL:
+		/* link status */
+		*ro_mask = 0xffff0000U;
+		break;
+	case PCIE_CAP_VPOS + PCIR_PCIE_SLOTCTRL:
+		/* slot status */
+		*ro_mask = (~PCIM_PCIE_SLOT_STA_RW1C & 0xffffU) << 16U;
+		*rw1c_mask = PCIM_PCIE_SLOT_STA_RW1C << 16U;
+		break;
+	case MSI_CAP_VPOS:
+		/* only the msi enable bit of the message control is writable */
+		*ro_mask = ~(PCIM_MSICTRL_MSI_ENABLE << 16U);
+		break;
+	default:
+		/* every bit is writable */
+		break;
+	}
+}
+
+static int32_t write_vrp_cfg(struct pci_vdev *vdev, uint32_t offset,
+	uint32_t bytes, uint32_t val)
 {
-	pci_vdev_write_vcfg(vdev, offset, bytes, val);
+	uint32_t shift = (offset & 0x3U) << 3U;
+	uint32_t bmask = (bytes == 4U) ? ~0U : ((1U << (bytes << 3U)) - 1U);
+	uint32_t ro_mask, rw1c_mask, old;
+
+	get_vrp_cfg_masks(offset & ~0x3U, &ro_mask, &rw1c_mask);
+	ro_mask = (ro_mask >> shift) & bmask;
+	rw1c_mask = (rw1c_mask >> shift) & bmask;
+	old = pci_vdev_read_vcfg(vdev, offset, bytes);
+
+	pci_vdev_write_vcfg(vdev, offset, bytes, (old & ro_mask) | (val & ~(ro_mask | rw1c_mask)) |
+			(old & rw1c_mask & ~val));
 
 	return 0;
 }
@@ -114,6 +170,71 @@ static void init_ptm(struct pci_vdev *vdev, struct vrp_config *vrp_config)
 	pci_vdev_write_vcfg(vdev, PCIR_SUBBUS_1, 1U, vrp_config->subordinate_bus);
 }
 
+/*
+ * @pre vdev != NULL
+ * @pre vrp_config != NULL
+ */
+static void init_slot(struct pci_vdev *vdev, const struct vrp_config *vrp_config)
+{
+	/* The device can be surprise removed as well: the guest is not asked
+	 * before a device is deassigned. The secondary bus number is unique
+	 * among the virtual root ports, it is the physical slot number.
+	 */
+	pci_vdev_write_vcfg(vdev, PCIE_CAP_VPOS + PCIR_PCIE_SLOTCAP, 4U,
+			((uint32_t)vrp_config->secondary_bus << PCIM_PCIE_SLOT_PSN_SHIFT) |
+			PCIM_PCIE_SLOT_NCCS | PCIM_PCIE_SLOT_HPC | PCIM_PCIE_SLOT_HPS);
+}
+
+/**
+ * @brief Signal the presence change of the device at \p bdf to the virtual root port above it
+ *
+ * The device is on the secondary bus of the virtual root port. The slot status
+ * reports the new presence and Data Link Layer Link Active states, and the
+ * hot-plug interrupt is injected if the guest enabled it. The guest does not
+ * have to rescan: its native PCIe hot-plug driver enumerates the device.
+ *
+ * @pre vm != NULL
+ */
+void vrp_notify_slot(struct acrn_vm *vm, union pci_bdf bdf, bool present)
+{
+	struct pci_vdev *vdev;
+	uint32_t i, sta, ctrl, msi_ctrl;
+	uint64_t msi_addr = 0UL, msi_data = 0UL;
+	bool inject = false;
+
+	for (i = 0U; i < vm->vpci.pci_vdev_cnt; i++) {
+		vdev = &vm->vpci.pci_vdevs[i];
+		if ((vdev->vdev_ops == &vrp_ops) && (vdev->user == vdev) &&
+				(pci_vdev_read_vcfg(vdev, PCIR_SECBUS_1, 1U) == bdf.bits.b)) {
+			spinlock_obtain(&vdev->lock);
+			sta = pci_vdev_read_vcfg(vdev, PCIE_CAP_VPOS + PCIR_PCIE_SLOTSTA, 2U);
+			if (((sta & PCIM_PCIE_SLOT_PDS) != 0U) != present) {
+				sta ^= PCIM_PCIE_SLOT_PDS;
+				sta |= PCIM_PCIE_SLOT_PDC | PCIM_PCIE_SLOT_DLLSC;
+				pci_vdev_write_vcfg(vdev, PCIE_CAP_VPOS + PCIR_PCIE_SLOTSTA, 2U, sta);
+				pci_vdev_write_vcfg(vdev, PCIE_CAP_VPOS + PCIR_PCIE_LINKCTRL + 2U, 2U,
+						present ? PCIM_PCIE_LINK_DLLLA : 0U);
+
+				ctrl = pci_vdev_read_vcfg(vdev, PCIE_CAP_VPOS + PCIR_PCIE_SLOTCTRL, 2U);
+				msi_ctrl = pci_vdev_read_vcfg(vdev, MSI_CAP_VPOS + PCIR_MSI_CTRL, 2U);
+				if (((msi_ctrl & PCIM_MSICTRL_MSI_ENABLE) != 0U) && ((ctrl & PCIM_PCIE_SLOT_HPIE) != 0U) &&
+						((ctrl & (PCIM_PCIE_SLOT_PDCE | PCIM_PCIE_SLOT_DLLSCE)) != 0U)) {
+					msi_addr = ((uint64_t)pci_vdev_read_vcfg(vdev, MSI_CAP_VPOS + PCIR_MSI_ADDR_HIGH, 4U) << 32U) |
+						pci_vdev_read_vcfg(vdev, MSI_CAP_VPOS + PCIR_MSI_ADDR, 4U);
+					msi_data = pci_vdev_read_vcfg(vdev, MSI_CAP_VPOS + PCIR_MSI_DATA_64BIT, 2U);
+					inject = true;
+				}
+			}
+			spinlock_release(&vdev->lock);
+			break;
+		}
+	}
+
+	if (inject) {
+		(void)vlapic_inject_msi(vm, msi_addr, msi_data);
+	}
+}
+
 int32_t create_vrp(struct acrn_vm *vm, struct acrn_vdev *dev)
 {
 	struct acrn_vm_config *vm_config = get_vm_config(vm->vm_id);
@@ -142,6 +263,7 @@ int32_t create_vrp(struct acrn_vm *vm, struct acrn_vdev *dev)
 			vdev = vpci_init_vdev(&vm->vpci, dev_config, NULL);
 
 			init_ptm(vdev, vrp_config);
+			init_slot(vdev, vrp_config);
 
 			break;
 		}
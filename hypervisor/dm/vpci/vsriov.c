@@ -95,6 +95,7 @@ static void create_vf(struct pci_vdev *pf_vdev, union pci_bdf vf_bdf, uint16_t v
 	if (vf_pdev != NULL) {
 		struct acrn_vm_pci_dev_config *dev_cfg;
 
+		vf_pdev->pf_bdf = pf_vdev->pdev->bdf;
 		dev_cfg = init_one_dev_config(vf_pdev);
 		if (dev_cfg != NULL) {
 			vf_vdev = vpci_init_vdev(&vpci2vm(pf_vdev->vpci)->vpci, dev_cfg, pf_vdev);
@@ -199,6 +200,11 @@ static void enable_vfs(struct pci_vdev *pf_vdev)
 		struct pci_vdev *vf_vdev;
 
 		num_vfs = read_sriov_reg(pf_vdev, PCIR_SRIOV_NUMVFS);
+		/*
+		 * Each VF maps its BARs and cuts its MSI-X table out of them, flush
+		 * the EPT once for all of them rather than a few times per VF.
+		 */
+		ept_begin_batch(vpci2vm(pf_vdev->vpci));
 		for (idx = 0U; idx < num_vfs; idx++) {
 			vf_bdf.fields.bus = get_vf_bus(pf_vdev, fst_off, stride, idx);
 			vf_bdf.fields.devfun = get_vf_devfun(pf_vdev, fst_off, stride, idx);
@@ -215,10 +221,13 @@ static void enable_vfs(struct pci_vdev *pf_vdev)
 			} else {
 				/* Re-activate a zombie VF */
 				if (is_zombie_vf(vf_vdev)) {
+					spinlock_obtain(&vf_vdev->lock);
 					vf_vdev->vdev_ops->init_vdev(vf_vdev);
+					spinlock_release(&vf_vdev->lock);
 				}
 			}
 		}
+		ept_end_batch(vpci2vm(pf_vdev->vpci));
 	} else {
 		/*
 		 * If the VF physical device was not created successfully, the pdev/vdev
@@ -249,6 +258,7 @@ static void disable_vfs(struct pci_vdev *pf_vdev)
 	num_vfs = read_sriov_reg(pf_vdev, PCIR_SRIOV_NUMVFS);
 	first = read_sriov_reg(pf_vdev, PCIR_SRIOV_FST_VF_OFF);
 	stride = read_sriov_reg(pf_vdev, PCIR_SRIOV_VF_STRIDE);
+	ept_begin_batch(vpci2vm(pf_vdev->vpci));
 	for (idx = 0U; idx < num_vfs; idx++) {
 		union pci_bdf bdf;
 
@@ -256,10 +266,13 @@ static void disable_vfs(struct pci_vdev *pf_vdev)
 		bdf.fields.devfun = get_vf_devfun(pf_vdev, first, stride, idx);
 		vf_vdev = pci_find_vdev(&vpci2vm(pf_vdev->vpci)->vpci, bdf);
 		if ((vf_vdev != NULL) && (!is_zombie_vf(vf_vdev))) {
-			/* set disabled VF as zombie vdev instance */
+			/* set disabled VF as zombie vdev instance, the PF is locked before its VFs */
+			spinlock_obtain(&vf_vdev->lock);
 			vf_vdev->vdev_ops->deinit_vdev(vf_vdev);
+			spinlock_release(&vf_vdev->lock);
 		}
 	}
+	ept_end_batch(vpci2vm(pf_vdev->vpci));
 }
 
 /**
@@ -397,6 +397,26 @@ static time_t vrtc_get_current_time(struct acrn_vrtc *vrtc)
 	return second;
 }
 
+/**
+ * @pre vm != NULL
+ *
+ * The wall clock time of the VM in seconds, from its vRTC if the hypervisor
+ * emulates it, else from the physical RTC. VRTC_BROKEN_TIME if unknown.
+ */
+time_t vrtc_get_wall_time(struct acrn_vm *vm)
+{
+	struct acrn_vrtc temp_vrtc;
+	time_t now;
+
+	if (is_rt_vm(vm) || !is_postlaunched_vm(vm)) {
+		now = vrtc_get_current_time(&vm->vrtc);
+	} else {
+		now = vrtc_get_physical_rtc_time(&temp_vrtc);
+	}
+
+	return now;
+}
+
 #define CMOS_ADDR_PORT		0x70U
 #define CMOS_DATA_PORT		0x71U
 
@@ -35,6 +35,8 @@
 #include <vmcs9900.h>
 #include <asm/guest/vm.h>
 #include <logmsg.h>
+#include <timer.h>
+#include <asm/per_cpu.h>
 
 #define init_vuart_lock(vu)	spinlock_init(&((vu)->lock))
 #define obtain_vuart_lock(vu, flags)	spinlock_irqsave_obtain(&((vu)->lock), &(flags))
@@ -124,6 +126,36 @@ static inline void init_fifo(struct acrn_vuart *vu)
 	reset_fifo(&(vu->rxfifo));
 }
 
+/*
+ * The RX FIFO of a connection vuart with the FIFOs enabled is coalesced as
+ * the one of a 16550: it only interrupts once it holds the characters of the
+ * trigger level, or once its character timeout expired. The other vuarts
+ * interrupt as soon as a character is received.
+ */
+static inline bool vuart_rx_coalesced(const struct acrn_vuart *vu)
+{
+	return ((vu->target_vu != NULL) && ((vu->fcr & FCR_FIFOE) != 0U));
+}
+
+/* The RX trigger level of FCR bits 7:6 */
+static uint32_t vuart_rx_trigger(const struct acrn_vuart *vu)
+{
+	static const uint32_t levels[4] = { 1U, 4U, 8U, 14U };
+
+	return levels[(vu->fcr & FCR_RX_MASK) >> 6U];
+}
+
+static bool vuart_rx_ready(const struct acrn_vuart *vu)
+{
+	uint32_t num = fifo_numchars(&vu->rxfifo);
+	bool ret = (num > 0U);
+
+	if (ret && vuart_rx_coalesced(vu)) {
+		ret = (vu->rx_timeout || (num >= vuart_rx_trigger(vu)));
+	}
+	return ret;
+}
+
 /*
  * The IIR returns a prioritized interrupt reason:
  * - receive data available
@@ -137,7 +169,7 @@ static uint8_t vuart_intr_reason(const struct acrn_vuart *vu)
 
 	if (((vu->lsr & LSR_OE) != 0U) && ((vu->ier & IER_ELSI) != 0U)) {
 		ret = IIR_RLS;
-	} else if ((fifo_numchars(&vu->rxfifo) > 0U) && ((vu->ier & IER_ERBFI) != 0U)) {
+	} else if (vuart_rx_ready(vu) && ((vu->ier & IER_ERBFI) != 0U)) {
 		ret = IIR_RXTOUT;
 	} else if (vu->thre_int_pending && ((vu->ier & IER_ETBEI) != 0U)) {
 		ret = IIR_TXRDY;
@@ -210,18 +242,99 @@ void vuart_toggle_intr(const struct acrn_vuart *vu)
 	}
 }
 
-static bool send_to_target(struct acrn_vuart *vu, uint8_t value_u8)
+/* The character timeout: 4 characters of 10 bits at the programmed baud rate */
+static uint64_t vuart_char_timeout(const struct acrn_vuart *vu)
+{
+	uint64_t divisor = ((uint64_t)vu->dlh << 8U) | (uint64_t)vu->dll;
+
+	if (divisor == 0UL) {
+		divisor = 1UL;
+	}
+	/* baud = UART_CLOCK_RATE / (16 * divisor) */
+	return us_to_ticks((uint32_t)((40UL * 16UL * 1000000UL * divisor) / UART_CLOCK_RATE));
+}
+
+static void vuart_rx_timer_expired(void *data)
+{
+	struct acrn_vuart *vu = (struct acrn_vuart *)data;
+	uint64_t rflags;
+
+	obtain_vuart_lock(vu, rflags);
+	vu->rx_timer_armed = false;
+	if (vu->active && (fifo_numchars(&vu->rxfifo) > 0U)) {
+		vu->rx_timeout = true;
+		vuart_toggle_intr(vu);
+	}
+	release_vuart_lock(vu, rflags);
+}
+
+/*
+ * Time out the characters below the trigger level one character timeout
+ * after the first of them came in.
+ *
+ * The timer is added on the pCPU of the sender and is never deleted from
+ * another one: it is armed once at a time, and its expiry disarms it.
+ *
+ * @pre the lock of vu is held
+ */
+static void vuart_arm_rx_timer(struct acrn_vuart *vu)
+{
+	if (!vu->rx_timer_armed) {
+		update_timer(&vu->rx_timer, cpu_ticks() + vuart_char_timeout(vu), 0UL);
+		if (add_timer(&vu->rx_timer) == 0) {
+			vu->rx_timer_armed = true;
+			vu->rx_timer_pcpu = get_pcpu_id();
+		}
+	}
+}
+
+static void vuart_stop_rx_timer(struct acrn_vuart *vu)
 {
 	uint64_t rflags;
+	bool armed;
+
+	do {
+		obtain_vuart_lock(vu, rflags);
+		if (vu->rx_timer_armed && (vu->rx_timer_pcpu == get_pcpu_id())) {
+			del_timer(&vu->rx_timer);
+			vu->rx_timer_armed = false;
+		}
+		armed = vu->rx_timer_armed;
+		release_vuart_lock(vu, rflags);
+		/* armed on another pCPU, it expires shortly */
+		if (armed) {
+			asm_pause();
+		}
+	} while (armed);
+}
+
+/*
+ * Put the characters into the RX FIFO of the target vuart. Its interrupt is
+ * only raised when its reason changes: the level is already asserted, or
+ * the MSI already sent, for the reason pending.
+ */
+static bool send_to_target(struct acrn_vuart *vu, const uint8_t *buf, uint32_t len)
+{
+	uint64_t rflags;
+	uint8_t old_reason;
+	uint32_t i;
 	bool ret = false;
 
 	obtain_vuart_lock(vu, rflags);
 	if (vu->active) {
-		fifo_putchar(&vu->rxfifo, (char)value_u8);
+		old_reason = vuart_intr_reason(vu);
+		for (i = 0U; i < len; i++) {
+			fifo_putchar(&vu->rxfifo, (char)buf[i]);
+		}
 		if (fifo_isfull(&vu->rxfifo)) {
 			ret = true;
 		}
-		vuart_toggle_intr(vu);
+		if (vuart_rx_coalesced(vu) && !vuart_rx_ready(vu)) {
+			vuart_arm_rx_timer(vu);
+		}
+		if (vuart_intr_reason(vu) != old_reason) {
+			vuart_toggle_intr(vu);
+		}
 	}
 	release_vuart_lock(vu, rflags);
 	return ret;
@@ -317,10 +430,11 @@ static void write_reg(struct acrn_vuart *vu, uint16_t reg, uint8_t value_u8)
 				vu->thre_int_pending = true;
 			}
 			/*
-			 * Apply mask so that bits 4-7 are 0
+			 * Apply mask so that bits 4-6 are 0
 			 * Also enables bits 0-3 only if they're 1
+			 * Bit 7 opts in the paravirtual burst writes
 			 */
-			vu->ier = value_u8 & 0x0FU;
+			vu->ier = value_u8 & (0x0FU | VUART_IER_PV_BURST);
 			break;
 		case UART16550_FCR:
 			/*
@@ -332,6 +446,7 @@ static void write_reg(struct acrn_vuart *vu, uint16_t reg, uint8_t value_u8)
 			} else {
 				if ((value_u8 & FCR_RFR) != 0U) {
 					reset_fifo(&vu->rxfifo);
+					vu->rx_timeout = false;
 				}
 				vu->fcr = value_u8 & (FCR_FIFOE | FCR_DMA | FCR_RX_MASK);
 			}
@@ -376,44 +491,88 @@ static void write_reg(struct acrn_vuart *vu, uint16_t reg, uint8_t value_u8)
 	release_vuart_lock(vu, rflags);
 }
 
+static inline bool is_connection_thr(const struct acrn_vuart *vu, uint16_t offset)
+{
+	return (((vu->mcr & MCR_LOOPBACK) == 0U) && ((vu->lcr & LCR_DLAB) == 0U)
+		&& (offset == UART16550_THR) && (vu->target_vu != NULL));
+}
+
 /*
  * @pre: vu != NULL
+ * @pre: vu->target_vu != NULL
  */
-void vuart_write_reg(struct acrn_vuart *vu, uint16_t offset, uint8_t value_u8)
+static void write_connection_thr(struct acrn_vuart *vu, const uint8_t *buf, uint32_t len)
 {
-	struct acrn_vuart *target_vu = NULL;
 	uint64_t rflags;
-
-	target_vu = vu->target_vu;
-
-	if (((vu->mcr & MCR_LOOPBACK) == 0U) && ((vu->lcr & LCR_DLAB) == 0U)
-		&& (offset == UART16550_THR) && (target_vu != NULL)) {
-		if (!send_to_target(target_vu, value_u8)) {
-			/* FIFO is not full, raise THRE interrupt */
-			obtain_vuart_lock(vu, rflags);
-			vu->thre_int_pending = true;
+	uint8_t old_reason;
+
+	if (!send_to_target(vu->target_vu, buf, len)) {
+		/* FIFO is not full, raise THRE interrupt */
+		obtain_vuart_lock(vu, rflags);
+		old_reason = vuart_intr_reason(vu);
+		vu->thre_int_pending = true;
+		if (vuart_intr_reason(vu) != old_reason) {
 			vuart_toggle_intr(vu);
-			release_vuart_lock(vu, rflags);
 		}
+		release_vuart_lock(vu, rflags);
+	}
+}
+
+/*
+ * @pre: vu != NULL
+ */
+void vuart_write_reg(struct acrn_vuart *vu, uint16_t offset, uint8_t value_u8)
+{
+	if (is_connection_thr(vu, offset)) {
+		write_connection_thr(vu, &value_u8, 1U);
 	} else {
 		write_reg(vu, offset, value_u8);
 	}
 }
 
+/*
+ * A write of width bytes. Once the guest opted in by setting
+ * VUART_IER_PV_BURST, a 2 or 4 bytes wide write to the THR sends as many
+ * characters, the lowest byte first, with one pass through the locks and
+ * the interrupts of both ends. A 16550 driver only does byte accesses.
+ *
+ * @pre: vu != NULL
+ */
+void vuart_write_burst(struct acrn_vuart *vu, uint16_t offset, uint32_t value, size_t width)
+{
+	uint8_t buf[4];
+	uint32_t i, len = (uint32_t)width;
+
+	if ((offset == UART16550_THR) && ((vu->ier & VUART_IER_PV_BURST) != 0U)
+			&& (len > 1U) && (len <= 4U)) {
+		for (i = 0U; i < len; i++) {
+			buf[i] = (uint8_t)(value >> (i * 8U));
+		}
+		if (is_connection_thr(vu, offset)) {
+			write_connection_thr(vu, buf, len);
+		} else {
+			for (i = 0U; i < len; i++) {
+				write_reg(vu, offset, buf[i]);
+			}
+		}
+	} else {
+		vuart_write_reg(vu, offset, (uint8_t)value);
+	}
+}
+
 /**
  * @pre vcpu != NULL
  * @pre vcpu->vm != NULL
  */
 static bool vuart_write(struct acrn_vcpu *vcpu, uint16_t offset_arg,
-			__unused size_t width, uint32_t value)
+			size_t width, uint32_t value)
 {
 	uint16_t offset = offset_arg;
 	struct acrn_vuart *vu = find_vuart_by_port(vcpu->vm, offset);
-	uint8_t value_u8 = (uint8_t)value;
 
 	if (vu != NULL) {
 		offset -= vu->port_base;
-		vuart_write_reg(vu, offset, value_u8);
+		vuart_write_burst(vu, offset, value, width);
 	}
 	return true;
 }
@@ -422,13 +581,17 @@ static void notify_target(const struct acrn_vuart *vu)
 {
 	struct acrn_vuart *t_vu;
 	uint64_t rflags;
+	uint8_t old_reason;
 
 	if (vu != NULL) {
 		t_vu = vu->target_vu;
 		if ((t_vu != NULL) && !fifo_isfull(&vu->rxfifo)) {
 			obtain_vuart_lock(t_vu, rflags);
+			old_reason = vuart_intr_reason(t_vu);
 			t_vu->thre_int_pending = true;
-			vuart_toggle_intr(t_vu);
+			if (vuart_intr_reason(t_vu) != old_reason) {
+				vuart_toggle_intr(t_vu);
+			}
 			release_vuart_lock(t_vu, rflags);
 		}
 	}
@@ -461,6 +624,9 @@ uint8_t vuart_read_reg(struct acrn_vuart *vu, uint16_t offset)
 		case UART16550_RBR:
 			vu->lsr &= ~LSR_OE;
 			reg = (uint8_t)fifo_getchar(&vu->rxfifo);
+			if (fifo_numchars(&vu->rxfifo) == 0U) {
+				vu->rx_timeout = false;
+			}
 			break;
 		case UART16550_IER:
 			reg = vu->ier;
@@ -582,6 +748,9 @@ static void setup_vuart(struct acrn_vm *vm, uint16_t vuart_idx)
 	vu->ier = 0U;
 	vuart_toggle_intr(vu);
 	vu->target_vu = NULL;
+	initialize_timer(&vu->rx_timer, vuart_rx_timer_expired, vu, 0UL, 0UL);
+	vu->rx_timer_armed = false;
+	vu->rx_timeout = false;
 }
 
 static struct acrn_vuart *find_active_target_vuart(const struct vuart_config *vu_config)
@@ -677,6 +846,7 @@ void deinit_legacy_vuarts(struct acrn_vm *vm)
 			if (vm->vuart[i].target_vu != NULL) {
 				vuart_deinit_connection(&vm->vuart[i]);
 			}
+			vuart_stop_rx_timer(&vm->vuart[i]);
 		}
 	}
 }
@@ -710,4 +880,5 @@ void deinit_pci_vuart(struct pci_vdev *vdev)
 	if (vu->target_vu != NULL) {
 		vuart_deinit_connection(vu);
 	}
+	vuart_stop_rx_timer(vu);
 }
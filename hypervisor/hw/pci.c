@@ -53,6 +53,12 @@ static uint32_t num_pci_pdev;
 static struct pci_pdev pci_pdevs[CONFIG_MAX_PCI_DEV_NUM];
 static struct hlist_head pdevs_hlist_heads[PDEV_HLIST_HASHSIZE];
 
+/*
+ * DRHD index + 1 of each BDF, 0 if there is no pdev at that BDF: IOMMU
+ * lookups of a device are a table read, with no walk of the pdevs.
+ */
+static uint8_t pdev_drhd_map[PCI_BUSMAX + 1U][(PCI_SLOTMAX + 1U) * (PCI_FUNCMAX + 1U)];
+
 /* For HV owned pdev */
 static uint32_t num_hv_owned_pci_pdev;
 static struct pci_pdev *hv_owned_pci_pdevs[CONFIG_MAX_PCI_DEV_NUM];
@@ -278,7 +284,7 @@ void pdev_restore_bar(const struct pci_pdev *pdev)
 	}
 }
 
-static const struct pci_pdev *pci_find_pdev(uint16_t pbdf)
+const struct pci_pdev *pci_find_pdev(uint16_t pbdf)
 {
 	struct hlist_node *n;
 	const struct pci_pdev *found = NULL, *tmp;
@@ -294,18 +300,17 @@ static const struct pci_pdev *pci_find_pdev(uint16_t pbdf)
 }
 
 /* @brief: Find the DRHD index corresponding to a PCI device
- * Runs through the pci_pdevs and returns the value in drhd_idx
- * member from pdev structure that matches matches B:D.F
+ * Reads the drhd_index that pci_init_pdev recorded for B:D.F
  *
  * @pbdf[in]	B:D.F of a PCI device
  *
- * @return if there is a matching pbdf in pci_pdevs, pdev->drhd_idx, else INVALID_DRHD_INDEX
+ * @return if there is a pdev at pbdf, pdev->drhd_idx, else INVALID_DRHD_INDEX
  */
 
 uint32_t pci_lookup_drhd_for_pbdf(uint16_t pbdf)
 {
-	const struct pci_pdev *pdev = pci_find_pdev(pbdf);
-	return (pdev != NULL) ? pdev->drhd_index : INVALID_DRHD_INDEX;
+	uint8_t entry = pdev_drhd_map[pbdf >> 8U][pbdf & 0xFFU];
+	return (entry != 0U) ? ((uint32_t)entry - 1U) : INVALID_DRHD_INDEX;
 }
 
 /* enable: 1: enable INTx; 0: Disable INTx */
@@ -713,7 +718,9 @@ static void pci_enumerate_ext_cap(struct pci_pdev *pdev)
 	/* PCI Express Extended Capability must have 4 bytes header */
 	hdr = pci_pdev_read_cfg(pdev->bdf, pos, 4U);
 	while ((hdr != 0U) && (node_limit > 0)) {
-		if (PCI_ECAP_ID(hdr) == PCIZ_SRIOV) {
+		if (PCI_ECAP_ID(hdr) == PCIZ_ATS) {
+			pdev->ats_capoff = pos;
+		} else if (PCI_ECAP_ID(hdr) == PCIZ_SRIOV) {
 			pdev->sriov.capoff = pos;
 			pdev->sriov.caplen = PCI_SRIOV_CAP_LEN;
 			pdev->sriov.pre_pos = pre_pos;
@@ -854,6 +861,7 @@ struct pci_pdev *pci_init_pdev(union pci_bdf bdf, uint32_t drhd_index)
 		if ((hdr_layout == PCIM_HDRTYPE_NORMAL) || (hdr_layout == PCIM_HDRTYPE_BRIDGE)) {
 			pdev = &pci_pdevs[num_pci_pdev];
 			pdev->bdf = bdf;
+			pdev->pf_bdf = bdf;
 			pdev->hdr_type = hdr_type;
 			pdev->base_class = (uint8_t)pci_pdev_read_cfg(bdf, PCIR_CLASS, 1U);
 			pdev->sub_class = (uint8_t)pci_pdev_read_cfg(bdf, PCIR_SUBCLASS, 1U);
@@ -877,6 +885,9 @@ struct pci_pdev *pci_init_pdev(union pci_bdf bdf, uint32_t drhd_index)
 			}
 			hlist_add_head(&pdev->link, &pdevs_hlist_heads[hash64(bdf.value, PDEV_HLIST_HASHBITS)]);
 			pdev->drhd_index = drhd_index;
+			if (drhd_index < MAX_DRHDS) {
+				pdev_drhd_map[bdf.bits.b][bdf.fields.devfun] = (uint8_t)(drhd_index + 1U);
+			}
 			num_pci_pdev++;
 			reserve_vmsix_on_msi_irtes(pdev);
 		} else {
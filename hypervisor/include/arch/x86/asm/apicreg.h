@@ -406,6 +406,7 @@ union ioapic_rte {
 /* window register offset */
 #define IOAPIC_REGSEL		0x00U
 #define IOAPIC_WINDOW		0x10U
+#define IOAPIC_EOIR		0x40U	/* version 0x20 and later */
 
 /* indexes into IO APIC */
 #define IOAPIC_ID		0x00U
@@ -138,6 +138,7 @@
 #define RFLAGS_A (1U<<4U)
 #define RFLAGS_Z (1U<<6U)
 #define RFLAGS_S (1U<<7U)
+#define RFLAGS_D (1U<<10U)
 #define RFLAGS_O (1U<<11U)
 #define RFLAGS_VM (1U<<17U)
 #define RFLAGS_AC (1U<<18U)
@@ -268,7 +269,7 @@ enum cpu_reg_name {
 
 /* In trampoline range, hold the jump target which trampline will jump to */
 extern uint64_t               main_entry[1];
-extern uint64_t               secondary_cpu_stack[1];
+extern uint64_t               ap_stack_table[1];
 
 /*
  * To support per_cpu access, we use a special struct "per_cpu_region" to hold
@@ -458,6 +459,7 @@ void init_pcpu_pre(bool is_bsp);
  */
 void init_pcpu_post(uint16_t pcpu_id);
 bool start_pcpus(uint64_t mask);
+void log_boot_phase(const char *phase);
 void wait_pcpus_offline(uint64_t mask);
 void stop_pcpus(void);
 void wait_sync_change(volatile const uint64_t *sync, uint64_t wake_sync);
@@ -542,6 +544,22 @@ static inline void asm_safe_hlt(void)
 	asm volatile ("sti; hlt; cli" : : : "cc");
 }
 
+static inline void asm_monitor(volatile const uint64_t *addr, uint64_t ecx, uint64_t edx)
+{
+	asm volatile("monitor\n" : : "a" (addr), "c" (ecx), "d" (edx));
+}
+
+static inline void asm_mwait(uint64_t eax, uint64_t ecx)
+{
+	asm volatile("mwait\n" : : "a" (eax), "c" (ecx));
+}
+
+/* the MWAIT counterpart of asm_safe_hlt(), eax is the MWAIT hint */
+static inline void asm_safe_mwait(uint64_t eax, uint64_t ecx)
+{
+	asm volatile ("sti; mwait; cli" : : "a" (eax), "c" (ecx) : "cc");
+}
+
 /* Disables interrupts on the current CPU */
 #ifdef CONFIG_KEEP_IRQ_DISABLED
 #define CPU_IRQ_DISABLE_ON_CONFIG()		do { } while (0)
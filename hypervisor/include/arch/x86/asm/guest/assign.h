@@ -63,6 +63,20 @@ void ptirq_intx_ack(struct acrn_vm *vm, uint32_t virt_gsi, enum intx_ctlr vgsi_c
 int32_t ptirq_prepare_msix_remap(struct acrn_vm *vm, uint16_t virt_bdf,  uint16_t phys_bdf,
 				uint16_t entry_nr, struct msi_info *info, uint16_t irte_idx);
 
+/**
+ * @brief Retarget the remapped mode MSIs of a vCPU to its current pCPU.
+ *
+ * Rebuild the IRTE of the remapped mode MSIs delivered to the vCPU, so that
+ * the physical interrupt arrives on the pCPU the vCPU now runs on instead of
+ * the one it ran on when the guest programmed the MSI.
+ *
+ * @param[in] vcpu pointer to the vCPU which was moved to another pCPU
+ *
+ * @pre vcpu != NULL
+ * @pre get_pcpu_id() == pcpuid_from_vcpu(vcpu)
+ */
+void ptirq_msi_follow_vcpu(struct acrn_vcpu *vcpu);
+
 
 /**
  * @brief INTx remapping for passthrough device.
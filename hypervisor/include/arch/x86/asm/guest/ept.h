@@ -113,6 +113,43 @@ void ept_modify_mr(struct acrn_vm *vm, uint64_t *pml4_page, uint64_t gpa,
 void ept_del_mr(struct acrn_vm *vm, uint64_t *pml4_page, uint64_t gpa,
 		uint64_t size);
 
+/**
+ * @brief Start batching the EPT updates of a VM on this pCPU
+ *
+ * The flushes requested by ept_add_mr(), ept_modify_mr() and ept_del_mr()
+ * for the VM on this pCPU are deferred to ept_end_batch(). Batches of the
+ * same VM nest, the outermost ept_end_batch() flushes.
+ *
+ * @param[in] vm the pointer that points to VM data structure
+ */
+void ept_begin_batch(struct acrn_vm *vm);
+/**
+ * @brief Stop batching the EPT updates of a VM and flush them at once
+ *
+ * @param[in] vm the pointer that points to VM data structure
+ */
+void ept_end_batch(struct acrn_vm *vm);
+
+/**
+ * @brief Whether the EPT accessed and dirty flags are enabled for a VM
+ *
+ * @param[in] vm the pointer that points to VM data structure
+ */
+bool is_ept_ad_enabled(const struct acrn_vm *vm);
+
+/**
+ * @brief Get and clear the accessed or dirty flags of a guest memory range
+ *
+ * @param[in] vm the pointer that points to VM data structure
+ * @param[in] gpa The page aligned start guest physical address of the range
+ * @param[in] pages The number of pages of the range
+ * @param[in] flag EPT_ACCESSED or EPT_DIRTY
+ * @param[out] bitmap The cleared bitmap to set the bits of the flagged pages in
+ *
+ * @pre is_ept_ad_enabled(vm)
+ */
+void ept_clear_access_log(struct acrn_vm *vm, uint64_t gpa, uint64_t pages, uint64_t flag, uint64_t *bitmap);
+
 /**
  * @brief Flush address space from the page entry
  *
@@ -150,8 +187,9 @@ void walk_ept_table(struct acrn_vm *vm, pge_handler cb);
  * @retval -EINVAL fail to handle the EPT misconfig
  * @retval 0 Success to handle the EPT misconfig
  */
-int32_t ept_misconfig_vmexit_handler(__unused struct acrn_vcpu *vcpu);
+int32_t ept_misconfig_vmexit_handler(struct acrn_vcpu *vcpu);
 
 void init_ept_pgtable(struct pgtable *table, uint16_t vm_id);
+void get_ept_page_pool_stats(uint16_t vm_id, struct page_pool_stats *stats);
 void reserve_buffer_for_ept_pages(void);
 #endif /* EPT_H */
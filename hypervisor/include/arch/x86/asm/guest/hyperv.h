@@ -8,6 +8,10 @@
 #define HYPERV_H
 
 #include <asm/guest/vcpuid.h>
+#include <timer.h>
+
+struct acrn_vcpu;
+struct acrn_vm;
 
 /* Hyper-V MSR numbers */
 #define HV_X64_MSR_GUEST_OS_ID		0x40000000U
@@ -19,6 +23,87 @@
 #define HV_X64_MSR_TSC_FREQUENCY	0x40000022U
 #define HV_X64_MSR_APIC_FREQUENCY	0x40000023U
 
+#define HV_X64_MSR_EOI			0x40000070U
+#define HV_X64_MSR_ICR			0x40000071U
+#define HV_X64_MSR_TPR			0x40000072U
+#define HV_X64_MSR_VP_ASSIST_PAGE	0x40000073U
+
+#define HV_X64_MSR_SCONTROL		0x40000080U
+#define HV_X64_MSR_SVERSION		0x40000081U
+#define HV_X64_MSR_SIEFP		0x40000082U
+#define HV_X64_MSR_SIMP			0x40000083U
+#define HV_X64_MSR_EOM			0x40000084U
+#define HV_X64_MSR_SINT0		0x40000090U
+#define HV_X64_MSR_SINT15		0x4000009FU
+
+/* HV_X64_MSR_STIMERn_CONFIG is HV_X64_MSR_STIMER0_CONFIG + 2n, STIMERn_COUNT follows it */
+#define HV_X64_MSR_STIMER0_CONFIG	0x400000B0U
+#define HV_X64_MSR_STIMER3_COUNT	0x400000B7U
+
+#define HV_SYNIC_SINT_COUNT		16U
+#define HV_STIMER_COUNT			4U
+
+union hyperv_page_msr {
+	uint64_t val64;
+	struct {
+		uint64_t enabled:1;
+		uint64_t rsvdp:11;
+		uint64_t gpfn:52;
+	};
+};
+
+union hyperv_sint_msr {
+	uint64_t val64;
+	struct {
+		uint64_t vector:8;
+		uint64_t rsvdp1:8;
+		uint64_t masked:1;
+		uint64_t auto_eoi:1;
+		uint64_t polling:1;
+		uint64_t rsvdp2:45;
+	};
+};
+
+union hyperv_stimer_config_msr {
+	uint64_t val64;
+	struct {
+		uint64_t enabled:1;
+		uint64_t periodic:1;
+		uint64_t lazy:1;
+		uint64_t auto_enable:1;
+		uint64_t apic_vector:8;
+		uint64_t direct_mode:1;
+		uint64_t rsvdp1:3;
+		uint64_t sintx:4;
+		uint64_t rsvdp2:44;
+	};
+};
+
+struct hyperv_stimer {
+	struct hv_timer			timer;
+	struct acrn_vcpu		*vcpu;
+	uint32_t			index;
+	union hyperv_stimer_config_msr	config;
+	uint64_t			count;
+	/* expiration in reference time (100ns) and in TSC */
+	uint64_t			exp_time;
+	uint64_t			exp_tsc;
+	/* the message slot of the SINT was busy */
+	bool				msg_pending;
+	/* the timer is in the timer heap of the old pCPU, see hyperv_migrate_vcpu() */
+	bool				migrated;
+};
+
+/* Synthetic interrupt controller and timers of a vCPU */
+struct acrn_hyperv_vcpu {
+	uint64_t			scontrol;
+	union hyperv_page_msr		simp;
+	union hyperv_page_msr		siefp;
+	union hyperv_sint_msr		sint[HV_SYNIC_SINT_COUNT];
+	struct hyperv_stimer		stimer[HV_STIMER_COUNT];
+	union hyperv_page_msr		vp_assist_page;
+};
+
 union hyperv_ref_tsc_page_msr {
 	uint64_t val64;
 	struct {
@@ -62,6 +147,8 @@ struct acrn_hyperv {
 int32_t hyperv_wrmsr(struct acrn_vcpu *vcpu, uint32_t msr, uint64_t wval);
 int32_t hyperv_rdmsr(struct acrn_vcpu *vcpu, uint32_t msr, uint64_t *rval);
 void hyperv_init_time(struct acrn_vm *vm);
-void hyperv_init_vcpuid_entry(uint32_t leaf, uint32_t subleaf, uint32_t flags,
+void hyperv_reset_vcpu(struct acrn_vcpu *vcpu);
+void hyperv_migrate_vcpu(struct acrn_vcpu *vcpu, bool out);
+void hyperv_init_vcpuid_entry(const struct acrn_vm *vm, uint32_t leaf, uint32_t subleaf, uint32_t flags,
 	struct vcpuid_entry *entry);
 #endif
@@ -56,7 +56,8 @@ struct instr_emul_vie {
 			repnz_present:1,	/* REPNE/REPNZ prefix */
 			opsize_override:1,	/* Operand size override */
 			addrsize_override:1,	/* Address size override */
-			seg_override:1;	/* Segment override */
+			seg_override:1,	/* Segment override */
+			lock_present:1;		/* LOCK prefix */
 
 	uint8_t		mod:2,			/* ModRM byte */
 			reg:4,
@@ -86,12 +87,26 @@ struct instr_emul_vie {
 	uint64_t	gva;		/* saved gva for instruction emulation */
 };
 
+/*
+ * A decoded instruction, reused when the same bytes are decoded again in
+ * the same CPU mode and default operand size, see decode_instruction().
+ */
+#define VIE_CACHE_SIZE	4U
+struct vie_cache_entry {
+	struct instr_emul_vie vie;
+	uint8_t cpu_mode;	/* enum vm_cpu_mode */
+	bool cs_d;
+};
+
 struct instr_emul_ctxt {
 	struct instr_emul_vie vie;
+	struct vie_cache_entry cache[VIE_CACHE_SIZE];
 };
 
 int32_t emulate_instruction(struct acrn_vcpu *vcpu);
 int32_t decode_instruction(struct acrn_vcpu *vcpu, bool full_decode);
 bool is_current_opcode_xchg(struct acrn_vcpu *vcpu);
+bool is_current_instr_locked_rmw(struct acrn_vcpu *vcpu);
+uint32_t current_instr_len(struct acrn_vcpu *vcpu);
 
 #endif
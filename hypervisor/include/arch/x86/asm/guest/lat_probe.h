@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef LAT_PROBE_H
+#define LAT_PROBE_H
+
+#include <types.h>
+#include <acrn_common.h>
+#include <asm/lib/spinlock.h>
+
+/*
+ * Latency probe of a VM, started and read by the Service VM with
+ * HC_VM_LATENCY_PROBE. While it is stopped, the only cost on the paths it
+ * measures is the test of enabled.
+ */
+struct lat_probe {
+	spinlock_t lock;
+	volatile bool enabled;
+	struct acrn_lat_hist hist[ACRN_LAT_TYPES];
+};
+
+void lat_probe_init(struct lat_probe *lp);
+void lat_probe_record(struct lat_probe *lp, uint32_t type, uint64_t ticks);
+void lat_probe_ctl(struct lat_probe *lp, struct acrn_vm_latency *lat);
+
+static inline bool lat_probe_enabled(const struct lat_probe *lp)
+{
+	return lp->enabled;
+}
+
+#endif /* LAT_PROBE_H */
@@ -7,6 +7,36 @@
 #ifndef SPLITLOCK_H_
 #define SPLITLOCK_H_
 
+#include <types.h>
+#include <asm/lib/spinlock.h>
+
+#define LOCK_SITE_NUM		8U
+/* a VM emulating split/uc-locks is reported at most once per LOCK_SITE_REPORT_MS */
+#define LOCK_SITE_REPORT_MS	1000U
+
+struct lock_site {
+	uint64_t rip;
+	uint64_t count;		/* emulations, estimated once evicted and taken again */
+	uint64_t in_hv;		/* emulations done without single-stepping the guest */
+	bool single_step;	/* the instruction can't be emulated in the hypervisor */
+};
+
+/*
+ * The guest RIPs a VM emulates split/uc-locks at most, kept with the
+ * space-saving algorithm: a new RIP replaces the least counted one and
+ * inherits its count.
+ */
+struct lock_sites {
+	spinlock_t lock;
+	uint64_t total;
+	uint64_t reported;	/* total at the last report */
+	uint64_t report_tsc;
+	struct lock_site site[LOCK_SITE_NUM];
+};
+
+void lock_sites_init(struct lock_sites *ls);
+void lock_sites_get(struct lock_sites *ls, struct lock_site *out, uint64_t *total, bool reset);
+
 void vcpu_kick_lock_instr_emulation(struct acrn_vcpu *cur_vcpu);
 void vcpu_complete_lock_instr_emulation(struct acrn_vcpu *cur_vcpu);
 int32_t emulate_lock_instr(struct acrn_vcpu *vcpu, uint32_t exception_vector, bool *queue_exception);
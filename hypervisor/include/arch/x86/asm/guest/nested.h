@@ -83,6 +83,14 @@ union value_64 {
 
 #define VMCS_SHADOW_BIT_INDICATOR		(1U << 31U)
 
+/* groups of the non-shadowing VMCS12 control fields that are merged to VMCS02 */
+#define VMCS12_DIRTY_MSR_BITMAP			(1U << 0U)
+#define VMCS12_DIRTY_EPTP			(1U << 1U)
+#define VMCS12_DIRTY_ENTRY_CTLS			(1U << 2U)
+#define VMCS12_DIRTY_EXIT_CTLS			(1U << 3U)
+#define VMCS12_DIRTY_VPID			(1U << 4U)
+#define VMCS12_DIRTY_ALL_CTLS			(0x1fU)
+
 /* refer to ISDM: Table 30-1. VM-Instruction Error Numbers */
 #define VMXERR_VMCLEAR_VMXON_POINTER		(3)
 #define VMXERR_VMLAUNCH_NONCLEAR_VMCS		(4)
@@ -335,7 +343,7 @@ struct acrn_vvmcs {
 	uint64_t vmcs12_gpa;            /* The corresponding L1 GPA for this VMCS12 */
 	uint32_t ref_cnt;		/* Count of being VMPTRLDed without VMCLEARed */
 	bool host_state_dirty;		/* To indicate need to merge VMCS12 host-state fields to VMCS01 */
-	bool control_fields_dirty;	/* For all other non-host-state fields that need to be merged */
+	uint32_t control_fields_dirty;	/* VMCS12_DIRTY_* groups of the other fields that need to be merged */
 } __aligned(PAGE_SIZE);
 
 #define MAX_ACTIVE_VVMCS_NUM	4
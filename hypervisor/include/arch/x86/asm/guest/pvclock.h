@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef PVCLOCK_H
+#define PVCLOCK_H
+
+#include <types.h>
+
+struct acrn_vcpu;
+
+/*
+ * The KVM paravirtual clock (pvclock ABI), which Linux guests use as the
+ * kvm-clock clocksource, the KVM steal time, PV EOI and asynchronous page
+ * faults. Their CPUID leaves are at
+ * 0x40000100, the guests look for the KVM signature from 0x40000000 on by
+ * steps of 0x100.
+ */
+#define KVM_CPUID_SIGNATURE		0x40000100U
+#define KVM_CPUID_FEATURES		0x40000101U
+#define KVM_FEATURE_CLOCKSOURCE2	(1U << 3U)
+#define KVM_FEATURE_ASYNC_PF		(1U << 4U)
+#define KVM_FEATURE_STEAL_TIME		(1U << 5U)
+#define KVM_FEATURE_PV_EOI		(1U << 6U)
+#define KVM_FEATURE_PV_UNHALT		(1U << 7U)
+#define KVM_FEATURE_ASYNC_PF_INT	(1U << 14U)
+#define KVM_FEATURE_CLOCKSOURCE_STABLE_BIT	(1U << 24U)
+
+#define MSR_KVM_WALL_CLOCK_NEW		0x4b564d00U
+#define MSR_KVM_SYSTEM_TIME_NEW		0x4b564d01U
+#define KVM_SYSTEM_TIME_ENABLE		(1UL << 0U)
+#define MSR_KVM_ASYNC_PF_EN		0x4b564d02U
+#define KVM_ASYNC_PF_ENABLED		(1UL << 0U)
+#define KVM_ASYNC_PF_SEND_ALWAYS	(1UL << 1U)
+#define KVM_ASYNC_PF_DELIVERY_AS_PF_VMEXIT	(1UL << 2U)
+#define KVM_ASYNC_PF_DELIVERY_AS_INT	(1UL << 3U)
+#define KVM_ASYNC_PF_RESERVED		0x30UL
+#define MSR_KVM_STEAL_TIME		0x4b564d03U
+#define KVM_STEAL_TIME_ENABLE		(1UL << 0U)
+#define KVM_STEAL_TIME_RESERVED		0x3eUL
+/* a dword whose bit 0 lets the guest skip the EOI, see vlapic_sync_lazy_eoi() */
+#define MSR_KVM_PV_EOI_EN		0x4b564d04U
+#define KVM_PV_EOI_ENABLE		(1UL << 0U)
+#define KVM_PV_EOI_RESERVED		0x2UL
+/* the vector of the "page ready" interrupt, and its acknowledge by the guest */
+#define MSR_KVM_ASYNC_PF_INT		0x4b564d06U
+#define KVM_ASYNC_PF_VECTOR_MASK	0xffUL
+#define MSR_KVM_ASYNC_PF_ACK		0x4b564d07U
+#define KVM_ASYNC_PF_ACK		(1UL << 0U)
+
+#define PVCLOCK_TSC_STABLE_BIT		(1U << 0U)
+
+/*
+ * time = system_time + (((guest TSC - tsc_timestamp) << tsc_shift) * tsc_to_system_mul) >> 32,
+ * in ns; tsc_shift shifts right if negative. An odd version is an update in progress.
+ */
+struct pvclock_vcpu_time_info {
+	uint32_t version;
+	uint32_t pad0;
+	uint64_t tsc_timestamp;
+	uint64_t system_time;
+	uint32_t tsc_to_system_mul;
+	int8_t tsc_shift;
+	uint8_t flags;
+	uint8_t pad[2];
+} __packed;
+
+/* the wall clock time when system_time was 0 */
+struct pvclock_wall_clock {
+	uint32_t version;
+	uint32_t sec;
+	uint32_t nsec;
+} __packed;
+
+/*
+ * The hypercalls of the KVM ABI: VMCALL with the number in RAX and the
+ * arguments from RBX, the result in RAX. Only the kick of the PV spinlocks,
+ * whose waiters halt until kicked, and the no-op KVM_HC_VAPIC_POLL_IRQ.
+ */
+#define KVM_HC_VAPIC_POLL_IRQ		1UL
+#define KVM_HC_KICK_CPU			5UL
+#define KVM_ENOSYS			1000
+
+/*
+ * The time the vCPU was runnable while other threads ran on its pCPU, in ns,
+ * and whether it is preempted now. 64 bytes aligned on 64 bytes.
+ */
+#define KVM_VCPU_PREEMPTED		(1U << 0U)
+
+struct kvm_steal_time {
+	uint64_t steal;
+	uint32_t version;
+	uint32_t flags;
+	uint8_t preempted;
+	uint8_t pad0[3];
+	uint32_t pad[11];
+} __packed;
+
+/*
+ * The asynchronous page faults, 64 bytes aligned on 64 bytes. "Page not
+ * present" is a #PF with the token in CR2 and KVM_PV_REASON_PAGE_NOT_PRESENT
+ * in flags, which the guest clears; "page ready" is the interrupt of
+ * MSR_KVM_ASYNC_PF_INT with the token in token, which the guest clears
+ * before its write to MSR_KVM_ASYNC_PF_ACK.
+ */
+#define KVM_PV_REASON_PAGE_NOT_PRESENT	1U
+
+struct kvm_vcpu_pv_apf_data {
+	uint32_t flags;
+	uint32_t token;
+	uint8_t pad[56];
+	uint32_t enabled;
+} __packed;
+
+int32_t pvclock_rdmsr(const struct acrn_vcpu *vcpu, uint32_t msr, uint64_t *val);
+int32_t pvclock_wrmsr(struct acrn_vcpu *vcpu, uint32_t msr, uint64_t val);
+void pvclock_update(struct acrn_vcpu *vcpu);
+void pvclock_reset(struct acrn_vcpu *vcpu);
+void pvclock_steal_switch_in(struct acrn_vcpu *vcpu);
+void pvclock_steal_switch_out(struct acrn_vcpu *vcpu, bool preempted);
+bool pvclock_async_pf(struct acrn_vcpu *vcpu, uint64_t gpa);
+void pvclock_async_pf_ready(struct acrn_vcpu *vcpu);
+void pvclock_async_pf_flush(struct acrn_vcpu *vcpu);
+
+#endif /* PVCLOCK_H */
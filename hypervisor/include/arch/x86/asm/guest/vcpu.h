@@ -21,6 +21,12 @@
 #include <asm/guest/virtual_cr.h>
 #include <asm/guest/vlapic.h>
 #include <asm/guest/vmtrr.h>
+#include <asm/guest/vcpuid.h>
+#include <asm/guest/vpmu.h>
+#include <asm/guest/pvclock.h>
+#ifdef CONFIG_HYPERV_ENABLED
+#include <asm/guest/hyperv.h>
+#endif
 #include <schedule.h>
 #include <event.h>
 #include <io_req.h>
@@ -107,6 +113,16 @@
 
 #define ACRN_REQUEST_SMP_CALL			11U
 
+/**
+ * @brief Request for retargeting the remapped mode MSIs to a new pCPU
+ */
+#define ACRN_REQUEST_PTIRQ_AFFINITY		12U
+
+/**
+ * @brief Request for completing the asynchronous page fault of the vCPU
+ */
+#define ACRN_REQUEST_ASYNC_PF			13U
+
 /**
  * @}
  */
@@ -160,6 +176,15 @@ enum vm_cpu_mode {
 	CPU_MODE_64BIT,			/* IA-32E mode (CS.L = 1) */
 };
 
+/* read-only VM exit information fields, read from the VMCS at most once per VM exit */
+enum vcpu_exit_info {
+	EXIT_INFO_QUALIFICATION,
+	EXIT_INFO_GUEST_PHYS_ADDR,
+	EXIT_INFO_GUEST_LINEAR_ADDR,
+	EXIT_INFO_INTR_INFO,
+	EXIT_INFO_INTR_ERR_CODE,
+};
+
 #define	VCPU_EVENT_IOREQ		0
 #define	VCPU_EVENT_VIRTUAL_INTERRUPT	1
 #define	VCPU_EVENT_SYNC_WBINVD		2
@@ -197,6 +222,12 @@ enum reset_mode;
 #define NUM_EMULATED_MSRS	(FLEXIBLE_MSR_INDEX + NUM_CAT_MSRS)
 /* For detailed layout of the emulated guest MSRs, see emulated_guest_msrs[NUM_EMULATED_MSRS] in vmsr.c */
 
+/* RDMSR/WRMSR exits are counted per emulated MSR, per x2APIC MSR and for all the other MSRs together */
+#define NUM_X2APIC_MSRS		0x100U
+#define VMSR_EXIT_X2APIC_SLOT	NUM_EMULATED_MSRS
+#define VMSR_EXIT_OTHER_SLOT	(NUM_EMULATED_MSRS + NUM_X2APIC_MSRS)
+#define VMSR_EXIT_SLOTS		(VMSR_EXIT_OTHER_SLOT + 1U)
+
 #define EOI_EXIT_BITMAP_SIZE	256U
 
 struct guest_cpu_context {
@@ -219,8 +250,25 @@ struct msr_store_entry {
 struct msr_store_area {
 	struct msr_store_entry guest[MSR_AREA_COUNT];
 	struct msr_store_entry host[MSR_AREA_COUNT];
-	uint32_t index_of_pqr_assoc;
 	uint32_t count;	/* actual count of entries to be loaded/restored during VMEntry/VMExit */
+
+	/*
+	 * MSR_IA32_PQR_ASSOC isn't in the lists above, it is switched when the vCPU
+	 * gets the pCPU rather than on each VMEntry/VMExit, see
+	 * load_guest_pqr_assoc()
+	 */
+	bool switch_pqr_assoc;	/* the guest runs with another CLOS than the hypervisor */
+	bool pqr_assoc_loaded;	/* the CLOS of the guest is in the MSR of the pCPU */
+	uint64_t guest_pqr_assoc;
+};
+
+/* what set_vcpu_state() leaves to finish_vcpu_restore() */
+struct acrn_vcpu_restore {
+	bool pending;
+	uint32_t interruptibility;
+	uint64_t tsc;
+	uint64_t apic_base;
+	uint64_t tsc_deadline;
 };
 
 struct iwkey {
@@ -230,6 +278,13 @@ struct iwkey {
 	uint64_t integrity_key[2];
 };
 
+/* guest paging-structure pages the vCPU walked lately, see pw_gpa2hva() */
+#define PW_CACHE_SIZE	8U
+struct pw_cache_entry {
+	uint64_t gpa;
+	void *hva;
+};
+
 struct acrn_vcpu_arch {
 	/* vmcs region for this vcpu, MUST be 4KB-aligned. This is VMCS01 when nested VMX is enabled */
 	uint8_t vmcs[PAGE_SIZE];
@@ -271,10 +326,26 @@ struct acrn_vcpu_arch {
 	bool emulating_lock;
 	bool xsave_enabled;
 
+	/* the VMCS was cleared on the old pCPU by a migration, see context_migrate() */
+	bool vmcs_migrated;
+	bool vtimer_migrated;
+
+	/* how long a HLT polls for an interrupt before sleeping, see hlt_vmexit_handler() */
+	uint64_t halt_poll_ticks;
+
+	/* the EPT pw_cache is valid for, NULL once it is flushed */
+	void *pw_cache_eptp;
+	struct pw_cache_entry pw_cache[PW_CACHE_SIZE];
+
 	/* VCPU context state information */
 	uint32_t exit_reason;
 	uint32_t idt_vectoring_info;
 	uint64_t exit_qualification;
+	uint64_t exit_guest_phys_addr;
+	uint64_t exit_guest_linear_addr;
+	uint32_t exit_intr_info;
+	uint32_t exit_intr_err_code;
+	uint32_t exit_info_cached; /* bitmap of enum vcpu_exit_info, cleared on each VM exit */
 	uint32_t proc_vm_exec_ctrls;
 	uint32_t inst_len;
 
@@ -288,9 +359,14 @@ struct acrn_vcpu_arch {
 	/* List of MSRS to be stored and loaded on VM exits or VM entries */
 	struct msr_store_area msr_area;
 
+	struct acrn_vpmu vpmu;
+
 	/* EOI_EXIT_BITMAP buffer, for the bitmap update */
 	uint64_t eoi_exit_bitmap[EOI_EXIT_BITMAP_SIZE >> 6U];
 
+	/* a vCPU loaded by set_vcpu_state(), until its first VM entry */
+	struct acrn_vcpu_restore restore;
+
 	/* Keylocker */
 	struct iwkey IWKey;
 	bool cr4_kl_enabled;
@@ -300,6 +376,41 @@ struct acrn_vcpu_arch {
 	 * Bit 63:1 - Reserved.
 	 */
 	uint64_t iwkey_copy_status;
+
+	/* MSR_KVM_SYSTEM_TIME_NEW and the time info it enables, NULL if none, see pvclock.c */
+	uint64_t pvclock_msr;
+	struct pvclock_vcpu_time_info *pvclock;
+
+	/* MSR_KVM_STEAL_TIME, its steal time, and the wait_ticks it accounts for */
+	uint64_t steal_time_msr;
+	struct kvm_steal_time *steal_time;
+	uint64_t steal_ticks;
+
+	/* MSR_KVM_PV_EOI_EN, its flag is the lazy EOI of the vLAPIC */
+	uint64_t pv_eoi_msr;
+
+	/* kicked by KVM_HC_KICK_CPU since it last halted, see hcall_pv_kick() */
+	bool pv_unhalted;
+
+	/*
+	 * MSR_KVM_ASYNC_PF_EN and its data, MSR_KVM_ASYNC_PF_INT, the token of
+	 * the page the device model is mapping (0 if none), of the page mapped
+	 * the guest wasn't told yet (0 if none), and the last token given.
+	 */
+	uint64_t apf_msr;
+	struct kvm_vcpu_pv_apf_data *apf;
+	uint64_t apf_int_msr;
+	uint32_t apf_token;
+	uint32_t apf_ready;
+	uint32_t apf_seq;
+
+	/* hypercall argument page of a Service VM vCPU and its HVA, NULL if none */
+	uint64_t hcall_args_gpa;
+	void *hcall_args;
+
+#ifdef CONFIG_HYPERV_ENABLED
+	struct acrn_hyperv_vcpu hyperv;
+#endif
 } __aligned(PAGE_SIZE);
 
 struct acrn_vm;
@@ -318,6 +429,11 @@ struct acrn_vcpu {
 
 	struct instr_emul_ctxt inst_ctxt;
 	struct io_request req; /* used by io/ept emulation */
+	struct io_handler_cache io_cache; /* last matched io/mmio handlers */
+	struct acrn_vmexit_stats exit_stats[ACRN_VMEXIT_REASONS]; /* always on, see vmexit_handler() */
+	uint64_t cpuid_exits[VCPUID_LEAF_SLOTS + 1U]; /* per vcpuid_leaf_slot(), see cpuid_vmexit_handler() */
+	uint64_t msr_exits[VMSR_EXIT_SLOTS]; /* see vmsr_count_exit() */
+	uint64_t lat_post_tsc; /* first interrupt posted since the last ACRN_MSR_LAT_ACK, 0 if none */
 
 	uint64_t reg_cached;
 	uint64_t reg_updated;
@@ -487,6 +603,55 @@ uint64_t vcpu_get_rflags(struct acrn_vcpu *vcpu);
  */
 void vcpu_set_rflags(struct acrn_vcpu *vcpu, uint64_t val);
 
+/**
+ * @brief get the exit qualification of the current VM exit
+ *
+ * Get & cache the exit qualification in vcpu->arch.exit_qualification.
+ *
+ * @param[inout] vcpu pointer to vcpu data structure
+ *
+ * @return the exit qualification.
+ */
+uint64_t vcpu_get_exit_qualification(struct acrn_vcpu *vcpu);
+
+/**
+ * @brief get the guest physical address of the current VM exit
+ *
+ * Get & cache the guest physical address of an EPT violation or misconfiguration.
+ *
+ * @param[inout] vcpu pointer to vcpu data structure
+ *
+ * @return the guest physical address.
+ */
+uint64_t vcpu_get_exit_guest_phys_addr(struct acrn_vcpu *vcpu);
+
+/**
+ * @brief get the guest linear address of the current VM exit
+ *
+ * @param[inout] vcpu pointer to vcpu data structure
+ *
+ * @return the guest linear address.
+ */
+uint64_t vcpu_get_exit_guest_linear_addr(struct acrn_vcpu *vcpu);
+
+/**
+ * @brief get the VM exit interruption information of the current VM exit
+ *
+ * @param[inout] vcpu pointer to vcpu data structure
+ *
+ * @return the VM exit interruption information.
+ */
+uint32_t vcpu_get_exit_intr_info(struct acrn_vcpu *vcpu);
+
+/**
+ * @brief get the VM exit interruption error code of the current VM exit
+ *
+ * @param[inout] vcpu pointer to vcpu data structure
+ *
+ * @return the VM exit interruption error code.
+ */
+uint32_t vcpu_get_exit_intr_err_code(struct acrn_vcpu *vcpu);
+
 /**
  * @brief get guest emulated MSR
  *
@@ -563,6 +728,15 @@ void set_vcpu_regs(struct acrn_vcpu *vcpu, struct acrn_regs *vcpu_regs);
  */
 void reset_vcpu_regs(struct acrn_vcpu *vcpu, enum reset_mode mode);
 
+/**
+ * @brief save and load the whole state of a vCPU
+ *
+ * For the snapshot of a paused VM and its restore into a VM not started yet.
+ */
+void get_vcpu_state(struct acrn_vcpu *vcpu, struct acrn_vcpu_state *state);
+int32_t set_vcpu_state(struct acrn_vcpu *vcpu, const struct acrn_vcpu_state *state);
+void finish_vcpu_restore(struct acrn_vcpu *vcpu);
+
 bool sanitize_cr0_cr4_pattern(void);
 
 /**
@@ -10,8 +10,22 @@
 #define CPUID_CHECK_SUBLEAF	(1U << 0U)
 #define MAX_VM_VCPUID_ENTRIES	64U
 
+/*
+ * The basic (0x0), hypervisor (0x40000000) and extended (0x80000000) leaf
+ * ranges have their first VCPUID_RANGE_LEAVES leaves indexed directly, all
+ * the other leaves share the VCPUID_OTHER_LEAF_SLOT slot.
+ */
+#define VCPUID_LEAF_RANGES	3U
+#define VCPUID_RANGE_LEAVES	64U
+#define VCPUID_LEAF_SLOTS	(VCPUID_LEAF_RANGES * VCPUID_RANGE_LEAVES)
+#define VCPUID_OTHER_LEAF_SLOT	VCPUID_LEAF_SLOTS
+#define VCPUID_NO_ENTRY		0xFFU
+
 /* Guest capability flags reported by CPUID */
 #define GUEST_CAPS_PRIVILEGE_VM	(1U << 0U)
+#define GUEST_CAPS_PV_IPI	(1U << 1U)	/* HC_SEND_IPI is available */
+#define GUEST_CAPS_PV_TIMER	(1U << 2U)	/* HC_SET_PV_TIMER_PAGE is available */
+#define GUEST_CAPS_LAT_ACK	(1U << 3U)	/* ACRN_MSR_LAT_ACK is available */
 
 struct vcpuid_entry {
 	uint32_t eax;
@@ -24,6 +38,19 @@ struct vcpuid_entry {
 	uint32_t padding;
 };
 
+static inline uint32_t vcpuid_leaf_slot(uint32_t leaf)
+{
+	uint32_t range = leaf >> 30U, offset = leaf & 0x3FFFFFFFU;
+
+	return ((range < VCPUID_LEAF_RANGES) && (offset < VCPUID_RANGE_LEAVES)) ?
+		((range * VCPUID_RANGE_LEAVES) + offset) : VCPUID_OTHER_LEAF_SLOT;
+}
+
+static inline uint32_t vcpuid_slot_leaf(uint32_t slot)
+{
+	return ((slot / VCPUID_RANGE_LEAVES) << 30U) | (slot % VCPUID_RANGE_LEAVES);
+}
+
 int32_t set_vcpuid_entries(struct acrn_vm *vm);
 void guest_cpuid(struct acrn_vcpu *vcpu,
 			uint32_t *eax, uint32_t *ebx,
@@ -36,12 +36,19 @@ struct vept_desc {
 	 */
 	uint64_t shadow_eptp;
 	uint32_t ref_count;
+	/*
+	 * A descriptor no VMCS12 refers to keeps its shadow EPT cached for the
+	 * next VMPTRLD of the guest EPTP. The order its ref_count dropped to 0,
+	 * the least recently used one is evicted first.
+	 */
+	uint64_t release_seq;
 };
 
 void init_vept(void);
 uint64_t get_shadow_eptp(uint64_t guest_eptp);
 struct vept_desc *get_vept_desc(uint64_t guest_eptp);
 void put_vept_desc(uint64_t guest_eptp);
+void flush_cached_vept_desc(void);
 bool handle_l2_ept_violation(struct acrn_vcpu *vcpu);
 int32_t invept_vmexit_handler(struct acrn_vcpu *vcpu);
 #else
@@ -92,6 +92,14 @@ void vcpu_inject_ud(struct acrn_vcpu *vcpu);
 void vcpu_inject_ss(struct acrn_vcpu *vcpu);
 void vcpu_make_request(struct acrn_vcpu *vcpu, uint16_t eventid);
 
+/**
+ * @brief Whether the guest takes maskable interrupts now: RFLAGS.IF is set
+ * and no STI or MOV SS blocks them.
+ *
+ * @pre vcpu == get_running_vcpu(get_pcpu_id()), its VMCS is loaded
+ */
+bool is_guest_irq_enabled(struct acrn_vcpu *vcpu);
+
 /*
  * @pre vcpu != NULL
  */
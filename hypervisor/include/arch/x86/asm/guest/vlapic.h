@@ -42,11 +42,16 @@
 
 #define VLAPIC_MAXLVT_INDEX	APIC_LVT_CMCI
 
+/* slots of the per-VM APIC ID hash, kept at most half full */
+#define VLAPIC_APICID_HASH_SIZE	(MAX_VCPUS_PER_VM * 2U)
+
 struct vlapic_timer {
 	struct hv_timer timer;
 	uint32_t mode;
 	uint32_t tmicr;
 	uint32_t divisor_shift;
+	/* registered with HC_SET_PV_TIMER_PAGE, NULL if none */
+	struct acrn_pv_timer_page *pv_page;
 };
 
 struct acrn_vlapic {
@@ -83,6 +88,14 @@ struct acrn_vlapic {
 	 */
 	uint32_t	svr_last;
 	uint32_t	lvt_last[VLAPIC_MAXLVT_INDEX + 1];
+
+	/* logical destination model and LDR this vLAPIC is filed under in the VM lookup tables */
+	uint32_t	filed_model;
+	uint32_t	filed_ldr;
+
+	/* guest flag whose bit 0 the guest clears in place of an EOI, NULL if none, see vlapic_sync_lazy_eoi() */
+	uint32_t	*lazy_eoi;
+	bool		lazy_eoi_pending;
 } __aligned(PAGE_SIZE);
 
 
@@ -125,7 +138,7 @@ uint32_t vlapic_get_next_pending_intr(struct acrn_vcpu *vcpu);
  */
 bool vlapic_clear_pending_intr(struct acrn_vcpu *vcpu, uint32_t vector);
 
-uint64_t vlapic_get_tsc_deadline_msr(const struct acrn_vlapic *vlapic);
+uint64_t vlapic_get_tsc_deadline_msr(struct acrn_vlapic *vlapic);
 void vlapic_set_tsc_deadline_msr(struct acrn_vlapic *vlapic, uint64_t val_arg);
 uint64_t vlapic_get_apicbase(const struct acrn_vlapic *vlapic);
 int32_t vlapic_set_apicbase(struct acrn_vlapic *vlapic, uint64_t new);
@@ -197,6 +210,9 @@ void vlapic_free(struct acrn_vcpu *vcpu);
 
 void vlapic_reset(struct acrn_vlapic *vlapic, const struct acrn_apicv_ops *ops, enum reset_mode mode);
 void vlapic_restore(struct acrn_vlapic *vlapic, const struct lapic_regs *regs);
+void vlapic_get_state(struct acrn_vlapic *vlapic, uint8_t *regs, uint64_t *tsc_deadline);
+void vlapic_set_state(struct acrn_vlapic *vlapic, const uint8_t *regs);
+void vlapic_restore_timer(struct acrn_vlapic *vlapic, uint64_t tsc_deadline);
 uint64_t vlapic_apicv_get_apic_access_addr(void);
 uint64_t vlapic_apicv_get_apic_page_addr(struct acrn_vlapic *vlapic);
 int32_t apic_access_vmexit_handler(struct acrn_vcpu *vcpu);
@@ -204,6 +220,14 @@ int32_t apic_write_vmexit_handler(struct acrn_vcpu *vcpu);
 int32_t veoi_vmexit_handler(struct acrn_vcpu *vcpu);
 void vlapic_update_tpr_threshold(const struct acrn_vlapic *vlapic);
 int32_t tpr_below_threshold_vmexit_handler(struct acrn_vcpu *vcpu);
+/* the vCPU of the VM with that APIC ID, INVALID_CPU_ID if none */
+uint16_t vm_apicid2vcpu_id(struct acrn_vm *vm, uint32_t lapicid);
+int32_t vlapic_send_ipi_mask(struct acrn_vcpu *vcpu, uint32_t icr_low, uint32_t base_apicid, uint64_t apicids);
+void vlapic_set_pv_timer_page(struct acrn_vlapic *vlapic, struct acrn_pv_timer_page *page);
+void vlapic_set_lazy_eoi(struct acrn_vlapic *vlapic, uint32_t *flag);
+int32_t vlapic_pv_msr_read(struct acrn_vlapic *vlapic, uint32_t msr, uint64_t *val);
+int32_t vlapic_pv_msr_write(struct acrn_vlapic *vlapic, uint32_t msr, uint64_t val);
+void vlapic_sync_pv_timer(struct acrn_vlapic *vlapic);
 uint64_t vlapic_calc_dest_noshort(struct acrn_vm *vm, bool is_broadcast,
 		uint32_t dest, bool phys, bool lowprio);
 bool is_x2apic_enabled(const struct acrn_vlapic *vlapic);
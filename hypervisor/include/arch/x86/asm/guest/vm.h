@@ -15,6 +15,7 @@
 
 #include <asm/lib/bits.h>
 #include <asm/lib/spinlock.h>
+#include <asm/lib/seqlock.h>
 #include <asm/pgtable.h>
 #include <asm/guest/vcpu.h>
 #include <vioapic.h>
@@ -29,10 +30,20 @@
 #include <asm/e820.h>
 #include <asm/vm_config.h>
 #include <io_req.h>
+#include <io_hotspot.h>
+#include <tsc_counter.h>
+#include <asm/guest/lat_probe.h>
+#include <asm/guest/lock_instr_emul.h>
 #ifdef CONFIG_HYPERV_ENABLED
 #include <asm/guest/hyperv.h>
 #endif
 
+/*
+ * vCPUs with a higher APIC ID are left out of the PID-pointer table and their
+ * IPIs exit as before. 0xFF is the xAPIC broadcast ID, so it is never an index.
+ */
+#define IPIV_PID_TABLE_ENTRIES	255U
+
 enum reset_mode {
 	POWER_ON_RESET,		/* reset by hardware Power-on */
 	COLD_RESET,		/* hardware cold reset */
@@ -72,6 +83,7 @@ struct vm_sw_info {
 	void *io_shared_page;
 	void *asyncio_sbuf;
 	void *vm_event_sbuf;
+	void *coalesced_mmio_sbuf;
 	/* If enable IO completion polling mode */
 	bool is_polling_ioreq;
 };
@@ -104,6 +116,13 @@ struct vm_arch {
 	/* I/O bitmaps A and B for this VM, MUST be 4-Kbyte aligned */
 	uint8_t io_bitmap[PAGE_SIZE*2];
 
+	/*
+	 * PID-pointer table of IPI virtualization, MUST be 4-Kbyte aligned:
+	 * the posted-interrupt descriptor of each vCPU indexed by its APIC ID.
+	 */
+	uint64_t pid_table[IPIV_PID_TABLE_ENTRIES] __aligned(PAGE_SIZE);
+	bool ipiv_enabled;	/* whether the vCPUs send fixed physical IPIs without VM exits */
+
 	/* EPT hierarchy for Normal World */
 	void *nworld_eptp;
 	/* EPT hierarchy for Secure World
@@ -120,6 +139,18 @@ struct vm_arch {
 #endif
 	enum vm_vlapic_mode vlapic_mode; /* Represents vLAPIC mode across vCPUs*/
 
+	/*
+	 * Destination lookup of vlapic_calc_dest_noshort(), in place of
+	 * matching the destination against every vCPU. Writers hold
+	 * vlapic_dest_lock and bump vlapic_dest_seq, readers take no lock.
+	 */
+	uint16_t vlapic_apicid_hash[VLAPIC_APICID_HASH_SIZE];	/* vCPU ids hashed by APIC ID */
+	uint64_t vlapic_flat_dest[8];		/* xAPIC flat model: vCPUs by logical ID bit */
+	uint64_t vlapic_cluster_dest[16][4];	/* xAPIC cluster model: vCPUs by cluster and logical ID bit */
+	uint64_t vlapic_other_dest;		/* x2APIC vCPUs whose LDR isn't derived from their APIC ID */
+	seqcount_t vlapic_dest_seq;
+	spinlock_t vlapic_dest_lock;
+
 	/*
 	 * Keylocker spec 4.5:
 	 * Bit 0 - Backup/restore valid.
@@ -145,9 +176,17 @@ struct acrn_vm {
 	enum vm_state state;	/* VM state */
 	struct acrn_vuart vuart[MAX_VUART_NUM_PER_VM];		/* Virtual UART */
 	struct asyncio_desc	aio_desc[ACRN_ASYNCIO_MAX];
-	struct list_head aiodesc_queue;
+	uint16_t aio_hash[ASYNCIO_HASH_SIZE];	/* aio_desc chains hashed by (type, addr) */
+	uint16_t aio_ranges;	/* aio_desc chain of the ACRN_ASYNCIO_RANGE descriptors */
+	seqcount_t asyncio_seq;	/* lets get_asyncio_fd() walk the chains locklessly */
 	spinlock_t asyncio_lock; /* Spin-lock used to protect asyncio add/remove for a VM */
 	spinlock_t vm_event_lock;
+	/* the coalesced MMIO zones, see coalesced_mmio_write(), and the lock serializing their sbuf writes */
+	struct acrn_coalesced_mmio_zone cmmio_zones[ACRN_COALESCED_MMIO_ZONE_MAX];
+	uint32_t cmmio_zone_cnt;
+	spinlock_t cmmio_lock;
+	/* the guest RAM the device model maps on demand, see pvclock_async_pf() */
+	struct acrn_lazy_memory lazy_mem;
 
 	enum vpic_wire_mode wire_mode;
 	struct iommu_domain *iommu;	/* iommu domain of this VM */
@@ -161,8 +200,27 @@ struct acrn_vm {
 	spinlock_t emul_mmio_lock;	/* Used to protect emulation mmio_node concurrent access for a VM */
 	uint16_t nr_emul_mmio_regions;	/* the emulated mmio_region number */
 	struct mem_io_node emul_mmio[CONFIG_MAX_EMULATED_MMIO_REGIONS];
+	/* Bumped around every update of emul_mmio/emul_mmio_index, so vCPUs can look up handlers without the lock */
+	seqcount_t emul_mmio_seq;
+	uint16_t nr_emul_mmio_index;	/* the number of valid entries in emul_mmio_index */
+	uint16_t emul_mmio_index[CONFIG_MAX_EMULATED_MMIO_REGIONS];	/* emul_mmio indexes sorted by range_start */
+	bool emul_mmio_overlap;		/* some registered MMIO ranges overlap, see lookup_mmio_node() */
 
 	struct vm_io_handler_desc emul_pio[EMUL_PIO_IDX_MAX];
+	uint32_t emul_pio_gen;	/* Bumped on every update of emul_pio to invalidate vCPU io_cache */
+	bool emul_pio_overlap;	/* some registered port ranges overlap, the vCPU io_cache is not used then */
+	struct io_hotspots io_hotspots;	/* sampled port I/O and MMIO accesses, see hv_emulate_pio() */
+	struct lock_sites lock_sites;	/* split/uc-lock emulations per guest RIP, see emulate_lock_instr() */
+	struct lat_probe lat_probe;	/* interrupt and timer latencies, see HC_VM_LATENCY_PROBE */
+	struct tsc_counter tsc_counter;	/* counter register read from the TSC, see HC_SET_TSC_COUNTER */
+	struct acrn_vm_freq_policy freq_policy;	/* HWP request of its vCPUs, see load_vcpu_freq_policy() */
+
+	/* start-up timeline in TSC ticks, reported by report_vm_startup() */
+	uint64_t create_tsc;		/* create_vm() entered */
+	uint64_t created_tsc;		/* create_vm() done */
+	uint64_t start_tsc;		/* start_vm() */
+	uint64_t pause_tsc;		/* pause_vm(), the guest TSCs of a snapshot are as of then */
+	bool startup_reported;
 
 	char name[MAX_VM_NAME_LEN];
 	struct secure_world_control sworld_control;
@@ -176,6 +234,9 @@ struct acrn_vm {
 
 	uint32_t vcpuid_entry_nr, vcpuid_level, vcpuid_xlevel;
 	struct vcpuid_entry vcpuid_entries[MAX_VM_VCPUID_ENTRIES];
+	/* first vcpuid_entries[] and number of entries per vcpuid_leaf_slot(), see local_find_vcpuid_entry() */
+	uint8_t vcpuid_leaf_first[VCPUID_LEAF_SLOTS];
+	uint8_t vcpuid_leaf_nr[VCPUID_LEAF_SLOTS];
 	struct acrn_vpci vpci;
 	struct acrn_vrtc vrtc;
 
@@ -239,6 +300,7 @@ void poweroff_if_rt_vm(struct acrn_vm *vm);
 void pause_vm(struct acrn_vm *vm);
 void resume_vm_from_s3(struct acrn_vm *vm, uint32_t wakeup_vec);
 void start_vm(struct acrn_vm *vm);
+void report_vm_startup(struct acrn_vm *vm);
 int32_t reset_vm(struct acrn_vm *vm);
 int32_t create_vm(uint16_t vm_id, uint64_t pcpu_bitmap, struct acrn_vm_config *vm_config, struct acrn_vm **rtn_vm);
 int32_t prepare_vm(uint16_t vm_id, struct acrn_vm_config *vm_config);
@@ -261,6 +323,7 @@ uint64_t find_space_from_ve820(struct acrn_vm *vm, uint32_t size, uint64_t min_a
 int32_t prepare_os_image(struct acrn_vm *vm);
 
 void vrtc_init(struct acrn_vm *vm);
+time_t vrtc_get_wall_time(struct acrn_vm *vm);
 
 bool is_lapic_pt_configured(const struct acrn_vm *vm);
 bool is_pmu_pt_configured(const struct acrn_vm *vm);
@@ -278,6 +341,13 @@ void update_vm_vlapic_state(struct acrn_vm *vm);
 enum vm_vlapic_mode check_vm_vlapic_mode(const struct acrn_vm *vm);
 bool is_vhwp_configured(const struct acrn_vm *vm);
 bool is_vtm_configured(const struct acrn_vm *vm);
+bool is_dirty_log_configured(const struct acrn_vm *vm);
+bool is_pv_ipi_configured(const struct acrn_vm *vm);
+bool is_pv_timer_configured(const struct acrn_vm *vm);
+bool is_pv_clock_configured(const struct acrn_vm *vm);
+bool is_idle_pt_configured(const struct acrn_vm *vm);
+bool is_vpmu_configured(const struct acrn_vm *vm);
+bool is_mwait_pt_configured(const struct acrn_vm *vm);
 /*
  * @pre vm != NULL
  */
@@ -56,6 +56,16 @@ int32_t ept_violation_vmexit_handler(struct acrn_vcpu *vcpu);
  */
 void emulate_pio_complete(struct acrn_vcpu *vcpu, const struct io_request *io_req);
 
+/**
+ * @brief General complete-work for string port I/O emulation
+ *
+ * @param vcpu The virtual CPU that triggers the string port I/O
+ * @param io_req The I/O request holding the details of the accesses
+ *
+ * @pre io_req->io_type == ACRN_IOREQ_TYPE_PORTIO_STRING
+ */
+void emulate_pio_string_complete(struct acrn_vcpu *vcpu, const struct io_request *io_req);
+
 /**
  * @brief Allow a VM to access a port I/O range
  *
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef VPMU_H_
+#define VPMU_H_
+
+#include <types.h>
+
+struct acrn_vcpu;
+struct acrn_vm;
+struct vcpuid_entry;
+
+/* the counters the MSR interception of the vCPUs covers */
+#define VPMU_MAX_GP_COUNTERS		4U
+#define VPMU_MAX_FIXED_COUNTERS		3U
+
+/*
+ * The architectural performance monitoring (version 2) of a vCPU, for VMs
+ * sharing their pCPUs. The counters are in the PMU while the vCPU runs,
+ * unless the hypervisor profiling owns the PMU of the pCPU, and saved here
+ * while it does not.
+ */
+struct acrn_vpmu {
+	bool enabled;
+	bool loaded;			/* the state below is in the PMU of the pCPU */
+	uint8_t nr_gp;
+	uint8_t nr_fixed;
+	uint64_t gp_mask;		/* width of the general purpose counters */
+	uint64_t fixed_mask;		/* width of the fixed counters */
+
+	uint64_t evtsel[VPMU_MAX_GP_COUNTERS];
+	uint64_t pmc[VPMU_MAX_GP_COUNTERS];
+	uint64_t fixed_ctr[VPMU_MAX_FIXED_COUNTERS];
+	uint64_t fixed_ctr_ctl;
+	uint64_t global_ctrl;
+	uint64_t global_status;		/* overflows taken while not loaded */
+};
+
+void init_vpmu_pcpu(uint16_t pcpu_id);
+void init_vpmu(struct acrn_vcpu *vcpu);
+bool vpmu_get_cpuid_0ah(const struct acrn_vm *vm, struct vcpuid_entry *entry);
+bool is_vpmu_msr(uint32_t msr);
+int32_t vpmu_read_msr(struct acrn_vcpu *vcpu, uint32_t msr, uint64_t *val);
+int32_t vpmu_write_msr(struct acrn_vcpu *vcpu, uint32_t msr, uint64_t val);
+int32_t rdpmc_vmexit_handler(struct acrn_vcpu *vcpu);
+void vpmu_switch_in(struct acrn_vcpu *vcpu);
+void vpmu_switch_out(struct acrn_vcpu *vcpu);
+void vpmu_set_host_owned(bool host_owned);
+bool vpmu_handle_pmi(void);
+
+#endif /* VPMU_H_ */
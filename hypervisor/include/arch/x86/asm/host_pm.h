@@ -41,5 +41,13 @@ struct acpi_reset_reg *get_host_reset_reg_data(void);
 void reset_host(void);
 void init_frequency_policy(void);
 void apply_frequency_policy(void);
+struct acrn_vm;
+struct acrn_vcpu;
+void init_vm_freq_policy(struct acrn_vm *vm);
+int32_t set_vm_freq_policy(struct acrn_vm *vm, const struct acrn_vm_freq_policy *policy);
+void load_vcpu_freq_policy(struct acrn_vcpu *vcpu);
+void restore_hv_freq_policy(void);
+void init_idle_governor(void);
+void enter_idle_state(uint16_t pcpu_id);
 
 #endif	/* HOST_PM_H */
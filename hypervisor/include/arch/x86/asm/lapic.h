@@ -88,13 +88,13 @@ void send_lapic_eoi(void);
 /**
  * @brief Send an SIPI to a specific cpu
  *
- * Send an Startup IPI to a specific cpu, to notify the cpu to start booting.
+ * Send the Startup IPIs to a set of cpus, to notify them to start booting.
  *
- * @param[in]	dest_pcpu_id The id of destination physical cpu
- * @param[in]	cpu_startup_start_address The address for the dest pCPU to start running
+ * @param[in]	dest_mask The bitmap of the destination physical cpus
+ * @param[in]	cpu_startup_start_address The address for the dest pCPUs to start running
  *
  */
-void send_startup_ipi(uint16_t dest_pcpu_id, uint64_t cpu_startup_start_address);
+void send_startup_ipi(uint64_t dest_mask, uint64_t cpu_startup_start_address);
 
 /**
  * @brief Send an IPI to multiple pCPUs
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2026 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#ifndef ASSEMBLER
+
+#include <types.h>
+
+/**
+ * The architecture dependent sequence counter type.
+ *
+ * A sequence counter lets readers access a read-mostly structure without
+ * taking any lock. Writers must be serialized by an external lock and bump the
+ * counter around each update; readers snapshot the counter before reading and
+ * retry if it changed (or was odd, i.e. an update was in progress) afterwards.
+ *
+ * x86 neither reorders loads with other loads nor stores with other stores,
+ * so only compiler barriers are needed on both sides.
+ */
+typedef struct _seqcount {
+	volatile uint32_t sequence;
+} seqcount_t;
+
+static inline void seqcount_init(seqcount_t *s)
+{
+	s->sequence = 0U;
+}
+
+static inline uint32_t seqcount_read_begin(const seqcount_t *s)
+{
+	uint32_t seq;
+
+	seq = s->sequence;
+	while ((seq & 1U) != 0U) {
+		asm volatile ("pause" ::: "memory");
+		seq = s->sequence;
+	}
+	asm volatile ("" ::: "memory");
+
+	return seq;
+}
+
+static inline bool seqcount_read_retry(const seqcount_t *s, uint32_t seq)
+{
+	asm volatile ("" ::: "memory");
+	return (s->sequence != seq);
+}
+
+/*
+ * @pre The caller holds the lock serializing writers of \p s
+ */
+static inline void seqcount_write_begin(seqcount_t *s)
+{
+	s->sequence = s->sequence + 1U;
+	asm volatile ("" ::: "memory");
+}
+
+/*
+ * @pre The caller holds the lock serializing writers of \p s
+ */
+static inline void seqcount_write_end(seqcount_t *s)
+{
+	asm volatile ("" ::: "memory");
+	s->sequence = s->sequence + 1U;
+}
+
+#endif /* ASSEMBLER */
+
+#endif /* SEQLOCK_H */
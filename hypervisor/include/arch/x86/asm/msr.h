@@ -624,7 +624,10 @@ struct acrn_vcpu;
 
 void init_msr_emulation(struct acrn_vcpu *vcpu);
 void init_intercepted_cat_msr_list(void);
+void init_emulated_msr_index(void);
 uint32_t vmsr_get_guest_msr_index(uint32_t msr);
+uint32_t vmsr_exit_slot_to_msr(uint32_t slot);
+void set_guest_tsc(struct acrn_vcpu *vcpu, uint64_t guest_tsc);
 void update_msr_bitmap_x2apic_apicv(struct acrn_vcpu *vcpu);
 void update_msr_bitmap_x2apic_passthru(struct acrn_vcpu *vcpu);
 
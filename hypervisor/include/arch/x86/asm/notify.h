@@ -7,14 +7,29 @@
 #ifndef NOTIFY_H
 #define NOTIFY_H
 
+#include <asm/lib/spinlock.h>
+
+#define SMP_CALL_QUEUE_SIZE	16U
+
 typedef void (*smp_call_func_t)(void *data);
-struct smp_call_info_data {
+struct smp_call_entry {
 	smp_call_func_t func;
 	void *data;
+	uint64_t *pending;	/* bitmap of the caller waiting for it, NULL for an async call */
+};
+
+/* per-pCPU ring of the calls queued to it */
+struct smp_call_queue {
+	spinlock_t lock;
+	uint32_t head;
+	uint32_t tail;
+	struct smp_call_entry entries[SMP_CALL_QUEUE_SIZE];
 };
 
 struct acrn_vm;
 void smp_call_function(uint64_t mask, smp_call_func_t func, void *data);
+void smp_call_function_async(uint64_t mask, smp_call_func_t func, void *data);
+void init_smp_call_queue(uint16_t pcpu_id);
 
 void setup_notification(void);
 void handle_smp_call(void);
@@ -32,6 +32,14 @@ struct page {
 	uint8_t contents[PAGE_SIZE];
 } __aligned(PAGE_SIZE);
 
+struct page_pool_stats {
+	uint64_t total_pages;
+	uint64_t used_pages;		/* pages allocated now */
+	uint64_t peak_pages;		/* most pages allocated at once since the pool was initialized */
+	uint64_t failed_allocs;		/* allocations served with the dummy page */
+	uint64_t freed_pages;		/* pages freed since the pool was initialized */
+};
+
 struct page_pool {
 	struct page *start_page;
 	spinlock_t lock;
@@ -39,9 +47,20 @@ struct page_pool {
 	uint64_t *bitmap;
 	uint64_t last_hint_id;
 
+	/*
+	 * freed pages, still set in the bitmap, linked through their first 8
+	 * bytes: the link is page aligned, so it reads as a non-present entry
+	 */
+	struct page *free_list;
+
+	struct page_pool_stats stats;
+
 	struct page *dummy_page;
 };
 
+void init_page_pool(struct page_pool *pool, struct page *start_page, uint64_t *bitmap,
+		uint64_t page_num, struct page *dummy_page);
 struct page *alloc_page(struct page_pool *pool);
 void free_page(struct page_pool *pool, struct page *page);
+void get_page_pool_stats(struct page_pool *pool, struct page_pool_stats *stats);
 #endif /* PAGE_H */
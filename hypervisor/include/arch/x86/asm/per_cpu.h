@@ -14,6 +14,7 @@
 #include <profiling.h>
 #include <logmsg.h>
 #include <schedule.h>
+#include <softirq.h>
 #include <asm/notify.h>
 #include <asm/page.h>
 #include <asm/gdt.h>
@@ -24,14 +25,19 @@ struct per_cpu_region {
 	/* vmxon_region MUST be 4KB-aligned */
 	uint8_t vmxon_region[PAGE_SIZE];
 	void *vmcs_run;
-#ifdef HV_DEBUG
+	/* the release tracer shares the trace sbuf too */
 	struct shared_buf *sbuf[ACRN_SBUF_PER_PCPU_ID_MAX];
+#ifdef HV_DEBUG
 	char logbuf[LOG_MESSAGE_MAX_SIZE];
 	uint32_t npk_log_ref;
 #endif
 	uint64_t irq_count[NR_IRQS];
 	uint64_t softirq_pending;
+	uint64_t softirq_deadline;	/* when the running softirq goes over its budget */
+	uint64_t softirq_preempt_mask;	/* the softirqs of a higher priority than the running one */
+	struct softirq_stats softirq_stats[NR_SOFTIRQS];
 	uint64_t spurious;
+	uint64_t irq_tsc;	/* when dispatch_interrupt() was entered last */
 	struct acrn_vcpu *ever_run_vcpu;
 #ifdef STACK_PROTECTOR
 	struct stack_canary stk_canary;
@@ -42,6 +48,7 @@ struct per_cpu_region {
 	struct sched_iorr_control sched_iorr_ctl;
 	struct sched_bvt_control sched_bvt_ctl;
 	struct sched_prio_control sched_prio_ctl;
+	struct sched_edf_control sched_edf_ctl;
 	struct thread_object idle;
 	struct host_gdt gdt;
 	struct tss_64 tss;
@@ -56,7 +63,11 @@ struct per_cpu_region {
 	uint32_t softirq_servicing;
 	uint32_t mode_to_kick_pcpu;
 	uint32_t mode_to_idle;
-	struct smp_call_info_data smp_call_info;
+	struct smp_call_queue smp_call_queue;
+	/* the VM whose EPT flushes are deferred to ept_end_batch() on this pCPU */
+	struct acrn_vm *ept_batch_vm;
+	uint32_t ept_batch_depth;
+	bool ept_batch_flush;
 	struct list_head softirq_dev_entry_list;
 #ifdef PROFILING_ON
 	struct profiling_info_wrapper profiling_info;
@@ -64,6 +75,13 @@ struct per_cpu_region {
 	uint64_t shutdown_vm_bitmap;
 	uint64_t tsc_suspend;
 	struct acrn_vcpu *whose_iwkey;
+	uint64_t pqr_assoc;	/* the value in MSR_IA32_PQR_ASSOC, see write_pqr_assoc() */
+	uint64_t hv_pqr_assoc;	/* the CLOS and RMID of the hypervisor */
+	uint64_t hwp_request;	/* the value in MSR_IA32_HWP_REQUEST, see write_hwp_request() */
+	uint64_t hv_hwp_request;	/* the HWP request of the hypervisor, set by apply_frequency_policy() */
+	uint64_t idle_history;	/* average idle period, in TSC ticks, see enter_idle_state() */
+	uint64_t exit_ticks;	/* time spent handling VM exits, see vmexit_account() */
+	uint64_t nr_exits;
 	/*
 	 * We maintain a per-pCPU array of vCPUs. vCPUs of a VM won't
 	 * share same pCPU. So the maximum possible # of vCPUs that can
@@ -115,6 +115,8 @@
 /* End of ept_mem_type */
 
 #define EPT_MT_MASK		(7UL << EPT_MT_SHIFT)
+#define EPT_ACCESSED		(1UL << 8U)
+#define EPT_DIRTY		(1UL << 9U)
 #define EPT_VE			(1UL << 63U)
 /* EPT leaf entry bits (bit 52 - bit 63) should be maksed  when calculate PFN */
 #define EPT_PFN_HIGH_MASK	0xFFF0000000000000UL
@@ -176,6 +178,8 @@ struct pgtable {
 	void (*clflush_pagewalk)(const void *p);
 	void (*tweak_exe_right)(uint64_t *entry);
 	void (*recover_exe_right)(uint64_t *entry);
+	/* collapse uniform PT pages back into 2MB pages after add and modify */
+	bool merge_large_page;
 };
 
 static inline bool pgentry_present(const struct pgtable *table, uint64_t pte)
@@ -22,6 +22,13 @@ enum {
 
 extern const uint16_t hv_clos;
 
+/* Event IDs of IA32_QM_EVTSEL */
+#define RDT_MON_EVT_LLC_OCCUPANCY	1U
+#define RDT_MON_EVT_MBM_TOTAL		2U
+#define RDT_MON_EVT_MBM_LOCAL		3U
+
+struct acrn_vm_rdt_mon;
+
 /* The instance of one RES_ID */
 struct rdt_ins {
 	union {
@@ -55,6 +62,14 @@ struct rdt_type {
 
 void setup_clos(uint16_t pcpu_id);
 uint64_t clos2pqr_msr(uint16_t clos);
+uint64_t clos_rmid2pqr_msr(uint16_t clos, uint32_t rmid);
+void write_pqr_assoc(uint64_t pqr_assoc);
+void restore_hv_pqr_assoc(void);
+void init_rdt_mon(void);
+uint32_t get_vm_rmid(uint16_t vm_id);
+void reset_vm_rdt_mon(uint16_t vm_id);
+void get_vm_rdt_mon(uint16_t vm_id, struct acrn_vm_rdt_mon *mon);
+int32_t set_clos_config(uint32_t res_id, uint32_t idx, uint16_t pcpu_id, uint32_t value);
 bool is_platform_rdt_capable(void);
 const struct rdt_ins *get_rdt_res_ins(int res, uint16_t pcpu_id);
 
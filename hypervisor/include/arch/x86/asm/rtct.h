@@ -80,4 +80,8 @@ struct rtct_entry_data_ssram_v2 {
 
 uint64_t get_software_sram_base(void);
 uint64_t get_software_sram_size(void);
+bool is_software_sram_range(uint64_t hpa, uint64_t size);
+bool get_ssram_share(uint16_t vm_id, uint64_t size);
+void put_ssram_share(uint16_t vm_id, uint64_t size);
+void reset_ssram_share(uint16_t vm_id);
 #endif /* RTCT_H */
@@ -8,7 +8,7 @@
 
 extern uint64_t read_trampoline_sym(const void *sym);
 extern void write_trampoline_sym(const void *sym, uint64_t val);
-extern void write_trampoline_stack_sym(uint16_t pcpu_id);
+extern void prepare_ap_stacks(uint64_t mask);
 extern uint64_t prepare_trampoline(void);
 extern uint64_t get_trampoline_start16_paddr(void);
 
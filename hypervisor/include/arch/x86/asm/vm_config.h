@@ -61,10 +61,11 @@
 #define DM_OWNED_GUEST_FLAG_MASK	0UL
 #elif defined(CONFIG_RELEASE)
 #define DM_OWNED_GUEST_FLAG_MASK	(GUEST_FLAG_SECURE_WORLD_ENABLED | GUEST_FLAG_LAPIC_PASSTHROUGH \
-					| GUEST_FLAG_RT | GUEST_FLAG_IO_COMPLETION_POLLING)
+					| GUEST_FLAG_RT | GUEST_FLAG_IO_COMPLETION_POLLING | GUEST_FLAG_DIRTY_LOG)
 #else
 #define DM_OWNED_GUEST_FLAG_MASK	(GUEST_FLAG_SECURE_WORLD_ENABLED | GUEST_FLAG_LAPIC_PASSTHROUGH \
-					| GUEST_FLAG_RT | GUEST_FLAG_IO_COMPLETION_POLLING | GUEST_FLAG_PMU_PASSTHROUGH)
+					| GUEST_FLAG_RT | GUEST_FLAG_IO_COMPLETION_POLLING | GUEST_FLAG_PMU_PASSTHROUGH \
+					| GUEST_FLAG_DIRTY_LOG)
 #endif
 
 /* ACRN guest severity */
@@ -152,6 +153,13 @@ struct acrn_vm_pci_dev_config {
 	const struct pci_vdev_ops *vdev_ops;		/* operations for PCI CFG read/write */
 } __aligned(8);
 
+/* a PT device of a pre-launched VM: vm_configs[vm_id].pci_devs[dev_idx] */
+struct acrn_prelaunched_ptdev {
+	union pci_bdf pbdf;
+	uint16_t vm_id;
+	uint16_t dev_idx;
+};
+
 struct pt_intx_config {
 	uint32_t phys_gsi;	/* physical IOAPIC gsi to be forwarded to the VM */
 	uint32_t virt_gsi;	/* virtual IOAPIC gsi triggered on the vIOAPIC */
@@ -172,8 +180,16 @@ struct acrn_vm_config {
 							 * We could add more guest flags in future;
 							 */
 	struct sched_params sched_params;		/* Scheduler params for vCPUs of this VM */
+	uint32_t ple_gap;				/* PAUSE-loop exiting gap in TSC cycles, 0 for the default */
+	uint32_t ple_window;				/* PAUSE-loop exiting window in TSC cycles, 0 for the default */
 	uint16_t companion_vm_id;			/* The companion VM id for this VM */
+	uint32_t ssram_kb;				/* KB of Software SRAM guaranteed to the VM, see
+							 * get_ssram_share()
+							 */
 	struct acrn_vm_mem_config memory;		/* memory configuration of VM */
+	uint32_t ept_page_num;				/* PD and PT pages of its EPT sized by the config tools,
+							 * 0 to size them from the host RAM
+							 */
 	struct epc_section epc;				/* EPC memory configuration of VM */
 	uint16_t pci_dev_num;				/* indicate how many PCI devices in VM */
 	struct acrn_vm_pci_dev_config *pci_devs;	/* point to PCI devices BDF list */
@@ -221,5 +237,8 @@ bool vm_has_matched_name(uint16_t vmid, const char *name);
 
 extern struct acrn_vm_config vm_configs[CONFIG_MAX_VM_NUM];
 extern struct acrn_vm_config *const service_vm_config;
+/* generated sorted by pbdf, see allocate_to_prelaunched_vm() */
+extern const struct acrn_prelaunched_ptdev prelaunched_ptdevs[];
+extern const uint16_t prelaunched_ptdev_num;
 
 #endif /* VM_CONFIG_H_ */
@@ -10,6 +10,7 @@
 /* 16-bit control fields */
 #define VMX_VPID						0x00000000U
 #define VMX_POSTED_INTR_VECTOR	0x00000002U
+#define VMX_LAST_PID_POINTER_INDEX	0x00000008U
 /* 16-bit guest-state fields */
 #define VMX_GUEST_ES_SEL    0x00000800U
 #define VMX_GUEST_CS_SEL    0x00000802U
@@ -77,6 +78,8 @@
 
 #define VMX_PROC_VM_EXEC_CONTROLS3_FULL		0x00002034U
 #define VMX_PROC_VM_EXEC_CONTROLS3_HIGH		0x00002035U
+#define VMX_PID_POINTER_TABLE_ADDR_FULL		0x00002042U
+#define VMX_PID_POINTER_TABLE_ADDR_HIGH		0x00002043U
 
 /* 64-bit read-only data fields */
 #define VMX_GUEST_PHYSICAL_ADDR_FULL 0x00002400U
@@ -339,6 +342,10 @@
 #define VMX_PROCBASED_CTLS2_UWAIT_PAUSE (1U<<26U)
 #define VMX_PROCBASED_CTLS2_ENCLV_EXIT (1U<<28U)
 #define VMX_PROCBASED_CTLS3_LOADIWKEY  (1U<<0U)
+#define VMX_PROCBASED_CTLS3_IPIV       (1U<<4U)
+
+/* valid bit of a PID-pointer table entry */
+#define PID_POINTER_VALID		(1UL << 0U)
 
 /* MSR_IA32_VMX_EPT_VPID_CAP: EPT and VPID capability bits */
 #define VMX_EPT_EXECUTE_ONLY		(1UL << 0U)
@@ -465,4 +472,5 @@ void init_cr0_cr4_flexible_bits(void);
 bool is_valid_cr0_cr4(uint64_t cr0, uint64_t cr4);
 
 #define POSTED_INTR_ON  0U
+#define POSTED_INTR_SN  1U
 #endif /* VMX_H_ */
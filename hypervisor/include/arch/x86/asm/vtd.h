@@ -12,6 +12,8 @@
 
 #define INVALID_DRHD_INDEX 0xFFFFFFFFU
 #define INVALID_IRTE_ID 0xFFFFU
+/* max number of invalidation descriptors submitted with a single wait */
+#define DMAR_QI_BATCH_SIZE 16U
 
 /*
  * Intel IOMMU register specification per version 1.0 public spec.
@@ -288,6 +290,16 @@ static inline uint8_t iommu_ecap_pds(uint64_t ecap)
 	return ((uint8_t)(ecap >> 42U) & 1U);
 }
 
+static inline uint8_t iommu_ecap_smts(uint64_t ecap)
+{
+	return ((uint8_t)(ecap >> 43U) & 1U);
+}
+
+static inline uint8_t iommu_ecap_slts(uint64_t ecap)
+{
+	return ((uint8_t)(ecap >> 46U) & 1U);
+}
+
 /* PMEN_REG */
 #define DMA_PMEN_EPM (1U << 31U)
 #define DMA_PMEN_PRS (1U << 0U)
@@ -377,6 +389,25 @@ static inline uint64_t dma_iec_index(uint16_t index, uint8_t index_mask)
 
 #define DMA_IOTLB_INVL_ADDR_IH_UNMODIFIED	(((uint64_t)1UL) << 6U)
 
+/* Device-TLB invalidate descriptor */
+#define DMA_DEV_IOTLB_SIZE			(((uint64_t)1UL) << 0U)
+/* with DMA_DEV_IOTLB_SIZE, all the address bits below bit 63 set cover the whole address space */
+#define DMA_DEV_IOTLB_ADDR_ALL			0x7ffffffffffff000UL
+static inline uint64_t dma_dev_iotlb_sid(uint16_t sid)
+{
+	return (((uint64_t)sid & 0xffffUL) << 32UL);
+}
+
+static inline uint64_t dma_dev_iotlb_qdep(uint16_t qdep)
+{
+	return (((uint64_t)qdep & 0x1fUL) << 16UL);
+}
+
+static inline uint64_t dma_dev_iotlb_pfsid(uint16_t pfsid)
+{
+	return ((((uint64_t)pfsid & 0xfUL) << 12UL) | ((((uint64_t)pfsid >> 4UL) & 0xfffUL) << 52UL));
+}
+
 /* FECTL_REG */
 #define DMA_FECTL_IM				(((uint32_t)1U) << 31U)
 
@@ -710,6 +741,20 @@ int32_t dmar_assign_irte(const struct intr_source *intr_src, union dmar_ir_entry
  */
 void dmar_free_irte(const struct intr_source *intr_src, uint16_t index);
 
+/**
+ * @brief Free IRTEs of one interrupt source with a single invalidation wait.
+ *
+ * Same as calling dmar_free_irte() for each index, but the interrupt entry
+ * cache invalidations are submitted together and waited for once.
+ *
+ * @param[in] intr_src filled with type of interrupt source and the source
+ * @param[in] index array of indexes into Interrupt Remapping Table
+ * @param[in] count number of indexes in the array
+ *
+ * @pre count <= DMAR_QI_BATCH_SIZE
+ */
+void dmar_free_irtes(const struct intr_source *intr_src, const uint16_t *index, uint16_t count);
+
 /**
  * @brief Flash cacheline(s) for a specific address with specific size.
  *
@@ -0,0 +1,17 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef CPU_UTIL_H
+#define CPU_UTIL_H
+#include <types.h>
+#include <acrn_common.h>
+
+struct acrn_vcpu;
+
+void get_pcpu_util(uint16_t pcpu_id, struct acrn_pcpu_util *util);
+void get_vcpu_util(struct acrn_vcpu *vcpu, struct acrn_vcpu_util *util);
+
+#endif /* CPU_UTIL_H */
@@ -186,6 +186,63 @@ int32_t hcall_set_irqline(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uin
  */
 int32_t hcall_inject_msi(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
 
+/**
+ * @brief send an IPI to several vCPUs
+ *
+ * Send the same fixed or NMI IPI to a set of vCPUs of the calling VM with one
+ * VM exit, in place of an ICR write per destination. The guest finds out that
+ * it is available with GUEST_CAPS_PV_IPI in CPUID.0x40000001:EAX.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm not used
+ * @param param1 bits 31:0 as the ICR low dword, only the vector and the fixed
+ *               or NMI delivery mode are used; bits 63:32 the APIC ID that bit 0
+ *               of param2 stands for
+ * @param param2 bitmap of the destination APIC IDs
+ *
+ * @pre is_pv_ipi_configured(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_send_ipi(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
+
+/**
+ * @brief wake up a vCPU halted on a PV spinlock
+ *
+ * KVM_HC_KICK_CPU of the KVM hypercall ABI, for the VMs with the KVM
+ * paravirtual interface (KVM_FEATURE_PV_UNHALT). A waiter on a contended
+ * PV qspinlock halts instead of spinning, its vCPU thread sleeps; the lock
+ * holder kicks it at the unlock, which wakes the thread up. A kick which
+ * comes before the halt makes the halt return at once.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm not used
+ * @param param1 not used, the flags of KVM_HC_KICK_CPU
+ * @param param2 APIC ID of the vCPU to wake up, in the VM of vcpu
+ *
+ * @pre is_pv_clock_configured(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_pv_kick(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
+
+/**
+ * @brief register the PV timer page of a vCPU
+ *
+ * Share a struct acrn_pv_timer_page with the hypervisor through which the
+ * calling vCPU can move its TSC deadline later, or disarm it, without a WRMSR
+ * exit. The guest finds out that it is available with GUEST_CAPS_PV_TIMER in
+ * CPUID.0x40000001:EAX.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm not used
+ * @param param1 not used
+ * @param param2 guest physical address of the struct acrn_pv_timer_page, it
+ *               must be 16 bytes aligned, 0 to unregister the page
+ *
+ * @pre is_pv_timer_configured(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_pv_timer_page(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
+
 /**
  * @brief set ioreq shared buffer
  *
@@ -217,6 +274,23 @@ int32_t hcall_set_ioreq_buffer(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm
  */
 int32_t hcall_notify_ioreq_finish(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
 
+/**
+ * @brief notify a batch of requests done
+ *
+ * Notify the requestor VCPUs for the completion of their ioreqs in one go.
+ * The function will return -1 if the target VM does not exist or any VCPU in
+ * the bitmap is not created.
+ *
+ * @param vcpu not used
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 not used
+ * @param param2 bitmap of vcpu IDs of the requestors
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_notify_ioreq_finish_batch(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		uint64_t param1, uint64_t param2);
+
 /**
  * @brief setup ept memory mapping for multi regions
  *
@@ -262,6 +336,44 @@ int32_t hcall_write_protect_page(struct acrn_vcpu *vcpu, struct acrn_vm *target_
  */
 int32_t hcall_gpa_to_hpa(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
 
+/**
+ * @brief get and clear the dirty log of a guest memory range
+ *
+ * Report the pages of the range the target VM wrote to, or accessed, since
+ * the last call in a bitmap and clear that. The VM must have its dirty log
+ * configured and the processor support the EPT accessed and dirty flags.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 not used
+ * @param param2 guest physical address. This gpa points to
+ *              struct acrn_dirty_log
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_get_dirty_log(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
+
+/**
+ * @brief set the guest RAM ranges the device model maps on demand
+ *
+ * The device model leaves the pages of these ranges out of the EPT, and
+ * maps them again on the I/O request of the next access. A vCPU of the
+ * target VM with the KVM asynchronous page faults enabled runs another task
+ * of its guest meanwhile, see pvclock_async_pf(). The new ranges replace the
+ * previous ones, all of size 0 turn it off.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 not used
+ * @param param2 guest physical address. This gpa points to
+ *              struct acrn_lazy_memory
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_lazy_memory(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
+
 /**
  * @brief Assign one PCI dev to VM.
  *
@@ -346,6 +458,37 @@ int32_t hcall_add_vdev(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64
  */
 int32_t hcall_remove_vdev(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
 
+/**
+ * @brief Shadow the configuration space of a PCI device emulated by ACRN-DM.
+ *
+ * The hypervisor serves the configuration accesses of the User VM to the
+ * device and only delivers to ACRN-DM those it has no answer to.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 not used
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vdev_cfg_shadow
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_add_vdev_cfg_shadow(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
+
+/**
+ * @brief Stop shadowing the configuration space of a PCI device emulated by ACRN-DM.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 not used
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vdev_cfg_shadow, only its bdf is used
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_remove_vdev_cfg_shadow(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
+
 /**
  * @brief Set interrupt mapping info of ptdev.
  *
@@ -388,6 +531,25 @@ int32_t hcall_reset_ptdev_intr_info(struct acrn_vcpu *vcpu, struct acrn_vm *targ
  */
 int32_t hcall_get_cpu_pm_state(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
 
+/**
+ * @brief Set the frequency policy of a VM.
+ *
+ * The pCPUs run with the HWP request of the policy while a vCPU of the VM
+ * runs on them.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 relative vmid to service vm
+ * @param param2 guest physical address. This gpa points to
+ *              struct acrn_vm_freq_policy
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, -ENODEV without HWP, -EPERM for a vHWP VM,
+ *         other non-zero on error.
+ */
+int32_t hcall_set_vm_freq_policy(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		uint64_t param1, uint64_t param2);
+
 /**
  * @brief Get VCPU a VM's interrupt count data.
  *
@@ -402,6 +564,160 @@ int32_t hcall_get_cpu_pm_state(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm
  */
 int32_t hcall_vm_intr_monitor(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
 
+/**
+ * @brief Get the scheduling statistics of a vCPU.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 relative vmid to Service VM
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vcpu_sched_stats
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_get_vcpu_sched_stats(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		uint64_t param1, uint64_t param2);
+
+/**
+ * @brief Get the VM exit statistics of a vCPU.
+ *
+ * Per basic exit reason: the number of exits, the time spent handling them
+ * and a log2 histogram of that time. They are collected in release builds
+ * too, unlike the trace events.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 relative vmid to Service VM
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vcpu_exit_stats
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_get_vcpu_exit_stats(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		uint64_t param1, uint64_t param2);
+
+/**
+ * @brief Get the utilization counters of all the pCPUs and vCPUs.
+ *
+ * Per pCPU the idle time and the time spent handling VM exits, per vCPU of
+ * the running VMs the run, wait and VM exit handling times. The counters are
+ * kept by the scheduler and the VM exit handler anyway, nothing is sampled
+ * until the Service VM asks.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 guest physical address. This gpa points to data structure of
+ *              acrn_cpu_util
+ * @param param2 not used
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_get_cpu_util(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		uint64_t param1, uint64_t param2);
+
+/**
+ * @brief Get the I/O hotspots of a VM.
+ *
+ * The (type, address, guest RIP) of the port I/O and MMIO accesses the VM
+ * traps on most, from one in 2^sample_shift of them, whether the hypervisor
+ * or the device model emulates them.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 relative vmid to Service VM
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vm_io_hotspots
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_get_vm_io_hotspots(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		uint64_t param1, uint64_t param2);
+
+/**
+ * @brief Get the state of a vCPU of a paused VM.
+ *
+ * The registers, the MSRs the hypervisor emulates, the XSAVE area and the
+ * vLAPIC of the vCPU, for a snapshot of the VM.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 relative vmid to Service VM
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vcpu_state, with its vcpu_id filled in
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_get_vcpu_state(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		uint64_t param1, uint64_t param2);
+
+/**
+ * @brief Load the state of a vCPU of a VM not started yet.
+ *
+ * The state is one hcall_get_vcpu_state() took from a VM of the same
+ * configuration: starting the VM resumes the vCPU where it was.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 relative vmid to Service VM
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vcpu_state
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_vcpu_state(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		uint64_t param1, uint64_t param2);
+
+/**
+ * @brief Get the vIOAPIC state of a paused VM.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 relative vmid to Service VM
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vioapic_state
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_get_vioapic_state(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		uint64_t param1, uint64_t param2);
+
+/**
+ * @brief Load the vIOAPIC state of a VM not started yet.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 relative vmid to Service VM
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vioapic_state
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_vioapic_state(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		uint64_t param1, uint64_t param2);
+
+/**
+ * @brief Start, stop or read the latency probe of a VM.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 relative vmid to Service VM
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vm_latency
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_vm_latency_probe(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		uint64_t param1, uint64_t param2);
+
 /**
  * @defgroup trusty_hypercall Trusty Hypercalls
  *
@@ -510,6 +826,42 @@ int32_t hcall_switch_ee(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
  */
 int32_t hcall_set_callback_vector(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
 
+/**
+ * @brief set the hypercall argument page of a vCPU
+ *
+ * The Service VM registers once a page per vCPU, which it keeps allocated,
+ * and puts the arguments of its hypercalls in it. The hypervisor reads them
+ * from that page without a GPA translation per hypercall; arguments out of
+ * it are still copied from their GPA.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall, the page is its own
+ * @param target_vm not used
+ * @param param1 page aligned guest physical address of the page, 0 to
+ *               unregister it
+ * @param param2 not used
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_hcall_args_page(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
+
+/**
+ * @brief copy a hypercall argument from the Service VM
+ *
+ * From the argument page of the vCPU when [gpa, gpa + size) lies in it,
+ * through copy_from_gpa() otherwise.
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int32_t copy_hcall_arg(struct acrn_vcpu *vcpu, void *h_ptr, uint64_t gpa, uint32_t size);
+
+/**
+ * @brief copy a hypercall result to the Service VM, the way copy_hcall_arg() reads
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int32_t copy_hcall_result(struct acrn_vcpu *vcpu, void *h_ptr, uint64_t gpa, uint32_t size);
+
 /**
  * @brief Setup a share buffer for a VM.
  *
@@ -524,6 +876,53 @@ int32_t hcall_set_callback_vector(struct acrn_vcpu *vcpu, struct acrn_vm *target
  */
 int32_t hcall_setup_sbuf(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
 
+/**
+ * @brief Set the runtime enable mask of the trace events.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm not used
+ * @param param1 guest physical address. This gpa points to
+ *              struct acrn_trace_mask
+ * @param param2 not used
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_trace_mask(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
+
+/**
+ * @brief Update a CLOS configuration of a cache or MBA instance at runtime.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm not used
+ * @param param1 guest physical address. This gpa points to
+ *              struct acrn_clos_config
+ * @param param2 not used
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, -EPERM for a CLOS or ways reserved by an RT VM,
+ *         other non-zero on error.
+ */
+int32_t hcall_set_clos_config(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
+
+/**
+ * @brief Get the cache and memory bandwidth monitoring counters of a VM.
+ *
+ * The LLC occupancy and the memory bandwidth of the VM, from the RDT
+ * monitoring counters of its RMID, sampled periodically on each L3.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 relative vmid to Service VM
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vm_rdt_mon
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_get_vm_rdt_mon(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		uint64_t param1, uint64_t param2);
+
 /**
  * @brief Assign an asyncio to a VM.
  *
@@ -551,6 +950,57 @@ int32_t hcall_asyncio_assign(__unused struct acrn_vcpu *vcpu, struct acrn_vm *ta
 int32_t hcall_asyncio_deassign(__unused struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
 		 __unused uint64_t param1, uint64_t param2);
 
+/**
+ * @brief Add a coalesced MMIO zone to a VM.
+ *
+ * The writes to the zone are posted to the ACRN_COALESCED_MMIO sbuf of the
+ * VM, the vCPUs do not wait for ACRN-DM to emulate them.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 not used
+ * @param param2 guest physical address. This gpa points to
+ *              struct acrn_coalesced_mmio_zone
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_add_coalesced_mmio(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		uint64_t param1, uint64_t param2);
+
+/**
+ * @brief Remove a coalesced MMIO zone from a VM.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 not used
+ * @param param2 guest physical address. This gpa points to
+ *              struct acrn_coalesced_mmio_zone
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_remove_coalesced_mmio(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		uint64_t param1, uint64_t param2);
+
+/**
+ * @brief Set the counter register of a VM read from the TSC.
+ *
+ * The reads of the register are emulated by the hypervisor instead of
+ * ACRN-DM, e.g. those of the HPET main counter.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 not used
+ * @param param2 guest physical address. This gpa points to
+ *              struct acrn_tsc_counter
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_tsc_counter(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		uint64_t param1, uint64_t param2);
+
 /**
  * @brief Setup the hypervisor NPK log.
  *
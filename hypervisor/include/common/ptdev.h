@@ -27,6 +27,9 @@ enum intx_ctlr {
 
 #define INVALID_PTDEV_ENTRY_ID 0xffffU
 
+/* max number of entries ptirq_softirq() dequeues with the interrupts off at once */
+#define PTIRQ_SOFTIRQ_BATCH	16U
+
 #define DEFINE_MSI_SID(name, a, b)	\
 union source_id (name) = {.msi_id = {.bdf = (a), .entry_nr = (b)} }
 
@@ -140,8 +143,11 @@ struct ptirq_remapping_info {
 	struct msi_info vmsi;
 	struct msi_info pmsi;
 	uint16_t irte_idx;
+	/* vCPUs the IRTE of a remapped mode MSI targets the pCPUs of, 0 in posted mode */
+	uint64_t vdmask;
 
 	uint64_t intr_count;
+	uint64_t intr_tsc;	/* the first interrupt not injected yet, for the latency probe */
 	struct hv_timer intr_delay_timer; /* used for delay intr injection */
 	ptirq_arch_release_fn_t release_cb;
 };
@@ -222,17 +228,20 @@ void ptdev_init(void);
 void ptdev_release_all_entries(const struct acrn_vm *vm);
 
 /**
- * @brief Dequeue an entry from per cpu ptdev softirq queue.
+ * @brief Dequeue a batch of entries from per cpu ptdev softirq queue.
  *
- * Dequeue an entry from the ptdev softirq queue on the specific physical cpu.
+ * Dequeue up to max entries from the ptdev softirq queue on the specific
+ * physical cpu, with the interrupts disabled only once for the whole batch.
  *
  * @param[in]    pcpu_id physical cpu id
+ * @param[out]   entries array the dequeued ptirq_remapping_info entries are stored in
+ * @param[in]    max size of the entries array
  *
- * @retval NULL when the queue is empty
- * @retval !NULL when there is available ptirq_remapping_info entry in the queue
+ * @return the number of entries dequeued, 0 when the queue is empty
  *
+ * @pre pcpu_id == get_pcpu_id()
  */
-struct ptirq_remapping_info *ptirq_dequeue_softirq(uint16_t pcpu_id);
+uint32_t ptirq_dequeue_softirq(uint16_t pcpu_id, struct ptirq_remapping_info **entries, uint32_t max);
 /**
  * @brief Allocate a ptirq_remapping_info entry.
  *
@@ -20,6 +20,9 @@
 
 #define THREAD_DATA_SIZE	(256U)
 
+/* wakeup latency bucket i counts the wakeups run within [2^(i-1), 2^i) us, bucket 0 within 1us */
+#define SCHED_LAT_BUCKETS	(16U)
+
 enum thread_object_state {
 	THREAD_STS_RUNNING = 1,
 	THREAD_STS_RUNNABLE,
@@ -48,11 +51,24 @@ struct sched_params {
 	int32_t bvt_warp_value; /* the warp reduce effective VT to boost priority */
 	uint32_t bvt_warp_limit;	/* max time in one warp */
 	uint32_t bvt_unwarp_period;	/* min unwarp time after a warp */
+
+	/* per thread parameters for edf scheduler, no reservation if either is 0 */
+	uint32_t edf_budget_us;		/* run time reserved in each period */
+	uint32_t edf_period_us;		/* the period, also the relative deadline */
+};
+
+/* all times in TSC ticks */
+struct sched_stats {
+	uint64_t run_ticks;		/* time spent running */
+	uint64_t wait_ticks;		/* time spent runnable, waiting for the pCPU */
+	uint64_t nr_switches;		/* times the thread was switched in */
+	uint64_t wakeup_lat[SCHED_LAT_BUCKETS];	/* from wake_thread() to being switched in */
 };
 
 struct thread_object;
 typedef void (*thread_entry_t)(struct thread_object *obj);
 typedef void (*switch_t)(struct thread_object *obj);
+typedef bool (*migrate_t)(struct thread_object *obj, uint16_t pcpu_id);
 struct thread_object {
 	char name[16];
 	uint16_t pcpu_id;
@@ -65,6 +81,19 @@ struct thread_object {
 	switch_t switch_out;
 	switch_t switch_in;
 
+	/* called on the old pCPU before the thread moves to pcpu_id, may refuse it */
+	migrate_t migrate;
+	uint64_t pcpu_bitmap;		/* pCPUs the thread may migrate to, 0 if pinned */
+	uint64_t switch_out_tsc;	/* when the thread was last switched out */
+
+	/* remote wakeups are pushed to the wake_list of the pCPU, see wake_thread() */
+	struct thread_object *wake_next;
+	uint32_t wake_state;
+
+	struct sched_stats stats;
+	uint64_t stats_tsc;		/* when the thread last started running or waiting */
+	bool woken;			/* waiting since a wakeup rather than a preemption */
+
 	uint8_t data[THREAD_DATA_SIZE];
 };
 
@@ -74,6 +103,8 @@ struct sched_control {
 	struct thread_object *curr_obj;
 	spinlock_t scheduler_lock;	/* to protect sched_control and thread_object */
 	struct acrn_scheduler *scheduler;
+	uint64_t migrate_req;		/* idle pCPUs waiting for a thread of this pCPU */
+	struct thread_object *wake_list;	/* lock-free stack of remote wakeups */
 	void *priv;
 };
 
@@ -95,6 +126,10 @@ struct acrn_scheduler {
 	void	(*yield)(struct sched_control *ctl);
 	/* prioritize the thread object */
 	void	(*prioritize)(struct thread_object *obj);
+	/* move a queued thread object ahead of the current one */
+	void	(*boost)(struct thread_object *obj);
+	/* pick a queued thread object that can migrate to pcpu_id */
+	struct thread_object* (*pick_migration)(struct sched_control *ctl, uint16_t pcpu_id);
 	/* deinit private data of scheduler */
 	void	(*deinit_data)(struct thread_object *obj);
 	/* deinit scheduler */
@@ -125,9 +160,17 @@ struct sched_prio_control {
 	struct list_head prio_queue;
 };
 
+extern struct acrn_scheduler sched_edf;
+struct sched_edf_control {
+	struct list_head runqueue;
+	struct hv_timer tick_timer;
+};
+
 bool is_idle_thread(const struct thread_object *obj);
 uint16_t sched_get_pcpuid(const struct thread_object *obj);
+bool sched_can_migrate(const struct thread_object *obj, uint16_t pcpu_id);
 struct thread_object *sched_get_current(uint16_t pcpu_id);
+void sched_get_stats(const struct thread_object *obj, struct sched_stats *stats);
 
 void init_sched(uint16_t pcpu_id);
 void deinit_sched(uint16_t pcpu_id);
@@ -145,6 +188,7 @@ void sleep_thread(struct thread_object *obj);
 void sleep_thread_sync(struct thread_object *obj);
 void wake_thread(struct thread_object *obj);
 void yield_current(void);
+bool boost_thread(struct thread_object *obj);
 void schedule(void);
 
 void arch_switch_to(void *prev_sp, void *next_sp);
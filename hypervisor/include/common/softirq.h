@@ -7,14 +7,28 @@
 #ifndef SOFTIRQ_H
 #define SOFTIRQ_H
 
+#include <types.h>
+
+/* in priority order, the lowest number is run first */
 #define SOFTIRQ_TIMER		0U
 #define SOFTIRQ_PTDEV		1U
-#define NR_SOFTIRQS		2U
+#define SOFTIRQ_SBUF		2U
+#define NR_SOFTIRQS		3U
+
+/* all times in TSC ticks */
+struct softirq_stats {
+	uint64_t count;		/* times the handler was run */
+	uint64_t ticks;		/* time spent in the handler */
+	uint64_t max_ticks;	/* longest run of the handler */
+	uint64_t deferred;	/* times it was left pending once over its budget */
+};
 
 typedef void (*softirq_handler)(uint16_t cpu_id);
 
 void init_softirq(void);
 void register_softirq(uint16_t nr, softirq_handler handler);
 void fire_softirq(uint16_t nr);
+bool softirq_should_yield(uint16_t cpu_id);
+bool has_pending_softirq(uint16_t cpu_id);
 void do_softirq(void);
 #endif /* SOFTIRQ_H */
@@ -30,15 +30,22 @@ enum tick_mode {
 /**
  * @brief Definition of timers for per-cpu
  */
+struct hv_timer;
 struct per_cpu_timers {
-	struct list_head timer_list;	/**< it's for runtime active timer list */
+	struct hv_timer *root;		/**< min-heap of the active timers, keyed on timeout */
+	uint32_t nr_timers;		/**< number of timers in the heap */
+	uint64_t nr_inserts;		/**< number of timers added to the heap */
+	uint64_t insert_depth;		/**< heap levels all the insertions sifted through */
 };
 
 /**
  * @brief Definition of timer
  */
 struct hv_timer {
-	struct list_head node;		/**< link all timers */
+	struct hv_timer *parent;	/**< parent in the timer heap */
+	struct hv_timer *left;		/**< left child in the timer heap */
+	struct hv_timer *right;		/**< right child in the timer heap */
+	struct per_cpu_timers *cpu_timer;	/**< timers of the pCPU the timer is added on, NULL if not started */
 	enum tick_mode mode;		/**< timer mode: one-shot or periodic */
 	uint64_t timeout;		/**< tsc deadline to interrupt */
 	uint64_t period_in_cycle;	/**< period of the periodic timer in CPU ticks */
@@ -80,7 +87,7 @@ bool timer_expired(const struct hv_timer *timer, uint64_t now, uint64_t *delta);
  *
  * @param[in] timer Pointer to timer.
  *
- * @retval true if the timer is in timer list, false otherwise.
+ * @retval true if the timer is in the timer heap, false otherwise.
  */
 bool timer_is_started(const struct hv_timer *timer);
 
@@ -90,6 +97,8 @@ bool timer_is_started(const struct hv_timer *timer);
  * @param[in] timer Pointer to timer.
  * @param[in] timeout deadline to interrupt.
  * @param[in] period period of the periodic timer in unit of CPU ticks.
+ *
+ * @remark Don't update a started timer, delete it first.
  */
 void update_timer(struct hv_timer *timer, uint64_t timeout, uint64_t period);
 
@@ -114,6 +123,15 @@ int32_t add_timer(struct hv_timer *timer);
  */
 void del_timer(struct hv_timer *timer);
 
+/**
+ * @brief The deadline of the next timer of a pCPU.
+ *
+ * @param[in] pcpu_id ID of the current pCPU.
+ *
+ * @return The timeout of its next timer, in TSC ticks, ~0UL if it has none.
+ */
+uint64_t next_timer_deadline(uint16_t pcpu_id);
+
 /**
  * @brief Initialize timer.
  */
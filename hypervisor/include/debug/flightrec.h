@@ -0,0 +1,25 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef FLIGHTREC_H
+#define FLIGHTREC_H
+
+/*
+ * The flight recorder keeps the last events of each pCPU in an overwrite
+ * mode ring, always on. It is frozen and dumped to the log on a panic or a
+ * triple fault, the log of a panic reaches acrnprobe in acrnlog_last.
+ */
+#define FLIGHTREC_VM_EXIT	1U	/* e: exit reason, f: guest RIP */
+#define FLIGHTREC_SCHED		2U	/* str: name of the thread switched to */
+#define FLIGHTREC_IRQ		3U	/* e: vector, f: irq */
+
+void flightrec_init(uint16_t pcpu_id);
+void flightrec_put(uint32_t evid, uint64_t e, uint64_t f);
+void flightrec_put_str(uint32_t evid, const char *str);
+/* freeze the rings and dump them to the log, then resume the recording if thaw */
+void flightrec_dump(bool thaw);
+
+#endif /* FLIGHTREC_H */
@@ -7,6 +7,7 @@
 #ifndef LOGMSG_H
 #define LOGMSG_H
 #include <asm/cpu.h>
+#include <flightrec.h>
 
 /* Logging severity levels */
 #define LOG_FATAL		1U
@@ -46,6 +47,9 @@ void asm_assert(int32_t line, const char *file, const char *txt);
 #endif /* HV_DEBUG */
 
 void init_logmsg();
+/* queue the console messages from now on, for logmsg_flush_console() to print them */
+void logmsg_defer_console(void);
+void logmsg_flush_console(void);
 
 /*
  * @pre the severity > 0
@@ -120,6 +124,7 @@ void vprintf(const char *fmt, va_list args);
 #define panic(...) 							\
 	do { pr_fatal("PANIC: %s line: %d\n", __func__, __LINE__);	\
 		pr_fatal(__VA_ARGS__); 					\
+		flightrec_dump(false);					\
 		while (1) { asm_pause(); }; } while (0)
 
 #endif /* LOGMSG_H */
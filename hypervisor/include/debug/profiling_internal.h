@@ -178,6 +178,57 @@ struct profiling_status {
 	uint32_t samples_dropped;
 };
 
+/*
+ * PEBS records, taken in the hypervisor only: PEBS is turned off while a
+ * guest runs, as it would write the records through the guest page tables.
+ * A record is attributed to the vCPU whose thread runs on the pCPU.
+ */
+#define PEBS_BUFFER_SIZE	4096U
+#define PEBS_NUM_CTR_RESET	8U
+#define PEBS_MIN_RECORD_SIZE	0x20U
+#define NUM_PEBS_RECORD		8U
+
+/* 64-bit DS save area */
+struct profiling_ds_area {
+	uint64_t bts_buffer_base;
+	uint64_t bts_index;
+	uint64_t bts_absolute_maximum;
+	uint64_t bts_interrupt_threshold;
+	uint64_t pebs_buffer_base;
+	uint64_t pebs_index;
+	uint64_t pebs_absolute_maximum;
+	uint64_t pebs_interrupt_threshold;
+	/* reload values of the general counters after a PEBS record */
+	uint64_t pebs_counter_reset[PEBS_NUM_CTR_RESET];
+} __aligned(64);
+
+/* a PEBS record, in the same layout whatever the PEBS format of the CPU */
+struct pebs_record {
+	/* eventing IP */
+	uint64_t rip;
+	/* counters which caused the record */
+	uint64_t applicable_counters;
+	/* data linear address, source and latency of the load latency and store events */
+	uint64_t data_linear_address;
+	uint64_t data_source;
+	uint64_t latency;
+	/* TSC of the record, 0 if the format has none */
+	uint64_t tsc;
+	/* VM and vCPU the hypervisor ran for, 0xFFFF if none */
+	uint16_t vm_id;
+	uint16_t vcpu_id;
+	uint32_t reserved;
+} __aligned(SEP_BUF_ENTRY_SIZE);
+
+struct pebs_pmu_sample {
+	uint64_t num_records;
+	uint64_t reserved[3];
+	struct pebs_record records[NUM_PEBS_RECORD];
+} __aligned(SEP_BUF_ENTRY_SIZE);
+
+#define PEBS_RECORD_SIZE	((uint64_t)sizeof(struct pebs_record))
+#define PEBS_PMU_SAMPLE_HDR_SIZE ((uint64_t)offsetof(struct pebs_pmu_sample, records))
+
 struct sep_state {
 	sep_pmu_state pmu_state;
 
@@ -218,6 +269,15 @@ struct sep_state {
 	uint32_t vmexit_msr_cnt;
 	uint64_t guest_debugctl_value;
 	uint64_t saved_debugctl_value;
+
+	/* LBR and PEBS formats from IA32_PERF_CAPABILITIES */
+	uint32_t lbr_format;
+	uint32_t pebs_format;
+	bool pebs_enabled;
+	/* IA32_PEBS_ENABLE of the hypervisor, restored on VM exit */
+	uint64_t saved_pebs_enable;
+	struct profiling_ds_area ds_area;
+	uint8_t pebs_buffer[PEBS_BUFFER_SIZE] __aligned(64);
 } __aligned(8);
 
 struct data_header {
@@ -293,6 +353,7 @@ struct profiling_info_wrapper {
 	struct guest_vm_info vm_info;
 	ipi_commands ipi_cmd;
 	struct pmu_sample p_sample;
+	struct pebs_pmu_sample pebs_sample;
 	struct vm_switch_trace vm_trace;
 	socwatch_state soc_state;
 	struct sw_msr_op_info sw_msr_info;
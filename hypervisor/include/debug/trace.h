@@ -41,8 +41,80 @@
 
 #define TRACE_VMEXIT_UNHANDLED		0x20000U
 
-void TRACE_2L(uint32_t evid, uint64_t e, uint64_t f);
-void TRACE_4I(uint32_t evid, uint32_t a, uint32_t b, uint32_t c, uint32_t d);
-void TRACE_6C(uint32_t evid, uint8_t a1, uint8_t a2, uint8_t a3, uint8_t a4, uint8_t b1, uint8_t b2);
+/* sizeof(trace_entry) == 4 x 64bit */
+struct trace_entry {
+	uint64_t tsc; /* TSC */
+	uint64_t id:48;
+	uint8_t n_data; /* nr of data in trace_entry */
+	uint8_t cpu; /* pcpu id of trace_entry */
+
+	union {
+		struct {
+			uint32_t a, b, c, d;
+		} fields_32;
+		struct {
+			uint8_t a1, a2, a3, a4;
+			uint8_t b1, b2, b3, b4;
+			uint8_t c1, c2, c3, c4;
+			uint8_t d1, d2, d3, d4;
+		} fields_8;
+		struct {
+			uint64_t e;
+			uint64_t f;
+		} fields_64;
+		char str[16];
+	} payload;
+} __aligned(8);
+
+/*
+ * The trace events are enabled at runtime by a bitmap, set by the Service VM
+ * with HC_SET_TRACE_MASK. All of them are enabled by default in the debug
+ * version and disabled in the release version, so a disabled tracepoint costs
+ * one test of a bit and a branch not taken.
+ */
+#define TRACE_NR_EVENTS		1024U
+#define TRACE_MASK_WORDS	(TRACE_NR_EVENTS / 64U)
+
+extern uint64_t trace_event_mask[TRACE_MASK_WORDS];
+
+/* bits 0x000 - 0x0FF: the events above, 0x100 - 0x1FF: VM exits, 0x200: unhandled VM exits */
+static inline uint32_t trace_event_bit(uint32_t evid)
+{
+	return ((evid >> 8U) & 0x300U) | (evid & 0xFFU);
+}
+
+static inline bool trace_event_enabled(uint32_t evid)
+{
+	uint32_t bit = trace_event_bit(evid);
+
+	return ((trace_event_mask[bit >> 6U] & (1UL << (bit & 0x3FU))) != 0UL);
+}
+
+void trace_set_event_mask(const uint64_t *mask);
+
+void trace_put_2l(uint32_t evid, uint64_t e, uint64_t f);
+void trace_put_4i(uint32_t evid, uint32_t a, uint32_t b, uint32_t c, uint32_t d);
+void trace_put_6c(uint32_t evid, uint8_t a1, uint8_t a2, uint8_t a3, uint8_t a4, uint8_t b1, uint8_t b2);
+
+static inline void TRACE_2L(uint32_t evid, uint64_t e, uint64_t f)
+{
+	if (trace_event_enabled(evid)) {
+		trace_put_2l(evid, e, f);
+	}
+}
+
+static inline void TRACE_4I(uint32_t evid, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+	if (trace_event_enabled(evid)) {
+		trace_put_4i(evid, a, b, c, d);
+	}
+}
+
+static inline void TRACE_6C(uint32_t evid, uint8_t a1, uint8_t a2, uint8_t a3, uint8_t a4, uint8_t b1, uint8_t b2)
+{
+	if (trace_event_enabled(evid)) {
+		trace_put_6c(evid, a1, a2, a3, a4, b1, b2);
+	}
+}
 
 #endif /* TRACE_H */
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef IO_HOTSPOT_H
+#define IO_HOTSPOT_H
+
+#include <types.h>
+#include <acrn_common.h>
+#include <asm/lib/atomic.h>
+#include <asm/lib/spinlock.h>
+
+/* one in 2^IO_HOTSPOT_SAMPLE_SHIFT port I/O and MMIO accesses is sampled */
+#define IO_HOTSPOT_SAMPLE_SHIFT	4U
+#define IO_HOTSPOT_DEPTH	4U
+#define IO_HOTSPOT_WIDTH	256U
+
+/*
+ * Sampler of the (type, address, guest RIP) a VM traps on most: a count-min
+ * sketch estimates how often each key was sampled, and the keys with the
+ * highest estimates are kept in a small top-N table.
+ */
+struct io_hotspots {
+	spinlock_t lock;
+	uint64_t seen;		/* accesses seen, sampling counter */
+	uint64_t samples;
+	uint32_t sketch[IO_HOTSPOT_DEPTH][IO_HOTSPOT_WIDTH];
+	uint32_t nr_top;
+	struct acrn_io_hotspot top[ACRN_IO_HOTSPOT_NUM];
+};
+
+void io_hotspot_init(struct io_hotspots *hs);
+void io_hotspot_sample(struct io_hotspots *hs, uint16_t type, uint64_t addr, uint64_t rip, bool in_hv);
+void io_hotspot_get(struct io_hotspots *hs, struct acrn_vm_io_hotspots *out, bool reset);
+
+/**
+ * @brief Whether the access to sample next is this one
+ *
+ * Cheap enough to call on every access, the RIP is only read for the sampled ones.
+ */
+static inline bool io_hotspot_sample_due(struct io_hotspots *hs)
+{
+	uint64_t seen = (uint64_t)atomic_inc64_return((int64_t *)&hs->seen);
+
+	return ((seen & ((1UL << IO_HOTSPOT_SAMPLE_SHIFT) - 1UL)) == 0UL);
+}
+
+#endif /* IO_HOTSPOT_H */
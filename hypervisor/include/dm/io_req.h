@@ -36,15 +36,27 @@ struct io_request {
 		struct acrn_pio_request         pio_request;
 		struct acrn_pci_request         pci_request;
 		struct acrn_mmio_request        mmio_request;
+		struct acrn_pio_string_request  pio_string_request;
 		uint64_t			data[8];
 	} reqs;
+
+	/**
+	 * @brief Guest linear address of the element of a string port I/O read
+	 * with ACRN_PIO_STRING_VALUE, it is stored there on completion.
+	 */
+	uint64_t pio_string_gva;
 };
 
+#define ASYNCIO_HASH_BITS	7U
+#define ASYNCIO_HASH_SIZE	(1U << ASYNCIO_HASH_BITS)
+#define ASYNCIO_INVALID_IDX	0xFFFFU
+
 struct asyncio_desc {
 	uint32_t type;
+	uint32_t len;		/* length of an ACRN_ASYNCIO_RANGE descriptor */
 	uint64_t addr;
 	uint64_t fd;
-	struct list_head list;
+	uint16_t next;		/* next aio_desc[] index in the same chain */
 };
 
 /**
@@ -176,6 +188,22 @@ struct mem_io_node {
 	uint64_t range_end;
 };
 
+#define IO_HANDLER_CACHE_INVALID	0xFFFFU
+
+/**
+ * @brief Per-vCPU cache of the last matched I/O handlers
+ *
+ * Accesses from a vCPU tend to hit the same emulated device repeatedly, so the
+ * last matched MMIO node and port I/O handler are remembered together with the
+ * VM's generation counters which are bumped on every (un)registration.
+ */
+struct io_handler_cache {
+	uint32_t mmio_seq;	/**< vm->emul_mmio_seq when \p mmio_idx is cached */
+	uint16_t mmio_idx;	/**< Index of the last matched node in vm->emul_mmio */
+	uint16_t pio_idx;	/**< Index of the last matched handler in vm->emul_pio */
+	uint32_t pio_gen;	/**< vm->emul_pio_gen when \p pio_idx is cached */
+};
+
 /* External Interfaces */
 
 /**
@@ -188,6 +216,24 @@ struct mem_io_node {
  */
 int32_t acrn_insert_request(struct acrn_vcpu *vcpu, const struct io_request *io_req);
 
+/**
+ * @brief Deliver \p io_req to Service VM and let \p vcpu run meanwhile
+ *
+ * The request holds the slot of \p vcpu until complete_async_ioreq() frees
+ * it, the completion is signaled by ACRN_REQUEST_ASYNC_PF.
+ *
+ * @pre vcpu != NULL && io_req != NULL
+ * @pre !vcpu->vm->sw.is_polling_ioreq
+ */
+int32_t acrn_insert_request_nowait(struct acrn_vcpu *vcpu, const struct io_request *io_req);
+
+/**
+ * @brief Free the slot of the request of acrn_insert_request_nowait() once it is complete
+ *
+ * @return whether it was complete
+ */
+bool complete_async_ioreq(struct acrn_vcpu *vcpu);
+
 /**
  * @brief Reset all IO requests status of the VM
  *
@@ -291,11 +337,18 @@ void unregister_mmio_emulation_handler(struct acrn_vm *vm,
 					uint64_t start, uint64_t end);
 void deinit_emul_io(struct acrn_vm *vm);
 
+void reset_asyncio(struct acrn_vm *vm);
 int init_asyncio(struct acrn_vm *vm, uint64_t *hva);
 
-int add_asyncio(struct acrn_vm *vm, uint32_t type, uint64_t addr, uint64_t fd);
+int add_asyncio(struct acrn_vm *vm, uint32_t type, uint64_t addr, uint32_t len, uint64_t fd);
 
 int remove_asyncio(struct acrn_vm *vm, uint32_t type, uint64_t addr, uint64_t fd);
+
+int init_coalesced_mmio(struct acrn_vm *vm, uint64_t *hva);
+
+int32_t add_coalesced_mmio(struct acrn_vm *vm, const struct acrn_coalesced_mmio_zone *zone);
+
+int32_t remove_coalesced_mmio(struct acrn_vm *vm, const struct acrn_coalesced_mmio_zone *zone);
 /**
  * @}
  */
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef TSC_COUNTER_H
+#define TSC_COUNTER_H
+
+#include <types.h>
+#include <acrn_common.h>
+#include <asm/lib/spinlock.h>
+#include <asm/lib/seqlock.h>
+
+struct acrn_vm;
+
+/*
+ * Free running counter register of a device model device, e.g. the HPET
+ * main counter, which the hypervisor reads from the TSC in place of ACRN-DM.
+ * The vCPUs read it under seq, the updates from HC_SET_TSC_COUNTER are
+ * serialized by lock.
+ */
+struct tsc_counter {
+	spinlock_t lock;
+	seqcount_t seq;
+	bool active;
+	bool running;
+	uint64_t addr;
+	uint64_t value;		/* counter value at host_tsc */
+	uint64_t host_tsc;
+	uint64_t mask;
+	uint64_t freq;
+	uint64_t tsc_hz;
+};
+
+void tsc_counter_init(struct tsc_counter *tc);
+int32_t set_tsc_counter(struct acrn_vm *vm, const struct acrn_tsc_counter *counter, uint64_t host_tsc);
+
+#endif /* TSC_COUNTER_H */
@@ -57,9 +57,11 @@ struct acrn_single_vioapic {
 	struct acrn_vm  *vm;
 	struct ioapic_info chipinfo;
 	uint32_t	ioregsel;
-	union ioapic_rte rtbl[REDIR_ENTRIES_HW];
-	/* pin_state status bitmap: 1 - high, 0 - low */
+	union ioapic_rte rtbl[REDIR_ENTRIES_HW];	/* Remote IRR always clear, see remote_irr */
+	/* pin_state status bitmap: 1 - high, 0 - low, updated atomically without the lock */
 	uint64_t pin_state[STATE_BITMAP_SIZE];
+	/* Remote IRR of the RTEs, updated atomically without the lock */
+	uint64_t remote_irr[STATE_BITMAP_SIZE];
 };
 
 /*
@@ -72,9 +74,13 @@ struct acrn_vioapics {
 	struct acrn_single_vioapic vioapic_array[CONFIG_MAX_IOAPIC_NUM];
 };
 
+struct acrn_vioapic_state;
+
 void dump_vioapic(struct acrn_vm *vm);
 void vioapic_init(struct acrn_vm *vm);
 void reset_vioapics(const struct acrn_vm *vm);
+void vioapic_get_state(const struct acrn_vm *vm, struct acrn_vioapic_state *state);
+int32_t vioapic_set_state(struct acrn_vm *vm, const struct acrn_vioapic_state *state);
 
 
 /**
@@ -99,8 +105,8 @@ void	vioapic_set_irqline_lock(const struct acrn_vm *vm, uint32_t vgsi, uint32_t
 /**
  * @brief Set vIOAPIC IRQ line status.
  *
- * Similar with vioapic_set_irqline_lock(),but would not make sure
- * operation be done with ioapic lock.
+ * Same as vioapic_set_irqline_lock(), the pin state is updated atomically
+ * and neither takes the ioapic lock.
  *
  * @param[in] vm        Pointer to target VM
  * @param[in] vgsi      GSI for the virtual interrupt
@@ -30,8 +30,10 @@
 #define VPCI_H_
 
 #include <asm/lib/spinlock.h>
+#include <asm/lib/seqlock.h>
 #include <pci.h>
 #include <list.h>
+#include <acrn_common.h>
 
 #define VDEV_LIST_HASHBITS 4U
 #define VDEV_LIST_HASHSIZE (1U << VDEV_LIST_HASHBITS)
@@ -80,6 +82,8 @@ struct pci_msix {
 	uint32_t  table_count;
 	bool      is_vmsix_on_msi;
 	bool	  is_vmsix_on_msi_programmed;
+	/* the physical entry holds the remapping of the current address/data */
+	uint64_t  remapped[(CONFIG_MAX_MSIX_TABLE_NUM + 63U) >> 6U];
 };
 
 /* SRIOV capability structure */
@@ -110,6 +114,8 @@ struct pci_vdev_ops {
 
 struct pci_vdev {
 	struct acrn_vpci *vpci;
+	/* Serializes the config space emulation and the (de)init of this vdev */
+	spinlock_t lock;
 	/* The bus/device/function triple of the virtual PCI device. */
 	union pci_bdf bdf;
 
@@ -117,6 +123,12 @@ struct pci_vdev {
 
 	union pci_cfgdata cfgdata;
 
+	/*
+	 * 16-bit words of the physical config space which are read-only, shadowed
+	 * in cfgdata for a passthrough device, see init_pt_cfg_shadow()
+	 */
+	uint64_t cfg_shadow[PCIE_CONFIG_SPACE_SIZE >> 7U];
+
 	uint32_t flags;
 
 	/* The bar info of the virtual PCI device. */
@@ -169,8 +181,34 @@ struct pci_mmio_res {
 	uint64_t end;
 };
 
+#define MAX_VDEV_CFG_SHADOW_NUM	32U
+
+/*
+ * The configuration space of a PCI device ACRN-DM emulates for a post-launched
+ * VM, see struct acrn_vdev_cfg_shadow.
+ */
+struct vdev_cfg_shadow {
+	union pci_bdf bdf;
+	uint32_t bar_mask[PCI_BAR_COUNT];
+	uint32_t dm_bar[PCI_BAR_COUNT];		/* the BARs as ACRN-DM has them */
+	uint64_t dm_map[ACRN_VDEV_CFG_SHADOW_SIZE >> 6U];
+	union {
+		uint8_t data_8[ACRN_VDEV_CFG_SHADOW_SIZE];
+		uint16_t data_16[ACRN_VDEV_CFG_SHADOW_SIZE >> 1U];
+		uint32_t data_32[ACRN_VDEV_CFG_SHADOW_SIZE >> 2U];
+	} cfg;
+};
+
+/*
+ * Lock order: vpci->lock, then pci_vdev->lock (a PF before its VFs), then
+ * vpci->vdevs_lock. The config accesses of the guest only take the lock of
+ * the vdev they target.
+ */
 struct acrn_vpci {
-	spinlock_t lock;
+	spinlock_t lock;	/* serializes the assignment and the creation of vdevs */
+	spinlock_t vdevs_lock;	/* serializes the updates of pci_vdev_cnt and vdevs_hlist_heads */
+	/* Bumped around every update of vdevs_hlist_heads, so vdevs can be looked up without a lock */
+	seqcount_t vdevs_seq;
 	union pci_cfg_addr_reg addr;
 	struct pci_mmcfg_region pci_mmcfg;
 	uint32_t pci_vdev_cnt;
@@ -178,6 +216,9 @@ struct acrn_vpci {
 	struct pci_mmio_res res64; 	/* 64-bit mmio start/end address */
 	struct pci_vdev pci_vdevs[CONFIG_MAX_PCI_DEV_NUM];
 	struct hlist_head vdevs_hlist_heads [VDEV_LIST_HASHSIZE];
+	spinlock_t cfg_shadows_lock;	/* serializes the accesses to cfg_shadows */
+	uint32_t cfg_shadow_cnt;
+	struct vdev_cfg_shadow cfg_shadows[MAX_VDEV_CFG_SHADOW_NUM];
 };
 
 struct acrn_vm;
@@ -192,6 +233,11 @@ struct acrn_pcidev;
 int32_t vpci_assign_pcidev(struct acrn_vm *tgt_vm, struct acrn_pcidev *pcidev);
 int32_t vpci_deassign_pcidev(struct acrn_vm *tgt_vm, struct acrn_pcidev *pcidev);
 struct pci_vdev *vpci_init_vdev(struct acrn_vpci *vpci, struct acrn_vm_pci_dev_config *dev_config, struct pci_vdev *parent_pf_vdev);
+int32_t vpci_add_cfg_shadow(struct acrn_vpci *vpci, const struct acrn_vdev_cfg_shadow *info);
+int32_t vpci_remove_cfg_shadow(struct acrn_vpci *vpci, uint16_t bdf);
+bool vpci_has_cfg_shadow(struct acrn_vpci *vpci, union pci_bdf bdf);
+int32_t vpci_read_cfg_shadow(struct acrn_vpci *vpci, union pci_bdf bdf, uint32_t offset, uint32_t bytes, uint32_t *val);
+int32_t vpci_write_cfg_shadow(struct acrn_vpci *vpci, union pci_bdf bdf, uint32_t offset, uint32_t bytes, uint32_t val);
 
 static inline bool is_pci_io_bar(struct pci_vbar *vbar)
 {
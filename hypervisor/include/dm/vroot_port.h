@@ -17,5 +17,6 @@ extern const struct pci_vdev_ops vrp_ops;
 
 int32_t create_vrp(struct acrn_vm *vm, struct acrn_vdev *dev);
 int32_t destroy_vrp(struct pci_vdev *vdev);
+void vrp_notify_slot(struct acrn_vm *vm, union pci_bdf bdf, bool present);
 
 #endif
@@ -31,11 +31,15 @@
 #include <types.h>
 #include <asm/lib/spinlock.h>
 #include <asm/vm_config.h>
+#include <timer.h>
 
 #define RX_BUF_SIZE		256U
 #define TX_BUF_SIZE		8192U
 #define INVAILD_VUART_IDX	0xFFU
 
+/* IER bit 7: the guest opts in the wide writes to the THR, see vuart_write_burst() */
+#define VUART_IER_PV_BURST	0x80U
+
 #define COM1_BASE		0x3F8U
 #define COM2_BASE		0x2F8U
 #define COM3_BASE		0x3E8U
@@ -74,6 +78,15 @@ struct acrn_vuart {
 	char vuart_rx_buf[RX_BUF_SIZE];
 	char vuart_tx_buf[TX_BUF_SIZE];
 	bool thre_int_pending;	/* THRE interrupt pending */
+	/*
+	 * The RX FIFO of a connection vuart with the FIFOs enabled only
+	 * interrupts at the trigger level, or once no character came in
+	 * for the character timeout.
+	 */
+	struct hv_timer rx_timer;
+	uint16_t rx_timer_pcpu;	/* the pCPU the rx_timer is added on */
+	bool rx_timer_armed;
+	bool rx_timeout;	/* the character timeout expired */
 	bool active;
 	struct acrn_vuart *target_vu; /* Pointer to target vuart */
 	struct acrn_vm *vm;
@@ -94,4 +107,5 @@ bool is_vuart_intx(const struct acrn_vm *vm, uint32_t intx_gsi);
 
 uint8_t vuart_read_reg(struct acrn_vuart *vu, uint16_t offset);
 void vuart_write_reg(struct acrn_vuart *vu, uint16_t offset, uint8_t value);
+void vuart_write_burst(struct acrn_vuart *vu, uint16_t offset, uint32_t value, size_t width);
 #endif /* VUART_H */
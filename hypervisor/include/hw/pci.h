@@ -119,9 +119,17 @@
 #define PCI_ECAP_BASE_PTR	0x100U
 #define PCI_ECAP_ID(hdr)	((uint32_t)((hdr) & 0xFFFFU))
 #define PCI_ECAP_NEXT(hdr)	((uint32_t)(((hdr) >> 20U) & 0xFFCU))
+#define PCIZ_ATS		0x0fU
 #define PCIZ_SRIOV		0x10U
 #define PCIZ_PTM 		0x1fU
 
+/* ATS Definitions */
+#define PCIR_ATS_CAP		0x4U
+#define PCIR_ATS_CTRL		0x6U
+#define PCIM_ATS_CAP_QDEP	0x1fU	/* invalidate queue depth, 0 for 32 */
+#define PCIM_ATS_CTRL_STU	0x1fU	/* smallest translation unit */
+#define PCIM_ATS_CTRL_EN	0x8000U
+
 /* SRIOV Definitions */
 #define PCI_SRIOV_CAP_LEN	0x40U
 #define PCIR_SRIOV_CONTROL	0x8U
@@ -174,6 +182,7 @@
 
 #define MSIX_CAPLEN           12U
 #define MSIX_TABLE_ENTRY_SIZE 16U
+#define PCI_MSIX_ENTRY_VECTOR_CONTROL 12U
 
 /* PCI Power Management Capability */
 #define PCIY_PMC              0x01U
@@ -185,12 +194,31 @@
 #define PCIY_PCIE             0x10U
 #define PCIR_PCIE_DEVCAP      0x04U
 #define PCIR_PCIE_DEVCTRL     0x08U
+#define PCIR_PCIE_LINKCAP     0x0CU
+#define PCIR_PCIE_LINKCTRL    0x10U
+#define PCIR_PCIE_SLOTCAP     0x14U
+#define PCIR_PCIE_SLOTCTRL    0x18U
+#define PCIR_PCIE_SLOTSTA     0x1AU
 #define PCIM_PCIE_DEV_CTRL_MAX_PAYLOAD    0x00E0U
 #define PCIM_PCIE_FLRCAP      (0x1U << 28U)
 #define PCIM_PCIE_FLR         (0x1U << 15U)
+#define PCIM_PCIE_LINK_DLLLARC    (0x1U << 20U)
+#define PCIM_PCIE_LINK_DLLLA      (0x1U << 13U)
+#define PCIM_PCIE_SLOT_HPS        (0x1U << 5U)
+#define PCIM_PCIE_SLOT_HPC        (0x1U << 6U)
+#define PCIM_PCIE_SLOT_NCCS       (0x1U << 18U)
+#define PCIM_PCIE_SLOT_PSN_SHIFT  19U
+#define PCIM_PCIE_SLOT_PDCE       (0x1U << 3U)
+#define PCIM_PCIE_SLOT_HPIE       (0x1U << 5U)
+#define PCIM_PCIE_SLOT_DLLSCE     (0x1U << 12U)
+#define PCIM_PCIE_SLOT_PDC        (0x1U << 3U)
+#define PCIM_PCIE_SLOT_PDS        (0x1U << 6U)
+#define PCIM_PCIE_SLOT_DLLSC      (0x1U << 8U)
+#define PCIM_PCIE_SLOT_STA_RW1C   0x011FU
 
 /* PCI Express Device Type definitions */
 #define PCIER_FLAGS                    0x2U
+#define PCIEM_FLAGS_VERSION            0x000FU
 #define PCIEM_FLAGS_TYPE               0x00F0U
 #define PCIEM_TYPE_ENDPOINT            0x0000U
 #define PCIEM_TYPE_ROOTPORT            0x0004U
@@ -200,6 +228,10 @@
 #define PCIM_PCIE_DEVCAP2_ARI (0x1U << 5U)
 #define PCIR_PCIE_DEVCTL2     0x28U
 #define PCIM_PCIE_DEVCTL2_ARI (0x1U << 5U)
+#define PCIR_PCIE_LINKCAP2    0x2CU
+
+/* Vendor Specific Capability */
+#define PCIY_VENDOR           0x09U
 
 /* Conventional PCI Advanced Features Capability */
 #define PCIY_AF               0x13U
@@ -297,6 +329,10 @@ struct pci_pdev {
 	struct pci_msix_cap msix;
 	struct pci_sriov_cap sriov;
 
+	uint32_t ats_capoff;
+	/* the BDF of the PF of a VF, of the device itself otherwise */
+	union pci_bdf pf_bdf;
+
 	bool has_pm_reset;
 	bool has_flr;
 	bool has_af_flr;
@@ -382,6 +418,7 @@ void init_pci_pdev_list(void);
  * @return if there is a matching pbdf in pci_pdevs, pdev->drhd_idx, else -1U
  */
 uint32_t pci_lookup_drhd_for_pbdf(uint16_t pbdf);
+const struct pci_pdev *pci_find_pdev(uint16_t pbdf);
 
 static inline bool is_pci_vendor_valid(uint32_t vendor_id)
 {
@@ -26,7 +26,7 @@
  */
 
 #define ACRN_IO_REQUEST_MAX		16U
-#define ACRN_ASYNCIO_MAX		64U
+#define ACRN_ASYNCIO_MAX		256U
 
 #define ACRN_IOREQ_STATE_PENDING	0U
 #define ACRN_IOREQ_STATE_COMPLETE	1U
@@ -37,6 +37,7 @@
 #define ACRN_IOREQ_TYPE_MMIO		1U
 #define ACRN_IOREQ_TYPE_PCICFG		2U
 #define ACRN_IOREQ_TYPE_WP		3U
+#define ACRN_IOREQ_TYPE_PORTIO_STRING	4U
 
 #define ACRN_IOREQ_DIR_READ		0U
 #define ACRN_IOREQ_DIR_WRITE		1U
@@ -65,6 +66,12 @@
 #define GUEST_FLAG_PMU_PASSTHROUGH	(1UL << 11U)    /* Whether PMU is passed through */
 #define GUEST_FLAG_VHWP				(1UL << 12U)    /* Whether the VM supports vHWP */
 #define GUEST_FLAG_VTM				(1UL << 13U)    /* Whether the VM supports virtual thermal monitor */
+#define GUEST_FLAG_DIRTY_LOG			(1UL << 14U)    /* Whether the EPT accessed and dirty flags of the VM are logged */
+#define GUEST_FLAG_PV_IPI			(1UL << 15U)    /* Whether the VM may send IPIs with the HC_SEND_IPI hypercall */
+#define GUEST_FLAG_PV_TIMER			(1UL << 16U)    /* Whether the VM may register PV timer pages with HC_SET_PV_TIMER_PAGE */
+#define GUEST_FLAG_IDLE_PT			(1UL << 17U)    /* Whether HLT, MWAIT and PAUSE of the VM run without VM exits */
+#define GUEST_FLAG_VPMU				(1UL << 18U)    /* Whether the VM has a virtual PMU on shared pCPUs */
+#define GUEST_FLAG_PV_CLOCK			(1UL << 19U)    /* Whether the VM has the KVM compatible paravirtual clock, steal time, PV EOI, PV spinlocks and async PF */
 
 /* TODO: We may need to get this addr from guest ACPI instead of hardcode here */
 #define VIRTUAL_SLEEP_CTL_ADDR		0x400U /* Pre-launched VM uses ACPI reduced HW mode and sleep control register */
@@ -147,6 +154,57 @@ struct acrn_pio_request {
 	uint32_t value;
 };
 
+/* flags of struct acrn_pio_string_request */
+#define ACRN_PIO_STRING_DOWN		(1U << 0U)	/* the elements are accessed from the highest address */
+#define ACRN_PIO_STRING_VALUE		(1U << 1U)	/* the only element is in value, not in guest memory */
+
+/**
+ * @brief Representation of a string port I/O request
+ *
+ * \p count iterations of an ins/outs instruction, at once: \p count accesses
+ * of \p size bytes to the port, which read from or write to the elements of
+ * the guest memory [gpa, gpa + count * size), in the same page. The first
+ * \p direction, \p address and \p size are as in struct acrn_pio_request.
+ */
+struct acrn_pio_string_request {
+	/**
+	 * @brief Direction of the accesses
+	 *
+	 * Either \p ACRN_IOREQ_DIR_READ (ins) or \p ACRN_IOREQ_DIR_WRITE (outs).
+	 */
+	uint32_t direction;
+
+	/**
+	 * @brief ACRN_PIO_STRING_* flags
+	 */
+	uint32_t flags;
+
+	/**
+	 * @brief Port address of the I/O accesses
+	 */
+	uint64_t address;
+
+	/**
+	 * @brief Width of each I/O access in byte
+	 */
+	uint64_t size;
+
+	/**
+	 * @brief Number of I/O accesses
+	 */
+	uint64_t count;
+
+	/**
+	 * @brief Guest physical address of the lowest element
+	 */
+	uint64_t gpa;
+
+	/**
+	 * @brief The element with ACRN_PIO_STRING_VALUE, its data crosses a page
+	 */
+	uint32_t value;
+};
+
 /**
  * @brief Representation of a PCI configuration space access
  */
@@ -310,6 +368,7 @@ struct acrn_io_request {
 		struct acrn_pio_request		pio_request;
 		struct acrn_pci_request		pci_request;
 		struct acrn_mmio_request	mmio_request;
+		struct acrn_pio_string_request	pio_string_request;
 		uint64_t			data[8];
 	} reqs;
 
@@ -346,10 +405,102 @@ struct acrn_io_request_buffer {
 
 struct acrn_asyncio_info {
 	uint32_t type;
+	/** length of the range for ACRN_ASYNCIO_RANGE, ignored otherwise */
+	uint32_t len;
 	uint64_t addr;
 	uint64_t fd;
 };
 
+/**
+ * @brief Entry of an asyncio sbuf whose ele_size is sizeof(struct acrn_asyncio_entry)
+ *
+ * With an ele_size of sizeof(uint64_t), an entry is the fd only.
+ */
+struct acrn_asyncio_entry {
+	uint64_t fd;
+	/** value written by the access, i.e. the queue index of a virtio notify */
+	uint64_t data;
+};
+
+#define ACRN_COALESCED_MMIO_ZONE_MAX	16U
+
+/**
+ * @brief A coalesced MMIO zone, the parameter of HC_ADD_COALESCED_MMIO and
+ * HC_REMOVE_COALESCED_MMIO
+ *
+ * The writes of the User VM to [addr, addr + len) the hypervisor does not
+ * emulate are appended to its ACRN_COALESCED_MMIO sbuf instead of being
+ * delivered as I/O requests, and the vCPU goes on right away. Reads, and
+ * writes finding the sbuf full, are delivered as usual: ACRN-DM drains the
+ * sbuf before it emulates any I/O request, which keeps the accesses in order.
+ */
+struct acrn_coalesced_mmio_zone {
+	uint64_t addr;
+	uint32_t len;
+	uint32_t reserved;
+};
+
+/**
+ * @brief Entry of the ACRN_COALESCED_MMIO sbuf, a write to a coalesced MMIO zone
+ */
+struct acrn_coalesced_mmio_entry {
+	uint64_t addr;
+	uint32_t size;
+	uint32_t reserved;
+	uint64_t value;
+};
+
+#define ACRN_TSC_COUNTER_ACTIVE		(1U << 0U)
+#define ACRN_TSC_COUNTER_RUNNING	(1U << 1U)
+
+/**
+ * @brief A counter register read from the TSC, the parameter of
+ * HC_SET_TSC_COUNTER
+ *
+ * While ACRN_TSC_COUNTER_ACTIVE is set, the hypervisor emulates the reads of
+ * the User VM of the 8 bytes at addr itself: they return (value + (TSC - tsc)
+ * * freq / TSC frequency) & mask if ACRN_TSC_COUNTER_RUNNING is set, else
+ * value & mask. tsc is a TSC value of the Service VM and the TSC frequency
+ * the one of CPUID leaf 0x40000010. The writes are still delivered as I/O
+ * requests.
+ */
+struct acrn_tsc_counter {
+	uint64_t addr;
+	uint64_t value;
+	uint64_t tsc;
+	uint64_t mask;
+	uint32_t freq;
+	uint32_t flags;
+};
+
+#define ACRN_MULTICALL_MAX	16U
+
+/**
+ * @brief A hypercall of a multicall
+ *
+ * hcall_id, param1 and param2 are what the Service VM would pass to the
+ * hypercall in R8, RDI and RSI, the hypervisor returns its result in result.
+ */
+struct acrn_multicall_entry {
+	uint64_t hcall_id;
+	uint64_t param1;
+	uint64_t param2;
+	int64_t result;
+};
+
+/**
+ * @brief Hypercalls run in one go, the parameter of HC_MULTICALL
+ *
+ * The hypervisor runs the count first entries in order, each as its own
+ * hypercall would, whatever the result of the previous ones. A multicall
+ * cannot be one of them.
+ */
+struct acrn_multicall {
+	uint32_t count;
+	uint32_t reserved;
+	struct acrn_multicall_entry entries[ACRN_MULTICALL_MAX];
+};
+
 /**
  * @brief Info to create a VM, the parameter for HC_CREATE_VM hypercall
  */
@@ -464,6 +615,111 @@ struct acrn_vcpu_regs {
 	struct acrn_regs vcpu_regs;
 };
 
+/** a segment register of a vCPU, see struct acrn_vcpu_state */
+struct acrn_segment {
+	uint64_t base;
+	uint32_t limit;
+	uint32_t attr;
+	uint16_t selector;
+	uint16_t reserved[3];
+};
+
+/** an emulated MSR of a vCPU, see struct acrn_vcpu_state */
+struct acrn_msr_entry {
+	uint32_t msr;
+	uint32_t reserved;
+	uint64_t value;
+};
+
+#define ACRN_VCPU_STATE_MSRS		16U
+#define ACRN_VCPU_STATE_LAPIC_SIZE	1024U
+#define ACRN_VCPU_STATE_XSAVE_SIZE	4096U
+
+/**
+ * @brief the whole state of a vCPU of a paused VM
+ *
+ * the parameter for HC_GET_VCPU_STATE and HC_SET_VCPU_STATE, which take a
+ * snapshot of a VM and restore it into a new one. The XSAVE area is in the
+ * compacted format of the platform, a snapshot only restores on the same
+ * kind of platform.
+ */
+struct acrn_vcpu_state {
+	/** the virtual CPU ID of the vCPU */
+	uint16_t vcpu_id;
+
+	/** 1 if the vCPU was started, 0 if it waits for a SIPI */
+	uint16_t launched;
+
+	uint16_t reserved[2];
+
+	struct acrn_gp_regs gprs;
+	uint64_t rip;
+	uint64_t rflags;
+	uint64_t cr0;
+	uint64_t cr2;
+	uint64_t cr3;
+	uint64_t cr4;
+	uint64_t dr7;
+	uint64_t ia32_efer;
+	uint64_t ia32_pat;
+	uint64_t ia32_star;
+	uint64_t ia32_cstar;
+	uint64_t ia32_lstar;
+	uint64_t ia32_fmask;
+	uint64_t ia32_kernel_gs_base;
+	uint64_t ia32_sysenter_cs;
+	uint64_t ia32_sysenter_esp;
+	uint64_t ia32_sysenter_eip;
+	uint64_t tsc_aux;
+	uint64_t xcr0;
+
+	/** guest TSC when the VM was paused */
+	uint64_t tsc;
+
+	uint64_t apic_base;
+
+	/** guest TSC deadline of the LAPIC timer, 0 if not armed in this mode */
+	uint64_t tsc_deadline;
+
+	uint32_t interruptibility;
+	uint32_t nr_msrs;
+
+	struct acrn_segment cs;
+	struct acrn_segment ss;
+	struct acrn_segment ds;
+	struct acrn_segment es;
+	struct acrn_segment fs;
+	struct acrn_segment gs;
+	struct acrn_segment ldtr;
+	struct acrn_segment tr;
+	struct acrn_descriptor_ptr gdt;
+	struct acrn_descriptor_ptr idt;
+
+	/** the MSRs the hypervisor emulates */
+	struct acrn_msr_entry msrs[ACRN_VCPU_STATE_MSRS];
+
+	/** the LAPIC registers, laid out as in the xAPIC page */
+	uint8_t lapic[ACRN_VCPU_STATE_LAPIC_SIZE];
+
+	uint8_t xsave[ACRN_VCPU_STATE_XSAVE_SIZE];
+};
+
+#define ACRN_VIOAPIC_STATE_PINS		120U
+
+/**
+ * @brief the state of the vIOAPIC of a paused VM
+ *
+ * the parameter for HC_GET_VIOAPIC_STATE and HC_SET_VIOAPIC_STATE. The pin
+ * levels are not part of it: the devices driving them assert them again.
+ */
+struct acrn_vioapic_state {
+	uint32_t id;
+	uint32_t ioregsel;
+	uint32_t nr_pins;
+	uint32_t reserved;
+	uint64_t rte[ACRN_VIOAPIC_STATE_PINS];
+};
+
 /** Operation types for setting IRQ line */
 #define GSI_SET_HIGH		0U
 #define GSI_SET_LOW		1U
@@ -494,6 +750,26 @@ struct acrn_msi_entry {
 	uint64_t msi_data;
 };
 
+/**
+ * @brief Info the guest and the hypervisor share on the TSC deadline timer of a vCPU
+ *
+ * Registered with HC_SET_PV_TIMER_PAGE. A guest arming the TSC deadline timer
+ * writes the deadline here first. If it is not earlier than a non-zero armed,
+ * it needs no WRMSR to IA32_TSC_DEADLINE: the hypervisor finds the new deadline
+ * when the armed one is hit and re-arms the timer for it, or drops it if the
+ * guest wrote 0. Otherwise the guest writes IA32_TSC_DEADLINE as usual.
+ *
+ * The timer interrupt may come at a deadline the guest already moved, so the
+ * guest has to check for expired events on each of them.
+ */
+struct acrn_pv_timer_page {
+	/** TSC deadline of the guest, 0 if disarmed, written by the guest */
+	uint64_t deadline;
+
+	/** TSC deadline the vLAPIC timer is armed for, 0 if none, written by the hypervisor */
+	uint64_t armed;
+} __aligned(16);
+
 /**
  * @brief Info The power state data of a VCPU.
  *
@@ -546,6 +822,24 @@ struct acrn_cpufreq_limits {
 	uint8_t performance_pstate;
 };
 
+/**
+ * @brief The frequency policy of a VM, the parameter of HC_SET_VM_FREQ_POLICY
+ *
+ * The HWP request a pCPU runs with while a vCPU of the VM runs on it. The
+ * levels are clamped to the ones the pCPU allows.
+ */
+struct acrn_vm_freq_policy {
+	/** the lowest and highest HWP performance levels */
+	uint8_t min_perf;
+	uint8_t max_perf;
+	/** the desired HWP performance level, 0 for autonomous selection */
+	uint8_t desired_perf;
+	/** the energy performance preference, from 0 (performance) to 0xff (energy saving) */
+	uint8_t epp;
+	/** Reserved */
+	uint32_t reserved;
+} __aligned(8);
+
 struct acpi_sx_pkg {
 	uint8_t		val_pm1a;
 	uint8_t		val_pm1b;
@@ -607,6 +901,275 @@ struct acrn_intr_monitor {
 #define INTR_CMD_GET_DATA 0U
 #define INTR_CMD_DELAY_INT 1U
 
+/**
+ * @brief Info to get the scheduling statistics of a vCPU
+ *
+ * the parameter for HC_GET_VCPU_SCHED_STATS hypercall
+ */
+#define ACRN_SCHED_LAT_BUCKETS 16U
+struct acrn_vcpu_sched_stats {
+	/** the vCPU to get the statistics of, set by the caller */
+	uint16_t vcpu_id;
+
+	/** the pCPU the vCPU is on */
+	uint16_t pcpu_id;
+
+	/** Reserved */
+	uint32_t reserved;
+
+	/** TSC frequency in kHz, to convert the times below */
+	uint64_t tsc_khz;
+
+	/** time the vCPU has been running, in TSC ticks */
+	uint64_t run_ticks;
+
+	/** time the vCPU has been runnable but waiting for its pCPU, in TSC ticks */
+	uint64_t wait_ticks;
+
+	/** number of times the vCPU was switched in */
+	uint64_t nr_switches;
+
+	/**
+	 * wakeup latency histogram, bucket i counts the wakeups switched in
+	 * within [2^(i-1), 2^i) us, bucket 0 within 1us
+	 */
+	uint64_t wakeup_lat[ACRN_SCHED_LAT_BUCKETS];
+} __aligned(8);
+
+/**
+ * @brief VM exit statistics of one basic exit reason
+ */
+#define ACRN_VMEXIT_REASONS 70U
+#define ACRN_VMEXIT_LAT_BUCKETS 16U
+struct acrn_vmexit_stats {
+	/** number of the exits */
+	uint64_t count;
+
+	/** time spent handling them, in TSC ticks */
+	uint64_t ticks;
+
+	/**
+	 * handling time histogram, bucket i counts the exits handled within
+	 * [2^(i+8), 2^(i+9)) TSC ticks, bucket 0 also the shorter and the last
+	 * bucket also the longer ones
+	 */
+	uint64_t lat[ACRN_VMEXIT_LAT_BUCKETS];
+} __aligned(8);
+
+/**
+ * @brief Info to get the VM exit statistics of a vCPU
+ *
+ * the parameter for HC_GET_VCPU_EXIT_STATS hypercall
+ */
+struct acrn_vcpu_exit_stats {
+	/** the vCPU to get the statistics of, set by the caller */
+	uint16_t vcpu_id;
+
+	/** Reserved */
+	uint16_t reserved[3];
+
+	/** TSC frequency in kHz, to convert the times below */
+	uint64_t tsc_khz;
+
+	/** indexed by the basic exit reason */
+	struct acrn_vmexit_stats reason[ACRN_VMEXIT_REASONS];
+} __aligned(8);
+
+/**
+ * @brief Utilization counters of a pCPU, since it was started
+ */
+struct acrn_pcpu_util {
+	/** time the idle thread of the pCPU has run, in TSC ticks */
+	uint64_t idle_ticks;
+
+	/** time spent handling the VM exits of the vCPUs on the pCPU, in TSC ticks */
+	uint64_t hv_ticks;
+
+	/** number of VM exits handled on the pCPU */
+	uint64_t nr_exits;
+} __aligned(8);
+
+/**
+ * @brief Utilization counters of a vCPU, since it was created
+ */
+struct acrn_vcpu_util {
+	/** the (absolute) ID of the VM of the vCPU */
+	uint16_t vm_id;
+
+	/** the ID of the vCPU in its VM */
+	uint16_t vcpu_id;
+
+	/** the pCPU the vCPU is on */
+	uint16_t pcpu_id;
+
+	/** Reserved */
+	uint16_t reserved;
+
+	/** time the vCPU has been running, VM exits included, in TSC ticks */
+	uint64_t run_ticks;
+
+	/** time the vCPU has been runnable but waiting for its pCPU, in TSC ticks */
+	uint64_t wait_ticks;
+
+	/** time spent handling the VM exits of the vCPU, in TSC ticks */
+	uint64_t exit_ticks;
+
+	/** number of VM exits of the vCPU */
+	uint64_t nr_exits;
+} __aligned(8);
+
+/**
+ * @brief Info to get the utilization counters of all the pCPUs and vCPUs
+ *
+ * the parameter for HC_GET_CPU_UTIL hypercall
+ *
+ * The counters only ever grow: the utilization over an interval is the
+ * difference of two snapshots, divided by that of tsc.
+ */
+#define ACRN_UTIL_MAX_PCPUS	64U
+#define ACRN_UTIL_MAX_VCPUS	128U
+struct acrn_cpu_util {
+	/** number of the entries filled in pcpu */
+	uint16_t nr_pcpus;
+
+	/** number of the entries filled in vcpu */
+	uint16_t nr_vcpus;
+
+	/** Reserved */
+	uint32_t reserved;
+
+	/** TSC frequency in kHz, to convert the times below */
+	uint64_t tsc_khz;
+
+	/** the TSC when the counters were read */
+	uint64_t tsc;
+
+	/** indexed by the pCPU ID */
+	struct acrn_pcpu_util pcpu[ACRN_UTIL_MAX_PCPUS];
+
+	/** the vCPUs of the running VMs, by VM then vCPU ID */
+	struct acrn_vcpu_util vcpu[ACRN_UTIL_MAX_VCPUS];
+} __aligned(8);
+
+/**
+ * @brief One sampled I/O hotspot of a VM
+ */
+#define ACRN_IO_HOTSPOT_PIO	0U
+#define ACRN_IO_HOTSPOT_MMIO	1U
+#define ACRN_IO_HOTSPOT_NUM	16U
+struct acrn_io_hotspot {
+	/** the port or the guest physical address accessed */
+	uint64_t addr;
+
+	/** the guest RIP of the access */
+	uint64_t rip;
+
+	/** estimated number of the sampled accesses, never below the real one */
+	uint64_t count;
+
+	/** ACRN_IO_HOTSPOT_PIO or ACRN_IO_HOTSPOT_MMIO */
+	uint16_t type;
+
+	/** 1 if the hypervisor emulated the last one, 0 if it went to the device model */
+	uint16_t in_hv;
+
+	/** Reserved */
+	uint32_t reserved;
+} __aligned(8);
+
+/**
+ * @brief Info to get the I/O hotspots of a VM
+ *
+ * the parameter for HC_GET_VM_IO_HOTSPOTS hypercall
+ */
+struct acrn_vm_io_hotspots {
+	/** clear the samples once copied if non-zero, set by the caller */
+	uint32_t reset;
+
+	/** one in 2^sample_shift of the port I/O and MMIO accesses is sampled */
+	uint32_t sample_shift;
+
+	/** number of the accesses sampled */
+	uint64_t samples;
+
+	/** the hottest (type, addr, rip), by count, the unused ones have a zero count */
+	struct acrn_io_hotspot hotspot[ACRN_IO_HOTSPOT_NUM];
+} __aligned(8);
+
+/**
+ * @brief The cache and memory bandwidth monitoring counters of a VM
+ *
+ * the parameter for HC_GET_VM_RDT_MON hypercall
+ */
+#define ACRN_RDT_MON_LLC_OCCUPANCY	(1U << 0U)
+#define ACRN_RDT_MON_MBM_TOTAL		(1U << 1U)
+#define ACRN_RDT_MON_MBM_LOCAL		(1U << 2U)
+struct acrn_vm_rdt_mon {
+	/** the ACRN_RDT_MON_* counters the platform has, 0 if it has none */
+	uint32_t events;
+
+	/** the RMID the vCPUs of the VM are tagged with, 0 if they are not */
+	uint32_t rmid;
+
+	/** the counters are sampled once per period_ms, and are as old as that */
+	uint64_t period_ms;
+
+	/** bytes of the LLC filled by the VM, over all the LLCs */
+	uint64_t llc_occupancy;
+
+	/** bytes the VM read from and wrote to memory since it was created */
+	uint64_t mbm_total;
+
+	/** the part of mbm_total to the memory of the local node */
+	uint64_t mbm_local;
+} __aligned(8);
+
+/**
+ * @brief Latency probe of a VM
+ *
+ * the parameter for HC_VM_LATENCY_PROBE hypercall
+ *
+ * A guest acks an interrupt to the probe by writing its vector to
+ * ACRN_MSR_LAT_ACK, when CPUID.0x40000001:EAX has GUEST_CAPS_LAT_ACK.
+ */
+#define ACRN_MSR_LAT_ACK	0x40000200U
+
+#define ACRN_LAT_TIMER		0U	/* deadline of the vLAPIC timer to its interrupt posted */
+#define ACRN_LAT_IRQ		1U	/* passthrough interrupt in dispatch_interrupt() to posted */
+#define ACRN_LAT_ACK		2U	/* interrupt posted to the guest writing ACRN_MSR_LAT_ACK */
+#define ACRN_LAT_TYPES		3U
+
+/* bucket i counts the latencies within [2^(i-1), 2^i) ns, bucket 0 below 1ns */
+#define ACRN_LAT_BUCKETS	24U
+
+#define ACRN_LAT_CMD_GET	0U	/* only read the histograms */
+#define ACRN_LAT_CMD_START	1U	/* clear the histograms and start the probe */
+#define ACRN_LAT_CMD_STOP	2U	/* stop the probe, the histograms are kept */
+
+struct acrn_lat_hist {
+	/** number of latencies measured */
+	uint64_t count;
+
+	/** sum of the latencies, in ns */
+	uint64_t sum_ns;
+
+	/** highest latency, in ns */
+	uint64_t max_ns;
+
+	uint64_t bucket[ACRN_LAT_BUCKETS];
+} __aligned(8);
+
+struct acrn_vm_latency {
+	/** ACRN_LAT_CMD_*, set by the caller */
+	uint32_t cmd;
+
+	/** 1 if the probe is running, after cmd */
+	uint32_t enabled;
+
+	/** indexed by ACRN_LAT_* */
+	struct acrn_lat_hist hist[ACRN_LAT_TYPES];
+} __aligned(8);
+
 /*
  * PRE_LAUNCHED_VM is launched by ACRN hypervisor, with LAPIC_PT;
  * Service VM is launched by ACRN hypervisor, without LAPIC_PT;
@@ -652,6 +1215,21 @@ struct vrp_config
 	uint32_t ptm_cap_offset;
 };
 
+/**
+ * @brief Info to create an HV-land ivshmem device
+ *
+ * The args of the acrn_vdev of an ivshmem device: the name of the shared
+ * memory region, then the virtio device run over the region, if any (see
+ * acrn_ivshmem_virtio.h).
+ */
+struct acrn_ivshmem_config
+{
+	char shm_name[32];
+	uint16_t virtio_id; /* 0 for a plain ivshmem device */
+	uint8_t virtio_role; /* IVSHMEM_VIRTIO_FRONTEND/BACKEND */
+	uint8_t reserved[5];
+};
+
 /* Type of PCI device assignment */
 #define ACRN_PTDEV_QUIRK_ASSIGN	(1U << 0)
 
@@ -741,8 +1319,41 @@ struct acrn_vdev {
 	uint8_t	args[128];
 };
 
+#define ACRN_VDEV_CFG_SHADOW_SIZE	256U
+
+/**
+ * @brief Info to shadow the configuration space of a PCI device emulated by ACRN-DM
+ *
+ * the parameter for HC_ADD_VDEV_CFG_SHADOW or HC_REMOVE_VDEV_CFG_SHADOW hypercall
+ *
+ * The hypervisor serves the configuration accesses of the User VM to the
+ * device from cfg and only delivers to ACRN-DM those touching a byte set in
+ * dm_map. The BARs are emulated by the hypervisor with their writable bits in
+ * bar_mask: the sizing of a BAR is absorbed, the writes moving a BAR are
+ * delivered to ACRN-DM as well. The extended configuration space reads as not
+ * implemented.
+ */
+struct acrn_vdev_cfg_shadow {
+	/** the BDF of the device in the User VM */
+	uint16_t bdf;
+
+	/** Reserved */
+	uint16_t reserved[3];
+
+	/** the writable bits of the BARs, 0 for an unimplemented BAR */
+	uint32_t bar_mask[ACRN_PCI_NUM_BARS];
+
+	/** bit n set: the accesses to the byte at offset n go to ACRN-DM */
+	uint64_t dm_map[ACRN_VDEV_CFG_SHADOW_SIZE / 64U];
+
+	/** the configuration space as a read of the User VM returns it */
+	uint8_t cfg[ACRN_VDEV_CFG_SHADOW_SIZE];
+};
+
 #define ACRN_ASYNCIO_PIO	(0x01U)
 #define ACRN_ASYNCIO_MMIO	(0x02U)
+/* match any access within [addr, addr + len) instead of addr only */
+#define ACRN_ASYNCIO_RANGE	(0x10U)
 
 #define SBUF_MAGIC	0x5aa57aa71aa13aa3UL
 #define SBUF_MAX_SIZE	(1UL << 22U)
@@ -751,6 +1362,8 @@ struct acrn_vdev {
 /* sbuf flags */
 #define OVERRUN_CNT_EN	(1U << 0U) /* whether overrun counting is enabled */
 #define OVERWRITE_EN	(1U << 1U) /* whether overwrite is enabled */
+#define WATERMARK_NOTIFY_EN	(1U << 2U) /* whether to notify the Service VM when watermark bytes are buffered */
+#define VARLEN_EN	(1U << 3U) /* whether the data are variable-length records in place of ele_size elements */
 
 /**
  * (sbuf) head + buf (store (ele_num - 1) elements at most)
@@ -777,6 +1390,7 @@ enum {
 	ACRN_SBUF_PER_PCPU_ID_MAX,
 	ACRN_ASYNCIO = 64,
 	ACRN_VM_EVENT,
+	ACRN_COALESCED_MMIO,
 };
 
 /* Make sure sizeof(struct shared_buf) == SBUF_HEAD_SIZE */
@@ -790,7 +1404,8 @@ struct shared_buf {
 	uint32_t reserved;
 	uint32_t overrun_cnt;	/* count of overrun */
 	uint32_t size;		/* ele_num * ele_size */
-	uint32_t padding[6];
+	uint32_t watermark;	/* bytes buffered at which to notify, with WATERMARK_NOTIFY_EN */
+	uint32_t padding[5];
 };
 
 /**
@@ -832,8 +1447,9 @@ struct shared_buf {
 #define VM_EVENT_RTC_CHG	0U
 #define VM_EVENT_POWEROFF	1U
 #define VM_EVENT_TRIPLE_FAULT	2U
+#define VM_EVENT_STARTUP	3U
 
-#define VM_EVENT_COUNT		3U
+#define VM_EVENT_COUNT		4U
 
 #define VM_EVENT_DATA_LEN	28U
 
@@ -852,6 +1468,13 @@ struct rtc_change_event_data {
  */
 #define RTC_CHG_RELATIVE_PHYSICAL_RTC		0
 #define RTC_CHG_RELATIVE_SERVICE_VM_SYS_TIME	1
+
+/* sent once the BSP of a post-launched VM enters the guest for the first time */
+struct startup_event_data {
+	uint64_t created_us;	/* time(in usecs) create_vm took */
+	uint64_t started_us;	/* time(in usecs) from the start of create_vm to start_vm */
+	uint64_t entry_us;	/* time(in usecs) from the start of create_vm to the first VM entry */
+};
 /**
  * @}
  */
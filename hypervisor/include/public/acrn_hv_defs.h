@@ -29,6 +29,8 @@
 #define HC_GET_API_VERSION          BASE_HC_ID(HC_ID, HC_ID_GEN_BASE + 0x00UL)
 #define HC_SERVICE_VM_OFFLINE_CPU   BASE_HC_ID(HC_ID, HC_ID_GEN_BASE + 0x01UL)
 #define HC_SET_CALLBACK_VECTOR      BASE_HC_ID(HC_ID, HC_ID_GEN_BASE + 0x02UL)
+#define HC_MULTICALL                BASE_HC_ID(HC_ID, HC_ID_GEN_BASE + 0x03UL)
+#define HC_SET_HCALL_ARGS_PAGE      BASE_HC_ID(HC_ID, HC_ID_GEN_BASE + 0x04UL)
 
 /* VM management */
 #define HC_ID_VM_BASE               0x10UL
@@ -39,12 +41,22 @@
 #define HC_CREATE_VCPU              BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x04UL)
 #define HC_RESET_VM                 BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x05UL)
 #define HC_SET_VCPU_REGS            BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x06UL)
+#define HC_GET_VCPU_SCHED_STATS     BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x07UL)
+#define HC_GET_VCPU_EXIT_STATS      BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x08UL)
+#define HC_GET_VM_IO_HOTSPOTS       BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x09UL)
+#define HC_GET_VCPU_STATE           BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x0AUL)
+#define HC_SET_VCPU_STATE           BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x0BUL)
+#define HC_GET_VIOAPIC_STATE        BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x0CUL)
+#define HC_SET_VIOAPIC_STATE        BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x0DUL)
+#define HC_VM_LATENCY_PROBE         BASE_HC_ID(HC_ID, HC_ID_VM_BASE + 0x0EUL)
 
 /* IRQ and Interrupts */
 #define HC_ID_IRQ_BASE              0x20UL
 #define HC_INJECT_MSI               BASE_HC_ID(HC_ID, HC_ID_IRQ_BASE + 0x03UL)
 #define HC_VM_INTR_MONITOR          BASE_HC_ID(HC_ID, HC_ID_IRQ_BASE + 0x04UL)
 #define HC_SET_IRQLINE              BASE_HC_ID(HC_ID, HC_ID_IRQ_BASE + 0x05UL)
+#define HC_SEND_IPI                 BASE_HC_ID(HC_ID, HC_ID_IRQ_BASE + 0x06UL)
+#define HC_SET_PV_TIMER_PAGE        BASE_HC_ID(HC_ID, HC_ID_IRQ_BASE + 0x07UL)
 
 /* DM ioreq management */
 #define HC_ID_IOREQ_BASE            0x30UL
@@ -52,6 +64,10 @@
 #define HC_NOTIFY_REQUEST_FINISH    BASE_HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x01UL)
 #define HC_ASYNCIO_ASSIGN           BASE_HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x02UL)
 #define HC_ASYNCIO_DEASSIGN         BASE_HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x03UL)
+#define HC_NOTIFY_REQUEST_FINISH_BATCH BASE_HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x04UL)
+#define HC_ADD_COALESCED_MMIO       BASE_HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x05UL)
+#define HC_REMOVE_COALESCED_MMIO    BASE_HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x06UL)
+#define HC_SET_TSC_COUNTER          BASE_HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x07UL)
 
 
 /* Guest memory management */
@@ -60,6 +76,8 @@
 #define HC_VM_SET_MEMORY_REGIONS    BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x02UL)
 #define HC_VM_WRITE_PROTECT_PAGE    BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x03UL)
 #define HC_SETUP_SBUF               BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x04UL)
+#define HC_VM_GET_DIRTY_LOG         BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x05UL)
+#define HC_VM_SET_LAZY_MEMORY       BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x06UL)
 
 /* PCI assignment*/
 #define HC_ID_PCI_BASE              0x50UL
@@ -74,12 +92,15 @@
 #define HC_DEASSIGN_MMIODEV         BASE_HC_ID(HC_ID, HC_ID_PCI_BASE + 0x08UL)
 #define HC_ADD_VDEV                 BASE_HC_ID(HC_ID, HC_ID_PCI_BASE + 0x09UL)
 #define HC_REMOVE_VDEV              BASE_HC_ID(HC_ID, HC_ID_PCI_BASE + 0x0AUL)
+#define HC_ADD_VDEV_CFG_SHADOW      BASE_HC_ID(HC_ID, HC_ID_PCI_BASE + 0x0BUL)
+#define HC_REMOVE_VDEV_CFG_SHADOW   BASE_HC_ID(HC_ID, HC_ID_PCI_BASE + 0x0CUL)
 
 /* DEBUG */
 #define HC_ID_DBG_BASE              0x60UL
 #define HC_SETUP_HV_NPK_LOG         BASE_HC_ID(HC_ID, HC_ID_DBG_BASE + 0x01UL)
 #define HC_PROFILING_OPS            BASE_HC_ID(HC_ID, HC_ID_DBG_BASE + 0x02UL)
 #define HC_GET_HW_INFO              BASE_HC_ID(HC_ID, HC_ID_DBG_BASE + 0x03UL)
+#define HC_SET_TRACE_MASK           BASE_HC_ID(HC_ID, HC_ID_DBG_BASE + 0x04UL)
 
 /* Trusty */
 #define HC_ID_TRUSTY_BASE           0x70UL
@@ -90,12 +111,19 @@
 /* Power management */
 #define HC_ID_PM_BASE               0x80UL
 #define HC_PM_GET_CPU_STATE         BASE_HC_ID(HC_ID, HC_ID_PM_BASE + 0x00UL)
+#define HC_SET_VM_FREQ_POLICY       BASE_HC_ID(HC_ID, HC_ID_PM_BASE + 0x01UL)
+#define HC_GET_CPU_UTIL             BASE_HC_ID(HC_ID, HC_ID_PM_BASE + 0x02UL)
 
 /* X86 TEE */
 #define HC_ID_TEE_BASE              0x90UL
 #define HC_TEE_VCPU_BOOT_DONE	    BASE_HC_ID(HC_ID, HC_ID_TEE_BASE + 0x00UL)
 #define HC_SWITCH_EE		    BASE_HC_ID(HC_ID, HC_ID_TEE_BASE + 0x01UL)
 
+/* RDT */
+#define HC_ID_RDT_BASE              0xA0UL
+#define HC_SET_CLOS_CONFIG          BASE_HC_ID(HC_ID, HC_ID_RDT_BASE + 0x00UL)
+#define HC_GET_VM_RDT_MON           BASE_HC_ID(HC_ID, HC_ID_RDT_BASE + 0x01UL)
+
 #define ACRN_INVALID_VMID (0xffffU)
 #define ACRN_INVALID_HPA (~0UL)
 
@@ -225,6 +253,43 @@ struct hv_npk_log_param {
 	uint64_t mmio_addr;
 } __aligned(8);
 
+/**
+ * @brief Runtime enable mask of the trace events
+ *
+ * the parameter for HC_SET_TRACE_MASK hypercall. Bit n of the mask enables
+ * the trace event of index n, see trace_event_bit() for the indexes.
+ */
+struct acrn_trace_mask {
+	/** one bit per trace event, 1: the event is traced */
+	uint64_t mask[16];
+} __aligned(8);
+
+/**
+ * @brief A CLOS configuration to apply at runtime
+ *
+ * the parameter for HC_SET_CLOS_CONFIG hypercall. The entry is updated on
+ * all the pCPUs of the cache (or MBA) instance pcpu_id belongs to.
+ */
+struct acrn_clos_config {
+#define ACRN_RDT_RES_L3		1U
+#define ACRN_RDT_RES_L2		2U
+#define ACRN_RDT_RES_MBA	3U
+	/** the resource, ACRN_RDT_RES_* */
+	uint32_t res;
+
+	/** the entry: the CLOS, or 2 * CLOS (data) and 2 * CLOS + 1 (code) with CDP */
+	uint32_t clos;
+
+	/** any pCPU of the cache (or MBA) instance */
+	uint16_t pcpu_id;
+
+	/** Reserved */
+	uint16_t reserved[3];
+
+	/** the capacity bitmask for L2/L3, the delay for MBA */
+	uint64_t value;
+} __aligned(8);
+
 /**
  * the parameter for HC_GET_HW_INFO hypercall
  */
@@ -233,6 +298,48 @@ struct acrn_hw_info {
 	uint16_t reserved[3];
 } __aligned(8);
 
+/**
+ * @brief Info to get and clear the dirty log of a guest memory range
+ *
+ * the parameter for HC_VM_GET_DIRTY_LOG hypercall
+ */
+struct acrn_dirty_log {
+/* log the pages accessed instead of the pages written to */
+#define ACRN_DIRTY_LOG_ACCESSED	(1U << 0U)
+	uint32_t flags;
+
+	/** Reserved */
+	uint32_t reserved;
+
+	/** the page aligned guest physical address of the range */
+	uint64_t gpa;
+
+	/** the page aligned size of the range */
+	uint64_t size;
+
+	/** the gpa of the bitmap buffer, one bit per page of the range, set
+	 *  if the page was written to (or accessed) since the last call
+	 */
+	uint64_t bitmap_gpa;
+} __aligned(8);
+
+#define ACRN_LAZY_MEMORY_RANGES	2U
+
+/**
+ * @brief The guest RAM ranges the device model maps on demand
+ *
+ * the parameter for HC_VM_SET_LAZY_MEMORY hypercall. An access of the User
+ * VM to a page of them the EPT does not map yet may be taken as an
+ * asynchronous page fault. The ranges of size 0 are unused.
+ */
+struct acrn_lazy_memory {
+	/** the page aligned guest physical address of each range */
+	uint64_t gpa[ACRN_LAZY_MEMORY_RANGES];
+
+	/** the page aligned size of each range */
+	uint64_t size[ACRN_LAZY_MEMORY_RANGES];
+} __aligned(8);
+
 /**
  * Gpa to hpa translation parameter, used for HC_VM_GPA2HPA hypercall
  */
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/**
+ * @file acrn_ivshmem_virtio.h
+ *
+ * @brief virtio transport over an HV-land ivshmem region
+ *
+ * Two VMs sharing an ivshmem region run a virtio device over it: the
+ * virtqueues and every buffer they point to live in the region, so the data
+ * never leaves the two VMs and no Service VM component copies or sees it.
+ * The frontend VM runs the standard virtio driver of the device (virtio-net,
+ * virtio-vsock, ...) over this transport, the backend VM implements the
+ * device. Doorbells of the ivshmem devices replace the virtio notifications.
+ *
+ * An ivshmem device taking part in the transport has the subsystem vendor
+ * ID IVSHMEM_VIRTIO_SUBVENDOR_ID, the subsystem ID
+ * IVSHMEM_VIRTIO_SUBDEV_BASE + virtio device ID, and its role in the
+ * programming interface of its class code.
+ */
+
+#ifndef ACRN_IVSHMEM_VIRTIO_H
+#define ACRN_IVSHMEM_VIRTIO_H
+
+#include <types.h>
+
+#define IVSHMEM_VIRTIO_SUBVENDOR_ID	0x1af4U
+#define IVSHMEM_VIRTIO_SUBDEV_BASE	0x4000U
+
+#define IVSHMEM_VIRTIO_FRONTEND		0U
+#define IVSHMEM_VIRTIO_BACKEND		1U
+
+#define IVSHMEM_VIRTIO_MAGIC		0x4f495649U	/* "IVIO" */
+#define IVSHMEM_VIRTIO_VERSION		1U
+#define IVSHMEM_VIRTIO_MAX_QUEUES	8U
+
+/* status, written by the backend with the virtio device status bits once set */
+#define IVSHMEM_VIRTIO_BACKEND_READY	(1U << 0U)
+#define IVSHMEM_VIRTIO_FRONTEND_READY	(1U << 1U)
+
+/*
+ * Doorbell vectors: the frontend rings IVSHMEM_VIRTIO_VECTOR_QUEUE(q) of the
+ * backend when it has made buffers available on queue q, the backend rings
+ * the same vector of the frontend when it has used some. Configuration and
+ * status changes ring IVSHMEM_VIRTIO_VECTOR_CONFIG.
+ */
+#define IVSHMEM_VIRTIO_VECTOR_CONFIG	0U
+#define IVSHMEM_VIRTIO_VECTOR_QUEUE(q)	((q) + 1U)
+
+/**
+ * @brief a virtqueue in the region
+ *
+ * The offsets are from the start of the region. The descriptors use
+ * offsets from the start of the region as addresses, the region is mapped
+ * at a different guest physical address in each VM.
+ */
+struct ivshmem_virtio_queue {
+	/** number of descriptors, a power of 2, 0 if the queue is not set up */
+	uint16_t size;
+	uint16_t reserved[3];
+	/** offsets of the split virtqueue rings */
+	uint64_t desc;
+	uint64_t avail;
+	uint64_t used;
+};
+
+/**
+ * @brief header at the start of the region
+ *
+ * The backend initializes it before setting IVSHMEM_VIRTIO_BACKEND_READY.
+ * The buffer pool the frontend allocates the buffers of the virtqueues from
+ * spans [pool_offset, pool_offset + pool_size).
+ */
+struct ivshmem_virtio_header {
+	uint32_t magic;
+	uint16_t version;
+	/** virtio device ID */
+	uint16_t device_id;
+	/** ivshmem peer IDs (IVSHMEM_IV_POS_REG) of the two sides */
+	uint16_t frontend_id;
+	uint16_t backend_id;
+	/** IVSHMEM_VIRTIO_*_READY */
+	uint32_t status;
+	/** virtio device status, written by the frontend */
+	uint32_t device_status;
+	uint32_t config_generation;
+	/** feature bits offered by the backend and accepted by the frontend */
+	uint64_t device_features;
+	uint64_t driver_features;
+	uint16_t num_queues;
+	uint16_t reserved[3];
+	struct ivshmem_virtio_queue queues[IVSHMEM_VIRTIO_MAX_QUEUES];
+	uint64_t pool_offset;
+	uint64_t pool_size;
+	/** device specific configuration space */
+	uint8_t config[256];
+} __aligned(64);
+
+#endif /* ACRN_IVSHMEM_VIRTIO_H */
@@ -0,0 +1,13 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <types.h>
+#include <flightrec.h>
+
+void flightrec_init(__unused uint16_t pcpu_id) {}
+void flightrec_put(__unused uint32_t evid, __unused uint64_t e, __unused uint64_t f) {}
+void flightrec_put_str(__unused uint32_t evid, __unused const char *str) {}
+void flightrec_dump(__unused bool thaw) {}
@@ -6,10 +6,31 @@
 
 #include <types.h>
 #include <errno.h>
+#include <asm/cpu.h>
+#include <asm/per_cpu.h>
 
-int32_t sbuf_share_setup(__unused uint16_t pcpu_id,
-		__unused uint32_t sbuf_id, __unused uint64_t *hva)
+/* only the trace sbufs are shared in the release version, for the runtime enabled tracepoints */
+int32_t sbuf_share_setup(uint16_t pcpu_id, uint32_t sbuf_id, uint64_t *hva)
 {
-	return -EPERM;
+	int32_t ret = -EPERM;
+
+	if (pcpu_id >= get_pcpu_nums()) {
+		ret = -EINVAL;
+	} else if (sbuf_id == ACRN_TRACE) {
+		per_cpu(sbuf, pcpu_id)[sbuf_id] = (struct shared_buf *) hva;
+		ret = 0;
+	} else {
+		/* the other sbufs are for debug only */
+	}
+
+	return ret;
+}
+
+void sbuf_reset(void)
+{
+	uint16_t pcpu_id;
+
+	for (pcpu_id = 0U; pcpu_id < get_pcpu_nums(); pcpu_id++) {
+		per_cpu(sbuf, pcpu_id)[ACRN_TRACE] = NULL;
+	}
 }
-void sbuf_reset(void) {}
@@ -5,15 +5,77 @@
  */
 
 #include <types.h>
+#include <asm/per_cpu.h>
+#include <ticks.h>
+#include <sbuf.h>
+#include <trace.h>
 
-void TRACE_2L(__unused uint32_t evid, __unused uint64_t e, __unused uint64_t f) {}
+/*
+ * The release version traces in the fixed trace_entry format only, and only
+ * the events the Service VM enabled with HC_SET_TRACE_MASK.
+ */
+uint64_t trace_event_mask[TRACE_MASK_WORDS];
 
-void TRACE_4I(__unused uint32_t evid, __unused uint32_t a, __unused uint32_t b,
-		__unused uint32_t c, __unused uint32_t d)
+void trace_set_event_mask(const uint64_t *mask)
 {
+	uint32_t i;
+
+	for (i = 0U; i < TRACE_MASK_WORDS; i++) {
+		trace_event_mask[i] = mask[i];
+	}
 }
 
-void TRACE_6C(__unused uint32_t evid, __unused uint8_t a1, __unused uint8_t a2,
-		__unused uint8_t a3, __unused uint8_t a4, __unused uint8_t b1, __unused uint8_t b2)
+static void trace_put(uint32_t evid, uint32_t n_data, struct trace_entry *entry)
 {
+	uint16_t cpu_id = get_pcpu_id();
+	struct shared_buf *sbuf = per_cpu(sbuf, cpu_id)[ACRN_TRACE];
+	bool varlen;
+
+	if (sbuf != NULL) {
+		stac();
+		varlen = ((sbuf->flags & VARLEN_EN) != 0U);
+		clac();
+
+		/* the compact format is not built in the release version */
+		if (!varlen) {
+			entry->tsc = cpu_ticks();
+			entry->id = evid;
+			entry->n_data = (uint8_t)n_data;
+			entry->cpu = (uint8_t)cpu_id;
+			(void)sbuf_put(sbuf, (uint8_t *)entry);
+		}
+	}
+}
+
+void trace_put_2l(uint32_t evid, uint64_t e, uint64_t f)
+{
+	struct trace_entry entry;
+
+	entry.payload.fields_64.e = e;
+	entry.payload.fields_64.f = f;
+	trace_put(evid, 2U, &entry);
+}
+
+void trace_put_4i(uint32_t evid, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+	struct trace_entry entry;
+
+	entry.payload.fields_32.a = a;
+	entry.payload.fields_32.b = b;
+	entry.payload.fields_32.c = c;
+	entry.payload.fields_32.d = d;
+	trace_put(evid, 4U, &entry);
+}
+
+void trace_put_6c(uint32_t evid, uint8_t a1, uint8_t a2, uint8_t a3, uint8_t a4, uint8_t b1, uint8_t b2)
+{
+	struct trace_entry entry;
+
+	entry.payload.fields_8.a1 = a1;
+	entry.payload.fields_8.a2 = a2;
+	entry.payload.fields_8.a3 = a3;
+	entry.payload.fields_8.a4 = a4;
+	entry.payload.fields_8.b1 = b1;
+	entry.payload.fields_8.b2 = b2;
+	trace_put(evid, 8U, &entry);
 }
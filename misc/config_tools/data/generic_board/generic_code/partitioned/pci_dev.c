@@ -10,6 +10,7 @@
 #include <asm/page.h>
 #include <vmcs9900.h>
 #include <ivshmem_cfg.h>
+#include <util.h>
 #define INVALID_PCI_BASE 0U
 struct acrn_vm_pci_dev_config vm0_pci_devs[VM0_CONFIG_PCI_DEV_NUM] = {
 	{
@@ -78,3 +79,40 @@ struct acrn_vm_pci_dev_config vm1_pci_devs[VM1_CONFIG_PCI_DEV_NUM] = {
 		.vbar_base[0] = 0x80000000UL,
 	},
 };
+/* pBDF sorted, the last entry only ends the array */
+const struct acrn_prelaunched_ptdev prelaunched_ptdevs[] = {
+	{
+		.pbdf.bits =
+			{
+				.b = 0x00U,
+				.d = 0x14U,
+				.f = 0x00U,
+			},
+		.vm_id = 1U,
+		.dev_idx = VM1_CONFIG_PCI_DEV_NUM - 1U,
+	},
+	{
+		.pbdf.bits =
+			{
+				.b = 0x00U,
+				.d = 0x17U,
+				.f = 0x00U,
+			},
+		.vm_id = 0U,
+		.dev_idx = VM0_CONFIG_PCI_DEV_NUM - 2U,
+	},
+	{
+		.pbdf.bits =
+			{
+				.b = 0x00U,
+				.d = 0x1FU,
+				.f = 0x06U,
+			},
+		.vm_id = 0U,
+		.dev_idx = VM0_CONFIG_PCI_DEV_NUM - 1U,
+	},
+	{
+		.vm_id = ACRN_INVALID_VMID,
+	},
+};
+const uint16_t prelaunched_ptdev_num = (uint16_t)(ARRAY_SIZE(prelaunched_ptdevs) - 1U);
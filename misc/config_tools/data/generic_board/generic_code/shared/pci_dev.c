@@ -10,5 +10,13 @@
 #include <asm/page.h>
 #include <vmcs9900.h>
 #include <ivshmem_cfg.h>
+#include <util.h>
 #define INVALID_PCI_BASE 0U
 struct acrn_vm_pci_dev_config sos_pci_devs[CONFIG_MAX_PCI_DEV_NUM] = {};
+/* pBDF sorted, the last entry only ends the array */
+const struct acrn_prelaunched_ptdev prelaunched_ptdevs[] = {
+	{
+		.vm_id = ACRN_INVALID_VMID,
+	},
+};
+const uint16_t prelaunched_ptdev_num = (uint16_t)(ARRAY_SIZE(prelaunched_ptdevs) - 1U);
@@ -275,7 +275,12 @@ def generate_for_one_vm(board_etree, hv_scenario_etree, vm_scenario_etree, vm_id
 
     if eval_xpath(vm_scenario_etree, "//SSRAM_ENABLED") == "y" and \
             eval_xpath(vm_scenario_etree, ".//vm_type/text()") == "RTVM":
-        script.add_plain_dm_parameter("--ssram")
+        ssram_size = int(eval_xpath(vm_scenario_etree, ".//ssram_size/text()", "0"))
+        if ssram_size > 0:
+            # the share of the VM, as one L3 buffer for all its vCPUs
+            script.add_plain_dm_parameter(f"--ssram L3,vcpu=all,size={ssram_size}K")
+        else:
+            script.add_plain_dm_parameter("--ssram")
 
     ###
     # Guest BIOS
@@ -0,0 +1,51 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2022 Intel Corporation.
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+
+import sys, os
+sys.path.append(os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'library'))
+import acrn_config_utilities
+from acrn_config_utilities import get_node
+
+# EPT page pool of the pre-launched VMs
+# The hypervisor sizes the EPT page pool of a VM for the whole host RAM mapped with 4K pages, plus the BARs of
+# CONFIG_MAX_PCI_DEV_NUM devices. A pre-launched VM maps only its own memory and devices, both known here, so its
+# pool is sized with the same worst case over what the VM really maps:
+#   - its RAM and the 4GB below, where the low MMIO and the ACPI/SSRAM/EPC regions are;
+#   - six 64-bit BARs (three BARs plus three VF BARs) for each of its PCI devices, one PD and one PT page each.
+# The PML4 and PDPT pages are added by the hypervisor. The Service VM maps all the host RAM and the memory of a
+# post-launched VM is only known when it is launched, the hypervisor keeps sizing their pools from the host RAM.
+
+BARS_PER_DEV = 6
+
+def page_num(size, page_size):
+    return (size + page_size - 1) // page_size
+
+def vm_ram_size(vm_node):
+    size_mb = sum(int(size) for size in vm_node.xpath("./memory/hpa_region/size_hpa/text()"))
+    size_mb += sum(int(size) for size in vm_node.xpath("./memory/size/text()"))
+    return size_mb * acrn_config_utilities.SIZE_M
+
+def vm_pci_dev_num(scenario_etree, vm_node):
+    vm_name = get_node("./name/text()", vm_node)
+    pt_devs = len(vm_node.xpath("./pci_devs/pci_dev[text() != '']"))
+    ivshmem_devs = len(scenario_etree.xpath(f"//IVSHMEM_VM[VM_NAME = '{vm_name}']"))
+    vuart_devs = len(scenario_etree.xpath(f"//vuart_connection[type = 'pci']/endpoint[vm_name = '{vm_name}']"))
+    # the virtual host bridge and the console vUART
+    return pt_devs + ivshmem_devs + vuart_devs + 2
+
+def fn(board_etree, scenario_etree, allocation_etree):
+    for vm_node in scenario_etree.xpath("//vm[load_order = 'PRE_LAUNCHED_VM']"):
+        vm_id = vm_node.get('id')
+        mapped_size = vm_ram_size(vm_node) + acrn_config_utilities.SIZE_4G
+        bar_pages = vm_pci_dev_num(scenario_etree, vm_node) * BARS_PER_DEV
+        pd_pages = page_num(mapped_size, acrn_config_utilities.SIZE_G) + bar_pages
+        pt_pages = page_num(mapped_size, 2 * acrn_config_utilities.SIZE_M) + bar_pages
+
+        allocation_vm_node = get_node(f"/acrn-config/vm[@id = '{vm_id}']", allocation_etree)
+        if allocation_vm_node is None:
+            allocation_vm_node = acrn_config_utilities.append_node("/acrn-config/vm", None, allocation_etree, id = vm_id)
+        acrn_config_utilities.append_node("./ept_page_num", str(pd_pages + pt_pages), allocation_vm_node)
@@ -20,6 +20,12 @@ policies = [
     GuestFlagPolicy(".//virtual_cat_support = 'y'", "GUEST_FLAG_VCAT_ENABLED"),
     GuestFlagPolicy(".//secure_world_support = 'y'", "GUEST_FLAG_SECURE_WORLD_ENABLED"),
     GuestFlagPolicy(".//hide_mtrr_support = 'y'", "GUEST_FLAG_HIDE_MTRR"),
+    GuestFlagPolicy(".//dirty_log_support = 'y'", "GUEST_FLAG_DIRTY_LOG"),
+    GuestFlagPolicy(".//pv_ipi_support = 'y'", "GUEST_FLAG_PV_IPI"),
+    GuestFlagPolicy(".//pv_timer_support = 'y'", "GUEST_FLAG_PV_TIMER"),
+    GuestFlagPolicy(".//pv_clock_support = 'y'", "GUEST_FLAG_PV_CLOCK"),
+    GuestFlagPolicy(".//idle_passthrough = 'y'", "GUEST_FLAG_IDLE_PT"),
+    GuestFlagPolicy(".//vpmu_support = 'y'", "GUEST_FLAG_VPMU"),
     GuestFlagPolicy(".//nested_virtualization_support = 'y'", "GUEST_FLAG_NVMX_ENABLED"),
     GuestFlagPolicy(".//security_vm = 'y'", "GUEST_FLAG_SECURITY_VM"),
     GuestFlagPolicy(".//vm_type = 'RTVM'", "GUEST_FLAG_RT"),
@@ -72,6 +72,10 @@
       <xsl:with-param name="value" select="'y'" />
     </xsl:call-template>
 
+    <xsl:call-template name="boolean-by-key">
+      <xsl:with-param name="key" select="'SCHED_BALANCE_ENABLED'" />
+    </xsl:call-template>
+
     <xsl:call-template name="boolean-by-key">
       <xsl:with-param name="key" select="'SPLIT_LOCK_DETECTION_ENABLED'" />
     </xsl:call-template>
@@ -172,9 +176,7 @@
       <xsl:with-param name="value" select="//allocation-data/acrn-config/platform/MAX_PCI_BUS_NUM" />
     </xsl:call-template>
 
-    <xsl:call-template name="integer-by-key">
-      <xsl:with-param name="key" select="'MAX_PCI_DEV_NUM'" />
-    </xsl:call-template>
+    <xsl:call-template name="pci-dev-max" />
 
     <xsl:call-template name="integer-by-key">
       <xsl:with-param name="key" select="'MAX_PT_IRQ_ENTRIES'" />
@@ -250,6 +252,15 @@
     </xsl:call-template>
   </xsl:template>
 
+  <!-- The vdevs of the Service VM also cover the VFs the SR-IOV devices of the board can expose. -->
+  <xsl:template name="pci-dev-max">
+    <xsl:variable name="board_devs" select="count(//board-data//bus[@type = 'pci']/device) + sum(//board-data//capability[@id = 'SR-IOV']/total_vfs)" />
+    <xsl:call-template name="integer-by-key-value">
+      <xsl:with-param name="key" select="'MAX_PCI_DEV_NUM'" />
+      <xsl:with-param name="value" select="acrn:max($board_devs, //CAPACITIES/MAX_PCI_DEV_NUM)" />
+    </xsl:call-template>
+  </xsl:template>
+
   <xsl:template name="msi-msix-max">
     <xsl:variable name="max">
       <xsl:for-each select="//capability[@id='MSI' or @id='MSI-X']/*[starts-with(local-name(), 'count') or starts-with(local-name(), 'table_size')]">
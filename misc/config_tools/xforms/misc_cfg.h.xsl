@@ -38,6 +38,7 @@
       <xsl:call-template name="sos_bootargs_diff" />
     </xsl:if>
     <xsl:call-template name="cpu_affinity" />
+    <xsl:call-template name="sched_edf" />
     <xsl:call-template name="rdt" />
     <xsl:call-template name="vm0_passthrough_tpm" />
     <xsl:call-template name="vm_config_pci_dev_num" />
@@ -114,6 +115,17 @@
   </xsl:for-each>
 </xsl:template>
 
+<xsl:template name="sched_edf">
+  <xsl:choose>
+    <xsl:when test="count(hv/FEATURES/SCHED_EDF_CPUS/pcpu_id)">
+      <xsl:value-of select="acrn:define('SCHED_EDF_PCPU_BITMAP', concat('(', acrn:string-join(hv/FEATURES/SCHED_EDF_CPUS/pcpu_id, '|', '(1UL &lt;&lt; ', 'U)'), ')'), '')" />
+    </xsl:when>
+    <xsl:otherwise>
+      <xsl:value-of select="acrn:define('SCHED_EDF_PCPU_BITMAP', 0, 'UL')" />
+    </xsl:otherwise>
+  </xsl:choose>
+</xsl:template>
+
 <!-- HV_SUPPORTED_MAX_CLOS:
   The maximum CLOS that is allowed by ACRN hypervisor.
   Its value is set to be least common Max CLOS (CPUID.(EAX=0x10,ECX=ResID):EDX[15:0])
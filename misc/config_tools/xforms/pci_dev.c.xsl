@@ -24,10 +24,40 @@
     <xsl:value-of select="acrn:include('asm/page.h')" />
     <xsl:value-of select="acrn:include('vmcs9900.h')" />
     <xsl:value-of select="acrn:include('ivshmem_cfg.h')" />
+    <xsl:value-of select="acrn:include('util.h')" />
 
     <xsl:value-of select="acrn:define('INVALID_PCI_BASE', '0', 'U')" />
 
     <xsl:apply-templates select="config-data/acrn-config/vm" />
+    <xsl:call-template name="prelaunched_ptdevs" />
+  </xsl:template>
+
+  <!-- The passthrough devices of all the pre-launched VMs, sorted by pBDF for a binary search.
+       They are the last entries of the pci_devs of their VM. -->
+  <xsl:template name="prelaunched_ptdevs">
+    <xsl:value-of select="acrn:comment('pBDF sorted, the last entry only ends the array')" />
+    <xsl:value-of select="$newline" />
+    <xsl:value-of select="acrn:array-initializer('const struct acrn_prelaunched_ptdev', 'prelaunched_ptdevs', '')" />
+    <xsl:for-each select="config-data/acrn-config/vm[acrn:is-pre-launched-vm(load_order)]/pci_devs/pci_dev[text() != '']">
+      <xsl:sort select="translate(substring-before(text(), ' '), $uppercase, $lowercase)" />
+      <xsl:variable name="vm_id" select="../../@id" />
+      <xsl:variable name="from_end" select="count(following-sibling::pci_dev[text() != '']) + 1" />
+      <xsl:text>{</xsl:text>
+      <xsl:value-of select="$newline" />
+      <xsl:value-of select="acrn:initializer('pbdf.bits', acrn:get-pbdf(text()), '')" />
+      <xsl:value-of select="acrn:initializer('vm_id', concat($vm_id, 'U'), '')" />
+      <xsl:value-of select="acrn:initializer('dev_idx', concat('VM', $vm_id, '_CONFIG_PCI_DEV_NUM - ', $from_end, 'U'), '')" />
+      <xsl:text>},</xsl:text>
+      <xsl:value-of select="$newline" />
+    </xsl:for-each>
+    <xsl:text>{</xsl:text>
+    <xsl:value-of select="$newline" />
+    <xsl:value-of select="acrn:initializer('vm_id', 'ACRN_INVALID_VMID', '')" />
+    <xsl:text>},</xsl:text>
+    <xsl:value-of select="$newline" />
+    <xsl:value-of select="$end_of_array_initializer" />
+    <xsl:text>const uint16_t prelaunched_ptdev_num = (uint16_t)(ARRAY_SIZE(prelaunched_ptdevs) - 1U);</xsl:text>
+    <xsl:value-of select="$newline" />
   </xsl:template>
 
   <xsl:template match="config-data/acrn-config/vm">
@@ -116,9 +116,14 @@
     <xsl:value-of select="acrn:initializer('bvt_warp_value', bvt_warp_value)" />
     <xsl:value-of select="acrn:initializer('bvt_warp_limit', bvt_warp_limit)" />
     <xsl:value-of select="acrn:initializer('bvt_unwarp_period', bvt_unwarp_period)" />
+    <xsl:value-of select="acrn:initializer('edf_budget_us', concat(edf_budget, 'U'))" />
+    <xsl:value-of select="acrn:initializer('edf_period_us', concat(edf_period, 'U'))" />
     <xsl:text>},</xsl:text>
     <xsl:value-of select="$newline" />
+    <xsl:value-of select="acrn:initializer('ple_gap', concat(ple_gap, 'U'))" />
+    <xsl:value-of select="acrn:initializer('ple_window', concat(ple_window, 'U'))" />
     <xsl:value-of select="acrn:initializer('companion_vm_id', concat(companion_vmid, 'U'))" />
+    <xsl:value-of select="acrn:initializer('ssram_kb', concat(ssram_size, 'U'))" />
     <xsl:call-template name="guest_flags" />
 
     <xsl:if test="acrn:is-rdt-enabled()">
@@ -129,6 +134,7 @@
     <xsl:apply-templates select="epc_section" />
     <xsl:if test="acrn:is-pre-launched-vm(load_order)">
       <xsl:apply-templates select="memory" />
+      <xsl:call-template name="ept_page_num" />
     </xsl:if>
     <xsl:apply-templates select="os_config" />
     <xsl:call-template name="acpi_config" />
@@ -228,6 +234,13 @@
     <xsl:value-of select="$newline" />
   </xsl:template>
 
+  <xsl:template name="ept_page_num">
+    <xsl:variable name="vm_id" select="@id" />
+    <xsl:for-each select="//allocation-data/acrn-config/vm[@id=$vm_id]/ept_page_num">
+      <xsl:value-of select="acrn:initializer('ept_page_num', concat(text(), 'U'))" />
+    </xsl:for-each>
+  </xsl:template>
+
   <xsl:template match="epc_section">
     <xsl:if test="base != '0' and size != '0'">
     <xsl:value-of select="acrn:initializer('epc', '{', true())" />
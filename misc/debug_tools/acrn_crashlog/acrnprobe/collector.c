@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * The logs of an event are collected by a pool of workers, the event
+ * handler only decides what to collect and where. Copying the logs of
+ * many VMs after an incident then neither waits on one another nor holds
+ * up the handling of the next events.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include "channels.h"
+#include "collector.h"
+#include "log_sys.h"
+
+struct collect_job {
+	void (*fn)(void *);
+	void *arg;
+	TAILQ_ENTRY(collect_job) entries;
+};
+
+static pthread_mutex_t cq_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cq_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static TAILQ_HEAD(, collect_job) collect_q = TAILQ_HEAD_INITIALIZER(collect_q);
+static int busy_jobs;
+
+/**
+ * Queue a collection to the workers.
+ *
+ * @param fn The collection, it owns arg.
+ * @param arg The arg of fn.
+ *
+ * @return 0 if successful, or -1 if not, fn is not called then.
+ */
+int collect_async(void (*fn)(void *), void *arg)
+{
+	struct collect_job *job;
+
+	job = malloc(sizeof(*job));
+	if (!job) {
+		LOGE("out of memory\n");
+		return -1;
+	}
+	job->fn = fn;
+	job->arg = arg;
+
+	pthread_mutex_lock(&cq_mtx);
+	TAILQ_INSERT_TAIL(&collect_q, job, entries);
+	busy_jobs++;
+	pthread_cond_signal(&cq_cond);
+	pthread_mutex_unlock(&cq_mtx);
+
+	return 0;
+}
+
+/**
+ * Wait for all the queued collections to be done.
+ */
+void collect_wait_idle(void)
+{
+	pthread_mutex_lock(&cq_mtx);
+	while (busy_jobs)
+		pthread_cond_wait(&idle_cond, &cq_mtx);
+	pthread_mutex_unlock(&cq_mtx);
+}
+
+static void *collect_worker(void *unused __attribute__((unused)))
+{
+	struct collect_job *job;
+
+	while (1) {
+		pthread_mutex_lock(&cq_mtx);
+		while (TAILQ_EMPTY(&collect_q))
+			pthread_cond_wait(&cq_cond, &cq_mtx);
+		job = TAILQ_FIRST(&collect_q);
+		TAILQ_REMOVE(&collect_q, job, entries);
+		pthread_mutex_unlock(&cq_mtx);
+
+		job->fn(job->arg);
+		free(job);
+
+		pthread_mutex_lock(&cq_mtx);
+		if (--busy_jobs == 0)
+			pthread_cond_broadcast(&idle_cond);
+		pthread_mutex_unlock(&cq_mtx);
+	}
+
+	return NULL;
+}
+
+/**
+ * Start the collection workers.
+ *
+ * @return 0 if successful, or errno if not.
+ */
+int init_collector(void)
+{
+	pthread_t pid;
+	int i;
+	int ret;
+
+	for (i = 0; i < COLLECT_WORKERS; i++) {
+		ret = create_detached_thread(&pid, &collect_worker, NULL);
+		if (ret) {
+			LOGE("create collector failed (%s)\n", strerror(ret));
+			return ret;
+		}
+	}
+	return 0;
+}
@@ -18,6 +18,7 @@
 #include "event_handler.h"
 #include "startupreason.h"
 #include "android_events.h"
+#include "collector.h"
 
 /* Watchdog timeout in second*/
 #define WDT_TIMEOUT 300
@@ -129,7 +130,8 @@ static void watchdog_init(int timeout)
 
 /**
  * Process each event in event queue.
- * Note that currently event handler is single threaded.
+ * Note that currently event handler is single threaded, the logs of the
+ * events are collected by the collectors.
  */
 static void *event_handle(void *unused __attribute__((unused)))
 {
@@ -170,9 +172,11 @@ static void *event_handle(void *unused __attribute__((unused)))
 
 			read_startupreason(reason, sizeof(reason));
 			if (!strcmp(reason, "WARM") ||
-			    !strcmp(reason, "WATCHDOG"))
+			    !strcmp(reason, "WATCHDOG")) {
+				collect_wait_idle();
 				if (exec_out2file(NULL, "reboot") == -1)
 					break;
+			}
 		}
 
 		if (e->event_type == VM) {
@@ -27,6 +27,7 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "fsutils.h"
 #include "load_conf.h"
 #include "history.h"
@@ -56,6 +57,21 @@ static int current_lines;
 static char *all_events_cnt;
 static size_t all_events_size;
 
+/*
+ * How far the incremental logs were collected, per source file. A log
+ * collected again starts from there, while the file is the same one.
+ */
+struct log_offset {
+	char *path;
+	ino_t ino;
+	off_t off;
+};
+
+static char *log_offsets_file;
+static struct log_offset *log_offsets;
+static int log_offsets_cnt;
+static pthread_mutex_t log_offsets_mtx = PTHREAD_MUTEX_INITIALIZER;
+
 static int event_count_file_path(char *path, size_t size)
 {
 	struct sender_t *crashlog = get_sender_by_name("crashlog");
@@ -392,6 +408,131 @@ static int get_time_from_firstline(char *buffer, size_t size)
 	return 0;
 }
 
+static struct log_offset *find_log_offset(const char *path)
+{
+	int i;
+
+	for (i = 0; i < log_offsets_cnt; i++)
+		if (!strcmp(log_offsets[i].path, path))
+			return &log_offsets[i];
+	return NULL;
+}
+
+static struct log_offset *add_log_offset(const char *path)
+{
+	struct log_offset *tmp;
+
+	tmp = realloc(log_offsets, (log_offsets_cnt + 1) * sizeof(*tmp));
+	if (!tmp)
+		return NULL;
+	log_offsets = tmp;
+	tmp = &log_offsets[log_offsets_cnt];
+	tmp->path = strdup(path);
+	if (!tmp->path)
+		return NULL;
+	log_offsets_cnt++;
+	return tmp;
+}
+
+static void load_log_offsets(void)
+{
+	FILE *fp;
+	char line[MAXLINESIZE];
+	char path[MAXLINESIZE];
+	unsigned long ino;
+	long long off;
+	struct log_offset *lo;
+
+	fp = fopen(log_offsets_file, "r");
+	if (!fp)
+		return;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%lu %lld %[^\n]", &ino, &off, path) != 3)
+			continue;
+		lo = add_log_offset(path);
+		if (!lo)
+			break;
+		lo->ino = (ino_t)ino;
+		lo->off = (off_t)off;
+	}
+	fclose(fp);
+}
+
+static void store_log_offsets(void)
+{
+	FILE *fp;
+	char *tmp;
+	int i;
+
+	if (asprintf(&tmp, "%s.tmp", log_offsets_file) == -1) {
+		LOGE("out of memory\n");
+		return;
+	}
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		LOGE("failed to open (%s), error (%s)\n", tmp, strerror(errno));
+		goto free;
+	}
+	for (i = 0; i < log_offsets_cnt; i++)
+		fprintf(fp, "%lu %lld %s\n", (unsigned long)log_offsets[i].ino,
+			(long long)log_offsets[i].off, log_offsets[i].path);
+	if (fclose(fp) == 0)
+		rename(tmp, log_offsets_file);
+	else
+		unlink(tmp);
+free:
+	free(tmp);
+}
+
+/**
+ * Get where the last collection of an incremental log ended.
+ *
+ * @param path The source file of the log.
+ * @param ino The inode of the source file now, a rotated file starts over.
+ *
+ * @return the offset to collect the log from.
+ */
+off_t hist_get_log_offset(const char *path, ino_t ino)
+{
+	struct log_offset *lo;
+	off_t off = 0;
+
+	pthread_mutex_lock(&log_offsets_mtx);
+	lo = find_log_offset(path);
+	if (lo && lo->ino == ino)
+		off = lo->off;
+	pthread_mutex_unlock(&log_offsets_mtx);
+
+	return off;
+}
+
+/**
+ * Record where the collection of an incremental log ended.
+ *
+ * @param path The source file of the log.
+ * @param ino The inode of the source file.
+ * @param off The size of the source file which was collected.
+ */
+void hist_set_log_offset(const char *path, ino_t ino, off_t off)
+{
+	struct log_offset *lo;
+
+	if (!log_offsets_file)
+		return;
+
+	pthread_mutex_lock(&log_offsets_mtx);
+	lo = find_log_offset(path);
+	if (!lo)
+		lo = add_log_offset(path);
+	if (lo) {
+		lo->ino = ino;
+		lo->off = off;
+		store_log_offsets();
+	}
+	pthread_mutex_unlock(&log_offsets_mtx);
+}
+
 int prepare_history(void)
 {
 	int ret;
@@ -415,6 +556,16 @@ int prepare_history(void)
 		}
 	}
 
+	if (!log_offsets_file) {
+		ret = asprintf(&log_offsets_file, "%s/%s", crashlog->outdir,
+			       LOG_OFFSETS_NAME);
+		if (ret < 0) {
+			LOGE("compute string failed, out of memory\n");
+			return -ENOMEM;
+		}
+		load_log_offsets();
+	}
+
 	ret = get_time_from_firstline(linebuf, MAXLINESIZE);
 	if (ret == 0) {
 		current_lines = count_lines_in_file(history_file);
@@ -0,0 +1,16 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef __COLLECTOR_H__
+#define __COLLECTOR_H__
+
+/* logs of different events collected at once */
+#define COLLECT_WORKERS	4
+
+int collect_async(void (*fn)(void *), void *arg);
+void collect_wait_idle(void);
+int init_collector(void);
+
+#endif
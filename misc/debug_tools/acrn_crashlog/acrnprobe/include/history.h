@@ -22,7 +22,10 @@
 #ifndef __HISTORY_H__
 #define __HISTORY_H__
 
+#include <sys/types.h>
+
 #define HISTORY_NAME		"history_event"
+#define LOG_OFFSETS_NAME	"log_offsets"
 
 extern char *history_file;
 
@@ -31,5 +34,7 @@ void hist_raise_infoerror(const char *type, size_t tlen);
 void hist_raise_uptime(char *lastuptime);
 void hist_raise_event(const char *event, const char *type, const char *log,
 			const char *lastuptime, const char *key);
+off_t hist_get_log_offset(const char *path, ino_t ino);
+void hist_set_log_offset(const char *path, ino_t ino, off_t off);
 
 #endif
@@ -65,6 +65,10 @@ struct log_t {
 	size_t		deletesource_len;
 	const char	*sizelimit;
 	size_t		sizelimit_len;
+	const char	*compress;
+	size_t		compress_len;
+	const char	*incremental;
+	size_t		incremental_len;
 
 	void (*get)(struct log_t *, void *);
 };
@@ -75,6 +75,8 @@ static void print(void)
 		print_id_item(lines, log, id);
 		print_id_item(path, log, id);
 		print_id_item(sizelimit, log, id);
+		print_id_item(compress, log, id);
+		print_id_item(incremental, log, id);
 	}
 
 	for_each_info(id, info, conf) {
@@ -456,6 +458,10 @@ static int parse_log(xmlNodePtr cur, struct log_t *log)
 			res = load_cur_content(cur, log, lines);
 		else if (name_is(cur, "sizelimit"))
 			res = load_cur_content(cur, log, sizelimit);
+		else if (name_is(cur, "compress"))
+			res = load_cur_content(cur, log, compress);
+		else if (name_is(cur, "incremental"))
+			res = load_cur_content(cur, log, incremental);
 
 		if (res)
 			return -1;
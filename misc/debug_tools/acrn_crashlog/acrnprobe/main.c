@@ -19,6 +19,7 @@
 #include "event_queue.h"
 #include "event_handler.h"
 #include "channels.h"
+#include "collector.h"
 #include "log_sys.h"
 #include "version.h"
 
@@ -119,6 +120,10 @@ int main(int argc, char *argv[])
 	if (ret)
 		return -1;
 
+	ret = init_collector();
+	if (ret)
+		return -1;
+
 	init_event_queue();
 	ret = init_event_handler();
 	if (ret)
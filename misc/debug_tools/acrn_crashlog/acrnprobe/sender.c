@@ -12,6 +12,8 @@
 #include <sys/wait.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <pthread.h>
+#include <zlib.h>
 #include "fsutils.h"
 #include "strutils.h"
 #include "cmdutils.h"
@@ -24,6 +26,28 @@
 #include "startupreason.h"
 #include "log_sys.h"
 #include "loop.h"
+#include "collector.h"
+
+/* outdir_blocks_size of crashlog grows from the collectors */
+static pthread_mutex_t space_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* the logs of a crash or an info, collected by a collector */
+struct collect_logs {
+	char *dir;
+	size_t dlen;
+	struct log_t *log[LOG_MAX];
+	char *trigger_src; /* the trigger file of an inotify event */
+	char *trigger_des;
+};
+
+/* the logs of a VM event, dumped from the image of the VM */
+struct collect_vmlogs {
+	char *dir;
+	size_t dlen;
+	char *vmlogpath;
+	char *vmkey;
+	size_t klen;
+};
 
 static int crashlog_check_space(void)
 {
@@ -46,11 +70,14 @@ static int crashlog_check_space(void)
 		     &cfg_size) == -1)
 		return -1;
 
+	pthread_mutex_lock(&space_mtx);
 	if (crashlog->outdir_blocks_size/MB >= (size_t)cfg_size) {
 		LOGD("the total blocks size (%zu) meets the quota (%zu)\n",
 		     crashlog->outdir_blocks_size/MB, (size_t)cfg_size);
+		pthread_mutex_unlock(&space_mtx);
 		return -1;
 	}
+	pthread_mutex_unlock(&space_mtx);
 	return 0;
 }
 
@@ -68,15 +95,32 @@ static int log_grows(char *dir, size_t len)
 	}
 
 	add += 4 * KB;
+	pthread_mutex_lock(&space_mtx);
 	crashlog->outdir_blocks_size += add;
 	LOGD("log size + %zu = %zu\n", add, crashlog->outdir_blocks_size);
+	pthread_mutex_unlock(&space_mtx);
 	return 0;
 }
 
+static int log_opt_enabled(const char *opt)
+{
+	return opt && !strcmp("true", opt);
+}
+
+/* the logs copied whole, or up to sizelimit, can be gzipped */
+static int log_gzipped(const struct log_t *log)
+{
+	if (!log_opt_enabled(log->compress))
+		return 0;
+	return !strcmp("node", log->type) ||
+	       (!strcmp("file", log->type) && !log->lines);
+}
+
 static int cal_log_filepath(char **out, const struct log_t *log,
 				const char *srcname, const char *desdir)
 {
 	const char *filename;
+	const char *suffix;
 	int need_timestamp = 0;
 	int hours;
 	char timebuf[UPTIME_SIZE];
@@ -84,6 +128,8 @@ static int cal_log_filepath(char **out, const struct log_t *log,
 	if (!out || !log || !desdir)
 		return -1;
 
+	suffix = log_gzipped(log) ? ".gz" : "";
+
 	if (is_ac_filefmt(log->path))
 		filename = srcname;
 	else
@@ -98,10 +144,11 @@ static int cal_log_filepath(char **out, const struct log_t *log,
 	if (need_timestamp) {
 		if (get_uptime_string(timebuf, &hours) == -1)
 			return -1;
-		return asprintf(out, "%s/%s_%s", desdir, filename, timebuf);
+		return asprintf(out, "%s/%s_%s%s", desdir, filename, timebuf,
+				suffix);
 	}
 
-	return asprintf(out, "%s/%s", desdir, filename);
+	return asprintf(out, "%s/%s%s", desdir, filename, suffix);
 }
 
 /* get_log_file_* only used to copy regular file which can be mmaped */
@@ -157,6 +204,105 @@ static void get_log_file(const char *despath, const char *srcpath,
 		get_log_file_complete(despath, srcpath);
 }
 
+/*
+ * Copy src from offset off, at most limit bytes if limit isn't 0, and
+ * gzip it on the way if gz. end is where the copy stopped in src.
+ */
+static int copy_log_stream(const char *src, const char *des, off_t off,
+			size_t limit, int gz, off_t *end)
+{
+	char buffer[CPBUFFERSIZE];
+	int fsrc;
+	int fdes = -1;
+	gzFile gzdes = NULL;
+	size_t done = 0;
+	ssize_t r_count;
+	int w_count;
+	int ret = -1;
+
+	fsrc = open(src, O_RDONLY);
+	if (fsrc < 0)
+		return -1;
+	if (off && lseek(fsrc, off, SEEK_SET) == -1)
+		goto close_src;
+
+	if (gz)
+		gzdes = gzopen(des, "wb");
+	else
+		fdes = open(des, O_WRONLY | O_CREAT | O_TRUNC, 0660);
+	if (!gzdes && fdes < 0)
+		goto close_src;
+
+	while (!limit || done < limit) {
+		r_count = read(fsrc, buffer, limit ?
+			       MIN(limit - done, sizeof(buffer)) :
+			       sizeof(buffer));
+		if (r_count < 0 && errno == EINTR)
+			continue;
+		if (r_count <= 0) {
+			ret = (r_count == 0) ? 0 : -1;
+			break;
+		}
+		if (gz)
+			w_count = gzwrite(gzdes, buffer, (unsigned int)r_count);
+		else
+			w_count = (int)write(fdes, buffer, (size_t)r_count);
+		if (w_count != r_count)
+			break;
+		done += (size_t)r_count;
+	}
+	if (limit && done == limit)
+		ret = 0;
+	*end = off + (off_t)done;
+
+	if (gz) {
+		if (gzclose(gzdes) != Z_OK)
+			ret = -1;
+	} else {
+		close(fdes);
+	}
+close_src:
+	close(fsrc);
+	return ret;
+}
+
+/*
+ * The file is copied from where its last collection ended if incremental,
+ * and not at all if it didn't grow since.
+ */
+static void get_log_file_stream(const char *despath, const char *srcpath,
+				size_t limit, int gz, int incremental)
+{
+	struct stat info;
+	off_t off = 0;
+	off_t end;
+
+	if (incremental) {
+		if (stat(srcpath, &info) == -1) {
+			LOGE("stat (%s) failed, error (%s)\n", srcpath,
+			     strerror(errno));
+			return;
+		}
+		off = hist_get_log_offset(srcpath, info.st_ino);
+		/* truncated since */
+		if (off > info.st_size)
+			off = 0;
+		if (off == info.st_size) {
+			LOGD("(%s) unchanged since its last collection\n",
+			     srcpath);
+			return;
+		}
+	}
+
+	if (copy_log_stream(srcpath, despath, off, limit, gz, &end) < 0) {
+		LOGE("copy (%s) failed, error (%s)\n", srcpath,
+		     strerror(errno));
+		return;
+	}
+	if (incremental)
+		hist_set_log_offset(srcpath, info.st_ino, end);
+}
+
 static void get_log_node(const char *despath, const char *nodepath,
 			size_t sizelimit)
 {
@@ -179,9 +325,15 @@ static void get_log_cmd(const char *despath, const char *cmd)
 static void get_log_by_type(const char *despath, const struct log_t *log,
 				const char *srcpath)
 {
+	int gz;
+	int incremental;
+
 	if (!despath || !log || !srcpath)
 		return;
 
+	gz = log_gzipped(log);
+	incremental = log_opt_enabled(log->incremental);
+
 	if (!strcmp("file", log->type)) {
 		int lines;
 
@@ -190,7 +342,11 @@ static void get_log_by_type(const char *despath, const struct log_t *log,
 		else
 			if (cfg_atoi(log->lines, log->lines_len, &lines) == -1)
 				return;
-		get_log_file(despath, srcpath, lines);
+		if (gz || (!lines && incremental))
+			get_log_file_stream(despath, srcpath, 0, gz,
+					    incremental);
+		else
+			get_log_file(despath, srcpath, lines);
 	} else if (!strcmp("node", log->type)) {
 		int size;
 
@@ -200,7 +356,12 @@ static void get_log_by_type(const char *despath, const struct log_t *log,
 			if (cfg_atoi(log->sizelimit, log->sizelimit_len,
 				     &size) == -1)
 				return;
-		get_log_node(despath, srcpath, (size_t)(size * 1024 * 1024));
+		if (gz)
+			get_log_file_stream(despath, srcpath,
+					    (size_t)(size * 1024 * 1024), gz, 0);
+		else
+			get_log_node(despath, srcpath,
+				     (size_t)(size * 1024 * 1024));
 	}
 	else if (!strcmp("cmd", log->type))
 		get_log_cmd(despath, srcpath);
@@ -274,6 +435,58 @@ static void crashlog_get_log(struct log_t *log, void *data)
 		LOGW("get (%s) spend %ds\n", log->name, spent);
 }
 
+static void collect_logs(void *arg)
+{
+	struct collect_logs *c = (struct collect_logs *)arg;
+	int id;
+	struct log_t *log;
+
+	for (id = 0; id < LOG_MAX; id++) {
+		log = c->log[id];
+		if (!log)
+			continue;
+		log->get(log, (void *)c->dir);
+	}
+	if (c->trigger_src) {
+		if (do_copy_tail(c->trigger_src, c->trigger_des, 0) < 0)
+			LOGE("failed to copy (%s) to (%s)\n", c->trigger_src,
+			     c->trigger_des);
+	}
+
+	log_grows(c->dir, c->dlen);
+	free(c->trigger_src);
+	free(c->trigger_des);
+	free(c->dir);
+	free(c);
+}
+
+/*
+ * Hand the logs over to the collectors, along with e->dir which the
+ * event doesn't own anymore.
+ */
+static void collect_logs_async(struct event_t *e, struct log_t **logs,
+				char *trigger_src, char *trigger_des)
+{
+	struct collect_logs *c;
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		LOGE("out of memory\n");
+		free(trigger_src);
+		free(trigger_des);
+		return;
+	}
+	c->dir = e->dir;
+	c->dlen = e->dlen;
+	memcpy(c->log, logs, sizeof(c->log));
+	c->trigger_src = trigger_src;
+	c->trigger_des = trigger_des;
+	e->dir = NULL;
+
+	if (collect_async(collect_logs, c) == -1)
+		collect_logs(c);
+}
+
 static void crashlog_send_crash(struct event_t *e, char *eid,
 				char *data, size_t dlen)
 {
@@ -284,8 +497,8 @@ static void crashlog_send_crash(struct event_t *e, char *eid,
 	size_t d1len;
 	size_t d2len;
 	struct crash_t *crash = (struct crash_t *)e->private;
-	int id;
-	struct log_t *log;
+	char *src = NULL;
+	char *des = NULL;
 
 	hist_raise_event(etype_str[e->event_type], crash->name, e->dir, "",
 			 eid);
@@ -303,16 +516,8 @@ static void crashlog_send_crash(struct event_t *e, char *eid,
 			   SHORT_KEY_LENGTH, crash->name, crash->name_len,
 			   data0, d0len, data1, d1len, data2, d2len);
 
-	for_each_log_collect(id, log, crash) {
-		if (!log)
-			continue;
-		log->get(log, (void *)e->dir);
-	}
 	if (!strcmp(e->channel, "inotify")) {
 		/* get the trigger file */
-		char *src;
-		char *des;
-
 		if (asprintf(&des, "%s/%s", e->dir, e->path) == -1) {
 			LOGE("out of memory\n");
 			return;
@@ -324,29 +529,18 @@ static void crashlog_send_crash(struct event_t *e, char *eid,
 			free(des);
 			return;
 		}
-
-		if (do_copy_tail(src, des, 0) < 0)
-			LOGE("failed to copy (%s) to (%s)\n", src, des);
-
-		free(src);
-		free(des);
 	}
+	collect_logs_async(e, crash->log, src, des);
 }
 
 static void crashlog_send_info(struct event_t *e, char *eid)
 {
-	int id;
 	struct info_t *info = (struct info_t *)e->private;
-	struct log_t *log;
 
 	hist_raise_event(etype_str[e->event_type], info->name, e->dir, "", eid);
 	if (!e->dir)
 		return;
-	for_each_log_collect(id, log, info) {
-		if (!log)
-			continue;
-		log->get(log, (void *)e->dir);
-	}
+	collect_logs_async(e, info->log, NULL, NULL);
 }
 
 static void crashlog_send_uptime(void)
@@ -380,6 +574,54 @@ static void crashlog_send_reboot(struct event_t *e, char *eid)
 	hist_raise_event(etype_str[e->event_type], reason, NULL, "", eid);
 }
 
+static void collect_vmlogs(void *arg)
+{
+	struct collect_vmlogs *c = (struct collect_vmlogs *)arg;
+	struct sender_t *crashlog = get_sender_by_name("crashlog");
+	enum vmrecord_mark_t mark = SUCCESS;
+	ext2_filsys datafs;
+	int res;
+	int cnt;
+
+	if (e2fs_open(loop_dev, &datafs) == -1) {
+		mark = WAITING_SYNC;
+		goto mark_record;
+	}
+
+	res = e2fs_dump_dir_by_dpath(datafs, c->vmlogpath, c->dir, &cnt);
+	e2fs_close(datafs);
+	if (res == -1) {
+		if (cnt) {
+			LOGE("dump (%s) abort at (%d)\n", c->vmlogpath, cnt);
+			mark = WAITING_SYNC;
+		} else {
+			LOGW("(%s) doesn't exsit\n", c->vmlogpath);
+			mark = MISS_LOG;
+		}
+	}
+	if (cnt == 1) {
+		LOGW("%s is empty, will sync it in the next loop\n",
+		     c->vmlogpath);
+		mark = WAITING_SYNC;
+	}
+	if (res == -1 || cnt == -1) {
+		if (remove_r(c->dir) == -1)
+			LOGE("failed to remove %s, %s\n", c->dir,
+			     strerror(errno));
+	} else {
+		log_grows(c->dir, c->dlen);
+	}
+
+mark_record:
+	if (crashlog)
+		vmrecord_open_mark(&crashlog->vmrecord, c->vmkey, c->klen,
+				   mark);
+	free(c->vmkey);
+	free(c->vmlogpath);
+	free(c->dir);
+	free(c);
+}
+
 static void crashlog_send_vmevent(struct event_t *e, char *eid,
 				char *data, size_t dlen)
 {
@@ -391,11 +633,8 @@ static void crashlog_send_vmevent(struct event_t *e, char *eid,
 	size_t elen;
 	size_t tlen;
 	size_t rlen;
-	char *vmlogpath;
 	char *log;
-	int res;
-	int cnt;
-	ext2_filsys datafs;
+	struct collect_vmlogs *c;
 	struct sender_t *crashlog = get_sender_by_name("crashlog");
 	struct vm_event_t *vme = (struct vm_event_t *)e->private;
 	enum vmrecord_mark_t mark = SUCCESS;
@@ -423,36 +662,28 @@ static void crashlog_send_vmevent(struct event_t *e, char *eid,
 	if (!log)
 		goto mark_record;
 
-	/* if line contains log, we need dump each file in the logdir */
-	vmlogpath = log + 1;
-
-	if (e2fs_open(loop_dev, &datafs) == -1) {
-		mark = WAITING_SYNC;
+	/*
+	 * if line contains log, we need dump each file in the logdir,
+	 * the collector marks the record once it's done.
+	 */
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		goto mark_record;
+	c->vmlogpath = strdup(log + 1);
+	c->vmkey = strndup(vmkey, klen);
+	if (!c->vmlogpath || !c->vmkey) {
+		free(c->vmlogpath);
+		free(c->vmkey);
+		free(c);
 		goto mark_record;
 	}
-
-	res = e2fs_dump_dir_by_dpath(datafs, vmlogpath, e->dir, &cnt);
-	e2fs_close(datafs);
-	if (res == -1) {
-		if (cnt) {
-			LOGE("dump (%s) abort at (%d)\n", vmlogpath, cnt);
-			mark = WAITING_SYNC;
-		} else {
-			LOGW("(%s) doesn't exsit\n", vmlogpath);
-			mark = MISS_LOG;
-		}
-	}
-	if (cnt == 1) {
-		LOGW("%s is empty, will sync it in the next loop\n", vmlogpath);
-		mark = WAITING_SYNC;
-	}
-	if (res == -1 || cnt == -1) {
-		if (remove_r(e->dir) == -1)
-			LOGE("failed to remove %s, %s\n", e->dir,
-			     strerror(errno));
-		free(e->dir);
-		e->dir = NULL;
-	}
+	c->klen = klen;
+	c->dir = e->dir;
+	c->dlen = e->dlen;
+	e->dir = NULL;
+	if (collect_async(collect_vmlogs, c) == -1)
+		collect_vmlogs(c);
+	return;
 
 mark_record:
 	vmrecord_open_mark(&crashlog->vmrecord, vmkey, klen, mark);
@@ -16,6 +16,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <pthread.h>
+#include <signal.h>
 
 #define LOG_ELEMENT_SIZE        80
 #define LOG_MSG_SIZE		480
@@ -33,29 +34,74 @@ static unsigned long interval = DEFAULT_POLL_INTERVAL;
 static size_t hvlog_log_size = LOG_FILE_SIZE;
 static unsigned short hvlog_log_num = LOG_FILE_NUM;
 
+/*
+ * The logs are copied into buffers of whole messages, written to the files
+ * by writer_thread, so reading the devices never waits for the disk.
+ */
+#define LOG_BUF_SIZE	(64*1024)
+#define LOG_BUF_NUM	8
+
+struct hvlog_file;
+
+struct log_buf {
+	struct hvlog_file *log;
+	int rotate;		/* 1 to start a new file before writing data */
+	size_t len;
+	char data[LOG_BUF_SIZE];
+};
+
 struct hvlog_file {
 	const char *path;
 	int fd;
+	int compress;		/* 1 to compress the rotated files */
 
 	size_t left_space;
 	unsigned short index;
 	unsigned short num;
+
+	/* filled by the readers, under lock */
+	pthread_mutex_t lock;
+	struct log_buf *buf;
+	int opened;		/* a file was started, by a buf with rotate set */
 };
 
 static struct hvlog_file cur_log = {
 	.path = "/var/log/acrnlog/acrnlog_cur",
 	.fd = -1,
+	.compress = 1,
 	.left_space = 0,
 	.index = ~0,
-	.num = LOG_FILE_NUM
+	.num = LOG_FILE_NUM,
+	.lock = PTHREAD_MUTEX_INITIALIZER
 };
 
+/* acrnprobe reads the last log, it is never compressed */
 static struct hvlog_file last_log = {
 	.path = "/var/log/acrnlog/acrnlog_last",
 	.fd = -1,
+	.compress = 0,
 	.left_space = 0,
 	.index = ~0,
-	.num = LOG_FILE_NUM
+	.num = LOG_FILE_NUM,
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+/* the compressor of the rotated files, NULL for none */
+static const char *compressor;
+static const char *compress_ext;
+
+/* free bufs and bufs to write, each a ring of pointers */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct log_buf *free[LOG_BUF_NUM];
+	int free_num;
+	struct log_buf *queue[LOG_BUF_NUM];
+	int queue_head;
+	int queue_num;
+} bufs = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
 };
 
 struct hvlog_msg {
@@ -81,7 +127,8 @@ struct hvlog_dev {
 	struct hvlog_msg latched_msg;	/* latch for parsed msg */
 };
 
-size_t write_log_file(struct hvlog_file * log, const char *buf, size_t len);
+static void log_write(struct hvlog_file *log, const char *buf, size_t len);
+static void log_flush(struct hvlog_file *log);
 
 static int get_dev_cnt(char *prefix)
 {
@@ -154,7 +201,7 @@ struct hvlog_msg *hvlog_read_dev(struct hvlog_dev *dev)
 								LOG_INCOMPLETE_WARNING) >= LOG_MSG_SIZE) {
 						printf("WARN: warning message is truncated\n");
 					}
-					write_log_file(&cur_log, warn_msg, strnlen(warn_msg, LOG_MSG_SIZE));
+					log_write(&cur_log, warn_msg, strnlen(warn_msg, LOG_MSG_SIZE));
 				} else {
 					msg_num++;
 					/* if we read another new msg, latch it */
@@ -245,10 +292,65 @@ static struct hvlog_data {
 } *cur, *last;
 
 /*
- * read the earliest msg from each dev, to hvlog_data[].msg
- * hvlog_data[] will be used for reordering
+ * min-heap of the devices with a msg read, on the seq of the msg, to merge
+ * the logs of all the pCPUs in order
+ */
+struct msg_heap {
+	struct hvlog_data **items;
+	int num;
+};
+
+static inline int heap_less(struct msg_heap *heap, int a, int b)
+{
+	return heap->items[a]->msg->seq < heap->items[b]->msg->seq;
+}
+
+static inline void heap_swap(struct msg_heap *heap, int a, int b)
+{
+	struct hvlog_data *tmp = heap->items[a];
+
+	heap->items[a] = heap->items[b];
+	heap->items[b] = tmp;
+}
+
+static void heap_push(struct msg_heap *heap, struct hvlog_data *data)
+{
+	int i = heap->num++;
+
+	heap->items[i] = data;
+	while (i > 0 && heap_less(heap, i, (i - 1) / 2)) {
+		heap_swap(heap, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static struct hvlog_data *heap_pop(struct msg_heap *heap)
+{
+	struct hvlog_data *data;
+	int i = 0, child;
+
+	if (!heap->num)
+		return NULL;
+
+	data = heap->items[0];
+	heap->items[0] = heap->items[--heap->num];
+	while ((child = 2 * i + 1) < heap->num) {
+		if (child + 1 < heap->num && heap_less(heap, child + 1, child))
+			child++;
+		if (!heap_less(heap, child, i))
+			break;
+		heap_swap(heap, i, child);
+		i = child;
+	}
+
+	return data;
+}
+
+/*
+ * read a msg from each dev without one, hvlog_data[].msg != NULL iff the
+ * dev is in the heap
  */
-static int hvlog_dev_read_msg(struct hvlog_data *data, int num_dev)
+static int heap_fill(struct msg_heap *heap, struct hvlog_data *data, int num_dev)
 {
 	int i, new_read;
 
@@ -260,42 +362,63 @@ static int hvlog_dev_read_msg(struct hvlog_data *data, int num_dev)
 			continue;
 
 		data[i].msg = hvlog_read_dev(data[i].dev);
-		if (data[i].msg)
+		if (data[i].msg) {
+			heap_push(heap, &data[i]);
 			new_read++;
+		}
 	}
 
 	return new_read;
 }
 
-static struct hvlog_msg *get_min_seq_msg(struct hvlog_data *data, int num_dev)
+/*
+ * take the msg of the lowest seq out of the heap, @msg is valid until
+ * heap_refill_dev() reads the next msg of its dev
+ */
+static struct hvlog_data *heap_next_msg(struct msg_heap *heap, struct hvlog_msg **msg)
 {
-	int i, index_min = -1;
-	__u64 min_seq = 0;
-	struct hvlog_msg *msg;
+	struct hvlog_data *data = heap_pop(heap);
 
-	for (i = 0; i < num_dev; i++) {
-		if (!data[i].msg)
-			continue;
+	if (data) {
+		*msg = data->msg;
+		data->msg = NULL;
+	}
 
-		if (index_min == -1) {
-			index_min = i;
-			min_seq = data[i].msg->seq;
-			continue;
-		}
+	return data;
+}
 
-		if (data[i].msg->seq > min_seq)
-			continue;
-		index_min = i;
-		min_seq = data[i].msg->seq;
-	}
+static void heap_refill_dev(struct msg_heap *heap, struct hvlog_data *data)
+{
+	data->msg = hvlog_read_dev(data->dev);
+	if (data->msg)
+		heap_push(heap, data);
+}
 
-	if (index_min == -1)
-		return NULL;
+static void remove_log_file(const char *file_name)
+{
+	char name[48];
 
-	msg = data[index_min].msg;
-	data[index_min].msg = NULL;
+	remove(file_name);
+	if (compress_ext) {
+		if (snprintf(name, sizeof(name), "%s%s", file_name, compress_ext) >= sizeof(name))
+			printf("WARN: log path is truncated\n");
+		else
+			remove(name);
+	}
+}
 
-	return msg;
+/* compress a rotated file in the background, the compressor removes it */
+static void compress_log_file(const char *file_name)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid == 0) {
+		execlp(compressor, compressor, "-q", "--rm", file_name, (char *)NULL);
+		_exit(1);
+	} else if (pid < 0) {
+		perror("fork");
+	}
 }
 
 static int new_log_file(struct hvlog_file *log)
@@ -307,13 +430,21 @@ static int new_log_file(struct hvlog_file *log)
 			return 0;
 		close(log->fd);
 		log->fd = -1;
+
+		if (log->compress && compressor) {
+			if (snprintf(file_name, sizeof(file_name), "%s.%hu", log->path,
+				 log->index) >= sizeof(file_name))
+				printf("WARN: log path is truncated\n");
+			else
+				compress_log_file(file_name);
+		}
 	}
 
 	if (snprintf(file_name, sizeof(file_name), "%s.%hu", log->path,
 		 log->index + 1) >= sizeof(file_name)) {
 		printf("WARN: log path is truncated\n");
 	} else
-		remove(file_name);
+		remove_log_file(file_name);
 
 	log->fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0666);
 	if (log->fd < 0) {
@@ -321,44 +452,176 @@ static int new_log_file(struct hvlog_file *log)
 		return -1;
 	}
 
-	log->left_space = hvlog_log_size;
 	log->index++;
 	if (snprintf(file_name, sizeof(file_name), "%s.%hu", log->path,
 			log->index - hvlog_log_num) >= sizeof(file_name)) {
 		printf("WARN: log path is truncated\n");
 	} else
-		remove(file_name);
+		remove_log_file(file_name);
 
 	return 0;
 }
 
 size_t write_log_file(struct hvlog_file * log, const char *buf, size_t len)
 {
-	int ret;
+	ssize_t ret;
+	size_t done = 0;
 
-	if (len >= log->left_space)
-		if (new_log_file(log))
-			return 0;
+	if (log->fd < 0)
+		return 0;
 
-	ret = write(log->fd, buf, len);
-	log->left_space -= ret;
+	while (done < len) {
+		ret = write(log->fd, buf + done, len - done);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			perror(log->path);
+			break;
+		}
+		done += ret;
+	}
 
-	return ret;
+	return done;
+}
+
+static struct log_buf *get_free_buf(void)
+{
+	struct log_buf *buf;
+
+	pthread_mutex_lock(&bufs.lock);
+	while (!bufs.free_num)
+		pthread_cond_wait(&bufs.cond, &bufs.lock);
+	buf = bufs.free[--bufs.free_num];
+	pthread_mutex_unlock(&bufs.lock);
+
+	buf->rotate = 0;
+	buf->len = 0;
+	return buf;
+}
+
+static void submit_buf(struct log_buf *buf)
+{
+	pthread_mutex_lock(&bufs.lock);
+	bufs.queue[(bufs.queue_head + bufs.queue_num) % LOG_BUF_NUM] = buf;
+	bufs.queue_num++;
+	pthread_cond_broadcast(&bufs.cond);
+	pthread_mutex_unlock(&bufs.lock);
+}
+
+static void *writer_func(void *arg)
+{
+	struct log_buf *buf;
+
+	while (1) {
+		pthread_mutex_lock(&bufs.lock);
+		while (!bufs.queue_num)
+			pthread_cond_wait(&bufs.cond, &bufs.lock);
+		buf = bufs.queue[bufs.queue_head];
+		bufs.queue_head = (bufs.queue_head + 1) % LOG_BUF_NUM;
+		bufs.queue_num--;
+		pthread_mutex_unlock(&bufs.lock);
+
+		if (buf->rotate)
+			new_log_file(buf->log);
+		write_log_file(buf->log, buf->data, buf->len);
+
+		pthread_mutex_lock(&bufs.lock);
+		bufs.free[bufs.free_num++] = buf;
+		pthread_cond_broadcast(&bufs.cond);
+		pthread_mutex_unlock(&bufs.lock);
+	}
+
+	return NULL;
+}
+
+/* wait for the writer to write all the bufs submitted */
+static void wait_writer_idle(void)
+{
+	pthread_mutex_lock(&bufs.lock);
+	while (bufs.free_num < LOG_BUF_NUM)
+		pthread_cond_wait(&bufs.cond, &bufs.lock);
+	pthread_mutex_unlock(&bufs.lock);
+}
+
+/*
+ * copy a whole msg into the buf of the log, the log files are rotated
+ * between msgs, as they were written directly
+ */
+static void log_write(struct hvlog_file *log, const char *buf, size_t len)
+{
+	pthread_mutex_lock(&log->lock);
+
+	if (!log->opened || (hvlog_log_size && len >= log->left_space)) {
+		if (log->buf)
+			submit_buf(log->buf);
+		log->buf = get_free_buf();
+		log->buf->log = log;
+		log->buf->rotate = 1;
+		log->left_space = hvlog_log_size;
+		log->opened = 1;
+	} else if (log->buf && log->buf->len + len > LOG_BUF_SIZE) {
+		submit_buf(log->buf);
+		log->buf = NULL;
+	}
+
+	if (!log->buf) {
+		log->buf = get_free_buf();
+		log->buf->log = log;
+	}
+
+	len = (len > LOG_BUF_SIZE) ? LOG_BUF_SIZE : len;
+	memcpy(&log->buf->data[log->buf->len], buf, len);
+	log->buf->len += len;
+	if (hvlog_log_size)
+		log->left_space -= len;
+
+	pthread_mutex_unlock(&log->lock);
+}
+
+/* hand the buffered msgs to the writer */
+static void log_flush(struct hvlog_file *log)
+{
+	pthread_mutex_lock(&log->lock);
+	if (log->buf) {
+		submit_buf(log->buf);
+		log->buf = NULL;
+	}
+	pthread_mutex_unlock(&log->lock);
 }
 
 static void *cur_read_func(void *arg)
 {
+	struct hvlog_data *data;
 	struct hvlog_msg *msg;
+	struct msg_heap heap;
 	__u64 last_seq = 0;
+	int merged = 0;
 	char warn_msg[LOG_MSG_SIZE] = {0};
 
+	heap.items = calloc(cur_cnt, sizeof(*heap.items));
+	if (!heap.items) {
+		printf("Failed to allocate the msg heap\n");
+		return NULL;
+	}
+	heap.num = 0;
+
 	while (1) {
-		hvlog_dev_read_msg(cur, cur_cnt);
-		msg = get_min_seq_msg(cur, cur_cnt);
-		if (!msg) {
+		/*
+		 * the devs without a msg are read again once the heap is empty,
+		 * or after cur_cnt msgs, so a busy dev can't hold the others
+		 */
+		if (!heap.num || merged >= cur_cnt) {
+			heap_fill(&heap, cur, cur_cnt);
+			merged = 0;
+		}
+
+		data = heap_next_msg(&heap, &msg);
+		if (!data) {
+			log_flush(&cur_log);
 			usleep(interval);
 			continue;
 		}
+		merged++;
 
 		/* if msg->seq is not contineous, warn for logs missing */
 		if (last_seq + 1 < msg->seq) {
@@ -368,14 +631,16 @@ static void *cur_read_func(void *arg)
 				printf("WARN: warning message is truncated\n");
 			}
 
-			write_log_file(&cur_log, warn_msg, strnlen(warn_msg, LOG_MSG_SIZE));
+			log_write(&cur_log, warn_msg, strnlen(warn_msg, LOG_MSG_SIZE));
 		}
 
 		last_seq = msg->seq;
 
-		write_log_file(&cur_log, msg->raw, msg->len);
+		log_write(&cur_log, msg->raw, msg->len);
+		heap_refill_dev(&heap, data);
 	}
 
+	free(heap.items);
 	return NULL;
 }
 
@@ -385,10 +650,9 @@ static void *cur_read_func(void *arg)
 static int mk_dir(const char *path)
 {
 	char prefix[32] = "acrnlog_cur."; /* acrnlog file prefix */
-	char acrnlog_file[64] = { };
+	char acrnlog_file[PATH_MAX] = { };
 	struct dirent *pdir;
 	struct stat st;
-	int index = 0;
 	char *find;
 	DIR *dir;
 
@@ -408,8 +672,9 @@ static int mk_dir(const char *path)
 			if (!find)
 				continue;
 
-			if (snprintf(acrnlog_file, sizeof(acrnlog_file), "%s/%s%d",
-					path, prefix, index++) >= sizeof(acrnlog_file)) {
+			/* by name, to remove the compressed ones as well */
+			if (snprintf(acrnlog_file, sizeof(acrnlog_file), "%s/%s",
+					path, pdir->d_name) >= sizeof(acrnlog_file)) {
 				printf("WARN: acrnlog file path is truncated\n");
 			} else
 				remove(acrnlog_file);
@@ -421,18 +686,19 @@ static int mk_dir(const char *path)
 }
 
 /* for user optinal args */
-static const char optString[] = "s:n:t:h";
+static const char optString[] = "s:n:t:z:h";
 
 static void display_usage(void)
 {
 	printf("acrnlog - tool to collect ACRN hypervisor log\n"
-	       "[Usage] acrnlog [-s size] [-n number] [-t interval] [-h]\n\n"
+	       "[Usage] acrnlog [-s size] [-n number] [-t interval] [-z compressor] [-h]\n\n"
 	       "[Options]\n"
 	       "\t-h: print this message\n"
 	       "\t-t: polling interval to collect logs, in ms\n"
 	       "\t-s: size limitation for each log file, in MB.\n"
 	       "\t    0 means no limitation.\n"
 	       "\t-n: how many files you would like to keep on disk\n"
+	       "\t-z: compress the rotated files, with zstd or lz4\n"
 	       "[Output] capatured log files under /var/log/acrnlog/\n");
 }
 
@@ -471,6 +737,17 @@ static int parse_opt(int argc, char *argv[])
 			interval = ret * 1000;
 			printf("Polling interval is %u ms\n", ret);
 			break;
+		case 'z':
+			if (!strcmp(optarg, "zstd")) {
+				compress_ext = ".zst";
+			} else if (!strcmp(optarg, "lz4")) {
+				compress_ext = ".lz4";
+			} else {
+				printf("'-z' requires zstd or lz4\n");
+				return -EINVAL;
+			}
+			compressor = optarg;
+			break;
 		case 'h':
 			display_usage();
 			return -EINVAL;
@@ -484,13 +761,17 @@ static int parse_opt(int argc, char *argv[])
 }
 
 static pthread_t cur_thread;
+static pthread_t writer_thread;
 
 int main(int argc, char *argv[])
 {
 	char name[32];
 	int i, ret;
 	int num_cur, num_last;
+	struct hvlog_data *data;
 	struct hvlog_msg *msg;
+	struct msg_heap heap;
+	static struct log_buf log_bufs[LOG_BUF_NUM];
 
 	if (parse_opt(argc, argv))
 		return -1;
@@ -502,6 +783,19 @@ int main(int argc, char *argv[])
 		return ret;
 	}
 
+	for (i = 0; i < LOG_BUF_NUM; i++)
+		bufs.free[bufs.free_num++] = &log_bufs[i];
+
+	/* the compressors of the rotated files are reaped by the kernel */
+	if (compressor)
+		signal(SIGCHLD, SIG_IGN);
+
+	ret = pthread_create(&writer_thread, NULL, writer_func, NULL);
+	if (ret) {
+		printf("Failed to create the writer thread\n");
+		return -1;
+	}
+
 	cur_cnt = get_dev_cnt("acrn_hvlog_cur_");
 	last_cnt = get_dev_cnt("acrn_hvlog_last_");
 
@@ -568,13 +862,20 @@ int main(int argc, char *argv[])
 	}
 
 	if (num_last) {
-		while (1) {
-			hvlog_dev_read_msg(last, cur_cnt);
-			msg = get_min_seq_msg(last, cur_cnt);
-			if (!msg)
-				break;
-			write_log_file(&last_log, msg->raw, msg->len);
+		heap.items = calloc(cur_cnt, sizeof(*heap.items));
+		if (heap.items) {
+			heap.num = 0;
+			heap_fill(&heap, last, cur_cnt);
+			while ((data = heap_next_msg(&heap, &msg)) != NULL) {
+				log_write(&last_log, msg->raw, msg->len);
+				heap_refill_dev(&heap, data);
+			}
+			free(heap.items);
+		} else {
+			printf("Failed to allocate the msg heap\n");
 		}
+		log_flush(&last_log);
+		wait_writer_idle();
 	}
 
 	if (cur_thread)
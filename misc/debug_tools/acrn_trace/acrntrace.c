@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/mman.h>
 #include <sys/statvfs.h>
 #include <sys/stat.h>
@@ -22,6 +23,7 @@
 #include <numa.h>
 
 #include "acrntrace.h"
+#include "trace_decode.h"
 
 #define TIMER_ID	(128)
 static uint32_t timeout = 0;
@@ -30,7 +32,7 @@ static int exiting = 0;
 
 /* for opt */
 static uint64_t period = 10000;
-static const char optString[] = "i:hcrt:a:";
+static const char optString[] = "i:hcrt:a:z";
 static const char dev_prefix[] = "acrn_trace_";
 
 static uint32_t flags = FLAG_CLEAR_BUF;
@@ -44,14 +46,15 @@ static struct bitmask *cpu_bitmask = NULL;
 static void display_usage(void)
 {
 	printf("acrntrace - tool to collect ACRN trace data\n"
-	       "[Usage] acrntrace [-i period] [-t max_time] [-ch]\n\n"
+	       "[Usage] acrntrace [-i period] [-t max_time] [-chz]\n\n"
 	       "[Options]\n"
 	       "\t-h: print this message\n"
 	       "\t-i: period_in_ms: specify polling interval [1-999]\n"
 	       "\t-t: max time to capture trace data (in second)\n"
 	       "\t-c: clear the buffered old data (deprecated)\n"
 	       "\t-r: capture the buffered old data instead of clearing it\n"
-	       "\t-a: cpu-set: only capture the trace data on these configured cpu-set\n");
+	       "\t-a: cpu-set: only capture the trace data on these configured cpu-set\n"
+	       "\t-z: record in the compact format, to decode with acrntrace_decode\n");
 }
 
 static void timer_handler(union sigval sv)
@@ -130,6 +133,9 @@ static int parse_opt(int argc, char *argv[])
 		case 'a':
 			cpu_bitmask = numa_parse_cpustring_all(optarg);
 			break;
+		case 'z':
+			flags |= FLAG_COMPACT;
+			break;
 		case 'h':
 			display_usage();
 			return -EINVAL;
@@ -217,12 +223,21 @@ static int create_trace_file_dir(char *dir)
 	return err;
 }
 
-/* function executed in each consumer thread */
+/*
+ * function executed in each consumer thread
+ *
+ * The HV notifies the Service VM once half of the sbuf is used, so the
+ * reader sleeps in poll() until then or for at most a period, and keeps up with
+ * high trace rates without waking up for nothing at low ones. A device that
+ * can't be polled reports it ready at once with nothing buffered, the reader
+ * then falls back to sleeping for a period.
+ */
 static void reader_fn(param_t * param)
 {
 	int ret;
 	int fd = param->trace_fd;
 	shared_buf_t *sbuf = param->sbuf;
+	struct pollfd pfd = { .fd = param->dev_fd, .events = POLLIN };
 
 	pr_dbg("reader thread[%lu] created for FILE*[0x%p]\n",
 	       pthread_self(), fp);
@@ -230,16 +245,29 @@ static void reader_fn(param_t * param)
 	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 	pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
 
-	/* Clear the old data in sbuf */
-	if (flags & FLAG_CLEAR_BUF)
+	/*
+	 * Clear the old data in sbuf. The compact records can't follow the old
+	 * fixed ones, so they are always cleared then, once the HV has seen
+	 * VARLEN_EN and puts no more fixed record.
+	 */
+	if (flags & FLAG_COMPACT) {
+		sbuf_add_flags(sbuf, VARLEN_EN);
+		usleep(1000);
+		sbuf_clear_buffered(sbuf);
+	} else if (flags & FLAG_CLEAR_BUF) {
 		sbuf_clear_buffered(sbuf);
+	}
+
+	sbuf->watermark = sbuf->size / 2;
+	sbuf_add_flags(sbuf, WATERMARK_NOTIFY_EN);
 
 	while (1) {
 		do {
 			ret = sbuf_write(fd, sbuf);
 		} while (ret > 0);
 
-		usleep(period);
+		if ((poll(&pfd, 1, period / 1000) > 0) && sbuf_is_empty(sbuf))
+			usleep(period);
 	}
 }
 
@@ -260,6 +288,7 @@ static int create_reader(reader_struct * reader, uint32_t dev_id)
 		return -1;
 	}
 
+	reader->param.dev_fd = reader->dev_fd;
 	reader->param.sbuf = mmap(NULL, MMAP_SIZE,
 				  PROT_READ | PROT_WRITE,
 				  MAP_SHARED, reader->dev_fd, 0);
@@ -283,6 +312,12 @@ static int create_reader(reader_struct * reader, uint32_t dev_id)
 		return -3;
 	}
 
+	if ((flags & FLAG_COMPACT) && write(reader->param.trace_fd, TRACE_COMPACT_MAGIC,
+				TRACE_COMPACT_MAGIC_LEN) != TRACE_COMPACT_MAGIC_LEN) {
+		pr_err("Failed to write %s, err %d\n", trace_file_name, errno);
+		return -3;
+	}
+
 	pr_info("trace data file %s created for %s\n",
 		trace_file_name, reader->dev_name);
 
@@ -306,6 +341,8 @@ static void destory_reader(reader_struct * reader)
 	}
 
 	if (reader->param.sbuf) {
+		/* leave the sbuf to the next user in the fixed format */
+		sbuf_clear_flags(reader->param.sbuf, WATERMARK_NOTIFY_EN | VARLEN_EN);
 		munmap(reader->param.sbuf, MMAP_SIZE);
 		reader->param.sbuf = NULL;
 	}
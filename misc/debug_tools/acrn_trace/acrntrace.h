@@ -4,7 +4,10 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
+#ifndef ACRNTRACE_H
+#define ACRNTRACE_H
 
+#include <pthread.h>
 #include "sbuf.h"
 
 #define PCPU_NUM        	4
@@ -38,9 +41,11 @@
  * flags:
  * FLAG_TO_REL   - resources need to be release
  * FLAG_CLEAR_BUF - to clear buffered old data
+ * FLAG_COMPACT   - to record in the compact format
  */
 #define FLAG_TO_REL		(1UL << 0)
 #define FLAG_CLEAR_BUF		(1UL << 1)
+#define FLAG_COMPACT		(1UL << 2)
 
 #define foreach_dev(dev_id)                                       \
         for ((dev_id) = 0; (dev_id) < (dev_cnt); (dev_id)++)
@@ -74,6 +79,7 @@ typedef struct {
 	uint32_t devid;
 	int exit_flag;
 	int trace_fd;
+	int dev_fd;
 	shared_buf_t *sbuf;
 	pthread_mutex_t *sbuf_lock;
 } param_t;
@@ -84,3 +90,5 @@ typedef struct {
 	pthread_t thrd;
 	param_t param;
 } reader_struct;
+
+#endif /* ACRNTRACE_H */
@@ -0,0 +1,339 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <errno.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace_decode.h"
+
+/*
+ * acrntrace_decode - decode the trace files acrntrace -z records in the
+ * compact format, and do the analyses of acrnalyze.py on them at C speed.
+ */
+
+#define VM_EXIT			0x10UL
+#define VM_ENTER		0x11UL
+#define VMEXIT_ENTRY		0x10000UL
+#define VMEXIT_EXTERNAL_INTERRUPT	(VMEXIT_ENTRY + 0x1UL)
+#define NR_VECTORS		256
+
+static const struct {
+	const char *name;
+	uint64_t evid;
+} exit_events[] = {
+	{ "VMEXIT_EXCEPTION_OR_NMI",     VMEXIT_ENTRY + 0x00000000UL },
+	{ "VMEXIT_EXTERNAL_INTERRUPT",   VMEXIT_ENTRY + 0x00000001UL },
+	{ "VMEXIT_INTERRUPT_WINDOW",     VMEXIT_ENTRY + 0x00000002UL },
+	{ "VMEXIT_CPUID",                VMEXIT_ENTRY + 0x00000004UL },
+	{ "VMEXIT_RDTSC",                VMEXIT_ENTRY + 0x00000010UL },
+	{ "VMEXIT_VMCALL",               VMEXIT_ENTRY + 0x00000012UL },
+	{ "VMEXIT_CR_ACCESS",            VMEXIT_ENTRY + 0x0000001CUL },
+	{ "VMEXIT_IO_INSTRUCTION",       VMEXIT_ENTRY + 0x0000001EUL },
+	{ "VMEXIT_RDMSR",                VMEXIT_ENTRY + 0x0000001FUL },
+	{ "VMEXIT_WRMSR",                VMEXIT_ENTRY + 0x00000020UL },
+	{ "VMEXIT_EPT_VIOLATION",        VMEXIT_ENTRY + 0x00000030UL },
+	{ "VMEXIT_EPT_MISCONFIGURATION", VMEXIT_ENTRY + 0x00000031UL },
+	{ "VMEXIT_RDTSCP",               VMEXIT_ENTRY + 0x00000033UL },
+	{ "VMEXIT_APICV_WRITE",          VMEXIT_ENTRY + 0x00000038UL },
+	{ "VMEXIT_APICV_ACCESS",         VMEXIT_ENTRY + 0x00000039UL },
+	{ "VMEXIT_APICV_VIRT_EOI",       VMEXIT_ENTRY + 0x0000003AUL },
+	{ "VMEXIT_UNHANDLED",            0x20000UL },
+};
+
+#define NR_EXIT_EVENTS	(sizeof(exit_events) / sizeof(exit_events[0]))
+
+static struct {
+	bool started;
+	uint64_t tsc_begin, tsc_end;
+	uint64_t tsc_exit;
+	uint64_t total_exits;
+	int last;
+	uint64_t nr_exits[NR_EXIT_EVENTS];
+	uint64_t time_in_exit[NR_EXIT_EVENTS];
+} vm_exit = { .last = -1 };
+
+static struct {
+	uint64_t tsc_begin, tsc_end;
+	uint64_t nr_exits[NR_VECTORS];
+} irq;
+
+static bool do_vm_exit, do_irq;
+
+static void display_usage(void)
+{
+	printf("acrntrace_decode - decode and analyze compact ACRN trace data\n"
+	       "[Usage] acrntrace_decode -i ifile [-d dfile] [-o ofile [-f freq] [--vm_exit] [--irq]] [-c cpu]\n\n"
+	       "[Options]\n"
+	       "\t-h: print this message\n"
+	       "\t-i, --ifile: trace data file recorded by acrntrace -z\n"
+	       "\t-d, --decode: write the events to dfile in the fixed trace format\n"
+	       "\t-o, --ofile: output report file, the reports are appended to ofile.csv\n"
+	       "\t-f, --frequency: TSC frequency in MHz\n"
+	       "\t-c, --cpu: pCPU the trace data was recorded on, to report in the events\n"
+	       "\t--vm_exit: to generate vm_exit report\n"
+	       "\t--irq: to generate irq related report\n");
+}
+
+/* same as vmexit_analyze.py, the exits before the first VM_EXIT are ignored */
+static void vm_exit_event(const trace_ev_t *ev, uint64_t event)
+{
+	size_t i;
+
+	if (!vm_exit.started) {
+		if (event != VM_EXIT)
+			return;
+		vm_exit.started = true;
+		vm_exit.tsc_begin = ev->tsc;
+	}
+
+	if (event == VM_ENTER) {
+		vm_exit.tsc_end = ev->tsc;
+		if (vm_exit.last >= 0)
+			vm_exit.time_in_exit[vm_exit.last] += ev->tsc - vm_exit.tsc_exit;
+	} else if (event == VM_EXIT) {
+		vm_exit.tsc_exit = ev->tsc;
+		vm_exit.total_exits++;
+	} else {
+		for (i = 0; i < NR_EXIT_EVENTS; i++) {
+			if (event == exit_events[i].evid) {
+				vm_exit.nr_exits[i]++;
+				vm_exit.last = (int)i;
+			}
+		}
+	}
+}
+
+static void irq_event(const trace_ev_t *ev, uint64_t event)
+{
+	if (irq.tsc_begin == 0)
+		irq.tsc_begin = ev->tsc;
+	irq.tsc_end = ev->tsc;
+
+	if (event == VMEXIT_EXTERNAL_INTERRUPT && ev->e < NR_VECTORS)
+		irq.nr_exits[ev->e]++;
+}
+
+static int vm_exit_report(FILE *csv, double freq)
+{
+	uint64_t rt_cycle = vm_exit.tsc_end - vm_exit.tsc_begin;
+	uint64_t total_exit_time = 0;
+	double rt_sec, ev_freq, pct;
+	size_t i;
+
+	if (rt_cycle == 0) {
+		printf("total_run_time in cycle is 0, tsc_end %lu, tsc_begin %lu\n",
+			vm_exit.tsc_end, vm_exit.tsc_begin);
+		return -1;
+	}
+	rt_sec = (double)rt_cycle / (freq * 1000 * 1000);
+
+	for (i = 0; i < NR_EXIT_EVENTS; i++)
+		total_exit_time += vm_exit.time_in_exit[i];
+
+	printf("Total run time: %lu cycles\n", rt_cycle);
+	printf("TSC Freq: %g MHz\n", freq);
+	printf("Total run time: %.6f sec\n", rt_sec);
+
+	fprintf(csv, "Run time(cycles),Run time(Sec),Freq(MHz)\r\n");
+	fprintf(csv, "%lu,%.3f,%g\r\n", rt_cycle, rt_sec, freq);
+
+	printf("%-28s\t%-12s\t%-12s\t%-24s\t%-16s\n", "Event", "NR_Exit",
+		"NR_Exit/Sec", "Time Consumed(cycles)", "Time percentage");
+	fprintf(csv, "Exit_Reason,NR_Exit,NR_Exit/Sec,Time Consumed(cycles),Time Percentage\r\n");
+
+	for (i = 0; i < NR_EXIT_EVENTS; i++) {
+		ev_freq = (double)vm_exit.nr_exits[i] / rt_sec;
+		pct = (double)vm_exit.time_in_exit[i] * 100 / (double)rt_cycle;
+		printf("%-28s\t%-12lu\t%-12.2f\t%-24lu\t%-16.2f\n", exit_events[i].name,
+			vm_exit.nr_exits[i], ev_freq, vm_exit.time_in_exit[i], pct);
+		fprintf(csv, "%s,%lu,%.2f,%lu,%2.2f\r\n", exit_events[i].name,
+			vm_exit.nr_exits[i], ev_freq, vm_exit.time_in_exit[i], pct);
+	}
+
+	ev_freq = (double)vm_exit.total_exits / rt_sec;
+	pct = (double)total_exit_time * 100 / (double)rt_cycle;
+	printf("%-28s\t%-12lu\t%-12.2f\t%-24lu\t%-16.2f\n", "Total",
+		vm_exit.total_exits, ev_freq, total_exit_time, pct);
+	fprintf(csv, "Total,%lu,%.2f,%lu,%2.2f\r\n", vm_exit.total_exits, ev_freq, total_exit_time, pct);
+
+	return 0;
+}
+
+static int irq_report(FILE *csv, double freq)
+{
+	uint64_t rt_cycle = irq.tsc_end - irq.tsc_begin;
+	double rt_sec;
+	int vec;
+
+	if (rt_cycle == 0) {
+		printf("Total run time in cycle is 0, TSC end %lu, TSC begin %lu\n",
+			irq.tsc_end, irq.tsc_begin);
+		return -1;
+	}
+	rt_sec = (double)rt_cycle / (freq * 1000 * 1000);
+
+	printf("%-8s\t%-8s\t%-8s\n", "Vector", "Count", "NR_Exit/Sec");
+	fprintf(csv, "Vector,NR_Exit,NR_Exit/Sec\r\n");
+	for (vec = 0; vec < NR_VECTORS; vec++) {
+		if (irq.nr_exits[vec] != 0) {
+			printf("0x%08x\t%-8lu\t%-8.2f\n", vec, irq.nr_exits[vec],
+				(double)irq.nr_exits[vec] / rt_sec);
+			fprintf(csv, "0x%08x,%lu,%.2f\r\n", vec, irq.nr_exits[vec],
+				(double)irq.nr_exits[vec] / rt_sec);
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "ifile", required_argument, NULL, 'i' },
+		{ "decode", required_argument, NULL, 'd' },
+		{ "ofile", required_argument, NULL, 'o' },
+		{ "frequency", required_argument, NULL, 'f' },
+		{ "cpu", required_argument, NULL, 'c' },
+		{ "vm_exit", no_argument, NULL, 'x' },
+		{ "irq", no_argument, NULL, 'q' },
+		{ NULL, 0, NULL, 0 },
+	};
+	const char *ifile = NULL, *dfile = NULL, *ofile = NULL;
+	/* Default TSC frequency of MRB in MHz, as acrnalyze.py */
+	double freq = 1881.6;
+	uint8_t cpu = 0;
+	struct trace_decoder dec;
+	char csv_name[256];
+	struct stat st;
+	trace_ev_t ev;
+	uint64_t event;
+	FILE *dfp = NULL, *csv;
+	uint8_t *buf;
+	int fd, opt, ret = 0;
+
+	while ((opt = getopt_long(argc, argv, "hi:d:o:f:c:", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'i':
+			ifile = optarg;
+			break;
+		case 'd':
+			dfile = optarg;
+			break;
+		case 'o':
+			ofile = optarg;
+			break;
+		case 'f':
+			freq = strtod(optarg, NULL);
+			break;
+		case 'c':
+			cpu = (uint8_t)strtoul(optarg, NULL, 10);
+			break;
+		case 'x':
+			do_vm_exit = true;
+			break;
+		case 'q':
+			do_irq = true;
+			break;
+		default:
+			display_usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (ifile == NULL || (dfile == NULL && !do_vm_exit && !do_irq) ||
+			((do_vm_exit || do_irq) && ofile == NULL) || freq <= 0) {
+		display_usage();
+		return EXIT_FAILURE;
+	}
+
+	fd = open(ifile, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		printf("Failed to open %s, errno %d\n", ifile, errno);
+		return EXIT_FAILURE;
+	}
+	if (st.st_size < TRACE_COMPACT_MAGIC_LEN) {
+		printf("%s is not a compact trace file\n", ifile);
+		return EXIT_FAILURE;
+	}
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED) {
+		printf("Failed to map %s, errno %d\n", ifile, errno);
+		return EXIT_FAILURE;
+	}
+	if (memcmp(buf, TRACE_COMPACT_MAGIC, TRACE_COMPACT_MAGIC_LEN) != 0) {
+		printf("%s is not a compact trace file\n", ifile);
+		return EXIT_FAILURE;
+	}
+	madvise(buf, st.st_size, MADV_SEQUENTIAL);
+
+	if (dfile != NULL) {
+		dfp = fopen(dfile, "wb");
+		if (dfp == NULL) {
+			printf("Failed to open %s, errno %d\n", dfile, errno);
+			return EXIT_FAILURE;
+		}
+	}
+
+	trace_decoder_init(&dec, buf + TRACE_COMPACT_MAGIC_LEN, st.st_size - TRACE_COMPACT_MAGIC_LEN, cpu);
+	while ((ret = trace_decode_next(&dec, &ev)) > 0) {
+		event = ev.id & 0xffffffffffffUL;
+		if (dfp != NULL && fwrite(&ev, sizeof(ev), 1, dfp) != 1) {
+			printf("Failed to write %s, errno %d\n", dfile, errno);
+			return EXIT_FAILURE;
+		}
+		if (do_vm_exit)
+			vm_exit_event(&ev, event);
+		if (do_irq)
+			irq_event(&ev, event);
+	}
+	if (ret < 0) {
+		/* the last record may be cut when acrntrace stopped, keep what was decoded */
+		printf("WARN: corrupted trace data at offset %zu, stop decoding there\n",
+			dec.pos + TRACE_COMPACT_MAGIC_LEN);
+		ret = 0;
+	}
+
+	if (dfp != NULL)
+		fclose(dfp);
+
+	if (do_vm_exit || do_irq) {
+		if (snprintf(csv_name, sizeof(csv_name), "%s.csv", ofile) >= (int)sizeof(csv_name)) {
+			printf("output file name is too long\n");
+			return EXIT_FAILURE;
+		}
+		csv = fopen(csv_name, "a");
+		if (csv == NULL) {
+			printf("Output File Error: %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+		if (do_vm_exit) {
+			printf("VM exits analysis started... \n\tinput file: %s\n"
+				"\toutput file: %s\n", ifile, csv_name);
+			if (vm_exit_report(csv, freq))
+				ret = -1;
+		}
+		if (do_irq) {
+			printf("IRQ analysis started... \n\tinput file: %s\n"
+				"\toutput file: %s\n", ifile, csv_name);
+			if (irq_report(csv, freq))
+				ret = -1;
+		}
+		fclose(csv);
+	}
+
+	munmap(buf, st.st_size);
+	close(fd);
+
+	return (ret < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -7,16 +7,12 @@
 #include <asm/errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include "sbuf.h"
 #include <errno.h>
 
-static inline bool sbuf_is_empty(shared_buf_t *sbuf)
-{
-	return (sbuf->head == sbuf->tail);
-}
-
 static inline uint32_t sbuf_next_ptr(uint32_t pos,
 		uint32_t span, uint32_t scope)
 {
@@ -46,29 +42,95 @@ int sbuf_get(shared_buf_t *sbuf, uint8_t *data)
 	return sbuf->ele_size;
 }
 
+/**
+ * Get the elements buffered in sbuf in place, without consuming them.
+ *
+ * span[0] starts at the head, span[1] at the base of the buffer if the
+ * elements wrap around its end, and is empty otherwise.
+ *
+ * return: the number of bytes buffered, span[0].len + span[1].len.
+ */
+uint32_t sbuf_peek(shared_buf_t *sbuf, struct sbuf_span span[2])
+{
+	uint32_t head, tail;
+	void *base;
+
+	if ((sbuf == NULL) || (span == NULL))
+		return 0;
+
+	head = sbuf->head;
+	tail = sbuf->tail;
+	/* read the elements only after the tail publishing them */
+	mb();
+
+	base = (void *)sbuf + SBUF_HEAD_SIZE;
+	span[0].data = base + head;
+	span[1].data = base;
+	if (tail >= head) {
+		span[0].len = tail - head;
+		span[1].len = 0;
+	} else {
+		span[0].len = sbuf->size - head;
+		span[1].len = tail;
+	}
+
+	return span[0].len + span[1].len;
+}
+
+/**
+ * Consume the first len bytes returned by sbuf_peek(), with a single update
+ * of the head however many elements they hold. With VARLEN_EN, len may be
+ * any number of bytes.
+ *
+ * @pre len <= the bytes returned by the last sbuf_peek()
+ */
+int sbuf_commit(shared_buf_t *sbuf, uint32_t len)
+{
+	if ((sbuf == NULL) || (((sbuf->flags & VARLEN_EN) == 0) && ((len % sbuf->ele_size) != 0U)))
+		return -EINVAL;
+
+	/* make sure the elements are read before the producer reuses them */
+	mb();
+
+	sbuf->head = sbuf_next_ptr(sbuf->head, len, sbuf->size);
+
+	return 0;
+}
+
+/* Write all the elements buffered in sbuf to fd, with a single writev() */
 int sbuf_write(int fd, shared_buf_t *sbuf)
 {
-	const void *start;
-	int written;
+	struct sbuf_span span[2];
+	struct iovec iov[2];
+	uint32_t len;
+	ssize_t written;
 
 	if (sbuf == NULL)
 		return -EINVAL;
 
-	if (sbuf_is_empty(sbuf)) {
+	len = sbuf_peek(sbuf, span);
+	if (len == 0) {
 		return 0;
 	}
 
-	start = (void *)sbuf + SBUF_HEAD_SIZE + sbuf->head;
-        written = write(fd, start, sbuf->ele_size);
-	if (written != sbuf->ele_size) {
-		printf("Failed to write: ret %d (ele_size %d), errno %d\n",
-			written, sbuf->ele_size, (written == -1) ? errno : 0);
+	iov[0].iov_base = span[0].data;
+	iov[0].iov_len = span[0].len;
+	iov[1].iov_base = span[1].data;
+	iov[1].iov_len = span[1].len;
+	written = writev(fd, iov, (span[1].len != 0) ? 2 : 1);
+	if (written != (ssize_t)len) {
+		printf("Failed to write: ret %zd (len %u), errno %d\n",
+			written, len, (written == -1) ? errno : 0);
+		/* don't write again the elements that made it to the file */
+		if (written > 0)
+			sbuf_commit(sbuf, ((sbuf->flags & VARLEN_EN) != 0) ? (uint32_t)written :
+				((uint32_t)written - ((uint32_t)written % sbuf->ele_size)));
 		return -1;
 	}
 
-	sbuf->head = sbuf_next_ptr(sbuf->head, sbuf->ele_size, sbuf->size);
+	sbuf_commit(sbuf, len);
 
-	return sbuf->ele_size;
+	return len;
 }
 
 int sbuf_clear_buffered(shared_buf_t *sbuf)
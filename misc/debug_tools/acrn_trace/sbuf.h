@@ -7,6 +7,7 @@
 #ifndef SHARED_BUF_H
 #define SHARED_BUF_H
 
+#include <stdbool.h>
 #include <linux/types.h>
 
 #define SBUF_MAGIC 0x5aa57aa71aa13aa3
@@ -16,11 +17,15 @@
 /* sbuf flags */
 #define OVERRUN_CNT_EN  (1ULL << 0) /* whether overrun counting is enabled */
 #define OVERWRITE_EN    (1ULL << 1) /* whether overwrite is enabled */
+#define WATERMARK_NOTIFY_EN (1ULL << 2) /* whether the HV notifies when watermark bytes are buffered */
+#define VARLEN_EN       (1ULL << 3) /* whether the data are variable-length records in place of elements */
 
 typedef unsigned char uint8_t;
 typedef unsigned int uint32_t;
 typedef unsigned long uint64_t;
 
+#define mb()    ({ asm volatile("mfence" ::: "memory"); (void)0; })
+
 /**
  * (sbuf) head + buf (store (ele_num - 1) elements at most)
  * buffer empty: tail == head
@@ -47,9 +52,15 @@ typedef struct shared_buf {
         uint64_t flags;
         uint32_t overrun_cnt;   /* count of overrun */
         uint32_t size;          /* ele_num * ele_size */
-        uint32_t padding[6];
+        uint32_t watermark;     /* bytes buffered to notify at, with WATERMARK_NOTIFY_EN */
+        uint32_t padding[5];
 } shared_buf_t;
 
+static inline bool sbuf_is_empty(shared_buf_t *sbuf)
+{
+	return (sbuf->head == sbuf->tail);
+}
+
 static inline void sbuf_clear_flags(shared_buf_t *sbuf, uint64_t flags)
 {
         sbuf->flags &= ~flags;
@@ -65,7 +76,15 @@ static inline void sbuf_add_flags(shared_buf_t *sbuf, uint64_t flags)
         sbuf->flags |= flags;
 }
 
+/* Contiguous elements buffered in a shared_buf, see sbuf_peek() */
+struct sbuf_span {
+	void *data;
+	uint32_t len;		/* in bytes, a multiple of ele_size */
+};
+
 int sbuf_get(shared_buf_t *sbuf, uint8_t *data);
+uint32_t sbuf_peek(shared_buf_t *sbuf, struct sbuf_span span[2]);
+int sbuf_commit(shared_buf_t *sbuf, uint32_t len);
 int sbuf_write(int fd, shared_buf_t *sbuf);
 int sbuf_clear_buffered(shared_buf_t *sbuf);
 #endif /* SHARED_BUF_H */
@@ -10,6 +10,7 @@ This is the main script of arnalyzer, which:
 import sys
 import getopt
 import os
+import subprocess
 from vmexit_analyze import analyze_vm_exit
 from irq_analyze import analyze_irq
 
@@ -31,6 +32,27 @@ def usage():
     --irq: to generate irq related report
     ''')
 
+# written at the start of the trace files recorded by acrntrace -z
+COMPACT_MAGIC = b'ACRNTRZ1'
+
+def decode_compact(ifile):
+    """decode a trace file of the compact format to the fixed one
+
+    Args:
+        ifile: input trace data file
+    Returns:
+        ifile if it is in the fixed format already, or the decoded file
+    Raises:
+        CalledProcessError
+    """
+    with open(ifile, 'rb') as fd:
+        if fd.read(len(COMPACT_MAGIC)) != COMPACT_MAGIC:
+            return ifile
+
+    dfile = ifile + '.fixed'
+    subprocess.run(['acrntrace_decode', '-i', ifile, '-d', dfile], check=True)
+    return dfile
+
 def do_analysis(ifile, ofile, analyzer, freq):
     """do the specific analysis
 
@@ -44,6 +66,7 @@ def do_analysis(ifile, ofile, analyzer, freq):
     Raises:
         NA
     """
+    ifile = decode_compact(ifile)
     for alyer in analyzer:
         alyer(ifile, ofile, freq)
 
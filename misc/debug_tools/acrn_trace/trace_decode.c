@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <string.h>
+#include <stdbool.h>
+#include "trace_decode.h"
+
+/*
+ * buf holds the records of one pCPU, without the file magic. cpu is only
+ * reported in the events, the records don't carry it.
+ */
+void trace_decoder_init(struct trace_decoder *dec, const void *buf, size_t len, uint8_t cpu)
+{
+	memset(dec, 0, sizeof(*dec));
+	dec->buf = buf;
+	dec->len = len;
+	dec->cpu = cpu;
+}
+
+static bool get_u8(struct trace_decoder *dec, uint8_t *v)
+{
+	if (dec->pos >= dec->len)
+		return false;
+
+	*v = dec->buf[dec->pos++];
+	return true;
+}
+
+static bool get_varint(struct trace_decoder *dec, uint64_t *v)
+{
+	uint64_t r = 0;
+	uint32_t shift = 0;
+	uint8_t b;
+
+	do {
+		if (shift > 63 || !get_u8(dec, &b))
+			return false;
+		r |= (uint64_t)(b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
+
+	*v = r;
+	return true;
+}
+
+static bool get_payload(struct trace_decoder *dec, uint8_t kind, trace_ev_t *ev)
+{
+	uint64_t v[4];
+	uint8_t n;
+	int i;
+
+	memset(ev->str, 0, sizeof(ev->str));
+
+	switch (kind) {
+	case TRACE_KIND_2L:
+		if (!get_varint(dec, &v[0]) || !get_varint(dec, &v[1]))
+			return false;
+		ev->e = v[0];
+		ev->f = v[1];
+		ev->id |= 2UL << 48;
+		break;
+	case TRACE_KIND_4I:
+		for (i = 0; i < 4; i++) {
+			if (!get_varint(dec, &v[i]))
+				return false;
+		}
+		ev->a = (uint32_t)v[0];
+		ev->b = (uint32_t)v[1];
+		ev->c = (uint32_t)v[2];
+		ev->d = (uint32_t)v[3];
+		ev->id |= 4UL << 48;
+		break;
+	case TRACE_KIND_6C:
+		if (dec->len - dec->pos < 6)
+			return false;
+		memcpy(ev->str, &dec->buf[dec->pos], 6);
+		dec->pos += 6;
+		ev->id |= 8UL << 48;
+		break;
+	case TRACE_KIND_STR:
+		if (!get_u8(dec, &n) || n >= sizeof(ev->str) || dec->len - dec->pos < n)
+			return false;
+		memcpy(ev->str, &dec->buf[dec->pos], n);
+		dec->pos += n;
+		ev->id |= 16UL << 48;
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Decode the next event to ev, going through the SYNC and DEF records before
+ * it.
+ *
+ * return:
+ * 1:	an event is decoded.
+ * 0:	no more events, the records end.
+ * -1:	the records are corrupted, or truncated in the middle of one.
+ */
+int trace_decode_next(struct trace_decoder *dec, trace_ev_t *ev)
+{
+	uint64_t evid, delta;
+	uint8_t tag, def_tag, kind;
+
+	while (get_u8(dec, &tag)) {
+		switch (tag) {
+		case TRACE_REC_SYNC:
+			if (dec->len - dec->pos < sizeof(dec->tsc))
+				return -1;
+			memcpy(&dec->tsc, &dec->buf[dec->pos], sizeof(dec->tsc));
+			dec->pos += sizeof(dec->tsc);
+			break;
+		case TRACE_REC_DEF:
+			if (!get_u8(dec, &def_tag) || !get_u8(dec, &kind) || !get_varint(dec, &evid)
+					|| def_tag < TRACE_REC_TAG_BASE)
+				return -1;
+			dec->tag_evid[def_tag] = (uint32_t)evid;
+			dec->tag_kind[def_tag] = kind;
+			break;
+		case TRACE_REC_RAW:
+			if (!get_u8(dec, &kind) || !get_varint(dec, &evid))
+				return -1;
+			/* fall through */
+		default:
+			if (tag != TRACE_REC_RAW) {
+				evid = dec->tag_evid[tag];
+				kind = dec->tag_kind[tag];
+			}
+			if (!get_varint(dec, &delta))
+				return -1;
+			dec->tsc += delta;
+			ev->tsc = dec->tsc;
+			ev->id = (evid & 0xffffffffffffUL) | ((uint64_t)dec->cpu << 56);
+			return get_payload(dec, kind, ev) ? 1 : -1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef TRACE_DECODE_H
+#define TRACE_DECODE_H
+
+#include <stddef.h>
+#include "acrntrace.h"
+
+/*
+ * Decoder of the compact trace format the HV writes when VARLEN_EN is set on
+ * a trace sbuf, see trace_put_compact() in hypervisor/debug/trace.c for the
+ * records. The events are decoded to the trace_ev_t of the fixed format, so
+ * the result can be analyzed, or written out for the scripts, as before.
+ */
+
+/* acrntrace -z writes it at the start of each compact trace file */
+#define TRACE_COMPACT_MAGIC	"ACRNTRZ1"
+#define TRACE_COMPACT_MAGIC_LEN	8
+
+#define TRACE_REC_SYNC		0U
+#define TRACE_REC_DEF		1U
+#define TRACE_REC_RAW		2U
+#define TRACE_REC_TAG_BASE	3U
+
+#define TRACE_KIND_2L		0U
+#define TRACE_KIND_4I		1U
+#define TRACE_KIND_6C		2U
+#define TRACE_KIND_STR		3U
+
+struct trace_decoder {
+	const uint8_t *buf;
+	size_t len;
+	size_t pos;
+
+	uint64_t tsc;
+	uint8_t cpu;
+	uint32_t tag_evid[256];
+	uint8_t tag_kind[256];
+};
+
+void trace_decoder_init(struct trace_decoder *dec, const void *buf, size_t len, uint8_t cpu);
+int trace_decode_next(struct trace_decoder *dec, trace_ev_t *ev);
+
+#endif /* TRACE_DECODE_H */
@@ -0,0 +1,470 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * A bare-metal payload timing the VM exits, I/O request round trips and
+ * interrupt injections of a User VM, in TSC cycles, against the hvbench
+ * device of the DM. See README.rst.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hvbench.h"
+
+#define PCI_CONF_ADDR		0xcf8U
+#define PCI_CONF_DATA		0xcfcU
+#define PCI_CONF_ENABLE		0x80000000U
+#define PCI_ID			0x00U
+#define PCI_COMMAND		0x04U
+#define PCI_COMMAND_IO		0x1U
+#define PCI_COMMAND_MEM		0x2U
+#define PCI_STATUS_CAP_LIST	(0x10U << 16U)
+#define PCI_BAR(n)		(0x10U + ((n) * 4U))
+#define PCI_CAP_PTR		0x34U
+#define PCI_INTERRUPT_LINE	0x3cU
+#define PCI_CAP_ID_MSI		0x05U
+#define PCI_MSI_ENABLE		(1U << 16U)
+#define PCI_MSI_64BIT		(1U << 23U)
+
+#define PIC_MASTER_IMR		0x21U
+#define PIC_SLAVE_IMR		0xa1U
+
+#define IOAPIC_BASE		0xfec00000U
+#define IOAPIC_REGSEL		0x00U
+#define IOAPIC_WINDOW		0x10U
+#define IOAPIC_RTE(irq)		(0x10U + ((irq) * 2U))
+#define IOAPIC_RTE_LOW_ACTIVE	(1U << 13U)
+#define IOAPIC_RTE_LEVEL	(1U << 15U)
+
+#define LAPIC_BASE		0xfee00000U
+#define LAPIC_ID		0x020U
+#define LAPIC_EOI		0x0b0U
+#define LAPIC_SVR		0x0f0U
+#define LAPIC_SVR_ENABLE	0x100U
+#define LAPIC_ICR_LO		0x300U
+#define LAPIC_ICR_SELF		(1U << 18U)
+#define IPI_VECTOR		0x40U
+#define MSI_VECTOR		0x50U
+#define INTX_VECTOR		0x51U
+
+#define KVM_CPUID_SIGNATURE	0x40000100U
+#define KVM_HC_VAPIC_POLL_IRQ	1U
+
+/* the latency probe of the hypervisor, see ACRN_MSR_LAT_ACK */
+#define ACRN_CPUID_SIGNATURE	0x40000000U
+#define ACRN_CPUID_CAPS		0x40000001U
+#define GUEST_CAPS_LAT_ACK	(1U << 3U)
+#define ACRN_MSR_LAT_ACK	0x40000200U
+
+/* the samples taken before the timed ones, to warm the caches and TLBs up */
+#define WARMUP_ITERS		16U
+
+/* the TSC cycles to wait for an interrupt before giving up on its op */
+#define IRQ_TIMEOUT		10000000000ULL
+
+struct idt_entry {
+	uint16_t offset_lo;
+	uint16_t selector;
+	uint8_t zero;
+	uint8_t type;
+	uint16_t offset_hi;
+} __attribute__((packed));
+
+struct idt_ptr {
+	uint16_t limit;
+	uint32_t base;
+} __attribute__((packed));
+
+extern char exc_stubs[];
+extern void ipi_entry(void);
+extern void irq_entry(void);
+void hvbench_main(void);
+void hvbench_fault(uint32_t vector);
+void hvbench_irq(void);
+
+volatile uint64_t ipi_tsc;
+volatile uint64_t irq_tsc;
+
+static struct idt_entry idt[256] __attribute__((aligned(8)));
+static uint32_t samples[HVBENCH_ITERS_MAX];
+static struct hvbench_result results[HVBENCH_OP_NUM];
+static uint16_t pio_base;
+static volatile uint32_t *mmio_base;
+static uint32_t pci_dev;
+static uint32_t msi_cap;	/* 0 if none */
+static bool intx;		/* the INTx line is routed to the vIOAPIC */
+static bool intx_on;		/* the interrupts are INTx rather than MSI */
+static bool lat_ack;
+static bool op_failed;
+
+static inline void outb(uint16_t port, uint8_t val)
+{
+	asm volatile("outb %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline void outl(uint16_t port, uint32_t val)
+{
+	asm volatile("outl %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint32_t inl(uint16_t port)
+{
+	uint32_t val;
+
+	asm volatile("inl %1, %0" : "=a"(val) : "Nd"(port));
+	return val;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d)
+{
+	asm volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0U));
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32U)));
+}
+
+/* ordered against the instructions before it, not the ones after */
+static inline uint64_t rdtsc(void)
+{
+	uint32_t lo, hi;
+
+	asm volatile("lfence; rdtsc" : "=a"(lo), "=d"(hi) : : "memory");
+	return ((uint64_t)hi << 32U) | lo;
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t val)
+{
+	*(volatile uint32_t *)(LAPIC_BASE + reg) = val;
+}
+
+static inline uint32_t lapic_read(uint32_t reg)
+{
+	return *(volatile uint32_t *)(LAPIC_BASE + reg);
+}
+
+static void ioapic_write(uint32_t reg, uint32_t val)
+{
+	*(volatile uint32_t *)(IOAPIC_BASE + IOAPIC_REGSEL) = reg;
+	*(volatile uint32_t *)(IOAPIC_BASE + IOAPIC_WINDOW) = val;
+}
+
+static uint32_t pci_read(uint32_t dev, uint32_t reg)
+{
+	outl(PCI_CONF_ADDR, PCI_CONF_ENABLE | (dev << 11U) | reg);
+	return inl(PCI_CONF_DATA);
+}
+
+static void pci_write(uint32_t dev, uint32_t reg, uint32_t val)
+{
+	outl(PCI_CONF_ADDR, PCI_CONF_ENABLE | (dev << 11U) | reg);
+	outl(PCI_CONF_DATA, val);
+}
+
+/* the hvbench device, function 0 of a slot of bus 0 */
+static bool find_device(void)
+{
+	uint32_t dev, cmd;
+	bool found = false;
+
+	for (dev = 0U; dev < 32U; dev++) {
+		if (pci_read(dev, PCI_ID) == ((HVBENCH_DEVICE_ID << 16U) | HVBENCH_VENDOR_ID)) {
+			pio_base = (uint16_t)(pci_read(dev, PCI_BAR(HVBENCH_PIO_BAR)) & ~0x3U);
+			mmio_base = (volatile uint32_t *)(pci_read(dev, PCI_BAR(HVBENCH_MMIO_BAR)) & ~0xfU);
+			cmd = pci_read(dev, PCI_COMMAND) & 0xffffU;
+			pci_write(dev, PCI_COMMAND, cmd | PCI_COMMAND_IO | PCI_COMMAND_MEM);
+			found = (inl(pio_base + HVBENCH_REG_ID) == HVBENCH_MAGIC);
+			pci_dev = dev;
+			break;
+		}
+	}
+
+	return found;
+}
+
+/* MSI 0 to this CPU, and the INTx line, active low and level triggered */
+static void setup_device_interrupts(void)
+{
+	uint32_t ptr, cap, apic_id, irq;
+
+	if ((pci_read(pci_dev, PCI_COMMAND) & PCI_STATUS_CAP_LIST) != 0U) {
+		ptr = pci_read(pci_dev, PCI_CAP_PTR) & 0xfcU;
+		while ((ptr != 0U) && (msi_cap == 0U)) {
+			cap = pci_read(pci_dev, ptr);
+			if ((cap & 0xffU) == PCI_CAP_ID_MSI) {
+				msi_cap = ptr;
+			}
+			ptr = (cap >> 8U) & 0xfcU;
+		}
+	}
+
+	apic_id = lapic_read(LAPIC_ID) >> 24U;
+	if (msi_cap != 0U) {
+		cap = pci_read(pci_dev, msi_cap);
+		pci_write(pci_dev, msi_cap + 4U, LAPIC_BASE | (apic_id << 12U));
+		if ((cap & PCI_MSI_64BIT) != 0U) {
+			pci_write(pci_dev, msi_cap + 8U, 0U);
+			pci_write(pci_dev, msi_cap + 12U, MSI_VECTOR);
+		} else {
+			pci_write(pci_dev, msi_cap + 8U, MSI_VECTOR);
+		}
+	}
+
+	irq = pci_read(pci_dev, PCI_INTERRUPT_LINE) & 0xffU;
+	if ((irq != 0U) && (irq != 0xffU)) {
+		ioapic_write(IOAPIC_RTE(irq) + 1U, apic_id << 24U);
+		ioapic_write(IOAPIC_RTE(irq), INTX_VECTOR | IOAPIC_RTE_LOW_ACTIVE | IOAPIC_RTE_LEVEL);
+		intx = true;
+	}
+}
+
+/* the MSI and the INTx of the device are exclusive */
+static void set_msi(bool enable)
+{
+	uint32_t cap;
+
+	if (msi_cap != 0U) {
+		cap = pci_read(pci_dev, msi_cap);
+		pci_write(pci_dev, msi_cap, enable ? (cap | PCI_MSI_ENABLE) : (cap & ~PCI_MSI_ENABLE));
+	}
+	intx_on = !enable;
+}
+
+static void set_idt_entry(uint32_t vector, uint32_t handler)
+{
+	idt[vector].offset_lo = (uint16_t)handler;
+	idt[vector].selector = 0x8U;
+	idt[vector].zero = 0U;
+	idt[vector].type = 0x8eU;	/* present, 32-bit interrupt gate */
+	idt[vector].offset_hi = (uint16_t)(handler >> 16U);
+}
+
+static void setup_interrupts(void)
+{
+	struct idt_ptr ptr;
+	uint32_t i;
+
+	for (i = 0U; i < 32U; i++) {
+		set_idt_entry(i, (uint32_t)exc_stubs + (i * 16U));
+	}
+	set_idt_entry(IPI_VECTOR, (uint32_t)ipi_entry);
+	set_idt_entry(MSI_VECTOR, (uint32_t)irq_entry);
+	set_idt_entry(INTX_VECTOR, (uint32_t)irq_entry);
+	ptr.limit = sizeof(idt) - 1U;
+	ptr.base = (uint32_t)idt;
+	asm volatile("lidt %0" : : "m"(ptr));
+
+	/* only the self IPIs and the interrupts of the device */
+	outb(PIC_MASTER_IMR, 0xffU);
+	outb(PIC_SLAVE_IMR, 0xffU);
+	lapic_write(LAPIC_SVR, lapic_read(LAPIC_SVR) | LAPIC_SVR_ENABLE | 0xffU);
+	setup_device_interrupts();
+	asm volatile("sti");
+}
+
+static bool is_kvm(void)
+{
+	uint32_t a, b, c, d;
+
+	cpuid(KVM_CPUID_SIGNATURE, &a, &b, &c, &d);
+	/* "KVMKVMKVM\0\0\0" */
+	return (b == 0x4b4d564bU) && (c == 0x564b4d56U) && (d == 0x4dU);
+}
+
+static bool is_acrn_lat_ack(void)
+{
+	uint32_t a, b, c, d;
+	bool ret = false;
+
+	cpuid(ACRN_CPUID_SIGNATURE, &a, &b, &c, &d);
+	/* "ACRNACRNACRN" */
+	if ((b == 0x4e524341U) && (c == 0x4e524341U) && (d == 0x4e524341U)) {
+		cpuid(ACRN_CPUID_CAPS, &a, &b, &c, &d);
+		ret = ((a & GUEST_CAPS_LAT_ACK) != 0U);
+	}
+
+	return ret;
+}
+
+/* from irq_entry, once it took the timestamp */
+void hvbench_irq(void)
+{
+	uint32_t vector = intx_on ? INTX_VECTOR : MSI_VECTOR;
+
+	if (lat_ack) {
+		wrmsr(ACRN_MSR_LAT_ACK, vector);
+	}
+	if (intx_on) {
+		outl(pio_base + HVBENCH_REG_IRQ_ACK, 1U);
+	}
+	lapic_write(LAPIC_EOI, 0U);
+}
+
+/* from the DM raising the interrupt of op to irq_entry, TSC of the Service VM */
+static uint32_t time_irq(enum hvbench_op op)
+{
+	uint64_t src, t0;
+
+	irq_tsc = 0UL;
+	outl(pio_base + HVBENCH_REG_IRQ, op);
+	if (inl(pio_base + HVBENCH_REG_IRQ) != 0U) {
+		op_failed = true;
+	} else {
+		t0 = rdtsc();
+		while ((irq_tsc == 0UL) && ((rdtsc() - t0) < IRQ_TIMEOUT)) {
+			asm volatile("pause");
+		}
+		op_failed = (irq_tsc == 0UL);
+	}
+
+	src = inl(pio_base + HVBENCH_REG_IRQ_TSC);
+	src |= (uint64_t)inl(pio_base + HVBENCH_REG_IRQ_TSC + 4U) << 32U;
+
+	return (!op_failed && (irq_tsc > src)) ? (uint32_t)(irq_tsc - src) : 0U;
+}
+
+static uint32_t time_op(enum hvbench_op op)
+{
+	uint32_t a, b, c, d;
+	uint64_t t0, t1;
+
+	t0 = rdtsc();
+	switch (op) {
+	case HVBENCH_OP_CPUID:
+		cpuid(0U, &a, &b, &c, &d);
+		break;
+	case HVBENCH_OP_PIO_HV:
+		(void)inl(PCI_CONF_ADDR);
+		break;
+	case HVBENCH_OP_PIO_DM:
+		(void)inl(pio_base + HVBENCH_REG_ID);
+		break;
+	case HVBENCH_OP_MMIO_DM:
+		(void)*mmio_base;
+		break;
+	case HVBENCH_OP_HYPERCALL:
+		a = KVM_HC_VAPIC_POLL_IRQ;
+		asm volatile("vmcall" : "+a"(a) : : "memory");
+		break;
+	case HVBENCH_OP_IPI:
+		ipi_tsc = 0UL;
+		lapic_write(LAPIC_ICR_LO, LAPIC_ICR_SELF | IPI_VECTOR);
+		while (ipi_tsc == 0UL) {
+			asm volatile("pause");
+		}
+		break;
+	case HVBENCH_OP_IRQ_MSI:
+	case HVBENCH_OP_IRQ_IRQFD:
+	case HVBENCH_OP_IRQ_INTX:
+		return time_irq(op);
+	default:
+		break;
+	}
+	t1 = (op == HVBENCH_OP_IPI) ? ipi_tsc : rdtsc();
+
+	return (t1 > t0) ? (uint32_t)(t1 - t0) : 0U;
+}
+
+static void sift_down(uint32_t *s, uint32_t root, uint32_t n)
+{
+	uint32_t child, tmp;
+
+	while ((child = (2U * root) + 1U) < n) {
+		if (((child + 1U) < n) && (s[child] < s[child + 1U])) {
+			child++;
+		}
+		if (s[root] >= s[child]) {
+			break;
+		}
+		tmp = s[root];
+		s[root] = s[child];
+		s[child] = tmp;
+		root = child;
+	}
+}
+
+static void sort(uint32_t *s, uint32_t n)
+{
+	uint32_t i, tmp;
+
+	for (i = n / 2U; i > 0U; i--) {
+		sift_down(s, i - 1U, n);
+	}
+	for (i = n; i > 1U; i--) {
+		tmp = s[0];
+		s[0] = s[i - 1U];
+		s[i - 1U] = tmp;
+		sift_down(s, 0U, i - 1U);
+	}
+}
+
+static void run_op(enum hvbench_op op, uint32_t iters)
+{
+	struct hvbench_result *res = &results[op];
+	uint32_t i, v;
+
+	res->op = op;
+	op_failed = (op == HVBENCH_OP_HYPERCALL) && !is_kvm();
+	if (op == HVBENCH_OP_IRQ_INTX) {
+		set_msi(false);
+		op_failed = !intx;
+	} else if ((op == HVBENCH_OP_IRQ_MSI) || (op == HVBENCH_OP_IRQ_IRQFD)) {
+		set_msi(true);
+		op_failed = (msi_cap == 0U);
+	}
+
+	for (i = 0U; (i < WARMUP_ITERS) && !op_failed; i++) {
+		(void)time_op(op);
+	}
+	for (i = 0U; (i < iters) && !op_failed; i++) {
+		samples[i] = time_op(op);
+	}
+
+	/* the ones cut short by a missing interrupt are not available */
+	if (!op_failed) {
+
+		for (i = 0U; i < iters; i++) {
+			v = samples[i];
+			res->total += v;
+			res->hist[(v == 0U) ? 0U : (31U - (uint32_t)__builtin_clz(v))]++;
+		}
+		sort(samples, iters);
+		res->count = iters;
+		res->min = samples[0];
+		res->p50 = samples[(iters - 1U) / 2U];
+		res->p99 = samples[((iters - 1U) * 99U) / 100U];
+		res->max = samples[iters - 1U];
+	}
+
+	outl(pio_base + HVBENCH_REG_RESULT, (uint32_t)res);
+}
+
+void hvbench_main(void)
+{
+	uint32_t iters, op;
+
+	if (find_device()) {
+		setup_interrupts();
+		lat_ack = is_acrn_lat_ack();
+
+		iters = inl(pio_base + HVBENCH_REG_ITERS);
+		if ((iters == 0U) || (iters > HVBENCH_ITERS_MAX)) {
+			iters = HVBENCH_ITERS_MAX;
+		}
+		for (op = 0U; op < HVBENCH_OP_NUM; op++) {
+			run_op((enum hvbench_op)op, iters);
+		}
+		outl(pio_base + HVBENCH_REG_DONE, 0U);
+	}
+}
+
+void hvbench_fault(uint32_t vector)
+{
+	if (pio_base != 0U) {
+		outl(pio_base + HVBENCH_REG_DONE, vector + 1U);
+	}
+}
@@ -0,0 +1,95 @@
+#!/bin/bash
+# Copyright (C) 2022 Intel Corporation.
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Load generator run in a User VM against the virtio-blk and virtio-net
+# devices of the Device Model, see README.rst.
+
+usage() {
+	echo "Usage: $0 blk <disk> [seconds]"
+	echo "       $0 net <interface> [seconds] [frame size]"
+	exit 1
+}
+
+# blk <disk> <seconds>: one fio job per hardware queue, pinned to a CPU of the queue
+bench_blk() {
+	local disk=$1 secs=$2 q cpu jobs=""
+
+	command -v fio > /dev/null || { echo "fio is required"; exit 1; }
+	[ -b /dev/$disk ] || { echo "/dev/$disk is not a block device"; exit 1; }
+
+	for q in /sys/block/$disk/mq/*; do
+		cpu=$(cut -d, -f1 < $q/cpu_list | cut -d- -f1)
+		jobs="$jobs --name=queue$(basename $q) --cpus_allowed=$cpu"
+	done
+
+	fio --filename=/dev/$disk --direct=1 --ioengine=libaio --time_based \
+		--runtime=$secs --group_reporting=0 \
+		--rw=randread --bs=4k --iodepth=1 --name=latency --cpus_allowed=0
+
+	fio --filename=/dev/$disk --direct=1 --ioengine=libaio --time_based \
+		--runtime=$secs --group_reporting=0 \
+		--rw=randread --bs=4k --iodepth=32 $jobs
+
+	fio --filename=/dev/$disk --direct=1 --ioengine=libaio --time_based \
+		--runtime=$secs --group_reporting=0 \
+		--rw=write --bs=128k --iodepth=16 $jobs
+}
+
+pgset() {
+	echo "$2" > $1
+}
+
+# net <interface> <seconds> <size>: one pktgen thread per tx queue, sending
+# to the MAC of the interface so that null=loopback gives the frames back
+bench_net() {
+	local ifname=$1 secs=$2 size=$3 mac ntx q cpu rx0 rx1 dev
+
+	modprobe pktgen || { echo "pktgen is required"; exit 1; }
+	[ -d /sys/class/net/$ifname ] || { echo "no interface $ifname"; exit 1; }
+	mac=$(cat /sys/class/net/$ifname/address)
+	ntx=$(ls -d /sys/class/net/$ifname/queues/tx-* | wc -l)
+	[ $ntx -le $(nproc) ] || ntx=$(nproc)
+
+	for cpu in $(seq 0 $(($(nproc) - 1))); do
+		pgset /proc/net/pktgen/kpktgend_$cpu "rem_device_all"
+	done
+	for q in $(seq 0 $((ntx - 1))); do
+		dev=$ifname@$q
+		pgset /proc/net/pktgen/kpktgend_$q "add_device $dev"
+		pgset /proc/net/pktgen/$dev "count 0"
+		pgset /proc/net/pktgen/$dev "pkt_size $size"
+		pgset /proc/net/pktgen/$dev "delay 0"
+		pgset /proc/net/pktgen/$dev "queue_map_min $q"
+		pgset /proc/net/pktgen/$dev "queue_map_max $q"
+		pgset /proc/net/pktgen/$dev "dst_mac $mac"
+		pgset /proc/net/pktgen/$dev "dst 198.18.0.1"
+	done
+
+	rx0=$(cat /sys/class/net/$ifname/statistics/rx_packets)
+	pgset /proc/net/pktgen/pgctrl "start" &
+	sleep $secs
+	pgset /proc/net/pktgen/pgctrl "stop"
+	wait
+	rx1=$(cat /sys/class/net/$ifname/statistics/rx_packets)
+
+	for q in $(seq 0 $((ntx - 1))); do
+		echo "tx queue $q: $(grep -A1 '^Result' /proc/net/pktgen/$ifname@$q | tail -n1)"
+	done
+	echo "rx: $(((rx1 - rx0) / secs)) pps"
+	command -v ethtool > /dev/null && ethtool -S $ifname | grep -E 'rx_queue_[0-9]+_packets'
+}
+
+case "$1" in
+blk)
+	[ -n "$2" ] || usage
+	bench_blk $2 ${3:-30}
+	;;
+net)
+	[ -n "$2" ] || usage
+	bench_net $2 ${3:-30} ${4:-64}
+	;;
+*)
+	usage
+	;;
+esac
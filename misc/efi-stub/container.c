@@ -44,6 +44,7 @@
 #include "multiboot.h"
 #include "container.h"
 #include "elf32.h"
+#include "lz4.h"
 
 #define LZH_BOOT_CMD	0u
 #define LZH_BOOT_IMG	1u
@@ -52,6 +53,30 @@
 #define MAX_BOOTCMD_SIZE	(2048 + 256)    /* Max linux command line size plus uefi boot options */
 #define MAX_MODULE_COUNT	32
 
+/* compression of a file in container, the Signature of its header */
+#define LZH_SIG_DUMMY	0x4D445A4Cu	/* "LZDM": stored as is */
+#define LZH_SIG_LZ4	0x20345A4Cu	/* "LZ4 ": an LZ4 block */
+
+/* the firmware calls the procedures it runs on the APs with the UEFI calling convention */
+#define EFI_MSABI	__attribute__((ms_abi))
+
+#define MP_SERVICES_PROTOCOL_GUID \
+	{ 0x3fdda605, 0xa76e, 0x4f46, { 0xad, 0x29, 0x12, 0xf4, 0x53, 0x1b, 0x3d, 0x08 } }
+
+typedef VOID (EFI_MSABI *AP_PROCEDURE)(VOID *arg);
+
+/* EFI_MP_SERVICES_PROTOCOL of the UEFI PI spec, up to the services used here */
+typedef struct _MP_SERVICES {
+	EFI_STATUS (EFI_MSABI *GetNumberOfProcessors)(struct _MP_SERVICES *this,
+		UINTN *nr_cpus, UINTN *nr_enabled_cpus);
+	VOID *GetProcessorInfo;
+	EFI_STATUS (EFI_MSABI *StartupAllAPs)(struct _MP_SERVICES *this, AP_PROCEDURE procedure,
+		BOOLEAN single_thread, EFI_EVENT wait_event, UINTN timeout_us, VOID *arg,
+		UINTN **failed_cpus);
+} MP_SERVICES;
+
+static EFI_GUID MpServicesProtocol = MP_SERVICES_PROTOCOL_GUID;
+
 typedef struct multiboot2_header_tag_relocatable RELOC_INFO;
 typedef struct multiboot2_header_tag_address LADDR_INFO;
 
@@ -88,6 +113,19 @@ typedef struct {
   UINT8         Data[];
 } LOADER_COMPRESSED_HEADER;
 
+/* a module to copy or decompress to its final address */
+struct unpack_job {
+	const LOADER_COMPRESSED_HEADER *lzh;
+	UINT8 *dst;
+	EFI_STATUS status;
+};
+
+struct unpack_queue {
+	struct unpack_job jobs[MAX_MODULE_COUNT];
+	UINTN count;
+	UINTN next;     /* the next job to take, by the BSP or an AP */
+};
+
 struct container {
 	struct hv_loader ops;   /* loader operation table */
 
@@ -192,6 +230,79 @@ out:
 	return err;
 }
 
+/**
+ * @brief Copy or decompress a file in container to its final address. It doesn't
+ * call any UEFI service, so it may run on the APs.
+ *
+ * @param[in]  lzh  Header of the file in container
+ * @param[out] dst  The memory to unpack the file to, of lzh->Size bytes
+ *
+ * @return EFI_SUCCESS(0) on success, non-zero on error
+ */
+static EFI_STATUS unpack_file(const LOADER_COMPRESSED_HEADER *lzh, UINT8 *dst)
+{
+	EFI_STATUS err = EFI_SUCCESS;
+
+	if (lzh->Signature == LZH_SIG_LZ4) {
+		if (lz4_decompress(lzh->Data, lzh->CompressedSize, dst, lzh->Size) != (INTN)lzh->Size)
+			err = EFI_LOAD_ERROR;
+	} else {
+		memcpy((char *)dst, (const char *)lzh->Data, lzh->Size);
+	}
+
+	return err;
+}
+
+static void run_unpack_jobs(struct unpack_queue *q)
+{
+	UINTN i;
+
+	while ((i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) < q->count)
+		q->jobs[i].status = unpack_file(q->jobs[i].lzh, q->jobs[i].dst);
+}
+
+static VOID EFI_MSABI ap_run_unpack_jobs(VOID *arg)
+{
+	run_unpack_jobs((struct unpack_queue *)arg);
+}
+
+/**
+ * @brief Unpack the modules, on the APs when the firmware can start them: with
+ * compressed kernels the boot time goes to their decompression. The BSP unpacks
+ * what the APs did not.
+ *
+ * @param[in] q The modules to unpack
+ *
+ * @return EFI_SUCCESS(0) on success, non-zero on error
+ */
+static EFI_STATUS unpack_modules(struct unpack_queue *q)
+{
+	EFI_STATUS err = EFI_SUCCESS;
+	MP_SERVICES *mp = NULL;
+	UINTN i, nr_cpus, nr_enabled_cpus = 0;
+
+	if ((q->count > 1) && (locate_protocol(&MpServicesProtocol, (void **)&mp) == EFI_SUCCESS)) {
+		(void)uefi_call_wrapper(mp->GetNumberOfProcessors, 3, mp, &nr_cpus, &nr_enabled_cpus);
+		if (nr_enabled_cpus > 1) {
+			err = uefi_call_wrapper(mp->StartupAllAPs, 7, mp, ap_run_unpack_jobs,
+				FALSE, NULL, 0, q, NULL);
+			if (err != EFI_SUCCESS)
+				Print(L"Failed to start the APs to unpack modules %r\n", err);
+		}
+	}
+	run_unpack_jobs(q);
+
+	err = EFI_SUCCESS;
+	for (i = 0; i < q->count; i++) {
+		if (q->jobs[i].status != EFI_SUCCESS) {
+			Print(L"Failed to unpack module 0x%x %r\n", i, q->jobs[i].status);
+			err = q->jobs[i].status;
+		}
+	}
+
+	return err;
+}
+
 static int parse_boot_image(const UINT8 *data, EFI_PHYSICAL_ADDRESS *hv_entry,
 	UINT8 *mb_version, LADDR_INFO **laddr, RELOC_INFO **reloc, const void **mb_header)
 {
@@ -238,6 +349,8 @@ static EFI_STATUS container_load_boot_image(HV_LOADER hvld)
 	EFI_STATUS err = EFI_SUCCESS;
 	struct container *ctr = (struct container *)hvld;
 	const void *mb_hdr;
+	const UINT8 *image;
+	EFI_PHYSICAL_ADDRESS image_hpa = 0;
 
 	LOADER_COMPRESSED_HEADER *lzh = NULL;
 
@@ -256,10 +369,27 @@ static EFI_STATUS container_load_boot_image(HV_LOADER hvld)
 		}
 	}
 
-	/* parse and load boot image */
+	/* parse and load boot image, decompressed to a temporary buffer first: its segments are
+	 * loaded at the addresses of its ELF header */
 	lzh = ctr->lzh_ptr[LZH_BOOT_IMG];
+	image = lzh->Data;
+	if (lzh->Signature != LZH_SIG_DUMMY) {
+		err = allocate_pages(AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(lzh->Size), &image_hpa);
+		if (err != EFI_SUCCESS) {
+			Print(L"Failed to allocate memory to decompress ACRN HV %r\n", err);
+			image_hpa = 0;
+			goto out;
+		}
+
+		err = unpack_file(lzh, (UINT8 *)image_hpa);
+		if (err != EFI_SUCCESS) {
+			Print(L"Failed to decompress ACRN HV %r\n", err);
+			goto out;
+		}
+		image = (const UINT8 *)image_hpa;
+	}
 
-	if (parse_boot_image((const UINT8 *)lzh->Data, &ctr->hv_entry, &ctr->mb_version,
+	if (parse_boot_image(image, &ctr->hv_entry, &ctr->mb_version,
 		&ctr->laddr, &ctr->reloc, &mb_hdr) < 0) {
 		err = EFI_INVALID_PARAMETER;
 		goto out;
@@ -270,9 +400,9 @@ static EFI_STATUS container_load_boot_image(HV_LOADER hvld)
 		if (!ctr->laddr) {
 			/* GRUB will fail if the elf image contains ".rela" section. We simply ignore it. */
 			UINT32 hv_ram_size = 0;
-			err = load_acrn_elf(lzh->Data, &ctr->hv_hpa, 0, &hv_ram_size, ctr->reloc);
+			err = load_acrn_elf(image, &ctr->hv_hpa, 0, &hv_ram_size, ctr->reloc);
 			ctr->est_hv_ram_size = hv_ram_size;
-			ctr->hv_entry = elf_get_entry((Elf32_Ehdr *)lzh->Data);
+			ctr->hv_entry = elf_get_entry((Elf32_Ehdr *)image);
 		} else {
 			/*
 			 * Multiboot2 specs address tag contains only one pair of load address and end address, which implies that
@@ -286,7 +416,7 @@ static EFI_STATUS container_load_boot_image(HV_LOADER hvld)
 			UINT32 load_addr = ctr->laddr->load_addr;
 			UINT32 load_size = ctr->laddr->load_end_addr - ctr->laddr->load_addr;
 
-			err = load_acrn_elf(lzh->Data, &ctr->hv_hpa, load_addr, &load_size, ctr->reloc);
+			err = load_acrn_elf(image, &ctr->hv_hpa, load_addr, &load_size, ctr->reloc);
 		}
 
 		if (err != EFI_SUCCESS) {
@@ -304,16 +434,19 @@ static EFI_STATUS container_load_boot_image(HV_LOADER hvld)
 		/* Multiboot 1. We don't do relocation for MB1 case. The ".rela" section will be ignored. */
 		/* TODO: add support for the case when AOUT_KLUDGE flag is set */
 		UINT32 hv_ram_size = 0;
-		err = load_acrn_elf(lzh->Data, &ctr->hv_hpa, 0, &hv_ram_size, NULL);
+		err = load_acrn_elf(image, &ctr->hv_hpa, 0, &hv_ram_size, NULL);
 		if (err != EFI_SUCCESS) {
 			Print(L"Failed to load ACRN HV ELF Image%r\n", err);
 			goto out;
 		}
 		ctr->est_hv_ram_size = hv_ram_size;
-		ctr->hv_entry = elf_get_entry((Elf32_Ehdr *)lzh->Data);
+		ctr->hv_entry = elf_get_entry((Elf32_Ehdr *)image);
 	}
 
 out:
+	if (image_hpa) {
+		free_pages(image_hpa, EFI_SIZE_TO_PAGES(lzh->Size));
+	}
 	return err;
 }
 
@@ -334,6 +467,7 @@ out:
 	UINT8 * p = NULL;
 	LOADER_COMPRESSED_HEADER *lzh = NULL;
 	LOADER_COMPRESSED_HEADER *cmd_lzh = NULL;
+	struct unpack_queue *q = NULL;
 
 	/* scan module headers to calculate required memory size to store files */
 	for (i = LZH_MOD0_CMD; i < ctr->lzh_count - 1; i++) {
@@ -368,11 +502,20 @@ out:
 		goto out;
 	}
 
+	err = allocate_pool(EfiLoaderData, sizeof(struct unpack_queue), (void **)&q);
+	if (EFI_ERROR(err)) {
+		Print(L"Failed to allocate memory to unpack modules %r\n", err);
+		goto out;
+	}
+	(void)memset((void *)q, 0x0, sizeof(struct unpack_queue));
+
 	p = (UINT8 *)ctr->mod_hpa;
 	for (i = LZH_BOOT_IMG + 2, j = 0; i < ctr->lzh_count - 1; i = i + 2) {
 		lzh = ctr->lzh_ptr[i];
 		cmd_lzh = ctr->lzh_ptr[i - 1];
-		memcpy((char *)p, (const char *)lzh->Data, lzh->Size);
+		q->jobs[j].lzh = lzh;
+		q->jobs[j].dst = p;
+		q->jobs[j].status = EFI_NOT_STARTED;
 		ctr->mod_info[j].mod_start = (EFI_PHYSICAL_ADDRESS)p;
 		ctr->mod_info[j].mod_end = (EFI_PHYSICAL_ADDRESS)p + lzh->Size;
 		ctr->mod_info[j].cmd = (const char *)cmd_lzh->Data;
@@ -380,8 +523,14 @@ out:
 		p += ALIGN_UP(lzh->Size, EFI_PAGE_SIZE);
 		j++;
 	}
+	q->count = j;
+
+	err = unpack_modules(q);
 
 out:
+	if (q) {
+		free_pool(q);
+	}
 	return err;
 }
 
@@ -533,14 +682,14 @@ static void container_deinit(HV_LOADER hvld)
 {
 	struct container *ctr = (struct container *)hvld;
 
-	if (ctr->lzh_ptr) {
-		free_pool(ctr->lzh_ptr);
-		free_pool(ctr);
-	}
-
 	if (ctr->mod_hpa) {
 		free_pages(ctr->mod_hpa, EFI_SIZE_TO_PAGES(ctr->total_modsize));
 	}
+
+	if (ctr->lzh_ptr) {
+		free_pool(ctr->lzh_ptr);
+	}
+	free_pool(ctr);
 }
 
 /* hypervisor loader operation table */
@@ -620,6 +769,16 @@ EFI_STATUS container_init(EFI_LOADED_IMAGE *info, HV_LOADER *hvld)
 		offset = hdr->DataOffset + comp->Offset;
 		ctr->lzh_ptr[i] = (LOADER_COMPRESSED_HEADER *)((UINT8 *)(hdr) + offset);
 
+		/* the command lines are used in place, the images may be compressed with LZ4.
+		 * The last file is the signature of the container, not loaded. */
+		if ((i < hdr->Count - 1) && (ctr->lzh_ptr[i]->Signature != LZH_SIG_DUMMY) &&
+			((ctr->lzh_ptr[i]->Signature != LZH_SIG_LZ4) ||
+			 ((i != LZH_BOOT_IMG) && ((i % 2) == 0)))) {
+			Print(L"Unsupported compression of file 0x%x in container\n", i);
+			err = EFI_UNSUPPORTED;
+			goto out;
+		}
+
 		comp = (COMPONENT_ENTRY *)((UINT8 *)(comp + 1) + comp->HashSize);
 	}
 
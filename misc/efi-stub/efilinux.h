@@ -190,6 +190,18 @@ handle_protocol(EFI_HANDLE handle, EFI_GUID *protocol, void **interface)
                                  handle, protocol, interface);
 }
 
+/**
+ * locate_protocol - Find the first interface of @protocol
+ * @protocol: the GUID of the protocol
+ * @interface: used to return the protocol interface
+ */
+static inline EFI_STATUS
+locate_protocol(EFI_GUID *protocol, void **interface)
+{
+	return uefi_call_wrapper(boot->LocateProtocol, 3,
+				 protocol, NULL, interface);
+}
+
 
 /*
  * emalloc_reserved_mem - it is called to allocate memory hypervisor itself
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2021 - 2022, Intel Corporation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *    * Neither the name of Intel Corporation nor the names of its
+ *      contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written
+ *      permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Decoder of the LZ4 block format, the payload of an "LZ4 " component of a
+ * Slim Bootloader container. It doesn't call any UEFI service, so it may run
+ * on the APs.
+ */
+
+#include <efi.h>
+#include "lz4.h"
+
+#define LZ4_MIN_MATCH	4U
+#define LZ4_RUN_MASK	15U
+
+/* the length of a literal run or a match, extended by 255 bytes at a time */
+static inline INTN lz4_read_length(const UINT8 **ip, const UINT8 *iend, UINTN *len)
+{
+	UINT8 b;
+
+	if (*len != LZ4_RUN_MASK)
+		return 0;
+
+	do {
+		if (*ip >= iend)
+			return -1;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255U);
+
+	return 0;
+}
+
+/*
+ * Copy len bytes, 8 at a time unless the source is less than 8 bytes behind:
+ * a match may overlap the bytes it writes.
+ */
+static inline void lz4_copy(UINT8 *dst, const UINT8 *src, UINTN len)
+{
+	if (((src + 8) <= dst) || ((dst + len) <= src)) {
+		for (; len >= 8U; len -= 8U, dst += 8, src += 8)
+			*(UINT64 *)dst = *(const UINT64 *)src;
+	}
+
+	while (len-- > 0U)
+		*dst++ = *src++;
+}
+
+/**
+ * @brief Decompress an LZ4 block
+ *
+ * @param[in]  src       The compressed block
+ * @param[in]  src_size  The size of the compressed block
+ * @param[out] dst       The buffer to decompress the block to
+ * @param[in]  dst_size  The size of the buffer
+ *
+ * @return the size of the decompressed data, -1 if the block is corrupted or
+ *         doesn't fit in the buffer
+ */
+INTN lz4_decompress(const UINT8 *src, UINTN src_size, UINT8 *dst, UINTN dst_size)
+{
+	const UINT8 *ip = src, *iend = src + src_size;
+	UINT8 *op = dst, *oend = dst + dst_size;
+	UINTN len, offset;
+	UINT8 token;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		/* literals */
+		len = token >> 4;
+		if ((lz4_read_length(&ip, iend, &len) < 0) ||
+			(len > (UINTN)(iend - ip)) || (len > (UINTN)(oend - op)))
+			return -1;
+		lz4_copy(op, ip, len);
+		ip += len;
+		op += len;
+
+		/* the last sequence has no match */
+		if (ip == iend)
+			break;
+
+		/* match */
+		if ((iend - ip) < 2)
+			return -1;
+		offset = ip[0] | ((UINTN)ip[1] << 8);
+		ip += 2;
+		if ((offset == 0U) || (offset > (UINTN)(op - dst)))
+			return -1;
+
+		len = token & LZ4_RUN_MASK;
+		if (lz4_read_length(&ip, iend, &len) < 0)
+			return -1;
+		len += LZ4_MIN_MATCH;
+		if (len > (UINTN)(oend - op))
+			return -1;
+		lz4_copy(op, op - offset, len);
+		op += len;
+	}
+
+	return op - dst;
+}
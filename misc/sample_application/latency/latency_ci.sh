@@ -0,0 +1,64 @@
+#!/bin/bash
+# Copyright (C) 2022 Intel Corporation.
+# SPDX-License-Identifier: BSD-3-Clause
+
+# Run the latency probe of the hypervisor on an RT VM and report its
+# histograms every INTERVAL seconds, from the Service VM. The run fails as
+# soon as a latency goes above the limit, which makes it usable in CI in
+# place of a cyclictest run inside the guest.
+
+usage() {
+    echo "Usage: $0 [-i INTERVAL] [-d DURATION] [-t MAX_US] VM_NAME"
+    echo "  -i INTERVAL  seconds between two reports, 10 by default"
+    echo "  -d DURATION  seconds to run, 0 (the default) runs until interrupted"
+    echo "  -t MAX_US    fail when a latency goes above MAX_US us, 0 (the default) never fails"
+    exit 2
+}
+
+interval=10
+duration=0
+max_us=0
+
+while getopts "i:d:t:h" opt; do
+    case ${opt} in
+        i) interval=${OPTARG} ;;
+        d) duration=${OPTARG} ;;
+        t) max_us=${OPTARG} ;;
+        *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+[[ $# -eq 1 ]] || usage
+vm=$1
+
+stop_probe() {
+    acrnctl latency "${vm}" stop > /dev/null
+}
+
+# the highest of the maximums of the timer, irq and ack latencies, in ns
+max_ns() {
+    awk '$1 == "timer" || $1 == "irq" || $1 == "ack" { if ($4 > m) m = $4 } END { print m + 0 }'
+}
+
+acrnctl latency "${vm}" start > /dev/null || exit 1
+trap 'stop_probe; exit 130' INT TERM
+
+elapsed=0
+status=0
+while [[ ${duration} -eq 0 || ${elapsed} -lt ${duration} ]]; do
+    sleep "${interval}"
+    elapsed=$((elapsed + interval))
+
+    report=$(acrnctl latency "${vm}") || { status=1; break; }
+    echo "$(date -Iseconds) ${vm} after ${elapsed}s"
+    echo "${report}"
+
+    if [[ ${max_us} -gt 0 && $(echo "${report}" | max_ns) -gt $((max_us * 1000)) ]]; then
+        echo "$(date -Iseconds) ${vm}: latency above ${max_us} us"
+        status=1
+        break
+    fi
+done
+
+stop_probe
+exit ${status}
@@ -30,6 +30,26 @@ header file.
 /* TODO: Revisit PARAM_LEN and see if size can be reduced */
 #define PARAM_LEN	256
 
+#define IO_HOTSPOT_NUM		16
+#define IO_HOTSPOT_DEV_LEN	20
+#define DM_STATS_IOREQ_TYPES	5
+/* the RDT monitoring counters, as ACRN_RDT_MON_* */
+#define DM_STATS_RDT_LLC_OCCUPANCY	(1U << 0)
+#define DM_STATS_RDT_MBM_TOTAL		(1U << 1)
+#define DM_STATS_RDT_MBM_LOCAL		(1U << 2)
+/* the latency probe, as ACRN_LAT_* */
+#define DM_LAT_TIMER		0
+#define DM_LAT_IRQ		1
+#define DM_LAT_ACK		2
+#define DM_LAT_TYPES		3
+#define DM_LAT_BUCKETS		24	/* bucket i within [2^(i-1), 2^i) ns */
+#define DM_LAT_CMD_GET		0
+#define DM_LAT_CMD_START	1	/* clear the histograms and start */
+#define DM_LAT_CMD_STOP		2
+#define ACRND_LIST_NUM		16	/* VMs per ACRND_LIST ack */
+#define ACRND_BULK_START	0
+#define ACRND_BULK_STOP		1
+
 struct mngr_msg {
 	unsigned long long magic;	/* Make sure you get a mngr_msg */
 	unsigned int msgid;
@@ -39,6 +59,10 @@ struct mngr_msg {
 		/* Arguments to rescan virtio-blk device */
 		char devargs[PARAM_LEN];
 
+		/* req of DM_SNAPSHOT and DM_DUMP, the file to save the UOS to;
+		   of DM_MIGRATE, the acrn-dm to migrate it to */
+		char snapshot_path[PARAM_LEN];
+
 		/* ack of DM_STOP, DM_SUSPEND, DM_RESUME,
 		   ACRND_TIMER, ACRND_STOP, ACRND_RESUME, RTC_TIMER */
 		int err;
@@ -79,6 +103,74 @@ struct mngr_msg {
 			time_t t;
 		} rtc_timer;
 
+		/* req and ack of DM_IO_HOTSPOTS */
+		struct io_hotspots {
+			int reset;		/* req: clear the samples once sent */
+			unsigned sample_shift;	/* one in 2^sample_shift accesses is sampled */
+			unsigned long long samples;
+			struct io_hotspot {
+				unsigned long long addr;
+				unsigned long long count;	/* estimated, sampled */
+				unsigned type;			/* 0: port I/O, 1: MMIO */
+				char dev[IO_HOTSPOT_DEV_LEN];	/* the emulating handler */
+			} hotspot[IO_HOTSPOT_NUM];	/* hottest first, ends at a 0 count */
+		} io_hotspots;
+
+		/* ack of DM_STATS */
+		struct dm_stats {
+			unsigned long long uptime;	/* seconds since started */
+			/* port I/O, MMIO, PCI config, write-protect, string port I/O requests */
+			unsigned long long ioreqs[DM_STATS_IOREQ_TYPES];
+			unsigned long long mem_shared;	/* bytes shared with a memory template */
+			unsigned long long mem_released;	/* bytes given back by the balloon */
+			unsigned long long cmds_pending;	/* slow commands queued or running */
+			unsigned long long cmds_done;
+			/* DM_STATS_RDT_*, the RDT monitoring counters below the platform has */
+			unsigned int rdt_events;
+			unsigned int rmid;
+			unsigned long long llc_occupancy;	/* bytes */
+			unsigned long long mbm_total;	/* bytes to and from memory */
+			unsigned long long mbm_local;	/* bytes to and from the local node */
+		} stats;
+
+		/* req and ack of DM_LATENCY */
+		struct dm_latency {
+			unsigned cmd;		/* req: DM_LAT_CMD_* */
+			int err;		/* 0, or the error of the hypervisor */
+			unsigned enabled;	/* the probe runs */
+			struct dm_lat_hist {
+				unsigned long long count;
+				unsigned long long sum_ns;
+				unsigned long long max_ns;
+				unsigned long long bucket[DM_LAT_BUCKETS];
+			} hist[DM_LAT_TYPES];
+		} latency;
+
+		/* req of DM_NOTIFY, the VM_SUSPEND_* mode the DM is in */
+		struct req_dm_notify {
+			char name[MAX_VM_NAME_LEN];
+			int state;	/* VM_SUSPEND_POWEROFF: the DM exits */
+		} dm_notify;
+
+		/* req and ack of ACRND_LIST */
+		struct acrnd_list {
+			unsigned start;		/* req: index of the first VM to send */
+			unsigned total;		/* VMs acrnd knows */
+			unsigned num;		/* VMs in this ack */
+			struct acrnd_list_vm {
+				char name[MAX_VM_NAME_LEN];
+				int state;	/* enum vm_state */
+			} vm[ACRND_LIST_NUM];
+		} acrnd_list;
+
+		/* req of ACRND_BULK, its ack err is the number of VMs failed */
+		struct req_acrnd_bulk {
+			int op;			/* ACRND_BULK_* */
+			int force;		/* stop: force to stop the VMs */
+			unsigned jobs;		/* VMs at once, 0 for the acrnd -j one */
+			unsigned timeout;	/* seconds for each VM, 0 for the default */
+		} acrnd_bulk;
+
 	} data;
 };
 
@@ -96,6 +188,12 @@ enum dm_msgid {
 	DM_RESUME,		/* Resume this UOS from suspend state */
 	DM_QUERY,		/* Ask power state of this UOS */
 	DM_BLKRESCAN,		/* Rescan virtio-blk device for any changes in UOS */
+	DM_IO_HOTSPOTS,		/* Ask the port I/O and MMIO accesses emulated most */
+	DM_SNAPSHOT,		/* Save this UOS to a file, it goes on running */
+	DM_STATS,		/* Ask the counters of this UOS, without pausing it */
+	DM_LATENCY,		/* Start, stop or read the latency probe of this UOS */
+	DM_DUMP,		/* Dump this UOS to an ELF core file, it goes on running */
+	DM_MIGRATE,		/* Migrate this UOS to an acrn-dm on another host */
 	DM_MAX,
 };
 
@@ -108,6 +206,10 @@ enum acrnd_msgid {
 	ACRND_REASON,		/* DM ask for updating wakeup reason */
 	DM_NOTIFY,		/* DM notify Acrnd that state is changed */
 
+	/* Acrnctl -> Acrnd */
+	ACRND_LIST,		/* Acrnctl ask the VMs and their states */
+	ACRND_BULK,		/* Acrnctl request to start or stop all VMs */
+
 	/* Service-VM-LCS ->Acrnd */
 	ACRND_STOP,		/* Service-VM-LCS request to Stop all User VM */
 	ACRND_RESUME,		/* Service-VM-LCS request to Resume User VM */
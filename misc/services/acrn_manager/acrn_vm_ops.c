@@ -42,6 +42,8 @@ struct vmmngr_struct *vmmngr_find(const char *name)
 }
 
 static int send_msg(const char *vmname, struct mngr_msg *req, struct mngr_msg *ack);
+static int send_msg_timeout(const char *vmname, struct mngr_msg *req,
+		struct mngr_msg *ack, unsigned timeout);
 
 static int query_state(const char *name)
 {
@@ -66,6 +68,23 @@ static int query_state(const char *name)
 	return ack.data.state;
 }
 
+static unsigned long dm_state_to_vm_state(int dm_state)
+{
+	if (dm_state < 0)
+		/* unsupport query */
+		return VM_STARTED;
+
+	switch (dm_state) {
+	case VM_SUSPEND_NONE:
+		return VM_STARTED;
+	case VM_SUSPEND_SUSPEND:
+		return VM_SUSPENDED;
+	default:
+		fprintf(stderr, "Warnning: unknow vm state:0x%x\n", dm_state);
+		return VM_STATE_UNKNOWN;
+	}
+}
+
 /*
  * get vmname and pid from /run/acrn/mngr/[vmname].monitor.[pid].socket
  */
@@ -151,24 +170,11 @@ static void _scan_alive_vm(void)
 			LIST_INSERT_HEAD(&vmmngr_head, vm, list);
 		}
 
-		ret = query_state(name);
-
-		if (ret < 0)
-			/* unsupport query */
-			vm->state_tmp = VM_STARTED;
+		/* a DM that notified acrnd of its state is not asked again */
+		if (vm->notified)
+			vm->state_tmp = dm_state_to_vm_state(vm->dm_state);
 		else
-			switch (ret) {
-			case VM_SUSPEND_NONE:
-				vm->state_tmp = VM_STARTED;
-				break;
-			case VM_SUSPEND_SUSPEND:
-				vm->state_tmp = VM_SUSPENDED;
-				break;
-			default:
-				fprintf(stderr, "Warnning: unknow vm state:0x%lx\n",
-										vm->state);
-				vm->state_tmp = VM_STATE_UNKNOWN;
-			}
+			vm->state_tmp = dm_state_to_vm_state(query_state(name));
 		vm->update = update_count;
 	}
 
@@ -287,6 +293,94 @@ void vmmngr_update(void)
 	pthread_mutex_unlock(&vmmngr_mutex);
 }
 
+void vmmngr_notify(const char *vmname, int dm_state)
+{
+	struct vmmngr_struct *vm;
+
+	pthread_mutex_lock(&vmmngr_mutex);
+	vm = vmmngr_find(vmname);
+	if (!vm) {
+		vm = calloc(1, sizeof(*vm));
+		if (!vm) {
+			printf("%s: Failed to alloc mem for %s\n", __func__, vmname);
+			goto out;
+		}
+		strncpy(vm->name, vmname, sizeof(vm->name) - 1);
+		vm->update = update_count;
+		LIST_INSERT_HEAD(&vmmngr_head, vm, list);
+	}
+
+	if (dm_state == VM_SUSPEND_POWEROFF) {
+		/* the DM exits, the next scan finds the VM stopped or gone */
+		vm->notified = 0;
+	} else {
+		vm->notified = 1;
+		vm->dm_state = dm_state;
+		vm->state = dm_state_to_vm_state(dm_state);
+	}
+ out:
+	pthread_mutex_unlock(&vmmngr_mutex);
+}
+
+static void _free_all_vm(void)
+{
+	struct vmmngr_struct *vm, *tvm;
+
+	list_foreach_safe(vm, &vmmngr_head, list, tvm) {
+		LIST_REMOVE(vm, list);
+		free(vm);
+	}
+}
+
+int vmmngr_update_from_acrnd(void)
+{
+	struct mngr_msg req;
+	struct mngr_msg ack;
+	struct vmmngr_struct *vm;
+	unsigned i, start = 0;
+	int fd, ret = 0;
+
+	fd = mngr_open_un("acrnd", MNGR_CLIENT);
+	if (fd < 0)
+		return -1;
+
+	pthread_mutex_lock(&vmmngr_mutex);
+	_free_all_vm();
+
+	req.magic = MNGR_MSG_MAGIC;
+	req.msgid = ACRND_LIST;
+	do {
+		req.timestamp = time(NULL);
+		req.data.acrnd_list.start = start;
+
+		if (mngr_send_msg(fd, &req, &ack, 1) != sizeof(ack)
+		    || ack.data.acrnd_list.num > ACRND_LIST_NUM) {
+			_free_all_vm();
+			ret = -1;
+			break;
+		}
+
+		for (i = 0; i < ack.data.acrnd_list.num; i++) {
+			vm = calloc(1, sizeof(*vm));
+			if (!vm) {
+				printf("%s: Failed to alloc mem\n", __func__);
+				break;
+			}
+			memcpy(vm->name, ack.data.acrnd_list.vm[i].name,
+				sizeof(vm->name) - 1);
+			vm->state = ack.data.acrnd_list.vm[i].state;
+			vm->update = update_count;
+			LIST_INSERT_HEAD(&vmmngr_head, vm, list);
+		}
+		start += ack.data.acrnd_list.num;
+	} while (ack.data.acrnd_list.num && start < ack.data.acrnd_list.total);
+	pthread_mutex_unlock(&vmmngr_mutex);
+
+	mngr_close(fd);
+
+	return ret;
+}
+
 /* helper functions */
 int shell_cmd(const char *cmd, char *outbuf, int len)
 {
@@ -315,6 +409,12 @@ int shell_cmd(const char *cmd, char *outbuf, int len)
 
 static int send_msg(const char *vmname, struct mngr_msg *req,
 		    struct mngr_msg *ack)
+{
+	return send_msg_timeout(vmname, req, ack, 1);
+}
+
+static int send_msg_timeout(const char *vmname, struct mngr_msg *req,
+		    struct mngr_msg *ack, unsigned timeout)
 {
 	int fd, ret;
 
@@ -329,7 +429,7 @@ static int send_msg(const char *vmname, struct mngr_msg *req,
 		return -1;
 	}
 
-	ret = mngr_send_msg(fd, req, ack, 1);
+	ret = mngr_send_msg(fd, req, ack, timeout);
 	if (ret < 0) {
 		printf("Unable to send msg to vm %s socket. It may have been shutdown\n", vmname);
 		mngr_close(fd);
@@ -428,3 +528,191 @@ int blkrescan_vm(const char *vmname, char *devargs)
 
 	return ack.data.err;
 }
+
+int io_hotspots_vm(const char *vmname, int reset)
+{
+	struct mngr_msg req;
+	struct mngr_msg ack;
+	const struct io_hotspot *hs;
+	int i, ret;
+
+	req.magic = MNGR_MSG_MAGIC;
+	req.msgid = DM_IO_HOTSPOTS;
+	req.timestamp = time(NULL);
+	req.data.io_hotspots.reset = reset;
+
+	ret = send_msg(vmname, &req, &ack);
+	if (ret) {
+		printf("Unable to get the I/O hotspots of %s, err: %d\n", vmname, ret);
+		return ret;
+	}
+
+	/* the counts are scaled back from the samples, the device is the emulating handler */
+	printf("%llu accesses sampled, one in %u\n", ack.data.io_hotspots.samples,
+		1U << ack.data.io_hotspots.sample_shift);
+	printf("%-6s %-18s %-14s %s\n", "TYPE", "ADDR", "COUNT", "DEVICE");
+	for (i = 0; i < IO_HOTSPOT_NUM; i++) {
+		hs = &ack.data.io_hotspots.hotspot[i];
+		if (hs->count == 0)
+			break;
+		printf("%-6s 0x%016llx %-14llu %.*s\n", hs->type ? "MMIO" : "PIO", hs->addr,
+			hs->count << ack.data.io_hotspots.sample_shift, IO_HOTSPOT_DEV_LEN, hs->dev);
+	}
+
+	return 0;
+}
+
+int stats_vm(const char *vmname)
+{
+	static const char *const ioreq_names[DM_STATS_IOREQ_TYPES] = {
+		"PIO", "MMIO", "PCI_CFG", "WP", "PIO_STR"
+	};
+	struct mngr_msg req;
+	struct mngr_msg ack;
+	const struct dm_stats *st = &ack.data.stats;
+	int i, ret;
+
+	req.magic = MNGR_MSG_MAGIC;
+	req.msgid = DM_STATS;
+	req.timestamp = time(NULL);
+
+	ret = send_msg(vmname, &req, &ack);
+	if (ret) {
+		printf("Unable to get the statistics of %s, err: %d\n", vmname, ret);
+		return ret;
+	}
+
+	printf("%-16s %llu s\n", "uptime", st->uptime);
+	for (i = 0; i < DM_STATS_IOREQ_TYPES; i++)
+		printf("ioreqs %-9s %llu\n", ioreq_names[i], st->ioreqs[i]);
+	printf("%-16s %llu MB\n", "mem shared", st->mem_shared >> 20);
+	printf("%-16s %llu MB\n", "mem released", st->mem_released >> 20);
+	printf("%-16s %llu\n", "cmds pending", st->cmds_pending);
+	printf("%-16s %llu\n", "cmds done", st->cmds_done);
+	if (st->rdt_events != 0)
+		printf("%-16s %u\n", "rmid", st->rmid);
+	if (st->rdt_events & DM_STATS_RDT_LLC_OCCUPANCY)
+		printf("%-16s %llu KB\n", "llc occupancy", st->llc_occupancy >> 10);
+	if (st->rdt_events & DM_STATS_RDT_MBM_TOTAL)
+		printf("%-16s %llu MB\n", "mem bw total", st->mbm_total >> 20);
+	if (st->rdt_events & DM_STATS_RDT_MBM_LOCAL)
+		printf("%-16s %llu MB\n", "mem bw local", st->mbm_local >> 20);
+
+	return 0;
+}
+
+int latency_vm(const char *vmname, unsigned cmd)
+{
+	static const char *const lat_names[DM_LAT_TYPES] = {
+		"timer", "irq", "ack"
+	};
+	struct mngr_msg req;
+	struct mngr_msg ack;
+	const struct dm_latency *dl = &ack.data.latency;
+	const struct dm_lat_hist *h;
+	int i, j, ret;
+
+	req.magic = MNGR_MSG_MAGIC;
+	req.msgid = DM_LATENCY;
+	req.timestamp = time(NULL);
+	req.data.latency.cmd = cmd;
+
+	ret = send_msg(vmname, &req, &ack);
+	if (!ret)
+		ret = dl->err;
+	if (ret) {
+		printf("Unable to get the latencies of %s, err: %d\n", vmname, ret);
+		return ret;
+	}
+
+	printf("probe %s\n", dl->enabled ? "running" : "stopped");
+	printf("%-6s %-12s %-10s %-10s %s\n", "TYPE", "COUNT", "AVG(ns)", "MAX(ns)", "HISTOGRAM(<ns:count)");
+	for (i = 0; i < DM_LAT_TYPES; i++) {
+		h = &dl->hist[i];
+		printf("%-6s %-12llu %-10llu %-10llu", lat_names[i], h->count,
+			h->count ? h->sum_ns / h->count : 0, h->max_ns);
+		for (j = 0; j < DM_LAT_BUCKETS; j++) {
+			if (h->bucket[j] == 0)
+				continue;
+			if (j < DM_LAT_BUCKETS - 1)
+				printf(" <%llu:%llu", 1ULL << j, h->bucket[j]);
+			else
+				printf(" >=%llu:%llu", 1ULL << (j - 1), h->bucket[j]);
+		}
+		printf("\n");
+	}
+
+	return 0;
+}
+
+/* the guest memory is written out before the ack */
+#define SNAPSHOT_TIMEOUT	600U
+
+static int save_vm(const char *vmname, unsigned msgid, const char *path)
+{
+	struct mngr_msg req;
+	struct mngr_msg ack;
+	int ret;
+
+	req.magic = MNGR_MSG_MAGIC;
+	req.msgid = msgid;
+	req.timestamp = time(NULL);
+	strncpy(req.data.snapshot_path, path, PARAM_LEN - 1);
+	req.data.snapshot_path[PARAM_LEN - 1] = '\0';
+
+	ret = send_msg_timeout(vmname, &req, &ack, SNAPSHOT_TIMEOUT);
+	if (ret)
+		return ret;
+
+	if (ack.data.err) {
+		printf("Unable to save vm %s to %s. errno(%d)\n", vmname, path, ack.data.err);
+	}
+
+	return ack.data.err;
+}
+
+int snapshot_vm(const char *vmname, const char *path)
+{
+	return save_vm(vmname, DM_SNAPSHOT, path);
+}
+
+int dump_vm(const char *vmname, const char *path)
+{
+	return save_vm(vmname, DM_DUMP, path);
+}
+
+int migrate_vm(const char *vmname, const char *target)
+{
+	return save_vm(vmname, DM_MIGRATE, target);
+}
+
+int bulk_vms_acrnd(int op, int force, unsigned jobs)
+{
+	struct mngr_msg req;
+	struct mngr_msg ack;
+	int fd, ret;
+
+	fd = mngr_open_un("acrnd", MNGR_CLIENT);
+	if (fd < 0) {
+		printf("Unable to open acrnd socket, is acrnd running?\n");
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.magic = MNGR_MSG_MAGIC;
+	req.msgid = ACRND_BULK;
+	req.timestamp = time(NULL);
+	req.data.acrnd_bulk.op = op;
+	req.data.acrnd_bulk.force = force;
+	req.data.acrnd_bulk.jobs = jobs;
+
+	/* acrnd acks once all the VMs are started or stopped */
+	ret = mngr_send_msg(fd, &req, &ack, 0);
+	mngr_close(fd);
+	if (ret != sizeof(ack)) {
+		printf("Unable to send msg to acrnd\n");
+		return -1;
+	}
+
+	return ack.data.err;
+}
@@ -15,10 +15,13 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <sys/ioctl.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <stdbool.h>
+#include "hsm_ioctl_defs.h"
 #include "acrn_mngr.h"
 #include "acrnctl.h"
 #include "ioc.h"
@@ -34,6 +37,15 @@
 #define ADD_DESC       "Add one virtual machine with SCRIPTS and OPTIONS"
 #define RESET_DESC     "Stop and then start virtual machine VM_NAME"
 #define BLKRESCAN_DESC  "Rescan virtio-blk device attached to a virtual machine"
+#define HOTSPOTS_DESC  "Show the port I/O and MMIO most emulated for VM_NAME, [--reset/-r, clear them]"
+#define SNAPSHOT_DESC  "Save virtual machine VM_NAME to FILE, acrn-dm --restore FILE starts it again"
+#define DUMP_DESC      "Dump virtual machine VM_NAME to the ELF core FILE for crash, it goes on running"
+#define MIGRATE_DESC   "Migrate virtual machine VM_NAME to the acrn-dm --incoming on HOST:PORT, it is stopped here"
+#define STATS_DESC     "Show the counters of virtual machine VM_NAME, it is not paused"
+#define LATENCY_DESC   "Show the interrupt and timer latencies of VM_NAME, [start/stop, the probe]"
+#define STARTALL_DESC  "Start all the stopped virtual machines, [-j N, N at once]"
+#define STOPALL_DESC   "Stop all the running virtual machines, [--force/-f] [-j N, N at once]"
+#define TOP_DESC       "Show the utilization of the pCPUs, VMs and vCPUs, [-d SECS, refresh period] [-n N, N times]"
 
 #define VM_NAME (1)
 #define CMD_ARGS (2)
@@ -427,6 +439,163 @@ static int acrnctl_do_blkrescan(int argc, char *argv[])
 	return 0;
 }
 
+static int acrnctl_do_hotspots(int argc, char *argv[])
+{
+	struct vmmngr_struct *s;
+	int i, reset = 0;
+	const char *vmname = NULL;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--reset") && strcmp(argv[i], "-r")) {
+			if (vmname == NULL)
+				vmname = argv[i];
+		} else {
+			reset = 1;
+		}
+	}
+
+	if (!vmname) {
+		printf("Please give a VM name\n");
+		return -1;
+	}
+
+	s = vmmngr_find(vmname);
+	if (!s) {
+		printf("can't find %s\n", vmname);
+		return -1;
+	}
+	if (s->state != VM_STARTED) {
+		printf("%s is in %s state but should be in %s state for hotspots\n",
+			vmname, state_str[s->state], state_str[VM_STARTED]);
+		return -1;
+	}
+
+	return io_hotspots_vm(vmname, reset);
+}
+
+/* the file argv[CMD_ARGS] of a running VM argv[VM_NAME], in path */
+static int save_vm_args(char *argv[], const char *what, char *path, size_t len)
+{
+	struct vmmngr_struct *s;
+
+	s = vmmngr_find(argv[VM_NAME]);
+	if (!s) {
+		printf("can't find %s\n", argv[VM_NAME]);
+		return -1;
+	}
+	if (s->state != VM_STARTED) {
+		printf("%s is in %s state but should be in %s state for %s\n",
+			argv[VM_NAME], state_str[s->state], state_str[VM_STARTED], what);
+		return -1;
+	}
+
+	/* acrn-dm does not run in the current directory */
+	if (argv[CMD_ARGS][0] != '/') {
+		if (!getcwd(path, len) ||
+		    strlen(path) + strlen(argv[CMD_ARGS]) + 2 > len) {
+			printf("%s: path too long\n", argv[CMD_ARGS]);
+			return -1;
+		}
+		strcat(path, "/");
+		strcat(path, argv[CMD_ARGS]);
+	} else if (snprintf(path, len, "%s", argv[CMD_ARGS]) >= len) {
+		printf("%s: path too long\n", argv[CMD_ARGS]);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int acrnctl_do_snapshot(int argc, char *argv[])
+{
+	char path[PARAM_LEN];
+
+	if (save_vm_args(argv, "snapshot", path, sizeof(path)))
+		return -1;
+
+	return snapshot_vm(argv[VM_NAME], path);
+}
+
+static int acrnctl_do_dump(int argc, char *argv[])
+{
+	char path[PARAM_LEN];
+
+	if (save_vm_args(argv, "dump", path, sizeof(path)))
+		return -1;
+
+	return dump_vm(argv[VM_NAME], path);
+}
+
+static int acrnctl_do_migrate(int argc, char *argv[])
+{
+	struct vmmngr_struct *s;
+
+	s = vmmngr_find(argv[VM_NAME]);
+	if (!s) {
+		printf("can't find %s\n", argv[VM_NAME]);
+		return -1;
+	}
+	if (s->state != VM_STARTED) {
+		printf("%s is in %s state but should be in %s state for migrate\n",
+			argv[VM_NAME], state_str[s->state], state_str[VM_STARTED]);
+		return -1;
+	}
+	if (strlen(argv[CMD_ARGS]) >= PARAM_LEN) {
+		printf("%s: target too long\n", argv[CMD_ARGS]);
+		return -1;
+	}
+
+	return migrate_vm(argv[VM_NAME], argv[CMD_ARGS]);
+}
+
+static int acrnctl_do_stats(int argc, char *argv[])
+{
+	struct vmmngr_struct *s;
+
+	s = vmmngr_find(argv[VM_NAME]);
+	if (!s) {
+		printf("can't find %s\n", argv[VM_NAME]);
+		return -1;
+	}
+	if (s->state != VM_STARTED) {
+		printf("%s is in %s state but should be in %s state for stats\n",
+			argv[VM_NAME], state_str[s->state], state_str[VM_STARTED]);
+		return -1;
+	}
+
+	return stats_vm(argv[VM_NAME]);
+}
+
+static int acrnctl_do_latency(int argc, char *argv[])
+{
+	struct vmmngr_struct *s;
+	unsigned cmd = DM_LAT_CMD_GET;
+
+	if (argc > CMD_ARGS) {
+		if (!strcmp(argv[CMD_ARGS], "start")) {
+			cmd = DM_LAT_CMD_START;
+		} else if (!strcmp(argv[CMD_ARGS], "stop")) {
+			cmd = DM_LAT_CMD_STOP;
+		} else {
+			printf("%s: should be start or stop\n", argv[CMD_ARGS]);
+			return -1;
+		}
+	}
+
+	s = vmmngr_find(argv[VM_NAME]);
+	if (!s) {
+		printf("can't find %s\n", argv[VM_NAME]);
+		return -1;
+	}
+	if (s->state != VM_STARTED) {
+		printf("%s is in %s state but should be in %s state for latency\n",
+			argv[VM_NAME], state_str[s->state], state_str[VM_STARTED]);
+		return -1;
+	}
+
+	return latency_vm(argv[VM_NAME], cmd);
+}
+
 static int acrnctl_do_stop(int argc, char *argv[])
 {
 	struct vmmngr_struct *s;
@@ -560,6 +729,177 @@ static int acrnctl_do_start(int argc, char *argv[])
 
 }
 
+static int acrnctl_do_bulk(int op, int argc, char *argv[])
+{
+	unsigned long jobs = 0;
+	int i, force = 0, failed;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--force") || !strcmp(argv[i], "-f")) {
+			force = 1;
+		} else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+			jobs = strtoul(argv[++i], NULL, 10);
+		} else {
+			printf("Unknown option %s\n", argv[i]);
+			return -1;
+		}
+	}
+
+	failed = bulk_vms_acrnd(op, force, jobs);
+	if (failed > 0)
+		printf("%d VMs failed to %s, see the acrnd log\n", failed,
+			(op == ACRND_BULK_START) ? "start" : "stop");
+
+	return failed ? -1 : 0;
+}
+
+static int acrnctl_do_startall(int argc, char *argv[])
+{
+	return acrnctl_do_bulk(ACRND_BULK_START, argc, argv);
+}
+
+static int acrnctl_do_stopall(int argc, char *argv[])
+{
+	return acrnctl_do_bulk(ACRND_BULK_STOP, argc, argv);
+}
+
+#define HSM_DEV		"/dev/acrn_hsm"
+
+/* the growth of a counter over span, in per mille */
+static unsigned long top_permille(uint64_t cur, uint64_t prev, uint64_t span)
+{
+	uint64_t delta = (cur >= prev) ? (cur - prev) : cur;
+
+	if (span == 0)
+		return 0;
+	delta = delta * 1000 / span;
+	return (delta > 1000) ? 1000 : delta;
+}
+
+static const struct acrn_vcpu_util *top_find_vcpu(const struct acrn_cpu_util *util,
+		uint16_t vm_id, uint16_t vcpu_id)
+{
+	int i;
+
+	for (i = 0; i < util->nr_vcpus; i++)
+		if (util->vcpu[i].vm_id == vm_id && util->vcpu[i].vcpu_id == vcpu_id)
+			return &util->vcpu[i];
+	return NULL;
+}
+
+static void top_print(const struct acrn_cpu_util *cur, const struct acrn_cpu_util *prev)
+{
+	static const struct acrn_vcpu_util zero;
+	const struct acrn_pcpu_util *pc, *pp;
+	const struct acrn_vcpu_util *vc, *vp;
+	uint64_t span = cur->tsc - prev->tsc;
+	uint64_t span_us = span * 1000 / (cur->tsc_khz ? cur->tsc_khz : 1);
+	unsigned long idle, hv, busy, run, wait, exit;
+	unsigned long vm_run = 0, vm_wait = 0, vm_exit = 0;
+	int i;
+
+	if (isatty(STDOUT_FILENO))
+		printf("\033[H\033[2J");
+	printf("over the last %lu ms\n\n", (unsigned long)(span_us / 1000));
+
+	printf("%-6s %-8s %-8s %-8s %-8s %s\n", "PCPU", "BUSY%", "GUEST%", "HV%", "IDLE%", "EXITS/s");
+	for (i = 0; i < cur->nr_pcpus; i++) {
+		pc = &cur->pcpu[i];
+		pp = &prev->pcpu[i];
+		idle = top_permille(pc->idle_ticks, pp->idle_ticks, span);
+		hv = top_permille(pc->hv_ticks, pp->hv_ticks, span);
+		busy = 1000 - idle;
+		printf("%-6d %3lu.%lu    %3lu.%lu    %3lu.%lu    %3lu.%lu    %lu\n", i,
+			busy / 10, busy % 10, (busy - (hv < busy ? hv : busy)) / 10,
+			(busy - (hv < busy ? hv : busy)) % 10, hv / 10, hv % 10, idle / 10, idle % 10,
+			span_us ? (unsigned long)((pc->nr_exits - pp->nr_exits) * 1000000 / span_us) : 0);
+	}
+
+	printf("\n%-14s %-6s %-8s %-8s %-8s %s\n", "VCPU", "PCPU", "RUN%", "WAIT%", "EXIT%", "EXITS/s");
+	for (i = 0; i < cur->nr_vcpus; i++) {
+		vc = &cur->vcpu[i];
+		/* a vCPU new since the previous sample counts from zero */
+		vp = top_find_vcpu(prev, vc->vm_id, vc->vcpu_id);
+		if (vp == NULL || vp->run_ticks > vc->run_ticks)
+			vp = &zero;
+		run = top_permille(vc->run_ticks, vp->run_ticks, span);
+		wait = top_permille(vc->wait_ticks, vp->wait_ticks, span);
+		exit = top_permille(vc->exit_ticks, vp->exit_ticks, span);
+		printf("vm%u:vcpu%-6u %-6u %3lu.%lu    %3lu.%lu    %3lu.%lu    %lu\n",
+			vc->vm_id, vc->vcpu_id, vc->pcpu_id, run / 10, run % 10,
+			wait / 10, wait % 10, exit / 10, exit % 10,
+			span_us ? (unsigned long)((vc->nr_exits - vp->nr_exits) * 1000000 / span_us) : 0);
+
+		vm_run += run;
+		vm_wait += wait;
+		vm_exit += exit;
+		/* the VM as a whole after its last vCPU, in percent of one pCPU */
+		if (i + 1 == cur->nr_vcpus || cur->vcpu[i + 1].vm_id != vc->vm_id) {
+			printf("vm%-12u %-6s %3lu.%lu    %3lu.%lu    %3lu.%lu\n", vc->vm_id, "-",
+				vm_run / 10, vm_run % 10, vm_wait / 10, vm_wait % 10,
+				vm_exit / 10, vm_exit % 10);
+			vm_run = vm_wait = vm_exit = 0;
+		}
+	}
+	fflush(stdout);
+}
+
+/*
+ * The hypervisor only keeps growing counters, the utilization is the
+ * difference of two samples, one refresh period apart.
+ */
+static int acrnctl_do_top(int argc, char *argv[])
+{
+	struct acrn_cpu_util *util;
+	unsigned long period = 1, count = 0, n;
+	int i, fd, cur = 0, ret = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+			period = strtoul(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+			count = strtoul(argv[++i], NULL, 10);
+		} else {
+			printf("Unknown option %s\n", argv[i]);
+			return -1;
+		}
+	}
+	if (period == 0)
+		period = 1;
+
+	fd = open(HSM_DEV, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		printf("failed to open %s: %s\n", HSM_DEV, strerror(errno));
+		return -1;
+	}
+
+	/* two samples, the current and the previous one */
+	util = calloc(2, sizeof(*util));
+	if (util == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	if (ioctl(fd, ACRN_IOCTL_GET_CPU_UTIL, &util[cur]) < 0) {
+		printf("failed to get the utilization: %s\n", strerror(errno));
+		ret = -1;
+	}
+	for (n = 0; ret == 0 && (count == 0 || n < count); n++) {
+		sleep(period);
+		cur ^= 1;
+		if (ioctl(fd, ACRN_IOCTL_GET_CPU_UTIL, &util[cur]) < 0) {
+			printf("failed to get the utilization: %s\n", strerror(errno));
+			ret = -1;
+			break;
+		}
+		top_print(&util[cur], &util[cur ^ 1]);
+	}
+
+	free(util);
+	close(fd);
+	return ret;
+}
+
 static int wait_vm_stop(const char * vmname, unsigned int timeout)
 {
 	unsigned long t = timeout;
@@ -567,7 +907,8 @@ static int wait_vm_stop(const char * vmname, unsigned int timeout)
 
 	do {
 		/* list and update the vm status */
-		vmmngr_update();
+		if (vmmngr_update_from_acrnd())
+			vmmngr_update();
 
 		s =  vmmngr_find(vmname);
 		if (s == NULL) {
@@ -641,6 +982,54 @@ static int valid_blkrescan_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
 	return 0;
 }
 
+static int valid_hotspots_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
+{
+	char df_opt[] = "VM_NAME [--reset/-r]";
+
+	if (argc < 2 || argc > 3 || !strcmp(argv[1], "help")) {
+		printf("acrnctl %s %s\n", cmd->cmd, df_opt);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int valid_latency_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
+{
+	char df_opt[] = "VM_NAME [start/stop]";
+
+	if (argc < 2 || argc > 3 || !strcmp(argv[1], "help")) {
+		printf("acrnctl %s %s\n", cmd->cmd, df_opt);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int valid_snapshot_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
+{
+	char df_opt[] = "VM_NAME FILE";
+
+	if (argc != 3 || !strcmp(argv[1], "help")) {
+		printf("acrnctl %s %s\n", cmd->cmd, df_opt);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int valid_migrate_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
+{
+	char df_opt[] = "VM_NAME HOST:PORT[,streams=N][,downtime=MS]";
+
+	if (argc != 3 || !strcmp(argv[1], "help")) {
+		printf("acrnctl %s %s\n", cmd->cmd, df_opt);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int valid_add_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
 {
 	char df_opt[32] = "launch_scripts options";
@@ -665,6 +1054,30 @@ static int valid_start_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
 	return 0;
 }
 
+static int valid_bulk_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
+{
+	char df_opt[] = "[--force/-f] [-j N]";
+
+	if (argc > 4 || (argc > 1 && !strcmp(argv[1], "help"))) {
+		printf("acrnctl %s %s\n", cmd->cmd, df_opt);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int valid_top_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
+{
+	char df_opt[] = "[-d SECS] [-n N]";
+
+	if (argc > 5 || (argc > 1 && !strcmp(argv[1], "help"))) {
+		printf("acrnctl %s %s\n", cmd->cmd, df_opt);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int valid_list_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
 {
 	if (argc != 1) {
@@ -683,6 +1096,15 @@ struct acrnctl_cmd acmds[] = {
 	ACMD("add", acrnctl_do_add, ADD_DESC, valid_add_args),
 	ACMD("reset", acrnctl_do_reset, RESET_DESC, df_valid_args),
 	ACMD("blkrescan", acrnctl_do_blkrescan, BLKRESCAN_DESC, valid_blkrescan_args),
+	ACMD("hotspots", acrnctl_do_hotspots, HOTSPOTS_DESC, valid_hotspots_args),
+	ACMD("snapshot", acrnctl_do_snapshot, SNAPSHOT_DESC, valid_snapshot_args),
+	ACMD("dump", acrnctl_do_dump, DUMP_DESC, valid_snapshot_args),
+	ACMD("migrate", acrnctl_do_migrate, MIGRATE_DESC, valid_migrate_args),
+	ACMD("stats", acrnctl_do_stats, STATS_DESC, valid_start_args),
+	ACMD("latency", acrnctl_do_latency, LATENCY_DESC, valid_latency_args),
+	ACMD("startall", acrnctl_do_startall, STARTALL_DESC, valid_bulk_args),
+	ACMD("stopall", acrnctl_do_stopall, STOPALL_DESC, valid_bulk_args),
+	ACMD("top", acrnctl_do_top, TOP_DESC, valid_top_args),
 };
 
 #define NCMD	(sizeof(acmds)/sizeof(struct acrnctl_cmd))
@@ -733,7 +1155,9 @@ int main(int argc, char *argv[])
 			if (acmds[i].valid_args(&acmds[i], argc - 1, &argv[1])) {
 				return -1;
 			} else {
-				vmmngr_update();
+				/* acrnd tracks the states, scan only without it */
+				if (vmmngr_update_from_acrnd())
+					vmmngr_update();
 				err = acmds[i].func(argc - 1, &argv[1]);
 				return err;
 			}
@@ -33,6 +33,8 @@ struct vmmngr_struct {
 	unsigned long state;
 	unsigned long state_tmp;
 	unsigned long update;   /* update count, remove a vm if no update for it */
+	int notified;		/* its DM sent DM_NOTIFY, dm_state is current */
+	int dm_state;		/* VM_SUSPEND_* of its DM */
 	LIST_ENTRY(vmmngr_struct) list;
 };
 
@@ -45,6 +47,12 @@ int shell_cmd(const char *cmd, char *outbuf, int len);
  */
 void vmmngr_update(void);
 
+/* record the state a DM sent with DM_NOTIFY, the scans no longer ask it */
+void vmmngr_notify(const char *vmname, int dm_state);
+
+/* fill vmmngr_head from acrnd with ACRND_LIST, -1 if acrnd is not running */
+int vmmngr_update_from_acrnd(void);
+
 struct vmmngr_list_struct {
 	struct vmmngr_struct *lh_first;
 };
@@ -58,5 +66,13 @@ int pause_vm(const char *vmname);
 int continue_vm(const char *vmname);
 int resume_vm(const char *vmname, unsigned reason);
 int blkrescan_vm(const char *vmname, char *devargs);
+int io_hotspots_vm(const char *vmname, int reset);
+int snapshot_vm(const char *vmname, const char *path);
+int dump_vm(const char *vmname, const char *path);
+int migrate_vm(const char *vmname, const char *target);
+int stats_vm(const char *vmname);
+int latency_vm(const char *vmname, unsigned cmd);
+/* ACRND_BULK_* all the VMs through acrnd, the number of VMs failed or -1 */
+int bulk_vms_acrnd(int op, int force, unsigned jobs);
 
 #endif				/* _ACRNCTL_H_ */
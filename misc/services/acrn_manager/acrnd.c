@@ -16,16 +16,22 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <limits.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include "mevent.h"
 #include "acrnctl.h"
 #include "acrn_mngr.h"
 #include "ioc.h"
+#include "metrics.h"
 
 #define ACRND_NAME		"acrnd"
 #define SERVICE_VM_LCS_SOCK	"service-vm-lcs"
 #define HW_IOC_PATH		"/dev/cbc-early-signals"
 #define VMS_STOP_TIMEOUT	20U /* Time to wait VMs to stop */
+#define VMS_START_TIMEOUT	60U /* Time to wait a VM to start */
+#define BULK_AFTER_MAX		8U  /* VMs a VM can start after */
 #define SOCK_TIMEOUT		2U
+#define METRICS_LINE_MAX	256U /* longest line of a snapshot */
 
 /* acrnd worker timer */
 
@@ -52,6 +58,13 @@ static unsigned char platform_has_hw_ioc;
 static int sigterm = 0; /* Exit acrnd when recevied SIGTERM and stop all vms */
 
 static int logfile = 1;
+static unsigned int bulk_jobs;	/* VMs started or stopped at once, 0 for all */
+static unsigned int metrics_port;	/* 0 not to serve the metrics */
+
+/* DM_NOTIFY count, the waits for VM states sleep on it rather than poll */
+static pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t state_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long state_events;
 #ifdef MNGR_DEBUG
 static int autostart_delay = 0;
 #endif
@@ -251,51 +264,316 @@ static void acrnd_run_vm(char *name)
 	exit(0);
 }
 
-static int active_all_vms(void)
+/* wait for a DM_NOTIFY after *seen, sec seconds at most */
+static void wait_state_event(unsigned long *seen, unsigned sec)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += sec;
+
+	pthread_mutex_lock(&state_mutex);
+	while (state_events == *seen) {
+		if (pthread_cond_timedwait(&state_cond, &state_mutex, &ts) == ETIMEDOUT)
+			break;
+	}
+	*seen = state_events;
+	pthread_mutex_unlock(&state_mutex);
+}
+
+static unsigned long get_state_events(void)
+{
+	unsigned long events;
+
+	pthread_mutex_lock(&state_mutex);
+	events = state_events;
+	pthread_mutex_unlock(&state_mutex);
+
+	return events;
+}
+
+/* bulk start and stop of the VMs */
+
+enum bulk_vm_state {
+	BULK_PENDING,
+	BULK_RUNNING,	/* started or stopped, not there yet */
+	BULK_DONE,
+	BULK_FAILED,
+};
+
+struct bulk_vm {
+	char name[MAX_VM_NAME_LEN];
+	char after[BULK_AFTER_MAX][MAX_VM_NAME_LEN];
+	unsigned nr_after;
+	int resume;		/* suspended, resumed rather than launched */
+	int state;
+	time_t since;
+};
+
+static pthread_mutex_t bulk_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* the names in [vmname].after, VMs to start before it and stop after it */
+static void load_bulk_after(struct bulk_vm *b)
+{
+	char path[PATH_LEN + MAX_VM_NAME_LEN + 8];
+	char dep[PATH_LEN];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s.after", ACRN_CONF_PATH_ADD, b->name);
+	fp = fopen(path, "r");
+	if (!fp)
+		return;
+
+	while (b->nr_after < BULK_AFTER_MAX && fscanf(fp, "%127s", dep) == 1) {
+		strncpy(b->after[b->nr_after], dep, MAX_VM_NAME_LEN - 1);
+		b->nr_after++;
+	}
+
+	fclose(fp);
+}
+
+/* @a starts after @b, and stops before it */
+static bool bulk_after(const struct bulk_vm *a, const struct bulk_vm *b)
+{
+	unsigned i;
+
+	for (i = 0; i < a->nr_after; i++)
+		if (!strcmp(a->after[i], b->name))
+			return true;
+
+	return false;
+}
+
+/* all the VMs @i waits on are done, it fails if one of them failed */
+static bool bulk_ready(struct bulk_vm *vms, int num, int i, int op)
+{
+	bool dep;
+	int j;
+
+	for (j = 0; j < num; j++) {
+		if (j == i)
+			continue;
+
+		dep = (op == ACRND_BULK_START) ? bulk_after(&vms[i], &vms[j])
+					       : bulk_after(&vms[j], &vms[i]);
+		if (!dep)
+			continue;
+
+		if (vms[j].state == BULK_FAILED) {
+			fprintf(stderr, "%s: skip %s, %s failed\n", __func__,
+				vms[i].name, vms[j].name);
+			vms[i].state = BULK_FAILED;
+			return false;
+		}
+		if (vms[j].state != BULK_DONE)
+			return false;
+	}
+
+	return true;
+}
+
+static int bulk_launch(struct bulk_vm *b, int op, int force)
 {
-	struct vmmngr_struct *vm;
-	int ret = 0;
-	pid_t pid;
 	unsigned reason = 0;
+	pid_t pid;
+
+	if (op == ACRND_BULK_STOP)
+		return stop_vm(b->name, force);
+
+	if (b->resume) {
+		if (platform_has_hw_ioc)
+			reason = get_sos_wakeup_reason();
+		return resume_vm(b->name, reason);
+	}
+
+	pid = fork();
+	if (!pid)
+		acrnd_run_vm(b->name);
 
+	return (pid < 0) ? -1 : 0;
+}
+
+/*
+ * Start (or resume) or stop all the VMs, @jobs at most at a time, 0 for no
+ * limit. A VM starts once the VMs of its .after file are started, and stops
+ * before them. Each VM has @timeout seconds to get started or stopped, the
+ * DM notifications wake the wait up.
+ *
+ * Return the number of VMs that failed.
+ */
+static int bulk_vms(int op, int force, unsigned jobs, unsigned timeout)
+{
+	struct vmmngr_struct *vm;
+	struct bulk_vm *vms;
+	unsigned long seen;
+	unsigned running;
+	bool launched, reached;
+	time_t now;
+	int i, num = 0, failed = 0;
+
+	pthread_mutex_lock(&bulk_mutex);
+	seen = get_state_events();
 	vmmngr_update();
 
+	LIST_FOREACH(vm, &vmmngr_head, list)
+		num++;
+
+	vms = calloc(num ? num : 1, sizeof(*vms));
+	if (!vms) {
+		pthread_mutex_unlock(&bulk_mutex);
+		return -1;
+	}
+
+	num = 0;
 	LIST_FOREACH(vm, &vmmngr_head, list) {
-		switch (vm->state) {
-		case VM_CREATED:
-			pid = fork();
-			if (!pid)
-				acrnd_run_vm(vm->name);
-			break;
-		case VM_SUSPENDED:
-			if (platform_has_hw_ioc) {
-				reason = get_sos_wakeup_reason();
+		if ((op == ACRND_BULK_START) ? (vm->state != VM_CREATED && vm->state != VM_SUSPENDED)
+					     : (vm->state == VM_CREATED))
+			continue;
+
+		strncpy(vms[num].name, vm->name, sizeof(vms[num].name) - 1);
+		vms[num].resume = (vm->state == VM_SUSPENDED);
+		load_bulk_after(&vms[num]);
+		num++;
+	}
+
+	do {
+		now = time(NULL);
+		running = 0;
+		launched = false;
+
+		for (i = 0; i < num; i++) {
+			if (vms[i].state != BULK_RUNNING)
+				continue;
+
+			vm = vmmngr_find(vms[i].name);
+			if (op == ACRND_BULK_START)
+				reached = vm && vm->state == VM_STARTED;
+			else
+				reached = !vm || vm->state == VM_CREATED;
+
+			if (reached) {
+				vms[i].state = BULK_DONE;
+			} else if (now - vms[i].since >= timeout) {
+				fprintf(stderr, "%s: timeout(%u sec) on %s\n", __func__,
+					timeout, vms[i].name);
+				vms[i].state = BULK_FAILED;
+			} else {
+				running++;
 			}
-			ret += resume_vm(vm->name, reason);
+		}
+
+		for (i = 0; i < num && (!jobs || running < jobs); i++) {
+			if (vms[i].state != BULK_PENDING || !bulk_ready(vms, num, i, op))
+				continue;
+
+			launched = true;
+			if (bulk_launch(&vms[i], op, force)) {
+				fprintf(stderr, "%s: Failed to %s %s\n", __func__,
+					(op == ACRND_BULK_START) ? "start" : "stop", vms[i].name);
+				vms[i].state = BULK_FAILED;
+			} else {
+				vms[i].state = BULK_RUNNING;
+				vms[i].since = now;
+				running++;
+			}
+		}
+
+		/* nothing in flight: the VMs left wait on each other */
+		if (!running && !launched)
 			break;
-		default:
-			printf("%s: Unkown vm state %ld\n", __func__, vm->state);
+
+		if (running) {
+			wait_state_event(&seen, 1);
+			vmmngr_update();
+		}
+	} while (1);
+
+	for (i = 0; i < num; i++) {
+		if (vms[i].state == BULK_PENDING) {
+			fprintf(stderr, "%s: %s waits on itself through its .after\n",
+				__func__, vms[i].name);
+			vms[i].state = BULK_FAILED;
 		}
+		if (vms[i].state == BULK_FAILED)
+			failed++;
 	}
 
-	return ret ? -1 : 0;
+	free(vms);
+	pthread_mutex_unlock(&bulk_mutex);
+
+	return failed;
 }
 
-static void stop_all_vms(void)
+struct bulk_req {
+	struct mngr_msg msg;
+	int client_fd;		/* to ack once done, -1 for none */
+};
+
+static void *bulk_thread(void *arg)
 {
-	struct vmmngr_struct *vm;
-	int err;
+	struct bulk_req *req = arg;
+	struct req_acrnd_bulk *bulk = &req->msg.data.acrnd_bulk;
+	struct mngr_msg ack;
+	int failed;
 
-	vmmngr_update();
+	if (!bulk->timeout)
+		bulk->timeout = (bulk->op == ACRND_BULK_START) ? VMS_START_TIMEOUT
+							      : VMS_STOP_TIMEOUT;
 
-	LIST_FOREACH(vm, &vmmngr_head, list) {
-		err = stop_vm(vm->name, 0);
-		if (err != 0) {
-			fprintf(stderr, "Fail to send stop cmd to vm %s\n", vm->name);
-		} else {
-			printf("Send stop cmd to vm %s successfully\n", vm->name);
-		}
+	failed = bulk_vms(bulk->op, bulk->force, bulk->jobs ? bulk->jobs : bulk_jobs,
+			  bulk->timeout);
+
+	if (req->client_fd > 0) {
+		ack.magic = MNGR_MSG_MAGIC;
+		ack.msgid = req->msg.msgid;
+		ack.timestamp = req->msg.timestamp;
+		ack.data.err = failed;
+		mngr_send_msg(req->client_fd, &ack, NULL, 0);
 	}
+
+	free(req);
+	return NULL;
+}
+
+/* run a bulk operation on a detached thread, which acks @client_fd */
+static int bulk_vms_async(struct mngr_msg *msg, int client_fd)
+{
+	struct bulk_req *req;
+	pthread_attr_t attr;
+	pthread_t tid;
+	int rc;
+
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		return -1;
+
+	memcpy(&req->msg, msg, sizeof(*msg));
+	req->client_fd = client_fd;
+
+	rc = pthread_attr_init(&attr);
+	if (rc)
+		goto fail_init;
+	rc = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (rc == 0)
+		rc = pthread_create(&tid, &attr, bulk_thread, req);
+	pthread_attr_destroy(&attr);
+	if (rc == 0)
+		return 0;
+
+ fail_init:
+	free(req);
+	return -1;
+}
+
+static int active_all_vms(void)
+{
+	struct mngr_msg msg = {};
+
+	msg.msgid = ACRND_BULK;
+	msg.data.acrnd_bulk.op = ACRND_BULK_START;
+	msg.data.acrnd_bulk.timeout = VMS_START_TIMEOUT;
+
+	return bulk_vms_async(&msg, -1);
 }
 
 static int wakeup_suspended_vms(unsigned wakeup_reason)
@@ -466,7 +744,8 @@ static int check_vms_status(unsigned int status)
 
 static int wait_for_stop(unsigned int timeout)
 {
-	unsigned long t = timeout;
+	time_t deadline = time(NULL) + timeout;
+	unsigned long seen = get_state_events();
 
 	/*Let ospm stopping User VMs */
 
@@ -474,7 +753,8 @@ static int wait_for_stop(unsigned int timeout)
 	do {
 		vmmngr_update();
 
-		printf("Waiting %lu seconds for all vms enter S3/S5 state\n", t);
+		printf("Waiting %ld seconds for all vms enter S3/S5 state\n",
+			deadline - time(NULL));
 
 		if (check_vms_status(VM_CREATED) == 0) {
 			printf("All vms have entered S5 state successfully\n");
@@ -486,9 +766,10 @@ static int wait_for_stop(unsigned int timeout)
 			return SUSPEND;
 		}
 
-		sleep(1);
+		/* a DM notifies its suspend and exit, rescan at least each second */
+		wait_state_event(&seen, 1);
 	}
-	while (t--);
+	while (time(NULL) <= deadline);
 
 	return -1;
 }
@@ -627,6 +908,277 @@ reply_ack:
 		mngr_send_msg(client_fd, &ack, NULL, 0);
 }
 
+/* a DM tells its state: at start, around a suspend and at exit */
+static void handle_dm_notify(struct mngr_msg *msg, int client_fd, void *param)
+{
+	char name[MAX_VM_NAME_LEN] = {};
+
+	strncpy(name, msg->data.dm_notify.name, sizeof(name) - 1);
+	vmmngr_notify(name, msg->data.dm_notify.state);
+
+	pthread_mutex_lock(&state_mutex);
+	state_events++;
+	pthread_cond_broadcast(&state_cond);
+	pthread_mutex_unlock(&state_mutex);
+}
+
+/* acrnctl startall/stopall, acked once all the VMs are there */
+static void handle_acrnd_bulk(struct mngr_msg *msg, int client_fd, void *param)
+{
+	struct mngr_msg ack;
+
+	if (msg->data.acrnd_bulk.op != ACRND_BULK_START
+	    && msg->data.acrnd_bulk.op != ACRND_BULK_STOP)
+		goto fail;
+
+	if (bulk_vms_async(msg, client_fd) == 0)
+		return;
+
+ fail:
+	ack.magic = MNGR_MSG_MAGIC;
+	ack.msgid = msg->msgid;
+	ack.timestamp = msg->timestamp;
+	ack.data.err = -1;
+	if (client_fd > 0)
+		mngr_send_msg(client_fd, &ack, NULL, 0);
+}
+
+static void handle_acrnd_list(struct mngr_msg *msg, int client_fd, void *param)
+{
+	struct mngr_msg ack;
+	struct vmmngr_struct *vm;
+	unsigned i = 0;
+
+	memset(&ack, 0, sizeof(ack));
+	ack.magic = MNGR_MSG_MAGIC;
+	ack.msgid = msg->msgid;
+	ack.timestamp = msg->timestamp;
+
+	/* the next pages of a list do not rescan */
+	if (msg->data.acrnd_list.start == 0)
+		vmmngr_update();
+
+	LIST_FOREACH(vm, &vmmngr_head, list) {
+		if (i >= msg->data.acrnd_list.start
+		    && ack.data.acrnd_list.num < ACRND_LIST_NUM) {
+			struct acrnd_list_vm *v =
+				&ack.data.acrnd_list.vm[ack.data.acrnd_list.num++];
+
+			strncpy(v->name, vm->name, sizeof(v->name) - 1);
+			v->state = vm->state;
+		}
+		i++;
+	}
+	ack.data.acrnd_list.start = msg->data.acrnd_list.start;
+	ack.data.acrnd_list.total = i;
+
+	if (client_fd > 0)
+		mngr_send_msg(client_fd, &ack, NULL, 0);
+}
+
+/*
+ * The metrics of the VMs, served over HTTP from the snapshots their DMs
+ * write to METRICS_PATH. A scrape only reads files on a tmpfs, it neither
+ * asks the DMs nor the hypervisor anything.
+ */
+struct metrics_line {
+	char family[METRICS_LINE_MAX];
+	int kind;		/* 0 for HELP, 1 for TYPE, 2 for a sample */
+	unsigned long seq;	/* keeps the order of the VMs and of the samples */
+	char text[METRICS_LINE_MAX];
+};
+
+static int metrics_line_cmp(const void *a, const void *b)
+{
+	const struct metrics_line *la = a, *lb = b;
+	int ret = strcmp(la->family, lb->family);
+
+	if (ret)
+		return ret;
+	if (la->kind != lb->kind)
+		return la->kind - lb->kind;
+	return (la->seq > lb->seq) - (la->seq < lb->seq);
+}
+
+static int metrics_parse_line(struct metrics_line *l, const char *text)
+{
+	const char *name = text;
+	size_t len;
+
+	if (!strncmp(text, "# HELP ", 7)) {
+		l->kind = 0;
+		name = text + 7;
+	} else if (!strncmp(text, "# TYPE ", 7)) {
+		l->kind = 1;
+		name = text + 7;
+	} else if (text[0] != '#' && text[0] != '\n') {
+		l->kind = 2;
+	} else {
+		return -1;
+	}
+
+	len = strcspn(name, "{ \n");
+	if (len == 0 || len >= sizeof(l->family))
+		return -1;
+	memcpy(l->family, name, len);
+	l->family[len] = '\0';
+	strncpy(l->text, text, sizeof(l->text) - 1);
+	l->text[sizeof(l->text) - 1] = '\0';
+
+	return 0;
+}
+
+static int metrics_prom_filter(const struct dirent *d)
+{
+	size_t len = strlen(d->d_name);
+
+	return len > 5 && !strcmp(d->d_name + len - 5, ".prom");
+}
+
+/* the snapshots of all the VMs, grouped by metric with one HELP and TYPE each */
+static char *metrics_collect(size_t *size)
+{
+	struct metrics_line *lines = NULL, *tmp;
+	struct dirent **files;
+	char path[PATH_MAX], buf[METRICS_LINE_MAX];
+	char *body = NULL;
+	unsigned long num = 0, max = 0, i;
+	FILE *fp, *out;
+	int n, f;
+
+	n = scandir(METRICS_PATH, &files, metrics_prom_filter, alphasort);
+	for (f = 0; f < n; f++) {
+		snprintf(path, sizeof(path), "%s/%s", METRICS_PATH, files[f]->d_name);
+		free(files[f]);
+		fp = fopen(path, "r");
+		if (!fp)
+			continue;
+
+		while (fgets(buf, sizeof(buf), fp)) {
+			if (num == max) {
+				tmp = realloc(lines, (max ? max * 2 : 256) * sizeof(*lines));
+				if (!tmp)
+					break;
+				lines = tmp;
+				max = max ? max * 2 : 256;
+			}
+			if (metrics_parse_line(&lines[num], buf) == 0) {
+				lines[num].seq = num;
+				num++;
+			}
+		}
+		fclose(fp);
+	}
+	if (n >= 0)
+		free(files);
+
+	qsort(lines, num, sizeof(*lines), metrics_line_cmp);
+
+	out = open_memstream(&body, size);
+	if (out) {
+		for (i = 0; i < num; i++) {
+			/* the VMs have the same HELP and TYPE for a metric */
+			if (lines[i].kind < 2 && i > 0
+			    && lines[i].kind == lines[i - 1].kind
+			    && !strcmp(lines[i].family, lines[i - 1].family))
+				continue;
+			fputs(lines[i].text, out);
+		}
+		fclose(out);
+	}
+	free(lines);
+
+	return body;
+}
+
+static void metrics_reply(int fd)
+{
+	char req[512], hdr[128];
+	const char *status = "200 OK";
+	char *body = NULL;
+	size_t size = 0;
+	ssize_t len;
+
+	len = recv(fd, req, sizeof(req) - 1, 0);
+	if (len <= 0)
+		return;
+	req[len] = '\0';
+
+	if (strncmp(req, "GET ", 4))
+		status = "405 Method Not Allowed";
+	else if (strncmp(req + 4, "/metrics ", 9) && strncmp(req + 4, "/ ", 2))
+		status = "404 Not Found";
+	else
+		body = metrics_collect(&size);
+
+	if (!body)
+		size = 0;
+	len = snprintf(hdr, sizeof(hdr), "HTTP/1.0 %s\r\n"
+		       "Content-Type: text/plain; version=0.0.4\r\n"
+		       "Content-Length: %zu\r\n\r\n", status, size);
+	if (send(fd, hdr, len, MSG_NOSIGNAL) == len && size)
+		send(fd, body, size, MSG_NOSIGNAL);
+	free(body);
+}
+
+/* one scrape at a time, Prometheus does not ask more */
+static void *metrics_thread(void *arg)
+{
+	int listen_fd = (int)(long)arg, fd;
+	struct timeval tv = { .tv_sec = SOCK_TIMEOUT };
+
+	while (1) {
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("metrics accept");
+			break;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		metrics_reply(fd);
+		close(fd);
+	}
+
+	close(listen_fd);
+	return NULL;
+}
+
+static int metrics_serve(unsigned int port)
+{
+	struct sockaddr_in addr;
+	pthread_attr_t attr;
+	pthread_t tid;
+	int fd, on = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons((uint16_t)port);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 4))
+		goto fail;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&tid, &attr, metrics_thread, (void *)(long)fd)) {
+		pthread_attr_destroy(&attr);
+		goto fail;
+	}
+	pthread_attr_destroy(&attr);
+
+	return 0;
+
+ fail:
+	close(fd);
+	return -1;
+}
+
 static void handle_on_exit(void)
 {
 	printf("Exiting from acrnd\n");
@@ -675,18 +1227,20 @@ static void sigterm_handler(int signo)
 	sigterm = 1;
 }
 
-static const char optString[] = "td:h";
+static const char optString[] = "tj:m:d:h";
 
 static void display_usage(void)
 {
 	printf("acrnd - Daemon for ACRN VM Management\n"
 #ifdef MNGR_DEBUG
-	       "[Usage] acrnd [-t] [-d delay] [-h]\n\n"
+	       "[Usage] acrnd [-t] [-j jobs] [-m port] [-d delay] [-h]\n\n"
 #else
-	       "[Usage] acrnd [-t] [-h]\n\n"
+	       "[Usage] acrnd [-t] [-j jobs] [-m port] [-h]\n\n"
 #endif
 	       "[Options]\n"
 	       "\t-t: print messages to stdout\n"
+	       "\t-j: start or stop at most jobs VMs at once, 0 (default) for all\n"
+	       "\t-m: serve the metrics of the VMs over HTTP on port, off by default\n"
 #ifdef MNGR_DEBUG
 	       "\t-d: delay the autostarting of VMs, <0-60> in second\n"
 #endif
@@ -697,6 +1251,7 @@ static void display_usage(void)
 static int parse_opt(int argc, char *argv[])
 {
 	int opt, ret = 0;
+	long jobs, port;
 #ifdef MNGR_DEBUG
 	long delay = 0;
 #endif
@@ -706,6 +1261,24 @@ static int parse_opt(int argc, char *argv[])
 		case 't':
 			logfile = 0;
 			break;
+		case 'j':
+			errno = 0;
+			jobs = strtol(optarg, NULL, 10);
+			if (errno != 0 || jobs < 0 || jobs > UINT_MAX) {
+				printf("'-j' invalid parameter: %s\n", optarg);
+				return -EINVAL;
+			}
+			bulk_jobs = (unsigned int)jobs;
+			break;
+		case 'm':
+			errno = 0;
+			port = strtol(optarg, NULL, 10);
+			if (errno != 0 || port <= 0 || port > 65535) {
+				printf("'-m' invalid parameter: %s\n", optarg);
+				return -EINVAL;
+			}
+			metrics_port = (unsigned int)port;
+			break;
 #ifdef MNGR_DEBUG
 		case 'd':
 			delay = strtol(optarg, NULL, 10);
@@ -771,6 +1344,15 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
+	if (metrics_port && metrics_serve(metrics_port))
+		printf("%s: Failed to serve the metrics on port %u, err: %s\n",
+		       __func__, metrics_port, strerror(errno));
+
+	/* the start of the VMs waits on their notifications */
+	mngr_add_handler(acrnd_fd, DM_NOTIFY, handle_dm_notify, NULL);
+	mngr_add_handler(acrnd_fd, ACRND_LIST, handle_acrnd_list, NULL);
+	mngr_add_handler(acrnd_fd, ACRND_BULK, handle_acrnd_bulk, NULL);
+
 	if (init_vm()) {
 		printf("%s: Failed to init_vm\n", __func__);
 		return -1;
@@ -795,12 +1377,11 @@ int main(int argc, char *argv[])
 	}
 
 	/*
-	 * Try to stop all the vms when receiving SIGTERM within VMS_STOP_TIMEOUT sec
-	 * gracefully. acrnd will exit after waiting maximal VMS_STOP_TIMEOUT sec.
+	 * Try to stop all the vms when receiving SIGTERM, each within VMS_STOP_TIMEOUT sec
+	 * gracefully, -j of them at once. acrnd exits once they are all stopped or timed out.
 	 * System will kill all other vms which can not be stopped within VMS_STOP_TIMEOUT sec.
 	 */
-	stop_all_vms();
-	wait_for_stop(VMS_STOP_TIMEOUT);
+	bulk_vms(ACRND_BULK_STOP, 0, bulk_jobs, VMS_STOP_TIMEOUT);
 
 	return 0;
 }
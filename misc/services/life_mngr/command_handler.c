@@ -45,7 +45,7 @@ static bool wait_post_vms_shutdown(void)
 	char command[64], buf[8];
 	char *endptr, *ret_str;
 	long val;
-	int check_time = SHUTDOWN_TIMEOUT/5;
+	int check_time = SHUTDOWN_TIMEOUT;
 	bool all_done = false;
 
 	snprintf(command, sizeof(command), "pgrep -u root -f acrn-dm | wc -l");
@@ -61,10 +61,11 @@ static bool wait_post_vms_shutdown(void)
 			break;
 		}
 		check_time--;
-		LOG_PRINTF("Wait post launched VMs shutdown check_time:%d, Running VM num:%ld\n",
-				check_time, val);
+		if ((check_time % 5) == 0)
+			LOG_PRINTF("Wait post launched VMs shutdown check_time:%d, Running VM num:%ld\n",
+					check_time, val);
 		pclose(fp);
-		sleep(5);
+		sleep(1);
 	} while (check_time > 0);
 	return all_done;
 }
@@ -125,7 +126,7 @@ int socket_req_shutdown_service_vm_handler(void *arg, int fd)
 {
 	int ret;
 
-	usleep(LISTEN_INTERVAL + SECOND_TO_US);
+	wait_uart_channel_peer(channel, LISTEN_INTERVAL + SECOND_TO_US);
 	ret = send_socket_ack(arg, fd, ACK_REQ_SYS_SHUTDOWN);
 	if (ret < 0)
 		return 0;
@@ -141,7 +142,7 @@ static int req_user_vm_shutdown_reboot(void *arg, int fd, char *msg, char *ack_m
 	struct socket_dev *sock = (struct socket_dev *)arg;
 	struct socket_client *client = NULL;
 
-	usleep(LISTEN_INTERVAL + SECOND_TO_US);
+	wait_uart_channel_peer(channel, LISTEN_INTERVAL + SECOND_TO_US);
 	client = find_socket_client(sock, fd);
 	if (client == NULL)
 		return -1;
@@ -179,7 +180,7 @@ int req_system_shutdown_reboot(void *arg, int fd, char *msg, char *ack_msg)
 	int ret;
 	struct channel_dev *c_dev = NULL;
 
-	usleep(LISTEN_INTERVAL + SECOND_TO_US);
+	wait_uart_channel_peer(channel, LISTEN_INTERVAL + SECOND_TO_US);
 	c_dev = (struct channel_dev *)LIST_FIRST(&channel->tty_conn_head);
 	if (c_dev == NULL) {
 		(void) send_socket_ack(arg, fd, USER_VM_DISCONNECT);
@@ -241,7 +242,7 @@ int sync_cmd_handler(void *arg, int fd)
 	(void)send_message_by_uart(c_dev->uart_device, ACK_SYNC, strlen(ACK_SYNC));
 	LOG_PRINTF("Receive sync message from user VM (%s), start to talk.\n",
 		c_dev->name);
-	usleep(2 * WAIT_RECV);
+	wait_uart_channel_peer(c, 2 * WAIT_RECV);
 	return 0;
 }
 int req_reboot_handler(void *arg, int fd)
@@ -265,11 +266,11 @@ int req_reboot_handler(void *arg, int fd)
 	if (ret < 0)
 		LOG_WRITE("Sending a reboot acknowledgement message to user VM failed.\n");
 	system_reboot_request_flag = true;
-	usleep(SECOND_TO_US);
+	wait_uart_channel_peer(c, SECOND_TO_US);
 	LOG_PRINTF("Send acked shutdown request message to user VM (%s)\n", c_dev->name);
 	start_all_uart_channel_dev_resend(c, POWEROFF_CMD, VM_SHUTDOWN_RETRY_TIMES);
 	notify_all_connected_uart_channel_dev(c, POWEROFF_CMD);
-	usleep(2 * WAIT_RECV);
+	wait_uart_channel_peer(c, 2 * WAIT_RECV);
 	return ret;
 }
 
@@ -300,11 +301,11 @@ int req_shutdown_handler(void *arg, int fd)
 								strlen(ACK_REQ_SYS_SHUTDOWN));
 	if (ret < 0)
 		LOG_WRITE("Sending a shutdown acknowledgement message to user VM failed.\n");
-	usleep(SECOND_TO_US);
+	wait_uart_channel_peer(c, SECOND_TO_US);
 	LOG_PRINTF("Send acked shutdown request message to user VM (%s)\n", c_dev->name);
 	start_all_uart_channel_dev_resend(c, POWEROFF_CMD, VM_SHUTDOWN_RETRY_TIMES);
 	notify_all_connected_uart_channel_dev(c, POWEROFF_CMD);
-	usleep(2 * WAIT_RECV);
+	wait_uart_channel_peer(c, 2 * WAIT_RECV);
 	return ret;
 }
 
@@ -428,7 +429,7 @@ static int user_vm_shutdown_reboot(struct uart_channel *c, int fd, char *ack, bo
 		LOG_PRINTF("Failed to send (%s) to service VM\n", ack);
 	}
 	disconnect_uart_channel_dev(c_dev, c);
-	usleep(2 * WAIT_RECV);
+	wait_uart_channel_peer(c, 2 * WAIT_RECV);
 	close_socket(sock_server);
 	if (reboot) {
 		user_vm_reboot_flag = true;
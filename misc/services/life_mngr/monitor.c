@@ -28,6 +28,7 @@
 
 struct uart_channel *channel; /* uart server instance */
 struct socket_dev *sock_server; /* socket server instance */
+static bool vsock_channel; /* DEV_NAME=vsock:<cid>,... */
 
 FILE *log_fd;
 
@@ -41,6 +42,14 @@ static void monitor_cmd_dispatch(const char *cmd_name, int fd)
 	else
 		LOG_PRINTF("Command [%s] is not supported, fd=%d\n", cmd_name, fd);
 }
+/* a vsock device is named after the CID of its peer VM, see uart.h */
+static char *channel_dev_path(char *path, size_t len, char *dev_name)
+{
+	if (!vsock_channel)
+		return dev_name;
+	snprintf(path, len, VSOCK_DEV_PREFIX "%s", dev_name);
+	return path;
+}
 /**
  * @brief open uart channel according to device name
  *
@@ -53,11 +62,13 @@ static int create_service_vm_uart_channel_dev(char *uart_dev_name)
 	struct channel_dev *c_dev;
 	char *dev_name;
 	char *saveptr;
+	char path[TTY_PATH_MAX];
 
 	saveptr = uart_dev_name;
 	do {
 		dev_name = strtok_r(saveptr, ",", &saveptr);
-		c_dev = create_uart_channel_dev(channel, dev_name, monitor_cmd_dispatch);
+		c_dev = create_uart_channel_dev(channel,
+				channel_dev_path(path, sizeof(path), dev_name), monitor_cmd_dispatch);
 		if (c_dev == NULL) {
 			LOG_PRINTF("Failed to create uart channel device for %s\n", dev_name);
 			ret = -1;
@@ -108,6 +119,7 @@ int init_uart_channel_devs_and_shutdown_commands(bool service_vm, char *uart_dev
 {
 	int ret = 0;
 	struct channel_dev *c_dev;
+	char path[TTY_PATH_MAX];
 
 	channel = init_uart_channel(life_conf.vm_name);
 	if (channel == NULL)
@@ -137,7 +149,8 @@ int init_uart_channel_devs_and_shutdown_commands(bool service_vm, char *uart_dev
 		register_command_handler(acked_req_shutdown_reboot_handler, channel, ACK_REQ_SYS_REBOOT);
 		register_command_handler(ack_timeout_default_handler, channel, ACK_TIMEOUT);
 
-		c_dev = create_uart_channel_dev(channel, uart_dev_name, monitor_cmd_dispatch);
+		c_dev = create_uart_channel_dev(channel,
+				channel_dev_path(path, sizeof(path), uart_dev_name), monitor_cmd_dispatch);
 		if (c_dev == NULL)
 			return -1;
 		strncpy(c_dev->name, SERVICE_VM_NAME, CHANNEL_DEV_NAME_MAX - 1U);
@@ -160,10 +173,14 @@ static int parse_cmd_channel_conf(char *dev_conf)
 
 	channel_name = strtok_r(dev_conf, ":", &saveptr);
 
-	if (strncmp(channel_name, "tty", sizeof("tty")) == 0)
+	if (strncmp(channel_name, "tty", sizeof("tty")) == 0) {
 		ret = 0;
-	else
+	} else if (strncmp(channel_name, "vsock", sizeof("vsock")) == 0) {
+		vsock_channel = true;
+		ret = 0;
+	} else {
 		LOG_WRITE("Invalid channel type in config file\n");
+	}
 
 	memcpy(dev_conf, saveptr, strlen(saveptr) + 1);
 	return ret;
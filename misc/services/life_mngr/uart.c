@@ -14,21 +14,45 @@
 #include <sys/queue.h>
 #include <pthread.h>
 #include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/vm_sockets.h>
 #include "uart.h"
 #include "uart_channel.h"
 #include "log.h"
 #include "config.h"
 
-/* it read from uart, and if end is '\0' or '\n' or len = buff-len it will return */
-static ssize_t try_receive_message_by_uart(int fd, void *buffer, size_t buf_len)
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+/* the peer of a vsock device went away, it reads nothing anymore */
+static void hangup_vsock_dev(struct uart_dev *dev)
+{
+	LOG_PRINTF("Connection of device %s closed\n", dev->tty_path);
+	close(dev->tty_fd);
+	dev->tty_fd = -1;
+}
+/*
+ * It read from uart, and if end is '\0' or '\n' or len = buff-len it will return.
+ * It sleeps in poll() until data comes, at most RETRY_RECV_TIMES * WAIT_RECV us
+ * in all, and returns as soon as a message is there.
+ */
+static ssize_t try_receive_message_by_uart(struct uart_dev *dev, void *buffer, size_t buf_len)
 {
 	ssize_t rc = 0U, count = 0U;
 	char *tmp;
-	unsigned int retry_times = RETRY_RECV_TIMES;
+	struct pollfd pfd = { .fd = dev->tty_fd, .events = POLLIN };
+	long long deadline = now_ms() + (long long)RETRY_RECV_TIMES * WAIT_RECV / 1000;
+	long long left;
 
 	do {
 		/* NOTE: Now we can't handle multi command message at one time. */
-		rc = read(fd, buffer + count, buf_len - count);
+		rc = read(dev->tty_fd, buffer + count, buf_len - count);
 		if (rc > 0) {
 			count += rc;
 			tmp = (char *)buffer;
@@ -38,15 +62,17 @@ static ssize_t try_receive_message_by_uart(int fd, void *buffer, size_t buf_len)
 					tmp[count - 1] = '\0';
 				break;
 			}
-		} else {
-			if (errno == EAGAIN) {
-				usleep(WAIT_RECV);
-				retry_times--;
-			} else {
+		} else if (rc == 0 && dev->vsock) {
+			hangup_vsock_dev(dev);
+			break;
+		} else if (rc == 0 || errno == EAGAIN) {
+			left = deadline - now_ms();
+			if ((left <= 0) || (poll(&pfd, 1, (int)left) <= 0))
 				break;
-			}
+		} else {
+			break;
 		}
-	} while (retry_times != 0U);
+	} while (true);
 
 	return count;
 }
@@ -59,7 +85,12 @@ ssize_t receive_message_by_uart(struct uart_dev *dev, void *buf, size_t len)
 	if ((dev == NULL) || (buf == NULL) || (len == 0))
 		return -EINVAL;
 
-	return try_receive_message_by_uart(dev->tty_fd, buf, len);
+	/* a vsock device not connected yet, or anymore, is a silent UART */
+	if (dev->tty_fd < 0) {
+		usleep(RETRY_RECV_TIMES * WAIT_RECV);
+		return 0;
+	}
+	return try_receive_message_by_uart(dev, buf, len);
 }
 ssize_t send_message_by_uart(struct uart_dev *dev, const void *buf, size_t len)
 {
@@ -67,10 +98,103 @@ ssize_t send_message_by_uart(struct uart_dev *dev, const void *buf, size_t len)
 
 	if ((dev == NULL) || (buf == NULL) || (len == 0))
 		return -EINVAL;
-	ret = write(dev->tty_fd, buf, len + 1);
+	if (dev->vsock)
+		ret = send(dev->tty_fd, buf, len + 1, MSG_NOSIGNAL);
+	else
+		ret = write(dev->tty_fd, buf, len + 1);
 
 	return ret;
 }
+static int vsock_socket(void)
+{
+	int fd;
+
+	/* SEQPACKET keeps the messages apart, unlike the bytes of a vUART */
+	fd = socket(AF_VSOCK, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		LOG_PRINTF("Failed to create vsock socket: %s\n", strerror(errno));
+	return fd;
+}
+static void set_vsock_dev_fd(struct uart_dev *dev, int fd)
+{
+	(void) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	dev->tty_fd = fd;
+	LOG_PRINTF("Device %s connected, fd=%d\n", dev->tty_path, fd);
+}
+int connect_vsock_dev(struct uart_dev *dev)
+{
+	struct sockaddr_vm addr;
+	int fd;
+
+	fd = vsock_socket();
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.svm_family = AF_VSOCK;
+	addr.svm_cid = dev->cid;
+	addr.svm_port = LIFE_MNGR_VSOCK_PORT;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	set_vsock_dev_fd(dev, fd);
+	return 0;
+}
+int accept_vsock_dev(struct uart_dev *dev)
+{
+	struct sockaddr_vm addr;
+	socklen_t len;
+	int fd;
+
+	if (dev->listen_fd < 0) {
+		dev->listen_fd = vsock_socket();
+		if (dev->listen_fd < 0)
+			return -1;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.svm_family = AF_VSOCK;
+		addr.svm_cid = VMADDR_CID_ANY;
+		addr.svm_port = LIFE_MNGR_VSOCK_PORT;
+		if ((bind(dev->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+				(listen(dev->listen_fd, 1) < 0)) {
+			LOG_PRINTF("Failed to listen on vsock port %u: %s\n",
+					LIFE_MNGR_VSOCK_PORT, strerror(errno));
+			close(dev->listen_fd);
+			dev->listen_fd = -1;
+			return -1;
+		}
+	}
+
+	do {
+		len = sizeof(addr);
+		fd = accept(dev->listen_fd, (struct sockaddr *)&addr, &len);
+		if (fd < 0)
+			return -1;
+		if (addr.svm_cid == dev->cid)
+			break;
+		LOG_PRINTF("Refuse vsock connection from cid %u\n", addr.svm_cid);
+		close(fd);
+	} while (true);
+
+	set_vsock_dev_fd(dev, fd);
+	return 0;
+}
+static int init_vsock_dev(struct uart_dev *dev)
+{
+	char *end;
+
+	errno = 0;
+	dev->cid = (unsigned int)strtoul(dev->tty_path + strlen(VSOCK_DEV_PREFIX), &end, 10);
+	if ((errno != 0) || (*end != '\0') || (end == dev->tty_path + strlen(VSOCK_DEV_PREFIX))) {
+		LOG_PRINTF("Invalid vsock device %s\n", dev->tty_path);
+		return -1;
+	}
+	dev->vsock = true;
+	dev->tty_fd = -1;
+	dev->listen_fd = -1;
+	return 0;
+}
 static int set_tty_attr(int fd, int baudrate)
 {
 	struct termios tty;
@@ -143,6 +267,16 @@ struct uart_dev *init_uart_dev(char *path)
 	if (strlen(path) < TTY_PATH_MAX)
 		memcpy(dev->tty_path, path, strlen(path));
 
+	/* connected later, by the listening thread */
+	if (strncmp(dev->tty_path, VSOCK_DEV_PREFIX, strlen(VSOCK_DEV_PREFIX)) == 0) {
+		if (init_vsock_dev(dev) < 0) {
+			free(dev);
+			return NULL;
+		}
+		return dev;
+	}
+
+	dev->listen_fd = -1;
 	dev->tty_fd = tty_listen_setup(dev->tty_path);
 	if (dev->tty_fd < 0) {
 		LOG_PRINTF("Failed to setup uart device %s\n", path);
@@ -155,7 +289,10 @@ void deinit_uart_dev(struct uart_dev *dev)
 {
 	if (dev != NULL) {
 		LOG_PRINTF("Close device: %s\n", dev->tty_path);
-		close(dev->tty_fd);
+		if (dev->tty_fd >= 0)
+			close(dev->tty_fd);
+		if (dev->listen_fd >= 0)
+			close(dev->listen_fd);
 		dev->tty_fd = -1;
 		free(dev);
 	}
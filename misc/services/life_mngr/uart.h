@@ -6,6 +6,7 @@
 #define _UART_H_
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <sys/queue.h>
 #include <pthread.h>
 #include <semaphore.h>
@@ -17,9 +18,20 @@
 #define WAIT_RECV (SECOND_TO_US>>2)
 #define RETRY_RECV_TIMES 100U
 
+/**
+ * A device named "vsock:<cid>" is a vsock SEQPACKET connection to the VM of
+ * that CID instead of a vUART: the service VM connects to the user VMs, a
+ * user VM accepts the connection from the service VM (cid 2) only.
+ */
+#define VSOCK_DEV_PREFIX "vsock:"
+#define LIFE_MNGR_VSOCK_PORT 0x4c4dU
+
 struct uart_dev {
 	char tty_path[TTY_PATH_MAX]; /**< UART device name */
-	int tty_fd; /**< the FD of opened UART device */
+	int tty_fd; /**< the FD of opened UART device, or of the vsock connection */
+	bool vsock; /**< a vsock connection, tty_fd is -1 until it is up */
+	unsigned int cid; /**< the CID of the peer VM of a vsock connection */
+	int listen_fd; /**< the vsock socket a user VM accepts the connection on */
 };
 /**
  * @brief Allocate UART device instance and initialize UART
@@ -44,6 +56,16 @@ ssize_t send_message_by_uart(struct uart_dev *dev, const void *buf, size_t len);
  * avoid miss message in some cases.
  */
 ssize_t receive_message_by_uart(struct uart_dev *dev, void *buf, size_t len);
+/**
+ * @brief Connect a vsock device to its user VM, from the service VM
+ *
+ * @return 0 once connected, -1 if the user VM does not listen yet
+ */
+int connect_vsock_dev(struct uart_dev *dev);
+/**
+ * @brief Wait for the service VM to connect a vsock device, from a user VM
+ */
+int accept_vsock_dev(struct uart_dev *dev);
 /**
  * @brief Get the file descriptor of a UART device
  */
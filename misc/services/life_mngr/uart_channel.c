@@ -59,6 +59,12 @@ void *listen_uart_channel_dev(void *arg)
 				get_uart_dev_fd(c_dev->uart_device), get_uart_dev_path(c_dev->uart_device));
 	memset(c_dev->buf, 0, sizeof(c_dev->buf));
 	while (c_dev->listening) {
+		/* the user VM listens once its lifecycle manager runs */
+		if (c_dev->uart_device->vsock && (get_uart_dev_fd(c_dev->uart_device) < 0) &&
+				(connect_vsock_dev(c_dev->uart_device) < 0)) {
+			usleep(VSOCK_CONNECT_INTERVAL);
+			continue;
+		}
 		num = receive_message_by_uart(c_dev->uart_device, (void *)c_dev->buf,
 							sizeof(c_dev->buf));
 		if (num == 0) {
@@ -73,7 +79,7 @@ void *listen_uart_channel_dev(void *arg)
 			c_dev->listening = false;
 			LOG_PRINTF("Receive sync message from user VM (%s), start to talk.\n",
 					c_dev->name);
-			usleep(2 * WAIT_RECV);
+			wait_uart_channel_peer(c_dev->channel, 2 * WAIT_RECV);
 			(void)send_message_by_uart(c_dev->uart_device, ACK_SYNC, strlen(ACK_SYNC));
 			sem_post(&c_dev->dev_sem);
 		}
@@ -100,13 +106,22 @@ void *connect_uart_channel_dev(void *arg)
 	char buf[CHANNEL_DEV_NAME_MAX + SYNC_LEN];
 
 	snprintf(buf, sizeof(buf), SYNC_FMT, c->conf.identifier);
+	if (c_dev->uart_device->vsock) {
+		LOG_WRITE("Wait for the service VM to connect\n");
+		if (accept_vsock_dev(c_dev->uart_device) < 0) {
+			c_dev->polling = false;
+			c_dev->listening = false;
+			sem_post(&c_dev->dev_sem);
+			return NULL;
+		}
+	}
 	/* TODO: will add SYNC resending */
 	LOG_PRINTF("Send sync command:%s identifier=%s\n", buf, c->conf.identifier);
 	ret = send_message_by_uart(c_dev->uart_device, (void *)buf, strlen(buf));
 	if (ret < 0) {
 		LOG_WRITE("Send sync command to service VM fail\n");
 	} else {
-		usleep(LISTEN_INTERVAL);
+		/* returns as soon as the ACK is there */
 		memset(c_dev->buf, 0, sizeof(c_dev->buf));
 		(void) receive_message_by_uart(c_dev->uart_device, (void *)c_dev->buf, sizeof(c_dev->buf));
 		if (strncmp(ACK_SYNC, c_dev->buf, sizeof(ACK_SYNC)) == 0) {
@@ -265,6 +280,11 @@ void notify_all_connected_uart_channel_dev(struct uart_channel *c, char *msg)
 	}
 	pthread_mutex_unlock(&c->tty_conn_list_lock);
 }
+void wait_uart_channel_peer(struct uart_channel *c, unsigned int us)
+{
+	if (!c->vsock)
+		usleep(us);
+}
 bool is_uart_channel_connection_list_empty(struct uart_channel *c)
 {
 	bool ret = false;
@@ -297,6 +317,7 @@ struct channel_dev *create_uart_channel_dev(struct uart_channel *c, char *path,
 	}
 	memset(c_dev, 0x0, sizeof(*c_dev));
 	c_dev->uart_device = dev;
+	c->vsock = dev->vsock;
 	c_dev->channel = c;
 	c_dev->listening = true;
 	c_dev->polling = true;
@@ -17,6 +17,7 @@
 
 #define MIN_RESEND_TIME 3U
 #define LISTEN_INTERVAL (5 * SECOND_TO_US)
+#define VSOCK_CONNECT_INTERVAL SECOND_TO_US
 
 typedef void data_handler_f(const char *cmd_name, int fd);
 
@@ -46,6 +47,7 @@ struct uart_channel {
 	LIST_HEAD(tty_head, channel_dev) tty_conn_head; /* UART connection list */
 	LIST_HEAD(tty_open_head, channel_dev) tty_open_head; /* UART opening list */
 	pthread_mutex_t tty_conn_list_lock;
+	bool vsock; /**< the devices are vsock connections, not vUARTs */
 
 	struct channel_config conf;
 };
@@ -138,6 +140,14 @@ void stop_uart_channel_dev_resend(struct channel_dev *c_dev);
  * @brief Broadcast message to each connected uart channel device
  */
 void notify_all_connected_uart_channel_dev(struct uart_channel *c, char *msg);
+/**
+ * @brief Give the peer the time to read a message before the next one
+ *
+ * Two messages on a vUART may be read as one, the peer must have read the
+ * first one before the next one is sent. The messages of a vsock channel stay
+ * apart, it does not wait.
+ */
+void wait_uart_channel_peer(struct uart_channel *c, unsigned int us);
 /**
  * @brief Check whether uart channel connection list is empty or not
  */